@@ -29,9 +29,11 @@ using UnityEngine.UI;
 using UnityEngine.Networking;
 
 using System;
+using System.Buffers;
 using System.Collections;
 using System.Runtime.InteropServices;
 using System.Threading;
+using System.Threading.Tasks;
 using System.Net.Sockets;
 using System.Net;
 using System.IO;
@@ -125,11 +127,33 @@ public class ZTSDK {
 	[DllImport (DLL_PATH)]
 	unsafe protected static extern int zts_recvfrom(int fd, [In, Out] IntPtr buf, int len, int flags, System.IntPtr addr, int addrlen);
 
+	// RX / TX straight from/to spans, see Recv()/Send()
+	[DllImport (DLL_PATH, EntryPoint = "zts_recv")]
+	unsafe private static extern IntPtr zts_recv_span(int fd, byte* buf, UIntPtr len, int flags);
+	[DllImport (DLL_PATH, EntryPoint = "zts_send")]
+	unsafe private static extern IntPtr zts_send_span(int fd, byte* buf, UIntPtr len, int flags);
+
+	// Completion queues, see ZTCompletionQueue
+	[DllImport (DLL_PATH)]
+	internal static extern int zts_cq_create(uint entries);
+	[DllImport (DLL_PATH)]
+	unsafe internal static extern int zts_submit(int cq, zts_sqe* sqes, uint n);
+	[DllImport (DLL_PATH)]
+	unsafe internal static extern int zts_complete(int cq, zts_cqe* cqes, uint max, int timeout);
+	[DllImport (DLL_PATH, EntryPoint = "zts_close")]
+	internal static extern int zts_close_fd(int fd);
+
 	// ZT Network controls
 	[DllImport (DLL_PATH)]
 	protected static extern void zts_join_network(string nwid);
 	[DllImport (DLL_PATH)]
 	protected static extern void zts_leave_network(string nwid);
+
+	// Statistics
+	[DllImport (DLL_PATH)]
+	protected static extern int zts_get_socket_stats(int fd, ref zts_socket_stats stats);
+	[DllImport (DLL_PATH)]
+	protected static extern int zts_get_network_stats(string nwid, ref zts_network_stats stats);
 #endregion
 
 	// Interop structures
@@ -142,6 +166,65 @@ public class ZTSDK {
 		public string sa_data;
 	}
 
+	[System.Runtime.InteropServices.StructLayoutAttribute(System.Runtime.InteropServices.LayoutKind.Sequential)]
+	public struct zts_socket_stats {
+		public ulong bytes_in;
+		public ulong bytes_out;
+		public ulong rx_drops;
+		public ulong accept_overflows;
+		public uint txbuf_hwm;
+		public uint rxbuf_hwm;
+		public uint accept_backlog;
+		public uint retransmits;
+		public uint rtt_ms;
+		public uint rttvar_ms;
+		public uint rto_ms;
+		public uint cwnd;
+	}
+
+	[System.Runtime.InteropServices.StructLayoutAttribute(System.Runtime.InteropServices.LayoutKind.Sequential)]
+	public struct zts_network_stats {
+		public ulong frames_in;
+		public ulong bytes_in;
+		public ulong frames_out;
+		public ulong bytes_out;
+		public ulong frames_dropped;
+		public ulong rx_coalesced;
+		public ulong stack_ticks;
+		public ulong stack_tick_us;
+		public uint rxq_hwm;
+		public uint nconns;
+		public uint stack;
+		public uint rx_pressure;
+		public ulong rxq_overflows;
+		public ulong rxq_early_drops;
+		public ulong rx_pressure_events;
+	}
+
+	// Same layout as struct zts_sqe/zts_cqe (size_t and pointers are native-sized)
+	public const int ZTS_OP_READ = 1;
+	public const int ZTS_OP_WRITE = 2;
+	public const int ZTS_OP_ACCEPT = 3;
+
+	[System.Runtime.InteropServices.StructLayoutAttribute(System.Runtime.InteropServices.LayoutKind.Sequential)]
+	public struct zts_sqe {
+		public int op;
+		public int fd;
+		public IntPtr buf;
+		public UIntPtr len;
+		public IntPtr addr;
+		public uint addrlen;
+		public ulong user_data;
+	}
+
+	[System.Runtime.InteropServices.StructLayoutAttribute(System.Runtime.InteropServices.LayoutKind.Sequential)]
+	public struct zts_cqe {
+		public ulong user_data;
+		public int op;
+		public int fd;
+		public IntPtr res;
+	}
+
 	[UnmanagedFunctionPointer(CallingConvention.Cdecl)]
 	public delegate void MyDelegate(string str);
 
@@ -314,6 +397,37 @@ public class ZTSDK {
 		return bytes_written;
 	}
 
+	// Receives into buf without marshalling, it's only pinned for the duration of the call.
+	// Returns the number of bytes received, 0 at end of stream or -1 on error
+	public int Recv(int fd, Span<byte> buf, int flags = 0)
+	{
+		unsafe {
+			fixed (byte* p = buf) {
+				return (int)zts_recv_span(fd, p, (UIntPtr)buf.Length, flags);
+			}
+		}
+	}
+
+	public int Recv(int fd, Memory<byte> buf, int flags = 0)
+	{
+		return Recv(fd, buf.Span, flags);
+	}
+
+	// Sends buf without marshalling, returns the number of bytes sent or -1 on error
+	public int Send(int fd, ReadOnlySpan<byte> buf, int flags = 0)
+	{
+		unsafe {
+			fixed (byte* p = buf) {
+				return (int)zts_send_span(fd, p, (UIntPtr)buf.Length, flags);
+			}
+		}
+	}
+
+	public int Send(int fd, ReadOnlyMemory<byte> buf, int flags = 0)
+	{
+		return Send(fd, buf.Span, flags);
+	}
+
 	// Sends data to an address
 	public int SendTo(int fd, char[] buf, int len, int flags, string addr, int port)
 	{
@@ -414,3 +528,181 @@ public class ZTSDK {
 		return sockAddrHandle;
 	}
 }
+
+/*
+ * Buffers for socket I/O which are pinned once, when the pool first creates them, rather than on
+ * every call, so neither marshalling nor repeated pinning shows up in GC time. Rented arrays go
+ * back to the pool (still pinned) with Return(), Dispose() unpins everything
+ */
+public sealed class ZTBufferPool : IDisposable {
+	private readonly ArrayPool<byte> pool;
+	private readonly Dictionary<byte[], GCHandle> pinned = new Dictionary<byte[], GCHandle> ();
+
+	public ZTBufferPool(int maxBufferSize = 65536, int maxBuffersPerSize = 64)
+	{
+		pool = ArrayPool<byte>.Create(maxBufferSize, maxBuffersPerSize);
+	}
+
+	// An array of at least minSize bytes, which stays put in memory until Dispose()
+	public byte[] Rent(int minSize)
+	{
+		byte[] buf = pool.Rent(minSize);
+		lock (pinned) {
+			if (!pinned.ContainsKey(buf))
+				pinned[buf] = GCHandle.Alloc(buf, GCHandleType.Pinned);
+		}
+		return buf;
+	}
+
+	public void Return(byte[] buf)
+	{
+		pool.Return(buf);
+	}
+
+	// Where a rented array lives, for handing it to native code directly
+	public IntPtr AddressOf(byte[] buf)
+	{
+		lock (pinned) {
+			return pinned[buf].AddrOfPinnedObject();
+		}
+	}
+
+	public void Dispose()
+	{
+		lock (pinned) {
+			foreach (GCHandle h in pinned.Values)
+				h.Free();
+			pinned.Clear();
+		}
+	}
+}
+
+/*
+ * ValueTask-based socket I/O over a libzt completion queue (see zts_cq_create()). A background
+ * thread reaps completions and finishes the awaiting tasks, buffers stay pinned only while their
+ * operation is outstanding
+ */
+public sealed class ZTCompletionQueue : IDisposable {
+	private struct Pending {
+		public TaskCompletionSource<int> tcs;
+		public MemoryHandle pin;
+	}
+
+	private const int ReapBatch = 64;
+
+	private readonly int cq;
+	private readonly Thread reaper;
+	private readonly Dictionary<ulong, Pending> pending = new Dictionary<ulong, Pending> ();
+	private ulong nextId;
+	private volatile bool disposed;
+
+	public ZTCompletionQueue(uint entries = 256)
+	{
+		cq = ZTSDK.zts_cq_create(entries);
+		if (cq < 0)
+			throw new InvalidOperationException("zts_cq_create() failed");
+		reaper = new Thread(Reap);
+		reaper.IsBackground = true;
+		reaper.Start();
+	}
+
+	// Completes with the number of bytes received (0 at end of stream)
+	public ValueTask<int> ReadAsync(int fd, Memory<byte> buf)
+	{
+		return Submit(ZTSDK.ZTS_OP_READ, fd, buf.Pin(), buf.Length);
+	}
+
+	// Completes with the number of bytes sent, which may be short
+	public ValueTask<int> WriteAsync(int fd, ReadOnlyMemory<byte> buf)
+	{
+		return Submit(ZTSDK.ZTS_OP_WRITE, fd, buf.Pin(), buf.Length);
+	}
+
+	// Completes with the accepted descriptor
+	public ValueTask<int> AcceptAsync(int fd)
+	{
+		return Submit(ZTSDK.ZTS_OP_ACCEPT, fd, default(MemoryHandle), 0);
+	}
+
+	private ValueTask<int> Submit(int op, int fd, MemoryHandle pin, int len)
+	{
+		Pending p = new Pending ();
+		p.tcs = new TaskCompletionSource<int> (TaskCreationOptions.RunContinuationsAsynchronously);
+		p.pin = pin;
+		ulong id;
+		lock (pending) {
+			if (disposed) {
+				pin.Dispose();
+				throw new ObjectDisposedException("ZTCompletionQueue");
+			}
+			id = ++nextId;
+			pending[id] = p;
+		}
+		int n;
+		unsafe {
+			ZTSDK.zts_sqe sqe = new ZTSDK.zts_sqe ();
+			sqe.op = op;
+			sqe.fd = fd;
+			sqe.buf = (IntPtr)pin.Pointer;
+			sqe.len = (UIntPtr)len;
+			sqe.user_data = id;
+			n = ZTSDK.zts_submit(cq, &sqe, 1);
+		}
+		if (n != 1) {
+			lock (pending) {
+				pending.Remove(id);
+			}
+			pin.Dispose();
+			return new ValueTask<int> (Task.FromException<int> (new IOException("zts_submit() failed")));
+		}
+		return new ValueTask<int> (p.tcs.Task);
+	}
+
+	private void Reap()
+	{
+		ZTSDK.zts_cqe[] cqes = new ZTSDK.zts_cqe[ReapBatch];
+		while (!disposed) {
+			int n;
+			unsafe {
+				fixed (ZTSDK.zts_cqe* p = cqes) {
+					n = ZTSDK.zts_complete(cq, p, ReapBatch, -1);
+				}
+			}
+			if (n < 0)
+				break; // closed by Dispose()
+			for (int i = 0; i < n; i++) {
+				Pending p;
+				lock (pending) {
+					if (!pending.TryGetValue(cqes[i].user_data, out p))
+						continue;
+					pending.Remove(cqes[i].user_data);
+				}
+				p.pin.Dispose();
+				long res = (long)cqes[i].res;
+				if (res < 0)
+					p.tcs.TrySetException(new IOException("libzt operation failed, errno=" + (-res)));
+				else
+					p.tcs.TrySetResult((int)res);
+			}
+		}
+	}
+
+	public void Dispose()
+	{
+		lock (pending) {
+			if (disposed)
+				return;
+			disposed = true;
+		}
+		ZTSDK.zts_close_fd(cq); // wakes the reaper
+		reaper.Join();
+		// Whatever the queue still held is cancelled along with it
+		lock (pending) {
+			foreach (Pending p in pending.Values) {
+				p.pin.Dispose();
+				p.tcs.TrySetCanceled();
+			}
+			pending.Clear();
+		}
+	}
+}
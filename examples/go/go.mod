@@ -0,0 +1,3 @@
+module github.com/zerotier/libzt/examples/go
+
+go 1.19
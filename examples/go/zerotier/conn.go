@@ -0,0 +1,285 @@
+// ZeroTier SDK - Network Virtualization Everywhere
+// Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+package zerotier
+
+import (
+	"context"
+	"errors"
+	"io"
+	"net"
+	"sync"
+	"sync/atomic"
+	"syscall"
+	"time"
+)
+
+const (
+	// Reads shorter than this go through the read-ahead buffer
+	readAheadSize = 16 * 1024
+	// WriteBuffers copies buffers into chunks of up to this much, larger ones are written as is
+	writeBatchSize = 64 * 1024
+)
+
+var errCanceled = errors.New("zerotier: canceled")
+
+// A deadline which can be moved while something waits on it
+type deadline struct {
+	ns atomic.Int64
+}
+
+func (d *deadline) get() time.Time {
+	if ns := d.ns.Load(); ns != 0 {
+		return time.Unix(0, ns)
+	}
+	return time.Time{}
+}
+
+func (d *deadline) set(t time.Time) {
+	if t.IsZero() {
+		d.ns.Store(0)
+	} else {
+		d.ns.Store(t.UnixNano())
+	}
+}
+
+// Conn is a libzt TCP connection, a net.Conn
+type Conn struct {
+	fd     int
+	pd     *pollDesc
+	p      *poller
+	local  *net.TCPAddr
+	remote *net.TCPAddr
+
+	rmu        sync.Mutex
+	rbuf       []byte
+	rpos, rend int
+	rdl        deadline
+
+	wmu  sync.Mutex
+	wbuf []byte
+	wdl  deadline
+
+	closeOnce sync.Once
+}
+
+func newConn(p *poller, pd *pollDesc) *Conn {
+	return &Conn{fd: pd.fd, pd: pd, p: p, local: sockName(pd.fd, false), remote: sockName(pd.fd, true)}
+}
+
+// Dial connects to address ("10.0.0.1:80", "[fd00::1]:80") over the ZeroTier networks joined,
+// network is "tcp", "tcp4" or "tcp6"
+func Dial(network, address string) (*Conn, error) {
+	return DialContext(context.Background(), network, address)
+}
+
+// DialContext is Dial, giving up once ctx is done
+func DialContext(ctx context.Context, network, address string) (*Conn, error) {
+	addr, err := net.ResolveTCPAddr(network, address)
+	if err != nil {
+		return nil, err
+	}
+	p, err := getPoller()
+	if err != nil {
+		return nil, opError("dial", nil, addr, err)
+	}
+	fd, err := socket(addr, false, 0)
+	if err != nil {
+		return nil, opError("dial", nil, addr, err)
+	}
+	pds, err := p.add(fd)
+	if err != nil {
+		closeFd(fd)
+		return nil, opError("dial", nil, addr, err)
+	}
+	pd := pds[0]
+	var dl deadline
+	if t, ok := ctx.Deadline(); ok {
+		dl.set(t)
+	}
+	// Writable (or in error) once the attempt is over, either way. A socket which connected
+	// at once is reported as soon as it's watched
+	if err = pd.wait(pd.wr, &dl, ctx.Done()); err == nil {
+		err = soError(fd)
+	} else if err == errCanceled {
+		err = ctx.Err()
+	}
+	if err != nil {
+		p.remove(pd)
+		closeFd(fd)
+		return nil, opError("dial", nil, addr, err)
+	}
+	return newConn(p, pd), nil
+}
+
+func opError(op string, local, remote net.Addr, err error) error {
+	if err == io.EOF {
+		return err
+	}
+	return &net.OpError{Op: op, Net: "tcp", Source: local, Addr: remote, Err: err}
+}
+
+func wouldBlock(err error) bool {
+	return err == syscall.EAGAIN || err == syscall.EWOULDBLOCK
+}
+
+// Read reads into b, parking the goroutine until data arrives
+func (c *Conn) Read(b []byte) (int, error) {
+	if len(b) == 0 {
+		return 0, nil
+	}
+	c.rmu.Lock()
+	defer c.rmu.Unlock()
+	if c.rpos < c.rend {
+		n := copy(b, c.rbuf[c.rpos:c.rend])
+		c.rpos += n
+		return n, nil
+	}
+	for {
+		dst := b
+		if len(b) < readAheadSize {
+			if c.rbuf == nil {
+				c.rbuf = make([]byte, readAheadSize)
+			}
+			dst = c.rbuf
+		}
+		n, err := read(c.fd, dst)
+		if n > 0 {
+			if len(b) < readAheadSize {
+				c.rpos, c.rend = copy(b, dst[:n]), n
+				return c.rpos, nil
+			}
+			return n, nil
+		}
+		if n == 0 {
+			return 0, io.EOF
+		}
+		if !wouldBlock(err) {
+			return 0, opError("read", c.local, c.remote, err)
+		}
+		if err = c.pd.wait(c.pd.rd, &c.rdl, nil); err != nil {
+			return 0, opError("read", c.local, c.remote, err)
+		}
+	}
+}
+
+// Write writes all of b, parking the goroutine while the send buffer is full
+func (c *Conn) Write(b []byte) (int, error) {
+	c.wmu.Lock()
+	defer c.wmu.Unlock()
+	return c.write(b)
+}
+
+func (c *Conn) write(b []byte) (int, error) {
+	done := 0
+	for done < len(b) {
+		n, err := write(c.fd, b[done:])
+		if n > 0 {
+			done += n
+			continue
+		}
+		if !wouldBlock(err) {
+			return done, opError("write", c.local, c.remote, err)
+		}
+		if err = c.pd.wait(c.pd.wr, &c.wdl, nil); err != nil {
+			return done, opError("write", c.local, c.remote, err)
+		}
+	}
+	return done, nil
+}
+
+// WriteBuffers writes bufs in order as one stream, as few zts_write() calls as possible
+// carrying them: small buffers are copied together into chunks of up to writeBatchSize
+func (c *Conn) WriteBuffers(bufs net.Buffers) (int64, error) {
+	c.wmu.Lock()
+	defer c.wmu.Unlock()
+	var total int64
+	for len(bufs) > 0 {
+		if len(bufs[0]) >= writeBatchSize {
+			n, err := c.write(bufs[0])
+			total += int64(n)
+			if err != nil {
+				return total, err
+			}
+			bufs = bufs[1:]
+			continue
+		}
+		if c.wbuf == nil {
+			c.wbuf = make([]byte, 0, writeBatchSize)
+		}
+		chunk := c.wbuf[:0]
+		for len(bufs) > 0 && len(bufs[0]) < writeBatchSize && len(chunk)+len(bufs[0]) <= writeBatchSize {
+			chunk = append(chunk, bufs[0]...)
+			bufs = bufs[1:]
+		}
+		if len(chunk) == 0 {
+			// The next one doesn't fit in what's left of a chunk, it's sent alone
+			chunk = append(chunk, bufs[0]...)
+			bufs = bufs[1:]
+		}
+		n, err := c.write(chunk)
+		total += int64(n)
+		if err != nil {
+			return total, err
+		}
+	}
+	return total, nil
+}
+
+// CloseWrite shuts down the sending side, the peer reads EOF
+func (c *Conn) CloseWrite() error {
+	if err := shutdown(c.fd, syscall.SHUT_WR); err != nil {
+		return opError("close", c.local, c.remote, err)
+	}
+	return nil
+}
+
+// Close closes the connection, Reads and Writes waiting return net.ErrClosed
+func (c *Conn) Close() error {
+	err := error(net.ErrClosed)
+	c.closeOnce.Do(func() {
+		c.p.remove(c.pd)
+		// Nothing uses the descriptor once the waiters are gone, it can't be reused under them
+		c.rmu.Lock()
+		c.wmu.Lock()
+		closeFd(c.fd)
+		c.wmu.Unlock()
+		c.rmu.Unlock()
+		err = nil
+	})
+	return err
+}
+
+func (c *Conn) LocalAddr() net.Addr  { return c.local }
+func (c *Conn) RemoteAddr() net.Addr { return c.remote }
+
+func (c *Conn) SetDeadline(t time.Time) error {
+	c.SetReadDeadline(t)
+	return c.SetWriteDeadline(t)
+}
+
+// SetReadDeadline also applies to a Read already waiting
+func (c *Conn) SetReadDeadline(t time.Time) error {
+	c.rdl.set(t)
+	kick(c.pd.rd)
+	return nil
+}
+
+func (c *Conn) SetWriteDeadline(t time.Time) error {
+	c.wdl.set(t)
+	kick(c.pd.wr)
+	return nil
+}
@@ -0,0 +1,123 @@
+// ZeroTier SDK - Network Virtualization Everywhere
+// Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+package zerotier
+
+import "C"
+
+import (
+	"net"
+	"sync"
+	"time"
+)
+
+// Listener is a listening libzt TCP socket, a net.Listener
+type Listener struct {
+	fd      int
+	pd      *pollDesc
+	p       *poller
+	addr    *net.TCPAddr
+	mu      sync.Mutex
+	fds     []C.int
+	pending []*pollDesc // accepted by the last batch, not yet handed out
+	dl      deadline
+
+	closeOnce sync.Once
+}
+
+// Listen listens on address (":80", "10.0.0.1:80"), network is "tcp", "tcp4" or "tcp6"
+func Listen(network, address string) (*Listener, error) {
+	addr, err := net.ResolveTCPAddr(network, address)
+	if err != nil {
+		return nil, err
+	}
+	if addr.IP == nil && network == "tcp6" {
+		addr.IP = net.IPv6unspecified
+	}
+	p, err := getPoller()
+	if err != nil {
+		return nil, opError("listen", nil, addr, err)
+	}
+	fd, err := socket(addr, true, listenBacklog)
+	if err != nil {
+		return nil, opError("listen", nil, addr, err)
+	}
+	pds, err := p.add(fd)
+	if err != nil {
+		closeFd(fd)
+		return nil, opError("listen", nil, addr, err)
+	}
+	return &Listener{fd: fd, pd: pds[0], p: p, addr: sockName(fd, false), fds: make([]C.int, acceptBatch)}, nil
+}
+
+// Accept returns the next connection. Connections are taken from libzt up to
+// acceptBatch (ZT_ACCEPT_MANY_MAX) at a time, and watched by the poller in one call
+func (l *Listener) Accept() (net.Conn, error) {
+	l.mu.Lock()
+	defer l.mu.Unlock()
+	for len(l.pending) == 0 {
+		n, err := accept(l.fd, l.fds)
+		if n > 0 {
+			fds := make([]int, n)
+			for i := range fds {
+				fds[i] = int(l.fds[i])
+			}
+			if l.pending, err = l.p.add(fds...); err != nil {
+				for _, fd := range fds {
+					closeFd(fd)
+				}
+				return nil, opError("accept", l.addr, nil, err)
+			}
+			break
+		}
+		if !wouldBlock(err) {
+			return nil, opError("accept", l.addr, nil, err)
+		}
+		if err = l.pd.wait(l.pd.rd, &l.dl, nil); err != nil {
+			return nil, opError("accept", l.addr, nil, err)
+		}
+	}
+	pd := l.pending[0]
+	l.pending = l.pending[1:]
+	return newConn(l.p, pd), nil
+}
+
+// Close stops listening, connections accepted but not yet returned by Accept are closed
+func (l *Listener) Close() error {
+	err := error(net.ErrClosed)
+	l.closeOnce.Do(func() {
+		l.p.remove(l.pd)
+		l.mu.Lock()
+		closeFd(l.fd)
+		for _, pd := range l.pending {
+			l.p.remove(pd)
+			closeFd(pd.fd)
+		}
+		l.pending = nil
+		l.mu.Unlock()
+		err = nil
+	})
+	return err
+}
+
+func (l *Listener) Addr() net.Addr { return l.addr }
+
+// SetDeadline makes Accept give up at t, including an Accept already waiting
+func (l *Listener) SetDeadline(t time.Time) error {
+	l.dl.set(t)
+	kick(l.pd.rd)
+	return nil
+}
@@ -0,0 +1,176 @@
+// ZeroTier SDK - Network Virtualization Everywhere
+// Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+package zerotier
+
+import "C"
+
+import (
+	"net"
+	"os"
+	"sync"
+	"syscall"
+	"time"
+)
+
+// Events taken from libzt per cgo call
+const pollBatch = 128
+
+// What the goroutines using one socket wait on. A send is never blocked on: a token left in
+// rd or wr covers readiness which arrived between a failed attempt and the wait
+type pollDesc struct {
+	fd     int
+	rd     chan struct{}
+	wr     chan struct{}
+	closed chan struct{}
+}
+
+func (pd *pollDesc) notify(events uint32) {
+	if events&(epollIn|epollRdHup|epollErr|epollHup) != 0 {
+		kick(pd.rd)
+	}
+	if events&(epollOut|epollErr|epollHup) != 0 {
+		kick(pd.wr)
+	}
+}
+
+func kick(ch chan struct{}) {
+	select {
+	case ch <- struct{}{}:
+	default:
+	}
+}
+
+// One zts_epoll instance for every socket of the process
+type poller struct {
+	epfd  int
+	mu    sync.Mutex
+	descs map[int]*pollDesc
+}
+
+var (
+	pollOnce   sync.Once
+	thePoller  *poller
+	thePollErr error
+)
+
+func getPoller() (*poller, error) {
+	pollOnce.Do(func() {
+		epfd, err := epollCreate()
+		if err != nil {
+			thePollErr = err
+			return
+		}
+		// The instance's descriptor is a pipe of the host's, readable while events are
+		// pending. Already non-blocking, so the runtime's netpoller takes it
+		f := os.NewFile(uintptr(epfd), "zts_epoll")
+		rc, err := f.SyscallConn()
+		if err != nil {
+			thePollErr = err
+			return
+		}
+		thePoller = &poller{epfd: epfd, descs: make(map[int]*pollDesc)}
+		go thePoller.run(rc)
+	})
+	return thePoller, thePollErr
+}
+
+func (p *poller) run(rc syscall.RawConn) {
+	fds := make([]C.int, pollBatch)
+	events := make([]uint32, pollBatch)
+	rc.Read(func(uintptr) bool {
+		for {
+			n, err := wait(p.epfd, fds, events)
+			if err != nil {
+				return false
+			}
+			p.mu.Lock()
+			for i := 0; i < n; i++ {
+				if pd := p.descs[int(fds[i])]; pd != nil {
+					pd.notify(events[i])
+				}
+			}
+			p.mu.Unlock()
+			// Fewer than asked for means the ready set is empty and the pipe drained, the
+			// next event makes it readable again
+			if n < pollBatch {
+				return false
+			}
+		}
+	})
+}
+
+// Watches fds (fresh sockets), returns their descriptors in the same order
+func (p *poller) add(fds ...int) ([]*pollDesc, error) {
+	pds := make([]*pollDesc, len(fds))
+	cfds := make([]C.int, len(fds))
+	p.mu.Lock()
+	for i, fd := range fds {
+		pds[i] = &pollDesc{
+			fd:     fd,
+			rd:     make(chan struct{}, 1),
+			wr:     make(chan struct{}, 1),
+			closed: make(chan struct{}),
+		}
+		p.descs[fd] = pds[i]
+		cfds[i] = C.int(fd)
+	}
+	p.mu.Unlock()
+	if err := watch(p.epfd, cfds); err != nil {
+		p.mu.Lock()
+		for _, fd := range fds {
+			delete(p.descs, fd)
+		}
+		p.mu.Unlock()
+		return nil, err
+	}
+	return pds, nil
+}
+
+// Forgets pd and wakes whatever waits on it, before its socket is closed (libzt takes a
+// closed socket off the instance by itself)
+func (p *poller) remove(pd *pollDesc) {
+	p.mu.Lock()
+	if p.descs[pd.fd] == pd {
+		delete(p.descs, pd.fd)
+	}
+	p.mu.Unlock()
+	close(pd.closed)
+}
+
+// Waits on ch until it's signalled, done is closed, the deadline passes or pd is closed
+func (pd *pollDesc) wait(ch chan struct{}, dl *deadline, done <-chan struct{}) error {
+	var timeout <-chan time.Time
+	if t := dl.get(); !t.IsZero() {
+		d := time.Until(t)
+		if d <= 0 {
+			return os.ErrDeadlineExceeded
+		}
+		timer := time.NewTimer(d)
+		defer timer.Stop()
+		timeout = timer.C
+	}
+	select {
+	case <-ch:
+		return nil
+	case <-timeout:
+		return os.ErrDeadlineExceeded
+	case <-done:
+		return errCanceled
+	case <-pd.closed:
+		return net.ErrClosed
+	}
+}
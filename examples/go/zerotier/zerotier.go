@@ -0,0 +1,301 @@
+// ZeroTier SDK - Network Virtualization Everywhere
+// Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Package zerotier implements net.Conn and net.Listener over libzt TCP sockets.
+//
+// Sockets are non-blocking and every operation is tried first. Only when libzt says it would
+// block does the goroutine park, on a channel which one poller goroutine signals from a
+// zts_epoll instance. That goroutine itself waits in the Go runtime's netpoller on the
+// instance's descriptor, so nothing holds an OS thread while waiting. Each cgo call does as
+// much as it can: the poller takes up to pollBatch events per crossing, Accept takes up to
+// ZT_ACCEPT_MANY_MAX connections, Read fills a read-ahead buffer which later small Reads are
+// served from, and WriteBuffers coalesces small buffers into one zts_write().
+package zerotier
+
+/*
+#cgo CFLAGS: -I${SRCDIR}/../../../include
+#cgo LDFLAGS: -L${SRCDIR}/../../../build/linux -lzt -lstdc++ -lpthread -lm
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include "libzt.h"
+
+// Fills in ss from a 4 or 16 byte address, returns its length
+static socklen_t gozt_sockaddr(struct sockaddr_storage *ss, const void *ip, int iplen, int port)
+{
+	memset(ss, 0, sizeof(*ss));
+	if(iplen == 4) {
+		struct sockaddr_in *in4 = (struct sockaddr_in *)ss;
+		in4->sin_family = AF_INET;
+		in4->sin_port = htons(port);
+		memcpy(&in4->sin_addr, ip, 4);
+		return sizeof(*in4);
+	}
+	struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)ss;
+	in6->sin6_family = AF_INET6;
+	in6->sin6_port = htons(port);
+	memcpy(&in6->sin6_addr, ip, 16);
+	return sizeof(*in6);
+}
+
+// A non-blocking TCP socket, bound to ip/port if listening, connecting to it otherwise
+static int gozt_socket(const void *ip, int iplen, int port, int listening, int backlog)
+{
+	struct sockaddr_storage ss;
+	socklen_t len = gozt_sockaddr(&ss, ip, iplen, port);
+	int fd = zts_socket(ss.ss_family, SOCK_STREAM, 0);
+	if(fd < 0)
+		return -errno;
+	if(zts_fcntl(fd, F_SETFL, O_NONBLOCK) < 0)
+		goto fail;
+	if(listening) {
+		if(zts_bind(fd, (struct sockaddr *)&ss, len) < 0 || zts_listen(fd, backlog) < 0)
+			goto fail;
+	}
+	else if(zts_connect(fd, (struct sockaddr *)&ss, len) < 0 && errno != EINPROGRESS)
+		goto fail;
+	return fd;
+fail:
+	{
+		int err = errno;
+		zts_close(fd);
+		return -err;
+	}
+}
+
+// Edge-triggered interest in everything, the Go side keeps track of what it waits for
+static int gozt_watch(int epfd, const int *fds, int n)
+{
+	for(int i=0; i<n; i++) {
+		struct zts_epoll_event ev;
+		ev.events = ZTS_EPOLLIN | ZTS_EPOLLOUT | ZTS_EPOLLRDHUP | ZTS_EPOLLET;
+		ev.data.u64 = (uint64_t)fds[i];
+		if(zts_epoll_ctl(epfd, ZTS_EPOLL_CTL_ADD, fds[i], &ev) < 0)
+			return -errno;
+	}
+	return 0;
+}
+
+static int gozt_wait(int epfd, int *fds, uint32_t *events, int max)
+{
+	struct zts_epoll_event evs[max];
+	int n = zts_epoll_wait(epfd, evs, max, 0);
+	for(int i=0; i<n; i++) {
+		fds[i] = (int)evs[i].data.u64;
+		events[i] = evs[i].events;
+	}
+	return n < 0 ? -errno : n;
+}
+
+// Up to max connections, each made non-blocking
+static int gozt_accept(int fd, int *fds, int max)
+{
+	int n = zts_accept_many(fd, fds, NULL, max);
+	if(n < 0)
+		return -errno;
+	for(int i=0; i<n; i++)
+		zts_fcntl(fds[i], F_SETFL, O_NONBLOCK);
+	return n;
+}
+
+static int gozt_soerror(int fd)
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+	if(zts_getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		return errno;
+	return err;
+}
+
+// The address family (0 on failure), ip gets 16 bytes of room
+static int gozt_name(int fd, int peer, void *ip, int *port)
+{
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+	if((peer ? zts_getpeername(fd, (struct sockaddr *)&ss, &len) : zts_getsockname(fd, (struct sockaddr *)&ss, &len)) < 0)
+		return 0;
+	if(ss.ss_family == AF_INET) {
+		struct sockaddr_in *in4 = (struct sockaddr_in *)&ss;
+		memcpy(ip, &in4->sin_addr, 4);
+		*port = ntohs(in4->sin_port);
+	}
+	else {
+		struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&ss;
+		memcpy(ip, &in6->sin6_addr, 16);
+		*port = ntohs(in6->sin6_port);
+	}
+	return ss.ss_family;
+}
+*/
+import "C"
+
+import (
+	"net"
+	"syscall"
+	"unsafe"
+)
+
+const (
+	epollIn    = C.ZTS_EPOLLIN
+	epollOut   = C.ZTS_EPOLLOUT
+	epollErr   = C.ZTS_EPOLLERR
+	epollHup   = C.ZTS_EPOLLHUP
+	epollRdHup = C.ZTS_EPOLLRDHUP
+
+	acceptBatch   = C.ZT_ACCEPT_MANY_MAX
+	listenBacklog = C.ZT_LISTEN_BACKLOG_MAX
+)
+
+// Start starts the ZeroTier service with its identity and state kept at path
+func Start(path string) {
+	cpath := C.CString(path)
+	defer C.free(unsafe.Pointer(cpath))
+	C.zts_start(cpath)
+}
+
+// SimpleStart starts the service, joins nwid and returns once this node has an address on it
+func SimpleStart(path, nwid string) {
+	cpath, cnwid := C.CString(path), C.CString(nwid)
+	defer C.free(unsafe.Pointer(cpath))
+	defer C.free(unsafe.Pointer(cnwid))
+	C.zts_simple_start(cpath, cnwid)
+}
+
+// Join joins network nwid (16 hex digits)
+func Join(nwid string) {
+	cnwid := C.CString(nwid)
+	defer C.free(unsafe.Pointer(cnwid))
+	C.zts_join(cnwid)
+}
+
+// HasAddress reports whether this node has been assigned an address on nwid
+func HasAddress(nwid string) bool {
+	cnwid := C.CString(nwid)
+	defer C.free(unsafe.Pointer(cnwid))
+	return C.zts_has_address(cnwid) != 0
+}
+
+// Stop stops the service, every socket goes with it
+func Stop() {
+	C.zts_stop()
+}
+
+// The errno carried by a negative return value of the gozt_* helpers
+func errnoOf(r C.int) error {
+	return syscall.Errno(-r)
+}
+
+// 4 bytes for IPv4 addresses, 16 otherwise
+func ipBytes(ip net.IP) []byte {
+	if ip4 := ip.To4(); ip4 != nil {
+		return ip4
+	}
+	if ip == nil {
+		return net.IPv4zero.To4()
+	}
+	return ip.To16()
+}
+
+func socket(addr *net.TCPAddr, listening bool, backlog int) (int, error) {
+	ip := ipBytes(addr.IP)
+	r := C.gozt_socket(unsafe.Pointer(&ip[0]), C.int(len(ip)), C.int(addr.Port), boolInt(listening), C.int(backlog))
+	if r < 0 {
+		return -1, errnoOf(r)
+	}
+	return int(r), nil
+}
+
+func sockName(fd int, peer bool) *net.TCPAddr {
+	var ip [16]byte
+	var port C.int
+	switch C.gozt_name(C.int(fd), boolInt(peer), unsafe.Pointer(&ip[0]), &port) {
+	case C.AF_INET:
+		return &net.TCPAddr{IP: net.IP(append([]byte(nil), ip[:4]...)), Port: int(port)}
+	case C.AF_INET6:
+		return &net.TCPAddr{IP: net.IP(append([]byte(nil), ip[:]...)), Port: int(port)}
+	}
+	return nil
+}
+
+func boolInt(b bool) C.int {
+	if b {
+		return 1
+	}
+	return 0
+}
+
+func epollCreate() (int, error) {
+	fd, err := C.zts_epoll_create(0)
+	if fd < 0 {
+		return -1, err
+	}
+	return int(fd), nil
+}
+
+func watch(epfd int, fds []C.int) error {
+	if r := C.gozt_watch(C.int(epfd), &fds[0], C.int(len(fds))); r < 0 {
+		return errnoOf(r)
+	}
+	return nil
+}
+
+func wait(epfd int, fds []C.int, events []uint32) (int, error) {
+	r := C.gozt_wait(C.int(epfd), &fds[0], (*C.uint32_t)(unsafe.Pointer(&events[0])), C.int(len(fds)))
+	if r < 0 {
+		return 0, errnoOf(r)
+	}
+	return int(r), nil
+}
+
+func accept(fd int, fds []C.int) (int, error) {
+	r := C.gozt_accept(C.int(fd), &fds[0], C.int(len(fds)))
+	if r < 0 {
+		return 0, errnoOf(r)
+	}
+	return int(r), nil
+}
+
+func read(fd int, b []byte) (int, error) {
+	n, err := C.zts_read(C.int(fd), unsafe.Pointer(&b[0]), C.size_t(len(b)))
+	return int(n), err
+}
+
+func write(fd int, b []byte) (int, error) {
+	n, err := C.zts_write(C.int(fd), unsafe.Pointer(&b[0]), C.size_t(len(b)))
+	return int(n), err
+}
+
+func shutdown(fd int, how int) error {
+	if r, err := C.zts_shutdown(C.int(fd), C.int(how)); r < 0 {
+		return err
+	}
+	return nil
+}
+
+func closeFd(fd int) {
+	C.zts_close(C.int(fd))
+}
+
+// How a non-blocking connect went, once the socket is writable
+func soError(fd int) error {
+	if err := C.gozt_soerror(C.int(fd)); err != 0 {
+		return syscall.Errno(err)
+	}
+	return nil
+}
@@ -30,6 +30,8 @@ package zerotier;
 import java.io.FileDescriptor;
 import java.io.FileInputStream;
 import java.io.FileOutputStream;
+import java.net.InetAddress;
+import java.nio.ByteBuffer;
 import java.util.ArrayList;
 import java.util.zip.ZipError;
 
@@ -153,9 +155,10 @@ public class ZeroTier {
         return err;
     }
 
-    public native int ztjni_accept4(int fd, String addr, int port);
-    public int accept4(int fd, String addr, int port) {
-        return ztjni_accept4(fd,addr,port);
+    // flags as for accept4(2), the peer's address is stored into addr (may be null)
+    public native int ztjni_accept4(int fd, zerotier.Address addr, int flags);
+    public int accept4(int fd, zerotier.Address addr, int flags) {
+        return ztjni_accept4(fd,addr,flags);
     }
 
     public native int ztjni_accept(int fd, zerotier.Address addr);
@@ -183,6 +186,35 @@ public class ZeroTier {
         return ztjni_write(fd, buf, len);
     }
 
+    // buf must be a direct ByteBuffer, data moves between its remaining bytes and the socket
+    // without being copied through the Java heap. Its position advances by what was transferred
+    public native int ztjni_read_direct(int fd, ByteBuffer buf, int off, int len);
+    public int read(int fd, ByteBuffer buf) {
+        int n = ztjni_read_direct(fd, buf, buf.position(), buf.remaining());
+        if (n > 0)
+            buf.position(buf.position() + n);
+        return n;
+    }
+
+    public native int ztjni_write_direct(int fd, ByteBuffer buf, int off, int len);
+    public int write(int fd, ByteBuffer buf) {
+        int n = ztjni_write_direct(fd, buf, buf.position(), buf.remaining());
+        if (n > 0)
+            buf.position(buf.position() + n);
+        return n;
+    }
+
+    // addr is the raw address (InetAddress.getAddress()), 4 bytes for IPv4 or 16 for IPv6
+    public native int ztjni_connect_addr(int fd, byte[] addr, int port);
+    public int connect(int fd, InetAddress addr, int port) {
+        return ztjni_connect_addr(fd, addr.getAddress(), port);
+    }
+
+    public native int ztjni_bind_addr(int fd, byte[] addr, int port);
+    public int bind(int fd, InetAddress addr, int port) {
+        return ztjni_bind_addr(fd, addr.getAddress(), port);
+    }
+
     public native int ztjni_sendto(int fd, byte[] buf, int len, int flags, zerotier.Address addr);
     public int sendto(int fd, byte[] buf, int len, int flags, zerotier.Address addr){
         return ztjni_sendto(fd,buf,len,flags,addr);
@@ -202,4 +234,39 @@ public class ZeroTier {
     public int fcntl(int sock, int cmd, int flag) {
         return  ztjni_fcntl(sock, F_SETFL, O_NONBLOCK);
     }
+
+    // Readiness-based I/O behind ZeroTierSelectorProvider, failures are returned as -errno
+    static native int[] ztjni_nio_constants();
+    static native int ztjni_nio_socket(int family, int type);
+    static native int ztjni_nio_set_blocking(int fd, boolean blocking);
+    static native int ztjni_nio_bind(int fd, byte[] addr, int port);
+    static native int ztjni_nio_listen(int fd, int backlog);
+    static native int ztjni_nio_accept(int fd);
+    static native int ztjni_nio_connect(int fd, byte[] addr, int port);
+    static native int ztjni_nio_setsockopt(int fd, int level, int optname, int value);
+    static native int ztjni_nio_getsockopt(int fd, int level, int optname, int[] value);
+    static native int ztjni_nio_shutdown(int fd, int how);
+    static native int ztjni_nio_close(int fd);
+    static native int ztjni_nio_getname(int fd, boolean peer, byte[] addr, int[] port);
+    static native int ztjni_nio_read(int fd, ByteBuffer buf, int off, int len);
+    static native int ztjni_nio_write(int fd, ByteBuffer buf, int off, int len);
+    static native int ztjni_nio_read_array(int fd, byte[] buf, int off, int len);
+    static native int ztjni_nio_write_array(int fd, byte[] buf, int off, int len);
+    static native int ztjni_nio_epoll_create();
+    static native int ztjni_nio_epoll_ctl(int epfd, int op, int fd, int events);
+    static native int ztjni_nio_epoll_wait(int epfd, int[] fds, int[] events, int timeout);
+    static native int ztjni_nio_epoll_wakeup(int epfd);
+
+    // { bytes_in, bytes_out, rx_drops, accept_overflows, txbuf_hwm, rxbuf_hwm, accept_backlog, retransmits, rtt_ms, rttvar_ms, rto_ms, cwnd }
+    public native long[] ztjni_get_socket_stats(int fd);
+    public long[] get_socket_stats(int fd) {
+        return ztjni_get_socket_stats(fd);
+    }
+
+    // { frames_in, bytes_in, frames_out, bytes_out, frames_dropped, rx_coalesced, stack_ticks, stack_tick_us, rxq_hwm, nconns, stack,
+    //   rx_pressure, rxq_overflows, rxq_early_drops, rx_pressure_events }
+    public native long[] ztjni_get_network_stats(String nwid);
+    public long[] get_network_stats(String nwid) {
+        return ztjni_get_network_stats(nwid);
+    }
 }
\ No newline at end of file
@@ -0,0 +1,189 @@
+/*
+ * ZeroTier One - Network Virtualization Everywhere
+ * Copyright (C) 2011-2015  ZeroTier, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * ZeroTier may be used and distributed under the terms of the GPLv3, which
+ * are available at: http://www.gnu.org/licenses/gpl-3.0.html
+ *
+ * If you would like to embed ZeroTier into a commercial application or
+ * redistribute it in a modified binary form, please contact ZeroTier Networks
+ * LLC. Start here: http://www.zerotier.com/
+ */
+
+package zerotier;
+
+import java.io.IOException;
+import java.net.InetAddress;
+import java.net.InetSocketAddress;
+import java.net.SocketAddress;
+import java.net.SocketOption;
+import java.net.StandardSocketOptions;
+import java.nio.ByteBuffer;
+import java.nio.ReadOnlyBufferException;
+import java.nio.channels.UnresolvedAddressException;
+import java.nio.channels.UnsupportedAddressTypeException;
+import java.util.Arrays;
+
+/**
+ * Native constants and the plumbing shared by the NIO channels (see ZeroTierSelectorProvider)
+ */
+final class ZeroTierNio {
+    private static final int[] C = ZeroTier.ztjni_nio_constants();
+
+    static final int AF_INET = C[0];
+    static final int AF_INET6 = C[1];
+    static final int SOCK_STREAM = C[2];
+    static final int EAGAIN = C[3];
+    static final int EINPROGRESS = C[4];
+    static final int SHUT_RD = C[5];
+    static final int SHUT_WR = C[6];
+    static final int EPOLLIN = C[7];
+    static final int EPOLLOUT = C[8];
+    static final int EPOLLERR = C[9];
+    static final int EPOLLHUP = C[10];
+    static final int EPOLL_CTL_ADD = C[11];
+    static final int EPOLL_CTL_DEL = C[12];
+    static final int EPOLL_CTL_MOD = C[13];
+    static final int SOL_SOCKET = C[14];
+    static final int IPPROTO_TCP = C[15];
+    static final int TCP_NODELAY = C[16];
+    static final int SO_KEEPALIVE = C[17];
+    static final int SO_SNDBUF = C[18];
+    static final int SO_RCVBUF = C[19];
+    static final int SO_REUSEADDR = C[20];
+
+    private ZeroTierNio() { }
+
+    // r is what one of the ztjni_nio_* calls returned (-errno)
+    static IOException error(int r, String what) {
+        return new IOException(what + " failed, errno=" + (-r));
+    }
+
+    static InetSocketAddress checkAddress(SocketAddress sa) {
+        if (!(sa instanceof InetSocketAddress))
+            throw new UnsupportedAddressTypeException();
+        InetSocketAddress isa = (InetSocketAddress)sa;
+        if (isa.isUnresolved())
+            throw new UnresolvedAddressException();
+        return isa;
+    }
+
+    static InetSocketAddress anyAddress(boolean ipv6) throws IOException {
+        return new InetSocketAddress(InetAddress.getByAddress(new byte[ipv6 ? 16 : 4]), 0);
+    }
+
+    static InetSocketAddress name(int fd, boolean peer) throws IOException {
+        byte[] addr = new byte[16];
+        int[] port = new int[1];
+        int n = ZeroTier.ztjni_nio_getname(fd, peer, addr, port);
+        if (n < 0)
+            throw error(n, peer ? "zts_getpeername" : "zts_getsockname");
+        return new InetSocketAddress(InetAddress.getByAddress(Arrays.copyOf(addr, n)), port[0]);
+    }
+
+    /**
+     * Reads into dst's remaining bytes, returns how many were read, 0 if none are available
+     * (non-blocking) or -1 at the end of the stream
+     */
+    static int read(int fd, ByteBuffer dst) throws IOException {
+        int len = dst.remaining();
+        if (len == 0)
+            return 0;
+        int pos = dst.position(), n;
+        if (dst.isDirect())
+            n = ZeroTier.ztjni_nio_read(fd, dst, pos, len);
+        else if (dst.hasArray())
+            n = ZeroTier.ztjni_nio_read_array(fd, dst.array(), dst.arrayOffset() + pos, len);
+        else
+            throw new ReadOnlyBufferException();
+        if (n == 0)
+            return -1;
+        if (n < 0) {
+            if (-n == EAGAIN)
+                return 0;
+            throw error(n, "zts_read");
+        }
+        dst.position(pos + n);
+        return n;
+    }
+
+    /**
+     * Writes src's remaining bytes, returns how many were written (0 if the socket is full)
+     */
+    static int write(int fd, ByteBuffer src) throws IOException {
+        int len = src.remaining();
+        if (len == 0)
+            return 0;
+        int pos = src.position(), n;
+        if (src.isDirect())
+            n = ZeroTier.ztjni_nio_write(fd, src, pos, len);
+        else if (src.hasArray())
+            n = ZeroTier.ztjni_nio_write_array(fd, src.array(), src.arrayOffset() + pos, len);
+        else {
+            byte[] tmp = new byte[len]; // read-only heap buffer
+            src.duplicate().get(tmp);
+            n = ZeroTier.ztjni_nio_write_array(fd, tmp, 0, len);
+        }
+        if (n < 0) {
+            if (-n == EAGAIN)
+                return 0;
+            throw error(n, "zts_write");
+        }
+        src.position(pos + n);
+        return n;
+    }
+
+    // { level, optname } for the options the channels support, null if name isn't one of them
+    private static int[] option(SocketOption<?> name) {
+        if (name == StandardSocketOptions.TCP_NODELAY)
+            return new int[] { IPPROTO_TCP, TCP_NODELAY };
+        if (name == StandardSocketOptions.SO_KEEPALIVE)
+            return new int[] { SOL_SOCKET, SO_KEEPALIVE };
+        if (name == StandardSocketOptions.SO_SNDBUF)
+            return new int[] { SOL_SOCKET, SO_SNDBUF };
+        if (name == StandardSocketOptions.SO_RCVBUF)
+            return new int[] { SOL_SOCKET, SO_RCVBUF };
+        if (name == StandardSocketOptions.SO_REUSEADDR)
+            return new int[] { SOL_SOCKET, SO_REUSEADDR };
+        return null;
+    }
+
+    static <T> void setOption(int fd, SocketOption<T> name, T value) throws IOException {
+        int[] opt = option(name);
+        if (opt == null)
+            throw new UnsupportedOperationException("'" + name + "' not supported");
+        int v = value instanceof Boolean ? (((Boolean)value) ? 1 : 0) : ((Integer)value).intValue();
+        int r = ZeroTier.ztjni_nio_setsockopt(fd, opt[0], opt[1], v);
+        if (r < 0)
+            throw error(r, "zts_setsockopt");
+    }
+
+    @SuppressWarnings("unchecked")
+    static <T> T getOption(int fd, SocketOption<T> name) throws IOException {
+        int[] opt = option(name);
+        if (opt == null)
+            throw new UnsupportedOperationException("'" + name + "' not supported");
+        int[] v = new int[1];
+        int r = ZeroTier.ztjni_nio_getsockopt(fd, opt[0], opt[1], v);
+        if (r < 0)
+            throw error(r, "zts_getsockopt");
+        if (name.type() == Boolean.class)
+            return (T)Boolean.valueOf(v[0] != 0);
+        return (T)Integer.valueOf(v[0]);
+    }
+}
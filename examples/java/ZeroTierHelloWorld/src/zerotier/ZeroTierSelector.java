@@ -0,0 +1,213 @@
+/*
+ * ZeroTier One - Network Virtualization Everywhere
+ * Copyright (C) 2011-2015  ZeroTier, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * ZeroTier may be used and distributed under the terms of the GPLv3, which
+ * are available at: http://www.gnu.org/licenses/gpl-3.0.html
+ *
+ * If you would like to embed ZeroTier into a commercial application or
+ * redistribute it in a modified binary form, please contact ZeroTier Networks
+ * LLC. Start here: http://www.zerotier.com/
+ */
+
+package zerotier;
+
+import java.io.IOException;
+import java.nio.channels.ClosedSelectorException;
+import java.nio.channels.IllegalSelectorException;
+import java.nio.channels.SelectionKey;
+import java.nio.channels.Selector;
+import java.nio.channels.spi.AbstractSelectableChannel;
+import java.nio.channels.spi.AbstractSelector;
+import java.nio.channels.spi.SelectorProvider;
+import java.util.Collections;
+import java.util.HashMap;
+import java.util.HashSet;
+import java.util.Map;
+import java.util.Set;
+
+/**
+ * A Selector backed by a zts_epoll instance. Readiness is level-triggered, as with any
+ * other Selector
+ */
+class ZeroTierSelector extends AbstractSelector {
+    private final int epfd;
+    private final Object regLock = new Object(); // keys, fdToKey
+    private final Set<SelectionKey> keys = new HashSet<SelectionKey>();
+    private final Set<SelectionKey> publicKeys = Collections.unmodifiableSet(keys);
+    private final Map<Integer, ZeroTierSelectionKey> fdToKey = new HashMap<Integer, ZeroTierSelectionKey>();
+    private final Set<SelectionKey> selected = new HashSet<SelectionKey>();
+    private final int[] fds = new int[256];
+    private final int[] events = new int[256];
+
+    ZeroTierSelector(SelectorProvider provider) throws IOException {
+        super(provider);
+        epfd = ZeroTier.ztjni_nio_epoll_create();
+        if (epfd < 0)
+            throw ZeroTierNio.error(epfd, "zts_epoll_create");
+    }
+
+    static int toEvents(int ops) {
+        int ev = 0;
+        if ((ops & (SelectionKey.OP_READ | SelectionKey.OP_ACCEPT)) != 0)
+            ev |= ZeroTierNio.EPOLLIN;
+        if ((ops & (SelectionKey.OP_WRITE | SelectionKey.OP_CONNECT)) != 0)
+            ev |= ZeroTierNio.EPOLLOUT;
+        return ev;
+    }
+
+    @Override
+    protected SelectionKey register(AbstractSelectableChannel ch, int ops, Object att) {
+        if (!(ch instanceof ZeroTierChannel))
+            throw new IllegalSelectorException();
+        ZeroTierSelectionKey k = new ZeroTierSelectionKey(this, ch, ops);
+        k.attach(att);
+        synchronized (regLock) {
+            if (!isOpen())
+                throw new ClosedSelectorException();
+            int r = ZeroTier.ztjni_nio_epoll_ctl(epfd, ZeroTierNio.EPOLL_CTL_ADD, k.fd, toEvents(ops));
+            if (r < 0)
+                throw new IllegalStateException("zts_epoll_ctl failed, errno=" + (-r));
+            keys.add(k);
+            // A key still mapped to fd belongs to a channel closed since, which took its
+            // registration with it
+            fdToKey.put(k.fd, k);
+        }
+        return k;
+    }
+
+    void updateInterest(ZeroTierSelectionKey k) {
+        synchronized (regLock) {
+            if (fdToKey.get(k.fd) == k)
+                ZeroTier.ztjni_nio_epoll_ctl(epfd, ZeroTierNio.EPOLL_CTL_MOD, k.fd, toEvents(k.interest));
+        }
+    }
+
+    private void processCancelled() {
+        Set<SelectionKey> cancelled = cancelledKeys();
+        synchronized (cancelled) {
+            for (SelectionKey sk : cancelled) {
+                ZeroTierSelectionKey k = (ZeroTierSelectionKey)sk;
+                synchronized (regLock) {
+                    keys.remove(k);
+                    if (fdToKey.get(k.fd) == k) {
+                        fdToKey.remove(k.fd);
+                        ZeroTier.ztjni_nio_epoll_ctl(epfd, ZeroTierNio.EPOLL_CTL_DEL, k.fd, 0);
+                    }
+                }
+                selected.remove(k);
+                deregister(k);
+            }
+            cancelled.clear();
+        }
+    }
+
+    private int doSelect(int timeout) throws IOException {
+        if (!isOpen())
+            throw new ClosedSelectorException();
+        synchronized (this) {
+            processCancelled();
+            int n = 0;
+            try {
+                begin(); // an interrupt wakes us up
+                n = ZeroTier.ztjni_nio_epoll_wait(epfd, fds, events, timeout);
+            } finally {
+                end();
+            }
+            if (n < 0)
+                throw ZeroTierNio.error(n, "zts_epoll_wait");
+            processCancelled();
+            int updated = 0;
+            for (int i = 0; i < n; i++) {
+                ZeroTierSelectionKey k;
+                synchronized (regLock) {
+                    k = fdToKey.get(fds[i]);
+                }
+                if (k == null || !k.isValid())
+                    continue;
+                int ready = ((ZeroTierChannel)k.channel()).translateReadyOps(events[i], k.interest);
+                if (ready == 0)
+                    continue;
+                if (!selected.contains(k)) {
+                    k.ready = ready;
+                    selected.add(k);
+                    updated++;
+                }
+                else if ((k.ready | ready) != k.ready) {
+                    k.ready |= ready;
+                    updated++;
+                }
+            }
+            return updated;
+        }
+    }
+
+    @Override
+    public Set<SelectionKey> keys() {
+        if (!isOpen())
+            throw new ClosedSelectorException();
+        return publicKeys;
+    }
+
+    @Override
+    public Set<SelectionKey> selectedKeys() {
+        if (!isOpen())
+            throw new ClosedSelectorException();
+        return selected;
+    }
+
+    @Override
+    public int selectNow() throws IOException {
+        return doSelect(0);
+    }
+
+    @Override
+    public int select(long timeout) throws IOException {
+        if (timeout < 0)
+            throw new IllegalArgumentException("negative timeout");
+        return doSelect(timeout == 0 ? -1 : (int)Math.min(timeout, Integer.MAX_VALUE));
+    }
+
+    @Override
+    public int select() throws IOException {
+        return doSelect(-1);
+    }
+
+    @Override
+    public Selector wakeup() {
+        ZeroTier.ztjni_nio_epoll_wakeup(epfd);
+        return this;
+    }
+
+    @Override
+    protected void implCloseSelector() throws IOException {
+        wakeup();
+        synchronized (this) {
+            synchronized (regLock) {
+                for (SelectionKey k : keys) {
+                    k.cancel(); // invalidates it
+                    deregister((ZeroTierSelectionKey)k);
+                }
+                keys.clear();
+                fdToKey.clear();
+            }
+            selected.clear();
+            ZeroTier.ztjni_nio_close(epfd);
+        }
+    }
+}
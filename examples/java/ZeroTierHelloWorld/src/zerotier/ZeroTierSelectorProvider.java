@@ -0,0 +1,92 @@
+/*
+ * ZeroTier One - Network Virtualization Everywhere
+ * Copyright (C) 2011-2015  ZeroTier, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * ZeroTier may be used and distributed under the terms of the GPLv3, which
+ * are available at: http://www.gnu.org/licenses/gpl-3.0.html
+ *
+ * If you would like to embed ZeroTier into a commercial application or
+ * redistribute it in a modified binary form, please contact ZeroTier Networks
+ * LLC. Start here: http://www.zerotier.com/
+ */
+
+package zerotier;
+
+import java.io.IOException;
+import java.net.ProtocolFamily;
+import java.net.StandardProtocolFamily;
+import java.nio.channels.DatagramChannel;
+import java.nio.channels.Pipe;
+import java.nio.channels.ServerSocketChannel;
+import java.nio.channels.SocketChannel;
+import java.nio.channels.spi.AbstractSelector;
+import java.nio.channels.spi.SelectorProvider;
+
+/**
+ * NIO channels and selectors on top of libzt sockets, so that NIO frameworks can drive
+ * many ZeroTier connections from a few event-loop threads. Selectors wait in zts_epoll_wait()
+ * and only take channels from this provider. TCP only, sockets are IPv4 unless opened with
+ * openSocketChannel(ProtocolFamily)/openServerSocketChannel(ProtocolFamily)
+ */
+public class ZeroTierSelectorProvider extends SelectorProvider {
+    private static final ZeroTierSelectorProvider INSTANCE = new ZeroTierSelectorProvider();
+
+    public static ZeroTierSelectorProvider provider() {
+        return INSTANCE;
+    }
+
+    protected ZeroTierSelectorProvider() { }
+
+    @Override
+    public AbstractSelector openSelector() throws IOException {
+        return new ZeroTierSelector(this);
+    }
+
+    @Override
+    public SocketChannel openSocketChannel() throws IOException {
+        return new ZeroTierSocketChannel(this, StandardProtocolFamily.INET);
+    }
+
+    public SocketChannel openSocketChannel(ProtocolFamily family) throws IOException {
+        return new ZeroTierSocketChannel(this, family);
+    }
+
+    @Override
+    public ServerSocketChannel openServerSocketChannel() throws IOException {
+        return new ZeroTierServerSocketChannel(this, StandardProtocolFamily.INET);
+    }
+
+    public ServerSocketChannel openServerSocketChannel(ProtocolFamily family) throws IOException {
+        return new ZeroTierServerSocketChannel(this, family);
+    }
+
+    @Override
+    public DatagramChannel openDatagramChannel() throws IOException {
+        throw new UnsupportedOperationException("datagram channels are not supported");
+    }
+
+    @Override
+    public DatagramChannel openDatagramChannel(ProtocolFamily family) throws IOException {
+        throw new UnsupportedOperationException("datagram channels are not supported");
+    }
+
+    @Override
+    public Pipe openPipe() throws IOException {
+        throw new UnsupportedOperationException("pipes are not supported");
+    }
+}
@@ -0,0 +1,180 @@
+/*
+ * ZeroTier One - Network Virtualization Everywhere
+ * Copyright (C) 2011-2015  ZeroTier, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * ZeroTier may be used and distributed under the terms of the GPLv3, which
+ * are available at: http://www.gnu.org/licenses/gpl-3.0.html
+ *
+ * If you would like to embed ZeroTier into a commercial application or
+ * redistribute it in a modified binary form, please contact ZeroTier Networks
+ * LLC. Start here: http://www.zerotier.com/
+ */
+
+package zerotier;
+
+import java.io.IOException;
+import java.net.InetSocketAddress;
+import java.net.ProtocolFamily;
+import java.net.ServerSocket;
+import java.net.SocketAddress;
+import java.net.SocketOption;
+import java.net.StandardProtocolFamily;
+import java.net.StandardSocketOptions;
+import java.nio.channels.AlreadyBoundException;
+import java.nio.channels.ClosedChannelException;
+import java.nio.channels.NotYetBoundException;
+import java.nio.channels.SelectionKey;
+import java.nio.channels.ServerSocketChannel;
+import java.nio.channels.SocketChannel;
+import java.nio.channels.spi.SelectorProvider;
+import java.util.Arrays;
+import java.util.Collections;
+import java.util.HashSet;
+import java.util.Set;
+
+/**
+ * A ServerSocketChannel over a listening libzt TCP socket, see ZeroTierSelectorProvider.
+ * There is no java.net.ServerSocket adaptor (socket() throws)
+ */
+public class ZeroTierServerSocketChannel extends ServerSocketChannel implements ZeroTierChannel {
+    private static final Set<SocketOption<?>> OPTIONS = Collections.unmodifiableSet(
+        new HashSet<SocketOption<?>>(Arrays.<SocketOption<?>>asList(StandardSocketOptions.SO_RCVBUF,
+            StandardSocketOptions.SO_REUSEADDR)));
+
+    // Backlog for bind() calls which leave it to us
+    private static final int DEFAULT_BACKLOG = 50;
+
+    private final int fd;
+    private final boolean ipv6;
+    private final Object lock = new Object();
+    private volatile boolean bound;
+
+    ZeroTierServerSocketChannel(SelectorProvider provider, ProtocolFamily family) throws IOException {
+        super(provider);
+        ipv6 = family == StandardProtocolFamily.INET6;
+        fd = ZeroTier.ztjni_nio_socket(ipv6 ? ZeroTierNio.AF_INET6 : ZeroTierNio.AF_INET, ZeroTierNio.SOCK_STREAM);
+        if (fd < 0)
+            throw ZeroTierNio.error(fd, "zts_socket");
+    }
+
+    public int fd() {
+        return fd;
+    }
+
+    public int translateReadyOps(int events, int interest) {
+        int ev = ZeroTierNio.EPOLLIN | ZeroTierNio.EPOLLERR | ZeroTierNio.EPOLLHUP;
+        return (events & ev) != 0 ? SelectionKey.OP_ACCEPT & interest : 0;
+    }
+
+    private void ensureOpen() throws ClosedChannelException {
+        if (!isOpen())
+            throw new ClosedChannelException();
+    }
+
+    @Override
+    public ServerSocketChannel bind(SocketAddress local, int backlog) throws IOException {
+        synchronized (lock) {
+            ensureOpen();
+            if (bound)
+                throw new AlreadyBoundException();
+            InetSocketAddress a = local == null ? ZeroTierNio.anyAddress(ipv6) : ZeroTierNio.checkAddress(local);
+            int r = ZeroTier.ztjni_nio_bind(fd, a.getAddress().getAddress(), a.getPort());
+            if (r < 0)
+                throw ZeroTierNio.error(r, "zts_bind");
+            r = ZeroTier.ztjni_nio_listen(fd, backlog < 1 ? DEFAULT_BACKLOG : backlog);
+            if (r < 0)
+                throw ZeroTierNio.error(r, "zts_listen");
+            bound = true;
+        }
+        return this;
+    }
+
+    @Override
+    public <T> ServerSocketChannel setOption(SocketOption<T> name, T value) throws IOException {
+        ensureOpen();
+        if (!OPTIONS.contains(name))
+            throw new UnsupportedOperationException("'" + name + "' not supported");
+        ZeroTierNio.setOption(fd, name, value);
+        return this;
+    }
+
+    @Override
+    public <T> T getOption(SocketOption<T> name) throws IOException {
+        ensureOpen();
+        if (!OPTIONS.contains(name))
+            throw new UnsupportedOperationException("'" + name + "' not supported");
+        return ZeroTierNio.getOption(fd, name);
+    }
+
+    @Override
+    public Set<SocketOption<?>> supportedOptions() {
+        return OPTIONS;
+    }
+
+    @Override
+    public ServerSocket socket() {
+        throw new UnsupportedOperationException("no java.net.ServerSocket adaptor, use the channel itself");
+    }
+
+    /**
+     * Returns the next connection, or null if none is waiting (non-blocking)
+     */
+    @Override
+    public SocketChannel accept() throws IOException {
+        synchronized (lock) {
+            ensureOpen();
+            if (!bound)
+                throw new NotYetBoundException();
+            int r = 0;
+            boolean done = false;
+            try {
+                begin();
+                r = ZeroTier.ztjni_nio_accept(fd);
+                done = true;
+            } finally {
+                end(done);
+            }
+            if (r < 0) {
+                if (-r == ZeroTierNio.EAGAIN)
+                    return null;
+                throw ZeroTierNio.error(r, "zts_accept");
+            }
+            return new ZeroTierSocketChannel(provider(), r, ipv6);
+        }
+    }
+
+    @Override
+    public SocketAddress getLocalAddress() throws IOException {
+        ensureOpen();
+        return bound ? ZeroTierNio.name(fd, false) : null;
+    }
+
+    @Override
+    protected void implCloseSelectableChannel() throws IOException {
+        int r = ZeroTier.ztjni_nio_close(fd);
+        if (r < 0)
+            throw ZeroTierNio.error(r, "zts_close");
+    }
+
+    @Override
+    protected void implConfigureBlocking(boolean block) throws IOException {
+        int r = ZeroTier.ztjni_nio_set_blocking(fd, block);
+        if (r < 0)
+            throw ZeroTierNio.error(r, "zts_fcntl");
+    }
+}
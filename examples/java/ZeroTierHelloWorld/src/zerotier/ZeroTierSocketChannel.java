@@ -0,0 +1,370 @@
+/*
+ * ZeroTier One - Network Virtualization Everywhere
+ * Copyright (C) 2011-2015  ZeroTier, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * ZeroTier may be used and distributed under the terms of the GPLv3, which
+ * are available at: http://www.gnu.org/licenses/gpl-3.0.html
+ *
+ * If you would like to embed ZeroTier into a commercial application or
+ * redistribute it in a modified binary form, please contact ZeroTier Networks
+ * LLC. Start here: http://www.zerotier.com/
+ */
+
+package zerotier;
+
+import java.io.IOException;
+import java.net.ConnectException;
+import java.net.InetSocketAddress;
+import java.net.ProtocolFamily;
+import java.net.Socket;
+import java.net.SocketAddress;
+import java.net.SocketOption;
+import java.net.StandardProtocolFamily;
+import java.net.StandardSocketOptions;
+import java.nio.ByteBuffer;
+import java.nio.channels.AlreadyConnectedException;
+import java.nio.channels.ClosedChannelException;
+import java.nio.channels.ConnectionPendingException;
+import java.nio.channels.NoConnectionPendingException;
+import java.nio.channels.NotYetConnectedException;
+import java.nio.channels.SelectionKey;
+import java.nio.channels.SocketChannel;
+import java.nio.channels.spi.SelectorProvider;
+import java.util.Arrays;
+import java.util.Collections;
+import java.util.HashSet;
+import java.util.Set;
+
+/**
+ * A SocketChannel over a libzt TCP socket, see ZeroTierSelectorProvider. There is no
+ * java.net.Socket adaptor (socket() throws)
+ */
+public class ZeroTierSocketChannel extends SocketChannel implements ZeroTierChannel {
+    private static final Set<SocketOption<?>> OPTIONS = Collections.unmodifiableSet(
+        new HashSet<SocketOption<?>>(Arrays.<SocketOption<?>>asList(StandardSocketOptions.TCP_NODELAY,
+            StandardSocketOptions.SO_KEEPALIVE, StandardSocketOptions.SO_SNDBUF,
+            StandardSocketOptions.SO_RCVBUF, StandardSocketOptions.SO_REUSEADDR)));
+
+    // How often a blocking finishConnect() checks on the attempt
+    private static final int CONNECT_POLL_MS = 10;
+
+    private final int fd;
+    private final boolean ipv6;
+    private final Object readLock = new Object();
+    private final Object writeLock = new Object();
+    private final Object stateLock = new Object();
+    private volatile InetSocketAddress remote;
+    private volatile boolean connected, pending, inputShutdown, outputShutdown;
+
+    ZeroTierSocketChannel(SelectorProvider provider, ProtocolFamily family) throws IOException {
+        super(provider);
+        ipv6 = family == StandardProtocolFamily.INET6;
+        fd = ZeroTier.ztjni_nio_socket(ipv6 ? ZeroTierNio.AF_INET6 : ZeroTierNio.AF_INET, ZeroTierNio.SOCK_STREAM);
+        if (fd < 0)
+            throw ZeroTierNio.error(fd, "zts_socket");
+    }
+
+    // An accepted connection, see ZeroTierServerSocketChannel.accept()
+    ZeroTierSocketChannel(SelectorProvider provider, int fd, boolean ipv6) throws IOException {
+        super(provider);
+        this.fd = fd;
+        this.ipv6 = ipv6;
+        connected = true;
+        ZeroTier.ztjni_nio_set_blocking(fd, true); // channels start out blocking
+        remote = ZeroTierNio.name(fd, true);
+    }
+
+    public int fd() {
+        return fd;
+    }
+
+    public int translateReadyOps(int events, int interest) {
+        int ready = 0;
+        boolean err = (events & (ZeroTierNio.EPOLLERR | ZeroTierNio.EPOLLHUP)) != 0;
+        if ((events & ZeroTierNio.EPOLLIN) != 0 || err)
+            ready |= SelectionKey.OP_READ;
+        if ((events & ZeroTierNio.EPOLLOUT) != 0 || err)
+            ready |= pending ? SelectionKey.OP_CONNECT : SelectionKey.OP_WRITE;
+        return ready & interest;
+    }
+
+    private void ensureOpen() throws ClosedChannelException {
+        if (!isOpen())
+            throw new ClosedChannelException();
+    }
+
+    @Override
+    public SocketChannel bind(SocketAddress local) throws IOException {
+        synchronized (stateLock) {
+            ensureOpen();
+            if (connected)
+                throw new AlreadyConnectedException();
+            if (pending)
+                throw new ConnectionPendingException();
+            InetSocketAddress a = local == null ? ZeroTierNio.anyAddress(ipv6) : ZeroTierNio.checkAddress(local);
+            int r = ZeroTier.ztjni_nio_bind(fd, a.getAddress().getAddress(), a.getPort());
+            if (r < 0)
+                throw ZeroTierNio.error(r, "zts_bind");
+        }
+        return this;
+    }
+
+    @Override
+    public <T> SocketChannel setOption(SocketOption<T> name, T value) throws IOException {
+        ensureOpen();
+        ZeroTierNio.setOption(fd, name, value);
+        return this;
+    }
+
+    @Override
+    public <T> T getOption(SocketOption<T> name) throws IOException {
+        ensureOpen();
+        return ZeroTierNio.getOption(fd, name);
+    }
+
+    @Override
+    public Set<SocketOption<?>> supportedOptions() {
+        return OPTIONS;
+    }
+
+    @Override
+    public SocketChannel shutdownInput() throws IOException {
+        synchronized (stateLock) {
+            ensureOpen();
+            if (!connected)
+                throw new NotYetConnectedException();
+            int r = ZeroTier.ztjni_nio_shutdown(fd, ZeroTierNio.SHUT_RD);
+            if (r < 0)
+                throw ZeroTierNio.error(r, "zts_shutdown");
+            inputShutdown = true;
+        }
+        return this;
+    }
+
+    @Override
+    public SocketChannel shutdownOutput() throws IOException {
+        synchronized (stateLock) {
+            ensureOpen();
+            if (!connected)
+                throw new NotYetConnectedException();
+            int r = ZeroTier.ztjni_nio_shutdown(fd, ZeroTierNio.SHUT_WR);
+            if (r < 0)
+                throw ZeroTierNio.error(r, "zts_shutdown");
+            outputShutdown = true;
+        }
+        return this;
+    }
+
+    @Override
+    public Socket socket() {
+        throw new UnsupportedOperationException("no java.net.Socket adaptor, use the channel itself");
+    }
+
+    @Override
+    public boolean isConnected() {
+        return connected;
+    }
+
+    @Override
+    public boolean isConnectionPending() {
+        return pending;
+    }
+
+    @Override
+    public boolean connect(SocketAddress sa) throws IOException {
+        InetSocketAddress a = ZeroTierNio.checkAddress(sa);
+        synchronized (readLock) {
+            synchronized (writeLock) {
+                synchronized (stateLock) {
+                    ensureOpen();
+                    if (connected)
+                        throw new AlreadyConnectedException();
+                    if (pending)
+                        throw new ConnectionPendingException();
+                    remote = a;
+                    int r = 0;
+                    boolean done = false;
+                    try {
+                        begin();
+                        r = ZeroTier.ztjni_nio_connect(fd, a.getAddress().getAddress(), a.getPort());
+                        done = true;
+                    } finally {
+                        end(done);
+                    }
+                    if (r == 0) {
+                        connected = true;
+                        return true;
+                    }
+                    if (-r == ZeroTierNio.EINPROGRESS && !isBlocking()) {
+                        pending = true;
+                        return false;
+                    }
+                    throw new ConnectException("zts_connect failed, errno=" + (-r));
+                }
+            }
+        }
+    }
+
+    @Override
+    public boolean finishConnect() throws IOException {
+        synchronized (readLock) {
+            synchronized (writeLock) {
+                synchronized (stateLock) {
+                    ensureOpen();
+                    if (connected)
+                        return true;
+                    if (!pending)
+                        throw new NoConnectionPendingException();
+                    byte[] addr = remote.getAddress().getAddress();
+                    for (;;) {
+                        int r = ZeroTier.ztjni_nio_connect(fd, addr, remote.getPort());
+                        if (r == 0) {
+                            pending = false;
+                            connected = true;
+                            return true;
+                        }
+                        if (-r != ZeroTierNio.EINPROGRESS) {
+                            pending = false;
+                            throw new ConnectException("zts_connect failed, errno=" + (-r));
+                        }
+                        if (!isBlocking())
+                            return false;
+                        boolean done = false;
+                        try {
+                            begin();
+                            Thread.sleep(CONNECT_POLL_MS);
+                            done = true;
+                        } catch (InterruptedException e) {
+                            Thread.currentThread().interrupt();
+                        } finally {
+                            end(done);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    @Override
+    public SocketAddress getRemoteAddress() throws IOException {
+        ensureOpen();
+        return connected ? remote : null;
+    }
+
+    @Override
+    public SocketAddress getLocalAddress() throws IOException {
+        ensureOpen();
+        return ZeroTierNio.name(fd, false);
+    }
+
+    @Override
+    public int read(ByteBuffer dst) throws IOException {
+        synchronized (readLock) {
+            ensureOpen();
+            if (!connected)
+                throw new NotYetConnectedException();
+            if (inputShutdown)
+                return -1;
+            int n = 0;
+            boolean done = false;
+            try {
+                begin();
+                n = ZeroTierNio.read(fd, dst);
+                done = true;
+            } finally {
+                end(done);
+            }
+            return n;
+        }
+    }
+
+    @Override
+    public long read(ByteBuffer[] dsts, int offset, int length) throws IOException {
+        if (offset < 0 || length < 0 || offset > dsts.length - length)
+            throw new IndexOutOfBoundsException();
+        synchronized (readLock) {
+            long tot = 0;
+            for (int i = offset; i < offset + length; i++) {
+                if (!dsts[i].hasRemaining())
+                    continue;
+                // Once something has been read a blocking channel mustn't wait for more
+                if (tot > 0 && isBlocking())
+                    break;
+                int n = read(dsts[i]);
+                if (n < 0)
+                    return tot > 0 ? tot : -1;
+                tot += n;
+                if (dsts[i].hasRemaining())
+                    break;
+            }
+            return tot;
+        }
+    }
+
+    @Override
+    public int write(ByteBuffer src) throws IOException {
+        synchronized (writeLock) {
+            ensureOpen();
+            if (!connected)
+                throw new NotYetConnectedException();
+            if (outputShutdown)
+                throw new ClosedChannelException();
+            int n = 0;
+            boolean done = false;
+            try {
+                begin();
+                n = ZeroTierNio.write(fd, src);
+                done = true;
+            } finally {
+                end(done);
+            }
+            return n;
+        }
+    }
+
+    @Override
+    public long write(ByteBuffer[] srcs, int offset, int length) throws IOException {
+        if (offset < 0 || length < 0 || offset > srcs.length - length)
+            throw new IndexOutOfBoundsException();
+        synchronized (writeLock) {
+            long tot = 0;
+            for (int i = offset; i < offset + length; i++) {
+                if (!srcs[i].hasRemaining())
+                    continue;
+                tot += write(srcs[i]);
+                if (srcs[i].hasRemaining())
+                    break;
+            }
+            return tot;
+        }
+    }
+
+    @Override
+    protected void implCloseSelectableChannel() throws IOException {
+        int r = ZeroTier.ztjni_nio_close(fd);
+        if (r < 0)
+            throw ZeroTierNio.error(r, "zts_close");
+    }
+
+    @Override
+    protected void implConfigureBlocking(boolean block) throws IOException {
+        int r = ZeroTier.ztjni_nio_set_blocking(fd, block);
+        if (r < 0)
+            throw ZeroTierNio.error(r, "zts_fcntl");
+    }
+}
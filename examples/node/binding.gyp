@@ -0,0 +1,11 @@
+{
+  "targets": [
+    {
+      "target_name": "libzt",
+      "sources": ["libzt.cc"],
+      "include_dirs": ["../../include"],
+      "libraries": ["-L<(module_root_dir)/../../build/linux", "-lzt", "-lstdc++", "-lpthread"],
+      "cflags_cc": ["-std=c++11"]
+    }
+  ]
+}
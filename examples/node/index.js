@@ -0,0 +1,447 @@
+// ZeroTier SDK - Network Virtualization Everywhere
+// Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// net.Socket- and net.Server-like classes over the libzt addon (libzt.cc).
+//
+// Readiness comes from one zts_epoll instance, watched by a uv_poll_t on the loop: every
+// socket is registered edge-triggered and tries its I/O first, waiting for the next event
+// only once libzt would block. Reads arrive as Buffers over the memory libzt wrote into,
+// writes (including those stream.Writable batches through _writev()) go out from the
+// Buffers' own memory in one zts_writev()
+
+'use strict';
+
+const dns = require('dns');
+const EventEmitter = require('events');
+const net = require('net');
+const { Duplex } = require('stream');
+const util = require('util');
+
+const native = require('./build/Release/libzt.node');
+
+const READ_SZ = 64 * 1024;
+const ACCEPT_BATCH = 64; // ZT_ACCEPT_MANY_MAX
+
+const handlers = new Map(); // fd -> Socket or Server
+let polling = false;
+let refs = 0;
+
+function dispatch(events) {
+  for (let i = 0; i < events.length; i += 2) {
+    const h = handlers.get(events[i]);
+    if (h)
+      h._onEvents(events[i + 1] >>> 0);
+  }
+}
+
+function watch(fd, handler) {
+  if (!polling) {
+    native.initPoller(dispatch);
+    polling = true;
+  }
+  handlers.set(fd, handler);
+  native.watch(fd);
+}
+
+// The loop stays alive while a watched handle is ref()'d, as with net
+function addRef(n) {
+  const before = refs;
+  refs += n;
+  if (!before !== !refs)
+    native.setRef(refs > 0);
+}
+
+function errnoException(errno, syscall) {
+  const code = util.getSystemErrorName(-errno);
+  const err = new Error(`${syscall} ${code}`);
+  err.code = code;
+  err.errno = -errno;
+  err.syscall = syscall;
+  return err;
+}
+
+const IN = native.EPOLLIN | native.EPOLLRDHUP | native.EPOLLERR | native.EPOLLHUP;
+const OUT = native.EPOLLOUT | native.EPOLLERR | native.EPOLLHUP;
+
+class Socket extends Duplex {
+  constructor(options = {}) {
+    super({ allowHalfOpen: !!options.allowHalfOpen, emitClose: true });
+    this._fd = -1;
+    this._refed = true;
+    this._wantRead = false;
+    this._pending = null; // { bufs, cb } of the write waiting for room
+    this._timeout = 0;
+    this._timer = null;
+    this._peer = undefined;
+    this.connecting = false;
+    this.bytesRead = 0;
+    this._bytesWritten = 0;
+    if (options.fd !== undefined)
+      this._attach(options.fd);
+  }
+
+  get bytesWritten() { return this._bytesWritten; }
+  get remoteAddress() { return this._remote().address; }
+  get remotePort() { return this._remote().port; }
+  get remoteFamily() { return this._remote().family; }
+  get localAddress() { return this.address().address; }
+  get localPort() { return this.address().port; }
+  get pending() { return this._fd < 0 || this.connecting; }
+  get readyState() {
+    if (this.connecting)
+      return 'opening';
+    if (this.readable && this.writable)
+      return 'open';
+    return this.readable ? 'readOnly' : this.writable ? 'writeOnly' : 'closed';
+  }
+
+  _remote() {
+    if (!this._peer && this._fd >= 0 && !this.connecting)
+      this._peer = native.peername(this._fd);
+    return this._peer || {};
+  }
+
+  address() {
+    return (this._fd >= 0 && native.sockname(this._fd)) || {};
+  }
+
+  _attach(fd) {
+    this._fd = fd;
+    watch(fd, this);
+    if (this._refed)
+      addRef(1);
+  }
+
+  // connect(port[, host][, listener]) or connect({ port, host }[, listener])
+  connect(...args) {
+    let options = args[0], cb;
+    if (typeof options !== 'object')
+      options = { port: args[0], host: typeof args[1] === 'string' ? args[1] : undefined };
+    cb = args.find((a) => typeof a === 'function');
+    if (cb)
+      this.once('connect', cb);
+    const host = options.host || '127.0.0.1';
+    this.connecting = true;
+    if (net.isIP(host))
+      this._connect(host, options.port);
+    else {
+      dns.lookup(host, (err, addr) => err ? this.destroy(err) : this._connect(addr, options.port));
+    }
+    return this;
+  }
+
+  _connect(host, port) {
+    try {
+      this._attach(native.connect(host, Number(port)));
+    } catch (err) {
+      process.nextTick(() => this.destroy(err));
+    }
+  }
+
+  _onEvents(ev) {
+    if (this.connecting) {
+      if (ev & OUT)
+        this._connected();
+      return;
+    }
+    if ((ev & IN) && this._wantRead)
+      this._pull();
+    if ((ev & OUT) && this._pending)
+      this._flush();
+  }
+
+  _connected() {
+    const errno = native.soError(this._fd);
+    if (errno) {
+      this.destroy(errnoException(errno, 'connect'));
+      return;
+    }
+    this.connecting = false;
+    this._touch();
+    this.emit('connect');
+    this.emit('ready');
+    if (this._wantRead)
+      this._pull();
+    if (this._pending)
+      this._flush();
+  }
+
+  _read() {
+    this._wantRead = true;
+    if (this._fd >= 0 && !this.connecting)
+      this._pull();
+  }
+
+  // Reads until libzt has nothing more or the stream's buffer is full
+  _pull() {
+    while (this._wantRead && this._fd >= 0) {
+      let buf;
+      try {
+        buf = native.read(this._fd, READ_SZ);
+      } catch (err) {
+        this.destroy(err);
+        return;
+      }
+      if (buf === null)
+        return; // the next EPOLLIN resumes
+      if (buf.length === 0) {
+        this._wantRead = false;
+        this.push(null);
+        return;
+      }
+      this.bytesRead += buf.length;
+      this._touch();
+      this._wantRead = this.push(buf);
+    }
+  }
+
+  _write(chunk, encoding, cb) {
+    this._writev([{ chunk }], cb);
+  }
+
+  _writev(chunks, cb) {
+    this._pending = { bufs: chunks.map((c) => c.chunk), cb };
+    if (this._fd >= 0 && !this.connecting)
+      this._flush();
+  }
+
+  // Writes until the pending buffers are gone or libzt's send buffer is full
+  _flush() {
+    const p = this._pending;
+    while (p.bufs.length) {
+      let n;
+      try {
+        n = native.writev(this._fd, p.bufs);
+      } catch (err) {
+        this._pending = null;
+        p.cb(err);
+        return;
+      }
+      if (n < 0)
+        return; // the next EPOLLOUT resumes
+      this._bytesWritten += n;
+      this._touch();
+      while (n > 0 && n >= p.bufs[0].length)
+        n -= p.bufs.shift().length;
+      if (n > 0)
+        p.bufs[0] = p.bufs[0].subarray(n);
+      while (p.bufs.length && !p.bufs[0].length)
+        p.bufs.shift();
+    }
+    this._pending = null;
+    p.cb();
+  }
+
+  _final(cb) {
+    if (this.connecting) {
+      this.once('connect', () => this._final(cb));
+      return;
+    }
+    try {
+      native.shutdown(this._fd);
+      cb();
+    } catch (err) {
+      cb(err);
+    }
+  }
+
+  _destroy(err, cb) {
+    this._clearTimer();
+    if (this._fd >= 0) {
+      handlers.delete(this._fd);
+      native.close(this._fd);
+      this._fd = -1;
+      if (this._refed)
+        addRef(-1);
+    }
+    cb(err);
+  }
+
+  setTimeout(ms, cb) {
+    this._timeout = ms;
+    if (cb)
+      ms ? this.once('timeout', cb) : this.removeListener('timeout', cb);
+    this._touch();
+    return this;
+  }
+
+  _clearTimer() {
+    if (this._timer) {
+      clearTimeout(this._timer);
+      this._timer = null;
+    }
+  }
+
+  // Restarts the idle timer after activity
+  _touch() {
+    this._clearTimer();
+    if (this._timeout) {
+      this._timer = setTimeout(() => this.emit('timeout'), this._timeout);
+      this._timer.unref();
+    }
+  }
+
+  setNoDelay(noDelay = true) {
+    if (this._fd >= 0)
+      native.setNoDelay(this._fd, !!noDelay);
+    return this;
+  }
+
+  setKeepAlive() {
+    return this;
+  }
+
+  ref() {
+    if (!this._refed) {
+      this._refed = true;
+      if (this._fd >= 0)
+        addRef(1);
+    }
+    return this;
+  }
+
+  unref() {
+    if (this._refed) {
+      this._refed = false;
+      if (this._fd >= 0)
+        addRef(-1);
+    }
+    return this;
+  }
+}
+
+class Server extends EventEmitter {
+  constructor(options, listener) {
+    super();
+    if (typeof options === 'function')
+      listener = options;
+    if (listener)
+      this.on('connection', listener);
+    this._fd = -1;
+    this._refed = true;
+    this.listening = false;
+  }
+
+  // listen(port[, host][, backlog][, callback]) or listen({ port, host, backlog }[, callback])
+  listen(...args) {
+    let options = args[0];
+    if (typeof options !== 'object') {
+      options = { port: args[0] };
+      if (typeof args[1] === 'string')
+        options.host = args[1];
+      const backlog = args.find((a, i) => i > 0 && typeof a === 'number');
+      if (backlog !== undefined)
+        options.backlog = backlog;
+    }
+    const cb = args.find((a) => typeof a === 'function');
+    if (cb)
+      this.once('listening', cb);
+    const host = options.host || '0.0.0.0';
+    const backlog = Math.min(options.backlog || 511, native.LISTEN_BACKLOG_MAX);
+    try {
+      this._fd = native.listen(host, Number(options.port || 0), backlog);
+      watch(this._fd, this);
+      if (this._refed)
+        addRef(1);
+    } catch (err) {
+      process.nextTick(() => this.emit('error', err));
+      return this;
+    }
+    this.listening = true;
+    process.nextTick(() => this.emit('listening'));
+    return this;
+  }
+
+  _onEvents(ev) {
+    if (!(ev & IN))
+      return;
+    // Edge-triggered, so everything queued is taken now, ACCEPT_BATCH per call
+    for (;;) {
+      let fds;
+      try {
+        fds = native.accept(this._fd);
+      } catch (err) {
+        this.emit('error', err);
+        return;
+      }
+      for (const fd of fds)
+        this.emit('connection', new Socket({ fd }));
+      if (fds.length < ACCEPT_BATCH || this._fd < 0)
+        return;
+    }
+  }
+
+  address() {
+    return this._fd >= 0 ? native.sockname(this._fd) : null;
+  }
+
+  close(cb) {
+    if (this._fd < 0) {
+      if (cb)
+        process.nextTick(cb, new Error('Server is not running.'));
+      return this;
+    }
+    handlers.delete(this._fd);
+    native.close(this._fd);
+    this._fd = -1;
+    this.listening = false;
+    if (this._refed)
+      addRef(-1);
+    if (cb)
+      this.once('close', cb);
+    process.nextTick(() => this.emit('close'));
+    return this;
+  }
+
+  ref() {
+    if (!this._refed) {
+      this._refed = true;
+      if (this._fd >= 0)
+        addRef(1);
+    }
+    return this;
+  }
+
+  unref() {
+    if (this._refed) {
+      this._refed = false;
+      if (this._fd >= 0)
+        addRef(-1);
+    }
+    return this;
+  }
+}
+
+function createServer(options, listener) {
+  return new Server(options, listener);
+}
+
+function connect(...args) {
+  const options = typeof args[0] === 'object' ? args[0] : {};
+  return new Socket(options).connect(...args);
+}
+
+module.exports = {
+  Socket,
+  Server,
+  createServer,
+  connect,
+  createConnection: connect,
+  start: native.start,
+  stop: native.stop,
+  join: native.join,
+  hasAddress: native.hasAddress,
+};
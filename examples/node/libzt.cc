@@ -0,0 +1,577 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// N-API addon over libzt.h (see README.md), index.js builds net.Socket-like streams on it.
+// Sockets are non-blocking int descriptors, calls which would block return null (or -1 for
+// counts) instead of throwing, other errors throw with code set to the errno name. Readiness
+// comes from one zts_epoll instance whose descriptor is watched by a uv_poll_t on the loop,
+// so no thread waits on libzt. Data read is handed to JS as an external Buffer over the
+// memory libzt wrote into, and writes go straight from the JS Buffers' memory
+
+#define NAPI_VERSION 8
+#include <node_api.h>
+#include <uv.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "libzt.h"
+
+// Events taken per zts_epoll_wait() and handed to JS per callback
+#define NODE_ZT_POLL_BATCH 128
+// Largest read() asked of libzt at once
+#define NODE_ZT_READ_MAX   (256 * 1024)
+// Buffers per zts_writev()
+#define NODE_ZT_IOV_MAX    64
+// Hex digits of a network ID
+#define NODE_ZT_NWID_LEN   16
+
+#define CHECK(call) do { if((call) != napi_ok) return NULL; } while(0)
+
+static napi_value throwErrno(napi_env env, int err)
+{
+	napi_value code, msg, error;
+	napi_create_string_utf8(env, uv_err_name(-err), NAPI_AUTO_LENGTH, &code);
+	napi_create_string_utf8(env, strerror(err), NAPI_AUTO_LENGTH, &msg);
+	napi_create_error(env, code, msg, &error);
+	napi_value errnum;
+	napi_create_int32(env, -err, &errnum);
+	napi_set_named_property(env, error, "errno", errnum);
+	napi_throw(env, error);
+	return NULL;
+}
+
+static napi_value undefinedValue(napi_env env)
+{
+	napi_value v;
+	napi_get_undefined(env, &v);
+	return v;
+}
+
+static napi_value nullValue(napi_env env)
+{
+	napi_value v;
+	napi_get_null(env, &v);
+	return v;
+}
+
+static napi_value intValue(napi_env env, int64_t n)
+{
+	napi_value v;
+	napi_create_int64(env, n, &v);
+	return v;
+}
+
+// argv[i] as a string into buf, false (with an exception pending) if it isn't one
+static bool getString(napi_env env, napi_value v, char *buf, size_t len)
+{
+	size_t n;
+	if(napi_get_value_string_utf8(env, v, buf, len, &n) != napi_ok) {
+		napi_throw_type_error(env, NULL, "expected a string");
+		return false;
+	}
+	return true;
+}
+
+static bool getInt(napi_env env, napi_value v, int *i)
+{
+	if(napi_get_value_int32(env, v, i) != napi_ok) {
+		napi_throw_type_error(env, NULL, "expected a number");
+		return false;
+	}
+	return true;
+}
+
+// (host, port) into ss
+static bool parseAddr(napi_env env, napi_value host, napi_value port, struct sockaddr_storage *ss, socklen_t *len)
+{
+	char h[INET6_ADDRSTRLEN];
+	int p;
+	if(!getString(env, host, h, sizeof(h)) || !getInt(env, port, &p))
+		return false;
+	memset(ss, 0, sizeof(*ss));
+	struct sockaddr_in *in = (struct sockaddr_in *)ss;
+	struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)ss;
+	if(inet_pton(AF_INET, h, &in->sin_addr) == 1) {
+		in->sin_family = AF_INET;
+		in->sin_port = htons(p);
+		*len = sizeof(*in);
+		return true;
+	}
+	if(inet_pton(AF_INET6, h, &in6->sin6_addr) == 1) {
+		in6->sin6_family = AF_INET6;
+		in6->sin6_port = htons(p);
+		*len = sizeof(*in6);
+		return true;
+	}
+	napi_throw_type_error(env, NULL, "not an IP address");
+	return false;
+}
+
+// { address, port, family } as net.Socket.address() has it
+static napi_value makeAddr(napi_env env, const struct sockaddr_storage *ss)
+{
+	char host[INET6_ADDRSTRLEN];
+	int port;
+	const char *family;
+	if(ss->ss_family == AF_INET) {
+		const struct sockaddr_in *in = (const struct sockaddr_in *)ss;
+		inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host));
+		port = ntohs(in->sin_port);
+		family = "IPv4";
+	}
+	else if(ss->ss_family == AF_INET6) {
+		const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)ss;
+		inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+		port = ntohs(in6->sin6_port);
+		family = "IPv6";
+	}
+	else
+		return undefinedValue(env);
+	napi_value obj, v;
+	napi_create_object(env, &obj);
+	napi_create_string_utf8(env, host, NAPI_AUTO_LENGTH, &v);
+	napi_set_named_property(env, obj, "address", v);
+	napi_set_named_property(env, obj, "port", intValue(env, port));
+	napi_create_string_utf8(env, family, NAPI_AUTO_LENGTH, &v);
+	napi_set_named_property(env, obj, "family", v);
+	return obj;
+}
+
+#define ARGS(n) \
+	size_t argc = n; \
+	napi_value argv[n]; \
+	CHECK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL)); \
+	if(argc < n) { \
+		napi_throw_type_error(env, NULL, "missing arguments"); \
+		return NULL; \
+	}
+
+/****************************************************************************/
+/* Service                                                                  */
+/****************************************************************************/
+
+static napi_value nodeStart(napi_env env, napi_callback_info info)
+{
+	ARGS(1);
+	char path[4096];
+	if(!getString(env, argv[0], path, sizeof(path)))
+		return NULL;
+	zts_start(path);
+	return undefinedValue(env);
+}
+
+static napi_value nodeStop(napi_env env, napi_callback_info info)
+{
+	zts_stop();
+	return undefinedValue(env);
+}
+
+static napi_value nodeJoin(napi_env env, napi_callback_info info)
+{
+	ARGS(1);
+	char nwid[NODE_ZT_NWID_LEN + 1];
+	if(!getString(env, argv[0], nwid, sizeof(nwid)))
+		return NULL;
+	zts_join(nwid);
+	return undefinedValue(env);
+}
+
+static napi_value nodeHasAddress(napi_env env, napi_callback_info info)
+{
+	ARGS(1);
+	char nwid[NODE_ZT_NWID_LEN + 1];
+	if(!getString(env, argv[0], nwid, sizeof(nwid)))
+		return NULL;
+	napi_value v;
+	napi_get_boolean(env, zts_has_address(nwid), &v);
+	return v;
+}
+
+/****************************************************************************/
+/* Readiness                                                                */
+/****************************************************************************/
+
+// One per process, on the main thread's loop: the callback gets an Int32Array of fd, events pairs
+static struct {
+	int epfd;
+	uv_poll_t poll;
+	napi_env env;
+	napi_ref cb;
+	napi_async_context ctx;
+} poller = { -1 };
+
+static void onPollable(uv_poll_t *handle, int status, int events)
+{
+	napi_env env = poller.env;
+	napi_handle_scope scope;
+	napi_open_handle_scope(env, &scope);
+	struct zts_epoll_event evs[NODE_ZT_POLL_BATCH];
+	int n;
+	do {
+		// Fewer than asked for leaves the ready set empty and the pipe drained
+		n = zts_epoll_wait(poller.epfd, evs, NODE_ZT_POLL_BATCH, 0);
+		if(n <= 0)
+			break;
+		napi_value ab, arr, cb, recv, result;
+		int32_t *data;
+		napi_create_arraybuffer(env, n * 2 * sizeof(int32_t), (void **)&data, &ab);
+		for(int i=0; i<n; i++) {
+			data[2 * i] = (int32_t)evs[i].data.fd;
+			data[2 * i + 1] = (int32_t)evs[i].events;
+		}
+		napi_create_typedarray(env, napi_int32_array, n * 2, ab, 0, &arr);
+		napi_get_reference_value(env, poller.cb, &cb);
+		napi_get_undefined(env, &recv);
+		napi_make_callback(env, poller.ctx, recv, cb, 1, &arr, &result);
+	} while(n == NODE_ZT_POLL_BATCH);
+	napi_close_handle_scope(env, scope);
+}
+
+static napi_value nodeInitPoller(napi_env env, napi_callback_info info)
+{
+	ARGS(1);
+	if(poller.epfd >= 0) {
+		napi_throw_error(env, NULL, "poller already initialized");
+		return NULL;
+	}
+	uv_loop_t *loop;
+	CHECK(napi_get_uv_event_loop(env, &loop));
+	if((poller.epfd = zts_epoll_create(0)) < 0)
+		return throwErrno(env, errno);
+	napi_value name;
+	napi_create_string_utf8(env, "libzt", NAPI_AUTO_LENGTH, &name);
+	CHECK(napi_create_reference(env, argv[0], 1, &poller.cb));
+	CHECK(napi_async_init(env, NULL, name, &poller.ctx));
+	poller.env = env;
+	// The instance's descriptor is a pipe of the host's, readable while events are pending
+	uv_poll_init(loop, &poller.poll, poller.epfd);
+	uv_poll_start(&poller.poll, UV_READABLE, onPollable);
+	// Only while sockets want it to, see setRef()
+	uv_unref((uv_handle_t *)&poller.poll);
+	return undefinedValue(env);
+}
+
+// Whether the poller keeps the loop alive, true while index.js has a ref()'d socket
+static napi_value nodeSetRef(napi_env env, napi_callback_info info)
+{
+	ARGS(1);
+	bool on;
+	if(napi_get_value_bool(env, argv[0], &on) != napi_ok || poller.epfd < 0)
+		return undefinedValue(env);
+	if(on)
+		uv_ref((uv_handle_t *)&poller.poll);
+	else
+		uv_unref((uv_handle_t *)&poller.poll);
+	return undefinedValue(env);
+}
+
+// Edge-triggered interest in everything, index.js keeps track of what it waits for
+static napi_value nodeWatch(napi_env env, napi_callback_info info)
+{
+	ARGS(1);
+	int fd;
+	if(!getInt(env, argv[0], &fd))
+		return NULL;
+	struct zts_epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = ZTS_EPOLLIN | ZTS_EPOLLOUT | ZTS_EPOLLRDHUP | ZTS_EPOLLET;
+	ev.data.fd = fd;
+	if(zts_epoll_ctl(poller.epfd, ZTS_EPOLL_CTL_ADD, fd, &ev) < 0)
+		return throwErrno(env, errno);
+	return undefinedValue(env);
+}
+
+/****************************************************************************/
+/* Sockets                                                                  */
+/****************************************************************************/
+
+static int nonblockingSocket(int family)
+{
+	int fd = zts_socket(family, SOCK_STREAM, 0);
+	if(fd >= 0 && zts_fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+		int err = errno;
+		zts_close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+// connect(host, port): a new socket whose connection is under way, writable once it's over
+static napi_value nodeConnect(napi_env env, napi_callback_info info)
+{
+	ARGS(2);
+	struct sockaddr_storage ss;
+	socklen_t len;
+	if(!parseAddr(env, argv[0], argv[1], &ss, &len))
+		return NULL;
+	int fd = nonblockingSocket(ss.ss_family);
+	if(fd < 0)
+		return throwErrno(env, errno);
+	if(zts_connect(fd, (struct sockaddr *)&ss, len) < 0 && errno != EINPROGRESS) {
+		int err = errno;
+		zts_close(fd);
+		return throwErrno(env, err);
+	}
+	return intValue(env, fd);
+}
+
+// listen(host, port, backlog)
+static napi_value nodeListen(napi_env env, napi_callback_info info)
+{
+	ARGS(3);
+	struct sockaddr_storage ss;
+	socklen_t len;
+	int backlog;
+	if(!parseAddr(env, argv[0], argv[1], &ss, &len) || !getInt(env, argv[2], &backlog))
+		return NULL;
+	int fd = nonblockingSocket(ss.ss_family);
+	if(fd < 0)
+		return throwErrno(env, errno);
+	if(zts_bind(fd, (struct sockaddr *)&ss, len) < 0 || zts_listen(fd, backlog) < 0) {
+		int err = errno;
+		zts_close(fd);
+		return throwErrno(env, err);
+	}
+	return intValue(env, fd);
+}
+
+// Up to ZT_ACCEPT_MANY_MAX non-blocking descriptors, [] if none are waiting
+static napi_value nodeAccept(napi_env env, napi_callback_info info)
+{
+	ARGS(1);
+	int fd;
+	if(!getInt(env, argv[0], &fd))
+		return NULL;
+	int fds[ZT_ACCEPT_MANY_MAX];
+	int n = zts_accept_many(fd, fds, NULL, ZT_ACCEPT_MANY_MAX);
+	if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		return throwErrno(env, errno);
+	napi_value arr;
+	CHECK(napi_create_array_with_length(env, n > 0 ? n : 0, &arr));
+	for(int i=0; i<n; i++) {
+		zts_fcntl(fds[i], F_SETFL, O_NONBLOCK);
+		napi_set_element(env, arr, i, intValue(env, fds[i]));
+	}
+	return arr;
+}
+
+static void freeData(napi_env env, void *data, void *hint)
+{
+	free(data);
+}
+
+// read(fd, size): a Buffer over what libzt wrote, empty at EOF, null if nothing is waiting
+static napi_value nodeRead(napi_env env, napi_callback_info info)
+{
+	ARGS(2);
+	int fd, size;
+	if(!getInt(env, argv[0], &fd) || !getInt(env, argv[1], &size))
+		return NULL;
+	if(size <= 0 || size > NODE_ZT_READ_MAX)
+		size = NODE_ZT_READ_MAX;
+	void *buf = malloc(size);
+	if(!buf)
+		return throwErrno(env, ENOMEM);
+	int n = zts_read(fd, buf, size);
+	if(n < 0) {
+		int err = errno;
+		free(buf);
+		if(err == EAGAIN || err == EWOULDBLOCK)
+			return nullValue(env);
+		return throwErrno(env, err);
+	}
+	// A short read gives back what it didn't use rather than pinning size bytes for n
+	if(n < size / 2) {
+		void *shrunk = realloc(buf, n ? n : 1);
+		if(shrunk)
+			buf = shrunk;
+	}
+	napi_value out;
+	if(napi_create_external_buffer(env, n, buf, freeData, NULL, &out) == napi_ok)
+		return out;
+	// Runtimes which forbid external buffers (a V8 sandbox) get a copy
+	napi_status status = napi_create_buffer_copy(env, n, buf, NULL, &out);
+	free(buf);
+	return status == napi_ok ? out : NULL;
+}
+
+// writev(fd, buffers): bytes libzt took (-1 if none fit), in one call for all of them
+static napi_value nodeWritev(napi_env env, napi_callback_info info)
+{
+	ARGS(2);
+	int fd;
+	uint32_t n;
+	if(!getInt(env, argv[0], &fd))
+		return NULL;
+	bool isArray = false;
+	napi_is_array(env, argv[1], &isArray);
+	struct iovec iov[NODE_ZT_IOV_MAX];
+	int iovcnt = 0;
+	if(isArray) {
+		CHECK(napi_get_array_length(env, argv[1], &n));
+		for(uint32_t i=0; i<n && iovcnt<NODE_ZT_IOV_MAX; i++) {
+			napi_value b;
+			CHECK(napi_get_element(env, argv[1], i, &b));
+			CHECK(napi_get_buffer_info(env, b, &iov[iovcnt].iov_base, &iov[iovcnt].iov_len));
+			if(iov[iovcnt].iov_len)
+				iovcnt++;
+		}
+	}
+	else {
+		CHECK(napi_get_buffer_info(env, argv[1], &iov[0].iov_base, &iov[0].iov_len));
+		iovcnt = 1;
+	}
+	if(!iovcnt)
+		return intValue(env, 0);
+	ssize_t w = zts_writev(fd, iov, iovcnt);
+	if(w < 0) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK)
+			return intValue(env, -1);
+		return throwErrno(env, errno);
+	}
+	return intValue(env, w);
+}
+
+static napi_value nodeShutdown(napi_env env, napi_callback_info info)
+{
+	ARGS(1);
+	int fd;
+	if(!getInt(env, argv[0], &fd))
+		return NULL;
+	if(zts_shutdown(fd, SHUT_WR) < 0)
+		return throwErrno(env, errno);
+	return undefinedValue(env);
+}
+
+// Also takes fd off the poller
+static napi_value nodeClose(napi_env env, napi_callback_info info)
+{
+	ARGS(1);
+	int fd;
+	if(!getInt(env, argv[0], &fd))
+		return NULL;
+	zts_close(fd);
+	return undefinedValue(env);
+}
+
+// 0 once a connection attempt succeeded, its errno otherwise
+static napi_value nodeSoError(napi_env env, napi_callback_info info)
+{
+	ARGS(1);
+	int fd, err = 0;
+	if(!getInt(env, argv[0], &fd))
+		return NULL;
+	socklen_t len = sizeof(err);
+	if(zts_getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		err = errno;
+	return intValue(env, err);
+}
+
+static napi_value nodeSetNoDelay(napi_env env, napi_callback_info info)
+{
+	ARGS(2);
+	int fd;
+	bool on;
+	if(!getInt(env, argv[0], &fd) || napi_get_value_bool(env, argv[1], &on) != napi_ok)
+		return NULL;
+	int v = on;
+	// Not every stack takes the option, like Node this isn't an error
+	zts_setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &v, sizeof(v));
+	return undefinedValue(env);
+}
+
+static napi_value sockName(napi_env env, napi_callback_info info, bool peer)
+{
+	ARGS(1);
+	int fd;
+	if(!getInt(env, argv[0], &fd))
+		return NULL;
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+	memset(&ss, 0, sizeof(ss));
+	if((peer ? zts_getpeername(fd, (struct sockaddr *)&ss, &len) : zts_getsockname(fd, (struct sockaddr *)&ss, &len)) < 0)
+		return undefinedValue(env);
+	return makeAddr(env, &ss);
+}
+
+static napi_value nodeSockName(napi_env env, napi_callback_info info)
+{
+	return sockName(env, info, false);
+}
+
+static napi_value nodePeerName(napi_env env, napi_callback_info info)
+{
+	return sockName(env, info, true);
+}
+
+/****************************************************************************/
+/* Module                                                                   */
+/****************************************************************************/
+
+static napi_value Init(napi_env env, napi_value exports)
+{
+	napi_property_descriptor props[] = {
+		{ "start", NULL, nodeStart, NULL, NULL, NULL, napi_default, NULL },
+		{ "stop", NULL, nodeStop, NULL, NULL, NULL, napi_default, NULL },
+		{ "join", NULL, nodeJoin, NULL, NULL, NULL, napi_default, NULL },
+		{ "hasAddress", NULL, nodeHasAddress, NULL, NULL, NULL, napi_default, NULL },
+		{ "initPoller", NULL, nodeInitPoller, NULL, NULL, NULL, napi_default, NULL },
+		{ "setRef", NULL, nodeSetRef, NULL, NULL, NULL, napi_default, NULL },
+		{ "watch", NULL, nodeWatch, NULL, NULL, NULL, napi_default, NULL },
+		{ "connect", NULL, nodeConnect, NULL, NULL, NULL, napi_default, NULL },
+		{ "listen", NULL, nodeListen, NULL, NULL, NULL, napi_default, NULL },
+		{ "accept", NULL, nodeAccept, NULL, NULL, NULL, napi_default, NULL },
+		{ "read", NULL, nodeRead, NULL, NULL, NULL, napi_default, NULL },
+		{ "writev", NULL, nodeWritev, NULL, NULL, NULL, napi_default, NULL },
+		{ "shutdown", NULL, nodeShutdown, NULL, NULL, NULL, napi_default, NULL },
+		{ "close", NULL, nodeClose, NULL, NULL, NULL, napi_default, NULL },
+		{ "soError", NULL, nodeSoError, NULL, NULL, NULL, napi_default, NULL },
+		{ "setNoDelay", NULL, nodeSetNoDelay, NULL, NULL, NULL, napi_default, NULL },
+		{ "sockname", NULL, nodeSockName, NULL, NULL, NULL, napi_default, NULL },
+		{ "peername", NULL, nodePeerName, NULL, NULL, NULL, napi_default, NULL },
+	};
+	CHECK(napi_define_properties(env, exports, sizeof(props) / sizeof(props[0]), props));
+	napi_value v;
+	const struct { const char *name; uint32_t value; } consts[] = {
+		{ "EPOLLIN", ZTS_EPOLLIN }, { "EPOLLOUT", ZTS_EPOLLOUT }, { "EPOLLERR", ZTS_EPOLLERR },
+		{ "EPOLLHUP", ZTS_EPOLLHUP }, { "EPOLLRDHUP", ZTS_EPOLLRDHUP }, { "LISTEN_BACKLOG_MAX", ZT_LISTEN_BACKLOG_MAX },
+	};
+	for(size_t i=0; i<sizeof(consts) / sizeof(consts[0]); i++) {
+		napi_create_uint32(env, consts[i].value, &v);
+		napi_set_named_property(env, exports, consts[i].name, v);
+	}
+	return exports;
+}
+
+NAPI_MODULE(NODE_GYP_MODULE_NAME, Init)
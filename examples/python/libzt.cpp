@@ -0,0 +1,530 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+// CPython extension over libzt.h (see README.md). Sockets are plain int descriptors as in C,
+// errors raise OSError (BlockingIOError etc. by errno). Buffers go through the buffer
+// protocol, so send()/recv_into() work on bytes, bytearray, memoryview or numpy arrays in
+// place, and the GIL is released whenever libzt may block
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include "libzt.h"
+
+static PyObject *errnoError()
+{
+	return PyErr_SetFromErrno(PyExc_OSError);
+}
+
+// (host, port) for AF_INET, (host, port[, flowinfo, scope_id]) for AF_INET6
+static bool parseAddr(PyObject *obj, struct sockaddr_storage *ss, socklen_t *len)
+{
+	const char *host;
+	int port;
+	unsigned int flowinfo = 0, scope = 0;
+	if(!PyArg_ParseTuple(obj, "si|II:address", &host, &port, &flowinfo, &scope))
+		return false;
+	memset(ss, 0, sizeof(*ss));
+	struct sockaddr_in *in = (struct sockaddr_in *)ss;
+	struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)ss;
+	if(inet_pton(AF_INET, host, &in->sin_addr) == 1) {
+		in->sin_family = AF_INET;
+		in->sin_port = htons(port);
+		*len = sizeof(*in);
+		return true;
+	}
+	if(inet_pton(AF_INET6, host, &in6->sin6_addr) == 1) {
+		in6->sin6_family = AF_INET6;
+		in6->sin6_port = htons(port);
+		in6->sin6_flowinfo = htonl(flowinfo);
+		in6->sin6_scope_id = scope;
+		*len = sizeof(*in6);
+		return true;
+	}
+	PyErr_Format(PyExc_ValueError, "not an IP address: %s", host);
+	return false;
+}
+
+static PyObject *makeAddr(const struct sockaddr_storage *ss)
+{
+	char host[INET6_ADDRSTRLEN];
+	if(ss->ss_family == AF_INET) {
+		const struct sockaddr_in *in = (const struct sockaddr_in *)ss;
+		inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host));
+		return Py_BuildValue("(si)", host, ntohs(in->sin_port));
+	}
+	if(ss->ss_family == AF_INET6) {
+		const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)ss;
+		inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+		return Py_BuildValue("(siII)", host, ntohs(in6->sin6_port), ntohl(in6->sin6_flowinfo), in6->sin6_scope_id);
+	}
+	Py_RETURN_NONE;
+}
+
+/****************************************************************************/
+/* Service                                                                  */
+/****************************************************************************/
+
+static PyObject *py_start(PyObject *self, PyObject *args)
+{
+	const char *path;
+	if(!PyArg_ParseTuple(args, "s:start", &path))
+		return NULL;
+	zts_start(path);
+	Py_RETURN_NONE;
+}
+
+static PyObject *py_stop(PyObject *self, PyObject *args)
+{
+	Py_BEGIN_ALLOW_THREADS
+	zts_stop();
+	Py_END_ALLOW_THREADS
+	Py_RETURN_NONE;
+}
+
+static PyObject *py_running(PyObject *self, PyObject *args)
+{
+	return PyBool_FromLong(zts_running());
+}
+
+static PyObject *py_join(PyObject *self, PyObject *args)
+{
+	const char *nwid;
+	if(!PyArg_ParseTuple(args, "s:join", &nwid))
+		return NULL;
+	zts_join(nwid);
+	Py_RETURN_NONE;
+}
+
+static PyObject *py_leave(PyObject *self, PyObject *args)
+{
+	const char *nwid;
+	if(!PyArg_ParseTuple(args, "s:leave", &nwid))
+		return NULL;
+	zts_leave(nwid);
+	Py_RETURN_NONE;
+}
+
+static PyObject *py_device_id(PyObject *self, PyObject *args)
+{
+	char id[ZT_ID_LEN+1];
+	memset(id, 0, sizeof(id));
+	if(zts_get_device_id(id) < 0)
+		Py_RETURN_NONE;
+	return PyUnicode_FromStringAndSize(id, strnlen(id, ZT_ID_LEN));
+}
+
+// "" until the network has given this device an address
+static PyObject *py_address(PyObject *self, PyObject *args)
+{
+	const char *nwid;
+	int family = AF_INET;
+	if(!PyArg_ParseTuple(args, "s|i:address", &nwid, &family))
+		return NULL;
+	char addr[ZT_MAX_IPADDR_LEN];
+	memset(addr, 0, sizeof(addr));
+	if(family == AF_INET6)
+		zts_get_ipv6_address(nwid, addr, sizeof(addr));
+	else
+		zts_get_ipv4_address(nwid, addr, sizeof(addr));
+	return PyUnicode_FromString(addr);
+}
+
+/****************************************************************************/
+/* Sockets                                                                  */
+/****************************************************************************/
+
+static PyObject *py_socket(PyObject *self, PyObject *args)
+{
+	int family = AF_INET, type = SOCK_STREAM, proto = 0;
+	if(!PyArg_ParseTuple(args, "|iii:socket", &family, &type, &proto))
+		return NULL;
+	int fd = zts_socket(family, type, proto);
+	if(fd < 0)
+		return errnoError();
+	return PyLong_FromLong(fd);
+}
+
+static PyObject *py_bind(PyObject *self, PyObject *args)
+{
+	int fd;
+	PyObject *addr;
+	struct sockaddr_storage ss;
+	socklen_t len;
+	if(!PyArg_ParseTuple(args, "iO:bind", &fd, &addr) || !parseAddr(addr, &ss, &len))
+		return NULL;
+	if(zts_bind(fd, (struct sockaddr *)&ss, len) < 0)
+		return errnoError();
+	Py_RETURN_NONE;
+}
+
+static PyObject *py_connect(PyObject *self, PyObject *args)
+{
+	int fd, err;
+	PyObject *addr;
+	struct sockaddr_storage ss;
+	socklen_t len;
+	if(!PyArg_ParseTuple(args, "iO:connect", &fd, &addr) || !parseAddr(addr, &ss, &len))
+		return NULL;
+	Py_BEGIN_ALLOW_THREADS
+	err = zts_connect(fd, (struct sockaddr *)&ss, len);
+	Py_END_ALLOW_THREADS
+	if(err < 0)
+		return errnoError();
+	Py_RETURN_NONE;
+}
+
+static PyObject *py_listen(PyObject *self, PyObject *args)
+{
+	int fd, backlog = 128;
+	if(!PyArg_ParseTuple(args, "i|i:listen", &fd, &backlog))
+		return NULL;
+	if(zts_listen(fd, backlog) < 0)
+		return errnoError();
+	Py_RETURN_NONE;
+}
+
+static PyObject *py_accept(PyObject *self, PyObject *args)
+{
+	int fd, nfd;
+	if(!PyArg_ParseTuple(args, "i:accept", &fd))
+		return NULL;
+	struct sockaddr_storage ss;
+	memset(&ss, 0, sizeof(ss));
+	socklen_t len = sizeof(ss);
+	Py_BEGIN_ALLOW_THREADS
+	nfd = zts_accept(fd, (struct sockaddr *)&ss, &len);
+	Py_END_ALLOW_THREADS
+	if(nfd < 0)
+		return errnoError();
+	PyObject *addr = makeAddr(&ss);
+	if(!addr)
+		return NULL;
+	return Py_BuildValue("(iN)", nfd, addr);
+}
+
+static PyObject *py_send(PyObject *self, PyObject *args)
+{
+	int fd, flags = 0;
+	Py_buffer buf;
+	ssize_t n;
+	if(!PyArg_ParseTuple(args, "iy*|i:send", &fd, &buf, &flags))
+		return NULL;
+	Py_BEGIN_ALLOW_THREADS
+	n = zts_send(fd, buf.buf, buf.len, flags);
+	Py_END_ALLOW_THREADS
+	PyBuffer_Release(&buf);
+	if(n < 0)
+		return errnoError();
+	return PyLong_FromSsize_t(n);
+}
+
+static PyObject *py_sendto(PyObject *self, PyObject *args)
+{
+	int fd, flags = 0;
+	Py_buffer buf;
+	PyObject *addr;
+	struct sockaddr_storage ss;
+	socklen_t len;
+	ssize_t n;
+	if(!PyArg_ParseTuple(args, "iy*O|i:sendto", &fd, &buf, &addr, &flags))
+		return NULL;
+	if(!parseAddr(addr, &ss, &len)) {
+		PyBuffer_Release(&buf);
+		return NULL;
+	}
+	Py_BEGIN_ALLOW_THREADS
+	n = zts_sendto(fd, buf.buf, buf.len, flags, (struct sockaddr *)&ss, len);
+	Py_END_ALLOW_THREADS
+	PyBuffer_Release(&buf);
+	if(n < 0)
+		return errnoError();
+	return PyLong_FromSsize_t(n);
+}
+
+// nbytes 0 (or more than fits) fills the whole buffer
+static bool recvBuffer(Py_buffer *buf, Py_ssize_t nbytes, size_t *len)
+{
+	if(nbytes < 0) {
+		PyBuffer_Release(buf);
+		PyErr_SetString(PyExc_ValueError, "negative buffersize");
+		return false;
+	}
+	*len = (nbytes && nbytes < buf->len) ? nbytes : buf->len;
+	return true;
+}
+
+static PyObject *py_recv_into(PyObject *self, PyObject *args)
+{
+	int fd, flags = 0;
+	Py_buffer buf;
+	Py_ssize_t nbytes = 0;
+	size_t len;
+	ssize_t n;
+	if(!PyArg_ParseTuple(args, "iw*|ni:recv_into", &fd, &buf, &nbytes, &flags) || !recvBuffer(&buf, nbytes, &len))
+		return NULL;
+	Py_BEGIN_ALLOW_THREADS
+	n = zts_recv(fd, buf.buf, len, flags);
+	Py_END_ALLOW_THREADS
+	PyBuffer_Release(&buf);
+	if(n < 0)
+		return errnoError();
+	return PyLong_FromSsize_t(n);
+}
+
+static PyObject *py_recvfrom_into(PyObject *self, PyObject *args)
+{
+	int fd, flags = 0;
+	Py_buffer buf;
+	Py_ssize_t nbytes = 0;
+	size_t len;
+	ssize_t n;
+	if(!PyArg_ParseTuple(args, "iw*|ni:recvfrom_into", &fd, &buf, &nbytes, &flags) || !recvBuffer(&buf, nbytes, &len))
+		return NULL;
+	struct sockaddr_storage ss;
+	memset(&ss, 0, sizeof(ss));
+	socklen_t alen = sizeof(ss);
+	Py_BEGIN_ALLOW_THREADS
+	n = zts_recvfrom(fd, buf.buf, len, flags, (struct sockaddr *)&ss, &alen);
+	Py_END_ALLOW_THREADS
+	PyBuffer_Release(&buf);
+	if(n < 0)
+		return errnoError();
+	PyObject *addr = makeAddr(&ss);
+	if(!addr)
+		return NULL;
+	return Py_BuildValue("(nN)", (Py_ssize_t)n, addr);
+}
+
+// Received straight into the bytes object returned
+static PyObject *py_recv(PyObject *self, PyObject *args)
+{
+	int fd, flags = 0;
+	Py_ssize_t len;
+	ssize_t n;
+	if(!PyArg_ParseTuple(args, "in|i:recv", &fd, &len, &flags))
+		return NULL;
+	if(len < 0) {
+		PyErr_SetString(PyExc_ValueError, "negative buffersize");
+		return NULL;
+	}
+	PyObject *bytes = PyBytes_FromStringAndSize(NULL, len);
+	if(!bytes)
+		return NULL;
+	char *p = PyBytes_AS_STRING(bytes);
+	Py_BEGIN_ALLOW_THREADS
+	n = zts_recv(fd, p, len, flags);
+	Py_END_ALLOW_THREADS
+	if(n < 0) {
+		Py_DECREF(bytes);
+		return errnoError();
+	}
+	if(n != len && _PyBytes_Resize(&bytes, n) < 0)
+		return NULL;
+	return bytes;
+}
+
+static PyObject *py_shutdown(PyObject *self, PyObject *args)
+{
+	int fd, how;
+	if(!PyArg_ParseTuple(args, "ii:shutdown", &fd, &how))
+		return NULL;
+	if(zts_shutdown(fd, how) < 0)
+		return errnoError();
+	Py_RETURN_NONE;
+}
+
+static PyObject *py_close(PyObject *self, PyObject *args)
+{
+	int fd, err;
+	if(!PyArg_ParseTuple(args, "i:close", &fd))
+		return NULL;
+	Py_BEGIN_ALLOW_THREADS
+	err = zts_close(fd);
+	Py_END_ALLOW_THREADS
+	if(err < 0)
+		return errnoError();
+	Py_RETURN_NONE;
+}
+
+static PyObject *py_setblocking(PyObject *self, PyObject *args)
+{
+	int fd, blocking;
+	if(!PyArg_ParseTuple(args, "ip:setblocking", &fd, &blocking))
+		return NULL;
+	int flags = zts_fcntl(fd, F_GETFL, 0);
+	if(flags < 0 || zts_fcntl(fd, F_SETFL, blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK)) < 0)
+		return errnoError();
+	Py_RETURN_NONE;
+}
+
+// Integer options only, which covers SO_ERROR, TCP_NODELAY, SO_SNDBUF and the like
+static PyObject *py_setsockopt(PyObject *self, PyObject *args)
+{
+	int fd, level, opt, value;
+	if(!PyArg_ParseTuple(args, "iiii:setsockopt", &fd, &level, &opt, &value))
+		return NULL;
+	if(zts_setsockopt(fd, level, opt, &value, sizeof(value)) < 0)
+		return errnoError();
+	Py_RETURN_NONE;
+}
+
+static PyObject *py_getsockopt(PyObject *self, PyObject *args)
+{
+	int fd, level, opt, value = 0;
+	if(!PyArg_ParseTuple(args, "iii:getsockopt", &fd, &level, &opt))
+		return NULL;
+	socklen_t len = sizeof(value);
+	if(zts_getsockopt(fd, level, opt, &value, &len) < 0)
+		return errnoError();
+	return PyLong_FromLong(value);
+}
+
+/****************************************************************************/
+/* Readiness (see ztasyncio.py)                                             */
+/****************************************************************************/
+
+static PyObject *py_epoll_create(PyObject *self, PyObject *args)
+{
+	int epfd = zts_epoll_create(0);
+	if(epfd < 0)
+		return errnoError();
+	return PyLong_FromLong(epfd);
+}
+
+static PyObject *py_epoll_ctl(PyObject *self, PyObject *args)
+{
+	int epfd, op, fd;
+	unsigned int events = 0;
+	if(!PyArg_ParseTuple(args, "iii|I:epoll_ctl", &epfd, &op, &fd, &events))
+		return NULL;
+	struct zts_epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = fd;
+	if(zts_epoll_ctl(epfd, op, fd, &ev) < 0)
+		return errnoError();
+	Py_RETURN_NONE;
+}
+
+// [(fd, events), ...], timeout in ms (-1 forever)
+static PyObject *py_epoll_wait(PyObject *self, PyObject *args)
+{
+	int epfd, maxevents = 64, timeout = -1, n;
+	if(!PyArg_ParseTuple(args, "i|ii:epoll_wait", &epfd, &maxevents, &timeout))
+		return NULL;
+	if(maxevents <= 0) {
+		PyErr_SetString(PyExc_ValueError, "maxevents must be positive");
+		return NULL;
+	}
+	struct zts_epoll_event *evs = (struct zts_epoll_event *)PyMem_Malloc(maxevents * sizeof(*evs));
+	if(!evs)
+		return PyErr_NoMemory();
+	Py_BEGIN_ALLOW_THREADS
+	n = zts_epoll_wait(epfd, evs, maxevents, timeout);
+	Py_END_ALLOW_THREADS
+	if(n < 0) {
+		PyMem_Free(evs);
+		return errnoError();
+	}
+	PyObject *list = PyList_New(n);
+	for(int i=0; list && i<n; i++) {
+		PyObject *t = Py_BuildValue("(iI)", evs[i].data.fd, evs[i].events);
+		if(!t) {
+			Py_CLEAR(list);
+			break;
+		}
+		PyList_SET_ITEM(list, i, t);
+	}
+	PyMem_Free(evs);
+	return list;
+}
+
+static PyObject *py_epoll_wakeup(PyObject *self, PyObject *args)
+{
+	int epfd;
+	if(!PyArg_ParseTuple(args, "i:epoll_wakeup", &epfd))
+		return NULL;
+	if(zts_epoll_wakeup(epfd) < 0)
+		return errnoError();
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef methods[] = {
+	{ "start", py_start, METH_VARARGS, "start(path): starts the service on path in the background" },
+	{ "stop", py_stop, METH_NOARGS, "stop()" },
+	{ "running", py_running, METH_NOARGS, "running() -> bool" },
+	{ "join", py_join, METH_VARARGS, "join(nwid)" },
+	{ "leave", py_leave, METH_VARARGS, "leave(nwid)" },
+	{ "device_id", py_device_id, METH_NOARGS, "device_id() -> str or None" },
+	{ "address", py_address, METH_VARARGS, "address(nwid, family=AF_INET) -> str, '' until assigned" },
+	{ "socket", py_socket, METH_VARARGS, "socket(family=AF_INET, type=SOCK_STREAM, proto=0) -> fd" },
+	{ "bind", py_bind, METH_VARARGS, "bind(fd, (host, port))" },
+	{ "connect", py_connect, METH_VARARGS, "connect(fd, (host, port))" },
+	{ "listen", py_listen, METH_VARARGS, "listen(fd, backlog=128)" },
+	{ "accept", py_accept, METH_VARARGS, "accept(fd) -> (fd, address)" },
+	{ "send", py_send, METH_VARARGS, "send(fd, buffer, flags=0) -> int" },
+	{ "sendto", py_sendto, METH_VARARGS, "sendto(fd, buffer, (host, port), flags=0) -> int" },
+	{ "recv", py_recv, METH_VARARGS, "recv(fd, bufsize, flags=0) -> bytes" },
+	{ "recv_into", py_recv_into, METH_VARARGS, "recv_into(fd, buffer, nbytes=0, flags=0) -> int" },
+	{ "recvfrom_into", py_recvfrom_into, METH_VARARGS, "recvfrom_into(fd, buffer, nbytes=0, flags=0) -> (int, address)" },
+	{ "shutdown", py_shutdown, METH_VARARGS, "shutdown(fd, how)" },
+	{ "close", py_close, METH_VARARGS, "close(fd)" },
+	{ "setblocking", py_setblocking, METH_VARARGS, "setblocking(fd, flag)" },
+	{ "setsockopt", py_setsockopt, METH_VARARGS, "setsockopt(fd, level, option, int)" },
+	{ "getsockopt", py_getsockopt, METH_VARARGS, "getsockopt(fd, level, option) -> int" },
+	{ "epoll_create", py_epoll_create, METH_NOARGS, "epoll_create() -> epfd, readable while events are pending" },
+	{ "epoll_ctl", py_epoll_ctl, METH_VARARGS, "epoll_ctl(epfd, op, fd, events=0)" },
+	{ "epoll_wait", py_epoll_wait, METH_VARARGS, "epoll_wait(epfd, maxevents=64, timeout=-1) -> [(fd, events)]" },
+	{ "epoll_wakeup", py_epoll_wakeup, METH_VARARGS, "epoll_wakeup(epfd)" },
+	{ NULL, NULL, 0, NULL }
+};
+
+static struct PyModuleDef module = {
+	PyModuleDef_HEAD_INIT, "libzt", "ZeroTier sockets (libzt)", -1, methods
+};
+
+PyMODINIT_FUNC PyInit_libzt(void)
+{
+	PyObject *m = PyModule_Create(&module);
+	if(!m)
+		return NULL;
+	PyModule_AddIntConstant(m, "EPOLLIN", ZTS_EPOLLIN);
+	PyModule_AddIntConstant(m, "EPOLLOUT", ZTS_EPOLLOUT);
+	PyModule_AddIntConstant(m, "EPOLLERR", ZTS_EPOLLERR);
+	PyModule_AddIntConstant(m, "EPOLLHUP", ZTS_EPOLLHUP);
+	PyModule_AddIntConstant(m, "EPOLLRDHUP", ZTS_EPOLLRDHUP);
+	PyModule_AddIntConstant(m, "EPOLLONESHOT", ZTS_EPOLLONESHOT);
+	PyModule_AddIntConstant(m, "EPOLL_CTL_ADD", ZTS_EPOLL_CTL_ADD);
+	PyModule_AddIntConstant(m, "EPOLL_CTL_DEL", ZTS_EPOLL_CTL_DEL);
+	PyModule_AddIntConstant(m, "EPOLL_CTL_MOD", ZTS_EPOLL_CTL_MOD);
+	return m;
+}
@@ -0,0 +1,24 @@
+# Builds the libzt extension against the library built by the top-level Makefile:
+#   python3 setup.py build_ext --inplace  (LIBZT_BUILD overrides ../../build/linux)
+import os
+
+from setuptools import Extension, setup
+
+build = os.environ.get("LIBZT_BUILD", "../../build/linux")
+
+setup(
+    name="libzt",
+    version="1.1.4",
+    py_modules=["ztasyncio"],
+    ext_modules=[
+        Extension(
+            "libzt",
+            sources=["libzt.cpp"],
+            include_dirs=["../../include"],
+            library_dirs=[build],
+            runtime_library_dirs=[os.path.abspath(build)],
+            libraries=["zt"],
+            extra_compile_args=["-std=c++11"],
+        )
+    ],
+)
@@ -0,0 +1,186 @@
+# ZeroTier SDK - Network Virtualization Everywhere
+# Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+"""asyncio over libzt sockets.
+
+Readiness comes from the stack itself through one zts_epoll instance per event loop, whose
+descriptor (readable while events are pending) the loop watches with add_reader(), so no
+thread waits on libzt. Sockets are non-blocking, each operation is tried first and awaits
+readiness only on BlockingIOError.
+"""
+
+import asyncio
+import errno
+import socket
+
+import libzt
+
+_reactors = {}
+
+
+class _Reactor:
+    def __init__(self, loop):
+        self._loop = loop
+        self._epfd = libzt.epoll_create()
+        self._waiters = {}  # fd -> {event: future}
+        loop.add_reader(self._epfd, self._ready)
+
+    def _ready(self):
+        while True:
+            events = libzt.epoll_wait(self._epfd, 64, 0)
+            for fd, ev in events:
+                waiting = self._waiters.get(fd, {})
+                for want in list(waiting):
+                    if ev & (want | libzt.EPOLLERR | libzt.EPOLLHUP):
+                        fut = waiting.pop(want)
+                        if not fut.done():
+                            fut.set_result(ev)
+                self._rearm(fd)
+            if len(events) < 64:
+                return
+
+    # One-shot interest in whatever is still awaited on fd
+    def _rearm(self, fd):
+        waiting = self._waiters.get(fd)
+        if not waiting:
+            return
+        mask = libzt.EPOLLONESHOT
+        for want in waiting:
+            mask |= want
+        libzt.epoll_ctl(self._epfd, libzt.EPOLL_CTL_MOD, fd, mask)
+
+    async def wait(self, fd, want):
+        waiting = self._waiters.get(fd)
+        if waiting is None:
+            waiting = self._waiters[fd] = {}
+            libzt.epoll_ctl(self._epfd, libzt.EPOLL_CTL_ADD, fd, want | libzt.EPOLLONESHOT)
+        if want in waiting:
+            raise RuntimeError("already waiting on this socket")
+        fut = waiting[want] = self._loop.create_future()
+        self._rearm(fd)
+        try:
+            return await fut
+        finally:
+            if waiting.get(want) is fut:
+                del waiting[want]
+
+    def forget(self, fd):
+        waiting = self._waiters.pop(fd, None)
+        if waiting is None:
+            return
+        for fut in waiting.values():
+            if not fut.done():
+                fut.set_exception(OSError(errno.EBADF, "socket closed"))
+        try:
+            libzt.epoll_ctl(self._epfd, libzt.EPOLL_CTL_DEL, fd)
+        except OSError:
+            pass
+
+
+def _reactor():
+    loop = asyncio.get_running_loop()
+    r = _reactors.get(loop)
+    if r is None:
+        r = _reactors[loop] = _Reactor(loop)
+    return r
+
+
+class Socket:
+    """A non-blocking libzt socket whose operations are coroutines."""
+
+    def __init__(self, family=socket.AF_INET, type=socket.SOCK_STREAM, fd=None):
+        self.fd = libzt.socket(family, type) if fd is None else fd
+        libzt.setblocking(self.fd, False)
+
+    async def connect(self, address):
+        try:
+            libzt.connect(self.fd, address)
+            return
+        except BlockingIOError:
+            pass
+        await _reactor().wait(self.fd, libzt.EPOLLOUT)
+        err = libzt.getsockopt(self.fd, socket.SOL_SOCKET, socket.SO_ERROR)
+        if err:
+            raise OSError(err, "connect failed")
+
+    def bind(self, address):
+        libzt.bind(self.fd, address)
+
+    def listen(self, backlog=128):
+        libzt.listen(self.fd, backlog)
+
+    async def accept(self):
+        while True:
+            try:
+                fd, address = libzt.accept(self.fd)
+                return Socket(fd=fd), address
+            except BlockingIOError:
+                await _reactor().wait(self.fd, libzt.EPOLLIN)
+
+    async def recv_into(self, buffer, nbytes=0):
+        while True:
+            try:
+                return libzt.recv_into(self.fd, buffer, nbytes)
+            except BlockingIOError:
+                await _reactor().wait(self.fd, libzt.EPOLLIN)
+
+    async def recv(self, bufsize):
+        while True:
+            try:
+                return libzt.recv(self.fd, bufsize)
+            except BlockingIOError:
+                await _reactor().wait(self.fd, libzt.EPOLLIN)
+
+    async def send(self, data):
+        while True:
+            try:
+                return libzt.send(self.fd, data)
+            except BlockingIOError:
+                await _reactor().wait(self.fd, libzt.EPOLLOUT)
+
+    async def sendall(self, data):
+        view = memoryview(data).cast("B")
+        while view:
+            view = view[await self.send(view):]
+
+    def close(self):
+        if self.fd < 0:
+            return
+        if _reactors:
+            try:
+                _reactor().forget(self.fd)
+            except RuntimeError:
+                pass
+        libzt.close(self.fd)
+        self.fd = -1
+
+    async def __aenter__(self):
+        return self
+
+    async def __aexit__(self, *exc):
+        self.close()
+
+
+async def open_connection(host, port):
+    """A connected Socket to host:port on a joined network."""
+    family = socket.AF_INET6 if ":" in host else socket.AF_INET
+    s = Socket(family)
+    try:
+        await s.connect((host, port))
+    except BaseException:
+        s.close()
+        raise
+    return s
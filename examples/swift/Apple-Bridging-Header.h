@@ -32,6 +32,7 @@
 #define Example_OSX_IOS_Bridging_Header_h
 
 #include <sys/socket.h>
+#include "libzt.h" // struct zts_sqe, struct zts_cqe, ZTS_OP_*
 
 // ZT INTERCEPT/RPC CONTROLS
 int zt_init_rpc(const char *path, const char *nwid);
@@ -71,6 +72,11 @@ int zt_recvfrom(RECVFROM_SIG);
 int zt_fcntl(FCNTL_SIG);
 int zt_sendto(SENDTO_SIG);
 
+// COMPLETION QUEUES
+int zt_cq_create(unsigned int entries);
+int zt_submit(int cq, const struct zts_sqe *sqes, unsigned int n);
+int zt_complete(int cq, struct zts_cqe *cqes, unsigned int max, int timeout);
+
 #endif /* Example_OSX_IOS_Bridging_Header_h */
 
 
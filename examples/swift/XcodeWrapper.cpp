@@ -134,4 +134,16 @@ extern "C" ssize_t zt_recvfrom(RECVFROM_SIG) {
 }
 extern "C" ssize_t zt_sendto(SENDTO_SIG) {
     return zts_sendto(fd, buf, len, flags, addr, addrlen);
-}
\ No newline at end of file
+}
+
+// COMPLETION QUEUES
+// Used by ztasync.swift, see zts_cq_create()
+extern "C" int zt_cq_create(unsigned int entries) {
+    return zts_cq_create(entries);
+}
+extern "C" int zt_submit(int cq, const struct zts_sqe *sqes, unsigned int n) {
+    return zts_submit(cq, sqes, n);
+}
+extern "C" int zt_complete(int cq, struct zts_cqe *cqes, unsigned int max, int timeout) {
+    return zts_complete(cq, cqes, max, timeout);
+}
@@ -0,0 +1,325 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+import Foundation
+
+// async/await socket I/O on a libzt completion queue (see zt_cq_create() in XcodeWrapper.cpp),
+// one reaper thread serves every socket instead of a blocked thread per socket. Requires Swift 5.5
+
+public struct ZTError: Error {
+    public let code: Int32
+}
+
+// Owns malloc'd memory a read lands in, handed to Data without copying once the read completes
+private final class ZTReadBuffer {
+    let ptr: UnsafeMutableRawPointer
+    private var owned = true
+
+    init(_ len: Int) {
+        ptr = malloc(max(len, 1))!
+    }
+
+    func take(_ count: Int) -> Data {
+        if count == 0 {
+            return Data()
+        }
+        owned = false
+        return Data(bytesNoCopy: ptr, count: count, deallocator: .free)
+    }
+
+    deinit {
+        if owned {
+            free(ptr)
+        }
+    }
+}
+
+public final class ZTCompletionQueue
+{
+    // Operations submitted together, resumed once the last of them completes
+    private final class Batch {
+        var results: [Int]
+        var remaining: Int
+        let cont: CheckedContinuation<[Int], Error>
+        let buffers: [AnyObject?] // kept alive until every operation has completed
+
+        init(_ count: Int, _ cont: CheckedContinuation<[Int], Error>, _ buffers: [AnyObject?]) {
+            results = [Int](repeating: 0, count: count)
+            remaining = count
+            self.cont = cont
+            self.buffers = buffers
+        }
+    }
+
+    private static let reapBatch = 64
+
+    private let cq: Int32
+    private let lock = NSLock()
+    private var pending = [UInt64: (Batch, Int)]()
+    private var nextId: UInt64 = 0
+    private var closed = false
+
+    public init(entries: UInt32 = 256) throws {
+        cq = zt_cq_create(entries)
+        if cq < 0 {
+            throw ZTError(code: errno)
+        }
+        let reaper = Thread { [self] in self.reap() }
+        reaper.name = "zt-cq"
+        reaper.start()
+    }
+
+    // Stops the reaper and fails anything outstanding. Must be called, the reaper keeps the queue alive
+    public func close() {
+        lock.lock()
+        if closed {
+            lock.unlock()
+            return
+        }
+        closed = true
+        lock.unlock()
+        _ = zt_close(cq) // wakes the reaper
+    }
+
+    // Submits sqes with a single zt_submit(), results are per operation: see ZTS_OP_*, or -errno
+    func submit(_ sqes: [zts_sqe], retaining buffers: [AnyObject?]) async throws -> [Int] {
+        if sqes.isEmpty {
+            return []
+        }
+        return try await withCheckedThrowingContinuation { cont in
+            let batch = Batch(sqes.count, cont, buffers)
+            var sqes = sqes
+            lock.lock()
+            if closed {
+                lock.unlock()
+                cont.resume(throwing: ZTError(code: EBADF))
+                return
+            }
+            for i in 0..<sqes.count {
+                nextId += 1
+                sqes[i].user_data = nextId
+                pending[nextId] = (batch, i)
+            }
+            lock.unlock()
+            let n = sqes.withUnsafeBufferPointer { zt_submit(cq, $0.baseAddress, UInt32($0.count)) }
+            if Int(n) < sqes.count {
+                // Whatever wasn't accepted fails here, the rest completes through the queue
+                let code = Int(n < 0 ? errno : EAGAIN)
+                var done = false
+                lock.lock()
+                for i in max(Int(n), 0)..<sqes.count {
+                    pending.removeValue(forKey: sqes[i].user_data)
+                    done = self.record(batch, i, -code)
+                }
+                lock.unlock()
+                if done {
+                    batch.cont.resume(returning: batch.results)
+                }
+            }
+        }
+    }
+
+    // Call with lock held, returns whether that was the last outstanding operation of batch
+    private func record(_ batch: Batch, _ index: Int, _ res: Int) -> Bool {
+        batch.results[index] = res
+        batch.remaining -= 1
+        return batch.remaining == 0
+    }
+
+    private func reap() {
+        var cqes = [zts_cqe](repeating: zts_cqe(), count: ZTCompletionQueue.reapBatch)
+        while true {
+            let n = cqes.withUnsafeMutableBufferPointer {
+                zt_complete(cq, $0.baseAddress, UInt32($0.count), -1)
+            }
+            if n < 0 {
+                if errno == EINTR {
+                    continue
+                }
+                break // closed
+            }
+            var finished = [Batch]()
+            lock.lock()
+            for i in 0..<Int(n) {
+                if let (batch, index) = pending.removeValue(forKey: cqes[i].user_data),
+                    record(batch, index, Int(cqes[i].res)) {
+                    finished.append(batch)
+                }
+            }
+            lock.unlock()
+            for batch in finished {
+                batch.cont.resume(returning: batch.results)
+            }
+        }
+        // Closed, whatever the queue still held is cancelled along with it
+        lock.lock()
+        var batches = [ObjectIdentifier: Batch]()
+        for (batch, _) in pending.values {
+            batches[ObjectIdentifier(batch)] = batch
+        }
+        pending.removeAll()
+        closed = true
+        lock.unlock()
+        for batch in batches.values {
+            batch.cont.resume(throwing: ZTError(code: ECANCELED))
+        }
+    }
+
+    // Reads from several sockets (or several times from one, in order) with one submission and
+    // a single wakeup per completion batch. Data wraps the buffer each read landed in, nothing is copied
+    public func read(_ requests: [(fd: Int32, maxLength: Int)]) async throws -> [Result<Data, ZTError>] {
+        let buffers = requests.map { ZTReadBuffer($0.maxLength) }
+        var sqes = [zts_sqe]()
+        sqes.reserveCapacity(requests.count)
+        for (i, r) in requests.enumerated() {
+            var sqe = zts_sqe()
+            sqe.op = ZTS_OP_READ
+            sqe.fd = r.fd
+            sqe.buf = buffers[i].ptr
+            sqe.len = r.maxLength
+            sqes.append(sqe)
+        }
+        let results = try await submit(sqes, retaining: buffers)
+        return results.enumerated().map { (i, res) in
+            res < 0 ? .failure(ZTError(code: Int32(-res))) : .success(buffers[i].take(res))
+        }
+    }
+
+    // Writes each buffer with one submission, results are the bytes sent, which may be short
+    public func write(_ requests: [(fd: Int32, data: Data)]) async throws -> [Result<Int, ZTError>] {
+        let buffers = requests.map { $0.data as NSData } // bytes stay put while the NSData lives
+        var sqes = [zts_sqe]()
+        sqes.reserveCapacity(requests.count)
+        for (i, r) in requests.enumerated() {
+            var sqe = zts_sqe()
+            sqe.op = ZTS_OP_WRITE
+            sqe.fd = r.fd
+            sqe.buf = UnsafeMutableRawPointer(mutating: buffers[i].bytes)
+            sqe.len = buffers[i].length
+            sqes.append(sqe)
+        }
+        let results = try await submit(sqes, retaining: buffers)
+        return results.map { $0 < 0 ? .failure(ZTError(code: Int32(-$0))) : .success($0) }
+    }
+
+    func single(_ sqe: zts_sqe, retaining buffer: AnyObject? = nil) async throws -> Int {
+        let res = try await submit([sqe], retaining: [buffer])[0]
+        if res < 0 {
+            throw ZTError(code: Int32(-res))
+        }
+        return res
+    }
+}
+
+// A TCP socket whose calls suspend the calling task rather than block a thread
+public final class ZTSocket
+{
+    public let fd: Int32
+    private let cq: ZTCompletionQueue
+
+    public init(_ cq: ZTCompletionQueue, family: Int32 = AF_INET) throws {
+        fd = zt_socket(family, SOCK_STREAM, 0)
+        if fd < 0 {
+            throw ZTError(code: errno)
+        }
+        self.cq = cq
+    }
+
+    init(_ cq: ZTCompletionQueue, fd: Int32) {
+        self.cq = cq
+        self.fd = fd
+    }
+
+    public func connect(host: String, port: UInt16) async throws {
+        // Copied during zt_submit(), it only has to outlive the submission
+        let sin = UnsafeMutablePointer<sockaddr_in>.allocate(capacity: 1)
+        defer { sin.deallocate() }
+        sin.initialize(to: sockaddr_in())
+        sin.pointee.sin_len = UInt8(MemoryLayout<sockaddr_in>.size)
+        sin.pointee.sin_family = sa_family_t(AF_INET)
+        sin.pointee.sin_port = port.bigEndian
+        if inet_pton(AF_INET, host, &sin.pointee.sin_addr) != 1 {
+            throw ZTError(code: EINVAL)
+        }
+        var sqe = zts_sqe()
+        sqe.op = ZTS_OP_CONNECT
+        sqe.fd = fd
+        sqe.addr = UnsafeRawPointer(sin).assumingMemoryBound(to: sockaddr.self)
+        sqe.addrlen = socklen_t(MemoryLayout<sockaddr_in>.size)
+        _ = try await cq.single(sqe)
+    }
+
+    public func bind(port: UInt16) throws {
+        var sin = sockaddr_in()
+        sin.sin_len = UInt8(MemoryLayout<sockaddr_in>.size)
+        sin.sin_family = sa_family_t(AF_INET)
+        sin.sin_port = port.bigEndian
+        let err = withUnsafePointer(to: &sin) {
+            $0.withMemoryRebound(to: sockaddr.self, capacity: 1) {
+                zt_bind(fd, $0, socklen_t(MemoryLayout<sockaddr_in>.size))
+            }
+        }
+        if err < 0 {
+            throw ZTError(code: errno)
+        }
+    }
+
+    public func listen(backlog: Int32 = 128) throws {
+        if zt_listen(fd, backlog) < 0 {
+            throw ZTError(code: errno)
+        }
+    }
+
+    public func accept() async throws -> ZTSocket {
+        var sqe = zts_sqe()
+        sqe.op = ZTS_OP_ACCEPT
+        sqe.fd = fd
+        return ZTSocket(cq, fd: Int32(try await cq.single(sqe)))
+    }
+
+    // Whatever has arrived, up to maxLength bytes. Empty at end of stream
+    public func read(maxLength: Int = 65536) async throws -> Data {
+        switch try await cq.read([(fd: fd, maxLength: maxLength)])[0] {
+        case .success(let data): return data
+        case .failure(let err): throw err
+        }
+    }
+
+    // Sends all of data
+    public func write(_ data: Data) async throws {
+        var rest = data
+        while !rest.isEmpty {
+            switch try await cq.write([(fd: fd, data: rest)])[0] {
+            case .success(let n): rest = rest.dropFirst(n)
+            case .failure(let err): throw err
+            }
+        }
+    }
+
+    public func close() {
+        _ = zt_close(fd)
+    }
+}
@@ -158,6 +158,18 @@
   #error "If you want to use TCP, TCP_WND must fit in an u16_t, so, you have to reduce it in your lwipopts.h (or enable window scaling)"
 #endif
 #endif /* LWIP_WND_SCALE */
+#if (LWIP_TCP && LWIP_TCP_SACK_OUT && !TCP_QUEUE_OOSEQ)
+  #error "LWIP_TCP_SACK_OUT needs TCP_QUEUE_OOSEQ, SACKs describe the ->ooseq queue"
+#endif
+#if (LWIP_TCP && LWIP_TCP_SACK_OUT && (LWIP_TCP_MAX_SACK_NUM < 1))
+  #error "LWIP_TCP_MAX_SACK_NUM must be at least 1"
+#endif
+#if (LWIP_TCP && LWIP_TCP_FASTOPEN && !defined LWIP_HOOK_TCP_FASTOPEN_COOKIE)
+  #error "LWIP_TCP_FASTOPEN needs LWIP_HOOK_TCP_FASTOPEN_COOKIE to make cookies"
+#endif
+#if (LWIP_TCP && LWIP_TCP_FASTOPEN && ((LWIP_TCP_FASTOPEN_COOKIE_LEN < 4) || (LWIP_TCP_FASTOPEN_COOKIE_LEN > 16) || (LWIP_TCP_FASTOPEN_COOKIE_LEN & 1)))
+  #error "LWIP_TCP_FASTOPEN_COOKIE_LEN must be even, 4 to 16"
+#endif
 #if (LWIP_TCP && (TCP_SND_QUEUELEN > 0xffff))
   #error "If you want to use TCP, TCP_SND_QUEUELEN must fit in an u16_t, so, you have to reduce it in your lwipopts.h"
 #endif
@@ -322,6 +334,12 @@
 #if TCP_SNDLOWAT >= (0xFFFF - (4 * TCP_MSS))
   #error "lwip_sanity_check: WARNING: TCP_SNDLOWAT must at least be 4*MSS below u16_t overflow!"
 #endif
+#if (TCP_RTO_MAX / TCP_SLOW_INTERVAL) > 0x7fff
+  #error "lwip_sanity_check: WARNING: TCP_RTO_MAX must fit in 0x7fff ticks of TCP_SLOW_INTERVAL. If you know what you are doing, define LWIP_DISABLE_TCP_SANITY_CHECKS to 1 to disable this error."
+#endif
+#if (TCP_RTO_MIN > TCP_RTO_MAX) || (TCP_RTO_INITIAL > TCP_RTO_MAX)
+  #error "lwip_sanity_check: WARNING: TCP_RTO_MIN and TCP_RTO_INITIAL must not exceed TCP_RTO_MAX. If you know what you are doing, define LWIP_DISABLE_TCP_SANITY_CHECKS to 1 to disable this error."
+#endif
 #if TCP_SNDQUEUELOWAT >= TCP_SND_QUEUELEN
   #error "lwip_sanity_check: WARNING: TCP_SNDQUEUELOWAT must be less than TCP_SND_QUEUELEN. If you know what you are doing, define LWIP_DISABLE_TCP_SANITY_CHECKS to 1 to disable this error."
 #endif
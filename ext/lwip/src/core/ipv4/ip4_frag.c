@@ -106,8 +106,11 @@ PACK_STRUCT_END
    ip4_addr_cmp(&(iphdrA)->dest, &(iphdrB)->dest) && \
    IPH_ID(iphdrA) == IPH_ID(iphdrB)) ? 1 : 0
 
+/* The bucket of a datagram, by the id its fragments carry */
+#define IP_REASS_BUCKET(iphdr) (ntohs(IPH_ID(iphdr)) % IP_REASS_BUCKETS)
+
 /* global variables */
-static struct ip_reassdata *reassdatagrams;
+static struct ip_reassdata *reassdatagrams[IP_REASS_BUCKETS];
 static u16_t ip_reass_pbufcount;
 
 /* function prototypes */
@@ -123,28 +126,32 @@ static int ip_reass_free_complete_datagram(struct ip_reassdata *ipr, struct ip_r
 void
 ip_reass_tmr(void)
 {
-  struct ip_reassdata *r, *prev = NULL;
-
-  r = reassdatagrams;
-  while (r != NULL) {
-    /* Decrement the timer. Once it reaches 0,
-     * clean up the incomplete fragment assembly */
-    if (r->timer > 0) {
-      r->timer--;
-      LWIP_DEBUGF(IP_REASS_DEBUG, ("ip_reass_tmr: timer dec %"U16_F"\n",(u16_t)r->timer));
-      prev = r;
-      r = r->next;
-    } else {
-      /* reassembly timed out */
-      struct ip_reassdata *tmp;
-      LWIP_DEBUGF(IP_REASS_DEBUG, ("ip_reass_tmr: timer timed out\n"));
-      tmp = r;
-      /* get the next pointer before freeing */
-      r = r->next;
-      /* free the helper struct and all enqueued pbufs */
-      ip_reass_free_complete_datagram(tmp, prev);
-     }
-   }
+  struct ip_reassdata *r, *prev;
+  u16_t i;
+
+  for (i = 0; i < IP_REASS_BUCKETS; i++) {
+    prev = NULL;
+    r = reassdatagrams[i];
+    while (r != NULL) {
+      /* Decrement the timer. Once it reaches 0,
+       * clean up the incomplete fragment assembly */
+      if (r->timer > 0) {
+        r->timer--;
+        LWIP_DEBUGF(IP_REASS_DEBUG, ("ip_reass_tmr: timer dec %"U16_F"\n",(u16_t)r->timer));
+        prev = r;
+        r = r->next;
+      } else {
+        /* reassembly timed out */
+        struct ip_reassdata *tmp;
+        LWIP_DEBUGF(IP_REASS_DEBUG, ("ip_reass_tmr: timer timed out\n"));
+        tmp = r;
+        /* get the next pointer before freeing */
+        r = r->next;
+        /* free the helper struct and all enqueued pbufs */
+        ip_reass_free_complete_datagram(tmp, prev);
+      }
+    }
+  }
 }
 
 /**
@@ -228,32 +235,27 @@ ip_reass_remove_oldest_datagram(struct ip_hdr *fraghdr, int pbufs_needed)
   struct ip_reassdata *r, *oldest, *prev, *oldest_prev;
   int pbufs_freed = 0, pbufs_freed_current;
   int other_datagrams;
+  u16_t i;
 
   /* Free datagrams until being allowed to enqueue 'pbufs_needed' pbufs,
    * but don't free the datagram that 'fraghdr' belongs to! */
   do {
     oldest = NULL;
-    prev = NULL;
     oldest_prev = NULL;
     other_datagrams = 0;
-    r = reassdatagrams;
-    while (r != NULL) {
-      if (!IP_ADDRESSES_AND_ID_MATCH(&r->iphdr, fraghdr)) {
-        /* Not the same datagram as fraghdr */
-        other_datagrams++;
-        if (oldest == NULL) {
-          oldest = r;
-          oldest_prev = prev;
-        } else if (r->timer <= oldest->timer) {
-          /* older than the previous oldest */
-          oldest = r;
-          oldest_prev = prev;
+    for (i = 0; i < IP_REASS_BUCKETS; i++) {
+      prev = NULL;
+      for (r = reassdatagrams[i]; r != NULL; prev = r, r = r->next) {
+        if (!IP_ADDRESSES_AND_ID_MATCH(&r->iphdr, fraghdr)) {
+          /* Not the same datagram as fraghdr */
+          other_datagrams++;
+          if ((oldest == NULL) || (r->timer <= oldest->timer)) {
+            /* older than the previous oldest */
+            oldest = r;
+            oldest_prev = prev;
+          }
         }
       }
-      if (r->next != NULL) {
-        prev = r;
-      }
-      r = r->next;
     }
     if (oldest != NULL) {
       pbufs_freed_current = ip_reass_free_complete_datagram(oldest, oldest_prev);
@@ -296,12 +298,12 @@ ip_reass_enqueue_new_datagram(struct ip_hdr *fraghdr, int clen)
   memset(ipr, 0, sizeof(struct ip_reassdata));
   ipr->timer = IP_REASS_MAXAGE;
 
-  /* enqueue the new structure to the front of the list */
-  ipr->next = reassdatagrams;
-  reassdatagrams = ipr;
   /* copy the ip header for later tests and input */
   /* @todo: no ip options supported? */
   SMEMCPY(&(ipr->iphdr), fraghdr, IP_HLEN);
+  /* enqueue the new structure to the front of its bucket */
+  ipr->next = reassdatagrams[IP_REASS_BUCKET(fraghdr)];
+  reassdatagrams[IP_REASS_BUCKET(fraghdr)] = ipr;
   return ipr;
 }
 
@@ -313,9 +315,9 @@ static void
 ip_reass_dequeue_datagram(struct ip_reassdata *ipr, struct ip_reassdata *prev)
 {
   /* dequeue the reass struct  */
-  if (reassdatagrams == ipr) {
+  if (reassdatagrams[IP_REASS_BUCKET(&ipr->iphdr)] == ipr) {
     /* it was the first in the list */
-    reassdatagrams = ipr->next;
+    reassdatagrams[IP_REASS_BUCKET(&ipr->iphdr)] = ipr->next;
   } else {
     /* it wasn't the first, so it must have a valid 'prev' */
     LWIP_ASSERT("sanity check linked list", prev != NULL);
@@ -506,15 +508,15 @@ ip4_reass(struct pbuf *p)
 
   /* Check if we are allowed to enqueue more datagrams. */
   clen = pbuf_clen(p);
-  if ((ip_reass_pbufcount + clen) > IP_REASS_MAX_PBUFS) {
+  if ((ip_reass_pbufcount + clen) > IP_REASS_PBUF_LIMIT) {
 #if IP_REASS_FREE_OLDEST
     if (!ip_reass_remove_oldest_datagram(fraghdr, clen) ||
-        ((ip_reass_pbufcount + clen) > IP_REASS_MAX_PBUFS))
+        ((ip_reass_pbufcount + clen) > IP_REASS_PBUF_LIMIT))
 #endif /* IP_REASS_FREE_OLDEST */
     {
       /* No datagram could be freed and still too many pbufs enqueued */
       LWIP_DEBUGF(IP_REASS_DEBUG,("ip4_reass: Overflow condition: pbufct=%d, clen=%d, MAX=%d\n",
-        ip_reass_pbufcount, clen, IP_REASS_MAX_PBUFS));
+        ip_reass_pbufcount, clen, IP_REASS_PBUF_LIMIT));
       IPFRAG_STATS_INC(ip_frag.memerr);
       /* @todo: send ICMP time exceeded here? */
       /* drop this pbuf */
@@ -524,7 +526,7 @@ ip4_reass(struct pbuf *p)
 
   /* Look for the datagram the fragment belongs to in the current datagram queue,
    * remembering the previous in the queue for later dequeueing. */
-  for (ipr = reassdatagrams; ipr != NULL; ipr = ipr->next) {
+  for (ipr = reassdatagrams[IP_REASS_BUCKET(fraghdr)]; ipr != NULL; ipr = ipr->next) {
     /* Check if the incoming fragment matches the one currently present
        in the reassembly buffer. If so, we proceed with copying the
        fragment into the buffer. */
@@ -605,10 +607,10 @@ ip4_reass(struct pbuf *p)
     }
 
     /* find the previous entry in the linked list */
-    if (ipr == reassdatagrams) {
+    if (ipr == reassdatagrams[IP_REASS_BUCKET(&ipr->iphdr)]) {
       ipr_prev = NULL;
     } else {
-      for (ipr_prev = reassdatagrams; ipr_prev != NULL; ipr_prev = ipr_prev->next) {
+      for (ipr_prev = reassdatagrams[IP_REASS_BUCKET(&ipr->iphdr)]; ipr_prev != NULL; ipr_prev = ipr_prev->next) {
         if (ipr_prev->next == ipr) {
           break;
         }
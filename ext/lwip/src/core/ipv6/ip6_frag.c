@@ -97,8 +97,11 @@ PACK_STRUCT_END
 #  include "arch/epstruct.h"
 #endif
 
+/* The bucket of a datagram, by the id its fragments carry */
+#define IP6_REASS_BUCKET(id) (ntohl(id) % IP_REASS_BUCKETS)
+
 /* static variables */
-static struct ip6_reassdata *reassdatagrams;
+static struct ip6_reassdata *reassdatagrams[IP_REASS_BUCKETS];
 static u16_t ip6_reass_pbufcount;
 
 /* Forward declarations. */
@@ -111,28 +114,31 @@ void
 ip6_reass_tmr(void)
 {
   struct ip6_reassdata *r, *tmp;
+  u16_t i;
 
 #if !IPV6_FRAG_COPYHEADER
   LWIP_ASSERT("sizeof(struct ip6_reass_helper) <= IP6_FRAG_HLEN, set IPV6_FRAG_COPYHEADER to 1",
     sizeof(struct ip6_reass_helper) <= IP6_FRAG_HLEN);
 #endif /* !IPV6_FRAG_COPYHEADER */
 
-  r = reassdatagrams;
-  while (r != NULL) {
-    /* Decrement the timer. Once it reaches 0,
-     * clean up the incomplete fragment assembly */
-    if (r->timer > 0) {
-      r->timer--;
-      r = r->next;
-    } else {
-      /* reassembly timed out */
-      tmp = r;
-      /* get the next pointer before freeing */
-      r = r->next;
-      /* free the helper struct and all enqueued pbufs */
-      ip6_reass_free_complete_datagram(tmp);
-     }
-   }
+  for (i = 0; i < IP_REASS_BUCKETS; i++) {
+    r = reassdatagrams[i];
+    while (r != NULL) {
+      /* Decrement the timer. Once it reaches 0,
+       * clean up the incomplete fragment assembly */
+      if (r->timer > 0) {
+        r->timer--;
+        r = r->next;
+      } else {
+        /* reassembly timed out */
+        tmp = r;
+        /* get the next pointer before freeing */
+        r = r->next;
+        /* free the helper struct and all enqueued pbufs */
+        ip6_reass_free_complete_datagram(tmp);
+      }
+    }
+  }
 }
 
 /**
@@ -145,7 +151,7 @@ ip6_reass_tmr(void)
 static void
 ip6_reass_free_complete_datagram(struct ip6_reassdata *ipr)
 {
-  struct ip6_reassdata *prev;
+  struct ip6_reassdata *prev, **bucket;
   u16_t pbufs_freed = 0;
   u8_t clen;
   struct pbuf *p;
@@ -189,10 +195,11 @@ ip6_reass_free_complete_datagram(struct ip6_reassdata *ipr)
   }
 
   /* Then, unchain the struct ip6_reassdata from the list and free it. */
-  if (ipr == reassdatagrams) {
-    reassdatagrams = ipr->next;
+  bucket = &reassdatagrams[IP6_REASS_BUCKET(ipr->identification)];
+  if (ipr == *bucket) {
+    *bucket = ipr->next;
   } else {
-    prev = reassdatagrams;
+    prev = *bucket;
     while (prev != NULL) {
       if (prev->next == ipr) {
         break;
@@ -223,28 +230,26 @@ static void
 ip6_reass_remove_oldest_datagram(struct ip6_reassdata *ipr, int pbufs_needed)
 {
   struct ip6_reassdata *r, *oldest;
+  u16_t i;
 
   /* Free datagrams until being allowed to enqueue 'pbufs_needed' pbufs,
    * but don't free the current datagram! */
   do {
-    r = oldest = reassdatagrams;
-    while (r != NULL) {
-      if (r != ipr) {
-        if (r->timer <= oldest->timer) {
+    oldest = NULL;
+    for (i = 0; i < IP_REASS_BUCKETS; i++) {
+      for (r = reassdatagrams[i]; r != NULL; r = r->next) {
+        if ((r != ipr) && ((oldest == NULL) || (r->timer <= oldest->timer))) {
           /* older than the previous oldest */
           oldest = r;
         }
       }
-      r = r->next;
     }
-    if (oldest == ipr) {
-      /* nothing to free, ipr is the only element on the list */
+    if (oldest == NULL) {
+      /* nothing to free, ipr is the only element on the lists */
       return;
     }
-    if (oldest != NULL) {
-      ip6_reass_free_complete_datagram(oldest);
-    }
-  } while (((ip6_reass_pbufcount + pbufs_needed) > IP_REASS_MAX_PBUFS) && (reassdatagrams != NULL));
+    ip6_reass_free_complete_datagram(oldest);
+  } while ((ip6_reass_pbufcount + pbufs_needed) > IP_REASS_PBUF_LIMIT);
 }
 #endif /* IP_REASS_FREE_OLDEST */
 
@@ -258,7 +263,7 @@ ip6_reass_remove_oldest_datagram(struct ip6_reassdata *ipr, int pbufs_needed)
 struct pbuf *
 ip6_reass(struct pbuf *p)
 {
-  struct ip6_reassdata *ipr, *ipr_prev;
+  struct ip6_reassdata *ipr, *ipr_prev, **bucket;
   struct ip6_reass_helper *iprh, *iprh_tmp, *iprh_prev=NULL;
   struct ip6_frag_hdr * frag_hdr;
   u16_t offset, len;
@@ -289,7 +294,8 @@ ip6_reass(struct pbuf *p)
 
   /* Look for the datagram the fragment belongs to in the current datagram queue,
    * remembering the previous in the queue for later dequeueing. */
-  for (ipr = reassdatagrams, ipr_prev = NULL; ipr != NULL; ipr = ipr->next) {
+  bucket = &reassdatagrams[IP6_REASS_BUCKET(frag_hdr->_identification)];
+  for (ipr = *bucket, ipr_prev = NULL; ipr != NULL; ipr = ipr->next) {
     /* Check if the incoming fragment matches the one currently present
        in the reassembly buffer. If so, we proceed with copying the
        fragment into the buffer. */
@@ -312,7 +318,7 @@ ip6_reass(struct pbuf *p)
       ipr = (struct ip6_reassdata *)memp_malloc(MEMP_IP6_REASSDATA);
       if (ipr != NULL) {
         /* re-search ipr_prev since it might have been removed */
-        for (ipr_prev = reassdatagrams; ipr_prev != NULL; ipr_prev = ipr_prev->next) {
+        for (ipr_prev = *bucket; ipr_prev != NULL; ipr_prev = ipr_prev->next) {
           if (ipr_prev->next == ipr) {
             break;
           }
@@ -329,9 +335,9 @@ ip6_reass(struct pbuf *p)
     memset(ipr, 0, sizeof(struct ip6_reassdata));
     ipr->timer = IP_REASS_MAXAGE;
 
-    /* enqueue the new structure to the front of the list */
-    ipr->next = reassdatagrams;
-    reassdatagrams = ipr;
+    /* enqueue the new structure to the front of its bucket */
+    ipr->next = *bucket;
+    *bucket = ipr;
 
     /* Use the current IPv6 header for src/dest address reference.
      * Eventually, we will replace it when we get the first fragment
@@ -351,12 +357,12 @@ ip6_reass(struct pbuf *p)
   }
 
   /* Check if we are allowed to enqueue more datagrams. */
-  if ((ip6_reass_pbufcount + clen) > IP_REASS_MAX_PBUFS) {
+  if ((ip6_reass_pbufcount + clen) > IP_REASS_PBUF_LIMIT) {
 #if IP_REASS_FREE_OLDEST
     ip6_reass_remove_oldest_datagram(ipr, clen);
-    if ((ip6_reass_pbufcount + clen) <= IP_REASS_MAX_PBUFS) {
+    if ((ip6_reass_pbufcount + clen) <= IP_REASS_PBUF_LIMIT) {
       /* re-search ipr_prev since it might have been removed */
-      for (ipr_prev = reassdatagrams; ipr_prev != NULL; ipr_prev = ipr_prev->next) {
+      for (ipr_prev = *bucket; ipr_prev != NULL; ipr_prev = ipr_prev->next) {
         if (ipr_prev->next == ipr) {
           break;
         }
@@ -573,9 +579,9 @@ ip6_reass(struct pbuf *p)
     frag_hdr->_identification = 0;
 
     /* release the sources allocate for the fragment queue entry */
-    if (reassdatagrams == ipr) {
+    if (*bucket == ipr) {
       /* it was the first in the list */
-      reassdatagrams = ipr->next;
+      *bucket = ipr->next;
     } else {
       /* it wasn't the first, so it must have a valid 'prev' */
       LWIP_ASSERT("sanity check linked list", ipr_prev != NULL);
@@ -241,6 +241,111 @@ tcp_backlog_accepted(struct tcp_pcb* pcb)
 }
 #endif /* TCP_LISTEN_BACKLOG */
 
+#if LWIP_TCP_FASTOPEN
+/** Cookies handed out by remote hosts, for tcp_connect_fastopen() */
+struct tcp_fastopen_entry {
+  ip_addr_t addr;
+  u32_t used; /* 0 if the entry is free */
+  u8_t cookie[LWIP_TCP_FASTOPEN_COOKIE_LEN];
+};
+static struct tcp_fastopen_entry tcp_fastopen_cache[LWIP_TCP_FASTOPEN_CACHE_SIZE];
+static u32_t tcp_fastopen_clock;
+
+/** @ingroup tcp_raw
+ * Enables TCP Fast Open (RFC 7413) on a listening pcb: SYNs asking for a
+ * cookie get one, data on SYNs presenting a valid cookie is accepted right
+ * away (the connection is passed to the accept callback before the
+ * handshake completes).
+ *
+ * @param pcb the listening pcb
+ * @param qlen most connections accepted this way still waiting for the ACK
+ *        which completes their handshake, 0 turns Fast Open off
+ */
+void
+tcp_fastopen(struct tcp_pcb *pcb, u16_t qlen)
+{
+  if ((pcb != NULL) && (pcb->state == LISTEN)) {
+    ((struct tcp_pcb_listen *)pcb)->fastopen_qlen = qlen;
+  }
+}
+
+/**
+ * A connection accepted on its SYN is no longer pending on its listener:
+ * its handshake completed or it went away.
+ *
+ * @param pcb the connection pcb
+ */
+void
+tcp_fastopen_accepted(struct tcp_pcb *pcb)
+{
+  if ((pcb->flags & TF_FASTOPEN_ACC) != 0) {
+    if (pcb->listener != NULL) {
+      LWIP_ASSERT("fastopen_pending != 0", pcb->listener->fastopen_pending != 0);
+      pcb->listener->fastopen_pending--;
+    }
+    pcb->flags &= ~TF_FASTOPEN_ACC;
+  }
+}
+
+static struct tcp_fastopen_entry *
+tcp_fastopen_cache_find(const ip_addr_t *addr)
+{
+  int i;
+  for (i = 0; i < LWIP_TCP_FASTOPEN_CACHE_SIZE; i++) {
+    if (tcp_fastopen_cache[i].used && ip_addr_cmp(&tcp_fastopen_cache[i].addr, addr)) {
+      return &tcp_fastopen_cache[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Copies the cookie cached for addr to cookie, returns 0 if there is none.
+ */
+u8_t
+tcp_fastopen_cache_get(const ip_addr_t *addr, u8_t *cookie)
+{
+  struct tcp_fastopen_entry *e = tcp_fastopen_cache_find(addr);
+  if (e == NULL) {
+    return 0;
+  }
+  e->used = ++tcp_fastopen_clock;
+  MEMCPY(cookie, e->cookie, LWIP_TCP_FASTOPEN_COOKIE_LEN);
+  return 1;
+}
+
+/**
+ * Caches the cookie addr handed out, in place of the least recently used
+ * entry if the cache is full.
+ */
+void
+tcp_fastopen_cache_put(const ip_addr_t *addr, const u8_t *cookie)
+{
+  struct tcp_fastopen_entry *e = tcp_fastopen_cache_find(addr);
+  if (e == NULL) {
+    int i;
+    e = &tcp_fastopen_cache[0];
+    for (i = 1; i < LWIP_TCP_FASTOPEN_CACHE_SIZE && e->used; i++) {
+      if (tcp_fastopen_cache[i].used < e->used) {
+        e = &tcp_fastopen_cache[i];
+      }
+    }
+    ip_addr_copy(e->addr, *addr);
+  }
+  e->used = ++tcp_fastopen_clock;
+  MEMCPY(e->cookie, cookie, LWIP_TCP_FASTOPEN_COOKIE_LEN);
+}
+
+/** @ingroup tcp_raw
+ * Forgets every cached cookie.
+ */
+void
+tcp_fastopen_flush(void)
+{
+  memset(tcp_fastopen_cache, 0, sizeof(tcp_fastopen_cache));
+}
+#endif /* LWIP_TCP_FASTOPEN */
+
 /**
  * Closes the TX side of a connection held by the PCB.
  * For tcp_close(), a RST is sent if the application didn't receive all data
@@ -692,6 +797,10 @@ tcp_listen_with_backlog(struct tcp_pcb *pcb, u8_t backlog)
   lpcb->accepts_pending = 0;
   lpcb->backlog = backlog;
 #endif /* TCP_LISTEN_BACKLOG */
+#if LWIP_TCP_FASTOPEN
+  lpcb->fastopen_qlen = 0;
+  lpcb->fastopen_pending = 0;
+#endif /* LWIP_TCP_FASTOPEN */
   TCP_REG(&tcp_listen_pcbs.pcbs, (struct tcp_pcb *)lpcb);
   return (struct tcp_pcb *)lpcb;
 }
@@ -820,9 +929,48 @@ again:
  *         ERR_OK if connect request has been sent
  *         other err_t values if connect request couldn't be sent
  */
+static err_t
+tcp_connect_data(struct tcp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port,
+      tcp_connected_fn connected, const void *data, u16_t *len);
+
 err_t
 tcp_connect(struct tcp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port,
       tcp_connected_fn connected)
+{
+  return tcp_connect_data(pcb, ipaddr, port, connected, NULL, NULL);
+}
+
+#if LWIP_TCP_FASTOPEN
+/**
+ * @ingroup tcp_raw
+ * tcp_connect() with TCP Fast Open (RFC 7413): if a cookie from the remote
+ * host is cached, as much of data as fits in one segment goes out on the SYN.
+ * Otherwise the SYN asks for a cookie and nothing of data is sent.
+ *
+ * @param pcb the tcp_pcb used to establish the connection
+ * @param ipaddr the remote ip address to connect to
+ * @param port the remote tcp port to connect to
+ * @param connected callback function to call when connected
+ * @param data the data to send on the SYN (copied)
+ * @param len length of data, set to how much of it was queued on the SYN.
+ *        The rest is up to the caller to tcp_write()
+ * @return see tcp_connect()
+ */
+err_t
+tcp_connect_fastopen(struct tcp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port,
+      tcp_connected_fn connected, const void *data, u16_t *len)
+{
+  LWIP_ERROR("tcp_connect_fastopen: invalid len", len != NULL, return ERR_ARG);
+  return tcp_connect_data(pcb, ipaddr, port, connected, data, len);
+}
+#endif /* LWIP_TCP_FASTOPEN */
+
+/**
+ * tcp_connect(), with data for a Fast Open SYN if len isn't NULL
+ */
+static err_t
+tcp_connect_data(struct tcp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port,
+      tcp_connected_fn connected, const void *data, u16_t *len)
 {
   err_t ret;
   u32_t iss;
@@ -906,6 +1054,27 @@ tcp_connect(struct tcp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port,
   LWIP_UNUSED_ARG(connected);
 #endif /* LWIP_CALLBACK_API */
 
+#if LWIP_TCP_FASTOPEN
+  if (len != NULL) {
+    u16_t n = 0;
+    pcb->flags |= TF_FASTOPEN;
+    pcb->tfo_cookie_len = 0;
+    if (tcp_fastopen_cache_get(&pcb->remote_ip, pcb->tfo_cookie)) {
+      pcb->tfo_cookie_len = LWIP_TCP_FASTOPEN_COOKIE_LEN;
+      /* One byte short of a segment so a retransmission fits the cwnd of
+         one mss it's sent with */
+      n = LWIP_MIN(*len, LWIP_MIN((u16_t)(tcp_mss(pcb) - 1), tcp_sndbuf(pcb)));
+      /* Just wide enough for the SYN, nothing queued behind it goes out
+         before the <SYN,ACK> */
+      pcb->cwnd = 1 + n;
+    }
+    ret = tcp_enqueue_syn_data(pcb, data, n);
+    *len = (ret == ERR_OK) ? n : 0;
+  } else
+#else /* LWIP_TCP_FASTOPEN */
+  LWIP_UNUSED_ARG(data);
+  LWIP_UNUSED_ARG(len);
+#endif /* LWIP_TCP_FASTOPEN */
   /* Send a SYN together with the MSS option. */
   ret = tcp_enqueue_flags(pcb, TCP_SYN);
   if (ret == ERR_OK) {
@@ -965,6 +1134,10 @@ tcp_slowtmr_start:
     pcb_remove = 0;
     pcb_reset = 0;
 
+    if (pcb->unacked == NULL && pcb->persist_backoff == 0) {
+      pcb->utmr = tcp_ticks;
+    }
+
     if (pcb->state == SYN_SENT && pcb->nrtx == TCP_SYNMAXRTX) {
       ++pcb_remove;
       LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: max SYN retries reached\n"));
@@ -972,6 +1145,10 @@ tcp_slowtmr_start:
     else if (pcb->nrtx == TCP_MAXRTX) {
       ++pcb_remove;
       LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: max DATA retries reached\n"));
+    } else if (pcb->user_timeout != 0 &&
+               (u32_t)(tcp_ticks - pcb->utmr) > pcb->user_timeout / TCP_SLOW_INTERVAL) {
+      ++pcb_remove;
+      LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: user timeout reached\n"));
     } else {
       if (pcb->persist_backoff > 0) {
         /* If snd_wnd is zero, use persist timer to send 1 byte probes
@@ -1003,7 +1180,7 @@ tcp_slowtmr_start:
           /* Double retransmission time-out unless we are trying to
            * connect to somebody (i.e., we are in SYN_SENT). */
           if (pcb->state != SYN_SENT) {
-            pcb->rto = ((pcb->sa >> 3) + pcb->sv) << tcp_backoff[pcb->nrtx];
+            tcp_set_rto(pcb, (s32_t)((pcb->sa >> 3) + pcb->sv) << tcp_backoff[pcb->nrtx]);
           }
 
           /* Reset the retransmission timer. */
@@ -1070,8 +1247,7 @@ tcp_slowtmr_start:
 #if TCP_QUEUE_OOSEQ
     if (pcb->ooseq != NULL &&
         (u32_t)tcp_ticks - pcb->tmr >= pcb->rto * TCP_OOSEQ_TIMEOUT) {
-      tcp_segs_free(pcb->ooseq);
-      pcb->ooseq = NULL;
+      tcp_free_ooseq(pcb);
       LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_slowtmr: dropping OOSEQ queued data\n"));
     }
 #endif /* TCP_QUEUE_OOSEQ */
@@ -1318,6 +1494,26 @@ tcp_segs_free(struct tcp_seg *seg)
   }
 }
 
+#if TCP_QUEUE_OOSEQ
+/**
+ * Frees the out-of-sequence queue of a pcb, together with the SACK ranges
+ * that described it.
+ *
+ * @param pcb the tcp_pcb whose ->ooseq is dropped
+ */
+void
+tcp_free_ooseq(struct tcp_pcb *pcb)
+{
+  if (pcb->ooseq != NULL) {
+    tcp_segs_free(pcb->ooseq);
+    pcb->ooseq = NULL;
+  }
+#if LWIP_TCP_SACK_OUT
+  memset(pcb->rcv_sacks, 0, sizeof(pcb->rcv_sacks));
+#endif /* LWIP_TCP_SACK_OUT */
+}
+#endif /* TCP_QUEUE_OOSEQ */
+
 /**
  * Frees a TCP segment (tcp_seg structure).
  *
@@ -1337,6 +1533,24 @@ tcp_seg_free(struct tcp_seg *seg)
   }
 }
 
+/**
+ * @ingroup tcp_raw
+ * Sets the floor of a connection's retransmission time-out (see TCP_RTO_MIN),
+ * rounded up to ticks of TCP_SLOW_INTERVAL. 0 leaves it to the round-trip time
+ * estimate.
+ *
+ * @param pcb the tcp_pcb to manipulate
+ * @param ms the floor in milliseconds
+ */
+void
+tcp_set_rto_min(struct tcp_pcb *pcb, u32_t ms)
+{
+  LWIP_ASSERT("tcp_set_rto_min: invalid pcb", pcb != NULL && pcb->state != LISTEN);
+  ms = LWIP_MIN(ms, TCP_RTO_MAX);
+  pcb->rto_min = (s16_t)((ms + TCP_SLOW_INTERVAL - 1) / TCP_SLOW_INTERVAL);
+  tcp_set_rto(pcb, pcb->rto);
+}
+
 /**
  * Sets the priority of a connection.
  *
@@ -1551,8 +1765,9 @@ tcp_alloc(u8_t prio)
     /* As initial send MSS, we use TCP_MSS but limit it to 536.
        The send MSS is updated when an MSS option is received. */
     pcb->mss = INITIAL_MSS;
-    pcb->rto = 3000 / TCP_SLOW_INTERVAL;
-    pcb->sv = 3000 / TCP_SLOW_INTERVAL;
+    pcb->rto_min = (TCP_RTO_MIN + TCP_SLOW_INTERVAL - 1) / TCP_SLOW_INTERVAL;
+    pcb->rto = LWIP_MAX(TCP_RTO_INITIAL / TCP_SLOW_INTERVAL, pcb->rto_min);
+    pcb->sv = TCP_RTO_INITIAL / TCP_SLOW_INTERVAL;
     pcb->rtime = -1;
     pcb->cwnd = 1;
     iss = tcp_next_iss();
@@ -1748,6 +1963,9 @@ tcp_pcb_purge(struct tcp_pcb *pcb)
     LWIP_DEBUGF(TCP_DEBUG, ("tcp_pcb_purge\n"));
 
     tcp_backlog_accepted(pcb);
+#if LWIP_TCP_FASTOPEN
+    tcp_fastopen_accepted(pcb);
+#endif /* LWIP_TCP_FASTOPEN */
 
     if (pcb->refused_data != NULL) {
       LWIP_DEBUGF(TCP_DEBUG, ("tcp_pcb_purge: data left on ->refused_data\n"));
@@ -1764,8 +1982,7 @@ tcp_pcb_purge(struct tcp_pcb *pcb)
     if (pcb->ooseq != NULL) {
       LWIP_DEBUGF(TCP_DEBUG, ("tcp_pcb_purge: data left on ->ooseq\n"));
     }
-    tcp_segs_free(pcb->ooseq);
-    pcb->ooseq = NULL;
+    tcp_free_ooseq(pcb);
 #endif /* TCP_QUEUE_OOSEQ */
 
     /* Stop the retransmission timer as it will expect data on unacked
@@ -1870,6 +2087,15 @@ tcp_eff_send_mss_impl(u16_t sendmss, const ip_addr_t *dest
   }
 #endif /* LWIP_IPV4 */
 
+#ifdef LWIP_HOOK_TCP_PATH_MTU
+  if (outif != NULL) {
+    u16_t pmtu = LWIP_HOOK_TCP_PATH_MTU(outif, dest);
+    if ((pmtu != 0) && ((mtu == 0) || (pmtu < (u16_t)mtu))) {
+      mtu = (s16_t)pmtu;
+    }
+  }
+#endif /* LWIP_HOOK_TCP_PATH_MTU */
+
   if (mtu != 0) {
 #if LWIP_IPV6
 #if LWIP_IPV4
@@ -60,6 +60,8 @@
 #include "lwip/nd6.h"
 #endif /* LWIP_ND6_TCP_REACHABILITY_HINTS */
 
+#include <string.h>
+
 /** Initial CWND calculation as defined RFC 2581 */
 #define LWIP_TCP_CALC_INITIAL_CWND(mss) LWIP_MIN((4U * (mss)), LWIP_MAX((2U * (mss)), 4380U));
 /** Initial slow start threshold value: we use the full window */
@@ -82,6 +84,15 @@ static u8_t flags;
 static u8_t recv_flags;
 static struct pbuf *recv_data;
 
+#if LWIP_TCP_FASTOPEN
+/* The Fast Open option of the incoming segment, see tcp_parseopt() */
+#define TCP_FASTOPEN_OPT_NONE   0
+#define TCP_FASTOPEN_OPT_REQ    1 /* empty, or a cookie of a length we don't hand out */
+#define TCP_FASTOPEN_OPT_COOKIE 2
+static u8_t tcp_fastopen_opt;
+static u8_t tcp_fastopen_cookie[LWIP_TCP_FASTOPEN_COOKIE_LEN];
+#endif /* LWIP_TCP_FASTOPEN */
+
 struct tcp_pcb *tcp_input_pcb;
 
 /* Forward declarations. */
@@ -89,7 +100,7 @@ static err_t tcp_process(struct tcp_pcb *pcb);
 static void tcp_receive(struct tcp_pcb *pcb);
 static void tcp_parseopt(struct tcp_pcb *pcb);
 
-static void tcp_listen_input(struct tcp_pcb_listen *pcb);
+static void tcp_listen_input(struct tcp_pcb_listen *pcb, struct pbuf *p);
 static void tcp_timewait_input(struct tcp_pcb *pcb);
 
 /**
@@ -320,7 +331,7 @@ tcp_input(struct pbuf *p, struct netif *inp)
       }
 
       LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_input: packed for LISTENing connection.\n"));
-      tcp_listen_input(lpcb);
+      tcp_listen_input(lpcb, p);
       pbuf_free(p);
       return;
     }
@@ -535,6 +546,7 @@ dropped:
  * connection (from tcp_input()).
  *
  * @param pcb the tcp_pcb_listen for which a segment arrived
+ * @param p the segment's data (a Fast Open SYN may carry some)
  * @return ERR_OK if the segment was processed
  *         another err_t on error
  *
@@ -543,10 +555,15 @@ dropped:
  *       involved is passed as a parameter to this function
  */
 static void
-tcp_listen_input(struct tcp_pcb_listen *pcb)
+tcp_listen_input(struct tcp_pcb_listen *pcb, struct pbuf *p)
 {
   struct tcp_pcb *npcb;
   err_t rc;
+#if LWIP_TCP_FASTOPEN
+  u8_t fastopen = 0;
+#else /* LWIP_TCP_FASTOPEN */
+  LWIP_UNUSED_ARG(p);
+#endif /* LWIP_TCP_FASTOPEN */
 
   if (flags & TCP_RST) {
     /* An incoming RST should be ignored. Return. */
@@ -616,12 +633,63 @@ tcp_listen_input(struct tcp_pcb_listen *pcb)
 
     MIB2_STATS_INC(mib2.tcppassiveopens);
 
+#if LWIP_TCP_FASTOPEN
+    if ((pcb->fastopen_qlen > 0) && (tcp_fastopen_opt != TCP_FASTOPEN_OPT_NONE)) {
+      u8_t cookie[LWIP_TCP_FASTOPEN_COOKIE_LEN];
+      LWIP_HOOK_TCP_FASTOPEN_COOKIE(&npcb->remote_ip, cookie);
+      if ((tcp_fastopen_opt == TCP_FASTOPEN_OPT_COOKIE) &&
+          (memcmp(cookie, tcp_fastopen_cookie, LWIP_TCP_FASTOPEN_COOKIE_LEN) == 0) &&
+          (pcb->fastopen_pending < pcb->fastopen_qlen) && (p->tot_len <= npcb->rcv_wnd)) {
+        fastopen = 1;
+      } else {
+        /* Hand out a cookie, data on this SYN waits for the retransmission
+           which follows the <SYN,ACK> */
+        MEMCPY(npcb->tfo_cookie, cookie, LWIP_TCP_FASTOPEN_COOKIE_LEN);
+        npcb->tfo_cookie_len = LWIP_TCP_FASTOPEN_COOKIE_LEN;
+        npcb->flags |= TF_FASTOPEN;
+      }
+    }
+    if (fastopen) {
+      /* The <SYN,ACK> acks the data, the connection is accepted right away */
+      npcb->rcv_nxt += p->tot_len;
+      npcb->rcv_ann_right_edge = npcb->rcv_nxt;
+      npcb->rcv_wnd -= p->tot_len;
+      npcb->rcv_ann_wnd -= p->tot_len;
+      npcb->flags |= TF_FASTOPEN_ACC;
+      pcb->fastopen_pending++;
+      /* Leave room for an answer to go out right behind the <SYN,ACK> */
+      npcb->cwnd = LWIP_TCP_CALC_INITIAL_CWND(npcb->mss);
+    }
+#endif /* LWIP_TCP_FASTOPEN */
+
     /* Send a SYN|ACK together with the MSS option. */
     rc = tcp_enqueue_flags(npcb, TCP_SYN | TCP_ACK);
     if (rc != ERR_OK) {
       tcp_abandon(npcb, 0);
       return;
     }
+#if LWIP_TCP_FASTOPEN
+    if (fastopen) {
+      TCP_EVENT_ACCEPT(pcb, npcb, npcb->callback_arg, ERR_OK, rc);
+      if (rc != ERR_OK) {
+        if (rc != ERR_ABRT) {
+          tcp_abort(npcb);
+        }
+        return;
+      }
+      if (p->tot_len > 0) {
+        /* tcp_input() frees p once we return */
+        pbuf_ref(p);
+        TCP_EVENT_RECV(npcb, p, ERR_OK, rc);
+        if (rc == ERR_ABRT) {
+          return;
+        }
+        if (rc != ERR_OK) {
+          npcb->refused_data = p;
+        }
+      }
+    }
+#endif /* LWIP_TCP_FASTOPEN */
     tcp_output(npcb);
   }
   return;
@@ -751,7 +819,12 @@ tcp_process(struct tcp_pcb *pcb)
      pcb->snd_nxt, ntohl(pcb->unacked->tcphdr->seqno)));
     /* received SYN ACK with expected sequence number? */
     if ((flags & TCP_ACK) && (flags & TCP_SYN)
+#if LWIP_TCP_FASTOPEN
+        /* if our SYN carried data, the remote host may ack it too */
+        && TCP_SEQ_BETWEEN(ackno, pcb->lastack + 1, pcb->snd_nxt)) {
+#else /* LWIP_TCP_FASTOPEN */
         && (ackno == pcb->lastack + 1)) {
+#endif /* LWIP_TCP_FASTOPEN */
       pcb->rcv_nxt = seqno + 1;
       pcb->rcv_ann_right_edge = pcb->rcv_nxt;
       pcb->lastack = ackno;
@@ -784,6 +857,23 @@ tcp_process(struct tcp_pcb *pcb)
       } else {
         pcb->unacked = rseg->next;
       }
+#if LWIP_TCP_FASTOPEN
+      if (rseg->len > 0) {
+        /* our SYN carried data, take what the remote host acked of it */
+        u16_t acked = (u16_t)(ackno - (ntohl(rseg->tcphdr->seqno) + 1));
+        pcb->snd_buf += acked;
+        recv_acked = acked;
+        if (acked < rseg->len) {
+          /* the cookie was refused (or the remote host knows no Fast Open):
+             the rest goes again, in a segment of its own */
+          if (tcp_requeue_syn_data(pcb, rseg, acked) != ERR_OK) {
+            tcp_seg_free(rseg);
+            tcp_abort(pcb);
+            return ERR_ABRT;
+          }
+        }
+      }
+#endif /* LWIP_TCP_FASTOPEN */
       tcp_seg_free(rseg);
 
       /* If there's nothing left to acknowledge, stop the retransmit
@@ -820,6 +910,12 @@ tcp_process(struct tcp_pcb *pcb)
       if (TCP_SEQ_BETWEEN(ackno, pcb->lastack+1, pcb->snd_nxt)) {
         pcb->state = ESTABLISHED;
         LWIP_DEBUGF(TCP_DEBUG, ("TCP connection established %"U16_F" -> %"U16_F".\n", inseg.tcphdr->src, inseg.tcphdr->dest));
+#if LWIP_TCP_FASTOPEN
+        if (pcb->flags & TF_FASTOPEN_ACC) {
+          /* accepted on its SYN already (see tcp_listen_input()) */
+          tcp_fastopen_accepted(pcb);
+        } else
+#endif /* LWIP_TCP_FASTOPEN */
 #if LWIP_CALLBACK_API
         LWIP_ASSERT("pcb->listener->accept != NULL",
           (pcb->listener == NULL) || (pcb->listener->accept != NULL));
@@ -870,7 +966,11 @@ tcp_process(struct tcp_pcb *pcb)
         tcp_rst(ackno, seqno + tcplen, ip_current_dest_addr(),
           ip_current_src_addr(), tcphdr->dest, tcphdr->src);
       }
-    } else if ((flags & TCP_SYN) && (seqno == pcb->rcv_nxt - 1)) {
+    } else if ((flags & TCP_SYN) && ((seqno == pcb->rcv_nxt - 1)
+#if LWIP_TCP_FASTOPEN
+               || ((pcb->flags & TF_FASTOPEN_ACC) && (seqno + tcplen == pcb->rcv_nxt))
+#endif /* LWIP_TCP_FASTOPEN */
+               )) {
       /* Looks like another copy of the SYN - retransmit our SYN-ACK */
       tcp_rexmit(pcb);
     }
@@ -976,6 +1076,102 @@ tcp_oos_insert_segment(struct tcp_seg *cseg, struct tcp_seg *next)
   }
   cseg->next = next;
 }
+
+#if LWIP_TCP_SACK_OUT
+/**
+ * Records [left, right) as the most recently received SACK range (RFC 2018
+ * wants it reported first), dropping older ranges it overlaps.
+ *
+ * Called from tcp_receive()
+ */
+static void
+tcp_add_sack(struct tcp_pcb *pcb, u32_t left, u32_t right)
+{
+  u8_t i;
+  u8_t unused_idx;
+
+  if ((pcb->flags & TF_SACK) == 0 || !TCP_SEQ_LT(left, right)) {
+    return;
+  }
+
+  /* Compact the ranges which don't overlap the new one to the front */
+  for (i = unused_idx = 0; (i < LWIP_TCP_MAX_SACK_NUM) && LWIP_TCP_SACK_VALID(pcb, i); ++i) {
+    if (TCP_SEQ_LEQ(pcb->rcv_sacks[i].right, left) || TCP_SEQ_LEQ(right, pcb->rcv_sacks[i].left)) {
+      if (unused_idx != i) {
+        pcb->rcv_sacks[unused_idx] = pcb->rcv_sacks[i];
+      }
+      ++unused_idx;
+    }
+  }
+
+  /* Shift them back by one (the oldest may fall off) and store the new one first */
+  for (i = LWIP_TCP_MAX_SACK_NUM - 1; i > 0; --i) {
+    if (i - 1 >= unused_idx) {
+      pcb->rcv_sacks[i].left = pcb->rcv_sacks[i].right = 0;
+    } else {
+      pcb->rcv_sacks[i] = pcb->rcv_sacks[i - 1];
+    }
+  }
+  pcb->rcv_sacks[0].left = left;
+  pcb->rcv_sacks[0].right = right;
+}
+
+/**
+ * Drops (or trims) the SACK ranges below seq, which has been delivered in order.
+ *
+ * Called from tcp_receive()
+ */
+static void
+tcp_remove_sacks_lt(struct tcp_pcb *pcb, u32_t seq)
+{
+  u8_t i;
+  u8_t unused_idx;
+
+  for (i = unused_idx = 0; (i < LWIP_TCP_MAX_SACK_NUM) && LWIP_TCP_SACK_VALID(pcb, i); ++i) {
+    if (TCP_SEQ_GT(pcb->rcv_sacks[i].right, seq)) {
+      if (unused_idx != i) {
+        pcb->rcv_sacks[unused_idx] = pcb->rcv_sacks[i];
+      }
+      if (TCP_SEQ_LT(pcb->rcv_sacks[unused_idx].left, seq)) {
+        pcb->rcv_sacks[unused_idx].left = seq;
+      }
+      ++unused_idx;
+    }
+  }
+  for (i = unused_idx; i < LWIP_TCP_MAX_SACK_NUM; ++i) {
+    pcb->rcv_sacks[i].left = pcb->rcv_sacks[i].right = 0;
+  }
+}
+
+#if TCP_OOSEQ_MAX_BYTES || TCP_OOSEQ_MAX_PBUFS
+/**
+ * Drops (or trims) the SACK ranges above seq, which has been dumped from ->ooseq.
+ *
+ * Called from tcp_receive()
+ */
+static void
+tcp_remove_sacks_gt(struct tcp_pcb *pcb, u32_t seq)
+{
+  u8_t i;
+  u8_t unused_idx;
+
+  for (i = unused_idx = 0; (i < LWIP_TCP_MAX_SACK_NUM) && LWIP_TCP_SACK_VALID(pcb, i); ++i) {
+    if (TCP_SEQ_LT(pcb->rcv_sacks[i].left, seq)) {
+      if (unused_idx != i) {
+        pcb->rcv_sacks[unused_idx] = pcb->rcv_sacks[i];
+      }
+      if (TCP_SEQ_GT(pcb->rcv_sacks[unused_idx].right, seq)) {
+        pcb->rcv_sacks[unused_idx].right = seq;
+      }
+      ++unused_idx;
+    }
+  }
+  for (i = unused_idx; i < LWIP_TCP_MAX_SACK_NUM; ++i) {
+    pcb->rcv_sacks[i].left = pcb->rcv_sacks[i].right = 0;
+  }
+}
+#endif /* TCP_OOSEQ_MAX_BYTES || TCP_OOSEQ_MAX_PBUFS */
+#endif /* LWIP_TCP_SACK_OUT */
 #endif /* TCP_QUEUE_OOSEQ */
 
 /**
@@ -1115,7 +1311,9 @@ tcp_receive(struct tcp_pcb *pcb)
       pcb->nrtx = 0;
 
       /* Reset the retransmission time-out. */
-      pcb->rto = (pcb->sa >> 3) + pcb->sv;
+      tcp_set_rto(pcb, (pcb->sa >> 3) + pcb->sv);
+      /* and the user timeout, the connection made progress */
+      pcb->utmr = tcp_ticks;
 
       /* Reset the fast retransmit variables. */
       pcb->dupacks = 0;
@@ -1249,7 +1447,7 @@ tcp_receive(struct tcp_pcb *pcb)
       }
       m = m - (pcb->sv >> 2);
       pcb->sv += m;
-      pcb->rto = (pcb->sa >> 3) + pcb->sv;
+      tcp_set_rto(pcb, (pcb->sa >> 3) + pcb->sv);
 
       LWIP_DEBUGF(TCP_RTO_DEBUG, ("tcp_receive: RTO %"U16_F" (%"U16_F" milliseconds)\n",
                                   pcb->rto, (u16_t)(pcb->rto * TCP_SLOW_INTERVAL)));
@@ -1507,6 +1705,16 @@ tcp_receive(struct tcp_pcb *pcb)
           pcb->ooseq = cseg->next;
           tcp_seg_free(cseg);
         }
+#if LWIP_TCP_SACK_OUT
+        /* Whatever is left on ->ooseq begins above rcv_nxt, SACKs below it are stale */
+        if (pcb->flags & TF_SACK) {
+          if (pcb->ooseq != NULL) {
+            tcp_remove_sacks_lt(pcb, pcb->ooseq->tcphdr->seqno);
+          } else if (LWIP_TCP_SACK_VALID(pcb, 0)) {
+            memset(pcb->rcv_sacks, 0, sizeof(pcb->rcv_sacks));
+          }
+        }
+#endif /* LWIP_TCP_SACK_OUT */
 #endif /* TCP_QUEUE_OOSEQ */
 
 
@@ -1522,7 +1730,6 @@ tcp_receive(struct tcp_pcb *pcb)
 
       } else {
         /* We get here if the incoming segment is out-of-sequence. */
-        tcp_send_empty_ack(pcb);
 #if TCP_QUEUE_OOSEQ
         /* We queue the segment on the ->ooseq queue. */
         if (pcb->ooseq == NULL) {
@@ -1657,6 +1864,9 @@ tcp_receive(struct tcp_pcb *pcb)
           if ((ooseq_blen > TCP_OOSEQ_MAX_BYTES) ||
               (ooseq_qlen > TCP_OOSEQ_MAX_PBUFS)) {
              /* too much ooseq data, dump this and everything after it */
+#if LWIP_TCP_SACK_OUT
+             tcp_remove_sacks_gt(pcb, next->tcphdr->seqno);
+#endif /* LWIP_TCP_SACK_OUT */
              tcp_segs_free(next);
              if (prev == NULL) {
                /* first ooseq segment is too much, dump the whole queue */
@@ -1669,7 +1879,27 @@ tcp_receive(struct tcp_pcb *pcb)
           }
         }
 #endif /* TCP_OOSEQ_MAX_BYTES || TCP_OOSEQ_MAX_PBUFS */
+#if LWIP_TCP_SACK_OUT
+        /* Report the contiguous run of queued data this segment landed in */
+        if (pcb->flags & TF_SACK) {
+          u32_t sackbeg = 0, sackend = 0;
+          for (next = pcb->ooseq; next != NULL; next = next->next) {
+            if (next == pcb->ooseq || next->tcphdr->seqno != sackend) {
+              if (sackbeg != sackend && TCP_SEQ_BETWEEN(seqno, sackbeg, sackend - 1)) {
+                break;
+              }
+              sackbeg = sackend = next->tcphdr->seqno;
+            }
+            sackend += TCP_TCPLEN(next);
+          }
+          if (sackbeg != sackend && TCP_SEQ_BETWEEN(seqno, sackbeg, sackend - 1)) {
+            tcp_add_sack(pcb, sackbeg, sackend);
+          }
+        }
+#endif /* LWIP_TCP_SACK_OUT */
 #endif /* TCP_QUEUE_OOSEQ */
+        /* Sent after queueing so that the ACK can carry the SACK for this segment */
+        tcp_send_empty_ack(pcb);
       }
     } else {
       /* The incoming segment is not within the window. */
@@ -1713,6 +1943,10 @@ tcp_parseopt(struct tcp_pcb *pcb)
   u32_t tsval;
 #endif
 
+#if LWIP_TCP_FASTOPEN
+  tcp_fastopen_opt = TCP_FASTOPEN_OPT_NONE;
+#endif /* LWIP_TCP_FASTOPEN */
+
   /* Parse the TCP MSS option, if present. */
   if (tcphdr_optlen != 0) {
     for (tcp_optidx = 0; tcp_optidx < tcphdr_optlen; ) {
@@ -1765,6 +1999,20 @@ tcp_parseopt(struct tcp_pcb *pcb)
         }
         break;
 #endif
+#if LWIP_TCP_SACK_OUT
+      case LWIP_TCP_OPT_SACK_PERM:
+        LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_parseopt: SACK_PERM\n"));
+        if (tcp_getoptbyte() != LWIP_TCP_OPT_LEN_SACK_PERM || (tcp_optidx - 2 + LWIP_TCP_OPT_LEN_SACK_PERM) > tcphdr_optlen) {
+          /* Bad length */
+          LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_parseopt: bad length\n"));
+          return;
+        }
+        /* If syn was received with SACK_PERM option, we may send SACKs */
+        if (flags & TCP_SYN) {
+          pcb->flags |= TF_SACK;
+        }
+        break;
+#endif /* LWIP_TCP_SACK_OUT */
 #if LWIP_TCP_TIMESTAMPS
       case LWIP_TCP_OPT_TS:
         LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_parseopt: TS\n"));
@@ -1790,6 +2038,33 @@ tcp_parseopt(struct tcp_pcb *pcb)
         tcp_optidx += LWIP_TCP_OPT_LEN_TS - 6;
         break;
 #endif
+#if LWIP_TCP_FASTOPEN
+      case LWIP_TCP_OPT_FASTOPEN:
+        LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_parseopt: FASTOPEN\n"));
+        data = tcp_getoptbyte();
+        if (data < 2 || (tcp_optidx - 2 + data) > tcphdr_optlen) {
+          /* Bad length */
+          LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_parseopt: bad length\n"));
+          return;
+        }
+        if (flags & TCP_SYN) {
+          if (data == LWIP_TCP_OPT_LEN_TFO_COOKIE) {
+            u8_t i;
+            for (i = 0; i < LWIP_TCP_FASTOPEN_COOKIE_LEN; i++) {
+              tcp_fastopen_cookie[i] = tcp_getoptbyte();
+            }
+            tcp_fastopen_opt = TCP_FASTOPEN_OPT_COOKIE;
+            /* A <SYN,ACK> hands its cookie out for our next connection */
+            if ((flags & TCP_ACK) && (pcb->state == SYN_SENT)) {
+              tcp_fastopen_cache_put(&pcb->remote_ip, tcp_fastopen_cookie);
+            }
+            break;
+          }
+          tcp_fastopen_opt = TCP_FASTOPEN_OPT_REQ;
+        }
+        tcp_optidx += data - 2;
+        break;
+#endif /* LWIP_TCP_FASTOPEN */
       default:
         LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_parseopt: other\n"));
         data = tcp_getoptbyte();
@@ -739,15 +739,16 @@ memerr:
 }
 
 /**
- * Enqueue TCP options for transmission.
- *
- * Called by tcp_connect(), tcp_listen_input(), and tcp_send_ctrl().
+ * Enqueue a SYN or FIN segment, carrying len bytes of data (only ever on a
+ * Fast Open SYN, see tcp_enqueue_syn_data()).
  *
  * @param pcb Protocol control block for the TCP connection.
  * @param flags TCP header flags to set in the outgoing segment.
+ * @param data the data to copy into the segment (if len > 0)
+ * @param len length of data
  */
-err_t
-tcp_enqueue_flags(struct tcp_pcb *pcb, u8_t flags)
+static err_t
+tcp_enqueue_ctrl(struct tcp_pcb *pcb, u8_t flags, const void *data, u16_t len)
 {
   struct pbuf *p;
   struct tcp_seg *seg;
@@ -768,6 +769,11 @@ tcp_enqueue_flags(struct tcp_pcb *pcb, u8_t flags)
     pcb->flags |= TF_NAGLEMEMERR;
     return ERR_MEM;
   }
+  if (len > pcb->snd_buf) {
+    LWIP_DEBUGF(TCP_OUTPUT_DEBUG | LWIP_DBG_LEVEL_SEVERE, ("tcp_enqueue_flags: too much data (%"U16_F" > %"TCPWNDSIZE_F")\n",
+                                       len, pcb->snd_buf));
+    return ERR_MEM;
+  }
 
   if (flags & TCP_SYN) {
     optflags = TF_SEG_OPTS_MSS;
@@ -778,6 +784,26 @@ tcp_enqueue_flags(struct tcp_pcb *pcb, u8_t flags)
       optflags |= TF_SEG_OPTS_WND_SCALE;
     }
 #endif /* LWIP_WND_SCALE */
+#if LWIP_TCP_SACK_OUT
+    if ((pcb->state != SYN_RCVD) || (pcb->flags & TF_SACK)) {
+      /* In a <SYN,ACK> (sent in state SYN_RCVD), the SACK_PERM option may only
+         be sent if we received a SACK_PERM option from the remote host. */
+      optflags |= TF_SEG_OPTS_SACK_PERM;
+    }
+#endif /* LWIP_TCP_SACK_OUT */
+#if LWIP_TCP_TIMESTAMPS
+    if (pcb->state != SYN_RCVD) {
+      /* Offer timestamps on an active open, the <SYN,ACK> will tell whether the
+         remote host agrees (see tcp_parseopt()) */
+      optflags |= TF_SEG_OPTS_TS;
+    }
+#endif /* LWIP_TCP_TIMESTAMPS */
+#if LWIP_TCP_FASTOPEN
+    if (pcb->flags & TF_FASTOPEN) {
+      /* Present a cookie (or hand one out on a <SYN,ACK>), without one we ask for one */
+      optflags |= pcb->tfo_cookie_len ? TF_SEG_OPTS_TFO_COOKIE : TF_SEG_OPTS_TFO_REQ;
+    }
+#endif /* LWIP_TCP_FASTOPEN */
   }
 #if LWIP_TCP_TIMESTAMPS
   if ((pcb->flags & TF_TIMESTAMP)) {
@@ -788,8 +814,8 @@ tcp_enqueue_flags(struct tcp_pcb *pcb, u8_t flags)
 #endif /* LWIP_TCP_TIMESTAMPS */
   optlen = LWIP_TCP_OPT_LENGTH(optflags);
 
-  /* Allocate pbuf with room for TCP header + options */
-  if ((p = pbuf_alloc(PBUF_TRANSPORT, optlen, PBUF_RAM)) == NULL) {
+  /* Allocate pbuf with room for TCP header + options + data */
+  if ((p = pbuf_alloc(PBUF_TRANSPORT, optlen + len, PBUF_RAM)) == NULL) {
     pcb->flags |= TF_NAGLEMEMERR;
     TCP_STATS_INC(tcp.memerr);
     return ERR_MEM;
@@ -804,7 +830,10 @@ tcp_enqueue_flags(struct tcp_pcb *pcb, u8_t flags)
     return ERR_MEM;
   }
   LWIP_ASSERT("seg->tcphdr not aligned", ((mem_ptr_t)seg->tcphdr % LWIP_MIN(MEM_ALIGNMENT, 4)) == 0);
-  LWIP_ASSERT("tcp_enqueue_flags: invalid segment length", seg->len == 0);
+  LWIP_ASSERT("tcp_enqueue_flags: invalid segment length", seg->len == len);
+  if (len > 0) {
+    TCP_DATA_COPY((u8_t *)(seg->tcphdr + 1) + optlen, data, len, seg);
+  }
 
   LWIP_DEBUGF(TCP_OUTPUT_DEBUG | LWIP_DBG_TRACE,
               ("tcp_enqueue_flags: queueing %"U32_F":%"U32_F" (0x%"X16_F")\n",
@@ -830,6 +859,8 @@ tcp_enqueue_flags(struct tcp_pcb *pcb, u8_t flags)
     pcb->snd_lbb++;
     /* optlen does not influence snd_buf */
   }
+  pcb->snd_lbb += len;
+  pcb->snd_buf -= len;
   if (flags & TCP_FIN) {
     pcb->flags |= TF_FIN;
   }
@@ -845,6 +876,85 @@ tcp_enqueue_flags(struct tcp_pcb *pcb, u8_t flags)
   return ERR_OK;
 }
 
+/**
+ * Enqueue TCP options for transmission.
+ *
+ * Called by tcp_connect(), tcp_listen_input(), and tcp_send_ctrl().
+ *
+ * @param pcb Protocol control block for the TCP connection.
+ * @param flags TCP header flags to set in the outgoing segment.
+ */
+err_t
+tcp_enqueue_flags(struct tcp_pcb *pcb, u8_t flags)
+{
+  return tcp_enqueue_ctrl(pcb, flags, NULL, 0);
+}
+
+#if LWIP_TCP_FASTOPEN
+/**
+ * Enqueue a SYN carrying data, for tcp_connect_fastopen() once the remote
+ * host's cookie is known (pcb->tfo_cookie).
+ *
+ * @param pcb Protocol control block for the TCP connection.
+ * @param data the data to send on the SYN (copied)
+ * @param len length of data, at most what fits in one segment
+ */
+err_t
+tcp_enqueue_syn_data(struct tcp_pcb *pcb, const void *data, u16_t len)
+{
+  return tcp_enqueue_ctrl(pcb, TCP_SYN, data, len);
+}
+
+/**
+ * Queue the data of a Fast Open SYN the remote host did not (fully) ack as a
+ * segment of its own at the head of the unsent queue. Called in SYN_SENT once
+ * the <SYN,ACK> arrived, pcb->lastack is the ackno it carried.
+ *
+ * @param pcb Protocol control block for the TCP connection.
+ * @param syn the SYN segment (not freed here)
+ * @param offset number of bytes of syn's data already acked
+ */
+err_t
+tcp_requeue_syn_data(struct tcp_pcb *pcb, struct tcp_seg *syn, u16_t offset)
+{
+  struct pbuf *p;
+  struct tcp_seg *seg;
+  u8_t optflags = 0;
+  u8_t optlen;
+  u16_t len = syn->len - offset;
+
+#if LWIP_TCP_TIMESTAMPS
+  if (pcb->flags & TF_TIMESTAMP) {
+    optflags |= TF_SEG_OPTS_TS;
+  }
+#endif /* LWIP_TCP_TIMESTAMPS */
+  optlen = LWIP_TCP_OPT_LENGTH(optflags);
+
+  if ((p = pbuf_alloc(PBUF_TRANSPORT, optlen + len, PBUF_RAM)) == NULL) {
+    TCP_STATS_INC(tcp.memerr);
+    return ERR_MEM;
+  }
+  if ((seg = tcp_create_segment(pcb, p, 0, pcb->lastack, optflags)) == NULL) {
+    TCP_STATS_INC(tcp.memerr);
+    return ERR_MEM;
+  }
+  TCP_DATA_COPY((u8_t *)(seg->tcphdr + 1) + optlen,
+                (u8_t *)syn->tcphdr + TCPH_HDRLEN(syn->tcphdr) * 4 + offset, len, seg);
+
+#if TCP_OVERSIZE
+  if (pcb->unsent == NULL) {
+    /* The new unsent tail has no space */
+    pcb->unsent_oversize = 0;
+  }
+#endif /* TCP_OVERSIZE */
+  seg->next = pcb->unsent;
+  pcb->unsent = seg;
+  pcb->snd_queuelen += pbuf_clen(p);
+  pcb->snd_nxt = pcb->lastack;
+  return ERR_OK;
+}
+#endif /* LWIP_TCP_FASTOPEN */
+
 #if LWIP_TCP_TIMESTAMPS
 /* Build a timestamp option (12 bytes long) at the specified options pointer)
  *
@@ -874,6 +984,46 @@ tcp_build_wnd_scale_option(u32_t *opts)
 }
 #endif
 
+#if LWIP_TCP_SACK_OUT
+/** Counts the SACK ranges tcp_build_sack_option() would add, given optlen
+ * bytes of other options
+ */
+static u8_t
+tcp_get_num_sacks(struct tcp_pcb *pcb, u8_t optlen)
+{
+  u8_t num_sacks = 0;
+
+  if (pcb->flags & TF_SACK) {
+    u8_t i;
+    /* 40 bytes of options, 4 of them for the NOPs, kind and length, 8 per range */
+    u8_t max_sacks = (u8_t)((40 - optlen - 4) / 8);
+    for (i = 0; (i < LWIP_TCP_MAX_SACK_NUM) && (num_sacks < max_sacks) && LWIP_TCP_SACK_VALID(pcb, i); ++i) {
+      ++num_sacks;
+    }
+  }
+  return num_sacks;
+}
+
+/** Build a SACK option (2 + 8 * num_sacks bytes long) at the specified options pointer
+ *
+ * @param pcb tcp_pcb
+ * @param opts option pointer where to store the SACK option
+ * @param num_sacks the number of ranges to include (see tcp_get_num_sacks())
+ */
+static void
+tcp_build_sack_option(struct tcp_pcb *pcb, u32_t *opts, u8_t num_sacks)
+{
+  u8_t i;
+
+  /* Pad with two NOP options to make everything nicely aligned */
+  opts[0] = htonl(0x01010500 + 2 + num_sacks * 8);
+  for (i = 0; i < num_sacks; ++i) {
+    opts[1 + 2 * i] = htonl(pcb->rcv_sacks[i].left);
+    opts[2 + 2 * i] = htonl(pcb->rcv_sacks[i].right);
+  }
+}
+#endif
+
 /** Send an ACK without data.
  *
  * @param pcb Protocol control block for the TCP connection to send the ACK
@@ -885,15 +1035,24 @@ tcp_send_empty_ack(struct tcp_pcb *pcb)
   struct pbuf *p;
   u8_t optlen = 0;
   struct netif *netif;
-#if LWIP_TCP_TIMESTAMPS || CHECKSUM_GEN_TCP
+#if LWIP_TCP_TIMESTAMPS || LWIP_TCP_SACK_OUT || CHECKSUM_GEN_TCP
   struct tcp_hdr *tcphdr;
-#endif /* LWIP_TCP_TIMESTAMPS || CHECKSUM_GEN_TCP */
+#endif /* LWIP_TCP_TIMESTAMPS || LWIP_TCP_SACK_OUT || CHECKSUM_GEN_TCP */
+#if LWIP_TCP_SACK_OUT
+  u8_t num_sacks;
+#endif /* LWIP_TCP_SACK_OUT */
 
 #if LWIP_TCP_TIMESTAMPS
   if (pcb->flags & TF_TIMESTAMP) {
     optlen = LWIP_TCP_OPT_LENGTH(TF_SEG_OPTS_TS);
   }
 #endif
+#if LWIP_TCP_SACK_OUT
+  num_sacks = tcp_get_num_sacks(pcb, optlen);
+  if (num_sacks > 0) {
+    optlen = (u8_t)(optlen + 4 + num_sacks * 8);
+  }
+#endif
 
   p = tcp_output_alloc_header(pcb, optlen, 0, htonl(pcb->snd_nxt));
   if (p == NULL) {
@@ -902,9 +1061,9 @@ tcp_send_empty_ack(struct tcp_pcb *pcb)
     LWIP_DEBUGF(TCP_OUTPUT_DEBUG, ("tcp_output: (ACK) could not allocate pbuf\n"));
     return ERR_BUF;
   }
-#if LWIP_TCP_TIMESTAMPS || CHECKSUM_GEN_TCP
+#if LWIP_TCP_TIMESTAMPS || LWIP_TCP_SACK_OUT || CHECKSUM_GEN_TCP
   tcphdr = (struct tcp_hdr *)p->payload;
-#endif /* LWIP_TCP_TIMESTAMPS || CHECKSUM_GEN_TCP */
+#endif /* LWIP_TCP_TIMESTAMPS || LWIP_TCP_SACK_OUT || CHECKSUM_GEN_TCP */
   LWIP_DEBUGF(TCP_OUTPUT_DEBUG,
               ("tcp_output: sending ACK for %"U32_F"\n", pcb->rcv_nxt));
 
@@ -916,6 +1075,11 @@ tcp_send_empty_ack(struct tcp_pcb *pcb)
     tcp_build_timestamp_option(pcb, (u32_t *)(tcphdr + 1));
   }
 #endif
+#if LWIP_TCP_SACK_OUT
+  if (num_sacks > 0) {
+    tcp_build_sack_option(pcb, (u32_t *)(void *)((u8_t *)(tcphdr + 1) + (optlen - 4 - num_sacks * 8)), num_sacks);
+  }
+#endif
 
   netif = ip_route(&pcb->local_ip, &pcb->remote_ip);
   if (netif == NULL) {
@@ -1189,6 +1353,27 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb, struct netif *netif
     opts += 1;
   }
 #endif
+#if LWIP_TCP_SACK_OUT
+  if (seg->flags & TF_SEG_OPTS_SACK_PERM) {
+    /* Pad with two NOP options to make everything nicely aligned */
+    *(opts++) = PP_HTONL(0x01010402);
+  }
+#endif
+#if LWIP_TCP_FASTOPEN
+  if (seg->flags & TF_SEG_OPTS_TFO_REQ) {
+    *(opts++) = PP_HTONL(0x01010000 | (LWIP_TCP_OPT_FASTOPEN << 8) | 2);
+  }
+  if (seg->flags & TF_SEG_OPTS_TFO_COOKIE) {
+    /* NOPs in front make up what the cookie leaves of the last 32 bits */
+    u8_t *o = (u8_t *)opts;
+    u8_t pad = LWIP_TCP_OPT_LEN_TFO_COOKIE_OUT - LWIP_TCP_OPT_LEN_TFO_COOKIE;
+    memset(o, LWIP_TCP_OPT_NOP, pad);
+    o[pad] = LWIP_TCP_OPT_FASTOPEN;
+    o[pad + 1] = LWIP_TCP_OPT_LEN_TFO_COOKIE;
+    MEMCPY(o + pad + 2, pcb->tfo_cookie, LWIP_TCP_FASTOPEN_COOKIE_LEN);
+    opts += LWIP_TCP_OPT_LEN_TFO_COOKIE_OUT / 4;
+  }
+#endif /* LWIP_TCP_FASTOPEN */
 
   /* Set retransmission timer running if it is not currently enabled
      This must be set before checking the route. */
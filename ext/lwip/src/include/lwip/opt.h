@@ -719,6 +719,25 @@
 #define IP_REASS_MAX_PBUFS              10
 #endif
 
+/**
+ * IP_REASS_PBUF_LIMIT: The limit on pbufs waiting to be reassembled actually
+ * applied (to IPv4 and IPv6 each). May be an expression evaluated at runtime,
+ * which must not exceed IP_REASS_MAX_PBUFS.
+ */
+#if !defined IP_REASS_PBUF_LIMIT || defined __DOXYGEN__
+#define IP_REASS_PBUF_LIMIT             IP_REASS_MAX_PBUFS
+#endif
+
+/**
+ * IP_REASS_BUCKETS: Number of hash buckets (by fragment identification) the
+ * datagrams waiting to be reassembled are kept in, so finding the one a
+ * fragment belongs to doesn't take a walk over all of them. 1 keeps them in
+ * a single list.
+ */
+#if !defined IP_REASS_BUCKETS || defined __DOXYGEN__
+#define IP_REASS_BUCKETS                1
+#endif
+
 /**
  * IP_FRAG_USES_STATIC_BUF==1: Use a static MTU-sized buffer for IP
  * fragmentation. Otherwise pbufs are allocated and reference the original
@@ -1181,6 +1200,31 @@
 #define TCP_SYNMAXRTX                   6
 #endif
 
+/**
+ * TCP_RTO_INITIAL: Retransmission time-out (in milliseconds) of a connection
+ * before its first round-trip time measurement.
+ */
+#if !defined TCP_RTO_INITIAL || defined __DOXYGEN__
+#define TCP_RTO_INITIAL                 3000
+#endif
+
+/**
+ * TCP_RTO_MIN: Default floor (in milliseconds) of a connection's retransmission
+ * time-out, see tcp_set_rto_min(). 0 leaves it to the round-trip time estimate.
+ * The time-out can't be finer than TCP_SLOW_INTERVAL either way.
+ */
+#if !defined TCP_RTO_MIN || defined __DOXYGEN__
+#define TCP_RTO_MIN                     0
+#endif
+
+/**
+ * TCP_RTO_MAX: Ceiling (in milliseconds) of the retransmission time-out as it
+ * is backed off.
+ */
+#if !defined TCP_RTO_MAX || defined __DOXYGEN__
+#define TCP_RTO_MAX                     60000
+#endif
+
 /**
  * TCP_QUEUE_OOSEQ==1: TCP will queue segments that arrive out of order.
  * Define to 0 if your device is low on memory.
@@ -1307,6 +1351,54 @@
 #define LWIP_TCP_TIMESTAMPS             0
 #endif
 
+/**
+ * LWIP_TCP_SACK_OUT==1: TCP will support sending selective acknowledgements (SACKs).
+ * Only the receiver side is implemented: out-of-sequence data queued on
+ * ->ooseq is reported to the remote host, lost segments are still only
+ * recovered by fast retransmit and RTO on our side.
+ */
+#if !defined LWIP_TCP_SACK_OUT || defined __DOXYGEN__
+#define LWIP_TCP_SACK_OUT               0
+#endif
+
+/**
+ * LWIP_TCP_MAX_SACK_NUM: The maximum number of SACK values to include in TCP segments.
+ * Must be at least 1, but is only used if LWIP_TCP_SACK_OUT is enabled.
+ * NOTE: Even though we never send more than 3 or 4 SACK ranges in a single segment
+ * (depending on other options), setting this option to values greater than 4 is not pointless.
+ * This is basically the max number of SACK ranges we want to keep track of.
+ */
+#if !defined LWIP_TCP_MAX_SACK_NUM || defined __DOXYGEN__
+#define LWIP_TCP_MAX_SACK_NUM           4
+#endif
+
+/**
+ * LWIP_TCP_FASTOPEN==1: TCP Fast Open (RFC 7413). Listeners enabled with
+ * tcp_fastopen() hand out cookies and accept data on SYNs which carry a valid
+ * one, tcp_connect_fastopen() sends data on the SYN once a cookie from the
+ * remote host is cached. Cookies are made by LWIP_HOOK_TCP_FASTOPEN_COOKIE(),
+ * which has to be defined.
+ */
+#if !defined LWIP_TCP_FASTOPEN || defined __DOXYGEN__
+#define LWIP_TCP_FASTOPEN               0
+#endif
+
+/**
+ * LWIP_TCP_FASTOPEN_COOKIE_LEN: The length of the cookies we hand out, and the
+ * only length of those we accept from remote hosts. Must be even, 4 to 16.
+ */
+#if !defined LWIP_TCP_FASTOPEN_COOKIE_LEN || defined __DOXYGEN__
+#define LWIP_TCP_FASTOPEN_COOKIE_LEN    8
+#endif
+
+/**
+ * LWIP_TCP_FASTOPEN_CACHE_SIZE: The number of remote hosts whose cookies are
+ * kept, the least recently used one makes room for a new one.
+ */
+#if !defined LWIP_TCP_FASTOPEN_CACHE_SIZE || defined __DOXYGEN__
+#define LWIP_TCP_FASTOPEN_CACHE_SIZE    16
+#endif
+
 /**
  * TCP_WND_UPDATE_THRESHOLD: difference in window to trigger an
  * explicit window update
@@ -1382,6 +1474,16 @@
 #if !defined PBUF_POOL_BUFSIZE || defined __DOXYGEN__
 #define PBUF_POOL_BUFSIZE               LWIP_MEM_ALIGN_SIZE(TCP_MSS+40+PBUF_LINK_ENCAPSULATION_HLEN+PBUF_LINK_HLEN)
 #endif
+
+/**
+ * LWIP_PBUF_RX_STAMP==1: add an rx_stamp field to struct pbuf which the netif
+ * driver may set to the arrival time of a received packet. It is zeroed by
+ * pbuf_alloc() and pbuf_alloced_custom() and only meaningful in the first pbuf
+ * of a packet.
+ */
+#if !defined LWIP_PBUF_RX_STAMP || defined __DOXYGEN__
+#define LWIP_PBUF_RX_STAMP              0
+#endif
 /**
  * @}
  */
@@ -2478,6 +2580,30 @@
 #define LWIP_HOOK_IP6_ROUTE(src, dest)
 #endif
 
+/**
+ * LWIP_HOOK_TCP_FASTOPEN_COOKIE(remote_ip, cookie):
+ * - called from tcp_listen_input() when LWIP_TCP_FASTOPEN is enabled
+ * - remote_ip: the address of the host asking for (or presenting) a cookie
+ * - cookie: u8_t[LWIP_TCP_FASTOPEN_COOKIE_LEN] to fill in
+ * The cookie has to be the same for the same address and impossible for
+ * anyone else to guess, e.g. a MAC of the address under a secret key.
+ */
+#ifdef __DOXYGEN__
+#define LWIP_HOOK_TCP_FASTOPEN_COOKIE(remote_ip, cookie)
+#endif
+
+/**
+ * LWIP_HOOK_TCP_PATH_MTU(netif, dest):
+ * - called from tcp_eff_send_mss_impl() (TCP_CALCULATE_EFF_SEND_MSS)
+ * - netif: struct netif * the segments to dest are sent on
+ * - dest: const ip_addr_t * the remote address
+ * Returns the MTU of the path to dest (0 if unknown). The MSS sent and used
+ * is calculated from it in place of the netif's mtu when it is smaller.
+ */
+#ifdef __DOXYGEN__
+#define LWIP_HOOK_TCP_PATH_MTU(netif, dest)
+#endif
+
 /**
  * LWIP_HOOK_VLAN_CHECK(netif, eth_hdr, vlan_hdr):
  * - called from ethernet_input() if VLAN support is enabled
@@ -146,6 +146,11 @@ struct pbuf {
    * the stack itself, or pbuf->next pointers from a chain.
    */
   u16_t ref;
+
+#if LWIP_PBUF_RX_STAMP
+  /** arrival time of a received packet as set by the netif driver, 0 if unknown */
+  uint64_t rx_stamp;
+#endif /* LWIP_PBUF_RX_STAMP */
 };
 
 
@@ -305,6 +305,9 @@ struct tcp_seg {
 #define TF_SEG_DATA_CHECKSUMMED (u8_t)0x04U /* ALL data (not the header) is
                                                checksummed into 'chksum' */
 #define TF_SEG_OPTS_WND_SCALE   (u8_t)0x08U /* Include WND SCALE option */
+#define TF_SEG_OPTS_SACK_PERM   (u8_t)0x10U /* Include SACK Permitted option */
+#define TF_SEG_OPTS_TFO_REQ     (u8_t)0x20U /* Include an empty Fast Open option (cookie request) */
+#define TF_SEG_OPTS_TFO_COOKIE  (u8_t)0x40U /* Include a Fast Open option with pcb->tfo_cookie */
   struct tcp_hdr *tcphdr;  /* the TCP header */
 };
 
@@ -312,7 +315,10 @@ struct tcp_seg {
 #define LWIP_TCP_OPT_NOP        1
 #define LWIP_TCP_OPT_MSS        2
 #define LWIP_TCP_OPT_WS         3
+#define LWIP_TCP_OPT_SACK_PERM  4
+#define LWIP_TCP_OPT_SACK       5
 #define LWIP_TCP_OPT_TS         8
+#define LWIP_TCP_OPT_FASTOPEN   34
 
 #define LWIP_TCP_OPT_LEN_MSS    4
 #if LWIP_TCP_TIMESTAMPS
@@ -327,11 +333,28 @@ struct tcp_seg {
 #else
 #define LWIP_TCP_OPT_LEN_WS_OUT 0
 #endif
+#if LWIP_TCP_SACK_OUT
+#define LWIP_TCP_OPT_LEN_SACK_PERM     2
+#define LWIP_TCP_OPT_LEN_SACK_PERM_OUT 4 /* aligned for output (includes NOP padding) */
+#else
+#define LWIP_TCP_OPT_LEN_SACK_PERM_OUT 0
+#endif
+#if LWIP_TCP_FASTOPEN
+#define LWIP_TCP_OPT_LEN_TFO_REQ_OUT    4 /* aligned for output (includes NOP padding) */
+#define LWIP_TCP_OPT_LEN_TFO_COOKIE     (2 + LWIP_TCP_FASTOPEN_COOKIE_LEN)
+#define LWIP_TCP_OPT_LEN_TFO_COOKIE_OUT ((LWIP_TCP_OPT_LEN_TFO_COOKIE + 3) & ~3)
+#else
+#define LWIP_TCP_OPT_LEN_TFO_REQ_OUT    0
+#define LWIP_TCP_OPT_LEN_TFO_COOKIE_OUT 0
+#endif
 
 #define LWIP_TCP_OPT_LENGTH(flags) \
   (flags & TF_SEG_OPTS_MSS       ? LWIP_TCP_OPT_LEN_MSS    : 0) + \
   (flags & TF_SEG_OPTS_TS        ? LWIP_TCP_OPT_LEN_TS_OUT : 0) + \
-  (flags & TF_SEG_OPTS_WND_SCALE ? LWIP_TCP_OPT_LEN_WS_OUT : 0)
+  (flags & TF_SEG_OPTS_WND_SCALE ? LWIP_TCP_OPT_LEN_WS_OUT : 0) + \
+  (flags & TF_SEG_OPTS_SACK_PERM ? LWIP_TCP_OPT_LEN_SACK_PERM_OUT : 0) + \
+  (flags & TF_SEG_OPTS_TFO_REQ   ? LWIP_TCP_OPT_LEN_TFO_REQ_OUT : 0) + \
+  (flags & TF_SEG_OPTS_TFO_COOKIE ? LWIP_TCP_OPT_LEN_TFO_COOKIE_OUT : 0)
 
 /** This returns a TCP header option for MSS in an u32_t */
 #define TCP_BUILD_MSS_OPTION(mss) htonl(0x02040000 | ((mss) & 0xFFFF))
@@ -469,11 +492,21 @@ void tcp_pcb_remove(struct tcp_pcb **pcblist, struct tcp_pcb *pcb);
 
 void tcp_segs_free(struct tcp_seg *seg);
 void tcp_seg_free(struct tcp_seg *seg);
+#if TCP_QUEUE_OOSEQ
+void tcp_free_ooseq(struct tcp_pcb *pcb);
+#endif /* TCP_QUEUE_OOSEQ */
+#if LWIP_TCP_FASTOPEN
+u8_t tcp_fastopen_cache_get(const ip_addr_t *addr, u8_t *cookie);
+void tcp_fastopen_cache_put(const ip_addr_t *addr, const u8_t *cookie);
+void tcp_fastopen_accepted(struct tcp_pcb *pcb);
+err_t tcp_enqueue_syn_data(struct tcp_pcb *pcb, const void *data, u16_t len);
+err_t tcp_requeue_syn_data(struct tcp_pcb *pcb, struct tcp_seg *syn, u16_t offset);
+#endif /* LWIP_TCP_FASTOPEN */
 struct tcp_seg *tcp_seg_copy(struct tcp_seg *seg);
 
 #define tcp_ack(pcb)                               \
   do {                                             \
-    if((pcb)->flags & TF_ACK_DELAY) {              \
+    if((pcb)->flags & (TF_ACK_DELAY | TF_QUICKACK)) { \
       (pcb)->flags &= ~TF_ACK_DELAY;               \
       (pcb)->flags |= TF_ACK_NOW;                  \
     }                                              \
@@ -482,6 +515,19 @@ struct tcp_seg *tcp_seg_copy(struct tcp_seg *seg);
     }                                              \
   } while (0)
 
+/* Sets pcb->rto to r (in ticks), kept within pcb->rto_min and TCP_RTO_MAX */
+#define tcp_set_rto(pcb, r)                        \
+  do {                                             \
+    s32_t rto_ = (s32_t)(r);                       \
+    if (rto_ < (pcb)->rto_min) {                   \
+      rto_ = (pcb)->rto_min;                       \
+    }                                              \
+    if (rto_ > TCP_RTO_MAX / TCP_SLOW_INTERVAL) {  \
+      rto_ = TCP_RTO_MAX / TCP_SLOW_INTERVAL;      \
+    }                                              \
+    (pcb)->rto = (s16_t)rto_;                      \
+  } while (0)
+
 #define tcp_ack_now(pcb)                           \
   do {                                             \
     (pcb)->flags |= TF_ACK_NOW;                    \
@@ -145,11 +145,7 @@ typedef u32_t tcpwnd_size_t;
 typedef u16_t tcpwnd_size_t;
 #endif
 
-#if LWIP_WND_SCALE || TCP_LISTEN_BACKLOG
 typedef u16_t tcpflags_t;
-#else
-typedef u8_t tcpflags_t;
-#endif
 
 enum tcp_state {
   CLOSED      = 0,
@@ -165,6 +161,17 @@ enum tcp_state {
   TIME_WAIT   = 10
 };
 
+#if LWIP_TCP_SACK_OUT
+/** SACK ranges to include in ACK packets.
+ * SACK entry is invalid if left==right. */
+struct tcp_sack_range {
+  /** Left edge of the SACK: the first acknowledged sequence number. */
+  u32_t left;
+  /** Right edge of the SACK: the last acknowledged sequence number +1 (so first NOT acknowledged). */
+  u32_t right;
+};
+#endif /* LWIP_TCP_SACK_OUT */
+
 /**
  * members common to struct tcp_pcb and struct tcp_listen_pcb
  */
@@ -193,6 +200,13 @@ struct tcp_pcb_listen {
   u8_t backlog;
   u8_t accepts_pending;
 #endif /* TCP_LISTEN_BACKLOG */
+
+#if LWIP_TCP_FASTOPEN
+  /* Most connections accepted with data on their SYN but not yet on an ACK,
+     0 if Fast Open is off */
+  u16_t fastopen_qlen;
+  u16_t fastopen_pending;
+#endif /* LWIP_TCP_FASTOPEN */
 };
 
 
@@ -215,11 +229,19 @@ struct tcp_pcb {
 #define TF_FIN         0x20U   /* Connection was closed locally (FIN segment enqueued). */
 #define TF_NODELAY     0x40U   /* Disable Nagle algorithm */
 #define TF_NAGLEMEMERR 0x80U   /* nagle enabled, memerr, try to output to prevent delayed ACK to happen */
+#define TF_QUICKACK    0x0400U /* Ack every segment right away, see tcp_quickack_enable() */
 #if LWIP_WND_SCALE
 #define TF_WND_SCALE   0x0100U /* Window Scale option enabled */
 #endif
 #if TCP_LISTEN_BACKLOG
 #define TF_BACKLOGPEND 0x0200U /* If this is set, a connection pcb has increased the backlog on its listener */
+#endif
+#if LWIP_TCP_SACK_OUT
+#define TF_SACK        0x1000U /* Selective ACKs enabled */
+#endif
+#if LWIP_TCP_FASTOPEN
+#define TF_FASTOPEN     0x2000U /* Our SYN (or SYN|ACK) carries the Fast Open option */
+#define TF_FASTOPEN_ACC 0x4000U /* Accepted on its SYN, counted in the listener's fastopen_pending */
 #endif
 
   /* the rest of the fields are in host byte order
@@ -247,8 +269,14 @@ struct tcp_pcb {
   s16_t sa, sv; /* @todo document this */
 
   s16_t rto;    /* retransmission time-out */
+  s16_t rto_min; /* floor of rto, see tcp_set_rto_min() */
   u8_t nrtx;    /* number of retransmissions */
 
+  /* Sent data may stay unacknowledged for user_timeout ms (0: no limit but
+     TCP_MAXRTX), utmr is the tcp_ticks when nothing was outstanding last */
+  u32_t user_timeout;
+  u32_t utmr;
+
   /* fast retransmit/recovery */
   u8_t dupacks;
   u32_t lastack; /* Highest acknowledged seqno. */
@@ -279,6 +307,11 @@ struct tcp_pcb {
   struct tcp_seg *unacked;  /* Sent but unacknowledged segments. */
 #if TCP_QUEUE_OOSEQ
   struct tcp_seg *ooseq;    /* Received out of sequence segments. */
+#if LWIP_TCP_SACK_OUT
+  /* SACK ranges to include in ACK packets (entry is invalid if left==right) */
+  struct tcp_sack_range rcv_sacks[LWIP_TCP_MAX_SACK_NUM];
+#define LWIP_TCP_SACK_VALID(pcb, idx) ((pcb)->rcv_sacks[idx].left != (pcb)->rcv_sacks[idx].right)
+#endif /* LWIP_TCP_SACK_OUT */
 #endif /* TCP_QUEUE_OOSEQ */
 
   struct pbuf *refused_data; /* Data previously received but not yet taken by upper layer */
@@ -324,6 +357,13 @@ struct tcp_pcb {
   u8_t snd_scale;
   u8_t rcv_scale;
 #endif
+
+#if LWIP_TCP_FASTOPEN
+  /* The cookie our SYN presents, or our SYN|ACK hands out (see TF_FASTOPEN),
+     none if tfo_cookie_len is 0 */
+  u8_t tfo_cookie[LWIP_TCP_FASTOPEN_COOKIE_LEN];
+  u8_t tfo_cookie_len;
+#endif /* LWIP_TCP_FASTOPEN */
 };
 
 #if LWIP_EVENT_API
@@ -365,6 +405,14 @@ void             tcp_err     (struct tcp_pcb *pcb, tcp_err_fn err);
 #define          tcp_nagle_enable(pcb)    ((pcb)->flags = (tcpflags_t)((pcb)->flags & ~TF_NODELAY))
 /** @ingroup tcp_raw */
 #define          tcp_nagle_disabled(pcb)  (((pcb)->flags & TF_NODELAY) != 0)
+/** @ingroup tcp_raw */
+#define          tcp_quickack_enable(pcb)  ((pcb)->flags |= TF_QUICKACK)
+/** @ingroup tcp_raw */
+#define          tcp_quickack_disable(pcb) ((pcb)->flags = (tcpflags_t)((pcb)->flags & ~TF_QUICKACK))
+/** @ingroup tcp_raw */
+#define          tcp_quickack_enabled(pcb) (((pcb)->flags & TF_QUICKACK) != 0)
+/** @ingroup tcp_raw */
+#define          tcp_set_user_timeout(pcb, ms) ((pcb)->user_timeout = (u32_t)(ms))
 
 #if TCP_LISTEN_BACKLOG
 #define          tcp_backlog_set(pcb, new_backlog) do { \
@@ -385,6 +433,14 @@ err_t            tcp_bind    (struct tcp_pcb *pcb, const ip_addr_t *ipaddr,
 err_t            tcp_connect (struct tcp_pcb *pcb, const ip_addr_t *ipaddr,
                               u16_t port, tcp_connected_fn connected);
 
+#if LWIP_TCP_FASTOPEN
+err_t            tcp_connect_fastopen(struct tcp_pcb *pcb, const ip_addr_t *ipaddr,
+                              u16_t port, tcp_connected_fn connected,
+                              const void *data, u16_t *len);
+void             tcp_fastopen(struct tcp_pcb *pcb, u16_t qlen);
+void             tcp_fastopen_flush(void);
+#endif /* LWIP_TCP_FASTOPEN */
+
 struct tcp_pcb * tcp_listen_with_backlog(struct tcp_pcb *pcb, u8_t backlog);
 /** @ingroup tcp_raw */
 #define          tcp_listen(pcb) tcp_listen_with_backlog(pcb, TCP_DEFAULT_LISTEN_BACKLOG)
@@ -401,6 +457,7 @@ err_t            tcp_write   (struct tcp_pcb *pcb, const void *dataptr, u16_t le
                               u8_t apiflags);
 
 void             tcp_setprio (struct tcp_pcb *pcb, u8_t prio);
+void             tcp_set_rto_min(struct tcp_pcb *pcb, u32_t ms);
 
 #define TCP_PRIO_MIN    1
 #define TCP_PRIO_NORMAL 64
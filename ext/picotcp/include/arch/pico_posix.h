@@ -49,6 +49,18 @@ static inline void pico_free(void *x)
     cur_mem -= *ptr;
     free(ptr);
 }
+#elif defined ZT_ARENA
+/* libzt's size-class arena, see src/Arena.cpp */
+#ifdef __cplusplus
+extern "C" {
+#endif
+void *zt_arena_zalloc(size_t sz);
+void zt_arena_free(void *p);
+#ifdef __cplusplus
+}
+#endif
+#define pico_zalloc(x) zt_arena_zalloc((size_t)(x))
+#define pico_free(x) zt_arena_free(x)
 #else
 #define pico_zalloc(x) calloc(x, 1)
 #define pico_free(x) free(x)
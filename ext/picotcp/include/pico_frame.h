@@ -53,6 +53,9 @@ struct pico_frame {
 
     pico_time timestamp;
 
+    /* When an incoming frame reached the device driver (see pico_stack_set_rx_stamp()), 0 if unknown */
+    uint64_t rx_stamp;
+
     /* Failures due to bad datalink addressing. */
     uint16_t failure_count;
 
@@ -82,6 +82,8 @@ struct pico_socket {
     uint16_t opt_flags;
     pico_time timestamp;
     void *priv;
+    uint8_t tos; /* IP TOS / traffic class of every frame sent, unless the frame sets its own */
+    uint64_t rx_stamp; /* arrival time of the last segment delivered to the socket, see pico_frame.rx_stamp */
 };
 
 struct pico_remote_endpoint {
@@ -150,6 +152,7 @@ struct pico_ip_mreq_source {
 
 # define PICO_SOCKET_OPT_RCVBUF               52
 # define PICO_SOCKET_OPT_SNDBUF               53
+# define PICO_SOCKET_OPT_TOS                  54
 
 
 /* Constants */
@@ -175,6 +178,7 @@ struct pico_msginfo {
     struct pico_device *dev;
     uint8_t ttl;
     uint8_t tos;
+    uint64_t rx_stamp; /* see pico_frame.rx_stamp */
 };
 
 #ifdef __cplusplus
@@ -259,6 +263,8 @@ int pico_is_port_free(uint16_t proto, uint16_t port, void *addr, void *net);
 struct pico_sockport *pico_get_sockport(uint16_t proto, uint16_t port);
 
 uint32_t pico_socket_get_mss(struct pico_socket *s);
+/* Path MTU to a socket's remote host (0 if unknown), TCP's MSS is clamped to it when smaller */
+void pico_socket_set_path_mtu_hook(uint32_t (*hook)(struct pico_device *dev, union pico_address *remote, int ipv6));
 int pico_socket_set_family(struct pico_socket *s, uint16_t family);
 
 int pico_count_sockets(uint8_t proto);
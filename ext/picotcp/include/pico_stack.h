@@ -53,6 +53,8 @@ int32_t pico_sendto_dev(struct pico_frame *f);
  * Incoming packet will be processed later on in the dev loop.
  * The zerocopy version will associate the current buffer to the newly created frame.
  * Warning: the buffer used in the zerocopy version MUST have been allocated using PICO_ZALLOC()
+ * The _notify version passes the buffer to notify_free once the stack is done with it, unless
+ * it returns -1: then the buffer was never taken and is still the caller's.
  */
 
 #ifdef __cplusplus
@@ -64,6 +66,8 @@ int32_t pico_stack_recv_zerocopy(struct pico_device *dev, uint8_t *buffer, uint3
 int32_t pico_stack_recv_zerocopy_ext_buffer(struct pico_device *dev, uint8_t *buffer, uint32_t len);
 int32_t pico_stack_recv_zerocopy_ext_buffer_notify(struct pico_device *dev, uint8_t *buffer, uint32_t len, void (*notify_free)(uint8_t *buffer));
 struct pico_frame *pico_stack_recv_new_frame(struct pico_device *dev, uint8_t *buffer, uint32_t len);
+/* Arrival time given to frames received from now on (see pico_frame.rx_stamp), 0 for none */
+void pico_stack_set_rx_stamp(uint64_t stamp);
 
 /* ----- Initialization ----- */
 int pico_stack_init(void);
@@ -89,6 +93,7 @@ extern "C" {
 #endif
 
 int pico_ntimers();
+int pico_timers_next_ms(void);
 
 #ifdef __cplusplus
 }
@@ -339,6 +339,7 @@ static int pico_fragments_reassemble(struct pico_tree *tree, unsigned int len, u
         full->transport_hdr = full->net_hdr + full->net_len;
         full->transport_len = (uint16_t)len;
         full->dev = first->dev;
+        full->rx_stamp = first->rx_stamp;
         pico_tree_foreach_safe(index, tree, tmp) {
             f = index->keyValue;
             memcpy(full->transport_hdr + bookmark, f->transport_hdr, f->transport_len);
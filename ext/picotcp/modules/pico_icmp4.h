@@ -142,9 +142,17 @@ int pico_icmp4_dest_unreachable(struct pico_frame *f);
 int pico_icmp4_mtu_exceeded(struct pico_frame *f);
 int pico_icmp4_ttl_expired(struct pico_frame *f);
 int pico_icmp4_frag_expired(struct pico_frame *f);
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 int pico_icmp4_ping(char *dst, int count, int interval, int timeout, int size, void (*cb)(struct pico_icmp4_stats *));
 int pico_icmp4_ping_abort(int id);
 
+#ifdef __cplusplus
+}
+#endif
+
 #ifdef PICO_SUPPORT_ICMP4
 int pico_icmp4_packet_filtered(struct pico_frame *f);
 int pico_icmp4_param_problem(struct pico_frame *f, uint8_t code);
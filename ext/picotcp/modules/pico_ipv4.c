@@ -1056,7 +1056,7 @@ int pico_ipv4_frame_push(struct pico_frame *f, struct pico_ip4 *dst, uint8_t pro
     hdr->dst.addr = dst->addr;
     hdr->src.addr = link->address.addr;
     hdr->ttl = ttl;
-    hdr->tos = f->send_tos;
+    hdr->tos = f->send_tos ? f->send_tos : (f->sock ? f->sock->tos : 0);
     hdr->proto = proto;
     hdr->frag = short_be(PICO_IPV4_DONTFRAG);
 
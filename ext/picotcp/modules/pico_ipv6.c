@@ -1295,6 +1295,8 @@ static inline void ipv6_push_hdr_adjust(struct pico_frame *f, struct pico_ipv6_l
 
     if (f->send_tos) {
         hdr->vtf |= ((uint32_t)f->send_tos << 20u);
+    } else if (f->sock && f->sock->tos) {
+        hdr->vtf |= long_be((uint32_t)f->sock->tos << 20u);
     }
 
     /* make adjustments to defaults according to proto */
@@ -230,9 +230,17 @@ static struct pico_eth *pico_nd_get_neighbor(struct pico_ip6 *addr, struct pico_
     return &n->hwaddr.mac;
 }
 
+static int (*pico_nd_resolver)(struct pico_device *dev, struct pico_ip6 *addr, struct pico_eth *mac) = NULL;
+
+void pico_ipv6_nd_set_resolver(int (*resolver)(struct pico_device *dev, struct pico_ip6 *addr, struct pico_eth *mac))
+{
+    pico_nd_resolver = resolver;
+}
+
 static struct pico_eth *pico_nd_get(struct pico_ip6 *address, struct pico_device *dev)
 {
     struct pico_ip6 gateway = {{0}}, addr = {{0}};
+    static struct pico_eth resolved;
 
     /* should we use gateway, or is dst local (gateway == 0)? */
     gateway = pico_ipv6_route_get_gateway(address);
@@ -241,6 +249,10 @@ static struct pico_eth *pico_nd_get(struct pico_ip6 *address, struct pico_device
     else
         addr = gateway;
 
+    /* the link layer address may be known without asking, the caller copies it right away */
+    if (pico_nd_resolver && pico_nd_resolver(dev, &addr, &resolved) == 0)
+        return &resolved;
+
     return pico_nd_get_neighbor(&addr, pico_nd_find_neighbor(&addr), dev);
 }
 
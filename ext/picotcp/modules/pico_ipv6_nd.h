@@ -27,6 +27,8 @@ void pico_ipv6_nd_init(void);
 struct pico_eth *pico_ipv6_get_neighbor(struct pico_frame *f);
 void pico_ipv6_nd_postpone(struct pico_frame *f);
 int pico_ipv6_nd_recv(struct pico_frame *f);
+/* Resolves a neighbor without soliciting it when resolver returns 0 (having filled in mac) */
+void pico_ipv6_nd_set_resolver(int (*resolver)(struct pico_device *dev, struct pico_ip6 *addr, struct pico_eth *mac));
 
 #ifdef PICO_SUPPORT_6LOWPAN
 int pico_6lp_nd_start_soliciting(struct pico_ipv6_link *l, struct pico_ipv6_route *gw);
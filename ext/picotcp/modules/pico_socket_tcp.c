@@ -180,6 +180,9 @@ static struct pico_socket *socket_tcp_deliver_ipv6(struct pico_socket *s, struct
 static int socket_tcp_do_deliver(struct pico_socket *s, struct pico_frame *f)
 {
     if (s != NULL) {
+        if (f->rx_stamp)
+            s->rx_stamp = f->rx_stamp;
+
         pico_tcp_input(s, f);
         if ((s->ev_pending) && s->wakeup) {
             s->wakeup(s->ev_pending, s);
@@ -266,6 +266,44 @@ struct tcp_sack_block {
     struct tcp_sack_block *next;
 };
 
+/* Congestion control state, see struct pico_tcp_cc */
+#define PICO_TCP_BBR_ROUNDS 10
+
+struct tcp_cubic {
+    uint32_t w_max;      /* cwnd before the last reduction */
+    uint32_t origin;     /* where the cubic plateaus, w_max or cwnd if that was higher */
+    uint32_t k;          /* ms from the start of the epoch until it reaches origin */
+    uint32_t acks;       /* segments acked since cwnd last grew */
+    pico_time epoch;     /* start of the current congestion avoidance epoch, 0 if none */
+};
+
+struct tcp_bbr {
+    uint32_t bw[PICO_TCP_BBR_ROUNDS]; /* delivery rate (segments/s) of each of the last rounds */
+    uint32_t full_bw;    /* rate startup last grew by a quarter to */
+    uint32_t delivered;  /* segments acked this round */
+    uint32_t min_rtt;    /* ms */
+    pico_time min_rtt_stamp;
+    pico_time round_start;
+    uint8_t round;       /* index into bw[] and the gain cycle */
+    uint8_t full_bw_rounds;
+    uint8_t filled;      /* startup found the bottleneck rate */
+};
+
+struct pico_socket_tcp;
+
+/* Congestion control algorithms. cwnd and ssthresh count segments, ack() is called for every
+ * ACK while in look-ahead mode with the number of segments it acked, recover() when fast
+ * recovery starts (cwnd already set to what is in flight), timeout() on a retransmission
+ * timeout before cwnd is reset, rtt() with every RTT sample. All but ack() may be NULL */
+struct pico_tcp_cc {
+    const char *name;
+    void (*init)(struct pico_socket_tcp *t);
+    void (*ack)(struct pico_socket_tcp *t, uint32_t acked);
+    void (*recover)(struct pico_socket_tcp *t);
+    void (*timeout)(struct pico_socket_tcp *t);
+    void (*rtt)(struct pico_socket_tcp *t, uint32_t rtt);
+};
+
 struct pico_socket_tcp {
     struct pico_socket sock;
 
@@ -293,6 +331,11 @@ struct pico_socket_tcp {
     uint16_t ssthresh;
     uint16_t recv_wnd;
     uint16_t recv_wnd_scale;
+    const struct pico_tcp_cc *cc;
+    union {
+        struct tcp_cubic cubic;
+        struct tcp_bbr bbr;
+    } cc_state;
 
     /* tcp_input */
     uint32_t rcv_nxt;
@@ -319,8 +362,9 @@ struct pico_socket_tcp {
     uint8_t backoff;
     uint8_t localZeroWindow;
 
-    /* Keepalive */
-    uint32_t keepalive_tmr;
+    /* Keepalive, see tcp_ka_schedule() */
+    struct pico_socket_tcp *ka_next;
+    struct pico_socket_tcp **ka_pprev;
     pico_time ack_timestamp;
     uint32_t ka_time;
     uint32_t ka_intvl;
@@ -329,8 +373,14 @@ struct pico_socket_tcp {
 
     /* FIN timer */
     uint32_t fin_tmr;
+
+    /* Statistics */
+    uint32_t retrans_count;
 };
 
+static const struct pico_tcp_cc tcp_cc_reno;
+static void tcp_cc_select(struct pico_socket_tcp *t, const struct pico_tcp_cc *cc);
+
 /* Queues */
 static struct pico_queue tcp_in = {
     0
@@ -1000,40 +1050,159 @@ static void sock_stats(uint32_t when, void *arg)
 
 static void tcp_send_probe(struct pico_socket_tcp *t);
 
-static void pico_tcp_keepalive(pico_time now, void *arg)
+/* Sockets with keepalive on wait in a wheel of one second slots, served by one shared timer
+ * which only runs while the wheel isn't empty. A socket is due at the end of its idle time
+ * (or probe interval); traffic since only moves that later, so each slot is simply rechecked
+ * when reached and its sockets put back where they are due next. An idle connection costs
+ * one check per keepalive period rather than a timer firing every second */
+#define PICO_TCP_KA_SLOTS 64
+
+static struct pico_socket_tcp *tcp_ka_wheel[PICO_TCP_KA_SLOTS];
+static uint32_t tcp_ka_count;
+static uint32_t tcp_ka_tmr;
+static pico_time tcp_ka_last; /* last second whose slot was served */
+
+static void tcp_ka_tick(pico_time now, void *arg);
+
+static void tcp_ka_unlink(struct pico_socket_tcp *t)
 {
-    struct pico_socket_tcp *t = (struct pico_socket_tcp *)arg;
-    if (((t->sock.state & PICO_SOCKET_STATE_TCP) == PICO_SOCKET_STATE_TCP_ESTABLISHED)  && (t->ka_time > 0)) {
-        if (t->ka_time < (now - t->ack_timestamp)) {
-            if (t->ka_retries_count == 0) {
-                /* First probe */
-                tcp_send_probe(t);
-                t->ka_retries_count++;
-            }
+    if (!t->ka_pprev)
+        return;
 
-            if (t->ka_retries_count > t->ka_probes) {
-                if (t->sock.wakeup)
-                {
-                    pico_err = PICO_ERR_ECONNRESET;
-                    t->sock.wakeup(PICO_SOCK_EV_ERR, &t->sock);
-                }
-            }
+    *t->ka_pprev = t->ka_next;
+    if (t->ka_next)
+        t->ka_next->ka_pprev = t->ka_pprev;
 
-            if (((t->ka_retries_count * (pico_time)t->ka_intvl) + t->ka_time) < (now - t->ack_timestamp)) {
-                /* Next probe */
-                tcp_send_probe(t);
-                t->ka_retries_count++;
-            }
-        } else {
-            t->ka_retries_count = 0;
-        }
+    t->ka_next = NULL;
+    t->ka_pprev = NULL;
+}
+
+static void tcp_ka_link(struct pico_socket_tcp **head, struct pico_socket_tcp *t)
+{
+    t->ka_next = *head;
+    if (t->ka_next)
+        t->ka_next->ka_pprev = &t->ka_next;
+
+    *head = t;
+    t->ka_pprev = head;
+}
+
+static void tcp_ka_remove(struct pico_socket_tcp *t)
+{
+    if (!t->ka_pprev)
+        return;
+
+    tcp_ka_unlink(t);
+    if (--tcp_ka_count == 0 && tcp_ka_tmr) {
+        pico_timer_cancel(tcp_ka_tmr);
+        tcp_ka_tmr = 0;
     }
+}
+
+static void tcp_ka_schedule(struct pico_socket_tcp *t, pico_time due)
+{
+    pico_time sec = due / 1000u;
+    int queued = t->ka_pprev != NULL;
+    tcp_ka_unlink(t);
+    if (!tcp_ka_count && !queued)
+        tcp_ka_last = TCP_TIME / 1000u;
+
+    /* Never behind the slot being served, nor a whole turn of the wheel ahead (it's rechecked) */
+    if (sec <= tcp_ka_last)
+        sec = tcp_ka_last + 1;
 
-    t->keepalive_tmr = pico_timer_add(1000, pico_tcp_keepalive, t);
-    if (!t->keepalive_tmr) {
-        tcp_dbg("TCP: Failed to start keepalive timer\n");
-        if (t->sock.wakeup)
+    tcp_ka_link(&tcp_ka_wheel[sec % PICO_TCP_KA_SLOTS], t);
+    if (!queued)
+        tcp_ka_count++;
+
+    if (!tcp_ka_tmr) {
+        tcp_ka_tmr = pico_timer_add(1000, tcp_ka_tick, NULL);
+        if (!tcp_ka_tmr)
+            tcp_dbg("TCP: Failed to start keepalive timer\n");
+    }
+}
+
+/* Probes t if it's due, returns when to look at it again or 0 to forget it. t may be gone
+ * once it has been told about the connection's failure */
+static pico_time tcp_ka_check(struct pico_socket_tcp *t, pico_time now)
+{
+    pico_time idle = now - t->ack_timestamp;
+    if (!t->ka_time)
+        return 0;
+
+    if ((t->sock.state & PICO_SOCKET_STATE_TCP) != PICO_SOCKET_STATE_TCP_ESTABLISHED)
+        return now + t->ka_time;
+
+    if (idle <= t->ka_time) {
+        t->ka_retries_count = 0;
+        return t->ack_timestamp + t->ka_time + 1;
+    }
+
+    if (t->ka_retries_count == 0) {
+        /* First probe */
+        tcp_send_probe(t);
+        t->ka_retries_count++;
+    }
+
+    if (t->ka_retries_count > t->ka_probes) {
+        if (t->sock.wakeup) {
+            pico_err = PICO_ERR_ECONNRESET;
             t->sock.wakeup(PICO_SOCK_EV_ERR, &t->sock);
+        }
+
+        return 0;
+    }
+
+    if (((t->ka_retries_count * (pico_time)t->ka_intvl) + t->ka_time) < idle) {
+        /* Next probe */
+        tcp_send_probe(t);
+        t->ka_retries_count++;
+    }
+
+    return t->ack_timestamp + t->ka_time + (t->ka_retries_count * (pico_time)t->ka_intvl) + 1;
+}
+
+static void tcp_ka_tick(pico_time now, void *arg)
+{
+    pico_time sec = now / 1000u;
+    (void)arg;
+    tcp_ka_tmr = 0;
+    /* A late tick catches up on the slots it missed, at most one turn of the wheel */
+    if (sec > tcp_ka_last + PICO_TCP_KA_SLOTS)
+        tcp_ka_last = sec - PICO_TCP_KA_SLOTS;
+
+    while (tcp_ka_last < sec) {
+        struct pico_socket_tcp *pending = NULL;
+        struct pico_socket_tcp **slot = &tcp_ka_wheel[(tcp_ka_last + 1) % PICO_TCP_KA_SLOTS];
+        tcp_ka_last++;
+        /* Moved aside so that whatever is put back in this slot waits for the next turn, and
+         * any socket closed meanwhile unlinks itself from here */
+        if (*slot) {
+            pending = *slot;
+            pending->ka_pprev = &pending;
+            *slot = NULL;
+        }
+
+        while (pending) {
+            struct pico_socket_tcp *t = pending;
+            pico_time due;
+            tcp_ka_unlink(t);
+            tcp_ka_count--;
+            due = tcp_ka_check(t, now);
+            if (due)
+                tcp_ka_schedule(t, due);
+        }
+    }
+
+    if (tcp_ka_count && !tcp_ka_tmr) {
+        tcp_ka_tmr = pico_timer_add(1000, tcp_ka_tick, NULL);
+        if (!tcp_ka_tmr)
+            tcp_dbg("TCP: Failed to start keepalive timer\n");
+    }
+
+    if (!tcp_ka_count && tcp_ka_tmr) {
+        pico_timer_cancel(tcp_ka_tmr);
+        tcp_ka_tmr = 0;
     }
 }
 
@@ -1065,6 +1234,7 @@ struct pico_socket *pico_tcp_open(uint16_t family)
     t->tcpq_out.max_size = PICO_DEFAULT_SOCKETQ;
     t->tcpq_hold.max_size = 2u * t->mss;
     rto_set(t, PICO_TCP_RTO_MIN);
+    tcp_cc_select(t, &tcp_cc_reno);
 
     /* Uncomment next line and disable Nagle by default */
     t->sock.opt_flags |= (1 << PICO_SOCKET_OPT_TCPNODELAY);
@@ -1084,12 +1254,6 @@ struct pico_socket *pico_tcp_open(uint16_t family)
     }
 #endif
 
-    t->keepalive_tmr = pico_timer_add(1000, pico_tcp_keepalive, t);
-    if (!t->keepalive_tmr) {
-        tcp_dbg("TCP: Failed to start keepalive timer\n");
-        PICO_FREE(t);
-        return NULL;
-    }
     tcp_set_space(t);
 
     return &t->sock;
@@ -1810,14 +1974,25 @@ static void tcp_rtt(struct pico_socket_tcp *t, uint32_t rtt)
     }
 
     tcp_dbg(" -----=============== RTT CUR: %u AVG: %u RTTVAR: %u RTO: %u ======================----\n", rtt, t->avg_rtt, t->rttvar, t->rto);
+    if (t->cc->rtt)
+        t->cc->rtt(t, rtt);
 }
 
-static void tcp_congestion_control(struct pico_socket_tcp *t)
+static inline void tcp_cc_set_cwnd(struct pico_socket_tcp *t, uint32_t cwnd)
 {
-    if (t->x_mode > PICO_TCP_LOOKAHEAD)
-        return;
+    if (cwnd < 2)
+        cwnd = 2;
 
-    tcp_dbg("Doing congestion control\n");
+    if (cwnd > 0xFFFF)
+        cwnd = 0xFFFF;
+
+    t->cwnd = (uint16_t)cwnd;
+}
+
+/* Reno, as picoTCP always did: one segment per ACK in slow start, one per window after */
+static void reno_ack(struct pico_socket_tcp *t, uint32_t acked)
+{
+    (void)acked;
     if (t->cwnd < t->ssthresh) {
         t->cwnd++;
     } else {
@@ -1827,7 +2002,247 @@ static void tcp_congestion_control(struct pico_socket_tcp *t)
             t->cwnd_counter = 0;
         }
     }
+}
 
+static void reno_recover(struct pico_socket_tcp *t)
+{
+    if (t->ssthresh > t->cwnd)
+        t->ssthresh >>= 2;
+    else
+        t->ssthresh = (t->cwnd >> 1);
+
+    if (t->ssthresh < 2)
+        t->ssthresh = 2;
+}
+
+static const struct pico_tcp_cc tcp_cc_reno = {
+    "reno", NULL, reno_ack, reno_recover, NULL, NULL
+};
+
+/* CUBIC (RFC 8312): after a reduction the window follows W(t) = C*(t-K)^3 + W_max, with
+ * C = 0.4 and beta = 0.7, or the Reno-friendly estimate where that grows faster */
+static uint32_t cubic_root(uint64_t a)
+{
+    uint64_t x = 0;
+    int b;
+    for (b = 63; b >= 0; b -= 3) {
+        uint64_t y;
+        x <<= 1;
+        y = 3 * x * (x + 1) + 1;
+        if ((a >> b) >= y) {
+            a -= y << b;
+            x++;
+        }
+    }
+    return (uint32_t)x;
+}
+
+static void cubic_init(struct pico_socket_tcp *t)
+{
+    memset(&t->cc_state.cubic, 0, sizeof(t->cc_state.cubic));
+}
+
+static void cubic_ack(struct pico_socket_tcp *t, uint32_t acked)
+{
+    struct tcp_cubic *c = &t->cc_state.cubic;
+    pico_time now = TCP_TIME;
+    uint64_t elapsed, d, offset, target, est, cnt;
+
+    if (!acked)
+        return;
+
+    if (t->cwnd < t->ssthresh) {
+        tcp_cc_set_cwnd(t, (uint32_t)t->cwnd + acked);
+        return;
+    }
+
+    if (!c->epoch) {
+        c->epoch = now;
+        c->acks = 0;
+        if (t->cwnd < c->w_max) {
+            c->origin = c->w_max;
+            c->k = cubic_root((uint64_t)(c->w_max - t->cwnd) * 2500000000ull); /* ms */
+        } else {
+            c->origin = t->cwnd;
+            c->k = 0;
+        }
+    }
+
+    elapsed = (uint64_t)(now - c->epoch) + t->avg_rtt;
+    d = (elapsed > c->k) ? (elapsed - c->k) : (c->k - elapsed);
+    if (d > 1000000)
+        d = 1000000;
+
+    offset = d * d * d / 2500000000ull; /* 0.4 * (d / 1000)^3 */
+    if (elapsed > c->k)
+        target = c->origin + offset;
+    else
+        target = (offset < c->origin) ? (c->origin - offset) : 0;
+
+    /* W_est = beta * W_max + 3 * (1 - beta) / (1 + beta) * t / RTT */
+    est = (uint64_t)c->w_max * 7 / 10 + (uint64_t)(now - c->epoch) * 529 / (1000ull * (t->avg_rtt ? t->avg_rtt : 1));
+    if (est > target)
+        target = est;
+
+    if (target > t->cwnd)
+        cnt = t->cwnd / (target - t->cwnd);
+    else
+        cnt = 100ull * t->cwnd;
+
+    if (cnt < 2)
+        cnt = 2;
+
+    c->acks += acked;
+    if (c->acks >= cnt) {
+        c->acks = 0;
+        tcp_cc_set_cwnd(t, (uint32_t)t->cwnd + 1);
+    }
+}
+
+static void cubic_reduce(struct pico_socket_tcp *t, uint32_t cwnd)
+{
+    struct tcp_cubic *c = &t->cc_state.cubic;
+    c->epoch = 0;
+    /* Fast convergence: give up some of W_max if the last reduction lost ground */
+    if (cwnd < c->w_max)
+        c->w_max = cwnd * 17 / 20;
+    else
+        c->w_max = cwnd;
+
+    t->ssthresh = (uint16_t)((cwnd * 7 / 10 < 2) ? 2 : cwnd * 7 / 10);
+}
+
+static void cubic_recover(struct pico_socket_tcp *t)
+{
+    cubic_reduce(t, t->cwnd);
+}
+
+static void cubic_timeout(struct pico_socket_tcp *t)
+{
+    cubic_reduce(t, t->cwnd);
+}
+
+static const struct pico_tcp_cc tcp_cc_cubic = {
+    "cubic", cubic_init, cubic_ack, cubic_recover, cubic_timeout, NULL
+};
+
+/* BBR-style: cwnd follows a model of the path (the bottleneck rate, the highest delivery rate
+ * of the last PICO_TCP_BBR_ROUNDS rounds, times the minimum RTT of the last 10 s) rather than
+ * loss. A round lasts one minimum RTT. Since picoTCP doesn't pace, the gain cycle which probes
+ * for more bandwidth (and then drains the queue it built) is applied to cwnd */
+static const uint8_t bbr_cwnd_gain[8] = {
+    20, 12, 16, 16, 16, 16, 16, 16 /* eighths */
+};
+
+static void bbr_init(struct pico_socket_tcp *t)
+{
+    memset(&t->cc_state.bbr, 0, sizeof(t->cc_state.bbr));
+    t->cc_state.bbr.round_start = TCP_TIME;
+}
+
+static uint32_t bbr_max_bw(struct tcp_bbr *b)
+{
+    uint32_t bw = 0;
+    int i;
+    for (i = 0; i < PICO_TCP_BBR_ROUNDS; i++)
+        if (b->bw[i] > bw)
+            bw = b->bw[i];
+
+    return bw;
+}
+
+static void bbr_ack(struct pico_socket_tcp *t, uint32_t acked)
+{
+    struct tcp_bbr *b = &t->cc_state.bbr;
+    pico_time now = TCP_TIME;
+    uint64_t bdp, target;
+    uint32_t bw;
+
+    b->delivered += acked;
+    if (now - b->round_start >= (b->min_rtt ? b->min_rtt : 1)) {
+        b->round = (uint8_t)((b->round + 1) % PICO_TCP_BBR_ROUNDS);
+        b->bw[b->round] = (uint32_t)((uint64_t)b->delivered * 1000 / (now - b->round_start));
+        b->delivered = 0;
+        b->round_start = now;
+        if (!b->filled) {
+            bw = bbr_max_bw(b);
+            if (bw >= b->full_bw + (b->full_bw >> 2)) {
+                b->full_bw = bw;
+                b->full_bw_rounds = 0;
+            } else if (++b->full_bw_rounds >= 3) {
+                b->filled = 1;
+            }
+        }
+    }
+
+    if (!b->filled || !b->min_rtt) {
+        /* Startup: double cwnd every round until the rate stops growing */
+        tcp_cc_set_cwnd(t, (uint32_t)t->cwnd + acked);
+        return;
+    }
+
+    bdp = (uint64_t)bbr_max_bw(b) * b->min_rtt / 1000;
+    target = bdp * bbr_cwnd_gain[b->round % 8] / 8;
+    if (target < 4)
+        target = 4;
+
+    if (t->cwnd + acked < target)
+        tcp_cc_set_cwnd(t, (uint32_t)t->cwnd + acked);
+    else
+        tcp_cc_set_cwnd(t, (uint32_t)((target > 0xFFFF) ? 0xFFFF : target));
+}
+
+static void bbr_recover(struct pico_socket_tcp *t)
+{
+    /* Loss isn't a signal to BBR, don't let ssthresh hold cwnd back afterwards */
+    t->ssthresh = t->cwnd;
+}
+
+static void bbr_rtt(struct pico_socket_tcp *t, uint32_t rtt)
+{
+    struct tcp_bbr *b = &t->cc_state.bbr;
+    pico_time now = TCP_TIME;
+    if (!b->min_rtt || rtt <= b->min_rtt || (now - b->min_rtt_stamp) > 10000) {
+        b->min_rtt = rtt;
+        b->min_rtt_stamp = now;
+    }
+}
+
+static const struct pico_tcp_cc tcp_cc_bbr = {
+    "bbr", bbr_init, bbr_ack, bbr_recover, NULL, bbr_rtt
+};
+
+static const struct pico_tcp_cc *const tcp_ccs[] = {
+    &tcp_cc_reno, &tcp_cc_cubic, &tcp_cc_bbr
+};
+
+static const struct pico_tcp_cc *tcp_cc_find(const char *name)
+{
+    uint32_t i;
+    if (!name)
+        return NULL;
+
+    for (i = 0; i < sizeof(tcp_ccs) / sizeof(tcp_ccs[0]); i++)
+        if (strcmp(tcp_ccs[i]->name, name) == 0)
+            return tcp_ccs[i];
+
+    return NULL;
+}
+
+static void tcp_cc_select(struct pico_socket_tcp *t, const struct pico_tcp_cc *cc)
+{
+    t->cc = cc;
+    if (cc->init)
+        cc->init(t);
+}
+
+static void tcp_congestion_control(struct pico_socket_tcp *t, uint32_t acked)
+{
+    if (t->x_mode > PICO_TCP_LOOKAHEAD)
+        return;
+
+    tcp_dbg("Doing congestion control\n");
+    t->cc->ack(t, acked);
     tcp_dbg("TCP_CWND, %lu, %u, %u, %u\n", TCP_TIME, t->cwnd, t->ssthresh, t->in_flight);
 }
 
@@ -1838,6 +2253,9 @@ static void add_retransmission_timer(struct pico_socket_tcp *t, pico_time next_t
 
 static void tcp_first_timeout(struct pico_socket_tcp *t)
 {
+    if (t->cc->timeout)
+        t->cc->timeout(t);
+
     t->x_mode = PICO_TCP_BLACKOUT;
     t->cwnd = PICO_TCP_IW;
     t->in_flight = 0;
@@ -1855,6 +2273,7 @@ static int tcp_rto_xmit(struct pico_socket_tcp *t, struct pico_frame *f)
 
     if (pico_enqueue(&tcp_out, cpy) > 0) {
         t->snd_last_out = SEQN(cpy);
+        t->retrans_count++;
         add_retransmission_timer(t, (t->rto << (++t->backoff)) + TCP_TIME);
         tcp_dbg("TCP_CWND, %lu, %u, %u, %u\n", TCP_TIME, t->cwnd, t->ssthresh, t->in_flight);
         tcp_dbg("Sending RTO!\n");
@@ -2006,6 +2425,7 @@ static int tcp_retrans(struct pico_socket_tcp *t, struct pico_frame *f)
         if (pico_enqueue(&tcp_out, cpy) > 0) {
             t->in_flight++;
             t->snd_last_out = SEQN(cpy);
+            t->retrans_count++;
         } else {
             pico_frame_discard(cpy);
         }
@@ -2163,13 +2583,8 @@ static int tcp_ack(struct pico_socket *s, struct pico_frame *f)
                     t->cwnd = PICO_TCP_IW;
 
                 t->snd_retry = SEQN((struct pico_frame *)first_segment(&t->tcpq_out));
-                if (t->ssthresh > t->cwnd)
-                    t->ssthresh >>= 2;
-                else
-                    t->ssthresh = (t->cwnd >> 1);
-
-                if (t->ssthresh < 2)
-                    t->ssthresh = 2;
+                if (t->cc->recover)
+                    t->cc->recover(t);
             }
         } else if (t->x_mode == PICO_TCP_RECOVER) {
             /* tcp_dbg("TCP RECOVER> DUPACK! snd_una: %08x, snd_nxt: %08x, acked now: %08x\n", SEQN(first_segment(&t->tcpq_out)), t->snd_nxt, ACKN(f)); */
@@ -2220,7 +2635,7 @@ static int tcp_ack(struct pico_socket *s, struct pico_frame *f)
 
 
     /* Do congestion control */
-    tcp_congestion_control(t);
+    tcp_congestion_control(t, acked);
     if ((acked > 0) && t->sock.wakeup) {
         if (t->tcpq_out.size < t->tcpq_out.max_size)
             t->sock.wakeup(PICO_SOCK_EV_WR, &(t->sock));
@@ -2405,8 +2820,9 @@ static int tcp_syn(struct pico_socket *s, struct pico_frame *f)
     mtu = (uint16_t)pico_socket_get_mss(&new->sock);
     new->mss = (uint16_t)(mtu - PICO_SIZE_TCPHDR);
     tcp_parse_options(f);
-    new->tcpq_in.max_size = PICO_DEFAULT_SOCKETQ;
-    new->tcpq_out.max_size = PICO_DEFAULT_SOCKETQ;
+    /* Inherit the listener's buffer sizes, they decide the window (and scale) of the SYN-ACK */
+    new->tcpq_in.max_size = ((struct pico_socket_tcp *)s)->tcpq_in.max_size;
+    new->tcpq_out.max_size = ((struct pico_socket_tcp *)s)->tcpq_out.max_size;
     new->tcpq_hold.max_size = 2u * mtu;
     new->rcv_nxt = long_be(hdr->seq) + 1;
     new->snd_nxt = long_be(pico_paws());
@@ -2416,6 +2832,13 @@ static int tcp_syn(struct pico_socket *s, struct pico_frame *f)
     new->recv_wnd = short_be(hdr->rwnd);
     new->jumbo = hdr->len & 0x07;
     new->linger_timeout = PICO_SOCKET_LINGER_TIMEOUT;
+    /* ...and its keepalive settings */
+    new->ka_probes = ((struct pico_socket_tcp *)s)->ka_probes;
+    new->ka_intvl = ((struct pico_socket_tcp *)s)->ka_intvl;
+    new->ack_timestamp = TCP_TIME;
+    if (((struct pico_socket_tcp *)s)->ka_time)
+        pico_tcp_set_keepalive_time(&new->sock, ((struct pico_socket_tcp *)s)->ka_time);
+    tcp_cc_select(new, ((struct pico_socket_tcp *)s)->cc);
     s->number_of_pending_conn++;
     new->sock.parent = s;
     new->sock.wakeup = s->wakeup;
@@ -2454,6 +2877,23 @@ static void tcp_set_init_point(struct pico_socket *s)
 }
 
 
+int pico_tcp_get_stats(struct pico_socket *s, struct pico_tcp_stats *st)
+{
+    struct pico_socket_tcp *t = (struct pico_socket_tcp *) s;
+    if (!s || !st || s->proto->proto_number != PICO_PROTO_TCP)
+        return -1;
+
+    st->rtt = t->avg_rtt;
+    st->rttvar = t->rttvar;
+    st->rto = t->rto;
+    st->cwnd = t->cwnd;
+    st->in_flight = t->in_flight;
+    st->retrans = t->retrans_count;
+    st->sndq = t->tcpq_out.size;
+    st->rcvq = t->tcpq_in.size;
+    return 0;
+}
+
 uint16_t pico_tcp_get_socket_mss(struct pico_socket *s)
 {
     struct pico_socket_tcp *t = (struct pico_socket_tcp *) s;
@@ -3178,11 +3618,10 @@ void pico_tcp_cleanup_queues(struct pico_socket *sck)
 {
     struct pico_socket_tcp *tcp = (struct pico_socket_tcp *)sck;
     pico_timer_cancel(tcp->retrans_tmr);
-    pico_timer_cancel(tcp->keepalive_tmr);
     pico_timer_cancel(tcp->fin_tmr);
+    tcp_ka_remove(tcp);
 
     tcp->retrans_tmr = 0;
-    tcp->keepalive_tmr = 0;
     tcp->fin_tmr = 0;
 
     tcp_discard_all_segments(&tcp->tcpq_in);
@@ -3294,6 +3733,12 @@ int pico_tcp_set_keepalive_time(struct pico_socket *s, uint32_t value)
 {
     struct pico_socket_tcp *t = (struct pico_socket_tcp *)s;
     t->ka_time = value;
+    t->ka_retries_count = 0;
+    if (value)
+        tcp_ka_schedule(t, TCP_TIME + value);
+    else
+        tcp_ka_remove(t);
+
     return 0;
 }
 
@@ -3304,4 +3749,26 @@ int pico_tcp_set_linger(struct pico_socket *s, uint32_t value)
     return 0;
 }
 
+int pico_tcp_set_congestion(struct pico_socket *s, const char *name)
+{
+    const struct pico_tcp_cc *cc = tcp_cc_find(name);
+    if (!cc) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    tcp_cc_select((struct pico_socket_tcp *)s, cc);
+    return 0;
+}
+
+const char *pico_tcp_get_congestion(struct pico_socket *s)
+{
+    return ((struct pico_socket_tcp *)s)->cc->name;
+}
+
+int pico_tcp_congestion_exists(const char *name)
+{
+    return tcp_cc_find(name) != NULL;
+}
+
 #endif /* PICO_SUPPORT_TCP */
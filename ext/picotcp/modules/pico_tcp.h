@@ -76,6 +76,18 @@ PACKED_STRUCT_DEF pico_tcp_option
     uint8_t len;
 };
 
+/* Snapshot of a socket's congestion control state, times in ms */
+struct pico_tcp_stats {
+    uint32_t rtt;
+    uint32_t rttvar;
+    uint32_t rto;
+    uint32_t cwnd;      /* segments */
+    uint32_t in_flight; /* segments */
+    uint32_t retrans;   /* segments retransmitted (timeout or fast retransmit) */
+    uint32_t sndq;      /* bytes queued to send or awaiting ack */
+    uint32_t rcvq;      /* bytes received but not yet read */
+};
+
 struct pico_socket *pico_tcp_open(uint16_t family);
 uint32_t pico_tcp_read(struct pico_socket *s, void *buf, uint32_t len);
 int pico_tcp_initconn(struct pico_socket *s);
@@ -101,6 +113,11 @@ int pico_tcp_set_keepalive_intvl(struct pico_socket *s, uint32_t value);
 int pico_tcp_set_keepalive_time(struct pico_socket *s, uint32_t value);
 int pico_tcp_set_linger(struct pico_socket *s, uint32_t value);
 uint16_t pico_tcp_get_socket_mss(struct pico_socket *s);
+int pico_tcp_get_stats(struct pico_socket *s, struct pico_tcp_stats *st);
 int pico_tcp_check_listen_close(struct pico_socket *s);
+/* Congestion control by name: "reno" (the default), "cubic" or "bbr" */
+int pico_tcp_set_congestion(struct pico_socket *s, const char *name);
+const char *pico_tcp_get_congestion(struct pico_socket *s);
+int pico_tcp_congestion_exists(const char *name);
 
 #endif
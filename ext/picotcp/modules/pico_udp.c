@@ -167,6 +167,7 @@ static void pico_udp_get_msginfo(struct pico_frame *f, struct pico_msginfo *msgi
         return;
 
     msginfo->dev = f->dev;
+    msginfo->rx_stamp = f->rx_stamp;
 
     if (IS_IPV4(f)) { /* IPV4 */
 #ifdef PICO_SUPPORT_IPV4
@@ -276,26 +276,40 @@ struct pico_frame *pico_frame_deepcopy(struct pico_frame *f)
 }
 
 
+/* 32 bit words summed into a 64 bit accumulator fold down to the same ones' complement
+ * sum as 16 bit words would (RFC 1071), with half the additions and no carries to mind */
 static inline uint32_t pico_checksum_adder(uint32_t sum, void *data, uint32_t len)
 {
-    uint16_t *buf = (uint16_t *)data;
-    uint16_t *stop;
+    uint8_t *buf = (uint8_t *)data;
+    uint64_t acc = sum;
+    uint32_t w[4];
+    uint16_t h;
 
     if (len & 0x01) {
         --len;
 #ifdef PICO_BIGENDIAN
-        sum += (((uint8_t *)data)[len]) << 8;
+        acc += (uint32_t)(buf[len]) << 8;
 #else
-        sum += ((uint8_t *)data)[len];
+        acc += buf[len];
 #endif
     }
 
-    stop = (uint16_t *)(((uint8_t *)data) + len);
-
-    while (buf < stop) {
-        sum += *buf++;
+    while (len >= sizeof(w)) {
+        memcpy(w, buf, sizeof(w));
+        acc += (uint64_t)w[0] + w[1] + w[2] + w[3];
+        buf += sizeof(w);
+        len -= (uint32_t)sizeof(w);
+    }
+    while (len >= 2) {
+        memcpy(&h, buf, sizeof(h));
+        acc += h;
+        buf += 2;
+        len -= 2;
+    }
+    while (acc >> 32) {
+        acc = (acc & 0xFFFFFFFFu) + (acc >> 32);
     }
-    return sum;
+    return (uint32_t)acc;
 }
 
 static inline uint16_t pico_checksum_finalize(uint32_t sum)
@@ -697,6 +697,7 @@ struct pico_socket *pico_socket_clone(struct pico_socket *facsimile)
     s->local_port = facsimile->local_port;
     s->remote_port = facsimile->remote_port;
     s->state = facsimile->state;
+    s->tos = facsimile->tos;
     pico_socket_clone_assign_address(s, facsimile);
     if (!s->net) {
         PICO_FREE(s);
@@ -1280,6 +1281,13 @@ static uint32_t pico_socket_adapt_mss_to_proto(struct pico_socket *s, uint32_t m
     return mss;
 }
 
+static uint32_t (*pico_socket_path_mtu)(struct pico_device *dev, union pico_address *remote, int ipv6) = NULL;
+
+void pico_socket_set_path_mtu_hook(uint32_t (*hook)(struct pico_device *dev, union pico_address *remote, int ipv6))
+{
+    pico_socket_path_mtu = hook;
+}
+
 uint32_t pico_socket_get_mss(struct pico_socket *s)
 {
     uint32_t mss = PICO_MIN_MSS;
@@ -1293,6 +1301,14 @@ uint32_t pico_socket_get_mss(struct pico_socket *s)
         mss = PICO_MIN_MSS;
     } else {
         mss = s->dev->mtu;
+#ifdef PICO_SUPPORT_TCP
+        /* a TCP segment is sized to the path to the remote host when that's known to be smaller */
+        if (pico_socket_path_mtu && PROTO(s) == PICO_PROTO_TCP) {
+            uint32_t pmtu = pico_socket_path_mtu(s->dev, &s->remote_addr, is_sock_ipv6(s));
+            if (pmtu && pmtu < mss)
+                mss = pmtu;
+        }
+#endif
     }
 
     return pico_socket_adapt_mss_to_proto(s, mss);
@@ -1821,6 +1837,15 @@ int MOCKABLE pico_socket_setoption(struct pico_socket *s, int option, void *valu
         return -1;
     }
 
+    if (option == PICO_SOCKET_OPT_TOS) {
+        if (!value) {
+            pico_err = PICO_ERR_EINVAL;
+            return -1;
+        }
+        s->tos = (uint8_t)*(int *)value;
+        return 0;
+    }
+
 
     if (PROTO(s) == PICO_PROTO_TCP)
         return pico_setsockopt_tcp(s, option, value);
@@ -1840,6 +1865,15 @@ int pico_socket_getoption(struct pico_socket *s, int option, void *value)
         return -1;
     }
 
+    if (option == PICO_SOCKET_OPT_TOS) {
+        if (!value) {
+            pico_err = PICO_ERR_EINVAL;
+            return -1;
+        }
+        *(int *)value = s->tos;
+        return 0;
+    }
+
 
     if (PROTO(s) == PICO_PROTO_TCP)
         return pico_getsockopt_tcp(s, option, value);
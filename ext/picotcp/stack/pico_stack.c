@@ -31,7 +31,6 @@
 #include "pico_udp.h"
 #include "pico_tcp.h"
 #include "pico_socket.h"
-#include "heap.h"
 
 #include "../../../include/Debug.hpp"
 
@@ -429,6 +428,13 @@ MOCKABLE int pico_datalink_send(struct pico_frame *f)
  *  PHYSICAL LAYER
  ******************************************************************************/
 
+static uint64_t rx_stamp_next = 0;
+
+void pico_stack_set_rx_stamp(uint64_t stamp)
+{
+    rx_stamp_next = stamp;
+}
+
 struct pico_frame *pico_stack_recv_new_frame(struct pico_device *dev, uint8_t *buffer, uint32_t len)
 {
     struct pico_frame *f;
@@ -444,6 +450,7 @@ struct pico_frame *pico_stack_recv_new_frame(struct pico_device *dev, uint8_t *b
 
     /* Association to the device that just received the frame. */
     f->dev = dev;
+    f->rx_stamp = rx_stamp_next;
 
     /* Setup the start pointer, length. */
     f->start = f->buffer;
@@ -505,8 +512,11 @@ static int32_t _pico_stack_recv_zerocopy(struct pico_device *dev, uint8_t *buffe
     }
 
     f->dev = dev;
+    f->rx_stamp = rx_stamp_next;
     ret = pico_enqueue(dev->q_in, f);
     if (ret <= 0) {
+        /* Left to the caller as on every other failure */
+        f->notify_free = NULL;
         pico_frame_discard(f);
     }
 
@@ -545,27 +555,209 @@ int32_t pico_sendto_dev(struct pico_frame *f)
     }
 }
 
+/* Timers live in a hierarchical timing wheel: TW_ROOT_SLOTS 1 ms slots for whatever is due
+ * within the next 256 ms, above them TW_LEVELS coarser wheels whose slots are cascaded into the
+ * finer ones as time reaches them. Adding and cancelling (found through tw_ids by id) are O(1)
+ * and the number of timers is only bounded by memory */
+#define TW_ROOT_BITS    8
+#define TW_LEVEL_BITS   6
+#define TW_LEVELS       4
+#define TW_ROOT_SLOTS   (1u << TW_ROOT_BITS)
+#define TW_LEVEL_SLOTS  (1u << TW_LEVEL_BITS)
+#define TW_ROOT_MASK    ((pico_time)(TW_ROOT_SLOTS - 1))
+#define TW_LEVEL_MASK   ((pico_time)(TW_LEVEL_SLOTS - 1))
+#define TW_MAX_DELTA    ((((pico_time)1) << (TW_ROOT_BITS + TW_LEVELS * TW_LEVEL_BITS)) - 1)
+
 struct pico_timer
 {
     void *arg;
     void (*timer)(pico_time timestamp, void *arg);
+    pico_time expire;
+    uint32_t id;
+    uint32_t hash;
+    int root_slot;               /* -1 unless in tw_root */
+    struct pico_timer *next;     /* in its slot */
+    struct pico_timer **pprev;
+    struct pico_timer *id_next;  /* in its tw_ids bucket */
 };
 
 
 static uint32_t tmr_id = 0u;
-struct pico_timer_ref
+
+static struct pico_timer *tw_root[TW_ROOT_SLOTS];
+static uint64_t tw_root_map[TW_ROOT_SLOTS / 64];
+static struct pico_timer *tw_level[TW_LEVELS][TW_LEVEL_SLOTS];
+static pico_time tw_now;         /* every timer due before this has fired */
+static uint32_t tw_count;
+static struct pico_timer **tw_ids;
+static uint32_t tw_ids_sz;       /* a power of two */
+
+static void tw_link(struct pico_timer **head, struct pico_timer *t)
 {
-    pico_time expire;
-    uint32_t id;
-    uint32_t hash;
-    struct pico_timer *tmr;
-};
+    t->next = *head;
+    if (t->next)
+        t->next->pprev = &t->next;
+    *head = t;
+    t->pprev = head;
+}
+
+static void tw_unlink(struct pico_timer *t)
+{
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+    if (t->root_slot >= 0 && !tw_root[t->root_slot])
+        tw_root_map[t->root_slot >> 6] &= ~(1ull << (t->root_slot & 63));
+    t->next = NULL;
+    t->pprev = NULL;
+    t->root_slot = -1;
+}
 
-typedef struct pico_timer_ref pico_timer_ref;
+/* Files t by its expiry relative to tw_now */
+static void tw_place(struct pico_timer *t)
+{
+    pico_time e = t->expire, delta;
+    int l;
+
+    if (e < tw_now)
+        e = tw_now; /* overdue, fires with the next slot */
+
+    delta = e - tw_now;
+    if (delta > TW_MAX_DELTA) {
+        /* Beyond the outermost wheel, filed again once this is reached (see tw_run()) */
+        e = tw_now + TW_MAX_DELTA;
+        delta = TW_MAX_DELTA;
+    }
 
-DECLARE_HEAP(pico_timer_ref, expire);
+    if (delta < TW_ROOT_SLOTS) {
+        t->root_slot = (int)(e & TW_ROOT_MASK);
+        tw_link(&tw_root[t->root_slot], t);
+        tw_root_map[t->root_slot >> 6] |= 1ull << (t->root_slot & 63);
+        return;
+    }
+
+    t->root_slot = -1;
+    for (l = 0; l < TW_LEVELS; l++) {
+        unsigned shift = TW_ROOT_BITS + (unsigned)l * TW_LEVEL_BITS;
+        if (l == TW_LEVELS - 1 || delta < ((pico_time)1 << (shift + TW_LEVEL_BITS))) {
+            tw_link(&tw_level[l][(e >> shift) & TW_LEVEL_MASK], t);
+            return;
+        }
+    }
+}
+
+/* Refiles every timer of a slot of wheel l into the finer wheels */
+static void tw_cascade(int l, uint32_t idx)
+{
+    struct pico_timer *t, *list = tw_level[l][idx];
+
+    tw_level[l][idx] = NULL;
+    while (list) {
+        t = list;
+        list = t->next;
+        t->next = NULL;
+        tw_place(t);
+    }
+}
+
+static struct pico_timer **tw_bucket(uint32_t id)
+{
+    return &tw_ids[id & (tw_ids_sz - 1)];
+}
+
+static int tw_ids_grow(void)
+{
+    uint32_t i, sz = tw_ids_sz ? tw_ids_sz * 2 : 64;
+    struct pico_timer **old = tw_ids;
+    uint32_t old_sz = tw_ids_sz;
+    struct pico_timer **ids = PICO_ZALLOC(sz * sizeof(struct pico_timer *));
+
+    if (!ids)
+        return -1;
+
+    tw_ids = ids;
+    tw_ids_sz = sz;
+    for (i = 0; i < old_sz; i++) {
+        while (old[i]) {
+            struct pico_timer *t = old[i];
+            struct pico_timer **b;
+            old[i] = t->id_next;
+            b = tw_bucket(t->id);
+            t->id_next = *b;
+            *b = t;
+        }
+    }
+    if (old)
+        PICO_FREE(old);
+
+    return 0;
+}
+
+/* Forgets t, which is no longer in any slot */
+static void tw_forget(struct pico_timer *t)
+{
+    struct pico_timer **b = tw_bucket(t->id);
 
-static heap_pico_timer_ref *Timers;
+    while (*b && *b != t)
+        b = &(*b)->id_next;
+    if (*b)
+        *b = t->id_next;
+
+    tw_count--;
+}
+
+/* Fires everything due before now */
+static void tw_run(pico_time now)
+{
+    struct pico_timer *t, *work;
+    pico_time slot_time;
+    uint32_t idx;
+    int l;
+
+    if (!tw_count) {
+        tw_now = now > tw_now ? now : tw_now;
+        return;
+    }
+
+    while (tw_now < now) {
+        idx = (uint32_t)(tw_now & TW_ROOT_MASK);
+        if (idx && !(tw_root_map[0] | tw_root_map[1] | tw_root_map[2] | tw_root_map[3])) {
+            /* Nothing can come due before the next cascade */
+            pico_time boundary = (tw_now | TW_ROOT_MASK) + 1;
+            tw_now = boundary < now ? boundary : now;
+            continue;
+        }
+        if (!idx) {
+            for (l = 0; l < TW_LEVELS; l++) {
+                uint32_t li = (uint32_t)((tw_now >> (TW_ROOT_BITS + (unsigned)l * TW_LEVEL_BITS)) & TW_LEVEL_MASK);
+                tw_cascade(l, li);
+                if (li)
+                    break;
+            }
+        }
+
+        work = tw_root[idx];
+        tw_root[idx] = NULL;
+        tw_root_map[idx >> 6] &= ~(1ull << (idx & 63));
+        if (work)
+            work->pprev = &work;
+
+        slot_time = tw_now++;
+        /* Timers may cancel others of this slot, they unlink themselves from work */
+        while (work) {
+            t = work;
+            tw_unlink(t);
+            if (t->expire > slot_time) {
+                tw_place(t);
+                continue;
+            }
+            tw_forget(t);
+            if (t->timer)
+                t->timer(pico_tick, t->arg);
+            PICO_FREE(t);
+        }
+    }
+}
 
 int32_t pico_seq_compare(uint32_t a, uint32_t b)
 {
@@ -594,46 +786,62 @@ int32_t pico_seq_compare(uint32_t a, uint32_t b)
 
 extern int pico_ntimers()
 {
-    return Timers->n;
+    return (int)tw_count;
 }
 
-static void pico_check_timers(void)
+/* Milliseconds until the earliest pending timer is due, or -1 if there are none */
+int pico_timers_next_ms(void)
 {
-    struct pico_timer *t;
-    struct pico_timer_ref tref_unused, *tref = heap_first(Timers);
-    pico_tick = PICO_TIME_MS();
-    while((tref) && (tref->expire < pico_tick)) {
-        t = tref->tmr;
-        if (t && t->timer)
-            t->timer(pico_tick, t->arg);
+    pico_time due, now;
+    uint32_t i, base;
 
-        if (t)
-        {
-            PICO_FREE(t);
-        }
+    if (!tw_count)
+        return -1;
 
-        heap_peek(Timers, &tref_unused);
-        tref = heap_first(Timers);
+    /* The first occupied root slot from tw_now on, but no later than the next cascade (which is
+     * when anything on the coarser wheels can first come due) */
+    base = (uint32_t)(tw_now & TW_ROOT_MASK);
+    due = base ? (tw_now | TW_ROOT_MASK) + 1 : tw_now;
+    for (i = 0; base && i < TW_ROOT_SLOTS; ) {
+        uint32_t slot = (base + i) & (TW_ROOT_SLOTS - 1);
+        uint64_t w = tw_root_map[slot >> 6] >> (slot & 63);
+        if (w) {
+            if (tw_now + i + (uint32_t)__builtin_ctzll(w) < due)
+                due = tw_now + i + (uint32_t)__builtin_ctzll(w);
+            break;
+        }
+        i += 64 - (slot & 63);
     }
+
+    now = PICO_TIME_MS();
+    /* pico_check_timers() only fires timers which expired strictly before the current tick */
+    if (due < now)
+        return 0;
+
+    if (due - now >= 0x7fffffff)
+        return 0x7fffffff;
+
+    return (int)(due - now) + 1;
+}
+
+static void pico_check_timers(void)
+{
+    pico_tick = PICO_TIME_MS();
+    tw_run(pico_tick);
 }
 
 void MOCKABLE pico_timer_cancel(uint32_t id)
 {
-    uint32_t i;
-    struct pico_timer_ref *tref;
-    if (id == 0u)
+    struct pico_timer *t;
+    if (id == 0u || !tw_ids)
         return;
 
-    for (i = 1; i <= Timers->n; i++) {
-        tref = heap_get_element(Timers, i);
-        if (tref->id == id) {
-            if (tref->tmr)
-            {
-                PICO_FREE(tref->tmr);
-                tref->tmr = NULL;
-                tref->id = 0;
-            }
-            break;
+    for (t = *tw_bucket(id); t; t = t->id_next) {
+        if (t->id == id) {
+            tw_unlink(t);
+            tw_forget(t);
+            PICO_FREE(t);
+            return;
         }
     }
 }
@@ -641,19 +849,21 @@ void MOCKABLE pico_timer_cancel(uint32_t id)
 void pico_timer_cancel_hashed(uint32_t hash)
 {
     uint32_t i;
-    struct pico_timer_ref *tref;
     if (hash == 0u)
         return;
 
-    for (i = 1; i <= Timers->n; i++) {
-        tref = heap_get_element(Timers, i);
-        if (tref->hash == hash) {
-            if (tref->tmr)
-            {
-                PICO_FREE(tref->tmr);
-                tref->tmr = NULL;
-                tref[i].id = 0;
+    for (i = 0; i < tw_ids_sz; i++) {
+        struct pico_timer **b = &tw_ids[i];
+        while (*b) {
+            struct pico_timer *t = *b;
+            if (t->hash != hash) {
+                b = &t->id_next;
+                continue;
             }
+            *b = t->id_next;
+            tw_unlink(t);
+            tw_count--;
+            PICO_FREE(t);
         }
     }
 }
@@ -825,24 +1035,25 @@ void pico_stack_loop(void)
 static uint32_t
 pico_timer_ref_add(pico_time expire, struct pico_timer *t, uint32_t id, uint32_t hash)
 {
-    struct pico_timer_ref tref;
-
-    tref.expire = PICO_TIME_MS() + expire;
-    tref.tmr = t;
-    tref.id = id;
-    tref.hash = hash;
+    struct pico_timer **b;
 
-    if (heap_insert(Timers, &tref) < 0) {
-        DEBUG_ERROR("Error: failed to insert timer(ID %u) into heap", id);
+    if (tw_count + 1 > tw_ids_sz && tw_ids_grow() < 0 && !tw_ids) {
+        DEBUG_ERROR("Error: failed to add timer(ID %u)", id);
         PICO_FREE(t);
         pico_err = PICO_ERR_ENOMEM;
         return 0;
     }
-    if (Timers->n > PICO_MAX_TIMERS) {
-        DEBUG_ERROR("Warning: I have %d timers", (int)Timers->n);
-    }
 
-    return tref.id;
+    t->expire = PICO_TIME_MS() + expire;
+    t->id = id;
+    t->hash = hash;
+    tw_place(t);
+    b = tw_bucket(id);
+    t->id_next = *b;
+    *b = t;
+    tw_count++;
+
+    return id;
 }
 
 static struct pico_timer *
@@ -936,10 +1147,8 @@ extern int MOCKABLE pico_stack_init(void)
 
     pico_rand_feed(123456);
 
-    /* Initialize timer heap */
-    Timers = heap_init();
-    if (!Timers)
-        return -1;
+    /* Start the timer wheel */
+    tw_now = PICO_TIME_MS();
 
 #if ((defined PICO_SUPPORT_IPV4) && (defined PICO_SUPPORT_ETH))
     /* Initialize ARP module */
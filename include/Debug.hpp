@@ -28,8 +28,6 @@
 #include <sys/syscall.h>
 #include <sys/types.h>
 
-#define ZT_DEBUG_LEVEL     6 // Set this to adjust what you'd like to see in the debug traces
-
 #define ZT_MSG_TEST        1 // For use in selftest
 #define ZT_MSG_ERROR       2 // Errors
 #define ZT_MSG_INFO        3 // Information which is generally useful to any developer
@@ -37,6 +35,18 @@
 #define ZT_MSG_TRANSFER    5 // RX/TX specific statements
 #define ZT_MSG_FLOW        6 // High-level flow messages
 
+// Set with ZT_DEBUG_LEVEL=n at build time, statements above this level compile to nothing
+#ifndef ZT_DEBUG_LEVEL
+	#define ZT_DEBUG_LEVEL ZT_MSG_ERROR
+#endif
+
+// With ZT_TRACE_RING=1 the enabled statements are recorded into per-thread binary rings and
+// formatted later on a separate thread instead of calling fprintf() in place (see TraceRing.hpp)
+#if defined(ZT_TRACE_RING) && defined(__cplusplus) && !defined(__ANDROID__)
+	#define ZT_TRACE_BACKEND
+	#include "TraceRing.hpp"
+#endif
+
 #define ZT_COLOR           true
 
 // Debug output colors
@@ -85,11 +95,57 @@
 		#define ZT_LOG_TAG "ZTSDK"
 #endif
 
+#if defined(ZT_TRACE_BACKEND)
+
+#if ZT_DEBUG_LEVEL >= ZT_MSG_TEST
+	#define DEBUG_TEST(fmt, args...) ZT_TRACE_RECORD("TEST ", fmt, ##args)
+#else
+	#define DEBUG_TEST(fmt, args...)
+#endif
+
+#if ZT_DEBUG_LEVEL >= ZT_MSG_ERROR
+	#define DEBUG_ERROR(fmt, args...) ZT_TRACE_RECORD("ERROR", fmt, ##args)
+#else
+	#define DEBUG_ERROR(fmt, args...)
+#endif
+
+#if ZT_DEBUG_LEVEL >= ZT_MSG_INFO
+	#define DEBUG_INFO(fmt, args...) ZT_TRACE_RECORD("INFO ", fmt, ##args)
+	#define DEBUG_ATTN(fmt, args...) ZT_TRACE_RECORD("ATTN ", fmt, ##args)
+	#define DEBUG_STACK(fmt, args...) ZT_TRACE_RECORD("STACK", fmt, ##args)
+	#define DEBUG_BLANK(fmt, args...) ZT_TRACE_RECORD("INFO ", fmt, ##args)
+#else
+	#define DEBUG_INFO(fmt, args...)
+	#define DEBUG_BLANK(fmt, args...)
+	#define DEBUG_ATTN(fmt, args...)
+	#define DEBUG_STACK(fmt, args...)
+#endif
+
+#if ZT_DEBUG_LEVEL >= ZT_MSG_TRANSFER
+	#define DEBUG_TRANS(fmt, args...) ZT_TRACE_RECORD("TRANS", fmt, ##args)
+#else
+	#define DEBUG_TRANS(fmt, args...)
+#endif
+
+#if ZT_DEBUG_LEVEL >= ZT_MSG_EXTRA
+	#define DEBUG_EXTRA(fmt, args...) ZT_TRACE_RECORD("EXTRA", fmt, ##args)
+#else
+	#define DEBUG_EXTRA(fmt, args...)
+#endif
+
+#if ZT_DEBUG_LEVEL >= ZT_MSG_FLOW
+	#define DEBUG_FLOW(fmt, args...) ZT_TRACE_RECORD("FLOW ", fmt, ##args)
+#else
+	#define DEBUG_FLOW(fmt, args...)
+#endif
+
+#else // fprintf()
+
 #if ZT_DEBUG_LEVEL >= ZT_MSG_TEST
 	#define DEBUG_TEST(fmt, args...) fprintf(stderr, ZT_CYN "TEST [%d] : %16s:%5d:%25s: " fmt   \
 		"\n" ZT_RESET, ZT_THREAD_ID, ZT_FILENAME, __LINE__, __FUNCTION__, ##args)
 #else
-	#define DEBUG_ERROR(fmt, args...)
+	#define DEBUG_TEST(fmt, args...)
 #endif
 
 #if ZT_DEBUG_LEVEL >= ZT_MSG_ERROR
@@ -152,7 +208,7 @@
 
 #if ZT_DEBUG_LEVEL >= ZT_MSG_FLOW
 	#if defined(__ANDROID__)
-		#define DEBUG_FLOW(fmt, args...) ((void)__android_log_print(ANDROID_LOG_VERBOSE, ZT_LOG_TAG, \ 
+		#define DEBUG_FLOW(fmt, args...) ((void)__android_log_print(ANDROID_LOG_VERBOSE, ZT_LOG_TAG, \
 			"FLOW : %16s:%5d:%25s: " fmt "\n", ZT_FILENAME, __LINE__, __FUNCTION__, ##args))
 	#else
 		#define DEBUG_FLOW(fmt, args...) fprintf(stderr, "FLOW [%ld] : %16s:%5d:%25s: " fmt "\n", \
@@ -160,4 +216,6 @@
 	#endif
 	#else
 		#define DEBUG_FLOW(fmt, args...)
-#endif
\ No newline at end of file
+#endif
+
+#endif // ZT_TRACE_BACKEND
@@ -0,0 +1,168 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// Binary trace backend for the DEBUG_* macros (enabled with ZT_TRACE_RING, see Debug.hpp)
+//
+// Each thread appends fixed-layout records (timestamp, call site, raw arguments) to its own
+// ring, a background thread turns them into text. Nothing is formatted on the thread which
+// logged, and a full ring drops records rather than blocking it
+
+#ifndef ZT_TRACE_RING_HPP
+#define ZT_TRACE_RING_HPP
+
+#include <stdint.h>
+#include <string.h>
+
+#define ZT_TRACE_RING_SZ        (1 << 16) // bytes per thread, must be a power of two
+#define ZT_TRACE_MAX_ARGS_SZ    256     // encoded arguments per record, extra arguments are dropped
+#define ZT_TRACE_MAX_STR_SZ     64      // characters of a string argument which are kept
+#define ZT_TRACE_FLUSH_INTERVAL 50      // ms between flushes
+
+// Debug.hpp (and so this file) is included from within libzt.h's extern "C" block
+extern "C++" {
+
+#include <type_traits>
+
+namespace ZeroTier {
+namespace TraceRing {
+
+	/*
+	 * One per DEBUG_* call site, its address serves as the record's format ID
+	 */
+	struct site
+	{
+		const char *tag;
+		const char *fmt;
+		const char *file;
+		const char *func;
+		int line;
+	};
+
+	enum arg_type
+	{
+		ARG_INT = 1,
+		ARG_UINT,
+		ARG_DBL,
+		ARG_PTR,
+		ARG_STR
+	};
+
+	/*
+	 * Raw arguments of a record, each is a type byte followed by an 8-byte value or (for
+	 * strings) a length byte and the characters
+	 */
+	struct args
+	{
+		unsigned char buf[ZT_TRACE_MAX_ARGS_SZ];
+		size_t len;
+
+		args() : len(0) {}
+
+		void put(unsigned char type, const void *v)
+		{
+			if(len + 9 > sizeof buf)
+				return;
+			buf[len++] = type;
+			memcpy(buf + len, v, 8);
+			len += 8;
+		}
+
+		void putstr(const char *s)
+		{
+			size_t n = s ? strnlen(s, ZT_TRACE_MAX_STR_SZ) : 0;
+			if(len + 2 + n > sizeof buf)
+				return;
+			buf[len++] = ARG_STR;
+			buf[len++] = (unsigned char)n;
+			memcpy(buf + len, s, n);
+			len += n;
+		}
+	};
+
+	template<typename T>
+	inline typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type
+	put(args &a, T v)
+	{
+		if(std::is_signed<T>::value) {
+			int64_t i = (int64_t)v;
+			a.put(ARG_INT, &i);
+		}
+		else {
+			uint64_t u = (uint64_t)v;
+			a.put(ARG_UINT, &u);
+		}
+	}
+
+	inline void put(args &a, double v) { a.put(ARG_DBL, &v); }
+	inline void put(args &a, const char *s) { a.putstr(s); }
+	inline void put(args &a, char *s) { a.putstr(s); }
+
+	template<typename T>
+	inline void put(args &a, T *p)
+	{
+		uint64_t u = (uint64_t)(uintptr_t)p;
+		a.put(ARG_PTR, &u);
+	}
+
+	inline void encode(args &a) {}
+
+	template<typename T, typename... R>
+	inline void encode(args &a, T v, R... rest)
+	{
+		put(a, v);
+		encode(a, rest...);
+	}
+
+	/*
+	 * Appends a record to the calling thread's ring (creating it on first use)
+	 */
+	void emit(const struct site *s, const args &a);
+
+	/*
+	 * Formats and writes out everything recorded so far, the flushing thread calls this
+	 * periodically. Also useful right before exiting or aborting
+	 */
+	void flush();
+
+	template<typename... A>
+	inline void record(const struct site *s, A... a)
+	{
+		args enc;
+		encode(enc, a...);
+		emit(s, enc);
+	}
+}
+}
+}
+
+#define ZT_TRACE_RECORD(tag, fmt, ...) do {                                            \
+	static const struct ZeroTier::TraceRing::site _zt_trace_site =                        \
+		{ tag, "" fmt, __FILE__, __FUNCTION__, __LINE__ };                                   \
+	ZeroTier::TraceRing::record(&_zt_trace_site, ##__VA_ARGS__);                          \
+} while(0)
+
+#endif // ZT_TRACE_RING_HPP
@@ -30,6 +30,8 @@
 #include <sys/socket.h>
 #include <poll.h>
 #include <net/if.h>
+#include <netdb.h>
+#include <stdint.h>
 
 /****************************************************************************/
 /* For SOCK_RAW support, it will initially be modeled after linux's API, so */
@@ -82,7 +84,10 @@ struct zts_ifreq {
 /****************************************************************************/
 
 #define LWIP_APPLICATION_POLL_FREQ         2
-#define LWIP_TCP_TIMER_INTERVAL            50
+// lwIP's TCP timers tick every TCP_TMR_INTERVAL (5 ms, see lwipopts.h), retransmission
+// timeouts, TCP_USER_TIMEOUT and ZT_SO_TCP_RTO_MIN every other tick. Up to this many ticks
+// missed while the stack thread was held up are made up at once, beyond that time is dropped
+#define LWIP_TCP_TIMER_CATCHUP             20
 #define LWIP_STATUS_TMR_INTERVAL           500 // How often we check connection statuses (in ms)
 
 /****************************************************************************/
@@ -90,18 +95,185 @@ struct zts_ifreq {
 /****************************************************************************/
 
 #define ZT_SDK_MTU                         ZT_MAX_MTU
-#define ZT_PHY_POLL_INTERVAL               2 // ms
+#define ZT_PHY_POLL_MAX_INTERVAL           100 // ms (longest a stack thread sleeps between pending timers)
+
+// A stack thread which sees this many frames arrive between two passes stops sleeping and
+// polls until none have arrived for ZT_BUSY_POLL_US, producers don't wake it meanwhile. See
+// zts_set_busy_poll(), 0 frames leaves it sleeping whenever there's nothing queued
+#define ZT_BUSY_POLL_FRAMES                16
+#define ZT_BUSY_POLL_US                    100
+
+// Wakeups outside ZTS_POWER_NORMAL (see zts_set_power_mode()) are coalesced to multiples of
+// these on the steady clock, background mode also stretches TCP keepalives by this factor
+#define ZT_POWER_LOW_SLOT_MS               1000
+#define ZT_POWER_BACKGROUND_SLOT_MS        10000
+#define ZT_POWER_KEEPALIVE_STRETCH         4
+
+// Number of threads running the stack for all SocketTaps (assigned by nwid), 0 gives every
+// SocketTap a thread of its own. Since picoTCP and lwIP each run as a single global instance
+// which isn't reentrant, 1 is the safe choice for apps which join more than one network.
+// Raising it does not spread TCP processing over more cores, that would require a stack
+// which can run as several independent contexts (NO_SYS lwIP and picoTCP keep all of their
+// PCBs, timers and pools in globals)
+#define ZT_STACK_THREAD_POOL_SZ            0
+
+// Most SocketTaps torn down at once by dismantleTaps(), each waits on its own TX thread
+#define ZT_TAP_TEARDOWN_THREADS            8
+
+// How long (ms) the connections of a tap which goes away wait for the next tap on its network
+// (see zts_set_rebind_grace()), 0 tears them down with it. The most zts_set_rebind_grace() takes
+#define ZT_TAP_REBIND_GRACE_MS             0
+#define ZT_TAP_REBIND_GRACE_MAX_MS         600000
 #define ZT_ACCEPT_RECHECK_DELAY            100 // ms (for blocking zts_accept() calls)
 #define ZT_CONNECT_RECHECK_DELAY           100 // ms (for blocking zts_connect() calls)
+#define ZT_CONNECT_ANY_STAGGER             250 // ms between zts_connect_any() attempts (RFC 8305)
+
+// zts_pool_connect() defaults (see zts_pool_config): idle connections kept per address, how
+// long one may idle and how long dialing one may take. The pool is health-checked and topped
+// up every ZT_POOL_INTERVAL, to the most connections in use at once over the latest
+// ZT_POOL_DEMAND_WINDOW (or the one before)
+#define ZT_POOL_MAX_IDLE                   8
+#define ZT_POOL_IDLE_TIMEOUT               60000 // ms
+#define ZT_POOL_DIAL_TIMEOUT               5000  // ms
+#define ZT_POOL_INTERVAL                   1000  // ms
+#define ZT_POOL_DEMAND_WINDOW              10000 // ms
+#define ZT_CONNECT_ANY_MAX                 16  // addresses
+#define ZT_DIRECT_IO_RECHECK_DELAY         100 // ms (for blocking direct I/O calls)
+#define ZT_CQ_RECHECK_DELAY                100 // ms (for zts_complete() calls with operations pending)
 #define ZT_API_CHECK_INTERVAL              500 // ms
+#define ZT_START_CHECK_INTERVAL            10  // ms (zts_simple_start() and zts_start_async() readiness checks)
+
+// How often learned peer paths are saved to the home path (see zts_enable_peer_path_cache()),
+// and how long ago a path must have last received for it to be tried again after a restart
+#define ZT_PEER_PATH_CACHE_INTERVAL        30000    // ms
+#define ZT_PEER_PATH_CACHE_MAX_AGE         86400000 // ms
+
+// A service whose state is kept in a store (see zts_set_state_store()) runs on a scratch home
+// path below ZT_STATE_SCRATCH_DIR (P_tmpdir where that doesn't exist), which is put back into
+// the store this often. The store's ZT_STATE_INDEX_KEY lists its other keys, one per line
+#define ZT_STATE_SCRATCH_DIR               "/dev/shm"
+#define ZT_STATE_SYNC_INTERVAL             10000 // ms
+#define ZT_STATE_INDEX_KEY                 "libzt.keys"
+
+// State libzt writes to the home path (network .conf files, the peer path cache) is queued for
+// a background writer which waits this long for more before writing and fsync()ing a batch,
+// see zts_get_state_write_stats()
+#define ZT_STATE_WRITE_DELAY               250 // ms
+
+// Where zts_daemon_start() serves and the zts_daemon_*() client calls look when given NULL
+#define ZT_DAEMON_SOCKET_PATH              "/tmp/libzt.sock"
+
+// Most identities kept ready by zts_identity_pool_fill() and left over from
+// zts_generate_identity_parallel(), which services starting without one are given first
+#define ZT_IDENTITY_POOL_MAX               64
+
+// How stale the view of peers behind zts_get_peers(), zts_get_peer_address() and
+// zts_get_peer_count() may be before the next call re-reads it from the core
+#define ZT_PEER_CACHE_TTL                  1000 // ms
+
+// How often the core's latency to each root and moon is sampled (see zts_get_upstreams()), and
+// by how much another upstream must beat the preferred one before it takes over
+#define ZT_UPSTREAM_SAMPLE_INTERVAL        5000 // ms
+#define ZT_UPSTREAM_HYSTERESIS             10   // ms
+
+// Defaults of zts_set_nat_traversal(), and the most endpoints tried for one peer. A NAT whose
+// allocations step by more than ZT_NAT_PREDICT_MAX_STRIDE ports is tried either side of its last
+#define ZT_NAT_PREDICT_PORTS               8
+#define ZT_NAT_RANDOM_PORTS                16
+#define ZT_NAT_HINTS_MAX                   64
+#define ZT_NAT_PREDICT_MAX_STRIDE          64
+
+// Number of frames which may be waiting between the ZeroTier core and the stack,
+// and the number of preallocated buffers those frames are carried in. The pool is
+// larger since the stack holds on to buffers until their contents have been read.
+#define ZT_FRAME_RX_QUEUE_LEN              128
+#define ZT_FRAME_POOL_SZ                   512
+
+// Overload behavior of that queue (percentages of ZT_FRAME_RX_QUEUE_LEN). Past ZT_FRAME_RX_RED_MIN
+// arriving frames are dropped at random, more likely the fuller it is, and all of them once it's
+// full (100 leaves only the latter). From ZT_FRAME_RX_PRESSURE_ON until the stack has drained it
+// below ZT_FRAME_RX_PRESSURE_OFF the tap asks whatever feeds it to hold off, see
+// zts_network_stats.rx_pressure
+#define ZT_FRAME_RX_RED_MIN                75
+#define ZT_FRAME_RX_PRESSURE_ON            90
+#define ZT_FRAME_RX_PRESSURE_OFF           50
+
+// Frames the stack may have sent but the ZeroTier core has yet to take. Each network has a thread
+// of its own handing them to the core so that the stack thread never waits while the core
+// encrypts and sends, 0 leaves that to the stack thread
+#define ZT_FRAME_TX_RING_LEN               256
+
+// Frames marked interactive (IPTOS_LOWDELAY, or DSCP class 2 and up, see IP_TOS/IPV6_TCLASS in
+// zts_setsockopt()) skip ahead of the bulk ones in a ring of their own, the TX thread sends
+// them first in each batch. 0 sends everything in order
+#define ZT_FRAME_TX_PRIO_RING_LEN          64
+
+// What the core puts around a frame it sends: the ZeroTier packet header and an EXT_FRAME's
+// network ID, flags, MACs and ethertype (FRAME carries less). A network's path MTU is the
+// core's UDP payload MTU (ZT_UDP_DEFAULT_PAYLOAD_MTU, the same over every physical path) less
+// this, where the core doesn't have to fragment what it sends. See SocketTap::pathMtu()
+#define ZT_FRAME_OVERHEAD                  (28 + 23)
+
+// The stacks' own allocations are served from ZT_ARENA_CLASSES size classes of up to
+// ZT_ARENA_MAX_BLOCK bytes (larger ones go to the heap), see zts_stack_config.arena_kb and
+// zts_get_arena_stats(). Builds with ZT_ARENA=0 leave them to the heap
+#define ZT_ARENA_CLASSES                   13
+#define ZT_ARENA_MAX_BLOCK                 65536
+
+// In-order TCP segments of one flow which are waiting in the RX queue together are merged
+// into one segment of up to this many bytes before the stack sees them (0 disables). The
+// merged segment's TCP checksum is stale, so builds which verify checksums don't merge
+#if defined(ZT_CHECKSUM_CHECK)
+#define ZT_RX_COALESCE_MAX                 0
+#else
+#define ZT_RX_COALESCE_MAX                 32768
+#endif
 
-#define MAX_PICO_FRAME_RX_BUF_SZ           ZT_MAX_MTU * 128
-
+// Upper bound on how much a Connection's TX/RX buffers may grow to by socket type,
+// memory is only committed as data is queued. SO_SNDBUF/SO_RCVBUF can lower this.
 #define ZT_TCP_TX_BUF_SZ                   1024 * 1024 * 128
 #define ZT_TCP_RX_BUF_SZ                   1024 * 1024 * 128
 #define ZT_UDP_TX_BUF_SZ                   ZT_MAX_MTU
 #define ZT_UDP_RX_BUF_SZ                   ZT_MAX_MTU * 10
 
+// TCP buffers are autotuned (see zts_stack_config.tcp_buf_autotune_kb): every interval each
+// cap is set to twice what went through the buffer in a round trip, starting from and never
+// below the minimum. They fall back to it once idle, and don't grow under memory pressure.
+// SO_SNDBUF/SO_RCVBUF turn this off for that buffer, the stack's is tuned along on picoTCP
+#define ZT_BUF_TUNE_INTERVAL_MS            100
+#define ZT_BUF_TUNE_MIN_SZ                 1024 * 256
+#define ZT_BUF_TUNE_IDLE_S                 5
+#define ZT_BUF_TUNE_MIN_RTT_MS             1
+
+// We stop reading a TCP Connection's socketpair once its TX buffer is this full (% of its
+// capacity) and start again when the stack has drained it to the low-water mark, leaving a
+// fast writer blocked in write() (and so governed by the TCP window) rather than overrunning
+#define ZT_TCP_TX_HIGH_WATER               75 // %
+#define ZT_TCP_TX_LOW_WATER                25 // %
+
+// Likewise we stop taking data from the stack once the RX buffer is this full, leaving it
+// queued in the stack (which shrinks the window it advertises) until the app has read the
+// RX buffer down to the low-water mark
+#define ZT_TCP_RX_HIGH_WATER               75 // %
+#define ZT_TCP_RX_LOW_WATER                25 // %
+
+// A Connection whose TX and RX buffers have been empty and unused for this long gives their
+// memory back to a pool shared by all of them, the next write takes it again. Checked every
+// ZT_HOUSEKEEPING_INTERVAL, see zts_stack_config.buf_park_s
+#define ZT_SOCK_BUF_PARK_IDLE              30 // s
+
+// With zts_stack_config.mem_limit_kb set, socket buffers, frame pools and the stacks' arena
+// share that budget (see zts_get_mem_stats()). Past ZT_MEM_PRESSURE_PCT of it no socket buffer
+// holds more than ZT_MEM_PRESSURE_BUF_SZ and idle ones are released at once, past
+// ZT_MEM_REFUSE_PCT new sockets fail with ENOBUFS. Buffers and the arena stop growing at the limit
+#define ZT_MEM_PRESSURE_PCT                80
+#define ZT_MEM_REFUSE_PCT                  95
+#define ZT_MEM_PRESSURE_BUF_SZ             (256 * 1024)
+
+// Most a connection takes from picoTCP at a time, what's left waits its turn behind the other
+// connections of the tap which have data to read so that one bulk flow can't hold up the rest
+#define ZT_TCP_RX_QUANTUM                  65536
+
 // Send and Receive buffer sizes for the network stack
 // By default picoTCP sets them to 16834, this is good for embedded-scale
 // stuff but you might want to consider higher values for desktop and mobile
@@ -112,7 +284,25 @@ struct zts_ifreq {
 // Maximum size we're allowed to read or write from a stack socket
 // This is put in place because picoTCP seems to fail at higher values.
 // If you use another stack you can probably bump this up a bit.
-#define ZT_STACK_SOCKET_WR_MAX             4096
+// Longest pbuf chain handed to SocketTap::_gatherHandler, longer chains are flattened
+#define ZT_MAX_TX_IOV                      16
+
+// Datagrams per sendmmsg()/recvmmsg() handed to the kernel by zts_sendmmsg()/zts_recvmmsg(),
+// and iovec entries available to each such batch (and to a single zts_sendmsg()/zts_recvmsg())
+#define ZT_MMSG_BATCH                      64
+#define ZT_MMSG_IOV_MAX                    256
+
+// Where zts_enable_http_control_plane() serves GET /metrics (OpenMetrics text) and
+// GET /connections (see zts_dump_connections()). Bound to
+// loopback unless built with another address, the endpoint has no authentication
+#ifndef ZT_HTTP_CONTROL_PLANE_ADDR
+#define ZT_HTTP_CONTROL_PLANE_ADDR         "127.0.0.1"
+#endif
+#ifndef ZT_HTTP_CONTROL_PLANE_PORT
+#define ZT_HTTP_CONTROL_PLANE_PORT         9994
+#endif
+
+#define ZT_STACK_SOCKET_WR_MAX             65536 // picoTCP segments each write itself
 #define ZT_STACK_SOCKET_RD_MAX             4096*4
 
 #define ZT_CORE_VERSION_MAJOR              1
@@ -125,6 +315,7 @@ struct zts_ifreq {
 
 #define ZT_MAX_IPADDR_LEN                  64
 #define ZT_ID_LEN                          10
+#define ZT_IDENTITY_SECRET_LEN             384 // buffer size for zts_generate_identity()
 #define ZT_VER_STR_LEN                     6
 #define ZT_HOME_PATH_MAX_LEN               128
 
@@ -147,16 +338,215 @@ struct zts_ifreq {
 // Wait time for socket closure if data is still present in the write queue
 #define ZT_SDK_CLTIME                      60
 
-// After closing a pico_socket, other threads might still try to use the 
-// Connection object for remaining data I/O, as a safety measure we will wait to 
-// delete this Connection object until the socket has been closed for some arbitrary
-// amount of time and it is safe to assume any clients interacting with this
-// socket have read some sort of error code from the API.
-#define ZT_CONNECTION_DELETE_WAIT_TIME     30 // s
+#define ZT_LISTEN_BACKLOG_MAX              4096 // zts_listen() backlogs are capped at this (like SOMAXCONN)
+#define ZT_ACCEPT_MANY_MAX                 64   // Connections accepted per zts_accept_many() call
+
+// Number of retired Connection objects kept for reuse, and number of socketpairs
+// created ahead of time for new Connections (replenished during housekeeping)
+#define ZT_CONNECTION_POOL_SZ              256
+#define ZT_SOCKETPAIR_POOL_SZ              64
+
+// Direct I/O: zts_read()/zts_write()/zts_recv()/zts_send() copy straight between the
+// caller's buffer and the Connection's TX/RX buffers instead of passing through the
+// socketpair (the app's fd remains valid as a handle, but no data arrives on it).
+// Enable per socket with zts_setsockopt(fd, ZT_SOL_LIBZT, ZT_SO_DIRECT_IO, &on, sizeof(on))
+// before calling zts_connect()/zts_listen(), accepted sockets inherit the setting.
+// Concurrent readers (or writers) on one socket are serialized as they would be by the kernel.
+#define ZT_SOL_LIBZT                       0x7a74
+#define ZT_SO_DIRECT_IO                    1
+#define ZT_SOCK_DIRECT_IO_DEFAULT          false
+
+// Most events one JNI ztjni_nio_epoll_wait() call hands back
+#define ZT_JNI_EPOLL_BATCH                 256
+
+// Zero-copy sends (see zts_send_zc()) which may be queued on a socket at once
+#define ZT_ZC_MAX_PENDING                  64
+
+// Frames a node may have on the simulated wire (see zts_sim_start()) unless
+// zts_sim_config.queue_frames says otherwise, and room kept in front of each for the stack
+#define ZT_SIM_QUEUE_FRAMES                1024
+#define ZT_SIM_HEADROOM                    64
+
+// How long the simulated wire holds a frame back while its destination reports RX pressure
+#define ZT_SIM_PRESSURE_BACKOFF            500 // us
+
+// Bounce buffer zts_sendfile() uses where there's no sendfile(2) to hand data to the kernel,
+// and zts_splice() between two descriptors neither of which is in direct I/O mode
+#define ZT_SENDFILE_CHUNK_SZ               16384
+
+// zts_splice() flags
+#define ZT_SPLICE_F_NONBLOCK               0x02 // like SPLICE_F_NONBLOCK
+
+// Egress shaping, see zts_set_network_rate() and SO_MAX_PACING_RATE (SOL_SOCKET, bytes/s as
+// a 32 or 64 bit value, 0 or ~0 is unlimited). A token bucket holding ZT_TX_SHAPER_BURST_MS worth
+// of the rate unless given a burst (never less than ZT_TX_SHAPER_BURST_MIN bytes) meters payload
+// bytes as the stack thread hands them to the stack. TCP data over the limit waits in TXbuf and
+// the app is held back through the socketpair as it is by a full window, nothing is dropped or
+// retransmitted. A datagram is sent whole, further ones wait in the socketpair until it's paid for
+#if !defined(SO_MAX_PACING_RATE)
+#define SO_MAX_PACING_RATE                 47
+#endif
+#define ZT_TX_SHAPER_BURST_MS              10
+#define ZT_TX_SHAPER_BURST_MIN             16384
+
+// Frame compression, see zts_set_network_compression(). Unicast frames of at least
+// ZT_COMPRESS_MIN_LEN bytes are sent compressed if that saves ZT_COMPRESS_MIN_SAVING percent,
+// after a frame which doesn't the next ZT_COMPRESS_SKIP_FRAMES to that peer aren't tried.
+// Peers are asked whether they take them every ZT_COMPRESS_HELLO_INTERVAL until they answer
+#define ZT_COMPRESS_ETHERTYPE              0x88b5
+#define ZT_COMPRESS_MIN_LEN                128
+#define ZT_COMPRESS_MIN_SAVING             10
+#define ZT_COMPRESS_SKIP_FRAMES            32
+#define ZT_COMPRESS_HELLO_INTERVAL         5000 // ms
+#define ZT_COMPRESS_MAX_PEERS              1024
+
+// Admission control, see zts_set_admission_limits(). Each tap hashes peers into this many
+// slots (allocated once a limit is set), peers sharing one share its limits
+#define ZT_ADMISSION_SLOTS                 1024
+
+// Send coalescing: TXbuf is held back from the stack until ZT_SO_TCP_COALESCE_BYTES have
+// queued up or the oldest queued byte has waited ZT_SO_TCP_COALESCE_MS (0 bytes disables it).
+// TCP_CORK (IPPROTO_TCP) holds back anything less than a full segment for up to
+// ZT_TCP_CORK_MAX_DELAY or until it is cleared. TCP_NODELAY is passed on to the stack
+#define ZT_SO_TCP_COALESCE_BYTES           2
+#define ZT_SO_TCP_COALESCE_MS              3
+#define ZT_TCP_COALESCE_BYTES_DEFAULT      0
+#define ZT_TCP_COALESCE_MS_DEFAULT         5   // ms
+#define ZT_TCP_CORK_MAX_DELAY              200 // ms
+#define ZT_SOCK_TCP_NODELAY_DEFAULT        true
+
+// TCP_CONGESTION (IPPROTO_TCP) selects a TCP socket's congestion control by name: "reno",
+// "cubic" (better suited to high-BDP paths) or "bbr" (model-based, tolerates random loss,
+// though without pacing). The default is set process-wide by zts_stack_config.tcp_congestion
+#define ZT_TCP_CONGESTION_NAME_LEN         16
+#define ZT_TCP_CONGESTION_DEFAULT          "reno"
+
+// SO_KEEPALIVE probes an idle TCP connection after TCP_KEEPIDLE s, then every TCP_KEEPINTVL s
+// and gives up after TCP_KEEPCNT unanswered ones. All of a stack's keepalives are served by
+// one timer (a single shared wheel in picoTCP, lwIP's slow timer) so idle connections cost
+// no timers of their own. Defaults are the kernel's
+#define ZT_TCP_KEEPIDLE_DEFAULT            7200 // s
+#define ZT_TCP_KEEPINTVL_DEFAULT           75   // s
+#define ZT_TCP_KEEPCNT_DEFAULT             9
+
+// TCP Fast Open (RFC 7413, lwIP only): zts_setsockopt(TCP_FASTOPEN, qlen) lets a listener
+// accept up to qlen connections on their SYN, with the data it carries, before their
+// handshake completes. A client calls zts_sendto(MSG_FASTOPEN) in place of zts_connect() and
+// its first zts_send(), which puts the data on the SYN once a cookie from the server is known
+#if !defined(TCP_FASTOPEN)
+#define TCP_FASTOPEN                       23
+#endif
+#if !defined(MSG_FASTOPEN)
+#define MSG_FASTOPEN                       0x20000000
+#endif
+
+// Fine-grained TCP timing (lwIP only, see LWIP_TCP_TIMER_CATCHUP). ZT_SO_TCP_RTO_MIN
+// (ZT_SOL_LIBZT, ms) floors a socket's retransmission timeout, down to 10 ms for peers on
+// the same LAN. TCP_QUICKACK acks every segment right away instead of delaying the ACK by up
+// to 5 ms, and stays on until cleared. TCP_USER_TIMEOUT (ms, 0 is off) drops a connection
+// whose sent data stays unacknowledged that long. Accepted sockets inherit the listener's
+#define ZT_SO_TCP_RTO_MIN                  7
+#define ZT_TCP_RTO_MIN_DEFAULT             200 // ms, like the kernel's
+#if !defined(TCP_QUICKACK)
+#define TCP_QUICKACK                       12
+#endif
+#if !defined(TCP_USER_TIMEOUT)
+#define TCP_USER_TIMEOUT                   18
+#endif
+
+// Received datagrams the app hasn't made room for yet are queued per socket, up to
+// ZT_SO_UDP_RXQ_DEPTH of them. When the queue is full either the new datagram (the default,
+// like the kernel) or the oldest queued one is dropped, see ZT_SO_UDP_RXQ_DROP_OLDEST.
+// zts_getsockopt(ZT_SO_UDP_RXQ_DROPS) returns the number dropped so far (int or uint64_t)
+#define ZT_SO_UDP_RXQ_DEPTH                4
+#define ZT_SO_UDP_RXQ_DROP_OLDEST          5
+#define ZT_SO_UDP_RXQ_DROPS                6
+#define ZT_UDP_RXQ_DEPTH_DEFAULT           64
+#define ZT_UDP_RXQ_DEPTH_MAX               4096
+#define ZT_UDP_RXQ_DROP_OLDEST_DEFAULT     false
+
+// zts_socket(AF_INET or AF_INET6, ZT_SOCK_MUX, 0) makes a stream socket whose connections to
+// the same address and port all share one libzt TCP connection (a session) instead of each
+// having a socket and PCB of its own, the peer listens with a ZT_SOCK_MUX socket too. Every
+// stream has its own ZT_MUX_WINDOW receive window, a stream whose reader falls behind only
+// stalls its own sender. Sessions with no streams left are closed after ZT_MUX_IDLE_TIMEOUT.
+// These descriptors work with the zts_*() calls for stream sockets and with zts_poll(), not
+// with zts_select(), zts_epoll_*() or completion queues, and zts_connect() always blocks
+#define ZT_SOCK_MUX                        0x40
+#define ZT_MUX_WINDOW                      (256 * 1024)
+#define ZT_MUX_FRAME_MAX                   16384
+#define ZT_MUX_IDLE_TIMEOUT                30000 // ms
+
+// zts_socket(ZTS_AF_MSG, ZT_SOCK_MSG, 0) makes a datagram socket for messages to and from ports
+// on other libzt nodes, sent as ZeroTier frames of ZT_MSG_ETHERTYPE (which the network's rules
+// have to allow) with no IP or stack in between. Addresses are zts_sockaddr_msg, a message
+// can be up to the network's MTU less ZT_MSG_HDR_LEN. With ZT_SO_MSG_RELIABLE (ZT_SOL_LIBZT)
+// set, messages are acknowledged (along with one going back if there is one within
+// ZT_MSG_ACK_DELAY) and resent after ZT_MSG_RTO, doubling, up to ZT_MSG_RETRIES times.
+// Duplicates are dropped, order isn't kept
+#define ZT_SOCK_MSG                        0x41
+#define ZTS_AF_MSG                         0x5a4d
+#define ZT_MSG_ETHERTYPE                   0x88b6
+#define ZT_MSG_HDR_LEN                     16
+#define ZT_SO_MSG_RELIABLE                 8
+#define ZT_MSG_ACK_DELAY                   2  // ms
+#define ZT_MSG_RTO                         20 // ms
+#define ZT_MSG_RETRIES                     6
+#define ZT_MSG_UNACKED_MAX                 1024 // per socket, sends beyond fail with ENOBUFS
+
+// Both stacks clamp TCP's MSS to a network's path MTU (see ZT_FRAME_OVERHEAD), larger packets
+// take two ZeroTier packets. zts_getsockopt(IP_MTU/IPV6_MTU) returns it for a socket's network.
+// With IP_MTU_DISCOVER/IPV6_MTU_DISCOVER set to IP_PMTUDISC_DO a datagram larger than that
+// fails with EMSGSIZE, any other value sends it regardless (fragmented by the stack above the
+// network's MTU, by the core above the path MTU)
+#if !defined(IP_MTU_DISCOVER)
+#define IP_MTU_DISCOVER                    10
+#endif
+#if !defined(IP_MTU)
+#define IP_MTU                             14
+#endif
+#if !defined(IPV6_MTU_DISCOVER)
+#define IPV6_MTU_DISCOVER                  23
+#endif
+#if !defined(IPV6_MTU)
+#define IPV6_MTU                           24
+#endif
+#if !defined(IP_PMTUDISC_DO)
+#define IP_PMTUDISC_DONT                   0
+#define IP_PMTUDISC_DO                     2
+#endif
+
+// With SO_TIMESTAMPNS (or SO_TIMESTAMP) set, zts_recvmsg()/zts_recvmmsg() add a SCM_TIMESTAMPNS
+// (struct timespec) or SCM_TIMESTAMP (struct timeval) control message holding when the data
+// reached the network's tap, so time spent queued in libzt can be told from time spent in the
+// app. Unlike the host's these are CLOCK_MONOTONIC. For SOCK_STREAM it is when the most recent
+// data arrived. Frames aren't stamped until some socket first sets either option
+#if !defined(SO_TIMESTAMPNS)
+#define SO_TIMESTAMPNS                     35
+#define SCM_TIMESTAMPNS                    SO_TIMESTAMPNS
+#endif
+
+// zts_getaddrinfo() asks every nameserver (see zts_add_dns_nameserver()) at once and takes the
+// first answer, asking again after ZT_DNS_TIMEOUT ms up to ZT_DNS_TRIES times in all. Answers
+// are cached for their TTL (at most ZT_DNS_MAX_TTL), names which don't resolve for the negative
+// TTL their zone gives or ZT_DNS_NEG_TTL without one
+#define ZTS_MAX_NAMESERVERS                4
+#define ZT_DNS_TIMEOUT                     1000 // ms
+#define ZT_DNS_TRIES                       3
+#define ZT_DNS_MAX_TTL                     3600 // s
+#define ZT_DNS_NEG_TTL                     60   // s
+#define ZT_DNS_CACHE_SZ                    1024 // names
 
 // Interval for performing cleanup tasks on Tap/Stack objects
 #define ZT_HOUSEKEEPING_INTERVAL           10 // s 
 
+// Local ports handed to outbound TCP connections which weren't bound first (see PortAllocator.hpp),
+// and how long after a connection is gone its port waits before going to the same destination
+#define ZT_EPHEMERAL_PORT_MIN              49152
+#define ZT_EPHEMERAL_PORT_MAX              65535
+#define ZT_EPHEMERAL_PORT_REUSE_DELAY      120000 // ms, lwIP's TIME_WAIT (2 * TCP_MSL)
+#define ZT_EPHEMERAL_PORT_TRIES            16 // ports bound on the tap passed over before the stack picks
+
 // Whether or not we want libzt to shit its pants
 #define ZT_EXIT_ON_GENERAL_FAIL            false
 
@@ -172,8 +562,14 @@ struct zts_ifreq {
 #define ZT_RECVFROM_SIG int fd, void *buf, size_t len, int flags, struct sockaddr *addr, socklen_t *addrlen
 #define ZT_RECVMSG_SIG int fd, struct msghdr *msg,int flags
 #define ZT_SEND_SIG int fd, const void *buf, size_t len, int flags
+#define ZT_SENDMMSG_SIG int fd, struct mmsghdr *msgvec, unsigned int vlen, int flags
+#define ZT_RECVMMSG_SIG int fd, struct mmsghdr *msgvec, unsigned int vlen, int flags, struct timespec *timeout
 #define ZT_READ_SIG int fd, void *buf, size_t len
 #define ZT_WRITE_SIG int fd, const void *buf, size_t len
+#define ZT_READV_SIG int fd, const struct iovec *iov, int iovcnt
+#define ZT_WRITEV_SIG int fd, const struct iovec *iov, int iovcnt
+#define ZT_SENDFILE_SIG int out_fd, int in_fd, off_t *offset, size_t count
+#define ZT_SPLICE_SIG int in_fd, int out_fd, size_t len, int flags
 #define ZT_SHUTDOWN_SIG int fd, int how
 #define ZT_SOCKET_SIG int socket_family, int socket_type, int protocol
 #define ZT_CONNECT_SIG int fd, const struct sockaddr *addr, socklen_t addrlen
@@ -189,6 +585,573 @@ struct zts_ifreq {
 #define ZT_FCNTL_SIG int fd, int cmd, int flags
 #define ZT_IOCTL_SIG int fd, unsigned long request, void *argp
 #define ZT_SYSCALL_SIG long number, ...
+#define ZT_EPOLL_CREATE_SIG int flags
+#define ZT_EPOLL_CTL_SIG int epfd, int op, int fd, struct zts_epoll_event *event
+#define ZT_EPOLL_WAIT_SIG int epfd, struct zts_epoll_event *events, int maxevents, int timeout
+#define ZT_CQ_CREATE_SIG unsigned int entries
+#define ZT_SUBMIT_SIG int cq, const struct zts_sqe *sqes, unsigned int n
+#define ZT_COMPLETE_SIG int cq, struct zts_cqe *cqes, unsigned int max, int timeout
+
+/****************************************************************************/
+/* libzt-native readiness notification (see zts_epoll_create())             */
+/****************************************************************************/
+
+// Values match those of epoll(7) where one exists
+#define ZTS_EPOLLIN                        0x001
+#define ZTS_EPOLLOUT                       0x004
+#define ZTS_EPOLLERR                       0x008
+#define ZTS_EPOLLHUP                       0x010
+#define ZTS_EPOLLRDHUP                     0x2000
+#define ZTS_EPOLLONESHOT                   (1u << 30)
+#define ZTS_EPOLLET                        (1u << 31)
+
+#define ZTS_EPOLL_CTL_ADD                  1
+#define ZTS_EPOLL_CTL_DEL                  2
+#define ZTS_EPOLL_CTL_MOD                  3
+
+typedef union zts_epoll_data {
+	void *ptr;
+	int fd;
+	uint32_t u32;
+	uint64_t u64;
+} zts_epoll_data_t;
+
+struct zts_epoll_event {
+	uint32_t events;
+	zts_epoll_data_t data;
+};
+
+/****************************************************************************/
+/* libzt-native completion queues (see zts_cq_create())                     */
+/****************************************************************************/
+
+#define ZTS_OP_READ                        1 // res is the number of bytes received (0 at EOF)
+#define ZTS_OP_WRITE                       2 // res is the number of bytes sent, which may be short
+#define ZTS_OP_ACCEPT                      3 // res is the accepted descriptor
+#define ZTS_OP_CONNECT                     4 // res is 0 once connected
+
+struct zts_sqe {
+	int op;                      // ZTS_OP_*
+	int fd;
+	void *buf;                   // ZTS_OP_READ/ZTS_OP_WRITE, must stay valid until completion
+	size_t len;
+	const struct sockaddr *addr; // ZTS_OP_CONNECT, copied during zts_submit()
+	socklen_t addrlen;
+	uint64_t user_data;          // handed back in the zts_cqe
+};
+
+struct zts_cqe {
+	uint64_t user_data;
+	int op;
+	int fd;
+	ssize_t res;                 // see ZTS_OP_*, or -errno
+};
+
+/****************************************************************************/
+/* Layer-2 frames (see zts_raw_send_batch(), zts_raw_recv_batch())          */
+/****************************************************************************/
+
+struct zts_raw_frame {
+	void *data;                  // Ethernet frame, header included
+	size_t len;                  // Length of the frame, or the room at data when receiving
+};
+
+/****************************************************************************/
+/* Shared memory frame bridge (see zts_shm_export())                         */
+/****************************************************************************/
+
+// The layout a process mapping the bridge's memfd finds. Both rings are single-producer,
+// single-consumer: head is only stored by the producer, tail only by the consumer, each with
+// release semantics and loaded by the other side with acquire. Slot i of a ring starts at
+// ring + sizeof(struct zts_shm_ring) + (i % slots) * slot_sz with a uint32_t length followed
+// by the Ethernet frame, header included
+#define ZTS_SHM_MAGIC                      0x5a54534d // "ZTSM"
+#define ZTS_SHM_VERSION                    1
+#define ZTS_SHM_SLOT_SZ                    4096
+#define ZTS_SHM_DEFAULT_SLOTS              512
+
+struct zts_shm_ring {
+	uint32_t head;               // slots produced so far (wraps)
+	uint32_t pad0[15];
+	uint32_t tail;               // slots consumed so far (wraps)
+	uint32_t pad1[15];
+	uint32_t drops;              // frames the producer found no room for, or too large for a slot
+	uint32_t pad2[15];
+};
+
+struct zts_shm_header {
+	uint32_t magic;              // ZTS_SHM_MAGIC
+	uint32_t version;            // ZTS_SHM_VERSION
+	uint32_t slots;              // per ring, a power of two
+	uint32_t slot_sz;            // ZTS_SHM_SLOT_SZ
+	uint64_t nwid;
+	uint64_t mac;                // this device's MAC on the network
+	uint64_t rx_off;             // to the ring of frames from the network (libzt produces)
+	uint64_t tx_off;             // to the ring of frames for the network (libzt consumes)
+	uint32_t pad[4];
+};
+
+struct zts_shm_info {
+	int memfd;                   // map size bytes of it MAP_SHARED, read and write
+	int rx_eventfd;              // libzt adds 1 after producing into an empty RX ring
+	int tx_eventfd;              // add 1 after producing into an empty TX ring
+	size_t size;
+};
+
+/****************************************************************************/
+/* Statistics (see zts_get_socket_stats(), zts_get_network_stats())         */
+/****************************************************************************/
+
+struct zts_socket_stats {
+	uint64_t bytes_in;       // received by the stack and handed to the app
+	uint64_t bytes_out;      // written by the app and handed to the stack
+	uint64_t rx_drops;       // datagrams dropped for lack of queue space (see ZT_SO_UDP_RXQ_DEPTH)
+	uint64_t accept_overflows; // connections refused because the listen backlog was full
+	uint32_t txbuf_hwm;      // most bytes ever waiting in the TX buffer
+	uint32_t rxbuf_hwm;      // most bytes ever waiting in the RX buffer
+	uint32_t accept_backlog; // connections accepted by the stack but not yet by the app
+	uint32_t retransmits;    // TCP segments retransmitted (from the stack's PCB)
+	uint32_t rtt_ms;         // smoothed round-trip time (from the stack's PCB)
+	uint32_t rttvar_ms;
+	uint32_t rto_ms;
+	uint32_t cwnd;           // congestion window in segments
+};
+
+// One row of zts_dump_connections(), fields which the network stack doesn't provide are 0
+struct zts_connection_info {
+	int fd;
+	int type;                // SOCK_STREAM or SOCK_DGRAM
+	int state;               // ZT_SOCK_STATE_*
+	int stack;               // ZTS_STACK_PICO or ZTS_STACK_LWIP
+	uint64_t nwid;           // network of the socket's tap
+	struct sockaddr_storage local;
+	struct sockaddr_storage peer;
+	uint32_t txbuf;          // bytes waiting in the TX buffer
+	uint32_t txbuf_cap;
+	uint32_t rxbuf;          // bytes waiting in the RX buffer
+	uint32_t rxbuf_cap;
+	uint32_t stack_sndq;     // bytes the stack has yet to send or see acked
+	uint32_t stack_rcvq;     // bytes the stack holds which haven't reached the RX buffer
+	uint32_t cwnd;           // congestion window in segments
+	uint32_t rtt_ms;         // smoothed round-trip time
+	uint32_t rttvar_ms;
+	uint32_t retransmits;
+};
+
+struct zts_network_stats {
+	uint64_t frames_in;      // from the ZeroTier virtual wire
+	uint64_t bytes_in;
+	uint64_t frames_out;     // to the ZeroTier virtual wire
+	uint64_t bytes_out;
+	uint64_t frames_dropped; // received but never given to the stack
+	uint64_t rx_coalesced;   // merged into the TCP segment before them (see ZT_RX_COALESCE_MAX)
+	uint64_t stack_ticks;    // passes of the stack's timers (shared by networks on one stack thread)
+	uint64_t stack_tick_us;  // time spent in them
+	uint32_t rxq_hwm;        // most frames ever waiting for the stack at once
+	uint32_t nconns;         // Connections known to the network's tap
+	uint32_t stack;          // ZTS_STACK_PICO or ZTS_STACK_LWIP, see zts_join_stack()
+	uint32_t rx_pressure;    // 1 while the stack is falling behind, see ZT_FRAME_RX_PRESSURE_ON
+	uint64_t rxq_overflows;  // of frames_dropped, those which found the RX frame queue full
+	uint64_t rxq_early_drops; // and those shed early, see ZT_FRAME_RX_RED_MIN
+	uint64_t rx_pressure_events; // times rx_pressure was raised
+	uint64_t compressed;     // of frames_out, those sent compressed (see zts_set_network_compression())
+	uint64_t compress_saved; // bytes that saved
+	uint64_t incompressible; // frames which didn't compress enough
+	uint64_t decompressed;   // compressed frames received
+	uint64_t decompress_errors; // and those dropped as malformed
+	uint64_t conns_refused;  // inbound connections over a limit (see zts_set_admission_limits())
+	uint64_t frames_limited; // of frames_dropped, those over their source's frame rate
+	uint64_t stack_tick_max_us; // longest of the stack_ticks
+	uint64_t loop_busy_us;   // the stack thread's, see zts_get_stack_loop_stats()
+	uint64_t loop_idle_us;
+};
+
+// See zts_get_stack_loop_stats()
+#define ZTS_LOOP_BUCKETS                   24
+#define ZT_LOOP_BUSY_WINDOW_MS             1000
+
+// Passes of a stack thread, shared by the networks it serves. Idle is time spent waiting for
+// something to do, busy everything else: the stack's timers, frames going into the stack, the
+// sockets' I/O and the stack's callbacks
+struct zts_stack_loop_stats {
+	uint32_t networks;       // served by the thread
+	uint32_t busy_pct;       // over the latest ZT_LOOP_BUSY_WINDOW_MS (or more) of passes
+	uint64_t passes;
+	uint64_t busy_us;
+	uint64_t idle_us;
+	uint64_t frames;         // handed to the stack
+	uint64_t pass_p50_ns;    // busy time of a pass, upper bounds of log-linear buckets (within 12.5%)
+	uint64_t pass_p99_ns;
+	uint64_t pass_p999_ns;
+	uint64_t pass_max_ns;
+	uint64_t pass_hist[ZTS_LOOP_BUCKETS];   // passes busy for 2^i to 2^(i+1) us, [0] from 0, the last one open-ended
+	uint64_t frames_hist[ZTS_LOOP_BUCKETS]; // passes handing the stack 2^i to 2^(i+1) frames, likewise
+};
+
+// What a stack thread is doing, see zts_set_stack_watchdog()
+#define ZTS_STACK_PHASE_IDLE               0 // waiting for work, never reported
+#define ZTS_STACK_PHASE_COMMANDS           1 // calls app threads make on the stack (see SocketTap::RunOnStack())
+#define ZTS_STACK_PHASE_SOCKET_IO          2 // moving data between the socketpairs and the stack
+#define ZTS_STACK_PHASE_STACK              3 // the stack's timers and output
+#define ZTS_STACK_PHASE_FRAME_RX           4 // handing received frames to the stack
+#define ZTS_STACK_PHASE_CALLBACK           5 // a stack's socket callback (pico_cb_socket_activity(), nc_recved(), ...)
+#define ZTS_STACK_PHASE_HANDLER            6 // sending a frame through the core
+#define ZTS_STACK_PHASE_HOUSEKEEPING       7 // closing, reaping and reconfiguring sockets
+#define ZTS_STACK_PHASE_COUNT              8
+
+struct zts_stack_watchdog_stats {
+	uint64_t stalls;         // phases which went on for longer than the threshold
+	uint64_t by_phase[ZTS_STACK_PHASE_COUNT];
+	uint64_t longest_ms;
+	uint64_t longest_nwid;   // the network the thread which stalled for longest_ms first served
+	int longest_phase;
+	int threshold_ms;        // 0 while off
+};
+
+/**
+ * Called once for each phase of a stack thread's pass found running for threshold_ms or more,
+ * with how long it had when noticed (in progress, it may go on for longer). Runs on the
+ * watchdog's thread and holds up its checks, so it should return quickly
+ */
+typedef void (*zts_stall_cb)(uint64_t nwid, int phase, uint64_t stalled_ms, void *arg);
+
+// See zts_set_admission_limits(), 0 is unlimited throughout
+struct zts_admission_limits {
+	uint32_t peer_conns;       // inbound connections at once from one remote address
+	uint32_t tap_conns;        // inbound connections at once on the network
+	uint32_t peer_conn_rate;   // new inbound connections/s from one remote address
+	uint32_t peer_conn_burst;  // taken at once, 0 is peer_conn_rate
+	uint32_t peer_frame_rate;  // frames/s from one source MAC
+	uint32_t peer_frame_burst; // 0 is peer_frame_rate
+};
+
+#define ZTS_PEER_ROLE_LEAF                 0
+#define ZTS_PEER_ROLE_MOON                 1
+#define ZTS_PEER_ROLE_PLANET               2
+
+// A peer and its best path, see zts_get_peers()
+struct zts_peer_info {
+	uint64_t address;        // ZeroTier address (device ID)
+	int latency;             // ms, -1 if unknown
+	int role;                // ZTS_PEER_ROLE_*
+	int version[3];          // major, minor, revision, -1 if unknown
+	uint32_t paths;          // live (unexpired) physical paths
+	struct sockaddr_storage preferred; // the path in use, ss_family is 0 if relayed
+	uint64_t last_receive;   // when anything last arrived over preferred (ms, ZeroTier clock)
+	int time_to_direct;      // ms from when the peer was first seen (or the service started, for those
+	                         // seen right away) to its first direct path, -1 while it has had none
+};
+
+// See zts_set_nat_traversal()
+struct zts_nat_traversal {
+	int enabled;
+	uint32_t predict_ports;  // ports following a symmetric NAT's last allocations tried for it
+	uint32_t random_ports;   // random ports tried on a symmetric NAT's address (birthday probing)
+};
+
+// See zts_get_traversal_stats(), leaf peers only
+struct zts_traversal_stats {
+	uint32_t peers_direct;   // with a direct path now
+	uint32_t peers_relayed;  // and without one
+	uint32_t went_direct;    // peers seen to get their first direct path
+	int first_direct_ms;     // from the service starting to the first direct path, -1 if none yet
+	int time_to_direct_avg_ms; // of went_direct, -1 if none
+	int time_to_direct_max_ms;
+	uint32_t hints;          // endpoints handed to the core to try at start (see zts_enable_peer_path_cache())
+	uint32_t hints_predicted; // of hints, those predicted by zts_set_nat_traversal()
+};
+
+// See zts_get_mux_stats()
+struct zts_mux_stats {
+	uint32_t sessions;         // open now
+	uint32_t streams;          // open now, over those sessions
+	uint64_t sessions_opened;
+	uint64_t streams_opened;
+	uint64_t streams_reset;    // by either side
+	uint64_t streams_refused;  // with the listener's backlog full (or no listener left)
+	uint64_t window_stalls;    // sends which found the peer's window for the stream closed
+	uint64_t frames_out;
+	uint64_t frames_in;
+	uint64_t bytes_out;        // stream data, without frame headers
+	uint64_t bytes_in;
+};
+
+// A ZT_SOCK_MSG socket's address, a port on a node on one of the networks joined
+struct zts_sockaddr_msg {
+	sa_family_t smsg_family;   // ZTS_AF_MSG
+	uint16_t smsg_port;        // network byte order
+	uint64_t smsg_nwid;        // 0: the network the socket is bound to
+	uint64_t smsg_node;        // 40-bit ZeroTier address
+};
+
+// See zts_get_msg_stats()
+struct zts_msg_stats {
+	uint64_t sent;
+	uint64_t received;
+	uint64_t dropped;          // with no room left in the socket
+	uint64_t duplicates;
+	uint64_t retransmits;
+	uint64_t lost;             // given up on after ZT_MSG_RETRIES
+	uint64_t acks_sent;        // frames of their own
+	uint64_t acks_piggybacked; // on messages going back
+	uint32_t unacked;          // sent and not yet acknowledged, now
+};
+
+// A root or moon and its RTT history, see zts_get_upstreams()
+struct zts_upstream_info {
+	uint64_t address;
+	int role;                // ZTS_PEER_ROLE_PLANET or ZTS_PEER_ROLE_MOON
+	int latency;             // ms, the core's latest measurement, -1 if unknown
+	int latency_avg;         // ms, smoothed over recent samples, -1 before the first
+	int latency_min;         // ms, -1 before the first sample
+	int latency_max;
+	uint32_t samples;
+	int reachable;           // 1 while the upstream has a live physical path
+	int preferred;           // 1 for the reachable upstream with the lowest latency_avg
+	struct sockaddr_storage path; // the path in use
+	uint64_t last_receive;   // when anything last arrived over path (ms, ZeroTier clock)
+	uint64_t last_sample;    // when the last sample was taken (ms, ZeroTier clock), 0 if never
+};
+
+// A network's addresses as strings, see zts_get_network_addresses()
+struct zts_network_addresses {
+	char ipv4[ZT_MAX_IPADDR_LEN];     // first assigned IPv4 address, empty if none
+	char ipv6[ZT_MAX_IPADDR_LEN];     // first assigned IPv6 address, empty if none
+	char sixplane[ZT_MAX_IPADDR_LEN]; // this device's 6PLANE address on the network (assigned or not)
+	char rfc4193[ZT_MAX_IPADDR_LEN];  // this device's RFC 4193 address on the network (assigned or not)
+};
+
+// Open sockets by state, see zts_get_socket_counts()
+struct zts_socket_counts {
+	uint32_t unassigned;     // not yet bound or connected
+	uint32_t connected;      // bound or connected (and not listening)
+	uint32_t listening;
+	uint32_t closing;        // closed by the app or in the stack, not released yet
+	uint32_t host;           // handed to the host's stack, see ZTS_ROUTE_HOST
+};
+
+// What bounds the number of sockets, see zts_get_socket_limits(). -1 where there's no such limit
+struct zts_socket_limits {
+	int max_sockets;         // zts_stack_config.max_sockets
+	int fds;                 // sockets RLIMIT_NOFILE has room for, each takes a socketpair
+	int tcp;                 // TCP sockets the default stack can hold (its PCB pool)
+	int tcp_listen;
+	int udp;
+	int timers;              // stack timers, every socket needs some of them (-1 if unbounded)
+	int timers_in_use;
+};
+
+// Locks zts_get_lock_stats() reports on. Those of a tap or of a stack's frame queue are
+// reported together for every tap
+#define ZTS_LOCK_MULTIPLEXER               0 // taken by every socket call which creates, assigns or closes a socket
+#define ZTS_LOCK_VTAPS                     1 // the list of taps
+#define ZTS_LOCK_TCPCONNS                  2 // a tap's Connection list
+#define ZTS_LOCK_TAP_IPS                   3 // a tap's addresses
+#define ZTS_LOCK_TAP_MULTICAST             4 // a tap's multicast groups
+#define ZTS_LOCK_TAP_REAP                  5 // Connections a tap is closing
+#define ZTS_LOCK_FRAME_RXQ                 6 // picoTCP's queue of received frames
+#define ZTS_LOCK_LWIP_CORE                 7 // lwIP's core (every lwIP call)
+#define ZTS_LOCK_EPOLLS                    8 // zts_epoll and zts_cq instances
+#define ZTS_LOCK_COUNT                     9
+
+// Times are upper bounds of log-linear buckets (within 12.5%), in ns
+struct zts_lock_stats {
+	char name[24];           // "multiplexer", "tcpconns", ... (ZTS_LOCK_* in lower case)
+	uint64_t acquisitions;
+	uint64_t contended;      // had to wait for another holder
+	uint64_t hold_p50_ns;
+	uint64_t hold_p99_ns;
+	uint64_t hold_p999_ns;
+	uint64_t hold_max_ns;
+	uint64_t wait_p50_ns;    // over every acquisition, uncontended ones wait 0
+	uint64_t wait_p99_ns;
+	uint64_t wait_p999_ns;
+	uint64_t wait_max_ns;
+};
+
+// Stages of the data path zts_get_latency_stats() reports on
+#define ZTS_LATENCY_TX_BUF                 0 // zts_write() until the stack takes the bytes
+#define ZTS_LATENCY_TX_QUEUE               1 // a frame the stack sent until the tap's sender thread takes it
+#define ZTS_LATENCY_WIRE                   2 // handing that frame to the core
+#define ZTS_LATENCY_RX_QUEUE               3 // a frame the core delivered until the stack takes it (picoTCP only)
+#define ZTS_LATENCY_RX_BUF                 4 // bytes the stack received until zts_read() takes them
+#define ZTS_LATENCY_COUNT                  5
+
+// Times are upper bounds of log-linear buckets (within 12.5%), in ns
+struct zts_latency_stats {
+	char name[16];           // "tx_buf", "wire", ... (ZTS_LATENCY_* in lower case)
+	uint64_t samples;
+	uint64_t p50_ns;
+	uint64_t p90_ns;
+	uint64_t p99_ns;
+	uint64_t p999_ns;
+	uint64_t max_ns;
+};
+
+// See zts_ping()
+#define ZTS_PING_ICMP                      1
+#define ZTS_PING_UDP                       2
+#define ZTS_PING_TIMEOUT_MS                1000
+#define ZTS_PING_BUCKETS                   32
+
+struct zts_ping_stats {
+	int sent;
+	int received;
+	uint64_t min_us;
+	uint64_t avg_us;
+	uint64_t max_us;
+	uint64_t p50_us;
+	uint64_t p90_us;
+	uint64_t p99_us;
+	uint32_t hist[ZTS_PING_BUCKETS]; // RTTs of 2^i to 2^(i+1) us, hist[0] from 0, the last one open-ended
+};
+
+// RTT of probe seq (0 on), -1 if no reply came
+typedef void (*zts_ping_cb)(int seq, int64_t rtt_us, void *arg);
+
+// See zts_capture_start()
+struct zts_capture_stats {
+	int running;
+	uint64_t packets;        // written to the file
+	uint64_t bytes;          // of those, as captured (at most snaplen each)
+	uint64_t drops;          // matched but the writer had fallen behind
+};
+
+// Leave destination MACs as captured instead of readdressing unicast frames to the tap
+#define ZTS_REPLAY_KEEP_MACS 0x1
+
+// See zts_replay(). Zeroed, frames go in once, as fast as the stack takes them
+struct zts_replay_config {
+	uint32_t speed_pct;      // 100 keeps the recorded spacing, 200 halves it, 0 doesn't wait
+	uint32_t loops;          // passes over the file, 0 for 1
+	uint32_t flags;          // ZTS_REPLAY_*
+};
+
+struct zts_replay_stats {
+	uint64_t frames;         // given to the tap
+	uint64_t bytes;
+	uint64_t skipped;        // outbound, not Ethernet or shorter than a header
+	uint64_t truncated;      // cut short by the capture's snaplen
+	uint64_t dropped;        // by the tap meanwhile (any frame, not only replayed ones)
+	uint32_t loops;          // passes completed
+	uint64_t elapsed_us;
+	uint64_t lag_max_us;     // furthest a frame fell behind its paced time
+};
+
+// See zts_pool_configure(), a field left 0 takes the default
+struct zts_pool_config {
+	uint32_t max_idle;        // per address, ZT_POOL_MAX_IDLE
+	uint32_t idle_timeout_ms; // ZT_POOL_IDLE_TIMEOUT
+	uint32_t dial_timeout_ms; // ZT_POOL_DIAL_TIMEOUT
+	uint32_t no_prewarm;      // nonzero: only connections given back are kept, none are dialed ahead
+};
+
+struct zts_pool_stats {
+	uint64_t hits;           // zts_pool_connect() calls served by an idle connection
+	uint64_t misses;         // which had to dial
+	uint64_t prewarmed;      // connections dialed ahead of demand
+	uint64_t dial_failures;  // of those
+	uint64_t stale;          // idle connections which failed a health check (closed or reset by the peer)
+	uint64_t expired;        // idle past idle_timeout_ms
+	uint32_t peers;          // addresses the pool keeps track of
+	uint32_t idle;
+	uint32_t in_use;         // handed out and not yet released
+};
+
+// Impairments of the simulated wire, see zts_sim_start(). A field left 0 disables it
+struct zts_sim_config {
+	uint32_t latency_ms;     // one-way delay added to every frame
+	uint32_t jitter_ms;      // plus up to this much more, uniformly (reorders frames too)
+	uint32_t loss_ppm;       // frames dropped, per million
+	uint32_t reorder_ppm;    // frames delivered without the latency, overtaking those in flight
+	uint64_t bandwidth_bps;  // rate at which each node's link serializes what it sends
+	uint32_t queue_frames;   // frames a node's link holds before dropping, see ZT_SIM_QUEUE_FRAMES
+	uint32_t seed;           // same seed and traffic, same impairment decisions
+	uint32_t time_scale;     // libzt's clock runs this many times faster than real time, 0 is 1
+};
+
+struct zts_sim_stats {
+	uint64_t frames;         // delivered
+	uint64_t bytes;
+	uint64_t lost;           // dropped by zts_sim_config.loss_ppm
+	uint64_t overflowed;     // dropped because the sender's link was full
+	uint64_t reordered;
+	uint64_t held;           // delivery put off by the destination's RX pressure
+};
+
+// See zts_get_state_write_stats()
+struct zts_state_write_stats {
+	uint64_t queued;         // writes and removals asked for
+	uint64_t coalesced;      // replaced by a later one for the same file before going out
+	uint64_t written;        // files written or removed
+	uint64_t failed;
+	uint64_t batches;        // rounds of writes, each fsync()ed together
+	uint64_t max_batch_us;   // longest round
+	uint64_t pending;        // waiting for the next round
+};
+
+/****************************************************************************/
+/* Stack configuration (see zts_set_stack_config())                         */
+/****************************************************************************/
+
+// Network stacks a network can run on, see zts_join_stack(). Each is available if the library
+// was built with it (STACK_PICO=1, STACK_LWIP=1, or both)
+#define ZTS_STACK_DEFAULT                  0 // picoTCP if built with it, otherwise lwIP
+#define ZTS_STACK_PICO                     1
+#define ZTS_STACK_LWIP                     2
+
+// Backing for the frame pools and the stack arena's reservation, see zts_stack_config.hugepages.
+// Each falls back to the next one down where it isn't available (always on non-Linux platforms)
+#define ZTS_HUGEPAGES_OFF                  0 // malloc()
+#define ZTS_HUGEPAGES_THP                  1 // 2 MiB aligned mappings advised with MADV_HUGEPAGE
+#define ZTS_HUGEPAGES_TLB                  2 // MAP_HUGETLB, needs pages reserved in vm.nr_hugepages
+
+// A field left 0 keeps its compile-time default
+struct zts_stack_config {
+	int max_sockets;         // open at once, of any type and including accepted ones (0 = no limit)
+	int frame_pool_sz;       // frames each network can hold for the stack, see ZT_FRAME_POOL_SZ
+	int tcp_sndbuf;          // stack send buffer of new TCP sockets, see ZT_STACK_TCP_SOCKET_TX_SZ
+	int tcp_rcvbuf;          // stack receive buffer of new TCP sockets, this bounds their window
+	char tcp_congestion[ZT_TCP_CONGESTION_NAME_LEN]; // of new TCP sockets, see TCP_CONGESTION
+	int arena_kb;            // preallocated for the stack at zts_start(), split across size classes
+	int arena_fixed;         // nonzero: the stack never takes more than arena_kb, allocations fail
+	int buf_park_s;          // idle time after which empty TX/RX buffers are released, -1 never
+	int userspace_fds;       // nonzero: TCP sockets get libzt descriptors, see zts_get_native_fd()
+	int hugepages;           // ZTS_HUGEPAGES_*
+	int prefault;            // nonzero: frame pools and arena_kb are faulted in when allocated
+	int mem_limit_kb;        // budget for buffers, frame pools and the arena (0 = no limit)
+	int tcp_buf_autotune_kb; // most TCP buffers are autotuned up to (0 = ZT_TCP_*_BUF_SZ), -1 never
+	int cooperative;         // nonzero: no threads run the stacks, the app calls zts_run_once()
+};
+
+// One per size class of the stack's allocator, the last one counts allocations larger than
+// ZT_ARENA_MAX_BLOCK which went to the heap
+struct zts_arena_stats {
+	uint32_t block_sz;       // largest allocation the class serves (0 for the heap)
+	uint32_t capacity;       // blocks preallocated (see zts_stack_config.arena_kb)
+	uint32_t reserved;       // blocks carved so far, these are never returned to the heap
+	uint32_t in_use;         // blocks held by the stack
+	uint64_t allocs;
+	uint64_t fails;          // the class was exhausted with zts_stack_config.arena_fixed set
+};
+
+// What zts_mem_stats.used is made up of
+#define ZTS_MEM_BUFFERS                    0 // socket TX/RX buffers, including chunks kept for reuse
+#define ZTS_MEM_FRAMES                     1 // frame pools and frames allocated past them
+#define ZTS_MEM_STACK                      2 // the stacks' arena (slabs, reservation, large blocks)
+#define ZTS_MEM_CLASSES                    3
+
+// Accounting of the memory budget, see zts_stack_config.mem_limit_kb
+struct zts_mem_stats {
+	uint64_t limit;          // bytes, 0 if there's no budget
+	uint64_t used;
+	uint64_t peak;
+	uint64_t by_class[ZTS_MEM_CLASSES];
+	uint64_t refused;        // allocations which would have gone over the limit
+	uint64_t sockets_refused; // zts_socket()/zts_accept() calls which failed with ENOBUFS
+	uint64_t shrinks;        // housekeeping passes which released buffers under pressure
+	int pressure;            // nonzero while past ZT_MEM_PRESSURE_PCT
+};
 
 /****************************************************************************/
 /* SDK Socket API (ZeroTier Service Controls)                               */
@@ -209,6 +1172,139 @@ void zts_start(const char *path);
  */
 void zts_simple_start(const char *path, const char *nwid);
 
+/**
+ * Called by zts_start_async() once nwid has an address (status 0) or the wait timed out
+ * (status ETIMEDOUT). Runs on a thread of the library's, not the caller's
+ */
+typedef void (*zts_ready_cb)(const char *nwid, int status, void *arg);
+
+/**
+ * Non-blocking zts_simple_start(): starts the service, joins nwid and returns, cb is called
+ * when the network is usable. timeout is in ms, -1 waits forever
+ */
+int zts_start_async(const char *path, const char *nwid, int timeout, zts_ready_cb cb, void *arg);
+
+/**
+ * Generates a new identity (a memory-hard computation), writes its secret form to secret, which
+ * must hold ZT_IDENTITY_SECRET_LEN bytes. Lets callers generate identities ahead of time. Same as
+ * zts_generate_identity_parallel() on one thread per CPU
+ */
+int zts_generate_identity(char *secret, int len);
+
+/**
+ * Takes an identity from the pool, or else runs threads searches (0 for one per CPU) at once and
+ * writes the first to finish to secret, the others go to the pool
+ */
+int zts_generate_identity_parallel(char *secret, int len, int threads);
+
+/**
+ * Called on a background search thread each time it adds an identity to the pool, which then
+ * holds generated of the wanted
+ */
+typedef void (*zts_identity_progress_cb)(int generated, int wanted, void *arg);
+
+/**
+ * Returns at once and keeps the pool topped up to count identities (at most ZT_IDENTITY_POOL_MAX,
+ * 0 stops) by searching on up to threads threads (0 for one per CPU). cb may be NULL, arg must
+ * stay valid until the next call
+ */
+int zts_identity_pool_fill(int count, int threads, zts_identity_progress_cb cb, void *arg);
+
+/**
+ * Takes an identity (secret form) from the pool, fails with EAGAIN if it's empty
+ */
+int zts_identity_pool_take(char *secret, int len);
+
+/**
+ * How many identities the pool holds
+ */
+int zts_identity_pool_size(void);
+
+/**
+ * Provisions the identity (secret form, see zts_generate_identity()) a service started on path
+ * will use, so that it need not be generated during zts_start()
+ */
+int zts_set_identity(const char *path, const char *secret);
+
+/**
+ * Provisions the planet (root server definition) a service started on path will use
+ */
+int zts_set_planet(const char *path, const void *data, int len);
+
+/**
+ * Provisions cached state for a peer (as saved by an earlier service in peers.d/) so that a
+ * service started on path need not rediscover its paths to it
+ */
+int zts_set_peer_cache(const char *path, uint64_t address, const void *data, int len);
+
+/**
+ * Where a service keeps its state instead of the files of its home path. Keys are the paths of
+ * those files relative to the home path ("identity.secret", "planet", "networks.d/<nwid>.conf",
+ * "peers.d/<address>.peer", ...). get copies up to len bytes of key's value to buf and returns
+ * the value's whole length, -1 if there's none. put and del return 0, or -1 if they failed.
+ * Called on libzt's threads, one at a time
+ */
+struct zts_state_store {
+	int (*get)(void *arg, const char *key, void *buf, int len);
+	int (*put)(void *arg, const char *key, const void *data, int len);
+	int (*del)(void *arg, const char *key);
+	void *arg;
+};
+
+/**
+ * Keeps the state of the service (and what zts_set_identity(), zts_set_planet() and
+ * zts_set_peer_cache() provision, whatever their path) in store rather than in files, NULL
+ * goes back to files. Must be called before zts_start(), whose path may then be NULL
+ */
+int zts_set_state_store(const struct zts_state_store *store);
+
+/**
+ * The built-in store, kept in this process's memory
+ */
+const struct zts_state_store *zts_memory_state_store(void);
+
+/**
+ * Fills in the accounting of the background writer of libzt's state files (see
+ * ZT_STATE_WRITE_DELAY)
+ */
+int zts_get_state_write_stats(struct zts_state_write_stats *stats);
+
+/**
+ * Sizes the network stacks for the whole process, must be called before zts_start(). Per
+ * socket, SO_SNDBUF/SO_RCVBUF override the buffer sizes
+ */
+int zts_set_stack_config(const struct zts_stack_config *config);
+
+/**
+ * Fills in the stack configuration in effect, with defaults in place of fields left 0
+ */
+int zts_get_stack_config(struct zts_stack_config *config);
+
+/**
+ * With zts_stack_config.cooperative set, runs the stacks on the calling thread: waits up to
+ * timeout_ms (-1 for as long as the stacks allow) for the networks' sockets, then handles
+ * their I/O, the frames that came in, timers and callbacks. It delivers the frames a
+ * simulation has due too. Returns ms until the next call is due, -1 on error.
+ *
+ * Every network is served by one loop and nothing runs it in between calls: a blocking call
+ * on a libzt socket needs another thread calling zts_run_once(), a single-threaded app uses
+ * non-blocking sockets. The core service (zts_start()) keeps its own threads, a simulation
+ * has none
+ */
+int zts_run_once(int timeout_ms);
+
+/**
+ * Copies the accounting of up to n of the stack allocator's pools into stats, returns how
+ * many pools there are (ZT_ARENA_CLASSES + 1)
+ */
+int zts_get_arena_stats(struct zts_arena_stats *stats, int n);
+
+/**
+ * Fills in how much of the memory budget (zts_stack_config.mem_limit_kb) is in use, the
+ * accounting is kept without a budget too
+ */
+int zts_get_mem_stats(struct zts_mem_stats *stats);
+
 /**
  * Stops the core ZeroTier service
  */
@@ -219,6 +1315,13 @@ void zts_stop();
  */
 void zts_join(const char * nwid);
 
+/**
+ * Join a network whose traffic is to run through the given stack (ZTS_STACK_*). Sockets bound or
+ * connected through its addresses are served by that stack, a network already joined keeps
+ * the stack it has until it is left
+ */
+int zts_join_stack(const char * nwid, int stack);
+
 /**
  * Join a network - Just create the dir and conf file required, don't instruct the core to do anything
  */
@@ -234,6 +1337,55 @@ void zts_leave(const char * nwid);
  */
 void zts_leave_soft(const char * filepath, const char * nwid);
 
+/**
+ * zts_join() for n networks, creating the service's networks.d once. Returns n, their conf
+ * files are written in the background (see ZT_STATE_WRITE_DELAY)
+ */
+int zts_join_many(const char **nwids, int n);
+
+/**
+ * zts_leave() for n networks. Their taps are taken off the stack threads serving them all
+ * together first (one pass of each thread rather than one per network), returns n
+ */
+int zts_leave_many(const char **nwids, int n);
+
+/**
+ * Another node of this process, with its own identity, peers and service, see zts_node_start()
+ */
+typedef struct zts_node *zts_node_t;
+
+/**
+ * Starts a node on path (not that of zts_start() or another node's) sharing the stacks of the
+ * service zts_start() runs, which must be up. Sockets reach a node's networks routed by address
+ * as usual, so a network can only have one node of the process on it. zts_stop() stops
+ * every node too
+ */
+int zts_node_start(const char *path, zts_node_t *node);
+
+/**
+ * Takes the node's networks down (their sockets stop working) and stops it
+ */
+int zts_node_stop(zts_node_t node);
+
+int zts_node_running(zts_node_t node);
+
+/**
+ * zts_join() for node, fails with EEXIST if another node of this process is on nwid
+ */
+int zts_node_join(zts_node_t node, const char *nwid);
+
+int zts_node_leave(zts_node_t node, const char *nwid);
+
+/**
+ * Writes the node's address to devID, which must hold ZT_ID_LEN+1 bytes
+ */
+int zts_node_get_device_id(zts_node_t node, char *devID);
+
+/**
+ * Which node the network fd is bound or connected on belongs to
+ */
+int zts_get_socket_node(int fd, zts_node_t *node);
+
 /**
  * Return the home path for this instance of ZeroTier
  * FIXME: double check this is correct on all platforms
@@ -302,29 +1454,88 @@ void zts_get_6plane_addr(char *addr, const char *nwid, const char *devID);
 void zts_get_rfc4193_addr(char *addr, const char *nwid, const char *devID);
 
 /**
- * Return the number of peers on this network
+ * Copies this device's addresses on the network nwid into addrs. They are formatted whenever
+ * the network's addresses change, so this neither locks nor formats anything
+ */
+int zts_get_network_addresses(const char *nwid, struct zts_network_addresses *addrs);
+
+/**
+ * Return the number of peers known to the service
  */
 unsigned long zts_get_peer_count();
 
 /**
- * Get the IP address of a peer if a direct path is available
+ * Writes the IP address of the peer devID's preferred direct path into peer (at least
+ * INET6_ADDRSTRLEN bytes)
  */
 int zts_get_peer_address(char *peer, const char *devID);
 
+/**
+ * Copies up to n peers into peers and returns how many there are in all (which may be
+ * more than n). The view is at most ZT_PEER_CACHE_TTL old
+ */
+int zts_get_peers(struct zts_peer_info *peers, int n);
+
+/**
+ * Copies up to n roots and moons into info and returns how many there are in all. Their
+ * latency is sampled every ZT_UPSTREAM_SAMPLE_INTERVAL while the service runs. Relaying
+ * itself is left to the core, which ranks its upstreams by latency as well
+ */
+int zts_get_upstreams(struct zts_upstream_info *info, int n);
+
+/**
+ * Returns the address of the reachable upstream with the lowest smoothed latency, 0 if none
+ */
+uint64_t zts_get_preferred_upstream();
+
 /**
  * Enable HTTP control plane (traditionally used by zerotier-cli)
- * - Allows one to control the ZeroTier core via HTTP requests
- * FIXME: Implement
+ * - Serves GET /metrics (see zts_get_metrics()) on ZT_HTTP_CONTROL_PLANE_ADDR:ZT_HTTP_CONTROL_PLANE_PORT
+ * - Serves GET /connections, a table of zts_dump_connections() in the manner of ss(8)
+ * FIXME: Control of the ZeroTier core via HTTP requests is not implemented
  */
 void zts_enable_http_control_plane();
 
 /**
  * Disable HTTP control plane (traditionally used by zerotier-cli)
- * - Allows one to control the ZeroTier core via HTTP requests
- * FIXME: Implement
  */
 void zts_disable_http_control_plane();
 
+/**
+ * Save the physical paths of peers (leaves and roots) to the home path while the service runs,
+ * and have services started afterwards try them first instead of waiting to learn them through
+ * the roots. Call before zts_start()
+ */
+void zts_enable_peer_path_cache();
+
+/**
+ * Stop saving and reloading peer paths (the default)
+ */
+void zts_disable_peer_path_cache();
+
+/**
+ * Enhanced NAT traversal for services started afterwards, which needs the peer path cache (see
+ * zts_enable_peer_path_cache()). A peer seen behind a symmetric NAT (more than one port on the
+ * same address) is also tried at the ports its NAT is likely to allocate next and at random ones,
+ * the core picks among a peer's endpoints each time it tries to reach it. Peers are checked for
+ * a direct path every ZT_PEER_CACHE_TTL instead of ZT_UPSTREAM_SAMPLE_INTERVAL. Probing itself
+ * is paced by the core
+ */
+int zts_set_nat_traversal(const struct zts_nat_traversal *cfg);
+
+int zts_get_nat_traversal(struct zts_nat_traversal *cfg);
+
+/**
+ * Copies how quickly leaf peers got a direct path since the service started into stats
+ */
+int zts_get_traversal_stats(struct zts_traversal_stats *stats);
+
+/**
+ * Renders per-network, per-socket and per-peer counters in the OpenMetrics text format,
+ * returns the length of the full text (which was truncated if >= len) or -1
+ */
+int zts_get_metrics(char *buf, size_t len);
+
 /****************************************************************************/
 /* SDK Socket API (Socket User Controls)                                    */
 /* - These functions are designed to work just like regular socket calls    */
@@ -339,39 +1550,102 @@ int zts_socket(ZT_SOCKET_SIG);
 
  /**
  * Connect a socket to a remote host
+ * - A non-blocking socket returns EINPROGRESS, it becomes writable (to zts_poll(), zts_select()
+ *   and zts_epoll_wait()) once the attempt is over, and SO_ERROR then tells how it went
  */
 int zts_connect(ZT_CONNECT_SIG);
 
 /**
- * Binds a socket to a specific address
- *  - To accept connections on a specific ZeroTier network you must
- *    use this bind call with an address which is associated with that network
- *
- *  For instance, given the following networks:
- *     - nwid = 97afaf1963cc6a90 (10.9.0.0/24)
- *     - nwid = 23bfae5663c8b188 (192.168.0.0/24)
- *
- *  In order to accept a connection on 97afaf1963cc6a90, you 
- *  should bind to 10.9.0.0
+ * Connects a new blocking TCP socket to whichever of naddrs addresses answers first. Attempts
+ * start in order, each ZT_CONNECT_ANY_STAGGER ms after the last (or at once if the last failed),
+ * the rest are closed as soon as one completes. Returns the socket, or -1 with errno from the
+ * last failure (ETIMEDOUT if timeout_ms, -1 for none, ran out first)
  */
-int zts_bind(ZT_BIND_SIG);
+int zts_connect_any(const struct sockaddr_storage *addrs, int naddrs, int timeout_ms);
 
 /**
- * Listen for incoming connections
+ * zts_connect_any() to port on devID's RFC 4193 and 6PLANE addresses on nwid, and ipv4 as well
+ * if it isn't NULL (the network config doesn't say which IPv4 address a member has)
  */
-int zts_listen(ZT_LISTEN_SIG);
+int zts_connect_by_device_id(const char *nwid, const char *devID, int port,
+	const struct sockaddr_in *ipv4, int timeout_ms);
 
 /**
- * Accept a connection
+ * Sets the limits of the connection pool (see zts_pool_connect()), for addresses seen from now on
+ * and the next pass over those already known. NULL restores the defaults
  */
-int zts_accept(ZT_ACCEPT_SIG);
+int zts_pool_configure(const struct zts_pool_config *cfg);
 
 /**
- * Accept a connection
+ * Returns a blocking TCP socket connected to addr: an idle one from the pool which passed a
+ * health check, or else one dialed now by zts_connect_any() within timeout_ms (-1 for the pool's
+ * dial_timeout_ms). The pool then keeps as many connections to addr dialed ahead as were in use
+ * at once lately, so the next calls needn't wait for a handshake. Give it back with
+ * zts_pool_release() rather than zts_close()
  */
-#if defined(__linux__)
-	int zts_accept4(ZT_ACCEPT4_SIG);
-#endif
+int zts_pool_connect(const struct sockaddr *addr, socklen_t addrlen, int timeout_ms);
+
+/**
+ * Gives fd, from zts_pool_connect(), back to the pool. With reuse 0 (after an error, or if the
+ * protocol left it in an unknown state) or once the address has max_idle idle ones, it's closed
+ */
+int zts_pool_release(int fd, int reuse);
+
+/**
+ * Has the pool keep at least count connections to addr (idle and in use), dialing the missing
+ * ones in the background. 0 leaves it to demand again
+ */
+int zts_pool_prewarm(const struct sockaddr *addr, socklen_t addrlen, int count);
+
+/**
+ * Closes every idle connection and forgets the addresses, connections in use are closed on release
+ */
+int zts_pool_flush(void);
+
+int zts_pool_get_stats(struct zts_pool_stats *stats);
+
+/**
+ * Binds a socket to a specific address
+ *  - To accept connections on a specific ZeroTier network you must
+ *    use this bind call with an address which is associated with that network
+ *
+ *  For instance, given the following networks:
+ *     - nwid = 97afaf1963cc6a90 (10.9.0.0/24)
+ *     - nwid = 23bfae5663c8b188 (192.168.0.0/24)
+ *
+ *  In order to accept a connection on 97afaf1963cc6a90, you 
+ *  should bind to 10.9.0.0
+ */
+int zts_bind(ZT_BIND_SIG);
+
+/**
+ * Listen for incoming connections
+ * - At most backlog (capped at ZT_LISTEN_BACKLOG_MAX) established connections wait for
+ *   zts_accept(), further ones are closed and counted (see zts_socket_stats.accept_overflows)
+ * - Stream sockets which set SO_REUSEPORT before zts_bind() may listen on the same address and
+ *   port, each new connection goes to one of them (by hash of its remote address and port)
+ *   so that threads accepting on separate sockets don't share an accept queue
+ */
+int zts_listen(ZT_LISTEN_SIG);
+
+/**
+ * Accept a connection
+ */
+int zts_accept(ZT_ACCEPT_SIG);
+
+/**
+ * Accept up to max (at most ZT_ACCEPT_MANY_MAX) queued connections at once, their descriptors
+ * are written to fds and, unless addrs is NULL, their remote addresses to addrs. Returns how
+ * many were accepted, blocking sockets wait for at least one
+ */
+int zts_accept_many(int fd, int *fds, struct sockaddr_storage *addrs, int max);
+
+/**
+ * Accept a connection
+ */
+#if defined(__linux__)
+	int zts_accept4(ZT_ACCEPT4_SIG);
+#endif
 
 /**
  * Set socket options
@@ -394,12 +1668,55 @@ int zts_getsockname(ZT_GETSOCKNAME_SIG);
 int zts_getpeername(ZT_GETPEERNAME_SIG);
 
 /**
- * Close a socket
- * TODO: Check that closing a socket immediately after writing doesn't behave in 
- * an undefined manner
+ * Close a socket. fd is gone once this returns, data still queued for it is handed to the 
+ * stack in the background (for up to ZT_SDK_CLTIME * ZT_API_CHECK_INTERVAL ms if fd is 
+ * blocking) before the stack's socket is closed, see zts_close_async()
  */
 int zts_close(ZT_CLOSE_SIG);
 
+/**
+ * Called once a socket closed through zts_close_async() has been closed in the stack, err is 0,
+ * ETIMEDOUT if queued data was still waiting when its time ran out, or ECANCELED if the network
+ * went away first. Runs on the stack thread (must not block, may call into the API)
+ */
+typedef void (*zts_close_cb)(int fd, int err, void *arg);
+
+/**
+ * zts_close(), with cb called when the closure is complete (cb may be NULL). For sockets which
+ * aren't attached to a network yet cb is called before this returns
+ */
+int zts_close_async(int fd, zts_close_cb cb, void *arg);
+
+typedef void (*zts_zc_cb)(int fd, uint64_t tag, ssize_t res, void *arg);
+
+/**
+ * Send len bytes straight from buf without copying them into the socket's buffers first. The
+ * send is queued behind anything already written, buf must stay untouched until cb is called
+ * (from the stack thread) with the number of bytes sent, or -errno if the connection failed or
+ * was closed first. Only for SOCK_STREAM sockets in direct I/O mode (see ZT_SO_DIRECT_IO)
+ */
+int zts_send_zc(int fd, const void *buf, size_t len, uint64_t tag, zts_zc_cb cb, void *arg);
+
+// A region of a socket's receive buffer, see zts_recv_zc()
+struct zts_iovec {
+	const void *iov_base;
+	size_t iov_len;
+};
+
+/**
+ * Fills in up to max views (at most 2) of the data received on fd, in order, without copying
+ * it out of the socket's buffer. Waits for data unless fd is non-blocking, returns the number
+ * of views, 0 at the end of the stream. Views stay valid until released, a later call returns
+ * the same data first along with whatever has arrived since. Only for SOCK_STREAM sockets in
+ * direct I/O mode (see ZT_SO_DIRECT_IO), don't mix with zts_recv() on the same socket
+ */
+int zts_recv_zc(int fd, struct zts_iovec *views, int max);
+
+/**
+ * Gives the first n bytes of what zts_recv_zc() returned back to fd's receive buffer
+ */
+int zts_recv_release(int fd, size_t n);
+
 /**
  * waits for one of a set of file descriptors to become ready to perform I/O.
  */
@@ -410,6 +1727,70 @@ int zts_poll(ZT_POLL_SIG);
  */
 int zts_select(ZT_SELECT_SIG);
 
+/**
+ * Creates a libzt event notification instance. Unlike zts_poll()/zts_select() readiness is
+ * reported by the network stack itself: ZTS_EPOLLIN as soon as data or a connection arrives
+ * and ZTS_EPOLLOUT only while the socket is connected and has room in its send buffer.
+ * Returns a descriptor which becomes readable while events are pending, close it with
+ * zts_close()
+ */
+int zts_epoll_create(ZT_EPOLL_CREATE_SIG);
+
+/**
+ * Adds, modifies or removes interest in a socket (ZTS_EPOLL_CTL_*)
+ */
+int zts_epoll_ctl(ZT_EPOLL_CTL_SIG);
+
+/**
+ * Waits up to timeout ms (forever if -1) for events on the sockets of an instance
+ */
+int zts_epoll_wait(ZT_EPOLL_WAIT_SIG);
+
+/**
+ * Makes a zts_epoll_wait() in progress on epfd (or else the next one) return, with no events
+ * if none are ready. For event loops which have to be woken from another thread
+ */
+int zts_epoll_wakeup(int epfd);
+
+/**
+ * Returns a host descriptor an external event loop can watch for fd. With
+ * zts_stack_config.userspace_fds set TCP sockets are numbered by libzt, always use direct I/O
+ * and have no socketpair behind them. The first call for one creates a socketpair whose end
+ * returned here is readable whenever the socket is (data, a connection to accept, an error
+ * or the peer's FIN). It is only for polling, I/O still goes through zts_*() on fd, and it is
+ * closed along with fd. Any other socket is its own host descriptor, fd is returned as is
+ */
+int zts_get_native_fd(int fd);
+
+/**
+ * Copies counters for the multiplexed streams (see ZT_SOCK_MUX) into stats
+ */
+int zts_get_mux_stats(struct zts_mux_stats *stats);
+
+/**
+ * Copies counters for a bound ZT_SOCK_MSG socket into stats
+ */
+int zts_get_msg_stats(int fd, struct zts_msg_stats *stats);
+
+/**
+ * Creates a completion queue which may have up to entries operations submitted and not yet
+ * reaped. Returns a descriptor which becomes readable when zts_complete() has something to
+ * do (and so can be watched by an external event loop), close it with zts_close()
+ */
+int zts_cq_create(ZT_CQ_CREATE_SIG);
+
+/**
+ * Queues n operations, returns how many were accepted. Each completes exactly once, operations
+ * in the same direction on a socket (reads and accepts, writes and connects) in order
+ */
+int zts_submit(ZT_SUBMIT_SIG);
+
+/**
+ * Carries out whatever pending operations the stack has made possible and returns up to max
+ * completions, waiting up to timeout ms (forever if -1) for at least one
+ */
+int zts_complete(ZT_COMPLETE_SIG);
+
 /**
  * Issue file control commands on a socket
  */
@@ -440,11 +1821,44 @@ ssize_t zts_recvfrom(ZT_RECVFROM_SIG);
  */
 ssize_t zts_recvmsg(ZT_RECVMSG_SIG);
 
+#if defined(__linux__)
+/**
+ * Send several datagrams in one call, returns the number sent
+ */
+int zts_sendmmsg(ZT_SENDMMSG_SIG);
+
+/**
+ * Receive several datagrams in one call, returns the number received
+ */
+int zts_recvmmsg(ZT_RECVMMSG_SIG);
+
+/**
+ * Send several ethernet frames on the tap a SOCK_RAW socket is bound to, returns the number sent
+ */
+int zts_raw_send_batch(int fd, const struct zts_raw_frame *frames, int n);
+
+/**
+ * Receive up to n ethernet frames from a bound SOCK_RAW socket, returns the number received and
+ * sets each len to its frame's length. Only the first frame is waited for (unless MSG_DONTWAIT)
+ */
+int zts_raw_recv_batch(int fd, struct zts_raw_frame *frames, int n, int flags);
+#endif
+
+/**
+ * Receive data from a remote host
+ */
+ssize_t zts_recv(ZT_RECV_SIG);
+
+/**
+ * Send data to a remote host
+ */
+ssize_t zts_send(ZT_SEND_SIG);
+
 /**
  * Read bytes from socket onto buffer
  *  - Note, this function isn't strictly necessary, you can
  *    use a regular read() call as long as the socket fd was
- *    created via a zts_socket() call. 
+ *    created via a zts_socket() call (and isn't in direct I/O mode).
  */
 int zts_read(ZT_READ_SIG);
 
@@ -452,19 +1866,81 @@ int zts_read(ZT_READ_SIG);
  * Write bytes from buffer to socket
  *  - Note, this function isn't strictly necessary, you can
  *    use a regular write() call as long as the socket fd was
- *    created via a zts_socket() call. 
+ *    created via a zts_socket() call (and isn't in direct I/O mode).
  */
 int zts_write(ZT_WRITE_SIG);
 
+/**
+ * Scatter/gather versions of zts_read()/zts_write(), a SOCK_DGRAM socket takes or gives
+ * one datagram per call
+ */
+ssize_t zts_readv(ZT_READV_SIG);
+ssize_t zts_writev(ZT_WRITEV_SIG);
+
+/**
+ * Send count bytes of in_fd (from *offset if offset isn't NULL, advancing it, otherwise from
+ * in_fd's file position) on a SOCK_STREAM socket without copying them through the caller. In
+ * direct I/O mode the file is read straight into the Connection's TX buffer
+ */
+ssize_t zts_sendfile(ZT_SENDFILE_SIG);
+
+/**
+ * Moves up to len bytes of what has been received on in_fd to out_fd, returns how many, 0 at
+ * the end of in_fd's stream. Waits for something to arrive on in_fd, then for room on out_fd
+ * for all of it, unless ZT_SPLICE_F_NONBLOCK is given. Either descriptor may be a host one. A
+ * SOCK_STREAM socket in direct I/O mode is read from its RX buffer, or written to its TX
+ * buffer, in place. Data goes from one socket's RX buffer to the other's TX buffer in one copy,
+ * and out_fd's flow control holds back in_fd's window. Otherwise data passes through a bounce
+ * buffer
+ */
+ssize_t zts_splice(ZT_SPLICE_SIG);
+
 /*
  * Sends a FIN segment
  */
 int zts_shutdown(ZT_SHUTDOWN_SIG);
 
+/*
+ * Adds a nameserver (reached through the networks like any other address) for zts_getaddrinfo()
+ * to ask, up to ZTS_MAX_NAMESERVERS
+ */
+int zts_add_dns_nameserver(const struct sockaddr *addr);
+
+int zts_del_dns_nameserver(const struct sockaddr *addr);
+
+/*
+ * getaddrinfo() through the virtual networks, with answers cached (see ZT_DNS_TIMEOUT). Returns
+ * 0 or an EAI_* code like getaddrinfo(). Numeric hosts never reach a nameserver, services must
+ * be numeric. res is freed with zts_freeaddrinfo()
+ */
+int zts_getaddrinfo(const char *node, const char *service, const struct addrinfo *hints,
+	struct addrinfo **res);
+
+void zts_freeaddrinfo(struct addrinfo *res);
+
+/*
+ * Called by zts_getaddrinfo_async() with what zts_getaddrinfo() would have returned, on a thread
+ * of the library's. res belongs to the callback
+ */
+typedef void (*zts_getaddrinfo_cb)(int status, struct addrinfo *res, void *arg);
+
+/*
+ * zts_getaddrinfo() which returns at once, cb is called inline if the answer is cached
+ */
+int zts_getaddrinfo_async(const char *node, const char *service, const struct addrinfo *hints,
+	zts_getaddrinfo_cb cb, void *arg);
+
+/*
+ * Forgets every cached answer
+ */
+int zts_dns_flush();
+
 /****************************************************************************/
 /* SDK Socket API Helper functions/objects --- DONT CALL THESE DIRECTLY     */
 /****************************************************************************/
 
+// The helpers taking libzt's own types are left out of C (and cgo) builds
+#ifdef __cplusplus
 namespace ZeroTier
 {
 	class picoTCP;
@@ -475,8 +1951,16 @@ namespace ZeroTier
 
 	class SocketTap;
 	struct InetAddress;
+	struct Connection;
+	struct DatagramHeader;
 }
 
+/*
+ * Removes a Connection from every zts_epoll instance watching it, called on closure
+ */
+void zts_epoll_detach(ZeroTier::Connection *conn);
+#endif
+
 /*
  * Gets a pointer to a pico_socket given a file descriptor
  */
@@ -485,31 +1969,405 @@ int zts_get_pico_socket(int fd, struct pico_socket **s);
 #endif
 
 /**
- * Returns the number of sockets either already provisioned or waiting to be
- * Some network stacks may have a limit on the number of sockets that they can
- * safely handle due to timer construction, this is a way to check that we
- * haven't passed that limit. Someday if multiple stacks are used simultaneously
- * the logic for this function should change accordingly.
+ * Returns the number of sockets either already provisioned or waiting to be, sockets handed
+ * to the host's stack aren't counted. Never locks
  */
 int zts_nsockets();
 
 /*
- * Returns maximum number of sockets allowed by network stack
+ * Returns how many sockets may be open at once, the tightest of the limits in
+ * zts_get_socket_limits() (for the timer limit, given the sockets open now)
  */
 int zts_maxsockets();
 
+/**
+ * Copies the number of open sockets in each state into counts
+ */
+int zts_get_socket_counts(struct zts_socket_counts *counts);
+
+/**
+ * Copies the limits on open sockets (of the library, the process and the default stack) into limits
+ */
+int zts_get_socket_limits(struct zts_socket_limits *limits);
+
+/**
+ * Copies the counters of a socket into stats, fields which the network stack doesn't
+ * provide (or which don't apply to the socket type) are 0
+ */
+int zts_get_socket_stats(int fd, struct zts_socket_stats *stats);
+
+/**
+ * Copies a row for each socket given to a network (up to n of them) into info and returns how
+ * many there are, so that a caller may call again with more room. Each tap is read in one
+ * pass of its stack thread, sockets not yet bound or connected aren't listed
+ */
+int zts_dump_connections(struct zts_connection_info *info, int n);
+
+/**
+ * Copies the counters of the tap for the network nwid into stats
+ */
+int zts_get_network_stats(const char *nwid, struct zts_network_stats *stats);
+
+/**
+ * Copies how busy the stack thread serving the network nwid has been into stats. A thread near
+ * 100% is the one to give fewer networks (see ZT_STACK_THREAD_POOL_SZ)
+ */
+int zts_get_stack_loop_stats(const char *nwid, struct zts_stack_loop_stats *stats);
+
+/**
+ * Has a watchdog thread look at every stack thread each threshold_ms / 4 (at least 1 ms) and
+ * report phases (ZTS_STACK_PHASE_*) running for threshold_ms or more, to cb (which may be NULL)
+ * and zts_get_stack_watchdog_stats(). Phases which end over it between two looks are reported
+ * once they end. 0 stops it
+ */
+int zts_set_stack_watchdog(int threshold_ms, zts_stall_cb cb, void *arg);
+
+int zts_get_stack_watchdog_stats(struct zts_stack_watchdog_stats *stats);
+
+/**
+ * Copies how long lock (ZTS_LOCK_*) was held and waited for since the start (or the last
+ * zts_reset_lock_stats()) into stats. Timing every acquisition isn't free, so this is only
+ * available in a library built with ZT_LOCK_STATS=1, EOPNOTSUPP otherwise
+ */
+int zts_get_lock_stats(int lock, struct zts_lock_stats *stats);
+
+int zts_reset_lock_stats();
+
+/**
+ * Traces one in every frames and socket writes or stack reads through the stages of the
+ * data path (ZTS_LATENCY_*), 0 (the default) stops
+ */
+int zts_set_latency_sampling(unsigned every);
+
+/**
+ * Copies the latencies of stage (ZTS_LATENCY_*) sampled since the start (or the last
+ * zts_reset_latency_stats()) into stats
+ */
+int zts_get_latency_stats(int stage, struct zts_latency_stats *stats);
+
+int zts_reset_latency_stats();
+
+/**
+ * Sends count ICMP echo requests (IPv4) to addr, interval_us apart, and waits for the replies
+ * up to ZTS_PING_TIMEOUT_MS after the last one. The tap's stack thread sends the probes
+ * and takes the replies, so RTTs are those of the overlay and the stack, leaving out the
+ * app's side of the socket layer. cb (if not NULL) hears of each probe from the calling
+ * thread, replies as they come and lost probes at the end, stats (if not NULL) gets the
+ * totals and a histogram
+ */
+int zts_ping(const struct sockaddr *addr, socklen_t addrlen, int count, int interval_us,
+	zts_ping_cb cb, void *arg, struct zts_ping_stats *stats);
+
+/**
+ * zts_ping() with UDP datagrams to an echo service (such as RFC 862's on port 7) at addr,
+ * IPv4 or IPv6
+ */
+int zts_ping_udp(const struct sockaddr *addr, socklen_t addrlen, int count, int interval_us,
+	zts_ping_cb cb, void *arg, struct zts_ping_stats *stats);
+
+/**
+ * Writes the frames crossing every tap in either direction to path as pcapng, one interface
+ * per network. At most snaplen (0 for 65535) bytes of each are kept. filter selects frames
+ * with a subset of pcap-filter(7): ip, ip6, arp, tcp, udp, icmp, icmp6, [src|dst] host <addr>,
+ * [src|dst] port <n>, inbound, outbound and nwid <hex>, each optionally preceded by not and
+ * joined by and/or (and binds tighter). NULL or "" captures everything
+ */
+int zts_capture_start(const char *path, unsigned int snaplen, const char *filter);
+
+/**
+ * Writes out whatever was captured so far and closes the file
+ */
+int zts_capture_stop();
+
+int zts_get_capture_stats(struct zts_capture_stats *stats);
+
+/**
+ * Feeds the Ethernet frames in a pcap or pcapng file at path to the tap of network nwid as
+ * if they had arrived from the network, for reproducible stack benchmarks. Frames recorded
+ * as outbound are left out. The tap must have the address the frames were sent to. Returns
+ * once every pass is done. Replayed TCP segments won't match the stack's own sequence
+ * numbers, so sessions don't complete: this measures frame intake, demultiplexing and
+ * the stack's responses rather than an end-to-end transfer
+ */
+int zts_replay(const char *nwid, const char *path, const struct zts_replay_config *cfg,
+	struct zts_replay_stats *stats);
+
+/**
+ * Exports the frames of network nwid through shared memory, for a process which doesn't link
+ * libzt (see struct zts_shm_header). Every frame from the network is also copied into the RX
+ * ring, frames put into the TX ring are sent as zts_raw_send_batch() would. slots (a power of
+ * two, 0 for ZTS_SHM_DEFAULT_SLOTS) sizes each ring. The descriptors in info stay libzt's, pass
+ * them on with SCM_RIGHTS. Linux only
+ */
+int zts_shm_export(const char *nwid, unsigned int slots, struct zts_shm_info *info);
+
+/**
+ * Stops the export of nwid and closes its descriptors, a process which mapped the memfd keeps
+ * its mapping but sees no more traffic
+ */
+int zts_shm_unexport(const char *nwid);
+
+/**
+ * Lets other processes on this host use this service's node instead of running their own: the
+ * zts_daemon_*() calls below, made from any process (which need not call zts_start()), get TCP
+ * connections and listeners on it through the Unix socket path (NULL for ZT_DAEMON_SOCKET_PATH,
+ * only this user may connect). Each connection is handed over as a descriptor of the client's
+ * to read(), write() and poll() as usual. Processes forked from this one after the call are
+ * clients like any other: the daemon keeps running in the parent only
+ */
+int zts_daemon_start(const char *path);
+
+/**
+ * Closes every connection handed out and stops serving
+ */
+int zts_daemon_stop(void);
+
+/**
+ * Connects the daemon on path to addr, the descriptor returned must be closed with
+ * zts_daemon_close()
+ */
+int zts_daemon_connect(const char *path, const struct sockaddr *addr, socklen_t addrlen);
+
+/**
+ * Has the daemon on path listen on addr, returns a descriptor to pass to zts_daemon_accept(),
+ * which is readable while a connection is pending. Clients listening on the same address
+ * (prefork workers, each calling this after fork()) share the daemon's listener, which hands
+ * each connection to the next of them waiting in zts_daemon_accept()
+ */
+int zts_daemon_listen(const char *path, const struct sockaddr *addr, socklen_t addrlen, int backlog);
+
+/**
+ * Blocks for the next connection to a zts_daemon_listen() descriptor, close it with
+ * zts_daemon_close()
+ */
+int zts_daemon_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+
+/**
+ * Closes a descriptor from zts_daemon_connect(), zts_daemon_listen() or zts_daemon_accept(),
+ * which closes the daemon's connection (or listener) too
+ */
+int zts_daemon_close(int fd);
+
+/**
+ * Drops loss_ppm (per million) of the frames this device sends on nwid and delays the rest by
+ * delay_ms, to test against lossy, high-latency paths. Both 0 lifts the impairment
+ */
+int zts_set_impairment(const char *nwid, int delay_ms, int loss_ppm);
+
+/**
+ * Limits what this device's sockets send on nwid to bytes_per_sec (0 lifts the limit) with
+ * bursts of up to burst bytes (0 picks one, see ZT_TX_SHAPER_BURST_MS). Shared by all of the
+ * network's sockets on top of their own SO_MAX_PACING_RATE
+ */
+int zts_set_network_rate(const char *nwid, uint64_t bytes_per_sec, uint64_t burst);
+
+/**
+ * Compresses (LZ4) the unicast frames this device sends on nwid to peers which compress theirs
+ * too, for links where bandwidth is scarcer than CPU. Peers find out about each other by
+ * themselves, those which don't (or run without it) get frames as they are. Frames which
+ * don't compress well (see ZT_COMPRESS_MIN_SAVING) are sent as they are. Compressed frames go
+ * as ZT_COMPRESS_ETHERTYPE, which the network's rules have to allow. Received ones are decoded
+ * whether or not this is on
+ */
+int zts_set_network_compression(const char *nwid, int enabled);
+
+/**
+ * Limits what one peer can take of nwid, so that a misbehaving one can't use up the stack's
+ * connections or the receive path for everyone. Connections are refused as the stack would
+ * accept them (after the handshake, the peer sees them closed), frames over their source's
+ * rate are dropped before they reach the stack. Both count in zts_get_network_stats()
+ */
+int zts_set_admission_limits(const char *nwid, const struct zts_admission_limits *limits);
+
+int zts_get_admission_limits(const char *nwid, struct zts_admission_limits *limits);
+
+/**
+ * Brings the network stacks up without the ZeroTier core and connects the nodes added with
+ * zts_sim_add_node() through an in-process wire impaired as cfg says, so the socket API and
+ * the stacks can be benchmarked reproducibly without peers. Fails with EBUSY once zts_start()
+ * has been called, zts_start() does nothing while a simulation runs
+ */
+int zts_sim_start(const struct zts_sim_config *cfg);
+
+/**
+ * Adds a node with address addr ("10.0.0.1/24") on network nwid, running on stack
+ * (ZTS_STACK_*). Each stack is a single instance per process, so nodes on the same stack
+ * reach one another inside it rather than over the wire: for traffic that crosses the wire,
+ * give each node its own stack (a library built with both). Sockets are routed by address as
+ * usual, a node added later takes over the routes it shares with earlier ones
+ */
+int zts_sim_add_node(const char *nwid, int stack, const char *addr);
+
+/**
+ * Changes the impairments of frames sent from here on
+ */
+int zts_sim_set_config(const struct zts_sim_config *cfg);
+
+int zts_sim_get_stats(struct zts_sim_stats *stats);
+
+/**
+ * Microseconds on the (monotonic) clock the stacks and the wire run on, which advances
+ * zts_sim_config.time_scale times faster than real time. Time measured with it (rather than
+ * the host's clock) is what the stacks saw. zts_sim_set_config() doesn't change the scale.
+ * picoTCP keeps its own clock, only lwIP's TCP timers go by this one
+ */
+int zts_sim_get_time(uint64_t *us);
+
+/**
+ * Removes the nodes (their sockets stop working) and the wire
+ */
+int zts_sim_stop();
+
+// Where a socket goes once it's bound or connected to an address no joined network has a
+// route to, see zts_set_route_policy()
+#define ZTS_ROUTE_VIRTUAL                  0 // nowhere, bind()/connect()/sendto() fail (default)
+#define ZTS_ROUTE_HOST                     1 // the host's own stack, under the same descriptor
+
+/**
+ * Sets the ZTS_ROUTE_* policy for sockets bound or connected from here on. A socket handed to
+ * the host's stack keeps its descriptor and is used through the same zts_* calls, which pass
+ * through to the host (zts_epoll_ctl() and zts_submit() don't take such sockets)
+ */
+int zts_set_route_policy(int policy);
+
+int zts_get_route_policy();
+
+// libzt's threads, see zts_set_thread_affinity()
+#define ZTS_THREAD_SERVICE                 1 // the ZeroTier service, nwid is ignored
+#define ZTS_THREAD_STACK                   2 // runs nwid's stack (a shared one follows its first network)
+#define ZTS_THREAD_TX                      3 // hands nwid's frames to the core, see ZT_FRAME_TX_RING_LEN
+
+/**
+ * Pins a ZTS_THREAD_* thread to the ncpus CPUs in cpus, ncpus 0 lets it run anywhere again.
+ * Settings for a network also apply to its threads if it's joined later. Linux only
+ */
+int zts_set_thread_affinity(int thread, const char *nwid, const int *cpus, int ncpus);
+
+/**
+ * Microseconds of CPU time ZTS_THREAD_* threads have used since the process started, those of
+ * nwid's network or (NULL) of all of them, including threads which have since exited. Sampled
+ * twice, gives their utilization. Linux only
+ */
+int zts_get_thread_cpu(int thread, const char *nwid, uint64_t *cpu_us);
+
+/**
+ * Sets when stack threads busy-poll (see ZT_BUSY_POLL_FRAMES), frames 0 turns it off
+ */
+int zts_set_busy_poll(int frames, int spin_us);
+
+int zts_get_busy_poll(int *frames, int *spin_us);
+
+// See zts_set_power_mode()
+#define ZTS_POWER_NORMAL                   0 // stack timers run on time
+#define ZTS_POWER_LOW                      1 // timer wakeups coalesced to ZT_POWER_LOW_SLOT_MS
+#define ZTS_POWER_BACKGROUND               2 // ZT_POWER_BACKGROUND_SLOT_MS, keepalives stretched
+
+/**
+ * Trades timer precision for fewer wakeups. Outside ZTS_POWER_NORMAL libzt's threads wake for
+ * their timers only on a shared coarse schedule and don't busy-poll, traffic still wakes them
+ * at once. ZTS_POWER_BACKGROUND also multiplies the TCP keepalive idle time and interval of
+ * every connection by ZT_POWER_KEEPALIVE_STRETCH until the mode changes again. The ZeroTier
+ * core's own peer timers are unaffected
+ */
+int zts_set_power_mode(int mode);
+
+int zts_get_power_mode();
+
+/**
+ * Keeps the connections of a tap which goes away (its network left or briefly unauthorized, the
+ * service restarted) for up to ms, and hands them to the next tap on the same network if one
+ * comes up in time. Meanwhile they stall rather than fail, what they send is retransmitted once
+ * the network is back. 0 tears them down with the tap. Only lwIP can carry connections over,
+ * those on picoTCP networks are torn down regardless
+ */
+int zts_set_rebind_grace(unsigned int ms);
+
+unsigned int zts_get_rebind_grace();
+
 int pico_ntimers();
 
 /****************************************************************************/
 /* ZeroTier Core helper functions for libzt - DON'T CALL THESE DIRECTLY     */
 /****************************************************************************/
 
+/*
+ * Returns the SO_RCVTIMEO/SO_SNDTIMEO value set on fd in ms, or -1 if none
+ */
+int getSockTimeoutMs(int fd, int optname);
+
+#ifdef __cplusplus
+/*
+ * zts_read()/zts_write() for sockets in direct I/O mode (see ZT_SO_DIRECT_IO)
+ */
+ssize_t directRead(ZeroTier::Connection *conn, void *buf, size_t len, int flags);
+ssize_t directWrite(ZeroTier::Connection *conn, const void *buf, size_t len, int flags);
+ssize_t directReadv(ZeroTier::Connection *conn, const struct iovec *iov, int iovcnt);
+ssize_t directWritev(ZeroTier::Connection *conn, const struct iovec *iov, int iovcnt);
+ssize_t directSendfile(ZeroTier::Connection *conn, int in_fd, off_t *offset, size_t count);
+
+/*
+ * zts_recv_zc()/zts_recv_release() for sockets in direct I/O mode
+ */
+int directRecvZc(ZeroTier::Connection *conn, struct zts_iovec *views, int max);
+int directRecvRelease(ZeroTier::Connection *conn, size_t n);
+
+/*
+ * zts_splice() where in (for in_fd) or out (for out_fd) is in direct I/O mode, the other may
+ * be NULL for a descriptor which isn't
+ */
+ssize_t directSplice(ZeroTier::Connection *in, int in_fd, ZeroTier::Connection *out, int out_fd,
+	size_t len, int flags);
+
+/*
+ * sendmsg()/recvmsg() for SOCK_DGRAM sockets, each datagram crosses the socketpair behind
+ * a DatagramHeader (see Connection.hpp) carrying the remote address
+ */
+ssize_t dgramSend(ZeroTier::Connection *conn, const struct msghdr *msg, int flags);
+ssize_t dgramRecv(ZeroTier::Connection *conn, struct msghdr *msg, int flags);
+
+/*
+ * Fills in the DatagramHeader for a datagram about to be sent (giving the socket to a tap
+ * first if it has none yet, returns 1 if it went to the host's stack instead and conn is
+ * gone), and unpacks one from a datagram just received
+ */
+int dgramHeader(ZeroTier::Connection *conn, const struct msghdr *msg, struct ZeroTier::DatagramHeader *hdr);
+void dgramFinishRecv(ZeroTier::Connection *conn, const struct ZeroTier::DatagramHeader *hdr, size_t n, 
+	const struct msghdr *got, struct msghdr *msg, unsigned int *len);
+
+/*
+ * sendmsg()/recvmsg() for ZT_SOCK_MSG sockets, messages go straight to the tap's MsgPorts and
+ * come back through the socketpair behind the zts_sockaddr_msg they came from
+ */
+ssize_t msgSend(ZeroTier::Connection *conn, const struct msghdr *msg, int flags);
+ssize_t msgRecv(ZeroTier::Connection *conn, struct msghdr *msg, int flags);
+
+/*
+ * Appends the SO_TIMESTAMP/SO_TIMESTAMPNS (optname) control message for an arrival time (see
+ * SocketTap::rxStamp()) behind the msg_controllen bytes already in msg_control, which holds cap
+ * bytes. Sets MSG_CTRUNC if it doesn't fit
+ */
+void rxTimestamp(int optname, uint64_t stamp, struct msghdr *msg, size_t cap);
 ZeroTier::SocketTap *getTapByNWID(uint64_t nwid);
 ZeroTier::SocketTap *getTapByAddr(ZeroTier::InetAddress &addr);
 ZeroTier::SocketTap *getTapByName(char *ifname);
 ZeroTier::SocketTap *getTapByIndex(int index);
+#endif
 void dismantleTaps();
 
+/*
+ * Saves learned peer paths to the home path, and turns saved ones into hints for the service
+ * about to start (see zts_enable_peer_path_cache())
+ */
+void savePeerPaths();
+void loadPeerPaths();
+void *peerPathCacheLoop(void *arg);
+
+/*
+ * Puts the service's scratch home path back into the state store every ZT_STATE_SYNC_INTERVAL
+ * (see zts_set_state_store())
+ */
+void *stateSyncLoop(void *arg);
+
 /**
  * Don't call this directly, use 'zts_start()'
  */
@@ -0,0 +1,439 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+// Optional C++20 coroutine front end for libzt sockets, built on the completion queue API
+// (zts_cq_create()/zts_submit()/zts_complete()). Header-only, nothing here is compiled into
+// the library.
+//
+//    ZeroTier::coro::io_context ctx;
+//    ZeroTier::coro::task<void> echo(ZeroTier::coro::io_context &ctx, int fd) {
+//        char buf[4096];
+//        ssize_t n;
+//        while((n = co_await ZeroTier::coro::async_read(ctx, fd, buf, sizeof(buf))) > 0)
+//            co_await ZeroTier::coro::async_write(ctx, fd, buf, n);
+//        zts_close(fd);
+//    }
+//    ZeroTier::coro::co_spawn(ctx, echo(ctx, fd));
+//    ctx.run(); // on as many threads as you like
+//
+// Operations return what the zts_cqe did: a byte count, descriptor or 0 on success, -errno
+// on failure.
+
+#ifndef ZT_LIBZT_CORO_HPP
+#define ZT_LIBZT_CORO_HPP
+
+#if !defined(__cpp_impl_coroutine)
+#error "libzt_coro.hpp requires C++20 coroutines (-std=c++20)"
+#endif
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "libzt.h"
+
+namespace ZeroTier {
+namespace coro {
+
+	/*
+	 * Somewhere coroutines can be resumed
+	 */
+	class executor
+	{
+	public:
+		virtual ~executor() { }
+		virtual void post(std::coroutine_handle<> h) = 0;
+	};
+
+	/*
+	 * An operation in flight, its address is the zts_sqe's user_data
+	 */
+	struct op_base
+	{
+		struct zts_sqe sqe;
+		ssize_t res;
+		std::coroutine_handle<> h;
+	};
+
+	/*
+	 * Owns a completion queue and resumes whoever was waiting on its completions. Any number
+	 * of threads may call run()/run_one(), a coroutine is resumed on whichever thread reaped
+	 * its completion (or picked up its post())
+	 */
+	class io_context : public executor
+	{
+	private:
+		int cq;
+		int wake[2];
+		std::mutex _m;
+		std::deque<std::coroutine_handle<> > posted;
+		std::deque<op_base*> backlog; // submitted while the queue was full
+		std::atomic<bool> stopped;
+		std::atomic<long> work; // ops in flight plus posted handles
+
+		void signal()
+		{
+			char c = 0;
+			if(write(wake[1], &c, 1) < 0) { } // full means it's readable already
+		}
+
+		void dispatch(op_base *op)
+		{
+			work--;
+			op->h.resume();
+		}
+
+		// Hands the backlog to the completion queue until it fills up again
+		void resubmit()
+		{
+			std::lock_guard<std::mutex> _l(_m);
+			while(!backlog.empty()) {
+				if(zts_submit(cq, &backlog.front()->sqe, 1) != 1)
+					break;
+				backlog.pop_front();
+			}
+		}
+
+	public:
+		explicit io_context(unsigned int entries = 4096)
+			: stopped(false),
+			work(0)
+		{
+			cq = zts_cq_create(entries);
+			wake[0] = wake[1] = -1;
+			if(pipe(wake) == 0) {
+				fcntl(wake[0], F_SETFL, O_NONBLOCK);
+				fcntl(wake[1], F_SETFL, O_NONBLOCK);
+			}
+		}
+
+		~io_context()
+		{
+			if(cq >= 0)
+				zts_close(cq);
+			close(wake[0]);
+			close(wake[1]);
+		}
+
+		io_context(const io_context &) = delete;
+		io_context &operator=(const io_context &) = delete;
+
+		// -1 if the completion queue couldn't be created
+		int fd() const { return cq; }
+
+		void post(std::coroutine_handle<> h) override
+		{
+			work++;
+			{
+				std::lock_guard<std::mutex> _l(_m);
+				posted.push_back(h);
+			}
+			signal();
+		}
+
+		void submit(op_base *op)
+		{
+			work++;
+			op->sqe.user_data = (uint64_t)(uintptr_t)op;
+			{
+				std::lock_guard<std::mutex> _l(_m);
+				// Ops already waiting keep their place in line
+				if(backlog.empty() && zts_submit(cq, &op->sqe, 1) == 1)
+					return; // op may already be resumed by now, don't touch it
+				if(errno == EAGAIN || !backlog.empty()) {
+					backlog.push_back(op);
+					return;
+				}
+			}
+			op->res = -errno;
+			post(op->h);
+			work--; // post() counted it again
+		}
+
+		/*
+		 * Resumes whatever is ready, waiting up to timeout ms (forever if -1) for something to
+		 * be. Returns the number of coroutines resumed
+		 */
+		int run_one(int timeout = -1)
+		{
+			int n = 0;
+			for(;;) {
+				std::coroutine_handle<> h;
+				{
+					std::lock_guard<std::mutex> _l(_m);
+					if(posted.empty())
+						break;
+					h = posted.front();
+					posted.pop_front();
+				}
+				work--;
+				h.resume();
+				n++;
+			}
+			if(n)
+				return n;
+			// The queue's descriptor is readable whenever zts_complete() has something to do,
+			// but nothing wakes it for the stack changes zts_complete() only catches by rechecking
+			struct pollfd fds[2];
+			fds[0].fd = cq;
+			fds[0].events = POLLIN;
+			fds[1].fd = wake[0];
+			fds[1].events = POLLIN;
+			int slice = (timeout < 0 || timeout > ZT_CQ_RECHECK_DELAY) ? ZT_CQ_RECHECK_DELAY : timeout;
+			int r = poll(fds, 2, slice);
+			if(r > 0 && (fds[1].revents & POLLIN)) {
+				char buf[64];
+				while(read(wake[0], buf, sizeof(buf)) > 0) { }
+			}
+			struct zts_cqe cqes[64];
+			int c = zts_complete(cq, cqes, 64, r == 0 && slice ? 1 : 0);
+			for(int i=0; i<c; i++) {
+				op_base *op = (op_base *)(uintptr_t)cqes[i].user_data;
+				op->res = cqes[i].res;
+				dispatch(op);
+				n++;
+			}
+			if(c > 0)
+				resubmit();
+			return n;
+		}
+
+		/*
+		 * Runs until stop() or until there is nothing left to wait for
+		 */
+		void run()
+		{
+			while(!stopped && work > 0)
+				run_one(-1);
+		}
+
+		void stop()
+		{
+			stopped = true;
+			signal();
+		}
+
+		bool is_stopped() const { return stopped; }
+	};
+
+	/*
+	 * co_await on one of these submits its zts_sqe and resumes with the result
+	 */
+	struct op_awaiter : op_base
+	{
+		io_context &ctx;
+
+		op_awaiter(io_context &ctx, int op, int fd, void *buf, size_t len, 
+			const struct sockaddr *addr = NULL, socklen_t addrlen = 0)
+			: ctx(ctx)
+		{
+			sqe.op = op;
+			sqe.fd = fd;
+			sqe.buf = buf;
+			sqe.len = len;
+			sqe.addr = addr;
+			sqe.addrlen = addrlen;
+			sqe.user_data = 0;
+			res = 0;
+		}
+
+		bool await_ready() noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> h) { this->h = h; ctx.submit(this); }
+		ssize_t await_resume() noexcept { return res; }
+	};
+
+	inline op_awaiter async_read(io_context &ctx, int fd, void *buf, size_t len)
+	{
+		return op_awaiter(ctx, ZTS_OP_READ, fd, buf, len);
+	}
+
+	inline op_awaiter async_write(io_context &ctx, int fd, const void *buf, size_t len)
+	{
+		return op_awaiter(ctx, ZTS_OP_WRITE, fd, const_cast<void *>(buf), len);
+	}
+
+	// Resumes with the accepted descriptor
+	inline op_awaiter async_accept(io_context &ctx, int fd)
+	{
+		return op_awaiter(ctx, ZTS_OP_ACCEPT, fd, NULL, 0);
+	}
+
+	// addr is copied before the coroutine is suspended
+	inline op_awaiter async_connect(io_context &ctx, int fd, const struct sockaddr *addr, socklen_t addrlen)
+	{
+		return op_awaiter(ctx, ZTS_OP_CONNECT, fd, NULL, 0, addr, addrlen);
+	}
+
+	/*
+	 * co_await resume_on(ex) carries on in one of ex's threads
+	 */
+	struct resume_on
+	{
+		executor &ex;
+		explicit resume_on(executor &ex) : ex(ex) { }
+		bool await_ready() noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> h) { ex.post(h); }
+		void await_resume() noexcept { }
+	};
+
+	template<typename T> class task;
+
+	namespace detail {
+
+		struct promise_base
+		{
+			std::coroutine_handle<> continuation;
+			std::exception_ptr error;
+
+			struct final_awaiter
+			{
+				bool await_ready() noexcept { return false; }
+				template<typename P>
+				std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+				{
+					std::coroutine_handle<> c = h.promise().continuation;
+					return c ? c : std::noop_coroutine();
+				}
+				void await_resume() noexcept { }
+			};
+
+			std::suspend_always initial_suspend() noexcept { return {}; }
+			final_awaiter final_suspend() noexcept { return {}; }
+			void unhandled_exception() { error = std::current_exception(); }
+		};
+
+		template<typename T>
+		struct promise : promise_base
+		{
+			std::optional<T> value;
+			task<T> get_return_object();
+			template<typename U> void return_value(U &&v) { value.emplace(std::forward<U>(v)); }
+			T result()
+			{
+				if(error)
+					std::rethrow_exception(error);
+				return std::move(*value);
+			}
+		};
+
+		template<>
+		struct promise<void> : promise_base
+		{
+			task<void> get_return_object();
+			void return_void() { }
+			void result()
+			{
+				if(error)
+					std::rethrow_exception(error);
+			}
+		};
+	}
+
+	/*
+	 * A lazily started coroutine, runs when co_await'ed (or handed to co_spawn())
+	 */
+	template<typename T = void>
+	class task
+	{
+	public:
+		typedef detail::promise<T> promise_type;
+
+		explicit task(std::coroutine_handle<promise_type> h) : h(h) { }
+		task(task &&t) noexcept : h(std::exchange(t.h, nullptr)) { }
+		task(const task &) = delete;
+		~task() { if(h) h.destroy(); }
+
+		bool await_ready() noexcept { return false; }
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept
+		{
+			h.promise().continuation = c;
+			return h;
+		}
+		T await_resume() { return h.promise().result(); }
+
+	private:
+		std::coroutine_handle<promise_type> h;
+	};
+
+	namespace detail {
+
+		template<typename T>
+		inline task<T> promise<T>::get_return_object()
+		{
+			return task<T>(std::coroutine_handle<promise<T> >::from_promise(*this));
+		}
+
+		inline task<void> promise<void>::get_return_object()
+		{
+			return task<void>(std::coroutine_handle<promise<void> >::from_promise(*this));
+		}
+
+		// Owns a spawned task, destroys itself once the task is done
+		struct detached
+		{
+			struct promise_type
+			{
+				detached get_return_object() 
+				{ 
+					return detached(std::coroutine_handle<promise_type>::from_promise(*this)); 
+				}
+				std::suspend_always initial_suspend() noexcept { return {}; }
+				std::suspend_never final_suspend() noexcept { return {}; }
+				void return_void() { }
+				void unhandled_exception() { std::terminate(); }
+			};
+
+			explicit detached(std::coroutine_handle<promise_type> h) : h(h) { }
+			std::coroutine_handle<promise_type> h;
+		};
+
+		inline detached run_detached(task<void> t)
+		{
+			co_await t;
+		}
+	}
+
+	/*
+	 * Starts t on ex without waiting for it, an exception escaping t terminates the process
+	 */
+	inline void co_spawn(executor &ex, task<void> t)
+	{
+		ex.post(detail::run_detached(std::move(t)).h);
+	}
+
+} // namespace coro
+} // namespace ZeroTier
+
+#endif // ZT_LIBZT_CORO_HPP
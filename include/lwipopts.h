@@ -44,17 +44,17 @@
  */
 #include "lwip/debug.h"
 
-// IP Protocol version 
-// It seems using ipv6/ipv4 in the same stack is problematic, for this reason we 
-// compile for only one or the other using the SDK_IPV4=1/SDK_IPV6=1 flags for now
-#if defined(SDK_IPV6)
+// IP Protocol version, a build with both carries them on one netif per tap (see 
+// lwIP::lwip_init_interface()). IPv4 only unless asked for otherwise
+#if defined(LIBZT_IPV6) || defined(SDK_IPV6)
 	#define LWIP_IPV6   1
- 	#define LWIP_IPV4   0
-
+#else
+	#define LWIP_IPV6   0
 #endif
-#if defined(SDK_IPV4) 
+#if defined(LIBZT_IPV4) || defined(SDK_IPV4) || !LWIP_IPV6
 	#define LWIP_IPV4   1
- 	#define LWIP_IPV6   0
+#else
+	#define LWIP_IPV4   0
 #endif
 
 #define LWIP_TCP        1
@@ -65,7 +65,19 @@
 
 #define LWIP_DBG_TYPES_ON LWIP_DBG_TRACE | LWIP_DBG_STATE | LWIP_DBG_FRESH
 
-#define LWIP_CHKSUM_ALGORITHM 2
+// 32 bit additions, and checksums of TCP data computed while it's copied into pbufs
+#define LWIP_CHKSUM_ALGORITHM 3
+#define LWIP_CHECKSUM_ON_COPY 1
+
+// Frames are authenticated end to end by the ZeroTier core so received checksums aren't
+// verified unless built with ZT_CHECKSUM_CHECK=1, outgoing ones are always generated
+#if !defined(LIBZT_CHECKSUM_CHECK)
+#define CHECKSUM_CHECK_IP     0
+#define CHECKSUM_CHECK_UDP    0
+#define CHECKSUM_CHECK_TCP    0
+#define CHECKSUM_CHECK_ICMP   0
+#define CHECKSUM_CHECK_ICMP6  0
+#endif
 
 #undef TCP_MSS
 #define TCP_MSS 1460
@@ -82,7 +94,23 @@ reason for "twice" are both the nagle algorithm and delayed ACK from the
 remote peer.
 */
 
-#define TCP_WND TCP_MSS*10 // max = 0xffff
+// With window scaling a window is no longer capped at 0xffff, which at intercontinental
+// latencies would hold a connection to a few Mbit/s. TCP_RCV_SCALE 5 allows up to 2 MiB
+#define LWIP_WND_SCALE 1
+#define TCP_RCV_SCALE  5
+#define TCP_WND        1024 * 1024
+
+// Timestamps (RTTM/PAWS) and SACKs of what sits on ->ooseq, so a loss in a window this large
+// doesn't cost the peer a retransmission of everything after it
+#define LWIP_TCP_TIMESTAMPS   1
+#define LWIP_TCP_SACK_OUT     1
+#define LWIP_TCP_MAX_SACK_NUM 4
+
+// TCP Fast Open (RFC 7413): a repeat connection carries its first request on the SYN, see
+// zts_setsockopt(TCP_FASTOPEN) and zts_sendto(MSG_FASTOPEN)
+#define LWIP_TCP_FASTOPEN             1
+#define LWIP_TCP_FASTOPEN_COOKIE_LEN  8
+#define LWIP_TCP_FASTOPEN_CACHE_SIZE  64
 
 //#define LWIP_NOASSERT 1
 #define TCP_LISTEN_BACKLOG   0
@@ -91,28 +119,20 @@ remote peer.
 ---------------------------------- Timers --------------------------------------
 ------------------------------------------------------------------------------*/
 /*
-Be careful about setting this too small.  lwIP just counts the number
-of times its timer is called and uses this to control time sensitive
-operations (such as TCP retransmissions), rather than actually
-measuring time using something more accurate.  If you call the timer
-functions very frequently you may see things (such as retransmissions)
-happening sooner than they should.
+lwIP counts time in calls to its timer (see lwIP::lwip_loop(), which makes up for calls it
+was late with). A 5 ms tick gives delayed ACKs a 5 ms ceiling and retransmission timeouts
+10 ms granularity, so a loss between LAN-local peers costs milliseconds rather than the
+hundreds the stock 250 ms tick would
 */
-/* these are originally defined in tcp_impl.h */
-#ifndef TCP_TMR_INTERVAL
-/* The TCP timer interval in milliseconds. */
-#define TCP_TMR_INTERVAL       250
-#endif /* TCP_TMR_INTERVAL */
-
-#ifndef TCP_FAST_INTERVAL
-/* the fine grained timeout in milliseconds */
+#define TCP_TMR_INTERVAL       5
 #define TCP_FAST_INTERVAL      TCP_TMR_INTERVAL
-#endif /* TCP_FAST_INTERVAL */
-
-#ifndef TCP_SLOW_INTERVALs
-/* the coarse grained timeout in milliseconds */
 #define TCP_SLOW_INTERVAL      (2*TCP_TMR_INTERVAL)
-#endif /* TCP_SLOW_INTERVAL */
+
+// RFC 6298's 1 s before the first RTT sample, no floor in the stack itself: sockets start at
+// ZT_TCP_RTO_MIN_DEFAULT (see ZT_SO_TCP_RTO_MIN). TIME-WAIT lasts 2 * TCP_MSL, like the kernel's
+#define TCP_RTO_INITIAL        1000
+#define TCP_RTO_MIN            0
+#define TCP_MSL                30000UL
 
 
 /*------------------------------------------------------------------------------
@@ -148,24 +168,68 @@ happening sooner than they should.
 #define MEM_LIBC_MALLOC 1
 #define MEMP_MEM_MALLOC 1
 
+// mem_malloc() (and through MEMP_MEM_MALLOC every memp pool) draws from libzt's size-class
+// arena rather than the process heap, see src/Arena.cpp
+#if defined(ZT_ARENA)
+#include <stddef.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+void *zt_arena_malloc(size_t sz);
+void *zt_arena_calloc(size_t n, size_t sz);
+void zt_arena_free(void *p);
+#ifdef __cplusplus
+}
+#endif
+#define mem_clib_malloc zt_arena_malloc
+#define mem_clib_calloc zt_arena_calloc
+#define mem_clib_free   zt_arena_free
+#endif
+
+// Sends on the netif of the tap with the most specific route to the destination rather than
+// on the default netif whenever no netif's own subnet matches, see src/lwIP.cpp
+struct netif;
+struct ip4_addr;
+struct ip6_addr;
+#ifdef __cplusplus
+extern "C" {
+#endif
+struct netif *zt_lwip_route4(const struct ip4_addr *dest);
+struct netif *zt_lwip_route6(const struct ip6_addr *src, const struct ip6_addr *dest);
+void zt_lwip_tfo_cookie(const void *remote_ip, unsigned char *cookie);
+unsigned int zt_lwip_reass_limit(void);
+unsigned short zt_lwip_path_mtu(struct netif *netif, const void *dest);
+#ifdef __cplusplus
+}
+#endif
+#define LWIP_HOOK_IP4_ROUTE(dest)      zt_lwip_route4(dest)
+#define LWIP_HOOK_IP6_ROUTE(src, dest) zt_lwip_route6(src, dest)
+// Fast Open cookies are a keyed hash of the client's address, see src/lwIP.cpp
+#define LWIP_HOOK_TCP_FASTOPEN_COOKIE(remote_ip, cookie) zt_lwip_tfo_cookie(remote_ip, cookie)
+// TCP's MSS is clamped to what the core sends unfragmented, see SocketTap::pathMtu()
+#define LWIP_HOOK_TCP_PATH_MTU(netif, dest) zt_lwip_path_mtu(netif, dest)
+
 
 
 /**
  * MEM_ALIGNMENT: should be set to the alignment of the CPU
  *    4 byte alignment -> #define MEM_ALIGNMENT 4
  *    2 byte alignment -> #define MEM_ALIGNMENT 2
+ * 8 keeps pbuf payloads, and so the copies and checksums over them, word-aligned on 64-bit
+ * hosts (malloc() and the arena return 16-byte aligned memory)
  */
-#define MEM_ALIGNMENT                   1
+#define MEM_ALIGNMENT                   8
 
 /**
  * MEM_SIZE: the size of the heap memory. If the application will send
  * a lot of data that needs to be copied, this should be set high.
  */
 #define MEM_SIZE                        1024 * 1024 * 64
-#define TCP_SND_BUF                     1024 * 63
+#define TCP_SND_BUF                     1024 * 1024
 //#define TCP_OVERSIZE                    TCP_MSS
 
-#define TCP_SND_QUEUELEN                1024
+#define TCP_SND_QUEUELEN                ((4 * (TCP_SND_BUF) + (TCP_MSS - 1)) / (TCP_MSS))
+#define TCP_SNDLOWAT                    32 * 1024 // a u16_t even though TCP_SND_BUF is larger
 
 /*------------------------------------------------------------------------------
 -------------------------------- Pbuf Options ----------------------------------
@@ -176,7 +240,13 @@ happening sooner than they should.
  * link level header. The default is 14, the standard value for
  * Ethernet.
  */
-#define PBUF_LINK_HLEN                  16
+#define PBUF_LINK_HLEN                  (14 + ETH_PAD_SIZE)
+
+/**
+ * ETH_PAD_SIZE: bytes in front of the ethernet header (part of struct eth_hdr), with 2 the
+ * IP header which follows it starts on a MEM_ALIGNMENT boundary, as pbuf payloads do
+ */
+#define ETH_PAD_SIZE                    2
 
 /**
  * PBUF_POOL_BUFSIZE: the size of each pbuf in the pbuf pool. The default is
@@ -186,11 +256,21 @@ happening sooner than they should.
  */
 #define PBUF_POOL_BUFSIZE               LWIP_MEM_ALIGN_SIZE(TCP_MSS+40+PBUF_LINK_HLEN)
 
+/**
+ * LWIP_PBUF_RX_STAMP: received frames carry their arrival time to SO_TIMESTAMP(NS), see
+ * SocketTap::rxStamp()
+ */
+#define LWIP_PBUF_RX_STAMP              1
+
 
 /*------------------------------------------------------------------------------
 -------------------------- Internal Memory Pool Sizes --------------------------
 ------------------------------------------------------------------------------*/
 
+// Since MEMP_MEM_MALLOC is set the pools below come from the arena and their sizes aren't
+// enforced, how many sockets may be open at once is set at runtime instead (see
+// zts_set_stack_config())
+
 /**
  * MEMP_NUM_PBUF: the number of memp struct pbufs (used for PBUF_ROM and PBUF_REF).
  * If the application sends a lot of data out of ROM (or other static memory),
@@ -233,7 +313,7 @@ happening sooner than they should.
  * MEMP_NUM_REASSDATA: the number of simultaneously IP packets queued for
  * reassembly (whole packets, not fragments!)
  */
-#define MEMP_NUM_REASSDATA              1
+#define MEMP_NUM_REASSDATA              64
 
 /**
  * MEMP_NUM_ARP_QUEUE: the number of simulateously queued outgoing
@@ -290,6 +370,13 @@ happening sooner than they should.
  */
 #define LWIP_ARP                        1
 
+/**
+ * LWIP_NETIF_HWADDRHINT==1: Each PCB remembers the ARP (or ND destination cache) entry it last
+ * sent to, rather than all of them sharing one. Connected UDP sockets to different peers
+ * would otherwise keep evicting each other's and fall back to scanning the table
+ */
+#define LWIP_NETIF_HWADDRHINT           1
+
 
 /*------------------------------------------------------------------------------
 ------------------------------------ IP options---------------------------------
@@ -336,7 +423,16 @@ happening sooner than they should.
  * PBUF_POOL_SIZE > IP_REASS_MAX_PBUFS so that the stack is still able to receive
  * packets even if the maximum amount of fragments is enqueued for reassembly!
  */
-#define IP_REASS_MAX_PBUFS              4
+#define IP_REASS_MAX_PBUFS              256
+
+// What reassembly may actually hold is bounded by the frames a tap holds for the stack
+// (zts_stack_config.frame_pool_sz), see src/lwIP.cpp
+#define IP_REASS_PBUF_LIMIT             zt_lwip_reass_limit()
+
+/**
+ * IP_REASS_BUCKETS: Number of hash buckets datagrams waiting to be reassembled are kept in
+ */
+#define IP_REASS_BUCKETS                32
 
 /**
  * IP_FRAG_USES_STATIC_BUF==1: Use a static MTU-sized buffer for IP
@@ -345,6 +441,10 @@ happening sooner than they should.
 */
 #define IP_FRAG_USES_STATIC_BUF         0
 
+// Received frames are handed to the stack in place as custom pbufs (see lwip_rx_ref()), whichever
+// address families are built
+#define LWIP_SUPPORT_CUSTOM_PBUF        1
+
 /**
  * IP_DEFAULT_TTL: Default value for Time-To-Live used by transport layers.
  */
@@ -445,6 +545,12 @@ happening sooner than they should.
 
 #define LWIP_LISTEN_BACKLOG             0
 
+/**
+ * LWIP_TCP_KEEPALIVE==1: Per PCB keepalive idle time, interval and count (see SO_KEEPALIVE in
+ * zts_setsockopt()), checked by tcp_slowtmr() along with every other PCB timer
+ */
+#define LWIP_TCP_KEEPALIVE              1
+
 
 /*------------------------------------------------------------------------------
 --------------------------------- LOOPIF Options -------------------------------
@@ -455,6 +561,13 @@ happening sooner than they should.
  */
 #define LWIP_HAVE_LOOPIF                0
 
+/**
+ * LWIP_NETIF_LOOPBACK==1: Packets to a tap's own address are queued on its netif and fed
+ * back in by the stack thread (see lwIP::lwip_loop()) rather than sent to the virtual wire,
+ * where nothing would answer the ARP/ND query for them
+ */
+#define LWIP_NETIF_LOOPBACK             1
+
 
 /*------------------------------------------------------------------------------
 ---------------------------- Sequential Layer Options --------------------------
@@ -60,7 +60,6 @@ UNIT_TEST_SRC_DIR  = test
 
 # Debug output for ZeroTier service
 ifeq ($(ZT_DEBUG),1)
-	DEFS+=-DZT_TRACE
 	CFLAGS+=-Wall -g -pthread $(INCLUDES) $(DEFS)
 	STRIP=echo
 	# The following line enables optimization for the crypto code, since
@@ -107,6 +106,30 @@ ifeq ($(SDK_DEBUG),1)
 		-Isrc/stack_drivers/picotcp
 endif
 
+# Highest DEBUG_* level compiled in (see include/Debug.hpp), statements above it cost nothing
+ifeq ($(SDK_DEBUG),1)
+	ZT_DEBUG_LEVEL?=6
+endif
+ifneq ($(ZT_DEBUG_LEVEL),)
+	CXXFLAGS+=-DZT_DEBUG_LEVEL=$(ZT_DEBUG_LEVEL)
+endif
+
+# Record debug output into per-thread binary rings which are formatted on a separate thread
+ifeq ($(ZT_TRACE_RING),1)
+	CXXFLAGS+=-DZT_TRACE_RING
+endif
+
+# The core's own trace events, formatted and written out on the thread hitting them. Off
+# unless asked for (ZT_DEBUG=1 no longer implies it) and never defined for libzt's sources
+ifeq ($(ZT_CORE_TRACE),1)
+$(ZTO_OBJS): DEFS+=-DZT_TRACE
+endif
+
+# Time every acquisition of the busiest locks, see zts_get_lock_stats()
+ifeq ($(ZT_LOCK_STATS),1)
+	CXXFLAGS+=-DZT_LOCK_STATS
+endif
+
 # JNI (Java Native Interface)
 ifeq ($(SDK_JNI), 1)
 	# jni.h
@@ -137,13 +160,45 @@ CXXFLAGS+=-DSDK_IPV6
 
 STACK_DRIVER_FILES:=src/picoTCP.cpp
 TAP_FILES:=src/SocketTap.cpp \
+	src/StackThread.cpp \
 	src/libzt.cpp \
-	src/Utilities.cpp
+	src/Utilities.cpp \
+	src/TraceRing.cpp \
+	src/HttpControlPlane.cpp \
+	src/Arena.cpp \
+	src/Capture.cpp \
+	src/RecordStore.cpp \
+	src/ShmBridge.cpp \
+	src/Resolver.cpp \
+	src/StateStore.cpp \
+	src/StateWriter.cpp \
+	src/IdentityPool.cpp \
+	src/NodeDaemon.cpp \
+	src/Mux.cpp \
+	src/MsgPorts.cpp \
+	src/Replay.cpp \
+	src/DialPool.cpp
 
 SDK_OBJS+= SocketTap.o \
+	StackThread.o \
 	picoTCP.o \
 	libzt.o \
-	Utilities.o
+	Utilities.o \
+	TraceRing.o \
+	HttpControlPlane.o \
+	Arena.o \
+	Capture.o \
+	RecordStore.o \
+	ShmBridge.o \
+	Resolver.o \
+	StateStore.o \
+	StateWriter.o \
+	IdentityPool.o \
+	NodeDaemon.o \
+	Mux.o \
+	MsgPorts.o \
+	Replay.o \
+	DialPool.o
 
 PICO_OBJS+= ext/picotcp/build/lib/pico_device.o \
 	ext/picotcp/build/lib/pico_frame.o \
@@ -162,8 +217,22 @@ tests: unit_tests
 ## User-Space Stack                                                         ##
 ##############################################################################
 
+# Frames on the virtual wire are authenticated end to end by the core (Poly1305), so by
+# default neither stack verifies IP/TCP/UDP checksums on receive. They're still generated
+# since the far end may be an OS stack which checks them. ZT_CHECKSUM_CHECK=1 verifies too
+ZT_CHECKSUM_CHECK?=0
+ifeq ($(ZT_CHECKSUM_CHECK),1)
+CXXFLAGS+=-DZT_CHECKSUM_CHECK
+endif
+
+# See ZT_ARENA in make-linux.mk
+ZT_ARENA?=1
+ifeq ($(ZT_ARENA),1)
+CXXFLAGS+=-DZT_ARENA
+endif
+
 picotcp:
-	cd $(PICO_DIR); gmake lib ARCH=shared IPV4=1 IPV6=1
+	cd $(PICO_DIR); gmake lib ARCH=shared IPV4=1 IPV6=1 CRC=$(ZT_CHECKSUM_CHECK) ZT_ARENA=$(ZT_ARENA)
 
 ##############################################################################
 ## Static Libraries                                                         ##
@@ -51,6 +51,21 @@ CFLAGS:=$(CFLAGS) \
 	-I$(LWIPDIR)/include -I$(LWIPARCH)/include -I$(LWIPDIR)/include/ipv4 \
 	-I$(LWIPDIR) -I. -Iext -Iinclude
 
+# See ZT_CHECKSUM_CHECK in make-linux.mk
+ifeq ($(ZT_CHECKSUM_CHECK),1)
+CFLAGS+=-DLIBZT_CHECKSUM_CHECK
+endif
+
+# See ZT_ARENA in make-linux.mk
+ifeq ($(ZT_ARENA),1)
+CFLAGS+=-DZT_ARENA
+endif
+
+# See ZT_FRAME_POINTERS in make-linux.mk
+ifeq ($(ZT_FRAME_POINTERS),1)
+CFLAGS+=-fno-omit-frame-pointer
+endif
+
 # COREFILES, CORE4FILES: The minimum set of files needed for lwIP.
 COREFILES=$(LWIPDIR)/core/init.c \
 	$(LWIPDIR)/core/def.c \
@@ -43,8 +43,10 @@ OSTYPE = $(shell uname -s | tr '[A-Z]' '[a-z]')
 
 # Target output filenames
 STATIC_LIB_NAME    = libzt.a
+SHARED_LIB_NAME    = libzt.so
 JNI_LIB_NAME       = libzt.jnilib
 STATIC_LIB         = $(BUILD)/$(STATIC_LIB_NAME)
+SHARED_LIB         = $(BUILD)/$(SHARED_LIB_NAME)
 SHARED_JNI_LIB     = $(BUILD)/$(JNI_LIB_NAME)
 TEST_BUILD_DIR     = $(BUILD)
 UNIT_TEST_SRC_DIR  = test
@@ -55,12 +57,8 @@ UNIT_TEST_SRC_DIR  = test
 
 # Debug output for ZeroTier service
 ifeq ($(ZT_DEBUG),1)
-	DEFS+=-DZT_TRACE
 	CFLAGS+=-Wall -g -pthread $(INCLUDES) $(DEFS)
 	STRIP=echo
-	# The following line enables optimization for the crypto code, since
-	# C25519 in particular is almost UNUSABLE in heavy testing without it.
-#ext/lz4/lz4.o node/Salsa20.o node/SHA512.o node/C25519.o node/Poly1305.o: CFLAGS = -Wall -O2 -g -pthread $(INCLUDES) $(DEFS)
 else
 	CFLAGS?=-Ofast -g -fstack-protector
 	CFLAGS+=-Wall -fPIE -fvisibility=hidden -pthread $(INCLUDES) $(DEFS)
@@ -70,6 +68,29 @@ endif
 
 CXXFLAGS=$(CFLAGS) -Wno-format -fno-rtti -std=c++11 -DZT_SOFTWARE_UPDATE_DEFAULT="\"disable\""
 
+# Every frame to and from the virtual wire goes through the core's Salsa20/12 and Poly1305.
+# Where the core ships hand-written Salsa20/12 for the target (x86 uses SSE2 intrinsics either
+# way) it's linked in, ZT_SALSA2012_ASM=0 falls back to the portable C++
+CC_MACH=$(shell $(CC) -dumpmachine | cut -d '-' -f 1)
+ZT_SALSA2012_ASM?=1
+ifeq ($(ZT_SALSA2012_ASM),1)
+ifeq ($(CC_MACH),x86_64)
+ifneq ($(wildcard $(ZTO)/ext/x64-salsa2012-asm/salsa2012.s),)
+	DEFS+=-DZT_USE_X64_ASM_SALSA2012
+	ZTO_OBJS+=$(ZTO)/ext/x64-salsa2012-asm/salsa2012.o
+endif
+endif
+ifneq ($(filter armv7%,$(CC_MACH)),)
+ifneq ($(wildcard $(ZTO)/ext/arm32-neon-salsa2012-asm/salsa2012.s),)
+	DEFS+=-DZT_USE_ARM32_NEON_ASM_SALSA2012
+	ZTO_OBJS+=$(ZTO)/ext/arm32-neon-salsa2012-asm/salsa2012.o
+endif
+endif
+endif
+
+# The crypto stays optimized in ZT_DEBUG=1 builds, C25519 in particular is unusable otherwise
+$(ZTO)/node/Salsa20.o $(ZTO)/node/Poly1305.o $(ZTO)/node/SHA512.o $(ZTO)/node/C25519.o: CFLAGS+=-O2
+
 INCLUDES+= -Iext \
 	-I$(ZTO)/osdep \
 	-I$(ZTO)/node \
@@ -97,6 +118,47 @@ ifeq ($(SDK_DEBUG),1)
 	CXXFLAGS+=-g
 endif
 
+# Highest DEBUG_* level compiled in (see include/Debug.hpp), statements above it cost nothing
+ifeq ($(SDK_DEBUG),1)
+	ZT_DEBUG_LEVEL?=6
+endif
+ifneq ($(ZT_DEBUG_LEVEL),)
+	CXXFLAGS+=-DZT_DEBUG_LEVEL=$(ZT_DEBUG_LEVEL)
+endif
+
+# Record debug output into per-thread binary rings which are formatted on a separate thread
+ifeq ($(ZT_TRACE_RING),1)
+	CXXFLAGS+=-DZT_TRACE_RING
+endif
+
+# The core's own trace events, formatted and written out on the thread hitting them. Off
+# unless asked for (ZT_DEBUG=1 no longer implies it) and never defined for libzt's sources
+ifeq ($(ZT_CORE_TRACE),1)
+$(ZTO_OBJS): DEFS+=-DZT_TRACE
+endif
+
+# Time every acquisition of the busiest locks, see zts_get_lock_stats()
+ifeq ($(ZT_LOCK_STATS),1)
+	CXXFLAGS+=-DZT_LOCK_STATS
+endif
+
+# For profiling production builds with perf/bpftrace: frame pointers throughout (libzt, the core
+# and the stacks) so stacks can be walked without DWARF unwinding, and nothing is stripped
+ZT_FRAME_POINTERS?=0
+ifeq ($(ZT_FRAME_POINTERS),1)
+	CFLAGS+=-fno-omit-frame-pointer
+ifneq ($(filter x86_64 aarch64,$(shell $(CC) -dumpmachine | cut -d '-' -f 1)),)
+	CFLAGS+=-mno-omit-leaf-frame-pointer
+endif
+	STRIP=echo
+endif
+
+# USDT probes at the data path's hot spots (see src/Probes.hpp), nops until something attaches.
+# Needs <sys/sdt.h> (systemtap-sdt-dev)
+ifeq ($(ZT_USDT),1)
+	CXXFLAGS+=-DZT_USDT
+endif
+
 # JNI (Java Native Interface)
 ifeq ($(SDK_JNI), 1)
 	# jni.h
@@ -110,14 +172,16 @@ endif
 ## Stack Configuration                                                      ##
 ##############################################################################
 
-# default stack (picoTCP)
+# default stack (picoTCP), both stacks are linked with STACK_PICO=1 STACK_LWIP=1 and chosen
+# per network through zts_join_stack()
 STACK_PICO=1
 ifeq ($(NO_STACK)$(STACK_LWIP),1)
 STACK_PICO=0
 endif
 
-# picoTCP default protocol versions
+# picoTCP default protocol versions (lwIP's when both are linked)
 ifeq ($(STACK_PICO),1)
+ifneq ($(STACK_LWIP),1)
 ifeq ($(LIBZT_IPV4)$(LIBZT_IPV6),1)
 ifeq ($(LIBZT_IPV4),1)
 CXXFLAGS+=-DLIBZT_IPV4
@@ -129,6 +193,7 @@ else
 CXXFLAGS+=-DLIBZT_IPV4 -DLIBZT_IPV6
 endif
 endif
+endif
 
 # lwIP default protocol versions
 ifeq ($(STACK_LWIP),1)
@@ -144,15 +209,15 @@ CXXFLAGS+=-DLIBZT_IPV4
 endif
 endif
 
-LIBZT_FILES:=src/SocketTap.cpp src/libzt.cpp src/Utilities.cpp
-LIBZT_OBJS+=SocketTap.o libzt.o Utilities.o 
+LIBZT_FILES:=src/SocketTap.cpp src/StackThread.cpp src/libzt.cpp src/Utilities.cpp src/TraceRing.cpp src/HttpControlPlane.cpp src/Arena.cpp src/Capture.cpp src/RecordStore.cpp src/ShmBridge.cpp src/Resolver.cpp src/StateStore.cpp src/StateWriter.cpp src/IdentityPool.cpp src/NodeDaemon.cpp src/Mux.cpp src/MsgPorts.cpp src/Replay.cpp src/DialPool.cpp
+LIBZT_OBJS+=SocketTap.o StackThread.o libzt.o Utilities.o TraceRing.o HttpControlPlane.o Arena.o Capture.o RecordStore.o ShmBridge.o Resolver.o StateStore.o StateWriter.o IdentityPool.o NodeDaemon.o Mux.o MsgPorts.o Replay.o DialPool.o
 
 ifeq ($(STACK_PICO),1)
 CXXFLAGS+=-DSTACK_PICO
 STACK_LIB:=libpicotcp.a
 STACK_DIR:=ext/picotcp
 STACK_LIB:=$(STACK_DIR)/build/lib/$(STACK_LIB)
-STACK_DRIVER_FILES:=src/picoTCP.cpp
+STACK_DRIVER_FILES+=src/picoTCP.cpp
 STACK_DRIVER_OBJS+=picoTCP.o
 STACK_OBJS+= ext/picotcp/build/lib/pico_device.o \
 	ext/picotcp/build/lib/pico_frame.o \
@@ -169,7 +234,7 @@ endif
 ifeq ($(STACK_LWIP),1)
 STACK_FLAGS+=-DLWIP_PREFIX_BYTEORDER_FUNCS
 CXXFLAGS+=-DSTACK_LWIP
-STACK_DRIVER_FILES:=src/lwIP.cpp
+STACK_DRIVER_FILES+=src/lwIP.cpp
 STACK_DRIVER_OBJS+=lwIP.o
 STACK_OBJS+= init.o def.o dns.o inet_chksum.o ip.o mem.o \
 			memp.o netif.o pbuf.o raw.o stats.o sys.o tcp.o \
@@ -197,24 +262,40 @@ all:
 ## User-Space Stack                                                         ##
 ##############################################################################
 
+# Frames on the virtual wire are authenticated end to end by the core (Poly1305), so by
+# default neither stack verifies IP/TCP/UDP checksums on receive. They're still generated
+# since the far end may be an OS stack which checks them. ZT_CHECKSUM_CHECK=1 verifies too
+ZT_CHECKSUM_CHECK?=0
+ifeq ($(ZT_CHECKSUM_CHECK),1)
+CXXFLAGS+=-DZT_CHECKSUM_CHECK
+endif
+
+# The stacks allocate from libzt's per-thread size-class arena (src/Arena.cpp) instead of the
+# process heap, ZT_ARENA=0 leaves them to malloc()
+ZT_ARENA?=1
+ifeq ($(ZT_ARENA),1)
+CXXFLAGS+=-DZT_ARENA
+endif
+
 picotcp:
-	cd $(STACK_DIR); make lib ARCH=shared IPV4=1 IPV6=1
+	cd $(STACK_DIR); make lib ARCH=shared IPV4=1 IPV6=1 CRC=$(ZT_CHECKSUM_CHECK) ZT_ARENA=$(ZT_ARENA) ZT_FRAME_POINTERS=$(ZT_FRAME_POINTERS)
 
 lwip:
-	-make -f make-liblwip.mk liblwip.a IPV4=1 IPV6=1
+	-make -f make-liblwip.mk liblwip.a IPV4=1 IPV6=1 ZT_CHECKSUM_CHECK=$(ZT_CHECKSUM_CHECK) ZT_ARENA=$(ZT_ARENA) ZT_FRAME_POINTERS=$(ZT_FRAME_POINTERS)
 
 ##############################################################################
 ## Static Libraries                                                         ##
 ##############################################################################
 
+# picoTCP, lwIP or both (see Stack Configuration)
 ifeq ($(STACK_PICO),1)
-static_lib: picotcp $(ZTO_OBJS)
-	@mkdir -p $(BUILD)
-	$(CXX) $(CXXFLAGS) $(LIBZT_FILES) $(STACK_DRIVER_FILES) -c
-	ar rcs -o $(STATIC_LIB) $(ZTO_OBJS) $(STACK_DRIVER_OBJS) $(STACK_OBJS) $(LIBZT_OBJS) $(STACK_LIB)
+STACK_TARGETS+=picotcp
 endif
 ifeq ($(STACK_LWIP),1)
-static_lib: lwip $(ZTO_OBJS)
+STACK_TARGETS+=lwip
+endif
+ifneq ($(STACK_TARGETS),)
+static_lib: $(STACK_TARGETS) $(ZTO_OBJS)
 	@mkdir -p $(BUILD)
 	$(CXX) $(CXXFLAGS) $(STACK_FLAGS) $(STACK_INCLUDES) $(LIBZT_FILES) $(STACK_DRIVER_FILES) -c
 	ar rcs -o $(STATIC_LIB) $(ZTO_OBJS) $(STACK_DRIVER_OBJS) $(STACK_OBJS) $(LIBZT_OBJS) $(STACK_LIB)
@@ -227,6 +308,79 @@ static_lib: $(ZTO_OBJS)
 	ar rcs -o $(STATIC_LIB) $(ZTO_OBJS) $(LIBZT_OBJS)
 endif
 
+##############################################################################
+## Shared Library                                                           ##
+##############################################################################
+
+# Built from its own position-independent objects in $(BUILD)/pic. libzt, the stack drivers
+# and the core are compiled and linked with -flto (ZT_LTO=0 to leave it out) so the glue
+# between them can be inlined across files. Only zts_* (and the JNI entry points) are
+# exported, see libzt.ver, which also lets LTO treat everything else as internal. The stacks
+# themselves come from their own builds as they are
+ZT_LTO?=1
+ifeq ($(ZT_LTO),1)
+LTO_FLAGS=-flto
+endif
+
+# Profile-guided optimization: ZT_PGO=gen instruments, ZT_PGO=use optimizes with the profile in
+# PGO_DIR. make pgo does both, trained by PGO_TRAIN (defaulting to bench sim, so it needs
+# STACK_PICO=1 STACK_LWIP=1) against the instrumented library
+PGO_DIR?=$(BUILD)/pgo
+ifeq ($(ZT_PGO),gen)
+PGO_FLAGS=-fprofile-generate=$(abspath $(PGO_DIR))
+endif
+ifeq ($(ZT_PGO),use)
+ifneq ($(findstring clang,$(CXX)),)
+PGO_FLAGS=-fprofile-use=$(abspath $(PGO_DIR))/default.profdata -Wno-profile-instr-unprofiled
+else
+PGO_FLAGS=-fprofile-use=$(abspath $(PGO_DIR)) -fprofile-correction -Wno-missing-profile
+endif
+endif
+
+SHARED_OBJ_DIR  = $(BUILD)/pic
+SHARED_OBJS     = $(addprefix $(SHARED_OBJ_DIR)/,$(LIBZT_FILES:.cpp=.o) $(STACK_DRIVER_FILES:.cpp=.o) $(ZTO_OBJS))
+SHARED_FLAGS    = -fPIC -fno-semantic-interposition $(LTO_FLAGS) $(PGO_FLAGS)
+SHARED_CFLAGS   = $(filter-out -fPIE -fvisibility=hidden,$(CFLAGS)) $(SHARED_FLAGS)
+SHARED_CXXFLAGS = $(filter-out -fPIE -fvisibility=hidden,$(CXXFLAGS)) $(SHARED_FLAGS)
+
+$(SHARED_OBJ_DIR)/%.o: %.cpp
+	@mkdir -p $(dir $@)
+	$(CXX) $(SHARED_CXXFLAGS) $(STACK_FLAGS) $(STACK_INCLUDES) -c $< -o $@
+
+$(SHARED_OBJ_DIR)/%.o: %.c
+	@mkdir -p $(dir $@)
+	$(CC) $(SHARED_CFLAGS) -c $< -o $@
+
+$(SHARED_OBJ_DIR)/%.o: %.s
+	@mkdir -p $(dir $@)
+	$(CC) $(SHARED_CFLAGS) -c $< -o $@
+
+# The core needs -O2 for its crypto here too (see above)
+$(SHARED_OBJ_DIR)/$(ZTO)/node/Salsa20.o $(SHARED_OBJ_DIR)/$(ZTO)/node/Poly1305.o $(SHARED_OBJ_DIR)/$(ZTO)/node/SHA512.o $(SHARED_OBJ_DIR)/$(ZTO)/node/C25519.o: CFLAGS+=-O2
+
+shared_lib: $(STACK_TARGETS) $(SHARED_OBJS)
+	$(CXX) $(SHARED_CXXFLAGS) -shared -Wl,-soname,$(SHARED_LIB_NAME) -Wl,--version-script=libzt.ver \
+		-o $(SHARED_LIB) $(SHARED_OBJS) $(STACK_OBJS) $(STACK_LIB) $(COMMON_LIBS)
+
+PGO_TRAIN?=$(BUILD)/pgo-bench sim conns=1,10 sizes=64,1024,16384 > /dev/null && \
+	$(BUILD)/pgo-bench sim case=scale threads=1,4 secs=1 > /dev/null
+
+# The training binaries link against the instrumented shared_lib
+$(BUILD)/pgo-%: $(UNIT_TEST_SRC_DIR)/%.cpp
+	$(CXX) $(CXXFLAGS) $(PGO_FLAGS) $(UNIT_TEST_INCLUDES) $(INCLUDES) -o $@ $< $(SHARED_LIB) -Wl,-rpath,$(abspath $(BUILD)) $(COMMON_LIBS)
+
+# Instrumented and optimized objects must have the same paths for the profile to be found
+pgo:
+	rm -rf $(SHARED_OBJ_DIR) $(PGO_DIR)
+	$(MAKE) shared_lib ZT_PGO=gen
+	$(MAKE) $(BUILD)/pgo-bench ZT_PGO=gen
+	$(PGO_TRAIN)
+ifneq ($(findstring clang,$(CXX)),)
+	llvm-profdata merge -output=$(PGO_DIR)/default.profdata $(PGO_DIR)/*.profraw
+endif
+	rm -rf $(SHARED_OBJ_DIR)
+	$(MAKE) shared_lib ZT_PGO=use
+
 ##############################################################################
 ## Java JNI                                                                 ##
 ##############################################################################
@@ -241,7 +395,7 @@ shared_jni_lib: picotcp $(ZTO_OBJS)
 UNIT_TEST_SRC_FILES := $(wildcard  $(UNIT_TEST_SRC_DIR)/*.cpp)
 UNIT_TEST_OBJ_FILES := $(addprefix $(TEST_BUILD_DIR)/,$(notdir $(UNIT_TEST_SRC_FILES:.cpp=)))
 UNIT_TEST_INCLUDES  := -Iinclude
-UNIT_TEST_LIBS      := -L$(BUILD) -lzt $(COMMON_LIBS)
+UNIT_TEST_LIBS      := $(STATIC_LIB) $(COMMON_LIBS) # not libzt.so, even if shared_lib was built
 
 $(TEST_BUILD_DIR)/%: $(UNIT_TEST_SRC_DIR)/%.cpp
 	@mkdir -p $(TEST_BUILD_DIR)
@@ -250,6 +404,67 @@ $(TEST_BUILD_DIR)/%: $(UNIT_TEST_SRC_DIR)/%.cpp
 
 tests: $(UNIT_TEST_OBJ_FILES)
 
+##############################################################################
+## Benchmarks                                                               ##
+##############################################################################
+
+# Run against a second host which runs the same target with BENCH_FROM/BENCH_TO
+# swapped (whichever personality has 'mode server' echoes), e.g.:
+#   make bench BENCH_FROM=bob BENCH_TO=alice BENCH_ARGS="fmt=json" BENCH_OUT=pico.json
+#   make bench BENCH_FROM=bob BENCH_TO=alice BENCH_ARGS="fmt=json" BENCH_OUT=lwip.json STACK_LWIP=1
+BENCH_CONF ?= test/selftest.conf
+BENCH_FROM ?= bob
+BENCH_TO   ?= alice
+BENCH_ARGS ?= fmt=csv
+BENCH_OUT  ?= $(BUILD)/bench.out
+
+bench: static_lib $(TEST_BUILD_DIR)/bench
+	$(TEST_BUILD_DIR)/bench $(BENCH_CONF) $(BENCH_FROM) to $(BENCH_TO) $(BENCH_ARGS) > $(BENCH_OUT)
+	@cat $(BENCH_OUT)
+
+# Both ends in this process over the simulated wire (needs STACK_PICO=1 STACK_LWIP=1), e.g.:
+#   make bench_sim STACK_PICO=1 STACK_LWIP=1 BENCH_ARGS="wire=0:0:0:0:0,20:5:1000:0:100 seed=7"
+bench_sim: static_lib $(TEST_BUILD_DIR)/bench
+	$(TEST_BUILD_DIR)/bench sim $(BENCH_ARGS) > $(BENCH_OUT)
+	@cat $(BENCH_OUT)
+
+# Bytes per network and per idle connection, on each stack the library was built with, e.g.:
+#   make bench_mem STACK_PICO=1 STACK_LWIP=1 BENCH_ARGS="conns=0,1000 fmt=json"
+bench_mem: static_lib $(TEST_BUILD_DIR)/bench
+	$(TEST_BUILD_DIR)/bench mem $(BENCH_ARGS) > $(BENCH_OUT)
+	@cat $(BENCH_OUT)
+
+# Hot paths in isolation, no network needed. Fails if a case is more than MICROBENCH_TOLERANCE
+# percent slower than in MICROBENCH_BASELINE (an earlier run's output), e.g.:
+#   make microbench MICROBENCH_OUT=base.csv
+#   make microbench MICROBENCH_BASELINE=base.csv
+MICROBENCH_ARGS      ?=
+MICROBENCH_OUT       ?= $(BUILD)/microbench.out
+MICROBENCH_TOLERANCE ?= 10
+
+microbench: static_lib $(TEST_BUILD_DIR)/microbench
+	$(TEST_BUILD_DIR)/microbench $(MICROBENCH_ARGS) $(if $(MICROBENCH_BASELINE),baseline=$(MICROBENCH_BASELINE) tolerance=$(MICROBENCH_TOLERANCE)) > $(MICROBENCH_OUT)
+	@cat $(MICROBENCH_OUT)
+
+# iperf-style throughput between two hosts, with the CPU use of libzt's threads, e.g.:
+#   make zts_perf PERF_NWID=<nwid> PERF_ARGS=server (on one host)
+#   make zts_perf PERF_NWID=<nwid> PERF_ARGS="client 10.9.9.1 proto=udp rate=50000000" (on the other)
+PERF_PATH ?= $(BUILD)/perf
+PERF_NWID ?=
+
+zts_perf: static_lib $(TEST_BUILD_DIR)/zts_perf
+	$(TEST_BUILD_DIR)/zts_perf $(PERF_PATH) $(PERF_NWID) $(PERF_ARGS)
+
+# zts_perf over the host's sockets, which test/compare.sh runs through zerotier-one's TAP
+# against libzt between the same two hosts, e.g.:
+#   make zts_perf zts_perf_kernel && test/compare.sh server <path> <nwid> (on one host)
+#   make zts_perf zts_perf_kernel && test/compare.sh client <path> <nwid> 10.9.9.1 10.8.8.1 (on the other)
+$(TEST_BUILD_DIR)/zts_perf_kernel: $(UNIT_TEST_SRC_DIR)/zts_perf.cpp
+	@mkdir -p $(TEST_BUILD_DIR)
+	$(CXX) $(CXXFLAGS) -DPERF_KERNEL -o $@ $< -lpthread
+
+zts_perf_kernel: $(TEST_BUILD_DIR)/zts_perf_kernel
+
 ##############################################################################
 ## Misc                                                                     ##
 ##############################################################################
@@ -55,7 +55,6 @@ UNIT_TEST_SRC_DIR  = test
 
 # Debug output for ZeroTier service
 ifeq ($(ZT_DEBUG),1)
-	DEFS+=-DZT_TRACE
 	CFLAGS+=-Wall -g -pthread $(INCLUDES) $(DEFS)
 	STRIP=echo
 	# The following line enables optimization for the crypto code, since
@@ -95,6 +94,30 @@ ifeq ($(SDK_DEBUG),1)
 	CXXFLAGS+=-g
 endif
 
+# Highest DEBUG_* level compiled in (see include/Debug.hpp), statements above it cost nothing
+ifeq ($(SDK_DEBUG),1)
+	ZT_DEBUG_LEVEL?=6
+endif
+ifneq ($(ZT_DEBUG_LEVEL),)
+	CXXFLAGS+=-DZT_DEBUG_LEVEL=$(ZT_DEBUG_LEVEL)
+endif
+
+# Record debug output into per-thread binary rings which are formatted on a separate thread
+ifeq ($(ZT_TRACE_RING),1)
+	CXXFLAGS+=-DZT_TRACE_RING
+endif
+
+# The core's own trace events, formatted and written out on the thread hitting them. Off
+# unless asked for (ZT_DEBUG=1 no longer implies it) and never defined for libzt's sources
+ifeq ($(ZT_CORE_TRACE),1)
+$(ZTO_OBJS): DEFS+=-DZT_TRACE
+endif
+
+# Time every acquisition of the busiest locks, see zts_get_lock_stats()
+ifeq ($(ZT_LOCK_STATS),1)
+	CXXFLAGS+=-DZT_LOCK_STATS
+endif
+
 # JNI (Java Native Interface)
 ifeq ($(SDK_JNI), 1)
 	# jni.h
@@ -108,14 +131,16 @@ endif
 ## Stack Configuration                                                      ##
 ##############################################################################
 
-# default stack (picoTCP)
+# default stack (picoTCP), both stacks are linked with STACK_PICO=1 STACK_LWIP=1 and chosen
+# per network through zts_join_stack()
 STACK_PICO=1
 ifeq ($(NO_STACK)$(STACK_LWIP),1)
 STACK_PICO=0
 endif
 
-# picoTCP default protocol versions
+# picoTCP default protocol versions (lwIP's when both are linked)
 ifeq ($(STACK_PICO),1)
+ifneq ($(STACK_LWIP),1)
 ifeq ($(LIBZT_IPV4)$(LIBZT_IPV6),1)
 ifeq ($(LIBZT_IPV4),1)
 CXXFLAGS+=-DLIBZT_IPV4
@@ -127,6 +152,7 @@ else
 CXXFLAGS+=-DLIBZT_IPV4 -DLIBZT_IPV6
 endif
 endif
+endif
 
 # lwIP default protocol versions
 ifeq ($(STACK_LWIP),1)
@@ -142,15 +168,15 @@ CXXFLAGS+=-DLIBZT_IPV4
 endif
 endif
 
-LIBZT_FILES:=src/SocketTap.cpp src/libzt.cpp src/Utilities.cpp
-LIBZT_OBJS+=SocketTap.o libzt.o Utilities.o 
+LIBZT_FILES:=src/SocketTap.cpp src/StackThread.cpp src/libzt.cpp src/Utilities.cpp src/TraceRing.cpp src/HttpControlPlane.cpp src/Arena.cpp src/Capture.cpp src/RecordStore.cpp src/ShmBridge.cpp src/Resolver.cpp src/StateStore.cpp src/StateWriter.cpp src/IdentityPool.cpp src/NodeDaemon.cpp src/Mux.cpp src/MsgPorts.cpp src/Replay.cpp src/DialPool.cpp
+LIBZT_OBJS+=SocketTap.o StackThread.o libzt.o Utilities.o TraceRing.o HttpControlPlane.o Arena.o Capture.o RecordStore.o ShmBridge.o Resolver.o StateStore.o StateWriter.o IdentityPool.o NodeDaemon.o Mux.o MsgPorts.o Replay.o DialPool.o
 
 ifeq ($(STACK_PICO),1)
 CXXFLAGS+=-DSTACK_PICO
 STACK_LIB:=libpicotcp.a
 STACK_DIR:=ext/picotcp
 STACK_LIB:=$(STACK_DIR)/build/lib/$(STACK_LIB)
-STACK_DRIVER_FILES:=src/picoTCP.cpp
+STACK_DRIVER_FILES+=src/picoTCP.cpp
 STACK_DRIVER_OBJS+=picoTCP.o
 STACK_OBJS+= ext/picotcp/build/lib/pico_device.o \
 	ext/picotcp/build/lib/pico_frame.o \
@@ -165,7 +191,7 @@ endif
 
 ifeq ($(STACK_LWIP),1)
 CXXFLAGS+=-DSTACK_LWIP
-STACK_DRIVER_FILES:=src/lwIP.cpp
+STACK_DRIVER_FILES+=src/lwIP.cpp
 STACK_DRIVER_OBJS+=lwIP.o
 STACK_OBJS+= init.o def.o dns.o inet_chksum.o ip.o mem.o \
 			memp.o netif.o pbuf.o raw.o stats.o sys.o tcp.o \
@@ -193,26 +219,42 @@ all:
 ## User-Space Stack                                                         ##
 ##############################################################################
 
+# Frames on the virtual wire are authenticated end to end by the core (Poly1305), so by
+# default neither stack verifies IP/TCP/UDP checksums on receive. They're still generated
+# since the far end may be an OS stack which checks them. ZT_CHECKSUM_CHECK=1 verifies too
+ZT_CHECKSUM_CHECK?=0
+ifeq ($(ZT_CHECKSUM_CHECK),1)
+CXXFLAGS+=-DZT_CHECKSUM_CHECK
+endif
+
+# The stacks allocate from libzt's per-thread size-class arena (src/Arena.cpp) instead of the
+# process heap, ZT_ARENA=0 leaves them to malloc()
+ZT_ARENA?=1
+ifeq ($(ZT_ARENA),1)
+CXXFLAGS+=-DZT_ARENA
+endif
+
 picotcp:
-	cd $(STACK_DIR); make lib ARCH=shared IPV4=1 IPV6=1
+	cd $(STACK_DIR); make lib ARCH=shared IPV4=1 IPV6=1 CRC=$(ZT_CHECKSUM_CHECK) ZT_ARENA=$(ZT_ARENA)
 
 lwip:
-	-make -f make-liblwip.mk liblwip.a
+	-make -f make-liblwip.mk liblwip.a ZT_CHECKSUM_CHECK=$(ZT_CHECKSUM_CHECK) ZT_ARENA=$(ZT_ARENA)
 
 ##############################################################################
 ## Static Libraries                                                         ##
 ##############################################################################
 
+# picoTCP, lwIP or both (see Stack Configuration)
 ifeq ($(STACK_PICO),1)
-static_lib: picotcp $(ZTO_OBJS)
-	@mkdir -p $(BUILD)
-	$(CXX) $(CXXFLAGS) $(LIBZT_FILES) $(STACK_DRIVER_FILES) -c
-	libtool -static -o $(STATIC_LIB) $(ZTO_OBJS) $(STACK_DRIVER_OBJS)  $(STACK_OBJS) $(LIBZT_OBJS) $(STACK_LIB)
+STACK_TARGETS+=picotcp
 endif
 ifeq ($(STACK_LWIP),1)
-static_lib: lwip $(ZTO_OBJS)
+STACK_TARGETS+=lwip
+endif
+ifneq ($(STACK_TARGETS),)
+static_lib: $(STACK_TARGETS) $(ZTO_OBJS)
 	@mkdir -p $(BUILD)
-	$(CXX) $(CXXFLAGS) $(STACK_INCLUDES) $(LIBZT_FILES) $(STACK_DRIVER_FILES) -c
+	$(CXX) $(CXXFLAGS) $(STACK_FLAGS) $(STACK_INCLUDES) $(LIBZT_FILES) $(STACK_DRIVER_FILES) -c
 	libtool -static -o $(STATIC_LIB) $(ZTO_OBJS) $(STACK_DRIVER_OBJS) $(STACK_OBJS) $(LIBZT_OBJS) $(STACK_LIB)
 endif
 # for layer-2 only (this will omit all userspace network stack code)
@@ -0,0 +1,193 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// Admission control of a network's inbound connections and frames, see zts_set_admission_limits()
+
+#ifndef ZT_ADMISSION_HPP
+#define ZT_ADMISSION_HPP
+
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <string.h>
+#include <stdint.h>
+
+#include "Mutex.hpp"
+#include "MAC.hpp"
+#include "Clock.hpp"
+#include "libzt.h"
+
+namespace ZeroTier {
+
+	/*
+	 * Limits for one tap. Peers (source MACs for frames, remote addresses for connections) are
+	 * hashed into ZT_ADMISSION_SLOTS slots, each with a token bucket and a count of the
+	 * connections admitted for it, so peers sharing a slot share its limits. The tables are
+	 * only allocated once a limit is set, frameAdmit() costs an atomic load until then.
+	 * frameAdmit() is called by whichever thread receives frames, connAdmit() by the stack
+	 * thread and connRelease() by whichever lets go of a connection
+	 */
+	class Admission
+	{
+	private:
+		struct bucket {
+			uint64_t tokens; // millionths of a frame or connection
+			uint64_t last;   // us
+		};
+
+		struct conn_slot {
+			uint32_t conns;
+			bucket rate;
+		};
+
+		struct zts_admission_limits _limits;
+		std::atomic<bool> _frames_limited;
+		std::atomic<bool> _conns_limited;
+		uint32_t _conns; // admitted on the whole tap
+
+		Mutex _frames_m;
+		std::vector<bucket> _frames;
+		Mutex _conns_m;
+		std::vector<conn_slot> _slots;
+
+		static uint32_t slotOf(const void *key, size_t len)
+		{
+			// FNV-1a
+			uint64_t h = 0xcbf29ce484222325ULL;
+			for(size_t i=0; i<len; i++) {
+				h ^= ((const unsigned char *)key)[i];
+				h *= 0x100000001b3ULL;
+			}
+			return (uint32_t)((h ^ (h >> 32)) % ZT_ADMISSION_SLOTS);
+		}
+
+		/*
+		 * Takes one from b refilled at rate/s up to burst (rate if 0), false if there's none
+		 */
+		static bool take(bucket &b, uint32_t rate, uint32_t burst, uint64_t now)
+		{
+			uint64_t cap = (uint64_t)(burst ? burst : rate) * 1000000;
+			if(!b.last || now - b.last >= cap / rate)
+				b.tokens = cap; // idle long enough to be full, also keeps the product below in range
+			else
+				b.tokens = std::min(cap, b.tokens + (now - b.last) * rate);
+			b.last = now;
+			if(b.tokens < 1000000)
+				return false;
+			b.tokens -= 1000000;
+			return true;
+		}
+
+	public:
+		Admission()
+			: _frames_limited(false),
+			_conns_limited(false),
+			_conns(0)
+		{
+			memset(&_limits, 0, sizeof(_limits));
+		}
+
+		void configure(const struct zts_admission_limits *limits)
+		{
+			{
+				Mutex::Lock _l(_frames_m);
+				_limits.peer_frame_rate = limits->peer_frame_rate;
+				_limits.peer_frame_burst = limits->peer_frame_burst;
+				if(limits->peer_frame_rate && _frames.empty())
+					_frames.resize(ZT_ADMISSION_SLOTS);
+				_frames_limited = limits->peer_frame_rate != 0;
+			}
+			Mutex::Lock _l(_conns_m);
+			_limits.peer_conns = limits->peer_conns;
+			_limits.tap_conns = limits->tap_conns;
+			_limits.peer_conn_rate = limits->peer_conn_rate;
+			_limits.peer_conn_burst = limits->peer_conn_burst;
+			// Counting goes on once started, connections admitted meanwhile are let go of later
+			if((limits->peer_conns || limits->tap_conns || limits->peer_conn_rate) && _slots.empty())
+				_slots.resize(ZT_ADMISSION_SLOTS);
+			_conns_limited = !_slots.empty();
+		}
+
+		void limits(struct zts_admission_limits *limits)
+		{
+			Mutex::Lock _fl(_frames_m);
+			Mutex::Lock _cl(_conns_m);
+			*limits = _limits;
+		}
+
+		bool framesLimited() const { return _frames_limited.load(std::memory_order_relaxed); }
+
+		/*
+		 * Whether a frame from may go on to the stack
+		 */
+		bool frameAdmit(const MAC &from)
+		{
+			if(!_frames_limited.load(std::memory_order_relaxed))
+				return true;
+			uint64_t mac = from.toInt();
+			uint32_t s = slotOf(&mac, sizeof(mac));
+			Mutex::Lock _l(_frames_m);
+			return !_limits.peer_frame_rate
+				|| take(_frames[s], _limits.peer_frame_rate, _limits.peer_frame_burst, Clock::now_us());
+		}
+
+		/*
+		 * Whether a connection from the remote address addr (len bytes) may be accepted. If so
+		 * it's counted until the returned slot (0 for none) is given to connRelease(), which -1
+		 * means it may not
+		 */
+		int connAdmit(const void *addr, size_t len)
+		{
+			if(!_conns_limited.load(std::memory_order_relaxed))
+				return 0;
+			uint32_t s = slotOf(addr, len);
+			Mutex::Lock _l(_conns_m);
+			conn_slot &slot = _slots[s];
+			if((_limits.tap_conns && _conns >= _limits.tap_conns) 
+				|| (_limits.peer_conns && slot.conns >= _limits.peer_conns))
+				return -1;
+			if(_limits.peer_conn_rate && !take(slot.rate, _limits.peer_conn_rate, _limits.peer_conn_burst, Clock::now_us()))
+				return -1;
+			slot.conns++;
+			_conns++;
+			return (int)s + 1;
+		}
+
+		void connRelease(int slot)
+		{
+			if(slot <= 0)
+				return;
+			Mutex::Lock _l(_conns_m);
+			if(_slots[slot - 1].conns)
+				_slots[slot - 1].conns--;
+			if(_conns)
+				_conns--;
+		}
+	};
+}
+
+#endif // ZT_ADMISSION_HPP
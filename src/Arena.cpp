@@ -0,0 +1,402 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "Mutex.hpp"
+
+#include "Arena.hpp"
+#include "HugePages.hpp"
+#include "MemBudget.hpp"
+#include "libzt.h"
+
+namespace ZeroTier {
+namespace Arena {
+
+	/*
+	 * Largest allocation each class serves and its share of zts_stack_config.arena_kb in
+	 * 64ths. Most of the stack's memory is held by frames and segments of about one ZeroTier
+	 * MTU (ZT_MAX_MTU, plus headers), the rest by PCBs, timers, tree nodes and the occasional
+	 * coalesced or reassembled packet (see ZT_RX_COALESCE_MAX)
+	 */
+	static const struct { uint32_t sz, share; } classes[ZT_ARENA_CLASSES] = {
+		{ 32, 2 }, { 64, 2 }, { 128, 4 }, { 256, 4 }, { 512, 4 }, { 1024, 4 }, { 2048, 6 },
+		{ 3072, 24 }, { 4096, 4 }, { 8192, 2 }, { 16384, 2 }, { 32768, 4 }, { ZT_ARENA_MAX_BLOCK, 2 }
+	};
+
+	#define ZT_ARENA_SLAB_SZ  (64 * 1024) // bytes carved at once when a class grows on demand
+	#define ZT_ARENA_CACHE_SZ (64 * 1024) // bytes of free blocks a thread keeps per class (4 to 64 blocks)
+	#define ZT_ARENA_HEAP     ZT_ARENA_CLASSES
+
+	/*
+	 * In front of every block, keeps the payload 16-byte aligned
+	 */
+	struct block_hdr
+	{
+		uint32_t cls; // ZT_ARENA_HEAP for allocations which came from malloc()
+		uint32_t _pad;
+		uint64_t len; // of those, credited to the MemBudget when they're freed
+	};
+
+	/*
+	 * Overlays the payload of a free block
+	 */
+	struct free_block
+	{
+		free_block *next;
+	};
+
+	struct depot
+	{
+		Mutex m;
+		free_block *head;
+		uint32_t nfree;
+		uint32_t reserved;
+		uint32_t capacity;
+		std::atomic<uint64_t> fails;
+		depot() : head(NULL), nfree(0), reserved(0), capacity(0), fails(0) {}
+	};
+
+	/*
+	 * Counted by one thread only, so plain loads and stores suffice
+	 */
+	struct counter
+	{
+		std::atomic<uint64_t> v;
+		counter() : v(0) {}
+		void inc() { v.store(v.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+		uint64_t get() const { return v.load(std::memory_order_relaxed); }
+	};
+
+	struct thread_cache
+	{
+		free_block *head[ZT_ARENA_CLASSES];
+		uint32_t n[ZT_ARENA_CLASSES];
+		counter allocs[ZT_ARENA_CLASSES + 1];
+		counter frees[ZT_ARENA_CLASSES + 1];
+		thread_cache() { memset(head, 0, sizeof(head)); memset(n, 0, sizeof(n)); }
+	};
+
+	/*
+	 * Never destroyed, threads may still return their caches while the process exits
+	 */
+	struct arena
+	{
+		depot depots[ZT_ARENA_CLASSES];
+		std::atomic<bool> fixed;
+		pthread_key_t key;
+		Mutex caches_m;
+		std::vector<thread_cache *> caches;
+		uint64_t retired_allocs[ZT_ARENA_CLASSES + 1]; // by threads which have exited
+		uint64_t retired_frees[ZT_ARENA_CLASSES + 1];
+		arena();
+	};
+
+	static void retire(void *p);
+
+	arena::arena() : fixed(false)
+	{
+		memset(retired_allocs, 0, sizeof(retired_allocs));
+		memset(retired_frees, 0, sizeof(retired_frees));
+		pthread_key_create(&key, retire);
+	}
+
+	static arena &get()
+	{
+		static arena *a = new arena();
+		return *a;
+	}
+
+	static thread_local thread_cache *tls_cache = NULL;
+
+	static inline size_t stride(int c) { return sizeof(struct block_hdr) + classes[c].sz; }
+	static inline uint32_t cache_max(int c) { return std::min(std::max(ZT_ARENA_CACHE_SZ / classes[c].sz, 4U), 64U); }
+
+	static inline int class_of(size_t sz)
+	{
+		for(int c=0; c<ZT_ARENA_CLASSES; c++) {
+			if(sz <= classes[c].sz)
+				return c;
+		}
+		return -1;
+	}
+
+	/*
+	 * Adds n blocks of class c to d, carved from slab or from a new one if it's NULL, which is
+	 * refused past the MemBudget's limit if hard is set. d.m must be held
+	 */
+	static bool carve(depot &d, int c, uint32_t n, unsigned char *slab = NULL, bool hard = true)
+	{
+		if(!slab) {
+			if(!MemBudget::charge(ZTS_MEM_STACK, n * stride(c), hard))
+				return false;
+			if(!(slab = (unsigned char *)malloc(n * stride(c)))) {
+				MemBudget::credit(ZTS_MEM_STACK, n * stride(c));
+				return false;
+			}
+		}
+		for(uint32_t i=0; i<n; i++) {
+			unsigned char *blk = slab + i * stride(c);
+			((struct block_hdr *)blk)->cls = (uint32_t)c;
+			free_block *b = (free_block *)(blk + sizeof(struct block_hdr));
+			b->next = d.head;
+			d.head = b;
+		}
+		d.nfree += n;
+		d.reserved += n;
+		return true;
+	}
+
+	/*
+	 * Moves n blocks (or all there are) from the front of *from to the front of *to
+	 */
+	static uint32_t splice(free_block **from, free_block **to, uint32_t n)
+	{
+		uint32_t moved = 0;
+		while(moved < n && *from) {
+			free_block *b = *from;
+			*from = b->next;
+			b->next = *to;
+			*to = b;
+			moved++;
+		}
+		return moved;
+	}
+
+	static thread_cache *cache()
+	{
+		thread_cache *tc = tls_cache;
+		if(tc)
+			return tc;
+		arena &a = get();
+		tc = new thread_cache();
+		{
+			Mutex::Lock _l(a.caches_m);
+			a.caches.push_back(tc);
+		}
+		pthread_setspecific(a.key, tc);
+		return tls_cache = tc;
+	}
+
+	static bool refill(thread_cache *tc, int c)
+	{
+		arena &a = get();
+		depot &d = a.depots[c];
+		Mutex::Lock _l(d.m);
+		if(!d.head) {
+			uint32_t n = std::max((uint32_t)(ZT_ARENA_SLAB_SZ / stride(c)), 1U);
+			if(a.fixed.load(std::memory_order_relaxed))
+				n = d.capacity > d.reserved ? std::min(n, d.capacity - d.reserved) : 0;
+			if(!n || !carve(d, c, n)) {
+				d.fails++;
+				return false;
+			}
+		}
+		uint32_t moved = splice(&d.head, &tc->head[c], std::max(cache_max(c) / 2, 1U));
+		d.nfree -= moved;
+		tc->n[c] += moved;
+		return true;
+	}
+
+	static void flush(thread_cache *tc, int c, uint32_t n)
+	{
+		depot &d = get().depots[c];
+		Mutex::Lock _l(d.m);
+		uint32_t moved = splice(&tc->head[c], &d.head, n);
+		d.nfree += moved;
+		tc->n[c] -= moved;
+	}
+
+	/*
+	 * pthread key destructor, gives an exiting thread's blocks back to the depots
+	 */
+	static void retire(void *p)
+	{
+		thread_cache *tc = (thread_cache *)p;
+		arena &a = get();
+		for(int c=0; c<ZT_ARENA_CLASSES; c++)
+			flush(tc, c, tc->n[c]);
+		{
+			Mutex::Lock _l(a.caches_m);
+			for(int c=0; c<=ZT_ARENA_CLASSES; c++) {
+				a.retired_allocs[c] += tc->allocs[c].get();
+				a.retired_frees[c] += tc->frees[c].get();
+			}
+			a.caches.erase(std::remove(a.caches.begin(), a.caches.end(), tc), a.caches.end());
+		}
+		delete tc;
+		tls_cache = NULL;
+	}
+
+	static void *alloc(size_t sz, bool zero)
+	{
+		thread_cache *tc = cache();
+		int c = class_of(sz);
+		if(c < 0) {
+			size_t len = sizeof(struct block_hdr) + sz;
+			if(!MemBudget::charge(ZTS_MEM_STACK, len))
+				return NULL;
+			unsigned char *blk = (unsigned char *)(zero ? calloc(1, len) : malloc(len));
+			if(!blk) {
+				MemBudget::credit(ZTS_MEM_STACK, len);
+				return NULL;
+			}
+			((struct block_hdr *)blk)->cls = ZT_ARENA_HEAP;
+			((struct block_hdr *)blk)->len = len;
+			tc->allocs[ZT_ARENA_HEAP].inc();
+			return blk + sizeof(struct block_hdr);
+		}
+		if(!tc->head[c] && !refill(tc, c))
+			return NULL;
+		free_block *b = tc->head[c];
+		tc->head[c] = b->next;
+		tc->n[c]--;
+		tc->allocs[c].inc();
+		if(zero)
+			memset(b, 0, sz);
+		return b;
+	}
+
+	static void release(void *p)
+	{
+		if(!p)
+			return;
+		thread_cache *tc = cache();
+		struct block_hdr *h = (struct block_hdr *)p - 1;
+		uint32_t c = h->cls;
+		tc->frees[c].inc();
+		if(c == ZT_ARENA_HEAP) {
+			MemBudget::credit(ZTS_MEM_STACK, h->len);
+			free(h);
+			return;
+		}
+		free_block *b = (free_block *)p;
+		b->next = tc->head[c];
+		tc->head[c] = b;
+		if(++tc->n[c] > cache_max(c))
+			flush(tc, c, tc->n[c] / 2);
+	}
+
+	void reserve(size_t kb, bool fixed, int hugepages, bool prefault)
+	{
+		arena &a = get();
+		uint32_t targets[ZT_ARENA_CLASSES];
+		size_t missing[ZT_ARENA_CLASSES], total = 0;
+		for(int c=0; c<ZT_ARENA_CLASSES && kb; c++) {
+			depot &d = a.depots[c];
+			targets[c] = (uint32_t)std::max(kb * 1024 * classes[c].share / 64 / stride(c), (size_t)1);
+			Mutex::Lock _l(d.m);
+			missing[c] = d.reserved < targets[c] ? targets[c] - d.reserved : 0;
+			total += missing[c] * stride(c);
+		}
+		// One region for the whole reservation, like the slabs it's never handed back
+		struct huge_region r;
+		unsigned char *region = total ? (unsigned char *)huge_alloc(&r, total, hugepages, prefault) : NULL;
+		if(region)
+			MemBudget::charge(ZTS_MEM_STACK, total, false);
+		for(int c=0; c<ZT_ARENA_CLASSES && kb; c++) {
+			depot &d = a.depots[c];
+			Mutex::Lock _l(d.m);
+			if(missing[c] && region) {
+				carve(d, c, (uint32_t)missing[c], region);
+				region += missing[c] * stride(c);
+			}
+			else if(d.reserved < targets[c])
+				carve(d, c, targets[c] - d.reserved, NULL, false);
+			d.capacity = std::max(d.reserved, targets[c]);
+		}
+		a.fixed = fixed && kb;
+	}
+
+	int stats(struct zts_arena_stats *stats, int n)
+	{
+		arena &a = get();
+		uint64_t allocs[ZT_ARENA_CLASSES + 1], frees[ZT_ARENA_CLASSES + 1];
+		{
+			Mutex::Lock _l(a.caches_m);
+			memcpy(allocs, a.retired_allocs, sizeof(allocs));
+			memcpy(frees, a.retired_frees, sizeof(frees));
+			for(size_t i=0; i<a.caches.size(); i++) {
+				for(int c=0; c<=ZT_ARENA_CLASSES; c++) {
+					allocs[c] += a.caches[i]->allocs[c].get();
+					frees[c] += a.caches[i]->frees[c].get();
+				}
+			}
+		}
+		for(int c=0; c<=ZT_ARENA_CLASSES && c<n; c++) {
+			struct zts_arena_stats &s = stats[c];
+			memset(&s, 0, sizeof(s));
+			if(c < ZT_ARENA_CLASSES) {
+				depot &d = a.depots[c];
+				Mutex::Lock _l(d.m);
+				s.block_sz = classes[c].sz;
+				s.capacity = d.capacity;
+				s.reserved = d.reserved;
+				s.fails = d.fails;
+			}
+			// counted on different threads, a free may be seen before its alloc
+			s.in_use = allocs[c] > frees[c] ? (uint32_t)(allocs[c] - frees[c]) : 0;
+			s.allocs = allocs[c];
+		}
+		return ZT_ARENA_CLASSES + 1;
+	}
+
+} // namespace Arena
+} // namespace ZeroTier
+
+extern "C" {
+
+void *zt_arena_malloc(size_t sz)
+{
+	return ZeroTier::Arena::alloc(sz, false);
+}
+
+void *zt_arena_zalloc(size_t sz)
+{
+	return ZeroTier::Arena::alloc(sz, true);
+}
+
+void *zt_arena_calloc(size_t n, size_t sz)
+{
+	if(sz && n > SIZE_MAX / sz)
+		return NULL;
+	return ZeroTier::Arena::alloc(n * sz, true);
+}
+
+void zt_arena_free(void *p)
+{
+	ZeroTier::Arena::release(p);
+}
+
+}
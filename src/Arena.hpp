@@ -0,0 +1,63 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// Size-class arena for the network stacks' own allocations (picoTCP's PICO_ZALLOC, lwIP's
+// mem_malloc() and, through MEMP_MEM_MALLOC, its memp pools)
+//
+// Each thread keeps a short free list per class and only takes a class's lock to exchange a
+// batch of blocks with that class's depot, so the stack doesn't contend with the app for the
+// process heap. Blocks are carved from slabs which are never handed back. zts_start() can
+// preallocate the depots (zts_stack_config.arena_kb) and cap them (arena_fixed)
+
+#ifndef ZT_ARENA_HPP
+#define ZT_ARENA_HPP
+
+#include <stddef.h>
+
+struct zts_arena_stats;
+
+namespace ZeroTier {
+namespace Arena {
+
+	/*
+	 * Preallocates kb KiB split across the classes (see classes in Arena.cpp), with fixed
+	 * set no class grows past its share again and allocations from an exhausted class fail.
+	 * The reservation is a single region backed according to hugepages (a ZTS_HUGEPAGES_*
+	 * value) and faulted in up front with prefault set
+	 */
+	void reserve(size_t kb, bool fixed, int hugepages, bool prefault);
+
+	/*
+	 * Fills in up to n entries, one per class followed by the one for allocations larger than
+	 * ZT_ARENA_MAX_BLOCK (which go to the heap), returns how many there are
+	 */
+	int stats(struct zts_arena_stats *stats, int n);
+
+} // namespace Arena
+} // namespace ZeroTier
+
+#endif // ZT_ARENA_HPP
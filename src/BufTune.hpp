@@ -0,0 +1,96 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+// Receive/send buffer autotuning of TCP Connections, see ZT_BUF_TUNE_INTERVAL_MS
+
+#ifndef ZT_BUFTUNE_HPP
+#define ZT_BUFTUNE_HPP
+
+#include <algorithm>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "libzt.h"
+
+namespace ZeroTier {
+
+	/*
+	 * Sizes one of a Connection's buffers the way Linux tunes a socket's: the cap becomes twice
+	 * what went through the buffer in a round trip. A buffer that's too small caps that at its
+	 * size, so a saturated one doubles every sample until it no longer holds the flow back.
+	 * Stack thread only
+	 */
+	class BufTune
+	{
+	private:
+		uint64_t _mark;   // bytes through the buffer at the last sample
+		uint64_t _ts;     // ms, of the last sample
+		uint64_t _active; // ms, when bytes last went through
+
+	public:
+		bool enabled;     // cleared by SO_SNDBUF/SO_RCVBUF
+
+		BufTune() { reset(); }
+
+		void reset()
+		{
+			_mark = _ts = _active = 0;
+			enabled = true;
+		}
+
+		/*
+		 * The cap a buffer of cur bytes which has had total bytes through it by now should get,
+		 * rtt_ms being the connection's smoothed round trip. Starts out at lo, stays within [lo, hi],
+		 * doesn't grow unless grow is set and falls back to lo once idle. Returns cur to leave it be
+		 */
+		size_t sample(uint64_t total, uint64_t now, uint32_t rtt_ms, size_t cur, size_t lo, size_t hi, bool grow)
+		{
+			if(!_ts) {
+				_ts = _active = now;
+				_mark = total;
+				return std::min(cur, lo);
+			}
+			uint64_t dt = now - _ts, moved = total - _mark;
+			if(dt < ZT_BUF_TUNE_INTERVAL_MS)
+				return cur;
+			_ts = now;
+			_mark = total;
+			if(!moved) {
+				if(now - _active >= (uint64_t)ZT_BUF_TUNE_IDLE_S * 1000)
+					return lo;
+				return cur;
+			}
+			_active = now;
+			uint64_t rtt = std::max(rtt_ms, (uint32_t)ZT_BUF_TUNE_MIN_RTT_MS);
+			uint64_t want = 2 * moved * rtt / dt;
+			if(!grow || want <= cur)
+				return cur;
+			return std::min(std::max((size_t)want, lo), hi);
+		}
+	};
+}
+
+#endif // ZT_BUFTUNE_HPP
@@ -0,0 +1,618 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Capture.hpp"
+#include "libzt.h"
+
+// Enough of a frame to find the addresses and ports (VLAN tag and IPv4 options included)
+#define ZT_CAPTURE_PEEK_SZ 96
+
+namespace ZeroTier {
+namespace Capture {
+
+	std::atomic<bool> active(false);
+
+	/*
+	 * Record layout in a ring, followed by caplen bytes of the frame and padded to 8 bytes so
+	 * a header never straddles the end
+	 */
+	struct record_hdr
+	{
+		uint32_t caplen;
+		uint32_t len;
+		uint64_t ts;   // ns since the epoch
+		uint64_t nwid;
+		uint32_t gen;  // capture it was taken for, leftovers of an earlier one are skipped
+		uint32_t dir;
+	};
+
+	/*
+	 * Single producer (the owning thread), single consumer (the writer)
+	 */
+	struct ring
+	{
+		unsigned char buf[ZT_CAPTURE_RING_SZ];
+		std::atomic<uint64_t> head;
+		std::atomic<uint64_t> tail;
+		std::atomic<bool> orphaned; // owning thread has exited, delete once drained
+	};
+
+	enum term_type
+	{
+		TERM_ETHERTYPE,
+		TERM_IPPROTO,
+		TERM_HOST,
+		TERM_PORT,
+		TERM_DIR,
+		TERM_NWID
+	};
+
+	enum term_side
+	{
+		SIDE_EITHER,
+		SIDE_SRC,
+		SIDE_DST
+	};
+
+	struct term
+	{
+		int type;
+		int side;
+		bool negate;
+		uint64_t value;
+		int family;
+		unsigned char addr[16];
+	};
+
+	/*
+	 * Alternatives (or) of terms which must all match (and), an empty filter matches everything
+	 */
+	struct filter
+	{
+		std::vector<std::vector<struct term> > any;
+	};
+
+	/*
+	 * What a filter looks at, taken from the first ZT_CAPTURE_PEEK_SZ bytes of a frame
+	 */
+	struct headers
+	{
+		unsigned int ethertype;
+		int ipproto;
+		int family;
+		const unsigned char *src;
+		const unsigned char *dst;
+		int sport;
+		int dport;
+	};
+
+	static std::mutex rings_m;
+	static std::vector<struct ring*> rings;
+
+	struct ring_ref
+	{
+		struct ring *r;
+		ring_ref() : r(NULL) {}
+		~ring_ref()
+		{
+			if(r)
+				r->orphaned = true;
+		}
+	};
+	static thread_local struct ring_ref local_ring;
+
+	static std::mutex capture_m; // start() and stop()
+	static std::atomic<const struct filter*> cur_filter(NULL);
+	static const struct filter *old_filter = NULL;
+	static std::atomic<uint32_t> cur_gen(0);
+	static std::atomic<uint32_t> cur_snaplen(ZT_CAPTURE_DEFAULT_SNAPLEN);
+	static std::atomic<bool> run(false);
+	static std::thread writer;
+	static FILE *out = NULL;
+
+	static std::atomic<uint64_t> packets(0);
+	static std::atomic<uint64_t> bytes(0);
+	static std::atomic<uint64_t> drops(0);
+
+	static struct ring *get_ring()
+	{
+		if(local_ring.r)
+			return local_ring.r;
+		struct ring *r = new struct ring;
+		r->head = 0;
+		r->tail = 0;
+		r->orphaned = false;
+		std::lock_guard<std::mutex> _l(rings_m);
+		rings.push_back(r);
+		local_ring.r = r;
+		return r;
+	}
+
+	static void ring_copy_in(struct ring *r, uint64_t pos, const void *src, size_t len)
+	{
+		size_t off = pos & (ZT_CAPTURE_RING_SZ - 1);
+		size_t first = len < ZT_CAPTURE_RING_SZ - off ? len : ZT_CAPTURE_RING_SZ - off;
+		memcpy(r->buf + off, src, first);
+		memcpy(r->buf, (const unsigned char *)src + first, len - first);
+	}
+
+	static void ring_copy_out(struct ring *r, uint64_t pos, void *dst, size_t len)
+	{
+		size_t off = pos & (ZT_CAPTURE_RING_SZ - 1);
+		size_t first = len < ZT_CAPTURE_RING_SZ - off ? len : ZT_CAPTURE_RING_SZ - off;
+		memcpy(dst, r->buf + off, first);
+		memcpy((unsigned char *)dst + first, r->buf, len - first);
+	}
+
+	/*
+	 * Copies the first (up to) max bytes of iov into buf
+	 */
+	static size_t gather(const struct iovec *iov, int iovcnt, unsigned char *buf, size_t max)
+	{
+		size_t n = 0;
+		for(int i=0; i<iovcnt && n < max; i++) {
+			size_t c = iov[i].iov_len < max - n ? iov[i].iov_len : max - n;
+			memcpy(buf + n, iov[i].iov_base, c);
+			n += c;
+		}
+		return n;
+	}
+
+	static void parse_headers(const unsigned char *b, size_t n, struct headers *h)
+	{
+		memset(h, 0, sizeof(*h));
+		h->ipproto = h->sport = h->dport = -1;
+		if(n < 14)
+			return;
+		size_t l3 = 14;
+		h->ethertype = (b[12] << 8) | b[13];
+		if(h->ethertype == 0x8100 && n >= 18) {
+			h->ethertype = (b[16] << 8) | b[17];
+			l3 = 18;
+		}
+		size_t l4;
+		if(h->ethertype == 0x0800 && n >= l3 + 20) {
+			h->family = AF_INET;
+			h->ipproto = b[l3 + 9];
+			h->src = b + l3 + 12;
+			h->dst = b + l3 + 16;
+			// Only the first fragment has the ports
+			if(((b[l3 + 6] & 0x1f) << 8 | b[l3 + 7]) != 0)
+				return;
+			l4 = l3 + (b[l3] & 0x0f) * 4;
+		}
+		else if(h->ethertype == 0x86dd && n >= l3 + 40) {
+			h->family = AF_INET6;
+			h->ipproto = b[l3 + 6];
+			h->src = b + l3 + 8;
+			h->dst = b + l3 + 24;
+			l4 = l3 + 40;
+		}
+		else
+			return;
+		if((h->ipproto == IPPROTO_TCP || h->ipproto == IPPROTO_UDP) && n >= l4 + 4) {
+			h->sport = (b[l4] << 8) | b[l4 + 1];
+			h->dport = (b[l4 + 2] << 8) | b[l4 + 3];
+		}
+	}
+
+	static bool term_matches(const struct term &t, uint64_t nwid, int dir, const struct headers &h)
+	{
+		switch(t.type) {
+			case TERM_ETHERTYPE:
+				return h.ethertype == t.value;
+			case TERM_IPPROTO:
+				return h.ipproto == (int)t.value;
+			case TERM_DIR:
+				return dir == (int)t.value;
+			case TERM_NWID:
+				return nwid == t.value;
+			case TERM_HOST: {
+				if(h.family != t.family)
+					return false;
+				size_t alen = t.family == AF_INET ? 4 : 16;
+				return (t.side != SIDE_DST && !memcmp(h.src, t.addr, alen))
+					|| (t.side != SIDE_SRC && !memcmp(h.dst, t.addr, alen));
+			}
+			case TERM_PORT:
+				return (t.side != SIDE_DST && h.sport == (int)t.value)
+					|| (t.side != SIDE_SRC && h.dport == (int)t.value);
+		}
+		return false;
+	}
+
+	static bool matches(const struct filter *f, uint64_t nwid, int dir, const struct headers &h)
+	{
+		if(f->any.empty())
+			return true;
+		for(size_t i=0; i<f->any.size(); i++) {
+			size_t j = 0;
+			for(; j<f->any[i].size(); j++) {
+				const struct term &t = f->any[i][j];
+				if(term_matches(t, nwid, dir, h) == t.negate)
+					break;
+			}
+			if(j == f->any[i].size())
+				return true;
+		}
+		return false;
+	}
+
+	/*
+	 * A subset of pcap-filter(7): primitives joined by and/or (and binds tighter), each of them
+	 * optionally negated with not. Returns false if expr doesn't parse
+	 */
+	static bool compile(const char *expr, struct filter *f)
+	{
+		std::vector<std::string> tok;
+		std::istringstream in(expr ? expr : "");
+		std::string s;
+		while(in >> s)
+			tok.push_back(s);
+		if(tok.empty())
+			return true;
+		f->any.resize(1);
+		size_t i = 0;
+		while(i < tok.size()) {
+			struct term t;
+			memset(&t, 0, sizeof(t));
+			if(tok[i] == "not" || tok[i] == "!") {
+				t.negate = true;
+				i++;
+			}
+			if(i < tok.size() && (tok[i] == "src" || tok[i] == "dst")) {
+				t.side = tok[i] == "src" ? SIDE_SRC : SIDE_DST;
+				i++;
+			}
+			if(i >= tok.size())
+				return false;
+			const std::string &p = tok[i++];
+			bool arg = p == "host" || p == "port" || p == "nwid";
+			if((t.side != SIDE_EITHER && p != "host" && p != "port") || (arg && i >= tok.size()))
+				return false;
+			if(p == "ip" || p == "ip6" || p == "arp") {
+				t.type = TERM_ETHERTYPE;
+				t.value = p == "ip" ? 0x0800 : p == "ip6" ? 0x86dd : 0x0806;
+			}
+			else if(p == "tcp" || p == "udp" || p == "icmp" || p == "icmp6") {
+				t.type = TERM_IPPROTO;
+				// glibc declares IPPROTO_ICMPV6 in an enum of its own
+				t.value = p == "tcp" ? (int)IPPROTO_TCP : p == "udp" ? (int)IPPROTO_UDP
+					: p == "icmp" ? (int)IPPROTO_ICMP : (int)IPPROTO_ICMPV6;
+			}
+			else if(p == "inbound" || p == "outbound") {
+				t.type = TERM_DIR;
+				t.value = p == "inbound" ? ZT_CAPTURE_IN : ZT_CAPTURE_OUT;
+			}
+			else if(p == "host") {
+				t.type = TERM_HOST;
+				const char *a = tok[i++].c_str();
+				if(inet_pton(AF_INET, a, t.addr) == 1)
+					t.family = AF_INET;
+				else if(inet_pton(AF_INET6, a, t.addr) == 1)
+					t.family = AF_INET6;
+				else
+					return false;
+			}
+			else if(p == "port" || p == "nwid") {
+				t.type = p == "port" ? TERM_PORT : TERM_NWID;
+				char *end;
+				t.value = strtoull(tok[i].c_str(), &end, p == "port" ? 10 : 16);
+				if(*end || end == tok[i].c_str() || (t.type == TERM_PORT && t.value > 65535))
+					return false;
+				i++;
+			}
+			else
+				return false;
+			f->any.back().push_back(t);
+			if(i == tok.size())
+				break;
+			if(tok[i] == "or" || tok[i] == "||")
+				f->any.resize(f->any.size() + 1);
+			else if(tok[i] != "and" && tok[i] != "&&")
+				return false;
+			if(++i == tok.size())
+				return false;
+		}
+		return true;
+	}
+
+	void frame(uint64_t nwid, int dir, const struct iovec *iov, int iovcnt)
+	{
+		const struct filter *f = cur_filter.load(std::memory_order_acquire);
+		if(!f)
+			return;
+		unsigned char peek[ZT_CAPTURE_PEEK_SZ];
+		struct headers h;
+		parse_headers(peek, gather(iov, iovcnt, peek, sizeof(peek)), &h);
+		if(!matches(f, nwid, dir, h))
+			return;
+
+		struct record_hdr rec;
+		size_t len = 0;
+		for(int i=0; i<iovcnt; i++)
+			len += iov[i].iov_len;
+		uint32_t snaplen = cur_snaplen.load(std::memory_order_relaxed);
+		rec.len = (uint32_t)len;
+		rec.caplen = len < snaplen ? (uint32_t)len : snaplen;
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		rec.ts = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+		rec.nwid = nwid;
+		rec.gen = cur_gen.load(std::memory_order_relaxed);
+		rec.dir = dir;
+
+		struct ring *r = get_ring();
+		uint64_t sz = (sizeof(rec) + rec.caplen + 7) & ~(uint64_t)7;
+		uint64_t head = r->head.load(std::memory_order_relaxed);
+		if(sz > ZT_CAPTURE_RING_SZ - (head - r->tail.load(std::memory_order_acquire))) {
+			drops++;
+			return;
+		}
+		ring_copy_in(r, head, &rec, sizeof(rec));
+		uint64_t pos = head + sizeof(rec);
+		size_t left = rec.caplen;
+		for(int i=0; i<iovcnt && left; i++) {
+			size_t c = iov[i].iov_len < left ? iov[i].iov_len : left;
+			ring_copy_in(r, pos, iov[i].iov_base, c);
+			pos += c;
+			left -= c;
+		}
+		r->head.store(head + sz, std::memory_order_release);
+	}
+
+	/*
+	 * pcapng (draft-ietf-opsawg-pcapng) in host byte order, readers go by the section's
+	 * byte-order magic
+	 */
+	static void put16(std::string &o, uint16_t v) { o.append((const char *)&v, 2); }
+	static void put32(std::string &o, uint32_t v) { o.append((const char *)&v, 4); }
+
+	static void pad4(std::string &o)
+	{
+		while(o.size() % 4)
+			o += '\0';
+	}
+
+	static void put_option(std::string &o, uint16_t code, const void *data, uint16_t len)
+	{
+		put16(o, code);
+		put16(o, len);
+		o.append((const char *)data, len);
+		pad4(o);
+	}
+
+	static size_t begin_block(std::string &o, uint32_t type)
+	{
+		size_t start = o.size();
+		put32(o, type);
+		put32(o, 0); // total length, see end_block()
+		return start;
+	}
+
+	static void end_block(std::string &o, size_t start)
+	{
+		put_option(o, 0, NULL, 0); // opt_endofopt
+		uint32_t total = (uint32_t)(o.size() - start + 4);
+		put32(o, total);
+		memcpy(&o[start + 4], &total, 4);
+	}
+
+	static void put_section_header(std::string &o)
+	{
+		size_t b = begin_block(o, 0x0a0d0d0a);
+		put32(o, 0x1a2b3c4d);
+		put16(o, 1);
+		put16(o, 0);
+		put32(o, 0xffffffff); // section length unknown
+		put32(o, 0xffffffff);
+		put_option(o, 4, "libzt", 5); // shb_userappl
+		end_block(o, b);
+	}
+
+	static void put_interface(std::string &o, uint64_t nwid, uint32_t snaplen)
+	{
+		size_t b = begin_block(o, 1);
+		put16(o, 1); // LINKTYPE_ETHERNET
+		put16(o, 0);
+		put32(o, snaplen);
+		char name[32];
+		snprintf(name, sizeof(name), "%016llx", (unsigned long long)nwid);
+		put_option(o, 2, name, (uint16_t)strlen(name)); // if_name
+		unsigned char tsresol = 9; // ns
+		put_option(o, 9, &tsresol, 1);
+		end_block(o, b);
+	}
+
+	static void put_packet(std::string &o, uint32_t ifid, const struct record_hdr &rec, const unsigned char *data)
+	{
+		size_t b = begin_block(o, 6);
+		put32(o, ifid);
+		put32(o, (uint32_t)(rec.ts >> 32));
+		put32(o, (uint32_t)rec.ts);
+		put32(o, rec.caplen);
+		put32(o, rec.len);
+		o.append((const char *)data, rec.caplen);
+		pad4(o);
+		uint32_t flags = rec.dir == ZT_CAPTURE_IN ? 1 : 2; // epb_flags: inbound, outbound
+		put_option(o, 2, &flags, 4);
+		end_block(o, b);
+	}
+
+	/*
+	 * Writes out every complete record queued so far, returns whether there were any
+	 */
+	static bool drain(FILE *fp, uint32_t gen, uint32_t snaplen, std::map<uint64_t, uint32_t> &ifaces)
+	{
+		std::vector<struct ring*> snapshot;
+		{
+			std::lock_guard<std::mutex> _l(rings_m);
+			snapshot = rings;
+		}
+		std::string o;
+		std::vector<unsigned char> data;
+		for(size_t i=0; i<snapshot.size(); i++) {
+			struct ring *r = snapshot[i];
+			bool orphaned = r->orphaned; // read first, anything written before exit is visible
+			uint64_t tail = r->tail.load(std::memory_order_relaxed);
+			uint64_t head = r->head.load(std::memory_order_acquire);
+			while(tail != head) {
+				struct record_hdr rec;
+				ring_copy_out(r, tail, &rec, sizeof(rec));
+				if(rec.gen == gen) {
+					data.resize(rec.caplen);
+					ring_copy_out(r, tail + sizeof(rec), data.data(), rec.caplen);
+					std::map<uint64_t, uint32_t>::iterator it = ifaces.find(rec.nwid);
+					if(it == ifaces.end()) {
+						uint32_t id = (uint32_t)ifaces.size();
+						it = ifaces.insert(std::make_pair(rec.nwid, id)).first;
+						put_interface(o, rec.nwid, snaplen);
+					}
+					put_packet(o, it->second, rec, data.data());
+					packets++;
+					bytes += rec.caplen;
+				}
+				tail += (sizeof(rec) + rec.caplen + 7) & ~(uint64_t)7;
+			}
+			r->tail.store(tail, std::memory_order_release);
+			if(orphaned) {
+				std::lock_guard<std::mutex> _l(rings_m);
+				for(size_t j=0; j<rings.size(); j++) {
+					if(rings[j] == r) {
+						rings.erase(rings.begin() + j);
+						break;
+					}
+				}
+				delete r;
+			}
+		}
+		if(o.size()) {
+			fwrite(o.data(), 1, o.size(), fp);
+			fflush(fp);
+		}
+		return o.size() > 0;
+	}
+
+	static void writer_main(FILE *fp, uint32_t gen, uint32_t snaplen)
+	{
+		std::map<uint64_t, uint32_t> ifaces;
+		for(;;) {
+			// One last pass after stop(), for whatever was queued before it
+			bool last = !run.load(std::memory_order_acquire);
+			bool busy = drain(fp, gen, snaplen, ifaces);
+			if(last)
+				break;
+			if(!busy)
+				std::this_thread::sleep_for(std::chrono::milliseconds(ZT_CAPTURE_FLUSH_INTERVAL));
+		}
+	}
+
+	int start(const char *path, unsigned int snaplen, const char *expr)
+	{
+		if(!path) {
+			errno = EINVAL;
+			return -1;
+		}
+		struct filter *f = new struct filter;
+		if(!compile(expr, f)) {
+			delete f;
+			errno = EINVAL;
+			return -1;
+		}
+		std::lock_guard<std::mutex> _l(capture_m);
+		if(run) {
+			delete f;
+			errno = EALREADY;
+			return -1;
+		}
+		FILE *fp = fopen(path, "wb");
+		if(!fp) {
+			delete f;
+			return -1;
+		}
+		std::string o;
+		put_section_header(o);
+		fwrite(o.data(), 1, o.size(), fp);
+		// The previous capture's filter may still have been in use by a thread which loaded
+		// it just before stop(), by now it has long finished with it
+		delete old_filter;
+		old_filter = f;
+		uint32_t gen = cur_gen.load() + 1;
+		snaplen = snaplen ? snaplen : ZT_CAPTURE_DEFAULT_SNAPLEN;
+		packets = 0;
+		bytes = 0;
+		drops = 0;
+		cur_gen = gen;
+		cur_snaplen = snaplen;
+		out = fp;
+		run = true;
+		writer = std::thread(writer_main, fp, gen, snaplen);
+		cur_filter.store(f, std::memory_order_release);
+		active = true;
+		return 0;
+	}
+
+	int stop()
+	{
+		std::lock_guard<std::mutex> _l(capture_m);
+		if(!run) {
+			errno = EALREADY;
+			return -1;
+		}
+		active = false;
+		cur_filter = NULL;
+		run.store(false, std::memory_order_release);
+		writer.join();
+		fclose(out);
+		out = NULL;
+		return 0;
+	}
+
+	void getStats(struct zts_capture_stats *stats)
+	{
+		stats->running = run ? 1 : 0;
+		stats->packets = packets;
+		stats->bytes = bytes;
+		stats->drops = drops;
+	}
+}
+}
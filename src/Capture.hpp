@@ -0,0 +1,106 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// Packet capture of what crosses the taps, written out as pcapng (see zts_capture_start())
+//
+// Frames are filtered and copied into a ring owned by the thread which saw them, a background
+// thread writes them to the file. While no capture is running every hook is a single relaxed
+// load of Capture::active
+
+#ifndef ZT_CAPTURE_HPP
+#define ZT_CAPTURE_HPP
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include <atomic>
+
+#include "MAC.hpp"
+
+#define ZT_CAPTURE_RING_SZ          (1 << 20) // bytes per capturing thread, must be a power of two
+#define ZT_CAPTURE_FLUSH_INTERVAL   10        // ms the writer sleeps once the rings are empty
+#define ZT_CAPTURE_DEFAULT_SNAPLEN  65535
+#define ZT_CAPTURE_MAX_FILTER_TERMS 16
+
+#define ZT_CAPTURE_IN               1
+#define ZT_CAPTURE_OUT              2
+
+struct zts_capture_stats;
+
+namespace ZeroTier {
+namespace Capture {
+
+	extern std::atomic<bool> active;
+
+	/*
+	 * Starts writing what passes filter (see zts_capture_start() for the syntax) to path,
+	 * truncating it. Returns 0 or -1 with errno set
+	 */
+	int start(const char *path, unsigned int snaplen, const char *filter);
+
+	/*
+	 * Writes out whatever is still queued and closes the file
+	 */
+	int stop();
+
+	void getStats(struct zts_capture_stats *stats);
+
+	/*
+	 * Captures one ethernet frame, given as iovcnt regions. Only call while active
+	 */
+	void frame(uint64_t nwid, int dir, const struct iovec *iov, int iovcnt);
+
+	inline void frame(uint64_t nwid, int dir, const void *frame, unsigned int len)
+	{
+		struct iovec iov;
+		iov.iov_base = (void*)frame;
+		iov.iov_len = len;
+		Capture::frame(nwid, dir, &iov, 1);
+	}
+
+	/*
+	 * For frames which are handed around without their ethernet header
+	 */
+	inline void frame(uint64_t nwid, int dir, const MAC &from, const MAC &to, unsigned int etherType,
+		const void *data, unsigned int len)
+	{
+		unsigned char eh[14];
+		to.copyTo(eh, 6);
+		from.copyTo(eh + 6, 6);
+		eh[12] = (unsigned char)(etherType >> 8);
+		eh[13] = (unsigned char)etherType;
+		struct iovec iov[2];
+		iov[0].iov_base = eh;
+		iov[0].iov_len = sizeof(eh);
+		iov[1].iov_base = (void*)data;
+		iov[1].iov_len = len;
+		Capture::frame(nwid, dir, iov, 2);
+	}
+}
+}
+
+#endif // ZT_CAPTURE_HPP
@@ -0,0 +1,134 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// The monotonic time libzt's timers run on, see zts_sim_config.time_scale
+
+#ifndef ZT_CLOCK_HPP
+#define ZT_CLOCK_HPP
+
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+
+namespace ZeroTier {
+
+	/*
+	 * Monotonic microseconds which stack threads, the drivers' timers and the simulated wire all
+	 * share. Normally the steady clock, while a simulation runs with a time scale it runs that
+	 * much faster than real time, and whatever sleeps until a point in it (see sleepMs()) sleeps
+	 * that much less. Stack threads tick() once a pass, cached() hands out the last tick without
+	 * reading the clock again
+	 */
+	class Clock
+	{
+	private:
+		struct source {
+			std::atomic<uint64_t> real_base; // us
+			std::atomic<uint64_t> base;
+			std::atomic<unsigned int> scale;
+			std::atomic<uint64_t> last;      // ms, latest tick() of any thread
+		};
+
+		static source &src()
+		{
+			static source s = { {0}, {0}, {1}, {0} };
+			return s;
+		}
+
+		static uint64_t real_us()
+		{
+			return std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+
+	public:
+		static uint64_t now_us()
+		{
+			source &s = src();
+			unsigned int scale = s.scale.load(std::memory_order_acquire);
+			uint64_t real = real_us();
+			if(scale <= 1 && !s.base.load(std::memory_order_relaxed))
+				return real;
+			return s.base.load(std::memory_order_relaxed)
+				+ (real - s.real_base.load(std::memory_order_relaxed)) * scale;
+		}
+
+		// ms
+		static uint64_t now() { return now_us() / 1000; }
+
+		/*
+		 * Reads the clock for a stack thread's pass, returns it in ms
+		 */
+		static uint64_t tick()
+		{
+			uint64_t t = now();
+			std::atomic<uint64_t> &last = src().last;
+			uint64_t prev = last.load(std::memory_order_relaxed);
+			while(prev < t && !last.compare_exchange_weak(prev, t, std::memory_order_relaxed)) { }
+			return t;
+		}
+
+		/*
+		 * ms as of the latest tick(), for code which runs on a stack thread during its pass
+		 */
+		static uint64_t cached()
+		{
+			uint64_t t = src().last.load(std::memory_order_relaxed);
+			return t ? t : tick();
+		}
+
+		/*
+		 * 0 or 1 is real time. Time carries on from where it is, it never goes back. Set while
+		 * nothing sleeps on the clock, timers armed before only notice the change when they're due
+		 */
+		static void setScale(unsigned int scale)
+		{
+			source &s = src();
+			uint64_t t = now_us(), real = real_us();
+			s.real_base.store(real, std::memory_order_relaxed);
+			s.base.store(t, std::memory_order_relaxed);
+			s.scale.store(scale ? scale : 1, std::memory_order_release);
+		}
+
+		static unsigned int scale() { return src().scale.load(std::memory_order_relaxed); }
+
+		// Real ms or us to sleep for a timeout on this clock, rounded up
+		static unsigned long sleepMs(unsigned long ms)
+		{
+			unsigned int k = scale();
+			return k <= 1 ? ms : (ms + k - 1) / k;
+		}
+
+		static uint64_t sleepUs(uint64_t us)
+		{
+			unsigned int k = scale();
+			return k <= 1 ? us : (us + k - 1) / k;
+		}
+	};
+}
+
+#endif
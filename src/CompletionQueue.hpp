@@ -0,0 +1,138 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+// Completion-based socket I/O on top of stack readiness notification (see zts_cq_create())
+
+#ifndef ZT_COMPLETIONQUEUE_HPP
+#define ZT_COMPLETIONQUEUE_HPP
+
+#include <map>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "libzt.h"
+#include "Connection.hpp"
+#include "Epoll.hpp"
+
+namespace ZeroTier {
+
+	/*
+	 * Operations which can't complete right away wait here until the stack reports activity on
+	 * their socket through a private Epoll (edge-triggered, since a failed attempt only becomes
+	 * worth retrying once something changes). The Epoll's descriptor doubles as the queue's, it
+	 * is kicked whenever completions are waiting to be reaped
+	 */
+	class CompletionQueue
+	{
+	public:
+		struct op
+		{
+			struct zts_sqe sqe;
+			struct sockaddr_storage addr; // copy of sqe.addr (ZTS_OP_CONNECT)
+			Connection *conn;             // the socket sqe.fd referred to at submission
+		};
+
+		/*
+		 * Reads and accepts are kept apart from writes and connects so that a read waiting on
+		 * the peer never holds up a write on the same socket
+		 */
+		struct fd_ops
+		{
+			std::deque<op> q[2];
+			Connection *conn;
+		};
+
+		static int direction(int opcode)
+		{
+			return (opcode == ZTS_OP_READ || opcode == ZTS_OP_ACCEPT) ? 0 : 1;
+		}
+
+		std::shared_ptr<Epoll> ep;
+		std::mutex _m; // everything below
+		std::map<int, fd_ops> pending;
+		std::deque<struct zts_cqe> done;
+		unsigned int cap;
+		unsigned int outstanding; // submitted and not yet reaped
+
+		explicit CompletionQueue(unsigned int entries)
+			: ep(new Epoll(true)),
+			cap(entries),
+			outstanding(0)
+		{ }
+
+		int fd() { return ep->fd(); }
+
+		void post(const struct zts_sqe &sqe, ssize_t res)
+		{
+			struct zts_cqe cqe;
+			cqe.user_data = sqe.user_data;
+			cqe.op = sqe.op;
+			cqe.fd = sqe.fd;
+			cqe.res = res;
+			done.push_back(cqe);
+		}
+
+		/*
+		 * Retries the operations waiting on fd in order, attempt() returns -EAGAIN if an op
+		 * still can't complete. Returns true if nothing is left waiting on fd
+		 */
+		template<typename F>
+		bool progress(int fd, F attempt)
+		{
+			std::map<int, fd_ops>::iterator it = pending.find(fd);
+			if(it == pending.end())
+				return true;
+			for(int d=0; d<2; d++) {
+				std::deque<op> &q = it->second.q[d];
+				while(!q.empty()) {
+					ssize_t res = attempt(q.front());
+					if(res == -EAGAIN)
+						break;
+					post(q.front().sqe, res);
+					q.pop_front();
+				}
+			}
+			return it->second.q[0].empty() && it->second.q[1].empty();
+		}
+
+		unsigned int reap(struct zts_cqe *cqes, unsigned int max)
+		{
+			unsigned int n = 0;
+			while(n < max && !done.empty()) {
+				cqes[n++] = done.front();
+				done.pop_front();
+			}
+			outstanding -= n;
+			return n;
+		}
+	};
+}
+
+#endif // ZT_COMPLETIONQUEUE_HPP
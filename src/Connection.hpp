@@ -30,37 +30,82 @@
 #define ZT_CONNECTION_HPP
 
 #include <ctime>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <queue>
+#include <vector>
+#include <unistd.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
 
 #if defined(STACK_PICO)
 #include "pico_socket.h"
 #endif
+#if defined(STACK_LWIP)
+struct pbuf;
+#endif
 
 #include "Phy.hpp"
 
 #include "libzt.h"
 #include "SocketTap.hpp"
 #include "RingBuffer.hpp"
+#include "DatagramQueue.hpp"
+#include "Stats.hpp"
+#include "LatencyTrace.hpp"
+#include "TokenBucket.hpp"
+#include "BufTune.hpp"
+#include "PortAllocator.hpp"
+
+// Stack socket options kept on a Connection, see StackDriver::ApplyOptions()
+#define ZT_CONN_OPT_NODELAY                0x01
+#define ZT_CONN_OPT_SNDBUF                 0x02
+#define ZT_CONN_OPT_RCVBUF                 0x04
+#define ZT_CONN_OPT_TOS                    0x08
+#define ZT_CONN_OPT_KEEPALIVE              0x10
+#define ZT_CONN_OPT_FASTOPEN               0x20
+#define ZT_CONN_OPT_TIMERS                 0x40
 
 namespace ZeroTier {
 	
 	class SocketTap;
+	class Epoll;
+	class ConnectionRegistry;
+	class StackDriver;
+	struct ConnectionPair;
 
 	struct Connection
 	{
-		int tot = 0;
-		RingBuffer<unsigned char> *TXbuf;
-		RingBuffer<unsigned char> *RXbuf;
+		// See zts_get_socket_stats()
+		ConnectionStats stats;
 
+		// Each buffer has exactly one producer and one consumer (the app-facing PhySocket on one
+		// side, the stack callbacks on the other) so they're lock-free rather than mutex-guarded.
+		// They start out empty and grow up to a cap set by socket type or SO_SNDBUF/SO_RCVBUF
+		SPSCChunkedBuffer<unsigned char> *TXbuf;
+		SPSCChunkedBuffer<unsigned char> *RXbuf;
+
+		// In direct I/O mode app threads are the producer of TXbuf and the consumer of RXbuf,
+		// these keep it to one app thread per side at a time (_rx_m first if both are taken)
 		Mutex _tx_m, _rx_m;
 
 		PhySocket *sock;	
 
+		// The stack the socket below belongs to, see StackDriver::Socket()
+		StackDriver *driver;
 #if defined(STACK_PICO)			
 		struct pico_socket *picosock;
 #endif
 #if defined(STACK_LWIP)
 		void *pcb;
+		// What lwIP has delivered which didn't fit in RXbuf yet, its window only opens by what
+		// has been taken from here (see nc_recved())
+		struct pbuf *rx_pbuf;
+		// The peer's FIN, passed on to the app as EOF once RXbuf has gone out (see lwip_remote_closed())
+		bool rx_fin;
 #endif
 		// TODO: For getsockname, etc
 		struct sockaddr_storage *local_addr; // Address we've bound to locally
@@ -69,31 +114,417 @@ namespace ZeroTier {
 		int socket_family, socket_type, protocol;
 
 		int app_fd; // used by app for I/O
-		int sdk_fd; // used by lib for I/O
+		int sdk_fd; // used by lib for I/O, -1 when app_fd is a userspace descriptor
+
+		// For a userspace descriptor (see zts_stack_config.userspace_fds), what the kernel
+		// would otherwise keep: SO_RCVTIMEO/SO_SNDTIMEO (ms, -1 none), and the socketpair made
+		// by zts_get_native_fd() whose app end (native_fd[0]) is readable while conn is.
+		// native_fd and native_ready are guarded by _epoll_m, see native_sync()
+		int rcvtimeo_ms;
+		int sndtimeo_ms;
+		int native_fd[2];
+		bool native_ready;
 
-		std::queue<Connection*> _AcceptedConnections;
+#if defined(STACK_PICO)
+		// Connections the stack has established on this listening socket which the app hasn't
+		// accepted yet. Nothing is allocated for them (no Connection, no socketpair) until
+		// zts_accept() takes one, and at most backlog wait here, see pico_cb_socket_activity()
+		std::deque<struct pico_socket*> _AcceptedConnections;
+#endif
+#if defined(STACK_LWIP)
+		// The same for lwIP, each waits as the ConnectionPair its pcb's events go to (guarded
+		// by lwIP's core lock rather than _tcpconns_m), see lwIP::nc_accept()
+		std::deque<ConnectionPair*> _AcceptedPairs;
+#endif
+		std::atomic<int> _AcceptedCount; // readable without _tcpconns_m (length of the above)
+		int backlog;
 		SocketTap *tap;
+		// Which registry (tap->_Connections) this is in and where, see ConnectionRegistry
+		const ConnectionRegistry *registry;
+		size_t registry_idx;
 		int state;      // See libzt.h for (ZT_SOCK_STATE_*)
 
 		// timestamp for closure event
 		std::time_t closure_ts;
 
-		Connection() {
-			TXbuf = new RingBuffer<unsigned char>(ZT_TCP_TX_BUF_SZ);
-			RXbuf = new RingBuffer<unsigned char>(ZT_TCP_RX_BUF_SZ);
+		// Whether a connection attempt has been handed to the stack and not yet established or
+		// refused, and the error it failed with (reported and cleared through SO_ERROR)
+		std::atomic<bool> connecting;
+		std::atomic<int> so_error;
+
+		// O_NONBLOCK of app_fd as last set through zts_fcntl() or zts_ioctl(FIONBIO), saves
+		// API calls an fcntl() to learn whether they may block
+		std::atomic<bool> nonblocking;
+
+		// Set by zts_close() once the app's fd is gone, the stack thread closes the stack's socket
+		// when everything the app wrote has reached it or at close_deadline (ms), and then calls
+		// close_cb, see SocketTap::ServiceClosing(). close_deadline is 0 when nothing is pending
+		uint64_t close_deadline;
+		zts_close_cb close_cb;
+		void *close_arg;
+		int close_fd;
+
+		// Zero-copy sends (see zts_send_zc()) in submission order, the stack thread takes them
+		// once TXbuf has been drained. Their buffers are the stack thread's until it calls their
+		// cb. zc_pending is the length of zc_q (readable without _zc_m), zc_closed is set once
+		// the stack has let go of the Connection and nothing more may be queued
+		struct zc_send {
+			const unsigned char *buf;
+			size_t len, off;
+			uint64_t tag;
+			zts_zc_cb cb;
+			void *arg;
+		};
+		std::deque<zc_send> zc_q;
+		std::atomic<int> zc_pending;
+		bool zc_closed;
+		Mutex _zc_m;
+
+		// Set through SO_REUSEPORT before zts_bind(), a listening Connection bound to the same
+		// port as another one shares its pico_socket but keeps an accept queue of its own
+		bool reuseport;
+
+		// Signalled by the stack whenever state changes or a Connection is queued on 
+		// _AcceptedConnections so that blocking zts_connect()/zts_accept() calls can wake up
+		std::mutex _state_m;
+		std::condition_variable _state_cv;
+		uint64_t _state_seq; // notify_state() calls so far, guarded by _state_m
+
+		// Whether the app's I/O bypasses the socketpair (see ZT_SO_DIRECT_IO), and whether
+		// the stack has data for us which didn't fit in RXbuf the last time it tried
+		bool direct;
+		std::atomic<bool> rx_stalled;
+
+		// Whether conn is waiting in its tap's _pico_rx_backlog, or its _pico_rx_flush, stack
+		// thread only
+		bool rx_backlog;
+		bool rx_flush;
+
+		// Buffer parking (see ZT_SOCK_BUF_PARK_IDLE), stack thread only. park_mark is the
+		// bytes through both buffers when SocketTap::ParkIdle() last saw them move, at park_ts
+		size_t park_mark;
+		std::time_t park_ts;
+
+		// Autotuning of TCP TXbuf/RXbuf caps, see SocketTap::TuneBuffers()
+		BufTune tx_tune, rx_tune;
 
+		// Send-side batching (see ZT_SO_TCP_COALESCE_BYTES, TCP_CORK), set by the app and read
+		// by the stack thread. tx_hold_ts is when TXbuf last went from empty to non-empty and
+		// is only touched by the stack thread
+		bool tx_nodelay;
+		std::atomic<bool> tx_cork;
+		std::atomic<int> tx_coalesce_bytes;
+		std::atomic<int> tx_coalesce_ms;
+		uint64_t tx_hold_ts;
+
+		// SO_MAX_PACING_RATE, see SocketTap::txAllowance()
+		TokenBucket tx_shaper;
+
+		// IP_TOS/IPV6_TCLASS set by the app, the stack marks what conn sends with it and the tap
+		// gives frames marked interactive priority (see ZT_FRAME_TX_PRIO_RING_LEN)
+		int tos;
+
+		// SO_KEEPALIVE, TCP_KEEPIDLE/TCP_KEEPINTVL (s) and TCP_KEEPCNT, see StackDriver::SetKeepalive()
+		bool keepalive;
+		int keep_idle;
+		int keep_intvl;
+		int keep_cnt;
+
+		// TCP_FASTOPEN queue length of a listener (0 is off). syn_data/syn_len is what
+		// zts_sendto(MSG_FASTOPEN) asks Connect() to put on the SYN, syn_len is left at what was
+		int fastopen;
+		const void *syn_data;
+		size_t syn_len;
+
+		// TCP_QUICKACK, TCP_USER_TIMEOUT (ms, 0 is off) and ZT_SO_TCP_RTO_MIN (ms)
+		bool quickack;
+		unsigned int user_timeout;
+		int rto_min;
+
+		// IP_MTU_DISCOVER/IPV6_MTU_DISCOVER, datagrams larger than the network's path MTU fail with
+		// EMSGSIZE instead of being fragmented, see dgramSend()
+		bool pmtudisc_do;
+
+		// SO_TIMESTAMP or SO_TIMESTAMPNS once the app has asked for arrival times (0 if it
+		// hasn't), rx_stamp is when the latest stream data reached the tap, see zts_recvmsg()
+		std::atomic<int> rx_timestamp;
+		std::atomic<uint64_t> rx_stamp;
+
+		// Options (ZT_CONN_OPT_*) changed by the app which the stack thread is yet to apply, see
+		// SocketTap::QueueOptions()
+		std::atomic<uint32_t> opts_pending;
+
+		// Socketpair flow control (see ZT_TCP_TX_HIGH_WATER), stack thread only. tx_spill holds
+		// whatever was read from sdk_fd before reading stopped but didn't fit in TXbuf
+		std::vector<unsigned char> tx_spill;
+		bool tx_paused;
+
+		// A connected datagram socket's route (lwIP's netif), as resolved with TapIndex at
+		// generation route_gen, 0 if never. Stack thread only, see lwip_write_dgram()
+		void *route_netif;
+		uint32_t route_gen;
+
+		// Slot of an inbound connection's peer in its tap's Admission, 0 if it isn't counted
+		int admit;
+
+		// Local port its tap's PortAllocator gave an outbound connection to eph_dst, 0 if none
+		PortAllocator::Key eph_dst;
+		uint16_t eph_port;
+
+		// A ZT_SOCK_MSG socket's port in its tap's MsgPorts (0 until bound) and where
+		// zts_connect() pointed it (node 0 if nowhere), host byte order
+		uint16_t msg_port;
+		uint64_t msg_node;
+		uint16_t msg_dport;
+		bool msg_reliable;
+
+		// Sampled latencies of TXbuf and RXbuf (see zts_set_latency_sampling()), positions
+		// are in produced()/consumed() terms
+		StreamMark tx_mark;
+		StreamMark rx_mark;
+
+		// Received datagrams waiting for room in the socketpair (SOCK_DGRAM only, see
+		// ZT_SO_UDP_RXQ_DEPTH), created by the stack thread when the first one arrives
+		DatagramQueue *rxq;
+		std::atomic<int> rxq_depth;
+		std::atomic<bool> rxq_drop_oldest;
+		std::atomic<uint64_t> rxq_drops;
+
+		// zts_epoll instances watching this Connection, see epoll_notify()
+		std::vector<Epoll*> _epolls;
+		Mutex _epoll_m;
+
+		/*
+		 * If neither end of a socketpair is given a new one is created
+		 */
+		Connection(int socket_type = SOCK_STREAM, int sdk_fd = -1, int app_fd = -1) {
+			TXbuf = new SPSCChunkedBuffer<unsigned char>(ZT_TCP_TX_BUF_SZ);
+			RXbuf = new SPSCChunkedBuffer<unsigned char>(ZT_TCP_RX_BUF_SZ);
+			rxq = NULL;
+			reset(socket_type, sdk_fd, app_fd);
+		}
+
+		~Connection() {
+			delete TXbuf;
+			delete RXbuf;
+			delete rxq;
+		}
+
+		// Closes the socketpair made by zts_get_native_fd(), if there is one
+		void close_native() {
+			Mutex::Lock _l(_epoll_m);
+			for(int i=0; i<2; i++) {
+				if(native_fd[i] >= 0)
+					close(native_fd[i]);
+				native_fd[i] = -1;
+			}
+			native_ready = false;
+		}
+
+		/*
+		 * Wakes up anyone in wait_state(). Must not be called with tap->_tcpconns_m held since
+		 * waiters may take it while evaluating their predicate
+		 */
+		void notify_state() {
+			std::lock_guard<std::mutex> _l(_state_m);
+			_state_seq++;
+			_state_cv.notify_all();
+		}
+
+		/*
+		 * Blocks until pred() holds or timeout_ms has elapsed (never times out if timeout_ms < 0),
+		 * returns whether pred() holds. pred() is also re-evaluated every recheck_ms regardless
+		 * of notifications as a safety net for state which changes without one. pred() runs with
+		 * _state_m held, so it may only read state
+		 */
+		template<typename Pred> bool wait_state(Pred pred, int timeout_ms, int recheck_ms) {
+			std::chrono::steady_clock::time_point deadline = 
+				std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+			std::unique_lock<std::mutex> _l(_state_m);
+			while(!pred()) {
+				std::chrono::steady_clock::time_point wake = 
+					std::chrono::steady_clock::now() + std::chrono::milliseconds(recheck_ms);
+				if(timeout_ms >= 0) {
+					if(std::chrono::steady_clock::now() >= deadline)
+						return false;
+					wake = std::min(wake, deadline);
+				}
+				_state_cv.wait_until(_l, wake);
+			}
+			return true;
+		}
+
+		/*
+		 * wait_state() for a pred() which may not run under _state_m, one that goes through
+		 * the stack thread (SocketTap::RunOnStack()) say: the stack thread takes _state_m in
+		 * notify_state(). pred() runs unlocked, then we wait for a notification since
+		 */
+		template<typename Pred> bool wait_state_unlocked(Pred pred, int timeout_ms, int recheck_ms) {
+			std::chrono::steady_clock::time_point deadline = 
+				std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+			for(;;) {
+				uint64_t seq;
+				{
+					std::lock_guard<std::mutex> _l(_state_m);
+					seq = _state_seq;
+				}
+				if(pred())
+					return true;
+				std::chrono::steady_clock::time_point wake = 
+					std::chrono::steady_clock::now() + std::chrono::milliseconds(recheck_ms);
+				if(timeout_ms >= 0) {
+					if(std::chrono::steady_clock::now() >= deadline)
+						return false;
+					wake = std::min(wake, deadline);
+				}
+				std::unique_lock<std::mutex> _l(_state_m);
+				_state_cv.wait_until(_l, wake, [this, seq]() { return _state_seq != seq; });
+			}
+		}
+
+		/*
+		 * Hands every queued zero-copy send back to the app with -err and takes no more, stack
+		 * thread only (or once there is no stack thread)
+		 */
+		void zc_fail(int err) {
+			std::deque<zc_send> failed;
+			{
+				Mutex::Lock _l(_zc_m);
+				zc_closed = true;
+				failed.swap(zc_q);
+				zc_pending = 0;
+			}
+			for(size_t i=0; i<failed.size(); i++) {
+				if(failed[i].cb)
+					failed[i].cb(app_fd, failed[i].tag, -err, failed[i].arg);
+			}
+		}
+
+		/*
+		 * Returns the object to the state of a freshly constructed Connection so that it can
+		 * be handed out again by a ConnectionPool. Must not be called while the Connection is
+		 * still known to a tap or the stack.
+		 */
+		void reset(int socket_type, int sdk_fd = -1, int app_fd = -1) {
+			stats.reset();
+			sock = NULL;
+			driver = NULL;
+#if defined(STACK_PICO)
+			picosock = NULL;
+#endif
+#if defined(STACK_LWIP)
+			pcb = NULL;
+			rx_pbuf = NULL;
+			rx_fin = false;
+#endif
+			local_addr = NULL;
+			peer_addr = NULL;
+			this->socket_type = socket_type;
+			socket_family = protocol = 0;
+#if defined(STACK_PICO)
+			std::deque<struct pico_socket*>().swap(_AcceptedConnections);
+#endif
+#if defined(STACK_LWIP)
+			std::deque<ConnectionPair*>().swap(_AcceptedPairs);
+#endif
+			_AcceptedCount = 0;
+			backlog = 0;
+			tap = NULL;
+			registry = NULL;
+			registry_idx = 0;
+			state = ZT_SOCK_STATE_NONE;
 			closure_ts = -1;
-			ZT_PHY_SOCKFD_TYPE fdpair[2];
-			if(socketpair(PF_LOCAL, SOCK_STREAM, 0, fdpair) < 0) {
-				if(errno < 0) {
+			connecting = false;
+			so_error = 0;
+			nonblocking = false;
+			rcvtimeo_ms = sndtimeo_ms = -1;
+			native_fd[0] = native_fd[1] = -1;
+			native_ready = false;
+			close_deadline = 0;
+			close_cb = NULL;
+			close_arg = NULL;
+			close_fd = -1;
+			std::deque<zc_send>().swap(zc_q);
+			zc_pending = 0;
+			zc_closed = false;
+			reuseport = false;
+			_state_seq = 0;
+			direct = ZT_SOCK_DIRECT_IO_DEFAULT;
+			rx_stalled = false;
+			rx_backlog = false;
+			rx_flush = false;
+			park_mark = 0;
+			park_ts = 0;
+			tx_tune.reset();
+			rx_tune.reset();
+			tx_nodelay = ZT_SOCK_TCP_NODELAY_DEFAULT;
+			tx_cork = false;
+			tx_coalesce_bytes = ZT_TCP_COALESCE_BYTES_DEFAULT;
+			tx_coalesce_ms = ZT_TCP_COALESCE_MS_DEFAULT;
+			tx_hold_ts = 0;
+			tx_shaper.configure(0, 0);
+			tos = 0;
+			keepalive = false;
+			keep_idle = ZT_TCP_KEEPIDLE_DEFAULT;
+			keep_intvl = ZT_TCP_KEEPINTVL_DEFAULT;
+			keep_cnt = ZT_TCP_KEEPCNT_DEFAULT;
+			fastopen = 0;
+			syn_data = NULL;
+			syn_len = 0;
+			quickack = false;
+			user_timeout = 0;
+			rto_min = ZT_TCP_RTO_MIN_DEFAULT;
+			pmtudisc_do = false;
+			rx_timestamp = 0;
+			rx_stamp = 0;
+			opts_pending = 0;
+			std::vector<unsigned char>().swap(tx_spill);
+			tx_paused = false;
+			route_netif = NULL;
+			route_gen = 0;
+			admit = 0;
+			eph_port = 0;
+			msg_port = 0;
+			msg_node = 0;
+			msg_dport = 0;
+			msg_reliable = false;
+			delete rxq;
+			rxq = NULL;
+			rxq_depth = ZT_UDP_RXQ_DEPTH_DEFAULT;
+			rxq_drop_oldest = ZT_UDP_RXQ_DROP_OLDEST_DEFAULT;
+			rxq_drops = 0;
+			_epolls.clear();
+
+			TXbuf->reset();
+			RXbuf->reset();
+			tx_mark.reset();
+			rx_mark.reset();
+			if(socket_type == SOCK_STREAM) {
+				TXbuf->setCapacity(ZT_TCP_TX_BUF_SZ);
+				RXbuf->setCapacity(ZT_TCP_RX_BUF_SZ);
+			}
+			else {
+				TXbuf->setCapacity(ZT_UDP_TX_BUF_SZ);
+				RXbuf->setCapacity(ZT_UDP_RX_BUF_SZ);
+			}
+
+			// A userspace descriptor comes without a socketpair, see ConnectionPool::get()
+			if(sdk_fd < 0 && app_fd < 0) {
+				// Datagram (and raw and message, one frame each) sockets keep their message
+				// boundaries across the socketpair
+				ZT_PHY_SOCKFD_TYPE fdpair[2];
+				bool dgram = socket_type == SOCK_DGRAM || socket_type == SOCK_RAW || socket_type == ZT_SOCK_MSG;
+				if(socketpair(PF_LOCAL, dgram ? SOCK_DGRAM : SOCK_STREAM, 0, fdpair) < 0) {
 					DEBUG_ERROR("unable to create socketpair");
+					this->sdk_fd = this->app_fd = -1;
 					return;
 				}
+				sdk_fd = fdpair[0];
+				app_fd = fdpair[1];
 			}
-			sdk_fd = fdpair[0];
-			app_fd = fdpair[1];
+			this->sdk_fd = sdk_fd;
+			this->app_fd = app_fd;
 		}
-		~Connection() { }
 	};
 
 	/*
@@ -102,8 +533,20 @@ namespace ZeroTier {
 	struct ConnectionPair
 	{
 	  SocketTap *tap;
-	  Connection *conn;
-	  ConnectionPair(SocketTap *_tap, Connection *conn) : tap(_tap), conn(conn) {}
+	  Connection *conn; // NULL until the app accepts, the stack's events collect in pending_ev
+	  uint16_t pending_ev;
+	  // Listening Connections sharing this pico_socket through SO_REUSEPORT (conn is the one
+	  // the stack's events go to), empty unless it is shared
+	  std::vector<Connection*> shards;
+	  // Connection::admit of a connection waiting to be accepted
+	  int admit;
+#if defined(STACK_LWIP)
+	  // The pcb of a connection waiting to be accepted, NULL once lwIP has freed it
+	  void *pcb;
+	  ConnectionPair(SocketTap *_tap, Connection *conn) : tap(_tap), conn(conn), pending_ev(0), admit(0), pcb(NULL) {}
+#else
+	  ConnectionPair(SocketTap *_tap, Connection *conn) : tap(_tap), conn(conn), pending_ev(0), admit(0) {}
+#endif
 	};
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,137 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+// Recycles Connection objects and keeps a few socketpairs ready for new ones
+
+#ifndef ZT_CONNECTIONPOOL_HPP
+#define ZT_CONNECTIONPOOL_HPP
+
+#include <queue>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "Mutex.hpp"
+#include "Connection.hpp"
+
+namespace ZeroTier {
+
+	/*
+	 * Keeps up to ZT_CONNECTION_POOL_SZ retired Connection objects (along with their buffers)
+	 * for reuse, and up to ZT_SOCKETPAIR_POOL_SZ socketpairs which are created ahead of time
+	 * by warm() so that zts_socket() and accept don't have to wait on socketpair()
+	 */
+	class ConnectionPool
+	{
+	private:
+		std::queue<Connection*> conns;
+		std::queue<std::pair<int,int> > fdpairs; // (sdk_fd, app_fd)
+		Mutex _m;
+
+	public:
+		~ConnectionPool()
+		{
+			while(conns.size()) {
+				delete conns.front();
+				conns.pop();
+			}
+			while(fdpairs.size()) {
+				close(fdpairs.front().first);
+				close(fdpairs.front().second);
+				fdpairs.pop();
+			}
+		}
+
+		/*
+		 * Returns a Connection in the same state as a newly constructed one. Given a userspace
+		 * descriptor (see FdTable::alloc_userspace()) it gets that in place of a socketpair
+		 */
+		Connection *get(int socket_type, int userspace_fd = -1)
+		{
+			Connection *conn = NULL;
+			int sdk_fd = -1, app_fd = userspace_fd;
+			{
+				Mutex::Lock _l(_m);
+				if(conns.size()) {
+					conn = conns.front();
+					conns.pop();
+				}
+				// Pooled socketpairs are SOCK_STREAM, see Connection::reset()
+				if(app_fd < 0 && fdpairs.size() && socket_type != SOCK_DGRAM && socket_type != SOCK_RAW
+					&& socket_type != ZT_SOCK_MSG) {
+					sdk_fd = fdpairs.front().first;
+					app_fd = fdpairs.front().second;
+					fdpairs.pop();
+				}
+			}
+			if(conn)
+				conn->reset(socket_type, sdk_fd, app_fd);
+			else
+				conn = new Connection(socket_type, sdk_fd, app_fd);
+			return conn;
+		}
+
+		/*
+		 * Takes back a Connection which is no longer referenced anywhere. Its socketpair (or
+		 * userspace descriptor) is expected to have been closed (freed) already.
+		 */
+		void recycle(Connection *conn)
+		{
+			if(!conn)
+				return;
+			{
+				Mutex::Lock _l(_m);
+				if(conns.size() < ZT_CONNECTION_POOL_SZ) {
+					conns.push(conn);
+					return;
+				}
+			}
+			delete conn;
+		}
+
+		/*
+		 * Tops up the set of ready socketpairs, called periodically from SocketTap::Housekeeping()
+		 */
+		void warm()
+		{
+			for(;;) {
+				{
+					Mutex::Lock _l(_m);
+					if(fdpairs.size() >= ZT_SOCKETPAIR_POOL_SZ)
+						return;
+				}
+				int fdpair[2];
+				if(socketpair(PF_LOCAL, SOCK_STREAM, 0, fdpair) < 0) {
+					DEBUG_ERROR("unable to create socketpair");
+					return;
+				}
+				Mutex::Lock _l(_m);
+				fdpairs.push(std::pair<int,int>(fdpair[0], fdpair[1]));
+			}
+		}
+	};
+}
+
+#endif // ZT_CONNECTIONPOOL_HPP
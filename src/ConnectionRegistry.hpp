@@ -0,0 +1,90 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+// The set of Connections belonging to a SocketTap
+
+#ifndef ZT_CONNECTIONREGISTRY_HPP
+#define ZT_CONNECTIONREGISTRY_HPP
+
+#include <stddef.h>
+
+#include <vector>
+
+#include "Connection.hpp"
+
+namespace ZeroTier {
+
+	/*
+	 * Each Connection records which registry it's in and at which slot, so adding and removing
+	 * are O(1) (the last Connection moves into the slot being vacated). Removing a Connection
+	 * which isn't in this registry does nothing, so a Connection recycled (and perhaps handed
+	 * to another tap) in the meantime is left alone. Not thread-safe, a SocketTap guards its
+	 * registry with _tcpconns_m
+	 */
+	class ConnectionRegistry
+	{
+	private:
+		std::vector<Connection*> slots;
+
+	public:
+		bool contains(const Connection *conn) const
+		{
+			return conn->registry == this && conn->registry_idx < slots.size() 
+				&& slots[conn->registry_idx] == conn;
+		}
+
+		void add(Connection *conn)
+		{
+			if(contains(conn))
+				return;
+			conn->registry = this;
+			conn->registry_idx = slots.size();
+			slots.push_back(conn);
+		}
+
+		/*
+		 * Returns whether conn was here
+		 */
+		bool remove(Connection *conn)
+		{
+			if(!contains(conn))
+				return false;
+			size_t i = conn->registry_idx;
+			slots[i] = slots.back();
+			slots[i]->registry_idx = i;
+			slots.pop_back();
+			conn->registry = NULL;
+			conn->registry_idx = 0;
+			return true;
+		}
+
+		// Slots are contiguous, iterate with size() and [] (order changes as Connections leave)
+		size_t size() const { return slots.size(); }
+		Connection *operator[](size_t i) const { return slots[i]; }
+	};
+}
+
+#endif // ZT_CONNECTIONREGISTRY_HPP
@@ -0,0 +1,204 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// Framing for datagrams crossing a SOCK_DGRAM Connection's socketpair, and the bounded queue
+// of received ones waiting for room in it
+
+#ifndef ZT_DATAGRAMQUEUE_HPP
+#define ZT_DATAGRAMQUEUE_HPP
+
+#include <atomic>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+namespace ZeroTier {
+
+	/*
+	 * Precedes every datagram crossing a SOCK_DGRAM Connection's socketpair. Holds the source
+	 * address of a received datagram and the destination of one being sent (addrlen is 0
+	 * for a send() on a connected socket)
+	 */
+	struct DatagramHeader
+	{
+		socklen_t addrlen;
+		union {
+			struct sockaddr sa;
+			struct sockaddr_in in4;
+			struct sockaddr_in6 in6;
+		} addr;
+		// When a received datagram reached the tap (see SocketTap::rxStamp()), only set if the
+		// socket asked for SO_TIMESTAMP(NS)
+		uint64_t rx_stamp;
+	};
+
+	/*
+	 * A ring of variable-length records, each laid out as
+	 *
+	 *   [uint32_t len][DatagramHeader][payload (len bytes)]
+	 *
+	 * so that everything but the length can be handed to the socketpair in one send(). A record
+	 * never wraps: if it doesn't fit in front of the end of the buffer a wrap marker is left in
+	 * its place and it goes at the start. Pushing, dropping and popping are all O(1). Only the
+	 * stack thread touches a queue, the drop counter (owned by the Connection so that it
+	 * survives the queue being resized) is read by app threads
+	 */
+	class DatagramQueue
+	{
+	private:
+		static const uint32_t WRAP = 0xffffffff;
+		static const size_t ALIGN = 8;
+
+		unsigned char *buf;
+		size_t cap;
+		size_t head, tail;
+		size_t n, depth;
+		size_t max_payload;
+		size_t pending; // bytes reserved by reserve(), consumed by commit()
+
+		static size_t record_sz(size_t len)
+		{
+			return (sizeof(uint32_t) + sizeof(struct DatagramHeader) + len + ALIGN - 1) & ~(ALIGN - 1);
+		}
+
+		uint32_t &len_at(size_t off) { return *(uint32_t *)(buf + off); }
+
+		// Offset at which a record of sz bytes would go, or cap if there isn't room
+		size_t slot_for(size_t sz) const
+		{
+			if(!n)
+				return 0;
+			if(tail > head) {
+				if(cap - tail >= sz)
+					return tail;
+				return head >= sz ? 0 : cap;
+			}
+			return head - tail >= sz ? tail : cap;
+		}
+
+		// Skips a wrap marker (or the unused end of the buffer) at head
+		void settle_head()
+		{
+			if(n && (cap - head < sizeof(uint32_t) || len_at(head) == WRAP))
+				head = 0;
+		}
+
+	public:
+		std::atomic<uint64_t> &drops;
+
+		/*
+		 * Room for depth datagrams of up to max_payload bytes each
+		 */
+		DatagramQueue(size_t depth, size_t max_payload, std::atomic<uint64_t> &drops)
+			: head(0),
+			tail(0),
+			n(0),
+			depth(depth ? depth : 1),
+			max_payload(max_payload),
+			pending(0),
+			drops(drops)
+		{
+			cap = this->depth * record_sz(max_payload);
+			buf = (unsigned char *)malloc(cap);
+		}
+
+		~DatagramQueue()
+		{
+			free(buf);
+		}
+
+		size_t count() const { return n; }
+		size_t capacity() const { return depth; }
+
+		/*
+		 * Returns space for the next datagram (up to max_payload bytes) and its header, making
+		 * room first if the queue is full. With drop_oldest the oldest queued datagram is
+		 * discarded, otherwise NULL is returned and the new datagram should be discarded.
+		 * Nothing is queued until commit()
+		 */
+		unsigned char *reserve(struct DatagramHeader **hdr, bool drop_oldest)
+		{
+			if(!buf)
+				return NULL;
+			size_t sz = record_sz(max_payload);
+			size_t off;
+			while(n >= depth || (off = slot_for(sz)) == cap) {
+				if(!drop_oldest || !n)
+					return NULL;
+				pop();
+				drops++;
+			}
+			if(!n)
+				head = tail = 0;
+			// Leave a marker behind if we're skipping the end of the buffer
+			if(off == 0 && n && tail + sizeof(uint32_t) <= cap)
+				len_at(tail) = WRAP;
+			pending = off;
+			*hdr = (struct DatagramHeader *)(buf + off + sizeof(uint32_t));
+			return buf + off + sizeof(uint32_t) + sizeof(struct DatagramHeader);
+		}
+
+		/*
+		 * Queues the datagram written to the space returned by the last reserve()
+		 */
+		void commit(size_t len)
+		{
+			len_at(pending) = (uint32_t)len;
+			tail = pending + record_sz(len);
+			n++;
+		}
+
+		/*
+		 * Returns the oldest datagram as its header followed by its payload, sz is set to the
+		 * combined length
+		 */
+		const unsigned char *front(size_t *sz)
+		{
+			*sz = sizeof(struct DatagramHeader) + len_at(head);
+			return buf + head + sizeof(uint32_t);
+		}
+
+		void pop()
+		{
+			head += record_sz(len_at(head));
+			n--;
+			settle_head();
+		}
+
+		/*
+		 * Discards everything queued
+		 */
+		void clear()
+		{
+			head = tail = n = 0;
+		}
+	};
+}
+
+#endif // ZT_DATAGRAMQUEUE_HPP
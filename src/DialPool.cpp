@@ -0,0 +1,389 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Clock.hpp"
+#include "DialPool.hpp"
+#include "libzt.h"
+
+namespace ZeroTier {
+namespace DialPool {
+
+	struct idle_conn
+	{
+		int fd;
+		uint64_t since;
+	};
+
+	struct peer
+	{
+		struct sockaddr_storage addr;
+		std::deque<idle_conn> idle;  // most recently released at the back
+		int in_use;
+		int dialing;                 // by the housekeeping thread
+		int reserve;                 // see prewarm()
+		int peak_cur, peak_prev;     // most in use at once this window and the last
+		uint64_t window_start;
+		uint64_t last_use;
+		peer() : in_use(0), dialing(0), reserve(0), peak_cur(0), peak_prev(0), window_start(0), last_use(0)
+		{
+			memset(&addr, 0, sizeof(addr));
+		}
+	};
+
+	/*
+	 * Never destroyed, the housekeeping thread may still be dialing while the process exits
+	 */
+	struct pool
+	{
+		std::mutex m;
+		std::condition_variable cv;
+		std::map<std::string, peer> peers;
+		std::map<int, std::string> lent;   // fds handed out, to the peer they go back to
+		struct zts_pool_config cfg;
+		struct zts_pool_stats st;
+		uint64_t generation;               // bumped by flush(), what was dialed before it is closed
+		bool running;
+		bool kicked;
+		pool() : generation(0), running(false), kicked(false)
+		{
+			memset(&cfg, 0, sizeof(cfg));
+			memset(&st, 0, sizeof(st));
+		}
+	};
+
+	static pool &get()
+	{
+		static pool *p = new pool();
+		return *p;
+	}
+
+	static uint32_t maxIdle(const pool &p) { return p.cfg.max_idle ? p.cfg.max_idle : ZT_POOL_MAX_IDLE; }
+	static uint32_t idleTimeout(const pool &p) { return p.cfg.idle_timeout_ms ? p.cfg.idle_timeout_ms : ZT_POOL_IDLE_TIMEOUT; }
+	static uint32_t dialTimeout(const pool &p) { return p.cfg.dial_timeout_ms ? p.cfg.dial_timeout_ms : ZT_POOL_DIAL_TIMEOUT; }
+
+	// Family, port and address, the same for every sockaddr naming the same peer
+	static bool makeKey(const struct sockaddr *addr, socklen_t addrlen, std::string &key, struct sockaddr_storage &ss)
+	{
+		if(!addr || addrlen > sizeof(ss))
+			return false;
+		memset(&ss, 0, sizeof(ss));
+		if(addr->sa_family == AF_INET && addrlen >= sizeof(struct sockaddr_in)) {
+			const struct sockaddr_in *in4 = (const struct sockaddr_in *)addr;
+			memcpy(&ss, in4, sizeof(*in4));
+			key.assign((const char *)&in4->sin_port, 2);
+			key.append((const char *)&in4->sin_addr, 4);
+			return true;
+		}
+		if(addr->sa_family == AF_INET6 && addrlen >= sizeof(struct sockaddr_in6)) {
+			const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+			memcpy(&ss, in6, sizeof(*in6));
+			key.assign((const char *)&in6->sin6_port, 2);
+			key.append((const char *)&in6->sin6_addr, 16);
+			key.append((const char *)&in6->sin6_scope_id, 4);
+			return true;
+		}
+		return false;
+	}
+
+	/*
+	 * An idle connection is healthy while it has nothing to read: a request/response peer
+	 * doesn't speak unasked, so readability means a FIN, a reset or an error
+	 */
+	static bool healthy(int fd)
+	{
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		if(zts_poll(&pfd, 1, 0) != 0)
+			return false;
+		int err = 0;
+		socklen_t len = sizeof(err);
+		return zts_getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && !err;
+	}
+
+	static void noteUse_locked(peer &pr)
+	{
+		pr.in_use++;
+		pr.peak_cur = std::max(pr.peak_cur, pr.in_use);
+		pr.last_use = Clock::now();
+	}
+
+	// How many connections to keep dialed (idle and in use)
+	static int wanted_locked(const pool &p, const peer &pr, uint64_t now)
+	{
+		int demand = 0;
+		if(!p.cfg.no_prewarm && now - pr.last_use < 2 * ZT_POOL_DEMAND_WINDOW)
+			demand = std::max(pr.peak_cur, pr.peak_prev);
+		int want = std::max(demand, pr.reserve);
+		return std::min(want, pr.in_use + (int)maxIdle(p));
+	}
+
+	/*
+	 * One pass: expires and health-checks idle connections, rolls the demand windows over,
+	 * dials what's missing (without the lock) and forgets peers with nothing left
+	 */
+	static void pass(pool &p)
+	{
+		std::vector<int> to_close;
+		std::vector<std::pair<std::string, struct sockaddr_storage> > to_dial;
+		uint64_t gen;
+		uint32_t timeout;
+		{
+			std::lock_guard<std::mutex> _l(p.m);
+			uint64_t now = Clock::now();
+			for(std::map<std::string, peer>::iterator it=p.peers.begin(); it!=p.peers.end(); ) {
+				peer &pr = it->second;
+				for(std::deque<idle_conn>::iterator c=pr.idle.begin(); c!=pr.idle.end(); ) {
+					bool expired = now - c->since >= idleTimeout(p);
+					if(expired || !healthy(c->fd)) {
+						expired ? p.st.expired++ : p.st.stale++;
+						to_close.push_back(c->fd);
+						c = pr.idle.erase(c);
+					}
+					else
+						++c;
+				}
+				if(now - pr.window_start >= ZT_POOL_DEMAND_WINDOW) {
+					pr.peak_prev = pr.peak_cur;
+					pr.peak_cur = pr.in_use;
+					pr.window_start = now;
+				}
+				int missing = wanted_locked(p, pr, now) - pr.in_use - (int)pr.idle.size() - pr.dialing;
+				for(int i=0; i<missing; i++) {
+					pr.dialing++;
+					to_dial.push_back(std::make_pair(it->first, pr.addr));
+				}
+				if(pr.idle.empty() && !pr.in_use && !pr.dialing && !pr.reserve
+					&& now - pr.last_use >= 2 * ZT_POOL_DEMAND_WINDOW)
+					p.peers.erase(it++);
+				else
+					++it;
+			}
+			gen = p.generation;
+			timeout = dialTimeout(p);
+		}
+		for(size_t i=0; i<to_close.size(); i++)
+			zts_close(to_close[i]);
+		for(size_t i=0; i<to_dial.size(); i++) {
+			int fd = zts_connect_any(&to_dial[i].second, 1, timeout);
+			std::lock_guard<std::mutex> _l(p.m);
+			std::map<std::string, peer>::iterator it = p.peers.find(to_dial[i].first);
+			if(it != p.peers.end())
+				it->second.dialing--;
+			if(fd < 0) {
+				p.st.dial_failures++;
+				continue;
+			}
+			p.st.prewarmed++;
+			if(it == p.peers.end() || gen != p.generation) {
+				zts_close(fd);
+				continue;
+			}
+			idle_conn c = { fd, Clock::now() };
+			it->second.idle.push_back(c);
+		}
+	}
+
+	static void housekeeper()
+	{
+		pool &p = get();
+		for(;;) {
+			{
+				std::unique_lock<std::mutex> l(p.m);
+				p.cv.wait_for(l, std::chrono::milliseconds(ZT_POOL_INTERVAL), [&p]() { return p.kicked; });
+				p.kicked = false;
+			}
+			pass(p);
+		}
+	}
+
+	// Starts the housekeeping thread once, and has it pass over the pool now
+	static void kick_locked(pool &p)
+	{
+		if(!p.running) {
+			p.running = true;
+			std::thread(housekeeper).detach();
+		}
+		p.kicked = true;
+		p.cv.notify_one();
+	}
+
+	void configure(const struct zts_pool_config *cfg)
+	{
+		pool &p = get();
+		std::lock_guard<std::mutex> _l(p.m);
+		if(cfg)
+			p.cfg = *cfg;
+		else
+			memset(&p.cfg, 0, sizeof(p.cfg));
+	}
+
+	int connect(const struct sockaddr *addr, socklen_t addrlen, int timeout_ms)
+	{
+		std::string key;
+		struct sockaddr_storage ss;
+		if(!makeKey(addr, addrlen, key, ss)) {
+			errno = EINVAL;
+			return -1;
+		}
+		pool &p = get();
+		std::vector<int> stale;
+		int fd = -1;
+		{
+			std::lock_guard<std::mutex> _l(p.m);
+			peer &pr = p.peers[key];
+			if(!pr.window_start) {
+				pr.addr = ss;
+				pr.window_start = Clock::now();
+			}
+			// The most recently released is the likeliest to still be open
+			while(fd < 0 && !pr.idle.empty()) {
+				int c = pr.idle.back().fd;
+				pr.idle.pop_back();
+				if(healthy(c))
+					fd = c;
+				else {
+					p.st.stale++;
+					stale.push_back(c);
+				}
+			}
+			noteUse_locked(pr);
+			if(fd >= 0) {
+				p.st.hits++;
+				p.lent[fd] = key;
+			}
+			else
+				p.st.misses++;
+			if(timeout_ms < 0)
+				timeout_ms = dialTimeout(p);
+			// The next call would have to dial, top up now if demand says so
+			if(pr.idle.empty())
+				kick_locked(p);
+		}
+		for(size_t i=0; i<stale.size(); i++)
+			zts_close(stale[i]);
+		if(fd >= 0)
+			return fd;
+		fd = zts_connect_any(&ss, 1, timeout_ms);
+		int err = errno;
+		std::lock_guard<std::mutex> _l(p.m);
+		if(fd < 0) {
+			std::map<std::string, peer>::iterator it = p.peers.find(key);
+			if(it != p.peers.end())
+				it->second.in_use--;
+			errno = err;
+			return -1;
+		}
+		p.lent[fd] = key;
+		return fd;
+	}
+
+	bool release(int fd, bool reuse)
+	{
+		pool &p = get();
+		{
+			std::lock_guard<std::mutex> _l(p.m);
+			std::map<int, std::string>::iterator l = p.lent.find(fd);
+			if(l == p.lent.end())
+				return false;
+			std::map<std::string, peer>::iterator it = p.peers.find(l->second);
+			p.lent.erase(l);
+			if(it != p.peers.end()) {
+				peer &pr = it->second;
+				pr.in_use--;
+				if(reuse && pr.idle.size() < maxIdle(p) && healthy(fd)) {
+					idle_conn c = { fd, Clock::now() };
+					pr.idle.push_back(c);
+					return true;
+				}
+			}
+		}
+		zts_close(fd);
+		return true;
+	}
+
+	void prewarm(const struct sockaddr *addr, socklen_t addrlen, int count)
+	{
+		std::string key;
+		struct sockaddr_storage ss;
+		if(!makeKey(addr, addrlen, key, ss))
+			return;
+		pool &p = get();
+		std::lock_guard<std::mutex> _l(p.m);
+		peer &pr = p.peers[key];
+		if(!pr.window_start) {
+			pr.addr = ss;
+			pr.window_start = Clock::now();
+		}
+		pr.reserve = std::max(count, 0);
+		kick_locked(p);
+	}
+
+	void flush()
+	{
+		pool &p = get();
+		std::vector<int> to_close;
+		{
+			std::lock_guard<std::mutex> _l(p.m);
+			for(std::map<std::string, peer>::iterator it=p.peers.begin(); it!=p.peers.end(); ++it) {
+				for(size_t i=0; i<it->second.idle.size(); i++)
+					to_close.push_back(it->second.idle[i].fd);
+			}
+			p.peers.clear();
+			p.generation++;
+		}
+		for(size_t i=0; i<to_close.size(); i++)
+			zts_close(to_close[i]);
+	}
+
+	void stats(struct zts_pool_stats *stats)
+	{
+		pool &p = get();
+		std::lock_guard<std::mutex> _l(p.m);
+		*stats = p.st;
+		stats->peers = (uint32_t)p.peers.size();
+		stats->idle = 0;
+		for(std::map<std::string, peer>::iterator it=p.peers.begin(); it!=p.peers.end(); ++it)
+			stats->idle += (uint32_t)it->second.idle.size();
+		stats->in_use = (uint32_t)p.lent.size();
+	}
+
+} // namespace DialPool
+} // namespace ZeroTier
@@ -0,0 +1,68 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// Warm connections to the addresses an app keeps coming back to (see zts_pool_connect())
+//
+// Idle connections are kept per address, health-checked as they're handed out and on every
+// pass of a housekeeping thread, which also dials ahead as many as were lately in use at once
+// (or as zts_pool_prewarm() asked for) so that requests don't wait for a handshake
+
+#ifndef ZT_DIALPOOL_HPP
+#define ZT_DIALPOOL_HPP
+
+#include <sys/socket.h>
+
+#include "libzt.h"
+
+namespace ZeroTier {
+namespace DialPool {
+
+	void configure(const struct zts_pool_config *cfg);
+
+	/*
+	 * A connected socket to addr, -1 with errno set if none could be had
+	 */
+	int connect(const struct sockaddr *addr, socklen_t addrlen, int timeout_ms);
+
+	/*
+	 * false if fd wasn't handed out by connect()
+	 */
+	bool release(int fd, bool reuse);
+
+	void prewarm(const struct sockaddr *addr, socklen_t addrlen, int count);
+
+	/*
+	 * Closes the idle connections, those in use are closed as they're released
+	 */
+	void flush();
+
+	void stats(struct zts_pool_stats *stats);
+
+} // namespace DialPool
+} // namespace ZeroTier
+
+#endif // ZT_DIALPOOL_HPP
@@ -0,0 +1,353 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+// Readiness notification for libzt sockets driven by the network stack (see zts_epoll_*)
+
+#ifndef ZT_EPOLL_HPP
+#define ZT_EPOLL_HPP
+
+#include <map>
+#include <set>
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "libzt.h"
+#include "SocketTap.hpp"
+#include "Connection.hpp"
+
+namespace ZeroTier {
+
+	/*
+	 * An interest list plus a set of descriptors which the stack has reported activity on.
+	 * Only descriptors in the ready set are examined during wait() so wakeups are O(ready), 
+	 * each is re-checked against the state of its Connection so that events are level-
+	 * triggered unless ZTS_EPOLLET is set. A pipe is kept readable while the ready set is
+	 * non-empty so that the instance itself can be watched with zts_poll()/zts_select().
+	 * A CompletionQueue drives its pending operations from one of these (see kick() and
+	 * take_dropped())
+	 */
+	class Epoll
+	{
+	private:
+		struct interest {
+			Connection *conn;
+			struct zts_epoll_event ev;
+		};
+
+		std::map<int, interest> interests;
+		std::set<int> ready_fds;
+		std::vector<int> dropped; // removed by zts_epoll_detach(), if track_dropped
+		bool track_dropped;
+		bool kicked;
+		bool closed;
+		int sig[2];
+		std::mutex _m;
+		std::condition_variable _cv;
+
+		void signal()
+		{
+			char c = 0;
+			if(write(sig[1], &c, 1) < 0) { } // pipe full means it's readable already
+		}
+
+		void drain()
+		{
+			char buf[64];
+			while(read(sig[0], buf, sizeof(buf)) > 0) { }
+		}
+
+	public:
+		explicit Epoll(bool track_dropped = false)
+			: track_dropped(track_dropped),
+			kicked(false),
+			closed(false)
+		{
+			sig[0] = sig[1] = -1;
+			if(pipe(sig) < 0) {
+				DEBUG_ERROR("unable to create pipe for epoll instance");
+				return;
+			}
+			fcntl(sig[0], F_SETFL, O_NONBLOCK);
+			fcntl(sig[1], F_SETFL, O_NONBLOCK);
+		}
+
+		~Epoll()
+		{
+			close(sig[0]);
+			close(sig[1]);
+		}
+
+		// The descriptor handed to the app to refer to this instance (-1 on failure)
+		int fd() { return sig[0]; }
+
+		/*
+		 * Returns the events which currently hold for conn, regardless of interest
+		 */
+		static uint32_t current_events(Connection *conn)
+		{
+			uint32_t ev = 0;
+			if(conn->state == ZT_SOCK_STATE_LISTENING) {
+				// _tcpconns_m can't be taken here since the stack may hold it while calling back into ready()
+				if(conn->_AcceptedCount > 0)
+					ev |= ZTS_EPOLLIN;
+			}
+			else {
+				int pending = 0;
+				if(conn->RXbuf->count() || (conn->sdk_fd >= 0 && ioctl(conn->app_fd, FIONREAD, &pending) == 0 && pending > 0))
+					ev |= ZTS_EPOLLIN;
+				if((conn->state == ZT_SOCK_STATE_CONNECTED || conn->state == ZT_SOCK_STATE_UNHANDLED_CONNECTED) 
+					&& conn->TXbuf->getFree())
+					ev |= ZTS_EPOLLOUT;
+				// Datagrams bypass TXbuf, they go straight into the socketpair (see dgramSend())
+				if(conn->socket_type == SOCK_DGRAM)
+					ev |= ZTS_EPOLLOUT;
+			}
+#if defined(STACK_PICO)
+			if(conn->state == PICO_ERR_ECONNRESET)
+				ev |= ZTS_EPOLLERR | ZTS_EPOLLHUP;
+#endif
+			// A failed connection attempt is writable with an error, the same as the kernel's
+			if(conn->so_error)
+				ev |= ZTS_EPOLLOUT | ZTS_EPOLLERR;
+			if(conn->closure_ts != -1)
+				ev |= ZTS_EPOLLIN | ZTS_EPOLLRDHUP;
+			return ev;
+		}
+
+		/*
+		 * Called (via epoll_notify()) when the stack reports activity on fd
+		 */
+		void ready(int fd)
+		{
+			std::lock_guard<std::mutex> _l(_m);
+			if(!interests.count(fd))
+				return;
+			if(ready_fds.empty())
+				signal();
+			ready_fds.insert(fd);
+			_cv.notify_all();
+		}
+
+		/*
+		 * ZTS_EPOLL_CTL_ADD/MOD/DEL, returns 0 or -1 with errno set. Connection::_epolls is
+		 * maintained by the caller
+		 */
+		int ctl(int op, int fd, Connection *conn, struct zts_epoll_event *event)
+		{
+			std::lock_guard<std::mutex> _l(_m);
+			std::map<int, interest>::iterator it = interests.find(fd);
+			if(op == ZTS_EPOLL_CTL_DEL) {
+				if(it == interests.end()) {
+					errno = ENOENT;
+					return -1;
+				}
+				interests.erase(it);
+				ready_fds.erase(fd);
+				if(track_dropped) {
+					dropped.push_back(fd);
+					kicked = true;
+					signal();
+					_cv.notify_all();
+				}
+				return 0;
+			}
+			if(!event) {
+				errno = EFAULT;
+				return -1;
+			}
+			if(op == ZTS_EPOLL_CTL_ADD && it != interests.end()) {
+				errno = EEXIST;
+				return -1;
+			}
+			if(op == ZTS_EPOLL_CTL_MOD && it == interests.end()) {
+				errno = ENOENT;
+				return -1;
+			}
+			if(op != ZTS_EPOLL_CTL_ADD && op != ZTS_EPOLL_CTL_MOD) {
+				errno = EINVAL;
+				return -1;
+			}
+			interest &i = interests[fd];
+			i.conn = conn;
+			i.ev = *event;
+			// The socket may already be ready, let the next wait() find out
+			if(ready_fds.empty())
+				signal();
+			ready_fds.insert(fd);
+			_cv.notify_all();
+			return 0;
+		}
+
+		/*
+		 * Waits up to timeout ms (forever if < 0) for events, returns the number of events 
+		 * written to events or -1 with errno set
+		 */
+		int wait(struct zts_epoll_event *events, int maxevents, int timeout)
+		{
+			std::chrono::steady_clock::time_point deadline = 
+				std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+			std::unique_lock<std::mutex> _l(_m);
+			for(;;) {
+				if(closed) {
+					errno = EBADF;
+					return -1;
+				}
+				int n = 0;
+				std::set<int>::iterator it = ready_fds.begin();
+				while(it != ready_fds.end() && n < maxevents) {
+					std::map<int, interest>::iterator i = interests.find(*it);
+					uint32_t ev = 0;
+					if(i != interests.end()) {
+						ev = current_events(i->second.conn) 
+							& (i->second.ev.events | ZTS_EPOLLERR | ZTS_EPOLLHUP);
+					}
+					if(!ev) {
+						ready_fds.erase(it++);
+						continue;
+					}
+					events[n].events = ev;
+					events[n].data = i->second.ev.data;
+					n++;
+					if(i->second.ev.events & ZTS_EPOLLONESHOT)
+						i->second.ev.events = 0;
+					if(i->second.ev.events & (ZTS_EPOLLET | ZTS_EPOLLONESHOT) || !i->second.ev.events)
+						ready_fds.erase(it++);
+					else
+						++it;
+				}
+				if(ready_fds.empty())
+					drain();
+				if(n || timeout == 0 || kicked) {
+					kicked = false;
+					return n;
+				}
+				if(timeout < 0)
+					_cv.wait(_l);
+				else if(_cv.wait_until(_l, deadline) == std::cv_status::timeout)
+					timeout = 0; // one last look
+			}
+		}
+
+		/*
+		 * Makes the descriptor readable and the current (or next) wait() return even if no
+		 * socket is ready, used to announce completions
+		 */
+		void kick()
+		{
+			std::lock_guard<std::mutex> _l(_m);
+			kicked = true;
+			signal();
+			_cv.notify_all();
+		}
+
+		/*
+		 * Like ZTS_EPOLL_CTL_DEL but not reported by take_dropped()
+		 */
+		void remove(int fd)
+		{
+			std::lock_guard<std::mutex> _l(_m);
+			interests.erase(fd);
+			ready_fds.erase(fd);
+		}
+
+		/*
+		 * Returns (and forgets) the descriptors which were removed by ZTS_EPOLL_CTL_DEL since
+		 * the last call, which for an instance nobody else can reach means they were closed
+		 */
+		std::vector<int> take_dropped()
+		{
+			std::lock_guard<std::mutex> _l(_m);
+			std::vector<int> fds;
+			fds.swap(dropped);
+			return fds;
+		}
+
+		/*
+		 * Wakes any waiters with EBADF and returns the Connections which were being watched
+		 */
+		std::vector<Connection*> shutdown()
+		{
+			std::lock_guard<std::mutex> _l(_m);
+			std::vector<Connection*> conns;
+			for(std::map<int, interest>::iterator it = interests.begin(); it != interests.end(); ++it)
+				conns.push_back(it->second.conn);
+			interests.clear();
+			ready_fds.clear();
+			closed = true;
+			_cv.notify_all();
+			return conns;
+		}
+	};
+
+	/*
+	 * Keeps the app end of conn's zts_get_native_fd() socketpair readable (one byte waiting
+	 * in it) for as long as conn is readable, has failed or has been closed by the peer. Must
+	 * be called with conn->_epoll_m held
+	 */
+	inline void native_sync(Connection *conn)
+	{
+		if(conn->native_fd[0] < 0)
+			return;
+		bool ready = (Epoll::current_events(conn) & (ZTS_EPOLLIN | ZTS_EPOLLERR | ZTS_EPOLLHUP)) != 0;
+		if(ready == conn->native_ready)
+			return;
+		if(ready) {
+			char c = 0;
+			if(write(conn->native_fd[1], &c, 1) < 0) { }
+		}
+		else {
+			char buf[16];
+			while(read(conn->native_fd[0], buf, sizeof(buf)) > 0) { }
+		}
+		conn->native_ready = ready;
+	}
+
+	// native_sync() for the app's side, after it has taken something from conn
+	inline void native_update(Connection *conn)
+	{
+		Mutex::Lock _l(conn->_epoll_m);
+		native_sync(conn);
+	}
+
+	/*
+	 * Tells every Epoll watching conn that something happened on it. Must not be called with
+	 * tap->_tcpconns_m held
+	 */
+	inline void epoll_notify(Connection *conn)
+	{
+		Mutex::Lock _l(conn->_epoll_m);
+		for(size_t i=0; i<conn->_epolls.size(); i++)
+			conn->_epolls[i]->ready(conn->app_fd);
+		native_sync(conn);
+	}
+}
+
+#endif // ZT_EPOLL_HPP
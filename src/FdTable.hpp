@@ -0,0 +1,334 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+// Maps application file descriptors to their Connection and SocketTap
+
+#ifndef ZT_FDTABLE_HPP
+#define ZT_FDTABLE_HPP
+
+#include <atomic>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Mutex.hpp"
+
+// Descriptors are small dense integers so the table is a two-level array indexed by fd,
+// pages are allocated on first use and live as long as the table
+#define ZT_FDTABLE_PAGE_SZ                 1024
+#define ZT_FDTABLE_MAX_PAGES               1024
+// Descriptors of libzt's own (see zts_stack_config.userspace_fds) are handed out from here up,
+// well above anything the host is expected to give out
+#define ZT_FDTABLE_USERSPACE_BASE          (ZT_FDTABLE_PAGE_SZ * ZT_FDTABLE_MAX_PAGES / 2)
+
+namespace ZeroTier {
+
+	struct Connection;
+	class SocketTap;
+
+	/*
+	 * A descriptor is "unassigned" when it refers to a Connection which hasn't been given to
+	 * a SocketTap yet (no bind()/connect() so far), and "assigned" once it has. A "host"
+	 * descriptor has no Connection, it is a socket of the host's own stack which the zts_*
+	 * calls pass straight through to (see ZTS_ROUTE_HOST). Lookups never
+	 * lock and may run concurrently with updates, updates are expected to be serialized by
+	 * the caller (_multiplexer_lock). A lookup made while holding a Pin on the descriptor
+	 * returns a Connection which stays valid until the Pin goes, see SocketTap::Reap()
+	 */
+	class FdTable
+	{
+	private:
+		struct fd_entry {
+			std::atomic<Connection*> conn;
+			std::atomic<SocketTap*> tap;
+			std::atomic<bool> host;
+			std::atomic<bool> listening;
+			std::atomic<int> pins;
+			std::atomic<bool> waited; // Reap() found it pinned and is waiting for the last unpin()
+		};
+
+		std::atomic<fd_entry*> pages[ZT_FDTABLE_MAX_PAGES];
+		std::atomic<size_t> n_unassigned;
+		std::atomic<size_t> n_assigned;
+		std::atomic<size_t> n_listening;
+		std::atomic<size_t> n_host;
+		std::atomic<uint32_t> n_released;
+		std::vector<int> userspace_free;
+		int userspace_next;
+		Mutex _m;
+
+		fd_entry *lookup(int fd)
+		{
+			if(fd < 0 || fd >= ZT_FDTABLE_PAGE_SZ * ZT_FDTABLE_MAX_PAGES)
+				return NULL;
+			fd_entry *page = pages[fd / ZT_FDTABLE_PAGE_SZ].load(std::memory_order_acquire);
+			return page ? &page[fd % ZT_FDTABLE_PAGE_SZ] : NULL;
+		}
+
+		fd_entry *lookup_or_create(int fd)
+		{
+			fd_entry *e = lookup(fd);
+			if(e || fd < 0 || fd >= ZT_FDTABLE_PAGE_SZ * ZT_FDTABLE_MAX_PAGES)
+				return e;
+			Mutex::Lock _l(_m);
+			std::atomic<fd_entry*> &slot = pages[fd / ZT_FDTABLE_PAGE_SZ];
+			fd_entry *page = slot.load(std::memory_order_relaxed);
+			if(!page) {
+				page = new fd_entry[ZT_FDTABLE_PAGE_SZ];
+				for(int i=0; i<ZT_FDTABLE_PAGE_SZ; i++) {
+					page[i].conn.store(NULL, std::memory_order_relaxed);
+					page[i].tap.store(NULL, std::memory_order_relaxed);
+					page[i].host.store(false, std::memory_order_relaxed);
+					page[i].listening.store(false, std::memory_order_relaxed);
+					page[i].pins.store(0, std::memory_order_relaxed);
+					page[i].waited.store(false, std::memory_order_relaxed);
+				}
+				slot.store(page, std::memory_order_release);
+			}
+			return &page[fd % ZT_FDTABLE_PAGE_SZ];
+		}
+
+	public:
+		FdTable() 
+			: n_unassigned(0),
+			n_assigned(0),
+			n_listening(0),
+			n_host(0),
+			n_released(0),
+			userspace_next(ZT_FDTABLE_USERSPACE_BASE)
+		{
+			for(int i=0; i<ZT_FDTABLE_MAX_PAGES; i++)
+				pages[i].store(NULL, std::memory_order_relaxed);
+		}
+
+		~FdTable()
+		{
+			for(int i=0; i<ZT_FDTABLE_MAX_PAGES; i++)
+				delete[] pages[i].load();
+		}
+
+		/*
+		 * Adds a newly created (unassigned) socket, returns false if fd is out of range
+		 */
+		bool add(int fd, Connection *conn)
+		{
+			fd_entry *e = lookup_or_create(fd);
+			if(!e)
+				return false;
+			erase(fd);
+			e->tap.store(NULL, std::memory_order_relaxed);
+			e->conn.store(conn, std::memory_order_release);
+			n_unassigned++;
+			return true;
+		}
+
+		/*
+		 * Associates fd with the SocketTap now handling its Connection
+		 */
+		bool assign(int fd, Connection *conn, SocketTap *tap)
+		{
+			fd_entry *e = lookup_or_create(fd);
+			if(!e)
+				return false;
+			erase(fd);
+			e->tap.store(tap, std::memory_order_relaxed);
+			e->conn.store(conn, std::memory_order_release);
+			n_assigned++;
+			return true;
+		}
+
+		/*
+		 * Points an fd assigned to conn at the SocketTap conn has moved to, see SocketTap::Park()
+		 */
+		void retap(int fd, Connection *conn, SocketTap *tap)
+		{
+			fd_entry *e = lookup(fd);
+			if(e && e->conn.load(std::memory_order_acquire) == conn && e->tap.load(std::memory_order_relaxed))
+				e->tap.store(tap, std::memory_order_relaxed);
+		}
+
+		void erase(int fd)
+		{
+			fd_entry *e = lookup(fd);
+			if(!e)
+				return;
+			// seq_cst, Reap() relies on a pin() after this seeing NULL (see pinned())
+			Connection *conn = e->conn.exchange(NULL);
+			SocketTap *tap = e->tap.exchange(NULL, std::memory_order_relaxed);
+			if(e->host.exchange(false, std::memory_order_acq_rel))
+				n_host--;
+			if(e->listening.exchange(false, std::memory_order_relaxed))
+				n_listening--;
+			if(conn)
+				tap ? n_assigned-- : n_unassigned--;
+		}
+
+		/*
+		 * Marks an assigned fd as listening (see zts_listen()), until it's erased or reassigned
+		 */
+		void set_listening(int fd)
+		{
+			fd_entry *e = lookup(fd);
+			if(e && e->tap.load(std::memory_order_relaxed) && !e->listening.exchange(true, std::memory_order_relaxed))
+				n_listening++;
+		}
+
+		/*
+		 * Marks fd as a host socket in place of whatever it referred to before
+		 */
+		bool add_host(int fd)
+		{
+			fd_entry *e = lookup_or_create(fd);
+			if(!e)
+				return false;
+			erase(fd);
+			e->host.store(true, std::memory_order_release);
+			n_host++;
+			return true;
+		}
+
+		bool is_host(int fd)
+		{
+			fd_entry *e = lookup(fd);
+			return e && e->host.load(std::memory_order_acquire);
+		}
+
+		/*
+		 * Reserves a descriptor which no kernel object stands behind, -1 if none are left.
+		 * It is given back with free_userspace() once nothing refers to it anymore
+		 */
+		int alloc_userspace()
+		{
+			Mutex::Lock _l(_m);
+			if(userspace_free.size()) {
+				int fd = userspace_free.back();
+				userspace_free.pop_back();
+				return fd;
+			}
+			if(userspace_next >= ZT_FDTABLE_PAGE_SZ * ZT_FDTABLE_MAX_PAGES)
+				return -1;
+			return userspace_next++;
+		}
+
+		void free_userspace(int fd)
+		{
+			Mutex::Lock _l(_m);
+			userspace_free.push_back(fd);
+		}
+
+		static bool is_userspace(int fd) { return fd >= ZT_FDTABLE_USERSPACE_BASE; }
+
+		/*
+		 * Returns the Connection for fd (NULL if none), and the SocketTap handling it if
+		 * the socket has been assigned to one (NULL otherwise)
+		 */
+		Connection *get(int fd, SocketTap **tap = NULL)
+		{
+			fd_entry *e = lookup(fd);
+			Connection *conn = e ? e->conn.load(std::memory_order_acquire) : NULL;
+			if(tap)
+				*tap = conn ? e->tap.load(std::memory_order_relaxed) : NULL;
+			return conn;
+		}
+
+		// Returns the Connection for fd only if it hasn't been assigned to a SocketTap yet
+		Connection *get_unassigned(int fd)
+		{
+			SocketTap *tap;
+			Connection *conn = get(fd, &tap);
+			return tap ? NULL : conn;
+		}
+
+		// Returns the Connection for fd only if it has been assigned to a SocketTap
+		Connection *get_assigned(int fd, SocketTap **tap)
+		{
+			Connection *conn = get(fd, tap);
+			return *tap ? conn : NULL;
+		}
+
+		/*
+		 * Descriptors with a Connection, host ones aren't counted (nor are they in the stack)
+		 */
+		size_t size()
+		{
+			return n_unassigned + n_assigned;
+		}
+
+		/*
+		 * Holds off the recycling of whatever Connection fd refers to (or comes to refer to)
+		 * until unpin(), to be taken before looking fd up
+		 */
+		void pin(int fd)
+		{
+			fd_entry *e = lookup_or_create(fd);
+			if(e)
+				e->pins++;
+		}
+
+		void unpin(int fd)
+		{
+			fd_entry *e = lookup(fd);
+			if(e && e->pins-- == 1 && e->waited.exchange(false))
+				n_released++;
+		}
+
+		/*
+		 * Whether fd is pinned. If it is, released() changes once it no longer is
+		 */
+		bool pinned(int fd)
+		{
+			fd_entry *e = lookup(fd);
+			if(!e || !e->pins)
+				return false;
+			e->waited = true;
+			return e->pins != 0; // unpinned in the meantime, the last unpin() may not have seen waited
+		}
+
+		uint32_t released() { return n_released; }
+
+		/*
+		 * Pins fd for as long as it is in scope
+		 */
+		class Pin
+		{
+		public:
+			Pin(FdTable &t, int fd) : _t(t), _fd(fd) { _t.pin(fd); }
+			~Pin() { _t.unpin(_fd); }
+		private:
+			Pin(const Pin &);
+			Pin &operator=(const Pin &);
+			FdTable &_t;
+			int _fd;
+		};
+
+		size_t unassigned() { return n_unassigned; }
+		size_t assigned() { return n_assigned; }
+		size_t listening() { return n_listening; }
+		size_t host() { return n_host; }
+	};
+}
+
+#endif // ZT_FDTABLE_HPP
@@ -0,0 +1,330 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// Compression of a network's outgoing frames, see zts_set_network_compression()
+
+#ifndef ZT_FRAMECOMPRESSOR_HPP
+#define ZT_FRAMECOMPRESSOR_HPP
+
+#include <atomic>
+#include <map>
+#include <vector>
+#include <string.h>
+#include <stdint.h>
+
+#include "Mutex.hpp"
+#include "MAC.hpp"
+#include "Clock.hpp"
+#include "libzt.h"
+
+// Frames compressed by a peer's tap go out as this (IEEE 802 local experimental) ethertype, the
+// payload starts with one of these
+#define ZT_COMPRESS_FRAME                  1 // ethertype (2), length (2), then an LZ4 block
+#define ZT_COMPRESS_HELLO                  2 // the sender takes compressed frames, answer with a...
+#define ZT_COMPRESS_HELLO_ACK              3 // ...which isn't answered
+#define ZT_COMPRESS_HEADER_LEN             5
+
+namespace ZeroTier {
+
+	/*
+	 * Compresses (LZ4 block format) the unicast frames of one tap to peers which have said they
+	 * take them, and decodes what they send in return. Peers learn of each other from HELLO
+	 * frames, sent to a MAC whenever a frame goes to it and it hasn't been heard from. A frame
+	 * is only sent compressed when that saves ZT_COMPRESS_MIN_SAVING of it, a peer whose frames
+	 * don't compress isn't tried again for ZT_COMPRESS_SKIP_FRAMES frames. compress() is called
+	 * by whichever thread hands frames to the core, uncompress() by those which receive them
+	 */
+	class FrameCompressor
+	{
+	private:
+		struct peer {
+			bool capable;       // has sent us a HELLO or compressed frame
+			bool ack;           // owes it a HELLO_ACK
+			uint64_t hello_at;  // ms, last HELLO sent to it
+			unsigned int skip;  // frames to send as they are
+		};
+
+		std::atomic<bool> _enabled;
+		std::atomic<bool> _acks; // some peer is owed a HELLO_ACK
+		Mutex _m;
+		std::map<uint64_t, peer> _peers;
+
+		static uint32_t read32(const unsigned char *p)
+		{
+			uint32_t v;
+			memcpy(&v, p, 4);
+			return v;
+		}
+
+		static unsigned char *putLength(unsigned char *op, unsigned int len)
+		{
+			for(; len >= 255; len -= 255)
+				*op++ = 255;
+			*op++ = (unsigned char)len;
+			return op;
+		}
+
+		// A sequence's literals and (mlen 0 for the last one) match, or NULL if it won't fit
+		static unsigned char *sequence(unsigned char *op, unsigned char *end, const unsigned char *lit,
+			unsigned int nlit, unsigned int off, unsigned int mlen)
+		{
+			if(op + 1 + nlit / 255 + 1 + nlit + 2 + (mlen / 255 + 1) > end)
+				return NULL;
+			unsigned int m = mlen ? mlen - 4 : 0;
+			unsigned char *token = op++;
+			*token = (unsigned char)((nlit >= 15 ? 15 : nlit) << 4);
+			if(nlit >= 15)
+				op = putLength(op, nlit - 15);
+			memcpy(op, lit, nlit);
+			op += nlit;
+			if(!mlen)
+				return op;
+			*op++ = (unsigned char)off;
+			*op++ = (unsigned char)(off >> 8);
+			*token |= (unsigned char)(m >= 15 ? 15 : m);
+			if(m >= 15)
+				op = putLength(op, m - 15);
+			return op;
+		}
+
+	public:
+		FrameCompressor() : _enabled(false), _acks(false) {}
+
+		/*
+		 * LZ4 block of src, 0 if it takes more than cap bytes
+		 */
+		static unsigned int lz4(const unsigned char *src, unsigned int n, unsigned char *dst, unsigned int cap)
+		{
+			// The format's end conditions: the last match starts 12 bytes before the end at the
+			// latest, the last 5 are literals
+			const unsigned int mflimit = 12, lastlits = 5;
+			uint16_t table[4096]; // position + 1 of a 4 byte sequence by hash, 0 for none
+			memset(table, 0, sizeof(table));
+			unsigned char *op = dst, *end = dst + cap;
+			unsigned int ip = 0, anchor = 0;
+			while(n > mflimit && ip < n - mflimit) {
+				uint32_t seq = read32(src + ip);
+				uint32_t h = (seq * 2654435761U) >> 20;
+				int ref = (int)table[h] - 1;
+				table[h] = (uint16_t)(ip + 1);
+				if(ref < 0 || ip - ref > 65535 || read32(src + ref) != seq) {
+					ip++;
+					continue;
+				}
+				unsigned int mlen = 4;
+				while(ip + mlen < n - lastlits && src[ref + mlen] == src[ip + mlen])
+					mlen++;
+				if(!(op = sequence(op, end, src + anchor, ip - anchor, ip - ref, mlen)))
+					return 0;
+				ip += mlen;
+				anchor = ip;
+			}
+			if(!(op = sequence(op, end, src + anchor, n - anchor, 0, 0)))
+				return 0;
+			return (unsigned int)(op - dst);
+		}
+
+		/*
+		 * Decodes an LZ4 block into at most cap bytes, -1 if it's malformed or larger
+		 */
+		static int unlz4(const unsigned char *src, unsigned int n, unsigned char *dst, unsigned int cap)
+		{
+			unsigned int ip = 0, op = 0;
+			while(ip < n) {
+				unsigned int token = src[ip++], b;
+				unsigned int nlit = token >> 4;
+				if(nlit == 15) {
+					do {
+						if(ip >= n)
+							return -1;
+						nlit += (b = src[ip++]);
+					} while(b == 255);
+				}
+				if(nlit > n - ip || nlit > cap - op)
+					return -1;
+				memcpy(dst + op, src + ip, nlit);
+				ip += nlit;
+				op += nlit;
+				if(ip == n)
+					break;
+				if(n - ip < 2)
+					return -1;
+				unsigned int off = src[ip] | (src[ip + 1] << 8);
+				ip += 2;
+				if(!off || off > op)
+					return -1;
+				unsigned int mlen = token & 15;
+				if(mlen == 15) {
+					do {
+						if(ip >= n)
+							return -1;
+						mlen += (b = src[ip++]);
+					} while(b == 255);
+				}
+				mlen += 4;
+				if(mlen > cap - op)
+					return -1;
+				// May overlap itself, a run of the last off bytes
+				for(unsigned int i=0; i<mlen; i++, op++)
+					dst[op] = dst[op - off];
+			}
+			return (int)op;
+		}
+
+		void enable(bool on)
+		{
+			if(!on) {
+				Mutex::Lock _l(_m);
+				_peers.clear();
+			}
+			_enabled = on;
+		}
+
+		bool enabled() const { return _enabled.load(std::memory_order_relaxed); }
+
+		/*
+		 * How a frame of len bytes to to goes out: written to out (at least len bytes) and its
+		 * length returned if it's to be sent compressed, 0 to send it as it is. hello is set
+		 * when a HELLO (see hello()) is to go to to first, failed when it didn't compress
+		 */
+		unsigned int compress(const MAC &to, unsigned int etherType, const void *data, unsigned int len,
+			unsigned char *out, bool &hello, bool &failed)
+		{
+			hello = failed = false;
+			if(!enabled() || to.isMulticast())
+				return 0;
+			{
+				Mutex::Lock _l(_m);
+				std::map<uint64_t, peer>::iterator p = _peers.find(to.toInt());
+				if(p == _peers.end()) {
+					if(_peers.size() >= ZT_COMPRESS_MAX_PEERS)
+						return 0;
+					peer fresh = { false, false, 0, 0 };
+					p = _peers.insert(std::make_pair(to.toInt(), fresh)).first;
+				}
+				if(!p->second.capable) {
+					uint64_t now = Clock::now();
+					if(!p->second.hello_at || now - p->second.hello_at >= ZT_COMPRESS_HELLO_INTERVAL) {
+						p->second.hello_at = now;
+						hello = true;
+					}
+					return 0;
+				}
+				if(len < ZT_COMPRESS_MIN_LEN)
+					return 0;
+				if(p->second.skip) {
+					p->second.skip--;
+					return 0;
+				}
+			}
+			unsigned int saving = len * ZT_COMPRESS_MIN_SAVING / 100;
+			unsigned int n = lz4((const unsigned char *)data, len, out + ZT_COMPRESS_HEADER_LEN,
+				len - saving - ZT_COMPRESS_HEADER_LEN);
+			if(!n) {
+				failed = true;
+				Mutex::Lock _l(_m);
+				std::map<uint64_t, peer>::iterator p = _peers.find(to.toInt());
+				if(p != _peers.end())
+					p->second.skip = ZT_COMPRESS_SKIP_FRAMES;
+				return 0;
+			}
+			out[0] = ZT_COMPRESS_FRAME;
+			out[1] = (unsigned char)(etherType >> 8);
+			out[2] = (unsigned char)etherType;
+			out[3] = (unsigned char)(len >> 8);
+			out[4] = (unsigned char)len;
+			return n + ZT_COMPRESS_HEADER_LEN;
+		}
+
+		/*
+		 * Decodes a frame of ZT_COMPRESS_ETHERTYPE from from into out (ZT_MAX_MTU bytes), returns
+		 * its length and sets etherType. 0 for a HELLO or HELLO_ACK, -1 for something malformed
+		 */
+		int uncompress(const MAC &from, const void *data, unsigned int len, unsigned int &etherType,
+			unsigned char *out)
+		{
+			const unsigned char *p = (const unsigned char *)data;
+			if(!len)
+				return -1;
+			if(p[0] == ZT_COMPRESS_HELLO || p[0] == ZT_COMPRESS_HELLO_ACK) {
+				if(!enabled())
+					return 0;
+				Mutex::Lock _l(_m);
+				std::map<uint64_t, peer>::iterator i = _peers.find(from.toInt());
+				if(i == _peers.end()) {
+					if(_peers.size() >= ZT_COMPRESS_MAX_PEERS)
+						return 0;
+					peer fresh = { false, false, 0, 0 };
+					i = _peers.insert(std::make_pair(from.toInt(), fresh)).first;
+				}
+				i->second.capable = true;
+				if(p[0] == ZT_COMPRESS_HELLO) {
+					i->second.ack = true;
+					_acks = true;
+				}
+				return 0;
+			}
+			if(p[0] != ZT_COMPRESS_FRAME || len < ZT_COMPRESS_HEADER_LEN)
+				return -1;
+			unsigned int olen = (p[3] << 8) | p[4];
+			if(olen > ZT_MAX_MTU)
+				return -1;
+			int n = unlz4(p + ZT_COMPRESS_HEADER_LEN, len - ZT_COMPRESS_HEADER_LEN, out, olen);
+			if(n != (int)olen)
+				return -1;
+			etherType = (p[1] << 8) | p[2];
+			return n;
+		}
+
+		// A HELLO or HELLO_ACK payload
+		static unsigned int hello(unsigned char *out, bool ack)
+		{
+			out[0] = ack ? ZT_COMPRESS_HELLO_ACK : ZT_COMPRESS_HELLO;
+			return 1;
+		}
+
+		bool acksPending() const { return _acks.load(std::memory_order_relaxed); }
+
+		/*
+		 * MACs of the peers owed a HELLO_ACK since the last call
+		 */
+		void takeAcks(std::vector<MAC> &to)
+		{
+			if(!_acks.exchange(false))
+				return;
+			Mutex::Lock _l(_m);
+			for(std::map<uint64_t, peer>::iterator i=_peers.begin(); i != _peers.end(); ++i) {
+				if(i->second.ack) {
+					i->second.ack = false;
+					to.push_back(MAC(i->first));
+				}
+			}
+		}
+	};
+}
+
+#endif
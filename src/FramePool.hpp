@@ -0,0 +1,366 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+// Pooled frame buffers and the descriptor queues used to hand them between threads
+
+#ifndef ZT_FRAMEPOOL_HPP
+#define ZT_FRAMEPOOL_HPP
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "HugePages.hpp"
+#include "MemBudget.hpp"
+#include "Mutex.hpp"
+#include "RingBuffer.hpp"
+#include "LockStats.hpp"
+
+namespace ZeroTier {
+
+	class FramePool;
+
+	/*
+	 * Stored immediately in front of every buffer handed out by a FramePool so that the
+	 * buffer can be returned from a context which only knows the buffer's address (such
+	 * as a stack's free notification callback). 32 bytes, keeping buffers aligned
+	 */
+	struct frame_buf_hdr
+	{
+		FramePool *owner; // NULL if the buffer was allocated outside of the pool
+		uint64_t stamp;   // when a traced frame was queued (see LatencyTrace), 0 if it isn't
+		uint64_t len;     // of the whole allocation, credited to the MemBudget when it's freed
+		uint64_t _pad;
+	};
+
+	/*
+	 * A fixed set of preallocated, equally-sized frame buffers
+	 */
+	class FramePool
+	{
+	private:
+		unsigned char *mem;
+		struct huge_region region;
+		unsigned char **freelist;
+		size_t nslots;
+		size_t nfree;
+		size_t slot_sz;
+		size_t buf_sz;
+		bool disposed;
+		Mutex _m;
+
+		~FramePool()
+		{
+			huge_free(&region);
+			delete[] freelist;
+			MemBudget::credit(ZTS_MEM_FRAMES, slot_sz * nslots);
+		}
+
+		static struct frame_buf_hdr *hdr(unsigned char *buf)
+		{
+			return (struct frame_buf_hdr *)(buf - sizeof(struct frame_buf_hdr));
+		}
+
+	public:
+		/*
+		 * Slots are backed according to hugepages (a ZTS_HUGEPAGES_* value) and, with prefault
+		 * set, faulted in before the pool is first used
+		 */
+		FramePool(size_t nslots, size_t buf_sz, int hugepages = ZTS_HUGEPAGES_OFF, bool prefault = false)
+			: nslots(nslots),
+			nfree(nslots),
+			buf_sz(buf_sz),
+			disposed(false)
+		{
+			slot_sz = sizeof(struct frame_buf_hdr) + buf_sz;
+			mem = (unsigned char *)huge_alloc(&region, slot_sz * nslots, hugepages, prefault);
+			MemBudget::charge(ZTS_MEM_FRAMES, slot_sz * nslots, false);
+			freelist = new unsigned char*[nslots];
+			for(size_t i=0; i<nslots; i++) {
+				unsigned char *slot = mem + (i * slot_sz);
+				((struct frame_buf_hdr *)slot)->owner = this;
+				freelist[i] = slot + sizeof(struct frame_buf_hdr);
+			}
+		}
+
+		/*
+		 * A buffer allocated outside of the pool, NULL if the MemBudget won't allow it
+		 */
+		unsigned char *standalone()
+		{
+			if(!MemBudget::charge(ZTS_MEM_FRAMES, slot_sz))
+				return NULL;
+			unsigned char *slot = (unsigned char *)malloc(slot_sz);
+			if(!slot) {
+				MemBudget::credit(ZTS_MEM_FRAMES, slot_sz);
+				return NULL;
+			}
+			((struct frame_buf_hdr *)slot)->owner = NULL;
+			((struct frame_buf_hdr *)slot)->stamp = 0;
+			((struct frame_buf_hdr *)slot)->len = slot_sz;
+			return slot + sizeof(struct frame_buf_hdr);
+		}
+
+		/*
+		 * Returns a buffer of at least bufSize() bytes. If the pool is exhausted (because
+		 * the stack is still holding on to previously received frames) a standalone buffer
+		 * is allocated instead so that callers only have to drop a frame once memory (or the
+		 * MemBudget) has run out
+		 */
+		unsigned char *acquire()
+		{
+			{
+				Mutex::Lock _l(_m);
+				if(nfree) {
+					unsigned char *buf = freelist[--nfree];
+					hdr(buf)->stamp = 0;
+					return buf;
+				}
+			}
+			return standalone();
+		}
+
+		/*
+		 * Fills bufs with n buffers (see acquire()) taking the lock only once, returns the
+		 * number acquired which is less than n only if memory has run out
+		 */
+		size_t acquire(unsigned char **bufs, size_t n)
+		{
+			size_t got = 0;
+			{
+				Mutex::Lock _l(_m);
+				while(got < n && nfree) {
+					bufs[got] = freelist[--nfree];
+					hdr(bufs[got++])->stamp = 0;
+				}
+			}
+			for(; got < n; got++) {
+				if(!(bufs[got] = standalone()))
+					break;
+			}
+			return got;
+		}
+
+		/*
+		 * Returns a buffer to the pool it came from (or frees it if it didn't come from one)
+		 */
+		static void release(unsigned char *buf)
+		{
+			if(!buf)
+				return;
+			unsigned char *slot = buf - sizeof(struct frame_buf_hdr);
+			FramePool *pool = ((struct frame_buf_hdr *)slot)->owner;
+			if(!pool) {
+				MemBudget::credit(ZTS_MEM_FRAMES, ((struct frame_buf_hdr *)slot)->len);
+				free(slot);
+				return;
+			}
+			bool last;
+			{
+				Mutex::Lock _l(pool->_m);
+				pool->freelist[pool->nfree++] = buf;
+				last = pool->disposed && pool->nfree == pool->nslots;
+			}
+			if(last)
+				delete pool;
+		}
+
+		/*
+		 * Destroys the pool once every outstanding buffer has been returned. Buffers may
+		 * still be owned by the stack after the owner of the pool has gone away
+		 */
+		void dispose()
+		{
+			bool idle;
+			{
+				Mutex::Lock _l(_m);
+				disposed = true;
+				idle = nfree == nslots;
+			}
+			if(idle)
+				delete this;
+		}
+
+		size_t bufSize() const { return buf_sz; }
+
+		/*
+		 * The stamp of a buffer handed out by any FramePool, 0 once it has been acquired
+		 */
+		static uint64_t &stamp(unsigned char *buf) { return hdr(buf)->stamp; }
+	};
+
+	/*
+	 * Describes a frame sitting in a pooled buffer
+	 */
+	struct frame_desc
+	{
+		unsigned char *buf;
+		unsigned int len;
+		uint64_t rx_stamp; // received frames only, see SocketTap::rxStamp()
+	};
+
+	/*
+	 * Fixed-capacity queue of frame descriptors. Only descriptors are moved in and out,
+	 * frames stay where they were written until the stack releases them. N must be a
+	 * power of two
+	 */
+	template<size_t N> class FrameQueue
+	{
+	private:
+		RingBuffer<struct frame_desc, N> q;
+		ProfiledMutex _m;
+
+	public:
+		FrameQueue()
+			: _m(ZTS_LOCK_FRAME_RXQ)
+		{
+		}
+
+		~FrameQueue()
+		{
+			// Return anything that never made it into the stack
+			struct frame_desc d;
+			while(q.read(&d, 1))
+				FramePool::release(d.buf);
+		}
+
+		/*
+		 * Enqueues a frame, returns false (and leaves ownership with the caller) if full. With
+		 * was_empty, sets it to whether the queue was empty until then
+		 */
+		bool push(unsigned char *buf, unsigned int len, uint64_t rx_stamp = 0, bool *was_empty = NULL)
+		{
+			struct frame_desc d = { buf, len, rx_stamp };
+			ProfiledMutex::Lock _l(_m);
+			if(was_empty)
+				*was_empty = !q.count();
+			return q.write(&d, 1) == 1;
+		}
+
+		/*
+		 * Enqueues as many of the n frames as will fit under a single lock acquisition, returns
+		 * the number enqueued (ownership of the rest stays with the caller). was_empty as above
+		 */
+		size_t push(const struct frame_desc *in, size_t n, bool *was_empty = NULL)
+		{
+			ProfiledMutex::Lock _l(_m);
+			if(was_empty)
+				*was_empty = !q.count();
+			return q.write(in, n);
+		}
+
+		/*
+		 * Dequeues up to max frames into out, returns the number dequeued
+		 */
+		size_t pop(struct frame_desc *out, size_t max)
+		{
+			ProfiledMutex::Lock _l(_m);
+			return q.read(out, max);
+		}
+
+		size_t count()
+		{
+			ProfiledMutex::Lock _l(_m);
+			return q.count();
+		}
+	};
+
+	/*
+	 * Lock-free single-producer single-consumer ring of frame descriptors. Several producers
+	 * (or consumers) are fine as long as something else serializes them, such as a stack's lock
+	 */
+	class FrameRing
+	{
+	private:
+		struct frame_desc *q;
+		size_t mask;
+		// Free-running, only the producer writes tail and only the consumer writes head. Padded
+		// onto cache lines of their own by hand, alignas() would over-align SocketTap (C++11 new)
+		char _pad0[64];
+		std::atomic<size_t> head;
+		char _pad1[64 - sizeof(size_t)];
+		std::atomic<size_t> tail;
+		char _pad2[64 - sizeof(size_t)];
+
+	public:
+		/*
+		 * Holds cap frames, rounded up to a power of two
+		 */
+		explicit FrameRing(size_t cap)
+			: head(0),
+			tail(0)
+		{
+			size_t sz = 1;
+			while(sz < cap)
+				sz <<= 1;
+			mask = sz - 1;
+			q = new struct frame_desc[sz];
+		}
+
+		~FrameRing()
+		{
+			for(size_t i=head; i!=tail; i++)
+				FramePool::release(q[i & mask].buf);
+			delete[] q;
+		}
+
+		/*
+		 * Producer: enqueues a frame, returns false (and leaves ownership with the caller) if full
+		 */
+		bool push(unsigned char *buf, unsigned int len)
+		{
+			size_t t = tail.load(std::memory_order_relaxed);
+			if(t - head.load(std::memory_order_acquire) > mask)
+				return false;
+			q[t & mask].buf = buf;
+			q[t & mask].len = len;
+			tail.store(t + 1, std::memory_order_release);
+			return true;
+		}
+
+		/*
+		 * Consumer: dequeues up to max frames into out, returns the number dequeued
+		 */
+		size_t pop(struct frame_desc *out, size_t max)
+		{
+			size_t h = head.load(std::memory_order_relaxed);
+			size_t cnt = std::min(max, tail.load(std::memory_order_acquire) - h);
+			for(size_t i=0; i<cnt; i++)
+				out[i] = q[(h + i) & mask];
+			head.store(h + cnt, std::memory_order_release);
+			return cnt;
+		}
+
+		size_t count() const
+		{
+			return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+		}
+	};
+}
+
+#endif // ZT_FRAMEPOOL_HPP
@@ -0,0 +1,181 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "InetAddress.hpp"
+
+#include "HttpControlPlane.hpp"
+#include "PowerMode.hpp"
+#include "libzt.h"
+
+// Requests are tiny, anything bigger than this isn't a scrape
+#define ZT_HTTP_MAX_REQUEST_SZ 8192
+
+namespace ZeroTier {
+
+	static HttpControlPlane *instance = NULL;
+	static Mutex instance_m;
+
+	HttpControlPlane::HttpControlPlane() :
+		_phy(this,false,true),
+		_listener((PhySocket *)0),
+		_run(true)
+	{
+	}
+
+	HttpControlPlane::~HttpControlPlane()
+	{
+		_run = false;
+		_phy.whack();
+		Thread::join(_thread);
+	}
+
+	bool HttpControlPlane::start(const char *addr, int port)
+	{
+		Mutex::Lock _l(instance_m);
+		if(instance)
+			return true;
+		InetAddress bindaddr(addr);
+		bindaddr.setPort(port);
+		HttpControlPlane *cp = new HttpControlPlane();
+		cp->_listener = cp->_phy.tcpListen((const struct sockaddr *)&bindaddr, (void *)0);
+		if(!cp->_listener) {
+			DEBUG_ERROR("unable to listen on %s:%d", addr, port);
+			cp->_run = false;
+			delete cp;
+			return false;
+		}
+		cp->_thread = Thread::start(cp);
+		instance = cp;
+		DEBUG_INFO("serving /metrics and /connections on %s:%d", addr, port);
+		return true;
+	}
+
+	void HttpControlPlane::stop()
+	{
+		HttpControlPlane *cp;
+		{
+			Mutex::Lock _l(instance_m);
+			cp = instance;
+			instance = NULL;
+		}
+		// Phy closes the listener and any open connections when it's destroyed
+		delete cp;
+	}
+
+	void HttpControlPlane::threadMain()
+		throw()
+	{
+		while(_run)
+			_phy.poll(PowerMode::align(PowerMode::maxInterval()));
+	}
+
+	void HttpControlPlane::respond(PhySocket *sock, HttpConnection *hc)
+	{
+		std::string body, status, type = "text/plain; charset=utf-8";
+		size_t sp1 = hc->req.find(' ');
+		size_t sp2 = sp1 == std::string::npos ? sp1 : hc->req.find(' ', sp1 + 1);
+		if(sp2 == std::string::npos) {
+			status = "400 Bad Request";
+		}
+		else {
+			std::string method = hc->req.substr(0, sp1);
+			std::string path = hc->req.substr(sp1 + 1, sp2 - sp1 - 1);
+			path = path.substr(0, path.find('?'));
+			if(path != "/metrics" && path != "/connections") {
+				status = "404 Not Found";
+			}
+			else if(method != "GET" && method != "HEAD") {
+				status = "405 Method Not Allowed";
+			}
+			else if(path == "/connections") {
+				status = "200 OK";
+				if(method == "GET")
+					body = connectionsText();
+			}
+			else {
+				status = "200 OK";
+				type = "application/openmetrics-text; version=1.0.0; charset=utf-8";
+				if(method == "GET")
+					body = metricsText();
+			}
+		}
+		if(status[0] != '2')
+			body = status + "\n";
+		char hdr[256];
+		snprintf(hdr, sizeof(hdr), "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %lu\r\n"
+			"Connection: close\r\n\r\n", status.c_str(), type.c_str(), (unsigned long)body.length());
+		hc->resp = hdr + body;
+		hc->sent = 0;
+		_phy.setNotifyWritable(sock, true);
+	}
+
+	void HttpControlPlane::phyOnTcpAccept(PhySocket *sockL,PhySocket *sockN,void **uptrL,void **uptrN,
+		const struct sockaddr *from)
+	{
+		HttpConnection *hc = new HttpConnection();
+		hc->sent = 0;
+		*uptrN = (void *)hc;
+	}
+
+	void HttpControlPlane::phyOnTcpClose(PhySocket *sock,void **uptr)
+	{
+		delete (HttpConnection *)*uptr;
+		*uptr = (void *)0;
+	}
+
+	void HttpControlPlane::phyOnTcpData(PhySocket *sock,void **uptr,void *data,unsigned long len)
+	{
+		HttpConnection *hc = (HttpConnection *)*uptr;
+		if(!hc || hc->resp.length()) // already answering, ignore anything pipelined
+			return;
+		hc->req.append((const char *)data, len);
+		if(hc->req.find("\r\n\r\n") != std::string::npos || hc->req.find("\n\n") != std::string::npos)
+			respond(sock, hc);
+		else if(hc->req.length() > ZT_HTTP_MAX_REQUEST_SZ)
+			_phy.close(sock);
+	}
+
+	void HttpControlPlane::phyOnTcpWritable(PhySocket *sock,void **uptr)
+	{
+		HttpConnection *hc = (HttpConnection *)*uptr;
+		if(!hc)
+			return;
+		if(hc->sent < hc->resp.length()) {
+			long n = _phy.streamSend(sock, hc->resp.data() + hc->sent, hc->resp.length() - hc->sent);
+			if(n < 0) // Phy has already closed sock (and deleted hc)
+				return;
+			hc->sent += n;
+		}
+		if(hc->sent >= hc->resp.length())
+			_phy.close(sock);
+	}
+
+} // namespace ZeroTier
@@ -0,0 +1,111 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+// A minimal HTTP server for scraping libzt's counters (see zts_enable_http_control_plane())
+
+#ifndef ZT_HTTPCONTROLPLANE_HPP
+#define ZT_HTTPCONTROLPLANE_HPP
+
+#include <string>
+
+#include "Mutex.hpp"
+#include "Thread.hpp"
+#include "Phy.hpp"
+
+namespace ZeroTier {
+
+	/*
+	 * Renders the OpenMetrics text served at /metrics, implemented in libzt.cpp
+	 */
+	std::string metricsText();
+
+	/*
+	 * Renders the ss-like table of zts_dump_connections() served at /connections, implemented
+	 * in libzt.cpp
+	 */
+	std::string connectionsText();
+
+	/*
+	 * Runs its own Phy loop on a host socket so that scraping never touches a stack thread
+	 */
+	class HttpControlPlane
+	{
+		friend class Phy<HttpControlPlane *>;
+
+	public:
+		/*
+		 * Starts serving on addr:port, returns false if the port couldn't be bound. Calling
+		 * start() while already serving does nothing
+		 */
+		static bool start(const char *addr, int port);
+
+		static void stop();
+
+		void threadMain()
+			throw();
+
+	private:
+		HttpControlPlane();
+		~HttpControlPlane();
+
+		/*
+		 * One request is read and answered per connection (no keep-alive)
+		 */
+		struct HttpConnection
+		{
+			std::string req;
+			std::string resp;
+			size_t sent;
+		};
+
+		void respond(PhySocket *sock, HttpConnection *hc);
+
+		Phy<HttpControlPlane *> _phy;
+		PhySocket *_listener;
+		volatile bool _run;
+		Thread _thread;
+
+		/****************************************************************************/
+		/* Phy callbacks                                                            */
+		/****************************************************************************/
+
+		void phyOnTcpAccept(PhySocket *sockL,PhySocket *sockN,void **uptrL,void **uptrN,
+			const struct sockaddr *from);
+		void phyOnTcpClose(PhySocket *sock,void **uptr);
+		void phyOnTcpData(PhySocket *sock,void **uptr,void *data,unsigned long len);
+		void phyOnTcpWritable(PhySocket *sock,void **uptr);
+
+		void phyOnDatagram(PhySocket *sock,void **uptr,const struct sockaddr *local_address, 
+			const struct sockaddr *from,void *data,unsigned long len) {}
+		void phyOnTcpConnect(PhySocket *sock,void **uptr,bool success) {}
+		void phyOnUnixClose(PhySocket *sock,void **uptr) {}
+		void phyOnUnixData(PhySocket *sock,void **uptr,void *data,ssize_t len) {}
+		void phyOnUnixWritable(PhySocket *sock,void **uptr,bool stack_invoked) {}
+	};
+
+} // namespace ZeroTier
+
+#endif // ZT_HTTPCONTROLPLANE_HPP
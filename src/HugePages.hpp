@@ -0,0 +1,124 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+
+// Backing for libzt's large, long-lived buffers (frame pools, the stack arena's reservation),
+// see zts_stack_config.hugepages and prefault
+
+#ifndef ZT_HUGEPAGES_HPP
+#define ZT_HUGEPAGES_HPP
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "libzt.h"
+
+// Transparent and hugetlbfs huge pages are 2 MiB on every platform libzt runs them on
+#define ZT_HUGE_PAGE_SZ (2 * 1024 * 1024)
+
+namespace ZeroTier {
+
+	struct huge_region
+	{
+		void *ptr;
+		size_t len;  // mapped length, 0 if ptr came from malloc()
+	};
+
+	// Writes to every base page of [p, p + len), whether or not huge pages were granted
+	static inline void huge_touch(void *p, size_t len)
+	{
+		long pg = sysconf(_SC_PAGESIZE);
+		for(size_t i=0; i<len; i+=pg > 0 ? pg : 4096)
+			((volatile unsigned char *)p)[i] = 0;
+	}
+
+	/*
+	 * Allocates sz bytes according to policy (a ZTS_HUGEPAGES_* value), falling back from hugetlbfs
+	 * to transparent huge pages to malloc() as each proves unavailable. With prefault set every
+	 * page is touched before returning so that later accesses never take a fault
+	 */
+	static inline void *huge_alloc(struct huge_region *r, size_t sz, int policy, bool prefault)
+	{
+		r->ptr = NULL;
+		r->len = 0;
+#if defined(__linux__)
+		size_t len = (sz + ZT_HUGE_PAGE_SZ - 1) & ~((size_t)ZT_HUGE_PAGE_SZ - 1);
+#if defined(MAP_HUGETLB)
+		if(policy == ZTS_HUGEPAGES_TLB) {
+			// Reserved pages are faulted in by MAP_POPULATE all at once
+			void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (prefault ? MAP_POPULATE : 0), -1, 0);
+			if(p != MAP_FAILED) {
+				r->ptr = p;
+				r->len = len;
+				return p;
+			}
+		}
+#endif
+#if defined(MADV_HUGEPAGE)
+		if(policy != ZTS_HUGEPAGES_OFF) {
+			// Over-map by a page so the region can be trimmed to a huge page boundary
+			unsigned char *p = (unsigned char *)mmap(NULL, len + ZT_HUGE_PAGE_SZ,
+				PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if(p != MAP_FAILED) {
+				unsigned char *a = (unsigned char *)(((uintptr_t)p + ZT_HUGE_PAGE_SZ - 1) & ~((uintptr_t)ZT_HUGE_PAGE_SZ - 1));
+				if(a > p)
+					munmap(p, a - p);
+				if(a + len < p + len + ZT_HUGE_PAGE_SZ)
+					munmap(a + len, (p + len + ZT_HUGE_PAGE_SZ) - (a + len));
+				madvise(a, len, MADV_HUGEPAGE);
+				if(prefault)
+					huge_touch(a, len);
+				r->ptr = a;
+				r->len = len;
+				return a;
+			}
+		}
+#endif
+#endif
+		r->ptr = malloc(sz);
+		if(r->ptr && prefault)
+			huge_touch(r->ptr, sz);
+		return r->ptr;
+	}
+
+	static inline void huge_free(struct huge_region *r)
+	{
+		if(r->len)
+			munmap(r->ptr, r->len);
+		else
+			free(r->ptr);
+		r->ptr = NULL;
+		r->len = 0;
+	}
+
+} // namespace ZeroTier
+
+#endif // ZT_HUGEPAGES_HPP
@@ -0,0 +1,208 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+#include <string.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "Identity.hpp"
+
+#include "IdentityPool.hpp"
+#include "libzt.h"
+
+namespace ZeroTier {
+namespace IdentityPool {
+
+	/*
+	 * Never destroyed, searches may still be running while the process exits
+	 */
+	struct pool
+	{
+		std::mutex m;
+		std::deque<std::string> ready;
+		int target;    // see fill()
+		int threads;
+		int fillers;   // threads searching for fill()
+		int searching; // searches of theirs under way
+		zts_identity_progress_cb cb;
+		void *arg;
+		pool() : target(0), threads(0), fillers(0), searching(0), cb(NULL), arg(NULL) {}
+	};
+
+	static pool &get()
+	{
+		static pool *p = new pool();
+		return *p;
+	}
+
+	static std::string search()
+	{
+		Identity id;
+		id.generate();
+		char buf[ZT_IDENTITY_STRING_BUFFER_LENGTH];
+		id.toString(true, buf);
+		std::string secret(buf);
+		memset(buf, 0, sizeof(buf));
+		return secret;
+	}
+
+	static int add_locked(pool &p, const std::string &secret)
+	{
+		if(p.ready.size() < ZT_IDENTITY_POOL_MAX)
+			p.ready.push_back(secret);
+		return (int)p.ready.size();
+	}
+
+	static void spawn_locked(pool &p);
+
+	static void filler()
+	{
+		pool &p = get();
+		for(;;) {
+			{
+				std::lock_guard<std::mutex> _l(p.m);
+				if((int)p.ready.size() + p.searching >= p.target) {
+					p.fillers--;
+					return;
+				}
+				p.searching++;
+			}
+			std::string secret = search();
+			zts_identity_progress_cb cb;
+			void *arg;
+			int n, target;
+			{
+				std::lock_guard<std::mutex> _l(p.m);
+				p.searching--;
+				n = add_locked(p, secret);
+				target = p.target;
+				cb = p.cb;
+				arg = p.arg;
+			}
+			if(cb)
+				cb(n, target, arg);
+		}
+	}
+
+	// Starts as many fillers as are missing, up to p.threads
+	static void spawn_locked(pool &p)
+	{
+		int missing = p.target - (int)p.ready.size() - p.searching;
+		while(missing-- > 0 && p.fillers < p.threads) {
+			p.fillers++;
+			std::thread(filler).detach();
+		}
+	}
+
+	static int cpus(int threads)
+	{
+		if(threads <= 0)
+			threads = (int)std::thread::hardware_concurrency();
+		return std::min(std::max(threads, 1), ZT_IDENTITY_POOL_MAX);
+	}
+
+	bool take(std::string &secret)
+	{
+		pool &p = get();
+		std::lock_guard<std::mutex> _l(p.m);
+		if(p.ready.empty())
+			return false;
+		secret = p.ready.front();
+		p.ready.pop_front();
+		spawn_locked(p);
+		return true;
+	}
+
+	/*
+	 * The searches started by one generate(), the first to finish is its caller's
+	 */
+	struct request
+	{
+		std::mutex m;
+		std::condition_variable cv;
+		std::string secret;
+		bool done;
+		request() : done(false) {}
+	};
+
+	std::string generate(int threads)
+	{
+		std::string secret;
+		if(take(secret))
+			return secret;
+		threads = cpus(threads);
+		if(threads == 1)
+			return search();
+		std::shared_ptr<request> r(new request());
+		for(int i=0; i<threads; i++) {
+			std::thread([r]() {
+				std::string s = search();
+				{
+					std::lock_guard<std::mutex> _l(r->m);
+					if(!r->done) {
+						r->secret = s;
+						r->done = true;
+						r->cv.notify_all();
+						return;
+					}
+				}
+				pool &p = get();
+				std::lock_guard<std::mutex> _l(p.m);
+				add_locked(p, s);
+			}).detach();
+		}
+		std::unique_lock<std::mutex> l(r->m);
+		r->cv.wait(l, [&r]() { return r->done; });
+		return r->secret;
+	}
+
+	void fill(int count, int threads, zts_identity_progress_cb cb, void *arg)
+	{
+		pool &p = get();
+		std::lock_guard<std::mutex> _l(p.m);
+		p.target = std::min(std::max(count, 0), ZT_IDENTITY_POOL_MAX);
+		p.threads = cpus(threads);
+		p.cb = cb;
+		p.arg = arg;
+		spawn_locked(p);
+	}
+
+	int size()
+	{
+		pool &p = get();
+		std::lock_guard<std::mutex> _l(p.m);
+		return (int)p.ready.size();
+	}
+
+} // namespace IdentityPool
+} // namespace ZeroTier
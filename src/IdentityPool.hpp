@@ -0,0 +1,67 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// Identities generated on several threads at once, and ahead of time
+//
+// Identity::generate() searches for a key pair whose memory-hard hash meets the address
+// criterion, each attempt being independent of the others. Searching on n threads at once
+// finds the first identity about n times sooner, the searches which finish after it aren't
+// wasted but kept in a pool (of up to ZT_IDENTITY_POOL_MAX) from which later requests, and a
+// service starting without an identity, are served at once
+
+#ifndef ZT_IDENTITYPOOL_HPP
+#define ZT_IDENTITYPOOL_HPP
+
+#include <string>
+
+#include "libzt.h"
+
+namespace ZeroTier {
+namespace IdentityPool {
+
+	/*
+	 * Takes an identity (secret form) from the pool, false if it's empty
+	 */
+	bool take(std::string &secret);
+
+	/*
+	 * take(), or else the first of threads searches (0 for one per CPU) to finish
+	 */
+	std::string generate(int threads);
+
+	/*
+	 * Keeps the pool topped up to count (0 stops) by searching in the background on up to
+	 * threads threads, cb (which may be NULL) is called on them as each identity is added
+	 */
+	void fill(int count, int threads, zts_identity_progress_cb cb, void *arg);
+
+	int size();
+
+} // namespace IdentityPool
+} // namespace ZeroTier
+
+#endif // ZT_IDENTITYPOOL_HPP
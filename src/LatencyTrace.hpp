@@ -0,0 +1,150 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// Sampled per-stage latencies of the data path, see zts_get_latency_stats()
+
+#ifndef ZT_LATENCYTRACE_HPP
+#define ZT_LATENCYTRACE_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <atomic>
+
+#include "libzt.h"
+#include "Stats.hpp"
+
+namespace ZeroTier {
+
+	class LatencyTrace
+	{
+	private:
+		std::atomic<uint32_t> every;
+		LatencyHistogram hist[ZTS_LATENCY_COUNT];
+		std::atomic<uint64_t> samples[ZTS_LATENCY_COUNT];
+		std::atomic<uint64_t> max[ZTS_LATENCY_COUNT];
+
+	public:
+		LatencyTrace() : every(0) { reset(); }
+
+		static uint64_t now_ns()
+		{
+			struct timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+		}
+
+		/*
+		 * Whether the caller is to trace what it is handling: every n-th call on each thread,
+		 * never while sampling is off (the default)
+		 */
+		bool sample()
+		{
+			uint32_t n = every.load(std::memory_order_relaxed);
+			if(!n)
+				return false;
+			static thread_local uint32_t calls = 0;
+			return ++calls % n == 0;
+		}
+
+		void setSampling(uint32_t n) { every.store(n, std::memory_order_relaxed); }
+
+		// Adds the time since since (from now_ns()) to stage
+		void record(int stage, uint64_t since)
+		{
+			uint64_t ns = now_ns() - since;
+			hist[stage].add(ns);
+			stat_add(samples[stage], 1);
+			stat_max(max[stage], ns);
+		}
+
+		void snapshot(int stage, struct zts_latency_stats *s) const
+		{
+			static const char *names[ZTS_LATENCY_COUNT] = { "tx_buf", "tx_queue", "wire", "rx_queue", "rx_buf" };
+			memset(s, 0, sizeof(*s));
+			strncpy(s->name, names[stage], sizeof(s->name) - 1);
+			s->samples = stat_get(samples[stage]);
+			s->p50_ns = hist[stage].percentile(0.50);
+			s->p90_ns = hist[stage].percentile(0.90);
+			s->p99_ns = hist[stage].percentile(0.99);
+			s->p999_ns = hist[stage].percentile(0.999);
+			s->max_ns = stat_get(max[stage]);
+		}
+
+		void reset()
+		{
+			for(int i=0; i<ZTS_LATENCY_COUNT; i++) {
+				hist[i].reset();
+				samples[i] = 0;
+				max[i] = 0;
+			}
+		}
+	};
+
+	extern LatencyTrace latencyTrace;
+
+	/*
+	 * Traces one position of a byte stream (TXbuf or RXbuf) at a time. The producer marks where
+	 * the bytes it has just queued end, the consumer records how long they waited once it has
+	 * taken everything up to there. Each side is only ever called by its own thread
+	 */
+	struct StreamMark
+	{
+		std::atomic<uint64_t> ns; // when pos was marked, 0 while nothing is
+		size_t pos;
+
+		StreamMark() : ns(0), pos(0) {}
+
+		void reset()
+		{
+			ns = 0;
+			pos = 0;
+		}
+
+		// Producer, total is how much it has queued in all
+		void produced(size_t total)
+		{
+			if(ns.load(std::memory_order_acquire) || !latencyTrace.sample())
+				return;
+			pos = total;
+			ns.store(LatencyTrace::now_ns(), std::memory_order_release);
+		}
+
+		// Consumer, total is how much it has taken in all
+		void consumed(size_t total, int stage)
+		{
+			uint64_t t = ns.load(std::memory_order_acquire);
+			if(!t || total < pos)
+				return;
+			latencyTrace.record(stage, t);
+			ns.store(0, std::memory_order_release);
+		}
+	};
+}
+
+#endif // ZT_LATENCYTRACE_HPP
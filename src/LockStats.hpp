@@ -0,0 +1,188 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// Hold and wait times of the library's most contended locks, see zts_get_lock_stats()
+
+#ifndef ZT_LOCKSTATS_HPP
+#define ZT_LOCKSTATS_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <atomic>
+#include <mutex>
+
+#include "libzt.h"
+#include "Stats.hpp"
+
+namespace ZeroTier {
+
+	/*
+	 * What is known about one lock (or one kind of lock, such as every tap's _tcpconns_m)
+	 */
+	class LockProfile
+	{
+	private:
+		LatencyHistogram hold;
+		LatencyHistogram wait;
+		std::atomic<uint64_t> acquisitions;
+		std::atomic<uint64_t> contended;
+		std::atomic<uint64_t> hold_max;
+		std::atomic<uint64_t> wait_max;
+
+	public:
+		LockProfile() { reset(); }
+
+		void acquired(uint64_t wait_ns, bool was_contended)
+		{
+			acquisitions.fetch_add(1, std::memory_order_relaxed);
+			if(was_contended)
+				contended.fetch_add(1, std::memory_order_relaxed);
+			wait.add(wait_ns);
+			stat_max(wait_max, wait_ns);
+		}
+
+		void released(uint64_t hold_ns)
+		{
+			hold.add(hold_ns);
+			stat_max(hold_max, hold_ns);
+		}
+
+		void snapshot(struct zts_lock_stats *s) const
+		{
+			memset(s, 0, sizeof(*s));
+			s->acquisitions = acquisitions.load(std::memory_order_relaxed);
+			s->contended = contended.load(std::memory_order_relaxed);
+			s->hold_p50_ns = hold.percentile(0.50);
+			s->hold_p99_ns = hold.percentile(0.99);
+			s->hold_p999_ns = hold.percentile(0.999);
+			s->hold_max_ns = hold_max.load(std::memory_order_relaxed);
+			s->wait_p50_ns = wait.percentile(0.50);
+			s->wait_p99_ns = wait.percentile(0.99);
+			s->wait_p999_ns = wait.percentile(0.999);
+			s->wait_max_ns = wait_max.load(std::memory_order_relaxed);
+		}
+
+		/*
+		 * Not synchronized with lockers, counts taken meanwhile may land either side of it
+		 */
+		void reset()
+		{
+			hold.reset();
+			wait.reset();
+			acquisitions = 0;
+			contended = 0;
+			hold_max = 0;
+			wait_max = 0;
+		}
+	};
+
+	extern LockProfile lockProfiles[ZTS_LOCK_COUNT];
+
+	inline const char *lock_name(int id)
+	{
+		static const char *names[ZTS_LOCK_COUNT] = {
+			"multiplexer", "vtaps", "tcpconns", "tap_ips", "tap_multicast", "tap_reap",
+			"frame_rxq", "lwip_core", "epolls"
+		};
+		return id >= 0 && id < ZTS_LOCK_COUNT ? names[id] : "";
+	}
+
+	/*
+	 * A mutex which, with ZT_LOCK_STATS, times how long it is waited for and held and adds that
+	 * to lockProfiles[id]. Without it this is a plain std::mutex. Same interface as Mutex
+	 */
+	class ProfiledMutex
+	{
+	private:
+		std::mutex _m;
+#if defined(ZT_LOCK_STATS)
+		int _id;
+		uint64_t _t0; // when the current holder got it, only the holder touches it
+
+		static uint64_t now_ns()
+		{
+			struct timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+		}
+#endif
+
+		ProfiledMutex(const ProfiledMutex &);
+		ProfiledMutex &operator=(const ProfiledMutex &);
+
+	public:
+#if defined(ZT_LOCK_STATS)
+		explicit ProfiledMutex(int id) : _id(id), _t0(0) {}
+#else
+		explicit ProfiledMutex(int id) { (void)id; }
+#endif
+
+		void lock()
+		{
+#if defined(ZT_LOCK_STATS)
+			if(_m.try_lock()) {
+				_t0 = now_ns();
+				lockProfiles[_id].acquired(0, false);
+				return;
+			}
+			uint64_t t = now_ns();
+			_m.lock();
+			_t0 = now_ns();
+			lockProfiles[_id].acquired(_t0 - t, true);
+#else
+			_m.lock();
+#endif
+		}
+
+		void unlock()
+		{
+#if defined(ZT_LOCK_STATS)
+			uint64_t held = now_ns() - _t0;
+			_m.unlock();
+			lockProfiles[_id].released(held);
+#else
+			_m.unlock();
+#endif
+		}
+
+		class Lock
+		{
+		public:
+			Lock(ProfiledMutex &m) : _m(m) { _m.lock(); }
+			Lock(const ProfiledMutex &m) : _m(const_cast<ProfiledMutex &>(m)) { _m.lock(); }
+			~Lock() { _m.unlock(); }
+		private:
+			Lock(const Lock &);
+			Lock &operator=(const Lock &);
+			ProfiledMutex &_m;
+		};
+	};
+}
+
+#endif // ZT_LOCKSTATS_HPP
@@ -0,0 +1,152 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// Process-wide memory budget, see zts_stack_config.mem_limit_kb and zts_get_mem_stats()
+
+#ifndef ZT_MEMBUDGET_HPP
+#define ZT_MEMBUDGET_HPP
+
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+
+#include "libzt.h"
+
+namespace ZeroTier {
+
+	/*
+	 * Socket buffers, frame pools and the stacks' arena charge what they take from the heap
+	 * here and credit it once it's given back. Hard charges fail past the limit (the caller
+	 * behaves as if it were out of memory), soft ones are only counted. May be used from any
+	 * thread
+	 */
+	class MemBudget
+	{
+	private:
+		struct state
+		{
+			std::atomic<uint64_t> limit;
+			std::atomic<uint64_t> used;
+			std::atomic<uint64_t> peak;
+			std::atomic<uint64_t> by_class[ZTS_MEM_CLASSES];
+			std::atomic<uint64_t> refused;
+			std::atomic<uint64_t> sockets_refused;
+			std::atomic<uint64_t> shrinks;
+			state() : limit(0), used(0), peak(0), refused(0), sockets_refused(0), shrinks(0)
+			{
+				for(int i=0; i<ZTS_MEM_CLASSES; i++)
+					by_class[i] = 0;
+			}
+		};
+
+		// Shared by every translation unit, and usable by static objects while the process exits
+		static state &get()
+		{
+			static state *s = new state();
+			return *s;
+		}
+
+	public:
+		// Bytes, 0 for no limit. Applied by zts_start(), what's already allocated stays charged
+		static void setLimit(uint64_t limit)
+		{
+			get().limit.store(limit, std::memory_order_relaxed);
+		}
+
+		static bool charge(int cls, size_t n, bool hard = true)
+		{
+			state &s = get();
+			uint64_t limit = s.limit.load(std::memory_order_relaxed);
+			uint64_t used = s.used.fetch_add(n, std::memory_order_relaxed) + n;
+			if(hard && limit && used > limit) {
+				s.used.fetch_sub(n, std::memory_order_relaxed);
+				s.refused.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+			s.by_class[cls].fetch_add(n, std::memory_order_relaxed);
+			uint64_t peak = s.peak.load(std::memory_order_relaxed);
+			while(used > peak && !s.peak.compare_exchange_weak(peak, used, std::memory_order_relaxed)) { }
+			return true;
+		}
+
+		static void credit(int cls, size_t n)
+		{
+			state &s = get();
+			s.used.fetch_sub(n, std::memory_order_relaxed);
+			s.by_class[cls].fetch_sub(n, std::memory_order_relaxed);
+		}
+
+		// Past ZT_MEM_PRESSURE_PCT of the limit
+		static bool pressure()
+		{
+			state &s = get();
+			uint64_t limit = s.limit.load(std::memory_order_relaxed);
+			return limit && s.used.load(std::memory_order_relaxed) >= limit / 100 * ZT_MEM_PRESSURE_PCT;
+		}
+
+		// Most a socket buffer may hold right now, see ZT_MEM_PRESSURE_BUF_SZ
+		static size_t bufCap()
+		{
+			return pressure() ? (size_t)ZT_MEM_PRESSURE_BUF_SZ : (size_t)-1;
+		}
+
+		// Whether a new socket may be created, counts the refusal if it may not
+		static bool admitSocket()
+		{
+			state &s = get();
+			uint64_t limit = s.limit.load(std::memory_order_relaxed);
+			if(!limit || s.used.load(std::memory_order_relaxed) < limit / 100 * ZT_MEM_REFUSE_PCT)
+				return true;
+			s.sockets_refused.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+
+		// Counts a housekeeping pass which released memory because of pressure()
+		static void shrunk()
+		{
+			get().shrinks.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		static void stats(struct zts_mem_stats *stats)
+		{
+			state &s = get();
+			memset(stats, 0, sizeof(*stats));
+			stats->limit = s.limit.load(std::memory_order_relaxed);
+			stats->used = s.used.load(std::memory_order_relaxed);
+			stats->peak = s.peak.load(std::memory_order_relaxed);
+			for(int i=0; i<ZTS_MEM_CLASSES; i++)
+				stats->by_class[i] = s.by_class[i].load(std::memory_order_relaxed);
+			stats->refused = s.refused.load(std::memory_order_relaxed);
+			stats->sockets_refused = s.sockets_refused.load(std::memory_order_relaxed);
+			stats->shrinks = s.shrinks.load(std::memory_order_relaxed);
+			stats->pressure = pressure();
+		}
+	};
+
+} // namespace ZeroTier
+
+#endif // ZT_MEMBUDGET_HPP
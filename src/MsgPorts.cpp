@@ -0,0 +1,407 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+
+
+#include <errno.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+
+#include "MsgPorts.hpp"
+
+// After the Ethernet header: [type][flags][dst port, 16 bits][src port][0, 16 bits]
+// [seq, 32 bits][ack, 32 bits] in network byte order, then the message. An ACK frame's
+// payload holds more acknowledged seqs, 32 bits each, after the one in the header
+#define ZT_MSG_DATA            0
+#define ZT_MSG_ACK             1
+#define ZT_MSG_F_RELIABLE      0x01 // to be acknowledged
+#define ZT_MSG_F_ACK           0x02 // ack holds a seq acknowledged
+
+#define ZT_MSG_ACKS_PER_FRAME  256
+#define ZT_MSG_REMOTE_IDLE     60000 // ms, a peer's port is forgotten after this long unheard from
+
+namespace ZeroTier {
+
+	MsgPorts::MsgPorts(uint64_t nwid, Output out) :
+		_nwid(nwid),
+		_out(out),
+		_next_port(ZT_EPHEMERAL_PORT_MIN),
+		_run(false)
+	{
+	}
+
+	MsgPorts::~MsgPorts()
+	{
+		{
+			std::lock_guard<std::mutex> _l(_m);
+			_run = false;
+			_cv.notify_all();
+		}
+		if(_timer.joinable())
+			_timer.join();
+	}
+
+	int64_t MsgPorts::now()
+	{
+		return std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	void MsgPorts::header(unsigned char *h, int type, int flags, uint16_t dport, uint16_t sport,
+		uint32_t seq, uint32_t ack)
+	{
+		h[0] = type;
+		h[1] = flags;
+		h[2] = dport >> 8;
+		h[3] = dport;
+		h[4] = sport >> 8;
+		h[5] = sport;
+		h[6] = h[7] = 0;
+		for(int i=0; i<4; i++) {
+			h[8 + i] = seq >> (24 - 8 * i);
+			h[12 + i] = ack >> (24 - 8 * i);
+		}
+	}
+
+	static uint32_t be32(const unsigned char *p)
+	{
+		return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+	}
+
+	bool MsgPorts::fresh(Remote &r, uint32_t seq)
+	{
+		const uint32_t w = ZT_MSG_UNACKED_MAX;
+		int32_t d = (int32_t)(seq - r.top);
+		// Further back than the sender could still be resending: it started over
+		if(!r.top || d <= -(int32_t)w) {
+			memset(r.seen, 0, sizeof(r.seen));
+			d = 0;
+		}
+		else if(d > 0) {
+			if((uint32_t)d >= w)
+				memset(r.seen, 0, sizeof(r.seen));
+			else {
+				for(uint32_t s=r.top+1; s!=seq; s++)
+					r.seen[(s % w) / 64] &= ~(1ULL << (s % 64));
+			}
+		}
+		else if(r.seen[(seq % w) / 64] & (1ULL << (seq % 64)))
+			return false;
+		if(d >= 0)
+			r.top = seq;
+		r.seen[(seq % w) / 64] |= 1ULL << (seq % 64);
+		return true;
+	}
+
+	int MsgPorts::bind(uint16_t *port, int sdk_fd)
+	{
+		std::lock_guard<std::mutex> _l(_m);
+		if(!*port) {
+			const int span = ZT_EPHEMERAL_PORT_MAX - ZT_EPHEMERAL_PORT_MIN + 1;
+			for(int i=0; i<span && !*port; i++) {
+				if(!_ports.count(_next_port))
+					*port = _next_port;
+				_next_port = _next_port == ZT_EPHEMERAL_PORT_MAX ? ZT_EPHEMERAL_PORT_MIN : _next_port + 1;
+			}
+			if(!*port) {
+				errno = EADDRINUSE;
+				return -1;
+			}
+		}
+		else if(_ports.count(*port)) {
+			errno = EADDRINUSE;
+			return -1;
+		}
+		Port &p = _ports[*port];
+		p.sdk_fd = sdk_fd;
+		p.reliable = false;
+		// Where a peer's receiver would notice a restarted sender, see fresh()
+		std::random_device rd;
+		p.next_seq = rd() | 1;
+		memset(&p.stats, 0, sizeof(p.stats));
+		return 0;
+	}
+
+	void MsgPorts::unbind(uint16_t port)
+	{
+		std::lock_guard<std::mutex> _l(_m);
+		_ports.erase(port);
+	}
+
+	void MsgPorts::setReliable(uint16_t port, bool reliable)
+	{
+		std::lock_guard<std::mutex> _l(_m);
+		std::unordered_map<uint16_t, Port>::iterator it = _ports.find(port);
+		if(it != _ports.end())
+			it->second.reliable = reliable;
+	}
+
+	ssize_t MsgPorts::send(uint16_t port, uint64_t node, uint16_t dport, const void *buf, size_t len,
+		unsigned int mtu)
+	{
+		std::string frame;
+		{
+			std::lock_guard<std::mutex> _l(_m);
+			std::unordered_map<uint16_t, Port>::iterator it = _ports.find(port);
+			if(it == _ports.end()) {
+				errno = ENOTCONN;
+				return -1;
+			}
+			if(len + ZT_MSG_HDR_LEN > mtu) {
+				errno = EMSGSIZE;
+				return -1;
+			}
+			Port &p = it->second;
+			if(p.reliable && p.unacked.size() >= ZT_MSG_UNACKED_MAX) {
+				errno = ENOBUFS;
+				return -1;
+			}
+			int flags = 0;
+			uint32_t seq = 0, ack = 0;
+			if(p.reliable) {
+				flags |= ZT_MSG_F_RELIABLE;
+				if(!(seq = p.next_seq++))
+					seq = p.next_seq++;
+			}
+			// An ack owed to the port we're sending to goes along
+			std::unordered_map<uint64_t, Remote>::iterator r = p.remotes.find(node << 16 | dport);
+			if(r != p.remotes.end() && r->second.acks.size()) {
+				ack = r->second.acks.back();
+				r->second.acks.pop_back();
+				if(r->second.acks.empty())
+					r->second.ack_due = 0;
+				flags |= ZT_MSG_F_ACK;
+				p.stats.acks_piggybacked++;
+			}
+			frame.resize(ZT_MSG_HDR_LEN + len);
+			header((unsigned char *)&frame[0], ZT_MSG_DATA, flags, dport, port, seq, ack);
+			if(len)
+				memcpy(&frame[ZT_MSG_HDR_LEN], buf, len);
+			if(p.reliable) {
+				Unacked u;
+				u.seq = seq;
+				u.node = node;
+				u.due = now() + ZT_MSG_RTO;
+				u.tries = 0;
+				u.frame = frame;
+				p.unacked.push_back(u);
+				if(!_timer.joinable()) {
+					_run = true;
+					_timer = std::thread(&MsgPorts::timerMain, this);
+				}
+				_cv.notify_all();
+			}
+			p.stats.sent++;
+		}
+		_out(node, frame.data(), (unsigned int)frame.size());
+		return len;
+	}
+
+	void MsgPorts::input(uint64_t node, const void *data, unsigned int len)
+	{
+		if(len < ZT_MSG_HDR_LEN)
+			return;
+		const unsigned char *h = (const unsigned char *)data;
+		int type = h[0], flags = h[1];
+		uint16_t dport = h[2] << 8 | h[3], sport = h[4] << 8 | h[5];
+		uint32_t seq = be32(h + 8), ack = be32(h + 12);
+		std::lock_guard<std::mutex> _l(_m);
+		std::unordered_map<uint16_t, Port>::iterator it = _ports.find(dport);
+		if(it == _ports.end())
+			return;
+		Port &p = it->second;
+		std::vector<uint32_t> acked;
+		if(flags & ZT_MSG_F_ACK)
+			acked.push_back(ack);
+		if(type == ZT_MSG_ACK) {
+			for(unsigned int off=ZT_MSG_HDR_LEN; off + 4 <= len; off += 4)
+				acked.push_back(be32(h + off));
+		}
+		for(size_t i=0; i<acked.size(); i++) {
+			for(std::deque<Unacked>::iterator u = p.unacked.begin(); u != p.unacked.end(); ++u) {
+				if(u->seq == acked[i] && u->node == node) {
+					p.unacked.erase(u);
+					break;
+				}
+			}
+		}
+		if(type != ZT_MSG_DATA)
+			return;
+		Remote *r = NULL;
+		if(flags & ZT_MSG_F_RELIABLE) {
+			std::unordered_map<uint64_t, Remote>::iterator ri = p.remotes.find(node << 16 | sport);
+			if(ri == p.remotes.end()) {
+				ri = p.remotes.insert(std::make_pair(node << 16 | sport, Remote())).first;
+				memset(ri->second.seen, 0, sizeof(ri->second.seen));
+				ri->second.top = 0;
+				ri->second.ack_due = 0;
+			}
+			r = &ri->second;
+			r->last = now();
+			if(!fresh(*r, seq)) {
+				// Our ack was lost or is still on its way, it's sent again
+				p.stats.duplicates++;
+				r->acks.push_back(seq);
+				if(!r->ack_due)
+					r->ack_due = r->last + ZT_MSG_ACK_DELAY;
+				r = NULL;
+			}
+		}
+		if(!(flags & ZT_MSG_F_RELIABLE) || r) {
+			struct zts_sockaddr_msg from;
+			memset(&from, 0, sizeof(from));
+			from.smsg_family = ZTS_AF_MSG;
+			from.smsg_port = htons(sport);
+			from.smsg_nwid = _nwid;
+			from.smsg_node = node;
+			struct iovec iov[2];
+			iov[0].iov_base = &from;
+			iov[0].iov_len = sizeof(from);
+			iov[1].iov_base = (void *)(h + ZT_MSG_HDR_LEN);
+			iov[1].iov_len = len - ZT_MSG_HDR_LEN;
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = 2;
+			if(sendmsg(p.sdk_fd, &msg, MSG_DONTWAIT) < 0) {
+				// Not acknowledged, so the sender tries again once there may be room
+				p.stats.dropped++;
+				if(r)
+					r->seen[(seq % ZT_MSG_UNACKED_MAX) / 64] &= ~(1ULL << (seq % 64));
+				return;
+			}
+			p.stats.received++;
+			if(r) {
+				r->acks.push_back(seq);
+				if(r->acks.size() >= ZT_MSG_ACKS_PER_FRAME)
+					r->ack_due = r->last;
+				else if(!r->ack_due)
+					r->ack_due = r->last + ZT_MSG_ACK_DELAY;
+			}
+		}
+		if(p.remotes.size() && !_timer.joinable()) {
+			_run = true;
+			_timer = std::thread(&MsgPorts::timerMain, this);
+		}
+		_cv.notify_all();
+	}
+
+	bool MsgPorts::stats(uint16_t port, struct zts_msg_stats *stats)
+	{
+		std::lock_guard<std::mutex> _l(_m);
+		std::unordered_map<uint16_t, Port>::iterator it = _ports.find(port);
+		if(it == _ports.end())
+			return false;
+		*stats = it->second.stats;
+		stats->unacked = (uint32_t)it->second.unacked.size();
+		return true;
+	}
+
+	int64_t MsgPorts::tick(std::vector<Out> &out)
+	{
+		int64_t t = now(), next = -1;
+		for(std::unordered_map<uint16_t, Port>::iterator it = _ports.begin(); it != _ports.end(); ++it) {
+			Port &p = it->second;
+			for(std::deque<Unacked>::iterator u = p.unacked.begin(); u != p.unacked.end(); ) {
+				if(u->due <= t) {
+					if(u->tries >= ZT_MSG_RETRIES) {
+						p.stats.lost++;
+						u = p.unacked.erase(u);
+						continue;
+					}
+					Out o;
+					o.node = u->node;
+					o.frame = u->frame;
+					out.push_back(o);
+					u->tries++;
+					u->due = t + ((int64_t)ZT_MSG_RTO << u->tries);
+					p.stats.retransmits++;
+				}
+				next = next < 0 ? u->due - t : std::min(next, u->due - t);
+				++u;
+			}
+			for(std::unordered_map<uint64_t, Remote>::iterator ri = p.remotes.begin(); ri != p.remotes.end(); ) {
+				Remote &r = ri->second;
+				if(r.ack_due && r.ack_due <= t) {
+					uint16_t rport = (uint16_t)ri->first;
+					while(r.acks.size()) {
+						size_t n = std::min(r.acks.size(), (size_t)ZT_MSG_ACKS_PER_FRAME);
+						Out o;
+						o.node = ri->first >> 16;
+						o.frame.resize(ZT_MSG_HDR_LEN + 4 * (n - 1));
+						unsigned char *h = (unsigned char *)&o.frame[0];
+						header(h, ZT_MSG_ACK, ZT_MSG_F_ACK, rport, it->first, 0, r.acks[0]);
+						for(size_t i=1; i<n; i++) {
+							for(int b=0; b<4; b++)
+								h[ZT_MSG_HDR_LEN + 4 * (i - 1) + b] = r.acks[i] >> (24 - 8 * b);
+						}
+						r.acks.erase(r.acks.begin(), r.acks.begin() + n);
+						out.push_back(o);
+						p.stats.acks_sent++;
+					}
+					r.ack_due = 0;
+				}
+				if(r.ack_due)
+					next = next < 0 ? r.ack_due - t : std::min(next, r.ack_due - t);
+				else if(t - r.last >= ZT_MSG_REMOTE_IDLE) {
+					ri = p.remotes.erase(ri);
+					continue;
+				}
+				++ri;
+			}
+		}
+		return next;
+	}
+
+	void MsgPorts::timerMain()
+	{
+		std::unique_lock<std::mutex> lk(_m);
+		while(_run) {
+			std::vector<Out> out;
+			int64_t next = tick(out);
+			if(out.size()) {
+				// Never into the core with _m held, its thread may be waiting on _m in input()
+				lk.unlock();
+				for(size_t i=0; i<out.size(); i++)
+					_out(out[i].node, out[i].frame.data(), (unsigned int)out[i].frame.size());
+				lk.lock();
+				continue;
+			}
+			// Idle remotes are looked at now and then even with nothing due
+			if(next < 0)
+				next = ZT_MSG_REMOTE_IDLE;
+			_cv.wait_for(lk, std::chrono::milliseconds(next));
+		}
+	}
+
+} // namespace ZeroTier
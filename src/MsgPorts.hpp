@@ -0,0 +1,150 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// A tap's ZT_SOCK_MSG ports: messages carried in frames of ZT_MSG_ETHERTYPE, with optional
+// acknowledgement and resending (see ZT_SO_MSG_RELIABLE)
+
+#ifndef ZT_MSGPORTS_HPP
+#define ZT_MSGPORTS_HPP
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "libzt.h"
+
+namespace ZeroTier {
+
+	class MsgPorts
+	{
+	public:
+		// Sends one frame's payload (header included) to a node on the tap's network
+		typedef std::function<void(uint64_t node, const void *data, unsigned int len)> Output;
+
+		MsgPorts(uint64_t nwid, Output out);
+
+		// Stops the timer thread, if one was started
+		~MsgPorts();
+
+		/*
+		 * Has messages to *port (host byte order, 0 picks a free one and sets it) delivered
+		 * to sdk_fd, each as a zts_sockaddr_msg followed by the message. Returns 0, or -1 with
+		 * errno set to EADDRINUSE
+		 */
+		int bind(uint16_t *port, int sdk_fd);
+
+		void unbind(uint16_t port);
+
+		void setReliable(uint16_t port, bool reliable);
+
+		/*
+		 * Sends len bytes from port to dport on node, returns len or -1 with errno set.
+		 * Messages longer than mtu - ZT_MSG_HDR_LEN fail with EMSGSIZE, reliable ones with
+		 * ZT_MSG_UNACKED_MAX awaiting acknowledgement with ENOBUFS
+		 */
+		ssize_t send(uint16_t port, uint64_t node, uint16_t dport, const void *buf, size_t len,
+			unsigned int mtu);
+
+		/*
+		 * A frame of ZT_MSG_ETHERTYPE from node, called from the core's thread
+		 */
+		void input(uint64_t node, const void *data, unsigned int len);
+
+		bool stats(uint16_t port, struct zts_msg_stats *stats);
+
+	private:
+		struct Unacked
+		{
+			uint32_t seq;
+			uint64_t node;
+			int64_t due;                   // ms
+			int tries;
+			std::string frame;
+		};
+
+		// What one port knows of a peer's port: messages seen (for duplicates), acks owed
+		struct Remote
+		{
+			uint32_t top;                  // highest seq seen, 0 if none
+			uint64_t seen[ZT_MSG_UNACKED_MAX / 64]; // by seq % ZT_MSG_UNACKED_MAX, the last that many
+			std::vector<uint32_t> acks;
+			int64_t ack_due;               // ms, 0 if no acks are owed
+			int64_t last;
+		};
+
+		struct Port
+		{
+			int sdk_fd;
+			bool reliable;
+			uint32_t next_seq;
+			std::deque<Unacked> unacked;
+			std::unordered_map<uint64_t, Remote> remotes; // by node << 16 | port
+			struct zts_msg_stats stats;
+		};
+
+		struct Out
+		{
+			uint64_t node;
+			std::string frame;
+		};
+
+		uint64_t _nwid;
+		Output _out;
+		std::mutex _m;
+		std::condition_variable _cv;
+		std::unordered_map<uint16_t, Port> _ports;
+		uint16_t _next_port;
+		bool _run;
+		std::thread _timer;
+
+		static int64_t now();
+
+		static void header(unsigned char *h, int type, int flags, uint16_t dport, uint16_t sport,
+			uint32_t seq, uint32_t ack);
+
+		// Whether seq from r is new, recording it. Caller holds _m
+		static bool fresh(Remote &r, uint32_t seq);
+
+		/*
+		 * Resends what's due, sends the acks owed, and drops what's been resent
+		 * ZT_MSG_RETRIES times. Returns the ms until the next thing is due, -1 if nothing is
+		 */
+		int64_t tick(std::vector<Out> &out);
+
+		void timerMain();
+	};
+
+} // namespace ZeroTier
+
+#endif // ZT_MSGPORTS_HPP
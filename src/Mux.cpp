@@ -0,0 +1,1164 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "Mux.hpp"
+#include "libzt.h"
+
+// A frame is an 8 byte header, [type][flags][length, 16 bits][stream id, 32 bits] in network
+// byte order, followed by length bytes. DATA carries a stream's bytes and its SYN, FIN and RST,
+// WINDOW a 32 bit count of bytes the receiver has made room for
+#define ZT_MUX_HDR_LEN     8
+#define ZT_MUX_DATA        0
+#define ZT_MUX_WINDOW_UPD  1
+#define ZT_MUX_F_SYN       0x01
+#define ZT_MUX_F_FIN       0x02
+#define ZT_MUX_F_RST       0x04
+
+#define ZT_MUX_POLL_MS     250 // how long session and listener threads wait before checking in
+#define ZT_MUX_READ_SZ     65536
+
+#if defined(MSG_NOSIGNAL)
+#define ZT_MUX_CTL_FLAGS   (MSG_NOSIGNAL | MSG_DONTWAIT)
+#else
+#define ZT_MUX_CTL_FLAGS   MSG_DONTWAIT
+#endif
+
+namespace ZeroTier {
+namespace Mux {
+
+	struct Session;
+	struct Listener;
+
+	/*
+	 * A mux socket: a stream once connected or accepted, otherwise one being set up or
+	 * listening. Kept small, beyond what's buffered for it this is all a stream costs
+	 */
+	struct Stream
+	{
+		int fd;                      // -1 once closed by the app (or not accepted yet)
+		int family;
+		uint32_t id;
+		std::shared_ptr<Session> s;  // until the stream is over in both directions
+		Listener *l;                 // while listening
+		std::string rx;              // received, not yet read from rx_off on
+		size_t rx_off;
+		uint32_t credit;             // bytes the peer will still take
+		uint32_t consumed;           // read since the peer was last given credit
+		bool connected;
+		bool queued;                 // waiting in l->pending to be accepted
+		bool fin_in, fin_out, rd_shut, nonblock;
+		int err;
+		int rcvtimeo, sndtimeo;      // ms, 0 waits forever
+		struct sockaddr_storage bound;
+		std::vector<int> waiters;    // pipes of the zts_poll() calls watching fd
+
+		Stream(int family) :
+			fd(-1), family(family), id(0), l(NULL), rx_off(0), credit(0), consumed(0),
+			connected(false), queued(false), fin_in(false), fin_out(false), rd_shut(false),
+			nonblock(false), err(0), rcvtimeo(0), sndtimeo(0)
+		{
+			memset(&bound, 0, sizeof(bound));
+			bound.ss_family = family;
+		}
+	};
+
+	// One libzt TCP connection and the streams over it
+	struct Session
+	{
+		int carrier;
+		bool client;                 // opens the streams, with odd ids
+		uint32_t next_id;
+		struct sockaddr_storage peer, local;
+		std::unordered_map<uint32_t, Stream*> streams;
+		Listener *l;                 // server side, where new streams are queued
+		std::string ctl;             // frames the session thread couldn't send without waiting
+		std::mutex write_m;          // frames go onto carrier whole, one at a time
+		bool dead;
+		int64_t idle_since;
+
+		Session() : carrier(-1), client(false), next_id(1), l(NULL), dead(false), idle_since(0)
+		{
+			memset(&peer, 0, sizeof(peer));
+			memset(&local, 0, sizeof(local));
+		}
+
+		~Session()
+		{
+			if(carrier >= 0)
+				zts_close(carrier);
+		}
+	};
+
+	struct Listener
+	{
+		Stream *owner;
+		int carrier;
+		int backlog;
+		std::deque<Stream*> pending;
+		bool run;
+		std::thread thread;
+	};
+
+	// Everything above is guarded by _m, except a session's carrier writes (write_m)
+	static std::mutex _m;
+	static std::condition_variable _cv;
+	static std::unordered_map<int, Stream*> fds;
+	static std::vector<int> free_fds;
+	static int next_fd = ZT_MUX_FD_BASE;
+	static std::vector<std::shared_ptr<Session> > sessions;
+	static int threads; // session and listener threads running
+	static struct zts_mux_stats counters;
+
+	static int64_t now()
+	{
+		return std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	static socklen_t addrLen(int family)
+	{
+		return family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+	}
+
+	static uint16_t addrPort(const struct sockaddr_storage *ss)
+	{
+		return ss->ss_family == AF_INET6 ? ((const struct sockaddr_in6 *)ss)->sin6_port
+			: ((const struct sockaddr_in *)ss)->sin_port;
+	}
+
+	static bool sameAddr(const struct sockaddr_storage *a, const struct sockaddr *b)
+	{
+		if(a->ss_family != b->sa_family)
+			return false;
+		if(b->sa_family == AF_INET) {
+			const struct sockaddr_in *x = (const struct sockaddr_in *)a, *y = (const struct sockaddr_in *)b;
+			return x->sin_port == y->sin_port && x->sin_addr.s_addr == y->sin_addr.s_addr;
+		}
+		const struct sockaddr_in6 *x = (const struct sockaddr_in6 *)a, *y = (const struct sockaddr_in6 *)b;
+		return x->sin6_port == y->sin6_port && !memcmp(&x->sin6_addr, &y->sin6_addr, sizeof(x->sin6_addr));
+	}
+
+	static void copyAddr(const struct sockaddr_storage *ss, struct sockaddr *addr, socklen_t *addrlen)
+	{
+		if(!addr || !addrlen)
+			return;
+		socklen_t len = addrLen(ss->ss_family);
+		memcpy(addr, ss, std::min(len, *addrlen));
+		*addrlen = len;
+	}
+
+	static int fail(int err)
+	{
+		errno = err;
+		return -1;
+	}
+
+	// Caller holds _m
+	static Stream *lookup(int fd)
+	{
+		std::unordered_map<int, Stream*>::iterator it = fds.find(fd);
+		return it == fds.end() ? NULL : it->second;
+	}
+
+	static int allocFd(Stream *st)
+	{
+		if(free_fds.size()) {
+			st->fd = free_fds.back();
+			free_fds.pop_back();
+		}
+		else if(next_fd < INT32_MAX)
+			st->fd = next_fd++;
+		else
+			return -1;
+		fds[st->fd] = st;
+		return st->fd;
+	}
+
+	// Tells whoever waits on st that something changed, caller holds _m
+	static void wake(Stream *st)
+	{
+		for(size_t i=0; i<st->waiters.size(); i++)
+			(void)!::write(st->waiters[i], "", 1);
+		_cv.notify_all();
+	}
+
+	/*
+	 * Takes st out of its session (and its listener's accept queue), the stream is over in
+	 * both directions. Caller holds _m
+	 */
+	static void detach(Stream *st)
+	{
+		if(!st->s)
+			return;
+		if(st->queued && st->s->l) {
+			std::deque<Stream*> &q = st->s->l->pending;
+			q.erase(std::remove(q.begin(), q.end(), st), q.end());
+		}
+		st->queued = false;
+		st->s->streams.erase(st->id);
+		st->s.reset();
+	}
+
+	// Frees st once neither the app nor a session refers to it, caller holds _m
+	static void release(Stream *st)
+	{
+		if(st->fd < 0 && !st->s && !st->l && !st->queued)
+			delete st;
+	}
+
+	static void header(unsigned char *h, int type, int flags, uint32_t id, uint16_t len)
+	{
+		h[0] = type;
+		h[1] = flags;
+		h[2] = len >> 8;
+		h[3] = len;
+		h[4] = id >> 24;
+		h[5] = id >> 16;
+		h[6] = id >> 8;
+		h[7] = id;
+	}
+
+	// Queues a payload-less frame for the session thread to send, caller holds _m
+	static void queueCtl(Session *s, int type, int flags, uint32_t id)
+	{
+		unsigned char h[ZT_MUX_HDR_LEN];
+		header(h, type, flags, id, 0);
+		s->ctl.append((const char *)h, sizeof(h));
+		counters.frames_out++;
+	}
+
+	static bool writeAll(int fd, struct iovec *iov, int iovcnt)
+	{
+		while(iovcnt) {
+			ssize_t n = zts_writev(fd, iov, iovcnt);
+			if(n < 0) {
+				if(errno == EINTR)
+					continue;
+				return false;
+			}
+			while(iovcnt && (size_t)n >= iov->iov_len) {
+				n -= iov->iov_len;
+				iov++;
+				iovcnt--;
+			}
+			if(iovcnt) {
+				iov->iov_base = (char *)iov->iov_base + n;
+				iov->iov_len -= n;
+			}
+		}
+		return true;
+	}
+
+	/*
+	 * Writes one frame (after any queued control frames) onto the session's carrier, waiting
+	 * for room. A failed write ends the session
+	 */
+	static int sendFrame(const std::shared_ptr<Session> &s, int type, int flags, uint32_t id,
+		const void *payload, uint16_t len)
+	{
+		std::lock_guard<std::mutex> _w(s->write_m);
+		std::string ctl;
+		{
+			std::lock_guard<std::mutex> _l(_m);
+			if(s->dead)
+				return fail(ECONNRESET);
+			ctl.swap(s->ctl);
+			counters.frames_out++;
+			if(type == ZT_MUX_DATA)
+				counters.bytes_out += len;
+		}
+		unsigned char h[ZT_MUX_HDR_LEN];
+		header(h, type, flags, id, len);
+		struct iovec iov[3];
+		int n = 0;
+		if(ctl.size()) {
+			iov[n].iov_base = (void *)ctl.data();
+			iov[n++].iov_len = ctl.size();
+		}
+		iov[n].iov_base = h;
+		iov[n++].iov_len = sizeof(h);
+		if(len) {
+			iov[n].iov_base = (void *)payload;
+			iov[n++].iov_len = len;
+		}
+		if(!writeAll(s->carrier, iov, n)) {
+			std::lock_guard<std::mutex> _l(_m);
+			s->dead = true;
+			return fail(ECONNRESET);
+		}
+		return 0;
+	}
+
+	/*
+	 * Sends what control frames it can without waiting, for the session thread, which must
+	 * keep reading: a peer blocked writing to us may be what's keeping our writes from going out
+	 */
+	static void flushCtl(const std::shared_ptr<Session> &s)
+	{
+		std::unique_lock<std::mutex> w(s->write_m, std::try_to_lock);
+		if(!w.owns_lock())
+			return;
+		std::string ctl;
+		{
+			std::lock_guard<std::mutex> _l(_m);
+			ctl.swap(s->ctl);
+		}
+		if(ctl.empty())
+			return;
+		ssize_t n = zts_send(s->carrier, ctl.data(), ctl.size(), ZT_MUX_CTL_FLAGS);
+		if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			std::lock_guard<std::mutex> _l(_m);
+			s->dead = true;
+			return;
+		}
+		if(n < (ssize_t)ctl.size()) {
+			std::lock_guard<std::mutex> _l(_m);
+			s->ctl.insert(0, ctl, n > 0 ? n : 0, std::string::npos);
+		}
+	}
+
+	/*
+	 * Handles one frame from the peer, caller holds _m. Returns false on a protocol error,
+	 * which ends the session
+	 */
+	static bool frame(const std::shared_ptr<Session> &s, int type, int flags, uint32_t id,
+		const unsigned char *p, uint16_t len)
+	{
+		counters.frames_in++;
+		std::unordered_map<uint32_t, Stream*>::iterator it = s->streams.find(id);
+		Stream *st = it == s->streams.end() ? NULL : it->second;
+		if(type == ZT_MUX_WINDOW_UPD) {
+			if(len != 4)
+				return false;
+			if(st) {
+				st->credit += (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+				wake(st);
+			}
+			return true;
+		}
+		if(type != ZT_MUX_DATA)
+			return false;
+		if(flags & ZT_MUX_F_SYN) {
+			if(st || s->client)
+				return false;
+			if(!s->l || s->l->pending.size() >= (size_t)s->l->backlog) {
+				queueCtl(s.get(), ZT_MUX_DATA, ZT_MUX_F_RST, id);
+				counters.streams_refused++;
+				return true;
+			}
+			st = new Stream(s->peer.ss_family);
+			st->id = id;
+			st->s = s;
+			st->credit = ZT_MUX_WINDOW;
+			st->connected = true;
+			st->queued = true;
+			s->streams[id] = st;
+			s->l->pending.push_back(st);
+			counters.streams_opened++;
+			wake(s->l->owner);
+		}
+		if(!st) {
+			if(!(flags & ZT_MUX_F_RST))
+				queueCtl(s.get(), ZT_MUX_DATA, ZT_MUX_F_RST, id);
+			return true;
+		}
+		if(len) {
+			// Nobody left to read it (or more than the window allows): the stream is reset
+			bool orphan = (st->fd < 0 && !st->queued) || st->rd_shut;
+			if(orphan || st->rx.size() - st->rx_off + st->consumed + len > ZT_MUX_WINDOW) {
+				queueCtl(s.get(), ZT_MUX_DATA, ZT_MUX_F_RST, id);
+				st->err = ECONNRESET;
+				counters.streams_reset++;
+				detach(st);
+				wake(st);
+				release(st);
+				return true;
+			}
+			st->rx.append((const char *)p, len);
+			counters.bytes_in += len;
+		}
+		if(flags & ZT_MUX_F_FIN)
+			st->fin_in = true;
+		if(flags & ZT_MUX_F_RST) {
+			st->err = ECONNRESET;
+			counters.streams_reset++;
+		}
+		if((flags & ZT_MUX_F_RST) || (st->fin_in && st->fin_out))
+			detach(st);
+		wake(st);
+		release(st);
+		return true;
+	}
+
+	// The session is over, its streams fail unless they're over already. Caller holds _m
+	static void die(const std::shared_ptr<Session> &s)
+	{
+		s->dead = true;
+		sessions.erase(std::remove(sessions.begin(), sessions.end(), s), sessions.end());
+		std::vector<Stream*> streams;
+		for(std::unordered_map<uint32_t, Stream*>::iterator it = s->streams.begin(); it != s->streams.end(); ++it)
+			streams.push_back(it->second);
+		for(size_t i=0; i<streams.size(); i++) {
+			Stream *st = streams[i];
+			if(!st->fin_in && !st->err)
+				st->err = ECONNRESET;
+			detach(st);
+			wake(st);
+			release(st);
+		}
+	}
+
+	static void readerMain(std::shared_ptr<Session> s)
+	{
+		std::string in;
+		std::vector<char> buf(ZT_MUX_READ_SZ);
+		for(;;) {
+			{
+				std::lock_guard<std::mutex> _l(_m);
+				if(s->dead)
+					break;
+				// The server side waits longer, so that it isn't what closes a session a stream is being opened on
+				int64_t idle = s->client ? ZT_MUX_IDLE_TIMEOUT : 2 * ZT_MUX_IDLE_TIMEOUT;
+				if(!s->streams.empty())
+					s->idle_since = 0;
+				else if(!s->idle_since)
+					s->idle_since = now();
+				else if(now() - s->idle_since >= idle)
+					break;
+			}
+			flushCtl(s);
+			struct pollfd p = { s->carrier, POLLIN, 0 };
+			int n = zts_poll(&p, 1, ZT_MUX_POLL_MS);
+			if(n < 0 && errno != EINTR)
+				break;
+			if(n <= 0)
+				continue;
+			ssize_t len = zts_recv(s->carrier, buf.data(), buf.size(), 0);
+			if(len == 0 || (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+				break;
+			if(len < 0)
+				continue;
+			in.append(buf.data(), len);
+			size_t off = 0;
+			bool ok = true;
+			{
+				std::lock_guard<std::mutex> _l(_m);
+				while(ok && in.size() - off >= ZT_MUX_HDR_LEN) {
+					const unsigned char *h = (const unsigned char *)in.data() + off;
+					uint16_t flen = h[2] << 8 | h[3];
+					if(in.size() - off < ZT_MUX_HDR_LEN + (size_t)flen)
+						break;
+					uint32_t id = (uint32_t)h[4] << 24 | (uint32_t)h[5] << 16 | (uint32_t)h[6] << 8 | h[7];
+					ok = frame(s, h[0], h[1], id, h + ZT_MUX_HDR_LEN, flen);
+					off += ZT_MUX_HDR_LEN + flen;
+				}
+			}
+			in.erase(0, off);
+			if(!ok)
+				break;
+		}
+		std::lock_guard<std::mutex> _l(_m);
+		die(s);
+		threads--;
+		_cv.notify_all();
+	}
+
+	// Starts the thread serving a new session, caller holds _m
+	static void start(const std::shared_ptr<Session> &s)
+	{
+		sessions.push_back(s);
+		threads++;
+		counters.sessions_opened++;
+		std::thread(readerMain, s).detach();
+	}
+
+	// A client session to addr still in use, caller holds _m
+	static std::shared_ptr<Session> findSession(const struct sockaddr *addr)
+	{
+		for(size_t i=0; i<sessions.size(); i++) {
+			if(sessions[i]->client && !sessions[i]->dead && sameAddr(&sessions[i]->peer, addr))
+				return sessions[i];
+		}
+		return std::shared_ptr<Session>();
+	}
+
+	static void acceptorMain(Listener *l, struct sockaddr_storage local)
+	{
+		for(;;) {
+			{
+				std::lock_guard<std::mutex> _l(_m);
+				if(!l->run)
+					break;
+			}
+			struct pollfd p = { l->carrier, POLLIN, 0 };
+			int n = zts_poll(&p, 1, ZT_MUX_POLL_MS);
+			if(n < 0 && errno != EINTR)
+				break;
+			if(n <= 0)
+				continue;
+			struct sockaddr_storage peer;
+			socklen_t peerlen = sizeof(peer);
+			int cfd = zts_accept(l->carrier, (struct sockaddr *)&peer, &peerlen);
+			if(cfd < 0)
+				continue;
+			std::shared_ptr<Session> s(new Session());
+			s->carrier = cfd;
+			s->next_id = 2;
+			s->peer = peer;
+			s->local = local;
+			s->l = l;
+			std::lock_guard<std::mutex> _l(_m);
+			if(l->run)
+				start(s);
+		}
+		std::lock_guard<std::mutex> _l(_m);
+		threads--;
+		_cv.notify_all();
+	}
+
+	/*
+	 * Waits for a change to any stream, until deadline if timeo_ms is set. Returns false once
+	 * the deadline has passed
+	 */
+	static bool waitFor(std::unique_lock<std::mutex> &lk, int timeo_ms, int64_t deadline)
+	{
+		if(!timeo_ms) {
+			_cv.wait(lk);
+			return true;
+		}
+		int64_t left = deadline - now();
+		if(left <= 0)
+			return false;
+		_cv.wait_for(lk, std::chrono::milliseconds(left));
+		return true;
+	}
+
+	int socket(int family)
+	{
+		if(family != AF_INET && family != AF_INET6)
+			return fail(EAFNOSUPPORT);
+		std::lock_guard<std::mutex> _l(_m);
+		Stream *st = new Stream(family);
+		if(allocFd(st) < 0) {
+			delete st;
+			return fail(EMFILE);
+		}
+		return st->fd;
+	}
+
+	int connect(int fd, const struct sockaddr *addr, socklen_t addrlen)
+	{
+		int family;
+		{
+			std::lock_guard<std::mutex> _l(_m);
+			Stream *st = lookup(fd);
+			if(!st)
+				return fail(EBADF);
+			if(st->connected)
+				return fail(EISCONN);
+			if(st->l)
+				return fail(EINVAL);
+			if(!addr || addrlen < addrLen(st->family))
+				return fail(EINVAL);
+			if(addr->sa_family != st->family)
+				return fail(EAFNOSUPPORT);
+			family = st->family;
+		}
+		std::shared_ptr<Session> s;
+		{
+			std::lock_guard<std::mutex> _l(_m);
+			s = findSession(addr);
+		}
+		if(!s) {
+			// None to this peer yet, the new one is only kept if no other connect() made one meanwhile
+			int cfd = zts_socket(family, SOCK_STREAM, 0);
+			if(cfd < 0)
+				return -1;
+			if(zts_connect(cfd, addr, addrlen) < 0) {
+				int err = errno;
+				zts_close(cfd);
+				return fail(err);
+			}
+			std::shared_ptr<Session> ns(new Session());
+			ns->carrier = cfd;
+			ns->client = true;
+			memcpy(&ns->peer, addr, addrLen(family));
+			ns->local.ss_family = family;
+			std::lock_guard<std::mutex> _l(_m);
+			if(!(s = findSession(addr))) {
+				s = ns;
+				start(s);
+			}
+		}
+		uint32_t id;
+		{
+			std::lock_guard<std::mutex> _l(_m);
+			Stream *st = lookup(fd);
+			if(!st)
+				return fail(EBADF);
+			if(st->connected)
+				return fail(EISCONN);
+			if(s->dead)
+				return fail(ECONNREFUSED);
+			id = st->id = s->next_id;
+			s->next_id += 2;
+			st->s = s;
+			st->credit = ZT_MUX_WINDOW;
+			st->connected = true;
+			s->streams[id] = st;
+			counters.streams_opened++;
+		}
+		return sendFrame(s, ZT_MUX_DATA, ZT_MUX_F_SYN, id, NULL, 0);
+	}
+
+	int bind(int fd, const struct sockaddr *addr, socklen_t addrlen)
+	{
+		std::lock_guard<std::mutex> _l(_m);
+		Stream *st = lookup(fd);
+		if(!st)
+			return fail(EBADF);
+		if(!addr || addrlen < addrLen(st->family) || st->connected || st->l)
+			return fail(EINVAL);
+		if(addr->sa_family != st->family)
+			return fail(EAFNOSUPPORT);
+		memcpy(&st->bound, addr, addrLen(st->family));
+		return 0;
+	}
+
+	int listen(int fd, int backlog)
+	{
+		struct sockaddr_storage local;
+		{
+			std::lock_guard<std::mutex> _l(_m);
+			Stream *st = lookup(fd);
+			if(!st)
+				return fail(EBADF);
+			if(st->l) {
+				st->l->backlog = std::max(backlog, 1);
+				return 0;
+			}
+			if(st->connected)
+				return fail(EINVAL);
+			if(!addrPort(&st->bound))
+				return fail(EDESTADDRREQ);
+			local = st->bound;
+		}
+		int lfd = zts_socket(local.ss_family, SOCK_STREAM, 0);
+		if(lfd < 0)
+			return -1;
+		if(zts_bind(lfd, (struct sockaddr *)&local, addrLen(local.ss_family)) < 0
+			|| zts_listen(lfd, backlog) < 0) {
+			int err = errno;
+			zts_close(lfd);
+			return fail(err);
+		}
+		std::lock_guard<std::mutex> _l(_m);
+		Stream *st = lookup(fd);
+		if(!st || st->l) {
+			zts_close(lfd);
+			return fail(st ? EINVAL : EBADF);
+		}
+		Listener *l = new Listener();
+		l->owner = st;
+		l->carrier = lfd;
+		l->backlog = std::max(backlog, 1);
+		l->run = true;
+		st->l = l;
+		threads++;
+		l->thread = std::thread(acceptorMain, l, local);
+		return 0;
+	}
+
+	int accept(int fd, struct sockaddr *addr, socklen_t *addrlen, int flags)
+	{
+		std::unique_lock<std::mutex> lk(_m);
+		Stream *st = lookup(fd);
+		if(!st)
+			return fail(EBADF);
+		if(!st->l)
+			return fail(EINVAL);
+		int64_t deadline = now() + st->rcvtimeo;
+		while(st->l->pending.empty()) {
+			if(st->nonblock || !waitFor(lk, st->rcvtimeo, deadline))
+				return fail(EAGAIN);
+			if(!(st = lookup(fd)) || !st->l)
+				return fail(EBADF);
+		}
+		Stream *ns = st->l->pending.front();
+		st->l->pending.pop_front();
+		ns->queued = false;
+		if(allocFd(ns) < 0) {
+			queueCtl(ns->s.get(), ZT_MUX_DATA, ZT_MUX_F_RST, ns->id);
+			detach(ns);
+			release(ns);
+			return fail(EMFILE);
+		}
+		ns->nonblock = (flags & SOCK_NONBLOCK) != 0;
+		copyAddr(&ns->s->peer, addr, addrlen);
+		return ns->fd;
+	}
+
+	ssize_t recv(int fd, void *buf, size_t len, int flags)
+	{
+		std::unique_lock<std::mutex> lk(_m);
+		Stream *st = lookup(fd);
+		if(!st)
+			return fail(EBADF);
+		if(!st->connected)
+			return fail(ENOTCONN);
+		int64_t deadline = now() + st->rcvtimeo;
+		while(st->rx.size() == st->rx_off) {
+			if(st->fin_in || st->rd_shut)
+				return 0;
+			if(st->err)
+				return fail(st->err);
+			if(!st->s)
+				return 0;
+			if((st->nonblock || (flags & MSG_DONTWAIT)) || !waitFor(lk, st->rcvtimeo, deadline))
+				return fail(EAGAIN);
+			if(!(st = lookup(fd)))
+				return fail(EBADF);
+		}
+		size_t n = std::min(len, st->rx.size() - st->rx_off);
+		memcpy(buf, st->rx.data() + st->rx_off, n);
+		if(flags & MSG_PEEK)
+			return n;
+		st->rx_off += n;
+		if(st->rx_off == st->rx.size()) {
+			std::string().swap(st->rx); // an idle stream holds no buffer
+			st->rx_off = 0;
+		}
+		else if(st->rx_off >= ZT_MUX_WINDOW / 2) {
+			st->rx.erase(0, st->rx_off);
+			st->rx_off = 0;
+		}
+		// Credit goes back in batches of half a window, not a frame per read
+		st->consumed += n;
+		if(!st->s || st->fin_in || st->consumed < ZT_MUX_WINDOW / 2)
+			return n;
+		std::shared_ptr<Session> s = st->s;
+		uint32_t id = st->id, credit = st->consumed;
+		st->consumed = 0;
+		lk.unlock();
+		unsigned char c[4] = { (unsigned char)(credit >> 24), (unsigned char)(credit >> 16),
+			(unsigned char)(credit >> 8), (unsigned char)credit };
+		sendFrame(s, ZT_MUX_WINDOW_UPD, 0, id, c, sizeof(c));
+		return n;
+	}
+
+	ssize_t send(int fd, const void *buf, size_t len, int flags)
+	{
+		std::unique_lock<std::mutex> lk(_m);
+		Stream *st = lookup(fd);
+		if(!st)
+			return fail(EBADF);
+		int64_t deadline = now() + st->sndtimeo;
+		size_t sent = 0;
+		int err = 0;
+		bool stalled = false;
+		while(sent < len) {
+			if(st->err)
+				err = st->err;
+			else if(!st->connected)
+				err = ENOTCONN;
+			else if(st->fin_out || !st->s)
+				err = EPIPE;
+			if(err)
+				break;
+			if(!st->credit) {
+				if(!stalled)
+					counters.window_stalls++;
+				stalled = true;
+				if((st->nonblock || (flags & MSG_DONTWAIT)) || !waitFor(lk, st->sndtimeo, deadline)) {
+					err = EAGAIN;
+					break;
+				}
+				if(!(st = lookup(fd))) {
+					err = EBADF;
+					break;
+				}
+				continue;
+			}
+			uint16_t n = std::min(std::min(len - sent, (size_t)st->credit), (size_t)ZT_MUX_FRAME_MAX);
+			st->credit -= n;
+			std::shared_ptr<Session> s = st->s;
+			uint32_t id = st->id;
+			lk.unlock();
+			int r = sendFrame(s, ZT_MUX_DATA, 0, id, (const char *)buf + sent, n);
+			lk.lock();
+			if(r < 0) {
+				err = errno;
+				break;
+			}
+			sent += n;
+			if(!(st = lookup(fd))) {
+				err = EBADF;
+				break;
+			}
+		}
+		if(sent || !len)
+			return sent;
+		return fail(err);
+	}
+
+	int shutdown(int fd, int how)
+	{
+		if(how != SHUT_RD && how != SHUT_WR && how != SHUT_RDWR)
+			return fail(EINVAL);
+		std::shared_ptr<Session> s;
+		uint32_t id;
+		{
+			std::lock_guard<std::mutex> _l(_m);
+			Stream *st = lookup(fd);
+			if(!st)
+				return fail(EBADF);
+			if(!st->connected)
+				return fail(ENOTCONN);
+			if(how != SHUT_WR) {
+				st->rd_shut = true;
+				std::string().swap(st->rx);
+				st->rx_off = 0;
+				wake(st);
+			}
+			if(how == SHUT_RD || st->fin_out || !st->s)
+				return 0;
+			st->fin_out = true;
+			s = st->s;
+			id = st->id;
+			if(st->fin_in)
+				detach(st);
+			wake(st);
+		}
+		return sendFrame(s, ZT_MUX_DATA, ZT_MUX_F_FIN, id, NULL, 0);
+	}
+
+	int close(int fd)
+	{
+		std::unique_lock<std::mutex> lk(_m);
+		Stream *st = lookup(fd);
+		if(!st)
+			return fail(EBADF);
+		fds.erase(fd);
+		free_fds.push_back(fd);
+		st->fd = -1;
+		wake(st);
+		st->waiters.clear(); // their pipes may be closed before st is gone
+		if(st->l) {
+			// Whatever hasn't been accepted is reset
+			Listener *l = st->l;
+			l->run = false;
+			for(size_t i=0; i<sessions.size(); i++) {
+				if(sessions[i]->l == l)
+					sessions[i]->l = NULL;
+			}
+			while(l->pending.size()) {
+				Stream *p = l->pending.front();
+				l->pending.pop_front();
+				p->queued = false;
+				queueCtl(p->s.get(), ZT_MUX_DATA, ZT_MUX_F_RST, p->id);
+				detach(p);
+				release(p);
+			}
+			lk.unlock();
+			l->thread.join();
+			zts_close(l->carrier);
+			lk.lock();
+			st->l = NULL;
+			delete l;
+			release(st);
+			return 0;
+		}
+		if(!st->s || st->fin_out) {
+			release(st);
+			return 0;
+		}
+		// A FIN, anything the peer still sends after it gets the stream reset (see frame())
+		std::shared_ptr<Session> s = st->s;
+		uint32_t id = st->id;
+		st->fin_out = true;
+		if(st->fin_in || st->rx.size() > st->rx_off) {
+			detach(st);
+			release(st);
+		}
+		lk.unlock();
+		sendFrame(s, ZT_MUX_DATA, ZT_MUX_F_FIN, id, NULL, 0);
+		return 0;
+	}
+
+	int getsockname(int fd, struct sockaddr *addr, socklen_t *addrlen)
+	{
+		std::lock_guard<std::mutex> _l(_m);
+		Stream *st = lookup(fd);
+		if(!st)
+			return fail(EBADF);
+		if(!addr || !addrlen)
+			return fail(EINVAL);
+		copyAddr(st->s ? &st->s->local : &st->bound, addr, addrlen);
+		return 0;
+	}
+
+	int getpeername(int fd, struct sockaddr *addr, socklen_t *addrlen)
+	{
+		std::lock_guard<std::mutex> _l(_m);
+		Stream *st = lookup(fd);
+		if(!st)
+			return fail(EBADF);
+		if(!addr || !addrlen)
+			return fail(EINVAL);
+		if(!st->s)
+			return fail(ENOTCONN);
+		copyAddr(&st->s->peer, addr, addrlen);
+		return 0;
+	}
+
+	int setsockopt(int fd, int level, int optname, const void *optval, socklen_t optlen)
+	{
+		std::lock_guard<std::mutex> _l(_m);
+		Stream *st = lookup(fd);
+		if(!st)
+			return fail(EBADF);
+		if(level == SOL_SOCKET && (optname == SO_RCVTIMEO || optname == SO_SNDTIMEO)) {
+			if(!optval || optlen < sizeof(struct timeval))
+				return fail(EINVAL);
+			const struct timeval *tv = (const struct timeval *)optval;
+			int ms = (int)(tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000);
+			(optname == SO_RCVTIMEO ? st->rcvtimeo : st->sndtimeo) = ms;
+			return 0;
+		}
+		// Accepted for the sake of code written for TCP, the session's connection has its own
+		if((level == SOL_SOCKET && (optname == SO_REUSEADDR || optname == SO_KEEPALIVE
+			|| optname == SO_LINGER)) || (level == IPPROTO_TCP && optname == TCP_NODELAY))
+			return 0;
+		return fail(ENOPROTOOPT);
+	}
+
+	int getsockopt(int fd, int level, int optname, void *optval, socklen_t *optlen)
+	{
+		std::lock_guard<std::mutex> _l(_m);
+		Stream *st = lookup(fd);
+		if(!st)
+			return fail(EBADF);
+		if(!optval || !optlen)
+			return fail(EINVAL);
+		if(level == SOL_SOCKET && (optname == SO_RCVTIMEO || optname == SO_SNDTIMEO)) {
+			if(*optlen < sizeof(struct timeval))
+				return fail(EINVAL);
+			int ms = optname == SO_RCVTIMEO ? st->rcvtimeo : st->sndtimeo;
+			struct timeval *tv = (struct timeval *)optval;
+			tv->tv_sec = ms / 1000;
+			tv->tv_usec = (ms % 1000) * 1000;
+			*optlen = sizeof(struct timeval);
+			return 0;
+		}
+		int v;
+		if(level == SOL_SOCKET && optname == SO_TYPE)
+			v = ZT_SOCK_MUX;
+		else if(level == SOL_SOCKET && optname == SO_ERROR)
+			v = st->err;
+		else if(level == SOL_SOCKET && optname == SO_RCVBUF)
+			v = ZT_MUX_WINDOW;
+		else if(level == SOL_SOCKET && optname == SO_ACCEPTCONN)
+			v = st->l != NULL;
+		else
+			return fail(ENOPROTOOPT);
+		if(*optlen < sizeof(int))
+			return fail(EINVAL);
+		memcpy(optval, &v, sizeof(v));
+		*optlen = sizeof(v);
+		return 0;
+	}
+
+	int fcntl(int fd, int cmd, int flags)
+	{
+		std::lock_guard<std::mutex> _l(_m);
+		Stream *st = lookup(fd);
+		if(!st)
+			return fail(EBADF);
+		if(cmd == F_GETFL)
+			return O_RDWR | (st->nonblock ? O_NONBLOCK : 0);
+		if(cmd == F_SETFL) {
+			st->nonblock = (flags & O_NONBLOCK) != 0;
+			return 0;
+		}
+		if(cmd == F_GETFD || cmd == F_SETFD)
+			return 0;
+		return fail(EINVAL);
+	}
+
+	int ioctl(int fd, unsigned long request, void *argp)
+	{
+		std::lock_guard<std::mutex> _l(_m);
+		Stream *st = lookup(fd);
+		if(!st)
+			return fail(EBADF);
+		if(!argp || (request != FIONBIO && request != FIONREAD))
+			return fail(EINVAL);
+		if(request == FIONBIO)
+			st->nonblock = *(int *)argp != 0;
+		else
+			*(int *)argp = (int)(st->rx.size() - st->rx_off);
+		return 0;
+	}
+
+	// poll() events for st, caller holds _m
+	static short readiness(const Stream *st)
+	{
+		if(st->l)
+			return st->l->pending.empty() ? 0 : POLLIN;
+		if(!st->connected)
+			return POLLOUT | POLLHUP; // as an unconnected TCP socket
+		short ev = 0;
+		if(st->rx.size() > st->rx_off || st->fin_in || st->rd_shut || st->err || !st->s)
+			ev |= POLLIN;
+		if(st->s && !st->fin_out && st->credit)
+			ev |= POLLOUT;
+		if(st->err)
+			ev |= POLLERR;
+		if(!st->s)
+			ev |= POLLHUP;
+		return ev;
+	}
+
+	int poll(struct pollfd *fds, nfds_t nfds, int timeout)
+	{
+		int sig[2];
+		if(pipe(sig) < 0)
+			return -1;
+		::fcntl(sig[0], F_SETFL, O_NONBLOCK);
+		::fcntl(sig[1], F_SETFL, O_NONBLOCK);
+		std::vector<nfds_t> ours, theirs;
+		std::vector<struct pollfd> pfds;
+		for(nfds_t i=0; i<nfds; i++) {
+			if(owns(fds[i].fd))
+				ours.push_back(i);
+			else {
+				theirs.push_back(i);
+				pfds.push_back(fds[i]);
+			}
+		}
+		struct pollfd w = { sig[0], POLLIN, 0 };
+		pfds.push_back(w);
+		{
+			std::lock_guard<std::mutex> _l(_m);
+			for(size_t i=0; i<ours.size(); i++) {
+				Stream *st = lookup(fds[ours[i]].fd);
+				if(st)
+					st->waiters.push_back(sig[1]);
+			}
+		}
+		int64_t deadline = now() + timeout;
+		int n = 0;
+		for(;;) {
+			int ready = 0;
+			{
+				std::lock_guard<std::mutex> _l(_m);
+				for(size_t i=0; i<ours.size(); i++) {
+					struct pollfd *p = &fds[ours[i]];
+					Stream *st = lookup(p->fd);
+					p->revents = st ? readiness(st) & (p->events | POLLERR | POLLHUP) : POLLNVAL;
+					ready += p->revents != 0;
+				}
+			}
+			int wait_ms = timeout;
+			if(ready)
+				wait_ms = 0;
+			else if(timeout > 0)
+				wait_ms = (int)std::max(deadline - now(), (int64_t)0);
+			if((n = zts_poll(pfds.data(), pfds.size(), wait_ms)) < 0)
+				break;
+			char drain[64];
+			while(::read(sig[0], drain, sizeof(drain)) > 0) { }
+			for(size_t i=0; i<theirs.size(); i++) {
+				fds[theirs[i]].revents = pfds[i].revents;
+				ready += pfds[i].revents != 0;
+			}
+			n = ready;
+			if(n || timeout == 0 || (timeout > 0 && now() >= deadline))
+				break;
+		}
+		{
+			std::lock_guard<std::mutex> _l(_m);
+			for(size_t i=0; i<ours.size(); i++) {
+				Stream *st = lookup(fds[ours[i]].fd);
+				if(st)
+					st->waiters.erase(std::remove(st->waiters.begin(), st->waiters.end(), sig[1]), st->waiters.end());
+			}
+		}
+		::close(sig[0]);
+		::close(sig[1]);
+		return n;
+	}
+
+	void stats(struct zts_mux_stats *stats)
+	{
+		std::lock_guard<std::mutex> _l(_m);
+		*stats = counters;
+		stats->sessions = sessions.size();
+		stats->streams = 0;
+		for(size_t i=0; i<sessions.size(); i++)
+			stats->streams += sessions[i]->streams.size();
+	}
+
+	void stop()
+	{
+		std::unique_lock<std::mutex> lk(_m);
+		for(size_t i=0; i<sessions.size(); i++)
+			sessions[i]->dead = true;
+		for(std::unordered_map<int, Stream*>::iterator it = fds.begin(); it != fds.end(); ++it) {
+			if(it->second->l)
+				it->second->l->run = false;
+		}
+		_cv.wait(lk, []() { return threads == 0; });
+	}
+
+} // namespace Mux
+} // namespace ZeroTier
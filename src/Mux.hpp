@@ -0,0 +1,88 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// Multiplexed stream sockets (see ZT_SOCK_MUX)
+//
+// Streams to the same address and port share one libzt TCP connection, a session, over which
+// each frame carries a stream id. A thread per session sorts what arrives into the streams'
+// buffers, which the peer is never allowed to overrun: every stream has its own window,
+// credited back as the app reads it. The descriptors are ours (from ZT_MUX_FD_BASE up), the
+// zts_*() calls hand them here before looking at the fdtable
+
+#ifndef ZT_MUX_HPP
+#define ZT_MUX_HPP
+
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "libzt.h"
+
+#define ZT_MUX_FD_BASE                     (1 << 30)
+
+namespace ZeroTier {
+namespace Mux {
+
+	static inline bool owns(int fd) { return fd >= ZT_MUX_FD_BASE; }
+
+	/*
+	 * The socket calls for mux descriptors, as zts_*(). All return -1 with errno set on failure
+	 */
+	int socket(int family);
+	int connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
+	int bind(int fd, const struct sockaddr *addr, socklen_t addrlen);
+	int listen(int fd, int backlog);
+	int accept(int fd, struct sockaddr *addr, socklen_t *addrlen, int flags);
+	ssize_t recv(int fd, void *buf, size_t len, int flags);
+	ssize_t send(int fd, const void *buf, size_t len, int flags);
+	int shutdown(int fd, int how);
+	int close(int fd);
+	int getsockname(int fd, struct sockaddr *addr, socklen_t *addrlen);
+	int getpeername(int fd, struct sockaddr *addr, socklen_t *addrlen);
+	int setsockopt(int fd, int level, int optname, const void *optval, socklen_t optlen);
+	int getsockopt(int fd, int level, int optname, void *optval, socklen_t *optlen);
+	int fcntl(int fd, int cmd, int flags);
+	int ioctl(int fd, unsigned long request, void *argp);
+
+	/*
+	 * zts_poll() for a set with at least one mux descriptor in it, the others are polled by
+	 * zts_poll() along with a pipe the streams wake
+	 */
+	int poll(struct pollfd *fds, nfds_t nfds, int timeout);
+
+	void stats(struct zts_mux_stats *stats);
+
+	/*
+	 * Closes every session and stops listening, for zts_stop(). Streams still open fail
+	 * with ECONNRESET
+	 */
+	void stop();
+
+} // namespace Mux
+} // namespace ZeroTier
+
+#endif // ZT_MUX_HPP
@@ -0,0 +1,680 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Debug.hpp"
+#include "NodeDaemon.hpp"
+#include "libzt.h"
+
+#if defined(MSG_NOSIGNAL)
+#define ZT_DAEMON_SEND_FLAGS (MSG_NOSIGNAL | MSG_DONTWAIT)
+#else
+#define ZT_DAEMON_SEND_FLAGS MSG_DONTWAIT
+#endif
+
+namespace ZeroTier {
+namespace NodeDaemon {
+
+	enum { OP_CONNECT = 1, OP_LISTEN = 2 };
+
+	struct request
+	{
+		uint32_t op;
+		int32_t backlog;
+		uint32_t addrlen;
+		struct sockaddr_storage addr;
+	};
+
+	// Comes with the connection (and for an accepted one its lifeline) as SCM_RIGHTS
+	struct reply
+	{
+		int32_t result;
+		int32_t err;
+		uint32_t addrlen;
+		struct sockaddr_storage addr;
+	};
+
+	static bool unixAddr(const char *path, struct sockaddr_un &sun)
+	{
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if(!path)
+			path = ZT_DAEMON_SOCKET_PATH;
+		if(strlen(path) >= sizeof(sun.sun_path)) {
+			errno = ENAMETOOLONG;
+			return false;
+		}
+		strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+		return true;
+	}
+
+	static bool sendFds(int sock, const struct reply &rep, const int *fds, int nfds)
+	{
+		struct iovec iov = { (void *)&rep, sizeof(rep) };
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		char cbuf[CMSG_SPACE(2 * sizeof(int))];
+		if(nfds) {
+			memset(cbuf, 0, sizeof(cbuf));
+			msg.msg_control = cbuf;
+			msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+			struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+			c->cmsg_level = SOL_SOCKET;
+			c->cmsg_type = SCM_RIGHTS;
+			c->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+			memcpy(CMSG_DATA(c), fds, nfds * sizeof(int));
+		}
+		return sendmsg(sock, &msg, ZT_DAEMON_SEND_FLAGS) == (ssize_t)sizeof(rep);
+	}
+
+	// Blocks for one reply, fds gets what came with it (-1 for none)
+	static bool recvFds(int sock, struct reply &rep, int *fds, int nfds)
+	{
+		for(int i=0; i<nfds; i++)
+			fds[i] = -1;
+		struct iovec iov = { &rep, sizeof(rep) };
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		char cbuf[CMSG_SPACE(2 * sizeof(int))];
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		ssize_t n;
+		while((n = recvmsg(sock, &msg, MSG_WAITALL)) < 0 && errno == EINTR)
+			;
+		for(struct cmsghdr *c = CMSG_FIRSTHDR(&msg); n > 0 && c; c = CMSG_NXTHDR(&msg, c)) {
+			if(c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+				continue;
+			int got = (int)((c->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+			for(int i=0; i<got; i++) {
+				int fd;
+				memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+				if(i < nfds)
+					fds[i] = fd;
+				else
+					::close(fd);
+			}
+		}
+		if(n != (ssize_t)sizeof(rep)) {
+			for(int i=0; i<nfds; i++) {
+				if(fds[i] >= 0)
+					::close(fds[i]);
+			}
+			if(n >= 0)
+				errno = ECONNRESET;
+			return false;
+		}
+		return true;
+	}
+
+	/****************************************************************************/
+	/* Daemon                                                                   */
+	/****************************************************************************/
+
+	/*
+	 * Clients listening on the same address (prefork workers, say) share one listener of ours.
+	 * Each member asks for a connection by sending a byte on its Unix connection, a connection
+	 * accepted goes to the next member which has asked, so idle ones are served first
+	 */
+	struct group
+	{
+		std::string key;
+		int fd; // libzt's
+		std::vector<std::pair<int, int> > members; // Unix connection, connections asked for
+		size_t next;
+	};
+
+	/*
+	 * What the daemon's loop watches. ctrl is the client's Unix connection: a request not yet
+	 * read, a listener member's (accepted connections are sent on it), or a connection's
+	 * lifeline
+	 */
+	struct entry
+	{
+		enum { REQUEST, LISTENER, LIFELINE } kind;
+		int ctrl;
+		int fd; // libzt's, for a LIFELINE
+		group *g; // for a LISTENER
+	};
+
+	// Connection handed out -> its lifeline, client side
+	static std::mutex client_m;
+	static std::map<int, int> lifelines;
+
+	static std::mutex daemon_m;
+	static std::thread *daemon_thread;
+	static bool running = false;
+	static int listen_fd = -1;
+	static int wake[2] = { -1, -1 };
+	static std::string sock_path;
+	static std::vector<entry> added; // by connect threads, under daemon_m
+	static std::map<std::string, group*> groups; // daemon thread only
+
+	static std::string addrKey(const struct sockaddr_storage &ss)
+	{
+		if(ss.ss_family == AF_INET) {
+			const struct sockaddr_in *in = (const struct sockaddr_in *)&ss;
+			return std::string((const char *)&in->sin_port, sizeof(in->sin_port))
+				+ std::string((const char *)&in->sin_addr, sizeof(in->sin_addr));
+		}
+		if(ss.ss_family == AF_INET6) {
+			const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)&ss;
+			return std::string((const char *)&in6->sin6_port, sizeof(in6->sin6_port))
+				+ std::string((const char *)&in6->sin6_addr, sizeof(in6->sin6_addr));
+		}
+		return std::string();
+	}
+
+	// Closes a LISTENER's Unix connection, and the listener once its last member has gone
+	static void leave(const entry &e)
+	{
+		group *g = e.g;
+		for(size_t i=0; i<g->members.size(); i++) {
+			if(g->members[i].first == e.ctrl) {
+				g->members.erase(g->members.begin() + i);
+				break;
+			}
+		}
+		::close(e.ctrl);
+		if(g->members.size())
+			return;
+		zts_close(g->fd);
+		groups.erase(g->key);
+		delete g;
+	}
+
+	static void release(const entry &e)
+	{
+		if(e.kind == entry::LISTENER) {
+			leave(e);
+			return;
+		}
+		if(e.fd >= 0)
+			zts_close(e.fd);
+		::close(e.ctrl);
+	}
+
+	static void reject(int ctrl, int err)
+	{
+		struct reply rep;
+		memset(&rep, 0, sizeof(rep));
+		rep.result = -1;
+		rep.err = err;
+		sendFds(ctrl, rep, NULL, 0);
+		::close(ctrl);
+	}
+
+	// zts_connect() may block for long, so each runs on its own thread
+	static void connectMain(int ctrl, struct request req)
+	{
+		int fd = zts_socket(req.addr.ss_family, SOCK_STREAM, 0);
+		if(fd < 0) {
+			reject(ctrl, errno);
+			return;
+		}
+		if(zts_connect(fd, (struct sockaddr *)&req.addr, req.addrlen) < 0) {
+			int err = errno;
+			zts_close(fd);
+			reject(ctrl, err);
+			return;
+		}
+		struct reply rep;
+		memset(&rep, 0, sizeof(rep));
+		if(!sendFds(ctrl, rep, &fd, 1)) {
+			zts_close(fd);
+			::close(ctrl);
+			return;
+		}
+		std::lock_guard<std::mutex> _l(daemon_m);
+		if(!running) {
+			zts_close(fd);
+			::close(ctrl);
+			return;
+		}
+		entry e = { entry::LIFELINE, ctrl, fd, NULL };
+		added.push_back(e);
+		if(write(wake[1], "", 1) < 0) {}
+	}
+
+	// Reads a REQUEST, false once the entry is done with
+	static bool serveRequest(entry &e)
+	{
+		struct request req;
+		ssize_t n = recv(e.ctrl, &req, sizeof(req), MSG_DONTWAIT);
+		if(n < 0 && (errno == EAGAIN || errno == EINTR))
+			return true;
+		if(n != (ssize_t)sizeof(req) || req.addrlen > sizeof(req.addr)) {
+			::close(e.ctrl);
+			return false;
+		}
+		if(req.op == OP_CONNECT) {
+			std::thread(connectMain, e.ctrl, req).detach();
+			return false;
+		}
+		if(req.op != OP_LISTEN) {
+			reject(e.ctrl, EINVAL);
+			return false;
+		}
+		std::string key = addrKey(req.addr);
+		std::map<std::string, group*>::iterator gi = groups.find(key);
+		group *g = gi == groups.end() ? NULL : gi->second;
+		int fd = -1;
+		if(!g) {
+			fd = zts_socket(req.addr.ss_family, SOCK_STREAM, 0);
+			if(fd < 0 || zts_bind(fd, (struct sockaddr *)&req.addr, req.addrlen) < 0 || zts_listen(fd, req.backlog) < 0) {
+				int err = errno;
+				if(fd >= 0)
+					zts_close(fd);
+				reject(e.ctrl, err);
+				return false;
+			}
+		}
+		struct reply rep;
+		memset(&rep, 0, sizeof(rep));
+		if(!sendFds(e.ctrl, rep, NULL, 0)) {
+			if(fd >= 0)
+				zts_close(fd);
+			::close(e.ctrl);
+			return false;
+		}
+		if(!g) {
+			g = new group();
+			g->key = key;
+			g->fd = fd;
+			g->next = 0;
+			groups[key] = g;
+		}
+		g->members.push_back(std::make_pair(e.ctrl, 0));
+		e.kind = entry::LISTENER;
+		e.g = g;
+		return true;
+	}
+
+	// Bytes from a LISTENER member ask for connections, false once it has gone
+	static bool serveAsk(const entry &e)
+	{
+		char buf[64];
+		ssize_t n = recv(e.ctrl, buf, sizeof(buf), MSG_DONTWAIT);
+		if(n < 0 && (errno == EAGAIN || errno == EINTR))
+			return true;
+		if(n <= 0)
+			return false;
+		for(size_t i=0; i<e.g->members.size(); i++) {
+			if(e.g->members[i].first == e.ctrl)
+				e.g->members[i].second += (int)n;
+		}
+		return true;
+	}
+
+	static bool asked(const group *g)
+	{
+		for(size_t i=0; i<g->members.size(); i++) {
+			if(g->members[i].second > 0)
+				return true;
+		}
+		return false;
+	}
+
+	/*
+	 * Sends a connection the listener accepted, with a new lifeline (added to entries), to the
+	 * next member which has asked for one
+	 */
+	static void serveAccept(group *g, std::vector<entry> &entries)
+	{
+		struct reply rep;
+		memset(&rep, 0, sizeof(rep));
+		socklen_t alen = sizeof(rep.addr);
+		int fd = zts_accept(g->fd, (struct sockaddr *)&rep.addr, &alen);
+		if(fd < 0)
+			return;
+		rep.addrlen = alen;
+		int life[2];
+		if(socketpair(AF_UNIX, SOCK_STREAM, 0, life) < 0) {
+			zts_close(fd);
+			return;
+		}
+		int fds[2] = { fd, life[1] };
+		bool sent = false;
+		for(size_t tried=0; tried<g->members.size() && !sent; tried++) {
+			std::pair<int, int> &m = g->members[g->next++ % g->members.size()];
+			if(m.second <= 0)
+				continue;
+			m.second--;
+			sent = sendFds(m.first, rep, fds, 2);
+		}
+		::close(life[1]);
+		if(!sent) {
+			zts_close(fd);
+			::close(life[0]);
+			return;
+		}
+		entry l = { entry::LIFELINE, life[0], fd, NULL };
+		entries.push_back(l);
+	}
+
+	static void daemonMain()
+	{
+		std::vector<entry> entries;
+		std::vector<struct pollfd> pfds;
+		std::vector<group*> polled;
+		for(;;) {
+			{
+				std::lock_guard<std::mutex> _l(daemon_m);
+				if(!running)
+					break;
+				entries.insert(entries.end(), added.begin(), added.end());
+				added.clear();
+			}
+			pfds.clear();
+			polled.clear();
+			struct pollfd w = { wake[0], POLLIN, 0 }, l = { listen_fd, POLLIN, 0 };
+			pfds.push_back(w);
+			pfds.push_back(l);
+			for(size_t i=0; i<entries.size(); i++) {
+				struct pollfd c = { entries[i].ctrl, POLLIN, 0 };
+				pfds.push_back(c);
+			}
+			// A listener nobody has asked of waits, its connections stay in the backlog
+			for(std::map<std::string, group*>::iterator g(groups.begin()); g != groups.end(); ++g) {
+				if(!asked(g->second))
+					continue;
+				struct pollfd z = { g->second->fd, POLLIN, 0 };
+				pfds.push_back(z);
+				polled.push_back(g->second);
+			}
+			if(zts_poll(&pfds[0], pfds.size(), -1) < 0) {
+				if(errno == EINTR)
+					continue;
+				DEBUG_ERROR("poll failed (errno=%d), node daemon stopped", errno);
+				break;
+			}
+			if(pfds[0].revents) {
+				char buf[64];
+				while(read(wake[0], buf, sizeof(buf)) > 0)
+					;
+			}
+			// Before entries go, which may take their group with them
+			size_t n = entries.size(), p = 2 + n;
+			for(size_t i=0; i<polled.size(); i++) {
+				if(pfds[p + i].revents & POLLIN)
+					serveAccept(polled[i], entries);
+			}
+			std::vector<entry> kept;
+			for(size_t i=0; i<n; i++) {
+				entry e = entries[i];
+				if(!pfds[2 + i].revents) {
+					kept.push_back(e);
+					continue;
+				}
+				bool keep = true;
+				if(e.kind == entry::REQUEST)
+					keep = serveRequest(e);
+				else if(e.kind == entry::LISTENER)
+					keep = serveAsk(e);
+				else
+					keep = false; // Clients send nothing on a lifeline, so this is the hangup
+				if(keep)
+					kept.push_back(e);
+				else if(e.kind != entry::REQUEST)
+					release(e);
+			}
+			// Lifelines serveAccept() added
+			for(size_t i=n; i<entries.size(); i++)
+				kept.push_back(entries[i]);
+			if(pfds[1].revents & POLLIN) {
+				int c = ::accept(listen_fd, NULL, NULL);
+				if(c >= 0) {
+					fcntl(c, F_SETFD, FD_CLOEXEC);
+					entry e = { entry::REQUEST, c, -1, NULL };
+					kept.push_back(e);
+				}
+			}
+			entries.swap(kept);
+		}
+		for(size_t i=0; i<entries.size(); i++)
+			release(entries[i]);
+	}
+
+	// A child forked while a daemon runs has no daemon thread, the parent keeps serving
+	static void atforkPrepare()
+	{
+		daemon_m.lock();
+		client_m.lock();
+	}
+
+	static void atforkParent()
+	{
+		client_m.unlock();
+		daemon_m.unlock();
+	}
+
+	static void atforkChild()
+	{
+		client_m.unlock();
+		daemon_m.unlock();
+		if(!running)
+			return;
+		running = false;
+		daemon_thread = NULL;
+		added.clear();
+		::close(listen_fd);
+		::close(wake[0]);
+		::close(wake[1]);
+		listen_fd = wake[0] = wake[1] = -1;
+	}
+
+	static int atfork = pthread_atfork(atforkPrepare, atforkParent, atforkChild);
+
+	bool start(const char *path)
+	{
+		struct sockaddr_un sun;
+		if(!unixAddr(path, sun))
+			return false;
+		std::lock_guard<std::mutex> _l(daemon_m);
+		if(running) {
+			errno = EBUSY;
+			return false;
+		}
+		int s = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(s < 0)
+			return false;
+		fcntl(s, F_SETFD, FD_CLOEXEC);
+		unlink(sun.sun_path);
+		if(bind(s, (struct sockaddr *)&sun, sizeof(sun)) < 0 || chmod(sun.sun_path, 0600) < 0
+			|| ::listen(s, SOMAXCONN) < 0 || pipe(wake) < 0) {
+			int err = errno;
+			::close(s);
+			unlink(sun.sun_path);
+			errno = err;
+			return false;
+		}
+		fcntl(wake[0], F_SETFL, O_NONBLOCK);
+		fcntl(wake[1], F_SETFL, O_NONBLOCK);
+		listen_fd = s;
+		sock_path = sun.sun_path;
+		running = true;
+		daemon_thread = new std::thread(daemonMain);
+		return true;
+	}
+
+	void stop()
+	{
+		std::thread *t;
+		{
+			std::lock_guard<std::mutex> _l(daemon_m);
+			if(!running)
+				return;
+			running = false;
+			if(write(wake[1], "", 1) < 0) {}
+			t = daemon_thread;
+			daemon_thread = NULL;
+		}
+		t->join();
+		delete t;
+		std::lock_guard<std::mutex> _l(daemon_m);
+		for(size_t i=0; i<added.size(); i++)
+			release(added[i]);
+		added.clear();
+		::close(listen_fd);
+		::close(wake[0]);
+		::close(wake[1]);
+		listen_fd = wake[0] = wake[1] = -1;
+		unlink(sock_path.c_str());
+	}
+
+	/****************************************************************************/
+	/* Client                                                                   */
+	/****************************************************************************/
+
+	// Connects to the daemon and sends req, the connection is returned
+	static int ask(const char *path, int op, const struct sockaddr *addr, socklen_t addrlen, int backlog)
+	{
+		struct sockaddr_un sun;
+		if(!addr || addrlen > sizeof(struct sockaddr_storage)) {
+			errno = EINVAL;
+			return -1;
+		}
+		if(!unixAddr(path, sun))
+			return -1;
+		int s = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(s < 0)
+			return -1;
+		fcntl(s, F_SETFD, FD_CLOEXEC);
+		struct request req;
+		memset(&req, 0, sizeof(req));
+		req.op = op;
+		req.backlog = backlog;
+		req.addrlen = addrlen;
+		memcpy(&req.addr, addr, addrlen);
+		if(::connect(s, (struct sockaddr *)&sun, sizeof(sun)) < 0 || send(s, &req, sizeof(req), 0) != (ssize_t)sizeof(req)) {
+			int err = errno;
+			::close(s);
+			errno = err;
+			return -1;
+		}
+		return s;
+	}
+
+	int connect(const char *path, const struct sockaddr *addr, socklen_t addrlen)
+	{
+		int s = ask(path, OP_CONNECT, addr, addrlen, 0);
+		if(s < 0)
+			return -1;
+		struct reply rep;
+		memset(&rep, 0, sizeof(rep));
+		int fd;
+		if(!recvFds(s, rep, &fd, 1) || rep.result < 0 || fd < 0) {
+			int err = rep.result < 0 ? rep.err : errno;
+			if(fd >= 0)
+				::close(fd);
+			::close(s);
+			errno = err;
+			return -1;
+		}
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		std::lock_guard<std::mutex> _l(client_m);
+		lifelines[fd] = s;
+		return fd;
+	}
+
+	int listen(const char *path, const struct sockaddr *addr, socklen_t addrlen, int backlog)
+	{
+		int s = ask(path, OP_LISTEN, addr, addrlen, backlog);
+		if(s < 0)
+			return -1;
+		struct reply rep;
+		memset(&rep, 0, sizeof(rep));
+		// Asks for the first connection, so that s is readable once it's here
+		if(!recvFds(s, rep, NULL, 0) || rep.result < 0 || send(s, "", 1, ZT_DAEMON_SEND_FLAGS) != 1) {
+			int err = rep.result < 0 ? rep.err : errno;
+			::close(s);
+			errno = err;
+			return -1;
+		}
+		return s;
+	}
+
+	int accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+	{
+		struct reply rep;
+		int fds[2];
+		if(!recvFds(fd, rep, fds, 2))
+			return -1;
+		// And the next one
+		if(send(fd, "", 1, ZT_DAEMON_SEND_FLAGS) != 1) {}
+		if(fds[0] < 0 || fds[1] < 0) {
+			if(fds[0] >= 0)
+				::close(fds[0]);
+			if(fds[1] >= 0)
+				::close(fds[1]);
+			errno = ECONNABORTED;
+			return -1;
+		}
+		fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+		fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+		if(addr && addrlen) {
+			socklen_t len = rep.addrlen < *addrlen ? rep.addrlen : *addrlen;
+			memcpy(addr, &rep.addr, len);
+			*addrlen = rep.addrlen;
+		}
+		std::lock_guard<std::mutex> _l(client_m);
+		lifelines[fds[0]] = fds[1];
+		return fds[0];
+	}
+
+	int close(int fd)
+	{
+		{
+			std::lock_guard<std::mutex> _l(client_m);
+			std::map<int, int>::iterator l = lifelines.find(fd);
+			if(l != lifelines.end()) {
+				::close(l->second);
+				lifelines.erase(l);
+			}
+		}
+		return ::close(fd);
+	}
+
+} // namespace NodeDaemon
+} // namespace ZeroTier
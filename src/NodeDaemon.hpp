@@ -0,0 +1,69 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// One process's node shared by others on the host (see zts_daemon_start()). Clients ask over a
+// Unix socket for a TCP connection or listener, the daemon makes it on its own node and passes
+// the app end of the connection's socketpair back with SCM_RIGHTS, so data moves between the
+// client and the stack with no relay. Each connection handed out comes with a lifeline, a Unix
+// connection the daemon watches, whose hangup (zts_daemon_close(), or the client exiting)
+// closes the connection. Clients listening on the same address share one listener, which
+// makes for prefork servers: each worker listens after fork() and is handed connections
+// as it asks for them
+
+#ifndef ZT_NODEDAEMON_HPP
+#define ZT_NODEDAEMON_HPP
+
+#include <sys/socket.h>
+
+namespace ZeroTier {
+namespace NodeDaemon {
+
+	/*
+	 * Serves clients on the Unix socket path, false with errno set if it can't be bound or
+	 * a daemon runs already
+	 */
+	bool start(const char *path);
+
+	/*
+	 * Closes every connection handed out and removes the socket
+	 */
+	void stop();
+
+	// Client side, these need no service of their own
+
+	int connect(const char *path, const struct sockaddr *addr, socklen_t addrlen);
+
+	int listen(const char *path, const struct sockaddr *addr, socklen_t addrlen, int backlog);
+
+	int accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+
+	int close(int fd);
+
+} // namespace NodeDaemon
+} // namespace ZeroTier
+
+#endif // ZT_NODEDAEMON_HPP
@@ -0,0 +1,390 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// Edge-triggered event loop (epoll on Linux, kqueue on macOS and the BSDs) for the stack
+// threads' socketpairs, in place of the select() based Phy which scans every descriptor on
+// every pass and can't take one past FD_SETSIZE. It implements the part of Phy's interface
+// StackThread and the drivers use (stream sockets wrapped with wrapSocket(), reported through
+// phyOnUnixData/Writable/Close) so StackPhy can be either of them.
+//
+// Descriptors are registered once for both directions and never modified: what the app asked
+// for with setNotifyReadable()/setNotifyWritable() is kept here instead, so toggling it (the
+// drivers do on every flush) costs no system call. A socket that has reported readable is read
+// until EAGAIN across passes, a writable edge only comes when the peer makes room, so a socket
+// asking for writability anew is given one callback of its own to find out
+
+#ifndef ZT_PHYEVENT_HPP
+#define ZT_PHYEVENT_HPP
+
+#if defined(__linux__)
+#define ZT_PHY_EPOLL 1
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) || defined(__DragonFly__)
+#define ZT_PHY_KQUEUE 1
+#endif
+
+#if defined(ZT_PHY_EPOLL) || defined(ZT_PHY_KQUEUE)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#if defined(ZT_PHY_EPOLL)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#else
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "Phy.hpp"
+
+#define ZT_PHY_EVENT_BUF_SZ          131072 // bytes read at once, as much as Phy reads
+#define ZT_PHY_EVENT_READS_PER_POLL  4      // reads per socket and pass before others get a turn
+#define ZT_PHY_EVENT_MAX_EVENTS      256
+
+namespace ZeroTier {
+
+	template <typename HANDLER_PTR_TYPE>
+	class PhyEvent
+	{
+	private:
+		struct sock {
+			int fd;
+			void *uptr;
+			std::atomic<bool> want_read;
+			std::atomic<bool> want_write;
+			std::atomic<bool> closed;
+			bool readable; // not drained to EAGAIN yet, loop thread only
+			bool pending;  // in _pending, guarded by _pending_m
+		};
+
+		HANDLER_PTR_TYPE _handler;
+		int _q;
+		int _whack[2];
+		unsigned char _buf[ZT_PHY_EVENT_BUF_SZ];
+		std::atomic<unsigned long> _count;
+
+		// Sockets whose app side interest has just been raised, from any thread
+		std::vector<sock*> _pending;
+		std::mutex _pending_m;
+		// Sockets closing, freed by the pass after (nothing refers to them by then)
+		std::vector<sock*> _dead;
+		std::vector<sock*> _socks;
+		std::mutex _socks_m;
+		// Readable sockets which still had data when their turn was up, loop thread only
+		std::vector<sock*> _carry;
+
+		void queue(sock *s)
+		{
+			std::lock_guard<std::mutex> _l(_pending_m);
+			if(s->pending)
+				return;
+			s->pending = true;
+			_pending.push_back(s);
+		}
+
+		static void setNonBlocking(int fd)
+		{
+			int flags = fcntl(fd, F_GETFL, 0);
+			if(flags >= 0)
+				fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+		}
+
+		// Reads s until EAGAIN, its turn is up or the app no longer wants to hear from it
+		void readFrom(sock *s)
+		{
+			for(int i=0; i<ZT_PHY_EVENT_READS_PER_POLL; i++) {
+				if(s->closed || !s->want_read)
+					return;
+				ssize_t n = ::read(s->fd, _buf, sizeof(_buf));
+				if(n > 0) {
+					_handler->phyOnUnixData((PhySocket*)s, &(s->uptr), (void*)_buf, n);
+					continue;
+				}
+				if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+					if(errno != EINTR)
+						s->readable = false;
+					return;
+				}
+				close((PhySocket*)s, true);
+				return;
+			}
+			if(!s->closed && s->want_read)
+				_carry.push_back(s);
+		}
+
+		void writeTo(sock *s)
+		{
+			if(!s->closed && s->want_write)
+				_handler->phyOnUnixWritable((PhySocket*)s, &(s->uptr), false);
+		}
+
+		void drainWhack()
+		{
+			unsigned char b[64];
+			while(::read(_whack[0], b, sizeof(b)) > 0) { }
+		}
+
+	public:
+		PhyEvent(HANDLER_PTR_TYPE handler, bool noDelay, bool noCloseOnExec) :
+			_handler(handler),
+			_count(0)
+		{
+#if defined(ZT_PHY_EPOLL)
+			_q = epoll_create1(noCloseOnExec ? 0 : EPOLL_CLOEXEC);
+			_whack[0] = _whack[1] = eventfd(0, EFD_NONBLOCK | (noCloseOnExec ? 0 : EFD_CLOEXEC));
+			struct epoll_event ev;
+			ev.events = EPOLLIN;
+			ev.data.ptr = NULL;
+			epoll_ctl(_q, EPOLL_CTL_ADD, _whack[0], &ev);
+#else
+			_q = kqueue();
+			if(pipe(_whack) == 0) {
+				setNonBlocking(_whack[0]);
+				setNonBlocking(_whack[1]);
+			}
+			struct kevent ev;
+			EV_SET(&ev, _whack[0], EVFILT_READ, EV_ADD, 0, 0, NULL);
+			kevent(_q, &ev, 1, NULL, 0, NULL);
+#endif
+		}
+
+		~PhyEvent()
+		{
+			for(size_t i=0; i<_socks.size(); i++) {
+				if(!_socks[i]->closed)
+					::close(_socks[i]->fd);
+				delete _socks[i];
+			}
+			for(size_t i=0; i<_dead.size(); i++)
+				delete _dead[i];
+			::close(_whack[0]);
+			if(_whack[1] != _whack[0])
+				::close(_whack[1]);
+			::close(_q);
+		}
+
+		static inline ZT_PHY_SOCKFD_TYPE getDescriptor(PhySocket *s) throw()
+		{
+			return ((sock*)s)->fd;
+		}
+
+		inline void **getuptr(PhySocket *s) throw()
+		{
+			return &(((sock*)s)->uptr);
+		}
+
+		inline unsigned long count() const throw()
+		{
+			return _count;
+		}
+
+		inline unsigned long maxCount() const throw()
+		{
+			return ~0UL;
+		}
+
+		inline PhySocket *wrapSocket(ZT_PHY_SOCKFD_TYPE fd, void *uptr = (void *)0)
+		{
+			sock *s = new sock();
+			s->fd = fd;
+			s->uptr = uptr;
+			s->want_read = true;
+			s->want_write = false;
+			s->closed = false;
+			// Whatever arrived before we registered produced no edge
+			s->readable = true;
+			s->pending = false;
+			setNonBlocking(fd);
+			{
+				std::lock_guard<std::mutex> _l(_socks_m);
+				_socks.push_back(s);
+			}
+#if defined(ZT_PHY_EPOLL)
+			struct epoll_event ev;
+			ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+			ev.data.ptr = s;
+			if(epoll_ctl(_q, EPOLL_CTL_ADD, fd, &ev) < 0) {
+#else
+			struct kevent ev[2];
+			EV_SET(&ev[0], fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, s);
+			EV_SET(&ev[1], fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, s);
+			if(kevent(_q, ev, 2, NULL, 0, NULL) < 0) {
+#endif
+				std::lock_guard<std::mutex> _l(_socks_m);
+				_socks.pop_back();
+				delete s;
+				return (PhySocket*)0;
+			}
+			_count++;
+			queue(s);
+			whack();
+			return (PhySocket*)s;
+		}
+
+		inline void whack()
+		{
+#if defined(ZT_PHY_EPOLL)
+			uint64_t one = 1;
+			if(::write(_whack[1], &one, sizeof(one)) < 0) { }
+#else
+			unsigned char b = 0;
+			if(::write(_whack[1], &b, 1) < 0) { }
+#endif
+		}
+
+		inline long streamSend(PhySocket *sock_, const void *data, unsigned long len, bool callCloseHandler = true)
+		{
+			return (long)::send(((sock*)sock_)->fd, data, len, MSG_DONTWAIT);
+		}
+
+		inline void setNotifyWritable(PhySocket *sock_, bool notifyWritable)
+		{
+			sock *s = (sock*)sock_;
+			if(!s || s->closed || s->want_write.exchange(notifyWritable) == notifyWritable)
+				return;
+			if(notifyWritable)
+				queue(s);
+		}
+
+		inline void setNotifyReadable(PhySocket *sock_, bool notifyReadable)
+		{
+			sock *s = (sock*)sock_;
+			if(!s || s->closed || s->want_read.exchange(notifyReadable) == notifyReadable)
+				return;
+			// Data which arrived while reading was off may have left no edge to find it by
+			if(notifyReadable)
+				queue(s);
+		}
+
+		inline void close(PhySocket *sock_, bool callHandlers = true)
+		{
+			sock *s = (sock*)sock_;
+			if(!s || s->closed.exchange(true))
+				return;
+			// A copy of the descriptor elsewhere would keep it in the epoll set otherwise
+#if defined(ZT_PHY_EPOLL)
+			struct epoll_event ev;
+			epoll_ctl(_q, EPOLL_CTL_DEL, s->fd, &ev);
+#endif
+			::close(s->fd);
+			_count--;
+			if(callHandlers)
+				_handler->phyOnUnixClose(sock_, &(s->uptr));
+			std::lock_guard<std::mutex> _l(_socks_m);
+			for(size_t i=0; i<_socks.size(); i++) {
+				if(_socks[i] == s) {
+					_socks[i] = _socks.back();
+					_socks.pop_back();
+					break;
+				}
+			}
+			_dead.push_back(s);
+		}
+
+		/*
+		 * Waits up to timeout (ms) for events and dispatches them, returning early (without
+		 * waiting) while sockets have data left over from an earlier pass
+		 */
+		inline void poll(unsigned long timeout)
+		{
+			std::vector<sock*> dead, work;
+			{
+				std::lock_guard<std::mutex> _l(_socks_m);
+				dead.swap(_dead);
+			}
+			{
+				std::lock_guard<std::mutex> _l(_pending_m);
+				work.swap(_pending);
+				for(size_t i=0; i<work.size(); i++)
+					work[i]->pending = false;
+			}
+			work.insert(work.end(), _carry.begin(), _carry.end());
+			_carry.clear();
+			// Nothing refers to these any more: they've left every list and the kernel's set
+			for(size_t i=0; i<dead.size(); i++) {
+				work.erase(std::remove(work.begin(), work.end(), dead[i]), work.end());
+				delete dead[i];
+			}
+			int wait_ms = work.size() ? 0 : (int)timeout;
+#if defined(ZT_PHY_EPOLL)
+			struct epoll_event evs[ZT_PHY_EVENT_MAX_EVENTS];
+			int n = epoll_wait(_q, evs, ZT_PHY_EVENT_MAX_EVENTS, wait_ms);
+			for(int i=0; i<n; i++) {
+				sock *s = (sock*)evs[i].data.ptr;
+				if(!s) {
+					drainWhack();
+					continue;
+				}
+				if(evs[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+					s->readable = true;
+					work.push_back(s);
+				}
+				else if(evs[i].events & EPOLLOUT)
+					work.push_back(s);
+			}
+#else
+			struct kevent evs[ZT_PHY_EVENT_MAX_EVENTS];
+			struct timespec ts;
+			ts.tv_sec = wait_ms / 1000;
+			ts.tv_nsec = (wait_ms % 1000) * 1000000L;
+			int n = kevent(_q, NULL, 0, evs, ZT_PHY_EVENT_MAX_EVENTS, &ts);
+			for(int i=0; i<n; i++) {
+				sock *s = (sock*)evs[i].udata;
+				if(!s) {
+					drainWhack();
+					continue;
+				}
+				if(evs[i].filter == EVFILT_READ)
+					s->readable = true;
+				work.push_back(s);
+			}
+#endif
+			// Several reasons may have listed a socket, it gets one visit
+			std::sort(work.begin(), work.end());
+			work.erase(std::unique(work.begin(), work.end()), work.end());
+			// Writable first, as Phy does, so that data headed for the app makes room before more
+			// arrives from it
+			for(size_t i=0; i<work.size(); i++)
+				writeTo(work[i]);
+			for(size_t i=0; i<work.size(); i++) {
+				if(!work[i]->closed && work[i]->readable)
+					readFrom(work[i]);
+			}
+		}
+	};
+}
+
+#endif // ZT_PHY_EPOLL || ZT_PHY_KQUEUE
+
+#endif // ZT_PHYEVENT_HPP
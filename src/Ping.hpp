@@ -0,0 +1,144 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// Latency probes sent by the network stacks themselves, see zts_ping()
+
+#ifndef ZT_PING_HPP
+#define ZT_PING_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+// Probes per run
+#define ZT_PING_MAX_COUNT                  1000000
+
+// What follows the ICMP header or makes up the UDP datagram, at least sizeof(PingPayload)
+#define ZT_PING_SIZE                       56
+
+namespace ZeroTier {
+
+	/*
+	 * Leads the payload of every probe so replies find their way back to the run and the probe
+	 * they belong to. Echoed as is, so byte order doesn't matter
+	 */
+	struct PingPayload
+	{
+		uint32_t cookie;
+		uint32_t seq;
+	};
+
+	/*
+	 * One zts_ping() (ICMP echo) or zts_ping_udp() (datagrams to an echo service) run. The
+	 * caller's thread paces the probes, the tap's driver sends each one from the stack thread
+	 * (StackDriver::Ping()) and its callbacks report replies there, so RTTs leave out the
+	 * socketpair and the app's side of the socket layer
+	 */
+	struct PingSession
+	{
+		int proto;                       // ZTS_PING_ICMP or ZTS_PING_UDP
+		struct sockaddr_storage dst;
+		uint32_t cookie;
+		uint16_t id;                     // ICMP identifier, lwIP
+		void *handle;                    // the driver's socket or PCB, NULL until PingOpen()
+		std::vector<int> ids;            // picoTCP's ping id for each probe, -1 if none
+
+		std::mutex m;
+		std::condition_variable cv;
+		std::vector<uint64_t> sent_us;   // 0 until sent
+		std::vector<uint64_t> rtt_us;    // UINT64_MAX until replied
+		std::vector<int> replies;        // seqs in the order their replies came, not yet reported
+
+		PingSession(int count) : proto(0), cookie(0), id(0), handle(NULL),
+			ids(count, -1), sent_us(count, 0), rtt_us(count, UINT64_MAX)
+		{
+			memset(&dst, 0, sizeof(dst));
+		}
+
+		static uint64_t now_us()
+		{
+			struct timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+		}
+
+		/*
+		 * The driver calls these from the stack thread, right before a probe goes to the stack
+		 * and once the reply came out of it
+		 */
+		void sent(uint32_t seq)
+		{
+			std::lock_guard<std::mutex> _l(m);
+			if(seq < sent_us.size())
+				sent_us[seq] = now_us();
+		}
+
+		bool replied(uint32_t seq)
+		{
+			uint64_t now = now_us();
+			std::lock_guard<std::mutex> _l(m);
+			if(seq >= sent_us.size() || !sent_us[seq] || rtt_us[seq] != UINT64_MAX)
+				return false;
+			rtt_us[seq] = now - sent_us[seq];
+			replies.push_back(seq);
+			cv.notify_all();
+			return true;
+		}
+
+		/*
+		 * A reply's payload, fills in seq if it's the reply to one of this run's probes
+		 */
+		bool match(const void *payload, size_t len, uint32_t *seq) const
+		{
+			struct PingPayload p;
+			if(len < sizeof(p))
+				return false;
+			memcpy(&p, payload, sizeof(p));
+			if(p.cookie != cookie)
+				return false;
+			*seq = p.seq;
+			return true;
+		}
+
+		/*
+		 * Writes the payload of probe seq into buf (ZT_PING_SIZE bytes)
+		 */
+		void payload(uint32_t seq, void *buf) const
+		{
+			struct PingPayload p = { cookie, seq };
+			memset(buf, 0, ZT_PING_SIZE);
+			memcpy(buf, &p, sizeof(p));
+		}
+	};
+}
+
+#endif
@@ -0,0 +1,218 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// Ephemeral ports of a tap's outbound TCP connections, see SocketTap::Connect()
+
+#ifndef ZT_PORTALLOCATOR_HPP
+#define ZT_PORTALLOCATOR_HPP
+
+#include <deque>
+#include <vector>
+#include <utility>
+#include <unordered_map>
+#include <string.h>
+#include <stdint.h>
+
+#include "Utils.hpp"
+#include "libzt.h"
+
+namespace ZeroTier {
+
+	/*
+	 * A port only has to be unique per destination (address and port), so each destination has
+	 * its own bitmap of ZT_EPHEMERAL_PORT_MIN..ZT_EPHEMERAL_PORT_MAX, searched a word at a time
+	 * onward from where the last search left off, and starting at a random port (as in RFC 6056).
+	 * Released ports wait out ZT_EPHEMERAL_PORT_REUSE_DELAY so that a new connection doesn't
+	 * meet the last one's TIME_WAIT. Only used by the tap's stack thread
+	 */
+	class PortAllocator
+	{
+	public:
+		struct Key {
+			uint8_t addr[16];
+			uint16_t port;
+			uint8_t family;
+
+			Key() { memset(this, 0, sizeof(*this)); }
+
+			bool operator==(const Key &k) const { return !memcmp(this, &k, sizeof(*this)); }
+		};
+
+	private:
+		enum {
+			RANGE = ZT_EPHEMERAL_PORT_MAX - ZT_EPHEMERAL_PORT_MIN + 1,
+			WORDS = (RANGE + 63) / 64
+		};
+
+		struct KeyHash {
+			size_t operator()(const Key &k) const
+			{
+				// FNV-1a
+				uint64_t h = 0xcbf29ce484222325ULL;
+				for(size_t i=0; i<sizeof(k); i++) {
+					h ^= ((const unsigned char *)&k)[i];
+					h *= 0x100000001b3ULL;
+				}
+				return (size_t)(h ^ (h >> 32));
+			}
+		};
+
+		struct Dest {
+			uint64_t bits[WORDS];
+			uint32_t cursor; // bit the next search starts from
+			uint32_t used;   // bits set, those of ports in quarantine included
+			std::deque<std::pair<uint64_t, uint16_t> > quarantine; // released at, bit
+		};
+
+		std::unordered_map<Key, Dest*, KeyHash> _dests;
+
+		static void clearBit(Dest *d, uint32_t bit)
+		{
+			uint64_t mask = 1ULL << (bit % 64);
+			if(d->bits[bit / 64] & mask) {
+				d->bits[bit / 64] &= ~mask;
+				d->used--;
+			}
+		}
+
+		static void drain(Dest *d, uint64_t now)
+		{
+			while(!d->quarantine.empty() && now - d->quarantine.front().first >= ZT_EPHEMERAL_PORT_REUSE_DELAY) {
+				clearBit(d, d->quarantine.front().second);
+				d->quarantine.pop_front();
+			}
+		}
+
+	public:
+		~PortAllocator()
+		{
+			for(std::unordered_map<Key, Dest*, KeyHash>::iterator i(_dests.begin()); i != _dests.end(); ++i)
+				delete i->second;
+		}
+
+		/*
+		 * Returns a port (host byte order) free for connections to dst, 0 if there are none,
+		 * which leaves the choice to the stack
+		 */
+		uint16_t alloc(const Key &dst, uint64_t now)
+		{
+			Dest *&d = _dests[dst];
+			if(!d) {
+				d = new Dest();
+				memset(d->bits, 0, sizeof(d->bits));
+				// Bits past the end of the range are never handed out
+				for(uint32_t b=RANGE; b<WORDS * 64; b++)
+					d->bits[b / 64] |= 1ULL << (b % 64);
+				d->used = WORDS * 64 - RANGE;
+				uint32_t r = 0;
+				Utils::getSecureRandom(&r, sizeof(r));
+				d->cursor = r % RANGE;
+			}
+			drain(d, now);
+			if(d->used == WORDS * 64)
+				return 0;
+			uint32_t w = d->cursor / 64;
+			// Only the first word looks below the cursor last, so the search always moves on
+			uint64_t first = d->bits[w] | ((1ULL << (d->cursor % 64)) - 1);
+			for(uint32_t n=0; n<=WORDS; n++, w = (w + 1) % WORDS) {
+				uint64_t bits = n ? d->bits[w] : first;
+				if(bits == ~0ULL)
+					continue;
+				uint32_t bit = w * 64 + __builtin_ctzll(~bits);
+				d->bits[w] |= 1ULL << (bit % 64);
+				d->used++;
+				d->cursor = (bit + 1) % RANGE;
+				return (uint16_t)(ZT_EPHEMERAL_PORT_MIN + bit);
+			}
+			return 0;
+		}
+
+		/*
+		 * Gives back a port alloc() returned for dst, ports it didn't are ignored. A port
+		 * which was never used may go back at once
+		 */
+		void release(const Key &dst, uint16_t port, uint64_t now, bool used = true)
+		{
+			std::unordered_map<Key, Dest*, KeyHash>::iterator i = _dests.find(dst);
+			if(i == _dests.end() || port < ZT_EPHEMERAL_PORT_MIN)
+				return;
+			// Past the range only if ZT_EPHEMERAL_PORT_MAX is set below 65535
+			uint32_t bit = port - ZT_EPHEMERAL_PORT_MIN;
+			if(bit >= RANGE)
+				return;
+			if(!(i->second->bits[bit / 64] & (1ULL << (bit % 64))))
+				return;
+			if(used)
+				i->second->quarantine.push_back(std::make_pair(now, (uint16_t)bit));
+			else
+				clearBit(i->second, bit);
+		}
+
+		/*
+		 * Takes over the ports of from, which is left empty
+		 */
+		void merge(PortAllocator &from)
+		{
+			for(std::unordered_map<Key, Dest*, KeyHash>::iterator i(from._dests.begin()); i != from._dests.end(); ++i) {
+				Dest *&d = _dests[i->first];
+				if(!d) {
+					d = i->second;
+					continue;
+				}
+				d->used = 0;
+				for(uint32_t w=0; w<WORDS; w++) {
+					d->bits[w] |= i->second->bits[w];
+					d->used += __builtin_popcountll(d->bits[w]);
+				}
+				d->quarantine.insert(d->quarantine.end(), i->second->quarantine.begin(), i->second->quarantine.end());
+				delete i->second;
+			}
+			from._dests.clear();
+		}
+
+		/*
+		 * Frees the ports whose quarantine is over and forgets destinations which have none left
+		 */
+		void expire(uint64_t now)
+		{
+			for(std::unordered_map<Key, Dest*, KeyHash>::iterator i(_dests.begin()); i != _dests.end(); ) {
+				drain(i->second, now);
+				if(i->second->used == WORDS * 64 - RANGE) {
+					delete i->second;
+					i = _dests.erase(i);
+				}
+				else {
+					++i;
+				}
+			}
+		}
+
+		size_t destinations() const { return _dests.size(); }
+	};
+}
+
+#endif // ZT_PORTALLOCATOR_HPP
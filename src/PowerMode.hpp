@@ -0,0 +1,114 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// Coarser, shared wakeups for battery-powered devices, see zts_set_power_mode()
+
+#ifndef ZT_POWERMODE_HPP
+#define ZT_POWERMODE_HPP
+
+#include <atomic>
+#include <algorithm>
+#include <stdint.h>
+
+#include "Clock.hpp"
+#include "libzt.h"
+
+namespace ZeroTier {
+
+	/*
+	 * Outside ZTS_POWER_NORMAL timer wakeups are pushed back to the next multiple of a slot on the
+	 * steady clock, so libzt's threads (and those of every network) wake together rather than each
+	 * on its own schedule. Anything which arrives on a descriptor still wakes a thread right away
+	 */
+	class PowerMode
+	{
+	private:
+		static std::atomic<int> &mode()
+		{
+			static std::atomic<int> m(ZTS_POWER_NORMAL);
+			return m;
+		}
+
+		static unsigned long alignTo(unsigned long timeout, unsigned long slot)
+		{
+			if(!timeout)
+				return 0;
+			uint64_t now = Clock::now();
+			uint64_t due = now + timeout;
+			return (unsigned long)((due + slot - 1) / slot * slot - now);
+		}
+
+	public:
+		static void set(int m) { mode().store(m, std::memory_order_relaxed); }
+		static int get() { return mode().load(std::memory_order_relaxed); }
+		static bool normal() { return get() == ZTS_POWER_NORMAL; }
+
+		static unsigned long slot()
+		{
+			return get() == ZTS_POWER_BACKGROUND ? ZT_POWER_BACKGROUND_SLOT_MS : ZT_POWER_LOW_SLOT_MS;
+		}
+
+		/*
+		 * Longest a stack thread sleeps with no timer pending, in place of ZT_PHY_POLL_MAX_INTERVAL
+		 */
+		static unsigned long maxInterval()
+		{
+			return normal() ? ZT_PHY_POLL_MAX_INTERVAL : slot();
+		}
+
+		/*
+		 * A stack thread's (ms) timeout, rounded up to the end of its slot. 0 (more work queued)
+		 * is left alone
+		 */
+		static unsigned long align(unsigned long timeout)
+		{
+			return normal() ? timeout : alignTo(timeout, slot());
+		}
+
+		/*
+		 * Sleep of a thread which only checks on something every interval ms. Never beyond
+		 * ZT_POWER_LOW_SLOT_MS, these threads are joined on shutdown
+		 */
+		static unsigned long check(unsigned long interval)
+		{
+			return normal() ? interval
+				: alignTo(std::max(interval, (unsigned long)ZT_POWER_LOW_SLOT_MS), ZT_POWER_LOW_SLOT_MS);
+		}
+
+		/*
+		 * TCP keepalive idle time or interval (s) to give the stack
+		 */
+		static int keepalive(int secs)
+		{
+			if(get() != ZTS_POWER_BACKGROUND)
+				return secs;
+			return std::min(secs * ZT_POWER_KEEPALIVE_STRETCH, 32767);
+		}
+	};
+}
+
+#endif
@@ -0,0 +1,64 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// USDT (SystemTap SDT) probes at the data path's hot spots, compiled in with ZT_USDT=1 (see
+// make-linux.mk). Each is a nop until perf, bpftrace or stap attaches to it, e.g.
+//
+//   bpftrace -e 'usdt:./libzt.so:libzt:frame_rx { @[arg0] = hist(arg1); }'
+//
+// Provider libzt:
+//
+//   frame_rx(nwid, len)             a frame from the core was queued for picoTCP (pico_rx*())
+//   frame_rx_drop(nwid, len)        ... or dropped, the queue was full
+//   frame_poll(nwid, n)             picoTCP took n queued frames (pico_eth_poll())
+//   frame_tx(nwid, len)             the stack sent a frame (pico_eth_send(), lwIP's output)
+//   txq_full(nwid)                  the tap's TX ring was full, the stack thread waits on the core
+//   socket_event(conn, ev)          picoTCP socket activity (PICO_SOCK_EV_*)
+//   rxbuf_full(conn, queued)        RXbuf reached its high water mark, the stack holds on to data
+//   rxbuf_empty(conn)               RXbuf was drained into the socketpair
+//   txbuf_full(conn, queued)        TXbuf reached its high water mark, the socketpair stops being read
+//   txbuf_resume(conn, queued)      ... and went back under its low water mark
+//   txbuf_empty(conn)               TXbuf was drained into the stack
+
+#ifndef ZT_PROBES_HPP
+#define ZT_PROBES_HPP
+
+#if defined(ZT_USDT)
+
+#include <sys/sdt.h>
+
+#define ZT_PROBE1(name, a)          DTRACE_PROBE1(libzt, name, a)
+#define ZT_PROBE2(name, a, b)       DTRACE_PROBE2(libzt, name, a, b)
+
+#else
+
+#define ZT_PROBE1(name, a)          do {} while(0)
+#define ZT_PROBE2(name, a, b)       do {} while(0)
+
+#endif // ZT_USDT
+
+#endif // ZT_PROBES_HPP
@@ -0,0 +1,468 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "RecordStore.hpp"
+#include "libzt.h"
+
+#if defined(__APPLE__)
+#define fdatasync fsync
+#endif
+
+namespace ZeroTier {
+
+	#define ZT_RECORD_STORE_MAGIC "ZTRECDB1"
+	#define ZT_RECORD_STORE_MAGIC_LEN 8
+
+	enum {
+		REC_NETWORK = 1,
+		REC_MEMBER = 2,
+		REC_ERASE_NETWORK = 3,
+		REC_ERASE_MEMBER = 4
+	};
+
+	// Precedes every value in the log, sum covers the rest of the header and the value
+	struct rec_hdr {
+		uint32_t sum;
+		uint32_t len;
+		uint64_t nwid;
+		uint64_t node;
+		uint32_t type;
+		uint32_t reserved;
+	};
+
+	static uint32_t fnv1a(uint32_t h, const void *data, size_t len)
+	{
+		const unsigned char *p = (const unsigned char *)data;
+		for(size_t i=0; i<len; i++) {
+			h ^= p[i];
+			h *= 16777619u;
+		}
+		return h;
+	}
+
+	static uint32_t recordSum(const rec_hdr &h, const void *value)
+	{
+		uint32_t s = fnv1a(2166136261u, (const unsigned char *)&h + sizeof(h.sum), sizeof(h) - sizeof(h.sum));
+		return fnv1a(s, value, h.len);
+	}
+
+	RecordStore::RecordStore()
+		: _fd(-1),
+		_map(NULL),
+		_map_len(0),
+		_end(0),
+		_live(0)
+	{
+	}
+
+	RecordStore::~RecordStore()
+	{
+		close();
+	}
+
+	bool RecordStore::open(const std::string &path)
+	{
+		Mutex::Lock _l(_m);
+		if(_fd >= 0)
+			return false;
+		_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+		if(_fd < 0) {
+			DEBUG_ERROR("unable to open record store: %s", path.c_str());
+			return false;
+		}
+		_path = path;
+		struct stat st;
+		if(fstat(_fd, &st) == 0 && st.st_size == 0
+			&& pwrite(_fd, ZT_RECORD_STORE_MAGIC, ZT_RECORD_STORE_MAGIC_LEN, 0) != ZT_RECORD_STORE_MAGIC_LEN) {
+			DEBUG_ERROR("unable to initialize record store: %s", path.c_str());
+			::close(_fd);
+			_fd = -1;
+			return false;
+		}
+		if(!map() || _map_len < ZT_RECORD_STORE_MAGIC_LEN || memcmp(_map, ZT_RECORD_STORE_MAGIC, ZT_RECORD_STORE_MAGIC_LEN)) {
+			DEBUG_ERROR("not a record store: %s", path.c_str());
+			unmap();
+			::close(_fd);
+			_fd = -1;
+			return false;
+		}
+		if(!scan()) {
+			unmap();
+			::close(_fd);
+			_fd = -1;
+			_networks.clear();
+			return false;
+		}
+		maybeCompact();
+		return true;
+	}
+
+	void RecordStore::close()
+	{
+		Mutex::Lock _l(_m);
+		unmap();
+		if(_fd >= 0)
+			::close(_fd);
+		_fd = -1;
+		_end = _live = 0;
+		_networks.clear();
+	}
+
+	bool RecordStore::map()
+	{
+		struct stat st;
+		if(fstat(_fd, &st) < 0)
+			return false;
+		_map_len = (size_t)st.st_size;
+		if(!_map_len)
+			return true;
+		void *m = mmap(NULL, _map_len, PROT_READ, MAP_SHARED, _fd, 0);
+		if(m == MAP_FAILED) {
+			_map_len = 0;
+			return false;
+		}
+		// The snapshot is read front to back once, then looked up at random
+		madvise(m, _map_len, MADV_SEQUENTIAL);
+		_map = (const unsigned char *)m;
+		return true;
+	}
+
+	void RecordStore::unmap()
+	{
+		if(_map)
+			munmap((void *)_map, _map_len);
+		_map = NULL;
+		_map_len = 0;
+	}
+
+	bool RecordStore::scan()
+	{
+		uint64_t off = ZT_RECORD_STORE_MAGIC_LEN;
+		while(off + sizeof(rec_hdr) <= _map_len) {
+			rec_hdr h;
+			memcpy(&h, _map + off, sizeof(h));
+			uint64_t vo = off + sizeof(h);
+			if(vo + h.len > _map_len || recordSum(h, _map + vo) != h.sum)
+				break;
+			loc l = { vo, h.len };
+			uint64_t sz = sizeof(h) + h.len;
+			network &n = _networks[h.nwid];
+			if(h.type == REC_NETWORK) {
+				if(n.has_config)
+					_live -= sizeof(h) + n.config.len;
+				n.has_config = true;
+				n.config = l;
+				_live += sz;
+			}
+			else if(h.type == REC_MEMBER) {
+				std::unordered_map<uint64_t, loc>::iterator it = n.members.find(h.node);
+				if(it != n.members.end())
+					_live -= sizeof(h) + it->second.len;
+				n.members[h.node] = l;
+				_live += sz;
+			}
+			else if(h.type == REC_ERASE_NETWORK) {
+				if(n.has_config)
+					_live -= sizeof(h) + n.config.len;
+				for(std::unordered_map<uint64_t, loc>::iterator it = n.members.begin(); it != n.members.end(); ++it)
+					_live -= sizeof(h) + it->second.len;
+				_networks.erase(h.nwid);
+			}
+			else if(h.type == REC_ERASE_MEMBER) {
+				std::unordered_map<uint64_t, loc>::iterator it = n.members.find(h.node);
+				if(it != n.members.end()) {
+					_live -= sizeof(h) + it->second.len;
+					n.members.erase(it);
+				}
+				if(!n.has_config && n.members.empty())
+					_networks.erase(h.nwid);
+			}
+			else
+				break;
+			off = vo + h.len;
+		}
+		_end = off;
+		madvise((void *)_map, _map_len, MADV_RANDOM);
+		// Whatever follows was cut short by a crash (or isn't ours), appends go in its place
+		if(_end < _map_len) {
+			DEBUG_ERROR("dropping %llu bytes at the end of %s", (unsigned long long)(_map_len - _end), _path.c_str());
+			if(ftruncate(_fd, _end) < 0)
+				return false;
+			unmap();
+			return map();
+		}
+		return true;
+	}
+
+	bool RecordStore::append(uint32_t type, uint64_t nwid, uint64_t node, const std::string &json, loc *where)
+	{
+		if(_fd < 0 || json.size() > UINT32_MAX)
+			return false;
+		rec_hdr h;
+		h.len = (uint32_t)json.size();
+		h.nwid = nwid;
+		h.node = node;
+		h.type = type;
+		h.reserved = 0;
+		h.sum = recordSum(h, json.data());
+		std::string buf((const char *)&h, sizeof(h));
+		buf += json;
+		size_t done = 0;
+		while(done < buf.size()) {
+			ssize_t w = pwrite(_fd, buf.data() + done, buf.size() - done, _end + done);
+			if(w <= 0) {
+				// Anything partially written is overwritten by the next append (or dropped by scan())
+				DEBUG_ERROR("unable to write to record store: %s", _path.c_str());
+				return false;
+			}
+			done += w;
+		}
+		if(where) {
+			where->off = _end + sizeof(h);
+			where->len = h.len;
+		}
+		_end += buf.size();
+		return true;
+	}
+
+	bool RecordStore::read(const loc &l, std::string &out)
+	{
+		if(l.off + l.len <= _map_len) {
+			out.assign((const char *)_map + l.off, l.len);
+			return true;
+		}
+		out.resize(l.len);
+		size_t done = 0;
+		while(done < l.len) {
+			ssize_t r = pread(_fd, &out[done], l.len - done, l.off + done);
+			if(r <= 0)
+				return false;
+			done += r;
+		}
+		return true;
+	}
+
+	bool RecordStore::getNetwork(uint64_t nwid, std::string &json)
+	{
+		Mutex::Lock _l(_m);
+		std::unordered_map<uint64_t, network>::iterator it = _networks.find(nwid);
+		if(it == _networks.end() || !it->second.has_config)
+			return false;
+		return read(it->second.config, json);
+	}
+
+	bool RecordStore::putNetwork(uint64_t nwid, const std::string &json)
+	{
+		Mutex::Lock _l(_m);
+		loc l;
+		if(!append(REC_NETWORK, nwid, 0, json, &l))
+			return false;
+		network &n = _networks[nwid];
+		if(n.has_config)
+			_live -= sizeof(rec_hdr) + n.config.len;
+		n.has_config = true;
+		n.config = l;
+		_live += sizeof(rec_hdr) + l.len;
+		maybeCompact();
+		return true;
+	}
+
+	bool RecordStore::eraseNetwork(uint64_t nwid)
+	{
+		Mutex::Lock _l(_m);
+		std::unordered_map<uint64_t, network>::iterator it = _networks.find(nwid);
+		if(it == _networks.end())
+			return false;
+		if(!append(REC_ERASE_NETWORK, nwid, 0, std::string(), NULL))
+			return false;
+		network &n = it->second;
+		if(n.has_config)
+			_live -= sizeof(rec_hdr) + n.config.len;
+		for(std::unordered_map<uint64_t, loc>::iterator m = n.members.begin(); m != n.members.end(); ++m)
+			_live -= sizeof(rec_hdr) + m->second.len;
+		_networks.erase(it);
+		maybeCompact();
+		return true;
+	}
+
+	bool RecordStore::getMember(uint64_t nwid, uint64_t node, std::string &json)
+	{
+		Mutex::Lock _l(_m);
+		std::unordered_map<uint64_t, network>::iterator it = _networks.find(nwid);
+		if(it == _networks.end())
+			return false;
+		std::unordered_map<uint64_t, loc>::iterator m = it->second.members.find(node);
+		if(m == it->second.members.end())
+			return false;
+		return read(m->second, json);
+	}
+
+	bool RecordStore::putMember(uint64_t nwid, uint64_t node, const std::string &json)
+	{
+		Mutex::Lock _l(_m);
+		loc l;
+		if(!append(REC_MEMBER, nwid, node, json, &l))
+			return false;
+		network &n = _networks[nwid];
+		std::unordered_map<uint64_t, loc>::iterator m = n.members.find(node);
+		if(m != n.members.end())
+			_live -= sizeof(rec_hdr) + m->second.len;
+		n.members[node] = l;
+		_live += sizeof(rec_hdr) + l.len;
+		maybeCompact();
+		return true;
+	}
+
+	bool RecordStore::eraseMember(uint64_t nwid, uint64_t node)
+	{
+		Mutex::Lock _l(_m);
+		std::unordered_map<uint64_t, network>::iterator it = _networks.find(nwid);
+		if(it == _networks.end())
+			return false;
+		std::unordered_map<uint64_t, loc>::iterator m = it->second.members.find(node);
+		if(m == it->second.members.end())
+			return false;
+		if(!append(REC_ERASE_MEMBER, nwid, node, std::string(), NULL))
+			return false;
+		_live -= sizeof(rec_hdr) + m->second.len;
+		it->second.members.erase(m);
+		if(!it->second.has_config && it->second.members.empty())
+			_networks.erase(it);
+		maybeCompact();
+		return true;
+	}
+
+	std::vector<uint64_t> RecordStore::networks()
+	{
+		Mutex::Lock _l(_m);
+		std::vector<uint64_t> ids;
+		ids.reserve(_networks.size());
+		for(std::unordered_map<uint64_t, network>::iterator it = _networks.begin(); it != _networks.end(); ++it)
+			ids.push_back(it->first);
+		return ids;
+	}
+
+	std::vector<uint64_t> RecordStore::members(uint64_t nwid)
+	{
+		Mutex::Lock _l(_m);
+		std::vector<uint64_t> ids;
+		std::unordered_map<uint64_t, network>::iterator it = _networks.find(nwid);
+		if(it == _networks.end())
+			return ids;
+		ids.reserve(it->second.members.size());
+		for(std::unordered_map<uint64_t, loc>::iterator m = it->second.members.begin(); m != it->second.members.end(); ++m)
+			ids.push_back(m->first);
+		return ids;
+	}
+
+	size_t RecordStore::memberCount(uint64_t nwid)
+	{
+		Mutex::Lock _l(_m);
+		std::unordered_map<uint64_t, network>::iterator it = _networks.find(nwid);
+		return it == _networks.end() ? 0 : it->second.members.size();
+	}
+
+	bool RecordStore::compact()
+	{
+		Mutex::Lock _l(_m);
+		return rewrite();
+	}
+
+	bool RecordStore::sync()
+	{
+		Mutex::Lock _l(_m);
+		return _fd >= 0 && fdatasync(_fd) == 0;
+	}
+
+	void RecordStore::maybeCompact()
+	{
+		if(_end >= ZT_RECORD_STORE_COMPACT_MIN && _end > _live * ZT_RECORD_STORE_COMPACT_RATIO)
+			rewrite();
+	}
+
+	/*
+	 * Writes the live records to a new log next to the old one and renames it into place, the
+	 * old log stays as it was if anything fails along the way
+	 */
+	bool RecordStore::rewrite()
+	{
+		if(_fd < 0)
+			return false;
+		std::string tmp = _path + ".tmp";
+		int fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		if(fd < 0) {
+			DEBUG_ERROR("unable to create %s", tmp.c_str());
+			return false;
+		}
+		int old_fd = _fd;
+		uint64_t old_end = _end;
+		std::unordered_map<uint64_t, network> index;
+		std::string value;
+		bool ok = pwrite(fd, ZT_RECORD_STORE_MAGIC, ZT_RECORD_STORE_MAGIC_LEN, 0) == ZT_RECORD_STORE_MAGIC_LEN;
+		_end = ZT_RECORD_STORE_MAGIC_LEN;
+		for(std::unordered_map<uint64_t, network>::iterator it = _networks.begin(); ok && it != _networks.end(); ++it) {
+			network &n = index[it->first];
+			n.has_config = it->second.has_config;
+			if(n.has_config) {
+				_fd = old_fd;
+				ok = read(it->second.config, value);
+				_fd = fd;
+				ok = ok && append(REC_NETWORK, it->first, 0, value, &n.config);
+			}
+			for(std::unordered_map<uint64_t, loc>::iterator m = it->second.members.begin(); ok && m != it->second.members.end(); ++m) {
+				_fd = old_fd;
+				ok = read(m->second, value);
+				_fd = fd;
+				ok = ok && append(REC_MEMBER, it->first, m->first, value, &n.members[m->first]);
+			}
+		}
+		_fd = old_fd;
+		ok = ok && fdatasync(fd) == 0 && rename(tmp.c_str(), _path.c_str()) == 0;
+		if(!ok) {
+			DEBUG_ERROR("unable to compact %s", _path.c_str());
+			::close(fd);
+			unlink(tmp.c_str());
+			_end = old_end;
+			return false;
+		}
+		unmap();
+		::close(old_fd);
+		_fd = fd;
+		_networks.swap(index);
+		_live = _end - ZT_RECORD_STORE_MAGIC_LEN;
+		if(!map())
+			DEBUG_ERROR("unable to map %s, records are read from the file", _path.c_str());
+		return true;
+	}
+}
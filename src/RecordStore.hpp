@@ -0,0 +1,125 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// Indexed, log-structured storage for an embedded network controller's network and member
+// records (the JSON objects JSONDB keeps as network/<nwid>.json and
+// network/<nwid>/member/<node>.json)
+//
+// Every put or erase is appended to a single log file in the home path. The log is
+// memory-mapped and scanned once when opened, which leaves hash indexes mapping each
+// network and member to where its latest value lies in the file. Records are read from the
+// mapping (or, for those appended since, with pread()) so memory use is the index alone. The
+// log is rewritten with only the live records once most of it is dead (see
+// ZT_RECORD_STORE_COMPACT_RATIO)
+
+#ifndef ZT_RECORDSTORE_HPP
+#define ZT_RECORDSTORE_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "Mutex.hpp"
+
+// The log is compacted when it is this many times the size of its live records, and at
+// least ZT_RECORD_STORE_COMPACT_MIN bytes
+#define ZT_RECORD_STORE_COMPACT_RATIO      4
+#define ZT_RECORD_STORE_COMPACT_MIN        (4 * 1024 * 1024)
+
+namespace ZeroTier {
+
+	class RecordStore
+	{
+	public:
+		RecordStore();
+		~RecordStore();
+
+		/*
+		 * Opens (creating it if needed) the log at path and indexes it. A record cut short by
+		 * a crash is dropped along with anything after it
+		 */
+		bool open(const std::string &path);
+		void close();
+
+		bool getNetwork(uint64_t nwid, std::string &json);
+		bool putNetwork(uint64_t nwid, const std::string &json);
+		// Also erases the network's members
+		bool eraseNetwork(uint64_t nwid);
+
+		bool getMember(uint64_t nwid, uint64_t node, std::string &json);
+		bool putMember(uint64_t nwid, uint64_t node, const std::string &json);
+		bool eraseMember(uint64_t nwid, uint64_t node);
+
+		// Networks with a record of their own or at least one member
+		std::vector<uint64_t> networks();
+		std::vector<uint64_t> members(uint64_t nwid);
+		size_t memberCount(uint64_t nwid);
+
+		/*
+		 * Rewrites the log with only the live records, called on its own once the log has
+		 * grown past ZT_RECORD_STORE_COMPACT_RATIO times their size
+		 */
+		bool compact();
+
+		// fdatasync()s the log
+		bool sync();
+
+	private:
+		struct loc {
+			uint64_t off; // of the value in the log
+			uint32_t len;
+		};
+		struct network {
+			network() : has_config(false) {}
+			bool has_config;
+			loc config;
+			std::unordered_map<uint64_t, loc> members;
+		};
+
+		bool append(uint32_t type, uint64_t nwid, uint64_t node, const std::string &json, loc *where);
+		bool read(const loc &l, std::string &out);
+		bool map();
+		void unmap();
+		bool scan();
+		bool rewrite();
+		void maybeCompact();
+
+		std::string _path;
+		int _fd;
+		const unsigned char *_map;
+		size_t _map_len;
+		uint64_t _end;  // of the last whole record
+		uint64_t _live; // bytes of records still in the index
+		std::unordered_map<uint64_t, network> _networks;
+		Mutex _m;
+	};
+}
+
+#endif // ZT_RECORDSTORE_HPP
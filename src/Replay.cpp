@@ -0,0 +1,333 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "Replay.hpp"
+#include "Capture.hpp"
+#include "SocketTap.hpp"
+#include "libzt.h"
+
+// Larger records than this are taken for a corrupt file
+#define ZT_REPLAY_MAX_RECORD (16 * 1024 * 1024)
+// Frames due sooner than this are sent rather than slept for
+#define ZT_REPLAY_SLEEP_MIN_US 200
+
+namespace ZeroTier {
+namespace Replay {
+
+	struct iface
+	{
+		uint16_t linktype;
+		uint64_t units;                 // timestamp units per second
+	};
+
+	struct reader
+	{
+		FILE *fp;
+		bool ng;
+		bool swap;
+		// Classic pcap has a single interface, pcapng one per IDB of the current section
+		std::vector<iface> ifaces;
+		std::vector<unsigned char> buf;
+	};
+
+	struct packet
+	{
+		unsigned char *data;
+		uint32_t caplen;
+		uint32_t len;
+		uint64_t ts_ns;
+		int dir;                        // ZT_CAPTURE_IN/OUT, 0 if not recorded
+		bool ethernet;
+	};
+
+	static uint16_t get16(const reader &r, const unsigned char *p)
+	{
+		uint16_t v;
+		memcpy(&v, p, 2);
+		return r.swap ? (uint16_t)((v >> 8) | (v << 8)) : v;
+	}
+
+	static uint32_t get32(const reader &r, const unsigned char *p)
+	{
+		uint32_t v;
+		memcpy(&v, p, 4);
+		return r.swap ? __builtin_bswap32(v) : v;
+	}
+
+	static uint64_t to_ns(uint64_t ts, uint64_t units)
+	{
+		return ts / units * 1000000000ULL + ts % units * 1000000000ULL / units;
+	}
+
+	static bool read_exact(reader &r, void *p, size_t n)
+	{
+		return fread(p, 1, n, r.fp) == n;
+	}
+
+	/*
+	 * Reads the file header, leaves the file at the first record
+	 */
+	static int open_file(reader &r)
+	{
+		unsigned char h[24];
+		if(!read_exact(r, h, 4))
+			return -1;
+		uint32_t magic;
+		memcpy(&magic, h, 4);
+		if(magic == 0x0a0d0d0a) {
+			// pcapng, the section header is read as any other block
+			r.ng = true;
+			return fseek(r.fp, 0, SEEK_SET);
+		}
+		r.ng = false;
+		uint64_t units;
+		if(magic == 0xa1b2c3d4 || magic == 0xd4c3b2a1)
+			units = 1000000;
+		else if(magic == 0xa1b23c4d || magic == 0x4d3cb2a1)
+			units = 1000000000;
+		else
+			return -1;
+		r.swap = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+		if(!read_exact(r, h + 4, 20))
+			return -1;
+		iface i = { (uint16_t)get32(r, h + 20), units };
+		r.ifaces.assign(1, i);
+		return 0;
+	}
+
+	/*
+	 * Reads the next packet, returns 1, 0 at the end of the file or -1 if it's malformed
+	 */
+	static int next_pcap(reader &r, packet &p)
+	{
+		unsigned char h[16];
+		size_t got = fread(h, 1, sizeof(h), r.fp);
+		if(!got)
+			return 0;
+		if(got < sizeof(h))
+			return -1;
+		uint32_t caplen = get32(r, h + 8);
+		if(caplen > ZT_REPLAY_MAX_RECORD)
+			return -1;
+		r.buf.resize(caplen);
+		if(caplen && !read_exact(r, r.buf.data(), caplen))
+			return -1;
+		p.data = r.buf.data();
+		p.caplen = caplen;
+		p.len = get32(r, h + 12);
+		p.ts_ns = (uint64_t)get32(r, h) * 1000000000ULL + to_ns(get32(r, h + 4), r.ifaces[0].units);
+		p.dir = 0;
+		p.ethernet = r.ifaces[0].linktype == 1;
+		return 1;
+	}
+
+	static int next_ng(reader &r, packet &p)
+	{
+		while(true) {
+			unsigned char h[8];
+			size_t got = fread(h, 1, sizeof(h), r.fp);
+			if(!got)
+				return 0;
+			if(got < sizeof(h))
+				return -1;
+			uint32_t type;
+			memcpy(&type, h, 4);
+			if(type == 0x0a0d0d0a) {
+				// A new section, its byte order magic says how to read the rest of it
+				unsigned char bom[4];
+				if(!read_exact(r, bom, 4))
+					return -1;
+				uint32_t magic;
+				memcpy(&magic, bom, 4);
+				if(magic != 0x1a2b3c4d && magic != 0x4d3c2b1a)
+					return -1;
+				r.swap = magic == 0x4d3c2b1a;
+				r.ifaces.clear();
+				uint32_t total = get32(r, h + 4);
+				if(total < 28 || total > ZT_REPLAY_MAX_RECORD || fseek(r.fp, total - 12, SEEK_CUR) < 0)
+					return -1;
+				continue;
+			}
+			type = get32(r, h);
+			uint32_t total = get32(r, h + 4);
+			if(total < 12 || total % 4 || total > ZT_REPLAY_MAX_RECORD)
+				return -1;
+			r.buf.resize(total - 8);
+			if(!read_exact(r, r.buf.data(), total - 8))
+				return -1;
+			const unsigned char *b = r.buf.data();
+			size_t body = total - 12; // less the trailing length
+			if(type == 1 && body >= 8) { // IDB
+				iface i = { get16(r, b), 1000000 };
+				for(size_t o=8; o+4<=body; ) {
+					uint16_t code = get16(r, b + o), len = get16(r, b + o + 2);
+					if(!code || o + 4 + len > body)
+						break;
+					if(code == 9 && len >= 1) { // if_tsresol
+						unsigned char v = b[o + 4];
+						i.units = v & 0x80 ? (uint64_t)1 << (v & 0x7f) : 1;
+						for(int k=0; !(v & 0x80) && k<v; k++)
+							i.units *= 10;
+						if(!i.units)
+							i.units = 1000000;
+					}
+					o += 4 + ((len + 3) & ~3);
+				}
+				r.ifaces.push_back(i);
+			}
+			else if(type == 6 && body >= 20) { // EPB
+				uint32_t ifid = get32(r, b), caplen = get32(r, b + 12);
+				if(caplen > body - 20 || ifid >= r.ifaces.size())
+					return -1;
+				p.data = r.buf.data() + 20;
+				p.caplen = caplen;
+				p.len = get32(r, b + 16);
+				p.ts_ns = to_ns((uint64_t)get32(r, b + 4) << 32 | get32(r, b + 8), r.ifaces[ifid].units);
+				p.dir = 0;
+				p.ethernet = r.ifaces[ifid].linktype == 1;
+				for(size_t o=20+((caplen + 3) & ~3); o+4<=body; ) {
+					uint16_t code = get16(r, b + o), len = get16(r, b + o + 2);
+					if(!code || o + 4 + len > body)
+						break;
+					if(code == 2 && len == 4) { // epb_flags, the direction in the low bits
+						uint32_t flags = get32(r, b + o + 4) & 3;
+						p.dir = flags == 1 ? ZT_CAPTURE_IN : flags == 2 ? ZT_CAPTURE_OUT : 0;
+					}
+					o += 4 + ((len + 3) & ~3);
+				}
+				return 1;
+			}
+			else if(type == 3 && body >= 4) { // SPB, no timestamp
+				if(r.ifaces.empty())
+					return -1;
+				p.data = r.buf.data() + 4;
+				p.len = get32(r, b);
+				p.caplen = std::min(p.len, (uint32_t)(body - 4));
+				p.ts_ns = 0;
+				p.dir = 0;
+				p.ethernet = r.ifaces[0].linktype == 1;
+				return 1;
+			}
+			// Anything else (name resolution, statistics, custom blocks) is skipped
+		}
+	}
+
+	static uint64_t steady_us()
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	int run(SocketTap *tap, const char *path, const struct zts_replay_config *cfg,
+		struct zts_replay_stats *stats)
+	{
+		struct zts_replay_config defaults;
+		memset(&defaults, 0, sizeof(defaults));
+		if(!cfg)
+			cfg = &defaults;
+		memset(stats, 0, sizeof(*stats));
+		reader r;
+		r.swap = false;
+		if(!(r.fp = fopen(path, "rb")))
+			return -1;
+		uint64_t dropped0 = stat_get(tap->_stats.frames_dropped);
+		uint64_t start = steady_us();
+		unsigned int loops = cfg->loops ? cfg->loops : 1;
+		int err = 0;
+		for(unsigned int loop=0; loop<loops && !err; loop++) {
+			if(fseek(r.fp, 0, SEEK_SET) < 0 || open_file(r) < 0) {
+				errno = EINVAL;
+				err = -1;
+				break;
+			}
+			// Each pass keeps the recorded spacing from its own first frame
+			uint64_t first_ts = 0, pass_start = 0;
+			bool started = false;
+			packet p;
+			int n;
+			while((n = r.ng ? next_ng(r, p) : next_pcap(r, p)) > 0) {
+				if(!p.ethernet || p.dir == ZT_CAPTURE_OUT || p.caplen < 14) {
+					stats->skipped++;
+					continue;
+				}
+				// The stacks would take a frame cut short for a corrupt one
+				if(p.caplen < p.len) {
+					stats->truncated++;
+					continue;
+				}
+				if(cfg->speed_pct) {
+					uint64_t now = steady_us();
+					if(!started) {
+						first_ts = p.ts_ns;
+						pass_start = now;
+						started = true;
+					}
+					uint64_t offset = p.ts_ns > first_ts ? (p.ts_ns - first_ts) / 1000 : 0;
+					uint64_t due = pass_start + offset * 100 / cfg->speed_pct;
+					if(due > now + ZT_REPLAY_SLEEP_MIN_US) {
+						std::this_thread::sleep_for(std::chrono::microseconds(due - now));
+						now = steady_us();
+					}
+					if(now > due && now - due > stats->lag_max_us)
+						stats->lag_max_us = now - due;
+				}
+				MAC from, to;
+				from.setTo(p.data + 6, 6);
+				// Unicast frames were addressed to the node which captured them
+				if(!(cfg->flags & ZTS_REPLAY_KEEP_MACS) && !(p.data[0] & 1))
+					tap->_mac.copyTo(p.data, 6);
+				to.setTo(p.data, 6);
+				unsigned int etherType = (unsigned int)p.data[12] << 8 | p.data[13];
+				tap->put(from, to, etherType, p.data + 14, p.caplen - 14);
+				stats->frames++;
+				stats->bytes += p.caplen;
+			}
+			if(n < 0) {
+				errno = EINVAL;
+				err = -1;
+			}
+			stats->loops = loop + (err ? 0 : 1);
+		}
+		stats->elapsed_us = steady_us() - start;
+		stats->dropped = stat_get(tap->_stats.frames_dropped) - dropped0;
+		fclose(r.fp);
+		return err;
+	}
+
+} // namespace Replay
+} // namespace ZeroTier
@@ -0,0 +1,53 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// Feeds frames recorded in a pcap or pcapng file to a tap as if the core had delivered them
+// (see zts_replay()), so the stacks can be measured against real traffic without any peers
+
+#ifndef ZT_REPLAY_HPP
+#define ZT_REPLAY_HPP
+
+struct zts_replay_config;
+struct zts_replay_stats;
+
+namespace ZeroTier {
+
+	class SocketTap;
+
+namespace Replay {
+
+	/*
+	 * Hands the frames of path to tap->put() on the calling thread, paced as cfg says. Returns
+	 * 0 or -1 with errno set, stats holds how far it got either way
+	 */
+	int run(SocketTap *tap, const char *path, const struct zts_replay_config *cfg,
+		struct zts_replay_stats *stats);
+
+} // namespace Replay
+} // namespace ZeroTier
+
+#endif // ZT_REPLAY_HPP
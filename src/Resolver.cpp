@@ -0,0 +1,587 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Mutex.hpp"
+
+#include "Resolver.hpp"
+#include "libzt.h"
+
+#define ZT_DNS_PORT      53
+#define ZT_DNS_MSG_MAX   1232 // bytes, the EDNS payload size recommended to avoid fragmentation
+#define ZT_DNS_NAME_MAX  253
+
+#define ZT_DNS_TYPE_A    1
+#define ZT_DNS_TYPE_SOA  6
+#define ZT_DNS_TYPE_AAAA 28
+#define ZT_DNS_CLASS_IN  1
+
+#define ZT_DNS_RCODE_NOERROR  0
+#define ZT_DNS_RCODE_NXDOMAIN 3
+
+namespace ZeroTier {
+namespace Resolver {
+
+	/*
+	 * What is known about one name and record type. A name which doesn't exist (or has no
+	 * records of the type) is cached with no addresses
+	 */
+	struct answer
+	{
+		std::vector<std::string> addrs; // raw, 4 or 16 bytes each
+		int64_t expires;                // ms, steady clock
+	};
+
+	// An outstanding query for one record type
+	struct query
+	{
+		int type;
+		uint16_t id;
+		unsigned char msg[12 + ZT_DNS_NAME_MAX + 2 + 4];
+		size_t len;
+		bool done;
+		answer ans;
+	};
+
+	static Mutex _m;
+	static std::vector<struct sockaddr_storage> nameservers; // guarded by _m
+	static std::unordered_map<std::string, answer> cache;    // guarded by _m
+
+	static int64_t now()
+	{
+		return std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	static socklen_t addrLen(const struct sockaddr *addr)
+	{
+		return addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+	}
+
+	static bool sameAddr(const struct sockaddr *a, const struct sockaddr *b)
+	{
+		if(a->sa_family != b->sa_family)
+			return false;
+		if(a->sa_family == AF_INET) {
+			const struct sockaddr_in *x = (const struct sockaddr_in *)a, *y = (const struct sockaddr_in *)b;
+			return x->sin_port == y->sin_port && x->sin_addr.s_addr == y->sin_addr.s_addr;
+		}
+		const struct sockaddr_in6 *x = (const struct sockaddr_in6 *)a, *y = (const struct sockaddr_in6 *)b;
+		return x->sin6_port == y->sin6_port && !memcmp(&x->sin6_addr, &y->sin6_addr, sizeof(x->sin6_addr));
+	}
+
+	static std::string key(const std::string &name, int type)
+	{
+		return name + (type == ZT_DNS_TYPE_A ? "/A" : "/AAAA");
+	}
+
+	/*
+	 * Lowercases name and drops a trailing dot, returns false if it can't be a DNS name
+	 */
+	static bool canonical(const char *node, std::string &name)
+	{
+		name = node;
+		if(name.size() && name[name.size() - 1] == '.')
+			name.erase(name.size() - 1);
+		if(name.empty() || name.size() > ZT_DNS_NAME_MAX)
+			return false;
+		size_t label = 0;
+		for(size_t i=0; i<name.size(); i++) {
+			if(name[i] == '.') {
+				if(!label)
+					return false;
+				label = 0;
+				continue;
+			}
+			if(++label > 63)
+				return false;
+			name[i] = (char)tolower((unsigned char)name[i]);
+		}
+		return label != 0;
+	}
+
+	static void encode(query &q, const std::string &name)
+	{
+		unsigned char *m = q.msg;
+		memset(m, 0, 12);
+		m[0] = (unsigned char)(q.id >> 8);
+		m[1] = (unsigned char)q.id;
+		m[2] = 0x01; // RD
+		m[5] = 1;    // QDCOUNT
+		size_t off = 12;
+		size_t start = 0;
+		while(start <= name.size()) {
+			size_t dot = name.find('.', start);
+			if(dot == std::string::npos)
+				dot = name.size();
+			m[off++] = (unsigned char)(dot - start);
+			memcpy(m + off, name.data() + start, dot - start);
+			off += dot - start;
+			start = dot + 1;
+		}
+		m[off++] = 0;
+		m[off++] = 0;
+		m[off++] = (unsigned char)q.type;
+		m[off++] = 0;
+		m[off++] = ZT_DNS_CLASS_IN;
+		q.len = off;
+	}
+
+	static bool skipName(const unsigned char *m, size_t len, size_t &off)
+	{
+		while(off < len) {
+			unsigned char l = m[off];
+			if((l & 0xc0) == 0xc0) {
+				off += 2;
+				return off <= len;
+			}
+			if(l & 0xc0)
+				return false;
+			off += 1 + l;
+			if(!l)
+				return true;
+		}
+		return false;
+	}
+
+	static uint32_t get32(const unsigned char *p)
+	{
+		return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+	}
+
+	/*
+	 * Takes a response to q, returns false if it isn't one (or is a failure some other
+	 * nameserver might not have)
+	 */
+	static bool parse(query &q, const unsigned char *m, size_t len)
+	{
+		if(len < q.len || m[0] != q.msg[0] || m[1] != q.msg[1] || !(m[2] & 0x80))
+			return false;
+		// The question has to be ours, byte for byte
+		if(m[4] != 0 || m[5] != 1 || memcmp(m + 12, q.msg + 12, q.len - 12))
+			return false;
+		int rcode = m[3] & 0x0f;
+		if(rcode != ZT_DNS_RCODE_NOERROR && rcode != ZT_DNS_RCODE_NXDOMAIN)
+			return false;
+		unsigned int an = (m[6] << 8) | m[7], ns = (m[8] << 8) | m[9];
+		size_t off = q.len;
+		uint32_t ttl = ZT_DNS_MAX_TTL, neg_ttl = ZT_DNS_NEG_TTL;
+		for(unsigned int i=0; i<an + ns; i++) {
+			if(!skipName(m, len, off) || off + 10 > len)
+				return false;
+			int type = (m[off] << 8) | m[off + 1];
+			int cls = (m[off + 2] << 8) | m[off + 3];
+			uint32_t rttl = get32(m + off + 4);
+			size_t rdlen = (m[off + 8] << 8) | m[off + 9];
+			off += 10;
+			if(off + rdlen > len)
+				return false;
+			if(i < an && cls == ZT_DNS_CLASS_IN && type == q.type
+				&& rdlen == (q.type == ZT_DNS_TYPE_A ? 4U : 16U)) {
+				q.ans.addrs.push_back(std::string((const char *)m + off, rdlen));
+				ttl = std::min(ttl, rttl);
+			}
+			// RFC 2308, the lesser of the SOA's own TTL and its MINIMUM field
+			if(i >= an && type == ZT_DNS_TYPE_SOA && rdlen >= 20)
+				neg_ttl = std::min(std::min(rttl, get32(m + off + rdlen - 4)), (uint32_t)ZT_DNS_MAX_TTL);
+			off += rdlen;
+		}
+		// CNAMEs are followed by the nameserver, anything without an address is negative
+		q.ans.expires = now() + 1000 * (int64_t)(q.ans.addrs.size() ? ttl : neg_ttl);
+		q.done = true;
+		return true;
+	}
+
+	/*
+	 * Asks every nameserver for each of the queries, returns 0 or an EAI_* code if some
+	 * never got an answer
+	 */
+	static int ask(std::vector<query> &qs)
+	{
+		std::vector<struct sockaddr_storage> servers;
+		{
+			Mutex::Lock _l(_m);
+			servers = nameservers;
+		}
+		if(servers.empty())
+			return EAI_FAIL;
+		// One socket per address family among the nameservers
+		struct pollfd fds[2];
+		int nfds = 0, families[2];
+		for(size_t i=0; i<servers.size(); i++) {
+			int family = servers[i].ss_family, j;
+			for(j=0; j<nfds && families[j] != family; j++);
+			if(j < nfds)
+				continue;
+			if((fds[nfds].fd = zts_socket(family, SOCK_DGRAM, 0)) < 0)
+				break;
+			fds[nfds].events = POLLIN;
+			families[nfds++] = family;
+		}
+		if(!nfds)
+			return EAI_SYSTEM;
+		int err = 0;
+		for(int t=0; t<ZT_DNS_TRIES && !err; t++) {
+			size_t pending = 0;
+			for(size_t i=0; i<qs.size(); i++) {
+				if(qs[i].done)
+					continue;
+				pending++;
+				for(size_t j=0; j<servers.size(); j++) {
+					for(int k=0; k<nfds; k++) {
+						if(families[k] == servers[j].ss_family)
+							zts_sendto(fds[k].fd, qs[i].msg, qs[i].len, 0, (struct sockaddr *)&servers[j],
+								addrLen((struct sockaddr *)&servers[j]));
+					}
+				}
+			}
+			if(!pending)
+				break;
+			int64_t deadline = now() + ZT_DNS_TIMEOUT;
+			while(pending) {
+				int64_t left = deadline - now();
+				if(left <= 0)
+					break;
+				int n = zts_poll(fds, nfds, (int)left);
+				if(n < 0 && errno != EINTR) {
+					err = EAI_SYSTEM;
+					break;
+				}
+				for(int k=0; k<nfds && n > 0; k++) {
+					if(!(fds[k].revents & POLLIN))
+						continue;
+					unsigned char buf[ZT_DNS_MSG_MAX];
+					struct sockaddr_storage from;
+					socklen_t fromlen = sizeof(from);
+					ssize_t len = zts_recvfrom(fds[k].fd, buf, sizeof(buf), 0, (struct sockaddr *)&from, &fromlen);
+					if(len <= 0)
+						continue;
+					size_t j;
+					for(j=0; j<servers.size() && !sameAddr((struct sockaddr *)&from, (struct sockaddr *)&servers[j]); j++);
+					if(j == servers.size())
+						continue;
+					for(size_t i=0; i<qs.size(); i++) {
+						if(!qs[i].done && parse(qs[i], buf, (size_t)len)) {
+							pending--;
+							break;
+						}
+					}
+				}
+			}
+		}
+		for(int k=0; k<nfds; k++)
+			zts_close(fds[k].fd);
+		if(err)
+			return err;
+		for(size_t i=0; i<qs.size(); i++) {
+			if(!qs[i].done)
+				return EAI_AGAIN;
+		}
+		return 0;
+	}
+
+	static void store(const std::string &k, const answer &a)
+	{
+		Mutex::Lock _l(_m);
+		if(cache.size() >= ZT_DNS_CACHE_SZ && !cache.count(k)) {
+			int64_t t = now();
+			for(std::unordered_map<std::string, answer>::iterator i(cache.begin()); i!=cache.end();) {
+				if(i->second.expires <= t)
+					i = cache.erase(i);
+				else
+					++i;
+			}
+			// Still full, the entry closest to expiring goes
+			if(cache.size() >= ZT_DNS_CACHE_SZ) {
+				std::unordered_map<std::string, answer>::iterator oldest(cache.begin());
+				for(std::unordered_map<std::string, answer>::iterator i(cache.begin()); i!=cache.end(); ++i) {
+					if(i->second.expires < oldest->second.expires)
+						oldest = i;
+				}
+				cache.erase(oldest);
+			}
+		}
+		cache[k] = a;
+	}
+
+	static bool fresh(const std::string &k, answer &a)
+	{
+		Mutex::Lock _l(_m);
+		std::unordered_map<std::string, answer>::iterator i(cache.find(k));
+		if(i == cache.end() || i->second.expires <= now())
+			return false;
+		a = i->second;
+		return true;
+	}
+
+	/*
+	 * Appends an entry per socket type for each address to *tail
+	 */
+	static int append(struct addrinfo ***tail, const struct addrinfo *hints, int family,
+		const void *addr, uint16_t port, const char *canonname)
+	{
+		static const int socktypes[2] = { SOCK_STREAM, SOCK_DGRAM };
+		for(int i=0; i<2; i++) {
+			if(hints && hints->ai_socktype && hints->ai_socktype != socktypes[i])
+				continue;
+			struct addrinfo *ai = (struct addrinfo *)calloc(1, sizeof(struct addrinfo) + sizeof(struct sockaddr_storage));
+			if(!ai)
+				return EAI_MEMORY;
+			struct sockaddr_storage *ss = (struct sockaddr_storage *)(ai + 1);
+			if(family == AF_INET) {
+				struct sockaddr_in *in4 = (struct sockaddr_in *)ss;
+				in4->sin_family = AF_INET;
+				in4->sin_port = htons(port);
+				memcpy(&in4->sin_addr, addr, 4);
+			}
+			else {
+				struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)ss;
+				in6->sin6_family = AF_INET6;
+				in6->sin6_port = htons(port);
+				memcpy(&in6->sin6_addr, addr, 16);
+			}
+			ai->ai_family = family;
+			ai->ai_socktype = socktypes[i];
+			ai->ai_protocol = hints && hints->ai_protocol ? hints->ai_protocol
+				: (socktypes[i] == SOCK_STREAM ? IPPROTO_TCP : IPPROTO_UDP);
+			ai->ai_addr = (struct sockaddr *)ss;
+			ai->ai_addrlen = family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+			if(canonname) {
+				if(!(ai->ai_canonname = strdup(canonname))) {
+					free(ai);
+					return EAI_MEMORY;
+				}
+				canonname = NULL; // only on the first entry
+			}
+			**tail = ai;
+			*tail = &ai->ai_next;
+		}
+		return 0;
+	}
+
+	/*
+	 * Everything lookup() does, without asking a nameserver if cache_only is set (returning
+	 * false instead)
+	 */
+	static bool resolve(const char *node, const char *service, const struct addrinfo *hints,
+		struct addrinfo **res, int *status, bool cache_only)
+	{
+		*res = NULL;
+		int family = hints ? hints->ai_family : AF_UNSPEC;
+		int flags = hints ? hints->ai_flags : 0;
+		if(!node && !service) {
+			*status = EAI_NONAME;
+			return true;
+		}
+		if(family != AF_UNSPEC && family != AF_INET && family != AF_INET6) {
+			*status = EAI_FAMILY;
+			return true;
+		}
+		if(hints && hints->ai_socktype && hints->ai_socktype != SOCK_STREAM && hints->ai_socktype != SOCK_DGRAM) {
+			*status = EAI_SOCKTYPE;
+			return true;
+		}
+		uint16_t port = 0;
+		if(service) {
+			char *end;
+			long p = strtol(service, &end, 10);
+			if(!*service || *end || p < 0 || p > 65535) {
+				*status = EAI_SERVICE;
+				return true;
+			}
+			port = (uint16_t)p;
+		}
+		struct addrinfo **tail = res;
+		unsigned char raw[16];
+		// No host, the wildcard address to bind to or loopback to connect to
+		if(!node) {
+			*status = 0;
+			if(family != AF_INET6) {
+				uint32_t a = htonl((flags & AI_PASSIVE) ? INADDR_ANY : INADDR_LOOPBACK);
+				*status = append(&tail, hints, AF_INET, &a, port, NULL);
+			}
+			if(family != AF_INET && !*status)
+				*status = append(&tail, hints, AF_INET6, (flags & AI_PASSIVE) ? &in6addr_any : &in6addr_loopback, port, NULL);
+			return true;
+		}
+		if(inet_pton(AF_INET, node, raw) == 1 || inet_pton(AF_INET6, node, raw) == 1) {
+			int f = strchr(node, ':') ? AF_INET6 : AF_INET;
+			*status = family != AF_UNSPEC && family != f ? EAI_NONAME : append(&tail, hints, f, raw, port,
+				(flags & AI_CANONNAME) ? node : NULL);
+			return true;
+		}
+		std::string name;
+		if((flags & AI_NUMERICHOST) || !canonical(node, name)) {
+			*status = EAI_NONAME;
+			return true;
+		}
+		std::vector<query> qs;
+		if(family != AF_INET6) {
+			qs.push_back(query());
+			qs.back().type = ZT_DNS_TYPE_A;
+		}
+		if(family != AF_INET) {
+			qs.push_back(query());
+			qs.back().type = ZT_DNS_TYPE_AAAA;
+		}
+		bool missing = false;
+		for(size_t i=0; i<qs.size(); i++) {
+			qs[i].done = fresh(key(name, qs[i].type), qs[i].ans);
+			missing |= !qs[i].done;
+		}
+		if(missing) {
+			if(cache_only)
+				return false;
+			std::random_device rd;
+			for(size_t i=0; i<qs.size(); i++) {
+				qs[i].id = (uint16_t)rd();
+				encode(qs[i], name);
+			}
+			if((*status = ask(qs)) != 0)
+				return true;
+			for(size_t i=0; i<qs.size(); i++)
+				store(key(name, qs[i].type), qs[i].ans);
+		}
+		const char *canonname = (flags & AI_CANONNAME) ? name.c_str() : NULL;
+		*status = 0;
+		for(size_t i=0; i<qs.size() && !*status; i++) {
+			const std::vector<std::string> &addrs = qs[i].ans.addrs;
+			for(size_t j=0; j<addrs.size() && !*status; j++) {
+				*status = append(&tail, hints, qs[i].type == ZT_DNS_TYPE_A ? AF_INET : AF_INET6,
+					addrs[j].data(), port, canonname);
+				canonname = NULL;
+			}
+		}
+		if(!*status && !*res)
+			*status = EAI_NONAME;
+		if(*status) {
+			freeAddrinfo(*res);
+			*res = NULL;
+		}
+		return true;
+	}
+
+	int addNameserver(const struct sockaddr *addr)
+	{
+		if(!addr || (addr->sa_family != AF_INET && addr->sa_family != AF_INET6)) {
+			errno = EINVAL;
+			return -1;
+		}
+		struct sockaddr_storage ss;
+		memset(&ss, 0, sizeof(ss));
+		memcpy(&ss, addr, addrLen(addr));
+		uint16_t *port = addr->sa_family == AF_INET ? &((struct sockaddr_in *)&ss)->sin_port
+			: &((struct sockaddr_in6 *)&ss)->sin6_port;
+		if(!*port)
+			*port = htons(ZT_DNS_PORT);
+		Mutex::Lock _l(_m);
+		for(size_t i=0; i<nameservers.size(); i++) {
+			if(sameAddr((struct sockaddr *)&nameservers[i], (struct sockaddr *)&ss)) {
+				errno = EEXIST;
+				return -1;
+			}
+		}
+		if(nameservers.size() >= ZTS_MAX_NAMESERVERS) {
+			errno = ENOSPC;
+			return -1;
+		}
+		nameservers.push_back(ss);
+		return 0;
+	}
+
+	int delNameserver(const struct sockaddr *addr)
+	{
+		if(!addr || (addr->sa_family != AF_INET && addr->sa_family != AF_INET6)) {
+			errno = EINVAL;
+			return -1;
+		}
+		struct sockaddr_storage ss;
+		memset(&ss, 0, sizeof(ss));
+		memcpy(&ss, addr, addrLen(addr));
+		uint16_t *port = addr->sa_family == AF_INET ? &((struct sockaddr_in *)&ss)->sin_port
+			: &((struct sockaddr_in6 *)&ss)->sin6_port;
+		if(!*port)
+			*port = htons(ZT_DNS_PORT);
+		Mutex::Lock _l(_m);
+		for(size_t i=0; i<nameservers.size(); i++) {
+			if(sameAddr((struct sockaddr *)&nameservers[i], (struct sockaddr *)&ss)) {
+				nameservers.erase(nameservers.begin() + i);
+				return 0;
+			}
+		}
+		errno = ENOENT;
+		return -1;
+	}
+
+	int lookup(const char *node, const char *service, const struct addrinfo *hints,
+		struct addrinfo **res)
+	{
+		int status = EAI_FAIL;
+		resolve(node, service, hints, res, &status, false);
+		return status;
+	}
+
+	bool cached(const char *node, const char *service, const struct addrinfo *hints,
+		struct addrinfo **res, int *status)
+	{
+		return resolve(node, service, hints, res, status, true);
+	}
+
+	void freeAddrinfo(struct addrinfo *res)
+	{
+		while(res) {
+			struct addrinfo *next = res->ai_next;
+			free(res->ai_canonname);
+			free(res);
+			res = next;
+		}
+	}
+
+	void flush()
+	{
+		Mutex::Lock _l(_m);
+		cache.clear();
+	}
+
+} // namespace Resolver
+} // namespace ZeroTier
@@ -0,0 +1,70 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+
+// Name resolution through the virtual networks (see zts_getaddrinfo())
+//
+// Queries go out over libzt's own UDP sockets, so they reach nameservers on the networks the
+// way any app traffic does and work alike over either stack. Answers, and names found not to
+// exist, are cached by name and record type for as long as their TTL allows
+
+#ifndef ZT_RESOLVER_HPP
+#define ZT_RESOLVER_HPP
+
+#include <sys/socket.h>
+#include <netdb.h>
+
+namespace ZeroTier {
+namespace Resolver {
+
+	/*
+	 * Nameservers are asked in parallel, a port of 0 means 53. Return 0 or -1 with errno set
+	 */
+	int addNameserver(const struct sockaddr *addr);
+	int delNameserver(const struct sockaddr *addr);
+
+	/*
+	 * getaddrinfo(), returns 0 or an EAI_* code
+	 */
+	int lookup(const char *node, const char *service, const struct addrinfo *hints,
+		struct addrinfo **res);
+
+	/*
+	 * lookup() as far as it can go without asking a nameserver, returns false (leaving *status
+	 * alone) if one would have to be asked
+	 */
+	bool cached(const char *node, const char *service, const struct addrinfo *hints,
+		struct addrinfo **res, int *status);
+
+	void freeAddrinfo(struct addrinfo *res);
+
+	void flush();
+
+} // namespace Resolver
+} // namespace ZeroTier
+
+#endif // ZT_RESOLVER_HPP
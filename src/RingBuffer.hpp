@@ -28,11 +28,56 @@
 #define ZT_RINGBUFFER_HPP
 
 #include <memory.h>
+#include <stdint.h>
 #include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <sys/uio.h>
+
+#include "MemBudget.hpp"
+
+// Used to keep indices written by different threads on separate cache lines
+#define ZT_CACHE_LINE_SZ 64
+
+// Granularity at which SPSCChunkedBuffer grows and releases memory
+#define ZT_SOCK_BUF_CHUNK_SZ 1024 * 16
+
+// Chunks given up by parked buffers (see SPSCChunkedBuffer::park()) kept for reuse by any buffer
+#define ZT_SOCK_BUF_POOL_CHUNKS 256
 
 namespace ZeroTier {
 
-	template<typename T> class RingBuffer {
+	/*
+	 * A contiguous region of a ring buffer. Regions are returned in pairs since
+	 * readable or writable space may wrap around the physical end of the buffer,
+	 * the second region has len == 0 if it doesn't
+	 */
+	template<typename T> struct ring_span {
+		T * ptr;
+		size_t len;
+	};
+
+	// Converts a span pair to an iovec array for readv/writev/sendmsg, returns iovcnt
+	template<typename T> int ring_span_to_iov(const ring_span<T> span[2], struct iovec iov[2])
+	{
+		int cnt = 0;
+		for (int i=0; i<2; i++) {
+			if (span[i].len) {
+				iov[cnt].iov_base = span[i].ptr;
+				iov[cnt].iov_len = span[i].len * sizeof(T);
+				cnt++;
+			}
+		}
+		return cnt;
+	}
+
+	/*
+	 * RingBuffer<T> is sized at runtime, RingBuffer<T, N> is sized at compile time (see below)
+	 */
+	template<typename T, size_t N = 0> class RingBuffer;
+
+	template<typename T> class RingBuffer<T, 0> {
 
 	private:
 		T * buf;
@@ -168,6 +213,540 @@ namespace ZeroTier {
 		size_t getFree() {
 			return size - count();
 		}
+
+		// get the (up to two) contiguous regions holding unread data, returns total length
+		size_t readable_span(ring_span<T> span[2])
+		{
+			const size_t n = count();
+			span[0].ptr = buf + begin;
+			span[0].len = std::min(n, size - begin);
+			span[1].ptr = buf;
+			span[1].len = n - span[0].len;
+			return n;
+		}
+
+		// get the (up to two) contiguous regions which may be filled before produce(), returns total length
+		size_t writable_span(ring_span<T> span[2])
+		{
+			const size_t n = getFree();
+			span[0].ptr = buf + end;
+			span[0].len = std::min(n, size - end);
+			span[1].ptr = buf;
+			span[1].len = n - span[0].len;
+			return n;
+		}
+
+		int readable_iov(struct iovec iov[2])
+		{
+			ring_span<T> span[2];
+			readable_span(span);
+			return ring_span_to_iov(span, iov);
+		}
+
+		int writable_iov(struct iovec iov[2])
+		{
+			ring_span<T> span[2];
+			writable_span(span);
+			return ring_span_to_iov(span, iov);
+		}
  	};
+
+	/*
+	 * RingBuffer with a compile-time, power-of-two capacity. Indices are free-running 64-bit
+	 * totals which are masked on access, so count() is a subtraction and there's no wrap flag
+	 * or modulo on any path. Same interface as RingBuffer<T>
+	 */
+	template<typename T, size_t N> class RingBuffer {
+
+		static_assert(N && !(N & (N - 1)), "RingBuffer capacity must be a power of two");
+
+	private:
+		static const size_t MASK = N - 1;
+		T buf[N];
+		uint64_t begin;
+		uint64_t end;
+
+	public:
+		RingBuffer()
+			: begin(0),
+			end(0)
+		{
+		}
+
+		T* get_buf()
+		{
+			return buf + (begin & MASK);
+		}
+
+		size_t produce(size_t n)
+		{
+			n = std::min(n, getFree());
+			end += n;
+			return n;
+		}
+
+		size_t consume(size_t n)
+		{
+			n = std::min(n, count());
+			begin += n;
+			return n;
+		}
+
+		size_t write(const T * data, size_t n)
+		{
+			n = std::min(n, getFree());
+			const size_t e = end & MASK;
+			const size_t first_chunk = std::min(n, N - e);
+			memcpy(buf + e, data, first_chunk * sizeof(T));
+			memcpy(buf, data + first_chunk, (n - first_chunk) * sizeof(T));
+			end += n;
+			return n;
+		}
+
+		size_t read(T * dest, size_t n)
+		{
+			n = std::min(n, count());
+			const size_t b = begin & MASK;
+			const size_t first_chunk = std::min(n, N - b);
+			memcpy(dest, buf + b, first_chunk * sizeof(T));
+			memcpy(dest + first_chunk, buf, (n - first_chunk) * sizeof(T));
+			begin += n;
+			return n;
+		}
+
+		size_t count() {
+			return (size_t)(end - begin);
+		}
+
+		size_t getFree() {
+			return N - count();
+		}
+
+		size_t readable_span(ring_span<T> span[2])
+		{
+			const size_t n = count(), b = begin & MASK;
+			span[0].ptr = buf + b;
+			span[0].len = std::min(n, N - b);
+			span[1].ptr = buf;
+			span[1].len = n - span[0].len;
+			return n;
+		}
+
+		size_t writable_span(ring_span<T> span[2])
+		{
+			const size_t n = getFree(), e = end & MASK;
+			span[0].ptr = buf + e;
+			span[0].len = std::min(n, N - e);
+			span[1].ptr = buf;
+			span[1].len = n - span[0].len;
+			return n;
+		}
+
+		int readable_iov(struct iovec iov[2])
+		{
+			ring_span<T> span[2];
+			readable_span(span);
+			return ring_span_to_iov(span, iov);
+		}
+
+		int writable_iov(struct iovec iov[2])
+		{
+			ring_span<T> span[2];
+			writable_span(span);
+			return ring_span_to_iov(span, iov);
+		}
+	};
+
+	/*
+	 * Lock-free single-producer/single-consumer byte queue which grows on demand.
+	 *
+	 * Offers the same interface as RingBuffer (minus get_buf()) but may be used without an
+	 * external lock as long as only one thread calls write()/produce()/writable_span() and 
+	 * only one thread calls read()/consume()/readable_span(). Storage is a linked list of 
+	 * fixed-size chunks which are only allocated once data is queued and are handed back as 
+	 * soon as they have been consumed, so memory scales with the number of bytes in flight
+	 * rather than with capacity. Chunk k holds the elements at logical positions 
+	 * [k*CHUNK_SZ, (k+1)*CHUNK_SZ), head and tail are monotonically increasing totals, each
+	 * written by only one side. Chunks are charged to the MemBudget, a buffer which can't get
+	 * another one under it behaves as if it were full.
+	 */
+	template<typename T, size_t CHUNK_SZ = ZT_SOCK_BUF_CHUNK_SZ> class SPSCChunkedBuffer {
+
+	private:
+		struct chunk {
+			std::atomic<chunk*> next;
+			T data[CHUNK_SZ];
+		};
+
+		std::atomic<size_t> capacity;
+		std::atomic<chunk*> first; // published by the producer when the first chunk is allocated
+		std::atomic<chunk*> spare; // one consumed chunk kept around for reuse by the producer
+		char _pad0[ZT_CACHE_LINE_SZ];
+
+		// Consumer state
+		std::atomic<size_t> head; // total elements consumed, written only by the consumer
+		chunk *rchunk;
+		size_t rend; // logical position one past the end of rchunk
+		char _pad1[ZT_CACHE_LINE_SZ];
+
+		// Producer state
+		std::atomic<size_t> tail; // total elements produced, written only by the producer
+		chunk *wchunk;
+		chunk *wnext; // already linked after wchunk, cached so we never touch a consumed chunk
+		size_t wend;
+		char _pad2[ZT_CACHE_LINE_SZ];
+
+		SPSCChunkedBuffer(const SPSCChunkedBuffer<T, CHUNK_SZ> & buf);
+
+		// Shared by every buffer of this type, see park()
+		struct chunk_pool {
+			std::mutex m;
+			std::vector<chunk*> free;
+			~chunk_pool()
+			{
+				for (size_t i=0; i<free.size(); i++) {
+					free_chunk(free[i]);
+				}
+			}
+		};
+
+		static void free_chunk(chunk *c)
+		{
+			if (c) {
+				delete c;
+				MemBudget::credit(ZTS_MEM_BUFFERS, sizeof(chunk));
+			}
+		}
+
+		static chunk_pool &pool()
+		{
+			static chunk_pool p;
+			return p;
+		}
+
+		chunk *alloc_chunk()
+		{
+			chunk *c = spare.exchange(NULL, std::memory_order_acquire);
+			if (!c) {
+				chunk_pool &p = pool();
+				std::lock_guard<std::mutex> _l(p.m);
+				if (p.free.size()) {
+					c = p.free.back();
+					p.free.pop_back();
+				}
+			}
+			if (!c) {
+				if (!MemBudget::charge(ZTS_MEM_BUFFERS, sizeof(chunk))) {
+					return NULL;
+				}
+				c = new chunk;
+			}
+			c->next.store(NULL, std::memory_order_relaxed);
+			return c;
+		}
+
+		void retire_chunk(chunk *c)
+		{
+			chunk *expected = NULL;
+			if (!spare.compare_exchange_strong(expected, c, std::memory_order_release)) {
+				free_chunk(c);
+			}
+		}
+
+		// (consumer side) step onto the next chunk once everything in rchunk has been consumed
+		void advance_rchunk()
+		{
+			if (!rchunk) {
+				rchunk = first.load(std::memory_order_acquire);
+				rend = (head.load(std::memory_order_relaxed) / CHUNK_SZ + 1) * CHUNK_SZ;
+			}
+			if (head.load(std::memory_order_relaxed) == rend && rchunk) {
+				chunk *nx = rchunk->next.load(std::memory_order_acquire);
+				if (nx) {
+					retire_chunk(rchunk);
+					rchunk = nx;
+					rend += CHUNK_SZ;
+				}
+			}
+		}
+
+	public:
+		/**
+		* create a SPSCChunkedBuffer which may hold up to capacity elements. Nothing is 
+		* allocated until the first write.
+		*/
+		explicit SPSCChunkedBuffer(size_t capacity)
+			: capacity(capacity),
+			first(NULL),
+			spare(NULL),
+			head(0),
+			rchunk(NULL),
+			rend(0),
+			tail(0),
+			wchunk(NULL),
+			wnext(NULL),
+			wend(0)
+		{ }
+
+		~SPSCChunkedBuffer()
+		{
+			chunk *c = rchunk ? rchunk : first.load();
+			while (c) {
+				chunk *nx = c->next.load();
+				free_chunk(c);
+				c = nx;
+			}
+			free_chunk(spare.load());
+		}
+
+		// Discard everything queued, keeping one chunk around. Neither side may be active
+		void reset()
+		{
+			chunk *c = rchunk ? rchunk : first.load();
+			while (c) {
+				chunk *nx = c->next.load();
+				retire_chunk(c);
+				c = nx;
+			}
+			first.store(NULL);
+			head.store(0);
+			tail.store(0);
+			rchunk = wchunk = wnext = NULL;
+			rend = wend = 0;
+		}
+
+		// Give the memory of an empty buffer to the shared pool, the next write takes a chunk from
+		// it again. The totals carry on. Neither side may be active, returns the bytes released
+		size_t park()
+		{
+			if (count()) {
+				return 0;
+			}
+			std::vector<chunk*> cs;
+			for (chunk *c = rchunk ? rchunk : first.load(); c; c = c->next.load()) {
+				cs.push_back(c);
+			}
+			if (spare.load()) {
+				cs.push_back(spare.exchange(NULL));
+			}
+			first.store(NULL);
+			rchunk = wchunk = wnext = NULL;
+			rend = wend = 0;
+			if (cs.empty()) {
+				return 0;
+			}
+			chunk_pool &p = pool();
+			std::lock_guard<std::mutex> _l(p.m);
+			for (size_t i=0; i<cs.size(); i++) {
+				if (p.free.size() < ZT_SOCK_BUF_POOL_CHUNKS && !MemBudget::pressure()) {
+					p.free.push_back(cs[i]);
+				}
+				else {
+					free_chunk(cs[i]);
+				}
+			}
+			return cs.size() * sizeof(chunk);
+		}
+
+		// Frees the chunks in the shared pool (see park()), returns the bytes released
+		static size_t trim()
+		{
+			chunk_pool &p = pool();
+			std::lock_guard<std::mutex> _l(p.m);
+			size_t n = p.free.size();
+			for (size_t i=0; i<n; i++) {
+				free_chunk(p.free[i]);
+			}
+			p.free.clear();
+			return n * sizeof(chunk);
+		}
+
+		// Whether park() would have nothing to release
+		bool parked()
+		{
+			return !wchunk && !rchunk && !spare.load(std::memory_order_relaxed);
+		}
+
+		// Change the maximum number of elements which may be queued, may be called from any thread
+		void setCapacity(size_t n)
+		{
+			capacity.store(n, std::memory_order_relaxed);
+		}
+
+		// Under memory pressure no buffer holds more than ZT_MEM_PRESSURE_BUF_SZ
+		size_t getCapacity()
+		{
+			return std::min(capacity.load(std::memory_order_relaxed), MemBudget::bufCap());
+		}
+
+		// (producer side) get the (up to two) contiguous regions which may be filled before produce(), returns total length.
+		// The region following the current chunk is only allocated if more than max elements are wanted
+		size_t writable_span(ring_span<T> span[2], size_t max = (size_t)-1)
+		{
+			const size_t n = std::min(getFree(), max);
+			span[0].ptr = span[1].ptr = NULL;
+			span[0].len = span[1].len = 0;
+			if (n == 0) {
+				return 0;
+			}
+			const size_t t = tail.load(std::memory_order_relaxed);
+			if (!wchunk) {
+				// Not necessarily at 0, see park()
+				if (!(wchunk = alloc_chunk())) {
+					return 0;
+				}
+				wend = (t / CHUNK_SZ + 1) * CHUNK_SZ;
+				first.store(wchunk, std::memory_order_release);
+			}
+			if (t == wend) {
+				if (!wnext && (wnext = alloc_chunk())) {
+					wchunk->next.store(wnext, std::memory_order_release);
+				}
+				if (!wnext) {
+					return 0;
+				}
+				wchunk = wnext;
+				wnext = NULL;
+				wend += CHUNK_SZ;
+			}
+			span[0].ptr = wchunk->data + (CHUNK_SZ - (wend - t));
+			span[0].len = std::min(n, wend - t);
+			if (span[0].len < n) {
+				if (!wnext && (wnext = alloc_chunk())) {
+					wchunk->next.store(wnext, std::memory_order_release);
+				}
+				if (wnext) {
+					span[1].ptr = wnext->data;
+					span[1].len = std::min(n - span[0].len, CHUNK_SZ);
+				}
+			}
+			return span[0].len + span[1].len;
+		}
+
+		// (consumer side) get the (up to two) contiguous regions holding unread data, returns total length
+		size_t readable_span(ring_span<T> span[2])
+		{
+			const size_t n = count();
+			span[0].ptr = span[1].ptr = NULL;
+			span[0].len = span[1].len = 0;
+			if (n == 0) {
+				return 0;
+			}
+			advance_rchunk();
+			const size_t h = head.load(std::memory_order_relaxed);
+			span[0].ptr = rchunk->data + (CHUNK_SZ - (rend - h));
+			span[0].len = std::min(n, rend - h);
+			if (span[0].len < n) {
+				span[1].ptr = rchunk->next.load(std::memory_order_acquire)->data;
+				span[1].len = std::min(n - span[0].len, CHUNK_SZ);
+			}
+			return span[0].len + span[1].len;
+		}
+
+		// adjust buffer index pointer as if we copied data in (producer side)
+		size_t produce(size_t n)
+		{
+			ring_span<T> span[2];
+			n = writable_span(span, n);
+			if (n == 0) {
+				return n;
+			}
+			const size_t t = tail.load(std::memory_order_relaxed);
+			if (t + n > wend) {
+				wchunk = wnext;
+				wnext = NULL;
+				wend += CHUNK_SZ;
+			}
+			tail.store(t + n, std::memory_order_release);
+			return n;
+		}
+
+		// adjust buffer index pointer as if we copied data out (consumer side)
+		size_t consume(size_t n)
+		{
+			ring_span<T> span[2];
+			n = std::min(n, readable_span(span));
+			if (n == 0) {
+				return n;
+			}
+			const size_t h = head.load(std::memory_order_relaxed);
+			if (h + n > rend) {
+				chunk *nx = rchunk->next.load(std::memory_order_acquire);
+				retire_chunk(rchunk);
+				rchunk = nx;
+				rend += CHUNK_SZ;
+			}
+			head.store(h + n, std::memory_order_release);
+			return n;
+		}
+
+		size_t write(const T * data, size_t n)
+		{
+			size_t tot = 0;
+			while (tot < n) {
+				ring_span<T> span[2];
+				if (!writable_span(span, n - tot)) {
+					break;
+				}
+				size_t w = 0;
+				for (int i=0; i<2 && span[i].len && tot + w < n; i++) {
+					const size_t c = std::min(span[i].len, n - tot - w);
+					memcpy(span[i].ptr, data + tot + w, c * sizeof(T));
+					w += c;
+				}
+				tot += produce(w);
+			}
+			return tot;
+		}
+
+		size_t read(T * dest, size_t n)
+		{
+			size_t tot = 0;
+			while (tot < n) {
+				ring_span<T> span[2];
+				if (!readable_span(span)) {
+					break;
+				}
+				size_t r = 0;
+				for (int i=0; i<2 && span[i].len && tot + r < n; i++) {
+					const size_t c = std::min(span[i].len, n - tot - r);
+					memcpy(dest + tot + r, span[i].ptr, c * sizeof(T));
+					r += c;
+				}
+				tot += consume(r);
+			}
+			return tot;
+		}
+
+		// Elements produced (producer side) and consumed (consumer side) since construction or reset()
+		size_t produced() { return tail.load(std::memory_order_relaxed); }
+		size_t consumed() { return head.load(std::memory_order_relaxed); }
+
+		// May be called from any thread, the result is a snapshot
+		size_t count() {
+			const size_t h = head.load(std::memory_order_acquire);
+			return tail.load(std::memory_order_acquire) - h;
+		}
+
+		size_t getFree() {
+			const size_t cap = getCapacity();
+			const size_t n = count();
+			return n < cap ? cap - n : 0;
+		}
+
+		int readable_iov(struct iovec iov[2])
+		{
+			ring_span<T> span[2];
+			readable_span(span);
+			return ring_span_to_iov(span, iov);
+		}
+
+		int writable_iov(struct iovec iov[2])
+		{
+			ring_span<T> span[2];
+			writable_span(span);
+			return ring_span_to_iov(span, iov);
+		}
+	};
 }
 #endif // ZT_RINGBUFFER_HPP
@@ -0,0 +1,208 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
+
+#include "ShmBridge.hpp"
+#include "SocketTap.hpp"
+#include "PowerMode.hpp"
+
+#if defined(__linux__) && !defined(MFD_CLOEXEC)
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+// Frames handed to SocketTap::WriteRaw() at once by the TX thread
+#define ZT_SHM_TX_BATCH 32
+
+namespace ZeroTier {
+
+	ShmBridge::ShmBridge() :
+		_tap(NULL),
+		_memfd(-1),
+		_rx_evfd(-1),
+		_tx_evfd(-1),
+		_size(0),
+		_hdr(NULL),
+		_rx(NULL),
+		_tx(NULL),
+		_run(false) {}
+
+	ShmBridge *ShmBridge::create(SocketTap *tap, unsigned int slots)
+	{
+#if defined(__linux__)
+		if(!slots)
+			slots = ZTS_SHM_DEFAULT_SLOTS;
+		if(slots & (slots - 1) || slots > (1u << 20)) {
+			errno = EINVAL;
+			return NULL;
+		}
+		size_t ring_sz = sizeof(struct zts_shm_ring) + (size_t)slots * ZTS_SHM_SLOT_SZ;
+		ShmBridge *b = new ShmBridge();
+		b->_tap = tap;
+		b->_size = sizeof(struct zts_shm_header) + 2 * ring_sz;
+		b->_memfd = (int)syscall(SYS_memfd_create, "libzt-shm", MFD_CLOEXEC);
+		if(b->_memfd < 0 || ftruncate(b->_memfd, (off_t)b->_size) < 0
+			|| (b->_rx_evfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0
+			|| (b->_tx_evfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+			int err = errno;
+			delete b;
+			errno = err;
+			return NULL;
+		}
+		void *p = mmap(NULL, b->_size, PROT_READ | PROT_WRITE, MAP_SHARED, b->_memfd, 0);
+		if(p == MAP_FAILED) {
+			int err = errno;
+			delete b;
+			errno = err;
+			return NULL;
+		}
+		// ftruncate() gave us zeroes, so both rings start empty
+		b->_hdr = (struct zts_shm_header *)p;
+		b->_hdr->magic = ZTS_SHM_MAGIC;
+		b->_hdr->version = ZTS_SHM_VERSION;
+		b->_hdr->slots = slots;
+		b->_hdr->slot_sz = ZTS_SHM_SLOT_SZ;
+		b->_hdr->nwid = tap->_nwid;
+		b->_hdr->mac = tap->_mac.toInt();
+		b->_hdr->rx_off = sizeof(struct zts_shm_header);
+		b->_hdr->tx_off = sizeof(struct zts_shm_header) + ring_sz;
+		b->_rx = (struct zts_shm_ring *)((unsigned char *)p + b->_hdr->rx_off);
+		b->_tx = (struct zts_shm_ring *)((unsigned char *)p + b->_hdr->tx_off);
+		b->_run = true;
+		b->_thread = std::thread([b]() { b->txMain(); });
+		return b;
+#else
+		errno = EOPNOTSUPP;
+		return NULL;
+#endif
+	}
+
+	ShmBridge::~ShmBridge()
+	{
+		if(_thread.joinable()) {
+			_run = false;
+			uint64_t one = 1;
+			// Even if this fails the thread notices _run within a poll interval
+			if(write(_tx_evfd, &one, sizeof(one)) < 0) { }
+			_thread.join();
+		}
+		if(_hdr)
+			munmap(_hdr, _size);
+		if(_memfd >= 0)
+			close(_memfd);
+		if(_rx_evfd >= 0)
+			close(_rx_evfd);
+		if(_tx_evfd >= 0)
+			close(_tx_evfd);
+	}
+
+	void ShmBridge::push(const struct iovec *iov, int iovcnt)
+	{
+		size_t len = 0;
+		for(int i=0; i<iovcnt; i++)
+			len += iov[i].iov_len;
+		uint32_t head = _rx->head, tail = __atomic_load_n(&_rx->tail, __ATOMIC_ACQUIRE);
+		if(head - tail >= _hdr->slots || len > _hdr->slot_sz - sizeof(uint32_t)) {
+			__atomic_store_n(&_rx->drops, _rx->drops + 1, __ATOMIC_RELAXED);
+			return;
+		}
+		unsigned char *s = slot(_rx, head);
+		uint32_t l = (uint32_t)len;
+		memcpy(s, &l, sizeof(l));
+		s += sizeof(l);
+		for(int i=0; i<iovcnt; i++) {
+			memcpy(s, iov[i].iov_base, iov[i].iov_len);
+			s += iov[i].iov_len;
+		}
+		__atomic_store_n(&_rx->head, head + 1, __ATOMIC_RELEASE);
+		if(head == tail) {
+			uint64_t one = 1;
+			// Fails only with the counter saturated, a wakeup is pending regardless
+			if(write(_rx_evfd, &one, sizeof(one)) < 0) { }
+		}
+	}
+
+	void ShmBridge::info(struct zts_shm_info *info) const
+	{
+		info->memfd = _memfd;
+		info->rx_eventfd = _rx_evfd;
+		info->tx_eventfd = _tx_evfd;
+		info->size = _size;
+	}
+
+	unsigned int ShmBridge::drainTx()
+	{
+		struct zts_raw_frame frames[ZT_SHM_TX_BATCH];
+		unsigned int total = 0;
+		for(;;) {
+			uint32_t tail = _tx->tail, head = __atomic_load_n(&_tx->head, __ATOMIC_ACQUIRE);
+			int n = 0;
+			uint32_t t = tail;
+			for(; t != head && n < ZT_SHM_TX_BATCH; t++) {
+				unsigned char *s = slot(_tx, t);
+				uint32_t l;
+				memcpy(&l, s, sizeof(l));
+				// The other process is trusted with the frames, not with our memory. WriteRaw()
+				// stops at a runt, so those are dropped here
+				if(l < 14 || l > _hdr->slot_sz - sizeof(uint32_t))
+					continue;
+				frames[n].data = s + sizeof(l);
+				frames[n].len = l;
+				n++;
+			}
+			if(t == tail)
+				return total;
+			if(n)
+				_tap->WriteRaw(NULL, frames, n);
+			__atomic_store_n(&_tx->tail, t, __ATOMIC_RELEASE);
+			total += n;
+		}
+	}
+
+	void ShmBridge::txMain()
+	{
+		struct pollfd pfd;
+		pfd.fd = _tx_evfd;
+		pfd.events = POLLIN;
+		while(_run) {
+			// Checked on every wakeup, the producer only signals an empty ring
+			drainTx();
+			if(poll(&pfd, 1, PowerMode::check(ZT_API_CHECK_INTERVAL)) > 0) {
+				uint64_t count;
+				if(read(_tx_evfd, &count, sizeof(count)) < 0) { }
+			}
+		}
+	}
+}
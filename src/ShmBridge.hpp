@@ -0,0 +1,98 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// Shared memory export of a tap's frames (see zts_shm_export()): a memfd holding one ring of
+// frames from the network and one for it, with an eventfd signalling each. Frames reach the
+// RX ring from the tap's raw path (SocketTap::putRaw()), a thread of ours drains the TX ring
+
+#ifndef ZT_SHMBRIDGE_HPP
+#define ZT_SHMBRIDGE_HPP
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include <atomic>
+#include <thread>
+
+#include "libzt.h"
+
+namespace ZeroTier {
+
+	class SocketTap;
+
+	class ShmBridge
+	{
+	public:
+		/*
+		 * Maps a new bridge for tap with slots per ring and starts its TX thread, NULL with
+		 * errno set on failure
+		 */
+		static ShmBridge *create(SocketTap *tap, unsigned int slots);
+
+		/*
+		 * Stops the TX thread, closes the descriptors and unmaps. The tap must no longer
+		 * call push()
+		 */
+		~ShmBridge();
+
+		/*
+		 * Copies one frame (given as iovcnt regions) into the RX ring, dropping it if the ring
+		 * is full. Only called by the tap with _raw_m held, which makes it the sole producer
+		 */
+		void push(const struct iovec *iov, int iovcnt);
+
+		void info(struct zts_shm_info *info) const;
+
+	private:
+		ShmBridge();
+
+		SocketTap *_tap;
+		int _memfd;
+		int _rx_evfd;
+		int _tx_evfd;
+		size_t _size;
+		struct zts_shm_header *_hdr;
+		struct zts_shm_ring *_rx;
+		struct zts_shm_ring *_tx;
+		std::atomic<bool> _run;
+		std::thread _thread;
+
+		unsigned char *slot(struct zts_shm_ring *ring, uint32_t i) const
+		{
+			return (unsigned char *)ring + sizeof(struct zts_shm_ring) + (size_t)(i & (_hdr->slots - 1)) * _hdr->slot_sz;
+		}
+
+		/*
+		 * Sends whatever the TX ring holds, returns the number of frames
+		 */
+		unsigned int drainTx();
+
+		void txMain();
+	};
+}
+
+#endif // ZT_SHMBRIDGE_HPP
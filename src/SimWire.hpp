@@ -0,0 +1,325 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// In-process virtual wire between SocketTaps, for benchmarking without the ZeroTier core
+
+#ifndef ZT_SIMWIRE_HPP
+#define ZT_SIMWIRE_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <string.h>
+
+#include "MAC.hpp"
+#include "FramePool.hpp"
+#include "SocketTap.hpp"
+#include "Clock.hpp"
+#include "libzt.h"
+
+namespace ZeroTier {
+
+	/*
+	 * Carries each frame a node's tap sends to the tap(s) its destination MAC belongs to, after
+	 * the configured serialization delay, latency, jitter, loss and reordering. Impairment
+	 * decisions come from one seeded generator in the order frames are sent, so a run is
+	 * repeatable for a given seed and traffic pattern. Frames are queued in a FramePool and
+	 * handed to unicast destinations with putRef(), uncopied
+	 */
+	class SimWire
+	{
+	public:
+		// One tap on the wire, with the state of its outgoing link
+		struct node {
+			SimWire *wire;
+			SocketTap *tap;
+			uint64_t busy_until; // us, when the link has finished serializing what it holds
+			unsigned int queued; // frames sent by this node and not yet delivered
+		};
+
+	private:
+		struct frame {
+			uint64_t due;        // us
+			uint64_t seq;        // keeps frames due at the same time in the order they were sent
+			node *src;
+			MAC from;
+			MAC to;
+			unsigned int etherType;
+			unsigned char *buf;  // from _pool, the payload starts ZT_SIM_HEADROOM in
+			unsigned int len;
+
+			// Earliest first in a std::priority_queue
+			bool operator<(const frame &f) const { return due != f.due ? due > f.due : seq > f.seq; }
+		};
+
+		std::mutex _m;
+		std::condition_variable _cv;
+		std::priority_queue<frame> _q;
+		std::vector<node*> _nodes;
+		std::vector<node*> _dst; // only used by the delivery thread, or by deliver()
+		std::mutex _deliver_m;   // one deliver() at a time
+		struct zts_sim_config _cfg;
+		struct zts_sim_stats _stats;
+		uint64_t _rng;
+		uint64_t _seq;
+		bool _run;
+		FramePool *_pool;
+		std::thread _thread;
+
+		static uint64_t now() { return Clock::now_us(); }
+
+		// xorshift64*, call with _m held
+		uint64_t next()
+		{
+			_rng ^= _rng >> 12;
+			_rng ^= _rng << 25;
+			_rng ^= _rng >> 27;
+			return _rng * 2685821657736338717ULL;
+		}
+
+		bool chance(unsigned int ppm)
+		{
+			return ppm && (next() % 1000000) < ppm;
+		}
+
+		static void release(void *buf)
+		{
+			FramePool::release((unsigned char *)buf);
+		}
+
+		void threadMain()
+		{
+			std::unique_lock<std::mutex> _l(_m);
+			while(_run) {
+				uint64_t wait = deliverDue(_l);
+				if(!_run)
+					break;
+				if(wait == UINT64_MAX)
+					_cv.wait(_l);
+				else
+					_cv.wait_for(_l, std::chrono::microseconds(Clock::sleepUs(wait)));
+			}
+		}
+
+		/*
+		 * Delivers the frames which are due, returns us until the next one is (UINT64_MAX if
+		 * the wire is empty). Takes _l, which it drops while the taps take frames
+		 */
+		uint64_t deliverDue(std::unique_lock<std::mutex> &_l)
+		{
+			while(_run) {
+				if(_q.empty())
+					return UINT64_MAX;
+				uint64_t t = now();
+				if(_q.top().due > t)
+					return _q.top().due - t;
+				frame f = _q.top();
+				_q.pop();
+				_dst.clear();
+				for(size_t i=0; i<_nodes.size(); i++) {
+					if(_nodes[i] != f.src && (f.to.isMulticast() || _nodes[i]->tap->_mac == f.to))
+						_dst.push_back(_nodes[i]);
+				}
+				// Like a NIC ring the host stops draining, a unicast frame waits for a tap which
+				// can't keep up (see SocketTap::rxPressure()), still counting against its sender
+				if(_dst.size() == 1 && _dst[0]->tap->rxPressure()) {
+					f.due = t + ZT_SIM_PRESSURE_BACKOFF;
+					_q.push(f);
+					_stats.held++;
+					continue;
+				}
+				f.src->queued--;
+				_stats.frames++;
+				_stats.bytes += f.len;
+				// The stacks may send (and so call back into send()) while taking these
+				_l.unlock();
+				unsigned char *data = f.buf + ZT_SIM_HEADROOM;
+				if(_dst.size() == 1) {
+					_dst[0]->tap->putRef(f.from, f.to, f.etherType, data, f.len, ZT_SIM_HEADROOM, release, f.buf);
+				}
+				else {
+					for(size_t i=0; i<_dst.size(); i++)
+						_dst[i]->tap->put(f.from, f.to, f.etherType, data, f.len);
+					FramePool::release(f.buf);
+				}
+				_l.lock();
+			}
+			return UINT64_MAX;
+		}
+
+	public:
+		SimWire(const struct zts_sim_config *cfg)
+			: _cfg(*cfg),
+			_rng(cfg->seed ? cfg->seed : 1),
+			_seq(0),
+			_run(true),
+			_pool(new FramePool(ZT_SIM_QUEUE_FRAMES, ZT_MAX_MTU + ZT_SIM_HEADROOM))
+		{
+			memset(&_stats, 0, sizeof(_stats));
+			// In cooperative mode zts_run_once() delivers, see deliver()
+			if(!StackThread::cooperative)
+				_thread = std::thread(&SimWire::threadMain, this);
+		}
+
+		~SimWire()
+		{
+			stop();
+			for(size_t i=0; i<_nodes.size(); i++)
+				delete _nodes[i];
+		}
+
+		/*
+		 * Stops delivering, frames still on the wire are dropped. Taps may keep calling the
+		 * handler until they are gone, it discards what they send
+		 */
+		void stop()
+		{
+			{
+				std::lock_guard<std::mutex> _l(_m);
+				if(!_run)
+					return;
+				_run = false;
+				_cv.notify_all();
+			}
+			if(_thread.joinable())
+				_thread.join();
+			std::lock_guard<std::mutex> _l(_m);
+			while(!_q.empty()) {
+				FramePool::release(_q.top().buf);
+				_q.pop();
+			}
+			_pool->dispose(); // once the stacks have returned whatever they still hold
+		}
+
+		/*
+		 * The delivery thread's work, done by the caller in cooperative mode. Returns us until
+		 * the next frame is due, UINT64_MAX if there's none
+		 */
+		uint64_t deliver()
+		{
+			std::lock_guard<std::mutex> _d(_deliver_m);
+			std::unique_lock<std::mutex> _l(_m);
+			return deliverDue(_l);
+		}
+
+		// Impairments apply to frames sent from here on, the generator isn't reseeded
+		void setConfig(const struct zts_sim_config *cfg)
+		{
+			std::lock_guard<std::mutex> _l(_m);
+			_cfg = *cfg;
+		}
+
+		void stats(struct zts_sim_stats *stats)
+		{
+			std::lock_guard<std::mutex> _l(_m);
+			*stats = _stats;
+		}
+
+		// The node's tap is set (and the node put on the wire with attach()) once it has been created
+		node *newNode()
+		{
+			node *n = new node();
+			n->wire = this;
+			n->tap = NULL;
+			n->busy_until = 0;
+			n->queued = 0;
+			return n;
+		}
+
+		void attach(node *n)
+		{
+			std::lock_guard<std::mutex> _l(_m);
+			_nodes.push_back(n);
+		}
+
+		// SocketTap::_handler of every node's tap, arg is its node
+		static void handler(void *arg, void *, uint64_t, const MAC &from, const MAC &to,
+			unsigned int etherType, unsigned int, const void *data, unsigned int len)
+		{
+			node *n = (node *)arg;
+			n->wire->send(n, from, to, etherType, data, len);
+		}
+
+		void send(node *src, const MAC &from, const MAC &to, unsigned int etherType,
+			const void *data, unsigned int len)
+		{
+			uint64_t t = now();
+			std::lock_guard<std::mutex> _l(_m);
+			if(!_run || !src->tap)
+				return;
+			if(chance(_cfg.loss_ppm)) {
+				_stats.lost++;
+				return;
+			}
+			unsigned int limit = _cfg.queue_frames ? _cfg.queue_frames : ZT_SIM_QUEUE_FRAMES;
+			if(src->queued >= limit || len > _pool->bufSize() - ZT_SIM_HEADROOM) {
+				_stats.overflowed++;
+				return;
+			}
+			unsigned char *buf = _pool->acquire();
+			if(!buf) {
+				_stats.overflowed++;
+				return;
+			}
+			memcpy(buf + ZT_SIM_HEADROOM, data, len);
+			// A node's link serializes its frames one after another (ethernet header included)
+			uint64_t depart = t;
+			if(_cfg.bandwidth_bps) {
+				depart = std::max(t, src->busy_until) + (uint64_t)(len + 14) * 8 * 1000000 / _cfg.bandwidth_bps;
+				src->busy_until = depart;
+			}
+			uint64_t due = depart + _cfg.latency_ms * 1000ULL;
+			if(_cfg.jitter_ms)
+				due += next() % (_cfg.jitter_ms * 1000ULL + 1);
+			if(chance(_cfg.reorder_ppm)) { // skips the latency, overtaking what's in flight
+				due = depart;
+				_stats.reordered++;
+			}
+			frame f;
+			f.due = due;
+			f.seq = _seq++;
+			f.src = src;
+			f.from = from;
+			f.to = to;
+			f.etherType = etherType;
+			f.buf = buf;
+			f.len = len;
+			bool earliest = _q.empty() || due < _q.top().due;
+			_q.push(f);
+			src->queued++;
+			if(earliest)
+				_cv.notify_one();
+		}
+	};
+}
+
+#endif
@@ -30,12 +30,26 @@
 
 #include <algorithm>
 #include <utility>
+#include <thread>
+#include <chrono>
 #include <sys/poll.h>
+#include <sys/ioctl.h>
 #include <stdint.h>
 #include <utility>
 #include <string>
 
 #include "SocketTap.hpp"
+#include "ConnectionPool.hpp"
+#include "FdTable.hpp"
+#include "Epoll.hpp"
+#include "TapIndex.hpp"
+#include "ThreadAffinity.hpp"
+#include "LatencyTrace.hpp"
+#include "Capture.hpp"
+#include "ShmBridge.hpp"
+#include "Probes.hpp"
+#include "Clock.hpp"
+#include "FrameCompressor.hpp"
 #include "libzt.h"
 
 #if defined(STACK_PICO)
@@ -57,13 +71,51 @@
 #include "Constants.hpp"
 #include "Phy.hpp"
 
-class SocketTap;
+#ifndef ETH_P_ALL
+#define ETH_P_ALL 0x0003
+#endif
 
-extern std::vector<void*> vtaps;
+namespace ZeroTier {
+	extern std::vector<void*> vtaps;
+	extern TapIndex tapindex;
+	extern ProfiledMutex _vtaps_lock;
+	extern FdTable fdtable;
+	extern ProfiledMutex _multiplexer_lock;
+	extern ConnectionPool connpool;
+	extern ThreadAffinity affinity;
+	extern std::atomic<uint32_t> closingConns;
+}
 
 namespace ZeroTier {
 
 	int SocketTap::devno = 0;
+	std::atomic<bool> SocketTap::_rx_stamping(false);
+	std::atomic<unsigned int> SocketTap::rebindGraceMs(ZT_TAP_REBIND_GRACE_MS);
+	std::vector<SocketTap*> SocketTap::_standins;
+	Mutex SocketTap::_standins_m;
+
+	uint64_t SocketTap::rxStamp()
+	{
+		return _rx_stamping.load(std::memory_order_relaxed) ? LatencyTrace::now_ns() : 0;
+	}
+
+#if defined(STACK_PICO)
+	// Frames a tap's pool holds, see zts_set_stack_config()
+	static size_t framePoolSize()
+	{
+		struct zts_stack_config config;
+		zts_get_stack_config(&config);
+		return config.frame_pool_sz;
+	}
+#endif
+
+	// A frame pool backed as zts_stack_config.hugepages and prefault ask
+	static FramePool *newFramePool(size_t nslots, size_t buf_sz)
+	{
+		struct zts_stack_config config;
+		zts_get_stack_config(&config);
+		return new FramePool(nslots, buf_sz, config.hugepages, config.prefault != 0);
+	}
 
 	/****************************************************************************/
 	/* SocketTap Service                                                        */
@@ -82,6 +134,15 @@ namespace ZeroTier {
 			unsigned int,unsigned int,const void *,unsigned int),
 		void *arg) :
 			_handler(handler),
+			_gatherHandler(NULL),
+			_batchHandler(NULL),
+#if defined(STACK_PICO)
+			_pico_frame_pool(newFramePool(framePoolSize(), ZT_SDK_MTU + sizeof(struct pico_eth_hdr))),
+			_pico_rx_defer(false),
+			_impair_delay_ms(0),
+			_impair_loss_ppm(0),
+			_impair_rng(nwid | 1),
+#endif
 			_homePath(homePath),
 			_arg(arg),
 			_enabled(true),
@@ -90,27 +151,241 @@ namespace ZeroTier {
 			_mtu(mtu),
 			_nwid(nwid),
 			_unixListenSocket((PhySocket *)0),
-			_phy(this,false,true)
+			_stack(StackThread::acquire(nwid)),
+			_phy(_stack->_phy),
+			_driver(static_cast<TapDriver*>(stackDriverFor(nwid))),
+			_reap_m(ZTS_LOCK_TAP_REAP),
+			_tx_pool(newFramePool((ZT_FRAME_TX_RING_LEN + ZT_FRAME_TX_PRIO_RING_LEN) * 2, ZT_MAX_MTU + 32)),
+			_txq(ZT_FRAME_TX_RING_LEN),
+			_txq_prio(ZT_FRAME_TX_PRIO_RING_LEN),
+			_multicastGroups_m(ZTS_LOCK_TAP_MULTICAST),
+			_ips_m(ZTS_LOCK_TAP_IPS),
+			_tcpconns_m(ZTS_LOCK_TCPCONNS),
+			_msg(nwid, [this](uint64_t node, const void *data, unsigned int len) { emitMsg(node, data, len); })
 	{
-		vtaps.push_back((void*)this);
+		last_housekeeping_ts = 0;
+		_tune_ts = 0;
+		_direct_pending = false;
+		_tx_held = false;
+		_opts_pending = false;
+		_multicast_changed = false;
+		_nraw = 0;
+		_shm = NULL;
+		_rx_pressure = false;
+		_rx_red_rng = (uint32_t)nwid | 1;
+#if defined(STACK_LWIP)
+		// Looked at by the stack thread before lwIP has added it (see lwip_loopback_queued())
+		memset(&lwipdev, 0, sizeof(lwipdev));
+#endif
 
 		// set interface name
 		char tmp3[17];
-		ifindex = devno;
-		sprintf(tmp3, "libzt%d", devno++);
-		_dev = tmp3;
+		{
+			ProfiledMutex::Lock _l(_vtaps_lock);
+			ifindex = devno;
+			sprintf(tmp3, "libzt%d", devno++);
+			_dev = tmp3;
+			vtaps.push_back((void*)this);
+			tapindex.rebuild(vtaps);
+		}
 		DEBUG_INFO("set device name to: %s", _dev.c_str());
 
-		_thread = Thread::start(this);
+		_closing_pending = false;
+		_reap_pending = false;
+		_reap_released = 0;
+		_standin = false;
+		_standin_id = 0;
+		_tx_idle = false;
+		// In cooperative mode frames go out from the pass which sent them
+		_tx_run = ZT_FRAME_TX_RING_LEN > 0 && !StackThread::cooperative;
+		if(_tx_run)
+			_tx_thread = Thread::start(this);
+		_stack->add(this);
+		Adopt();
 	}
 
 	SocketTap::~SocketTap()
 	{
+		// Its TX thread sends through us
+		delete DetachShm();
 		_run = false;
-		_phy.whack();
-		Thread::join(_thread);
-		_phy.close(_unixListenSocket,false);
-		for(int i=0; i<_Connections.size(); i++) delete _Connections[i];
+		{
+			ProfiledMutex::Lock _l(_vtaps_lock);
+			std::vector<void*>::iterator i = std::find(vtaps.begin(), vtaps.end(), (void*)this);
+			if(i != vtaps.end()) {
+				vtaps.erase(i);
+				tapindex.rebuild(vtaps);
+			}
+		}
+		Park();
+		// Once this returns the stack thread won't touch us or our Connections' PhySockets again
+		StackThread::release(_stack, this);
+		if(_driver)
+			_driver->remove_interface(this);
+		// ...so nothing more is queued for the TX thread, which sends what's left and exits
+		if(_tx_run) {
+			{
+				std::lock_guard<std::mutex> _l(_tx_m);
+				_tx_run = false;
+				_tx_cv.notify_one();
+			}
+			Thread::join(_tx_thread);
+		}
+		// Closures which never got to finish (those closed in the stack already are in _reap_q)
+		for(size_t i=0; i<_closing.size(); i++) {
+			if(_closing[i]->closure_ts == -1)
+				closingConns--;
+			if(_closing[i]->close_cb)
+				_closing[i]->close_cb(_closing[i]->close_fd, ECANCELED, _closing[i]->close_arg);
+		}
+		for(int i=0; i<_Connections.size(); i++) {
+			_Connections[i]->zc_fail(ECANCELED);
+			delete _Connections[i];
+		}
+		closingConns -= (uint32_t)_reap_q.size();
+		{
+			Mutex::Lock _l(_raw_m);
+			for(size_t i=0; i<_rawConns.size(); i++)
+				_rawConns[i]->tap = NULL;
+		}
+#if defined(STACK_PICO)
+		// picoTCP may still own some of these buffers, the pool is freed once they're returned
+		_pico_frame_pool->dispose();
+#endif
+		// Any frames still in _txq or _txq_prio are returned to the pool as it goes, see FramePool::dispose()
+		_tx_pool->dispose();
+	}
+
+	// What a stand-in sends goes nowhere, see Park()
+	static void standinHandler(void *, void *, uint64_t, const MAC &, const MAC &, unsigned int,
+		unsigned int, const void *, unsigned int) {}
+
+	void SocketTap::Park()
+	{
+		static std::atomic<uint64_t> standins(0);
+		unsigned int grace = rebindGraceMs;
+		if(_standin || !grace || !_driver || !_driver->rebinds())
+			return;
+		{
+			ProfiledMutex::Lock _l(_tcpconns_m);
+			if(!_Connections.size())
+				return;
+		}
+		// The stand-in, and the next tap after it, get our stack thread since that's where the
+		// Connections' PhySockets are
+		StackThread::hold(_stack, _nwid);
+		SocketTap *standin = new SocketTap(_homePath.c_str(), _mac, _mtu, 0, _nwid, "standin",
+			standinHandler, NULL);
+		{
+			ProfiledMutex::Lock _l(_vtaps_lock);
+			vtaps.erase(std::remove(vtaps.begin(), vtaps.end(), (void*)standin), vtaps.end());
+			tapindex.rebuild(vtaps);
+		}
+		standin->_standin = true;
+		standin->_standin_id = ++standins;
+		RunOnStack([&]() { MoveConnections(this, standin); });
+		DEBUG_INFO("nwid=%llx, connections wait %u ms for the next tap", (unsigned long long)_nwid, grace);
+		{
+			Mutex::Lock _l(_standins_m);
+			_standins.push_back(standin);
+		}
+		StackThread::hold(_stack, _nwid);
+		uint64_t id = standin->_standin_id;
+		std::thread([id, grace]() {
+			std::this_thread::sleep_for(std::chrono::milliseconds(Clock::sleepMs(grace)));
+			ExpireStandin(id);
+		}).detach();
+	}
+
+	void SocketTap::Adopt()
+	{
+		SocketTap *standin = NULL;
+		{
+			Mutex::Lock _l(_standins_m);
+			for(size_t i=0; i<_standins.size(); i++) {
+				if(_standins[i]->_nwid == _nwid && _standins[i]->_stack == _stack) {
+					standin = _standins[i];
+					_standins.erase(_standins.begin() + i);
+					break;
+				}
+			}
+		}
+		if(!standin)
+			return;
+		DEBUG_INFO("nwid=%llx, taking over connections", (unsigned long long)_nwid);
+		RunOnStack([&]() { MoveConnections(standin, this); });
+		delete standin;
+	}
+
+	void SocketTap::ExpireStandin(uint64_t standin_id)
+	{
+		SocketTap *standin = NULL;
+		{
+			Mutex::Lock _l(_standins_m);
+			for(size_t i=0; i<_standins.size(); i++) {
+				if(_standins[i]->_standin_id == standin_id) {
+					standin = _standins[i];
+					_standins.erase(_standins.begin() + i);
+					break;
+				}
+			}
+		}
+		if(!standin)
+			return; // taken over
+		DEBUG_INFO("nwid=%llx, no tap in time", (unsigned long long)standin->_nwid);
+		StackThread::unhold(standin->_stack, standin->_nwid);
+		standin->RunOnStack([standin]() {
+			ProfiledMutex::Lock _l(standin->_tcpconns_m);
+			for(size_t i=0; i<standin->_Connections.size(); i++)
+				standin->_driver->Close(standin->_Connections[i]);
+		});
+		delete standin;
+	}
+
+	void SocketTap::MoveConnections(SocketTap *from, SocketTap *to)
+	{
+		{
+			ProfiledMutex::Lock _fl(from->_tcpconns_m);
+			ProfiledMutex::Lock _tl(to->_tcpconns_m);
+			while(from->_Connections.size()) {
+				Connection *conn = from->_Connections[0];
+				from->_Connections.remove(conn);
+				to->_Connections.add(conn);
+				conn->tap = to;
+				conn->admit = 0; // to's Admission hasn't counted it
+				from->_driver->Rebind(conn, to);
+				fdtable.retap(conn->app_fd, conn, to);
+			}
+			// Taps on one stack thread, the Connections' ports go with them
+			to->_ports.merge(from->_ports);
+#if defined(STACK_LWIP)
+			to->_lwip_accepted.insert(to->_lwip_accepted.end(), from->_lwip_accepted.begin(),
+				from->_lwip_accepted.end());
+			from->_lwip_accepted.clear();
+#endif
+		}
+		{
+			Mutex::Lock _fl(from->_closing_m);
+			Mutex::Lock _tl(to->_closing_m);
+			for(size_t i=0; i<from->_closing.size(); i++) {
+				from->_closing[i]->tap = to;
+				from->_closing[i]->admit = 0;
+			}
+			to->_closing.insert(to->_closing.end(), from->_closing.begin(), from->_closing.end());
+			from->_closing.clear();
+			to->_closing_pending = to->_closing.size() > 0;
+		}
+		{
+			ProfiledMutex::Lock _fl(from->_reap_m);
+			ProfiledMutex::Lock _tl(to->_reap_m);
+			for(size_t i=0; i<from->_reap_q.size(); i++) {
+				from->_reap_q[i]->tap = to;
+				from->_reap_q[i]->admit = 0;
+			}
+			to->_reap_q.insert(to->_reap_q.end(), from->_reap_q.begin(), from->_reap_q.end());
+			from->_reap_q.clear();
+			to->_reap_pending = to->_reap_q.size() > 0;
+		}
 	}
 
 	void SocketTap::setEnabled(bool en)
@@ -125,18 +400,8 @@ namespace ZeroTier {
 
 	bool SocketTap::registerIpWithStack(const InetAddress &ip)
 	{
-#if defined(STACK_PICO)
-		if(picostack){
-			picostack->pico_init_interface(this, ip);
-			return true;
-		}
-#endif
-#if defined(STACK_LWIP)
-		if(lwipstack){
-			lwipstack->lwip_init_interface(this, ip);
-			return true;
-		}
-#endif
+		if(_driver)
+			return _driver->init_interface(this, ip);
 		return false;
 	}
 
@@ -145,16 +410,26 @@ namespace ZeroTier {
 #if defined(NO_STACK)
 		char ipbuf[64];
 		DEBUG_INFO("addIp (%s)", ip.toString(ipbuf));
-		_ips.push_back(ip);
-		std::sort(_ips.begin(),_ips.end());
+		{
+			ProfiledMutex::Lock _l(_ips_m);
+			_ips.push_back(ip);
+			std::sort(_ips.begin(),_ips.end());
+		}
+		joinMulticastGroup(MulticastGroup::deriveMulticastGroupForAddressResolution(ip));
+		routesChanged();
 		return true;
 #endif
 		if(registerIpWithStack(ip))
 		{
 			// only start the stack if we successfully registered and initialized a device to 
 			// the given address
-			_ips.push_back(ip);
-			std::sort(_ips.begin(),_ips.end());
+			{
+				ProfiledMutex::Lock _l(_ips_m);
+				_ips.push_back(ip);
+				std::sort(_ips.begin(),_ips.end());
+			}
+			joinMulticastGroup(MulticastGroup::deriveMulticastGroupForAddressResolution(ip));
+			routesChanged();
 			return true;
 		}
 		return false;
@@ -162,37 +437,285 @@ namespace ZeroTier {
 
 	bool SocketTap::removeIp(const InetAddress &ip)
 	{
-		Mutex::Lock _l(_ips_m);
-		std::vector<InetAddress>::iterator i(std::find(_ips.begin(),_ips.end(),ip));
-		if (i == _ips.end())
-			return false;
-		_ips.erase(i);
-		if (ip.isV4()) {
-			// FIXME: De-register from network stacks
-		}
-		if (ip.isV6()) {
-			// FIXME: De-register from network stacks
+		{
+			ProfiledMutex::Lock _l(_ips_m);
+			std::vector<InetAddress>::iterator i(std::find(_ips.begin(),_ips.end(),ip));
+			if (i == _ips.end())
+				return false;
+			_ips.erase(i);
 		}
+		leaveMulticastGroup(MulticastGroup::deriveMulticastGroupForAddressResolution(ip));
+		routesChanged();
+		RunOnStack([&]() {
+			if(_driver)
+				_driver->remove_interface_ip(this, ip);
+		});
 		return true;
 	}
 
+	void SocketTap::routesChanged()
+	{
+		ProfiledMutex::Lock _l(_vtaps_lock);
+		tapindex.rebuild(vtaps);
+	}
+
 	std::vector<InetAddress> SocketTap::ips() const
 	{
-		Mutex::Lock _l(_ips_m);
+		ProfiledMutex::Lock _l(_ips_m);
 		return _ips;
 	}
 
 	void SocketTap::put(const MAC &from,const MAC &to,unsigned int etherType,
 		const void *data,unsigned int len)
 	{
-#if defined(STACK_PICO)
-		if(picostack)
-			picostack->pico_rx(this,from,to,etherType,data,len);
-#endif
-#if defined(STACK_LWIP)
-		if(lwipstack)
-			lwipstack->lwip_rx(this,from,to,etherType,data,len);
-#endif  
+		if(etherType == ZT_COMPRESS_ETHERTYPE) {
+			putCompressed(from,to,data,len);
+			return;
+		}
+		// Decoded ones are counted as put() sees them
+		if(!_admission.frameAdmit(from)) {
+			stat_add(_stats.frames_limited, 1);
+			stat_add(_stats.frames_dropped, 1);
+			return;
+		}
+		if(Capture::active.load(std::memory_order_relaxed))
+			Capture::frame(_nwid,ZT_CAPTURE_IN,from,to,etherType,data,len);
+		if(_nraw.load(std::memory_order_relaxed))
+			putRaw(from,to,etherType,data,len);
+		if(etherType == ZT_MSG_ETHERTYPE) {
+			putMsg(from,data,len);
+			return;
+		}
+		if(_driver)
+			_driver->rx(this,from,to,etherType,data,len);
+	}
+
+	void SocketTap::putRef(const MAC &from,const MAC &to,unsigned int etherType,void *data,
+		unsigned int len,unsigned int headroom,void (*release)(void *),void *arg)
+	{
+		if(etherType == ZT_COMPRESS_ETHERTYPE) {
+			putCompressed(from,to,data,len);
+			release(arg);
+			return;
+		}
+		if(!_admission.frameAdmit(from)) {
+			stat_add(_stats.frames_limited, 1);
+			stat_add(_stats.frames_dropped, 1);
+			release(arg);
+			return;
+		}
+		// Before the stack may release data
+		if(Capture::active.load(std::memory_order_relaxed))
+			Capture::frame(_nwid,ZT_CAPTURE_IN,from,to,etherType,data,len);
+		if(_nraw.load(std::memory_order_relaxed))
+			putRaw(from,to,etherType,data,len);
+		if(etherType == ZT_MSG_ETHERTYPE) {
+			putMsg(from,data,len);
+			release(arg);
+			return;
+		}
+		// picoTCP frames are copied into pooled buffers anyway, see pico_rx()
+		if(_driver)
+			_driver->rx_ref(this,from,to,etherType,data,len,headroom,release,arg);
+		else
+			release(arg);
+	}
+
+	void SocketTap::putBatch(const TapFrame *frames, unsigned int n)
+	{
+		if(!frames || !n)
+			return;
+		// Compressed frames are decoded in between runs of the others, keeping their order
+		unsigned int start = 0;
+		for(unsigned int i=0; i<n; i++) {
+			if(frames[i].etherType != ZT_COMPRESS_ETHERTYPE)
+				continue;
+			if(i > start)
+				putBatch(frames + start, i - start);
+			putCompressed(frames[i].from,frames[i].to,frames[i].data,frames[i].len);
+			start = i + 1;
+		}
+		if(start) {
+			if(start < n)
+				putBatch(frames + start, n - start);
+			return;
+		}
+		if(!_admission.framesLimited()) {
+			putAdmitted(frames, n);
+			return;
+		}
+		// Those over their source's rate are left out, the rest go on in runs
+		for(unsigned int i=0; i<n; i++) {
+			if(_admission.frameAdmit(frames[i].from))
+				continue;
+			stat_add(_stats.frames_limited, 1);
+			stat_add(_stats.frames_dropped, 1);
+			if(i > start)
+				putAdmitted(frames + start, i - start);
+			start = i + 1;
+		}
+		if(start < n)
+			putAdmitted(frames + start, n - start);
+	}
+
+	void SocketTap::putAdmitted(const TapFrame *frames, unsigned int n)
+	{
+		if(Capture::active.load(std::memory_order_relaxed)) {
+			for(unsigned int i=0; i<n; i++)
+				Capture::frame(_nwid,ZT_CAPTURE_IN,frames[i].from,frames[i].to,frames[i].etherType,frames[i].data,frames[i].len);
+		}
+		if(_nraw.load(std::memory_order_relaxed)) {
+			for(unsigned int i=0; i<n; i++)
+				putRaw(frames[i].from,frames[i].to,frames[i].etherType,frames[i].data,frames[i].len);
+		}
+		// Messages are taken out, the stack gets the runs in between
+		unsigned int start = 0;
+		for(unsigned int i=0; i<n; i++) {
+			if(frames[i].etherType != ZT_MSG_ETHERTYPE)
+				continue;
+			if(i > start && _driver)
+				_driver->rx_batch(this,frames + start,i - start);
+			putMsg(frames[i].from,frames[i].data,frames[i].len);
+			start = i + 1;
+		}
+		if(start < n && _driver)
+			_driver->rx_batch(this,frames + start,n - start);
+	}
+
+	void SocketTap::putMsg(const MAC &from,const void *data,unsigned int len)
+	{
+		stat_add(_stats.frames_in, 1);
+		stat_add(_stats.bytes_in, len);
+		_msg.input(from.toAddress(_nwid).toInt(),data,len);
+	}
+
+	void SocketTap::emitMsg(uint64_t node,const void *data,unsigned int len)
+	{
+		MAC to(Address(node),_nwid);
+		if(Capture::active.load(std::memory_order_relaxed))
+			Capture::frame(_nwid,ZT_CAPTURE_OUT,_mac,to,ZT_MSG_ETHERTYPE,data,len);
+		_handler(_arg,NULL,_nwid,_mac,to,ZT_MSG_ETHERTYPE,0,data,len);
+		stat_add(_stats.frames_out, 1);
+		stat_add(_stats.bytes_out, len);
+	}
+
+	void SocketTap::putCompressed(const MAC &from,const MAC &to,const void *data,unsigned int len)
+	{
+		unsigned char buf[ZT_MAX_MTU];
+		unsigned int etherType = 0;
+		int n = _compressor.uncompress(from,data,len,etherType,buf);
+		if(n < 0 || etherType == ZT_COMPRESS_ETHERTYPE) {
+			stat_add(_stats.decompress_errors, 1);
+			stat_add(_stats.frames_dropped, 1);
+			return;
+		}
+		if(!n) {
+			// Answered by the TX thread, without one the peer learns of us from our own HELLOs
+			if(_tx_run && _compressor.acksPending()) {
+				std::lock_guard<std::mutex> _l(_tx_m);
+				_tx_cv.notify_one();
+			}
+			return;
+		}
+		stat_add(_stats.decompressed, 1);
+		put(from,to,etherType,buf,(unsigned int)n);
+	}
+
+	bool SocketTap::rxAdmit(size_t queued)
+	{
+		const size_t cap = ZT_FRAME_RX_QUEUE_LEN, red_min = cap * ZT_FRAME_RX_RED_MIN / 100;
+		if(queued * 100 >= cap * ZT_FRAME_RX_PRESSURE_ON && !_rx_pressure.exchange(true))
+			stat_add(_stats.rx_pressure_events, 1);
+		if(queued >= cap) {
+			stat_add(_stats.rxq_overflows, 1);
+			return false;
+		}
+		if(queued <= red_min)
+			return true;
+		// xorshift32, concurrent callers only make it less predictable
+		uint32_t x = _rx_red_rng.load(std::memory_order_relaxed);
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		_rx_red_rng.store(x, std::memory_order_relaxed);
+		// From never at red_min to always at cap
+		if(x % (cap - red_min) < queued - red_min) {
+			stat_add(_stats.rxq_early_drops, 1);
+			return false;
+		}
+		return true;
+	}
+
+	void SocketTap::rxDrained(size_t queued)
+	{
+		if(queued * 100 < (size_t)ZT_FRAME_RX_QUEUE_LEN * ZT_FRAME_RX_PRESSURE_OFF)
+			_rx_pressure.store(false, std::memory_order_relaxed);
+	}
+
+	void SocketTap::putRaw(const MAC &from,const MAC &to,unsigned int etherType,const void *data,
+		unsigned int len)
+	{
+		struct ether_header eh;
+		to.copyTo(eh.ether_dhost, 6);
+		from.copyTo(eh.ether_shost, 6);
+		eh.ether_type = Utils::hton((uint16_t)etherType);
+		struct iovec iov[2];
+		iov[0].iov_base = &eh;
+		iov[0].iov_len = sizeof(eh);
+		iov[1].iov_base = (void*)data;
+		iov[1].iov_len = len;
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 2;
+		Mutex::Lock _l(_raw_m);
+		if(_shm)
+			_shm->push(iov, 2);
+		for(size_t i=0; i<_rawConns.size(); i++) {
+			Connection *conn = _rawConns[i];
+			// As given to zts_socket()/zts_bind(), in network byte order like AF_PACKET's
+			uint16_t proto = Utils::ntoh((uint16_t)conn->protocol);
+			if(proto != ETH_P_ALL && proto != etherType)
+				continue;
+			if(sendmsg(conn->sdk_fd, &msg, MSG_DONTWAIT) < 0)
+				conn->rxq_drops++;
+			else
+				stat_add(conn->stats.bytes_in, len + sizeof(eh));
+		}
+	}
+
+	void SocketTap::AddRaw(Connection *conn)
+	{
+		Mutex::Lock _l(_raw_m);
+		if(std::find(_rawConns.begin(), _rawConns.end(), conn) == _rawConns.end())
+			_rawConns.push_back(conn);
+		_nraw = (int)_rawConns.size() + (_shm ? 1 : 0);
+	}
+
+	void SocketTap::RemoveRaw(Connection *conn)
+	{
+		Mutex::Lock _l(_raw_m);
+		_rawConns.erase(std::remove(_rawConns.begin(), _rawConns.end(), conn), _rawConns.end());
+		_nraw = (int)_rawConns.size() + (_shm ? 1 : 0);
+	}
+
+	bool SocketTap::AttachShm(ShmBridge *shm)
+	{
+		Mutex::Lock _l(_raw_m);
+		if(_shm)
+			return false;
+		_shm = shm;
+		_nraw = (int)_rawConns.size() + 1;
+		return true;
+	}
+
+	ShmBridge *SocketTap::DetachShm()
+	{
+		Mutex::Lock _l(_raw_m);
+		ShmBridge *shm = _shm;
+		_shm = NULL;
+		_nraw = (int)_rawConns.size();
+		return shm;
 	}
 
 	std::string SocketTap::deviceName() const
@@ -209,47 +732,89 @@ namespace ZeroTier {
 	void SocketTap::scanMulticastGroups(std::vector<MulticastGroup> &added,
 		std::vector<MulticastGroup> &removed)
 	{
-		std::vector<MulticastGroup> newGroups;
-		Mutex::Lock _l(_multicastGroups_m);
-		// TODO: get multicast subscriptions from network stack
-		std::vector<InetAddress> allIps(ips());
-		for(std::vector<InetAddress>::iterator ip(allIps.begin());ip!=allIps.end();++ip)
-			newGroups.push_back(MulticastGroup::deriveMulticastGroupForAddressResolution(*ip));
+		if(!_multicast_changed.load(std::memory_order_acquire))
+			return;
+		ProfiledMutex::Lock _l(_multicastGroups_m);
+		added.insert(added.end(), _multicastAdded.begin(), _multicastAdded.end());
+		removed.insert(removed.end(), _multicastRemoved.begin(), _multicastRemoved.end());
+		_multicastAdded.clear();
+		_multicastRemoved.clear();
+		_multicast_changed = false;
+	}
 
-		std::sort(newGroups.begin(),newGroups.end());
-		std::unique(newGroups.begin(),newGroups.end());
+	void SocketTap::joinMulticastGroup(const MulticastGroup &mg)
+	{
+		ProfiledMutex::Lock _l(_multicastGroups_m);
+		if(_multicastGroups[mg]++)
+			return;
+		// Left and joined again before the core noticed, it's still in there
+		std::vector<MulticastGroup>::iterator r(std::find(_multicastRemoved.begin(),_multicastRemoved.end(),mg));
+		if(r != _multicastRemoved.end())
+			_multicastRemoved.erase(r);
+		else
+			_multicastAdded.push_back(mg);
+		_multicast_changed = true;
+	}
 
-		for(std::vector<MulticastGroup>::iterator m(newGroups.begin());m!=newGroups.end();++m) {
-			if (!std::binary_search(_multicastGroups.begin(),_multicastGroups.end(),*m))
-				added.push_back(*m);
+	void SocketTap::leaveMulticastGroup(const MulticastGroup &mg)
+	{
+		ProfiledMutex::Lock _l(_multicastGroups_m);
+		std::map<MulticastGroup,unsigned int>::iterator g(_multicastGroups.find(mg));
+		if(g == _multicastGroups.end() || --g->second)
+			return;
+		_multicastGroups.erase(g);
+		std::vector<MulticastGroup>::iterator a(std::find(_multicastAdded.begin(),_multicastAdded.end(),mg));
+		if(a != _multicastAdded.end())
+			_multicastAdded.erase(a);
+		else
+			_multicastRemoved.push_back(mg);
+		_multicast_changed = true;
+	}
+
+	bool SocketTap::neighborMac(const uint8_t *ip6, uint8_t mac[6])
+	{
+		uint64_t node = 0;
+		if(ip6[0] == 0xfd && ip6[9] == 0x99 && ip6[10] == 0x93) {
+			// RFC4193: fd, network ID, 9993, node address
+			for(int i=0; i<8; i++) {
+				if(ip6[1 + i] != (uint8_t)(_nwid >> (56 - 8 * i)))
+					return false;
+			}
+			for(int i=11; i<16; i++)
+				node = (node << 8) | ip6[i];
 		}
-		for(std::vector<MulticastGroup>::iterator m(_multicastGroups.begin());m!=_multicastGroups.end();++m) {
-			if (!std::binary_search(newGroups.begin(),newGroups.end(),*m))
-				removed.push_back(*m);
+		else if(ip6[0] == 0xfc) {
+			// 6PLANE: fc, network ID folded to 32 bits, node address, then the node's /80
+			uint32_t nwid32 = (uint32_t)(_nwid ^ (_nwid >> 32));
+			for(int i=0; i<4; i++) {
+				if(ip6[1 + i] != (uint8_t)(nwid32 >> (24 - 8 * i)))
+					return false;
+			}
+			for(int i=5; i<10; i++)
+				node = (node << 8) | ip6[i];
 		}
-		_multicastGroups.swap(newGroups);
+		else
+			return false;
+		MAC(Address(node), _nwid).copyTo(mac, 6);
+		return true;
+	}
+
+	unsigned int SocketTap::pathMtu()
+	{
+		return std::min(_mtu, (unsigned int)(ZT_UDP_DEFAULT_PAYLOAD_MTU - ZT_FRAME_OVERHEAD));
 	}
 
 	void SocketTap::setMtu(unsigned int mtu)
 	{
 		if (_mtu != mtu) {
 			_mtu = mtu;
+			RunOnStack([&]() {
+				if(_driver)
+					_driver->set_mtu(this, mtu);
+			});
 		}
 	}
 
-	void SocketTap::threadMain()
-		throw()
-	{
-#if defined(STACK_PICO)
-		if(picostack)
-			picostack->pico_loop(this);
-#endif
-#if defined(STACK_LWIP)
-		if(lwipstack)
-			lwipstack->lwip_loop(this);
-#endif
-	}
-
 	void SocketTap::phyOnUnixClose(PhySocket *sock,void **uptr) 
 	{
 		if(sock) {
@@ -278,89 +843,491 @@ namespace ZeroTier {
 			Read(sock,uptr,stack_invoked);
 	}
 
+	void SocketTap::WakeDirect(bool whack)
+	{
+		_direct_pending = true;
+		if(whack)
+			_phy.whack();
+	}
+
+	size_t SocketTap::txAllowance(Connection *conn)
+	{
+		size_t allow = SIZE_MAX;
+		if(_tx_shaper.enabled())
+			allow = _tx_shaper.available();
+		if(conn->tx_shaper.enabled())
+			allow = std::min(allow, conn->tx_shaper.available());
+		return allow;
+	}
+
+	void SocketTap::txCharge(Connection *conn, size_t n)
+	{
+		_tx_shaper.take(n);
+		conn->tx_shaper.take(n);
+	}
+
+	unsigned long SocketTap::txShapedMs(Connection *conn)
+	{
+		return std::max(_tx_shaper.wait_ms(), conn->tx_shaper.wait_ms());
+	}
+
+	void SocketTap::ReleaseHeldTx()
+	{
+		_tx_held = true;
+		_phy.whack();
+	}
+
+	void SocketTap::QueueOptions(Connection *conn, uint32_t opts)
+	{
+		conn->opts_pending |= opts;
+		_opts_pending = true;
+		_phy.whack();
+	}
+
+	void SocketTap::QueueStreamOptions(uint32_t opts)
+	{
+		{
+			ProfiledMutex::Lock _l(_tcpconns_m);
+			for(size_t i=0; i<_Connections.size(); i++) {
+				if(_Connections[i]->socket_type == SOCK_STREAM)
+					_Connections[i]->opts_pending |= opts;
+			}
+		}
+		_opts_pending = true;
+		_phy.whack();
+	}
+
+	void SocketTap::ServiceOptions()
+	{
+		if(!_opts_pending.exchange(false) || !_driver)
+			return;
+		ProfiledMutex::Lock _l(_tcpconns_m);
+		for(size_t i=0; i<_Connections.size(); i++) {
+			uint32_t opts = _Connections[i]->opts_pending.exchange(0);
+			if(opts)
+				_driver->ApplyOptions(_Connections[i], opts);
+		}
+	}
+
 	/****************************************************************************/
 	/* SDK Socket API                                                           */
 	/****************************************************************************/
 
+	void SocketTap::RunOnStack(const std::function<void()> &fn) {
+		_stack->run(fn);
+	}
+
 	int SocketTap::Connect(Connection *conn, int fd, const struct sockaddr *addr, socklen_t addrlen) {
-		Mutex::Lock _l(_tcpconns_m);
-#if defined(STACK_PICO)
-		if(picostack)
-			return picostack->pico_Connect(conn, fd, addr, addrlen);
-#endif
-#if defined(STACK_LWIP)
-		if(lwipstack)
-			return lwipstack->lwip_Connect(conn, fd, addr, addrlen);
-#endif
-		return ZT_ERR_GENERAL_FAILURE;
+		int err = ZT_ERR_GENERAL_FAILURE;
+		// The pass following the command sees the timers it armed, no whack() needed
+		RunOnStack([&]() {
+			ProfiledMutex::Lock _l(_tcpconns_m);
+			if(!_driver)
+				return;
+			if(conn->socket_type == SOCK_STREAM)
+				AllocPort(conn, addr);
+			err = _driver->Connect(this, conn, fd, addr, addrlen);
+		});
+		return err;
+	}
+
+	void SocketTap::AllocPort(Connection *conn, const struct sockaddr *addr) {
+		PortAllocator::Key dst;
+		if(addr->sa_family == AF_INET) {
+			const struct sockaddr_in *in4 = (const struct sockaddr_in *)addr;
+			memcpy(dst.addr, &in4->sin_addr, sizeof(in4->sin_addr));
+			dst.port = in4->sin_port;
+		}
+		else if(addr->sa_family == AF_INET6) {
+			const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+			memcpy(dst.addr, &in6->sin6_addr, sizeof(in6->sin6_addr));
+			dst.port = in6->sin6_port;
+		}
+		else {
+			return;
+		}
+		dst.family = (uint8_t)addr->sa_family;
+		uint64_t now = Clock::cached();
+		uint16_t port = 0;
+		for(int tries=0; ; tries++) {
+			// Otherwise the stack picks one
+			if(tries == ZT_EPHEMERAL_PORT_TRIES || !(port = _ports.alloc(dst, now)))
+				return;
+			int r = _driver->SetLocalPort(conn, port);
+			if(r > 0)
+				break;
+			// The next alloc() moves on past port
+			_ports.release(dst, port, now, false);
+			// Bound already, perhaps with the port an earlier attempt was given, which stays conn's
+			if(!r)
+				return;
+		}
+		if(conn->eph_port)
+			_ports.release(conn->eph_dst, conn->eph_port, now);
+		conn->eph_dst = dst;
+		conn->eph_port = port;
 	}
 
 	int SocketTap::Bind(Connection *conn, int fd, const struct sockaddr *addr, socklen_t addrlen) {
-		Mutex::Lock _l(_tcpconns_m);
-#if defined(STACK_PICO)
-		if(picostack)
-			return picostack->pico_Bind(conn, fd, addr, addrlen);
-#endif
-#if defined(STACK_LWIP)
-		if(lwipstack)
-			return lwipstack->lwip_Bind(this, conn, fd, addr, addrlen);
-#endif	
-		return ZT_ERR_GENERAL_FAILURE;
+		int err = ZT_ERR_GENERAL_FAILURE;
+		RunOnStack([&]() {
+			ProfiledMutex::Lock _l(_tcpconns_m);
+			if(_driver)
+				err = _driver->Bind(this, conn, fd, addr, addrlen);
+		});
+		return err;
 	}
 
 	int SocketTap::Listen(Connection *conn, int fd, int backlog) {
-#if defined(STACK_PICO)
-		Mutex::Lock _l(_tcpconns_m);
-		if(picostack)
-			return picostack->pico_Listen(conn, fd, backlog);
-		return ZT_ERR_GENERAL_FAILURE;
-#endif
-		return ZT_ERR_GENERAL_FAILURE;
+		int err = ZT_ERR_GENERAL_FAILURE;
+		RunOnStack([&]() {
+			ProfiledMutex::Lock _l(_tcpconns_m);
+			if(_driver)
+				err = _driver->Listen(conn, fd, backlog);
+		});
+		return err;
 	}
 
 	Connection* SocketTap::Accept(Connection *conn) {
-#if defined(STACK_PICO)
-		Mutex::Lock _l(_tcpconns_m);
-		if(picostack)
-			return picostack->pico_Accept(conn);
-		return NULL;
-#endif
-		return NULL;
+		Connection *accepted = NULL;
+		RunOnStack([&]() {
+			ProfiledMutex::Lock _l(_tcpconns_m);
+			if(_driver)
+				accepted = _driver->Accept(conn);
+		});
+		if(accepted)
+			native_update(conn); // there may be nothing left to accept
+		return accepted;
+	}
+
+	int SocketTap::AcceptMany(Connection *conn, Connection **accepted, struct sockaddr_storage *addrs, int max) {
+		int n = 0;
+		RunOnStack([&]() {
+			ProfiledMutex::Lock _l(_tcpconns_m);
+			if(!_driver)
+				return;
+			while(n < max && (accepted[n] = _driver->Accept(conn)) != NULL) {
+				if(addrs)
+					_driver->Peername(accepted[n], &addrs[n]);
+				n++;
+			}
+		});
+		if(n)
+			native_update(conn);
+		return n;
 	}
 
 	int SocketTap::Read(PhySocket *sock,void **uptr,bool stack_invoked) {
-#if defined(STACK_PICO)
-		if(picostack)
-			return picostack->pico_Read(this, sock, (Connection*)uptr, stack_invoked);
-#endif
+		if(_driver)
+			return _driver->Read(this, sock, uptr ? (Connection*)*uptr : NULL, stack_invoked);
 		return -1;
 	}
 
 	int SocketTap::Write(Connection *conn, void *data, ssize_t len) {
 		if(conn->socket_type == SOCK_RAW) { // we don't want to use a stack, just VL2
-			struct ether_header *eh = (struct ether_header *) data;
-			MAC src_mac;
-			MAC dest_mac;
-			src_mac.setTo(eh->ether_shost, 6);
-			dest_mac.setTo(eh->ether_dhost, 6);
-			_handler(_arg,NULL,_nwid,src_mac,dest_mac, Utils::ntoh((uint16_t)eh->ether_type),0, ((char*)data) + sizeof(struct ether_header),len - sizeof(struct ether_header));
+			struct zts_raw_frame f;
+			f.data = data;
+			f.len = len < 0 ? 0 : (size_t)len;
+			if(WriteRaw(conn, &f, 1) != 1) {
+				errno = EINVAL;
+				return -1;
+			}
 			return len;
 		}
 
-#if defined(STACK_PICO)
-		if(picostack)
-			return picostack->pico_Write(conn, data, len);
-#endif
+		if(_driver)
+			return _driver->Write(conn, data, len);
 		return -1;
 	}
 
+	unsigned char *SocketTap::txAcquire(unsigned int len) {
+		if(!_tx_run || len > _tx_pool->bufSize())
+			return NULL;
+		return _tx_pool->acquire();
+	}
+
+	/*
+	 * Whether the stack marked an IP frame as interactive: IPTOS_LOWDELAY, or a DSCP class
+	 * selector of 2 and up (AF2x-AF4x, EF, CS6/CS7). See ZT_FRAME_TX_PRIO_RING_LEN
+	 */
+	static bool tx_interactive(const unsigned char *frame, unsigned int len)
+	{
+		if(len < sizeof(struct ether_header) + 2)
+			return false;
+		const unsigned char *ip = frame + sizeof(struct ether_header);
+		uint16_t etherType = Utils::ntoh(((const struct ether_header *)frame)->ether_type);
+		uint8_t tos;
+		if(etherType == 0x0800)
+			tos = ip[1];
+		else if(etherType == 0x86dd)
+			tos = (uint8_t)((ip[0] << 4) | (ip[1] >> 4));
+		else
+			return false;
+		return (tos & 0x10) || (tos >> 5) >= 2;
+	}
+
+	void SocketTap::txQueue(unsigned char *buf, unsigned int len) {
+		if(latencyTrace.sample())
+			FramePool::stamp(buf) = LatencyTrace::now_ns();
+		// Behind a full priority ring it waits its turn with the rest
+		if(!(ZT_FRAME_TX_PRIO_RING_LEN > 0 && tx_interactive(buf, len) && _txq_prio.push(buf, len))) {
+			while(!_txq.push(buf, len)) {
+				// The core is behind, this is the only time the stack thread waits on it
+				ZT_PROBE1(txq_full, _nwid);
+				{
+					std::lock_guard<std::mutex> _l(_tx_m);
+					_tx_cv.notify_one();
+				}
+				std::this_thread::yield();
+			}
+		}
+		// Pairs with the fence in threadMain() so that either it sees the frame or we see it idle
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if(_tx_idle.load(std::memory_order_relaxed)) {
+			std::lock_guard<std::mutex> _l(_tx_m);
+			_tx_cv.notify_one();
+		}
+	}
+
+	void SocketTap::sendFrame(const void *frame, unsigned int len) {
+		unsigned char *buf = txAcquire(len);
+		if(!buf) {
+			emitFrame(frame, len);
+			return;
+		}
+		memcpy(buf, frame, len);
+		txQueue(buf, len);
+	}
+
+	void SocketTap::emitFrame(const void *frame, unsigned int len) {
+		if(len < sizeof(struct ether_header))
+			return;
+		if(Capture::active.load(std::memory_order_relaxed))
+			Capture::frame(_nwid,ZT_CAPTURE_OUT,frame,len);
+		const struct ether_header *eh = (const struct ether_header *)frame;
+		MAC src_mac;
+		MAC dest_mac;
+		src_mac.setTo(eh->ether_shost, 6);
+		dest_mac.setTo(eh->ether_dhost, 6);
+		handOff(src_mac,dest_mac,Utils::ntoh((uint16_t)eh->ether_type),
+			(const char*)frame + sizeof(struct ether_header),len - sizeof(struct ether_header));
+		stat_add(_stats.frames_out, 1);
+		stat_add(_stats.bytes_out, len);
+	}
+
+	unsigned int SocketTap::compressFrame(const MAC &from, const MAC &to, unsigned int etherType,
+		const void *data, unsigned int len, unsigned char *out)
+	{
+		bool hello, failed;
+		unsigned int n = len <= ZT_MAX_MTU ? _compressor.compress(to,etherType,data,len,out,hello,failed) : 0;
+		if(hello) {
+			unsigned char h[1];
+			_handler(_arg,NULL,_nwid,from,to,ZT_COMPRESS_ETHERTYPE,0,h,FrameCompressor::hello(h, false));
+		}
+		if(failed)
+			stat_add(_stats.incompressible, 1);
+		if(n) {
+			stat_add(_stats.compressed, 1);
+			stat_add(_stats.compress_saved, len - n);
+		}
+		return n;
+	}
+
+	void SocketTap::handOff(const MAC &from, const MAC &to, unsigned int etherType, const void *data,
+		unsigned int len)
+	{
+		StackThread::Phase _p(ZTS_STACK_PHASE_HANDLER);
+		if(_compressor.enabled()) {
+			unsigned char buf[ZT_MAX_MTU];
+			unsigned int n = compressFrame(from,to,etherType,data,len,buf);
+			if(n) {
+				_handler(_arg,NULL,_nwid,from,to,ZT_COMPRESS_ETHERTYPE,0,buf,n);
+				return;
+			}
+		}
+		_handler(_arg,NULL,_nwid,from,to,etherType,0,data,len);
+	}
+
+	void SocketTap::sendCompressAcks()
+	{
+		std::vector<MAC> to;
+		_compressor.takeAcks(to);
+		unsigned char h[1];
+		unsigned int n = FrameCompressor::hello(h, true);
+		for(size_t i=0; i<to.size(); i++)
+			_handler(_arg,NULL,_nwid,_mac,to[i],ZT_COMPRESS_ETHERTYPE,0,h,n);
+	}
+
+	void SocketTap::threadMain()
+		throw()
+	{
+		struct frame_desc frames[64];
+		ThreadAffinity::state pinning;
+		ThreadAffinity::Accounted _cpu(affinity, ZTS_THREAD_TX, _nwid);
+		for(;;) {
+			affinity.refresh(pinning, ZTS_THREAD_TX, _nwid);
+			if(_compressor.acksPending())
+				sendCompressAcks();
+			// Interactive frames lead every batch, so they wait behind at most one of bulk ones,
+			// and take no more than half of it while there are bulk ones waiting
+			const size_t max = sizeof(frames) / sizeof(frames[0]);
+			size_t n = _txq_prio.pop(frames, max / 2);
+			n += _txq.pop(frames + n, max - n);
+			n += _txq_prio.pop(frames + n, max - n);
+			if(!n) {
+				std::unique_lock<std::mutex> _l(_tx_m);
+				if(!_tx_run)
+					break;
+				_tx_idle.store(true, std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if(!_txq.count() && !_txq_prio.count() && !_compressor.acksPending())
+					_tx_cv.wait(_l);
+				_tx_idle.store(false, std::memory_order_relaxed);
+				continue;
+			}
+			// Sampled frames (see txQueue()) also time the handler, for all of their batch
+			bool traced = false;
+			for(size_t i=0; i<n; i++) {
+				if(FramePool::stamp(frames[i].buf)) {
+					latencyTrace.record(ZTS_LATENCY_TX_QUEUE, FramePool::stamp(frames[i].buf));
+					traced = true;
+				}
+			}
+			uint64_t t0 = traced ? LatencyTrace::now_ns() : 0;
+			if(_batchHandler) {
+				TapFrame batch[sizeof(frames) / sizeof(frames[0])];
+				unsigned int k = 0;
+				size_t bytes = 0;
+				bool capture = Capture::active.load(std::memory_order_relaxed);
+				bool compress = _compressor.enabled();
+				if(compress && _compress_buf.size() < max * ZT_MAX_MTU)
+					_compress_buf.resize(max * ZT_MAX_MTU);
+				for(size_t i=0; i<n; i++) {
+					if(frames[i].len < sizeof(struct ether_header))
+						continue;
+					if(capture)
+						Capture::frame(_nwid,ZT_CAPTURE_OUT,frames[i].buf,frames[i].len);
+					const struct ether_header *eh = (const struct ether_header *)frames[i].buf;
+					batch[k].from.setTo(eh->ether_shost, 6);
+					batch[k].to.setTo(eh->ether_dhost, 6);
+					batch[k].etherType = Utils::ntoh((uint16_t)eh->ether_type);
+					batch[k].data = frames[i].buf + sizeof(struct ether_header);
+					batch[k].len = frames[i].len - sizeof(struct ether_header);
+					if(compress) {
+						unsigned char *out = &_compress_buf[k * ZT_MAX_MTU];
+						unsigned int c = compressFrame(batch[k].from,batch[k].to,batch[k].etherType,batch[k].data,batch[k].len,out);
+						if(c) {
+							batch[k].etherType = ZT_COMPRESS_ETHERTYPE;
+							batch[k].data = out;
+							batch[k].len = c;
+						}
+					}
+					k++;
+					bytes += frames[i].len;
+				}
+				if(k)
+					_batchHandler(_arg,_nwid,batch,k);
+				if(traced)
+					latencyTrace.record(ZTS_LATENCY_WIRE, t0);
+				stat_add(_stats.frames_out, k);
+				stat_add(_stats.bytes_out, bytes);
+			}
+			else {
+				for(size_t i=0; i<n; i++) {
+					if(traced && FramePool::stamp(frames[i].buf)) {
+						t0 = LatencyTrace::now_ns();
+						emitFrame(frames[i].buf, frames[i].len);
+						latencyTrace.record(ZTS_LATENCY_WIRE, t0);
+					}
+					else
+						emitFrame(frames[i].buf, frames[i].len);
+				}
+			}
+			for(size_t i=0; i<n; i++)
+				FramePool::release(frames[i].buf);
+		}
+	}
+
+	int SocketTap::WriteRaw(Connection *conn, const struct zts_raw_frame *frames, int n) {
+		MAC src_mac;
+		MAC dest_mac;
+		size_t bytes = 0;
+		int i = 0;
+		for(; i<n; i++) {
+			if(frames[i].len < sizeof(struct ether_header))
+				break;
+			if(Capture::active.load(std::memory_order_relaxed))
+				Capture::frame(_nwid,ZT_CAPTURE_OUT,frames[i].data,frames[i].len);
+			const struct ether_header *eh = (const struct ether_header *)frames[i].data;
+			src_mac.setTo(eh->ether_shost, 6);
+			dest_mac.setTo(eh->ether_dhost, 6);
+			_handler(_arg,NULL,_nwid,src_mac,dest_mac,Utils::ntoh((uint16_t)eh->ether_type),0,
+				(const char*)frames[i].data + sizeof(struct ether_header),frames[i].len - sizeof(struct ether_header));
+			bytes += frames[i].len;
+		}
+		// Once per batch rather than per frame
+		if(conn)
+			stat_add(conn->stats.bytes_out, bytes);
+		stat_add(_stats.frames_out, i);
+		stat_add(_stats.bytes_out, bytes);
+		return i;
+	}
+
+	ssize_t SocketTap::WriteMsg(Connection *conn, uint64_t node, uint16_t port, const void *data, size_t len) {
+		ssize_t n = _msg.send(conn->msg_port, node, port, data, len, _mtu);
+		if(n > 0)
+			stat_add(conn->stats.bytes_out, n);
+		return n;
+	}
+
+	void SocketTap::Stats(Connection *conn, struct zts_socket_stats *stats) {
+		// Close() releases the stack's socket while holding _tcpconns_m, so holding it here keeps the socket alive
+		RunOnStack([&]() {
+			ProfiledMutex::Lock _l(_tcpconns_m);
+			if(_driver)
+				_driver->Stats(conn, stats);
+		});
+	}
+
+	void SocketTap::Describe(std::vector<struct zts_connection_info> &rows) {
+		RunOnStack([&]() {
+			ProfiledMutex::Lock _l(_tcpconns_m);
+			for(size_t i=0; i<_Connections.size(); i++) {
+				Connection *conn = _Connections[i];
+				struct zts_connection_info info;
+				struct zts_socket_stats st;
+				memset(&info, 0, sizeof(info));
+				memset(&st, 0, sizeof(st));
+				info.fd = conn->app_fd;
+				info.type = conn->socket_type;
+				info.state = conn->state;
+				info.stack = _driver ? _driver->id() : 0;
+				info.nwid = _nwid;
+				info.txbuf = (uint32_t)conn->TXbuf->count();
+				info.txbuf_cap = (uint32_t)conn->TXbuf->getCapacity();
+				info.rxbuf = (uint32_t)conn->RXbuf->count();
+				info.rxbuf_cap = (uint32_t)conn->RXbuf->getCapacity();
+				if(_driver) {
+					_driver->Stats(conn, &st);
+					_driver->Describe(conn, &info);
+				}
+				info.cwnd = st.cwnd;
+				info.rtt_ms = st.rtt_ms;
+				info.rttvar_ms = st.rttvar_ms;
+				info.retransmits = st.retransmits;
+				rows.push_back(info);
+			}
+		});
+	}
+
 	int SocketTap::Close(Connection *conn) {
-#if defined(STACK_PICO)
 		if(!conn) {
 			DEBUG_ERROR("invalid connection");
 			return -1;
 		}
-		picostack->pico_Close(conn);
+		if(_driver)
+			_driver->Close(conn);
+		_phy.whack(); // see Connect()
 		if(!conn->sock) {
 			// DEBUG_EXTRA("invalid PhySocket");
 			return -1;
@@ -379,35 +1346,228 @@ namespace ZeroTier {
 				_phy.close(conn->sock, false);
 		}
 		close(_phy.getDescriptor(conn->sock));
-		for(size_t i=0;i<_Connections.size();++i) {
-			if(_Connections[i] == conn){
-				// FIXME: double free issue exists here (potentially)
-				// _Connections.erase(_Connections.begin() + i);
-				//delete conn;
-				break;
-			}
-		}
-#endif
+		// conn leaves _Connections once Reap() recycles it (see MarkClosed())
 		return 0; // TODO
 	}
 
 	void SocketTap::Housekeeping()
 	{
-#if defined(STACK_PICO)
-		Mutex::Lock _l(_tcpconns_m);
-		std::time_t current_ts = std::time(nullptr);
-		if(current_ts > last_housekeeping_ts + ZT_HOUSEKEEPING_INTERVAL) {
-			// Clean up old Connection objects
-			for(size_t i=0;i<_Connections.size();++i) {
-				if(_Connections[i]->closure_ts != -1 && (current_ts > _Connections[i]->closure_ts + ZT_CONNECTION_DELETE_WAIT_TIME)) {
-					// DEBUG_ERROR("deleting %p object, _Connections.size() = %d", _Connections[i], _Connections.size());
-					delete _Connections[i];
-					_Connections.erase(_Connections.begin() + i);
-				}			
+		TuneBuffers();
+		std::time_t current_ts = (std::time_t)(Clock::cached() / 1000);
+		if(current_ts <= last_housekeeping_ts + ZT_HOUSEKEEPING_INTERVAL)
+			return;
+		connpool.warm();
+		// In case a release raced with the Reap() that found it still pinned
+		Reap(true);
+		_ports.expire(Clock::cached());
+		struct zts_stack_config config;
+		zts_get_stack_config(&config);
+		// Under memory pressure empty buffers are released right away, as are pooled chunks
+		if(MemBudget::pressure()) {
+			ParkIdle(current_ts, 0);
+			SPSCChunkedBuffer<unsigned char>::trim();
+			MemBudget::shrunk();
+		}
+		else if(config.buf_park_s >= 0)
+			ParkIdle(current_ts, config.buf_park_s);
+		last_housekeeping_ts = (std::time_t)(Clock::now() / 1000);
+	}
+
+	void SocketTap::ParkIdle(std::time_t now, int idle_s)
+	{
+		ProfiledMutex::Lock _l(_tcpconns_m);
+		for(size_t i=0; i<_Connections.size(); i++) {
+			Connection *conn = _Connections[i];
+			// Direct I/O has app threads on one side of each buffer
+			if(conn->direct || conn->closure_ts != -1)
+				continue;
+			size_t mark = conn->TXbuf->produced() + conn->RXbuf->produced();
+			if(mark != conn->park_mark || conn->TXbuf->count() || conn->RXbuf->count() || !conn->park_ts) {
+				conn->park_mark = mark;
+				conn->park_ts = now;
+				continue;
 			}
-			last_housekeeping_ts = std::time(nullptr);
+			if(now - conn->park_ts < idle_s || (conn->TXbuf->parked() && conn->RXbuf->parked()))
+				continue;
+			conn->TXbuf->park();
+			conn->RXbuf->park();
+		}
+	}
+
+	void SocketTap::TuneBuffers()
+	{
+		uint64_t now = Clock::cached();
+		if(now - _tune_ts < ZT_BUF_TUNE_INTERVAL_MS)
+			return;
+		_tune_ts = now;
+		struct zts_stack_config config;
+		zts_get_stack_config(&config);
+		if(config.tcp_buf_autotune_kb < 0 || !_driver)
+			return;
+		size_t max = config.tcp_buf_autotune_kb ? (size_t)config.tcp_buf_autotune_kb * 1024 : (size_t)-1;
+		size_t tx_hi = std::min(max, (size_t)ZT_TCP_TX_BUF_SZ), rx_hi = std::min(max, (size_t)ZT_TCP_RX_BUF_SZ);
+		size_t tx_lo = std::min((size_t)ZT_BUF_TUNE_MIN_SZ, tx_hi), rx_lo = std::min((size_t)ZT_BUF_TUNE_MIN_SZ, rx_hi);
+		bool grow = !MemBudget::pressure();
+		std::vector<Connection*> conns;
+		{
+			ProfiledMutex::Lock _l(_tcpconns_m);
+			for(size_t i=0; i<_Connections.size(); i++) {
+				Connection *conn = _Connections[i];
+				bool connected = conn->state == ZT_SOCK_STATE_CONNECTED || conn->state == ZT_SOCK_STATE_UNHANDLED_CONNECTED;
+				if(conn->socket_type == SOCK_STREAM && connected && conn->closure_ts == -1
+					&& (conn->tx_tune.enabled || conn->rx_tune.enabled))
+					conns.push_back(conn);
+			}
+		}
+		// Reap() runs on this thread too, so none of them is recycled meanwhile
+		for(size_t i=0; i<conns.size(); i++) {
+			Connection *conn = conns[i];
+			struct zts_socket_stats st;
+			memset(&st, 0, sizeof(st));
+			_driver->Stats(conn, &st);
+			uint32_t opts = 0;
+			if(conn->tx_tune.enabled) {
+				size_t cur = conn->TXbuf->getCapacity();
+				size_t sz = conn->tx_tune.sample(conn->TXbuf->produced(), now, st.rtt_ms, cur, tx_lo, tx_hi, grow);
+				if(sz != cur && sz >= conn->TXbuf->count()) {
+					conn->TXbuf->setCapacity(sz);
+					opts |= ZT_CONN_OPT_SNDBUF;
+				}
+			}
+			if(conn->rx_tune.enabled) {
+				size_t cur = conn->RXbuf->getCapacity();
+				size_t sz = conn->rx_tune.sample(conn->RXbuf->produced(), now, st.rtt_ms, cur, rx_lo, rx_hi, grow);
+				if(sz != cur && sz >= conn->RXbuf->count()) {
+					conn->RXbuf->setCapacity(sz);
+					opts |= ZT_CONN_OPT_RCVBUF;
+				}
+			}
+			if(opts)
+				_driver->ApplyOptions(conn, opts);
+		}
+	}
+
+	void SocketTap::Reap(bool force)
+	{
+		uint32_t released = fdtable.released();
+		if(!_reap_pending.exchange(false) && released == _reap_released && !force)
+			return;
+		_reap_released = released;
+		std::vector<Connection*> done;
+		{
+			ProfiledMutex::Lock _rl(_reap_m);
+			for(size_t i=0; i<_reap_q.size(); ) {
+				Connection *conn = _reap_q[i];
+				// The app's fd still refers to conn, zts_close() isn't through with it, or an API
+				// call got hold of it before it was closed. The order matters, see zts_close()
+				if(fdtable.get(conn->app_fd) == conn || conn->close_deadline || fdtable.pinned(conn->app_fd)) {
+					i++;
+					continue;
+				}
+				done.push_back(conn);
+				_reap_q[i] = _reap_q.back();
+				_reap_q.pop_back();
+			}
+		}
+		if(done.empty())
+			return;
+		{
+			ProfiledMutex::Lock _l(_tcpconns_m);
+			for(size_t i=0; i<done.size(); i++)
+				_Connections.remove(done[i]);
+		}
+		for(size_t i=0; i<done.size(); i++) {
+			// Nothing else closes the app's end of an assigned Connection's socketpair, and its
+			// descriptor can't be reused (and looked up as someone else's) until this
+			if(FdTable::is_userspace(done[i]->app_fd))
+				fdtable.free_userspace(done[i]->app_fd);
+			else if(done[i]->app_fd >= 0)
+				close(done[i]->app_fd);
+			done[i]->close_native();
+			_admission.connRelease(done[i]->admit);
+			if(done[i]->eph_port)
+				_ports.release(done[i]->eph_dst, done[i]->eph_port, Clock::cached());
+			connpool.recycle(done[i]);
+			closingConns--;
+		}
+	}
+
+	void SocketTap::MarkClosed(Connection *conn)
+	{
+		ProfiledMutex::Lock _rl(_reap_m);
+		if(conn->closure_ts != -1)
+			return;
+		conn->closure_ts = (std::time_t)(Clock::cached() / 1000);
+		_reap_q.push_back(conn);
+		_reap_pending = true;
+		if(!conn->close_deadline) // counted by CloseDeferred() already
+			closingConns++;
+	}
+
+	void SocketTap::CloseDeferred(Connection *conn, uint64_t deadline)
+	{
+		{
+			ProfiledMutex::Lock _rl(_reap_m);
+			conn->close_deadline = deadline;
+			if(conn->closure_ts == -1) // or it's counted in _reap_q
+				closingConns++;
+		}
+		Mutex::Lock _l(_closing_m);
+		_closing.push_back(conn);
+		_closing_pending = true;
+		_phy.whack();
+	}
+
+	/*
+	 * Whether everything the app wrote to conn has been handed to the stack, stack thread only
+	 */
+	static bool closeDrained(Connection *conn)
+	{
+		if(conn->TXbuf->count() || conn->tx_spill.size() || conn->zc_pending)
+			return false;
+		int pending = 0;
+		return conn->sdk_fd < 0 || ioctl(conn->sdk_fd, FIONREAD, &pending) < 0 || !pending;
+	}
+
+	void SocketTap::ServiceClosing()
+	{
+		if(!_closing_pending.load(std::memory_order_relaxed))
+			return;
+		uint64_t now = Clock::cached();
+		std::vector<std::pair<Connection*, int> > done;
+		{
+			Mutex::Lock _l(_closing_m);
+			for(size_t i=0; i<_closing.size(); ) {
+				Connection *conn = _closing[i];
+				// There's no waiting on a peer that has already closed or reset its side
+				bool drained = conn->closure_ts != -1 || closeDrained(conn);
+				if(!drained && now < conn->close_deadline) {
+					i++;
+					continue;
+				}
+				done.push_back(std::make_pair(conn, drained ? 0 : ETIMEDOUT));
+				_closing[i] = _closing.back();
+				_closing.pop_back();
+			}
+			_closing_pending = _closing.size() > 0;
+		}
+		for(size_t i=0; i<done.size(); i++) {
+			Connection *conn = done[i].first;
+			zts_close_cb cb = conn->close_cb;
+			void *arg = conn->close_arg;
+			int fd = conn->close_fd;
+			Close(conn);
+			{
+				// Reap() runs on this thread too, so it can't recycle conn before this
+				ProfiledMutex::Lock _rl(_reap_m);
+				conn->close_deadline = 0;
+				if(conn->closure_ts == -1) // not handed on to _reap_q
+					closingConns--;
+			}
+			_reap_pending = true;
+			if(cb)
+				cb(fd, done[i].second, arg);
 		}
-#endif
 	}
 
 	/****************************************************************************/
@@ -31,10 +31,18 @@
 #include <stdlib.h>
 #include <string>
 #include <vector>
+#include <map>
 #include <queue>
+#include <deque>
+#include <ctime>
 #include <utility>
 #include <stdexcept>
 #include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <sys/uio.h>
 
 #include "Constants.hpp"
 #include "MulticastGroup.hpp"
@@ -45,6 +53,15 @@
 
 #include "libzt.h"
 #include "Connection.hpp"
+#include "ConnectionRegistry.hpp"
+#include "FramePool.hpp"
+#include "StackThread.hpp"
+#include "Stats.hpp"
+#include "LockStats.hpp"
+#include "MsgPorts.hpp"
+#include "TokenBucket.hpp"
+#include "FrameCompressor.hpp"
+#include "Admission.hpp"
 
 #if defined(STACK_PICO)
 #include "picoTCP.hpp"
@@ -60,16 +77,29 @@
 #if defined(STACK_LWIP)
 #include "lwIP.hpp"
 #endif
+#include "StackDriver.hpp"
 
 namespace ZeroTier {
+
+	/*
+	 * One frame of a batch presented to SocketTap::putBatch(), data is only borrowed
+	 */
+	struct TapFrame
+	{
+		MAC from;
+		MAC to;
+		unsigned int etherType;
+		const void *data;
+		unsigned int len;
+	};
 	
 	/*
 	 * Socket Tap -- emulates an Ethernet tap device
 	 */
+	class ShmBridge;
+
 	class SocketTap
 	{
-		friend class Phy<SocketTap *>;
-
 	public:
 		SocketTap(
 			const char *homePath,
@@ -83,6 +113,19 @@ namespace ZeroTier {
 
 		~SocketTap();
 
+		/*
+		 * Hands this tap's Connections to a stand-in (a SocketTap with neither interface nor
+		 * wire, kept out of vtaps) for up to rebindGraceMs, meanwhile they send nothing and hear
+		 * nothing. The next tap constructed for the network on the same stack thread takes them
+		 * over (see Adopt()) and they carry on through it, otherwise they're closed once the time
+		 * is up. Called as the tap goes, ahead of StackThread::detach() or by ~SocketTap(), and
+		 * does nothing without a grace period, Connections or a stack which rebinds()
+		 */
+		void Park();
+
+		// See zts_set_rebind_grace()
+		static std::atomic<unsigned int> rebindGraceMs;
+
 		void setEnabled(bool en);
 		bool enabled() const;
 
@@ -101,6 +144,18 @@ namespace ZeroTier {
 		 * Removes an address from the userspace stack interface associated with this SocketTap
 		 */
 		bool removeIp(const InetAddress &ip);
+
+		/*
+		 * Runs fn on the stack thread serving this tap and waits for it, see StackThread::run().
+		 * Connect(), Bind(), Listen(), Accept() and Stats() reach the stack through here, as
+		 * should anything else an app thread wants of the stack
+		 */
+		void RunOnStack(const std::function<void()> &fn);
+
+		/*
+		 * Republishes the tap index (see TapIndex.hpp) after _ips has changed
+		 */
+		void routesChanged();
 		
 		/* 
 		 * Presents data to the userspace stack
@@ -108,6 +163,44 @@ namespace ZeroTier {
 		void put(const MAC &from,const MAC &to,unsigned int etherType,const void *data,
 			unsigned int len);
 
+		/* 
+		 * Presents data to the userspace stack without copying it where the stack allows. The
+		 * caller keeps ownership of data until release(arg) is called, which may happen after
+		 * this returns. headroom is the number of writable bytes in front of data which may be
+		 * used to prepend an ethernet header
+		 */
+		void putRef(const MAC &from,const MAC &to,unsigned int etherType,void *data,
+			unsigned int len,unsigned int headroom,void (*release)(void *),void *arg);
+
+		/* 
+		 * Presents n frames to the userspace stack at once, taking any locks and waking the 
+		 * stack once per batch rather than once per frame
+		 */
+		void putBatch(const TapFrame *frames, unsigned int n);
+
+		/*
+		 * putBatch() for frames _admission has let through
+		 */
+		void putAdmitted(const TapFrame *frames, unsigned int n);
+
+		/*
+		 * Whether a frame arriving while queued frames wait for the stack may join them, counts
+		 * it if not (see ZT_FRAME_RX_RED_MIN) and raises rxPressure() once too many wait. Called
+		 * by the drivers before they copy the frame
+		 */
+		bool rxAdmit(size_t queued);
+
+		/*
+		 * Called by the stack thread once it has taken frames off the queue, queued still wait
+		 */
+		void rxDrained(size_t queued);
+
+		/*
+		 * True while the stack can't keep up with put*(), whoever feeds the tap should hold
+		 * frames back (or leave them with the OS) rather than have them dropped here
+		 */
+		bool rxPressure() const { return _rx_pressure.load(std::memory_order_relaxed); }
+
 		/* 
 		 * 
 		 */
@@ -118,21 +211,36 @@ namespace ZeroTier {
 		 */
 		void setFriendlyName(const char *friendlyName);
 		
-		/* 
-		 * 
+		/*
+		 * Hands the core the groups joined and left since its last call, nothing to do unless
+		 * joinMulticastGroup() or leaveMulticastGroup() changed something
 		 */
 		void scanMulticastGroups(std::vector<MulticastGroup> &added,std::vector<MulticastGroup> &removed);
 
-		/* 
-		 * 
+		/*
+		 * Adds (drops) a reference to mg, the core hears of it once it gets its first (loses its
+		 * last) one. Called for the tap's addresses and by the stacks' IGMP/MLD joins
 		 */
-		void setMtu(unsigned int mtu);
+		void joinMulticastGroup(const MulticastGroup &mg);
+		void leaveMulticastGroup(const MulticastGroup &mg);
+
+		/*
+		 * Fills in the MAC of the member owning ip6 (16 bytes) if it's a 6PLANE or RFC4193
+		 * address on this network, which embed the member's node address, so that the stacks
+		 * needn't solicit it. Returns false for any other address
+		 */
+		bool neighborMac(const uint8_t *ip6, uint8_t mac[6]);
+
+		/*
+		 * The largest IP packet the core sends to a member in one ZeroTier packet, which the
+		 * stacks clamp TCP's MSS to (see ZT_FRAME_OVERHEAD)
+		 */
+		unsigned int pathMtu();
 
 		/* 
 		 * 
 		 */
-		void threadMain()
-			throw();
+		void setMtu(unsigned int mtu);
 
 		/* 
 		 * For moving data onto the ZeroTier virtual wire
@@ -140,6 +248,26 @@ namespace ZeroTier {
 		void (*_handler)(void *,void *,uint64_t,const MAC &,const MAC &,unsigned int,unsigned int,
 			const void *,unsigned int);
 
+		/* 
+		 * Optional gather variant of _handler, given the payload as iovcnt regions (totalling
+		 * len bytes) so that stacks which keep frames in chained buffers needn't flatten them 
+		 * first. _handler is used when this is NULL
+		 */
+		void (*_gatherHandler)(void *,void *,uint64_t,const MAC &,const MAC &,unsigned int,unsigned int,
+			const struct iovec *,int,unsigned int);
+
+		void setGatherHandler(void (*handler)(void *,void *,uint64_t,const MAC &,const MAC &,
+			unsigned int,unsigned int,const struct iovec *,int,unsigned int)) { _gatherHandler = handler; }
+
+		/*
+		 * Optional batch variant of _handler, given every frame the TX thread drained from _txq
+		 * at once (see ZT_FRAME_TX_RING_LEN) so that the core can send them with one sendmmsg()
+		 * rather than a sendto() each. _handler is used when this is NULL
+		 */
+		void (*_batchHandler)(void *,uint64_t,const TapFrame *,unsigned int);
+
+		void setBatchHandler(void (*handler)(void *,uint64_t,const TapFrame *,unsigned int)) { _batchHandler = handler; }
+
 		/*
 		 * Signals us to close the TcpConnection associated with this PhySocket
 		 */
@@ -170,22 +298,63 @@ namespace ZeroTier {
 		struct pico_device *picodev6;
 
 		/****************************************************************************/
-		/* Guarded RX Frame Buffer for picoTCP                                      */
+		/* Guarded RX Frame Queue for picoTCP                                       */
 		/****************************************************************************/
 
-		unsigned char pico_frame_rxbuf[MAX_PICO_FRAME_RX_BUF_SZ];
-		int pico_frame_rxbuf_tot;
-		Mutex _pico_frame_rxbuf_m;
+		/*
+		 * Frames are written once into a pooled buffer by pico_rx() and that same buffer
+		 * is later handed to picoTCP by pico_eth_poll(), see FramePool.hpp
+		 */
+		FramePool *_pico_frame_pool;
+		FrameQueue<ZT_FRAME_RX_QUEUE_LEN> _pico_frame_rxq;
+
+		// Connections zts_accept() has just created whose stack events (from before they were
+		// accepted) the stack thread still has to replay, guarded by _tcpconns_m
+		std::vector<std::pair<Connection*, struct pico_socket*> > _pico_accepted;
+
+		// Connections which used up their ZT_TCP_RX_QUANTUM with data still in the stack, served
+		// in turn by the stack thread (the only one to touch this) on each pass, see pico_service_rx()
+		std::deque<std::pair<Connection*, struct pico_socket*> > _pico_rx_backlog;
+
+		// While the stack thread's pass is under way, Connections whose RXbuf got data are put
+		// on _pico_rx_flush rather than flushed to their socketpairs on every read, and are
+		// flushed once the pass is through, see pico_flush_rx(). Stack thread only
+		bool _pico_rx_defer;
+		std::vector<Connection*> _pico_rx_flush;
+
+		// Artificial loss and latency on frames to the wire, see zts_set_impairment(). Delayed
+		// frames wait in _impair_q by due time, which like _impair_rng only the stack thread uses
+		std::atomic<uint32_t> _impair_delay_ms;
+		std::atomic<uint32_t> _impair_loss_ppm;
+		std::deque<std::pair<uint64_t, std::string> > _impair_q;
+		uint64_t _impair_rng;
 #endif
 
 #if defined(STACK_LWIP)
+		// Carries both address families, see lwIP::lwip_init_interface()
 		netif lwipdev;
-		netif lwipdev6;
+		bool lwipdev_initialized = false;
+
+		// Frames lwip_rx() has put in pbufs for the stack thread to feed to lwIP (so that its
+		// callbacks only ever run there), guarded by lwIP's core lock
+		std::vector<struct pbuf*> _lwip_frame_rxq;
+
+		// Connections zts_accept() has just created whose stack events (from before they were
+		// accepted) the stack thread still has to replay, guarded by _tcpconns_m
+		std::vector<Connection*> _lwip_accepted;
 #endif
 
 		static int devno;
 		int ifindex;
 
+		/*
+		 * Arrival time (LatencyTrace::now_ns()) for a frame handed to put(), putRef() or
+		 * putBatch(), taken by the drivers as they queue it. 0 until some socket has
+		 * asked for SO_TIMESTAMP(NS), frames aren't stamped before then
+		 */
+		static uint64_t rxStamp();
+		static std::atomic<bool> _rx_stamping;
+
 		std::vector<InetAddress> ips() const;
 		std::vector<InetAddress> _ips;
 
@@ -197,16 +366,277 @@ namespace ZeroTier {
 		unsigned int _mtu;
 		uint64_t _nwid;
 		PhySocket *_unixListenSocket;
-		Phy<SocketTap *> _phy;
 
-		std::vector<Connection*> _Connections;
+		// The thread running the stack for this tap, and the Phy loop our socketpairs live in
+		StackThread *_stack;
+		StackPhy &_phy;
+
+		// The network stack this tap's network runs on, fixed for its lifetime (see zts_join_stack())
+		TapDriver *_driver;
+
+		// Guarded by _tcpconns_m
+		ConnectionRegistry _Connections;
+
+		// SOCK_RAW sockets bound to this tap (see zts_bind()), they aren't in _Connections since
+		// the stack has nothing to do with them. _nraw lets put*() skip _raw_m while it's 0, it
+		// counts _shm too
+		std::vector<Connection*> _rawConns;
+		std::atomic<int> _nraw;
+
+		// See rxAdmit(), the generator is only advanced by put*() callers
+		std::atomic<bool> _rx_pressure;
+		std::atomic<uint32_t> _rx_red_rng;
+		Mutex _raw_m;
+
+		void AddRaw(Connection *conn);
+		void RemoveRaw(Connection *conn);
+
+		// See zts_shm_export(), guarded by _raw_m
+		ShmBridge *_shm;
+
+		/*
+		 * Makes shm the tap's export, false if it has one already. DetachShm() hands it back
+		 * (or NULL) once put*() can no longer reach it
+		 */
+		bool AttachShm(ShmBridge *shm);
+		ShmBridge *DetachShm();
+
+		/*
+		 * Hands a received frame to every SOCK_RAW socket whose protocol matches, each gets it
+		 * (ethernet header included) in its socketpair gathered straight from data, so the
+		 * frame a multicast fans out from is never copied in here. Dropped for a socket which
+		 * has no room for it
+		 */
+		void putRaw(const MAC &from,const MAC &to,unsigned int etherType,const void *data,
+			unsigned int len);
+
+		/*
+		 * A frame of ZT_MSG_ETHERTYPE, for _msg in place of the stack
+		 */
+		void putMsg(const MAC &from,const void *data,unsigned int len);
+
+		/*
+		 * Sends a frame of ZT_MSG_ETHERTYPE, _msg's Output
+		 */
+		void emitMsg(uint64_t node,const void *data,unsigned int len);
+
+		/*
+		 * Called by the driver once the stack no longer reports on conn, Reap() recycles it as
+		 * soon as the app is done with it too
+		 */
+		void MarkClosed(Connection *conn);
+
+		// Connections closed in the stack and not recycled yet. _reap_m since closures are
+		// reported with _tcpconns_m held or not. _reap_pending is set whenever one of them may
+		// have become ready, _reap_released is FdTable::released() as of the last Reap()
+		std::vector<Connection*> _reap_q;
+		std::atomic<bool> _reap_pending;
+		uint32_t _reap_released;
+		ProfiledMutex _reap_m;
+
+		/*
+		 * Has the stack thread close conn (whose fd the app has already given up) once all it has
+		 * queued is with the stack, or at the latest by deadline (ms), see zts_close_async()
+		 */
+		void CloseDeferred(Connection *conn, uint64_t deadline);
+
+		// Connections waiting for CloseDeferred() to finish, _closing_pending is whether there
+		// are any so that ServiceClosing() costs an atomic load on every other pass
+		std::vector<Connection*> _closing;
+		std::atomic<bool> _closing_pending;
+		Mutex _closing_m;
+
+		// Set on stand-ins (see Park()), _standin_id tells a stand-in's expiry which one it's for
+		bool _standin;
+		uint64_t _standin_id;
+
+		// Stand-ins yet to be taken over or to expire, guarded by _standins_m
+		static std::vector<SocketTap*> _standins;
+		static Mutex _standins_m;
+
+		/*
+		 * Takes over the Connections of a stand-in for our network on our stack thread, called
+		 * once constructed
+		 */
+		void Adopt();
+
+		/*
+		 * Closes the Connections of the stand-in standin_id and deletes it, unless it has been
+		 * taken over already
+		 */
+		static void ExpireStandin(uint64_t standin_id);
+
+		/*
+		 * Moves every Connection of from (those closing and being reaped too) over to to, on
+		 * the stack thread serving both
+		 */
+		static void MoveConnections(SocketTap *from, SocketTap *to);
+
+		// See zts_get_network_stats()
+		TapStats _stats;
+
+		/****************************************************************************/
+		/* TX frame ring to the ZeroTier core                                       */
+		/****************************************************************************/
+
+		// Frames the stack has sent wait in _txq (in _tx_pool's buffers) until threadMain() hands
+		// them to _handler, see ZT_FRAME_TX_RING_LEN. The stack's own lock serializes producers.
+		// Interactive ones wait in _txq_prio instead, see ZT_FRAME_TX_PRIO_RING_LEN
+		FramePool *_tx_pool;
+		FrameRing _txq;
+		FrameRing _txq_prio;
+		std::mutex _tx_m;
+		std::condition_variable _tx_cv;
+		std::atomic<bool> _tx_idle;
+		bool _tx_run;
+		Thread _tx_thread;
+
+		/*
+		 * Returns a buffer for a frame of len bytes to be given to txQueue(), or NULL if frames
+		 * should be given to emitFrame() right away (there's no ring, or len won't fit)
+		 */
+		unsigned char *txAcquire(unsigned int len);
+
+		/*
+		 * Queues a frame from txAcquire() for threadMain(), waiting for room if the ring is full
+		 */
+		void txQueue(unsigned char *buf, unsigned int len);
+
+		/*
+		 * What the stack calls to put a frame (ethernet header included) on the wire, through
+		 * the ring if there is one
+		 */
+		void sendFrame(const void *frame, unsigned int len);
+
+		/*
+		 * Hands a frame (ethernet header included) to _handler
+		 */
+		void emitFrame(const void *frame, unsigned int len);
+
+		// See zts_set_network_compression()
+		FrameCompressor _compressor;
+
+		// See zts_set_admission_limits()
+		Admission _admission;
+
+		// Local ports of outbound TCP connections, only used by the stack thread
+		PortAllocator _ports;
+
+		/*
+		 * _handler, through _compressor when it's enabled
+		 */
+		void handOff(const MAC &from, const MAC &to, unsigned int etherType, const void *data,
+			unsigned int len);
+
+		/*
+		 * Has _compressor write the frame to out (ZT_MAX_MTU bytes) if it's to go compressed and
+		 * returns its length then, 0 if not. Sends the HELLO it asks for and counts the outcome
+		 */
+		unsigned int compressFrame(const MAC &from, const MAC &to, unsigned int etherType,
+			const void *data, unsigned int len, unsigned char *out);
+
+		/*
+		 * Decodes a ZT_COMPRESS_ETHERTYPE frame and put()s what it held
+		 */
+		void putCompressed(const MAC &from, const MAC &to, const void *data, unsigned int len);
+
+		/*
+		 * The HELLO_ACKs _compressor owes, from the TX thread
+		 */
+		void sendCompressAcks();
+
+		// Batches as _compressor leaves them, TX thread only
+		std::vector<unsigned char> _compress_buf;
+
+		/*
+		 * Drains _txq_prio and _txq, the former first
+		 */
+		void threadMain()
+			throw();
+
+		/*
+		 * Fills in the stack's view of conn (RTT, retransmits, etc.) which isn't counted by us
+		 */
+		void Stats(Connection *conn, struct zts_socket_stats *stats);
+
+		/*
+		 * Gives conn a local port from _ports for its connection to addr unless it's bound
+		 * already, passing over ports other sockets on the tap are bound to or listening on.
+		 * Called on the stack thread with _tcpconns_m held
+		 */
+		void AllocPort(Connection *conn, const struct sockaddr *addr);
+
+		/*
+		 * Appends a row for each of the tap's Connections to rows, all read in one pass of the
+		 * stack thread (see zts_dump_connections())
+		 */
+		void Describe(std::vector<struct zts_connection_info> &rows);
+
+		// Set when a direct I/O Connection has TX data or RX space for the stack thread
+		std::atomic<bool> _direct_pending;
+
+		/*
+		 * Called by app threads after direct I/O on one of this tap's Connections, the stack
+		 * thread is only woken if it might otherwise sit on the new work until its next poll
+		 */
+		void WakeDirect(bool whack);
+
+		// Set when a Connection is holding back TX data (see ZT_SO_TCP_COALESCE_BYTES, TCP_CORK,
+		// txAllowance()) which the stack thread has to send once the hold expires
+		std::atomic<bool> _tx_held;
+
+		// Shared by all Connections, see zts_set_network_rate()
+		TokenBucket _tx_shaper;
+
+		/*
+		 * Payload bytes conn may hand the stack now under the tap's and its own limits (SIZE_MAX
+		 * if neither has one), what it then sends is paid for with txCharge(). txShapedMs() is
+		 * how long until either limit lets conn send again. Stack thread only
+		 */
+		size_t txAllowance(Connection *conn);
+		void txCharge(Connection *conn, size_t n);
+		unsigned long txShapedMs(Connection *conn);
+
+		/*
+		 * Called by app threads after changing a Connection's hold settings so that the stack
+		 * thread reconsiders (and sends) anything it's holding back
+		 */
+		void ReleaseHeldTx();
+
+		// Set when some Connection has options waiting for the stack thread, see QueueOptions()
+		std::atomic<bool> _opts_pending;
+
+		/*
+		 * Called by app threads after changing options (ZT_CONN_OPT_*) of conn, the stack thread
+		 * applies them on its next pass so that setting options never contends for the stack
+		 */
+		void QueueOptions(Connection *conn, uint32_t opts);
+
+		/*
+		 * QueueOptions() for every TCP Connection of the tap, also wakes the stack thread when
+		 * there are none
+		 */
+		void QueueStreamOptions(uint32_t opts);
+
+		/*
+		 * Applies whatever QueueOptions() has queued, stack thread only
+		 */
+		void ServiceOptions();
 
-		Thread _thread;
 		std::string _dev; // path to Unix domain socket
 
-		std::vector<MulticastGroup> _multicastGroups;
-		Mutex _multicastGroups_m;
-		Mutex _ips_m, _tcpconns_m, _rx_buf_m, _close_m;
+		// References to each group the tap's in and what the core's yet to be told about,
+		// guarded by _multicastGroups_m
+		std::map<MulticastGroup,unsigned int> _multicastGroups;
+		std::vector<MulticastGroup> _multicastAdded, _multicastRemoved;
+		ProfiledMutex _multicastGroups_m;
+		std::atomic<bool> _multicast_changed;
+		ProfiledMutex _ips_m;
+		Mutex _rx_buf_m, _close_m;
+		ProfiledMutex _tcpconns_m;
+
+		// Ports of the ZT_SOCK_MSG sockets bound to the network, see zts_bind()
+		MsgPorts _msg;
 
 		/*
 		 * Timestamp of last run of housekeeping 
@@ -214,6 +644,9 @@ namespace ZeroTier {
 		 */
 		std::time_t last_housekeeping_ts;
 
+		// Clock::cached() of the last TuneBuffers() pass
+		uint64_t _tune_ts;
+
 		/****************************************************************************/
 		/* In these, we will call the stack's corresponding functions, this is      */
 		/* where one would put logic to select between different stacks             */
@@ -238,6 +671,12 @@ namespace ZeroTier {
 		 * Accepts an incoming Connection
 		 */
 		Connection* Accept(Connection *conn);
+
+		/*
+		 * Accepts up to max queued Connections under one lock acquisition, fills in each one's
+		 * remote address if addrs isn't NULL, returns how many were accepted
+		 */
+		int AcceptMany(Connection *conn, Connection **accepted, struct sockaddr_storage *addrs, int max);
 		
 		/* 
 		 * Move data from RX buffer to application's "socket"
@@ -249,16 +688,55 @@ namespace ZeroTier {
 		 */
 		int Write(Connection *conn, void *data, ssize_t len);
 
+		/*
+		 * Hands n ethernet frames (header included) of a SOCK_RAW socket straight to VL2, returns
+		 * how many were sent, the first one shorter than an ethernet header stops the batch. conn
+		 * is NULL for frames from a shared memory export (see ShmBridge.hpp)
+		 */
+		int WriteRaw(Connection *conn, const struct zts_raw_frame *frames, int n);
+
+		/*
+		 * Sends a message from a ZT_SOCK_MSG socket (whose port is bound in _msg) to port on
+		 * node, returns len or -1 with errno set
+		 */
+		ssize_t WriteMsg(Connection *conn, uint64_t node, uint16_t port, const void *data, size_t len);
+
 		/*
 		 * Closes a Connection
 		 */
 		int Close(Connection *conn);
 
 		/*
-		 * Disposes of previously-closed Connections
+		 * Periodic upkeep (see ZT_HOUSEKEEPING_INTERVAL), called by the stack thread on every pass
 		 */
 		void Housekeeping();
 
+		/*
+		 * Parks the buffers of Connections which have been idle for idle_s, see
+		 * ZT_SOCK_BUF_PARK_IDLE. Stack thread only
+		 */
+		void ParkIdle(std::time_t now, int idle_s);
+
+		/*
+		 * Resizes the buffers of established TCP Connections to their bandwidth-delay product
+		 * (see BufTune and ZT_BUF_TUNE_INTERVAL_MS), along with the stack's where it has its own.
+		 * Stack thread only
+		 */
+		void TuneBuffers();
+
+		/*
+		 * Recycles (and closes the app's end of) those closed Connections which the app has
+		 * closed and no API call has pinned (see FdTable::Pin), costs O(closed) when there's
+		 * reason to look and nothing otherwise. Stack thread only
+		 */
+		void Reap(bool force = false);
+
+		/*
+		 * Closes those of _closing which are done draining or out of time, called by the stack
+		 * thread on every pass
+		 */
+		void ServiceClosing();
+
 		/* 
 		 * Return the address that the socket is bound to 
 		 */
@@ -0,0 +1,230 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// The interface SocketTap and the socket API drive a userspace network stack through
+
+#ifndef ZT_STACKDRIVER_HPP
+#define ZT_STACKDRIVER_HPP
+
+#include <vector>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "MAC.hpp"
+#include "InetAddress.hpp"
+#include "Phy.hpp"
+
+struct zts_socket_stats;
+
+namespace ZeroTier {
+
+	class SocketTap;
+	struct Connection;
+	struct TapFrame;
+	struct PingSession;
+
+	/*
+	 * One network stack linked into the library (picoTCP, lwIP). Each network's SocketTap runs
+	 * on one of them, chosen when the network is joined (see zts_join_stack()), and every
+	 * Connection is served by the driver which created its stack socket (Connection::driver)
+	 */
+	class StackDriver
+	{
+	public:
+		virtual ~StackDriver() {}
+
+		/*
+		 * ZTS_STACK_PICO or ZTS_STACK_LWIP
+		 */
+		virtual int id() const = 0;
+
+		/*
+		 * Set up an interface in the network stack for the SocketTap
+		 */
+		virtual bool init_interface(SocketTap *tap, const InetAddress &ip) = 0;
+
+		/*
+		 * Take an address (already gone from tap->_ips) off the tap's interface, and give the
+		 * interface a new MTU, both called on the stack thread serving tap
+		 */
+		virtual void remove_interface_ip(SocketTap *tap, const InetAddress &ip) {}
+		virtual void set_mtu(SocketTap *tap, unsigned int mtu) {}
+
+		/*
+		 * Takes the tap's interface out of the stack as the tap goes, leaving the sockets bound
+		 * to its addresses be. Called once the stack thread is done with tap
+		 */
+		virtual void remove_interface(SocketTap *tap) {}
+
+		/*
+		 * Whether the stack can carry on a Connection through another tap on the same network
+		 * (see SocketTap::Park()), and hands conn's stack state over to tap to. Rebind() is
+		 * called on the stack thread serving both, with both of their _tcpconns_m held
+		 */
+		virtual bool rebinds() const { return false; }
+		virtual void Rebind(Connection *conn, SocketTap *to) {}
+
+		/*
+		 * One pass of the stack on behalf of the taps (all of this driver's) served by a
+		 * StackThread, returns how long (ms) the thread may sleep before the next pass is due
+		 */
+		virtual unsigned long loop(std::vector<SocketTap*> &taps) = 0;
+
+		/*
+		 * Packets from the ZeroTier virtual wire enter the stack here
+		 */
+		virtual void rx(SocketTap *tap, const MAC &from,const MAC &to,unsigned int etherType,const void *data,unsigned int len) = 0;
+
+		/*
+		 * Zero-copy rx(), release(arg) is called once the stack is done with data. Stacks which
+		 * copy frames anyway take the copy right away
+		 */
+		virtual void rx_ref(SocketTap *tap, const MAC &from,const MAC &to,unsigned int etherType,
+			void *data,unsigned int len,unsigned int headroom,void (*release)(void *),void *arg)
+		{
+			rx(tap, from, to, etherType, data, len);
+			release(arg);
+		}
+
+		/*
+		 * Batched rx()
+		 */
+		virtual void rx_batch(SocketTap *tap, const TapFrame *frames, unsigned int n) = 0;
+
+		/*
+		 * Creates conn's stack socket (for its socket_family, socket_type and protocol) and
+		 * sets conn->driver, returns -1 if the stack has none to spare
+		 */
+		virtual int Socket(Connection *conn) = 0;
+
+		/*
+		 * Frees the stack socket of a Connection which was never handed to a tap
+		 */
+		virtual void Discard(Connection *conn) = 0;
+
+		/*
+		 * From here on the stack's events on conn's socket reach conn through tap
+		 */
+		virtual void Assign(SocketTap *tap, Connection *conn) = 0;
+
+		virtual int Connect(SocketTap *tap, Connection *conn, int fd, const struct sockaddr *addr, socklen_t addrlen) = 0;
+
+		/*
+		 * Has the Connect() which follows use port (host byte order) as the local port of conn's
+		 * stack socket instead of the stack picking one. Returns 1 if it will, 0 if the socket is
+		 * already bound and -1 if another socket on the stack is bound to or listening on port
+		 */
+		virtual int SetLocalPort(Connection *conn, uint16_t port) { return 0; }
+		virtual int Bind(SocketTap *tap, Connection *conn, int fd, const struct sockaddr *addr, socklen_t addrlen) = 0;
+		virtual int Listen(Connection *conn, int fd, int backlog) = 0;
+
+		/*
+		 * Takes the next connection queued on the listener conn, NULL if there's none. Called
+		 * on the stack thread with _tcpconns_m held (see SocketTap::Accept()): it sets options
+		 * on the stack's socket and wraps the new socketpair in the loop's Phy
+		 */
+		virtual Connection *Accept(Connection *conn) = 0;
+		virtual void Peername(Connection *conn, struct sockaddr_storage *addr) = 0;
+		virtual int Read(SocketTap *tap, PhySocket *sock, Connection *conn, bool stack_invoked) = 0;
+		virtual int Write(Connection *conn, void *data, ssize_t len) = 0;
+
+		/*
+		 * Closes conn's stack socket, the driver sees to it that the tap's MarkClosed() follows
+		 * once the stack is done with it
+		 */
+		virtual int Close(Connection *conn) = 0;
+
+		/*
+		 * Fills in stats from conn's stack socket, called on the stack thread with _tcpconns_m
+		 * held (see SocketTap::Stats()) since it reads the stack's own state
+		 */
+		virtual void Stats(Connection *conn, struct zts_socket_stats *stats) = 0;
+
+		/*
+		 * Fills in the addresses and queue depths of conn's stack socket (see
+		 * zts_dump_connections()), called on the stack thread with _tcpconns_m held
+		 */
+		virtual void Describe(Connection *conn, struct zts_connection_info *info) {}
+
+		/*
+		 * Marks what conn's stack socket sends from here on with conn->tos
+		 */
+		virtual void SetTos(Connection *conn) = 0;
+
+		/*
+		 * Applies conn's keepalive settings to its stack socket
+		 */
+		virtual void SetKeepalive(Connection *conn) = 0;
+
+		/*
+		 * Applies the options opts (ZT_CONN_OPT_*) of conn to its stack socket. Called by the stack
+		 * thread for assigned Connections (see SocketTap::ServiceOptions())
+		 */
+		virtual void ApplyOptions(Connection *conn, uint32_t opts) = 0;
+
+		/*
+		 * Fills in the stack's fields of limits (tcp, tcp_listen, udp, timers, timers_in_use)
+		 */
+		virtual void Limits(struct zts_socket_limits *limits) = 0;
+
+		/*
+		 * Latency probes (see PingSession), all three called on the stack thread serving tap.
+		 * PingOpen() sets up what s->proto sends with and returns -1 if the stack can't,
+		 * Ping() sends probe seq, PingClose() stops reporting replies to s
+		 */
+		virtual int PingOpen(SocketTap *tap, PingSession *s) { return -1; }
+		virtual int Ping(PingSession *s, uint32_t seq) { return -1; }
+		virtual void PingClose(PingSession *s) {}
+	};
+
+	/*
+	 * The driver a network's tap runs on, see zts_join_stack()
+	 */
+	StackDriver *stackDriverFor(uint64_t nwid);
+
+	/*
+	 * The driver zts_socket() creates stack sockets with, they move to their tap's driver
+	 * if it's another one once they're bound or connected
+	 */
+	StackDriver *defaultStackDriver();
+
+	/*
+	 * What a tap calls its driver through. With only one stack built that's the stack's
+	 * own (final) class so calls on the frame path bind directly instead of through the vtable
+	 */
+#if defined(STACK_PICO) && !defined(STACK_LWIP)
+	class picoTCP;
+	typedef picoTCP TapDriver;
+#elif defined(STACK_LWIP) && !defined(STACK_PICO)
+	class lwIP;
+	typedef lwIP TapDriver;
+#else
+	typedef StackDriver TapDriver;
+#endif
+}
+
+#endif
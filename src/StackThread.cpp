@@ -0,0 +1,634 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+#include <algorithm>
+#include <map>
+#include <string.h>
+
+#include "StackThread.hpp"
+#include "SocketTap.hpp"
+#include "Connection.hpp"
+#include "libzt.h"
+
+#include "StackDriver.hpp"
+#include "ThreadAffinity.hpp"
+#include "PowerMode.hpp"
+#include "Clock.hpp"
+
+namespace ZeroTier {
+
+	extern ThreadAffinity affinity;
+
+#if ZT_STACK_THREAD_POOL_SZ > 0
+	static StackThread *pool[ZT_STACK_THREAD_POOL_SZ];
+#endif
+	// With cooperative set every tap is served by this one, see runOnce()
+	static StackThread *driven = NULL;
+	static Mutex pool_m;
+	// See hold(), each holds a reference. Guarded by pool_m
+	static std::map<uint64_t, StackThread*> held;
+
+	std::atomic<int> StackThread::busyPollFrames(ZT_BUSY_POLL_FRAMES);
+	std::atomic<int> StackThread::busyPollUs(ZT_BUSY_POLL_US);
+
+	std::atomic<bool> StackThread::cooperative(false);
+
+	std::atomic<uint64_t> StackThread::watchdogUs(0);
+	thread_local StackThread *StackThread::current = NULL;
+
+	// The watchdog's state, every StackThread and the stalls found. The thread is never joined
+	// at exit, so it's left alone rather than destroyed while running
+	static std::mutex watch_m;
+	static std::condition_variable watch_cv;
+	static std::vector<StackThread*> watched;
+	static std::thread *watcher = NULL;
+	static bool watcher_stop = false;
+	static zts_stall_cb stall_cb = NULL;
+	static void *stall_arg = NULL;
+	static struct zts_stack_watchdog_stats stall_stats;
+	struct stall_event {
+		uint64_t nwid;
+		int phase;
+		uint64_t ms;
+	};
+	static std::vector<stall_event> stall_q;
+
+	static uint64_t steady_us()
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	StackThread::StackThread(uint64_t nwid) :
+		_phy(this,false,true),
+		_nwid(nwid),
+		_refs(0),
+		_slot(-1),
+		_run(true),
+		_spinning(false),
+		_frames_seen(0),
+		_cb_ns(0),
+		_pass_frames(0),
+		_win_busy_ns(0),
+		_win_ns(0)
+	{
+		_phase = ZTS_STACK_PHASE_IDLE;
+		_flagged = 0;
+		{
+			std::lock_guard<std::mutex> _l(watch_m);
+			watched.push_back(this);
+		}
+		_loop.passes = 0;
+		_loop.busy_ns = 0;
+		_loop.idle_ns = 0;
+		_loop.frames = 0;
+		_loop.pass_max_ns = 0;
+		_loop.busy_pct = 0;
+		for(int i=0; i<ZTS_LOOP_BUCKETS; i++) {
+			_loop.pass_hist[i] = 0;
+			_loop.frames_hist[i] = 0;
+		}
+		_commands = NULL;
+		_tid = std::thread::id();
+		_due_at = 0;
+		_threaded = !cooperative;
+		if(_threaded)
+			_thread = Thread::start(this);
+	}
+
+	StackThread::~StackThread()
+	{
+		{
+			std::lock_guard<std::mutex> _l(watch_m);
+			watched.erase(std::remove(watched.begin(), watched.end(), this), watched.end());
+		}
+		_run = false;
+		_phy.whack();
+		if(_threaded)
+			Thread::join(_thread);
+		// Nobody's left to race with, don't leave a caller of run() waiting
+		runCommands();
+	}
+
+	void StackThread::run(const std::function<void()> &fn)
+	{
+		if(_tid.load() == std::this_thread::get_id()) {
+			fn();
+			return;
+		}
+		command c;
+		c.fn = &fn;
+		std::future<void> done = c.done.get_future();
+		c.next = _commands.load();
+		while(!_commands.compare_exchange_weak(c.next, &c))
+			;
+		_phy.whack();
+		if(_threaded)
+			done.wait();
+		else
+			drive([&done]() { return done.wait_for(std::chrono::seconds(0)) == std::future_status::ready; });
+	}
+
+	void StackThread::runCommands()
+	{
+		command *c = _commands.exchange(NULL), *fifo = NULL;
+		while(c) {
+			command *next = c->next;
+			c->next = fifo;
+			fifo = c;
+			c = next;
+		}
+		while(fifo) {
+			// The caller's command goes out of scope as soon as it's done
+			command *next = fifo->next;
+			(*fifo->fn)();
+			fifo->done.set_value();
+			fifo = next;
+		}
+	}
+
+	StackThread *StackThread::acquire(uint64_t nwid)
+	{
+		Mutex::Lock _l(pool_m);
+		StackThread *t;
+		if(cooperative) {
+			if(!driven)
+				driven = new StackThread(nwid);
+			driven->_refs++;
+			return driven;
+		}
+		std::map<uint64_t, StackThread*>::iterator h = held.find(nwid);
+		if(h != held.end()) {
+			t = h->second; // its reference is the caller's now
+			held.erase(h);
+			return t;
+		}
+#if ZT_STACK_THREAD_POOL_SZ > 0
+		int slot = (int)(nwid % ZT_STACK_THREAD_POOL_SZ);
+		if(!pool[slot]) {
+			pool[slot] = new StackThread(nwid);
+			pool[slot]->_slot = slot;
+		}
+		t = pool[slot];
+#else
+		t = new StackThread(nwid);
+#endif
+		t->_refs++;
+		return t;
+	}
+
+	void StackThread::release(StackThread *t, SocketTap *tap)
+	{
+		t->remove(tap);
+		Mutex::Lock _l(pool_m);
+		unref(t);
+	}
+
+	void StackThread::unref(StackThread *t)
+	{
+		if(--t->_refs)
+			return;
+		if(t == driven)
+			driven = NULL;
+#if ZT_STACK_THREAD_POOL_SZ > 0
+		if(t->_slot >= 0)
+			pool[t->_slot] = NULL;
+#endif
+		delete t;
+	}
+
+	void StackThread::hold(StackThread *t, uint64_t nwid)
+	{
+		Mutex::Lock _l(pool_m);
+		t->_refs++;
+		StackThread *&h = held[nwid];
+		if(h)
+			unref(h);
+		h = t;
+	}
+
+	void StackThread::unhold(StackThread *t, uint64_t nwid)
+	{
+		Mutex::Lock _l(pool_m);
+		std::map<uint64_t, StackThread*>::iterator h = held.find(nwid);
+		if(h == held.end() || h->second != t)
+			return;
+		held.erase(h);
+		unref(t);
+	}
+
+	void StackThread::add(SocketTap *tap)
+	{
+		{
+			std::lock_guard<std::mutex> _l(_taps_m);
+			_taps.push_back(tap);
+		}
+		_phy.whack();
+	}
+
+	void StackThread::remove(SocketTap *tap)
+	{
+		std::unique_lock<std::mutex> _l(_taps_m);
+		if(std::find(_taps.begin(), _taps.end(), tap) == _taps.end())
+			return;
+		_removing.push_back(tap);
+		_phy.whack();
+		if(!_threaded) {
+			_l.unlock();
+			drive([this, tap]() {
+				std::lock_guard<std::mutex> _l(_taps_m);
+				return std::find(_removing.begin(), _removing.end(), tap) == _removing.end();
+			});
+			return;
+		}
+		_taps_cv.wait(_l, [this, tap]() { 
+			return std::find(_removing.begin(), _removing.end(), tap) == _removing.end(); 
+		});
+	}
+
+	void StackThread::detach(const std::vector<SocketTap*> &taps)
+	{
+		std::vector<StackThread*> threads;
+		for(size_t i=0; i<taps.size(); i++) {
+			StackThread *t = taps[i]->_stack;
+			std::lock_guard<std::mutex> _l(t->_taps_m);
+			if(std::find(t->_taps.begin(), t->_taps.end(), taps[i]) == t->_taps.end())
+				continue;
+			t->_removing.push_back(taps[i]);
+			if(std::find(threads.begin(), threads.end(), t) == threads.end())
+				threads.push_back(t);
+		}
+		for(size_t i=0; i<threads.size(); i++)
+			threads[i]->_phy.whack();
+		for(size_t i=0; i<threads.size(); i++) {
+			StackThread *t = threads[i];
+			if(!t->_threaded) {
+				t->drive([t]() {
+					std::lock_guard<std::mutex> _l(t->_taps_m);
+					return t->_removing.empty();
+				});
+				continue;
+			}
+			std::unique_lock<std::mutex> _l(t->_taps_m);
+			t->_taps_cv.wait(_l, [t]() { return t->_removing.empty(); });
+		}
+	}
+
+	static uint64_t since_ns(std::chrono::steady_clock::time_point t)
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - t).count();
+	}
+
+	void StackThread::threadMain()
+		throw()
+	{
+		unsigned long timeout = 0;
+		ThreadAffinity::state pinning;
+		ThreadAffinity::Accounted _cpu(affinity, ZTS_THREAD_STACK, _nwid);
+		_tid = std::this_thread::get_id();
+		current = this;
+		while(_run)
+		{
+			affinity.refresh(pinning, ZTS_THREAD_STACK, _nwid);
+			timeout = pass(Clock::sleepMs(timeout));
+		}
+	}
+
+	unsigned long StackThread::pass(unsigned long wait_ms)
+	{
+		_cb_ns = 0;
+		std::chrono::steady_clock::time_point slept = std::chrono::steady_clock::now();
+		_phy.poll(wait_ms);
+		std::chrono::steady_clock::time_point woke = std::chrono::steady_clock::now();
+		uint64_t polled = std::chrono::duration_cast<std::chrono::nanoseconds>(woke - slept).count();
+		uint64_t idle_ns = polled > _cb_ns ? polled - _cb_ns : 0;
+		Clock::tick();
+		unsigned long timeout = serve(PowerMode::maxInterval());
+		// The pass ends here: what it did since poll() returned, and the callbacks poll() made
+		passDone(since_ns(woke) + _cb_ns, idle_ns);
+		enter(ZTS_STACK_PHASE_IDLE);
+		return timeout;
+	}
+
+	unsigned long StackThread::serve(unsigned long timeout)
+	{
+		std::lock_guard<std::mutex> _l(_taps_m);
+		// Ahead of the pass so that it sees (and its timeout accounts for) what they did
+		enter(ZTS_STACK_PHASE_COMMANDS);
+		runCommands();
+		enter(ZTS_STACK_PHASE_HOUSEKEEPING);
+		if(_removing.size()) {
+			for(size_t i=0; i<_removing.size(); i++) {
+				SocketTap *tap = _removing[i];
+				ProfiledMutex::Lock _cl(tap->_tcpconns_m);
+				for(size_t j=0; j<tap->_Connections.size(); j++) {
+					if(tap->_Connections[j]->sock) {
+						_phy.close(tap->_Connections[j]->sock, false);
+						tap->_Connections[j]->sock = NULL;
+					}
+				}
+				_taps.erase(std::remove(_taps.begin(), _taps.end(), tap), _taps.end());
+			}
+			_removing.clear();
+			_taps_cv.notify_all();
+		}
+		if(!_taps.size()) {
+			_spinning = false;
+			return PowerMode::align(timeout);
+		}
+		// Taps sharing a thread may run on different stacks, each gets a pass over its own
+		enter(ZTS_STACK_PHASE_STACK);
+		std::vector<SocketTap*> taps;
+		std::vector<TapDriver*> done;
+		for(size_t i=0; i<_taps.size(); i++) {
+			TapDriver *driver = _taps[i]->_driver;
+			if(!driver || std::find(done.begin(), done.end(), driver) != done.end())
+				continue;
+			done.push_back(driver);
+			taps.clear();
+			for(size_t j=i; j<_taps.size(); j++) {
+				if(_taps[j]->_driver == driver)
+					taps.push_back(_taps[j]);
+			}
+			timeout = std::min(timeout, driver->loop(taps));
+		}
+		return PowerMode::align(busyPoll(timeout));
+	}
+
+	unsigned long StackThread::drivePass(unsigned long wait_ms)
+	{
+		std::thread::id tid = _tid.exchange(std::this_thread::get_id());
+		StackThread *was = current;
+		current = this;
+		unsigned long timeout = pass(wait_ms);
+		current = was;
+		_tid = tid;
+		return timeout;
+	}
+
+	void StackThread::drive(const std::function<bool()> &done)
+	{
+		while(!done()) {
+			std::unique_lock<std::mutex> _l(_drive_m, std::try_to_lock);
+			if(_l.owns_lock()) {
+				drivePass(0);
+				continue;
+			}
+			// Whoever is driving it gets to it on their next pass
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+
+	int StackThread::runOnce(int timeout_ms)
+	{
+		StackThread *t;
+		{
+			Mutex::Lock _l(pool_m);
+			t = driven;
+			if(t)
+				t->_refs++;
+		}
+		unsigned long wait = timeout_ms < 0 ? PowerMode::maxInterval() : (unsigned long)timeout_ms;
+		if(!t) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(wait));
+			return (int)Clock::sleepMs(PowerMode::maxInterval());
+		}
+		unsigned long timeout;
+		{
+			std::lock_guard<std::mutex> _d(t->_drive_m);
+			// Not past what the stack asked for last time
+			uint64_t now = Clock::now();
+			wait = std::min(wait, t->_due_at > now ? Clock::sleepMs(t->_due_at - now) : 0);
+			timeout = t->drivePass(wait);
+			t->_due_at = Clock::now() + timeout;
+		}
+		Mutex::Lock _l(pool_m);
+		unref(t);
+		return (int)Clock::sleepMs(timeout);
+	}
+
+	unsigned long StackThread::busyPoll(unsigned long timeout)
+	{
+		uint64_t seen = 0;
+		for(size_t i=0; i<_taps.size(); i++)
+			seen += stat_get(_taps[i]->_stats.frames_in);
+		// Less than last time if a tap has gone
+		uint64_t arrived = seen > _frames_seen ? seen - _frames_seen : 0;
+		_frames_seen = seen;
+		int frames = busyPollFrames.load(std::memory_order_relaxed);
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if(frames > 0 && PowerMode::normal() && (arrived >= (uint64_t)frames || (_spinning && arrived))) {
+			_spin_until = now + std::chrono::microseconds(busyPollUs.load(std::memory_order_relaxed));
+			_spinning = true;
+		}
+		if(!_spinning)
+			return timeout;
+		if(now < _spin_until)
+			return 0;
+		// Producers which saw us spinning didn't wake us, one more pass picks up what they queued
+		_spinning.store(false, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		return 0;
+	}
+
+	// Bucket of a pass_hist/frames_hist value
+	static unsigned int log2Bucket(uint64_t v)
+	{
+		unsigned int b = v ? 63 - __builtin_clzll(v) : 0;
+		return b < ZTS_LOOP_BUCKETS ? b : ZTS_LOOP_BUCKETS - 1;
+	}
+
+	void StackThread::passDone(uint64_t busy_ns, uint64_t idle_ns)
+	{
+		stat_add(_loop.passes, 1);
+		stat_add(_loop.busy_ns, busy_ns);
+		stat_add(_loop.idle_ns, idle_ns);
+		stat_add(_loop.frames, _pass_frames);
+		stat_max(_loop.pass_max_ns, busy_ns);
+		_loop.pass_ns.add(busy_ns);
+		stat_add(_loop.pass_hist[log2Bucket(busy_ns / 1000)], 1);
+		stat_add(_loop.frames_hist[log2Bucket(_pass_frames)], 1);
+		_pass_frames = 0;
+		_win_busy_ns += busy_ns;
+		_win_ns += busy_ns + idle_ns;
+		if(_win_ns >= (uint64_t)ZT_LOOP_BUSY_WINDOW_MS * 1000000) {
+			_loop.busy_pct.store((uint32_t)(_win_busy_ns * 100 / _win_ns), std::memory_order_relaxed);
+			_win_busy_ns = 0;
+			_win_ns = 0;
+		}
+	}
+
+	int StackThread::enter(int phase)
+	{
+		uint64_t now = steady_us();
+		uint64_t was = _phase.load(std::memory_order_relaxed);
+		uint64_t limit = watchdogUs.load(std::memory_order_relaxed);
+		int prev = (int)(was & 15);
+		uint64_t since = was >> 4;
+		if(limit && prev != ZTS_STACK_PHASE_IDLE && since && now - since >= limit) {
+			std::lock_guard<std::mutex> _l(watch_m);
+			bool known = _flagged.load(std::memory_order_relaxed) == was;
+			_flagged.store(was, std::memory_order_relaxed);
+			stalled(prev, (now - since) / 1000, known);
+		}
+		_phase.store(now << 4 | (uint64_t)phase, std::memory_order_relaxed);
+		return prev;
+	}
+
+	void StackThread::stalled(int phase, uint64_t ms, bool known)
+	{
+		if(!known) {
+			stall_stats.stalls++;
+			stall_stats.by_phase[phase]++;
+			stall_event e = { _nwid, phase, ms };
+			stall_q.push_back(e);
+			watch_cv.notify_all();
+		}
+		if(ms > stall_stats.longest_ms) {
+			stall_stats.longest_ms = ms;
+			stall_stats.longest_nwid = _nwid;
+			stall_stats.longest_phase = phase;
+		}
+	}
+
+	void StackThread::watchMain()
+	{
+		std::unique_lock<std::mutex> _l(watch_m);
+		while(!watcher_stop) {
+			uint64_t limit = watchdogUs.load(std::memory_order_relaxed);
+			if(stall_q.empty())
+				watch_cv.wait_for(_l, std::chrono::microseconds(std::max(limit / 4, (uint64_t)1000)));
+			uint64_t now = steady_us();
+			for(size_t i=0; limit && i<watched.size(); i++) {
+				StackThread *t = watched[i];
+				uint64_t w = t->_phase.load(std::memory_order_relaxed);
+				uint64_t since = w >> 4;
+				if((w & 15) == ZTS_STACK_PHASE_IDLE || !since || now < since + limit
+					|| t->_flagged.load(std::memory_order_relaxed) == w)
+					continue;
+				t->_flagged.store(w, std::memory_order_relaxed);
+				t->stalled((int)(w & 15), (now - since) / 1000, false);
+			}
+			std::vector<stall_event> q;
+			q.swap(stall_q);
+			zts_stall_cb cb = stall_cb;
+			void *arg = stall_arg;
+			if(!cb || q.empty())
+				continue;
+			_l.unlock();
+			for(size_t i=0; i<q.size(); i++)
+				cb(q[i].nwid, q[i].phase, q[i].ms, arg);
+			_l.lock();
+		}
+	}
+
+	void StackThread::setWatchdog(unsigned int threshold_ms, zts_stall_cb cb, void *arg)
+	{
+		std::thread *done = NULL;
+		{
+			std::lock_guard<std::mutex> _l(watch_m);
+			stall_cb = cb;
+			stall_arg = arg;
+			stall_stats.threshold_ms = threshold_ms;
+			watchdogUs = (uint64_t)threshold_ms * 1000;
+			if(threshold_ms && !watcher) {
+				watcher_stop = false;
+				watcher = new std::thread(watchMain);
+			}
+			else if(!threshold_ms && watcher) {
+				watcher_stop = true;
+				done = watcher;
+				watcher = NULL;
+			}
+			watch_cv.notify_all();
+		}
+		if(done) {
+			done->join();
+			delete done;
+		}
+	}
+
+	void StackThread::watchdogStats(struct zts_stack_watchdog_stats *stats)
+	{
+		std::lock_guard<std::mutex> _l(watch_m);
+		*stats = stall_stats;
+	}
+
+	void StackThread::loopStats(struct zts_stack_loop_stats *stats)
+	{
+		memset(stats, 0, sizeof(*stats));
+		{
+			std::lock_guard<std::mutex> _l(_taps_m);
+			stats->networks = _taps.size();
+		}
+		stats->busy_pct = stat_get(_loop.busy_pct);
+		stats->passes = stat_get(_loop.passes);
+		stats->busy_us = stat_get(_loop.busy_ns) / 1000;
+		stats->idle_us = stat_get(_loop.idle_ns) / 1000;
+		stats->frames = stat_get(_loop.frames);
+		stats->pass_p50_ns = _loop.pass_ns.percentile(0.5);
+		stats->pass_p99_ns = _loop.pass_ns.percentile(0.99);
+		stats->pass_p999_ns = _loop.pass_ns.percentile(0.999);
+		stats->pass_max_ns = stat_get(_loop.pass_max_ns);
+		for(int i=0; i<ZTS_LOOP_BUCKETS; i++) {
+			stats->pass_hist[i] = stat_get(_loop.pass_hist[i]);
+			stats->frames_hist[i] = stat_get(_loop.frames_hist[i]);
+		}
+	}
+
+	void StackThread::phyOnUnixClose(PhySocket *sock,void **uptr)
+	{
+		Phase _p(ZTS_STACK_PHASE_SOCKET_IO);
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		Connection *conn = (Connection*)*uptr;
+		if(conn && conn->tap)
+			conn->tap->phyOnUnixClose(sock,uptr);
+		_cb_ns += since_ns(start);
+	}
+
+	void StackThread::phyOnUnixData(PhySocket *sock,void **uptr,void *data,ssize_t len)
+	{
+		Phase _p(ZTS_STACK_PHASE_SOCKET_IO);
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		Connection *conn = (Connection*)*uptr;
+		if(conn && conn->tap)
+			conn->tap->phyOnUnixData(sock,uptr,data,len);
+		_cb_ns += since_ns(start);
+	}
+
+	void StackThread::phyOnUnixWritable(PhySocket *sock,void **uptr,bool stack_invoked)
+	{
+		Phase _p(ZTS_STACK_PHASE_SOCKET_IO);
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		Connection *conn = (Connection*)*uptr;
+		if(conn && conn->tap)
+			conn->tap->phyOnUnixWritable(sock,uptr,stack_invoked);
+		_cb_ns += since_ns(start);
+	}
+
+} // namespace ZeroTier
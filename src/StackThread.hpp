@@ -0,0 +1,323 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// Threads which run the userspace stack on behalf of one or more SocketTaps
+
+#ifndef ZT_STACKTHREAD_HPP
+#define ZT_STACKTHREAD_HPP
+
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <thread>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "libzt.h"
+#include "Mutex.hpp"
+#include "Stats.hpp"
+#include "Thread.hpp"
+#include "Phy.hpp"
+#include "PhyEvent.hpp"
+
+namespace ZeroTier {
+
+	class SocketTap;
+	class StackThread;
+
+	// The event loop serving the taps' socketpairs, see PhyEvent.hpp
+#if defined(ZT_PHY_EPOLL) || defined(ZT_PHY_KQUEUE)
+	typedef PhyEvent<StackThread *> StackPhy;
+#else
+	typedef Phy<StackThread *> StackPhy;
+#endif
+
+	/*
+	 * Owns the Phy I/O loop that a group of SocketTaps do their socketpair I/O through, and
+	 * drives the stack for them. With ZT_STACK_THREAD_POOL_SZ == 0 every SocketTap gets its
+	 * own StackThread, otherwise taps share a fixed pool of them (assigned by nwid). In
+	 * cooperative mode one StackThread serves every tap and no thread runs it, see runOnce()
+	 */
+	class StackThread
+	{
+#if defined(ZT_PHY_EPOLL) || defined(ZT_PHY_KQUEUE)
+		friend class PhyEvent<StackThread *>;
+#endif
+		friend class Phy<StackThread *>;
+
+	public:
+		/*
+		 * Returns the StackThread which should serve the network nwid (starting it if needed),
+		 * the caller must add() its tap once constructed and release() it when done
+		 */
+		static StackThread *acquire(uint64_t nwid);
+
+		/*
+		 * Removes tap from t, stopping and deleting t once it serves no taps
+		 */
+		static void release(StackThread *t, SocketTap *tap);
+
+		/*
+		 * Keeps t running for the next acquire(nwid), which gets it in place of whichever
+		 * thread it would have, see SocketTap::Park(). unhold() lets go of it unless that
+		 * acquire() has taken it already
+		 */
+		static void hold(StackThread *t, uint64_t nwid);
+		static void unhold(StackThread *t, uint64_t nwid);
+
+		/*
+		 * Start/stop serving tap. remove() waits for the loop to close the PhySockets of tap's
+		 * Connections (Phy may only be modified between polls) and forget about it
+		 */
+		void add(SocketTap *tap);
+		void remove(SocketTap *tap);
+
+		/*
+		 * remove() for many taps at once, each StackThread serving some of them is waited on
+		 * once for all of them. release() doesn't wait on the stack for a tap detached this way
+		 */
+		static void detach(const std::vector<SocketTap*> &taps);
+
+		/*
+		 * Runs fn on this thread between stack passes and returns once it has, anything an app
+		 * thread does to the stack goes through here (see SocketTap::RunOnStack()). Called from
+		 * this thread (a stack callback, say) fn runs right away. The caller may not hold a lock
+		 * the loop takes (_taps_m, a tap's _tcpconns_m). In cooperative mode it is run by the
+		 * caller's own pass unless another thread is running them
+		 */
+		void run(const std::function<void()> &fn);
+
+		void threadMain()
+			throw();
+
+		/*
+		 * See zts_stack_config.cooperative, taken at the first acquire() of the process
+		 */
+		static std::atomic<bool> cooperative;
+
+		/*
+		 * In cooperative mode, one pass of the loop on the calling thread: polls the taps'
+		 * socketpairs for up to timeout_ms (-1 for as long as the stack allows), then runs
+		 * commands, frames and stack timers. Returns ms until the stack wants its next pass
+		 */
+		static int runOnce(int timeout_ms);
+
+		/*
+		 * Whether the loop is busy polling, in which case what a producer has just queued
+		 * will be seen without a whack()
+		 */
+		bool spinning() const
+		{
+			// Pairs with the one in busyPoll() so that either we see it sleeping or it sees the queue
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			return _spinning.load(std::memory_order_relaxed);
+		}
+
+		// Frames the stack has been handed this pass, called by the driver on this thread
+		void framesPolled(size_t n) { _pass_frames += n; }
+
+		// See zts_get_stack_loop_stats()
+		void loopStats(struct zts_stack_loop_stats *stats);
+
+		// See zts_set_stack_watchdog()
+		static void setWatchdog(unsigned int threshold_ms, zts_stall_cb cb, void *arg);
+		static void watchdogStats(struct zts_stack_watchdog_stats *stats);
+
+		// The watchdog's threshold in us, 0 while it's off
+		static std::atomic<uint64_t> watchdogUs;
+
+		// The StackThread running the calling thread, NULL if it's not one
+		static thread_local StackThread *current;
+
+		/*
+		 * Marks what the calling stack thread is doing (ZTS_STACK_PHASE_*) for the watchdog
+		 * while in scope. The phase it was in before resumes once it goes, timed afresh
+		 */
+		class Phase
+		{
+		public:
+			Phase(int phase) : _t(watchdogUs.load(std::memory_order_relaxed) ? current : NULL)
+			{
+				if(_t)
+					_prev = _t->enter(phase);
+			}
+			~Phase()
+			{
+				if(_t)
+					_t->enter(_prev);
+			}
+
+		private:
+			StackThread *_t;
+			int _prev;
+		};
+
+		// See zts_set_busy_poll()
+		static std::atomic<int> busyPollFrames;
+		static std::atomic<int> busyPollUs;
+
+		StackPhy _phy;
+
+	private:
+		StackThread(uint64_t nwid);
+		~StackThread();
+
+		// Drops a reference, deleting t with the last one. Caller holds pool_m
+		static void unref(StackThread *t);
+
+		// The network whose ZTS_THREAD_STACK affinity we follow, the first one we served
+		uint64_t _nwid;
+		std::vector<SocketTap*> _taps;
+		std::vector<SocketTap*> _removing;
+		// Held by the loop while it processes the stack (not while polling)
+		std::mutex _taps_m;
+		std::condition_variable _taps_cv;
+		int _refs;
+		int _slot; // index into the pool, or -1 if dedicated to one tap
+		volatile bool _run;
+		bool _threaded; // false in cooperative mode, where app threads drive() the loop
+		Thread _thread;
+
+		// Held by whichever thread is running a pass in cooperative mode. _due_at (Clock::now())
+		// is when the last runOnce() pass asked for the next one
+		std::mutex _drive_m;
+		uint64_t _due_at;
+
+		/*
+		 * One pass of the loop, polling for up to wait_ms first. Returns what the stack wants
+		 * the next poll's timeout to be
+		 */
+		unsigned long pass(unsigned long wait_ms);
+
+		/*
+		 * The part of a pass after polling: commands, removals and the stacks' loops
+		 */
+		unsigned long serve(unsigned long timeout);
+
+		/*
+		 * pass() on the calling thread as though it were ours, with _drive_m held
+		 */
+		unsigned long drivePass(unsigned long wait_ms);
+
+		/*
+		 * What a caller waiting on the loop does in cooperative mode: runs passes until done()
+		 * holds, or waits for the thread that's running them
+		 */
+		void drive(const std::function<bool()> &done);
+
+		// Commands from run(), pushed by any thread and taken all at once by the loop, newest first
+		struct command {
+			const std::function<void()> *fn;
+			std::promise<void> done;
+			command *next;
+		};
+		std::atomic<command*> _commands;
+		std::atomic<std::thread::id> _tid;
+
+		/*
+		 * Runs whatever run() has queued, in the order it was queued
+		 */
+		void runCommands();
+
+		// Busy polling state, see busyPoll(). _frames_seen is the taps' frames_in at the last pass
+		std::atomic<bool> _spinning;
+		uint64_t _frames_seen;
+		std::chrono::steady_clock::time_point _spin_until;
+
+		/*
+		 * Given the timeout the stack asked for, returns the one to poll with
+		 */
+		unsigned long busyPoll(unsigned long timeout);
+
+		// How the passes went, see passDone(). Written by this thread, read by any
+		struct {
+			std::atomic<uint64_t> passes;
+			std::atomic<uint64_t> busy_ns;
+			std::atomic<uint64_t> idle_ns;
+			std::atomic<uint64_t> frames;
+			std::atomic<uint64_t> pass_max_ns;
+			std::atomic<uint32_t> busy_pct;
+			std::atomic<uint64_t> pass_hist[ZTS_LOOP_BUCKETS];
+			std::atomic<uint64_t> frames_hist[ZTS_LOOP_BUCKETS];
+			LatencyHistogram pass_ns;
+		} _loop;
+		// This thread's alone: the current pass's callbacks and frames, the busy_pct window
+		uint64_t _cb_ns;
+		uint64_t _pass_frames;
+		uint64_t _win_busy_ns;
+		uint64_t _win_ns;
+
+		/*
+		 * Books a pass which was busy_ns doing things after idle_ns of waiting for them
+		 */
+		void passDone(uint64_t busy_ns, uint64_t idle_ns);
+
+		// The current phase, since (steady clock us) << 4 | phase. _flagged is the last value
+		// of it reported as a stall, so that each one is reported once
+		std::atomic<uint64_t> _phase;
+		std::atomic<uint64_t> _flagged;
+
+		/*
+		 * Switches to phase and returns the one it's leaving, which is reported if it went on
+		 * for too long and the watchdog hasn't noticed yet
+		 */
+		int enter(int phase);
+
+		/*
+		 * Reports a stall of phase, the watchdog noticing it in progress or this thread at its
+		 * end. Caller holds watch_m (see StackThread.cpp)
+		 */
+		void stalled(int phase, uint64_t ms, bool known);
+
+		static void watchMain();
+
+		/****************************************************************************/
+		/* Phy callbacks, forwarded to the SocketTap owning the Connection          */
+		/****************************************************************************/
+
+		// Run by _phy.poll(), the time they take counts as busy
+		void phyOnUnixClose(PhySocket *sock,void **uptr);
+		void phyOnUnixData(PhySocket *sock,void **uptr,void *data,ssize_t len);
+		void phyOnUnixWritable(PhySocket *sock,void **uptr,bool stack_invoked);
+
+		void phyOnDatagram(PhySocket *sock,void **uptr,const struct sockaddr *local_address, 
+			const struct sockaddr *from,void *data,unsigned long len) {}
+		void phyOnTcpConnect(PhySocket *sock,void **uptr,bool success) {}
+		void phyOnTcpAccept(PhySocket *sockL,PhySocket *sockN,void **uptrL,void **uptrN,
+			const struct sockaddr *from) {}
+		void phyOnTcpClose(PhySocket *sock,void **uptr) {}
+		void phyOnTcpData(PhySocket *sock,void **uptr,void *data,unsigned long len) {}
+		void phyOnTcpWritable(PhySocket *sock,void **uptr) {}
+	};
+
+} // namespace ZeroTier
+
+#endif // ZT_STACKTHREAD_HPP
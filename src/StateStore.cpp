@@ -0,0 +1,312 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "Constants.hpp"
+#include "Mutex.hpp"
+#include "OSUtils.hpp"
+
+#include "StateStore.hpp"
+#include "libzt.h"
+
+namespace ZeroTier {
+namespace StateStore {
+
+	static Mutex _m;
+	static struct zts_state_store _store;
+	static bool _active = false;
+	static std::string _dir;                       // the scratch home path while one is open
+	static std::map<std::string, std::string> _synced; // what the store holds of it
+
+	// Written by the service for its own use, not state to carry over
+	static bool transient(const std::string &key)
+	{
+		return key == "zerotier-one.pid" || key == "zerotier-one.port";
+	}
+
+	bool active()
+	{
+		Mutex::Lock _l(_m);
+		return _active;
+	}
+
+	void set(const struct zts_state_store *store)
+	{
+		Mutex::Lock _l(_m);
+		_active = store != NULL;
+		if(store)
+			_store = *store;
+	}
+
+	static bool get_locked(const std::string &key, std::string &value)
+	{
+		char buf[4096];
+		int n = _store.get(_store.arg, key.c_str(), buf, sizeof(buf));
+		if(n < 0)
+			return false;
+		if((size_t)n <= sizeof(buf)) {
+			value.assign(buf, n);
+			return true;
+		}
+		// Too long for buf, asked again for all of it
+		std::vector<char> big(n);
+		int m = _store.get(_store.arg, key.c_str(), big.data(), n);
+		if(m < 0 || m > n)
+			return false;
+		value.assign(big.data(), m);
+		return true;
+	}
+
+	static std::vector<std::string> keys_locked()
+	{
+		std::string index;
+		if(!get_locked(ZT_STATE_INDEX_KEY, index))
+			return std::vector<std::string>();
+		std::vector<std::string> keys(OSUtils::split(index.c_str(), "\n", "", ""));
+		keys.erase(std::remove(keys.begin(), keys.end(), std::string()), keys.end());
+		return keys;
+	}
+
+	static bool index_locked(const std::string &key, bool add)
+	{
+		std::vector<std::string> keys(keys_locked());
+		std::vector<std::string>::iterator k = std::find(keys.begin(), keys.end(), key);
+		if(add == (k != keys.end()))
+			return true;
+		if(add)
+			keys.push_back(key);
+		else
+			keys.erase(k);
+		std::string index;
+		for(size_t i=0; i<keys.size(); i++)
+			index += keys[i] + "\n";
+		return _store.put(_store.arg, ZT_STATE_INDEX_KEY, index.data(), (int)index.size()) == 0;
+	}
+
+	static bool put_locked(const std::string &key, const void *data, size_t len)
+	{
+		return _store.put(_store.arg, key.c_str(), data, (int)len) == 0 && index_locked(key, true);
+	}
+
+	static bool del_locked(const std::string &key)
+	{
+		// A key which was never there is as good as deleted
+		_store.del(_store.arg, key.c_str());
+		return index_locked(key, false);
+	}
+
+	bool get(const std::string &key, std::string &value)
+	{
+		Mutex::Lock _l(_m);
+		return _active && get_locked(key, value);
+	}
+
+	bool put(const std::string &key, const void *data, size_t len)
+	{
+		Mutex::Lock _l(_m);
+		return _active && put_locked(key, data, len);
+	}
+
+	bool del(const std::string &key)
+	{
+		Mutex::Lock _l(_m);
+		return _active && del_locked(key);
+	}
+
+	/*
+	 * Adds every regular file below dir/rel to files, keyed by its path relative to dir
+	 */
+	static void walk(const std::string &dir, const std::string &rel, std::map<std::string, std::string> &files)
+	{
+		std::string path = rel.size() ? dir + ZT_PATH_SEPARATOR_S + rel : dir;
+		DIR *d = opendir(path.c_str());
+		if(!d)
+			return;
+		struct dirent *e;
+		while((e = readdir(d))) {
+			if(!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+				continue;
+			std::string key = rel.size() ? rel + ZT_PATH_SEPARATOR_S + e->d_name : std::string(e->d_name);
+			struct stat st;
+			if(lstat((dir + ZT_PATH_SEPARATOR_S + key).c_str(), &st) != 0)
+				continue;
+			if(S_ISDIR(st.st_mode))
+				walk(dir, key, files);
+			else if(S_ISREG(st.st_mode) && !transient(key))
+				OSUtils::readFile((dir + ZT_PATH_SEPARATOR_S + key).c_str(), files[key]);
+		}
+		closedir(d);
+	}
+
+	// Creates the directories leading up to key below dir
+	static bool mkdirs(const std::string &dir, const std::string &key)
+	{
+		for(size_t i = key.find(ZT_PATH_SEPARATOR); i != std::string::npos; i = key.find(ZT_PATH_SEPARATOR, i + 1)) {
+			if(!OSUtils::mkdir(dir + ZT_PATH_SEPARATOR_S + key.substr(0, i)))
+				return false;
+		}
+		return true;
+	}
+
+	std::string open()
+	{
+		Mutex::Lock _l(_m);
+		if(!_active)
+			return std::string();
+		struct stat st;
+		std::string tmpl = std::string(stat(ZT_STATE_SCRATCH_DIR, &st) == 0 && S_ISDIR(st.st_mode) 
+			? ZT_STATE_SCRATCH_DIR : P_tmpdir) + ZT_PATH_SEPARATOR_S "libzt-XXXXXX";
+		std::vector<char> path(tmpl.begin(), tmpl.end());
+		path.push_back(0);
+		if(!mkdtemp(path.data()))
+			return std::string();
+		_dir = path.data();
+		_synced.clear();
+		std::vector<std::string> keys(keys_locked());
+		for(size_t i=0; i<keys.size(); i++) {
+			// Nothing outside the scratch path
+			if(keys[i][0] == ZT_PATH_SEPARATOR || keys[i].find("..") != std::string::npos)
+				continue;
+			std::string value, fpath = _dir + ZT_PATH_SEPARATOR_S + keys[i];
+			if(!get_locked(keys[i], value) || !mkdirs(_dir, keys[i]) 
+				|| !OSUtils::writeFile(fpath.c_str(), value.data(), (unsigned int)value.size()))
+				continue;
+			if(keys[i].find("secret") != std::string::npos)
+				OSUtils::lockDownFile(fpath.c_str(), false);
+			_synced[keys[i]] = value;
+		}
+		return _dir;
+	}
+
+	static void sync_locked()
+	{
+		if(!_active || _dir.empty())
+			return;
+		std::map<std::string, std::string> files;
+		walk(_dir, std::string(), files);
+		for(std::map<std::string, std::string>::iterator f(files.begin()); f != files.end(); ++f) {
+			std::map<std::string, std::string>::iterator s = _synced.find(f->first);
+			if(s != _synced.end() && s->second == f->second)
+				continue;
+			if(put_locked(f->first, f->second.data(), f->second.size()))
+				_synced[f->first] = f->second;
+		}
+		for(std::map<std::string, std::string>::iterator s(_synced.begin()); s != _synced.end(); ) {
+			if(files.find(s->first) == files.end() && del_locked(s->first))
+				_synced.erase(s++);
+			else
+				++s;
+		}
+	}
+
+	void sync()
+	{
+		Mutex::Lock _l(_m);
+		sync_locked();
+	}
+
+	// Removes dir and everything below it
+	static void rmtree(const std::string &dir)
+	{
+		DIR *d = opendir(dir.c_str());
+		if(d) {
+			struct dirent *e;
+			while((e = readdir(d))) {
+				if(!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+					continue;
+				std::string path = dir + ZT_PATH_SEPARATOR_S + e->d_name;
+				struct stat st;
+				if(lstat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+					rmtree(path);
+				else
+					unlink(path.c_str());
+			}
+			closedir(d);
+		}
+		rmdir(dir.c_str());
+	}
+
+	void close()
+	{
+		Mutex::Lock _l(_m);
+		if(_dir.empty())
+			return;
+		sync_locked();
+		rmtree(_dir);
+		_dir.clear();
+		_synced.clear();
+	}
+
+	/*
+	 * The built-in store
+	 */
+	static Mutex _mem_m;
+	static std::map<std::string, std::string> _mem;
+
+	static int mem_get(void *arg, const char *key, void *buf, int len)
+	{
+		Mutex::Lock _l(_mem_m);
+		std::map<std::string, std::string>::iterator v = _mem.find(key);
+		if(v == _mem.end())
+			return -1;
+		memcpy(buf, v->second.data(), std::min((size_t)len, v->second.size()));
+		return (int)v->second.size();
+	}
+
+	static int mem_put(void *arg, const char *key, const void *data, int len)
+	{
+		Mutex::Lock _l(_mem_m);
+		_mem[key].assign((const char *)data, len);
+		return 0;
+	}
+
+	static int mem_del(void *arg, const char *key)
+	{
+		Mutex::Lock _l(_mem_m);
+		return _mem.erase(key) ? 0 : -1;
+	}
+
+	static const struct zts_state_store _mem_store = { mem_get, mem_put, mem_del, NULL };
+
+	const struct zts_state_store *memory()
+	{
+		return &_mem_store;
+	}
+
+} // namespace StateStore
+} // namespace ZeroTier
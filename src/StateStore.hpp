@@ -0,0 +1,80 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// Service state kept in a store of the app's (see zts_set_state_store()) instead of files
+//
+// The core service only knows how to keep its state in files, so a service whose state lives
+// in a store runs on a scratch home path in memory-backed storage (ZT_STATE_SCRATCH_DIR). The
+// store's keys are written there before the service starts, and whatever the service (or libzt)
+// changes there is put back into the store every ZT_STATE_SYNC_INTERVAL and when it stops
+
+#ifndef ZT_STATESTORE_HPP
+#define ZT_STATESTORE_HPP
+
+#include <string>
+
+struct zts_state_store;
+
+namespace ZeroTier {
+namespace StateStore {
+
+	/*
+	 * Whether a store has been set, with NULL files are used again
+	 */
+	bool active();
+	void set(const struct zts_state_store *store);
+
+	bool get(const std::string &key, std::string &value);
+	bool put(const std::string &key, const void *data, size_t len);
+	bool del(const std::string &key);
+
+	/*
+	 * Creates the scratch home path and writes every key of the store to it, returns the path
+	 * or "" if it couldn't be created
+	 */
+	std::string open();
+
+	/*
+	 * Puts what changed on the scratch home path since open() or the last sync() into the
+	 * store, and deletes the keys of files which have gone away
+	 */
+	void sync();
+
+	/*
+	 * sync()s one last time and removes the scratch home path
+	 */
+	void close();
+
+	/*
+	 * The built-in store, kept in memory for the life of the process
+	 */
+	const struct zts_state_store *memory();
+
+} // namespace StateStore
+} // namespace ZeroTier
+
+#endif // ZT_STATESTORE_HPP
@@ -0,0 +1,241 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Constants.hpp"
+
+#include "StateWriter.hpp"
+#include "libzt.h"
+
+namespace ZeroTier {
+namespace StateWriter {
+
+	struct op
+	{
+		std::string data;
+		bool remove;
+		bool secret;
+	};
+
+	/*
+	 * Never destroyed, the writer thread may still be running while the process exits
+	 */
+	struct writer
+	{
+		std::mutex m;
+		std::condition_variable cv;      // something was queued, or a flush is waiting
+		std::condition_variable done_cv; // a batch went out
+		std::map<std::string, op> pending;
+		bool started;
+		int flushing;
+		uint64_t queued_gen;  // ops queued so far
+		uint64_t written_gen; // of those, how many have gone out
+		struct zts_state_write_stats st;
+		writer() : started(false), flushing(0), queued_gen(0), written_gen(0) { memset(&st, 0, sizeof(st)); }
+	};
+
+	static writer &get()
+	{
+		static writer *w = new writer();
+		return *w;
+	}
+
+	static std::string dirname(const std::string &path)
+	{
+		size_t i = path.rfind(ZT_PATH_SEPARATOR);
+		return i == std::string::npos ? std::string(".") : i ? path.substr(0, i) : path.substr(0, 1);
+	}
+
+	static bool write_all(int fd, const std::string &data)
+	{
+		size_t off = 0;
+		while(off < data.size()) {
+			ssize_t n = ::write(fd, data.data() + off, data.size() - off);
+			if(n < 0 && errno == EINTR)
+				continue;
+			if(n <= 0)
+				return false;
+			off += n;
+		}
+		return true;
+	}
+
+	/*
+	 * Writes every file of batch to its temporary name and fsync()s it, renames them all into
+	 * place and fsync()s each directory once. Returns the number which failed
+	 */
+	static uint64_t write_batch(const std::map<std::string, op> &batch)
+	{
+		uint64_t failed = 0;
+		std::vector<std::string> done;
+		std::set<std::string> dirs;
+		for(std::map<std::string, op>::const_iterator b(batch.begin()); b != batch.end(); ++b) {
+			if(b->second.remove) {
+				if(unlink(b->first.c_str()) != 0 && errno != ENOENT)
+					failed++;
+				else
+					dirs.insert(dirname(b->first));
+				continue;
+			}
+			std::string tmp = b->first + ".tmp";
+			int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, b->second.secret ? 0600 : 0644);
+			if(fd < 0 && errno == ENOENT) {
+				mkdir(dirname(b->first).c_str(), 0755);
+				fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, b->second.secret ? 0600 : 0644);
+			}
+			if(fd < 0) {
+				failed++;
+				continue;
+			}
+			bool ok = write_all(fd, b->second.data) && fsync(fd) == 0;
+			close(fd);
+			if(!ok) {
+				unlink(tmp.c_str());
+				failed++;
+				continue;
+			}
+			done.push_back(b->first);
+		}
+		for(size_t i=0; i<done.size(); i++) {
+			if(rename((done[i] + ".tmp").c_str(), done[i].c_str()) != 0) {
+				unlink((done[i] + ".tmp").c_str());
+				failed++;
+				continue;
+			}
+			dirs.insert(dirname(done[i]));
+		}
+		// The renames (and removals) are only durable once their directories are
+		for(std::set<std::string>::iterator d(dirs.begin()); d != dirs.end(); ++d) {
+			int fd = open(d->c_str(), O_RDONLY);
+			if(fd >= 0) {
+				fsync(fd);
+				close(fd);
+			}
+		}
+		return failed;
+	}
+
+	static void writer_main()
+	{
+		writer &w = get();
+		std::unique_lock<std::mutex> l(w.m);
+		for(;;) {
+			w.cv.wait(l, [&w]() { return !w.pending.empty(); });
+			// Give writes to the same paths a chance to pile up behind the first
+			if(!w.flushing)
+				w.cv.wait_for(l, std::chrono::milliseconds(ZT_STATE_WRITE_DELAY), [&w]() { return w.flushing > 0; });
+			std::map<std::string, op> batch;
+			batch.swap(w.pending);
+			uint64_t gen = w.queued_gen;
+			l.unlock();
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			uint64_t failed = write_batch(batch);
+			uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::steady_clock::now() - start).count();
+			l.lock();
+			w.st.written += batch.size() - failed;
+			w.st.failed += failed;
+			w.st.batches++;
+			w.st.max_batch_us = std::max(w.st.max_batch_us, us);
+			w.written_gen = gen;
+			w.done_cv.notify_all();
+		}
+	}
+
+	static void queue(const std::string &path, const op &o)
+	{
+		writer &w = get();
+		std::lock_guard<std::mutex> _l(w.m);
+		if(!w.started) {
+			std::thread(writer_main).detach();
+			w.started = true;
+		}
+		std::pair<std::map<std::string, op>::iterator, bool> ins = w.pending.insert(std::make_pair(path, o));
+		if(!ins.second) {
+			ins.first->second = o;
+			w.st.coalesced++;
+		}
+		w.st.queued++;
+		w.queued_gen++;
+		w.cv.notify_all();
+	}
+
+	void write(const std::string &path, const std::string &data, bool secret)
+	{
+		op o;
+		o.data = data;
+		o.remove = false;
+		o.secret = secret;
+		queue(path, o);
+	}
+
+	void remove(const std::string &path)
+	{
+		op o;
+		o.remove = true;
+		o.secret = false;
+		queue(path, o);
+	}
+
+	void flush()
+	{
+		writer &w = get();
+		std::unique_lock<std::mutex> l(w.m);
+		uint64_t want = w.queued_gen;
+		if(w.written_gen >= want)
+			return;
+		w.flushing++;
+		w.cv.notify_all();
+		w.done_cv.wait(l, [&w, want]() { return w.written_gen >= want; });
+		w.flushing--;
+	}
+
+	void stats(struct zts_state_write_stats *stats)
+	{
+		writer &w = get();
+		std::lock_guard<std::mutex> _l(w.m);
+		*stats = w.st;
+		stats->pending = w.pending.size();
+	}
+
+} // namespace StateWriter
+} // namespace ZeroTier
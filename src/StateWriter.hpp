@@ -0,0 +1,67 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// Background writer for the state libzt keeps on the home path (networks.d/<nwid>.conf, the
+// peer path cache, the scratch home path of a state store)
+//
+// Writes are queued by path and a later write to (or removal of) the same path replaces one
+// which hasn't gone out yet. A thread of its own writes whatever has queued up every
+// ZT_STATE_WRITE_DELAY, each file to a temporary name which is renamed into place once the
+// whole batch has been fsync()ed, so no caller waits on the disk and a crash leaves either the
+// old or the new version
+
+#ifndef ZT_STATEWRITER_HPP
+#define ZT_STATEWRITER_HPP
+
+#include <string>
+
+struct zts_state_write_stats;
+
+namespace ZeroTier {
+namespace StateWriter {
+
+	/*
+	 * Queues data to be written to path (with secret set, readable by the owner only)
+	 */
+	void write(const std::string &path, const std::string &data, bool secret = false);
+
+	/*
+	 * Queues the removal of path
+	 */
+	void remove(const std::string &path);
+
+	/*
+	 * Returns once everything queued so far has been written
+	 */
+	void flush();
+
+	void stats(struct zts_state_write_stats *stats);
+
+} // namespace StateWriter
+} // namespace ZeroTier
+
+#endif // ZT_STATEWRITER_HPP
@@ -0,0 +1,201 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// Counters kept per Connection and per SocketTap, see zts_get_socket_stats()
+
+#ifndef ZT_STATS_HPP
+#define ZT_STATS_HPP
+
+#include <stdint.h>
+
+#include <atomic>
+
+// Log-linear histogram, 8 buckets per power of two (values within 12.5% share one)
+#define ZT_HISTOGRAM_BUCKETS               512
+
+namespace ZeroTier {
+
+	/*
+	 * Counters are only ever updated by the thread which moves the data they count and read
+	 * by whoever asks for a snapshot, so they need atomicity but no ordering
+	 */
+	inline void stat_add(std::atomic<uint64_t> &c, uint64_t n)
+	{
+		c.fetch_add(n, std::memory_order_relaxed);
+	}
+
+	inline void stat_max(std::atomic<uint32_t> &m, uint64_t v)
+	{
+		uint32_t val = v > UINT32_MAX ? UINT32_MAX : (uint32_t)v;
+		uint32_t cur = m.load(std::memory_order_relaxed);
+		while(val > cur && !m.compare_exchange_weak(cur, val, std::memory_order_relaxed)) {}
+	}
+
+	inline void stat_max(std::atomic<uint64_t> &m, uint64_t v)
+	{
+		uint64_t cur = m.load(std::memory_order_relaxed);
+		while(v > cur && !m.compare_exchange_weak(cur, v, std::memory_order_relaxed)) {}
+	}
+
+	inline uint64_t stat_get(const std::atomic<uint64_t> &c)
+	{
+		return c.load(std::memory_order_relaxed);
+	}
+
+	inline uint32_t stat_get(const std::atomic<uint32_t> &c)
+	{
+		return c.load(std::memory_order_relaxed);
+	}
+
+	/*
+	 * Counts of durations in ns, safe to add to from any number of threads
+	 */
+	class LatencyHistogram
+	{
+	private:
+		std::atomic<uint64_t> b[ZT_HISTOGRAM_BUCKETS];
+
+		static unsigned int bucket(uint64_t ns)
+		{
+			if(ns < 8)
+				return (unsigned int)ns;
+			unsigned int msb = 63 - __builtin_clzll(ns);
+			return (msb - 2) * 8 + ((ns >> (msb - 3)) & 7);
+		}
+
+		// Smallest value falling into bucket i
+		static uint64_t floor(unsigned int i)
+		{
+			if(i < 8)
+				return i;
+			return (uint64_t)(8 + (i & 7)) << (i / 8 - 1);
+		}
+
+	public:
+		LatencyHistogram() { reset(); }
+
+		void add(uint64_t ns)
+		{
+			b[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+		}
+
+		/*
+		 * Upper bound of the bucket holding the p-th percentile (nearest rank), 0 if empty
+		 */
+		uint64_t percentile(double p) const
+		{
+			uint64_t total = 0;
+			for(int i=0; i<ZT_HISTOGRAM_BUCKETS; i++)
+				total += b[i].load(std::memory_order_relaxed);
+			if(!total)
+				return 0;
+			uint64_t rank = (uint64_t)(p * total + 0.999999), seen = 0;
+			if(rank < 1)
+				rank = 1;
+			for(unsigned int i=0; i<ZT_HISTOGRAM_BUCKETS; i++) {
+				seen += b[i].load(std::memory_order_relaxed);
+				if(seen >= rank)
+					return i + 1 < ZT_HISTOGRAM_BUCKETS ? floor(i + 1) : UINT64_MAX;
+			}
+			return UINT64_MAX;
+		}
+
+		void reset()
+		{
+			for(int i=0; i<ZT_HISTOGRAM_BUCKETS; i++)
+				b[i].store(0, std::memory_order_relaxed);
+		}
+	};
+
+	struct ConnectionStats
+	{
+		std::atomic<uint64_t> bytes_in;  // from the stack to RXbuf (or the datagram queue)
+		std::atomic<uint64_t> bytes_out; // from TXbuf (or the socketpair) to the stack
+		std::atomic<uint32_t> txbuf_hwm;
+		std::atomic<uint32_t> rxbuf_hwm;
+		std::atomic<uint64_t> accept_overflows; // listening sockets only
+
+		void reset()
+		{
+			bytes_in = 0;
+			bytes_out = 0;
+			accept_overflows = 0;
+			txbuf_hwm = 0;
+			rxbuf_hwm = 0;
+		}
+	};
+
+	struct TapStats
+	{
+		std::atomic<uint64_t> frames_in;      // from the ZeroTier virtual wire
+		std::atomic<uint64_t> bytes_in;
+		std::atomic<uint64_t> frames_out;     // to the ZeroTier virtual wire
+		std::atomic<uint64_t> bytes_out;
+		std::atomic<uint64_t> frames_dropped; // received but never given to the stack
+		std::atomic<uint64_t> rx_coalesced;   // merged into the TCP segment before them
+		std::atomic<uint32_t> rxq_hwm;        // most frames waiting for the stack at once
+		std::atomic<uint64_t> rxq_overflows;  // dropped, the RX frame queue was full
+		std::atomic<uint64_t> rxq_early_drops; // dropped early, see SocketTap::rxAdmit()
+		std::atomic<uint64_t> rx_pressure_events;
+		std::atomic<uint64_t> stack_ticks;    // passes of the stack's timer/output processing
+		std::atomic<uint64_t> stack_tick_ns;  // and the time they took
+		std::atomic<uint64_t> stack_tick_max_ns;
+		std::atomic<uint64_t> compressed;     // see FrameCompressor
+		std::atomic<uint64_t> compress_saved;
+		std::atomic<uint64_t> incompressible;
+		std::atomic<uint64_t> decompressed;
+		std::atomic<uint64_t> decompress_errors;
+		std::atomic<uint64_t> conns_refused;  // see Admission
+		std::atomic<uint64_t> frames_limited;
+
+		TapStats()
+		{
+			frames_in = 0;
+			bytes_in = 0;
+			frames_out = 0;
+			bytes_out = 0;
+			frames_dropped = 0;
+			rx_coalesced = 0;
+			rxq_hwm = 0;
+			rxq_overflows = 0;
+			rxq_early_drops = 0;
+			rx_pressure_events = 0;
+			stack_ticks = 0;
+			stack_tick_ns = 0;
+			stack_tick_max_ns = 0;
+			compressed = 0;
+			compress_saved = 0;
+			incompressible = 0;
+			decompressed = 0;
+			decompress_errors = 0;
+			conns_refused = 0;
+			frames_limited = 0;
+		}
+	};
+}
+
+#endif // ZT_STATS_HPP
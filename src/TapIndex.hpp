@@ -0,0 +1,273 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// Indexes SocketTaps by nwid, interface index, interface name and routed address
+
+#ifndef ZT_TAPINDEX_HPP
+#define ZT_TAPINDEX_HPP
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
+#include <string.h>
+
+#include "InetAddress.hpp"
+#include "SocketTap.hpp"
+
+namespace ZeroTier {
+
+	/*
+	 * A tap's addresses as strings, formatted once per change of _ips
+	 */
+	struct TapAddresses
+	{
+		struct zts_network_addresses pub;
+		char ipv4_cidr[ZT_MAX_IPADDR_LEN]; // as zts_get_ipv4_address() has always returned them
+		char ipv6_cidr[ZT_MAX_IPADDR_LEN];
+	};
+
+	/*
+	 * Binary trie of address prefixes, match() returns the tap owning the longest prefix
+	 * containing the given address. Nodes live in a vector so a trie is cheap to build and
+	 * free as a whole
+	 */
+	class RouteTrie
+	{
+	private:
+		struct node {
+			int child[2];
+			SocketTap *tap;
+		};
+		std::vector<node> nodes;
+
+		static inline int bit(const uint8_t *key, unsigned int i)
+		{
+			return (key[i >> 3] >> (7 - (i & 7))) & 1;
+		}
+
+	public:
+		RouteTrie()
+		{
+			node root = { { -1, -1 }, NULL };
+			nodes.push_back(root);
+		}
+
+		void insert(const uint8_t *key, unsigned int bits, SocketTap *tap)
+		{
+			int n = 0;
+			for(unsigned int i=0; i<bits; i++) {
+				int b = bit(key, i);
+				if(nodes[n].child[b] < 0) {
+					node c = { { -1, -1 }, NULL };
+					nodes.push_back(c);
+					nodes[n].child[b] = (int)nodes.size() - 1;
+				}
+				n = nodes[n].child[b];
+			}
+			nodes[n].tap = tap;
+		}
+
+		SocketTap *match(const uint8_t *key, unsigned int bits) const
+		{
+			SocketTap *best = nodes[0].tap;
+			int n = 0;
+			for(unsigned int i=0; i<bits; i++) {
+				n = nodes[n].child[bit(key, i)];
+				if(n < 0)
+					break;
+				if(nodes[n].tap)
+					best = nodes[n].tap;
+			}
+			return best;
+		}
+	};
+
+	/*
+	 * Lookups read an immutable snapshot through a single atomic load and never lock. Updates
+	 * build a new snapshot from the full tap list and publish it, they are expected to be
+	 * serialized by the caller (_vtaps_lock). Replaced snapshots are kept until an update finds
+	 * no lookup in progress, a lookup racing an update can therefore never touch freed memory
+	 * while an app joining hundreds of networks doesn't keep hundreds of snapshots around
+	 */
+	class TapIndex
+	{
+	private:
+		struct snapshot {
+			std::unordered_map<uint64_t, SocketTap*> by_nwid;
+			std::unordered_map<int, SocketTap*> by_index;
+			std::unordered_map<std::string, SocketTap*> by_name;
+			RouteTrie routes4;
+			RouteTrie routes6;
+			std::unordered_map<uint64_t, TapAddresses> addrs;
+		};
+
+		std::atomic<const snapshot*> _current;
+		std::atomic<uint32_t> _generation;
+		std::vector<const snapshot*> _retired;
+		mutable std::atomic<int> _readers;
+
+		const snapshot *current() const
+		{
+			return _current.load();
+		}
+
+		// Marks a lookup in progress for as long as it is in scope
+		struct reader {
+			const TapIndex &idx;
+			reader(const TapIndex &i) : idx(i) { idx._readers++; }
+			~reader() { idx._readers--; }
+		};
+
+		// The first address of each family (as the old per-call scans found them) and the tap's own 6PLANE/RFC 4193 addresses
+		static void format(TapAddresses &a, const SocketTap *tap, const std::vector<InetAddress> &ips)
+		{
+			char ipbuf[64];
+			memset(&a, 0, sizeof(a));
+			for(size_t j=0; j<ips.size(); j++) {
+				if(ips[j].isV4() && !a.pub.ipv4[0]) {
+					strncpy(a.pub.ipv4, ips[j].toIpString(ipbuf), ZT_MAX_IPADDR_LEN-1);
+					strncpy(a.ipv4_cidr, ips[j].toString(ipbuf), ZT_MAX_IPADDR_LEN-1);
+				}
+				else if(ips[j].isV6() && !a.pub.ipv6[0]) {
+					strncpy(a.pub.ipv6, ips[j].toIpString(ipbuf), ZT_MAX_IPADDR_LEN-1);
+					strncpy(a.ipv6_cidr, ips[j].toString(ipbuf), ZT_MAX_IPADDR_LEN-1);
+				}
+			}
+			uint64_t node = tap->_mac.toAddress(tap->_nwid).toInt();
+			strncpy(a.pub.sixplane, InetAddress::makeIpv66plane(tap->_nwid, node).toIpString(ipbuf), ZT_MAX_IPADDR_LEN-1);
+			strncpy(a.pub.rfc4193, InetAddress::makeIpv6rfc4193(tap->_nwid, node).toIpString(ipbuf), ZT_MAX_IPADDR_LEN-1);
+		}
+
+	public:
+		TapIndex() : _current(new snapshot()), _generation(1), _readers(0) {}
+
+		~TapIndex()
+		{
+			delete current();
+			for(size_t i=0; i<_retired.size(); i++)
+				delete _retired[i];
+		}
+
+		/*
+		 * Replaces the index with one built from taps (a copy of vtaps), takes each tap's _ips_m
+		 */
+		void rebuild(const std::vector<void*> &taps)
+		{
+			snapshot *s = new snapshot();
+			for(size_t i=0; i<taps.size(); i++) {
+				SocketTap *tap = (SocketTap*)taps[i];
+				// Later taps win, as they did with the linear scans this replaces
+				s->by_nwid[tap->_nwid] = tap;
+				s->by_index[tap->ifindex] = tap;
+				s->by_name[tap->_dev] = tap;
+				std::vector<InetAddress> ips = tap->ips();
+				for(size_t j=0; j<ips.size(); j++) {
+					unsigned int bits = ips[j].netmaskBits();
+					if(ips[j].isV4())
+						s->routes4.insert((const uint8_t *)ips[j].rawIpData(), bits > 32 ? 32 : bits, tap);
+					else if(ips[j].isV6())
+						s->routes6.insert((const uint8_t *)ips[j].rawIpData(), bits > 128 ? 128 : bits, tap);
+				}
+				format(s->addrs[tap->_nwid], tap, ips);
+			}
+			_retired.push_back(current());
+			_current.store(s);
+			_generation++;
+			// A lookup starting after this sees s, so none is left holding a retired snapshot
+			if(!_readers) {
+				for(size_t i=0; i<_retired.size(); i++)
+					delete _retired[i];
+				_retired.clear();
+			}
+		}
+
+		/*
+		 * Changes whenever the index is rebuilt (taps, addresses or routes changed), never 0.
+		 * Whatever was cached from a lookup holds for as long as this doesn't change
+		 */
+		uint32_t generation() const
+		{
+			return _generation.load(std::memory_order_acquire);
+		}
+
+		SocketTap *byNwid(uint64_t nwid) const
+		{
+			reader _r(*this);
+			const snapshot *s = current();
+			std::unordered_map<uint64_t, SocketTap*>::const_iterator i = s->by_nwid.find(nwid);
+			return i == s->by_nwid.end() ? NULL : i->second;
+		}
+
+		SocketTap *byIndex(int index) const
+		{
+			reader _r(*this);
+			const snapshot *s = current();
+			std::unordered_map<int, SocketTap*>::const_iterator i = s->by_index.find(index);
+			return i == s->by_index.end() ? NULL : i->second;
+		}
+
+		SocketTap *byName(const char *ifname) const
+		{
+			reader _r(*this);
+			const snapshot *s = current();
+			std::unordered_map<std::string, SocketTap*>::const_iterator i = s->by_name.find(ifname);
+			return i == s->by_name.end() ? NULL : i->second;
+		}
+
+		/*
+		 * Copies the formatted addresses of the tap for nwid into a, false if there's no such tap
+		 */
+		bool addresses(uint64_t nwid, TapAddresses *a) const
+		{
+			reader _r(*this);
+			const snapshot *s = current();
+			std::unordered_map<uint64_t, TapAddresses>::const_iterator i = s->addrs.find(nwid);
+			if(i == s->addrs.end())
+				return false;
+			memcpy(a, &(i->second), sizeof(*a));
+			return true;
+		}
+
+		/*
+		 * Returns the tap with the most specific route to addr
+		 */
+		SocketTap *byAddr(const InetAddress &addr) const
+		{
+			reader _r(*this);
+			const snapshot *s = current();
+			if(addr.isV4())
+				return s->routes4.match((const uint8_t *)addr.rawIpData(), 32);
+			if(addr.isV6())
+				return s->routes6.match((const uint8_t *)addr.rawIpData(), 128);
+			return NULL;
+		}
+	};
+}
+
+#endif // ZT_TAPINDEX_HPP
@@ -0,0 +1,236 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+// Which CPUs libzt's threads may run on, see zts_set_thread_affinity(), and how much CPU time
+// they have used, see zts_get_thread_cpu()
+
+#ifndef ZT_THREADAFFINITY_HPP
+#define ZT_THREADAFFINITY_HPP
+
+#include <atomic>
+#include <map>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+#include "Mutex.hpp"
+
+namespace ZeroTier {
+
+	/*
+	 * CPU sets by (ZTS_THREAD_*, nwid). Threads apply theirs when they start and then whenever
+	 * generation() has moved on, which costs a single atomic load per check
+	 */
+	class ThreadAffinity
+	{
+	private:
+		std::map<std::pair<int, uint64_t>, std::vector<int> > _cpus;
+		std::atomic<uint32_t> _gen;
+		Mutex _m;
+
+#if defined(__linux__)
+		// CPU clocks of the threads running now, and the time of those which have exited
+		std::multimap<std::pair<int, uint64_t>, clockid_t> _clocks;
+		std::map<std::pair<int, uint64_t>, uint64_t> _retired;
+		Mutex _clocks_m;
+
+		static uint64_t clock_us(clockid_t c)
+		{
+			struct timespec ts;
+			if(clock_gettime(c, &ts) < 0)
+				return 0;
+			return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+		}
+#endif
+
+	public:
+		ThreadAffinity() : _gen(0) {}
+
+		/*
+		 * An empty cpus lets the thread run anywhere again
+		 */
+		void set(int thread, uint64_t nwid, const std::vector<int> &cpus)
+		{
+			{
+				Mutex::Lock _l(_m);
+				if(cpus.size())
+					_cpus[std::make_pair(thread, nwid)] = cpus;
+				else
+					_cpus.erase(std::make_pair(thread, nwid));
+			}
+			_gen.fetch_add(1, std::memory_order_release);
+		}
+
+		uint32_t generation() const
+		{
+			return _gen.load(std::memory_order_acquire);
+		}
+
+#if defined(__linux__)
+		/*
+		 * Fills set with the CPUs chosen for (thread, nwid), returns false if there are none
+		 */
+		bool lookup(int thread, uint64_t nwid, cpu_set_t *set)
+		{
+			CPU_ZERO(set);
+			Mutex::Lock _l(_m);
+			std::map<std::pair<int, uint64_t>, std::vector<int> >::const_iterator i =
+				_cpus.find(std::make_pair(thread, nwid));
+			if(i == _cpus.end())
+				return false;
+			for(size_t j=0; j<i->second.size(); j++)
+				CPU_SET(i->second[j], set);
+			return true;
+		}
+
+		static void all(cpu_set_t *set)
+		{
+			CPU_ZERO(set);
+			for(int cpu=0; cpu<CPU_SETSIZE; cpu++)
+				CPU_SET(cpu, set);
+		}
+#endif
+
+		/*
+		 * Pins t to the CPUs chosen for (thread, nwid), or lets it run anywhere if there are
+		 * none. Returns 0 or an errno value
+		 */
+		int apply(pthread_t t, int thread, uint64_t nwid)
+		{
+#if defined(__linux__)
+			cpu_set_t set;
+			if(!lookup(thread, nwid, &set))
+				all(&set);
+			return pthread_setaffinity_np(t, sizeof(set), &set);
+#else
+			return ENOTSUP;
+#endif
+		}
+
+		/*
+		 * What a thread remembers between refresh() calls
+		 */
+		struct state
+		{
+			uint32_t gen;
+			bool pinned;
+			state() : gen(0), pinned(false) {}
+		};
+
+		/*
+		 * Pins the calling thread if its CPUs changed since it last looked. A thread which was
+		 * never pinned is left with the affinity it inherited from whoever started it
+		 */
+		void refresh(state &st, int thread, uint64_t nwid)
+		{
+			uint32_t g = generation();
+			if(g == st.gen)
+				return;
+			st.gen = g;
+#if defined(__linux__)
+			cpu_set_t set;
+			bool pin = lookup(thread, nwid, &set);
+			if(!pin && !st.pinned)
+				return;
+			if(!pin)
+				all(&set);
+			if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0)
+				st.pinned = pin;
+#endif
+		}
+
+		/*
+		 * Counts the CPU time of the thread which constructs it towards (thread, nwid) until
+		 * it's destroyed, which must be on that thread too
+		 */
+		class Accounted
+		{
+		public:
+			Accounted(ThreadAffinity &a, int thread, uint64_t nwid) : _a(a), _key(thread, nwid)
+			{
+#if defined(__linux__)
+				_ok = pthread_getcpuclockid(pthread_self(), &_clock) == 0;
+				if(_ok) {
+					Mutex::Lock _l(_a._clocks_m);
+					_it = _a._clocks.insert(std::make_pair(_key, _clock));
+				}
+#endif
+			}
+
+			~Accounted()
+			{
+#if defined(__linux__)
+				if(!_ok)
+					return;
+				uint64_t us = clock_us(_clock);
+				Mutex::Lock _l(_a._clocks_m);
+				_a._clocks.erase(_it);
+				_a._retired[_key] += us;
+#endif
+			}
+
+		private:
+			ThreadAffinity &_a;
+			std::pair<int, uint64_t> _key;
+#if defined(__linux__)
+			bool _ok;
+			clockid_t _clock;
+			std::multimap<std::pair<int, uint64_t>, clockid_t>::iterator _it;
+#endif
+		};
+
+		/*
+		 * Microseconds of CPU time the threads (ZTS_THREAD_*) of nwid, or of every network if
+		 * all, have used so far. Returns false where threads have no CPU clocks
+		 */
+		bool cpu_us(int thread, uint64_t nwid, bool all, uint64_t *us)
+		{
+#if defined(__linux__)
+			*us = 0;
+			Mutex::Lock _l(_clocks_m);
+			for(std::multimap<std::pair<int, uint64_t>, clockid_t>::const_iterator c(_clocks.begin()); c != _clocks.end(); ++c) {
+				if(c->first.first == thread && (all || c->first.second == nwid))
+					*us += clock_us(c->second);
+			}
+			for(std::map<std::pair<int, uint64_t>, uint64_t>::const_iterator r(_retired.begin()); r != _retired.end(); ++r) {
+				if(r->first.first == thread && (all || r->first.second == nwid))
+					*us += r->second;
+			}
+			return true;
+#else
+			return false;
+#endif
+		}
+	};
+}
+
+#endif // ZT_THREADAFFINITY_HPP
@@ -0,0 +1,128 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// Token bucket behind egress shaping, see zts_set_network_rate() and SO_MAX_PACING_RATE
+
+#ifndef ZT_TOKENBUCKET_HPP
+#define ZT_TOKENBUCKET_HPP
+
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <stdint.h>
+
+#include "libzt.h"
+
+namespace ZeroTier {
+
+	/*
+	 * Refilled at rate bytes/s up to burst bytes. Senders take what they send, which may leave
+	 * the bucket in debt (a datagram is sent whole) until it has been paid back. configure() may be
+	 * called from any thread, everything else only from the one stack thread which sends
+	 */
+	class TokenBucket
+	{
+	private:
+		std::atomic<uint64_t> _rate;
+		std::atomic<uint64_t> _burst;
+		int64_t _tokens;
+		uint64_t _last; // us
+
+		static uint64_t now()
+		{
+			return std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+
+	public:
+		TokenBucket()
+			: _rate(0),
+			_burst(0),
+			_tokens(0),
+			_last(0)
+		{
+		}
+
+		/*
+		 * A rate of 0 turns shaping off, a burst of 0 picks ZT_TX_SHAPER_BURST_MS worth of the rate
+		 */
+		void configure(uint64_t rate, uint64_t burst)
+		{
+			if(rate && !burst)
+				burst = std::max(rate * ZT_TX_SHAPER_BURST_MS / 1000, (uint64_t)ZT_TX_SHAPER_BURST_MIN);
+			_burst = burst;
+			_rate = rate;
+		}
+
+		bool enabled() const { return _rate.load(std::memory_order_relaxed) != 0; }
+		uint64_t rate() const { return _rate.load(std::memory_order_relaxed); }
+		uint64_t burst() const { return _burst.load(std::memory_order_relaxed); }
+
+		/*
+		 * Bytes which may be sent now, 0 while in debt. Starts out full
+		 */
+		size_t available()
+		{
+			uint64_t rate = _rate.load(std::memory_order_relaxed);
+			int64_t burst = (int64_t)_burst.load(std::memory_order_relaxed);
+			uint64_t t = now();
+			if(!_last) {
+				_tokens = burst;
+				_last = t;
+			}
+			// Whole bytes only, the remainder of the interval is kept for the next refill
+			uint64_t add = (t - _last) * rate / 1000000;
+			if(add) {
+				_tokens = std::min(_tokens + (int64_t)add, burst);
+				_last += add * 1000000 / rate;
+			}
+			if(_tokens >= burst)
+				_last = t;
+			return _tokens > 0 ? (size_t)_tokens : 0;
+		}
+
+		void take(size_t n)
+		{
+			if(enabled())
+				_tokens -= (int64_t)n;
+		}
+
+		/*
+		 * How long (ms, at least 1) until available() is non-zero again
+		 */
+		unsigned long wait_ms()
+		{
+			uint64_t rate = _rate.load(std::memory_order_relaxed);
+			if(!rate || available())
+				return 0;
+			uint64_t owed = (uint64_t)(1 - _tokens);
+			return (unsigned long)std::max((uint64_t)1, (owed * 1000 + rate - 1) / rate);
+		}
+	};
+}
+
+#endif // ZT_TOKENBUCKET_HPP
@@ -0,0 +1,323 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+#if defined(ZT_TRACE_RING)
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "TraceRing.hpp"
+
+namespace ZeroTier {
+namespace TraceRing {
+
+	/*
+	 * Record layout in a ring, always 8-byte aligned so a header never straddles the end
+	 */
+	struct record_hdr
+	{
+		uint32_t len; // header + arguments, before padding
+		uint32_t pad;
+		uint64_t ts;  // ns, CLOCK_MONOTONIC
+		const struct site *s;
+	};
+
+	/*
+	 * Single producer (the owning thread), single consumer (whoever holds flush_m)
+	 */
+	struct ring
+	{
+		unsigned char buf[ZT_TRACE_RING_SZ];
+		std::atomic<uint64_t> head; // written by the owner
+		std::atomic<uint64_t> tail; // written by the flusher
+		std::atomic<uint64_t> drops;
+		std::atomic<bool> orphaned; // owning thread has exited, delete once drained
+		int id;
+	};
+
+	static pthread_mutex_t rings_m = PTHREAD_MUTEX_INITIALIZER;
+	static pthread_mutex_t flush_m = PTHREAD_MUTEX_INITIALIZER;
+	static std::vector<struct ring*> *rings = NULL; // never freed, the flusher may outlive static destructors
+	static pthread_key_t ring_key;
+	static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+	static __thread struct ring *local_ring = NULL;
+	static int next_id = 0;
+
+	static void ring_exit(void *arg)
+	{
+		// anything logged by later TLS destructors goes to a fresh ring
+		local_ring = NULL;
+		((struct ring *)arg)->orphaned = true;
+	}
+
+	static void *flush_loop(void *arg)
+	{
+		while(true) {
+			usleep(ZT_TRACE_FLUSH_INTERVAL * 1000);
+			flush();
+		}
+		return NULL;
+	}
+
+	static void init()
+	{
+		rings = new std::vector<struct ring*>;
+		pthread_key_create(&ring_key, ring_exit);
+		pthread_t t;
+		if(pthread_create(&t, NULL, flush_loop, NULL) == 0)
+			pthread_detach(t);
+	}
+
+	static struct ring *get_ring()
+	{
+		if(local_ring)
+			return local_ring;
+		pthread_once(&ring_once, init);
+		struct ring *r = new struct ring;
+		r->head = 0;
+		r->tail = 0;
+		r->drops = 0;
+		r->orphaned = false;
+		pthread_mutex_lock(&rings_m);
+		r->id = next_id++;
+		rings->push_back(r);
+		pthread_mutex_unlock(&rings_m);
+		pthread_setspecific(ring_key, r);
+		local_ring = r;
+		return r;
+	}
+
+	static void ring_copy_in(struct ring *r, uint64_t pos, const void *src, size_t len)
+	{
+		size_t off = pos & (ZT_TRACE_RING_SZ - 1);
+		size_t first = len < ZT_TRACE_RING_SZ - off ? len : ZT_TRACE_RING_SZ - off;
+		memcpy(r->buf + off, src, first);
+		memcpy(r->buf, (const unsigned char *)src + first, len - first);
+	}
+
+	static void ring_copy_out(struct ring *r, uint64_t pos, void *dst, size_t len)
+	{
+		size_t off = pos & (ZT_TRACE_RING_SZ - 1);
+		size_t first = len < ZT_TRACE_RING_SZ - off ? len : ZT_TRACE_RING_SZ - off;
+		memcpy(dst, r->buf + off, first);
+		memcpy((unsigned char *)dst + first, r->buf, len - first);
+	}
+
+	void emit(const struct site *s, const args &a)
+	{
+		struct ring *r = get_ring();
+		struct record_hdr h;
+		h.len = sizeof h + a.len;
+		h.pad = 0;
+		h.s = s;
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		h.ts = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+		uint64_t sz = (h.len + 7) & ~(uint64_t)7;
+		uint64_t head = r->head.load(std::memory_order_relaxed);
+		if(sz > ZT_TRACE_RING_SZ - (head - r->tail.load(std::memory_order_acquire))) {
+			r->drops++;
+			return;
+		}
+		ring_copy_in(r, head, &h, sizeof h);
+		ring_copy_in(r, head + sizeof h, a.buf, a.len);
+		r->head.store(head + sz, std::memory_order_release);
+	}
+
+	/*
+	 * Formats one record the way fprintf() would have, conversions are fed from the recorded
+	 * arguments rather than a va_list. Length modifiers in the format string are replaced to
+	 * match how the argument was stored
+	 */
+	static void format(std::string &out, const struct site *s, const unsigned char *a, size_t alen)
+	{
+		const char *f = s->fmt;
+		size_t pos = 0;
+		char spec[32], tmp[128];
+		while(*f) {
+			if(*f != '%') {
+				out += *f++;
+				continue;
+			}
+			if(f[1] == '%') {
+				out += '%';
+				f += 2;
+				continue;
+			}
+			// flags, width, precision. A * takes its value from the next argument, which is
+			// written into spec in its place
+			size_t n = 0;
+			spec[n++] = *f++;
+			while(*f && strchr("-+ #0123456789.*", *f) && n < sizeof spec - 16) {
+				if(*f != '*') {
+					spec[n++] = *f++;
+					continue;
+				}
+				f++;
+				int64_t w = 0;
+				if(pos < alen && a[pos] != ARG_STR) {
+					uint64_t v;
+					memcpy(&v, a + pos + 1, 8);
+					pos += 9;
+					w = (int64_t)v;
+				}
+				if(w < 0 && n && spec[n-1] == '.')
+					n--; // a negative precision is taken as if omitted
+				else
+					n += snprintf(spec + n, sizeof spec - n, "%d", (int)w);
+			}
+			while(*f && strchr("hlLqjzt", *f))
+				f++;
+			char conv = *f ? *f++ : 0;
+			if(!conv)
+				break;
+			if(pos >= alen) {
+				out += "<?>";
+				continue;
+			}
+			unsigned char type = a[pos++];
+			if(type == ARG_STR) {
+				size_t slen = a[pos++];
+				std::string str((const char *)a + pos, slen);
+				pos += slen;
+				spec[n++] = 's';
+				spec[n] = 0;
+				snprintf(tmp, sizeof tmp, spec, str.c_str());
+				out += tmp;
+				continue;
+			}
+			uint64_t v;
+			memcpy(&v, a + pos, 8);
+			pos += 8;
+			if(strchr("diouxXc", conv)) {
+				if(conv != 'c') {
+					spec[n++] = 'l';
+					spec[n++] = 'l';
+				}
+				spec[n++] = conv;
+				spec[n] = 0;
+				if(conv == 'c')
+					snprintf(tmp, sizeof tmp, spec, (int)v);
+				else if(type == ARG_DBL) {
+					double d;
+					memcpy(&d, &v, sizeof d);
+					snprintf(tmp, sizeof tmp, spec, (long long)d);
+				}
+				else
+					snprintf(tmp, sizeof tmp, spec, (long long)v);
+			}
+			else if(strchr("fFeEgGaA", conv)) {
+				double d;
+				if(type == ARG_DBL)
+					memcpy(&d, &v, sizeof d);
+				else
+					d = type == ARG_INT ? (double)(int64_t)v : (double)v;
+				spec[n++] = conv;
+				spec[n] = 0;
+				snprintf(tmp, sizeof tmp, spec, d);
+			}
+			else if(conv == 'p') {
+				spec[n++] = 'p';
+				spec[n] = 0;
+				snprintf(tmp, sizeof tmp, spec, (void *)(uintptr_t)v);
+			}
+			else {
+				snprintf(tmp, sizeof tmp, "<%%%c?>", conv);
+			}
+			out += tmp;
+		}
+	}
+
+	void flush()
+	{
+		if(!rings)
+			return;
+		pthread_mutex_lock(&flush_m);
+		pthread_mutex_lock(&rings_m);
+		std::vector<struct ring*> snapshot = *rings;
+		pthread_mutex_unlock(&rings_m);
+
+		std::string out;
+		unsigned char abuf[ZT_TRACE_MAX_ARGS_SZ];
+		for(size_t i=0; i<snapshot.size(); i++) {
+			struct ring *r = snapshot[i];
+			bool orphaned = r->orphaned; // read first, anything written before exit is visible
+			uint64_t tail = r->tail.load(std::memory_order_relaxed);
+			uint64_t head = r->head.load(std::memory_order_acquire);
+			while(tail != head) {
+				struct record_hdr h;
+				ring_copy_out(r, tail, &h, sizeof h);
+				size_t alen = h.len - sizeof h;
+				ring_copy_out(r, tail + sizeof h, abuf, alen);
+				tail += (h.len + 7) & ~(uint64_t)7;
+
+				const char *file = strrchr(h.s->file, '/') ? strrchr(h.s->file, '/') + 1 : h.s->file;
+				char prefix[160];
+				snprintf(prefix, sizeof prefix, "%llu.%06llu %s[%d] : %16s:%5d:%25s: ",
+					(unsigned long long)(h.ts / 1000000000), (unsigned long long)((h.ts / 1000) % 1000000),
+					h.s->tag, r->id, file, h.s->line, h.s->func);
+				out += prefix;
+				format(out, h.s, abuf, alen);
+				out += '\n';
+			}
+			r->tail.store(tail, std::memory_order_release);
+			uint64_t drops = r->drops.exchange(0);
+			if(drops) {
+				char note[64];
+				snprintf(note, sizeof note, "TRACE[%d] : dropped %llu records\n", r->id, (unsigned long long)drops);
+				out += note;
+			}
+			if(orphaned) {
+				pthread_mutex_lock(&rings_m);
+				for(size_t j=0; j<rings->size(); j++) {
+					if((*rings)[j] == r) {
+						rings->erase(rings->begin() + j);
+						break;
+					}
+				}
+				pthread_mutex_unlock(&rings_m);
+				delete r;
+			}
+		}
+		if(out.size()) {
+			fwrite(out.data(), 1, out.size(), stderr);
+			fflush(stderr);
+		}
+		pthread_mutex_unlock(&flush_m);
+	}
+}
+}
+
+#endif // ZT_TRACE_RING
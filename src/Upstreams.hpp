@@ -0,0 +1,134 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+// RTT history of the roots and moons relaying for this node, see zts_get_upstreams()
+
+#ifndef ZT_UPSTREAMS_HPP
+#define ZT_UPSTREAMS_HPP
+
+#include <vector>
+#include <algorithm>
+#include <string.h>
+#include <stdint.h>
+
+#include "libzt.h"
+
+namespace ZeroTier {
+
+	/*
+	 * Fed each fresh read of the core's peers. The core only updates an upstream's latency as
+	 * its echoes return, so a sample is only taken when something new has arrived over the
+	 * upstream's path. Not thread safe, the caller serializes (libzt.cpp uses _peer_cache_lock)
+	 */
+	class Upstreams
+	{
+	private:
+		std::vector<struct zts_upstream_info> _ups;
+		uint64_t _preferred;
+
+		struct zts_upstream_info *find(uint64_t address)
+		{
+			for(size_t i=0; i<_ups.size(); i++) {
+				if(_ups[i].address == address)
+					return &_ups[i];
+			}
+			return NULL;
+		}
+
+	public:
+		Upstreams() : _preferred(0) {}
+
+		void sample(const std::vector<struct zts_peer_info> &peers, uint64_t now)
+		{
+			std::vector<struct zts_upstream_info> ups;
+			for(size_t i=0; i<peers.size(); i++) {
+				const struct zts_peer_info &p = peers[i];
+				if(p.role == ZTS_PEER_ROLE_LEAF)
+					continue;
+				struct zts_upstream_info u, *old = find(p.address);
+				if(old) {
+					u = *old;
+				}
+				else {
+					memset(&u, 0, sizeof(u));
+					u.address = p.address;
+					u.latency_avg = u.latency_min = u.latency_max = -1;
+				}
+				u.role = p.role;
+				u.latency = p.latency;
+				u.preferred = 0;
+				u.reachable = p.paths > 0;
+				memcpy(&u.path, &p.preferred, sizeof(u.path));
+				if(u.reachable && p.latency > 0 && p.last_receive != u.last_receive) {
+					// Smoothed as TCP does its RTT, over about the last eight samples. Steps of at
+					// least 1ms so that it settles on the latency rather than within 8ms of it
+					if(u.latency_avg < 0) {
+						u.latency_avg = p.latency;
+					}
+					else {
+						int d = p.latency - u.latency_avg;
+						u.latency_avg += d / 8 ? d / 8 : (d > 0) - (d < 0);
+					}
+					u.latency_min = u.latency_min < 0 ? p.latency : std::min(u.latency_min, p.latency);
+					u.latency_max = std::max(u.latency_max, p.latency);
+					u.samples++;
+					u.last_sample = now;
+				}
+				u.last_receive = p.last_receive;
+				ups.push_back(u);
+			}
+			_ups.swap(ups);
+			// Of those reachable now, the lowest smoothed RTT. The current choice is kept until
+			// another beats it by more than ZT_UPSTREAM_HYSTERESIS, so it doesn't flap
+			struct zts_upstream_info *best = NULL, *cur = find(_preferred);
+			for(size_t i=0; i<_ups.size(); i++) {
+				if(!_ups[i].reachable || _ups[i].latency_avg < 0)
+					continue;
+				if(!best || _ups[i].latency_avg < best->latency_avg)
+					best = &_ups[i];
+			}
+			if(best && cur && cur != best && cur->reachable && cur->latency_avg >= 0 
+				&& cur->latency_avg <= best->latency_avg + ZT_UPSTREAM_HYSTERESIS)
+				best = cur;
+			_preferred = best ? best->address : 0;
+			if(best)
+				best->preferred = 1;
+		}
+
+		const std::vector<struct zts_upstream_info> &list() const { return _ups; }
+
+		uint64_t preferred() const { return _preferred; }
+
+		void clear()
+		{
+			_ups.clear();
+			_preferred = 0;
+		}
+	};
+}
+
+#endif // ZT_UPSTREAMS_HPP
@@ -44,7 +44,7 @@ inline ip_addr_t convert_ip(struct sockaddr_in * addr)
 	short b = ip4_addr2b(&(ipv4->sin_addr));
 	short c = ip4_addr3b(&(ipv4->sin_addr));
 	short d = ip4_addr4b(&(ipv4->sin_addr));
-	IP4_ADDR(&conn_addr, a,b,c,d);
+	IP_ADDR4(&conn_addr, a,b,c,d);
 	return conn_addr;
 }
 
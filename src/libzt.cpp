@@ -34,6 +34,7 @@ for applications to use. See also: include/libzt.h */
 #include <stdarg.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
 
 #if defined(__APPLE__)
 #include <net/ethernet.h>
@@ -42,32 +43,78 @@ for applications to use. See also: include/libzt.h */
 #if defined(__linux__)
 #include <netinet/ether.h>
 #include <sys/socket.h>
+#include <netinet/tcp.h>
 #include <linux/if_packet.h>
 #include <net/ethernet.h>
+#include <sys/sendfile.h>
 #endif
 
 #include <pthread.h>
 #include <poll.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <unordered_map>
 
 #if defined(STACK_PICO)
 #include "pico_stack.h"
+#include "pico_tcp.h"
+#include "pico_ipv6_nd.h"
 #endif
 #if defined(STACK_LWIP)
 #include "lwIP.hpp"
 #endif
 
+// picoTCP marks a reset Connection through its state, lwIP only through so_error (see nc_err())
+#if defined(STACK_PICO)
+#define ZTS_CONN_RESET(conn) ((conn)->state == PICO_ERR_ECONNRESET)
+#else
+#define ZTS_CONN_RESET(conn) false
+#endif
+
 #include "OneService.hpp"
 #include "Utils.hpp"
+#include "Identity.hpp"
 #include "OSUtils.hpp"
 #include "InetAddress.hpp"
 #include "ZeroTierOne.h"
 
 #include "SocketTap.hpp"
+#include "ConnectionPool.hpp"
+#include "FdTable.hpp"
+#include "ShmBridge.hpp"
+#include "Mux.hpp"
+#include "TapIndex.hpp"
+#include "ThreadAffinity.hpp"
+#include "Epoll.hpp"
+#include "CompletionQueue.hpp"
+#include "HttpControlPlane.hpp"
+#include "Arena.hpp"
+#include "MemBudget.hpp"
+#include "SimWire.hpp"
+#include "LockStats.hpp"
+#include "LatencyTrace.hpp"
+#include "Capture.hpp"
+#include "Replay.hpp"
+#include "Resolver.hpp"
+#include "StateStore.hpp"
+#include "StateWriter.hpp"
+#include "IdentityPool.hpp"
+#include "DialPool.hpp"
+#include "NodeDaemon.hpp"
+#include "Ping.hpp"
+#include "PowerMode.hpp"
+#include "Clock.hpp"
+#include "Upstreams.hpp"
 #include "libzt.h"
 
 #ifdef __cplusplus
@@ -76,6 +123,19 @@ extern "C" {
 
 static ZeroTier::OneService *zt1Service;
 
+// Stands in for the core while zts_sim_start() is in effect
+static ZeroTier::SimWire *simWire;
+static unsigned int simNodes;
+
+// Those started by zts_node_start(), see zts_stop()
+static void stopNodes();
+
+// Whether there are taps (real or simulated) for the socket API to use
+static bool serviceRunning()
+{
+	return zt1Service || simWire;
+}
+
 namespace ZeroTier {
 	std::string homeDir; // Platform-specific dir we *must* use internally
 	std::string netDir;  // Where network .conf files are to be written
@@ -88,22 +148,145 @@ namespace ZeroTier {
 #endif
 
 	/*
+	 * ZTS_STACK_* chosen through zts_join_stack() by network ID, networks not in here run on
+	 * the default stack
+	 */
+	std::map<uint64_t, int> networkStacks;
+	Mutex _networkStacks_lock;
+
+	// NULL if the library wasn't built with the stack
+	static StackDriver *stackDriverById(int stack)
+	{
+#if defined(STACK_PICO)
+		if(stack == ZTS_STACK_PICO || stack == ZTS_STACK_DEFAULT)
+			return picostack;
+#endif
+#if defined(STACK_LWIP)
+		if(stack == ZTS_STACK_LWIP || stack == ZTS_STACK_DEFAULT)
+			return lwipstack;
+#endif
+		return NULL;
+	}
+
+	// Declared in StackDriver.hpp for SocketTap.cpp, hence outside this file's C linkage
+	extern "C++" {
+	StackDriver *defaultStackDriver()
+	{
+		return stackDriverById(ZTS_STACK_DEFAULT);
+	}
+
+	StackDriver *stackDriverFor(uint64_t nwid)
+	{
+		Mutex::Lock _l(_networkStacks_lock);
+		std::map<uint64_t, int>::iterator it = networkStacks.find(nwid);
+		return stackDriverById(it != networkStacks.end() ? it->second : ZTS_STACK_DEFAULT);
+	}
+	}
+
+	/*
+	 * For fast lookup of Connections and SocketTaps via given file descriptor, includes
 	 * "sockets" that have been created but not bound to a SocketTap interface yet
 	 */
-	std::map<int, Connection*> unmap;
+	FdTable fdtable;
 
 	/*
-	 * For fast lookup of Connections and SocketTaps via given file descriptor
+	 * zts_epoll instances by descriptor
 	 */
-	std::map<int, std::pair<Connection*,SocketTap*>*> fdmap;
+	std::map<int, std::shared_ptr<Epoll> > epolls;
+	ZeroTier::ProfiledMutex _epolls_lock(ZTS_LOCK_EPOLLS);
+
+	/*
+	 * zts_cq instances by descriptor, also guarded by _epolls_lock
+	 */
+	std::map<int, std::shared_ptr<CompletionQueue> > cqs;
 
 	/*
 	 * 
 	 */
 	std::vector<void*> vtaps;
 
-	ZeroTier::Mutex _vtaps_lock;
-	ZeroTier::Mutex _multiplexer_lock;
+	/*
+	 * Lock-free lookups of taps in vtaps, republished whenever vtaps or a tap's _ips changes
+	 */
+	TapIndex tapindex;
+
+	/*
+	 * CPUs chosen for libzt's threads, see zts_set_thread_affinity()
+	 */
+	ThreadAffinity affinity;
+
+	/*
+	 * The thread zts_start() runs the service on
+	 */
+	pthread_t serviceThread;
+	std::atomic<bool> serviceThreadStarted(false);
+
+	/*
+	 * Connections waiting in some tap's _closing or _reap_q, see zts_get_socket_counts()
+	 */
+	std::atomic<uint32_t> closingConns(0);
+
+	/*
+	 * Retired Connection objects and spare socketpairs, see ConnectionPool.hpp
+	 */
+	ConnectionPool connpool;
+
+	/*
+	 * See zts_enable_peer_path_cache()
+	 */
+	bool peerPathCache = false;
+	volatile bool peerPathCacheRunning = false;
+
+	/*
+	 * See zts_set_state_store()
+	 */
+	volatile bool stateSyncRunning = false;
+
+	/*
+	 * Peers as last read from the core, indexed by address, see refreshPeers()
+	 */
+	extern "C++" {
+		std::vector<struct zts_peer_info> peerCache;
+		std::unordered_map<uint64_t, size_t> peerIndex;
+		// Fed by refreshPeers(), see zts_get_upstreams()
+		Upstreams upstreams;
+		// When each peer was first seen and went direct, see zts_get_traversal_stats()
+		struct peer_direct {
+			uint64_t first_seen;
+			int time_to_direct;
+			int role;
+		};
+		struct traversal_state {
+			uint64_t start;
+			bool sampled; // peers seen before this is set were there as the service started
+			int first_direct;
+			uint32_t hints, hints_predicted;
+			std::unordered_map<uint64_t, peer_direct> peers;
+			traversal_state() : start(0), sampled(false), first_direct(-1), hints(0), hints_predicted(0) {}
+		} traversal;
+	}
+	// See zts_set_nat_traversal()
+	struct zts_nat_traversal natTraversal = { 0, ZT_NAT_PREDICT_PORTS, ZT_NAT_RANDOM_PORTS };
+	uint64_t peerCacheTime = 0;
+	ZeroTier::Mutex _peer_cache_lock;
+	volatile bool upstreamsRunning = false;
+
+	/*
+	 * See zts_set_route_policy()
+	 */
+	std::atomic<int> routePolicy(ZTS_ROUTE_VIRTUAL);
+
+	/*
+	 * See zts_set_stack_config(), only changes while no service is running
+	 */
+	struct zts_stack_config stackConfig;
+
+	ZeroTier::ProfiledMutex _vtaps_lock(ZTS_LOCK_VTAPS);
+	ZeroTier::ProfiledMutex _multiplexer_lock(ZTS_LOCK_MULTIPLEXER);
+#if defined(ZT_LOCK_STATS)
+	extern "C++" { LockProfile lockProfiles[ZTS_LOCK_COUNT]; }
+#endif
+	extern "C++" { LatencyTrace latencyTrace; }
 	ZeroTier::Mutex _accepted_connection_lock;
 }
 
@@ -111,1740 +294,7459 @@ namespace ZeroTier {
 /* SDK Socket API - Language Bindings are written in terms of these         */
 /****************************************************************************/
 
-void zts_start(const char *path)
+// Creates path and any missing parents
+static bool makeHomePath(const std::string &path)
 {
-	if(zt1Service)
+	std::vector<std::string> hpsp(ZeroTier::OSUtils::split(path.c_str(), ZT_PATH_SEPARATOR_S,"",""));
+	std::string ptmp;
+	if (path.length() && path[0] == ZT_PATH_SEPARATOR)
+		ptmp.push_back(ZT_PATH_SEPARATOR);
+	for(std::vector<std::string>::iterator pi(hpsp.begin());pi!=hpsp.end();++pi) {
+		if (ptmp.length() > 0)
+			ptmp.push_back(ZT_PATH_SEPARATOR);
+		ptmp.append(*pi);
+		if ((*pi != ".")&&(*pi != "..")) {
+			if (!ZeroTier::OSUtils::mkdir(ptmp))
+				return false;
+		}
+	}
+	return true;
+}
+
+// Writes a file holding a private key, readable by the owner alone from the moment it exists
+static bool writeSecretFile(const std::string &fpath, const void *data, int len)
+{
+	// A file there already may be readable by others, this one is made afresh
+	unlink(fpath.c_str());
+	int fd = open(fpath.c_str(), O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0600);
+	if(fd < 0)
+		return false;
+	const char *p = (const char *)data;
+	int left = len;
+	while(left > 0) {
+		ssize_t n = write(fd, p, left);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			break;
+		p += n;
+		left -= n;
+	}
+	bool ok = !left && !fsync(fd);
+	close(fd);
+	if(!ok)
+		unlink(fpath.c_str());
+	return ok;
+}
+
+// Gives a service about to start on path without an identity one from the pool, or searched
+// for on every CPU, rather than have it search on one
+static void provisionIdentity(const std::string &path)
+{
+	std::string sfile = path + ZT_PATH_SEPARATOR_S + "identity.secret";
+	if(ZeroTier::OSUtils::fileExists(sfile.c_str(), false))
+		return;
+	ZeroTier::Identity id;
+	if(!id.fromString(ZeroTier::IdentityPool::generate(0).c_str()))
+		return;
+	char buf[ZT_IDENTITY_STRING_BUFFER_LENGTH];
+	id.toString(true, buf);
+	bool ok = writeSecretFile(sfile, buf, strlen(buf));
+	memset(buf, 0, sizeof(buf));
+	if(!ok)
 		return;
+	id.toString(false, buf);
+	ZeroTier::OSUtils::writeFile((path + ZT_PATH_SEPARATOR_S + "identity.public").c_str(), buf, strlen(buf));
+}
+
+// Once per process, by zts_start() or zts_sim_start()
+static bool stacksStarted()
+{
 #if defined(STACK_PICO)
 	if(ZeroTier::picostack)
-		return;
+		return true;
+#endif
+#if defined(STACK_LWIP)
+	if(ZeroTier::lwipstack)
+		return true;
+#endif
+	return false;
+}
+
+static void startStacks()
+{
+	ZeroTier::StackThread::cooperative = ZeroTier::stackConfig.cooperative != 0;
+	// before the stack is initialized, which allocates for the first time
+	ZeroTier::MemBudget::setLimit((uint64_t)ZeroTier::stackConfig.mem_limit_kb * 1024);
+	ZeroTier::Arena::reserve(ZeroTier::stackConfig.arena_kb, ZeroTier::stackConfig.arena_fixed,
+		ZeroTier::stackConfig.hugepages, ZeroTier::stackConfig.prefault);
+#if defined(STACK_PICO)
 	ZeroTier::picostack = new ZeroTier::picoTCP();
 	pico_stack_init();
+	pico_ipv6_nd_set_resolver(ZeroTier::pico_nd_resolve);
+	pico_socket_set_path_mtu_hook(ZeroTier::pico_path_mtu);
 #endif
 #if defined(STACK_LWIP)
 	ZeroTier::lwipstack = new ZeroTier::lwIP();
 	lwip_init();
 #endif
+}
+
+void zts_start(const char *path)
+{
+	if(zt1Service || simWire || stacksStarted())
+		return;
+	startStacks();
 	if(path)
 		ZeroTier::homeDir = path;
-	pthread_t service_thread;
-	pthread_create(&service_thread, NULL, zts_start_service, (void *)(path));
+	if(pthread_create(&ZeroTier::serviceThread, NULL, zts_start_service, (void *)(path)) == 0)
+		ZeroTier::serviceThreadStarted = true;
 }
 
 void zts_simple_start(const char *path, const char *nwid)
 {
 	zts_start(path);
 	while(!zts_running())
-		usleep(ZT_API_CHECK_INTERVAL * 1000);
+		usleep(ZT_START_CHECK_INTERVAL * 1000);
 	zts_join(nwid);
 	while(!zts_has_address(nwid))
-		usleep(ZT_API_CHECK_INTERVAL * 1000);
+		usleep(ZT_START_CHECK_INTERVAL * 1000);
 }
 
-void zts_stop() {
-	if(zt1Service) { 
-		zt1Service->terminate();
-		dismantleTaps();
-	}
-}
+struct start_request
+{
+	std::string nwid;
+	int timeout;
+	zts_ready_cb cb;
+	void *arg;
+};
 
-void zts_join(const char * nwid) {
-	if(zt1Service) {
-		std::string confFile = zt1Service->givenHomePath() + "/networks.d/" + nwid + ".conf";
-		if(!ZeroTier::OSUtils::mkdir(ZeroTier::netDir)) {
-			DEBUG_ERROR("unable to create: %s", ZeroTier::netDir.c_str());
-			handle_general_failure();
+static void *zts_start_waiter(void *arg)
+{
+	struct start_request *req = (struct start_request *)arg;
+	uint64_t deadline = ZeroTier::OSUtils::now() + req->timeout;
+	int status = 0;
+	while(!zts_running()) {
+		if(req->timeout >= 0 && ZeroTier::OSUtils::now() >= deadline) {
+			status = ETIMEDOUT;
+			break;
 		}
-		if(!ZeroTier::OSUtils::writeFile(confFile.c_str(), "")) {
-			DEBUG_ERROR("unable to write network conf file: %s", confFile.c_str());
-			handle_general_failure();
+		usleep(ZT_START_CHECK_INTERVAL * 1000);
+	}
+	if(!status) {
+		zts_join(req->nwid.c_str());
+		while(!zts_has_address(req->nwid.c_str())) {
+			if(req->timeout >= 0 && ZeroTier::OSUtils::now() >= deadline) {
+				status = ETIMEDOUT;
+				break;
+			}
+			usleep(ZT_START_CHECK_INTERVAL * 1000);
 		}
-		zt1Service->join(nwid);
 	}
+	if(req->cb)
+		req->cb(req->nwid.c_str(), status, req->arg);
+	delete req;
+	return NULL;
 }
 
-void zts_join_soft(const char * filepath, const char * nwid) { 
-	std::string net_dir = std::string(filepath) + "/networks.d/";
-	std::string confFile = net_dir + std::string(nwid) + ".conf";
-	if(!ZeroTier::OSUtils::mkdir(net_dir)) {
-		DEBUG_ERROR("unable to create: %s", net_dir.c_str());
-		handle_general_failure();
+/*
+ * [--] [EINVAL]   path or nwid is NULL.
+ * [--] [EAGAIN]   A thread to wait for the network could not be created.
+ */
+int zts_start_async(const char *path, const char *nwid, int timeout, zts_ready_cb cb, void *arg)
+{
+	if(!path || !nwid) {
+		errno = EINVAL;
+		return -1;
 	}
-	if(!ZeroTier::OSUtils::fileExists(confFile.c_str(),false)) {
-		if(!ZeroTier::OSUtils::writeFile(confFile.c_str(), "")) {
-			DEBUG_ERROR("unable to write network conf file: %s", confFile.c_str());
-			handle_general_failure();
-		}
+	struct start_request *req = new struct start_request;
+	req->nwid = nwid;
+	req->timeout = timeout;
+	req->cb = cb;
+	req->arg = arg;
+	zts_start(path);
+	pthread_t waiter;
+	if(pthread_create(&waiter, NULL, zts_start_waiter, req)) {
+		delete req;
+		errno = EAGAIN;
+		return -1;
 	}
+	pthread_detach(waiter);
+	return 0;
 }
 
-void zts_leave(const char * nwid) { 
-	if(zt1Service)
-		zt1Service->leave(nwid);
+/*
+ * [--] [EINVAL]   secret is NULL.
+ * [--] [ERANGE]   len is less than ZT_IDENTITY_SECRET_LEN.
+ */
+int zts_generate_identity(char *secret, int len)
+{
+	if(!secret) {
+		errno = EINVAL;
+		return -1;
+	}
+	if(len < ZT_IDENTITY_SECRET_LEN) {
+		errno = ERANGE;
+		return -1;
+	}
+	return zts_generate_identity_parallel(secret, len, 0);
 }
 
-void zts_leave_soft(const char * filepath, const char * nwid) {
-	std::string net_dir = std::string(filepath) + "/networks.d/";
-	ZeroTier::OSUtils::rm((net_dir + nwid + ".conf").c_str()); 
+/*
+ * [--] [EINVAL]   secret is NULL.
+ * [--] [ERANGE]   len is less than ZT_IDENTITY_SECRET_LEN.
+ */
+int zts_generate_identity_parallel(char *secret, int len, int threads)
+{
+	if(!secret) {
+		errno = EINVAL;
+		return -1;
+	}
+	if(len < ZT_IDENTITY_SECRET_LEN) {
+		errno = ERANGE;
+		return -1;
+	}
+	std::string s = ZeroTier::IdentityPool::generate(threads);
+	memset(secret, 0, len);
+	strncpy(secret, s.c_str(), len - 1);
+	std::fill(s.begin(), s.end(), 0);
+	return 0;
 }
 
-void zts_get_homepath(char *homePath, int len) { 
-	if(ZeroTier::homeDir.length()) {
-		memset(homePath, 0, len);
-		memcpy(homePath, ZeroTier::homeDir.c_str(), len < ZeroTier::homeDir.length() ? len : ZeroTier::homeDir.length());
+/*
+ * [--] [EINVAL]   count is negative.
+ */
+int zts_identity_pool_fill(int count, int threads, zts_identity_progress_cb cb, void *arg)
+{
+	if(count < 0) {
+		errno = EINVAL;
+		return -1;
 	}
+	ZeroTier::IdentityPool::fill(count, threads, cb, arg);
+	return 0;
 }
 
-void zts_core_version(char *ver) {
-	int major, minor, revision;
-	ZT_version(&major, &minor, &revision);
-	sprintf(ver, "%d.%d.%d", major, minor, revision);
+/*
+ * [--] [EINVAL]   secret is NULL.
+ * [--] [ERANGE]   len is less than ZT_IDENTITY_SECRET_LEN.
+ * [--] [EAGAIN]   The pool is empty.
+ */
+int zts_identity_pool_take(char *secret, int len)
+{
+	if(!secret) {
+		errno = EINVAL;
+		return -1;
+	}
+	if(len < ZT_IDENTITY_SECRET_LEN) {
+		errno = ERANGE;
+		return -1;
+	}
+	std::string s;
+	if(!ZeroTier::IdentityPool::take(s)) {
+		errno = EAGAIN;
+		return -1;
+	}
+	memset(secret, 0, len);
+	strncpy(secret, s.c_str(), len - 1);
+	std::fill(s.begin(), s.end(), 0);
+	return 0;
 }
 
-void zts_lib_version(char *ver) {
-	sprintf(ver, "%d.%d.%d", ZT_LIB_VERSION_MAJOR, ZT_LIB_VERSION_MINOR, ZT_LIB_VERSION_REVISION);
+int zts_identity_pool_size(void)
+{
+	return ZeroTier::IdentityPool::size();
 }
 
-int zts_get_device_id(char *devID) { 
-	if(zt1Service) {
-		char id[ZT_ID_LEN+1];
-		sprintf(id, "%lx",zt1Service->getNode()->address());
-		memcpy(devID, id, ZT_ID_LEN+1);
-		return 0;
+// Writes a state file (or key, see zts_set_state_store()) for a service which hasn't started on
+// path yet
+static int provisionState(const char *path, const std::string &name, const void *data, int len, bool secret)
+{
+	bool store = ZeroTier::StateStore::active();
+	if((!path && !store) || !data || len < 0) {
+		errno = EINVAL;
+		return -1;
 	}
-	else // Service isn't online, try to read ID from file
-	{
-		std::string fname("identity.public");
-		std::string fpath(ZeroTier::homeDir);
-
-		if(ZeroTier::OSUtils::fileExists((fpath + ZT_PATH_SEPARATOR_S + fname).c_str(),false)) {
-			std::string oldid;
-			ZeroTier::OSUtils::readFile((fpath + ZT_PATH_SEPARATOR_S + fname).c_str(),oldid);
-			memcpy(devID, oldid.c_str(), ZT_ID_LEN); // first 10 bytes of file
-			return 0;
+	if(store) {
+		if(zt1Service) {
+			errno = EBUSY;
+			return -1;
 		}
+		if(!ZeroTier::StateStore::put(name, data, len)) {
+			errno = EACCES;
+			return -1;
+		}
+		return 0;
 	}
-	return -1;
-}
-
-int zts_running() { 
-	return !zt1Service ? false : zt1Service->isRunning(); 
+	if(zt1Service && ZeroTier::homeDir == path) {
+		errno = EBUSY;
+		return -1;
+	}
+	if(!makeHomePath(path) || (name.find(ZT_PATH_SEPARATOR) != std::string::npos 
+		&& !ZeroTier::OSUtils::mkdir(std::string(path) + ZT_PATH_SEPARATOR_S 
+			+ name.substr(0, name.find(ZT_PATH_SEPARATOR))))) {
+		errno = EACCES;
+		return -1;
+	}
+	std::string fpath = std::string(path) + ZT_PATH_SEPARATOR_S + name;
+	if(!(secret ? writeSecretFile(fpath, data, len) : ZeroTier::OSUtils::writeFile(fpath.c_str(), data, len))) {
+		errno = EACCES;
+		return -1;
+	}
+	return 0;
 }
 
-int zts_has_ipv4_address(const char *nwid)
+/*
+ * [--] [EINVAL]   path (without a state store) or secret is NULL, or secret is not an identity
+ *                 with its private key.
+ * [--] [EBUSY]    The service is already running on path (or at all, with a state store).
+ * [--] [EACCES]   path or the identity files (keys) could not be written.
+ */
+int zts_set_identity(const char *path, const char *secret)
 {
-	char ipv4_addr[ZT_MAX_IPADDR_LEN];
-	memset(ipv4_addr, 0, ZT_MAX_IPADDR_LEN);
-	zts_get_ipv4_address(nwid, ipv4_addr, ZT_MAX_IPADDR_LEN);
-	return strcmp(ipv4_addr, "\0");
+	ZeroTier::Identity id;
+	if(!secret || !id.fromString(secret) || !id.hasPrivate()) {
+		errno = EINVAL;
+		return -1;
+	}
+	char buf[ZT_IDENTITY_STRING_BUFFER_LENGTH];
+	id.toString(true, buf);
+	int err = provisionState(path, "identity.secret", buf, strlen(buf), true);
+	memset(buf, 0, sizeof(buf));
+	if(err < 0)
+		return -1;
+	id.toString(false, buf);
+	return provisionState(path, "identity.public", buf, strlen(buf), false);
 }
 
-int zts_has_ipv6_address(const char *nwid)
+/*
+ * [--] [EINVAL]   path or data is NULL, or len is negative.
+ * [--] [EBUSY]    The service is already running on path.
+ * [--] [EACCES]   path or the planet file could not be written.
+ */
+int zts_set_planet(const char *path, const void *data, int len)
 {
-	char ipv6_addr[ZT_MAX_IPADDR_LEN];
-	memset(ipv6_addr, 0, ZT_MAX_IPADDR_LEN);
-	zts_get_ipv6_address(nwid, ipv6_addr, ZT_MAX_IPADDR_LEN);
-	return strcmp(ipv6_addr, "\0");
+	return provisionState(path, "planet", data, len, false);
 }
 
-int zts_has_address(const char *nwid)
+/*
+ * [--] [EINVAL]   path or data is NULL, or len is negative.
+ * [--] [EBUSY]    The service is already running on path.
+ * [--] [EACCES]   path or the peer file could not be written.
+ */
+int zts_set_peer_cache(const char *path, uint64_t address, const void *data, int len)
 {
-	return zts_has_ipv4_address(nwid) || zts_has_ipv6_address(nwid);
+	char name[64];
+	snprintf(name, sizeof(name), "peers.d" ZT_PATH_SEPARATOR_S "%.10llx.peer", (unsigned long long)address);
+	return provisionState(path, name, data, len, false);
 }
 
-void zts_get_ipv4_address(const char *nwid, char *addrstr, const int addrlen)
+/*
+ * [--] [EINVAL]   One of store's callbacks is NULL.
+ * [--] [EBUSY]    The service is already running.
+ */
+int zts_set_state_store(const struct zts_state_store *store)
 {
+	if(store && (!store->get || !store->put || !store->del)) {
+		errno = EINVAL;
+		return -1;
+	}
 	if(zt1Service) {
-		uint64_t nwid_int = strtoull(nwid, NULL, 16);
-		ZeroTier::SocketTap *tap = getTapByNWID(nwid_int);
-		if(tap && tap->_ips.size()){ 
-			for(int i=0; i<tap->_ips.size(); i++) {
-				if(tap->_ips[i].isV4()) {
-					char ipbuf[64];
-					std::string addr = tap->_ips[i].toString(ipbuf);
-					int len = addrlen < addr.length() ? addrlen : addr.length();
-					memset(addrstr, 0, len);
-					memcpy(addrstr, addr.c_str(), len); 
-					return;
-				}
-			}
-		}
+		errno = EBUSY;
+		return -1;
 	}
-	else
-		memcpy(addrstr, "\0", 1);
+	ZeroTier::StateStore::set(store);
+	return 0;
 }
 
-void zts_get_ipv6_address(const char *nwid, char *addrstr, const int addrlen)
+const struct zts_state_store *zts_memory_state_store(void)
 {
-	if(zt1Service) {
-		uint64_t nwid_int = strtoull(nwid, NULL, 16);
-		ZeroTier::SocketTap *tap = getTapByNWID(nwid_int);
-		if(tap && tap->_ips.size()){ 
-			for(int i=0; i<tap->_ips.size(); i++) {
-				if(tap->_ips[i].isV6()) {
-					char ipbuf[64];
-					std::string addr = tap->_ips[i].toString(ipbuf);
-					int len = addrlen < addr.length() ? addrlen : addr.length();
-					memset(addrstr, 0, len);
-					memcpy(addrstr, addr.c_str(), len); 
-					return;
-				}
-			}
-		}
-	}
-	else
-		memcpy(addrstr, "\0", 1);
+	return ZeroTier::StateStore::memory();
 }
 
-void zts_get_6plane_addr(char *addr, const char *nwid, const char *devID)
+/*
+ * [--] [EINVAL]   stats is NULL.
+ */
+int zts_get_state_write_stats(struct zts_state_write_stats *stats)
 {
-	ZeroTier::InetAddress _6planeAddr = ZeroTier::InetAddress::makeIpv66plane(
-		ZeroTier::Utils::hexStrToU64(nwid),ZeroTier::Utils::hexStrToU64(devID));
-	char ipbuf[64];
-	memcpy(addr, _6planeAddr.toIpString(ipbuf), 40);
+	if(!stats) {
+		errno = EINVAL;
+		return -1;
+	}
+	ZeroTier::StateWriter::stats(stats);
+	return 0;
 }
 
-void zts_get_rfc4193_addr(char *addr, const char *nwid, const char *devID)
+/*
+ * [--] [EINVAL]   config is NULL, one of its fields is negative, tcp_congestion isn't known,
+ *                 arena_fixed is set without arena_kb or hugepages isn't a ZTS_HUGEPAGES_* value.
+ *                 Only buf_park_s and tcp_buf_autotune_kb may be -1.
+ * [--] [EBUSY]    The service is already running, or cooperative would change once the stacks
+ *                 have been started.
+ */
+int zts_set_stack_config(const struct zts_stack_config *config)
 {
-	ZeroTier::InetAddress _6planeAddr = ZeroTier::InetAddress::makeIpv6rfc4193(
-		ZeroTier::Utils::hexStrToU64(nwid),ZeroTier::Utils::hexStrToU64(devID));
-	char ipbuf[64];
-	memcpy(addr, _6planeAddr.toIpString(ipbuf), 40);
+	if(!config || config->max_sockets < 0 || config->frame_pool_sz < 0 
+		|| config->tcp_sndbuf < 0 || config->tcp_rcvbuf < 0 || config->arena_kb < 0
+		|| (config->arena_fixed && !config->arena_kb) || config->buf_park_s < -1
+		|| config->hugepages < ZTS_HUGEPAGES_OFF || config->hugepages > ZTS_HUGEPAGES_TLB
+		|| config->mem_limit_kb < 0 || config->tcp_buf_autotune_kb < -1 || !memchr(config->tcp_congestion, 0, sizeof(config->tcp_congestion))) {
+		errno = EINVAL;
+		return -1;
+	}
+#if defined(STACK_PICO)
+	if(config->tcp_congestion[0] && !pico_tcp_congestion_exists(config->tcp_congestion)) {
+		errno = EINVAL;
+		return -1;
+	}
+#endif
+	if(zt1Service || (stacksStarted() && !config->cooperative != !ZeroTier::stackConfig.cooperative)) {
+		errno = EBUSY;
+		return -1;
+	}
+	ZeroTier::stackConfig = *config;
+	return 0;
 }
 
-unsigned long zts_get_peer_count() {
-	if(zt1Service)
-		return zt1Service->getNode()->peers()->peerCount;
-	else
-		return 0;
+/*
+ * [--] [EINVAL]   config is NULL.
+ */
+int zts_get_stack_config(struct zts_stack_config *config)
+{
+	if(!config) {
+		errno = EINVAL;
+		return -1;
+	}
+	const struct zts_stack_config &c = ZeroTier::stackConfig;
+	config->max_sockets = c.max_sockets;
+	config->frame_pool_sz = c.frame_pool_sz ? std::max(c.frame_pool_sz, ZT_FRAME_RX_QUEUE_LEN) : ZT_FRAME_POOL_SZ;
+	config->tcp_sndbuf = c.tcp_sndbuf ? c.tcp_sndbuf : ZT_STACK_TCP_SOCKET_TX_SZ;
+	config->tcp_rcvbuf = c.tcp_rcvbuf ? c.tcp_rcvbuf : ZT_STACK_TCP_SOCKET_RX_SZ;
+	strcpy(config->tcp_congestion, c.tcp_congestion[0] ? c.tcp_congestion : ZT_TCP_CONGESTION_DEFAULT);
+	config->arena_kb = c.arena_kb;
+	config->arena_fixed = c.arena_fixed;
+	config->buf_park_s = c.buf_park_s ? c.buf_park_s : ZT_SOCK_BUF_PARK_IDLE;
+	config->userspace_fds = c.userspace_fds;
+	config->hugepages = c.hugepages;
+	config->prefault = c.prefault;
+	config->mem_limit_kb = c.mem_limit_kb;
+	config->tcp_buf_autotune_kb = c.tcp_buf_autotune_kb;
+	config->cooperative = c.cooperative;
+	return 0;
 }
 
-int zts_get_peer_address(char *peer, const char *devID) {
-	if(zt1Service) {
-		ZT_PeerList *pl = zt1Service->getNode()->peers();
-		// uint64_t addr;
-		for(int i=0; i<pl->peerCount; i++) {
-			// ZT_Peer *p = &(pl->peers[i]);
-			// DEBUG_INFO("peer[%d] = %lx", i, p->address);
-		}
-		return pl->peerCount;
-	}
-	else
+/*
+ * [--] [EINVAL]   The stacks weren't started in cooperative mode.
+ */
+int zts_run_once(int timeout_ms)
+{
+	if(!ZeroTier::StackThread::cooperative) {
+		errno = EINVAL;
 		return -1;
+	}
+	uint64_t due = UINT64_MAX;
+	if(simWire)
+		due = simWire->deliver();
+	unsigned long wait = timeout_ms < 0 ? ULONG_MAX : (unsigned long)timeout_ms;
+	if(due != UINT64_MAX)
+		wait = std::min(wait, ZeroTier::Clock::sleepMs((unsigned long)((due + 999) / 1000)));
+	int next = ZeroTier::StackThread::runOnce(wait == ULONG_MAX ? -1 : (int)std::min(wait, (unsigned long)INT_MAX));
+	// What the pass sent may be due already
+	if(simWire && (due = simWire->deliver()) != UINT64_MAX)
+		next = std::min(next, (int)ZeroTier::Clock::sleepMs((unsigned long)((due + 999) / 1000)));
+	return next;
 }
 
-void zts_enable_http_control_plane()
+/*
+ * [--] [EINVAL]   stats is NULL and n isn't 0.
+ */
+int zts_get_arena_stats(struct zts_arena_stats *stats, int n)
 {
-	// TODO
+	if(!stats && n) {
+		errno = EINVAL;
+		return -1;
+	}
+	return ZeroTier::Arena::stats(stats, n);
 }
 
-void zts_disable_http_control_plane()
+/*
+ * [--] [EINVAL]   stats is NULL.
+ */
+int zts_get_mem_stats(struct zts_mem_stats *stats)
 {
-	// TODO
+	if(!stats) {
+		errno = EINVAL;
+		return -1;
+	}
+	ZeroTier::MemBudget::stats(stats);
+	return 0;
 }
 
-/****************************************************************************/
-/* SocketTap Multiplexer Functionality                                      */
-/* - This section of the API is used to implement the general socket        */
-/*   controls. Basically this is designed to handle socket provisioning     */
-/*   requests when no SocketTap is yet initialized, and as a way to         */
-/*   determine which SocketTap is to be used for a particular connect() or  */ 
-/*   bind() call. This enables multi-network support                        */
-/****************************************************************************/
-
-/*
+void zts_stop() {
+	ZeroTier::HttpControlPlane::stop();
+	ZeroTier::DialPool::flush();
+	ZeroTier::Mux::stop();
+	stopNodes();
+	if(zt1Service) { 
+		if(ZeroTier::peerPathCache)
+			savePeerPaths();
+		zt1Service->terminate();
+		dismantleTaps();
+		ZeroTier::Mutex::Lock _l(ZeroTier::_peer_cache_lock);
+		ZeroTier::peerCacheTime = 0;
+		ZeroTier::upstreams.clear();
+	}
+}
 
-Darwin:
+void zts_join(const char * nwid) {
+	if(zt1Service) {
+		std::string confFile = zt1Service->givenHomePath() + "/networks.d/" + nwid + ".conf";
+		if(!ZeroTier::OSUtils::mkdir(ZeroTier::netDir)) {
+			DEBUG_ERROR("unable to create: %s", ZeroTier::netDir.c_str());
+			handle_general_failure();
+		}
+		ZeroTier::StateWriter::write(confFile, "");
+		zt1Service->join(nwid);
+	}
+}
 
-	[  ] [EACCES]           Permission to create a socket of the specified type and/or protocol is denied.
-	[  ] [EAFNOSUPPORT]     The specified address family is not supported.
-	[--] [EMFILE]           The per-process descriptor table is full.
-	[NA] [ENFILE]           The system file table is full.
-	[  ] [ENOBUFS]          Insufficient buffer space is available.  The socket cannot be created until sufficient resources are freed.
-	[  ] [ENOMEM]           Insufficient memory was available to fulfill the request.
-	[--] [EPROTONOSUPPORT]  The protocol type or the specified protocol is not supported within this domain.
-	[  ] [EPROTOTYPE]       The socket type is not supported by the protocol.
+/*
+	[--] [EINVAL]           nwid is NULL or stack isn't one of ZTS_STACK_*.
+	[--] [EPROTONOSUPPORT]  The library wasn't built with the stack.
 */
-
-// int socket_family, int socket_type, int protocol
-int zts_socket(ZT_SOCKET_SIG) {
-	errno = 0;
-	if(socket_family < 0 || socket_type < 0 || protocol < 0) {
+int zts_join_stack(const char * nwid, int stack)
+{
+	if(!nwid || stack < ZTS_STACK_DEFAULT || stack > ZTS_STACK_LWIP) {
 		errno = EINVAL;
 		return -1;
 	}
-	int err = 0;
-	if(!zt1Service) {
-		DEBUG_ERROR("cannot create socket, no service running. call zts_start() first.");
-		errno = EMFILE; // could also be ENFILE
+	// Looked up by the network's tap once the core brings it up, see SocketTap::SocketTap()
+	if(!ZeroTier::stackDriverById(stack)) {
+		errno = EPROTONOSUPPORT;
 		return -1;
 	}
-	if(socket_type == SOCK_SEQPACKET) {
-		DEBUG_ERROR("SOCK_SEQPACKET not yet supported.");
-		errno = EPROTONOSUPPORT; // seemingly closest match
-		return -1;
+	{
+		ZeroTier::Mutex::Lock _l(ZeroTier::_networkStacks_lock);
+		ZeroTier::networkStacks[strtoull(nwid, NULL, 16)] = stack;
 	}
+	zts_join(nwid);
+	return 0;
+}
 
-	ZeroTier::_multiplexer_lock.lock();
+void zts_join_soft(const char * filepath, const char * nwid) { 
+	std::string net_dir = std::string(filepath) + "/networks.d/";
+	std::string confFile = net_dir + std::string(nwid) + ".conf";
+	if(!ZeroTier::OSUtils::mkdir(net_dir)) {
+		DEBUG_ERROR("unable to create: %s", net_dir.c_str());
+		handle_general_failure();
+	}
+	if(!ZeroTier::OSUtils::fileExists(confFile.c_str(),false)) {
+		if(!ZeroTier::OSUtils::writeFile(confFile.c_str(), "")) {
+			DEBUG_ERROR("unable to write network conf file: %s", confFile.c_str());
+			handle_general_failure();
+		}
+	}
+}
 
-	if(socket_type == SOCK_RAW)
-	{
-		// Connection is only used to associate a socket with a SocketTap, it has no other implication
-		ZeroTier::Connection *conn = new ZeroTier::Connection();
-		conn->socket_family = socket_family;
-		conn->socket_type = socket_type;
-		conn->protocol = protocol;
-		ZeroTier::unmap[conn->app_fd] = conn;
-		return conn->app_fd;
+void zts_leave(const char * nwid) { 
+	if(zt1Service) {
+		// Or a write from zts_join() which hasn't gone out yet would bring it back
+		ZeroTier::StateWriter::remove(zt1Service->givenHomePath() + "/networks.d/" + nwid + ".conf");
+		zt1Service->leave(nwid);
 	}
+}
 
-#if defined(STACK_PICO)
-	struct pico_socket *p;
-	err = ZeroTier::picostack->pico_Socket(&p, socket_family, socket_type, protocol);
-	if(p) {
-		ZeroTier::Connection *conn = new ZeroTier::Connection();
-		conn->socket_family = socket_family;
-		conn->socket_type = socket_type;
-		conn->picosock = p;
-		ZeroTier::unmap[conn->app_fd] = conn;
-		err = conn->app_fd; // return one end of the socketpair
+void zts_leave_soft(const char * filepath, const char * nwid) {
+	std::string net_dir = std::string(filepath) + "/networks.d/";
+	ZeroTier::OSUtils::rm((net_dir + nwid + ".conf").c_str()); 
+}
+
+// Whether nwids holds n networks, errno set if it doesn't or the service isn't running
+static bool checkNetworkList(const char **nwids, int n)
+{
+	if(n < 0 || (n && !nwids)) {
+		errno = EINVAL;
+		return false;
 	}
-	else {
-		DEBUG_ERROR("failed to create pico_socket");
-		err = -1;
+	for(int i=0; i<n; i++) {
+		if(!nwids[i]) {
+			errno = EINVAL;
+			return false;
+		}
 	}
-#endif
+	if(!zt1Service) {
+		errno = ENETDOWN;
+		return false;
+	}
+	return true;
+}
 
-#if defined(STACK_LWIP)
-	// TODO: check for max lwIP timers/sockets
-	ZeroTier::Connection *conn = new ZeroTier::Connection();
-	void *pcb;
-	err = ZeroTier::lwipstack->lwip_Socket(&pcb, socket_family, socket_type, protocol);
-	if(pcb) {
-		ZeroTier::Connection *conn = new ZeroTier::Connection();
-		conn->socket_family = socket_family;
-		conn->socket_type = socket_type;
-		conn->pcb = pcb;
-		ZeroTier::unmap[conn->app_fd] = conn;
-		err = conn->app_fd; // return one end of the socketpair
+/*
+	[--] [EINVAL]           nwids is NULL, n is negative or one of the entries is NULL.
+	[--] [ENETDOWN]         The service isn't running.
+	[--] [EIO]              networks.d couldn't be created.
+*/
+int zts_join_many(const char **nwids, int n)
+{
+	if(!checkNetworkList(nwids, n))
+		return -1;
+	if(!ZeroTier::OSUtils::mkdir(ZeroTier::netDir)) {
+		DEBUG_ERROR("unable to create: %s", ZeroTier::netDir.c_str());
+		errno = EIO;
+		return -1;
 	}
-	else {
-		DEBUG_ERROR("failed to create lwip pcb");
-		err = -1;
+	std::string dir = zt1Service->givenHomePath() + "/networks.d/";
+	for(int i=0; i<n; i++) {
+		ZeroTier::StateWriter::write(dir + nwids[i] + ".conf", "");
+		zt1Service->join(nwids[i]);
 	}
-#endif
-
-	ZeroTier::_multiplexer_lock.unlock();
-	return err;
+	return n;
 }
 
+/*
+	[--] [EINVAL]           nwids is NULL, n is negative or one of the entries is NULL.
+	[--] [ENETDOWN]         The service isn't running.
+*/
+int zts_leave_many(const char **nwids, int n)
+{
+	if(!checkNetworkList(nwids, n))
+		return -1;
+	// The service deletes the taps one after the other, each would otherwise wait for its
+	// stack thread to come around
+	std::vector<ZeroTier::SocketTap*> taps;
+	for(int i=0; i<n; i++) {
+		ZeroTier::SocketTap *tap = getTapByNWID(strtoull(nwids[i], NULL, 16));
+		if(tap)
+			taps.push_back(tap);
+	}
+	// Before their Connections' PhySockets are closed by detach()
+	for(size_t i=0; i<taps.size(); i++)
+		taps[i]->Park();
+	ZeroTier::StackThread::detach(taps);
+	std::string dir = zt1Service->givenHomePath() + "/networks.d/";
+	for(int i=0; i<n; i++) {
+		ZeroTier::StateWriter::remove(dir + nwids[i] + ".conf");
+		zt1Service->leave(nwids[i]);
+	}
+	return n;
+}
 
 /*
+ * A node started by zts_node_start(), next to the one zts_start() runs. Its taps are told apart
+ * from the others' by their home path
+ */
+struct zts_node
+{
+	ZeroTier::OneService *service;
+	std::string homeDir;
+	int port;
+	pthread_t thread;
+};
 
-Darwin:
+static ZeroTier::Mutex nodes_m;
+static std::vector<zts_node_t> nodes;
 
-	[  ] [EACCES]           The destination address is a broadcast address and the socket option SO_BROADCAST is not set.
-	[  ] [EADDRINUSE]       The address is already in use.
-	[  ] [EADDRNOTAVAIL]    The specified address is not available on this machine.
-	[  ] [EAFNOSUPPORT]     Addresses in the specified address family cannot be used with this socket.
-	[  ] [EALREADY]         The socket is non-blocking and a previous connection attempt has not yet been completed.
-	[--] [EBADF]            socket is not a valid descriptor.
-	[  ] [ECONNREFUSED]     The attempt to connect was ignored (because the target is not listening for connections) or explicitly rejected.
-	[  ] [EFAULT]           The address parameter specifies an area outside the process address space.
-	[  ] [EHOSTUNREACH]     The target host cannot be reached (e.g., down, disconnected).
-	[--] [EINPROGRESS]      The socket is non-blocking and the connection cannot be completed immediately.  
-							It is possible to select(2) for completion by selecting the socket for writing.
-	[NA] [EINTR]            Its execution was interrupted by a signal.
-	[  ] [EINVAL]           An invalid argument was detected (e.g., address_len is not valid for the address family, the specified address family is invalid).
-	[  ] [EISCONN]          The socket is already connected.
-	[  ] [ENETDOWN]         The local network interface is not functioning.
-	[--] [ENETUNREACH]      The network isn't reachable from this host.
-	[  ] [ENOBUFS]          The system call was unable to allocate a needed memory buffer.
-	[  ] [ENOTSOCK]         socket is not a file descriptor for a socket.
-	[  ] [EOPNOTSUPP]       Because socket is listening, no connection is allowed.
-	[  ] [EPROTOTYPE]       address has a different type than the socket that is bound to the specified peer address.
-	[  ] [ETIMEDOUT]        Connection establishment timed out without establishing a connection.
-	[  ] [ECONNRESET]       Remote host reset the connection request.
+static int randomServicePort();
+static void runService(ZeroTier::OneService **service, const std::string &home, int port);
+static void dismantleNodeTaps(const std::string &homePath);
 
-Linux:
+static void *nodeMain(void *arg)
+{
+	zts_node_t node = (zts_node_t)arg;
+	ZeroTier::ThreadAffinity::Accounted _cpu(ZeroTier::affinity, ZTS_THREAD_SERVICE, 0);
+	runService(&node->service, node->homeDir, node->port);
+	delete node->service;
+	node->service = (ZeroTier::OneService *)0;
+	return NULL;
+}
 
-	[  ] [EACCES]           For UNIX domain sockets, which are identified by pathname: Write permission is denied on the socket file, 
-							or search permission is denied for one of the directories in the path prefix. (See also path_resolution(7).)
-	[  ] [EACCES, EPERM]    The user tried to connect to a broadcast address without having the socket broadcast flag enabled or the 
-							connection request failed because of a local firewall rule.
-	[  ] [EADDRINUSE]       Local address is already in use.
-	[  ] [EAFNOSUPPORT]     The passed address didn't have the correct address family in its sa_family field.
-	[  ] [EAGAIN]           No more free local ports or insufficient entries in the routing cache. For AF_INET see the description 
-							of /proc/sys/net/ipv4/ip_local_port_range ip(7) for information on how to increase the number of local ports.
-	[  ] [EALREADY]         The socket is nonblocking and a previous connection attempt has not yet been completed.
-	[  ] [EBADF]            The file descriptor is not a valid index in the descriptor table.
-	[  ] [ECONNREFUSED]     No-one listening on the remote address.
-	[  ] [EFAULT]           The socket structure address is outside the user's address space.
-	[  ] [EINPROGRESS]      The socket is nonblocking and the connection cannot be completed immediately. It is possible to select(2) or 
-							poll(2) for completion by selecting the socket for writing. After select(2) indicates writability, use getsockopt(2) 
-							to read the SO_ERROR option at level SOL_SOCKET to determine whether connect() completed successfully (SO_ERROR is zero) 
-							or unsuccessfully (SO_ERROR is one of the usual error codes listed here, explaining the reason for the failure).
-	[  ] [EINTR]            The system call was interrupted by a signal that was caught; see signal(7).
-	[  ] [EISCONN]          The socket is already connected.
-	[  ] [ENETUNREACH]      Network is unreachable.
-	[  ] [ENOTSOCK]         The file descriptor is not associated with a socket.
-	[  ] [ETIMEDOUT]        Timeout while attempting connection. The server may be too busy to accept new connections. Note that for 
-							IP sockets the timeout may be very long when syncookies are enabled on the server.
+// Whether node is one of ours, errno set if it isn't
+static bool checkNode(zts_node_t node)
+{
+	ZeroTier::Mutex::Lock _l(nodes_m);
+	if(!node || std::find(nodes.begin(), nodes.end(), node) == nodes.end()) {
+		errno = EINVAL;
+		return false;
+	}
+	return true;
+}
 
+/*
+	[--] [EINVAL]           path or node is NULL.
+	[--] [EAGAIN]           zts_start() hasn't brought the service up.
+	[--] [EEXIST]           A node runs on path already.
+	[--] [EIO]              path could not be created.
+	Errors starting the node's thread are passed on as they are.
 */
-int zts_connect(ZT_CONNECT_SIG) {
-#if defined(STACK_PICO)
-	//DEBUG_INFO("fd = %d", fd);
-	int err = 0;
-	if(fd < 0) {
-		errno = EBADF;
-		DEBUG_ERROR("EBADF");
+int zts_node_start(const char *path, zts_node_t *node)
+{
+	if(!path || !node) {
+		errno = EINVAL;
 		return -1;
 	}
-	if(!zt1Service) {
-		DEBUG_ERROR("Service not started. Call zts_start(path) first");
-		errno = EBADF;
+	if(!zts_running()) {
+		errno = EAGAIN;
 		return -1;
 	}
-	ZeroTier::_multiplexer_lock.lock();
-	ZeroTier::Connection *conn = ZeroTier::unmap[fd];
-	ZeroTier::SocketTap *tap;
-
-	if(conn) {      
-		char ipstr[INET6_ADDRSTRLEN];
-		memset(ipstr, 0, INET6_ADDRSTRLEN);
-		ZeroTier::InetAddress iaddr;
-		int port = 0;
-
-		if(conn->socket_family == AF_INET) {
-			inet_ntop(AF_INET, 
-				(const void *)&((struct sockaddr_in *)addr)->sin_addr.s_addr, ipstr, INET_ADDRSTRLEN);
-			iaddr.fromString(ipstr);
-			port = ((struct sockaddr_in*)addr)->sin_port;
-		}
-		if(conn->socket_family == AF_INET6) {
-			inet_ntop(AF_INET6, 
-				(const void *)&((struct sockaddr_in6 *)addr)->sin6_addr.s6_addr, ipstr, INET6_ADDRSTRLEN);
-			// TODO: This is a hack, determine a proper way to do this
-			char addrstr[64];
-			sprintf(addrstr, "%s%s", ipstr, std::string("/88").c_str());
-			iaddr.fromString(addrstr);
-			port = ((struct sockaddr_in6*)addr)->sin6_port;
-		}
-		DEBUG_EXTRA("fd = %d, %s : %d", fd, ipstr, ntohs(port));
-		tap = getTapByAddr(iaddr);
-		if(!tap) {
-			DEBUG_ERROR("no route to host");
-			errno = ENETUNREACH;
-			err = -1;
-		}
-		else {
-			// pointer to tap we use in callbacks from the stack
-			conn->picosock->priv = new ZeroTier::ConnectionPair(tap, conn); 
-			err = tap->Connect(conn, fd, addr, addrlen); 
-			if(err == 0) {
-				tap->_Connections.push_back(conn); // Give this Connection to the tap we decided on
-				conn->tap = tap;
-			}
-			// Wrap the socketpair we created earlier
-			// For I/O loop participation and referencing the PhySocket's parent Connection in callbacks
-			conn->sock = tap->_phy.wrapSocket(conn->sdk_fd, conn);  
-			//DEBUG_ERROR("sock->fd = %d", tap->_phy.getDescriptor(conn->sock));      
-		}
+	ZeroTier::Mutex::Lock _l(nodes_m);
+	bool taken = ZeroTier::homeDir == path;
+	for(size_t i=0; i<nodes.size() && !taken; i++)
+		taken = nodes[i]->homeDir == path;
+	if(taken) {
+		errno = EEXIST;
+		return -1;
 	}
-	else {
-		DEBUG_ERROR("unable to locate connection");
-		errno = EBADF;
-		err = -1;
+	if(!makeHomePath(path)) {
+		errno = EIO;
+		return -1;
 	}
-	ZeroTier::unmap.erase(fd);
-	ZeroTier::fdmap[fd] = new std::pair<ZeroTier::Connection*,ZeroTier::SocketTap*>(conn, tap);
-	ZeroTier::_multiplexer_lock.unlock();
-
-	// NOTE: pico_socket_connect() will return 0 if no error happens immediately, but that doesn't indicate
-	// the connection was completed, for that we must wait for a callback from the stack. During that
-	// callback we will place the Connection in a ZT_SOCK_STATE_UNHANDLED_CONNECTED state to signal 
-	// to the multiplexer logic that this connection is complete and a success value can be sent to the
-	// user application
-
-	int f_err, blocking = 1;
-	if ((f_err = fcntl(fd, F_GETFL, 0)) < 0) {
-		DEBUG_ERROR("fcntl error, err = %s, errno = %d", f_err, errno);
-		err = -1;
-	} 
-	else {
-		blocking = !(f_err & O_NONBLOCK);
+	zts_node_t n = new zts_node();
+	n->service = (ZeroTier::OneService *)0;
+	n->homeDir = path;
+	n->port = randomServicePort();
+	int err = pthread_create(&n->thread, NULL, nodeMain, n);
+	if(err) {
+		delete n;
+		errno = err;
+		return -1;
 	}
+	nodes.push_back(n);
+	*node = n;
+	return 0;
+}
 
-	// non-blocking
-	if(err == 0 && !blocking) {
-		DEBUG_EXTRA("EINPROGRESS, not a real error, assuming non-blocking mode");
-		errno = EINPROGRESS;
-		err = -1;
-	}
-	else // blocking
+static void stopNode(zts_node_t node)
+{
+	if(node->service)
+		node->service->terminate();
+	dismantleNodeTaps(node->homeDir);
+	pthread_join(node->thread, NULL);
+	delete node;
+}
+
+/*
+	[--] [EINVAL]           node isn't a running node.
+*/
+int zts_node_stop(zts_node_t node)
+{
 	{
-		// FIXME: Double check that accept/connect queues in multithreaded apps don't get mixed up
-		if(err == 0 && blocking) {
-			bool complete = false;
-			while(true)
-			{
-				// FIXME: locking and unlocking so often might cause a performance bottleneck while outgoing connections
-				// are being established (also applies to accept())
-				usleep(ZT_CONNECT_RECHECK_DELAY * 1000);
-				//DEBUG_ERROR("waiting to connect...\n");
-				tap->_tcpconns_m.lock();
-				for(int i=0; i<tap->_Connections.size(); i++)
-				{
-					if(tap->_Connections[i]->state == PICO_ERR_ECONNRESET) {   
-						errno = ECONNRESET;
-						DEBUG_ERROR("ECONNRESET");
-						err = -1;
-					}
-					if(tap->_Connections[i]->state == ZT_SOCK_STATE_UNHANDLED_CONNECTED) {
-						tap->_Connections[i]->state = ZT_SOCK_STATE_CONNECTED;
-						errno = 0;
-						err = 0; // complete
-						complete = true;
-					}
-				}
-				tap->_tcpconns_m.unlock();
-				if(complete)
-					break;
-			}
+		ZeroTier::Mutex::Lock _l(nodes_m);
+		std::vector<zts_node_t>::iterator n = std::find(nodes.begin(), nodes.end(), node);
+		if(n == nodes.end()) {
+			errno = EINVAL;
+			return -1;
 		}
+		nodes.erase(n);
 	}
-	return err;
-#endif
+	stopNode(node);
 	return 0;
 }
 
-/*
+// By zts_stop(), nodes don't outlive the service they share stacks with
+static void stopNodes()
+{
+	std::vector<zts_node_t> all;
+	{
+		ZeroTier::Mutex::Lock _l(nodes_m);
+		all.swap(nodes);
+	}
+	for(size_t i=0; i<all.size(); i++)
+		stopNode(all[i]);
+}
 
-Darwin:
+int zts_node_running(zts_node_t node)
+{
+	return checkNode(node) && node->service && node->service->isRunning();
+}
 
-	[--] [EBADF]            S is not a valid descriptor.
-	[  ] [ENOTSOCK]         S is not a socket.
-	[--] [EADDRNOTAVAIL]    The specified address is not available from the local
-							machine.
-	[  ] [EADDRINUSE]       The specified address is already in use.
-	[  ] [EINVAL]           The socket is already bound to an address.
-	[  ] [EACCES]           The requested address is protected, and the current
-							user has inadequate permission to access it.
-	[  ] [EFAULT]           The name parameter is not in a valid part of the user
-							address space.
+/*
+	[--] [EINVAL]           node isn't a running node or nwid is NULL.
+	[--] [ENETDOWN]         The node's service isn't up (yet).
+	[--] [EEXIST]           Another node (or the service) of this process is on the network, the
+	                        stacks keep one tap per network.
+	[--] [EIO]              The node's networks.d couldn't be created.
 */
-int zts_bind(ZT_BIND_SIG) {
-	int err = 0;
-	if(fd < 0) {
-		errno = EBADF;
+int zts_node_join(zts_node_t node, const char *nwid)
+{
+	if(!checkNode(node) || !nwid) {
+		errno = EINVAL;
 		return -1;
 	}
-	if(!zt1Service) {
-		DEBUG_ERROR("Service not started. Call zts_start(path) first");        
-		errno = EBADF;
+	if(!node->service) {
+		errno = ENETDOWN;
 		return -1;
 	}
-	ZeroTier::_multiplexer_lock.lock();
-	ZeroTier::Connection *conn = ZeroTier::unmap[fd];
-	ZeroTier::SocketTap *tap;
-	
-	if(conn) {     
-		char ipstr[INET6_ADDRSTRLEN];
-		memset(ipstr, 0, INET6_ADDRSTRLEN);
-		ZeroTier::InetAddress iaddr;
-		int port = 0;
-		if(conn->socket_family == AF_INET) {
-			inet_ntop(AF_INET, 
-				(const void *)&((struct sockaddr_in *)addr)->sin_addr.s_addr, ipstr, INET_ADDRSTRLEN);
-			port = ((struct sockaddr_in*)addr)->sin_port;
-		}
-		if(conn->socket_family == AF_INET6) {
-			inet_ntop(AF_INET6, 
-				(const void *)&((struct sockaddr_in6 *)addr)->sin6_addr.s6_addr, ipstr, INET6_ADDRSTRLEN);
-			port = ((struct sockaddr_in6*)addr)->sin6_port;
-		}
-		DEBUG_EXTRA("fd = %d, %s : %d", fd, ipstr, ntohs(port));
-		iaddr.fromString(ipstr);
-		tap = getTapByAddr(iaddr);
-
-		if(!tap) {
-			DEBUG_ERROR("no matching interface to bind to");            
-			errno = EADDRNOTAVAIL;
-			err = -1;
-		}
-#if defined(STACK_PICO) 
-		else {
-			conn->picosock->priv = new ZeroTier::ConnectionPair(tap, conn);
-			tap->_Connections.push_back(conn); // Give this Connection to the tap we decided on
-			err = tap->Bind(conn, fd, addr, addrlen);
-			conn->tap = tap;
-			if(err == 0) { // success
-				ZeroTier::unmap.erase(fd);
-				ZeroTier::fdmap[fd] = new std::pair<ZeroTier::Connection*,ZeroTier::SocketTap*>(conn, tap);
-			}
-		}
-#endif
-#if defined(STACK_LWIP)
-		else {
-			tap->_Connections.push_back(conn);
-			err = tap->Bind(conn, fd, addr, addrlen);
-			if(err == 0) { // success
-				ZeroTier::unmap.erase(fd);
-				ZeroTier::fdmap[fd] = new std::pair<ZeroTier::Connection*,ZeroTier::SocketTap*>(conn, tap);
-			}
-		}
-#endif
+	ZeroTier::SocketTap *tap = getTapByNWID(strtoull(nwid, NULL, 16));
+	if(tap && tap->_homePath != node->homeDir) {
+		errno = EEXIST;
+		return -1;
 	}
-	else {
-		DEBUG_ERROR("unable to locate connection");
-		errno = EBADF;
-		err = -1;
+	std::string dir = node->homeDir + "/networks.d";
+	if(!ZeroTier::OSUtils::mkdir(dir)) {
+		DEBUG_ERROR("unable to create: %s", dir.c_str());
+		errno = EIO;
+		return -1;
 	}
-	ZeroTier::_multiplexer_lock.unlock();
-	return err;
+	ZeroTier::StateWriter::write(dir + "/" + nwid + ".conf", "");
+	node->service->join(nwid);
+	return 0;
 }
 
 /*
-
-Darwin:
-
-	[--] [EACCES]           The current process has insufficient privileges.
-	[--] [EBADF]            The argument socket is not a valid file descriptor.
-	[--] [EDESTADDRREQ]     The socket is not bound to a local address and the protocol does not support listening on an unbound socket.
-	[  ] [EINVAL]           socket is already connected.
-	[  ] [ENOTSOCK]         The argument socket does not reference a socket.
-	[  ] [EOPNOTSUPP]       The socket is not of a type that supports the operation listen().
-
-Linux:
-
-	[  ] [EADDRINUSE]       Another socket is already listening on the same port.
-	[--] [EBADF]            The argument sockfd is not a valid descriptor.
-	[  ] [ENOTSOCK]         The argument sockfd is not a socket.
-	[  ] [EOPNOTSUPP]       The socket is not of a type that supports the listen() operation.
+	[--] [EINVAL]           node isn't a running node or nwid is NULL.
+	[--] [ENETDOWN]         The node's service isn't up (yet).
 */
-int zts_listen(ZT_LISTEN_SIG) {
-#if defined(STACK_PICO)
-	DEBUG_EXTRA("fd = %d", fd);
-	int err = 0;
-	if(fd < 0) {
-		errno = EBADF;
+int zts_node_leave(zts_node_t node, const char *nwid)
+{
+	if(!checkNode(node) || !nwid) {
+		errno = EINVAL;
 		return -1;
 	}
-	if(!zt1Service) {
-		DEBUG_ERROR("service not started. call zts_start(path) first");
-		errno = EACCES;
+	if(!node->service) {
+		errno = ENETDOWN;
 		return -1;
 	}
-	ZeroTier::_multiplexer_lock.lock();
-	std::pair<ZeroTier::Connection*, ZeroTier::SocketTap*> *p = ZeroTier::fdmap[fd];
-	if(!p) {
-		DEBUG_ERROR("unable to locate connection pair. did you bind?");
-		errno = EDESTADDRREQ;
+	ZeroTier::StateWriter::remove(node->homeDir + "/networks.d/" + nwid + ".conf");
+	node->service->leave(nwid);
+	return 0;
+}
+
+/*
+	[--] [EINVAL]           node isn't a running node or devID is NULL.
+	[--] [ENETDOWN]         The node's service isn't up (yet).
+*/
+int zts_node_get_device_id(zts_node_t node, char *devID)
+{
+	if(!checkNode(node) || !devID) {
+		errno = EINVAL;
 		return -1;
 	}
-	ZeroTier::Connection *conn = p->first;
-	ZeroTier::SocketTap *tap = p->second;
-	if(!tap || !conn) {
-		DEBUG_ERROR("unable to locate tap interface for file descriptor");
-		errno = EBADF;
+	if(!node->service) {
+		errno = ENETDOWN;
 		return -1;
 	}
-	if(!err) {
-		backlog = backlog > 128 ? 128 : backlog; // See: /proc/sys/net/core/somaxconn
-		err = tap->Listen(conn, fd, backlog);
-		conn->state = ZT_SOCK_STATE_LISTENING;
-		ZeroTier::_multiplexer_lock.unlock();
-	}
-	return err;
-#endif
+	snprintf(devID, ZT_ID_LEN+1, "%.10llx", (unsigned long long)node->service->getNode()->address());
 	return 0;
 }
 
 /*
-
-Darwin:
-
-	[--] [EBADF]            The descriptor is invalid.
-	[  ] [ENOTSOCK]         The descriptor references a file, not a socket.
-	[  ] [EOPNOTSUPP]       The referenced socket is not of type SOCK_STREAM.
-	[  ] [EFAULT]           The addr parameter is not in a writable part of the
-							user address space.
-	[--] [EWOULDBLOCK]      The socket is marked non-blocking and no connections
-							are present to be accepted.
-	[--] [EMFILE]           The per-process descriptor table is full.
-	[  ] [ENFILE]           The system file table is full.
+	[--] [EBADF]            fd isn't a socket of this library.
+	[--] [ENOENT]           The socket isn't on any node's network yet (not bound or connected), or
+	                        it's on that of the service zts_start() runs.
 */
-int zts_accept(ZT_ACCEPT_SIG) {
-#if defined(STACK_PICO)
-	DEBUG_EXTRA("fd = %d", fd);
-	int err = 0;
-	if(fd < 0) {
+int zts_get_socket_node(int fd, zts_node_t *node)
+{
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+	ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+	if(!conn || !node) {
 		errno = EBADF;
 		return -1;
 	}
-	else
-	{
-		// +1 since we'll be creating a new pico_socket when we accept the connection
-		if(pico_ntimers()+1 >= PICO_MAX_TIMERS) {
-			DEBUG_ERROR("cannot provision additional socket due to limitation of PICO_MAX_TIMERS.");
-			errno = EMFILE;
-			err = -1;
-		}
-		ZeroTier::_multiplexer_lock.lock();
-		std::pair<ZeroTier::Connection*, ZeroTier::SocketTap*> *p = ZeroTier::fdmap[fd];
-		if(!p) {
-			DEBUG_ERROR("unable to locate connection pair (did you zts_bind())?");
-			errno = EBADF;
-			err = -1;
-		}
-		else {
-			ZeroTier::Connection *conn = p->first;
-			ZeroTier::SocketTap *tap = p->second;
-
-			// BLOCKING: loop and keep checking until we find a newly accepted connection
-			int f_err, blocking = 1;
-			if ((f_err = fcntl(fd, F_GETFL, 0)) < 0) {
-				DEBUG_ERROR("fcntl error, err = %s, errno = %d", f_err, errno);
-				err = -1;
-			} 
-			else {
-				blocking = !(f_err & O_NONBLOCK);
-			}
-			if(!err) {
-				ZeroTier::Connection *accepted_conn;
-				if(!blocking) { // non-blocking
-					DEBUG_EXTRA("EWOULDBLOCK, not a real error, assuming non-blocking mode");
-					errno = EWOULDBLOCK;
-					err = -1;
-					accepted_conn = tap->Accept(conn);
-				}
-				else { // blocking
-					while(true) {
-						usleep(ZT_ACCEPT_RECHECK_DELAY * 1000);
-						accepted_conn = tap->Accept(conn);
-						if(accepted_conn)
-							break; // accepted fd = err
-					}
-				}
-				if(accepted_conn) {
-					ZeroTier::fdmap[accepted_conn->app_fd] = new std::pair<ZeroTier::Connection*,ZeroTier::SocketTap*>(accepted_conn, tap);
-					err = accepted_conn->app_fd;
-				}
-			}
+	ZeroTier::SocketTap *tap = (ZeroTier::SocketTap *)conn->tap;
+	ZeroTier::Mutex::Lock _l(nodes_m);
+	for(size_t i=0; tap && i<nodes.size(); i++) {
+		if(nodes[i]->homeDir == tap->_homePath) {
+			*node = nodes[i];
+			return 0;
 		}
-		ZeroTier::_multiplexer_lock.unlock();
 	}
-	return err;
-#endif
-	return 0;
+	errno = ENOENT;
+	return -1;
 }
 
+void zts_get_homepath(char *homePath, int len) { 
+	if(ZeroTier::homeDir.length()) {
+		memset(homePath, 0, len);
+		memcpy(homePath, ZeroTier::homeDir.c_str(), len < ZeroTier::homeDir.length() ? len : ZeroTier::homeDir.length());
+	}
+}
 
-/*
-Linux accept() (and accept4()) passes already-pending network errors on the new socket as an error code from accept(). This behavior differs from other BSD socket implementations. For reliable operation the application should detect the network errors defined for the protocol after accept() and treat them like EAGAIN by retrying. In the case of TCP/IP, these are ENETDOWN, EPROTO, ENOPROTOOPT, EHOSTDOWN, ENONET, EHOSTUNREACH, EOPNOTSUPP, and ENETUNREACH.
-Errors
-
-	[  ] [EAGAIN or EWOULDBLOCK]   The socket is marked nonblocking and no connections are present to be accepted. POSIX.1-2001 allows either error to be returned for this case, and does not require these constants to have the same value, so a portable application should check for both possibilities.
-	[--] [EBADF]                   The descriptor is invalid.
-	[  ] [ECONNABORTED]            A connection has been aborted.
-	[  ] [EFAULT]                  The addr argument is not in a writable part of the user address space.
-	[NA] [EINTR]                   The system call was interrupted by a signal that was caught before a valid connection arrived; see signal(7).
-	[  ] [EINVAL]                  Socket is not listening for connections, or addrlen is invalid (e.g., is negative).
-	[  ] [EINVAL]                  (accept4()) invalid value in flags.
-	[  ] [EMFILE]                  The per-process limit of open file descriptors has been reached.
-	[  ] [ENFILE]                  The system limit on the total number of open files has been reached.
-	[  ] [ENOBUFS, ENOMEM]         Not enough free memory. This often means that the memory allocation is limited by the socket buffer limits, not by the system memory.
-	[  ] [ENOTSOCK]                The descriptor references a file, not a socket.
-	[  ] [EOPNOTSUPP]              The referenced socket is not of type SOCK_STREAM.
-	[  ] [EPROTO]                  Protocol error.
+void zts_core_version(char *ver) {
+	int major, minor, revision;
+	ZT_version(&major, &minor, &revision);
+	sprintf(ver, "%d.%d.%d", major, minor, revision);
+}
 
-In addition, Linux accept() may fail if:
+void zts_lib_version(char *ver) {
+	sprintf(ver, "%d.%d.%d", ZT_LIB_VERSION_MAJOR, ZT_LIB_VERSION_MINOR, ZT_LIB_VERSION_REVISION);
+}
 
-EPERM Firewall rules forbid connection.
-*/
-#if defined(__linux__)
-	int zts_accept4(ZT_ACCEPT4_SIG)
+int zts_get_device_id(char *devID) { 
+	if(zt1Service) {
+		char id[ZT_ID_LEN+1];
+		sprintf(id, "%lx",zt1Service->getNode()->address());
+		memcpy(devID, id, ZT_ID_LEN+1);
+		return 0;
+	}
+	else // Service isn't online, try to read ID from file
 	{
-		DEBUG_INFO("fd = %d", fd);
-		int err = 0;
-		if(fd < 0) {
-			errno = EBADF;
-			err = -1;
+		std::string fname("identity.public");
+		std::string fpath(ZeroTier::homeDir);
+
+		if(ZeroTier::OSUtils::fileExists((fpath + ZT_PATH_SEPARATOR_S + fname).c_str(),false)) {
+			std::string oldid;
+			ZeroTier::OSUtils::readFile((fpath + ZT_PATH_SEPARATOR_S + fname).c_str(),oldid);
+			memcpy(devID, oldid.c_str(), ZT_ID_LEN); // first 10 bytes of file
+			return 0;
 		}
-		return 0;
 	}
-#endif
+	return -1;
+}
+
+int zts_running() { 
+	return !zt1Service ? false : zt1Service->isRunning(); 
+}
+
+int zts_has_ipv4_address(const char *nwid)
+{
+	char ipv4_addr[ZT_MAX_IPADDR_LEN];
+	memset(ipv4_addr, 0, ZT_MAX_IPADDR_LEN);
+	zts_get_ipv4_address(nwid, ipv4_addr, ZT_MAX_IPADDR_LEN);
+	return strcmp(ipv4_addr, "\0");
+}
+
+int zts_has_ipv6_address(const char *nwid)
+{
+	char ipv6_addr[ZT_MAX_IPADDR_LEN];
+	memset(ipv6_addr, 0, ZT_MAX_IPADDR_LEN);
+	zts_get_ipv6_address(nwid, ipv6_addr, ZT_MAX_IPADDR_LEN);
+	return strcmp(ipv6_addr, "\0");
+}
+
+int zts_has_address(const char *nwid)
+{
+	return zts_has_ipv4_address(nwid) || zts_has_ipv6_address(nwid);
+}
+
+// Copies src into dst (len bytes), always terminated
+static void copyAddrString(char *dst, const char *src, int len)
+{
+	if(len <= 0)
+		return;
+	strncpy(dst, src, len);
+	dst[len-1] = 0;
+}
+
+void zts_get_ipv4_address(const char *nwid, char *addrstr, const int addrlen)
+{
+	ZeroTier::TapAddresses a;
+	if(zt1Service && ZeroTier::tapindex.addresses(strtoull(nwid, NULL, 16), &a))
+		copyAddrString(addrstr, a.ipv4_cidr, addrlen);
+	else if(addrlen > 0)
+		addrstr[0] = 0;
+}
+
+void zts_get_ipv6_address(const char *nwid, char *addrstr, const int addrlen)
+{
+	ZeroTier::TapAddresses a;
+	if(zt1Service && ZeroTier::tapindex.addresses(strtoull(nwid, NULL, 16), &a))
+		copyAddrString(addrstr, a.ipv6_cidr, addrlen);
+	else if(addrlen > 0)
+		addrstr[0] = 0;
+}
+
+// True if devID is this device, whose derived addresses the tap for nwid has formatted already
+static bool ownAddresses(uint64_t nwid, uint64_t devID, ZeroTier::TapAddresses *a)
+{
+	return zt1Service && zt1Service->getNode()->address() == devID && ZeroTier::tapindex.addresses(nwid, a);
+}
+
+void zts_get_6plane_addr(char *addr, const char *nwid, const char *devID)
+{
+	uint64_t nwid_int = ZeroTier::Utils::hexStrToU64(nwid), dev = ZeroTier::Utils::hexStrToU64(devID);
+	ZeroTier::TapAddresses a;
+	if(ownAddresses(nwid_int, dev, &a)) {
+		memcpy(addr, a.pub.sixplane, 40);
+		return;
+	}
+	ZeroTier::InetAddress _6planeAddr = ZeroTier::InetAddress::makeIpv66plane(nwid_int, dev);
+	char ipbuf[64];
+	memcpy(addr, _6planeAddr.toIpString(ipbuf), 40);
+}
 
+void zts_get_rfc4193_addr(char *addr, const char *nwid, const char *devID)
+{
+	uint64_t nwid_int = ZeroTier::Utils::hexStrToU64(nwid), dev = ZeroTier::Utils::hexStrToU64(devID);
+	ZeroTier::TapAddresses a;
+	if(ownAddresses(nwid_int, dev, &a)) {
+		memcpy(addr, a.pub.rfc4193, 40);
+		return;
+	}
+	ZeroTier::InetAddress _6planeAddr = ZeroTier::InetAddress::makeIpv6rfc4193(nwid_int, dev);
+	char ipbuf[64];
+	memcpy(addr, _6planeAddr.toIpString(ipbuf), 40);
+}
 
 /*
-	[--] [EBADF]            The argument s is not a valid descriptor.
-	[  ] [ENOTSOCK]         The argument s is a file, not a socket.
-	[--] [ENOPROTOOPT]      The option is unknown at the level indicated.
-	[  ] [EFAULT]           The address pointed to by optval is not in a valid
-							part of the process address space.  For getsockopt(),
-							this error may also be returned if optlen is not in a
-							valid part of the process address space.
-	[  ] [EDOM]             The argument value is out of bounds.
+	[--] [EINVAL]           nwid or addrs is NULL.
+	[--] [ENODEV]           This device hasn't joined the network nwid (or the service isn't running).
 */
-int zts_setsockopt(ZT_SETSOCKOPT_SIG)
+int zts_get_network_addresses(const char *nwid, struct zts_network_addresses *addrs)
 {
-#if defined(STACK_PICO)
-	DEBUG_INFO("fd = %d", fd);
-	int err = 0;
-	if(fd < 0) {
-		errno = EBADF;
-		err = -1;
+	if(!nwid || !addrs) {
+		errno = EINVAL;
+		return -1;
+	}
+	ZeroTier::TapAddresses a;
+	if(!zt1Service || !ZeroTier::tapindex.addresses(strtoull(nwid, NULL, 16), &a)) {
+		errno = ENODEV;
+		return -1;
 	}
+	memcpy(addrs, &(a.pub), sizeof(*addrs));
+	return 0;
+}
 
-	// Disable Nagle's algorithm
-	struct pico_socket *p = NULL;
-	err = zts_get_pico_socket(fd, &p);
-	if(p) {
-		int value = 1;
-		if((err = pico_socket_setoption(p, PICO_TCP_NODELAY, &value)) < 0) {
-			if(err == PICO_ERR_EINVAL) {
-				DEBUG_ERROR("error while disabling Nagle's algorithm");
-				errno = ENOPROTOOPT;
-				return -1;
-			}
+// Re-reads the peer list from the core if the cached one is older than ZT_PEER_CACHE_TTL. Caller holds _peer_cache_lock
+static void refreshPeers()
+{
+	uint64_t now = ZeroTier::OSUtils::now();
+	if(ZeroTier::peerCacheTime && now - ZeroTier::peerCacheTime < ZT_PEER_CACHE_TTL)
+		return;
+	ZeroTier::Node *node = zt1Service ? zt1Service->getNode() : NULL;
+	ZT_PeerList *pl = node ? node->peers() : NULL;
+	ZeroTier::peerCache.clear();
+	ZeroTier::peerIndex.clear();
+	ZeroTier::peerCacheTime = now;
+	if(!pl) {
+		ZeroTier::upstreams.clear();
+		return;
+	}
+	ZeroTier::peerCache.resize(pl->peerCount);
+	for(unsigned long i=0; i<pl->peerCount; i++) {
+		ZT_Peer *p = &(pl->peers[i]);
+		struct zts_peer_info *info = &(ZeroTier::peerCache[i]);
+		memset(info, 0, sizeof(*info));
+		info->address = p->address;
+		info->latency = p->latency ? (int)p->latency : -1;
+		info->role = p->role == ZT_PEER_ROLE_PLANET ? ZTS_PEER_ROLE_PLANET
+			: (p->role == ZT_PEER_ROLE_MOON ? ZTS_PEER_ROLE_MOON : ZTS_PEER_ROLE_LEAF);
+		info->version[0] = p->versionMajor;
+		info->version[1] = p->versionMinor;
+		info->version[2] = p->versionRev;
+		int best = -1;
+		for(unsigned int j=0; j<p->pathCount; j++) {
+			if(p->paths[j].expired)
+				continue;
+			info->paths++;
+			if(best < 0 || (p->paths[j].preferred && !p->paths[best].preferred) ||
+				(p->paths[j].preferred == p->paths[best].preferred && p->paths[j].lastReceive > p->paths[best].lastReceive))
+				best = j;
 		}
+		if(best >= 0) {
+			memcpy(&(info->preferred), &(p->paths[best].address), sizeof(info->preferred));
+			info->last_receive = p->paths[best].lastReceive;
+		}
+		std::unordered_map<uint64_t, ZeroTier::peer_direct>::iterator t = ZeroTier::traversal.peers.find(p->address);
+		if(t == ZeroTier::traversal.peers.end()) {
+			ZeroTier::peer_direct d;
+			d.first_seen = ZeroTier::traversal.sampled ? now : ZeroTier::traversal.start;
+			d.time_to_direct = -1;
+			t = ZeroTier::traversal.peers.insert(std::make_pair(p->address, d)).first;
+		}
+		t->second.role = info->role;
+		if(info->last_receive && t->second.time_to_direct < 0) {
+			t->second.time_to_direct = (int)(now - std::min(now, t->second.first_seen));
+			if(info->role == ZTS_PEER_ROLE_LEAF && ZeroTier::traversal.first_direct < 0)
+				ZeroTier::traversal.first_direct = (int)(now - std::min(now, ZeroTier::traversal.start));
+		}
+		info->time_to_direct = t->second.time_to_direct;
+		ZeroTier::peerIndex[p->address] = i;
+	}
+	node->freeQueryResult((void *)pl);
+	ZeroTier::traversal.sampled = true;
+	ZeroTier::upstreams.sample(ZeroTier::peerCache, now);
+}
+
+unsigned long zts_get_peer_count() {
+	ZeroTier::Mutex::Lock _l(ZeroTier::_peer_cache_lock);
+	refreshPeers();
+	return ZeroTier::peerCache.size();
+}
 
+/*
+	[--] [EINVAL]           peer or devID is NULL.
+	[--] [ENOENT]           No such peer is known to the service.
+	[--] [ENETUNREACH]      The peer is only reachable through a relay.
+*/
+int zts_get_peer_address(char *peer, const char *devID) {
+	if(!peer || !devID) {
+		errno = EINVAL;
+		return -1;
 	}
-	err = setsockopt(fd, level, optname, optval, optlen);
-	return err;
-#endif
+	ZeroTier::Mutex::Lock _l(ZeroTier::_peer_cache_lock);
+	refreshPeers();
+	std::unordered_map<uint64_t, size_t>::iterator it = ZeroTier::peerIndex.find(ZeroTier::Utils::hexStrToU64(devID));
+	if(it == ZeroTier::peerIndex.end()) {
+		errno = ENOENT;
+		return -1;
+	}
+	struct zts_peer_info *info = &(ZeroTier::peerCache[it->second]);
+	if(!info->preferred.ss_family) {
+		errno = ENETUNREACH;
+		return -1;
+	}
+	char ipbuf[64];
+	ZeroTier::InetAddress addr((const struct sockaddr *)&(info->preferred));
+	strncpy(peer, addr.toIpString(ipbuf), INET6_ADDRSTRLEN);
+	peer[INET6_ADDRSTRLEN-1] = 0;
 	return 0;
 }
 
 /*
-	[--] [EBADF]            The argument s is not a valid descriptor.
-	[  ] [ENOTSOCK]         The argument s is a file, not a socket.
-	[  ] [ENOPROTOOPT]      The option is unknown at the level indicated.
-	[  ] [EFAULT]           The address pointed to by optval is not in a valid
-							part of the process address space.  For getsockopt(),
-							this error may also be returned if optlen is not in a
-							valid part of the process address space.
-	[  ] [EDOM]             The argument value is out of bounds.
+	[--] [EINVAL]           n is negative, or peers is NULL and n isn't 0.
+*/
+int zts_get_peers(struct zts_peer_info *peers, int n) {
+	if(n < 0 || (!peers && n)) {
+		errno = EINVAL;
+		return -1;
+	}
+	ZeroTier::Mutex::Lock _l(ZeroTier::_peer_cache_lock);
+	refreshPeers();
+	size_t count = ZeroTier::peerCache.size();
+	if(n && count)
+		memcpy(peers, &(ZeroTier::peerCache[0]), std::min(count, (size_t)n) * sizeof(*peers));
+	return (int)count;
+}
 
+/*
+	[--] [EINVAL]           info is NULL and n isn't 0.
 */
-int zts_getsockopt(ZT_GETSOCKOPT_SIG)
-{
-	//DEBUG_INFO("fd = %d", fd);    
-	int err = 0;
-	if(fd < 0) {
-		errno = EBADF;
-		err = -1;
+int zts_get_upstreams(struct zts_upstream_info *info, int n) {
+	if(n < 0 || (!info && n)) {
+		errno = EINVAL;
+		return -1;
 	}
-	err = getsockopt(fd, level, optname, optval, optlen);
-	return err;
+	ZeroTier::Mutex::Lock _l(ZeroTier::_peer_cache_lock);
+	refreshPeers();
+	const std::vector<struct zts_upstream_info> &ups = ZeroTier::upstreams.list();
+	if(n && ups.size())
+		memcpy(info, &ups[0], std::min(ups.size(), (size_t)n) * sizeof(*info));
+	return (int)ups.size();
 }
 
 /*
-	[--] [EBADF]            The argument s is not a valid descriptor.
-	[  ] [ENOTSOCK]         The argument s is a file, not a socket.
-	[  ] [ENOBUFS]          Insufficient resources were available in the system to
-							perform the operation.
-	[  ] [EFAULT]           The name parameter points to memory not in a valid
-							part of the process address space.
+	[--] [EINVAL]           cfg is NULL, or more ports would be tried for a peer than ZT_NAT_HINTS_MAX.
 */
-int zts_getsockname(ZT_GETSOCKNAME_SIG)
-{
-	DEBUG_INFO("fd = %d", fd);
-	int err = 0;
-	if(fd < 0) {
-		errno = EBADF;
-		err = -1;
+int zts_set_nat_traversal(const struct zts_nat_traversal *cfg) {
+	if(!cfg || cfg->predict_ports + cfg->random_ports > ZT_NAT_HINTS_MAX) {
+		errno = EINVAL;
+		return -1;
 	}
-	// TODO
-	return err;
+	ZeroTier::Mutex::Lock _l(ZeroTier::_peer_cache_lock);
+	ZeroTier::natTraversal = *cfg;
+	return 0;
 }
 
 /*
-	[--] [EBADF]            The argument s is not a valid descriptor.
-	[  ] [ENOTSOCK]         The argument s is a file, not a socket.
-	[  ] [ENOTCONN]         The socket is not connected.
-	[  ] [ENOBUFS]          Insufficient resources were available in the system to
-							perform the operation.
-	[  ] [EFAULT]           The name parameter points to memory not in a valid
-							part of the process address space.
+	[--] [EINVAL]           cfg is NULL.
 */
-int zts_getpeername(ZT_GETPEERNAME_SIG)
-{
-	DEBUG_INFO("fd = %d", fd);
-	int err = 0;
-	if(fd < 0) {
-		errno = EBADF;
-		err = -1;
+int zts_get_nat_traversal(struct zts_nat_traversal *cfg) {
+	if(!cfg) {
+		errno = EINVAL;
+		return -1;
 	}
-	// TODO
-	return err;
+	ZeroTier::Mutex::Lock _l(ZeroTier::_peer_cache_lock);
+	*cfg = ZeroTier::natTraversal;
+	return 0;
 }
 
 /*
+	[--] [EINVAL]           stats is NULL.
+*/
+int zts_get_traversal_stats(struct zts_traversal_stats *stats) {
+	if(!stats) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(stats, 0, sizeof(*stats));
+	ZeroTier::Mutex::Lock _l(ZeroTier::_peer_cache_lock);
+	refreshPeers();
+	for(size_t i=0; i<ZeroTier::peerCache.size(); i++) {
+		if(ZeroTier::peerCache[i].role != ZTS_PEER_ROLE_LEAF)
+			continue;
+		if(ZeroTier::peerCache[i].last_receive)
+			stats->peers_direct++;
+		else
+			stats->peers_relayed++;
+	}
+	uint64_t total = 0;
+	stats->time_to_direct_max_ms = -1;
+	for(std::unordered_map<uint64_t, ZeroTier::peer_direct>::iterator t(ZeroTier::traversal.peers.begin());
+		t != ZeroTier::traversal.peers.end(); ++t) {
+		if(t->second.role != ZTS_PEER_ROLE_LEAF || t->second.time_to_direct < 0)
+			continue;
+		stats->went_direct++;
+		total += t->second.time_to_direct;
+		stats->time_to_direct_max_ms = std::max(stats->time_to_direct_max_ms, t->second.time_to_direct);
+	}
+	stats->time_to_direct_avg_ms = stats->went_direct ? (int)(total / stats->went_direct) : -1;
+	stats->first_direct_ms = ZeroTier::traversal.first_direct;
+	stats->hints = ZeroTier::traversal.hints;
+	stats->hints_predicted = ZeroTier::traversal.hints_predicted;
+	return 0;
+}
 
-Linux:
+uint64_t zts_get_preferred_upstream() {
+	ZeroTier::Mutex::Lock _l(ZeroTier::_peer_cache_lock);
+	refreshPeers();
+	return ZeroTier::upstreams.preferred();
+}
 
-	See: http://yarchive.net/comp/linux/close_return_value.html
+void zts_enable_http_control_plane()
+{
+	ZeroTier::HttpControlPlane::start(ZT_HTTP_CONTROL_PLANE_ADDR, ZT_HTTP_CONTROL_PLANE_PORT);
+}
 
-Linux / Darwin:
+void zts_disable_http_control_plane()
+{
+	ZeroTier::HttpControlPlane::stop();
+}
 
-	[--] [EBADF]            fildes is not a valid, active file descriptor.
-	[NA] [EINTR]            Its execution was interrupted by a signal.
-	[  ] [EIO]              A previously-uncommitted write(2) encountered an input/output error.
-*/
+void zts_enable_peer_path_cache()
+{
+	ZeroTier::peerPathCache = true;
+}
 
-int zts_close(ZT_CLOSE_SIG)
+void zts_disable_peer_path_cache()
 {
-#if defined(STACK_PICO)
-	DEBUG_EXTRA("fd = %d", fd);
-	int err = 0;
-	if(fd < 0) {
-		errno = EBADF;
-		err = -1;
+	ZeroTier::peerPathCache = false;
+}
+
+int zts_get_metrics(char *buf, size_t len)
+{
+	if(!buf && len) {
+		errno = EINVAL;
+		return -1;
 	}
-	else
+	std::string text = ZeroTier::metricsText();
+	if(len) {
+		size_t n = std::min(len - 1, text.length());
+		memcpy(buf, text.data(), n);
+		buf[n] = '\0';
+	}
+	return (int)text.length();
+}
+
+/****************************************************************************/
+/* SocketTap Multiplexer Functionality                                      */
+/* - This section of the API is used to implement the general socket        */
+/*   controls. Basically this is designed to handle socket provisioning     */
+/*   requests when no SocketTap is yet initialized, and as a way to         */
+/*   determine which SocketTap is to be used for a particular connect() or  */ 
+/*   bind() call. This enables multi-network support                        */
+/****************************************************************************/
+
+/*
+
+Darwin:
+
+	[  ] [EACCES]           Permission to create a socket of the specified type and/or protocol is denied.
+	[  ] [EAFNOSUPPORT]     The specified address family is not supported.
+	[--] [EMFILE]           The per-process descriptor table is full.
+	[NA] [ENFILE]           The system file table is full.
+	[--] [ENOBUFS]          Insufficient buffer space is available.  The socket cannot be created until sufficient resources are freed.
+	[  ] [ENOMEM]           Insufficient memory was available to fulfill the request.
+	[--] [EPROTONOSUPPORT]  The protocol type or the specified protocol is not supported within this domain.
+	[  ] [EPROTOTYPE]       The socket type is not supported by the protocol.
+*/
+
+// How many more sockets may be open before zts_stack_config.max_sockets is reached
+static int socketsAvailable()
+{
+	int max = ZeroTier::stackConfig.max_sockets;
+	return max ? std::max(max - (int)ZeroTier::fdtable.size(), 0) : INT_MAX;
+}
+
+// int socket_family, int socket_type, int protocol
+int zts_socket(ZT_SOCKET_SIG) {
+	errno = 0;
+	if(socket_family < 0 || socket_type < 0 || protocol < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	int err = 0;
+	if(!serviceRunning()) {
+		DEBUG_ERROR("cannot create socket, no service running. call zts_start() first.");
+		errno = EMFILE; // could also be ENFILE
+		return -1;
+	}
+	// Streams aren't stack sockets, they are carried by one (see ZT_SOCK_MUX)
+	if(socket_type == ZT_SOCK_MUX)
+		return ZeroTier::Mux::socket(socket_family);
+	if(!socketsAvailable()) {
+		DEBUG_ERROR("cannot create socket, see zts_stack_config.max_sockets");
+		errno = EMFILE;
+		return -1;
+	}
+	if(!ZeroTier::MemBudget::admitSocket()) {
+		DEBUG_ERROR("cannot create socket, see zts_stack_config.mem_limit_kb");
+		errno = ENOBUFS;
+		return -1;
+	}
+	if(socket_type == SOCK_SEQPACKET) {
+		DEBUG_ERROR("SOCK_SEQPACKET not yet supported.");
+		errno = EPROTONOSUPPORT; // seemingly closest match
+		return -1;
+	}
+
+	if(socket_type == ZT_SOCK_MSG && socket_family != ZTS_AF_MSG) {
+		errno = EAFNOSUPPORT;
+		return -1;
+	}
+
+	ZeroTier::_multiplexer_lock.lock();
+
+	if(socket_type == SOCK_RAW || socket_type == ZT_SOCK_MSG)
+	{
+		// Connection is only used to associate a socket with a SocketTap, it has no other implication
+		ZeroTier::Connection *conn = ZeroTier::connpool.get(socket_type);
+		conn->socket_family = socket_family;
+		conn->socket_type = socket_type;
+		conn->protocol = protocol;
+		ZeroTier::fdtable.add(conn->app_fd, conn);
+		ZeroTier::_multiplexer_lock.unlock();
+		return conn->app_fd;
+	}
+
+	// Which network (and so which stack) the socket is for isn't known until it's bound or
+	// connected, it starts out on the default stack (see stackAssign())
+	ZeroTier::StackDriver *driver = ZeroTier::defaultStackDriver();
+	if(driver) {
+		// A userspace descriptor stands for a TCP socket in direct I/O mode, nothing needs the
+		// socketpair unless zts_get_native_fd() asks for one
+		int ufd = -1;
+#if defined(STACK_PICO)
+		if(ZeroTier::stackConfig.userspace_fds && socket_type == SOCK_STREAM
+			&& (ufd = ZeroTier::fdtable.alloc_userspace()) < 0) {
+			ZeroTier::_multiplexer_lock.unlock();
+			errno = EMFILE;
+			return -1;
+		}
+#endif
+		ZeroTier::Connection *conn = ZeroTier::connpool.get(socket_type, ufd);
+		conn->socket_family = socket_family;
+		conn->socket_type = socket_type;
+		conn->protocol = protocol;
+		if(ufd >= 0)
+			conn->direct = true;
+		if(driver->Socket(conn) < 0) {
+			DEBUG_ERROR("failed to create stack socket");
+			if(ufd >= 0)
+				ZeroTier::fdtable.free_userspace(ufd);
+			ZeroTier::connpool.recycle(conn);
+			err = -1;
+		}
+		else {
+			ZeroTier::fdtable.add(conn->app_fd, conn);
+			err = conn->app_fd; // return one end of the socketpair (or the userspace descriptor)
+		}
+	}
+
+	ZeroTier::_multiplexer_lock.unlock();
+	return err;
+}
+
+
+/*
+
+Darwin:
+
+	[  ] [EACCES]           The destination address is a broadcast address and the socket option SO_BROADCAST is not set.
+	[  ] [EADDRINUSE]       The address is already in use.
+	[  ] [EADDRNOTAVAIL]    The specified address is not available on this machine.
+	[  ] [EAFNOSUPPORT]     Addresses in the specified address family cannot be used with this socket.
+	[  ] [EALREADY]         The socket is non-blocking and a previous connection attempt has not yet been completed.
+	[--] [EBADF]            socket is not a valid descriptor.
+	[  ] [ECONNREFUSED]     The attempt to connect was ignored (because the target is not listening for connections) or explicitly rejected.
+	[  ] [EFAULT]           The address parameter specifies an area outside the process address space.
+	[  ] [EHOSTUNREACH]     The target host cannot be reached (e.g., down, disconnected).
+	[--] [EINPROGRESS]      The socket is non-blocking and the connection cannot be completed immediately.  
+							It is possible to select(2) for completion by selecting the socket for writing.
+	[NA] [EINTR]            Its execution was interrupted by a signal.
+	[  ] [EINVAL]           An invalid argument was detected (e.g., address_len is not valid for the address family, the specified address family is invalid).
+	[--] [EISCONN]          The socket is already connected.
+	[  ] [ENETDOWN]         The local network interface is not functioning.
+	[--] [ENETUNREACH]      The network isn't reachable from this host.
+	[  ] [ENOBUFS]          The system call was unable to allocate a needed memory buffer.
+	[  ] [ENOTSOCK]         socket is not a file descriptor for a socket.
+	[  ] [EOPNOTSUPP]       Because socket is listening, no connection is allowed.
+	[  ] [EPROTOTYPE]       address has a different type than the socket that is bound to the specified peer address.
+	[  ] [ETIMEDOUT]        Connection establishment timed out without establishing a connection.
+	[  ] [ECONNRESET]       Remote host reset the connection request.
+
+Linux:
+
+	[  ] [EACCES]           For UNIX domain sockets, which are identified by pathname: Write permission is denied on the socket file, 
+							or search permission is denied for one of the directories in the path prefix. (See also path_resolution(7).)
+	[  ] [EACCES, EPERM]    The user tried to connect to a broadcast address without having the socket broadcast flag enabled or the 
+							connection request failed because of a local firewall rule.
+	[  ] [EADDRINUSE]       Local address is already in use.
+	[  ] [EAFNOSUPPORT]     The passed address didn't have the correct address family in its sa_family field.
+	[  ] [EAGAIN]           No more free local ports or insufficient entries in the routing cache. For AF_INET see the description 
+							of /proc/sys/net/ipv4/ip_local_port_range ip(7) for information on how to increase the number of local ports.
+	[--] [EALREADY]         The socket is nonblocking and a previous connection attempt has not yet been completed.
+	[  ] [EBADF]            The file descriptor is not a valid index in the descriptor table.
+	[  ] [ECONNREFUSED]     No-one listening on the remote address.
+	[  ] [EFAULT]           The socket structure address is outside the user's address space.
+	[--] [EINPROGRESS]      The socket is nonblocking and the connection cannot be completed immediately. It is possible to select(2) or 
+							poll(2) for completion by selecting the socket for writing. After select(2) indicates writability, use getsockopt(2) 
+							to read the SO_ERROR option at level SOL_SOCKET to determine whether connect() completed successfully (SO_ERROR is zero) 
+							or unsuccessfully (SO_ERROR is one of the usual error codes listed here, explaining the reason for the failure).
+	[  ] [EINTR]            The system call was interrupted by a signal that was caught; see signal(7).
+	[  ] [EISCONN]          The socket is already connected.
+	[  ] [ENETUNREACH]      Network is unreachable.
+	[  ] [ENOTSOCK]         The file descriptor is not associated with a socket.
+	[  ] [ETIMEDOUT]        Timeout while attempting connection. The server may be too busy to accept new connections. Note that for 
+							IP sockets the timeout may be very long when syncookies are enabled on the server.
+
+*/
+/*
+	Gives conn's stack socket to tap, first moving it to the tap's stack if zts_socket() created
+	it on another one. Options set on the old socket by zts_setsockopt() which only the stack
+	keeps (not conn) don't carry over
+*/
+static int stackAssign(ZeroTier::Connection *conn, ZeroTier::SocketTap *tap)
+{
+	// Only picoTCP does direct I/O, which is all a userspace descriptor has
+	if(!tap->_driver || (ZeroTier::FdTable::is_userspace(conn->app_fd) && tap->_driver->id() != ZTS_STACK_PICO)) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	int err = 0;
+	tap->RunOnStack([&]() {
+		if(conn->driver != tap->_driver) {
+			if(conn->driver)
+				conn->driver->Discard(conn);
+			conn->driver = NULL;
+			if((err = tap->_driver->Socket(conn)) < 0)
+				return;
+		}
+		tap->_driver->Assign(tap, conn);
+	});
+	if(err < 0) {
+		DEBUG_ERROR("failed to create stack socket");
+		errno = EMFILE;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+	Puts a socket of the host's stack in place of conn's end of the socketpair (app_fd) if the
+	route policy allows it and fd is a host descriptor to begin with, so the app's descriptor
+	stays the same (see ZTS_ROUTE_HOST). What
+	conn kept of zts_fcntl()/zts_setsockopt() carries over. conn is released on success, fd is
+	a host descriptor from then on. Must be called with _multiplexer_lock held
+*/
+static int hostSocket(ZeroTier::Connection *conn)
+{
+	if(ZeroTier::routePolicy != ZTS_ROUTE_HOST || conn->socket_type == SOCK_RAW
+		|| ZeroTier::FdTable::is_userspace(conn->app_fd))
+		return -1;
+	int fd = conn->app_fd;
+	int s = socket(conn->socket_family, conn->socket_type, conn->protocol);
+	if(s < 0) {
+		DEBUG_ERROR("unable to create host socket");
+		return -1;
+	}
+	if(conn->nonblocking)
+		fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+	if(conn->socket_type == SOCK_STREAM && conn->tx_nodelay) {
+		int one = 1;
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+	int timeo[] = { SO_RCVTIMEO, SO_SNDTIMEO };
+	for(int i=0; i<2; i++) {
+		struct timeval tv;
+		socklen_t len = sizeof(tv);
+		if(getsockopt(fd, SOL_SOCKET, timeo[i], &tv, &len) == 0)
+			setsockopt(s, SOL_SOCKET, timeo[i], &tv, len);
+	}
+	// Atomically closes app_fd's end of the socketpair, fd never refers to nothing
+	if(dup2(s, fd) < 0) {
+		DEBUG_ERROR("unable to move host socket to fd=%d", fd);
+		close(s);
+		return -1;
+	}
+	close(s);
+	zts_epoll_detach(conn);
+	if(conn->driver)
+		conn->driver->Discard(conn);
+	close(conn->sdk_fd);
+	ZeroTier::fdtable.add_host(fd);
+	ZeroTier::connpool.recycle(conn);
+	return 0;
+}
+
+// accept() on a listening host socket, what it returns is a host descriptor too
+static int hostAccept(ZT_ACCEPT_SIG)
+{
+	int newfd = accept(fd, addr, addrlen);
+	if(newfd >= 0) {
+		ZeroTier::ProfiledMutex::Lock _l(ZeroTier::_multiplexer_lock);
+		ZeroTier::fdtable.add_host(newfd);
+	}
+	return newfd;
+}
+
+#if defined(STACK_PICO) || defined(STACK_LWIP)
+/*
+	Hands the connection attempt to the stack without waiting for it to complete, see zts_connect()
+*/
+static int connectStart(ZT_CONNECT_SIG, ZeroTier::Connection **connp)
+{
+	int err = 0;
+	if(fd < 0) {
+		errno = EBADF;
+		DEBUG_ERROR("EBADF");
+		return -1;
+	}
+	if(!serviceRunning()) {
+		DEBUG_ERROR("Service not started. Call zts_start(path) first");
+		errno = EBADF;
+		return -1;
+	}
+	if(ZeroTier::fdtable.is_host(fd)) {
+		*connp = NULL;
+		return connect(fd, addr, addrlen);
+	}
+	ZeroTier::_multiplexer_lock.lock();
+	ZeroTier::Connection *conn = ZeroTier::fdtable.get_unassigned(fd);
+	ZeroTier::SocketTap *tap = NULL;
+
+	if(conn) {      
+		char ipstr[INET6_ADDRSTRLEN];
+		memset(ipstr, 0, INET6_ADDRSTRLEN);
+		ZeroTier::InetAddress iaddr;
+		int port = 0;
+
+		if(conn->socket_family == AF_INET) {
+			inet_ntop(AF_INET, 
+				(const void *)&((struct sockaddr_in *)addr)->sin_addr.s_addr, ipstr, INET_ADDRSTRLEN);
+			iaddr.fromString(ipstr);
+			port = ((struct sockaddr_in*)addr)->sin_port;
+		}
+		if(conn->socket_family == AF_INET6) {
+			inet_ntop(AF_INET6, 
+				(const void *)&((struct sockaddr_in6 *)addr)->sin6_addr.s6_addr, ipstr, INET6_ADDRSTRLEN);
+			// TODO: This is a hack, determine a proper way to do this
+			char addrstr[64];
+			sprintf(addrstr, "%s%s", ipstr, std::string("/88").c_str());
+			iaddr.fromString(addrstr);
+			port = ((struct sockaddr_in6*)addr)->sin6_port;
+		}
+		DEBUG_EXTRA("fd = %d, %s : %d", fd, ipstr, ntohs(port));
+		tap = getTapByAddr(iaddr);
+		if(!tap && hostSocket(conn) == 0) {
+			ZeroTier::_multiplexer_lock.unlock();
+			*connp = NULL;
+			return connect(fd, addr, addrlen);
+		}
+		if(!tap) {
+			DEBUG_ERROR("no route to host");
+			errno = ENETUNREACH;
+			err = -1;
+		}
+		else if(stackAssign(conn, tap) < 0)
+			err = -1;
+		else {
+			// Set first, the stack may report on the attempt before tap->Connect() returns
+			conn->so_error = 0;
+			conn->connecting = true;
+			err = tap->Connect(conn, fd, addr, addrlen); 
+			if(err != 0)
+				conn->connecting = false;
+			if(err == 0) {
+				ZeroTier::ProfiledMutex::Lock _l(tap->_tcpconns_m);
+				tap->_Connections.add(conn); // Give this Connection to the tap we decided on
+				conn->tap = tap;
+			}
+			// Wrap the socketpair we created earlier
+			// For I/O loop participation and referencing the PhySocket's parent Connection in callbacks
+			if(conn->sdk_fd >= 0)
+				conn->sock = tap->_phy.wrapSocket(conn->sdk_fd, conn);  
+			//DEBUG_ERROR("sock->fd = %d", tap->_phy.getDescriptor(conn->sock));      
+			ZeroTier::fdtable.assign(fd, conn, tap);
+		}
+	}
+	else if((conn = ZeroTier::fdtable.get(fd)) != NULL) {
+		// Already handed to a tap by an earlier zts_connect()/zts_bind()
+		if(conn->connecting)
+			errno = EALREADY;
+		else if(conn->state == ZT_SOCK_STATE_CONNECTED || conn->state == ZT_SOCK_STATE_UNHANDLED_CONNECTED)
+			errno = EISCONN;
+		else
+			errno = EINVAL;
+		err = -1;
+	}
+	else {
+		DEBUG_ERROR("unable to locate connection");
+		errno = EBADF;
+		err = -1;
+	}
+	ZeroTier::_multiplexer_lock.unlock();
+	*connp = conn;
+	return err;
+}
+#endif
+
+/*
+	Gives a ZT_SOCK_MSG socket port (0 for any free one) on the tap for nwid. The caller
+	holds _multiplexer_lock
+*/
+static int msgBind(ZeroTier::Connection *conn, uint64_t nwid, uint16_t port)
+{
+	if(conn->msg_port) {
+		errno = EINVAL;
+		return -1;
+	}
+	ZeroTier::SocketTap *tap = nwid ? getTapByNWID(nwid) : NULL;
+	if(!tap) {
+		errno = ENETUNREACH;
+		return -1;
+	}
+	if(tap->_msg.bind(&port, conn->sdk_fd) < 0)
+		return -1;
+	if(conn->msg_reliable)
+		tap->_msg.setReliable(port, true);
+	conn->tap = tap;
+	conn->msg_port = port;
+	return 0;
+}
+
+static const struct zts_sockaddr_msg *msgAddr(const struct sockaddr *addr, socklen_t addrlen)
+{
+	const struct zts_sockaddr_msg *to = (const struct zts_sockaddr_msg *)addr;
+	if(!to || addrlen < sizeof(*to) || to->smsg_family != ZTS_AF_MSG) {
+		errno = EAFNOSUPPORT;
+		return NULL;
+	}
+	return to;
+}
+
+/*
+	Points a ZT_SOCK_MSG socket at a port, binding it first (on smsg_nwid) if it isn't. A node
+	of 0 undoes it
+*/
+static int msgConnect(ZeroTier::Connection *conn, const struct sockaddr *addr, socklen_t addrlen)
+{
+	const struct zts_sockaddr_msg *to = msgAddr(addr, addrlen);
+	if(!to)
+		return -1;
+	ZeroTier::ProfiledMutex::Lock _l(ZeroTier::_multiplexer_lock);
+	if(!conn->msg_port && msgBind(conn, to->smsg_nwid, 0) < 0)
+		return -1;
+	conn->msg_node = to->smsg_node;
+	conn->msg_dport = ntohs(to->smsg_port);
+	return 0;
+}
+
+// zts_getsockname()/zts_getpeername() for a ZT_SOCK_MSG socket
+static int msgName(ZeroTier::Connection *conn, bool peer, struct sockaddr *addr, socklen_t *addrlen)
+{
+	if(!conn->msg_port || (peer && !conn->msg_node)) {
+		errno = peer ? ENOTCONN : EINVAL;
+		return -1;
+	}
+	if(!addr || !addrlen) {
+		errno = EINVAL;
+		return -1;
+	}
+	struct zts_sockaddr_msg name;
+	memset(&name, 0, sizeof(name));
+	name.smsg_family = ZTS_AF_MSG;
+	name.smsg_port = htons(peer ? conn->msg_dport : conn->msg_port);
+	name.smsg_nwid = conn->tap->_nwid;
+	name.smsg_node = peer ? conn->msg_node : conn->tap->_mac.toAddress(conn->tap->_nwid).toInt();
+	memcpy(addr, &name, std::min((size_t)*addrlen, sizeof(name)));
+	*addrlen = sizeof(name);
+	return 0;
+}
+
+int zts_connect(ZT_CONNECT_SIG) {
+	if(ZeroTier::Mux::owns(fd))
+		return ZeroTier::Mux::connect(fd, addr, addrlen);
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+	ZeroTier::Connection *mconn = ZeroTier::fdtable.get_unassigned(fd);
+	if(mconn && mconn->socket_type == ZT_SOCK_MSG)
+		return msgConnect(mconn, addr, addrlen);
+#if defined(STACK_PICO) || defined(STACK_LWIP)
+	//DEBUG_INFO("fd = %d", fd);
+	ZeroTier::Connection *conn = NULL;
+	int err = connectStart(fd, addr, addrlen, &conn);
+	if(err < 0 || !conn)
+		return err; // !conn: connected through the host's stack
+
+	// NOTE: pico_socket_connect() will return 0 if no error happens immediately, but that doesn't indicate
+	// the connection was completed, for that we must wait for a callback from the stack. During that
+	// callback we will place the Connection in a ZT_SOCK_STATE_UNHANDLED_CONNECTED state to signal 
+	// to the multiplexer logic that this connection is complete and a success value can be sent to the
+	// user application
+
+	int blocking = !conn->nonblocking;
+
+	// non-blocking
+	if(err == 0 && !blocking) {
+		DEBUG_EXTRA("EINPROGRESS, not a real error, assuming non-blocking mode");
+		errno = EINPROGRESS;
+		err = -1;
+	}
+	else // blocking
+	{
+		if(err == 0 && blocking) {
+			// Woken by pico_cb_socket_activity() as soon as the stack reports on this connection
+			int timeout_ms = getSockTimeoutMs(fd, SO_SNDTIMEO);
+			bool complete = conn->wait_state([conn]() { 
+				return !conn->connecting || ZTS_CONN_RESET(conn); 
+			}, timeout_ms, ZT_CONNECT_RECHECK_DELAY);
+			if(!complete) {
+				errno = EINPROGRESS; // timed out, same as connect() with SO_SNDTIMEO
+				err = -1;
+			}
+			else if(conn->so_error || ZTS_CONN_RESET(conn)) {
+				errno = conn->so_error ? conn->so_error.exchange(0) : ECONNRESET;
+				DEBUG_ERROR("connect failed, errno = %d", errno);
+				err = -1;
+			}
+			else {
+				conn->state = ZT_SOCK_STATE_CONNECTED;
+				errno = 0;
+				err = 0; // complete
+			}
+		}
+	}
+	return err;
+#endif
+	return 0;
+}
+
+/*
+ * [--] [EINVAL]   addrs is NULL or naddrs isn't 1 to ZT_CONNECT_ANY_MAX.
+ * [--] [ETIMEDOUT] No attempt completed within timeout_ms.
+ * [--] [...]      Otherwise, how the last attempt failed.
+ */
+int zts_connect_any(const struct sockaddr_storage *addrs, int naddrs, int timeout_ms)
+{
+	if(!addrs || naddrs <= 0 || naddrs > ZT_CONNECT_ANY_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	struct pollfd fds[ZT_CONNECT_ANY_MAX];
+	int nfds = 0, next = 0, winner = -1, lasterr = ETIMEDOUT;
+	int64_t t = ZeroTier::OSUtils::now(), deadline = t + timeout_ms, next_at = t;
+	while(winner < 0) {
+		t = ZeroTier::OSUtils::now();
+		if(timeout_ms >= 0 && t >= deadline) {
+			lasterr = ETIMEDOUT;
+			break;
+		}
+		// The next attempt starts when its turn comes, or right away with nothing in flight
+		if(next < naddrs && (t >= next_at || !nfds)) {
+			const struct sockaddr *sa = (const struct sockaddr *)&addrs[next++];
+			socklen_t len = sa->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+			int fd = zts_socket(sa->sa_family, SOCK_STREAM, 0);
+			if(fd < 0) {
+				lasterr = errno;
+				continue;
+			}
+			zts_fcntl(fd, F_SETFL, O_NONBLOCK);
+			if(zts_connect(fd, sa, len) == 0) {
+				winner = fd;
+				break;
+			}
+			if(errno != EINPROGRESS) {
+				lasterr = errno;
+				zts_close(fd);
+				continue;
+			}
+			fds[nfds].fd = fd;
+			fds[nfds].events = POLLOUT;
+			fds[nfds].revents = 0;
+			nfds++;
+			next_at = t + ZT_CONNECT_ANY_STAGGER;
+			continue;
+		}
+		if(!nfds)
+			break; // every attempt failed
+		int64_t wait = next < naddrs ? next_at - t : -1;
+		if(timeout_ms >= 0 && (wait < 0 || deadline - t < wait))
+			wait = deadline - t;
+		int n = zts_poll(fds, nfds, (int)wait);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			lasterr = errno;
+			break;
+		}
+		for(int i=0; i<nfds && n > 0;) {
+			if(!fds[i].revents) {
+				i++;
+				continue;
+			}
+			n--;
+			int soerr = 0;
+			socklen_t optlen = sizeof(soerr);
+			if(zts_getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &soerr, &optlen) < 0)
+				soerr = errno;
+			if(!soerr && (fds[i].revents & POLLOUT)) {
+				winner = fds[i].fd;
+				fds[i] = fds[--nfds];
+				break;
+			}
+			lasterr = soerr ? soerr : ECONNREFUSED;
+			zts_close(fds[i].fd);
+			fds[i] = fds[--nfds];
+			next_at = t; // a failure lets the next attempt start now
+		}
+	}
+	for(int i=0; i<nfds; i++)
+		zts_close(fds[i].fd);
+	if(winner < 0) {
+		errno = lasterr;
+		return -1;
+	}
+	zts_fcntl(winner, F_SETFL, 0);
+	return winner;
+}
+
+/*
+ * [--] [EINVAL]   nwid or devID is NULL, or port isn't 1 to 65535.
+ * [--] [...]      See zts_connect_any().
+ */
+int zts_connect_by_device_id(const char *nwid, const char *devID, int port,
+	const struct sockaddr_in *ipv4, int timeout_ms)
+{
+	if(!nwid || !devID || port <= 0 || port > 65535) {
+		errno = EINVAL;
+		return -1;
+	}
+	uint64_t nwid_int = ZeroTier::Utils::hexStrToU64(nwid), dev = ZeroTier::Utils::hexStrToU64(devID);
+	// Alternating families, as RFC 8305 suggests
+	struct sockaddr_storage addrs[3];
+	int naddrs = 0;
+	ZeroTier::InetAddress rfc4193 = ZeroTier::InetAddress::makeIpv6rfc4193(nwid_int, dev);
+	rfc4193.setPort(port);
+	memcpy(&addrs[naddrs++], &rfc4193, sizeof(struct sockaddr_storage));
+	if(ipv4) {
+		memset(&addrs[naddrs], 0, sizeof(struct sockaddr_storage));
+		memcpy(&addrs[naddrs], ipv4, sizeof(struct sockaddr_in));
+		((struct sockaddr_in *)&addrs[naddrs++])->sin_port = htons(port);
+	}
+	ZeroTier::InetAddress sixplane = ZeroTier::InetAddress::makeIpv66plane(nwid_int, dev);
+	sixplane.setPort(port);
+	memcpy(&addrs[naddrs++], &sixplane, sizeof(struct sockaddr_storage));
+	return zts_connect_any(addrs, naddrs, timeout_ms);
+}
+
+int zts_pool_configure(const struct zts_pool_config *cfg)
+{
+	ZeroTier::DialPool::configure(cfg);
+	return 0;
+}
+
+/*
+ * [--] [EINVAL]   addr is NULL, or not an AF_INET or AF_INET6 address of addrlen bytes.
+ * [--] [...]      See zts_connect_any().
+ */
+int zts_pool_connect(const struct sockaddr *addr, socklen_t addrlen, int timeout_ms)
+{
+	return ZeroTier::DialPool::connect(addr, addrlen, timeout_ms);
+}
+
+/*
+ * [--] [EBADF]    fd wasn't handed out by zts_pool_connect() (or was already released).
+ */
+int zts_pool_release(int fd, int reuse)
+{
+	if(!ZeroTier::DialPool::release(fd, reuse != 0)) {
+		errno = EBADF;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * [--] [EINVAL]   addr is NULL, or not an AF_INET or AF_INET6 address of addrlen bytes, or
+ *                 count is negative.
+ */
+int zts_pool_prewarm(const struct sockaddr *addr, socklen_t addrlen, int count)
+{
+	if(!addr || count < 0 || (addr->sa_family != AF_INET && addr->sa_family != AF_INET6)
+		|| addrlen < (addr->sa_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6))) {
+		errno = EINVAL;
+		return -1;
+	}
+	ZeroTier::DialPool::prewarm(addr, addrlen, count);
+	return 0;
+}
+
+int zts_pool_flush(void)
+{
+	ZeroTier::DialPool::flush();
+	return 0;
+}
+
+/*
+ * [--] [EINVAL]   stats is NULL.
+ */
+int zts_pool_get_stats(struct zts_pool_stats *stats)
+{
+	if(!stats) {
+		errno = EINVAL;
+		return -1;
+	}
+	ZeroTier::DialPool::stats(stats);
+	return 0;
+}
+
+/*
+	Has the tap picked by an AF_PACKET address (sll_ifindex, see zts_ioctl(SIOCGIFINDEX)) give
+	a SOCK_RAW socket the frames it receives, all of them or only those of sll_protocol (or of
+	the protocol given to zts_socket() if that's 0). The socket stays unassigned, zts_sendto()
+	and zts_raw_send_batch() then send on this tap unless given another sll_ifindex
+*/
+static int rawBind(ZeroTier::Connection *conn, const struct sockaddr *addr, socklen_t addrlen)
+{
+#if defined(__linux__)
+	if(!addr || addr->sa_family != AF_PACKET || addrlen < sizeof(struct sockaddr_ll)) {
+		errno = EAFNOSUPPORT;
+		return -1;
+	}
+	const struct sockaddr_ll *sll = (const struct sockaddr_ll *)addr;
+	ZeroTier::SocketTap *tap = getTapByIndex(sll->sll_ifindex);
+	if(!tap) {
+		errno = ENODEV;
+		return -1;
+	}
+	if(sll->sll_protocol)
+		conn->protocol = sll->sll_protocol;
+	if(conn->tap)
+		conn->tap->RemoveRaw(conn);
+	conn->tap = tap;
+	tap->AddRaw(conn);
+	return 0;
+#else
+	errno = EAFNOSUPPORT;
+	return -1;
+#endif
+}
+
+/*
+
+Darwin:
+
+	[--] [EBADF]            S is not a valid descriptor.
+	[--] [ENODEV]           S is a SOCK_RAW socket and sll_ifindex names no tap.
+	[--] [ENETUNREACH]      S is a ZT_SOCK_MSG socket and smsg_nwid isn't a joined network.
+	[--] [EAFNOSUPPORT]     S is a ZT_SOCK_MSG socket and name isn't a zts_sockaddr_msg.
+	[--] [EAFNOSUPPORT]     S is a SOCK_RAW socket and name isn't a sockaddr_ll.
+	[  ] [ENOTSOCK]         S is not a socket.
+	[--] [EADDRNOTAVAIL]    The specified address is not available from the local
+							machine.
+	[  ] [EADDRINUSE]       The specified address is already in use.
+	[  ] [EINVAL]           The socket is already bound to an address.
+	[  ] [EACCES]           The requested address is protected, and the current
+							user has inadequate permission to access it.
+	[  ] [EFAULT]           The name parameter is not in a valid part of the user
+							address space.
+*/
+int zts_bind(ZT_BIND_SIG) {
+	if(ZeroTier::Mux::owns(fd))
+		return ZeroTier::Mux::bind(fd, addr, addrlen);
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+	int err = 0;
+	if(fd < 0) {
+		errno = EBADF;
+		return -1;
+	}
+	if(!serviceRunning()) {
+		DEBUG_ERROR("Service not started. Call zts_start(path) first");        
+		errno = EBADF;
+		return -1;
+	}
+	if(ZeroTier::fdtable.is_host(fd))
+		return bind(fd, addr, addrlen);
+	ZeroTier::_multiplexer_lock.lock();
+	ZeroTier::Connection *conn = ZeroTier::fdtable.get_unassigned(fd);
+	ZeroTier::SocketTap *tap;
+	
+	if(conn && conn->socket_type == SOCK_RAW)
+		err = rawBind(conn, addr, addrlen);
+	else if(conn && conn->socket_type == ZT_SOCK_MSG) {
+		const struct zts_sockaddr_msg *name = msgAddr(addr, addrlen);
+		err = name ? msgBind(conn, name->smsg_nwid, ntohs(name->smsg_port)) : -1;
+	}
+	else if(conn) {     
+		char ipstr[INET6_ADDRSTRLEN];
+		memset(ipstr, 0, INET6_ADDRSTRLEN);
+		ZeroTier::InetAddress iaddr;
+		int port = 0;
+		if(conn->socket_family == AF_INET) {
+			inet_ntop(AF_INET, 
+				(const void *)&((struct sockaddr_in *)addr)->sin_addr.s_addr, ipstr, INET_ADDRSTRLEN);
+			port = ((struct sockaddr_in*)addr)->sin_port;
+		}
+		if(conn->socket_family == AF_INET6) {
+			inet_ntop(AF_INET6, 
+				(const void *)&((struct sockaddr_in6 *)addr)->sin6_addr.s6_addr, ipstr, INET6_ADDRSTRLEN);
+			port = ((struct sockaddr_in6*)addr)->sin6_port;
+		}
+		DEBUG_EXTRA("fd = %d, %s : %d", fd, ipstr, ntohs(port));
+		iaddr.fromString(ipstr);
+		tap = getTapByAddr(iaddr);
+
+		if(!tap && hostSocket(conn) == 0) {
+			ZeroTier::_multiplexer_lock.unlock();
+			return bind(fd, addr, addrlen);
+		}
+		if(!tap) {
+			DEBUG_ERROR("no matching interface to bind to");            
+			errno = EADDRNOTAVAIL;
+			err = -1;
+		}
+		else if(stackAssign(conn, tap) < 0)
+			err = -1;
+		else {
+			{
+				ZeroTier::ProfiledMutex::Lock _l(tap->_tcpconns_m);
+				tap->_Connections.add(conn); // Give this Connection to the tap we decided on
+			}
+			err = tap->Bind(conn, fd, addr, addrlen);
+			conn->tap = tap;
+			if(err == 0) { // success
+				// A bound datagram socket can send right away, its socketpair joins the I/O loop now
+				if(conn->socket_type == SOCK_DGRAM) {
+					conn->sock = tap->_phy.wrapSocket(conn->sdk_fd, conn);
+					tap->_phy.whack();
+				}
+				ZeroTier::fdtable.assign(fd, conn, tap);
+			}
+		}
+	}
+	else {
+		DEBUG_ERROR("unable to locate connection");
+		errno = EBADF;
+		err = -1;
+	}
+	ZeroTier::_multiplexer_lock.unlock();
+	return err;
+}
+
+/*
+
+Darwin:
+
+	[--] [EACCES]           The current process has insufficient privileges.
+	[--] [EBADF]            The argument socket is not a valid file descriptor.
+	[--] [EDESTADDRREQ]     The socket is not bound to a local address and the protocol does not support listening on an unbound socket.
+	[  ] [EINVAL]           socket is already connected.
+	[  ] [ENOTSOCK]         The argument socket does not reference a socket.
+	[  ] [EOPNOTSUPP]       The socket is not of a type that supports the operation listen().
+
+Linux:
+
+	[  ] [EADDRINUSE]       Another socket is already listening on the same port.
+	[--] [EBADF]            The argument sockfd is not a valid descriptor.
+	[  ] [ENOTSOCK]         The argument sockfd is not a socket.
+	[  ] [EOPNOTSUPP]       The socket is not of a type that supports the listen() operation.
+*/
+int zts_listen(ZT_LISTEN_SIG) {
+	if(ZeroTier::Mux::owns(fd))
+		return ZeroTier::Mux::listen(fd, backlog);
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+#if defined(STACK_PICO) || defined(STACK_LWIP)
+	DEBUG_EXTRA("fd = %d", fd);
+	int err = 0;
+	if(fd < 0) {
+		errno = EBADF;
+		return -1;
+	}
+	if(!serviceRunning()) {
+		DEBUG_ERROR("service not started. call zts_start(path) first");
+		errno = EACCES;
+		return -1;
+	}
+	if(ZeroTier::fdtable.is_host(fd))
+		return listen(fd, backlog);
+	ZeroTier::SocketTap *tap;
+	ZeroTier::Connection *conn = ZeroTier::fdtable.get_assigned(fd, &tap);
+	if(!conn) {
+		DEBUG_ERROR("unable to locate connection pair. did you bind?");
+		errno = EDESTADDRREQ;
+		return -1;
+	}
+	ZeroTier::_multiplexer_lock.lock();
+	backlog = backlog > 128 ? 128 : backlog; // See: /proc/sys/net/core/somaxconn
+	err = tap->Listen(conn, fd, backlog);
+	conn->state = ZT_SOCK_STATE_LISTENING;
+	if(err == 0)
+		ZeroTier::fdtable.set_listening(fd);
+	ZeroTier::_multiplexer_lock.unlock();
+	return err;
+#endif
+	return 0;
+}
+
+/*
+
+Darwin:
+
+	[--] [EBADF]            The descriptor is invalid.
+	[  ] [ENOTSOCK]         The descriptor references a file, not a socket.
+	[  ] [EOPNOTSUPP]       The referenced socket is not of type SOCK_STREAM.
+	[  ] [EFAULT]           The addr parameter is not in a writable part of the
+							user address space.
+	[--] [EWOULDBLOCK]      The socket is marked non-blocking and no connections
+							are present to be accepted.
+	[--] [EMFILE]           The per-process descriptor table is full.
+	[  ] [ENFILE]           The system file table is full.
+	[--] [ENOBUFS]          The memory budget (zts_stack_config.mem_limit_kb) is nearly used up.
+*/
+int zts_accept(ZT_ACCEPT_SIG) {
+	if(ZeroTier::Mux::owns(fd))
+		return ZeroTier::Mux::accept(fd, addr, addrlen, 0);
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+#if defined(STACK_PICO) || defined(STACK_LWIP)
+	DEBUG_EXTRA("fd = %d", fd);
+	int err = 0;
+	if(fd < 0) {
+		errno = EBADF;
+		return -1;
+	}
+	else if(ZeroTier::fdtable.is_host(fd))
+		return hostAccept(fd, addr, addrlen);
+	else
+	{
+		if(!socketsAvailable()) {
+			DEBUG_ERROR("cannot provision additional socket, see zts_stack_config.max_sockets");
+			errno = EMFILE;
+			err = -1;
+		}
+		else if(!ZeroTier::MemBudget::admitSocket()) {
+			DEBUG_ERROR("cannot provision additional socket, see zts_stack_config.mem_limit_kb");
+			errno = ENOBUFS;
+			err = -1;
+		}
+		ZeroTier::SocketTap *tap;
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get_assigned(fd, &tap);
+		if(!conn) {
+			DEBUG_ERROR("unable to locate connection pair (did you zts_bind())?");
+			errno = EBADF;
+			err = -1;
+		}
+		else {
+
+			// BLOCKING: loop and keep checking until we find a newly accepted connection
+			int blocking = !conn->nonblocking;
+			if(!err) {
+				ZeroTier::Connection *accepted_conn;
+				if(!blocking) { // non-blocking
+					DEBUG_EXTRA("EWOULDBLOCK, not a real error, assuming non-blocking mode");
+					errno = EWOULDBLOCK;
+					err = -1;
+					accepted_conn = tap->Accept(conn);
+				}
+				else { // blocking
+					accepted_conn = NULL;
+					int timeout_ms = getSockTimeoutMs(fd, SO_RCVTIMEO);
+					if(!conn->wait_state_unlocked([&]() { return (accepted_conn = tap->Accept(conn)) != NULL; }, 
+						timeout_ms, ZT_ACCEPT_RECHECK_DELAY)) {
+						errno = EWOULDBLOCK; // timed out
+						err = -1;
+					}
+				}
+				if(accepted_conn) {
+					ZeroTier::_multiplexer_lock.lock();
+					ZeroTier::fdtable.assign(accepted_conn->app_fd, accepted_conn, tap);
+					ZeroTier::_multiplexer_lock.unlock();
+					err = accepted_conn->app_fd;
+				}
+			}
+		}
+	}
+	return err;
+#endif
+	return 0;
+}
+
+
+/*
+	[--] [EBADF]            The descriptor is invalid.
+	[--] [EINVAL]           fds is NULL or max is less than 1.
+	[--] [EWOULDBLOCK]      The socket is marked non-blocking (or SO_RCVTIMEO expired) and
+							no connections are present to be accepted.
+	[--] [EMFILE]           The network stack can't provision another socket.
+	[--] [ENOBUFS]          The memory budget (zts_stack_config.mem_limit_kb) is nearly used up.
+*/
+int zts_accept_many(int fd, int *fds, struct sockaddr_storage *addrs, int max)
+{
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+#if defined(STACK_PICO) || defined(STACK_LWIP)
+	DEBUG_EXTRA("fd = %d, max = %d", fd, max);
+	if(fd < 0) {
+		errno = EBADF;
+		return -1;
+	}
+	if(!fds || max < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+	// One at a time, the host's accept() takes no more
+	if(ZeroTier::fdtable.is_host(fd)) {
+		socklen_t addrlen = sizeof(struct sockaddr_storage);
+		if((fds[0] = hostAccept(fd, addrs ? (struct sockaddr *)&addrs[0] : NULL, addrs ? &addrlen : NULL)) < 0)
+			return -1;
+		return 1;
+	}
+	int avail = socketsAvailable();
+	if(avail < 1) {
+		DEBUG_ERROR("cannot provision additional socket, see zts_stack_config.max_sockets");
+		errno = EMFILE;
+		return -1;
+	}
+	if(!ZeroTier::MemBudget::admitSocket()) {
+		DEBUG_ERROR("cannot provision additional socket, see zts_stack_config.mem_limit_kb");
+		errno = ENOBUFS;
+		return -1;
+	}
+	max = std::min(std::min(max, avail), ZT_ACCEPT_MANY_MAX);
+	ZeroTier::SocketTap *tap;
+	ZeroTier::Connection *conn = ZeroTier::fdtable.get_assigned(fd, &tap);
+	if(!conn) {
+		DEBUG_ERROR("unable to locate connection pair (did you zts_bind())?");
+		errno = EBADF;
+		return -1;
+	}
+	ZeroTier::Connection *accepted[ZT_ACCEPT_MANY_MAX];
+	int n = 0;
+	if(conn->nonblocking)
+		n = tap->AcceptMany(conn, accepted, addrs, max);
+	else {
+		int timeout_ms = getSockTimeoutMs(fd, SO_RCVTIMEO);
+		conn->wait_state_unlocked([&]() { return (n = tap->AcceptMany(conn, accepted, addrs, max)) > 0; }, 
+			timeout_ms, ZT_ACCEPT_RECHECK_DELAY);
+	}
+	if(!n) {
+		errno = EWOULDBLOCK;
+		return -1;
+	}
+	ZeroTier::_multiplexer_lock.lock();
+	for(int i=0; i<n; i++) {
+		ZeroTier::fdtable.assign(accepted[i]->app_fd, accepted[i], tap);
+		fds[i] = accepted[i]->app_fd;
+	}
+	ZeroTier::_multiplexer_lock.unlock();
+	return n;
+#endif
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+/*
+Linux accept() (and accept4()) passes already-pending network errors on the new socket as an error code from accept(). This behavior differs from other BSD socket implementations. For reliable operation the application should detect the network errors defined for the protocol after accept() and treat them like EAGAIN by retrying. In the case of TCP/IP, these are ENETDOWN, EPROTO, ENOPROTOOPT, EHOSTDOWN, ENONET, EHOSTUNREACH, EOPNOTSUPP, and ENETUNREACH.
+Errors
+
+	[  ] [EAGAIN or EWOULDBLOCK]   The socket is marked nonblocking and no connections are present to be accepted. POSIX.1-2001 allows either error to be returned for this case, and does not require these constants to have the same value, so a portable application should check for both possibilities.
+	[--] [EBADF]                   The descriptor is invalid.
+	[  ] [ECONNABORTED]            A connection has been aborted.
+	[  ] [EFAULT]                  The addr argument is not in a writable part of the user address space.
+	[NA] [EINTR]                   The system call was interrupted by a signal that was caught before a valid connection arrived; see signal(7).
+	[  ] [EINVAL]                  Socket is not listening for connections, or addrlen is invalid (e.g., is negative).
+	[  ] [EINVAL]                  (accept4()) invalid value in flags.
+	[  ] [EMFILE]                  The per-process limit of open file descriptors has been reached.
+	[  ] [ENFILE]                  The system limit on the total number of open files has been reached.
+	[  ] [ENOBUFS, ENOMEM]         Not enough free memory. This often means that the memory allocation is limited by the socket buffer limits, not by the system memory.
+	[  ] [ENOTSOCK]                The descriptor references a file, not a socket.
+	[  ] [EOPNOTSUPP]              The referenced socket is not of type SOCK_STREAM.
+	[  ] [EPROTO]                  Protocol error.
+
+In addition, Linux accept() may fail if:
+
+EPERM Firewall rules forbid connection.
+*/
+#if defined(__linux__)
+	int zts_accept4(ZT_ACCEPT4_SIG)
+	{
+		if(ZeroTier::Mux::owns(fd))
+			return ZeroTier::Mux::accept(fd, addr, addrlen, flags);
+		DEBUG_INFO("fd = %d", fd);
+		int err = 0;
+		if(fd < 0) {
+			errno = EBADF;
+			err = -1;
+		}
+		return 0;
+	}
+#endif
+
+
+/*
+	Has opts (ZT_CONN_OPT_*) of conn applied to its stack socket, by the tap's stack thread once
+	conn is assigned (see SocketTap::QueueOptions()) and right away before that
+*/
+static void applyStackOptions(ZeroTier::Connection *conn, uint32_t opts)
+{
+	if(conn->tap)
+		conn->tap->QueueOptions(conn, opts);
+	else if(conn->driver)
+		conn->driver->ApplyOptions(conn, opts);
+}
+
+/*
+	The options which the kernel would otherwise keep for a userspace descriptor (see
+	zts_stack_config.userspace_fds), anything else that gets this far isn't supported
+*/
+static int userspaceSetsockopt(int fd, int level, int optname, const void *optval, socklen_t optlen)
+{
+	ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+	if(!conn) {
+		errno = EBADF;
+		return -1;
+	}
+	if(level != SOL_SOCKET || (optname != SO_RCVTIMEO && optname != SO_SNDTIMEO)) {
+		errno = ENOPROTOOPT;
+		return -1;
+	}
+	if(!optval || optlen < sizeof(struct timeval)) {
+		errno = EINVAL;
+		return -1;
+	}
+	const struct timeval *tv = (const struct timeval*)optval;
+	if(tv->tv_sec < 0 || tv->tv_usec < 0 || tv->tv_usec >= 1000000) {
+		errno = EDOM;
+		return -1;
+	}
+	// Same as getSockTimeoutMs() makes of the kernel's
+	int ms = -1;
+	if(tv->tv_sec || tv->tv_usec)
+		ms = (int)std::min<long long>((long long)tv->tv_sec * 1000 + tv->tv_usec / 1000, INT_MAX);
+	(optname == SO_RCVTIMEO ? conn->rcvtimeo_ms : conn->sndtimeo_ms) = ms;
+	return 0;
+}
+
+static int userspaceGetsockopt(int fd, int level, int optname, void *optval, socklen_t *optlen)
+{
+	ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+	if(!conn) {
+		errno = EBADF;
+		return -1;
+	}
+	if(level != SOL_SOCKET || (optname != SO_RCVTIMEO && optname != SO_SNDTIMEO && optname != SO_TYPE)) {
+		errno = ENOPROTOOPT;
+		return -1;
+	}
+	if(optname == SO_TYPE) {
+		if(!optval || !optlen || *optlen < sizeof(int)) {
+			errno = EINVAL;
+			return -1;
+		}
+		*(int*)optval = conn->socket_type;
+		*optlen = sizeof(int);
+		return 0;
+	}
+	if(!optval || !optlen || *optlen < sizeof(struct timeval)) {
+		errno = EINVAL;
+		return -1;
+	}
+	int ms = optname == SO_RCVTIMEO ? conn->rcvtimeo_ms : conn->sndtimeo_ms;
+	struct timeval *tv = (struct timeval*)optval;
+	tv->tv_sec = ms < 0 ? 0 : ms / 1000;
+	tv->tv_usec = ms < 0 ? 0 : (ms % 1000) * 1000;
+	*optlen = sizeof(struct timeval);
+	return 0;
+}
+
+/*
+	[--] [EBADF]            The argument s is not a valid descriptor.
+	[  ] [ENOTSOCK]         The argument s is a file, not a socket.
+	[--] [ENOPROTOOPT]      The option is unknown at the level indicated.
+	[  ] [EFAULT]           The address pointed to by optval is not in a valid
+							part of the process address space.  For getsockopt(),
+							this error may also be returned if optlen is not in a
+							valid part of the process address space.
+	[--] [EDOM]             The argument value is out of bounds.
+	[--] [EINVAL]           optval is NULL or optlen is too small, or ZT_SO_DIRECT_IO was
+							turned off for a userspace descriptor.
+	[--] [EISCONN]          ZT_SO_DIRECT_IO was given after connect()/listen(), or
+							SO_REUSEPORT after bind()/connect().
+	[--] [ENOENT]           TCP_CONGESTION names an unknown algorithm.
+*/
+int zts_setsockopt(ZT_SETSOCKOPT_SIG)
+{
+	if(ZeroTier::Mux::owns(fd))
+		return ZeroTier::Mux::setsockopt(fd, level, optname, optval, optlen);
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+#if defined(STACK_PICO)
+	DEBUG_INFO("fd = %d", fd);
+	int err = 0;
+	if(fd < 0) {
+		errno = EBADF;
+		err = -1;
+	}
+	if(ZeroTier::fdtable.is_host(fd))
+		return setsockopt(fd, level, optname, optval, optlen);
+
+	if(level == ZT_SOL_LIBZT && optname == ZT_SO_MSG_RELIABLE) {
+		if(!optval || optlen < sizeof(int)) {
+			errno = EINVAL;
+			return -1;
+		}
+		ZeroTier::ProfiledMutex::Lock _l(ZeroTier::_multiplexer_lock);
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get_unassigned(fd);
+		if(!conn || conn->socket_type != ZT_SOCK_MSG) {
+			errno = conn ? ENOPROTOOPT : EBADF;
+			return -1;
+		}
+		// Applies to messages sent from now on
+		conn->msg_reliable = *(const int*)optval != 0;
+		if(conn->msg_port)
+			conn->tap->_msg.setReliable(conn->msg_port, conn->msg_reliable);
+		return 0;
+	}
+	if(level == ZT_SOL_LIBZT) {
+		bool dgram_opt = optname == ZT_SO_UDP_RXQ_DEPTH || optname == ZT_SO_UDP_RXQ_DROP_OLDEST;
+		if(optname != ZT_SO_DIRECT_IO && optname != ZT_SO_TCP_COALESCE_BYTES 
+			&& optname != ZT_SO_TCP_COALESCE_MS && optname != ZT_SO_TCP_RTO_MIN && !dgram_opt) {
+			errno = ENOPROTOOPT;
+			return -1;
+		}
+		if(!optval || optlen < sizeof(int)) {
+			errno = EINVAL;
+			return -1;
+		}
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+		if(!conn) {
+			errno = EBADF;
+			return -1;
+		}
+		if(conn->socket_type != (dgram_opt ? SOCK_DGRAM : SOCK_STREAM)) {
+			errno = ENOPROTOOPT;
+			return -1;
+		}
+		int value = *(const int*)optval;
+		if(optname == ZT_SO_UDP_RXQ_DEPTH) {
+			// Takes effect the next time the queue is empty
+			if(value < 1 || value > ZT_UDP_RXQ_DEPTH_MAX) {
+				errno = EDOM;
+				return -1;
+			}
+			conn->rxq_depth = value;
+			return 0;
+		}
+		if(optname == ZT_SO_UDP_RXQ_DROP_OLDEST) {
+			conn->rxq_drop_oldest = value != 0;
+			return 0;
+		}
+		if(optname == ZT_SO_TCP_COALESCE_BYTES || optname == ZT_SO_TCP_COALESCE_MS) {
+			if(value < 0) {
+				errno = EDOM;
+				return -1;
+			}
+			if(optname == ZT_SO_TCP_COALESCE_BYTES)
+				conn->tx_coalesce_bytes = value;
+			else
+				conn->tx_coalesce_ms = value;
+			// Anything held under the old setting is reconsidered
+			if(conn->tap)
+				conn->tap->ReleaseHeldTx();
+			return 0;
+		}
+		if(optname == ZT_SO_TCP_RTO_MIN) {
+			if(conn->picosock) {
+				errno = ENOPROTOOPT;
+				return -1;
+			}
+			if(value < 0) {
+				errno = EDOM;
+				return -1;
+			}
+			conn->rto_min = value;
+			applyStackOptions(conn, ZT_CONN_OPT_TIMERS);
+			return 0;
+		}
+		// Data may already be sitting in the socketpair once the stack is involved
+		if(conn->state != ZT_SOCK_STATE_NONE || conn->tap) {
+			errno = EISCONN;
+			return -1;
+		}
+		// There is no socketpair to fall back to
+		if(!value && ZeroTier::FdTable::is_userspace(fd)) {
+			errno = EINVAL;
+			return -1;
+		}
+		conn->direct = value != 0;
+		return 0;
+	}
+
+	if(level == IPPROTO_TCP && (optname == TCP_NODELAY
+#if defined(TCP_CORK)
+		|| optname == TCP_CORK
+#endif
+		)) {
+		if(!optval || optlen < sizeof(int)) {
+			errno = EINVAL;
+			return -1;
+		}
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+		if(!conn) {
+			errno = EBADF;
+			return -1;
+		}
+		if(conn->socket_type != SOCK_STREAM) {
+			errno = ENOPROTOOPT;
+			return -1;
+		}
+		bool on = *(const int*)optval != 0;
+#if defined(TCP_CORK)
+		if(optname == TCP_CORK) {
+			conn->tx_cork = on;
+			if(!on && conn->tap)
+				conn->tap->ReleaseHeldTx();
+			return 0;
+		}
+#endif
+		conn->tx_nodelay = on;
+		applyStackOptions(conn, ZT_CONN_OPT_NODELAY);
+		return 0;
+	}
+
+#if defined(TCP_CONGESTION)
+	// Accepted sockets inherit the listener's, the stack copies it to them
+	if(level == IPPROTO_TCP && optname == TCP_CONGESTION) {
+		char name[ZT_TCP_CONGESTION_NAME_LEN];
+		if(!optval || optlen < 1) {
+			errno = EINVAL;
+			return -1;
+		}
+		memset(name, 0, sizeof(name));
+		memcpy(name, optval, std::min((size_t)optlen, sizeof(name) - 1));
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+		if(!conn) {
+			errno = EBADF;
+			return -1;
+		}
+		// Only picoTCP has pluggable congestion control
+#if defined(STACK_PICO)
+		if(conn->socket_type == SOCK_STREAM && conn->picosock) {
+			if(pico_tcp_set_congestion(conn->picosock, name) < 0) {
+				errno = ENOENT;
+				return -1;
+			}
+			return 0;
+		}
+#endif
+		errno = ENOPROTOOPT;
+		return -1;
+	}
+#endif
+
+	// Marks what the socket sends, and the tap sends frames marked interactive ahead of the rest
+	// (see ZT_FRAME_TX_PRIO_RING_LEN). Accepted sockets inherit the listener's
+	if((level == IPPROTO_IP && optname == IP_TOS) || (level == IPPROTO_IPV6 && optname == IPV6_TCLASS)) {
+		if(!optval || optlen < sizeof(int)) {
+			errno = EINVAL;
+			return -1;
+		}
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+		if(!conn) {
+			errno = EBADF;
+			return -1;
+		}
+		if(conn->socket_type == SOCK_RAW) {
+			errno = ENOPROTOOPT;
+			return -1;
+		}
+		int value = *(const int*)optval;
+		// -1 is the kernel's way of asking for the default
+		if(optname == IPV6_TCLASS && value == -1)
+			value = 0;
+		if(value < 0 || value > 0xff) {
+			errno = EDOM;
+			return -1;
+		}
+		conn->tos = value;
+		applyStackOptions(conn, ZT_CONN_OPT_TOS);
+		return 0;
+	}
+
+	// Checked as datagrams are sent, see dgramSend()
+	if((level == IPPROTO_IP && optname == IP_MTU_DISCOVER) || (level == IPPROTO_IPV6 && optname == IPV6_MTU_DISCOVER)) {
+		if(!optval || optlen < sizeof(int)) {
+			errno = EINVAL;
+			return -1;
+		}
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+		if(!conn) {
+			errno = EBADF;
+			return -1;
+		}
+		if(conn->socket_type != SOCK_DGRAM) {
+			errno = ENOPROTOOPT;
+			return -1;
+		}
+		conn->pmtudisc_do = *(const int*)optval == IP_PMTUDISC_DO;
+		return 0;
+	}
+
+	// Metered by the stack thread as it hands data to the stack, see SocketTap::txAllowance()
+	if(level == SOL_SOCKET && optname == SO_MAX_PACING_RATE) {
+		if(!optval || (optlen != sizeof(uint32_t) && optlen != sizeof(uint64_t))) {
+			errno = EINVAL;
+			return -1;
+		}
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+		if(!conn) {
+			errno = EBADF;
+			return -1;
+		}
+		uint64_t rate;
+		if(optlen == sizeof(uint64_t))
+			memcpy(&rate, optval, sizeof(rate));
+		else {
+			uint32_t r32;
+			memcpy(&r32, optval, sizeof(r32));
+			rate = r32 == UINT32_MAX ? UINT64_MAX : r32;
+		}
+		conn->tx_shaper.configure(rate == UINT64_MAX ? 0 : rate, 0);
+		if(conn->tap)
+			conn->tap->ReleaseHeldTx();
+		return 0;
+	}
+
+	// Arrival times are taken as frames reach the tap, see dgramFinishRecv() and zts_recvmsg()
+	if(level == SOL_SOCKET && (optname == SO_TIMESTAMP || optname == SO_TIMESTAMPNS)) {
+		if(!optval || optlen < sizeof(int)) {
+			errno = EINVAL;
+			return -1;
+		}
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+		if(!conn) {
+			errno = EBADF;
+			return -1;
+		}
+		if(*(const int*)optval) {
+			ZeroTier::SocketTap::_rx_stamping = true;
+			conn->rx_timestamp = optname;
+		}
+		else if(conn->rx_timestamp == optname)
+			conn->rx_timestamp = 0;
+		return 0;
+	}
+
+	// Probes are scheduled by the stack on one shared timer, see ZT_TCP_KEEPIDLE_DEFAULT
+	if((level == SOL_SOCKET && optname == SO_KEEPALIVE) || (level == IPPROTO_TCP
+		&& (optname == TCP_KEEPIDLE || optname == TCP_KEEPINTVL || optname == TCP_KEEPCNT))) {
+		if(!optval || optlen < sizeof(int)) {
+			errno = EINVAL;
+			return -1;
+		}
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+		if(!conn) {
+			errno = EBADF;
+			return -1;
+		}
+		if(conn->socket_type != SOCK_STREAM) {
+			errno = ENOPROTOOPT;
+			return -1;
+		}
+		int value = *(const int*)optval;
+		if(optname != SO_KEEPALIVE && (value < 1 || value > 32767)) {
+			errno = EDOM;
+			return -1;
+		}
+		if(optname == SO_KEEPALIVE)
+			conn->keepalive = value != 0;
+		else if(optname == TCP_KEEPIDLE)
+			conn->keep_idle = value;
+		else if(optname == TCP_KEEPINTVL)
+			conn->keep_intvl = value;
+		else
+			conn->keep_cnt = value;
+		applyStackOptions(conn, ZT_CONN_OPT_KEEPALIVE);
+		return 0;
+	}
+
+	// Fine-grained timing of lwIP's TCP, see ZT_SO_TCP_RTO_MIN
+	if(level == IPPROTO_TCP && (optname == TCP_QUICKACK || optname == TCP_USER_TIMEOUT)) {
+		if(!optval || optlen < sizeof(int)) {
+			errno = EINVAL;
+			return -1;
+		}
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+		if(!conn) {
+			errno = EBADF;
+			return -1;
+		}
+		if(conn->socket_type != SOCK_STREAM || conn->picosock) {
+			errno = ENOPROTOOPT;
+			return -1;
+		}
+		int value = *(const int*)optval;
+		if(optname == TCP_QUICKACK)
+			conn->quickack = value != 0;
+		else if(value < 0) {
+			errno = EDOM;
+			return -1;
+		}
+		else
+			conn->user_timeout = (unsigned int)value;
+		applyStackOptions(conn, ZT_CONN_OPT_TIMERS);
+		return 0;
+	}
+
+	// The queue length of connections a listener accepts on their SYN, before their handshake
+	// completes (RFC 7413). Only lwIP does Fast Open, the client side is zts_sendto(MSG_FASTOPEN)
+	if(level == IPPROTO_TCP && optname == TCP_FASTOPEN) {
+		if(!optval || optlen < sizeof(int)) {
+			errno = EINVAL;
+			return -1;
+		}
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+		if(!conn) {
+			errno = EBADF;
+			return -1;
+		}
+		if(conn->socket_type != SOCK_STREAM || conn->picosock) {
+			errno = ENOPROTOOPT;
+			return -1;
+		}
+		int value = *(const int*)optval;
+		if(value < 0) {
+			errno = EDOM;
+			return -1;
+		}
+		conn->fastopen = value;
+		applyStackOptions(conn, ZT_CONN_OPT_FASTOPEN);
+		return 0;
+	}
+
+#if defined(SO_REUSEPORT)
+	// Listeners sharing a port are a picoTCP driver construct, see pico_Bind()
+	if(level == SOL_SOCKET && optname == SO_REUSEPORT) {
+		if(!optval || optlen < sizeof(int)) {
+			errno = EINVAL;
+			return -1;
+		}
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+		if(!conn) {
+			errno = EBADF;
+			return -1;
+		}
+		if(conn->tap) {
+			errno = EISCONN;
+			return -1;
+		}
+		conn->reuseport = *(const int*)optval != 0;
+		return 0;
+	}
+#endif
+
+	// Buffer caps are enforced by our own TX/RX buffers, the socketpair just passes data through
+	if(level == SOL_SOCKET && (optname == SO_SNDBUF || optname == SO_RCVBUF)) {
+		if(!optval || optlen < sizeof(int)) {
+			errno = EINVAL;
+			return -1;
+		}
+		int sz = *(const int*)optval;
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+		if(conn) {
+			// The TCP buffer caps leave datagram sockets alone
+			sz = std::max(sz, ZT_SDK_MTU);
+			if(conn->socket_type == SOCK_STREAM)
+				sz = std::min(sz, optname == SO_SNDBUF ? ZT_TCP_TX_BUF_SZ : ZT_TCP_RX_BUF_SZ);
+			(optname == SO_SNDBUF ? conn->TXbuf : conn->RXbuf)->setCapacity(sz);
+			(optname == SO_SNDBUF ? conn->tx_tune : conn->rx_tune).enabled = false;
+			if(conn->socket_type == SOCK_STREAM)
+				applyStackOptions(conn, optname == SO_SNDBUF ? ZT_CONN_OPT_SNDBUF : ZT_CONN_OPT_RCVBUF);
+		}
+	}
+
+	if(ZeroTier::FdTable::is_userspace(fd))
+		return userspaceSetsockopt(fd, level, optname, optval, optlen);
+	err = setsockopt(fd, level, optname, optval, optlen);
+	return err;
+#endif
+	return 0;
+}
+
+/*
+	[--] [EBADF]            The argument s is not a valid descriptor.
+	[  ] [ENOTSOCK]         The argument s is a file, not a socket.
+	[--] [ENOPROTOOPT]      The option is unknown at the level indicated.
+	[  ] [EFAULT]           The address pointed to by optval is not in a valid
+							part of the process address space.  For getsockopt(),
+							this error may also be returned if optlen is not in a
+							valid part of the process address space.
+	[  ] [EDOM]             The argument value is out of bounds.
+	[--] [ENOTCONN]         IP_MTU/IPV6_MTU was asked of a socket not yet on a network.
+*/
+int zts_getsockopt(ZT_GETSOCKOPT_SIG)
+{
+	if(ZeroTier::Mux::owns(fd))
+		return ZeroTier::Mux::getsockopt(fd, level, optname, optval, optlen);
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+	//DEBUG_INFO("fd = %d", fd);    
+	int err = 0;
+	if(fd < 0) {
+		errno = EBADF;
+		err = -1;
+	}
+	if(ZeroTier::fdtable.is_host(fd))
+		return getsockopt(fd, level, optname, optval, optlen);
+	if(level == ZT_SOL_LIBZT) {
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+		if(!conn) {
+			errno = EBADF;
+			return -1;
+		}
+		if(!optval || !optlen || *optlen < sizeof(int)) {
+			errno = EINVAL;
+			return -1;
+		}
+		if(optname == ZT_SO_UDP_RXQ_DROPS) {
+			uint64_t drops = conn->rxq_drops;
+			if(*optlen >= sizeof(uint64_t)) {
+				memcpy(optval, &drops, sizeof(drops));
+				*optlen = sizeof(drops);
+			}
+			else {
+				*(int*)optval = (int)std::min(drops, (uint64_t)INT_MAX);
+				*optlen = sizeof(int);
+			}
+			return 0;
+		}
+		if(optname == ZT_SO_DIRECT_IO)
+			*(int*)optval = conn->direct;
+		else if(optname == ZT_SO_TCP_COALESCE_BYTES)
+			*(int*)optval = conn->tx_coalesce_bytes;
+		else if(optname == ZT_SO_TCP_COALESCE_MS)
+			*(int*)optval = conn->tx_coalesce_ms;
+		else if(optname == ZT_SO_UDP_RXQ_DEPTH)
+			*(int*)optval = conn->rxq_depth;
+		else if(optname == ZT_SO_UDP_RXQ_DROP_OLDEST)
+			*(int*)optval = conn->rxq_drop_oldest;
+		else if(optname == ZT_SO_TCP_RTO_MIN)
+			*(int*)optval = conn->rto_min;
+		else if(optname == ZT_SO_MSG_RELIABLE && conn->socket_type == ZT_SOCK_MSG)
+			*(int*)optval = conn->msg_reliable;
+		else {
+			errno = ENOPROTOOPT;
+			return -1;
+		}
+		*optlen = sizeof(int);
+		return 0;
+	}
+	if(level == IPPROTO_TCP && (optname == TCP_NODELAY
+#if defined(TCP_CORK)
+		|| optname == TCP_CORK
+#endif
+		)) {
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+		if(!conn) {
+			errno = EBADF;
+			return -1;
+		}
+		if(!optval || !optlen || *optlen < sizeof(int)) {
+			errno = EINVAL;
+			return -1;
+		}
+		*(int*)optval = optname == TCP_NODELAY ? conn->tx_nodelay : conn->tx_cork.load();
+		*optlen = sizeof(int);
+		return 0;
+	}
+#if defined(TCP_CONGESTION)
+	if(level == IPPROTO_TCP && optname == TCP_CONGESTION) {
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+		if(!conn) {
+			errno = EBADF;
+			return -1;
+		}
+		if(!optval || !optlen || *optlen < 1) {
+			errno = EINVAL;
+			return -1;
+		}
+#if defined(STACK_PICO)
+		if(conn->socket_type == SOCK_STREAM && conn->picosock) {
+			const char *name = pico_tcp_get_congestion(conn->picosock);
+			*optlen = std::min((socklen_t)(strlen(name) + 1), *optlen);
+			memcpy(optval, name, *optlen);
+			return 0;
+		}
+#endif
+		errno = ENOPROTOOPT;
+		return -1;
+	}
+#endif
+	if((level == IPPROTO_IP && optname == IP_TOS) || (level == IPPROTO_IPV6 && optname == IPV6_TCLASS)) {
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+		if(!conn) {
+			errno = EBADF;
+			return -1;
+		}
+		if(!optval || !optlen || *optlen < sizeof(int)) {
+			errno = EINVAL;
+			return -1;
+		}
+		*(int*)optval = conn->tos;
+		*optlen = sizeof(int);
+		return 0;
+	}
+	if((level == IPPROTO_IP && optname == IP_MTU_DISCOVER) || (level == IPPROTO_IPV6 && optname == IPV6_MTU_DISCOVER)) {
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+		if(!conn) {
+			errno = EBADF;
+			return -1;
+		}
+		if(!optval || !optlen || *optlen < sizeof(int)) {
+			errno = EINVAL;
+			return -1;
+		}
+		*(int*)optval = conn->pmtudisc_do ? IP_PMTUDISC_DO : IP_PMTUDISC_DONT;
+		*optlen = sizeof(int);
+		return 0;
+	}
+	if(level == SOL_SOCKET && optname == SO_MAX_PACING_RATE) {
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+		if(conn) {
+			if(!optval || !optlen || (*optlen != sizeof(uint32_t) && *optlen < sizeof(uint64_t))) {
+				errno = EINVAL;
+				return -1;
+			}
+			uint64_t rate = conn->tx_shaper.enabled() ? conn->tx_shaper.rate() : UINT64_MAX;
+			if(*optlen == sizeof(uint32_t)) {
+				uint32_t r32 = (uint32_t)std::min(rate, (uint64_t)UINT32_MAX);
+				memcpy(optval, &r32, sizeof(r32));
+			}
+			else {
+				memcpy(optval, &rate, sizeof(rate));
+				*optlen = sizeof(rate);
+			}
+			return 0;
+		}
+	}
+	if(level == SOL_SOCKET && (optname == SO_TIMESTAMP || optname == SO_TIMESTAMPNS)) {
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+		if(conn) {
+			if(!optval || !optlen || *optlen < sizeof(int)) {
+				errno = EINVAL;
+				return -1;
+			}
+			*(int*)optval = conn->rx_timestamp == optname;
+			*optlen = sizeof(int);
+			return 0;
+		}
+	}
+	if((level == IPPROTO_IP && optname == IP_MTU) || (level == IPPROTO_IPV6 && optname == IPV6_MTU)) {
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+		if(!conn) {
+			errno = EBADF;
+			return -1;
+		}
+		if(!optval || !optlen || *optlen < sizeof(int)) {
+			errno = EINVAL;
+			return -1;
+		}
+		if(!conn->tap) {
+			errno = ENOTCONN;
+			return -1;
+		}
+		*(int*)optval = (int)conn->tap->pathMtu();
+		*optlen = sizeof(int);
+		return 0;
+	}
+	if((level == SOL_SOCKET && optname == SO_KEEPALIVE) || (level == IPPROTO_TCP
+		&& (optname == TCP_KEEPIDLE || optname == TCP_KEEPINTVL || optname == TCP_KEEPCNT))) {
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+		if(!conn) {
+			errno = EBADF;
+			return -1;
+		}
+		if(!optval || !optlen || *optlen < sizeof(int)) {
+			errno = EINVAL;
+			return -1;
+		}
+		if(optname == SO_KEEPALIVE)
+			*(int*)optval = conn->keepalive;
+		else if(optname == TCP_KEEPIDLE)
+			*(int*)optval = conn->keep_idle;
+		else if(optname == TCP_KEEPINTVL)
+			*(int*)optval = conn->keep_intvl;
+		else
+			*(int*)optval = conn->keep_cnt;
+		*optlen = sizeof(int);
+		return 0;
+	}
+	if(level == IPPROTO_TCP && (optname == TCP_QUICKACK || optname == TCP_USER_TIMEOUT)) {
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+		if(!conn) {
+			errno = EBADF;
+			return -1;
+		}
+		if(!optval || !optlen || *optlen < sizeof(int)) {
+			errno = EINVAL;
+			return -1;
+		}
+		*(int*)optval = optname == TCP_QUICKACK ? conn->quickack : (int)conn->user_timeout;
+		*optlen = sizeof(int);
+		return 0;
+	}
+	if(level == IPPROTO_TCP && optname == TCP_FASTOPEN) {
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+		if(!conn) {
+			errno = EBADF;
+			return -1;
+		}
+		if(!optval || !optlen || *optlen < sizeof(int)) {
+			errno = EINVAL;
+			return -1;
+		}
+		*(int*)optval = conn->fastopen;
+		*optlen = sizeof(int);
+		return 0;
+	}
+#if defined(SO_REUSEPORT)
+	if(level == SOL_SOCKET && optname == SO_REUSEPORT) {
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+		if(conn) {
+			if(!optval || !optlen || *optlen < sizeof(int)) {
+				errno = EINVAL;
+				return -1;
+			}
+			*(int*)optval = conn->reuseport;
+			*optlen = sizeof(int);
+			return 0;
+		}
+	}
+#endif
+	// The outcome of a non-blocking zts_connect(), the socketpair knows nothing of it
+	if(level == SOL_SOCKET && optname == SO_ERROR) {
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+		if(conn) {
+			if(!optval || !optlen || *optlen < sizeof(int)) {
+				errno = EINVAL;
+				return -1;
+			}
+			*(int*)optval = conn->so_error.exchange(0);
+			*optlen = sizeof(int);
+			return 0;
+		}
+	}
+	if(ZeroTier::FdTable::is_userspace(fd))
+		return userspaceGetsockopt(fd, level, optname, optval, optlen);
+	err = getsockopt(fd, level, optname, optval, optlen);
+	return err;
+}
+
+/*
+	[--] [EBADF]            The argument s is not a valid descriptor.
+	[  ] [ENOTSOCK]         The argument s is a file, not a socket.
+	[  ] [ENOBUFS]          Insufficient resources were available in the system to
+							perform the operation.
+	[  ] [EFAULT]           The name parameter points to memory not in a valid
+							part of the process address space.
+*/
+int zts_getsockname(ZT_GETSOCKNAME_SIG)
+{
+	if(ZeroTier::Mux::owns(fd))
+		return ZeroTier::Mux::getsockname(fd, addr, addrlen);
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+	DEBUG_INFO("fd = %d", fd);
+	int err = 0;
+	if(fd < 0) {
+		errno = EBADF;
+		err = -1;
+	}
+	else if(ZeroTier::fdtable.is_host(fd))
+		err = getsockname(fd, addr, addrlen);
+	else {
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get_unassigned(fd);
+		if(conn && conn->socket_type == ZT_SOCK_MSG)
+			err = msgName(conn, false, addr, addrlen);
+	}
+	// TODO
+	return err;
+}
+
+/*
+	[--] [EBADF]            The argument s is not a valid descriptor.
+	[  ] [ENOTSOCK]         The argument s is a file, not a socket.
+	[  ] [ENOTCONN]         The socket is not connected.
+	[  ] [ENOBUFS]          Insufficient resources were available in the system to
+							perform the operation.
+	[  ] [EFAULT]           The name parameter points to memory not in a valid
+							part of the process address space.
+*/
+int zts_getpeername(ZT_GETPEERNAME_SIG)
+{
+	if(ZeroTier::Mux::owns(fd))
+		return ZeroTier::Mux::getpeername(fd, addr, addrlen);
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+	DEBUG_INFO("fd = %d", fd);
+	int err = 0;
+	if(fd < 0) {
+		errno = EBADF;
+		err = -1;
+	}
+	else if(ZeroTier::fdtable.is_host(fd))
+		err = getpeername(fd, addr, addrlen);
+	else {
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get_unassigned(fd);
+		if(conn && conn->socket_type == ZT_SOCK_MSG)
+			err = msgName(conn, true, addr, addrlen);
+	}
+	// TODO
+	return err;
+}
+
+/*
+
+Linux:
+
+	See: http://yarchive.net/comp/linux/close_return_value.html
+
+Linux / Darwin:
+
+	[--] [EBADF]            fildes is not a valid, active file descriptor.
+	[NA] [EINTR]            Its execution was interrupted by a signal.
+	[  ] [EIO]              A previously-uncommitted write(2) encountered an input/output error.
+*/
+
+int zts_close(ZT_CLOSE_SIG)
+{
+	return zts_close_async(fd, NULL, NULL);
+}
+
+/*
+	As zts_close(), cb is called right away unless the closure is left to a stack thread
+*/
+int zts_close_async(int fd, zts_close_cb cb, void *arg)
+{
+#if defined(STACK_PICO) || defined(STACK_LWIP)
+	DEBUG_EXTRA("fd = %d", fd);
+	int err = 0;
+	if(fd < 0) {
+		errno = EBADF;
+		err = -1;
+	}
+	else if(ZeroTier::fdtable.is_host(fd)) {
+		ZeroTier::ProfiledMutex::Lock _l(ZeroTier::_multiplexer_lock);
+		ZeroTier::fdtable.erase(fd);
+		err = close(fd);
+	}
+	else if(ZeroTier::Mux::owns(fd))
+		err = ZeroTier::Mux::close(fd);
+	else
+	{
+		// zts_epoll instance
+		ZeroTier::_epolls_lock.lock();
+		std::map<int, std::shared_ptr<ZeroTier::Epoll> >::iterator it = ZeroTier::epolls.find(fd);
+		if(it != ZeroTier::epolls.end()) {
+			std::shared_ptr<ZeroTier::Epoll> ep = it->second;
+			ZeroTier::epolls.erase(it);
+			std::vector<ZeroTier::Connection*> conns = ep->shutdown();
+			for(size_t i=0; i<conns.size(); i++) {
+				ZeroTier::Mutex::Lock _cl(conns[i]->_epoll_m);
+				conns[i]->_epolls.erase(std::remove(conns[i]->_epolls.begin(), 
+					conns[i]->_epolls.end(), ep.get()), conns[i]->_epolls.end());
+			}
+			ZeroTier::_epolls_lock.unlock();
+			if(cb)
+				cb(fd, 0, arg);
+			return 0; // the descriptor is closed once the last waiter lets go of ep
+		}
+		// zts_cq instance, whatever is still pending or unreaped is discarded
+		std::map<int, std::shared_ptr<ZeroTier::CompletionQueue> >::iterator cit = ZeroTier::cqs.find(fd);
+		if(cit != ZeroTier::cqs.end()) {
+			std::shared_ptr<ZeroTier::Epoll> ep = cit->second->ep;
+			ZeroTier::cqs.erase(cit);
+			std::vector<ZeroTier::Connection*> conns = ep->shutdown();
+			for(size_t i=0; i<conns.size(); i++) {
+				ZeroTier::Mutex::Lock _cl(conns[i]->_epoll_m);
+				conns[i]->_epolls.erase(std::remove(conns[i]->_epolls.begin(), 
+					conns[i]->_epolls.end(), ep.get()), conns[i]->_epolls.end());
+			}
+			ZeroTier::_epolls_lock.unlock();
+			if(cb)
+				cb(fd, 0, arg);
+			return 0;
+		}
+		ZeroTier::_epolls_lock.unlock();
+
+		if(!serviceRunning()) {
+			DEBUG_ERROR("cannot close socket. service not started. call zts_start(path) first");
+			errno = EBADF;
+			err = -1;
+		}
+		else
+		{
+			ZeroTier::_multiplexer_lock.lock();
+			//DEBUG_INFO("nsockets=%d", ZeroTier::fdtable.size());
+			ZeroTier::SocketTap *tap;
+			ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd, &tap);
+
+			// If this is an unassigned connection, we don't need to consult the stack or tap
+			// during closure - it isn't yet stitched into the clockwork
+			if(conn && !tap) // unassigned
+			{
+				DEBUG_ERROR("unassigned closure");
+				zts_epoll_detach(conn);
+				if(conn->socket_type == SOCK_RAW && conn->tap)
+					conn->tap->RemoveRaw(conn);
+				if(conn->socket_type == ZT_SOCK_MSG && conn->msg_port)
+					conn->tap->_msg.unbind(conn->msg_port);
+				if(conn->driver)
+					conn->driver->Discard(conn);
+				if(ZeroTier::FdTable::is_userspace(fd))
+					conn->close_native();
+				else {
+					if((err = close(conn->app_fd)) < 0)
+						DEBUG_ERROR("error closing app_fd");
+					if((err = close(conn->sdk_fd)) < 0)
+						DEBUG_ERROR("error closing sdk_fd");            
+				}
+				ZeroTier::fdtable.erase(fd);
+				if(ZeroTier::FdTable::is_userspace(fd))
+					ZeroTier::fdtable.free_userspace(fd);
+				ZeroTier::connpool.recycle(conn);
+			}
+			else // assigned
+			{
+				if(!conn) 
+				{
+					DEBUG_ERROR("unable to locate connection pair.");
+					errno = EBADF;
+					err = -1;
+				}
+				else // found everything, begin closure
+				{
+					// The fd goes right away, the stack thread sends on whatever is still queued
+					// and then closes the stack's socket. Only blocking sockets get to wait for
+					// that, closing a non-blocking one hands the stack what it takes at once
+					uint64_t deadline = ZeroTier::Clock::now();
+					if(!conn->nonblocking)
+						deadline += ZT_SDK_CLTIME * ZT_API_CHECK_INTERVAL;
+					zts_epoll_detach(conn);
+					conn->close_cb = cb;
+					conn->close_arg = arg;
+					conn->close_fd = fd;
+					tap->CloseDeferred(conn, deadline);
+					cb = NULL; // it's the stack thread's to call now
+					ZeroTier::fdtable.erase(fd);
+					err = 0;
+				}
+			}
+			//DEBUG_INFO("nsockets=%d", ZeroTier::fdtable.size());
+			ZeroTier::_multiplexer_lock.unlock();
+		}
+	}
+	if(cb && !err)
+		cb(fd, 0, arg);
+	return err;
+#endif
+	return 0;
+}
+
+/*
+	Registers conn with an Epoll instance nobody else can reach (see zts_poll(), zts_submit()),
+	fails if fd no longer refers to conn
+*/
+static bool epollWatch(ZeroTier::Epoll *ep, int fd, ZeroTier::Connection *conn, uint32_t events)
+{
+	ZeroTier::ProfiledMutex::Lock _l(ZeroTier::_epolls_lock);
+	if(ZeroTier::fdtable.get(fd) != conn)
+		return false;
+	struct zts_epoll_event ev;
+	ev.events = events;
+	ev.data.fd = fd;
+	if(ep->ctl(ZTS_EPOLL_CTL_ADD, fd, conn, &ev) < 0 && errno != EEXIST)
+		return false;
+	ZeroTier::Mutex::Lock _cl(conn->_epoll_m);
+	if(std::find(conn->_epolls.begin(), conn->_epolls.end(), ep) == conn->_epolls.end())
+		conn->_epolls.push_back(ep);
+	return true;
+}
+
+static void epollUnwatch(ZeroTier::Epoll *ep, int fd, ZeroTier::Connection *conn)
+{
+	ZeroTier::ProfiledMutex::Lock _l(ZeroTier::_epolls_lock);
+	ep->remove(fd);
+	// If fd was closed zts_epoll_detach() has already let go of conn (which may be in use again)
+	if(ZeroTier::fdtable.get(fd) != conn)
+		return;
+	ZeroTier::Mutex::Lock _cl(conn->_epoll_m);
+	conn->_epolls.erase(std::remove(conn->_epolls.begin(), conn->_epolls.end(), ep), 
+		conn->_epolls.end());
+}
+
+/*
+	poll() for a set containing sockets with a non-blocking zts_connect() in flight, their
+	socketpairs are always writable so POLLOUT comes from the stack's report on the attempt
+	instead (through a private Epoll, woken by pico_cb_socket_activity()). Userspace
+	descriptors (see zts_stack_config.userspace_fds) have nothing for the kernel to look at,
+	all of their events come from the stack
+*/
+static int pollStack(struct pollfd *fds, nfds_t nfds, int timeout, const std::vector<nfds_t> &watched)
+{
+	ZeroTier::Epoll ep;
+	std::vector<ZeroTier::Connection*> conns(watched.size());
+	std::vector<struct pollfd> pfds(fds, fds + nfds);
+	for(size_t i=0; i<watched.size(); i++) {
+		struct pollfd *p = &pfds[watched[i]];
+		ZeroTier::fdtable.pin(p->fd); // conns[i] is used until the end
+		conns[i] = ZeroTier::fdtable.get(p->fd);
+		uint32_t events = ZTS_EPOLLOUT;
+		if(ZeroTier::FdTable::is_userspace(p->fd)) {
+			events |= ZTS_EPOLLIN;
+			p->fd = -1; // skipped by poll()
+		}
+		p->events &= ~POLLOUT;
+		if(conns[i] && !epollWatch(&ep, fds[watched[i]].fd, conns[i], events))
+			conns[i] = NULL;
+	}
+	struct pollfd sig = { ep.fd(), POLLIN, 0 };
+	pfds.push_back(sig);
+
+	uint64_t deadline = ZeroTier::OSUtils::now() + timeout;
+	int n;
+	for(;;) {
+		int wait_ms = timeout;
+		if(timeout > 0) {
+			uint64_t now = ZeroTier::OSUtils::now();
+			wait_ms = now < deadline ? (int)(deadline - now) : 0;
+		}
+		if((n = poll(pfds.data(), pfds.size(), wait_ms)) < 0)
+			break;
+		struct zts_epoll_event evs[16];
+		while(ep.wait(evs, 16, 0) == 16) { } // only drains the pipe, readiness is rechecked below
+		n = 0;
+		for(nfds_t i=0; i<nfds; i++)
+			fds[i].revents = pfds[i].revents;
+		for(size_t i=0; i<watched.size(); i++) {
+			struct pollfd *p = &fds[watched[i]];
+			if(!conns[i]) {
+				p->revents |= POLLNVAL;
+				continue;
+			}
+			uint32_t ev = ZeroTier::Epoll::current_events(conns[i]);
+			if((ev & ZTS_EPOLLIN) && (p->events & POLLIN) && ZeroTier::FdTable::is_userspace(p->fd))
+				p->revents |= POLLIN;
+			if((ev & ZTS_EPOLLOUT) && (p->events & POLLOUT))
+				p->revents |= POLLOUT;
+			if(ev & ZTS_EPOLLERR)
+				p->revents |= POLLERR;
+			if(ev & ZTS_EPOLLHUP)
+				p->revents |= POLLHUP;
+		}
+		for(nfds_t i=0; i<nfds; i++)
+			n += fds[i].revents != 0;
+		if(n || timeout == 0 || (timeout > 0 && ZeroTier::OSUtils::now() >= deadline))
+			break;
+	}
+	for(size_t i=0; i<watched.size(); i++) {
+		if(conns[i])
+			epollUnwatch(&ep, fds[watched[i]].fd, conns[i]);
+		ZeroTier::fdtable.unpin(fds[watched[i]].fd);
+	}
+	return n;
+}
+
+int zts_poll(ZT_POLL_SIG)
+{
+	std::vector<nfds_t> watched;
+	for(nfds_t i=0; i<nfds; i++) {
+		if(ZeroTier::Mux::owns(fds[i].fd))
+			return ZeroTier::Mux::poll(fds, nfds, timeout);
+		if(ZeroTier::FdTable::is_userspace(fds[i].fd)) {
+			watched.push_back(i);
+			continue;
+		}
+		if(fds[i].fd < 0 || !(fds[i].events & POLLOUT))
+			continue;
+		ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fds[i].fd);
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fds[i].fd);
+		if(conn && conn->connecting)
+			watched.push_back(i);
+	}
+	if(watched.empty())
+		return poll(fds, nfds, timeout);
+	return pollStack(fds, nfds, timeout, watched);
+}
+
+int zts_select(ZT_SELECT_SIG)
+{
+	bool connecting = false;
+	for(int fd=0; writefds && fd<nfds && !connecting; fd++) {
+		if(!FD_ISSET(fd, writefds))
+			continue;
+		ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+		connecting = conn && conn->connecting;
+	}
+	if(!connecting)
+		return select(nfds, readfds, writefds, exceptfds, timeout);
+	// Same as zts_poll(), see pollStack()
+	std::vector<struct pollfd> fds;
+	for(int fd=0; fd<nfds; fd++) {
+		struct pollfd p = { fd, 0, 0 };
+		if(readfds && FD_ISSET(fd, readfds))
+			p.events |= POLLIN;
+		if(writefds && FD_ISSET(fd, writefds))
+			p.events |= POLLOUT;
+		if(exceptfds && FD_ISSET(fd, exceptfds))
+			p.events |= POLLPRI;
+		if(p.events)
+			fds.push_back(p);
+	}
+	int timeout_ms = timeout ? (int)(timeout->tv_sec * 1000 + timeout->tv_usec / 1000) : -1;
+	int n = zts_poll(fds.data(), fds.size(), timeout_ms);
+	if(n < 0)
+		return n;
+	if(readfds)
+		FD_ZERO(readfds);
+	if(writefds)
+		FD_ZERO(writefds);
+	if(exceptfds)
+		FD_ZERO(exceptfds);
+	n = 0;
+	for(size_t i=0; i<fds.size(); i++) {
+		short ev = fds[i].revents, want = fds[i].events;
+		// Like the kernel's select(), an error makes a socket both readable and writable
+		if((want & POLLIN) && (ev & (POLLIN | POLLHUP | POLLERR))) {
+			FD_SET(fds[i].fd, readfds);
+			n++;
+		}
+		if((want & POLLOUT) && (ev & (POLLOUT | POLLERR))) {
+			FD_SET(fds[i].fd, writefds);
+			n++;
+		}
+		if((want & POLLPRI) && (ev & POLLPRI)) {
+			FD_SET(fds[i].fd, exceptfds);
+			n++;
+		}
+	}
+	return n;
+}
+
+/*
+	[--] [EINVAL]           Invalid value specified in flags.
+	[--] [EMFILE]           Unable to create a descriptor for the instance.
+*/
+int zts_epoll_create(ZT_EPOLL_CREATE_SIG)
+{
+	if(flags != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	std::shared_ptr<ZeroTier::Epoll> ep(new ZeroTier::Epoll());
+	int epfd = ep->fd();
+	if(epfd < 0) {
+		errno = EMFILE;
+		return -1;
+	}
+	ZeroTier::ProfiledMutex::Lock _l(ZeroTier::_epolls_lock);
+	ZeroTier::epolls[epfd] = ep;
+	return epfd;
+}
+
+/*
+	[--] [EBADF]            epfd or fd is not a valid descriptor.
+	[--] [EEXIST]           op was ZTS_EPOLL_CTL_ADD and fd is already registered.
+	[--] [EINVAL]           epfd is the same as fd, or op is not supported.
+	[--] [ENOENT]           op was ZTS_EPOLL_CTL_MOD or ZTS_EPOLL_CTL_DEL and fd is not registered.
+	[--] [EFAULT]           event is NULL for ZTS_EPOLL_CTL_ADD or ZTS_EPOLL_CTL_MOD.
+	[--] [EPERM]            fd is a socket of the host's stack (see ZTS_ROUTE_HOST).
+*/
+int zts_epoll_ctl(ZT_EPOLL_CTL_SIG)
+{
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+	ZeroTier::ProfiledMutex::Lock _l(ZeroTier::_epolls_lock);
+	std::map<int, std::shared_ptr<ZeroTier::Epoll> >::iterator it = ZeroTier::epolls.find(epfd);
+	if(it == ZeroTier::epolls.end()) {
+		errno = EBADF;
+		return -1;
+	}
+	if(fd == epfd) {
+		errno = EINVAL;
+		return -1;
+	}
+	ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+	if(!conn) {
+		errno = ZeroTier::fdtable.is_host(fd) || ZeroTier::Mux::owns(fd) ? EPERM : EBADF;
+		return -1;
+	}
+	ZeroTier::Epoll *ep = it->second.get();
+	int err = ep->ctl(op, fd, conn, event);
+	if(err == 0) {
+		ZeroTier::Mutex::Lock _cl(conn->_epoll_m);
+		std::vector<ZeroTier::Epoll*>::iterator e = std::find(conn->_epolls.begin(), conn->_epolls.end(), ep);
+		if(op == ZTS_EPOLL_CTL_ADD && e == conn->_epolls.end())
+			conn->_epolls.push_back(ep);
+		if(op == ZTS_EPOLL_CTL_DEL && e != conn->_epolls.end())
+			conn->_epolls.erase(e);
+	}
+	return err;
+}
+
+/*
+	[--] [EBADF]            epfd is not a valid descriptor (or was closed while waiting).
+	[--] [EINVAL]           maxevents is less than or equal to zero.
+	[--] [EFAULT]           events is NULL.
+*/
+int zts_epoll_wait(ZT_EPOLL_WAIT_SIG)
+{
+	if(!events) {
+		errno = EFAULT;
+		return -1;
+	}
+	if(maxevents <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	std::shared_ptr<ZeroTier::Epoll> ep;
+	ZeroTier::_epolls_lock.lock();
+	std::map<int, std::shared_ptr<ZeroTier::Epoll> >::iterator it = ZeroTier::epolls.find(epfd);
+	if(it != ZeroTier::epolls.end())
+		ep = it->second;
+	ZeroTier::_epolls_lock.unlock();
+	if(!ep) {
+		errno = EBADF;
+		return -1;
+	}
+	return ep->wait(events, maxevents, timeout);
+}
+
+/*
+	[--] [EBADF]            epfd is not a valid descriptor.
+*/
+int zts_epoll_wakeup(int epfd)
+{
+	ZeroTier::ProfiledMutex::Lock _l(ZeroTier::_epolls_lock);
+	std::map<int, std::shared_ptr<ZeroTier::Epoll> >::iterator it = ZeroTier::epolls.find(epfd);
+	if(it == ZeroTier::epolls.end()) {
+		errno = EBADF;
+		return -1;
+	}
+	it->second->kick();
+	return 0;
+}
+
+/*
+	[--] [EBADF]            fd is not a valid descriptor.
+	[--] [EMFILE]           Unable to create the socketpair.
+*/
+/*
+	[--] [EINVAL]           stats is NULL.
+*/
+/*
+	[--] [EBADF]            fd isn't a bound ZT_SOCK_MSG socket.
+	[--] [EINVAL]           stats is NULL.
+*/
+int zts_get_msg_stats(int fd, struct zts_msg_stats *stats)
+{
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+	if(!stats) {
+		errno = EINVAL;
+		return -1;
+	}
+	ZeroTier::ProfiledMutex::Lock _l(ZeroTier::_multiplexer_lock);
+	ZeroTier::Connection *conn = ZeroTier::fdtable.get_unassigned(fd);
+	if(!conn || conn->socket_type != ZT_SOCK_MSG || !conn->msg_port
+		|| !conn->tap->_msg.stats(conn->msg_port, stats)) {
+		errno = EBADF;
+		return -1;
+	}
+	return 0;
+}
+
+int zts_get_mux_stats(struct zts_mux_stats *stats)
+{
+	if(!stats) {
+		errno = EINVAL;
+		return -1;
+	}
+	ZeroTier::Mux::stats(stats);
+	return 0;
+}
+
+int zts_get_native_fd(int fd)
+{
+	if(fd < 0) {
+		errno = EBADF;
+		return -1;
+	}
+	if(!ZeroTier::FdTable::is_userspace(fd))
+		return fd;
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+	ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+	if(!conn) {
+		errno = EBADF;
+		return -1;
+	}
+	ZeroTier::Mutex::Lock _l(conn->_epoll_m);
+	if(conn->native_fd[0] < 0) {
+		int fdpair[2];
+		if(socketpair(PF_LOCAL, SOCK_STREAM, 0, fdpair) < 0) {
+			DEBUG_ERROR("unable to create socketpair");
+			errno = EMFILE;
+			return -1;
+		}
+		fcntl(fdpair[0], F_SETFL, O_NONBLOCK);
+		fcntl(fdpair[1], F_SETFL, O_NONBLOCK);
+		conn->native_fd[0] = fdpair[0];
+		conn->native_fd[1] = fdpair[1];
+		conn->native_ready = false;
+		ZeroTier::native_sync(conn);
+	}
+	return conn->native_fd[0];
+}
+
+/*
+	[--] [EINVAL]           entries is zero.
+	[--] [EMFILE]           Unable to create a descriptor for the instance.
+*/
+int zts_cq_create(ZT_CQ_CREATE_SIG)
+{
+	if(!entries) {
+		errno = EINVAL;
+		return -1;
+	}
+	std::shared_ptr<ZeroTier::CompletionQueue> cq(new ZeroTier::CompletionQueue(entries));
+	int cqfd = cq->fd();
+	if(cqfd < 0) {
+		errno = EMFILE;
+		return -1;
+	}
+	ZeroTier::ProfiledMutex::Lock _l(ZeroTier::_epolls_lock);
+	ZeroTier::cqs[cqfd] = cq;
+	return cqfd;
+}
+
+static std::shared_ptr<ZeroTier::CompletionQueue> getCompletionQueue(int cqfd)
+{
+	ZeroTier::ProfiledMutex::Lock _l(ZeroTier::_epolls_lock);
+	std::map<int, std::shared_ptr<ZeroTier::CompletionQueue> >::iterator it = ZeroTier::cqs.find(cqfd);
+	return it == ZeroTier::cqs.end() ? std::shared_ptr<ZeroTier::CompletionQueue>() : it->second;
+}
+
+/*
+	Has the stack tell cq about activity on fd, false if fd no longer refers to conn
+*/
+static bool cqWatch(ZeroTier::CompletionQueue *cq, int fd, ZeroTier::Connection *conn)
+{
+	return epollWatch(cq->ep.get(), fd, conn, ZTS_EPOLLIN | ZTS_EPOLLOUT | ZTS_EPOLLET);
+}
+
+static void cqUnwatch(ZeroTier::CompletionQueue *cq, int fd, ZeroTier::Connection *conn)
+{
+	epollUnwatch(cq->ep.get(), fd, conn);
+}
+
+/*
+	One non-blocking try at an operation, returns its result (-errno on failure) or -EAGAIN if
+	it has to wait for the stack
+*/
+static ssize_t cqAttempt(ZeroTier::CompletionQueue::op &o)
+{
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, o.sqe.fd);
+	ZeroTier::SocketTap *tap = NULL;
+	ZeroTier::Connection *conn = ZeroTier::fdtable.get(o.sqe.fd, &tap);
+	if(!conn || conn != o.conn)
+		return -EBADF; // closed since submission
+	ssize_t n;
+	int flags = MSG_DONTWAIT;
+#if defined(MSG_NOSIGNAL)
+	flags |= MSG_NOSIGNAL;
+#endif
+	switch(o.sqe.op) {
+		case ZTS_OP_READ:
+			n = zts_recv(o.sqe.fd, o.sqe.buf, o.sqe.len, flags);
+			return n < 0 ? (errno == EWOULDBLOCK ? -EAGAIN : -errno) : n;
+		case ZTS_OP_WRITE:
+			n = zts_send(o.sqe.fd, o.sqe.buf, o.sqe.len, flags);
+			return n < 0 ? (errno == EWOULDBLOCK ? -EAGAIN : -errno) : n;
+		case ZTS_OP_ACCEPT: {
+			if(!tap || conn->state != ZT_SOCK_STATE_LISTENING)
+				return -EINVAL;
+			if(!conn->_AcceptedCount)
+				return -EAGAIN;
+			ZeroTier::Connection *accepted_conn = tap->Accept(conn);
+			if(!accepted_conn)
+				return -EAGAIN;
+			ZeroTier::ProfiledMutex::Lock _l(ZeroTier::_multiplexer_lock);
+			ZeroTier::fdtable.assign(accepted_conn->app_fd, accepted_conn, tap);
+			return accepted_conn->app_fd;
+		}
+		case ZTS_OP_CONNECT:
+			if(conn->so_error)
+				return -conn->so_error.exchange(0);
+#if defined(STACK_PICO)
+			if(conn->state == PICO_ERR_ECONNRESET)
+				return -ECONNRESET;
+#endif
+			if(conn->state == ZT_SOCK_STATE_UNHANDLED_CONNECTED)
+				conn->state = ZT_SOCK_STATE_CONNECTED;
+			return conn->state == ZT_SOCK_STATE_CONNECTED ? 0 : -EAGAIN;
+	}
+	return -EINVAL;
+}
+
+/*
+	[--] [EBADF]            cq is not a valid descriptor.
+	[--] [EFAULT]           sqes is NULL.
+	[--] [EAGAIN]           No operation could be accepted, entries are already outstanding.
+
+	Per-operation errors are reported in the res of its zts_cqe.
+*/
+int zts_submit(ZT_SUBMIT_SIG)
+{
+	if(!sqes && n) {
+		errno = EFAULT;
+		return -1;
+	}
+	std::shared_ptr<ZeroTier::CompletionQueue> q = getCompletionQueue(cq);
+	if(!q) {
+		errno = EBADF;
+		return -1;
+	}
+	std::lock_guard<std::mutex> _l(q->_m);
+	size_t posted = q->done.size();
+	unsigned int i;
+	for(i=0; i<n && q->outstanding < q->cap; i++) {
+		ZeroTier::CompletionQueue::op o;
+		o.sqe = sqes[i];
+		o.conn = ZeroTier::fdtable.get(o.sqe.fd);
+		q->outstanding++;
+		if(!o.conn) {
+			q->post(o.sqe, -EBADF);
+			continue;
+		}
+		if(o.sqe.op < ZTS_OP_READ || o.sqe.op > ZTS_OP_CONNECT 
+			|| ((o.sqe.op == ZTS_OP_READ || o.sqe.op == ZTS_OP_WRITE) && !o.sqe.buf && o.sqe.len)) {
+			q->post(o.sqe, -EINVAL);
+			continue;
+		}
+		if(o.sqe.op == ZTS_OP_CONNECT) {
+			if(!o.sqe.addr || o.sqe.addrlen > sizeof(o.addr)) {
+				q->post(o.sqe, -EINVAL);
+				continue;
+			}
+			memcpy(&o.addr, o.sqe.addr, o.sqe.addrlen);
+			o.sqe.addr = NULL; // o is copied around, don't point into it
+#if defined(STACK_PICO)
+			ZeroTier::Connection *conn;
+			if(connectStart(o.sqe.fd, (struct sockaddr *)&o.addr, o.sqe.addrlen, &conn) < 0) {
+				q->post(o.sqe, -errno);
+				continue;
+			}
+			if(!conn) { // connected through the host's stack, o.conn is gone
+				q->post(o.sqe, 0);
+				continue;
+			}
+#else
+			q->post(o.sqe, -EOPNOTSUPP);
+			continue;
+#endif
+		}
+		int d = ZeroTier::CompletionQueue::direction(o.sqe.op);
+		std::map<int, ZeroTier::CompletionQueue::fd_ops>::iterator it = q->pending.find(o.sqe.fd);
+		if(it != q->pending.end() && it->second.conn != o.conn) {
+			// fd was closed and reused, fail whatever was waiting on the old socket first
+			ZeroTier::Connection *old = it->second.conn;
+			q->progress(o.sqe.fd, cqAttempt);
+			q->pending.erase(it);
+			cqUnwatch(q.get(), o.sqe.fd, old);
+			it = q->pending.end();
+		}
+		if(it == q->pending.end() || it->second.q[d].empty()) {
+			ssize_t res = cqAttempt(o);
+			if(res != -EAGAIN) {
+				q->post(o.sqe, res);
+				continue;
+			}
+		}
+		if(it == q->pending.end()) {
+			if(!cqWatch(q.get(), o.sqe.fd, o.conn)) {
+				q->post(o.sqe, -EBADF);
+				continue;
+			}
+			it = q->pending.insert(std::make_pair(o.sqe.fd, ZeroTier::CompletionQueue::fd_ops())).first;
+			it->second.conn = o.conn;
+		}
+		it->second.q[d].push_back(o);
+	}
+	if(q->done.size() != posted)
+		q->ep->kick();
+	if(!i && n) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return i;
+}
+
+/*
+	[--] [EBADF]            cq is not a valid descriptor (or was closed while waiting).
+	[--] [EFAULT]           cqes is NULL.
+	[--] [EINVAL]           max is zero.
+*/
+int zts_complete(ZT_COMPLETE_SIG)
+{
+	if(!cqes) {
+		errno = EFAULT;
+		return -1;
+	}
+	if(!max) {
+		errno = EINVAL;
+		return -1;
+	}
+	std::shared_ptr<ZeroTier::CompletionQueue> q = getCompletionQueue(cq);
+	if(!q) {
+		errno = EBADF;
+		return -1;
+	}
+	std::chrono::steady_clock::time_point deadline = 
+		std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+	struct zts_epoll_event events[64];
+	int wait_ms = 0;
+	for(;;) {
+		int nev = q->ep->wait(events, 64, wait_ms);
+		if(nev < 0)
+			return -1;
+		{
+			std::lock_guard<std::mutex> _l(q->_m);
+			std::vector<int> fds = q->ep->take_dropped();
+			for(int i=0; i<nev; i++)
+				fds.push_back(events[i].data.fd);
+			// Nothing was reported for a while, retry everything in case a change went unannounced
+			if(!nev && wait_ms) {
+				for(std::map<int, ZeroTier::CompletionQueue::fd_ops>::iterator it = q->pending.begin(); 
+					it != q->pending.end(); ++it)
+					fds.push_back(it->first);
+			}
+			for(size_t i=0; i<fds.size(); i++) {
+				std::map<int, ZeroTier::CompletionQueue::fd_ops>::iterator it = q->pending.find(fds[i]);
+				if(it == q->pending.end())
+					continue;
+				ZeroTier::Connection *conn = it->second.conn;
+				if(q->progress(fds[i], cqAttempt)) {
+					q->pending.erase(it);
+					cqUnwatch(q.get(), fds[i], conn);
+				}
+			}
+			int n = q->reap(cqes, max);
+			if(!q->done.empty())
+				q->ep->kick(); // there's more for the next call
+			if(n)
+				return n;
+		}
+		if(timeout == 0)
+			return 0;
+		wait_ms = ZT_CQ_RECHECK_DELAY;
+		if(timeout > 0) {
+			long left = std::chrono::duration_cast<std::chrono::milliseconds>(
+				deadline - std::chrono::steady_clock::now()).count();
+			if(left <= 0)
+				return 0;
+			if(left < wait_ms)
+				wait_ms = left;
+		}
+	}
+}
+
+// Keeps Connection::nonblocking in step with the descriptor's O_NONBLOCK
+static void setNonblocking(int fd, bool nonblocking)
+{
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+	ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+	if(conn)
+		conn->nonblocking = nonblocking;
+}
+
+int zts_fcntl(ZT_FCNTL_SIG)
+{
+	int err = 0;
+	if(fd < 0) {
+		errno = EBADF;
+		err = -1;
+	}
+	else if(ZeroTier::Mux::owns(fd))
+		err = ZeroTier::Mux::fcntl(fd, cmd, flags);
+	else if(ZeroTier::FdTable::is_userspace(fd)) {
+		// O_NONBLOCK is all there is to a userspace descriptor's flags
+		ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+		if(!conn) {
+			errno = EBADF;
+			err = -1;
+		}
+		else if(cmd == F_GETFL)
+			err = O_RDWR | (conn->nonblocking ? O_NONBLOCK : 0);
+		else if(cmd == F_SETFL)
+			conn->nonblocking = (flags & O_NONBLOCK) != 0;
+		else if(cmd != F_GETFD && cmd != F_SETFD) {
+			errno = EINVAL;
+			err = -1;
+		}
+	}
+	else {
+		err = fcntl(fd, cmd, flags);
+		if(err == 0 && cmd == F_SETFL)
+			setNonblocking(fd, flags & O_NONBLOCK);
+	}
+	return err;
+}
+
+/*
+	   struct ifreq {
+		   char ifr_name[IFNAMSIZ];
+		   union {
+			   struct sockaddr ifr_addr;
+			   struct sockaddr ifr_dstaddr;
+			   struct sockaddr ifr_broadaddr;
+			   struct sockaddr ifr_netmask;
+			   struct sockaddr ifr_hwaddr;
+			   short           ifr_flags;
+			   int             ifr_ifindex;
+			   int             ifr_metric;
+			   int             ifr_mtu;
+			   struct ifmap    ifr_map;
+			   char            ifr_slave[IFNAMSIZ];
+			   char            ifr_newname[IFNAMSIZ];
+			   char           *ifr_data;
+		   };
+	   };
+*/
+
+/*
+	[  ] [BADF]             fd is not a valid file descriptor.
+	[  ] [EFAULT]           argp references an inaccessible memory area.
+	[  ] [EINVAL]           request or argp is not valid.
+	[  ] [ENOTTY]           The specified request does not apply to the kind of object that the file descriptor fd references.
+*/
+
+int zts_ioctl(ZT_IOCTL_SIG)
+{
+	int err = 0;
+	if(fd < 0) {
+		errno = EBADF;
+		err = -1;
+	}
+	else if(ZeroTier::Mux::owns(fd))
+		err = ZeroTier::Mux::ioctl(fd, request, argp);
+	else if(ZeroTier::FdTable::is_userspace(fd) && (request == FIONBIO || request == FIONREAD)) {
+		ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+		if(!conn || !argp) {
+			errno = conn ? EINVAL : EBADF;
+			err = -1;
+		}
+		else if(request == FIONBIO)
+			conn->nonblocking = *(int *)argp != 0;
+		else
+			*(int *)argp = (int)conn->RXbuf->count();
+	}
+	else if(request == FIONBIO) {
+		if((err = ioctl(fd, request, argp)) == 0 && argp)
+			setNonblocking(fd, *(int *)argp);
+	}
+	else {
+#if defined(__linux__)
+		if(argp)
+		{
+			struct ifreq *ifr = (struct ifreq *)argp;
+			ZeroTier::SocketTap *tap = getTapByName(ifr->ifr_name);
+			if(!tap) {
+				DEBUG_ERROR("unable to locate tap interface with that name");
+				err = -1;
+				errno = EINVAL;
+			}
+			// index of SocketTap interface
+			if(request == SIOCGIFINDEX) {
+				ifr->ifr_ifindex = tap->ifindex;
+				err = 0;
+			}
+			// MAC addres or SocketTap
+			if(request == SIOCGIFHWADDR) {
+				tap->_mac.copyTo(&(ifr->ifr_hwaddr.sa_data), sizeof(ifr->ifr_hwaddr.sa_data));
+				err = 0;
+			}
+			// IP address of SocketTap
+			if(request == SIOCGIFADDR) {
+				struct sockaddr_in *in4 = (struct sockaddr_in *)&(ifr->ifr_addr);
+				memcpy(&(in4->sin_addr.s_addr), tap->_ips[0].rawIpData(), sizeof(ifr->ifr_addr));
+				err = 0;
+			}
+		}
+		else
+		{
+			DEBUG_INFO("!argp");
+		}
+#else
+		err = ioctl(fd, request, argp);
+#endif
+	}
+	return err;
+}
+
+
+/*
+
+Linux:
+
+	[  ] [EAGAIN or EWOULDBLOCK] The socket is marked nonblocking and the requested operation would block. POSIX.1-2001 allows either error to be returned for this case, and does not require these constants to have the same value, so a portable application should check for both possibilities.
+	[  ] [EBADF]                 An invalid descriptor was specified.
+	[  ] [ECONNRESET]            Connection reset by peer.
+	[  ] [EDESTADDRREQ]          The socket is not connection-mode, and no peer address is set.
+	[  ] [EFAULT]                An invalid user space address was specified for an argument.
+	[  ] [EINTR]                 A signal occurred before any data was transmitted; see signal(7).
+	[  ] [EINVAL]                Invalid argument passed.
+	[  ] [EISCONN]               The connection-mode socket was connected already but a recipient was specified. (Now either this error is returned, or the recipient specification is ignored.)
+	[--] [EMSGSIZE]              The socket type requires that message be sent atomically, and the size of the message to be sent made this impossible (IP_PMTUDISC_DO is set and the datagram exceeds the network's path MTU).
+	[  ] [ENOBUFS]               The output queue for a network interface was full. This generally indicates that the interface has stopped sending, but may be caused by transient congestion. (Normally, this does not occur in Linux. Packets are just silently dropped when a device queue overflows.)
+	[  ] [ENOMEM]                No memory available.
+	[  ] [ENOTCONN]              The socket is not connected, and no target has been given.
+	[  ] [ENOTSOCK]              The argument sockfd is not a socket.
+	[  ] [EOPNOTSUPP]            Some bit in the flags argument is inappropriate for the socket type.
+	[  ] [EPIPE]                 The local end has been shut down on a connection oriented socket. In this case the process will also receive a SIGPIPE unless MSG_NOSIGNAL is set.
+
+*/
+ssize_t zts_sendto(ZT_SENDTO_SIG)
+{
+	if(ZeroTier::Mux::owns(fd)) {
+		if(addr) {
+			errno = EISCONN;
+			return -1;
+		}
+		return ZeroTier::Mux::send(fd, buf, len, flags);
+	}
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+	DEBUG_INFO("fd = %d", fd);
+	int err = 0;
+	if(fd < 0) {
+		errno = EBADF;
+		err = -1;
+	}
+	else {
+		if(ZeroTier::fdtable.is_host(fd))
+			return sendto(fd, buf, len, flags, addr, addrlen);
+		ZeroTier::Connection *dconn = ZeroTier::fdtable.get(fd);
+		// TCP Fast Open: connect() puts what it can of buf on the SYN if the peer's cookie is
+		// known (see lwip_Connect()), the rest is sent once connected
+		if(dconn && dconn->socket_type == SOCK_STREAM && (flags & MSG_FASTOPEN)) {
+			if(!addr) {
+				errno = EDESTADDRREQ;
+				return -1;
+			}
+			dconn->syn_data = buf;
+			dconn->syn_len = len;
+			int rc = zts_connect(fd, addr, addrlen);
+			size_t sent = dconn->syn_len;
+			dconn->syn_data = NULL;
+			dconn->syn_len = 0;
+			if(rc < 0)
+				return errno == EINPROGRESS && sent ? (ssize_t)sent : -1;
+			if(sent < len) {
+				ssize_t n = zts_send(fd, (const char *)buf + sent, len - sent, flags & ~MSG_FASTOPEN);
+				if(n < 0)
+					return sent ? (ssize_t)sent : -1;
+				sent += n;
+			}
+			return sent;
+		}
+		if(dconn && (dconn->socket_type == SOCK_DGRAM || dconn->socket_type == ZT_SOCK_MSG)) {
+			struct iovec iov;
+			iov.iov_base = (void*)buf;
+			iov.iov_len = len;
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_name = (void*)addr;
+			msg.msg_namelen = addr ? addrlen : 0;
+			msg.msg_iov = &iov;
+			msg.msg_iovlen = 1;
+			if(dconn->socket_type == ZT_SOCK_MSG)
+				return msgSend(dconn, &msg, flags);
+			return dgramSend(dconn, &msg, flags);
+		}
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get_unassigned(fd);
+		if(!conn) {
+			DEBUG_ERROR("unable to locate connection object for fd=%d", fd);
+			errno = EINVAL;
+			return -1;
+		}
+		// A bound SOCK_RAW socket already knows its tap, see rawBind()
+		struct sockaddr_ll *socket_address = (struct sockaddr_ll *)addr;
+		ZeroTier::SocketTap *tap = conn->tap;
+		if(socket_address && (!tap || socket_address->sll_ifindex != tap->ifindex))
+			tap = getTapByIndex(socket_address->sll_ifindex);
+		if(tap)
+			err = tap->Write(conn, (void*)buf, len);
+		else
+		{
+			DEBUG_ERROR("unable to locate tap for fd=%d", fd);
+			err = -1;
+			errno = socket_address ? EINVAL : EDESTADDRREQ;
+		}
+		//err = sendto(fd, buf, len, flags, addr, addrlen);
+	}
+	return err;
+}
+
+/*
+	[--] [EBADF]            An invalid descriptor was specified.
+	[--] [EDESTADDRREQ]     The socket is not connected, and no destination was given.
+	[--] [EAFNOSUPPORT]     msg_name is neither an AF_INET nor an AF_INET6 address.
+	[--] [EINVAL]           msg_namelen is too short for msg_name's family.
+	[--] [EMSGSIZE]         msg_iovlen exceeds ZT_MMSG_IOV_MAX, or IP_PMTUDISC_DO is set and the
+							datagram exceeds the network's path MTU.
+	[--] [ENETUNREACH]      No joined network has a route to the destination.
+*/
+ssize_t zts_sendmsg(ZT_SENDMSG_SIG)
+{
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+	DEBUG_INFO("fd = %d", fd);
+	int err = 0;
+	if(fd < 0) {
+		errno = EBADF;
+		err = -1;
+	}
+	else {
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+		if(conn && conn->socket_type == SOCK_DGRAM)
+			return dgramSend(conn, msg, flags);
+		if(conn && conn->socket_type == ZT_SOCK_MSG)
+			return msgSend(conn, msg, flags);
+		err = sendmsg(fd, msg, flags);
+	}
+	return err;
+}
+
+/*
+	[--] [EBADF]            An invalid descriptor was specified.
+	[--] [EMSGSIZE]         msg_iovlen exceeds ZT_MMSG_IOV_MAX (zts_recvmsg() only).
+*/
+ssize_t zts_recvfrom(ZT_RECVFROM_SIG)
+{
+	if(ZeroTier::Mux::owns(fd))
+		return ZeroTier::Mux::recv(fd, buf, len, flags); // addr is left alone, as for TCP
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+	DEBUG_INFO("fd = %d", fd);
+	int err = 0;
+	if(fd < 0) {
+		errno = EBADF;
+		err = -1;
+	}
+	else {
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+		if(conn && (conn->socket_type == SOCK_DGRAM || conn->socket_type == ZT_SOCK_MSG)) {
+			struct iovec iov;
+			iov.iov_base = buf;
+			iov.iov_len = len;
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_name = addr;
+			msg.msg_namelen = addr && addrlen ? *addrlen : 0;
+			msg.msg_iov = &iov;
+			msg.msg_iovlen = 1;
+			ssize_t n = conn->socket_type == ZT_SOCK_MSG ? msgRecv(conn, &msg, flags) : dgramRecv(conn, &msg, flags);
+			if(n >= 0 && addr && addrlen)
+				*addrlen = msg.msg_namelen;
+			return n;
+		}
+		err = recvfrom(fd, buf, len, flags, addr, addrlen);
+	}
+	return err;
+}
+
+ssize_t zts_recvmsg(ZT_RECVMSG_SIG)
+{
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+	DEBUG_INFO("fd = %d", fd);
+	int err = 0;
+	if(fd < 0) {
+		errno = EBADF;
+		err = -1;
+	}
+	else {
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+		if(conn && conn->socket_type == SOCK_DGRAM)
+			return dgramRecv(conn, msg, flags);
+		if(conn && conn->socket_type == ZT_SOCK_MSG)
+			return msgRecv(conn, msg, flags);
+		size_t cap = msg->msg_controllen;
+		err = recvmsg(fd, msg, flags);
+		// Stream data carries no stamps through the socketpair, it gets that of the latest arrival
+		if(err > 0 && conn && conn->rx_timestamp && conn->rx_stamp)
+			rxTimestamp(conn->rx_timestamp, conn->rx_stamp, msg, cap);
+	}
+	return err;
+}
+
+#if defined(__linux__)
+/*
+	Returns the number of datagrams sent, their msg_len is set to the payload length sent.
+	Should an error occur after some datagrams have been sent their count is returned.
+
+	[--] [EBADF]            An invalid descriptor was specified.
+	[--] [EDESTADDRREQ]     The socket is not connected, and no destination was given.
+	[--] [EAFNOSUPPORT]     A msg_name is neither an AF_INET nor an AF_INET6 address.
+	[--] [EINVAL]           A msg_namelen is too short for its msg_name's family.
+	[--] [EMSGSIZE]         A single message has more than ZT_MMSG_IOV_MAX - 1 iovecs.
+	[--] [ENETUNREACH]      No joined network has a route to the destination.
+*/
+int zts_sendmmsg(ZT_SENDMMSG_SIG)
+{
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+	ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+	if(!conn && ZeroTier::fdtable.is_host(fd))
+		return sendmmsg(fd, msgvec, vlen, flags);
+	if(!conn) {
+		errno = EBADF;
+		return -1;
+	}
+	if(conn->socket_type != SOCK_DGRAM)
+		return sendmmsg(fd, msgvec, vlen, flags);
+	unsigned int sent = 0;
+	while(sent < vlen) {
+		struct ZeroTier::DatagramHeader hdrs[ZT_MMSG_BATCH];
+		struct mmsghdr mv[ZT_MMSG_BATCH];
+		struct iovec iov[ZT_MMSG_IOV_MAX];
+		unsigned int n = 0;
+		size_t niov = 0;
+		for(; sent + n < vlen && n < ZT_MMSG_BATCH; n++) {
+			const struct msghdr *src = &msgvec[sent + n].msg_hdr;
+			if(niov + src->msg_iovlen + 1 > ZT_MMSG_IOV_MAX)
+				break;
+			int r = dgramHeader(conn, src, &hdrs[n]);
+			if(r < 0)
+				return sent ? (int)sent : -1;
+			if(r > 0) // now a host socket, only possible for the very first datagram
+				return sendmmsg(fd, msgvec, vlen, flags);
+			memset(&mv[n], 0, sizeof(mv[n]));
+			mv[n].msg_hdr.msg_iov = &iov[niov];
+			mv[n].msg_hdr.msg_iovlen = src->msg_iovlen + 1;
+			iov[niov].iov_base = &hdrs[n];
+			iov[niov++].iov_len = sizeof(hdrs[n]);
+			for(size_t i=0; i<src->msg_iovlen; i++)
+				iov[niov++] = src->msg_iov[i];
+		}
+		if(!n) {
+			errno = EMSGSIZE;
+			return sent ? (int)sent : -1;
+		}
+		// Only the first batch may block
+		int r = sendmmsg(conn->app_fd, mv, n, sent ? flags | MSG_DONTWAIT : flags);
+		if(r < 0)
+			return sent ? (int)sent : -1;
+		for(int i=0; i<r; i++)
+			msgvec[sent + i].msg_len = mv[i].msg_len - sizeof(struct ZeroTier::DatagramHeader);
+		sent += r;
+		if((unsigned int)r < n)
+			break;
+	}
+	return (int)sent;
+}
+
+/*
+	Returns the number of datagrams received, msg_len is set to each payload's length and
+	msg_name/msg_namelen to its source. timeout only applies to the first ZT_MMSG_BATCH.
+
+	[--] [EBADF]            An invalid descriptor was specified.
+	[--] [EMSGSIZE]         A single message has more than ZT_MMSG_IOV_MAX - 1 iovecs.
+*/
+int zts_recvmmsg(ZT_RECVMMSG_SIG)
+{
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+	ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+	if(!conn && ZeroTier::fdtable.is_host(fd))
+		return recvmmsg(fd, msgvec, vlen, flags, timeout);
+	if(!conn) {
+		errno = EBADF;
+		return -1;
+	}
+	if(conn->socket_type != SOCK_DGRAM)
+		return recvmmsg(fd, msgvec, vlen, flags, timeout);
+	unsigned int got = 0;
+	while(got < vlen) {
+		struct ZeroTier::DatagramHeader hdrs[ZT_MMSG_BATCH];
+		struct mmsghdr mv[ZT_MMSG_BATCH];
+		struct iovec iov[ZT_MMSG_IOV_MAX];
+		unsigned int n = 0;
+		size_t niov = 0;
+		for(; got + n < vlen && n < ZT_MMSG_BATCH; n++) {
+			const struct msghdr *dst = &msgvec[got + n].msg_hdr;
+			if(niov + dst->msg_iovlen + 1 > ZT_MMSG_IOV_MAX)
+				break;
+			memset(&mv[n], 0, sizeof(mv[n]));
+			mv[n].msg_hdr.msg_iov = &iov[niov];
+			mv[n].msg_hdr.msg_iovlen = dst->msg_iovlen + 1;
+			iov[niov].iov_base = &hdrs[n];
+			iov[niov++].iov_len = sizeof(hdrs[n]);
+			for(size_t i=0; i<dst->msg_iovlen; i++)
+				iov[niov++] = dst->msg_iov[i];
+		}
+		if(!n) {
+			errno = EMSGSIZE;
+			return got ? (int)got : -1;
+		}
+		int r = got ? recvmmsg(conn->app_fd, mv, n, flags | MSG_DONTWAIT, NULL)
+			: recvmmsg(conn->app_fd, mv, n, flags, timeout);
+		if(r < 0)
+			return got ? (int)got : -1;
+		for(int i=0; i<r; i++)
+			dgramFinishRecv(conn, &hdrs[i], mv[i].msg_len, &mv[i].msg_hdr, &msgvec[got + i].msg_hdr, 
+				&msgvec[got + i].msg_len);
+		got += r;
+		if((unsigned int)r < n)
+			break;
+	}
+	return (int)got;
+}
+
+/*
+	Should an error occur after some frames have been sent their count is returned.
+
+	[--] [EBADF]            fd isn't a SOCK_RAW socket.
+	[--] [EDESTADDRREQ]     The socket isn't bound to a tap, see rawBind().
+	[--] [EINVAL]           The first frame is shorter than an ethernet header, or n < 0.
+*/
+int zts_raw_send_batch(int fd, const struct zts_raw_frame *frames, int n)
+{
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+	ZeroTier::Connection *conn = ZeroTier::fdtable.get_unassigned(fd);
+	if(!conn || conn->socket_type != SOCK_RAW) {
+		errno = EBADF;
+		return -1;
+	}
+	if(!frames || n < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	ZeroTier::SocketTap *tap = conn->tap;
+	if(!tap) {
+		errno = EDESTADDRREQ;
+		return -1;
+	}
+	int sent = tap->WriteRaw(conn, frames, n);
+	if(!sent && n) {
+		errno = EINVAL;
+		return -1;
+	}
+	return sent;
+}
+
+/*
+	Frames are read ZT_MMSG_BATCH at a time from the socket's socketpair, which SocketTap::putRaw()
+	fills, frames longer than their len are truncated.
+
+	[--] [EBADF]            fd isn't a SOCK_RAW socket.
+	[--] [EINVAL]           n < 0.
+	[--] [EAGAIN]           No frame is waiting and the socket is nonblocking or MSG_DONTWAIT was given.
+*/
+int zts_raw_recv_batch(int fd, struct zts_raw_frame *frames, int n, int flags)
+{
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+	ZeroTier::Connection *conn = ZeroTier::fdtable.get_unassigned(fd);
+	if(!conn || conn->socket_type != SOCK_RAW) {
+		errno = EBADF;
+		return -1;
+	}
+	if(!frames || n < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	int got = 0;
+	while(got < n) {
+		struct mmsghdr mv[ZT_MMSG_BATCH];
+		struct iovec iov[ZT_MMSG_BATCH];
+		int k = n - got < ZT_MMSG_BATCH ? n - got : ZT_MMSG_BATCH;
+		for(int i=0; i<k; i++) {
+			memset(&mv[i], 0, sizeof(mv[i]));
+			iov[i].iov_base = frames[got + i].data;
+			iov[i].iov_len = frames[got + i].len;
+			mv[i].msg_hdr.msg_iov = &iov[i];
+			mv[i].msg_hdr.msg_iovlen = 1;
+		}
+		// Only the first batch may block
+		int r = recvmmsg(conn->app_fd, mv, k, got ? flags | MSG_DONTWAIT : flags | MSG_WAITFORONE, NULL);
+		if(r < 0)
+			return got ? got : -1;
+		for(int i=0; i<r; i++)
+			frames[got + i].len = mv[i].msg_len;
+		got += r;
+		if(r < k)
+			break;
+	}
+	return got;
+}
+#endif
+
+ssize_t zts_recv(ZT_RECV_SIG)
+{
+	if(ZeroTier::Mux::owns(fd))
+		return ZeroTier::Mux::recv(fd, buf, len, flags);
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+	ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+	if(conn && conn->direct)
+		return directRead(conn, buf, len, flags);
+	if(conn && (conn->socket_type == SOCK_DGRAM || conn->socket_type == ZT_SOCK_MSG))
+		return zts_recvfrom(fd, buf, len, flags, NULL, NULL);
+	return recv(fd, buf, len, flags);
+}
+
+ssize_t zts_send(ZT_SEND_SIG)
+{
+	if(ZeroTier::Mux::owns(fd))
+		return ZeroTier::Mux::send(fd, buf, len, flags);
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+	ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+	if(conn && conn->direct)
+		return directWrite(conn, buf, len, flags);
+	if(conn && (conn->socket_type == SOCK_DGRAM || conn->socket_type == ZT_SOCK_MSG))
+		return zts_sendto(fd, buf, len, flags, NULL, 0);
+	return send(fd, buf, len, flags);
+}
+
+int zts_read(ZT_READ_SIG) {
+	if(ZeroTier::Mux::owns(fd))
+		return ZeroTier::Mux::recv(fd, buf, len, 0);
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+	//DEBUG_INFO("fd = %d", fd);
+	ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+	if(conn && conn->direct)
+		return directRead(conn, buf, len, 0);
+	if(conn && (conn->socket_type == SOCK_DGRAM || conn->socket_type == ZT_SOCK_MSG))
+		return zts_recvfrom(fd, buf, len, 0, NULL, NULL);
+	return read(fd, buf, len);
+}
+
+int zts_write(ZT_WRITE_SIG) {
+	if(ZeroTier::Mux::owns(fd))
+		return ZeroTier::Mux::send(fd, buf, len, 0);
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+	//DEBUG_INFO("fd = %d", fd);
+	ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+	if(conn && conn->direct)
+		return directWrite(conn, buf, len, 0);
+	if(conn && (conn->socket_type == SOCK_DGRAM || conn->socket_type == ZT_SOCK_MSG))
+		return zts_sendto(fd, buf, len, 0, NULL, 0);
+	return write(fd, buf, len);
+}
+
+ssize_t zts_writev(ZT_WRITEV_SIG)
+{
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+	ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+	if(conn && conn->direct)
+		return directWritev(conn, iov, iovcnt);
+	if(conn && (conn->socket_type == SOCK_DGRAM || conn->socket_type == ZT_SOCK_MSG)) {
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = (struct iovec *)iov;
+		msg.msg_iovlen = iovcnt;
+		return zts_sendmsg(fd, &msg, 0);
+	}
+	return writev(fd, iov, iovcnt);
+}
+
+ssize_t zts_readv(ZT_READV_SIG)
+{
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+	ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+	if(conn && conn->direct)
+		return directReadv(conn, iov, iovcnt);
+	if(conn && (conn->socket_type == SOCK_DGRAM || conn->socket_type == ZT_SOCK_MSG)) {
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = (struct iovec *)iov;
+		msg.msg_iovlen = iovcnt;
+		return zts_recvmsg(fd, &msg, 0);
+	}
+	return readv(fd, iov, iovcnt);
+}
+
+/*
+	[--] [EINVAL]           out_fd is a SOCK_DGRAM socket.
+	Otherwise as for sendfile(2) (or directWrite() in direct I/O mode)
+*/
+ssize_t zts_sendfile(ZT_SENDFILE_SIG)
+{
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, out_fd);
+	ZeroTier::Connection *conn = ZeroTier::fdtable.get(out_fd);
+	if(conn && conn->direct)
+		return directSendfile(conn, in_fd, offset, count);
+	if(conn && conn->socket_type == SOCK_DGRAM) {
+		errno = EINVAL;
+		return -1;
+	}
+#if defined(__linux__)
+	// The kernel moves the file into the socketpair without it passing through user space
+	return sendfile(out_fd, in_fd, offset, count);
+#else
+	char buf[ZT_SENDFILE_CHUNK_SZ];
+	off_t pos = offset ? *offset : 0;
+	size_t tot = 0;
+	ssize_t err = 0;
+	while(tot < count) {
+		size_t want = std::min(count - tot, sizeof(buf));
+		ssize_t r = offset ? pread(in_fd, buf, want, pos) : read(in_fd, buf, want);
+		if(r <= 0) {
+			err = r;
+			break;
+		}
+		ssize_t w = write(out_fd, buf, r);
+		if(w > 0) {
+			tot += w;
+			pos += w;
+		}
+		if(w < r) {
+			err = w < 0 ? -1 : 0;
+			if(!offset)
+				lseek(in_fd, (w < 0 ? 0 : w) - r, SEEK_CUR); // give back what wasn't sent
+			break;
+		}
+	}
+	if(offset)
+		*offset = pos;
+	return tot ? (ssize_t)tot : err;
+#endif
+}
+
+/*
+	[--] [EINVAL]           in_fd and out_fd are the same, or either is a SOCK_DGRAM socket.
+	[--] [EAGAIN]           ZT_SPLICE_F_NONBLOCK was given and nothing could be moved.
+	Otherwise as for read(2)/write(2) (or directRead()/directWrite() in direct I/O mode)
+*/
+ssize_t zts_splice(ZT_SPLICE_SIG)
+{
+	ZeroTier::FdTable::Pin _in_pin(ZeroTier::fdtable, in_fd);
+	ZeroTier::FdTable::Pin _out_pin(ZeroTier::fdtable, out_fd);
+	ZeroTier::Connection *in = ZeroTier::fdtable.get(in_fd);
+	ZeroTier::Connection *out = ZeroTier::fdtable.get(out_fd);
+	if(in_fd == out_fd || (in && in->socket_type == SOCK_DGRAM) || (out && out->socket_type == SOCK_DGRAM)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if(!len)
+		return 0;
+	if((in && in->direct) || (out && out->direct))
+		return directSplice(in && in->direct ? in : NULL, in_fd, out && out->direct ? out : NULL, out_fd, len, flags);
+	// Both are descriptors of their own (the app's end of a socketpair for a socket)
+	char buf[ZT_SENDFILE_CHUNK_SZ];
+	struct pollfd pfd = { in_fd, POLLIN, 0 };
+	if((flags & ZT_SPLICE_F_NONBLOCK) && poll(&pfd, 1, 0) <= 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	ssize_t r = read(in_fd, buf, std::min(len, sizeof(buf)));
+	if(r <= 0)
+		return r;
+	ssize_t tot = 0;
+	while(tot < r) {
+		ssize_t w = write(out_fd, buf + tot, r - tot);
+		if(w < 0) {
+			if(errno == EINTR)
+				continue;
+			return tot ? tot : -1; // what was read and not written is lost, as with a failed write()
+		}
+		tot += w;
+	}
+	return tot;
+}
+
+/*
+	[--] [EBADF]            fd is not a valid descriptor.
+	[--] [EFAULT]           buf is NULL.
+	[--] [EOPNOTSUPP]       fd isn't a SOCK_STREAM socket in direct I/O mode.
+	[--] [ENOTCONN]         The socket is not connected.
+	[--] [ECONNRESET]       Connection reset by peer.
+	[--] [EPIPE]            The connection has been closed.
+	[--] [EAGAIN]           ZT_ZC_MAX_PENDING sends are already queued on fd.
+*/
+int zts_send_zc(int fd, const void *buf, size_t len, uint64_t tag, zts_zc_cb cb, void *arg)
+{
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+	ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+	if(!conn) {
+		errno = EBADF;
+		return -1;
+	}
+#if defined(STACK_PICO)
+	if(!conn->direct || conn->socket_type != SOCK_STREAM || !conn->tap) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	if(!buf && len) {
+		errno = EFAULT;
+		return -1;
+	}
+	if(conn->state == PICO_ERR_ECONNRESET) {
+		errno = ECONNRESET;
+		return -1;
+	}
+	if(conn->state != ZT_SOCK_STATE_CONNECTED && conn->state != ZT_SOCK_STATE_UNHANDLED_CONNECTED) {
+		errno = ENOTCONN;
+		return -1;
+	}
+	{
+		ZeroTier::Mutex::Lock _l(conn->_zc_m);
+		// Once the stack has let go of conn nothing would ever call cb
+		if(conn->zc_closed || conn->closure_ts != -1) {
+			errno = EPIPE;
+			return -1;
+		}
+		if(conn->zc_pending >= ZT_ZC_MAX_PENDING) {
+			errno = EAGAIN;
+			return -1;
+		}
+		ZeroTier::Connection::zc_send zc = { (const unsigned char*)buf, len, 0, tag, cb, arg };
+		conn->zc_q.push_back(zc);
+		conn->zc_pending++;
+	}
+	conn->tap->WakeDirect(true);
+	return 0;
+#endif
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+/*
+	[--] [EBADF]            fd is not a valid descriptor.
+	[--] [EINVAL]           views is NULL or max is less than 1.
+	[--] [EOPNOTSUPP]       fd isn't a SOCK_STREAM socket in direct I/O mode.
+	[--] [ENOTCONN]         The socket is not connected.
+	[--] [ECONNRESET]       Connection reset by peer.
+	[--] [EAGAIN]           Non-blocking (or SO_RCVTIMEO expired) and no data is available.
+*/
+int zts_recv_zc(int fd, struct zts_iovec *views, int max)
+{
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+	ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+	if(!conn) {
+		errno = EBADF;
+		return -1;
+	}
+	if(!views || max < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+	if(!conn->direct || conn->socket_type != SOCK_STREAM) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	return directRecvZc(conn, views, max);
+}
+
+/*
+	[--] [EBADF]            fd is not a valid descriptor.
+	[--] [EINVAL]           n is more than zts_recv_zc() can have returned.
+	[--] [EOPNOTSUPP]       fd isn't a SOCK_STREAM socket in direct I/O mode.
+*/
+int zts_recv_release(int fd, size_t n)
+{
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+	ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+	if(!conn) {
+		errno = EBADF;
+		return -1;
+	}
+	if(!conn->direct || conn->socket_type != SOCK_STREAM) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	return directRecvRelease(conn, n);
+}
+
+int zts_shutdown(ZT_SHUTDOWN_SIG)
+{
+	if(ZeroTier::Mux::owns(fd))
+		return ZeroTier::Mux::shutdown(fd, how);
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+#if defined(STACK_PICO)
+	DEBUG_INFO("fd = %d", fd);
+ 
+	int err = 0, mode = 0;
+	if(how == SHUT_RD) mode = PICO_SHUT_RD;
+	if(how == SHUT_WR) mode = PICO_SHUT_WR;
+	if(how == SHUT_RDWR) mode = PICO_SHUT_RDWR;
+
+	if(fd < 0) {
+		errno = EBADF;
+		err = -1;
+	}
+	else if(ZeroTier::fdtable.is_host(fd))
+		err = shutdown(fd, how);
+	else
+	{
+		if(!serviceRunning()) {
+			DEBUG_ERROR("cannot shutdown socket. service not started. call zts_start(path) first");
+			errno = EBADF;
+			err = -1;
+		}
+		else
+		{
+			ZeroTier::_multiplexer_lock.lock();
+			ZeroTier::SocketTap *tap;
+			ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd, &tap);
+			// If this is an unassigned connection, we don't need to consult the stack or tap
+			// during closure - it isn't yet stitched into the clockwork
+			if(conn && !tap) // unassigned
+			{
+				DEBUG_ERROR("unassigned shutdown");
+				/*
+				   PICO_SHUT_RD
+				   PICO_SHUT_WR
+				   PICO_SHUT_RDWR
+				*/
+				if(conn->picosock && (err = pico_socket_shutdown(conn->picosock, mode)) < 0)
+					DEBUG_ERROR("error calling pico_socket_shutdown()");
+				ZeroTier::fdtable.erase(fd);
+				ZeroTier::connpool.recycle(conn);
+				// FIXME: Is deleting this correct behaviour?
+			}
+			else // assigned
+			{
+				if(!conn) 
+				{
+					DEBUG_ERROR("unable to locate connection pair.");
+					errno = EBADF;
+					err = -1;
+				}
+				else // found everything, begin closure
+				{
+					int blocking = !conn->nonblocking;
+					if(blocking) {
+						DEBUG_INFO("blocking, waiting for write operations before shutdown...");
+						for(int i=0; i<ZT_SDK_CLTIME; i++) {
+							if(conn->TXbuf->count() == 0)
+								break;
+							usleep(ZT_API_CHECK_INTERVAL * 1000);
+						}
+					}
+
+					if(conn->picosock && (err = pico_socket_shutdown(conn->picosock, mode)) < 0)
+						DEBUG_ERROR("error calling pico_socket_shutdown()");
+				}
+			}
+			ZeroTier::_multiplexer_lock.unlock();
+		}
+	}
+	return err;
+#endif
+	return 0;
+}
+
+/*
+ * [--] [EINVAL]   addr is NULL or not AF_INET/AF_INET6.
+ * [--] [EEXIST]   addr is already a nameserver.
+ * [--] [ENOSPC]   There are ZTS_MAX_NAMESERVERS already.
+ */
+int zts_add_dns_nameserver(const struct sockaddr *addr)
+{
+	return ZeroTier::Resolver::addNameserver(addr);
+}
+
+/*
+ * [--] [EINVAL]   addr is NULL or not AF_INET/AF_INET6.
+ * [--] [ENOENT]   addr isn't a nameserver.
+ */
+int zts_del_dns_nameserver(const struct sockaddr *addr)
+{
+	return ZeroTier::Resolver::delNameserver(addr);
+}
+
+/*
+ * [--] [EAI_NONAME]   node doesn't resolve (or isn't numeric with AI_NUMERICHOST).
+ * [--] [EAI_SERVICE]  service isn't a port number.
+ * [--] [EAI_FAMILY]   hints->ai_family isn't AF_UNSPEC, AF_INET or AF_INET6.
+ * [--] [EAI_SOCKTYPE] hints->ai_socktype isn't 0, SOCK_STREAM or SOCK_DGRAM.
+ * [--] [EAI_AGAIN]    No nameserver answered.
+ * [--] [EAI_FAIL]     There are no nameservers.
+ * [--] [EAI_MEMORY]   Out of memory.
+ * [--] [EAI_SYSTEM]   A socket couldn't be created or polled, see errno.
+ */
+int zts_getaddrinfo(const char *node, const char *service, const struct addrinfo *hints,
+	struct addrinfo **res)
+{
+	if(!res)
+		return EAI_FAIL;
+	return ZeroTier::Resolver::lookup(node, service, hints, res);
+}
+
+void zts_freeaddrinfo(struct addrinfo *res)
+{
+	ZeroTier::Resolver::freeAddrinfo(res);
+}
+
+struct getaddrinfo_request
+{
+	std::string node, service;
+	bool has_node, has_service, has_hints;
+	struct addrinfo hints;
+	zts_getaddrinfo_cb cb;
+	void *arg;
+};
+
+static void *zts_getaddrinfo_worker(void *arg)
+{
+	struct getaddrinfo_request *req = (struct getaddrinfo_request *)arg;
+	struct addrinfo *res = NULL;
+	int status = ZeroTier::Resolver::lookup(req->has_node ? req->node.c_str() : NULL,
+		req->has_service ? req->service.c_str() : NULL, req->has_hints ? &req->hints : NULL, &res);
+	req->cb(status, res, req->arg);
+	delete req;
+	return NULL;
+}
+
+/*
+ * [--] [EINVAL]   cb is NULL.
+ * [--] [EAGAIN]   A thread to wait for the answer could not be created.
+ */
+int zts_getaddrinfo_async(const char *node, const char *service, const struct addrinfo *hints,
+	zts_getaddrinfo_cb cb, void *arg)
+{
+	if(!cb) {
+		errno = EINVAL;
+		return -1;
+	}
+	struct addrinfo *res = NULL;
+	int status;
+	if(ZeroTier::Resolver::cached(node, service, hints, &res, &status)) {
+		cb(status, res, arg);
+		return 0;
+	}
+	struct getaddrinfo_request *req = new struct getaddrinfo_request;
+	req->has_node = node != NULL;
+	req->has_service = service != NULL;
+	req->has_hints = hints != NULL;
+	if(node)
+		req->node = node;
+	if(service)
+		req->service = service;
+	memset(&req->hints, 0, sizeof(req->hints));
+	if(hints) {
+		req->hints.ai_flags = hints->ai_flags;
+		req->hints.ai_family = hints->ai_family;
+		req->hints.ai_socktype = hints->ai_socktype;
+		req->hints.ai_protocol = hints->ai_protocol;
+	}
+	req->cb = cb;
+	req->arg = arg;
+	pthread_t worker;
+	if(pthread_create(&worker, NULL, zts_getaddrinfo_worker, req)) {
+		delete req;
+		errno = EAGAIN;
+		return -1;
+	}
+	pthread_detach(worker);
+	return 0;
+}
+
+int zts_dns_flush()
+{
+	ZeroTier::Resolver::flush();
+	return 0;
+}
+
+/****************************************************************************/
+/* SDK Socket API (Java Native Interface JNI)                               */
+/* JNI naming convention: Java_PACKAGENAME_CLASSNAME_METHODNAME             */
+/****************************************************************************/
+
+
+#if defined(SDK_JNI)
+
+namespace ZeroTier {
+
+	#include <jni.h>
+
+	// Looked up once in JNI_OnLoad() rather than on every call, NULL where the class isn't there
+	static struct {
+		jclass address;            // zerotier.Address
+		jfieldID address_port;
+		jfieldID address_raw;
+		jclass list;               // java.util.ArrayList
+		jmethodID list_init;
+		jmethodID list_add;
+	} jni;
+
+	static jclass jniGlobalClass(JNIEnv *env, const char *name)
+	{
+		jclass c = env->FindClass(name);
+		if(!c) {
+			env->ExceptionClear();
+			return NULL;
+		}
+		jclass g = (jclass)env->NewGlobalRef(c);
+		env->DeleteLocalRef(c);
+		return g;
+	}
+
+	JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM *vm, void *reserved)
+	{
+		JNIEnv *env;
+		if(vm->GetEnv((void **)&env, JNI_VERSION_1_6) != JNI_OK)
+			return JNI_ERR;
+		if((jni.address = jniGlobalClass(env, "zerotier/Address"))) {
+			jni.address_port = env->GetFieldID(jni.address, "port", "I");
+			jni.address_raw = env->GetFieldID(jni.address, "_rawAddr", "J");
+		}
+		if((jni.list = jniGlobalClass(env, "java/util/ArrayList"))) {
+			jni.list_init = env->GetMethodID(jni.list, "<init>", "()V");
+			jni.list_add = env->GetMethodID(jni.list, "add", "(Ljava/lang/Object;)Z");
+		}
+		return JNI_VERSION_1_6;
+	}
+
+	// Stores an IPv4 address into a zerotier.Address, port in host order and _rawAddr as s_addr
+	static void jniSetAddress(JNIEnv *env, jobject ztaddr, const struct sockaddr_in *in4)
+	{
+		if(!ztaddr || !jni.address_port)
+			return;
+		env->SetIntField(ztaddr, jni.address_port, ntohs(in4->sin_port));
+		env->SetLongField(ztaddr, jni.address_raw, (jlong)in4->sin_addr.s_addr);
+	}
+
+	static void jniGetAddress(JNIEnv *env, jobject ztaddr, struct sockaddr_in *in4)
+	{
+		memset(in4, 0, sizeof(*in4));
+		in4->sin_family = AF_INET;
+		if(!ztaddr || !jni.address_port)
+			return;
+		in4->sin_port = htons(env->GetIntField(ztaddr, jni.address_port));
+		in4->sin_addr.s_addr = (uint32_t)env->GetLongField(ztaddr, jni.address_raw);
+	}
+
+	// An ArrayList holding str, NULL if it can't be made
+	static jobject jniStringList(JNIEnv *env, const char *str)
+	{
+		if(!jni.list)
+			return NULL;
+		jobject l = env->NewObject(jni.list, jni.list_init);
+		jstring s = env->NewStringUTF(str);
+		if(l && s)
+			env->CallBooleanMethod(l, jni.list_add, s);
+		return l;
+	}
+
+	// Network IDs are 16 hex digits, copied out without pinning the string
+	static bool jniNwid(JNIEnv *env, jstring nwid, char *buf, size_t sz)
+	{
+		jsize n = nwid ? env->GetStringLength(nwid) : 0;
+		if(n <= 0 || (size_t)n * 3 >= sz)
+			return false;
+		env->GetStringUTFRegion(nwid, 0, n, buf);
+		buf[env->GetStringUTFLength(nwid)] = 0;
+		return true;
+	}
+
+	JNIEXPORT void JNICALL Java_zerotier_ZeroTier_ztjni_1start(JNIEnv *env, jobject thisObj, jstring path) {
+		if(path) {
+			const char *str = env->GetStringUTFChars(path, NULL);
+			homeDir = str;
+			env->ReleaseStringUTFChars(path, str);
+			zts_start(homeDir.c_str());
+		}
+	}
+	// Shuts down ZeroTier service and SOCKS5 Proxy server
+	JNIEXPORT void JNICALL Java_zerotier_ZeroTier_ztjni_1stop(JNIEnv *env, jobject thisObj) {
+		if(zt1Service)
+			zts_stop();
+	}
+
+	// Returns whether the ZeroTier service is running
+	JNIEXPORT jboolean JNICALL Java_zerotier_ZeroTier_ztjni_1running(
+		JNIEnv *env, jobject thisObj) 
+	{
+		return  zts_running();
+	}
+	// Returns path for ZT config/data files    
+	JNIEXPORT jstring JNICALL Java_zerotier_ZeroTier_ztjni_1homepath(
+		JNIEnv *env, jobject thisObj) 
+	{
+		// TODO: fix, should copy into given arg
+		// return (*env).NewStringUTF(zts_get_homepath());
+		return (*env).NewStringUTF("");
+	}
+	// Join a network
+	JNIEXPORT void JNICALL Java_zerotier_ZeroTier_ztjni_1join(
+		JNIEnv *env, jobject thisObj, jstring nwid) 
+	{
+		char nwidstr[64];
+		if(jniNwid(env, nwid, nwidstr, sizeof(nwidstr)))
+			zts_join(nwidstr);
+	}
+	// Leave a network
+	JNIEXPORT void JNICALL Java_zerotier_ZeroTier_ztjni_1leave(
+		JNIEnv *env, jobject thisObj, jstring nwid) 
+	{
+		char nwidstr[64];
+		if(jniNwid(env, nwid, nwidstr, sizeof(nwidstr)))
+			zts_leave(nwidstr);
+	}
+	// FIXME: Re-implemented to make it play nicer with the C-linkage required for Xcode integrations
+	// Now only returns first assigned address per network. Shouldn't normally be a problem
+	JNIEXPORT jobject JNICALL Java_zerotier_ZeroTier_ztjni_1get_1ipv4_1address(
+		JNIEnv *env, jobject thisObj, jstring nwid) 
+	{
+		char nwidstr[64];
+		char address_string[ZT_MAX_IPADDR_LEN];
+		memset(address_string, 0, sizeof(address_string));
+		if(jniNwid(env, nwid, nwidstr, sizeof(nwidstr)))
+			zts_get_ipv4_address(nwidstr, address_string, ZT_MAX_IPADDR_LEN);
+		return jniStringList(env, address_string);
+	}
+
+	JNIEXPORT jobject JNICALL Java_zerotier_ZeroTier_ztjni_1get_1ipv6_1address(
+		JNIEnv *env, jobject thisObj, jstring nwid) 
+	{
+		char nwidstr[64];
+		char address_string[ZT_MAX_IPADDR_LEN];
+		memset(address_string, 0, sizeof(address_string));
+		if(jniNwid(env, nwid, nwidstr, sizeof(nwidstr)))
+			zts_get_ipv6_address(nwidstr, address_string, ZT_MAX_IPADDR_LEN);
+		return jniStringList(env, address_string);
+	}
+
+	// Returns the device is in integer form
+	JNIEXPORT jint Java_zerotier_ZeroTier_ztjni_1get_1device_1id() 
+	{
+		return zts_get_device_id(NULL); // TODO
+	}
+
+	// Arrays are only pinned for as long as the call uses them, writes don't copy anything back
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1send(JNIEnv *env, jobject thisObj, jint fd, jarray buf, jint len, int flags)
+	{
+		if(len < 0 || len > (*env).GetArrayLength(buf)) {
+			errno = EINVAL;
+			return -1;
+		}
+		jbyte *body = (*env).GetByteArrayElements((jbyteArray)buf, 0);
+		int written_bytes = zts_send(fd, body, len, flags);
+		int err = errno;
+		(*env).ReleaseByteArrayElements((jbyteArray)buf, body, JNI_ABORT);
+		errno = err;
+		return written_bytes;
+	}
+
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1sendto(
+		JNIEnv *env, jobject thisObj, jint fd, jarray buf, jint len, jint flags, jobject ztaddr)
+	{
+		struct sockaddr_in addr;
+		jniGetAddress(env, ztaddr, &addr);
+		if(len < 0 || len > (*env).GetArrayLength(buf)) {
+			errno = EINVAL;
+			return -1;
+		}
+		jbyte *body = (*env).GetByteArrayElements((jbyteArray)buf, 0);
+		int sent_bytes = zts_sendto(fd, body, len, flags, (struct sockaddr *)&addr, sizeof(addr));
+		int err = errno;
+		(*env).ReleaseByteArrayElements((jbyteArray)buf, body, JNI_ABORT);
+		errno = err;
+		return sent_bytes;
+	}
+
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1recvfrom(
+		JNIEnv *env, jobject thisObj, jint fd, jbyteArray buf, jint len, jint flags, jobject ztaddr)
+	{
+		struct sockaddr_in addr;
+		socklen_t addrlen = sizeof(addr);
+		memset(&addr, 0, sizeof(addr));
+		if(len < 0 || len > (*env).GetArrayLength(buf)) {
+			errno = EINVAL;
+			return -1;
+		}
+		jbyte *body = (*env).GetByteArrayElements(buf, 0);
+		int rxbytes = zts_recvfrom(fd, body, len, flags, (struct sockaddr *)&addr, &addrlen);
+		int err = errno;
+		(*env).ReleaseByteArrayElements(buf, body, rxbytes > 0 ? 0 : JNI_ABORT);
+		if(rxbytes >= 0)
+			jniSetAddress(env, ztaddr, &addr);
+		errno = err;
+		return rxbytes;
+	}
+
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1write(JNIEnv *env, jobject thisObj, jint fd, jarray buf, jint len)
 	{
-		if(!zt1Service) {
-			DEBUG_ERROR("cannot close socket. service not started. call zts_start(path) first");
+		if(len < 0 || len > (*env).GetArrayLength(buf)) {
+			errno = EINVAL;
+			return -1;
+		}
+		jbyte *body = (*env).GetByteArrayElements((jbyteArray)buf, 0);
+		int written_bytes = zts_write(fd, body, len);
+		int err = errno;
+		(*env).ReleaseByteArrayElements((jbyteArray)buf, body, JNI_ABORT);
+		errno = err;
+		return written_bytes;
+	}
+
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1read(JNIEnv *env, jobject thisObj, jint fd, jarray buf, jint len)
+	{
+		if(len < 0 || len > (*env).GetArrayLength(buf)) {
+			errno = EINVAL;
+			return -1;
+		}
+		jbyte *body = (*env).GetByteArrayElements((jbyteArray)buf, 0);
+		int read_bytes = zts_read(fd, body, len);
+		int err = errno;
+		(*env).ReleaseByteArrayElements((jbyteArray)buf, body, read_bytes > 0 ? 0 : JNI_ABORT);
+		errno = err;
+		return read_bytes;
+	}    
+
+	// [off, off + len) of a direct ByteBuffer, NULL (errno set) if buf isn't one or is too small
+	static char *jniDirectBuffer(JNIEnv *env, jobject buf, jint off, jint len)
+	{
+		char *p = buf ? (char *)(*env).GetDirectBufferAddress(buf) : NULL;
+		if(!p || off < 0 || len < 0 || (jlong)off + len > (*env).GetDirectBufferCapacity(buf)) {
+			errno = EINVAL;
+			return NULL;
+		}
+		return p + off;
+	}
+
+	// Reads and writes straight to/from a direct ByteBuffer's memory, nothing is pinned or copied
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1read_1direct(JNIEnv *env, jobject thisObj, jint fd, jobject buf, jint off, jint len)
+	{
+		char *p = jniDirectBuffer(env, buf, off, len);
+		return p ? zts_read(fd, p, len) : -1;
+	}
+
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1write_1direct(JNIEnv *env, jobject thisObj, jint fd, jobject buf, jint off, jint len)
+	{
+		char *p = jniDirectBuffer(env, buf, off, len);
+		return p ? zts_write(fd, p, len) : -1;
+	}
+
+	// addr is in network byte order, 4 bytes for IPv4 or 16 for IPv6. Returns 0 (errno set) otherwise
+	static socklen_t jniSockaddr(JNIEnv *env, jbyteArray addr, jint port, struct sockaddr_storage *ss)
+	{
+		memset(ss, 0, sizeof(*ss));
+		jsize n = addr ? (*env).GetArrayLength(addr) : 0;
+		if(n == 4) {
+			struct sockaddr_in *in4 = (struct sockaddr_in *)ss;
+			in4->sin_family = AF_INET;
+			in4->sin_port = htons(port);
+			(*env).GetByteArrayRegion(addr, 0, 4, (jbyte *)&in4->sin_addr);
+			return sizeof(*in4);
+		}
+		if(n == 16) {
+			struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)ss;
+			in6->sin6_family = AF_INET6;
+			in6->sin6_port = htons(port);
+			(*env).GetByteArrayRegion(addr, 0, 16, (jbyte *)&in6->sin6_addr);
+			return sizeof(*in6);
+		}
+		errno = EINVAL;
+		return 0;
+	}
+
+	// ztjni_connect()/ztjni_bind() taking the address in binary form (see jniSockaddr()), saves
+	// the string conversion and parsing on every call
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1connect_1addr(JNIEnv *env, jobject thisObj, jint fd, jbyteArray addr, jint port) {
+		struct sockaddr_storage ss;
+		socklen_t len = jniSockaddr(env, addr, port, &ss);
+		return len ? zts_connect(fd, (struct sockaddr *)&ss, len) : -1;
+	}
+
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1bind_1addr(JNIEnv *env, jobject thisObj, jint fd, jbyteArray addr, jint port) {
+		struct sockaddr_storage ss;
+		socklen_t len = jniSockaddr(env, addr, port, &ss);
+		return len ? zts_bind(fd, (struct sockaddr *)&ss, len) : -1;
+	}
+
+	/*
+	 * Entry points for zerotier.ZeroTierSelectorProvider and its channels. Failures come back
+	 * as -errno, Java has no reliable way of reading errno after the call returns
+	 */
+	static jint jniResult(int r) { return r < 0 ? -errno : r; }
+
+	// { AF_INET, AF_INET6, SOCK_STREAM, EAGAIN, EINPROGRESS, SHUT_RD, SHUT_WR, ZTS_EPOLLIN,
+	//   ZTS_EPOLLOUT, ZTS_EPOLLERR, ZTS_EPOLLHUP, ZTS_EPOLL_CTL_ADD, ZTS_EPOLL_CTL_DEL, ZTS_EPOLL_CTL_MOD,
+	//   SOL_SOCKET, IPPROTO_TCP, TCP_NODELAY, SO_KEEPALIVE, SO_SNDBUF, SO_RCVBUF, SO_REUSEADDR }
+	JNIEXPORT jintArray JNICALL Java_zerotier_ZeroTier_ztjni_1nio_1constants(JNIEnv *env, jclass cls) {
+		jint v[] = { AF_INET, AF_INET6, SOCK_STREAM, EAGAIN, EINPROGRESS, SHUT_RD, SHUT_WR, ZTS_EPOLLIN,
+			ZTS_EPOLLOUT, ZTS_EPOLLERR, ZTS_EPOLLHUP, ZTS_EPOLL_CTL_ADD, ZTS_EPOLL_CTL_DEL, ZTS_EPOLL_CTL_MOD,
+			SOL_SOCKET, IPPROTO_TCP, TCP_NODELAY, SO_KEEPALIVE, SO_SNDBUF, SO_RCVBUF, SO_REUSEADDR };
+		jintArray arr = (*env).NewIntArray(sizeof(v) / sizeof(v[0]));
+		if(arr)
+			(*env).SetIntArrayRegion(arr, 0, sizeof(v) / sizeof(v[0]), v);
+		return arr;
+	}
+
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1nio_1socket(JNIEnv *env, jclass cls, jint family, jint type) {
+		return jniResult(zts_socket(family, type, 0));
+	}
+
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1nio_1set_1blocking(JNIEnv *env, jclass cls, jint fd, jboolean blocking) {
+		int flags = zts_fcntl(fd, F_GETFL, 0);
+		if(flags < 0)
+			return -errno;
+		return jniResult(zts_fcntl(fd, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK));
+	}
+
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1nio_1bind(JNIEnv *env, jclass cls, jint fd, jbyteArray addr, jint port) {
+		struct sockaddr_storage ss;
+		socklen_t len = jniSockaddr(env, addr, port, &ss);
+		return len ? jniResult(zts_bind(fd, (struct sockaddr *)&ss, len)) : -errno;
+	}
+
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1nio_1listen(JNIEnv *env, jclass cls, jint fd, jint backlog) {
+		return jniResult(zts_listen(fd, backlog));
+	}
+
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1nio_1accept(JNIEnv *env, jclass cls, jint fd) {
+		struct sockaddr_storage ss;
+		socklen_t len = sizeof(ss);
+		return jniResult(zts_accept(fd, (struct sockaddr *)&ss, &len));
+	}
+
+	// 0 once connected, -EINPROGRESS while a non-blocking attempt is under way
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1nio_1connect(JNIEnv *env, jclass cls, jint fd, jbyteArray addr, jint port) {
+		struct sockaddr_storage ss;
+		socklen_t len = jniSockaddr(env, addr, port, &ss);
+		if(!len)
+			return -errno;
+		// A failed non-blocking attempt only shows in SO_ERROR
+		int soerr = 0;
+		socklen_t optlen = sizeof(soerr);
+		if(zts_getsockopt(fd, SOL_SOCKET, SO_ERROR, &soerr, &optlen) == 0 && soerr)
+			return -soerr;
+		if(zts_connect(fd, (struct sockaddr *)&ss, len) == 0 || errno == EISCONN)
+			return 0;
+		return errno == EALREADY ? -EINPROGRESS : -errno;
+	}
+
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1nio_1setsockopt(JNIEnv *env, jclass cls, jint fd, jint level, jint optname, jint value) {
+		int v = value;
+		return jniResult(zts_setsockopt(fd, level, optname, &v, sizeof(v)));
+	}
+
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1nio_1getsockopt(JNIEnv *env, jclass cls, jint fd, jint level, jint optname, jintArray value) {
+		int v = 0;
+		socklen_t len = sizeof(v);
+		if(zts_getsockopt(fd, level, optname, &v, &len) < 0)
+			return -errno;
+		jint jv = v;
+		(*env).SetIntArrayRegion(value, 0, 1, &jv);
+		return 0;
+	}
+
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1nio_1shutdown(JNIEnv *env, jclass cls, jint fd, jint how) {
+		return jniResult(zts_shutdown(fd, how));
+	}
+
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1nio_1close(JNIEnv *env, jclass cls, jint fd) {
+		return jniResult(zts_close(fd));
+	}
+
+	// Copies the local (or peer's) address into addr (16 bytes) and port[0], returns its length
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1nio_1getname(JNIEnv *env, jclass cls, jint fd, jboolean peer, jbyteArray addr, jintArray port) {
+		struct sockaddr_storage ss;
+		socklen_t len = sizeof(ss);
+		memset(&ss, 0, sizeof(ss));
+		int err = peer ? zts_getpeername(fd, (struct sockaddr *)&ss, &len) 
+			: zts_getsockname(fd, (struct sockaddr *)&ss, &len);
+		if(err < 0)
+			return -errno;
+		jint p;
+		if(ss.ss_family == AF_INET6) {
+			struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&ss;
+			(*env).SetByteArrayRegion(addr, 0, 16, (jbyte *)&in6->sin6_addr);
+			p = ntohs(in6->sin6_port);
+			(*env).SetIntArrayRegion(port, 0, 1, &p);
+			return 16;
+		}
+		struct sockaddr_in *in4 = (struct sockaddr_in *)&ss;
+		(*env).SetByteArrayRegion(addr, 0, 4, (jbyte *)&in4->sin_addr);
+		p = ntohs(in4->sin_port);
+		(*env).SetIntArrayRegion(port, 0, 1, &p);
+		return 4;
+	}
+
+	// Direct ByteBuffers are used in place, anything else is passed as its backing array
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1nio_1read(JNIEnv *env, jclass cls, jint fd, jobject buf, jint off, jint len) {
+		char *p = jniDirectBuffer(env, buf, off, len);
+		return p ? jniResult(zts_read(fd, p, len)) : -errno;
+	}
+
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1nio_1write(JNIEnv *env, jclass cls, jint fd, jobject buf, jint off, jint len) {
+		char *p = jniDirectBuffer(env, buf, off, len);
+		return p ? jniResult(zts_write(fd, p, len)) : -errno;
+	}
+
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1nio_1read_1array(JNIEnv *env, jclass cls, jint fd, jbyteArray buf, jint off, jint len) {
+		if(off < 0 || len < 0 || off + len > (*env).GetArrayLength(buf))
+			return -EINVAL;
+		jbyte *body = (*env).GetByteArrayElements(buf, 0);
+		int n = zts_read(fd, body + off, len);
+		int err = errno;
+		(*env).ReleaseByteArrayElements(buf, body, 0);
+		return n < 0 ? -err : n;
+	}
+
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1nio_1write_1array(JNIEnv *env, jclass cls, jint fd, jbyteArray buf, jint off, jint len) {
+		if(off < 0 || len < 0 || off + len > (*env).GetArrayLength(buf))
+			return -EINVAL;
+		jbyte *body = (*env).GetByteArrayElements(buf, 0);
+		int n = zts_write(fd, body + off, len);
+		int err = errno;
+		(*env).ReleaseByteArrayElements(buf, body, JNI_ABORT); // nothing to copy back
+		return n < 0 ? -err : n;
+	}
+
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1nio_1epoll_1create(JNIEnv *env, jclass cls) {
+		return jniResult(zts_epoll_create(0));
+	}
+
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1nio_1epoll_1ctl(JNIEnv *env, jclass cls, jint epfd, jint op, jint fd, jint events) {
+		struct zts_epoll_event ev;
+		ev.events = events;
+		ev.data.fd = fd;
+		return jniResult(zts_epoll_ctl(epfd, op, fd, &ev));
+	}
+
+	// Fills fds[]/events[] (of equal length) with what is ready, returns how many
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1nio_1epoll_1wait(JNIEnv *env, jclass cls, jint epfd, jintArray fds, jintArray events, jint timeout) {
+		struct zts_epoll_event evs[ZT_JNI_EPOLL_BATCH];
+		int max = std::min((int)(*env).GetArrayLength(fds), ZT_JNI_EPOLL_BATCH);
+		int n = zts_epoll_wait(epfd, evs, max, timeout);
+		if(n < 0)
+			return -errno;
+		jint f[ZT_JNI_EPOLL_BATCH], e[ZT_JNI_EPOLL_BATCH];
+		for(int i=0; i<n; i++) {
+			f[i] = evs[i].data.fd;
+			e[i] = evs[i].events;
+		}
+		(*env).SetIntArrayRegion(fds, 0, n, f);
+		(*env).SetIntArrayRegion(events, 0, n, e);
+		return n;
+	}
+
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1nio_1epoll_1wakeup(JNIEnv *env, jclass cls, jint epfd) {
+		return jniResult(zts_epoll_wakeup(epfd));
+	}
+
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1setsockopt(
+		JNIEnv *env, jobject thisObj, jint fd, jint level, jint optname, jint optval, jint optlen) {
+		return zts_setsockopt(fd, level, optname, (const void*)optval, optlen);
+	}
+
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1getsockopt(JNIEnv *env, jobject thisObj, jint fd, jint level, jint optname, jint optval, jint optlen) {
+		return zts_getsockopt(fd, level, optname, (void*)optval, (socklen_t *)optlen);
+	}
+
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1socket(JNIEnv *env, jobject thisObj, jint family, jint type, jint protocol) {
+		return zts_socket(family, type, protocol);
+	}
+	
+	// A numeric address from Java (no name resolution), copied out without pinning the string
+	static socklen_t jniSockaddrStr(JNIEnv *env, jstring addrstr, jint port, struct sockaddr_storage *ss)
+	{
+		char str[INET6_ADDRSTRLEN * 3];
+		memset(ss, 0, sizeof(*ss));
+		jsize n = addrstr ? (*env).GetStringLength(addrstr) : 0;
+		if(n <= 0 || n >= INET6_ADDRSTRLEN) {
+			errno = EINVAL;
+			return 0;
+		}
+		(*env).GetStringUTFRegion(addrstr, 0, n, str);
+		str[(*env).GetStringUTFLength(addrstr)] = 0;
+		struct sockaddr_in *in4 = (struct sockaddr_in *)ss;
+		if(inet_pton(AF_INET, str, &in4->sin_addr) == 1) {
+			in4->sin_family = AF_INET;
+			in4->sin_port = htons(port);
+			return sizeof(*in4);
+		}
+		struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)ss;
+		if(inet_pton(AF_INET6, str, &in6->sin6_addr) == 1) {
+			in6->sin6_family = AF_INET6;
+			in6->sin6_port = htons(port);
+			return sizeof(*in6);
+		}
+		errno = EINVAL;
+		return 0;
+	}
+
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1connect(JNIEnv *env, jobject thisObj, jint fd, jstring addrstr, jint port) {
+		struct sockaddr_storage ss;
+		socklen_t len = jniSockaddrStr(env, addrstr, port, &ss);
+		return len ? zts_connect(fd, (struct sockaddr *)&ss, len) : -1;
+	}
+
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1bind(JNIEnv *env, jobject thisObj, jint fd, jstring addrstr, jint port) {
+		struct sockaddr_storage ss;
+		socklen_t len = jniSockaddrStr(env, addrstr, port, &ss);
+		return len ? zts_bind(fd, (struct sockaddr *)&ss, len) : -1;
+	}
+
+	// The peer's address is stored into ztaddr (if not null) for IPv4 connections
+	static jint jniAccept(JNIEnv *env, jint fd, jobject ztaddr, int flags)
+	{
+		struct sockaddr_storage ss;
+		socklen_t len = sizeof(ss);
+		memset(&ss, 0, sizeof(ss));
+#if defined(__linux__)
+		int accfd = flags ? zts_accept4(fd, (struct sockaddr *)&ss, &len, flags) 
+			: zts_accept(fd, (struct sockaddr *)&ss, &len);
+#else
+		int accfd = zts_accept(fd, (struct sockaddr *)&ss, &len);
+#endif
+		if(accfd >= 0 && ss.ss_family == AF_INET)
+			jniSetAddress(env, ztaddr, (struct sockaddr_in *)&ss);
+		return accfd;
+	}
+
+#if defined(__linux__)
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1accept4(JNIEnv *env, jobject thisObj, jint fd, jobject ztaddr, jint flags) {
+		return jniAccept(env, fd, ztaddr, flags);
+	}
+#endif
+
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1accept(JNIEnv *env, jobject thisObj, jint fd, jobject ztaddr) {
+		return jniAccept(env, fd, ztaddr, 0);
+	}
+
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1listen(JNIEnv *env, jobject thisObj, jint fd, int backlog) {
+		return zts_listen(fd, backlog);
+	}
+
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1close(JNIEnv *env, jobject thisObj, jint fd) {
+		return zts_close(fd);
+	}
+
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1getsockname(JNIEnv *env, jobject thisObj, jint fd, jobject ztaddr) {
+		struct sockaddr_in addr;
+		socklen_t len = sizeof(addr);
+		memset(&addr, 0, sizeof(addr));
+		int err = zts_getsockname(fd, (struct sockaddr *)&addr, &len);
+		if(!err)
+			jniSetAddress(env, ztaddr, &addr);
+		return err;    
+	}
+
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1getpeername(JNIEnv *env, jobject thisObj, jint fd, jobject ztaddr) {
+		struct sockaddr_in addr;
+		socklen_t len = sizeof(addr);
+		memset(&addr, 0, sizeof(addr));
+		int err = zts_getpeername(fd, (struct sockaddr *)&addr, &len);
+		if(!err)
+			jniSetAddress(env, ztaddr, &addr);
+		return err;
+	}
+
+	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1fcntl(JNIEnv *env, jobject thisObj, jint fd, jint cmd, jint flags) {
+		return zts_fcntl(fd,cmd,flags);
+	}
+
+	// Field order matches struct zts_socket_stats, returns null on error
+	JNIEXPORT jlongArray JNICALL Java_zerotier_ZeroTier_ztjni_1get_1socket_1stats(JNIEnv *env, jobject thisObj, jint fd) {
+		struct zts_socket_stats st;
+		if(zts_get_socket_stats(fd, &st) < 0)
+			return NULL;
+		jlong v[] = { (jlong)st.bytes_in, (jlong)st.bytes_out, (jlong)st.rx_drops, (jlong)st.accept_overflows, st.txbuf_hwm, st.rxbuf_hwm,
+			st.accept_backlog, st.retransmits, st.rtt_ms, st.rttvar_ms, st.rto_ms, st.cwnd };
+		jlongArray arr = env->NewLongArray(sizeof(v) / sizeof(v[0]));
+		if(arr)
+			env->SetLongArrayRegion(arr, 0, sizeof(v) / sizeof(v[0]), v);
+		return arr;
+	}
+	// Field order matches struct zts_network_stats, returns null on error
+	JNIEXPORT jlongArray JNICALL Java_zerotier_ZeroTier_ztjni_1get_1network_1stats(JNIEnv *env, jobject thisObj, jstring nwid) {
+		struct zts_network_stats st;
+		if(!nwid)
+			return NULL;
+		const char *nwidstr = env->GetStringUTFChars(nwid, NULL);
+		int err = zts_get_network_stats(nwidstr, &st);
+		env->ReleaseStringUTFChars(nwid, nwidstr);
+		if(err < 0)
+			return NULL;
+		jlong v[] = { (jlong)st.frames_in, (jlong)st.bytes_in, (jlong)st.frames_out, (jlong)st.bytes_out,
+			(jlong)st.frames_dropped, (jlong)st.rx_coalesced, (jlong)st.stack_ticks, (jlong)st.stack_tick_us, st.rxq_hwm, st.nconns, st.stack,
+			st.rx_pressure, (jlong)st.rxq_overflows, (jlong)st.rxq_early_drops, (jlong)st.rx_pressure_events };
+		jlongArray arr = env->NewLongArray(sizeof(v) / sizeof(v[0]));
+		if(arr)
+			env->SetLongArrayRegion(arr, 0, sizeof(v) / sizeof(v[0]), v);
+		return arr;
+	}
+}
+#endif
+
+/****************************************************************************/
+/* SDK Socket API Helper functions --- DON'T CALL THESE DIRECTLY            */
+/****************************************************************************/
+
+#if defined(STACK_PICO)
+int zts_get_pico_socket(int fd, struct pico_socket **s)
+{
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+	int err = 0;
+	if(!zt1Service) {
+		DEBUG_ERROR("cannot locate socket. service not started. call zts_start(path) first");
+		errno = EBADF;
+		err = -1;
+	}
+	else
+	{
+		ZeroTier::SocketTap *tap;
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd, &tap);
+		if(!conn) 
+		{
+			DEBUG_ERROR("unable to locate connection pair.");
 			errno = EBADF;
 			err = -1;
 		}
 		else
 		{
-			ZeroTier::_multiplexer_lock.lock();
-			//DEBUG_INFO("unmap=%d, fdmap=%d", ZeroTier::unmap.size(), ZeroTier::fdmap.size());
-			// First, look for for unassigned connections
-			ZeroTier::Connection *conn = ZeroTier::unmap[fd];
+			*s = conn->picosock;
+			err = tap ? 0 : 1; // assigned : unassigned
+		}
+	}
+	return err;
+}
+#endif
+
+int zts_nsockets()
+{
+	// A socket moving between the assigned and unassigned counts may be missed or counted twice
+	return ZeroTier::fdtable.size();
+}
+
+/*
+	[--] [EINVAL]           limits is NULL.
+*/
+int zts_get_socket_limits(struct zts_socket_limits *limits)
+{
+	if(!limits) {
+		errno = EINVAL;
+		return -1;
+	}
+	limits->max_sockets = ZeroTier::stackConfig.max_sockets ? ZeroTier::stackConfig.max_sockets : -1;
+	limits->fds = ZT_FDTABLE_PAGE_SZ * ZT_FDTABLE_MAX_PAGES;
+	struct rlimit rl;
+	if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+		limits->fds = (int)std::min((rlim_t)limits->fds, rl.rlim_cur / 2);
+	limits->tcp = limits->tcp_listen = limits->udp = -1;
+	limits->timers = limits->timers_in_use = -1;
+	ZeroTier::StackDriver *driver = ZeroTier::defaultStackDriver();
+	if(driver)
+		driver->Limits(limits);
+	return 0;
+}
+
+int zts_maxsockets()
+{
+	struct zts_socket_limits limits;
+	zts_get_socket_limits(&limits);
+	int max = limits.fds;
+	if(limits.max_sockets >= 0)
+		max = std::min(max, limits.max_sockets);
+	if(limits.tcp >= 0)
+		max = std::min(max, limits.tcp + std::max(limits.udp, 0));
+	// Every open socket holds some of the timers in use, what's left is enough for this many more
+	if(limits.timers >= 0)
+		max = std::min(max, (int)ZeroTier::fdtable.size() + std::max(limits.timers - 1 - limits.timers_in_use, 0));
+	return max;
+}
+
+/*
+	[--] [EINVAL]           counts is NULL.
+*/
+int zts_get_socket_counts(struct zts_socket_counts *counts)
+{
+	if(!counts) {
+		errno = EINVAL;
+		return -1;
+	}
+	size_t assigned = ZeroTier::fdtable.assigned();
+	size_t listening = ZeroTier::fdtable.listening();
+	counts->unassigned = (uint32_t)ZeroTier::fdtable.unassigned();
+	counts->listening = (uint32_t)listening;
+	counts->connected = (uint32_t)(assigned > listening ? assigned - listening : 0);
+	counts->closing = ZeroTier::closingConns;
+	counts->host = (uint32_t)ZeroTier::fdtable.host();
+	return 0;
+}
+
+/*
+	[--] [EBADF]            fd is not a valid descriptor.
+	[--] [EINVAL]           stats is NULL.
+*/
+int zts_get_socket_stats(int fd, struct zts_socket_stats *stats)
+{
+	ZeroTier::FdTable::Pin _pin(ZeroTier::fdtable, fd);
+	if(!stats) {
+		errno = EINVAL;
+		return -1;
+	}
+	ZeroTier::SocketTap *tap = NULL;
+	ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd, &tap);
+	if(!conn) {
+		errno = EBADF;
+		return -1;
+	}
+	memset(stats, 0, sizeof(*stats));
+	stats->bytes_in = ZeroTier::stat_get(conn->stats.bytes_in);
+	stats->bytes_out = ZeroTier::stat_get(conn->stats.bytes_out);
+	stats->rx_drops = conn->rxq_drops;
+	stats->accept_overflows = ZeroTier::stat_get(conn->stats.accept_overflows);
+	stats->txbuf_hwm = ZeroTier::stat_get(conn->stats.txbuf_hwm);
+	stats->rxbuf_hwm = ZeroTier::stat_get(conn->stats.rxbuf_hwm);
+	stats->accept_backlog = conn->_AcceptedCount;
+	// Only a Connection which has been given to a tap has anything in the stack
+	if(tap)
+		tap->Stats(conn, stats);
+	return 0;
+}
+
+static void snapshotConnections(std::vector<struct zts_connection_info> &rows)
+{
+	// Taps are read one at a time on their stack threads, never with _vtaps_lock held
+	std::vector<uint64_t> nwids;
+	{
+		ZeroTier::ProfiledMutex::Lock _l(ZeroTier::_vtaps_lock);
+		for(size_t i=0; i<ZeroTier::vtaps.size(); i++)
+			nwids.push_back(((ZeroTier::SocketTap *)ZeroTier::vtaps[i])->_nwid);
+	}
+	for(size_t i=0; i<nwids.size(); i++) {
+		ZeroTier::SocketTap *tap = getTapByNWID(nwids[i]);
+		if(tap)
+			tap->Describe(rows);
+	}
+}
+
+/*
+	[--] [EINVAL]           info is NULL and n isn't 0.
+*/
+int zts_dump_connections(struct zts_connection_info *info, int n)
+{
+	if((!info && n) || n < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	std::vector<struct zts_connection_info> rows;
+	if(serviceRunning())
+		snapshotConnections(rows);
+	size_t copied = std::min(rows.size(), (size_t)n);
+	if(copied)
+		memcpy(info, rows.data(), copied * sizeof(*info));
+	return (int)rows.size();
+}
+
+/*
+	[--] [EINVAL]           threshold_ms is negative.
+*/
+int zts_set_stack_watchdog(int threshold_ms, zts_stall_cb cb, void *arg)
+{
+	if(threshold_ms < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	ZeroTier::StackThread::setWatchdog(threshold_ms, cb, arg);
+	return 0;
+}
+
+/*
+	[--] [EINVAL]           stats is NULL.
+*/
+int zts_get_stack_watchdog_stats(struct zts_stack_watchdog_stats *stats)
+{
+	if(!stats) {
+		errno = EINVAL;
+		return -1;
+	}
+	ZeroTier::StackThread::watchdogStats(stats);
+	return 0;
+}
+
+/*
+	[--] [EINVAL]           stats or nwid is NULL.
+	[--] [ENODEV]           This device hasn't joined the network nwid (or the service isn't running).
+*/
+int zts_get_stack_loop_stats(const char *nwid, struct zts_stack_loop_stats *stats)
+{
+	if(!stats || !nwid) {
+		errno = EINVAL;
+		return -1;
+	}
+	ZeroTier::SocketTap *tap = serviceRunning() ? getTapByNWID(strtoull(nwid, NULL, 16)) : NULL;
+	if(!tap || !tap->_stack) {
+		errno = ENODEV;
+		return -1;
+	}
+	tap->_stack->loopStats(stats);
+	return 0;
+}
 
-			// Since we found an unassigned connection, we don't need to consult the stack or tap
-			// during closure - it isn't yet stitched into the clockwork
-			if(conn) // unassigned
-			{
-				DEBUG_ERROR("unassigned closure");
-				if((err = pico_socket_close(conn->picosock)) < 0)
-					DEBUG_ERROR("error calling pico_socket_close()");
-				if((err = close(conn->app_fd)) < 0)
-					DEBUG_ERROR("error closing app_fd");
-				if((err = close(conn->sdk_fd)) < 0)
-					DEBUG_ERROR("error closing sdk_fd");            
-				delete conn;
-				ZeroTier::unmap.erase(fd);
-			}
-			else // assigned
-			{
-				std::pair<ZeroTier::Connection*, ZeroTier::SocketTap*> *p = ZeroTier::fdmap[fd];
-				if(!p) 
-				{
-					DEBUG_ERROR("unable to locate connection pair.");
-					errno = EBADF;
-					err = -1;
-				}
-				else // found everything, begin closure
-				{
-					conn = p->first;
-					ZeroTier::SocketTap *tap = p->second;
+/*
+	[--] [EINVAL]           stats or nwid is NULL.
+	[--] [ENODEV]           This device hasn't joined the network nwid (or the service isn't running).
+*/
+int zts_get_network_stats(const char *nwid, struct zts_network_stats *stats)
+{
+	if(!stats || !nwid) {
+		errno = EINVAL;
+		return -1;
+	}
+	ZeroTier::SocketTap *tap = serviceRunning() ? getTapByNWID(strtoull(nwid, NULL, 16)) : NULL;
+	if(!tap) {
+		errno = ENODEV;
+		return -1;
+	}
+	memset(stats, 0, sizeof(*stats));
+	stats->frames_in = ZeroTier::stat_get(tap->_stats.frames_in);
+	stats->bytes_in = ZeroTier::stat_get(tap->_stats.bytes_in);
+	stats->frames_out = ZeroTier::stat_get(tap->_stats.frames_out);
+	stats->bytes_out = ZeroTier::stat_get(tap->_stats.bytes_out);
+	stats->frames_dropped = ZeroTier::stat_get(tap->_stats.frames_dropped);
+	stats->rx_coalesced = ZeroTier::stat_get(tap->_stats.rx_coalesced);
+	stats->stack_ticks = ZeroTier::stat_get(tap->_stats.stack_ticks);
+	stats->stack_tick_us = ZeroTier::stat_get(tap->_stats.stack_tick_ns) / 1000;
+	stats->rxq_hwm = ZeroTier::stat_get(tap->_stats.rxq_hwm);
+	stats->stack = tap->_driver ? tap->_driver->id() : 0;
+	stats->rx_pressure = tap->rxPressure();
+	stats->rxq_overflows = ZeroTier::stat_get(tap->_stats.rxq_overflows);
+	stats->rxq_early_drops = ZeroTier::stat_get(tap->_stats.rxq_early_drops);
+	stats->rx_pressure_events = ZeroTier::stat_get(tap->_stats.rx_pressure_events);
+	stats->compressed = ZeroTier::stat_get(tap->_stats.compressed);
+	stats->compress_saved = ZeroTier::stat_get(tap->_stats.compress_saved);
+	stats->incompressible = ZeroTier::stat_get(tap->_stats.incompressible);
+	stats->decompressed = ZeroTier::stat_get(tap->_stats.decompressed);
+	stats->decompress_errors = ZeroTier::stat_get(tap->_stats.decompress_errors);
+	stats->conns_refused = ZeroTier::stat_get(tap->_stats.conns_refused);
+	stats->frames_limited = ZeroTier::stat_get(tap->_stats.frames_limited);
+	stats->stack_tick_max_us = ZeroTier::stat_get(tap->_stats.stack_tick_max_ns) / 1000;
+	if(tap->_stack) {
+		struct zts_stack_loop_stats loop;
+		tap->_stack->loopStats(&loop);
+		stats->loop_busy_us = loop.busy_us;
+		stats->loop_idle_us = loop.idle_us;
+	}
+	ZeroTier::ProfiledMutex::Lock _l(tap->_tcpconns_m);
+	stats->nconns = tap->_Connections.size();
+	return 0;
+}
 
-					// check if socket is blocking
-					int f_err, blocking = 1;
-					if ((f_err = fcntl(fd, F_GETFL, 0)) < 0) {
-						DEBUG_ERROR("fcntl error, err = %s, errno = %d", f_err, errno);
-						err = -1;
-					} 
-					else {
-						blocking = !(f_err & O_NONBLOCK);
-					}
+/*
+	[--] [EINVAL]           stats is NULL or lock isn't one of ZTS_LOCK_*.
+	[--] [EOPNOTSUPP]       The library was built without ZT_LOCK_STATS.
+*/
+int zts_get_lock_stats(int lock, struct zts_lock_stats *stats)
+{
+	if(!stats || lock < 0 || lock >= ZTS_LOCK_COUNT) {
+		errno = EINVAL;
+		return -1;
+	}
+#if defined(ZT_LOCK_STATS)
+	ZeroTier::lockProfiles[lock].snapshot(stats);
+	strncpy(stats->name, ZeroTier::lock_name(lock), sizeof(stats->name) - 1);
+	return 0;
+#else
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+}
 
-					if(blocking) {
-						DEBUG_INFO("blocking, waiting for write operations before closure...");
-						for(int i=0; i<ZT_SDK_CLTIME; i++) {
-							if(conn->TXbuf->count() == 0)
-								break;
-							usleep(ZT_API_CHECK_INTERVAL * 1000);
-						}
-					}
+/*
+	[--] [EOPNOTSUPP]       The library was built without ZT_LOCK_STATS.
+*/
+int zts_reset_lock_stats()
+{
+#if defined(ZT_LOCK_STATS)
+	for(int i=0; i<ZTS_LOCK_COUNT; i++)
+		ZeroTier::lockProfiles[i].reset();
+	return 0;
+#else
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+}
 
-					// For cases where data might still need to pass through the library
-					// before socket closure
-					
-					/*
-					if(ZT_SOCK_BEHAVIOR_LINGER) {
-						socklen_t optlen;
-						struct linger so_linger;
-						so_linger.l_linger = 0;                        
-						zts_getsockopt(fd, SOL_SOCKET, SO_LINGER, &so_linger, &optlen);
-						//DEBUG_ERROR("fd = %d, value = %d", fd, so_linger.l_linger);
-					   // if (so_linger.l_linger != 0) {
-							DEBUG_EXTRA("lingering before closure for (%d) seconds...", so_linger.l_linger);
-							sleep(3); // do the linger!
-					   // }    
-					}
-					else
-					{
-						DEBUG_ERROR("LINGER NOT enabled");
-					}
-					*/
+int zts_set_latency_sampling(unsigned every)
+{
+	ZeroTier::latencyTrace.setSampling(every);
+	return 0;
+}
 
-					//DEBUG_INFO("s->state = %s", ZeroTier::picoTCP::beautify_pico_state(conn->picosock->state));
-					tap->Close(conn);
-					ZeroTier::fdmap.erase(fd);
-					err = 0;
+/*
+	[--] [EINVAL]           stats is NULL or stage isn't one of ZTS_LATENCY_*.
+*/
+int zts_get_latency_stats(int stage, struct zts_latency_stats *stats)
+{
+	if(!stats || stage < 0 || stage >= ZTS_LATENCY_COUNT) {
+		errno = EINVAL;
+		return -1;
+	}
+	ZeroTier::latencyTrace.snapshot(stage, stats);
+	return 0;
+}
+
+int zts_reset_latency_stats()
+{
+	ZeroTier::latencyTrace.reset();
+	return 0;
+}
+
+/*
+	Probes addr for zts_ping() and zts_ping_udp()
+*/
+static int pingRun(int proto, const struct sockaddr *addr, socklen_t addrlen, int count, int interval_us,
+	zts_ping_cb cb, void *arg, struct zts_ping_stats *stats)
+{
+	if(!addr || count <= 0 || count > ZT_PING_MAX_COUNT || interval_us < 0 || addrlen > sizeof(struct sockaddr_storage)
+		|| (addr->sa_family == AF_INET && addrlen < sizeof(struct sockaddr_in))
+		|| (addr->sa_family == AF_INET6 && addrlen < sizeof(struct sockaddr_in6))) {
+		errno = EINVAL;
+		return -1;
+	}
+	if(addr->sa_family != AF_INET && (addr->sa_family != AF_INET6 || proto == ZTS_PING_ICMP)) {
+		errno = EAFNOSUPPORT;
+		return -1;
+	}
+	ZeroTier::SocketTap *tap = NULL;
+	if(serviceRunning()) {
+		char ipstr[INET6_ADDRSTRLEN];
+		memset(ipstr, 0, INET6_ADDRSTRLEN);
+		if(addr->sa_family == AF_INET)
+			inet_ntop(AF_INET, &((struct sockaddr_in *)addr)->sin_addr, ipstr, INET_ADDRSTRLEN);
+		else
+			inet_ntop(AF_INET6, &((struct sockaddr_in6 *)addr)->sin6_addr, ipstr, INET6_ADDRSTRLEN);
+		ZeroTier::InetAddress iaddr;
+		iaddr.fromString(ipstr);
+		ZeroTier::ProfiledMutex::Lock _ml(ZeroTier::_multiplexer_lock);
+		tap = getTapByAddr(iaddr);
+	}
+	if(!tap || !tap->_driver) {
+		errno = ENETUNREACH;
+		return -1;
+	}
+	ZeroTier::PingSession s(count);
+	s.proto = proto;
+	memcpy(&s.dst, addr, addrlen);
+	ZeroTier::Utils::getSecureRandom(&s.cookie, sizeof(s.cookie));
+	s.id = (uint16_t)s.cookie;
+	int err = 0;
+	tap->RunOnStack([&]() { err = tap->_driver->PingOpen(tap, &s); });
+	if(err < 0) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	std::vector<int> reported;
+	uint64_t start = ZeroTier::PingSession::now_us(), deadline = 0;
+	int sent = 0;
+	for(int seq=0; ; ) {
+		if(seq < count) {
+			tap->RunOnStack([&]() { err = tap->_driver->Ping(&s, seq); });
+			if(err == 0)
+				sent++;
+			if(++seq == count)
+				deadline = ZeroTier::PingSession::now_us() + ZTS_PING_TIMEOUT_MS * 1000ULL;
+		}
+		// Report replies while waiting for the next probe to be due
+		uint64_t until = seq < count ? start + (uint64_t)seq * interval_us : deadline;
+		std::unique_lock<std::mutex> _l(s.m);
+		do {
+			while(!s.replies.empty()) {
+				std::vector<int> r;
+				r.swap(s.replies);
+				_l.unlock();
+				for(size_t i=0; i<r.size(); i++) {
+					if(cb)
+						cb(r[i], (int64_t)s.rtt_us[r[i]], arg);
 				}
+				reported.insert(reported.end(), r.begin(), r.end());
+				_l.lock();
 			}
-			//DEBUG_INFO(" unmap=%d, fdmap=%d", ZeroTier::unmap.size(), ZeroTier::fdmap.size());
-			ZeroTier::_multiplexer_lock.unlock();
+			uint64_t now = ZeroTier::PingSession::now_us();
+			if(now >= until || (seq == count && (int)reported.size() == sent))
+				break;
+			s.cv.wait_for(_l, std::chrono::microseconds(until - now));
+		} while(true);
+		if(seq == count && (ZeroTier::PingSession::now_us() >= deadline || (int)reported.size() == sent))
+			break;
+	}
+	tap->RunOnStack([&]() { tap->_driver->PingClose(&s); });
+	// Nothing replies from here on
+	std::vector<uint64_t> rtts;
+	for(int i=0; i<count; i++) {
+		if(s.rtt_us[i] != UINT64_MAX)
+			rtts.push_back(s.rtt_us[i]);
+		else if(cb)
+			cb(i, -1, arg);
+	}
+	if(stats) {
+		memset(stats, 0, sizeof(*stats));
+		stats->sent = sent;
+		stats->received = rtts.size();
+		uint64_t total = 0;
+		for(size_t i=0; i<rtts.size(); i++) {
+			int b = rtts[i] < 2 ? 0 : 63 - __builtin_clzll(rtts[i]);
+			stats->hist[b < ZTS_PING_BUCKETS ? b : ZTS_PING_BUCKETS - 1]++;
+			total += rtts[i];
+		}
+		std::sort(rtts.begin(), rtts.end());
+		if(!rtts.empty()) {
+			stats->min_us = rtts.front();
+			stats->max_us = rtts.back();
+			stats->avg_us = total / rtts.size();
+			// Nearest rank
+			stats->p50_us = rtts[(rtts.size() * 50 + 99) / 100 - 1];
+			stats->p90_us = rtts[(rtts.size() * 90 + 99) / 100 - 1];
+			stats->p99_us = rtts[(rtts.size() * 99 + 99) / 100 - 1];
 		}
 	}
-	return err;
-#endif
 	return 0;
 }
 
-int zts_poll(ZT_POLL_SIG)
+/*
+	[--] [EINVAL]           addr is NULL or too short for its family, count isn't 1 to ZT_PING_MAX_COUNT or interval_us is negative.
+	[--] [EAFNOSUPPORT]     addr isn't IPv4 (or, for zts_ping_udp(), IPv6).
+	[--] [ENETUNREACH]      No network has a route to addr.
+	[--] [ENOTSUP]          The network's stack can't send the probes.
+*/
+int zts_ping(const struct sockaddr *addr, socklen_t addrlen, int count, int interval_us,
+	zts_ping_cb cb, void *arg, struct zts_ping_stats *stats)
 {
-	return poll(fds, nfds, timeout);
+	return pingRun(ZTS_PING_ICMP, addr, addrlen, count, interval_us, cb, arg, stats);
 }
 
-int zts_select(ZT_SELECT_SIG)
+int zts_ping_udp(const struct sockaddr *addr, socklen_t addrlen, int count, int interval_us,
+	zts_ping_cb cb, void *arg, struct zts_ping_stats *stats)
 {
-	return select(nfds, readfds, writefds, exceptfds, timeout);
+	return pingRun(ZTS_PING_UDP, addr, addrlen, count, interval_us, cb, arg, stats);
 }
 
-int zts_fcntl(ZT_FCNTL_SIG)
+/*
+	[--] [EINVAL]           path is NULL or filter doesn't parse.
+	[--] [EALREADY]         A capture is already running.
+	Errors opening path are passed on as they are (see fopen()).
+*/
+int zts_capture_start(const char *path, unsigned int snaplen, const char *filter)
 {
-	int err = 0;
-	if(fd < 0) {
-		errno = EBADF;
-		err = -1;
+	return ZeroTier::Capture::start(path, snaplen, filter);
+}
+
+/*
+	[--] [EALREADY]         No capture is running.
+*/
+int zts_capture_stop()
+{
+	return ZeroTier::Capture::stop();
+}
+
+/*
+	[--] [EINVAL]           nwid or info is NULL, or slots isn't a power of two.
+	[--] [ENODEV]           This device hasn't joined the network nwid (or the service isn't running).
+	[--] [EEXIST]           The network is exported already.
+	[--] [EOPNOTSUPP]       Not supported on this platform (only Linux has memfd and eventfd).
+	Errors creating the memfd, eventfds or mapping are passed on as they are.
+*/
+int zts_shm_export(const char *nwid, unsigned int slots, struct zts_shm_info *info)
+{
+	if(!nwid || !info) {
+		errno = EINVAL;
+		return -1;
 	}
-	else {
-		err = fcntl(fd, cmd, flags);
+	ZeroTier::SocketTap *tap = serviceRunning() ? getTapByNWID(strtoull(nwid, NULL, 16)) : NULL;
+	if(!tap) {
+		errno = ENODEV;
+		return -1;
 	}
-	return err;
+	ZeroTier::ShmBridge *shm = ZeroTier::ShmBridge::create(tap, slots);
+	if(!shm)
+		return -1;
+	if(!tap->AttachShm(shm)) {
+		delete shm;
+		errno = EEXIST;
+		return -1;
+	}
+	shm->info(info);
+	return 0;
 }
 
 /*
-	   struct ifreq {
-		   char ifr_name[IFNAMSIZ];
-		   union {
-			   struct sockaddr ifr_addr;
-			   struct sockaddr ifr_dstaddr;
-			   struct sockaddr ifr_broadaddr;
-			   struct sockaddr ifr_netmask;
-			   struct sockaddr ifr_hwaddr;
-			   short           ifr_flags;
-			   int             ifr_ifindex;
-			   int             ifr_metric;
-			   int             ifr_mtu;
-			   struct ifmap    ifr_map;
-			   char            ifr_slave[IFNAMSIZ];
-			   char            ifr_newname[IFNAMSIZ];
-			   char           *ifr_data;
-		   };
-	   };
+	[--] [EINVAL]           nwid is NULL.
+	[--] [ENODEV]           This device hasn't joined the network nwid (or the service isn't running).
+	[--] [ENOENT]           The network isn't exported.
+*/
+int zts_shm_unexport(const char *nwid)
+{
+	if(!nwid) {
+		errno = EINVAL;
+		return -1;
+	}
+	ZeroTier::SocketTap *tap = serviceRunning() ? getTapByNWID(strtoull(nwid, NULL, 16)) : NULL;
+	if(!tap) {
+		errno = ENODEV;
+		return -1;
+	}
+	ZeroTier::ShmBridge *shm = tap->DetachShm();
+	if(!shm) {
+		errno = ENOENT;
+		return -1;
+	}
+	delete shm;
+	return 0;
+}
+
+/*
+	[--] [EAGAIN]           The service isn't running.
+	[--] [EBUSY]            A daemon runs already.
+	[--] [ENAMETOOLONG]     path doesn't fit a Unix socket address.
+	Errors binding the socket are passed on as they are.
 */
+int zts_daemon_start(const char *path)
+{
+	if(!serviceRunning()) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return ZeroTier::NodeDaemon::start(path) ? 0 : -1;
+}
+
+int zts_daemon_stop(void)
+{
+	ZeroTier::NodeDaemon::stop();
+	return 0;
+}
 
 /*
-	[  ] [BADF]             fd is not a valid file descriptor.
-	[  ] [EFAULT]           argp references an inaccessible memory area.
-	[  ] [EINVAL]           request or argp is not valid.
-	[  ] [ENOTTY]           The specified request does not apply to the kind of object that the file descriptor fd references.
+	[--] [EINVAL]           addr is NULL or addrlen too large.
+	[--] [ENAMETOOLONG]     path doesn't fit a Unix socket address.
+	Errors reaching the daemon (ENOENT, ECONNREFUSED) and those of zts_connect() on its side are
+	passed on as they are.
 */
+int zts_daemon_connect(const char *path, const struct sockaddr *addr, socklen_t addrlen)
+{
+	return ZeroTier::NodeDaemon::connect(path, addr, addrlen);
+}
 
-int zts_ioctl(ZT_IOCTL_SIG)
+/*
+	As for zts_daemon_connect(), with the errors of zts_bind() and zts_listen() on its side.
+*/
+int zts_daemon_listen(const char *path, const struct sockaddr *addr, socklen_t addrlen, int backlog)
 {
-	int err = 0;
-	if(fd < 0) {
-		errno = EBADF;
-		err = -1;
+	return ZeroTier::NodeDaemon::listen(path, addr, addrlen, backlog);
+}
+
+/*
+	[--] [ECONNRESET]       The daemon stopped (or the listener failed).
+	[--] [ECONNABORTED]     The connection came without its descriptors.
+*/
+int zts_daemon_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+	return ZeroTier::NodeDaemon::accept(fd, addr, addrlen);
+}
+
+int zts_daemon_close(int fd)
+{
+	return ZeroTier::NodeDaemon::close(fd);
+}
+
+/*
+	[--] [EINVAL]           stats is NULL.
+*/
+int zts_get_capture_stats(struct zts_capture_stats *stats)
+{
+	if(!stats) {
+		errno = EINVAL;
+		return -1;
+	}
+	ZeroTier::Capture::getStats(stats);
+	return 0;
+}
+
+/*
+	[--] [EINVAL]           nwid, path or stats is NULL, or path isn't a pcap or pcapng file.
+	[--] [ENODEV]           This device hasn't joined the network nwid (or the service isn't running).
+	[--] [ENOENT]           path could not be opened (or any other error of fopen()).
+*/
+int zts_replay(const char *nwid, const char *path, const struct zts_replay_config *cfg,
+	struct zts_replay_stats *stats)
+{
+	if(!nwid || !path || !stats) {
+		errno = EINVAL;
+		return -1;
+	}
+	ZeroTier::SocketTap *tap = serviceRunning() ? getTapByNWID(strtoull(nwid, NULL, 16)) : NULL;
+	if(!tap) {
+		errno = ENODEV;
+		return -1;
+	}
+	return ZeroTier::Replay::run(tap, path, cfg, stats);
+}
+
+/*
+	[--] [EINVAL]           nwid is NULL, delay_ms is negative or loss_ppm isn't within 0-1000000.
+	[--] [ENODEV]           This device hasn't joined the network nwid (or the service isn't running).
+	[--] [ENOTSUP]          The stack driver doesn't implement impairments.
+*/
+int zts_set_impairment(const char *nwid, int delay_ms, int loss_ppm)
+{
+	if(!nwid || delay_ms < 0 || loss_ppm < 0 || loss_ppm > 1000000) {
+		errno = EINVAL;
+		return -1;
+	}
+	ZeroTier::SocketTap *tap = serviceRunning() ? getTapByNWID(strtoull(nwid, NULL, 16)) : NULL;
+	if(!tap) {
+		errno = ENODEV;
+		return -1;
+	}
+#if defined(STACK_PICO)
+	if(tap->_driver == ZeroTier::picostack) {
+		tap->_impair_delay_ms = delay_ms;
+		tap->_impair_loss_ppm = loss_ppm;
+		tap->_phy.whack();
+		return 0;
 	}
-	else {
-#if defined(__linux__)
-		if(argp)
-		{
-			struct ifreq *ifr = (struct ifreq *)argp;
-			ZeroTier::SocketTap *tap = getTapByName(ifr->ifr_name);
-			if(!tap) {
-				DEBUG_ERROR("unable to locate tap interface with that name");
-				err = -1;
-				errno = EINVAL;
-			}
-			// index of SocketTap interface
-			if(request == SIOCGIFINDEX) {
-				ifr->ifr_ifindex = tap->ifindex;
-				err = 0;
-			}
-			// MAC addres or SocketTap
-			if(request == SIOCGIFHWADDR) {
-				tap->_mac.copyTo(&(ifr->ifr_hwaddr.sa_data), sizeof(ifr->ifr_hwaddr.sa_data));
-				err = 0;
-			}
-			// IP address of SocketTap
-			if(request == SIOCGIFADDR) {
-				struct sockaddr_in *in4 = (struct sockaddr_in *)&(ifr->ifr_addr);
-				memcpy(&(in4->sin_addr.s_addr), tap->_ips[0].rawIpData(), sizeof(ifr->ifr_addr));
-				err = 0;
-			}
-		}
-		else
-		{
-			DEBUG_INFO("!argp");
-		}
-#else
-		err = ioctl(fd, request, argp);
 #endif
+	errno = ENOTSUP;
+	return -1;
+}
+
+/*
+	[--] [EINVAL]           nwid is NULL.
+	[--] [ENODEV]           This device hasn't joined the network nwid (or the service isn't running).
+*/
+int zts_set_network_rate(const char *nwid, uint64_t bytes_per_sec, uint64_t burst)
+{
+	if(!nwid) {
+		errno = EINVAL;
+		return -1;
 	}
-	return err;
+	ZeroTier::SocketTap *tap = serviceRunning() ? getTapByNWID(strtoull(nwid, NULL, 16)) : NULL;
+	if(!tap) {
+		errno = ENODEV;
+		return -1;
+	}
+	tap->_tx_shaper.configure(bytes_per_sec, burst);
+	// Whatever the old limit held back is reconsidered
+	tap->ReleaseHeldTx();
+	return 0;
 }
 
+/*
+	[--] [EINVAL]           nwid is NULL.
+	[--] [ENODEV]           This device hasn't joined the network nwid (or the service isn't running).
+*/
+int zts_set_network_compression(const char *nwid, int enabled)
+{
+	if(!nwid) {
+		errno = EINVAL;
+		return -1;
+	}
+	ZeroTier::SocketTap *tap = serviceRunning() ? getTapByNWID(strtoull(nwid, NULL, 16)) : NULL;
+	if(!tap) {
+		errno = ENODEV;
+		return -1;
+	}
+	tap->_compressor.enable(enabled != 0);
+	return 0;
+}
 
 /*
+	[--] [EINVAL]           nwid or limits is NULL.
+	[--] [ENODEV]           This device hasn't joined the network nwid (or the service isn't running).
+*/
+int zts_set_admission_limits(const char *nwid, const struct zts_admission_limits *limits)
+{
+	if(!nwid || !limits) {
+		errno = EINVAL;
+		return -1;
+	}
+	ZeroTier::SocketTap *tap = serviceRunning() ? getTapByNWID(strtoull(nwid, NULL, 16)) : NULL;
+	if(!tap) {
+		errno = ENODEV;
+		return -1;
+	}
+	tap->_admission.configure(limits);
+	return 0;
+}
 
-Linux:
+/*
+	[--] [EINVAL]           nwid or limits is NULL.
+	[--] [ENODEV]           This device hasn't joined the network nwid (or the service isn't running).
+*/
+int zts_get_admission_limits(const char *nwid, struct zts_admission_limits *limits)
+{
+	if(!nwid || !limits) {
+		errno = EINVAL;
+		return -1;
+	}
+	ZeroTier::SocketTap *tap = serviceRunning() ? getTapByNWID(strtoull(nwid, NULL, 16)) : NULL;
+	if(!tap) {
+		errno = ENODEV;
+		return -1;
+	}
+	tap->_admission.limits(limits);
+	return 0;
+}
 
-	[  ] [EAGAIN or EWOULDBLOCK] The socket is marked nonblocking and the requested operation would block. POSIX.1-2001 allows either error to be returned for this case, and does not require these constants to have the same value, so a portable application should check for both possibilities.
-	[  ] [EBADF]                 An invalid descriptor was specified.
-	[  ] [ECONNRESET]            Connection reset by peer.
-	[  ] [EDESTADDRREQ]          The socket is not connection-mode, and no peer address is set.
-	[  ] [EFAULT]                An invalid user space address was specified for an argument.
-	[  ] [EINTR]                 A signal occurred before any data was transmitted; see signal(7).
-	[  ] [EINVAL]                Invalid argument passed.
-	[  ] [EISCONN]               The connection-mode socket was connected already but a recipient was specified. (Now either this error is returned, or the recipient specification is ignored.)
-	[  ] [EMSGSIZE]              The socket type requires that message be sent atomically, and the size of the message to be sent made this impossible.
-	[  ] [ENOBUFS]               The output queue for a network interface was full. This generally indicates that the interface has stopped sending, but may be caused by transient congestion. (Normally, this does not occur in Linux. Packets are just silently dropped when a device queue overflows.)
-	[  ] [ENOMEM]                No memory available.
-	[  ] [ENOTCONN]              The socket is not connected, and no target has been given.
-	[  ] [ENOTSOCK]              The argument sockfd is not a socket.
-	[  ] [EOPNOTSUPP]            Some bit in the flags argument is inappropriate for the socket type.
-	[  ] [EPIPE]                 The local end has been shut down on a connection oriented socket. In this case the process will also receive a SIGPIPE unless MSG_NOSIGNAL is set.
+/*
+	[--] [EINVAL]           cfg is NULL, or a loss_ppm/reorder_ppm isn't within 0-1000000.
+	[--] [EBUSY]            zts_start() has been called.
+	[--] [EALREADY]         A simulation is running already.
+*/
+int zts_sim_start(const struct zts_sim_config *cfg)
+{
+	if(!cfg || cfg->loss_ppm > 1000000 || cfg->reorder_ppm > 1000000) {
+		errno = EINVAL;
+		return -1;
+	}
+	if(zt1Service || ZeroTier::serviceThreadStarted) {
+		errno = EBUSY;
+		return -1;
+	}
+	if(simWire) {
+		errno = EALREADY;
+		return -1;
+	}
+	if(!stacksStarted())
+		startStacks();
+	ZeroTier::Clock::setScale(cfg->time_scale);
+	simWire = new ZeroTier::SimWire(cfg);
+	return 0;
+}
 
+/*
+	[--] [EINVAL]           No simulation is running, nwid or addr is NULL or addr isn't an address.
+	[--] [EPROTONOSUPPORT]  The library wasn't built with stack.
+	[--] [EEXIST]           There is a node on nwid already.
+	[--] [EADDRNOTAVAIL]    The stack couldn't take addr.
 */
-ssize_t zts_sendto(ZT_SENDTO_SIG)
+int zts_sim_add_node(const char *nwid, int stack, const char *addr)
 {
-	DEBUG_INFO("fd = %d", fd);
-	int err = 0;
-	if(fd < 0) {
-		errno = EBADF;
-		err = -1;
+	if(!simWire || !nwid || !addr) {
+		errno = EINVAL;
+		return -1;
 	}
-	else {
-		struct sockaddr_ll *socket_address = (struct sockaddr_ll *)addr;
-		ZeroTier::SocketTap *tap = getTapByIndex(socket_address->sll_ifindex);
-		if(tap)
-		{
-			DEBUG_INFO("found interface of ifindex=%d", tap->ifindex);
-			ZeroTier::Connection *conn = ZeroTier::unmap[fd];
-			if(conn) {
-				DEBUG_INFO("located connection object for fd=%d", fd);
-				err = tap->Write(conn, (void*)buf, len);
-			}
-			else {
-				DEBUG_ERROR("unable to locate connection object for fd=%d", fd);
-				err = -1;
-				errno = EINVAL;
-			}
-		}
-		else
+	ZeroTier::InetAddress ip(addr);
+	if(!ip) {
+		errno = EINVAL;
+		return -1;
+	}
+	if(!ZeroTier::stackDriverById(stack)) {
+		errno = EPROTONOSUPPORT;
+		return -1;
+	}
+	uint64_t nwid_int = strtoull(nwid, NULL, 16);
+	if(getTapByNWID(nwid_int)) {
+		errno = EEXIST;
+		return -1;
+	}
+	{
+		ZeroTier::Mutex::Lock _l(ZeroTier::_networkStacks_lock);
+		ZeroTier::networkStacks[nwid_int] = stack;
+	}
+	// Locally administered unicast MACs, one per node
+	ZeroTier::MAC mac(0x320000000000ULL | ++simNodes);
+	ZeroTier::SimWire::node *n = simWire->newNode();
+	ZeroTier::SocketTap *tap = new ZeroTier::SocketTap(ZeroTier::homeDir.c_str(), mac, ZT_SDK_MTU, 0,
+		nwid_int, "sim", ZeroTier::SimWire::handler, n);
+	n->tap = tap;
+	if(!tap->addIp(ip)) {
 		{
-			DEBUG_ERROR("unable to locate tap of ifindex=%d", socket_address->sll_ifindex);
-			err = -1;
-			errno = EINVAL;
+			ZeroTier::ProfiledMutex::Lock _l(ZeroTier::_vtaps_lock);
+			ZeroTier::vtaps.erase(std::remove(ZeroTier::vtaps.begin(), ZeroTier::vtaps.end(), (void*)tap), 
+				ZeroTier::vtaps.end());
+			ZeroTier::tapindex.rebuild(ZeroTier::vtaps);
 		}
-		//err = sendto(fd, buf, len, flags, addr, addrlen);
+		delete tap;
+		delete n;
+		errno = EADDRNOTAVAIL;
+		return -1;
 	}
-	return err;
+	simWire->attach(n);
+	return 0;
 }
 
-// TODO
-ssize_t zts_sendmsg(ZT_SENDMSG_SIG)
+/*
+	[--] [EINVAL]           No simulation is running, cfg is NULL, or a loss_ppm/reorder_ppm isn't within 0-1000000.
+*/
+int zts_sim_set_config(const struct zts_sim_config *cfg)
 {
-	DEBUG_INFO("fd = %d", fd);
-	int err = 0;
-	if(fd < 0) {
-		errno = EBADF;
-		err = -1;
-	}
-	else {
-		err = sendmsg(fd, msg, flags);
+	if(!simWire || !cfg || cfg->loss_ppm > 1000000 || cfg->reorder_ppm > 1000000) {
+		errno = EINVAL;
+		return -1;
 	}
-	return err;
+	simWire->setConfig(cfg);
+	return 0;
 }
 
-// TODO
-ssize_t zts_recvfrom(ZT_RECVFROM_SIG)
+/*
+	[--] [EINVAL]           No simulation is running, or stats is NULL.
+*/
+int zts_sim_get_stats(struct zts_sim_stats *stats)
 {
-	DEBUG_INFO("fd = %d", fd);
-	int err = 0;
-	if(fd < 0) {
-		errno = EBADF;
-		err = -1;
-	}
-	else {
-		err = recvfrom(fd, buf, len, flags, addr, addrlen);
+	if(!simWire || !stats) {
+		errno = EINVAL;
+		return -1;
 	}
-	return err;
+	simWire->stats(stats);
+	return 0;
 }
 
-// TODO
-ssize_t zts_recvmsg(ZT_RECVMSG_SIG)
+/*
+	[--] [EINVAL]           No simulation is running, or us is NULL.
+*/
+int zts_sim_get_time(uint64_t *us)
 {
-	DEBUG_INFO("fd = %d", fd);
-	int err = 0;
-	if(fd < 0) {
-		errno = EBADF;
-		err = -1;
-	}
-	else {
-		err = recvmsg(fd, msg, flags);
+	if(!simWire || !us) {
+		errno = EINVAL;
+		return -1;
 	}
-	return err;
+	*us = ZeroTier::Clock::now_us();
+	return 0;
 }
 
-int zts_read(ZT_READ_SIG) {
-	//DEBUG_INFO("fd = %d", fd);
-	return read(fd, buf, len);
+/*
+	[--] [EINVAL]           No simulation is running.
+*/
+int zts_sim_stop()
+{
+	if(!simWire) {
+		errno = EINVAL;
+		return -1;
+	}
+	// Nothing is delivered once the wire has stopped, the taps' frames are dropped until they're gone
+	simWire->stop();
+	dismantleTaps();
+	delete simWire;
+	simWire = NULL;
+	ZeroTier::Clock::setScale(1);
+	return 0;
 }
 
-int zts_write(ZT_WRITE_SIG) {
-	//DEBUG_INFO("fd = %d", fd);
-	return write(fd, buf, len);
+/*
+	[--] [EINVAL]           policy isn't one of ZTS_ROUTE_*.
+*/
+int zts_set_route_policy(int policy)
+{
+	if(policy != ZTS_ROUTE_VIRTUAL && policy != ZTS_ROUTE_HOST) {
+		errno = EINVAL;
+		return -1;
+	}
+	ZeroTier::routePolicy = policy;
+	return 0;
 }
 
-int zts_shutdown(ZT_SHUTDOWN_SIG)
+int zts_get_route_policy()
 {
-#if defined(STACK_PICO)
-	DEBUG_INFO("fd = %d", fd);
- 
-	int err = 0, mode = 0;
-	if(how == SHUT_RD) mode = PICO_SHUT_RD;
-	if(how == SHUT_WR) mode = PICO_SHUT_WR;
-	if(how == SHUT_RDWR) mode = PICO_SHUT_RDWR;
+	return ZeroTier::routePolicy;
+}
 
-	if(fd < 0) {
-		errno = EBADF;
-		err = -1;
+/*
+	[--] [EINVAL]           thread isn't a ZTS_THREAD_*, nwid is NULL for a network's thread, or
+	                        a CPU is out of range.
+	[--] [ENOTSUP]          Threads can't be pinned on this platform.
+*/
+int zts_set_thread_affinity(int thread, const char *nwid, const int *cpus, int ncpus)
+{
+#if defined(__linux__)
+	if(thread != ZTS_THREAD_SERVICE && thread != ZTS_THREAD_STACK && thread != ZTS_THREAD_TX) {
+		errno = EINVAL;
+		return -1;
 	}
-	else
-	{
-		if(!zt1Service) {
-			DEBUG_ERROR("cannot shutdown socket. service not started. call zts_start(path) first");
-			errno = EBADF;
-			err = -1;
+	if((thread != ZTS_THREAD_SERVICE && !nwid) || ncpus < 0 || (ncpus && !cpus)) {
+		errno = EINVAL;
+		return -1;
+	}
+	std::vector<int> set;
+	for(int i=0; i<ncpus; i++) {
+		if(cpus[i] < 0 || cpus[i] >= CPU_SETSIZE) {
+			errno = EINVAL;
+			return -1;
 		}
-		else
-		{
-			ZeroTier::_multiplexer_lock.lock();
-			// First, look for for unassigned connections
-			ZeroTier::Connection *conn = ZeroTier::unmap[fd];
-			// Since we found an unassigned connection, we don't need to consult the stack or tap
-			// during closure - it isn't yet stitched into the clockwork
-			if(conn) // unassigned
-			{
-				DEBUG_ERROR("unassigned shutdown");
-				/*
-				   PICO_SHUT_RD
-				   PICO_SHUT_WR
-				   PICO_SHUT_RDWR
-				*/
-				if((err = pico_socket_shutdown(conn->picosock, mode)) < 0)
-					DEBUG_ERROR("error calling pico_socket_shutdown()");
-				delete conn;
-				ZeroTier::unmap.erase(fd);
-				// FIXME: Is deleting this correct behaviour?
-			}
-			else // assigned
-			{
-				std::pair<ZeroTier::Connection*, ZeroTier::SocketTap*> *p = ZeroTier::fdmap[fd];
-				if(!p) 
-				{
-					DEBUG_ERROR("unable to locate connection pair.");
-					errno = EBADF;
-					err = -1;
-				}
-				else // found everything, begin closure
-				{
-					conn = p->first;
-					int f_err, blocking = 1;
-					if ((f_err = fcntl(fd, F_GETFL, 0)) < 0) {
-						DEBUG_ERROR("fcntl error, err = %s, errno = %d", f_err, errno);
-						err = -1;
-					} 
-					else {
-						blocking = !(f_err & O_NONBLOCK);
-					}
-					if(blocking) {
-						DEBUG_INFO("blocking, waiting for write operations before shutdown...");
-						for(int i=0; i<ZT_SDK_CLTIME; i++) {
-							if(conn->TXbuf->count() == 0)
-								break;
-							usleep(ZT_API_CHECK_INTERVAL * 1000);
-						}
-					}
+		set.push_back(cpus[i]);
+	}
+	uint64_t id = thread == ZTS_THREAD_SERVICE ? 0 : strtoull(nwid, NULL, 16);
+	ZeroTier::affinity.set(thread, id, set);
+	// Network threads pick this up the next time they wake, the service is never back in our code
+	if(thread == ZTS_THREAD_SERVICE && ZeroTier::serviceThreadStarted) {
+		int err = ZeroTier::affinity.apply(ZeroTier::serviceThread, thread, id);
+		if(err) {
+			errno = err;
+			return -1;
+		}
+	}
+	return 0;
+#else
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+/*
+	[--] [EINVAL]           thread isn't a ZTS_THREAD_* or cpu_us is NULL.
+	[--] [ENOTSUP]          Threads have no CPU clocks on this platform.
+*/
+int zts_get_thread_cpu(int thread, const char *nwid, uint64_t *cpu_us)
+{
+	if((thread != ZTS_THREAD_SERVICE && thread != ZTS_THREAD_STACK && thread != ZTS_THREAD_TX) || !cpu_us) {
+		errno = EINVAL;
+		return -1;
+	}
+	uint64_t id = nwid ? strtoull(nwid, NULL, 16) : 0;
+	if(!ZeroTier::affinity.cpu_us(thread, id, thread == ZTS_THREAD_SERVICE || !nwid, cpu_us)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+	[--] [EINVAL]           frames or spin_us is negative.
+*/
+int zts_set_busy_poll(int frames, int spin_us)
+{
+	if(frames < 0 || spin_us < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	// Stack threads pick this up on their next pass
+	ZeroTier::StackThread::busyPollFrames = frames;
+	ZeroTier::StackThread::busyPollUs = spin_us;
+	return 0;
+}
 
-					if((err = pico_socket_shutdown(conn->picosock, mode)) < 0)
-						DEBUG_ERROR("error calling pico_socket_shutdown()");
-				}
-			}
-			ZeroTier::_multiplexer_lock.unlock();
-		}
+/*
+	[--] [EINVAL]           frames or spin_us is NULL.
+*/
+int zts_get_busy_poll(int *frames, int *spin_us)
+{
+	if(!frames || !spin_us) {
+		errno = EINVAL;
+		return -1;
 	}
-	return err;
-#endif
+	*frames = ZeroTier::StackThread::busyPollFrames;
+	*spin_us = ZeroTier::StackThread::busyPollUs;
 	return 0;
 }
 
-/****************************************************************************/
-/* SDK Socket API (Java Native Interface JNI)                               */
-/* JNI naming convention: Java_PACKAGENAME_CLASSNAME_METHODNAME             */
-/****************************************************************************/
+/*
+	[--] [EINVAL]           mode isn't a ZTS_POWER_*.
+*/
+int zts_set_power_mode(int mode)
+{
+	if(mode != ZTS_POWER_NORMAL && mode != ZTS_POWER_LOW && mode != ZTS_POWER_BACKGROUND) {
+		errno = EINVAL;
+		return -1;
+	}
+	int was = ZeroTier::PowerMode::get();
+	ZeroTier::PowerMode::set(mode);
+	// Stack threads recompute their sleep, keepalives are redone when they stretch or shrink back
+	uint32_t opts = (was == ZTS_POWER_BACKGROUND) != (mode == ZTS_POWER_BACKGROUND) ? ZT_CONN_OPT_KEEPALIVE : 0;
+	ZeroTier::ProfiledMutex::Lock _l(ZeroTier::_vtaps_lock);
+	for(size_t i=0; i<ZeroTier::vtaps.size(); i++)
+		((ZeroTier::SocketTap*)ZeroTier::vtaps[i])->QueueStreamOptions(opts);
+	return 0;
+}
 
+int zts_get_power_mode()
+{
+	return ZeroTier::PowerMode::get();
+}
 
-#if defined(SDK_JNI)
+/*
+	[--] [EINVAL]           ms is more than ZT_TAP_REBIND_GRACE_MAX_MS.
+*/
+int zts_set_rebind_grace(unsigned int ms)
+{
+	if(ms > ZT_TAP_REBIND_GRACE_MAX_MS) {
+		errno = EINVAL;
+		return -1;
+	}
+	ZeroTier::SocketTap::rebindGraceMs = ms;
+	return 0;
+}
 
-namespace ZeroTier {
+unsigned int zts_get_rebind_grace()
+{
+	return ZeroTier::SocketTap::rebindGraceMs;
+}
 
-	#include <jni.h>
+/****************************************************************************/
+/* ZeroTier Core helper functions for libzt - DON'T CALL THESE DIRECTLY     */
+/****************************************************************************/
 
-	JNIEXPORT int JNICALL Java_zerotier_ZeroTier_ztjni_1start(JNIEnv *env, jobject thisObj, jstring path) {
-		if(path) {
-			homeDir = env->GetStringUTFChars(path, NULL);
-			zts_start(homeDir.c_str());
-		}
+void zts_epoll_detach(ZeroTier::Connection *conn)
+{
+	ZeroTier::ProfiledMutex::Lock _l(ZeroTier::_epolls_lock);
+	std::vector<ZeroTier::Epoll*> eps;
+	{
+		ZeroTier::Mutex::Lock _cl(conn->_epoll_m);
+		eps.swap(conn->_epolls);
 	}
-	// Shuts down ZeroTier service and SOCKS5 Proxy server
-	JNIEXPORT void JNICALL Java_zerotier_ZeroTier_ztjni_1stop(JNIEnv *env, jobject thisObj) {
-		if(zt1Service)
-			zts_stop();
+	for(size_t i=0; i<eps.size(); i++)
+		eps[i]->ctl(ZTS_EPOLL_CTL_DEL, conn->app_fd, conn, NULL);
+}
+
+int getSockTimeoutMs(int fd, int optname)
+{
+	if(ZeroTier::FdTable::is_userspace(fd)) {
+		ZeroTier::Connection *conn = ZeroTier::fdtable.get(fd);
+		if(!conn)
+			return -1;
+		return optname == SO_RCVTIMEO ? conn->rcvtimeo_ms : conn->sndtimeo_ms;
 	}
+	struct timeval tv;
+	socklen_t len = sizeof(tv);
+	if(getsockopt(fd, SOL_SOCKET, optname, &tv, &len) < 0 || (!tv.tv_sec && !tv.tv_usec))
+		return -1;
+	return (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+}
 
-	// Returns whether the ZeroTier service is running
-	JNIEXPORT jboolean JNICALL Java_zerotier_ZeroTier_ztjni_1running(
-		JNIEnv *env, jobject thisObj) 
-	{
-		return  zts_running();
+/*
+ * Gives an unbound, unconnected datagram socket to the tap with a route to addr (as the
+ * kernel would bind it implicitly on its first sendto())
+ */
+static int dgramAssign(ZeroTier::Connection *conn, const struct sockaddr *addr)
+{
+#if defined(STACK_PICO) || defined(STACK_LWIP)
+	char ipstr[INET6_ADDRSTRLEN];
+	memset(ipstr, 0, INET6_ADDRSTRLEN);
+	if(addr->sa_family == AF_INET)
+		inet_ntop(AF_INET, &((struct sockaddr_in *)addr)->sin_addr, ipstr, INET_ADDRSTRLEN);
+	else if(addr->sa_family == AF_INET6)
+		inet_ntop(AF_INET6, &((struct sockaddr_in6 *)addr)->sin6_addr, ipstr, INET6_ADDRSTRLEN);
+	ZeroTier::InetAddress iaddr;
+	iaddr.fromString(ipstr);
+	ZeroTier::ProfiledMutex::Lock _ml(ZeroTier::_multiplexer_lock);
+	if(conn->tap)
+		return 0;
+	ZeroTier::SocketTap *tap = getTapByAddr(iaddr);
+	if(!tap && hostSocket(conn) == 0)
+		return 1;
+	if(!tap) {
+		errno = ENETUNREACH;
+		return -1;
 	}
-	// Returns path for ZT config/data files    
-	JNIEXPORT jstring JNICALL Java_zerotier_ZeroTier_ztjni_1homepath(
-		JNIEnv *env, jobject thisObj) 
+	if(stackAssign(conn, tap) < 0)
+		return -1;
 	{
-		// TODO: fix, should copy into given arg
-		// return (*env).NewStringUTF(zts_get_homepath());
-		return (*env).NewStringUTF("");
+		ZeroTier::ProfiledMutex::Lock _l(tap->_tcpconns_m);
+		tap->_Connections.add(conn);
 	}
-	// Join a network
-	JNIEXPORT void JNICALL Java_zerotier_ZeroTier_ztjni_1join(
-		JNIEnv *env, jobject thisObj, jstring nwid) 
-	{
-		const char *nwidstr;
-		if(nwid) {
-			nwidstr = env->GetStringUTFChars(nwid, NULL);
-			zts_join(nwidstr);
+	conn->tap = tap;
+	if(conn->sdk_fd >= 0)
+		conn->sock = tap->_phy.wrapSocket(conn->sdk_fd, conn);
+	ZeroTier::fdtable.assign(conn->app_fd, conn, tap);
+	tap->_phy.whack();
+	return 0;
+#endif
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+int dgramHeader(ZeroTier::Connection *conn, const struct msghdr *msg, struct ZeroTier::DatagramHeader *hdr)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	if(msg->msg_name && msg->msg_namelen) {
+		// Callers tend to pass sizeof(struct sockaddr_storage), what matters is that the
+		// family's address fits (anything past the storage is ignored)
+		socklen_t namelen = std::min(msg->msg_namelen, (socklen_t)sizeof(struct sockaddr_storage));
+		if(namelen < offsetof(struct sockaddr, sa_family) + sizeof(sa_family_t)) {
+			errno = EINVAL;
+			return -1;
 		}
-	}
-	// Leave a network
-	JNIEXPORT void JNICALL Java_zerotier_ZeroTier_ztjni_1leave(
-		JNIEnv *env, jobject thisObj, jstring nwid) 
-	{
-		const char *nwidstr;
-		if(nwid) {
-			nwidstr = env->GetStringUTFChars(nwid, NULL);
-			zts_leave(nwidstr);
+		sa_family_t family = ((const struct sockaddr *)msg->msg_name)->sa_family;
+		socklen_t need = family == AF_INET ? sizeof(struct sockaddr_in)
+			: family == AF_INET6 ? sizeof(struct sockaddr_in6) : 0;
+		if(!need) {
+			errno = EAFNOSUPPORT;
+			return -1;
+		}
+		if(namelen < need) {
+			errno = EINVAL;
+			return -1;
 		}
+		memcpy(&hdr->addr, msg->msg_name, need);
+		hdr->addrlen = need;
+		if(!conn->tap)
+			return dgramAssign(conn, (const struct sockaddr *)msg->msg_name);
+		return 0;
 	}
-	// FIXME: Re-implemented to make it play nicer with the C-linkage required for Xcode integrations
-	// Now only returns first assigned address per network. Shouldn't normally be a problem
-	JNIEXPORT jobject JNICALL Java_zerotier_ZeroTier_ztjni_1get_1ipv4_1address(
-		JNIEnv *env, jobject thisObj, jstring nwid) 
-	{
-		const char *nwid_str = env->GetStringUTFChars(nwid, NULL);
-		char address_string[32];
-		memset(address_string, 0, 32);
-		zts_get_ipv4_address(nwid_str, address_string, ZT_MAX_IPADDR_LEN);
-		jclass clazz = (*env).FindClass("java/util/ArrayList");
-		jobject addresses = (*env).NewObject(clazz, (*env).GetMethodID(clazz, "<init>", "()V"));        
-		jstring _str = (*env).NewStringUTF(address_string);
-		env->CallBooleanMethod(addresses, env->GetMethodID(clazz, "add", "(Ljava/lang/Object;)Z"), _str);
-		return addresses;
+	if(!conn->tap) {
+		errno = EDESTADDRREQ;
+		return -1;
 	}
+	return 0;
+}
 
-	JNIEXPORT jobject JNICALL Java_zerotier_ZeroTier_ztjni_1get_1ipv6_1address(
-		JNIEnv *env, jobject thisObj, jstring nwid) 
-	{
-		const char *nwid_str = env->GetStringUTFChars(nwid, NULL);
-		char address_string[32];
-		memset(address_string, 0, 32);
-		zts_get_ipv6_address(nwid_str, address_string, ZT_MAX_IPADDR_LEN);
-		jclass clazz = (*env).FindClass("java/util/ArrayList");
-		jobject addresses = (*env).NewObject(clazz, (*env).GetMethodID(clazz, "<init>", "()V"));        
-		jstring _str = (*env).NewStringUTF(address_string);
-		env->CallBooleanMethod(addresses, env->GetMethodID(clazz, "add", "(Ljava/lang/Object;)Z"), _str);
-		return addresses;
+void dgramFinishRecv(ZeroTier::Connection *conn, const struct ZeroTier::DatagramHeader *hdr, size_t n, 
+	const struct msghdr *got, struct msghdr *msg, unsigned int *len)
+{
+	*len = n > sizeof(*hdr) ? (unsigned int)(n - sizeof(*hdr)) : 0;
+	msg->msg_flags = got->msg_flags;
+	size_t cap = msg->msg_controllen;
+	msg->msg_controllen = 0;
+	if(msg->msg_name) {
+		socklen_t addrlen = n >= sizeof(*hdr) ? hdr->addrlen : 0;
+		memcpy(msg->msg_name, &hdr->addr, std::min(msg->msg_namelen, addrlen));
+		msg->msg_namelen = addrlen;
 	}
+	if(conn->rx_timestamp && n >= sizeof(*hdr) && hdr->rx_stamp)
+		rxTimestamp(conn->rx_timestamp, hdr->rx_stamp, msg, cap);
+}
 
-	// Returns the device is in integer form
-	JNIEXPORT jint Java_zerotier_ZeroTier_ztjni_1get_1device_1id() 
-	{
-		return zts_get_device_id(NULL); // TODO
+void rxTimestamp(int optname, uint64_t stamp, struct msghdr *msg, size_t cap)
+{
+	size_t used = CMSG_ALIGN((size_t)msg->msg_controllen);
+	size_t len = optname == SO_TIMESTAMPNS ? sizeof(struct timespec) : sizeof(struct timeval);
+	if(!msg->msg_control || used + CMSG_SPACE(len) > cap) {
+		msg->msg_flags |= MSG_CTRUNC;
+		return;
+	}
+	struct cmsghdr *cm = (struct cmsghdr *)((char *)msg->msg_control + used);
+	memset(cm, 0, CMSG_SPACE(len));
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_len = CMSG_LEN(len);
+	if(optname == SO_TIMESTAMPNS) {
+		struct timespec ts;
+		ts.tv_sec = (time_t)(stamp / 1000000000);
+		ts.tv_nsec = (long)(stamp % 1000000000);
+		cm->cmsg_type = SCM_TIMESTAMPNS;
+		memcpy(CMSG_DATA(cm), &ts, sizeof(ts));
+	}
+	else {
+		struct timeval tv;
+		tv.tv_sec = (time_t)(stamp / 1000000000);
+		tv.tv_usec = (suseconds_t)(stamp % 1000000000 / 1000);
+		cm->cmsg_type = SCM_TIMESTAMP;
+		memcpy(CMSG_DATA(cm), &tv, sizeof(tv));
 	}
+	msg->msg_controllen = used + CMSG_SPACE(len);
+}
 
-	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1send(JNIEnv *env, jobject thisObj, jint fd, jarray buf, jint len, int flags)
-	{
-		jbyte *body = (*env).GetByteArrayElements((_jbyteArray *)buf, 0);
-		char * bufp = (char *)malloc(sizeof(char)*len);
-		memcpy(bufp, body, len);
-		(*env).ReleaseByteArrayElements((_jbyteArray *)buf, body, 0);
-		int written_bytes = zts_write(fd, body, len);
-		return written_bytes;
+ssize_t dgramSend(ZeroTier::Connection *conn, const struct msghdr *msg, int flags)
+{
+	if(msg->msg_iovlen + 1 > ZT_MMSG_IOV_MAX) {
+		errno = EMSGSIZE;
+		return -1;
 	}
+	int fd = conn->app_fd;
+	struct ZeroTier::DatagramHeader hdr;
+	int r = dgramHeader(conn, msg, &hdr);
+	if(r < 0)
+		return -1;
+	if(r > 0) // conn is gone, fd is a host socket now
+		return sendmsg(fd, msg, flags);
+	if(conn->pmtudisc_do && conn->tap) {
+		size_t len = conn->socket_family == AF_INET6 ? 48 : 28; // IP and UDP headers
+		for(size_t i=0; i<msg->msg_iovlen; i++)
+			len += msg->msg_iov[i].iov_len;
+		if(len > conn->tap->pathMtu()) {
+			errno = EMSGSIZE;
+			return -1;
+		}
+	}
+	struct iovec iov[ZT_MMSG_IOV_MAX];
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	for(size_t i=0; i<msg->msg_iovlen; i++)
+		iov[i + 1] = msg->msg_iov[i];
+	struct msghdr m;
+	memset(&m, 0, sizeof(m));
+	m.msg_iov = iov;
+	m.msg_iovlen = msg->msg_iovlen + 1;
+	ssize_t n = sendmsg(conn->app_fd, &m, flags);
+	return n < 0 ? n : n - (ssize_t)sizeof(hdr);
+}
 
-	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1sendto(
-		JNIEnv *env, jobject thisObj, jint fd, jarray buf, jint len, jint flags, jobject ztaddr)
-	{
-		struct sockaddr_in addr;
-		jclass cls = (*env).GetObjectClass( ztaddr);
-		jfieldID f = (*env).GetFieldID( cls, "port", "I");
-		addr.sin_port = htons((*env).GetIntField( ztaddr, f));
-		f = (*env).GetFieldID( cls, "_rawAddr", "J");
-		addr.sin_addr.s_addr = (*env).GetLongField( ztaddr, f);
-		addr.sin_family = AF_INET;
-		//LOGV("zt_sendto(): fd = %d\naddr = %s\nport=%d", fd, inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
-		// TODO: Optimize this
-		jbyte *body = (*env).GetByteArrayElements((_jbyteArray *)buf, 0);
-		char * bufp = (char *)malloc(sizeof(char)*len);
-		memcpy(bufp, body, len);
-		(*env).ReleaseByteArrayElements((_jbyteArray *)buf, body, 0);
-		// "connect" and send buffer contents
-		int sent_bytes = zts_sendto(fd, body, len, flags, (struct sockaddr *)&addr, sizeof(addr));
-		return sent_bytes;
+ssize_t dgramRecv(ZeroTier::Connection *conn, struct msghdr *msg, int flags)
+{
+	if(msg->msg_iovlen + 1 > ZT_MMSG_IOV_MAX) {
+		errno = EMSGSIZE;
+		return -1;
 	}
+	struct ZeroTier::DatagramHeader hdr;
+	struct iovec iov[ZT_MMSG_IOV_MAX];
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	for(size_t i=0; i<msg->msg_iovlen; i++)
+		iov[i + 1] = msg->msg_iov[i];
+	struct msghdr m;
+	memset(&m, 0, sizeof(m));
+	m.msg_iov = iov;
+	m.msg_iovlen = msg->msg_iovlen + 1;
+	ssize_t n = recvmsg(conn->app_fd, &m, flags);
+	if(n < 0)
+		return -1;
+	unsigned int len;
+	dgramFinishRecv(conn, &hdr, n, &m, msg, &len);
+	return len;
+}
 
-	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1recvfrom(
-		JNIEnv *env, jobject thisObj, jint fd, jbyteArray buf, jint len, jint flags, jobject ztaddr)
+ssize_t msgSend(ZeroTier::Connection *conn, const struct msghdr *msg, int flags)
+{
+	const struct zts_sockaddr_msg *to = NULL;
+	if(msg->msg_name && !(to = msgAddr((const struct sockaddr *)msg->msg_name, msg->msg_namelen)))
+		return -1;
+	uint64_t node = to ? to->smsg_node : conn->msg_node;
+	uint16_t port = to ? ntohs(to->smsg_port) : conn->msg_dport;
+	if(!node) {
+		errno = EDESTADDRREQ;
+		return -1;
+	}
 	{
-		struct sockaddr_in addr;
-		jbyte *body = (*env).GetByteArrayElements( buf, 0);
-		unsigned char buffer[ZT_SDK_MTU];
-		int payload_offset = sizeof(int) + sizeof(struct sockaddr_storage);
-		int rxbytes = zts_recvfrom(fd, &buffer, len, flags, (struct sockaddr *)&addr, (socklen_t *)sizeof(struct sockaddr_storage));
-		if(rxbytes > 0)
-			memcpy(body, (jbyte*)buffer + payload_offset, rxbytes);
-		(*env).ReleaseByteArrayElements( buf, body, 0);
-		// Update fields of Java ZTAddress object
-		jfieldID fid;
-		jclass cls = (*env).GetObjectClass( ztaddr);
-		fid = (*env).GetFieldID( cls, "port", "I");
-		(*env).SetIntField( ztaddr, fid, addr.sin_port);
-		fid = (*env).GetFieldID( cls,"_rawAddr", "J");
-		(*env).SetLongField( ztaddr, fid,addr.sin_addr.s_addr);        
-		return rxbytes;
+		ZeroTier::ProfiledMutex::Lock _l(ZeroTier::_multiplexer_lock);
+		if(!conn->msg_port && msgBind(conn, to ? to->smsg_nwid : 0, 0) < 0)
+			return -1;
+	}
+	// A socket sends on the network it's bound to
+	if(to && to->smsg_nwid && to->smsg_nwid != conn->tap->_nwid) {
+		errno = ENETUNREACH;
+		return -1;
 	}
+	if(msg->msg_iovlen == 1)
+		return conn->tap->WriteMsg(conn, node, port, msg->msg_iov[0].iov_base, msg->msg_iov[0].iov_len);
+	std::string buf;
+	for(size_t i=0; i<msg->msg_iovlen; i++)
+		buf.append((const char *)msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len);
+	return conn->tap->WriteMsg(conn, node, port, buf.data(), buf.size());
+}
 
-	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1write(JNIEnv *env, jobject thisObj, jint fd, jarray buf, jint len)
-	{
-		jbyte *body = (*env).GetByteArrayElements((_jbyteArray *)buf, 0);
-		char * bufp = (char *)malloc(sizeof(char)*len);
-		memcpy(bufp, body, len);
-		(*env).ReleaseByteArrayElements((_jbyteArray *)buf, body, 0);
-		int written_bytes = zts_write(fd, body, len);
-		return written_bytes;
+ssize_t msgRecv(ZeroTier::Connection *conn, struct msghdr *msg, int flags)
+{
+	if(msg->msg_iovlen + 1 > ZT_MMSG_IOV_MAX) {
+		errno = EMSGSIZE;
+		return -1;
 	}
+	struct zts_sockaddr_msg from;
+	struct iovec iov[ZT_MMSG_IOV_MAX];
+	iov[0].iov_base = &from;
+	iov[0].iov_len = sizeof(from);
+	for(size_t i=0; i<msg->msg_iovlen; i++)
+		iov[i + 1] = msg->msg_iov[i];
+	struct msghdr m;
+	memset(&m, 0, sizeof(m));
+	m.msg_iov = iov;
+	m.msg_iovlen = msg->msg_iovlen + 1;
+	ssize_t n = recvmsg(conn->app_fd, &m, flags);
+	if(n < 0)
+		return -1;
+	if(n < (ssize_t)sizeof(from)) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if(msg->msg_name) {
+		memcpy(msg->msg_name, &from, std::min((size_t)msg->msg_namelen, sizeof(from)));
+		msg->msg_namelen = sizeof(from);
+	}
+	msg->msg_flags = m.msg_flags;
+	msg->msg_controllen = 0;
+	return n - sizeof(from);
+}
 
-	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1read(JNIEnv *env, jobject thisObj, jint fd, jarray buf, jint len)
-	{
-		jbyte *body = (*env).GetByteArrayElements((_jbyteArray *)buf, 0);
-		int read_bytes = read(fd, body, len);
-		(*env).ReleaseByteArrayElements((_jbyteArray *)buf, body, 0);
-		return read_bytes;
-	}    
+static bool directWouldBlock(ZeroTier::Connection *conn, int flags)
+{
+	return (flags & MSG_DONTWAIT) || conn->nonblocking;
+}
 
-	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1setsockopt(
-		JNIEnv *env, jobject thisObj, jint fd, jint level, jint optname, jint optval, jint optlen) {
-		return zts_setsockopt(fd, level, optname, (const void*)optval, optlen);
+/*
+	[--] [EAGAIN]           Non-blocking (or SO_RCVTIMEO expired) and no data is available.
+	[--] [ECONNRESET]       Connection reset by peer.
+	[--] [ENOTCONN]         The socket is not connected.
+	[--] [EOPNOTSUPP]       MSG_OOB was given.
+*/
+#if defined(STACK_PICO)
+/*
+	Waits (unless non-blocking) until conn's RXbuf has something in it. Returns 1 once it has,
+	0 at the end of the stream or -1 with errno set
+*/
+static int directWaitReadable(ZeroTier::Connection *conn, int flags)
+{
+	if(!conn->RXbuf->count()) {
+		if(conn->closure_ts == -1 && conn->state != PICO_ERR_ECONNRESET) {
+			if(directWouldBlock(conn, flags)) {
+				errno = EAGAIN;
+				return -1;
+			}
+			// Woken by the stack thread as soon as it has put something in RXbuf
+			int timeout_ms = getSockTimeoutMs(conn->app_fd, SO_RCVTIMEO);
+			bool ready = conn->wait_state([conn]() {
+				return conn->RXbuf->count() || conn->closure_ts != -1 || conn->state == PICO_ERR_ECONNRESET;
+			}, timeout_ms, ZT_DIRECT_IO_RECHECK_DELAY);
+			if(!ready) {
+				errno = EAGAIN;
+				return -1;
+			}
+		}
+		if(!conn->RXbuf->count()) {
+			if(conn->state == PICO_ERR_ECONNRESET) {
+				errno = ECONNRESET;
+				return -1;
+			}
+			return 0; // orderly shutdown
+		}
 	}
+	return 1;
+}
 
-	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1getsockopt(JNIEnv *env, jobject thisObj, jint fd, jint level, jint optname, jint optval, jint optlen) {
-		return zts_getsockopt(fd, level, optname, (void*)optval, (socklen_t *)optlen);
-	}
+/*
+	Bookkeeping once the app has taken data out of conn's RXbuf
+*/
+static void directConsumed(ZeroTier::Connection *conn)
+{
+	conn->rx_mark.consumed(conn->RXbuf->consumed(), ZTS_LATENCY_RX_BUF);
+	if(!conn->RXbuf->count())
+		ZeroTier::native_update(conn);
+	// There's room now, have the stack thread pick up whatever it couldn't fit before
+	if(conn->rx_stalled)
+		conn->tap->WakeDirect(true);
+}
+#endif
 
-	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1socket(JNIEnv *env, jobject thisObj, jint family, jint type, jint protocol) {
-		return zts_socket(family, type, protocol);
+ssize_t directRead(ZeroTier::Connection *conn, void *buf, size_t len, int flags)
+{
+#if defined(STACK_PICO)
+	if(flags & MSG_OOB) {
+		errno = EOPNOTSUPP;
+		return -1;
 	}
-	
-	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1connect(JNIEnv *env, jobject thisObj, jint fd, jstring addrstr, jint port) {
-		struct sockaddr_in addr;
-		const char *str = (*env).GetStringUTFChars( addrstr, 0);
-		addr.sin_addr.s_addr = inet_addr(str);
-		addr.sin_family = AF_INET;
-		addr.sin_port = htons( port );
-		(*env).ReleaseStringUTFChars( addrstr, str);
-		return zts_connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+	if(!conn->tap) {
+		errno = ENOTCONN;
+		return -1;
 	}
-
-	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1bind(JNIEnv *env, jobject thisObj, jint fd, jstring addrstr, jint port) {
-		struct sockaddr_in addr;
-		const char *str = (*env).GetStringUTFChars( addrstr, 0);
-		DEBUG_INFO("fd=%d, addr=%s, port=%d", fd, str, port);
-		addr.sin_addr.s_addr = inet_addr(str);
-		addr.sin_family = AF_INET;
-		addr.sin_port = htons( port );
-		(*env).ReleaseStringUTFChars( addrstr, str);
-		return zts_bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	if(!len)
+		return 0;
+	ZeroTier::Mutex::Lock _l(conn->_rx_m); // RXbuf has one consumer, one app thread at a time
+	int r = directWaitReadable(conn, flags);
+	if(r <= 0)
+		return r;
+	size_t n = 0;
+	if(flags & MSG_PEEK) {
+		ZeroTier::ring_span<unsigned char> span[2];
+		conn->RXbuf->readable_span(span);
+		for(int i=0; i<2 && span[i].len && n < len; i++) {
+			size_t c = std::min(span[i].len, len - n);
+			memcpy((unsigned char*)buf + n, span[i].ptr, c);
+			n += c;
+		}
+		return n;
 	}
+	n = conn->RXbuf->read((unsigned char*)buf, len);
+	directConsumed(conn);
+	return n;
+#endif
+	errno = EOPNOTSUPP;
+	return -1;
+}
 
-#if defined(__linux__)
-	 JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1accept4(JNIEnv *env, jobject thisObj, jint fd, jstring addrstr, jint port, jint flags) {
-		struct sockaddr_in addr;
-		char *str;
-		// = env->GetStringUTFChars(addrstr, NULL);
-		(*env).ReleaseStringUTFChars( addrstr, str);
-		addr.sin_addr.s_addr = inet_addr(str);
-		addr.sin_family = AF_INET;
-		addr.sin_port = htons( port );
-		return zts_accept4(fd, (struct sockaddr *)&addr, sizeof(addr), flags);
+/*
+	[--] [ENOTCONN]         The socket is not connected.
+	[--] [ECONNRESET]       Connection reset by peer.
+	[--] [EAGAIN]           Non-blocking (or SO_RCVTIMEO expired) and no data is available.
+*/
+int directRecvZc(ZeroTier::Connection *conn, struct zts_iovec *views, int max)
+{
+#if defined(STACK_PICO)
+	if(!conn->tap) {
+		errno = ENOTCONN;
+		return -1;
+	}
+	ZeroTier::Mutex::Lock _l(conn->_rx_m);
+	int r = directWaitReadable(conn, 0);
+	if(r <= 0)
+		return r;
+	// Only the app consumes RXbuf in direct I/O mode, what's readable stays put until released
+	ZeroTier::ring_span<unsigned char> span[2];
+	conn->RXbuf->readable_span(span);
+	int n = 0;
+	for(int i=0; i<2 && n<max && span[i].len; i++, n++) {
+		views[n].iov_base = span[i].ptr;
+		views[n].iov_len = span[i].len;
 	}
+	return n;
 #endif
+	errno = EOPNOTSUPP;
+	return -1;
+}
 
-	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1accept(JNIEnv *env, jobject thisObj, jint fd, jstring addrstr, jint port) {
-		struct sockaddr_in addr;
-		// TODO: Send addr info back to Javaland
-		addr.sin_addr.s_addr = inet_addr("");
-		addr.sin_family = AF_INET;
-		addr.sin_port = htons( port );
-		return zts_accept(fd, (struct sockaddr *)&addr, (socklen_t *)sizeof(addr));    
+/*
+	[--] [EINVAL]           n is more than is in RXbuf.
+*/
+int directRecvRelease(ZeroTier::Connection *conn, size_t n)
+{
+#if defined(STACK_PICO)
+	ZeroTier::Mutex::Lock _l(conn->_rx_m);
+	if(n > conn->RXbuf->count()) {
+		errno = EINVAL;
+		return -1;
 	}
+	if(!n)
+		return 0;
+	conn->RXbuf->consume(n);
+	directConsumed(conn);
+	return 0;
+#endif
+	errno = EOPNOTSUPP;
+	return -1;
+}
 
-	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1listen(JNIEnv *env, jobject thisObj, jint fd, int backlog) {
-		return zts_listen(fd, backlog);
+#if defined(STACK_PICO)
+/*
+	Queues up to len bytes on conn's TXbuf for the stack thread, waiting for room unless
+	non-blocking. fill(done, want) adds at most want bytes to TXbuf and returns how many it
+	added, 0 once its source has run dry or -1 (with errno set) on error
+*/
+extern "C++" {
+template<typename F> static ssize_t directProduce(ZeroTier::Connection *conn, size_t len, int flags, F fill)
+{
+	if(flags & MSG_OOB) {
+		errno = EOPNOTSUPP;
+		return -1;
 	}
-
-	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1close(JNIEnv *env, jobject thisObj, jint fd) {
-		return zts_close(fd);
+	if(conn->state != ZT_SOCK_STATE_CONNECTED && conn->state != ZT_SOCK_STATE_UNHANDLED_CONNECTED
+		&& conn->state != PICO_ERR_ECONNRESET) {
+		errno = ENOTCONN;
+		return -1;
+	}
+	// Otherwise every way out of the loop below with nothing written has errno set
+	if(!len)
+		return 0;
+	// TXbuf has one producer, writers on the same socket take turns
+	ZeroTier::Mutex::Lock _l(conn->_tx_m);
+	size_t tot = 0;
+	while(tot < len) {
+		if(conn->state == PICO_ERR_ECONNRESET) {
+			errno = ECONNRESET;
+			break;
+		}
+		if(conn->closure_ts != -1) {
+			errno = EPIPE;
+			break;
+		}
+		// Anything written now goes out after the zero-copy sends already queued
+		if(conn->TXbuf->getFree() && !conn->zc_pending) {
+			size_t queued = conn->TXbuf->count();
+			ssize_t w = fill(tot, len - tot);
+			if(w <= 0) {
+				if(!w && !tot)
+					return 0;
+				break;
+			}
+			tot += w;
+			conn->tx_mark.produced(conn->TXbuf->produced());
+			ZeroTier::stat_max(conn->stats.txbuf_hwm, conn->TXbuf->count());
+			// If something was already queued the stack thread is still working on TXbuf
+			// and will see this data without being woken up
+			conn->tap->WakeDirect(queued == 0);
+			continue;
+		}
+		if(directWouldBlock(conn, flags)) {
+			errno = EAGAIN;
+			break;
+		}
+		// Woken by the stack thread whenever it takes data out of TXbuf
+		int timeout_ms = getSockTimeoutMs(conn->app_fd, SO_SNDTIMEO);
+		bool ready = conn->wait_state([conn]() {
+			return (conn->TXbuf->getFree() && !conn->zc_pending) || conn->closure_ts != -1 
+				|| conn->state == PICO_ERR_ECONNRESET;
+		}, timeout_ms, ZT_DIRECT_IO_RECHECK_DELAY);
+		if(!ready) {
+			errno = EAGAIN;
+			break;
+		}
 	}
+	return tot ? (ssize_t)tot : -1;
+}
+}
+#endif
 
-	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1getsockname(JNIEnv *env, jobject thisObj, jint fd, jobject ztaddr) {
-		struct sockaddr_in addr;
-		int err = zts_getsockname(fd, (struct sockaddr *)&addr, (socklen_t *)sizeof(struct sockaddr));
-		jfieldID fid;
-		jclass cls = (*env).GetObjectClass(ztaddr);
-		fid = (*env).GetFieldID( cls, "port", "I");
-		(*env).SetIntField( ztaddr, fid, addr.sin_port);
-		fid = (*env).GetFieldID( cls,"_rawAddr", "J");
-		(*env).SetLongField( ztaddr, fid,addr.sin_addr.s_addr);        
-		return err;    
-	}
+/*
+	[--] [EAGAIN]           Non-blocking (or SO_SNDTIMEO expired) and TXbuf is full.
+	[--] [ECONNRESET]       Connection reset by peer.
+	[--] [ENOTCONN]         The socket is not connected.
+	[--] [EPIPE]            The connection has been closed.
+	[--] [EOPNOTSUPP]       MSG_OOB was given.
+*/
+ssize_t directWrite(ZeroTier::Connection *conn, const void *buf, size_t len, int flags)
+{
+#if defined(STACK_PICO)
+	return directProduce(conn, len, flags, [conn, buf](size_t done, size_t want) {
+		return (ssize_t)conn->TXbuf->write((const unsigned char*)buf + done, want);
+	});
+#endif
+	errno = EOPNOTSUPP;
+	return -1;
+}
 
-	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1getpeername(JNIEnv *env, jobject thisObj, jint fd, jobject ztaddr) {
-		struct sockaddr_in addr;
-		int err = zts_getpeername(fd, (struct sockaddr *)&addr, (socklen_t *)sizeof(struct sockaddr));
-		jfieldID fid;
-		jclass cls = (*env).GetObjectClass( ztaddr);
-		fid = (*env).GetFieldID( cls, "port", "I");
-		(*env).SetIntField( ztaddr, fid, addr.sin_port);
-		fid = (*env).GetFieldID( cls,"_rawAddr", "J");
-		(*env).SetLongField( ztaddr, fid,addr.sin_addr.s_addr);        
-		return err;
-	}
+ssize_t directWritev(ZeroTier::Connection *conn, const struct iovec *iov, int iovcnt)
+{
+#if defined(STACK_PICO)
+	size_t len = 0;
+	for(int i=0; i<iovcnt; i++)
+		len += iov[i].iov_len;
+	int i = 0;
+	size_t off = 0; // into iov[i]
+	return directProduce(conn, len, 0, [conn, iov, iovcnt, &i, &off](size_t, size_t want) {
+		size_t n = 0;
+		while(i < iovcnt && n < want) {
+			size_t w = conn->TXbuf->write((const unsigned char*)iov[i].iov_base + off, 
+				std::min(iov[i].iov_len - off, want - n));
+			n += w;
+			off += w;
+			if(off == iov[i].iov_len) {
+				i++;
+				off = 0;
+			}
+			else if(!w)
+				break; // TXbuf is full
+		}
+		return (ssize_t)n;
+	});
+#endif
+	errno = EOPNOTSUPP;
+	return -1;
+}
 
-	JNIEXPORT jint JNICALL Java_zerotier_ZeroTier_ztjni_1fcntl(JNIEnv *env, jobject thisObj, jint fd, jint cmd, jint flags) {
-		return zts_fcntl(fd,cmd,flags);
+ssize_t directReadv(ZeroTier::Connection *conn, const struct iovec *iov, int iovcnt)
+{
+#if defined(STACK_PICO)
+	int i = 0;
+	while(i < iovcnt && !iov[i].iov_len)
+		i++;
+	if(i == iovcnt)
+		return directRead(conn, NULL, 0, 0);
+	if(!conn->tap) {
+		errno = ENOTCONN;
+		return -1;
 	}
-}
+	ZeroTier::Mutex::Lock _l(conn->_rx_m);
+	// Only the first buffer is waited for, the rest take whatever else is already there
+	int r = directWaitReadable(conn, 0);
+	if(r <= 0)
+		return r;
+	ssize_t n = 0;
+	for(; i<iovcnt && conn->RXbuf->count(); i++)
+		n += conn->RXbuf->read((unsigned char*)iov[i].iov_base, iov[i].iov_len);
+	directConsumed(conn);
+	return n;
 #endif
+	errno = EOPNOTSUPP;
+	return -1;
+}
 
-/****************************************************************************/
-/* SDK Socket API Helper functions --- DON'T CALL THESE DIRECTLY            */
-/****************************************************************************/
+/*
+	Errors reading in_fd are passed on as they are (for pread() if offset is given, or read()),
+	see directWrite() for the rest
+*/
+ssize_t directSendfile(ZeroTier::Connection *conn, int in_fd, off_t *offset, size_t count)
+{
+#if defined(STACK_PICO)
+	off_t pos = offset ? *offset : 0;
+	ssize_t n = directProduce(conn, count, 0, [conn, in_fd, offset, &pos](size_t, size_t want) {
+		// The file is read straight into TXbuf's free space
+		ZeroTier::ring_span<unsigned char> span[2];
+		conn->TXbuf->writable_span(span, want);
+		struct iovec iov[2];
+		int cnt = ZeroTier::ring_span_to_iov(span, iov);
+		ssize_t r;
+		do {
+			r = offset ? preadv(in_fd, iov, cnt, pos) : readv(in_fd, iov, cnt);
+		} while(r < 0 && errno == EINTR);
+		if(r > 0) {
+			conn->TXbuf->produce(r);
+			pos += r;
+		}
+		return r;
+	});
+	if(offset)
+		*offset = pos;
+	return n;
+#endif
+	errno = EOPNOTSUPP;
+	return -1;
+}
 
 #if defined(STACK_PICO)
-int zts_get_pico_socket(int fd, struct pico_socket **s)
+/*
+	directSplice() with in's _rx_m held (if there's an in)
+*/
+static ssize_t directSpliceLocked(ZeroTier::Connection *in, int in_fd, ZeroTier::Connection *out,
+	int out_fd, size_t len, int flags)
 {
-	int err = 0;
-	if(!zt1Service) {
-		DEBUG_ERROR("cannot locate socket. service not started. call zts_start(path) first");
-		errno = EBADF;
-		err = -1;
+	int msg_flags = (flags & ZT_SPLICE_F_NONBLOCK) ? MSG_DONTWAIT : 0;
+	if(in) {
+		if(!in->tap) {
+			errno = ENOTCONN;
+			return -1;
+		}
+		int r = directWaitReadable(in, msg_flags);
+		if(r <= 0)
+			return r;
+		len = std::min(len, in->RXbuf->count());
 	}
-	else
-	{
-		ZeroTier::_multiplexer_lock.lock();
-		// First, look for for unassigned connections
-		ZeroTier::Connection *conn = ZeroTier::unmap[fd];
-		if(conn)
-		{
-			*s = conn->picosock;
-			err = 1; // unassigned
+	else if(msg_flags) {
+		struct pollfd pfd = { in_fd, POLLIN, 0 };
+		if(poll(&pfd, 1, 0) <= 0) {
+			errno = EAGAIN;
+			return -1;
 		}
-		else
-		{
-			std::pair<ZeroTier::Connection*, ZeroTier::SocketTap*> *p = ZeroTier::fdmap[fd];
-			if(!p) 
-			{
-				DEBUG_ERROR("unable to locate connection pair.");
-				errno = EBADF;
-				err = -1;
-			}
-			else
-			{
-				*s = p->first->picosock;
-				err = 0; // assigned
+	}
+	ssize_t n;
+	if(in && out) {
+		// RXbuf to TXbuf, in is only consumed as far as out has taken it
+		n = directProduce(out, len, msg_flags, [in, out](size_t, size_t want) {
+			ZeroTier::ring_span<unsigned char> span[2];
+			in->RXbuf->readable_span(span);
+			size_t moved = 0;
+			for(int i=0; i<2 && span[i].len && moved < want; i++) {
+				size_t c = std::min(span[i].len, want - moved);
+				size_t w = out->TXbuf->write(span[i].ptr, c);
+				moved += w;
+				if(w < c)
+					break;
 			}
+			in->RXbuf->consume(moved);
+			return (ssize_t)moved;
+		});
+	}
+	else if(out) {
+		// Read once straight into TXbuf's free space, a socket needn't have len bytes coming
+		bool done = false;
+		n = directProduce(out, len, msg_flags, [out, in_fd, &done](size_t, size_t want) {
+			if(done)
+				return (ssize_t)0;
+			done = true;
+			ZeroTier::ring_span<unsigned char> span[2];
+			out->TXbuf->writable_span(span, want);
+			struct iovec iov[2];
+			int cnt = ZeroTier::ring_span_to_iov(span, iov);
+			ssize_t r;
+			do {
+				r = readv(in_fd, iov, cnt);
+			} while(r < 0 && errno == EINTR);
+			if(r > 0)
+				out->TXbuf->produce(r);
+			return r;
+		});
+		return n;
+	}
+	else {
+		// Written straight from RXbuf
+		ZeroTier::ring_span<unsigned char> span[2];
+		in->RXbuf->readable_span(span);
+		struct iovec iov[2];
+		int cnt = 0;
+		for(size_t left = len; cnt<2 && span[cnt].len && left; cnt++) {
+			iov[cnt].iov_base = span[cnt].ptr;
+			iov[cnt].iov_len = std::min(span[cnt].len, left);
+			left -= iov[cnt].iov_len;
 		}
-		ZeroTier::_multiplexer_lock.unlock();
+		do {
+			n = writev(out_fd, iov, cnt);
+		} while(n < 0 && errno == EINTR);
+		if(n > 0)
+			in->RXbuf->consume(n);
 	}
-	return err;
+	if(n > 0)
+		directConsumed(in);
+	return n;
 }
 #endif
 
-int zts_nsockets()
+/*
+	Errors on a host descriptor are passed on as they are (for readv()/writev()), see
+	directRead()/directWrite() for the rest
+*/
+ssize_t directSplice(ZeroTier::Connection *in, int in_fd, ZeroTier::Connection *out, int out_fd,
+	size_t len, int flags)
 {
-	ZeroTier::_multiplexer_lock.unlock();
-	int num = ZeroTier::unmap.size() + ZeroTier::fdmap.size();
-	ZeroTier::_multiplexer_lock.unlock(); 
-	return num;
+#if defined(STACK_PICO)
+	if(in) {
+		// Taken before out's _tx_m (see directProduce()) wherever both are held
+		ZeroTier::Mutex::Lock _l(in->_rx_m);
+		return directSpliceLocked(in, in_fd, out, out_fd, len, flags);
+	}
+	return directSpliceLocked(in, in_fd, out, out_fd, len, flags);
+#endif
+	errno = EOPNOTSUPP;
+	return -1;
 }
 
-int zts_maxsockets()
+ZeroTier::SocketTap *getTapByNWID(uint64_t nwid)
 {
-#if defined(STACK_PICO)
-	// TODO: This is only an approximation
-	return PICO_MAX_TIMERS - 10;
-#endif
-	return 32;
+	return ZeroTier::tapindex.byNwid(nwid);
 }
 
-/****************************************************************************/
-/* ZeroTier Core helper functions for libzt - DON'T CALL THESE DIRECTLY     */
-/****************************************************************************/
+ZeroTier::SocketTap *getTapByAddr(ZeroTier::InetAddress &addr)
+{
+	return ZeroTier::tapindex.byAddr(addr);
+}
 
-ZeroTier::SocketTap *getTapByNWID(uint64_t nwid)
+ZeroTier::SocketTap *getTapByName(char *ifname)
+{
+	return ZeroTier::tapindex.byName(ifname);
+}
+
+ZeroTier::SocketTap *getTapByIndex(int index)
+{
+	return ZeroTier::tapindex.byIndex(index);
+}
+
+static void deleteTaps(std::vector<void*> &taps);
+
+void dismantleTaps()
 {
 	ZeroTier::_vtaps_lock.lock();
-	ZeroTier::SocketTap *s, *tap = nullptr;    
-	for(int i=0; i<ZeroTier::vtaps.size(); i++) {
-		s = (ZeroTier::SocketTap*)ZeroTier::vtaps[i];
-		if(s->_nwid == nwid) { tap = s; }
-	}
+	std::vector<void*> taps;
+	taps.swap(ZeroTier::vtaps);
+	ZeroTier::tapindex.rebuild(ZeroTier::vtaps);
 	ZeroTier::_vtaps_lock.unlock();
-	return tap;
+	deleteTaps(taps);
 }
 
-ZeroTier::SocketTap *getTapByAddr(ZeroTier::InetAddress &addr)
+// Those of the node running on homePath only, see zts_node_stop()
+static void dismantleNodeTaps(const std::string &homePath)
 {
 	ZeroTier::_vtaps_lock.lock();
-	ZeroTier::SocketTap *s, *tap = nullptr; 
-	for(int i=0; i<ZeroTier::vtaps.size(); i++) {
-		s = (ZeroTier::SocketTap*)ZeroTier::vtaps[i];
-		for(int j=0; j<s->_ips.size(); j++) {
-			if(s->_ips[j].isEqualPrefix(addr) 
-				|| s->_ips[j].ipsEqual(addr) 
-				|| s->_ips[j].containsAddress(addr)) 
-			{
-				tap = s;
-			}
-		}
+	std::vector<void*> taps, kept;
+	for(size_t i=0; i<ZeroTier::vtaps.size(); i++) {
+		if(((ZeroTier::SocketTap*)ZeroTier::vtaps[i])->_homePath == homePath)
+			taps.push_back(ZeroTier::vtaps[i]);
+		else
+			kept.push_back(ZeroTier::vtaps[i]);
 	}
+	ZeroTier::vtaps.swap(kept);
+	ZeroTier::tapindex.rebuild(ZeroTier::vtaps);
 	ZeroTier::_vtaps_lock.unlock();
-	return tap;
+	deleteTaps(taps);
 }
 
-ZeroTier::SocketTap *getTapByName(char *ifname)
+static void deleteTaps(std::vector<void*> &taps)
 {
-	ZeroTier::_vtaps_lock.lock();
-	ZeroTier::SocketTap *s, *tap = nullptr;  
-	for(int i=0; i<ZeroTier::vtaps.size(); i++) {
-		s = (ZeroTier::SocketTap*)ZeroTier::vtaps[i];
-		if(!strcmp(s->_dev.c_str(), ifname)) {
-			tap = s;
-		}
+	// Deleting a tap waits on its stack thread, so _vtaps_lock is not held here. The stack
+	// threads let go of all of them at once, then up to ZT_TAP_TEARDOWN_THREADS taps at a time
+	// wait on their TX threads
+	std::vector<ZeroTier::SocketTap*> all(taps.size());
+	for(size_t i=0; i<taps.size(); i++) {
+		all[i] = (ZeroTier::SocketTap*)taps[i];
+		all[i]->Park(); // see zts_set_rebind_grace()
 	}
-	ZeroTier::_vtaps_lock.unlock();
-	return tap;
+	ZeroTier::StackThread::detach(all);
+	std::atomic<size_t> next(0);
+	std::vector<std::thread> workers;
+	for(size_t w=0; w<all.size() && w<ZT_TAP_TEARDOWN_THREADS; w++) {
+		workers.push_back(std::thread([&all, &next]() {
+			for(size_t i; (i = next++) < all.size(); )
+				delete all[i];
+		}));
+	}
+	for(size_t w=0; w<workers.size(); w++)
+		workers[w].join();
 }
 
-ZeroTier::SocketTap *getTapByIndex(int index)
+
+#define ZT_PEER_PATH_CACHE_FILE "peers.paths"
+
+// Serializes savePeerPaths(), the cache thread and zts_stop() may both be at it
+static ZeroTier::Mutex peer_paths_save_m;
+
+// Writes "<address> <ip/port> <last receive>" for every live path of every peer
+void savePeerPaths()
 {
-	ZeroTier::_vtaps_lock.lock();
-	ZeroTier::SocketTap *s, *tap = nullptr;    
-	for(int i=0; i<ZeroTier::vtaps.size(); i++) {
-		s = (ZeroTier::SocketTap*)ZeroTier::vtaps[i];
-		if(s->ifindex == index) {
-			tap = s;
+	// Or an older snapshot could be queued after a newer one
+	ZeroTier::Mutex::Lock _l(peer_paths_save_m);
+	ZeroTier::Node *node = zt1Service ? zt1Service->getNode() : NULL;
+	ZT_PeerList *pl = node ? node->peers() : NULL;
+	if(!pl)
+		return;
+	std::string out;
+	for(unsigned long i=0; i<pl->peerCount; i++) {
+		ZT_Peer *p = &(pl->peers[i]);
+		for(unsigned int j=0; j<p->pathCount; j++) {
+			if(p->paths[j].expired || !p->paths[j].lastReceive)
+				continue;
+			char ipbuf[64], line[128];
+			ZeroTier::InetAddress addr((const struct sockaddr *)&(p->paths[j].address));
+			snprintf(line, sizeof(line), "%010llx %s %llu\n", (unsigned long long)p->address, 
+				addr.toString(ipbuf), (unsigned long long)p->paths[j].lastReceive);
+			out += line;
 		}
 	}
-	ZeroTier::_vtaps_lock.unlock();
-	return tap;
+	node->freeQueryResult((void *)pl);
+	// Nothing learned yet (just started, or offline), keep what the last run knew
+	if(out.size())
+		ZeroTier::StateWriter::write(ZeroTier::homeDir + ZT_PATH_SEPARATOR_S ZT_PEER_PATH_CACHE_FILE, out);
 }
 
-void dismantleTaps()
+/*
+ * Adds to paths the endpoints a symmetric NAT seen in seen (when each last received, and where)
+ * is likely to hand out next. A NAT which gave out more than one port on an address keeps
+ * stepping by about as much as it did last, or if that was too far apart to guess from, lands
+ * near the last. Random ports catch those where neither side's allocation can be guessed, as
+ * both ends probing many ports soon find a pair which meet
+ */
+static unsigned predictPeerPaths(std::vector<std::string> &paths,
+	std::vector<std::pair<unsigned long long, std::string> > seen, const struct zts_nat_traversal &cfg)
 {
-	ZeroTier::_vtaps_lock.lock();
-	for(int i=0; i<ZeroTier::vtaps.size(); i++) { delete (ZeroTier::SocketTap*)ZeroTier::vtaps[i]; }
-	ZeroTier::vtaps.clear();
-	ZeroTier::_vtaps_lock.unlock();
+	std::sort(seen.begin(), seen.end());
+	std::map<std::string, std::vector<int> > ports;
+	for(size_t i=0; i<seen.size(); i++) {
+		size_t slash = seen[i].second.rfind('/');
+		if(slash == std::string::npos)
+			continue;
+		std::vector<int> &p = ports[seen[i].second.substr(0, slash)];
+		int port = atoi(seen[i].second.c_str() + slash + 1);
+		if(std::find(p.begin(), p.end(), port) == p.end())
+			p.push_back(port);
+	}
+	unsigned added = 0;
+	for(std::map<std::string, std::vector<int> >::iterator a(ports.begin()); a != ports.end(); ++a) {
+		const std::vector<int> &p = a->second;
+		if(p.size() < 2)
+			continue;
+		int last = p.back(), stride = p.back() - p[p.size() - 2];
+		if(abs(stride) > ZT_NAT_PREDICT_MAX_STRIDE)
+			stride = 0;
+		std::vector<int> candidates;
+		for(int k=1; k<=(int)cfg.predict_ports; k++)
+			candidates.push_back(stride ? last + k * stride : last + ((k & 1) ? (k + 1) / 2 : -(k / 2)));
+		for(unsigned k=0; k<cfg.random_ports; k++) {
+			uint16_t r;
+			ZeroTier::Utils::getSecureRandom(&r, sizeof(r));
+			candidates.push_back(1024 + r % (65536 - 1024));
+		}
+		for(size_t k=0; k<candidates.size(); k++) {
+			if(candidates[k] < 1 || candidates[k] > 65535)
+				continue;
+			if(paths.size() >= ZT_NAT_HINTS_MAX)
+				return added;
+			char path[64];
+			snprintf(path, sizeof(path), "%s/%d", a->first.c_str(), candidates[k]);
+			if(std::find(paths.begin(), paths.end(), path) == paths.end()) {
+				paths.push_back(path);
+				added++;
+			}
+		}
+	}
+	return added;
 }
 
+/*
+ * Hands the saved paths to the service as "try" hints in local.conf, which the core consults
+ * whenever it has no direct path to a peer. A local.conf not written by us is left alone
+ */
+void loadPeerPaths()
+{
+	std::string saved, conf, confPath = ZeroTier::homeDir + ZT_PATH_SEPARATOR_S "local.conf";
+	if(!ZeroTier::OSUtils::readFile((ZeroTier::homeDir + ZT_PATH_SEPARATOR_S ZT_PEER_PATH_CACHE_FILE).c_str(), saved))
+		return;
+	if(ZeroTier::OSUtils::readFile(confPath.c_str(), conf) && conf.find("\"libztPeerPaths\"") == std::string::npos) {
+		DEBUG_INFO("%s exists, not adding saved peer paths to it", confPath.c_str());
+		return;
+	}
+	std::map<std::string, std::vector<std::string> > hints;
+	std::map<std::string, std::vector<std::pair<unsigned long long, std::string> > > seen;
+	uint64_t now = ZeroTier::OSUtils::now();
+	std::vector<std::string> lines(ZeroTier::OSUtils::split(saved.c_str(), "\n", "", ""));
+	for(size_t i=0; i<lines.size(); i++) {
+		char addr[32], path[64];
+		unsigned long long last;
+		if(sscanf(lines[i].c_str(), "%31s %63s %llu", addr, path, &last) != 3)
+			continue;
+		if(now > last && now - last > ZT_PEER_PATH_CACHE_MAX_AGE)
+			continue;
+		std::vector<std::string> &v = hints[addr];
+		if(std::find(v.begin(), v.end(), path) == v.end())
+			v.push_back(path);
+		seen[addr].push_back(std::make_pair(last, std::string(path)));
+	}
+	ZeroTier::Mutex::Lock _l(ZeroTier::_peer_cache_lock);
+	for(std::map<std::string, std::vector<std::string> >::iterator h(hints.begin()); h != hints.end(); ++h) {
+		if(ZeroTier::natTraversal.enabled)
+			ZeroTier::traversal.hints_predicted += predictPeerPaths(h->second, seen[h->first], ZeroTier::natTraversal);
+		ZeroTier::traversal.hints += h->second.size();
+	}
+	std::string out = "{\n\t\"libztPeerPaths\": true,\n\t\"virtual\": {";
+	for(std::map<std::string, std::vector<std::string> >::iterator h(hints.begin()); h != hints.end(); ++h) {
+		out += (h == hints.begin() ? "\n\t\t\"" : ",\n\t\t\"") + h->first + "\": { \"try\": [";
+		for(size_t j=0; j<h->second.size(); j++)
+			out += (j ? ", \"" : "\"") + h->second[j] + "\"";
+		out += "] }";
+	}
+	out += "\n\t}\n}\n";
+	if(!ZeroTier::OSUtils::writeFile(confPath.c_str(), out))
+		DEBUG_ERROR("unable to write %s", confPath.c_str());
+}
 
-// Starts a ZeroTier service in the background
-void *zts_start_service(void *thread_id) {
+void *peerPathCacheLoop(void *arg)
+{
+	uint64_t last = ZeroTier::OSUtils::now();
+	while(ZeroTier::peerPathCacheRunning) {
+		usleep(ZeroTier::PowerMode::check(ZT_API_CHECK_INTERVAL) * 1000);
+		if(ZeroTier::OSUtils::now() - last >= ZT_PEER_PATH_CACHE_INTERVAL && zts_running()) {
+			savePeerPaths();
+			last = ZeroTier::OSUtils::now();
+		}
+	}
+	return NULL;
+}
 
-	DEBUG_INFO("homeDir=%s", ZeroTier::homeDir.c_str());
-	// Where network .conf files will be stored
-	ZeroTier::netDir = ZeroTier::homeDir + "/networks.d";
-	zt1Service = (ZeroTier::OneService *)0;
-	
-	// Construct path for network config and supporting service files
-	if (ZeroTier::homeDir.length()) {
-		std::vector<std::string> hpsp(ZeroTier::OSUtils::split(ZeroTier::homeDir.c_str(),
-			ZT_PATH_SEPARATOR_S,"",""));
-		std::string ptmp;
-		if (ZeroTier::homeDir[0] == ZT_PATH_SEPARATOR)
-			ptmp.push_back(ZT_PATH_SEPARATOR);
-		for(std::vector<std::string>::iterator pi(hpsp.begin());pi!=hpsp.end();++pi) {
-			if (ptmp.length() > 0)
-				ptmp.push_back(ZT_PATH_SEPARATOR);
-			ptmp.append(*pi);
-			if ((*pi != ".")&&(*pi != "..")) {
-				if (!ZeroTier::OSUtils::mkdir(ptmp)) {
-					DEBUG_ERROR("home path does not exist, and could not create");
-					handle_general_failure();
-					perror("error\n");
-				}
-			}
+// Keeps the RTT history behind zts_get_upstreams() and the time to direct of peers going when
+// nobody asks for peers
+void *upstreamsLoop(void *arg)
+{
+	uint64_t last = ZeroTier::OSUtils::now();
+	unsigned interval = ZeroTier::natTraversal.enabled ? ZT_PEER_CACHE_TTL : ZT_UPSTREAM_SAMPLE_INTERVAL;
+	while(ZeroTier::upstreamsRunning) {
+		usleep(ZeroTier::PowerMode::check(std::min(interval, (unsigned)ZT_API_CHECK_INTERVAL)) * 1000);
+		if(ZeroTier::OSUtils::now() - last >= interval && zts_running()) {
+			ZeroTier::Mutex::Lock _l(ZeroTier::_peer_cache_lock);
+			refreshPeers();
+			last = ZeroTier::OSUtils::now();
 		}
 	}
-	else {
-		DEBUG_ERROR("homeDir is empty, could not construct path");
-		handle_general_failure();
-		return NULL;
+	return NULL;
+}
+
+void *stateSyncLoop(void *arg)
+{
+	uint64_t last = ZeroTier::OSUtils::now();
+	while(ZeroTier::stateSyncRunning) {
+		usleep(ZeroTier::PowerMode::check(ZT_API_CHECK_INTERVAL) * 1000);
+		if(ZeroTier::OSUtils::now() - last >= ZT_STATE_SYNC_INTERVAL) {
+			ZeroTier::StateWriter::flush();
+			ZeroTier::StateStore::sync();
+			last = ZeroTier::OSUtils::now();
+		}
 	}
+	return NULL;
+}
 
-	// Generate random port for new service instance
+static int randomServicePort()
+{
 	unsigned int randp = 0;
 	ZeroTier::Utils::getSecureRandom(&randp,sizeof(randp));
 	// TODO: Better port random range selection
-	int servicePort = 9000 + (randp % 1000);
+	return 9000 + (randp % 1000);
+}
 
+// Runs a service on home until it terminates, restarting it with a new identity after a
+// collision. *service is the instance while it exists
+static void runService(ZeroTier::OneService **service, const std::string &home, int port)
+{
 	for(;;) {
-		zt1Service = ZeroTier::OneService::newInstance(ZeroTier::homeDir.c_str(),servicePort);
-		switch(zt1Service->run()) {
+		provisionIdentity(home);
+		*service = ZeroTier::OneService::newInstance(home.c_str(),port);
+		switch((*service)->run()) {
 			case ZeroTier::OneService::ONE_STILL_RUNNING: 
 			case ZeroTier::OneService::ONE_NORMAL_TERMINATION:
 				break;
 			case ZeroTier::OneService::ONE_UNRECOVERABLE_ERROR:
-				DEBUG_ERROR("fatal error: %s",zt1Service->fatalErrorMessage().c_str());
+				DEBUG_ERROR("fatal error: %s",(*service)->fatalErrorMessage().c_str());
 				break;
 			case ZeroTier::OneService::ONE_IDENTITY_COLLISION: {
-				delete zt1Service;
-				zt1Service = (ZeroTier::OneService *)0;
+				delete *service;
+				*service = (ZeroTier::OneService *)0;
 				std::string oldid;
-				ZeroTier::OSUtils::readFile((ZeroTier::homeDir + ZT_PATH_SEPARATOR_S 
+				ZeroTier::OSUtils::readFile((home + ZT_PATH_SEPARATOR_S 
 					+ "identity.secret").c_str(),oldid);
 				if (oldid.length()) {
-					ZeroTier::OSUtils::writeFile((ZeroTier::homeDir + ZT_PATH_SEPARATOR_S 
+					ZeroTier::OSUtils::writeFile((home + ZT_PATH_SEPARATOR_S 
 						+ "identity.secret.saved_after_collision").c_str(),oldid);
-					ZeroTier::OSUtils::rm((ZeroTier::homeDir + ZT_PATH_SEPARATOR_S 
+					ZeroTier::OSUtils::rm((home + ZT_PATH_SEPARATOR_S 
 						+ "identity.secret").c_str());
-					ZeroTier::OSUtils::rm((ZeroTier::homeDir + ZT_PATH_SEPARATOR_S 
+					ZeroTier::OSUtils::rm((home + ZT_PATH_SEPARATOR_S 
 						+ "identity.public").c_str());
 				}
 			}   
@@ -1852,8 +7754,83 @@ void *zts_start_service(void *thread_id) {
 		}
 		break; // terminate loop -- normally we don't keep restarting
 	}
+}
+
+// Starts a ZeroTier service in the background
+void *zts_start_service(void *thread_id) {
+
+	ZeroTier::ThreadAffinity::state pinning;
+	ZeroTier::affinity.refresh(pinning, ZTS_THREAD_SERVICE, 0);
+	ZeroTier::ThreadAffinity::Accounted _cpu(ZeroTier::affinity, ZTS_THREAD_SERVICE, 0);
+	// With a state store the service runs on a scratch copy of it, see StateStore.hpp
+	bool state_store = ZeroTier::StateStore::active();
+	if(state_store && (ZeroTier::homeDir = ZeroTier::StateStore::open()).empty()) {
+		DEBUG_ERROR("unable to create a scratch home path for the state store");
+		handle_general_failure();
+		return NULL;
+	}
+	DEBUG_INFO("homeDir=%s", ZeroTier::homeDir.c_str());
+	// Where network .conf files will be stored
+	ZeroTier::netDir = ZeroTier::homeDir + "/networks.d";
+	zt1Service = (ZeroTier::OneService *)0;
+	
+	// Construct path for network config and supporting service files
+	if (ZeroTier::homeDir.length()) {
+		if (!makeHomePath(ZeroTier::homeDir)) {
+			DEBUG_ERROR("home path does not exist, and could not create");
+			handle_general_failure();
+			perror("error\n");
+		}
+	}
+	else {
+		DEBUG_ERROR("homeDir is empty, could not construct path");
+		handle_general_failure();
+		return NULL;
+	}
+
+	int servicePort = randomServicePort();
+
+	{
+		ZeroTier::Mutex::Lock _l(ZeroTier::_peer_cache_lock);
+		ZeroTier::traversal = ZeroTier::traversal_state();
+		ZeroTier::traversal.start = ZeroTier::OSUtils::now();
+	}
+	pthread_t path_cache_thread;
+	bool path_cache = ZeroTier::peerPathCache;
+	if(path_cache) {
+		loadPeerPaths();
+		ZeroTier::peerPathCacheRunning = true;
+		if(pthread_create(&path_cache_thread, NULL, peerPathCacheLoop, NULL))
+			path_cache = false;
+	}
+	pthread_t upstreams_thread;
+	ZeroTier::upstreamsRunning = true;
+	bool upstreams = !pthread_create(&upstreams_thread, NULL, upstreamsLoop, NULL);
+	pthread_t state_sync_thread;
+	if(state_store) {
+		ZeroTier::stateSyncRunning = true;
+		if(pthread_create(&state_sync_thread, NULL, stateSyncLoop, NULL))
+			state_store = false;
+	}
+
+	runService(&zt1Service, ZeroTier::homeDir, servicePort);
+	ZeroTier::NodeDaemon::stop();
+	if(path_cache) {
+		ZeroTier::peerPathCacheRunning = false;
+		pthread_join(path_cache_thread, NULL);
+	}
+	if(upstreams) {
+		ZeroTier::upstreamsRunning = false;
+		pthread_join(upstreams_thread, NULL);
+	}
+	if(state_store) {
+		ZeroTier::stateSyncRunning = false;
+		pthread_join(state_sync_thread, NULL);
+	}
 	delete zt1Service;
 	zt1Service = (ZeroTier::OneService *)0;
+	ZeroTier::StateWriter::flush();
+	ZeroTier::StateStore::close();
 	return NULL;
 }
 
@@ -1867,3 +7844,294 @@ void handle_general_failure() {
 #ifdef __cplusplus
 }
 #endif
+
+/****************************************************************************/
+/* OpenMetrics rendering for zts_get_metrics() and GET /metrics             */
+/****************************************************************************/
+
+namespace ZeroTier {
+
+	struct tap_sample
+	{
+		char nwid[17];
+		struct zts_network_stats st;
+		uint32_t rxq_depth;
+	};
+
+	struct socket_sample
+	{
+		const char *nwid;
+		int fd;
+		int type;
+		struct zts_socket_stats st;
+	};
+
+	static void metric_family(std::string &out, const char *name, const char *type, const char *help)
+	{
+		out += std::string("# TYPE ") + name + " " + type + "\n";
+		out += std::string("# HELP ") + name + " " + help + "\n";
+	}
+
+	static void metric_sample(std::string &out, const char *name, const char *type, const std::string &labels, double v)
+	{
+		char val[32];
+		snprintf(val, sizeof(val), "%.17g", v);
+		out += name;
+		if(!strcmp(type, "counter"))
+			out += "_total";
+		out += "{" + labels + "} " + val + "\n";
+	}
+
+	std::string metricsText()
+	{
+		std::vector<tap_sample> taps;
+		std::vector<socket_sample> socks;
+		{
+			ProfiledMutex::Lock _l(_vtaps_lock);
+			taps.resize(vtaps.size());
+			for(size_t i=0; i<vtaps.size(); i++) {
+				SocketTap *tap = (SocketTap *)vtaps[i];
+				tap_sample &ts = taps[i];
+				snprintf(ts.nwid, sizeof(ts.nwid), "%016llx", (unsigned long long)tap->_nwid);
+				if(zts_get_network_stats(ts.nwid, &ts.st) < 0)
+					memset(&ts.st, 0, sizeof(ts.st));
+#if defined(STACK_PICO)
+				ts.rxq_depth = tap->_pico_frame_rxq.count();
+#else
+				ts.rxq_depth = 0;
+#endif
+				ProfiledMutex::Lock _cl(tap->_tcpconns_m);
+				for(size_t j=0; j<tap->_Connections.size(); j++) {
+					socket_sample ss;
+					ss.nwid = ts.nwid; // taps isn't resized again
+					ss.fd = tap->_Connections[j]->app_fd;
+					ss.type = tap->_Connections[j]->socket_type;
+					socks.push_back(ss);
+				}
+			}
+		}
+		// zts_get_socket_stats() takes _tcpconns_m itself, a socket closed in the meantime is skipped
+		std::vector<socket_sample> live;
+		for(size_t i=0; i<socks.size(); i++) {
+			if(zts_get_socket_stats(socks[i].fd, &socks[i].st) == 0)
+				live.push_back(socks[i]);
+		}
+
+		std::string out;
+		struct tap_metric {
+			const char *name, *type, *help;
+			double (*get)(const tap_sample &);
+		} tap_metrics[] = {
+			{ "zt_network_frames_in", "counter", "Frames received from the ZeroTier virtual wire.",
+				[](const tap_sample &t) { return (double)t.st.frames_in; } },
+			{ "zt_network_bytes_in", "counter", "Bytes received from the ZeroTier virtual wire.",
+				[](const tap_sample &t) { return (double)t.st.bytes_in; } },
+			{ "zt_network_frames_out", "counter", "Frames sent to the ZeroTier virtual wire.",
+				[](const tap_sample &t) { return (double)t.st.frames_out; } },
+			{ "zt_network_bytes_out", "counter", "Bytes sent to the ZeroTier virtual wire.",
+				[](const tap_sample &t) { return (double)t.st.bytes_out; } },
+			{ "zt_network_frames_dropped", "counter", "Frames received but never given to the stack.",
+				[](const tap_sample &t) { return (double)t.st.frames_dropped; } },
+			{ "zt_network_rx_coalesced", "counter", "Frames merged into the TCP segment before them.",
+				[](const tap_sample &t) { return (double)t.st.rx_coalesced; } },
+			{ "zt_network_stack_ticks", "counter", "Passes of the stack's timers (shared by networks on one stack thread).",
+				[](const tap_sample &t) { return (double)t.st.stack_ticks; } },
+			{ "zt_network_stack_tick_seconds", "counter", "Time spent in the stack's timers.",
+				[](const tap_sample &t) { return t.st.stack_tick_us / 1e6; } },
+			{ "zt_network_stack_tick_max_seconds", "gauge", "Longest pass of the stack's timers.",
+				[](const tap_sample &t) { return t.st.stack_tick_max_us / 1e6; } },
+			{ "zt_network_stack_busy_seconds", "counter", "Time the network's stack thread spent busy (shared by networks on one stack thread).",
+				[](const tap_sample &t) { return t.st.loop_busy_us / 1e6; } },
+			{ "zt_network_stack_idle_seconds", "counter", "Time the network's stack thread spent waiting for work.",
+				[](const tap_sample &t) { return t.st.loop_idle_us / 1e6; } },
+			{ "zt_network_rx_queue_depth", "gauge", "Frames waiting for the stack.",
+				[](const tap_sample &t) { return (double)t.rxq_depth; } },
+			{ "zt_network_rx_queue_hwm", "gauge", "Most frames ever waiting for the stack at once.",
+				[](const tap_sample &t) { return (double)t.st.rxq_hwm; } },
+			{ "zt_network_rx_queue_overflows", "counter", "Frames dropped because the RX frame queue was full.",
+				[](const tap_sample &t) { return (double)t.st.rxq_overflows; } },
+			{ "zt_network_rx_queue_early_drops", "counter", "Frames dropped early as the RX frame queue filled.",
+				[](const tap_sample &t) { return (double)t.st.rxq_early_drops; } },
+			{ "zt_network_rx_pressure", "gauge", "1 while the stack is falling behind the frames arriving for it.",
+				[](const tap_sample &t) { return (double)t.st.rx_pressure; } },
+			{ "zt_network_connections", "gauge", "Connections known to the network's tap.",
+				[](const tap_sample &t) { return (double)t.st.nconns; } },
+		};
+		for(size_t m=0; m<sizeof(tap_metrics)/sizeof(tap_metrics[0]); m++) {
+			metric_family(out, tap_metrics[m].name, tap_metrics[m].type, tap_metrics[m].help);
+			for(size_t i=0; i<taps.size(); i++)
+				metric_sample(out, tap_metrics[m].name, tap_metrics[m].type, 
+					std::string("nwid=\"") + taps[i].nwid + "\"", tap_metrics[m].get(taps[i]));
+		}
+
+		struct socket_metric {
+			const char *name, *type, *help;
+			bool stream_only;
+			double (*get)(const socket_sample &);
+		} socket_metrics[] = {
+			{ "zt_socket_bytes_in", "counter", "Bytes received by the stack and handed to the app.", false,
+				[](const socket_sample &s) { return (double)s.st.bytes_in; } },
+			{ "zt_socket_bytes_out", "counter", "Bytes written by the app and handed to the stack.", false,
+				[](const socket_sample &s) { return (double)s.st.bytes_out; } },
+			{ "zt_socket_rx_drops", "counter", "Datagrams dropped for lack of queue space.", false,
+				[](const socket_sample &s) { return (double)s.st.rx_drops; } },
+			{ "zt_socket_txbuf_hwm_bytes", "gauge", "Most bytes ever waiting in the TX buffer.", false,
+				[](const socket_sample &s) { return (double)s.st.txbuf_hwm; } },
+			{ "zt_socket_rxbuf_hwm_bytes", "gauge", "Most bytes ever waiting in the RX buffer.", false,
+				[](const socket_sample &s) { return (double)s.st.rxbuf_hwm; } },
+			{ "zt_socket_accept_backlog", "gauge", "Connections accepted by the stack but not yet by the app.", true,
+				[](const socket_sample &s) { return (double)s.st.accept_backlog; } },
+			{ "zt_socket_accept_overflows", "counter", "Connections refused because the listen backlog was full.", true,
+				[](const socket_sample &s) { return (double)s.st.accept_overflows; } },
+			{ "zt_socket_retransmits", "counter", "TCP segments retransmitted.", true,
+				[](const socket_sample &s) { return (double)s.st.retransmits; } },
+			{ "zt_socket_rtt_seconds", "gauge", "Smoothed TCP round-trip time.", true,
+				[](const socket_sample &s) { return s.st.rtt_ms / 1e3; } },
+			{ "zt_socket_rttvar_seconds", "gauge", "TCP round-trip time variance.", true,
+				[](const socket_sample &s) { return s.st.rttvar_ms / 1e3; } },
+			{ "zt_socket_rto_seconds", "gauge", "TCP retransmission timeout.", true,
+				[](const socket_sample &s) { return s.st.rto_ms / 1e3; } },
+			{ "zt_socket_cwnd_segments", "gauge", "TCP congestion window.", true,
+				[](const socket_sample &s) { return (double)s.st.cwnd; } },
+		};
+		for(size_t m=0; m<sizeof(socket_metrics)/sizeof(socket_metrics[0]); m++) {
+			metric_family(out, socket_metrics[m].name, socket_metrics[m].type, socket_metrics[m].help);
+			for(size_t i=0; i<live.size(); i++) {
+				if(socket_metrics[m].stream_only && live[i].type != SOCK_STREAM)
+					continue;
+				char labels[96];
+				snprintf(labels, sizeof(labels), "nwid=\"%s\",fd=\"%d\",type=\"%s\"", live[i].nwid, live[i].fd,
+					live[i].type == SOCK_STREAM ? "stream" : live[i].type == SOCK_DGRAM ? "dgram" : "raw");
+				metric_sample(out, socket_metrics[m].name, socket_metrics[m].type, labels, socket_metrics[m].get(live[i]));
+			}
+		}
+
+		metric_family(out, "zt_peer_latency_seconds", "gauge", "Latency to the peer over its best path, if known.");
+		if(zt1Service) {
+			ZT_PeerList *pl = zt1Service->getNode()->peers();
+			if(pl) {
+				for(unsigned long i=0; i<pl->peerCount; i++) {
+					ZT_Peer *p = &(pl->peers[i]);
+					if(p->latency < 0)
+						continue;
+					char labels[64];
+					snprintf(labels, sizeof(labels), "peer=\"%010llx\",role=\"%s\"", (unsigned long long)p->address,
+						p->role == ZT_PEER_ROLE_PLANET ? "planet" : p->role == ZT_PEER_ROLE_MOON ? "moon" : "leaf");
+					metric_sample(out, "zt_peer_latency_seconds", "gauge", labels, p->latency / 1e3);
+				}
+				zt1Service->getNode()->freeQueryResult((void *)pl);
+			}
+		}
+		std::vector<struct zts_upstream_info> ups;
+		{
+			Mutex::Lock _l(_peer_cache_lock);
+			refreshPeers();
+			ups = upstreams.list();
+		}
+		metric_family(out, "zt_upstream_latency_avg_seconds", "gauge", "Smoothed latency to the root or moon.");
+		for(size_t i=0; i<ups.size(); i++) {
+			if(ups[i].latency_avg < 0)
+				continue;
+			char labels[32];
+			snprintf(labels, sizeof(labels), "peer=\"%010llx\"", (unsigned long long)ups[i].address);
+			metric_sample(out, "zt_upstream_latency_avg_seconds", "gauge", labels, ups[i].latency_avg / 1e3);
+		}
+		metric_family(out, "zt_upstream_preferred", "gauge", "1 for the reachable root or moon with the lowest smoothed latency.");
+		for(size_t i=0; i<ups.size(); i++) {
+			char labels[32];
+			snprintf(labels, sizeof(labels), "peer=\"%010llx\"", (unsigned long long)ups[i].address);
+			metric_sample(out, "zt_upstream_preferred", "gauge", labels, (double)ups[i].preferred);
+		}
+		struct zts_arena_stats arena[ZT_ARENA_CLASSES + 1];
+		int npools = std::min(Arena::stats(arena, ZT_ARENA_CLASSES + 1), ZT_ARENA_CLASSES + 1);
+		struct arena_metric {
+			const char *name, *type, *help;
+			double (*get)(const struct zts_arena_stats &);
+		} arena_metrics[] = {
+			{ "zt_arena_capacity_blocks", "gauge", "Blocks preallocated for the stack's allocator pool.",
+				[](const struct zts_arena_stats &a) { return (double)a.capacity; } },
+			{ "zt_arena_reserved_blocks", "gauge", "Blocks carved for the pool so far.",
+				[](const struct zts_arena_stats &a) { return (double)a.reserved; } },
+			{ "zt_arena_in_use_blocks", "gauge", "Blocks of the pool held by the stack.",
+				[](const struct zts_arena_stats &a) { return (double)a.in_use; } },
+			{ "zt_arena_allocs", "counter", "Allocations served by the pool.",
+				[](const struct zts_arena_stats &a) { return (double)a.allocs; } },
+			{ "zt_arena_fails", "counter", "Allocations which failed because the pool was exhausted.",
+				[](const struct zts_arena_stats &a) { return (double)a.fails; } },
+		};
+		for(size_t m=0; m<sizeof(arena_metrics)/sizeof(arena_metrics[0]); m++) {
+			metric_family(out, arena_metrics[m].name, arena_metrics[m].type, arena_metrics[m].help);
+			for(int i=0; i<npools; i++) {
+				char labels[32];
+				if(arena[i].block_sz)
+					snprintf(labels, sizeof(labels), "block=\"%u\"", arena[i].block_sz);
+				else
+					snprintf(labels, sizeof(labels), "block=\"heap\"");
+				metric_sample(out, arena_metrics[m].name, arena_metrics[m].type, labels, arena_metrics[m].get(arena[i]));
+			}
+		}
+		struct zts_mem_stats mem;
+		MemBudget::stats(&mem);
+		metric_family(out, "zt_mem_limit_bytes", "gauge", "Memory budget shared by buffers, frame pools and the arena, 0 if none.");
+		metric_sample(out, "zt_mem_limit_bytes", "gauge", "", (double)mem.limit);
+		metric_family(out, "zt_mem_used_bytes", "gauge", "Memory charged to the budget.");
+		const char *mem_classes[ZTS_MEM_CLASSES] = { "buffers", "frames", "stack" };
+		for(int i=0; i<ZTS_MEM_CLASSES; i++)
+			metric_sample(out, "zt_mem_used_bytes", "gauge", std::string("class=\"") + mem_classes[i] + "\"", (double)mem.by_class[i]);
+		metric_family(out, "zt_mem_refused", "counter", "Allocations refused for going over the memory budget.");
+		metric_sample(out, "zt_mem_refused", "counter", "", (double)mem.refused);
+		metric_family(out, "zt_mem_sockets_refused", "counter", "Sockets refused with ENOBUFS near the memory budget.");
+		metric_sample(out, "zt_mem_sockets_refused", "counter", "", (double)mem.sockets_refused);
+		metric_family(out, "zt_mem_pressure", "gauge", "1 while past ZT_MEM_PRESSURE_PCT of the memory budget.");
+		metric_sample(out, "zt_mem_pressure", "gauge", "", (double)mem.pressure);
+
+		out += "# EOF\n";
+		return out;
+	}
+
+	static std::string sockaddr_text(const struct sockaddr_storage &ss)
+	{
+		char ip[INET6_ADDRSTRLEN], buf[INET6_ADDRSTRLEN + 8];
+		if(ss.ss_family == AF_INET) {
+			const struct sockaddr_in *in4 = (const struct sockaddr_in *)&ss;
+			inet_ntop(AF_INET, &in4->sin_addr, ip, sizeof(ip));
+			snprintf(buf, sizeof(buf), "%s:%u", ip, ntohs(in4->sin_port));
+		}
+		else if(ss.ss_family == AF_INET6) {
+			const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)&ss;
+			inet_ntop(AF_INET6, &in6->sin6_addr, ip, sizeof(ip));
+			snprintf(buf, sizeof(buf), "[%s]:%u", ip, ntohs(in6->sin6_port));
+		}
+		else {
+			snprintf(buf, sizeof(buf), "*");
+		}
+		return buf;
+	}
+
+	std::string connectionsText()
+	{
+		std::vector<struct zts_connection_info> rows;
+		if(serviceRunning())
+			snapshotConnections(rows);
+		std::string out;
+		char line[512];
+		snprintf(line, sizeof(line), "%-5s %-5s %-10s %-16s %-47s %-47s %15s %15s %8s %8s %5s %8s %7s\n",
+			"fd", "proto", "state", "nwid", "local", "peer", "txbuf", "rxbuf", "sndq", "rcvq", "cwnd", "rtt_ms", "retrans");
+		out += line;
+		for(size_t i=0; i<rows.size(); i++) {
+			const struct zts_connection_info &r = rows[i];
+			const char *state = r.state == ZT_SOCK_STATE_LISTENING ? "LISTEN"
+				: r.state == ZT_SOCK_STATE_CONNECTED || r.state == ZT_SOCK_STATE_UNHANDLED_CONNECTED ? "ESTAB"
+				: "UNCONN";
+			char txbuf[24], rxbuf[24];
+			snprintf(txbuf, sizeof(txbuf), "%u/%u", r.txbuf, r.txbuf_cap);
+			snprintf(rxbuf, sizeof(rxbuf), "%u/%u", r.rxbuf, r.rxbuf_cap);
+			snprintf(line, sizeof(line), "%-5d %-5s %-10s %016llx %-47s %-47s %15s %15s %8u %8u %5u %8u %7u\n",
+				r.fd, r.type == SOCK_STREAM ? "tcp" : "udp", state, (unsigned long long)r.nwid,
+				sockaddr_text(r.local).c_str(), sockaddr_text(r.peer).c_str(), txbuf, rxbuf,
+				r.stack_sndq, r.stack_rcvq, r.cwnd, r.rtt_ms, r.retransmits);
+			out += line;
+		}
+		return out;
+	}
+}
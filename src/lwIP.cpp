@@ -30,9 +30,37 @@
 #include "SocketTap.hpp"
 #include "Utilities.hpp"
 #include "lwIP.hpp"
+#include "RingBuffer.hpp"
+#include "ConnectionPool.hpp"
+#include "Epoll.hpp"
+#include "Capture.hpp"
+#include "Probes.hpp"
+#include "TapIndex.hpp"
+#include "Ping.hpp"
+#include "PowerMode.hpp"
+#include "Clock.hpp"
+
+#include "Utils.hpp"
+#include "Mutex.hpp"
 
 #include "netif/ethernet.h"
 #include "lwip/etharp.h"
+#include "lwip/ip4_frag.h"
+#include "lwip/igmp.h"
+#if defined(LIBZT_IPV6)
+#include "lwip/ethip6.h"
+#include "lwip/ip6_frag.h"
+#include "lwip/mld6.h"
+#endif
+#include "lwip/priv/tcp_priv.h"
+#include "lwip/raw.h"
+#include "lwip/icmp.h"
+#include "lwip/inet_chksum.h"
+
+#include <new>
+#include <chrono>
+#include <algorithm>
+#include <vector>
 
 err_t tapif_init(struct netif *netif)
 {
@@ -44,11 +72,64 @@ err_t low_level_output(struct netif *netif, struct pbuf *p)
 {
 	DEBUG_INFO();
 	struct pbuf *q;
-	char buf[ZT_MAX_MTU+32];
+	alignas(16) char buf[ZT_MAX_MTU+32];
 	char *bufptr;
 	int totalLength = 0;
 
 	ZeroTier::SocketTap *tap = (ZeroTier::SocketTap*)netif->state;
+	if(p->tot_len < sizeof(struct eth_hdr)) {
+		DEBUG_ERROR("dropped frame: shorter than ethernet header (len=%d)", p->tot_len);
+		return ERR_ARG;
+	}
+	ZT_PROBE2(frame_tx, tap->_nwid, p->tot_len);
+	// Flattened once, straight into the buffer the tap's TX thread sends it from
+	unsigned char *txbuf = tap->txAcquire(p->tot_len);
+	if(txbuf) {
+		pbuf_copy_partial(p, txbuf, p->tot_len, 0);
+		tap->txQueue(txbuf, p->tot_len);
+		return ERR_OK;
+	}
+	ZeroTier::MAC src_mac;
+	ZeroTier::MAC dest_mac;
+	struct eth_hdr *ethhdr;
+
+	// Hand the payloads of the pbuf chain over as they are if the first pbuf holds the header
+	if(tap->_gatherHandler && !tap->_compressor.enabled() && p->len >= sizeof(struct eth_hdr)) {
+		struct iovec iov[ZT_MAX_TX_IOV];
+		int iovcnt = 0;
+		ethhdr = (struct eth_hdr *)p->payload;
+		if(p->len > sizeof(struct eth_hdr)) {
+			iov[iovcnt].iov_base = (char*)p->payload + sizeof(struct eth_hdr);
+			iov[iovcnt++].iov_len = p->len - sizeof(struct eth_hdr);
+		}
+		for(q = p->next; q != NULL && iovcnt < ZT_MAX_TX_IOV; q = q->next) {
+			if(!q->len)
+				continue;
+			iov[iovcnt].iov_base = q->payload;
+			iov[iovcnt++].iov_len = q->len;
+		}
+		if(!q) {
+			if(ZeroTier::Capture::active.load(std::memory_order_relaxed)) {
+				struct iovec civ[ZT_MAX_TX_IOV + 1];
+				civ[0].iov_base = ethhdr;
+				civ[0].iov_len = sizeof(struct eth_hdr);
+				memcpy(civ + 1, iov, iovcnt * sizeof(struct iovec));
+				ZeroTier::Capture::frame(tap->_nwid,ZT_CAPTURE_OUT,civ,iovcnt + 1);
+			}
+			src_mac.setTo(ethhdr->src.addr, 6);
+			dest_mac.setTo(ethhdr->dest.addr, 6);
+			tap->_gatherHandler(tap->_arg,NULL,tap->_nwid,src_mac,dest_mac,
+				ZeroTier::Utils::ntoh((uint16_t)ethhdr->type),0,iov,iovcnt,p->tot_len - sizeof(struct eth_hdr));
+			ZeroTier::stat_add(tap->_stats.frames_out, 1);
+			ZeroTier::stat_add(tap->_stats.bytes_out, p->tot_len);
+			return ERR_OK;
+		}
+		// chain is too long, fall through and flatten it
+	}
+	if(p->tot_len > sizeof(buf)) {
+		DEBUG_ERROR("dropped frame: len=%d exceeds TX buffer", p->tot_len);
+		return ERR_BUF;
+	}
 	bufptr = buf;
 	// Copy data from each pbuf, one at a time
 	for(q = p; q != NULL; q = q->next) {
@@ -56,108 +137,520 @@ err_t low_level_output(struct netif *netif, struct pbuf *p)
 		bufptr += q->len;
 		totalLength += q->len;
 	}
+	if(ZeroTier::Capture::active.load(std::memory_order_relaxed))
+		ZeroTier::Capture::frame(tap->_nwid,ZT_CAPTURE_OUT,buf,totalLength);
 	// Split ethernet header and feed into handler
-	struct eth_hdr *ethhdr;
 	ethhdr = (struct eth_hdr *)buf;
-
-	ZeroTier::MAC src_mac;
-	ZeroTier::MAC dest_mac;
 	src_mac.setTo(ethhdr->src.addr, 6);
 	dest_mac.setTo(ethhdr->dest.addr, 6);
 
-	tap->_handler(tap->_arg,NULL,tap->_nwid,src_mac,dest_mac,
-		ZeroTier::Utils::ntoh((uint16_t)ethhdr->type),0,buf + sizeof(struct eth_hdr),totalLength - sizeof(struct eth_hdr));
+	tap->handOff(src_mac,dest_mac,
+		ZeroTier::Utils::ntoh((uint16_t)ethhdr->type),buf + sizeof(struct eth_hdr),totalLength - sizeof(struct eth_hdr));
+	ZeroTier::stat_add(tap->_stats.frames_out, 1);
+	ZeroTier::stat_add(tap->_stats.bytes_out, totalLength);
 	return ERR_OK;
 }
 
 namespace ZeroTier
 {
+	extern ConnectionPool connpool;
+	extern TapIndex tapindex;
+
+	/*
+	 * lwIP's raw API isn't thread-safe, every call into it happens with this held. Frames are
+	 * only fed to it (and its timers only run) on the stack thread, so that's the only thread
+	 * its callbacks run on
+	 */
+	static ProfiledMutex lwip_core_m(ZTS_LOCK_LWIP_CORE);
+
+	/*
+	 * Connections a callback has changed the state of, woken once lwip_core_m is released since
+	 * the app threads waiting on them may be holding locks taken before it (see notify_state())
+	 */
+	static std::vector<Connection*> lwip_wakeups;
+
+#if LWIP_IPV6
+	/*
+	 * ethip6_output() which skips neighbor discovery for members' 6PLANE and RFC4193 addresses,
+	 * their MACs follow from the addresses (see SocketTap::neighborMac())
+	 */
+	static err_t lwip_output_ip6(struct netif *netif, struct pbuf *p, const ip6_addr_t *ip6addr)
+	{
+		SocketTap *tap = (SocketTap*)netif->state;
+		struct eth_addr dest;
+		if(!tap || ip6_addr_ismulticast(ip6addr) || !tap->neighborMac((const uint8_t *)ip6addr->addr, dest.addr))
+			return ethip6_output(netif, p, ip6addr);
+		if(pbuf_header(p, sizeof(struct eth_hdr)) != 0)
+			return ERR_BUF;
+		struct eth_hdr *ethhdr = (struct eth_hdr *)p->payload;
+		SMEMCPY(&ethhdr->dest, &dest, 6);
+		SMEMCPY(&ethhdr->src, netif->hwaddr, 6);
+		ethhdr->type = PP_HTONS(ETHTYPE_IPV6);
+		return netif->linkoutput(netif, p);
+	}
+#endif
+
+	/*
+	 * Adds the tap's netif, which carries both address families, on its first address. The
+	 * default netif is only ever the first tap's, routing picks a tap's netif by destination
+	 * (see zt_lwip_route4()/zt_lwip_route6())
+	 */
+	// pbufs reassembly may hold, see zt_lwip_reass_limit()
+	static unsigned int lwip_reass_limit = IP_REASS_MAX_PBUFS;
+
+#if LWIP_IPV4 && LWIP_IGMP
+	// IPv4 groups go to 01:00:5e plus the group's low 23 bits
+	static err_t lwip_igmp_mac_filter(struct netif *netif, const ip4_addr_t *group, u8_t action)
+	{
+		SocketTap *tap = (SocketTap*)netif->state;
+		MulticastGroup mg(MAC(0x01005e000000ULL | (lwip_ntohl(ip4_addr_get_u32(group)) & 0x7fffff)), 0);
+		if(action == IGMP_ADD_MAC_FILTER)
+			tap->joinMulticastGroup(mg);
+		else
+			tap->leaveMulticastGroup(mg);
+		return ERR_OK;
+	}
+#endif
+
+#if LWIP_IPV6 && LWIP_IPV6_MLD
+	// IPv6 groups go to 33:33 plus the group's low 32 bits
+	static err_t lwip_mld_mac_filter(struct netif *netif, const ip6_addr_t *group, u8_t action)
+	{
+		SocketTap *tap = (SocketTap*)netif->state;
+		MulticastGroup mg(MAC(0x333300000000ULL | lwip_ntohl(group->addr[3])), 0);
+		if(action == MLD6_ADD_MAC_FILTER)
+			tap->joinMulticastGroup(mg);
+		else
+			tap->leaveMulticastGroup(mg);
+		return ERR_OK;
+	}
+#endif
+
+	static void lwip_add_netif(SocketTap *tap)
+	{
+		struct netif *nif = &(tap->lwipdev);
+		// Fragments wait in the frames a tap holds for the stack, reassembly gets half of them
+		struct zts_stack_config config;
+		zts_get_stack_config(&config);
+		lwip_reass_limit = std::min((unsigned int)IP_REASS_MAX_PBUFS, (unsigned int)config.frame_pool_sz / 2);
+#if LWIP_IPV4
+		ip4_addr_t any;
+		ip4_addr_set_zero(&any);
+		netif_add(nif, &any, &any, &any, tap, tapif_init, ethernet_input);
+		nif->output = etharp_output;
+#else
+		netif_add(nif, tap, tapif_init, ethernet_input);
+#endif
+		tap->_mac.copyTo(nif->hwaddr, 6);
+		nif->hwaddr_len = 6;
+		nif->mtu = tap->_mtu;
+		nif->name[0] = 'z';
+		nif->name[1] = 't';
+		nif->linkoutput = low_level_output;
+		nif->flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_IGMP | NETIF_FLAG_LINK_UP | NETIF_FLAG_UP;
+#if LWIP_IPV4 && LWIP_IGMP
+		netif_set_igmp_mac_filter(nif, lwip_igmp_mac_filter);
+#endif
+#if LWIP_IPV6 && LWIP_IPV6_MLD
+		netif_set_mld_mac_filter(nif, lwip_mld_mac_filter);
+#endif
+#if LWIP_IPV6
+		nif->output_ip6 = lwip_output_ip6;
+		nif->ip6_autoconfig_enabled = 1;
+		netif_create_ip6_linklocal_address(nif, 1);
+#endif
+		if(!netif_default)
+			netif_set_default(nif);
+		netif_set_up(nif);
+		tap->lwipdev_initialized = true;
+	}
+
 	void lwIP::lwip_init_interface(SocketTap *tap, const InetAddress &ip)
 	{
 		DEBUG_INFO();
-		Mutex::Lock _l(tap->_ips_m);
+		ProfiledMutex::Lock _l(tap->_ips_m);
+		ProfiledMutex::Lock _c(lwip_core_m);
 
 		if (std::find(tap->_ips.begin(),tap->_ips.end(),ip) == tap->_ips.end()) {
 			tap->_ips.push_back(ip);
 			std::sort(tap->_ips.begin(),tap->_ips.end());
+			if(!tap->lwipdev_initialized)
+				lwip_add_netif(tap);
+			char ipbuf[64];
 #if defined(LIBZT_IPV4)
 			if (ip.isV4()) {
-				// Set IP
-				static ip_addr_t ipaddr, netmask, gw;
+				// A netif holds one IPv4 address, the first one assigned keeps it
+				if(!ip4_addr_isany_val(*netif_ip4_addr(&(tap->lwipdev)))) {
+					DEBUG_ERROR("ignoring additional IPv4 address %s", ip.toString(ipbuf));
+					return;
+				}
+				ip4_addr_t ipaddr, netmask, gw;
 				IP4_ADDR(&gw,127,0,0,1);
 				ipaddr.addr = *((u32_t *)ip.rawIpData());
 				netmask.addr = *((u32_t *)ip.netmask().rawIpData());
-				netif_add(&(tap->lwipdev),&ipaddr, &netmask, &gw, NULL, tapif_init, ethernet_input);
-				tap->lwipdev.state = tap;
-				tap->lwipdev.output = etharp_output;
-				tap->_mac.copyTo(tap->lwipdev.hwaddr, 6);
-				tap->lwipdev.mtu = tap->_mtu;
-				tap->lwipdev.name[0] = 'l';
-				tap->lwipdev.name[1] = '4';
-				tap->lwipdev.linkoutput = low_level_output;
-				tap->lwipdev.hwaddr_len = 6;
-				tap->lwipdev.flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_IGMP | NETIF_FLAG_LINK_UP | NETIF_FLAG_UP;
-				netif_set_default(&(tap->lwipdev));
-				netif_set_up(&(tap->lwipdev));
-				char ipbuf[64];
+				netif_set_addr(&(tap->lwipdev), &ipaddr, &netmask, &gw);
 				DEBUG_INFO("addr=%s, netmask=%s", ip.toString(ipbuf), ip.netmask().toString(ipbuf));
 			}
 #endif
 #if defined(LIBZT_IPV6)
 			if(ip.isV6()) {
-				DEBUG_INFO("local_addr=%s", ip.toString().c_str());
-				static ip6_addr_t addr6;
-				struct sockaddr_in6 in6;
-				memcpy(in6.sin6_addr.s6_addr,ip.rawIpData(),16);
-				in6_to_ip6((ip6_addr *)&addr6, &in6);
-				tap->lwipdev6.mtu = tap->_mtu;
-				tap->lwipdev6.name[0] = 'l';
-				tap->lwipdev6.name[1] = '6';
-				tap->lwipdev6.hwaddr_len = 6;
-				tap->lwipdev6.linkoutput = low_level_output;
-				tap->lwipdev6.ip6_autoconfig_enabled = 1;
-				tap->_mac.copyTo(tap->lwipdev6.hwaddr, tap->lwipdev6.hwaddr_len);
-				netif_create_ip6_linklocal_address(&(tap->lwipdev6), 1);
-				netif_add(&(tap->lwipdev6), NULL, tapif_init, ethernet_input);
-				netif_set_default(&(tap->lwipdev6));
-				netif_set_up(&(tap->lwipdev6)); 
-				netif_ip6_addr_set_state(&(tap->lwipdev6), 1, IP6_ADDR_TENTATIVE); 
-				ip6_addr_copy(ip_2_ip6(tap->lwipdev6.ip6_addr[1]), addr6);
-				tap->lwipdev6.output_ip6 = ethip6_output;
-				tap->lwipdev6.state = tap;
-				tap->lwipdev6.flags = NETIF_FLAG_LINK_UP | NETIF_FLAG_UP;
-				char ipbuf[64];
+				ip6_addr_t addr6;
+				memcpy(addr6.addr, ip.rawIpData(), 16);
+				// Starts out tentative, duplicate address detection runs from nd6_tmr()
+				if(netif_add_ip6_address(&(tap->lwipdev), &addr6, NULL) != ERR_OK) {
+					DEBUG_ERROR("no free IPv6 address slot for %s, see LWIP_IPV6_NUM_ADDRESSES", ip.toString(ipbuf));
+					return;
+				}
 				DEBUG_INFO("addr=%s, netmask=%s", ip.toString(ipbuf), ip.netmask().toString(ipbuf));
 			}
-#endif 
+#endif
 		}
 	}
 
-	void lwIP::lwip_loop(SocketTap *tap)
+	// See ConnectionPair::pending_ev
+	#define LWIP_EV_FIN 0x01
+
+	// In units of TCP_SLOW_INTERVAL
+	#define LWIP_POLL_INTERVAL 2
+
+	static void lwip_wake(Connection *conn)
 	{
-	   DEBUG_INFO();
-	   uint64_t prev_tcp_time = 0, prev_status_time = 0, prev_discovery_time = 0;
-	   while(tap->_run)
-	   {
-			uint64_t now = OSUtils::now();
-			uint64_t since_tcp = now - prev_tcp_time;
-			uint64_t since_discovery = now - prev_discovery_time;
-			uint64_t since_status = now - prev_status_time;
-			uint64_t tcp_remaining = LWIP_TCP_TIMER_INTERVAL;
-			uint64_t discovery_remaining = 5000;
+		if(std::find(lwip_wakeups.begin(), lwip_wakeups.end(), conn) == lwip_wakeups.end())
+			lwip_wakeups.push_back(conn);
+	}
+
+	// Caller holds neither lwip_core_m nor _tcpconns_m
+	static void lwip_flush_wakeups()
+	{
+		std::vector<Connection*> woken;
+		{
+			ProfiledMutex::Lock _l(lwip_core_m);
+			woken.swap(lwip_wakeups);
+		}
+		for(size_t i=0; i<woken.size(); i++) {
+			woken[i]->notify_state();
+			epoll_notify(woken[i]);
+		}
+	}
 
 #if defined(LIBZT_IPV6)
-				#define DISCOVERY_INTERVAL 1000
+	// netif_ip6_addr_set_state() leaves these alone, unlike netif_set_ipaddr() for IPv4
+	static void lwip_abort_bound6(struct tcp_pcb *pcb, const ip6_addr_t *addr)
+	{
+		while(pcb) {
+			struct tcp_pcb *next = pcb->next;
+			if(IP_IS_V6_VAL(pcb->local_ip) && ip6_addr_cmp(ip_2_ip6(&pcb->local_ip), addr))
+				tcp_abort(pcb);
+			pcb = next;
+		}
+	}
+#endif
+
+	// Caller holds _ips_m and lwip_core_m
+	static void lwip_remove_netif_ip(SocketTap *tap, const InetAddress &ip)
+	{
+		struct netif *nif = &(tap->lwipdev);
+		char ipbuf[64];
+#if defined(LIBZT_IPV4)
+		if(ip.isV4()) {
+			ip4_addr_t ipaddr;
+			ipaddr.addr = *((u32_t *)ip.rawIpData());
+			if(!ip4_addr_cmp(&ipaddr, netif_ip4_addr(nif)))
+				return; // one of the ignored ones, see lwip_init_interface()
+			// Aborts the TCP connections bound to it
+			ip4_addr_t any;
+			ip4_addr_set_zero(&any);
+			netif_set_addr(nif, &any, &any, &any);
+			DEBUG_INFO("removed addr=%s", ip.toString(ipbuf));
+			// The next IPv4 address in line takes its place
+			for(size_t i=0; i<tap->_ips.size(); i++) {
+				if(!tap->_ips[i].isV4())
+					continue;
+				ip4_addr_t netmask, gw;
+				IP4_ADDR(&gw,127,0,0,1);
+				ipaddr.addr = *((u32_t *)tap->_ips[i].rawIpData());
+				netmask.addr = *((u32_t *)tap->_ips[i].netmask().rawIpData());
+				netif_set_addr(nif, &ipaddr, &netmask, &gw);
+				DEBUG_INFO("addr=%s", tap->_ips[i].toString(ipbuf));
+				break;
+			}
+		}
+#endif
+#if defined(LIBZT_IPV6)
+		if(ip.isV6()) {
+			ip6_addr_t addr6;
+			memcpy(addr6.addr, ip.rawIpData(), 16);
+			s8_t slot = netif_get_ip6_addr_match(nif, &addr6);
+			if(slot < 0)
+				return;
+			netif_ip6_addr_set_state(nif, slot, IP6_ADDR_INVALID);
+			lwip_abort_bound6(tcp_active_pcbs, &addr6);
+			lwip_abort_bound6(tcp_bound_pcbs, &addr6);
+			DEBUG_INFO("removed addr=%s", ip.toString(ipbuf));
+		}
+#endif
+	}
+
+	void lwIP::lwip_remove_interface_ip(SocketTap *tap, const InetAddress &ip)
+	{
+		{
+			ProfiledMutex::Lock _l(tap->_ips_m);
+			ProfiledMutex::Lock _c(lwip_core_m);
+			if(tap->lwipdev_initialized)
+				lwip_remove_netif_ip(tap, ip);
+		}
+		lwip_flush_wakeups(); // for the connections nc_err() reported
+	}
+
+	void lwIP::lwip_set_mtu(SocketTap *tap, unsigned int mtu)
+	{
+		ProfiledMutex::Lock _c(lwip_core_m);
+		// Not yet added, lwip_add_netif() picks it up from tap->_mtu
+		if(tap->lwipdev_initialized)
+			tap->lwipdev.mtu = mtu;
+	}
+
+	void lwIP::lwip_remove_interface(SocketTap *tap)
+	{
+		ProfiledMutex::Lock _c(lwip_core_m);
+		if(!tap->lwipdev_initialized)
+			return;
+		struct netif *nif = &(tap->lwipdev);
+#if LWIP_IPV4
+		ip4_addr_set_zero(ip_2_ip4(&nif->ip_addr));
+#endif
+		netif_remove(nif);
+		if(!netif_default && netif_list)
+			netif_set_default(netif_list);
+		tap->lwipdev_initialized = false;
+	}
+
+	void lwIP::lwip_Rebind(Connection *conn, SocketTap *to)
+	{
+		ProfiledMutex::Lock _l(lwip_core_m);
+		conn->route_netif = NULL;
+		conn->route_gen = 0;
+		for(size_t i=0; i<conn->_AcceptedPairs.size(); i++) {
+			conn->_AcceptedPairs[i]->tap = to;
+			conn->_AcceptedPairs[i]->admit = 0;
+		}
+		if(!conn->pcb)
+			return;
+		ConnectionPair *pair = conn->socket_type == SOCK_DGRAM
+			? (ConnectionPair*)((struct udp_pcb*)conn->pcb)->recv_arg
+			: (ConnectionPair*)((struct tcp_pcb*)conn->pcb)->callback_arg;
+		if(pair)
+			pair->tap = to;
+	}
+
+	static int lwip_errno(err_t err)
+	{
+		switch(err) {
+			case ERR_OK:         return 0;
+			case ERR_MEM:        return ENOMEM;
+			case ERR_BUF:        return ENOBUFS;
+			case ERR_TIMEOUT:    return ETIMEDOUT;
+			case ERR_RTE:        return EHOSTUNREACH;
+			case ERR_INPROGRESS: return EINPROGRESS;
+			case ERR_VAL:        return EINVAL;
+			case ERR_WOULDBLOCK: return EWOULDBLOCK;
+			case ERR_USE:        return EADDRINUSE;
+			case ERR_ALREADY:    return EALREADY;
+			case ERR_ISCONN:     return EISCONN;
+			case ERR_CONN:       return ENOTCONN;
+			case ERR_ABRT:       return ECONNABORTED;
+			case ERR_RST:        return ECONNRESET;
+			case ERR_CLSD:       return ENOTCONN;
+			case ERR_ARG:        return EINVAL;
+			default:             return EIO;
+		}
+	}
+
+	/*
+	 * sockaddr (network byte order) to lwIP's address and port (host byte order), returns false
+	 * if lwIP wasn't built for the address family
+	 */
+	static bool lwip_from_sockaddr(const struct sockaddr *sa, ip_addr_t *ip, u16_t *port)
+	{
+		memset(ip, 0, sizeof(*ip));
+#if LWIP_IPV4
+		if(sa->sa_family == AF_INET) {
+			const struct sockaddr_in *in4 = (const struct sockaddr_in *)sa;
+			ip4_addr_set_u32(ip_2_ip4(ip), in4->sin_addr.s_addr);
+			IP_SET_TYPE(ip, IPADDR_TYPE_V4);
+			*port = lwip_ntohs(in4->sin_port);
+			return true;
+		}
+#endif
+#if LWIP_IPV6
+		if(sa->sa_family == AF_INET6) {
+			const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)sa;
+			memcpy(ip_2_ip6(ip)->addr, &in6->sin6_addr, sizeof(ip_2_ip6(ip)->addr));
+			IP_SET_TYPE(ip, IPADDR_TYPE_V6);
+			*port = lwip_ntohs(in6->sin6_port);
+			return true;
+		}
+#endif
+		return false;
+	}
+
+	// The reverse of lwip_from_sockaddr(), returns the length of the address written to sa
+	static socklen_t lwip_to_sockaddr(const ip_addr_t *ip, u16_t port, struct sockaddr *sa)
+	{
+#if LWIP_IPV6
+		if(IP_IS_V6(ip)) {
+			struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)sa;
+			memset(in6, 0, sizeof(*in6));
+			in6->sin6_family = AF_INET6;
+			in6->sin6_port = lwip_htons(port);
+			memcpy(&in6->sin6_addr, ip_2_ip6(ip)->addr, sizeof(in6->sin6_addr));
+			return sizeof(*in6);
+		}
+#endif
+#if LWIP_IPV4
+		struct sockaddr_in *in4 = (struct sockaddr_in *)sa;
+		memset(in4, 0, sizeof(*in4));
+		in4->sin_family = AF_INET;
+		in4->sin_port = lwip_htons(port);
+		in4->sin_addr.s_addr = ip4_addr_get_u32(ip_2_ip4(ip));
+		return sizeof(*in4);
+#endif
+		return 0;
+	}
+
+	/*
+	 * Drops the first n bytes of chain p, returns what is left of it (NULL if nothing is)
+	 */
+	static struct pbuf *lwip_pbuf_advance(struct pbuf *p, u16_t n)
+	{
+		while(p && n >= p->len) {
+			struct pbuf *q = p->next;
+			n -= p->len;
+			// q keeps the reference p held on it
+			p->next = NULL;
+			pbuf_free(p);
+			p = q;
+		}
+		while(p && n) {
+			s16_t d = (s16_t)std::min(n, (u16_t)0x7fff);
+			pbuf_header(p, (s16_t)-d);
+			n -= d;
+		}
+		return p;
+	}
+
+	/*
+	 * Detaches pcb from us and closes it, lwIP frees it once the connection is done with. If
+	 * there's no memory for the FIN yet nc_poll() tries again
+	 */
+	static void lwip_close_pcb(struct tcp_pcb *pcb)
+	{
+		tcp_arg(pcb, NULL);
+		if(pcb->state == LISTEN)
+			tcp_accept(pcb, NULL);
+		else {
+			tcp_recv(pcb, NULL); // lwIP's tcp_recv_null() takes over
+			tcp_sent(pcb, NULL);
+			tcp_err(pcb, NULL);
+			tcp_poll(pcb, NULL, 0);
+		}
+		if(tcp_close(pcb) != ERR_OK)
+			tcp_poll(pcb, lwIP::nc_poll, LWIP_POLL_INTERVAL);
+	}
+
+	static void lwip_attach_pcb(struct tcp_pcb *pcb, ConnectionPair *pair)
+	{
+		tcp_arg(pcb, pair);
+		tcp_recv(pcb, lwIP::nc_recved);
+		tcp_sent(pcb, lwIP::nc_sent);
+		tcp_err(pcb, lwIP::nc_err);
+		tcp_poll(pcb, lwIP::nc_poll, LWIP_POLL_INTERVAL);
+	}
+
+	// feed a complete ethernet frame into the stack, caller holds lwip_core_m
+	static void lwip_input_frame(SocketTap *tap, struct pbuf *p)
+	{
+		struct netif *nif = &(tap->lwipdev);
+		if(!tap->lwipdev_initialized || nif->input(p, nif) != ERR_OK) {
+			DEBUG_ERROR("error while feeding frame into stack");
+			pbuf_free(p);
+		}
+	}
+
+	/*
+	 * Whether packets the stack sent to one of the tap's own addresses are waiting to be fed
+	 * back in (see LWIP_NETIF_LOOPBACK), they're only fed on the stack thread (lwip_loop()) so
+	 * that lwIP's callbacks never run on another one. Caller holds lwip_core_m
+	 */
+	static bool lwip_loopback_queued(SocketTap *tap)
+	{
+		return tap->lwipdev.loop_first;
+	}
+
+	static void lwip_poll_loopback(SocketTap *tap)
+	{
+		if(tap->lwipdev.loop_first)
+			netif_poll(&tap->lwipdev);
+	}
+
+	unsigned long lwIP::lwip_loop(std::vector<SocketTap*> &taps)
+	{
+		for(size_t i=0; i<taps.size(); i++)
+			lwip_service_accepted(taps[i]);
+
+		// lwIP's timers are global, not per tap
+		uint64_t now = Clock::cached();
+		uint64_t since_tcp = now - prev_tcp_time;
+		uint64_t since_discovery = now - prev_discovery_time;
+		uint64_t since_reass = now - prev_reass_time;
+		uint64_t tcp_remaining = TCP_TMR_INTERVAL;
+		uint64_t discovery_remaining = 5000;
+		uint64_t reass_remaining = 1000;
+
+#if defined(LIBZT_IPV6)
+			#define DISCOVERY_INTERVAL 1000
 #elif defined(LIBZT_IPV4)
-				#define DISCOVERY_INTERVAL ARP_TMR_INTERVAL
+			#define DISCOVERY_INTERVAL ARP_TMR_INTERVAL
+#endif
+#if defined(LIBZT_IPV4)
+			#define REASS_INTERVAL IP_TMR_INTERVAL
+#elif defined(LIBZT_IPV6)
+			#define REASS_INTERVAL IP6_REASS_TMR_INTERVAL
 #endif
-			// Main TCP/ETHARP timer section
-			if (since_tcp >= LWIP_TCP_TIMER_INTERVAL) {
-				prev_tcp_time = now;
-				tcp_tmr();
-			} 
+		std::chrono::steady_clock::time_point tick_start = std::chrono::steady_clock::now();
+		{
+			ProfiledMutex::Lock _l(lwip_core_m);
+			// Frames which arrived since the last pass
+			for(size_t i=0; i<taps.size(); i++) {
+				StackThread::Phase _p(ZTS_STACK_PHASE_FRAME_RX);
+				std::vector<struct pbuf*> frames;
+				frames.swap(taps[i]->_lwip_frame_rxq);
+				taps[i]->rxDrained(0);
+				taps[i]->_stack->framesPolled(frames.size());
+				for(size_t j=0; j<frames.size(); j++)
+					lwip_input_frame(taps[i], frames[j]);
+				// Including whatever the app's calls on other threads sent since
+				lwip_poll_loopback(taps[i]);
+			}
+			// Main TCP/ETHARP timer section. lwIP's TCP clock is the number of tcp_tmr() calls,
+			// those missed while the thread was held up are made up for (see
+			// LWIP_TCP_TIMER_CATCHUP). With no connections to time the thread isn't woken for it
+			if (!tcp_active_pcbs && !tcp_tw_pcbs) {
+				prev_tcp_time = 0;
+				tcp_remaining = PowerMode::maxInterval();
+			}
+			else if (!prev_tcp_time) {
+				prev_tcp_time = now; // the first connection since, its timers start now
+			}
+			else if (since_tcp >= TCP_TMR_INTERVAL) {
+				uint64_t ticks = since_tcp / TCP_TMR_INTERVAL;
+				for(uint64_t t=0; t<std::min(ticks, (uint64_t)LWIP_TCP_TIMER_CATCHUP); t++)
+					tcp_tmr();
+				prev_tcp_time = ticks > LWIP_TCP_TIMER_CATCHUP ? now : prev_tcp_time + ticks * TCP_TMR_INTERVAL;
+				tcp_remaining = TCP_TMR_INTERVAL - (now - prev_tcp_time);
+			}
 			else {
-				tcp_remaining = LWIP_TCP_TIMER_INTERVAL - since_tcp;
+				tcp_remaining = TCP_TMR_INTERVAL - since_tcp;
 			}
 			if (since_discovery >= DISCOVERY_INTERVAL) {
 				prev_discovery_time = now;
@@ -170,64 +663,205 @@ namespace ZeroTier
 			} else {
 				discovery_remaining = DISCOVERY_INTERVAL - since_discovery;
 			}
-			tap->_phy.poll((unsigned long)std::min(tcp_remaining,discovery_remaining));
+			// Partly reassembled datagrams age out after IP_REASS_MAXAGE of these
+			if (since_reass >= REASS_INTERVAL) {
+				prev_reass_time = now;
+#if defined(LIBZT_IPV4)
+					ip_reass_tmr();
+#endif
+#if defined(LIBZT_IPV6)
+					ip6_reass_tmr();
+#endif
+			} else {
+				reass_remaining = REASS_INTERVAL - since_reass;
+			}
 		}
+		unsigned long held = 0;
+		for(size_t i=0; i<taps.size(); i++) {
+			unsigned long t = lwip_service_held(taps[i]);
+			if(t && (!held || t < held))
+				held = t;
+		}
+		lwip_flush_wakeups();
+		uint64_t tick_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - tick_start).count();
+		for(size_t i=0; i<taps.size(); i++) {
+			stat_add(taps[i]->_stats.stack_ticks, 1);
+			stat_add(taps[i]->_stats.stack_tick_ns, tick_ns);
+			stat_max(taps[i]->_stats.stack_tick_max_ns, tick_ns);
+		}
+		unsigned long timeout = (unsigned long)std::min(std::min(tcp_remaining,discovery_remaining),reass_remaining);
+		if(held)
+			timeout = std::min(timeout, held);
+		StackThread::Phase _p(ZTS_STACK_PHASE_HOUSEKEEPING);
+		for(size_t i=0; i<taps.size(); i++) {
+			taps[i]->ServiceOptions();
+			taps[i]->ServiceClosing();
+			taps[i]->Reap();
+			taps[i]->Housekeeping();
+		}
+		// Frames queued while we were busy are fed in right away
+		ProfiledMutex::Lock _l(lwip_core_m);
+		for(size_t i=0; i<taps.size(); i++) {
+			if(taps[i]->_lwip_frame_rxq.size() || lwip_loopback_queued(taps[i]))
+				timeout = 0;
+		}
+		return timeout;
+	}
+
+
+	/*
+	 * Puts a frame from the wire in a pbuf and queues it for the stack thread, returns false if
+	 * it had to be dropped. Caller holds lwip_core_m
+	 */
+	static bool lwip_queue_frame(SocketTap *tap, const MAC &from,const MAC &to,unsigned int etherType,const void *data,unsigned int len)
+	{
+		stat_add(tap->_stats.frames_in, 1);
+		stat_add(tap->_stats.bytes_in, len);
+		// Bounded like picoTCP's queue, shed before anything is copied if the stack is falling behind
+		if(!tap->rxAdmit(tap->_lwip_frame_rxq.size())) {
+			stat_add(tap->_stats.frames_dropped, 1);
+			return false;
+		}
+		// Allocated with PBUF_LINK_HLEN of headroom so the payload is copied once, to an aligned
+		// address, and the ethernet header (with its ETH_PAD_SIZE pad) is then written in front
+		struct pbuf *p = len <= 0xffff ? pbuf_alloc(PBUF_LINK, (u16_t)len, PBUF_POOL) : NULL;
+		if (p == NULL) {
+			DEBUG_ERROR("dropped packet: no pbufs available");
+			stat_add(tap->_stats.frames_dropped, 1);
+			return false;
+		}
+		pbuf_take(p, data, (u16_t)len);
+		if (pbuf_header(p, SIZEOF_ETH_HDR)) {
+			DEBUG_ERROR("dropped packet: no headroom for ethernet header");
+			stat_add(tap->_stats.frames_dropped, 1);
+			pbuf_free(p);
+			return false;
+		}
+		struct eth_hdr *ethhdr = (struct eth_hdr *)p->payload;
+		from.copyTo(ethhdr->src.addr, 6);
+		to.copyTo(ethhdr->dest.addr, 6);
+		ethhdr->type = ZeroTier::Utils::hton((uint16_t)etherType);
+		p->rx_stamp = SocketTap::rxStamp();
+		tap->_lwip_frame_rxq.push_back(p);
+		stat_max(tap->_stats.rxq_hwm, tap->_lwip_frame_rxq.size());
+		return true;
 	}
 
 	void lwIP::lwip_rx(SocketTap *tap, const MAC &from,const MAC &to,unsigned int etherType,const void *data,unsigned int len)
 	{
 		DEBUG_INFO();
-		struct pbuf *p,*q;
 		if (!tap->_enabled)
 			return;
-		struct eth_hdr ethhdr;
-		from.copyTo(ethhdr.src.addr, 6);
-		to.copyTo(ethhdr.dest.addr, 6);
-		ethhdr.type = ZeroTier::Utils::hton((uint16_t)etherType);
-
-		p = pbuf_alloc(PBUF_RAW, len+sizeof(struct eth_hdr), PBUF_POOL);
-		if (p != NULL) {
-			const char *dataptr = reinterpret_cast<const char *>(data);
-			// First pbuf gets ethernet header at start
-			q = p;
-			if (q->len < sizeof(ethhdr)) {
-				DEBUG_ERROR("dropped packet: first pbuf smaller than ethernet header");
+		bool idle;
+		{
+			ProfiledMutex::Lock _l(lwip_core_m);
+			// The stack thread only sleeps with an empty queue, so it needs waking for the first frame
+			idle = tap->_lwip_frame_rxq.empty();
+			if(!lwip_queue_frame(tap, from, to, etherType, data, len))
+				return;
+		}
+		if(idle && !tap->_stack->spinning())
+			tap->_phy.whack();
+	}
+
+	/*
+	 * A pbuf referencing a frame buffer which still belongs to the ZeroTier core, the core is
+	 * told it may reuse the buffer once lwIP frees the pbuf
+	 */
+	struct lwip_ref_pbuf
+	{
+		struct pbuf_custom pc; // must be first
+		void (*release)(void *);
+		void *arg;
+	};
+
+	static void lwip_ref_pbuf_free(struct pbuf *p)
+	{
+		struct lwip_ref_pbuf *rp = (struct lwip_ref_pbuf *)p;
+		rp->release(rp->arg);
+		delete rp;
+	}
+
+	void lwIP::lwip_rx_ref(SocketTap *tap, const MAC &from,const MAC &to,unsigned int etherType,
+		void *data,unsigned int len,unsigned int headroom,void (*release)(void *),void *arg)
+	{
+		if (!tap->_enabled) {
+			release(arg);
+			return;
+		}
+		struct lwip_ref_pbuf *rp = NULL;
+		unsigned int frame_len = len + sizeof(struct eth_hdr);
+		if(headroom >= sizeof(struct eth_hdr) && frame_len <= 0xffff)
+			rp = new (std::nothrow) lwip_ref_pbuf;
+		if(!rp) {
+			// Nowhere to put the ethernet header (or no memory for the wrapper), copy as usual
+			lwip_rx(tap, from, to, etherType, data, len);
+			release(arg);
+			return;
+		}
+		// The ethernet header goes into the headroom in front of the payload
+		unsigned char *frame = (unsigned char *)data - sizeof(struct eth_hdr);
+		struct eth_hdr *ethhdr = (struct eth_hdr *)frame;
+		from.copyTo(ethhdr->src.addr, 6);
+		to.copyTo(ethhdr->dest.addr, 6);
+		ethhdr->type = ZeroTier::Utils::hton((uint16_t)etherType);
+
+		stat_add(tap->_stats.frames_in, 1);
+		stat_add(tap->_stats.bytes_in, len);
+		rp->pc.custom_free_function = lwip_ref_pbuf_free;
+		rp->release = release;
+		rp->arg = arg;
+		bool idle;
+		{
+			ProfiledMutex::Lock _l(lwip_core_m);
+			if(!tap->rxAdmit(tap->_lwip_frame_rxq.size())) {
+				stat_add(tap->_stats.frames_dropped, 1);
+				delete rp;
+				release(arg);
 				return;
 			}
-			memcpy(q->payload,&ethhdr,sizeof(ethhdr));
-			memcpy((char*)q->payload + sizeof(ethhdr),dataptr,q->len - sizeof(ethhdr));
-			dataptr += q->len - sizeof(ethhdr);
-
-			// Remaining pbufs (if any) get rest of data
-			while ((q = q->next)) {
-				memcpy(q->payload,dataptr,q->len);
-				dataptr += q->len;
+			struct pbuf *p = pbuf_alloced_custom(PBUF_RAW, (u16_t)frame_len, PBUF_REF, &rp->pc, frame, (u16_t)frame_len);
+			if(!p) {
+				DEBUG_ERROR("dropped packet: unable to wrap frame buffer");
+				stat_add(tap->_stats.frames_dropped, 1);
+				delete rp;
+				release(arg);
+				return;
 			}
-		} 
-		else {
-			DEBUG_ERROR("dropped packet: no pbufs available");
-			return;
+			p->rx_stamp = SocketTap::rxStamp();
+			idle = tap->_lwip_frame_rxq.empty();
+			tap->_lwip_frame_rxq.push_back(p);
+			stat_max(tap->_stats.rxq_hwm, tap->_lwip_frame_rxq.size());
 		}
+		if(idle && !tap->_stack->spinning())
+			tap->_phy.whack();
+	}
+
+	void lwIP::lwip_rx_batch(SocketTap *tap, const TapFrame *frames, unsigned int n)
+	{
+		if (!tap->_enabled)
+			return;
+		bool idle;
 		{
-#if defined(LIBZT_IPV6)
-				if(tap->lwipdev6.input(p, &(tap->lwipdev6)) != ERR_OK) {
-					DEBUG_ERROR("error while feeding frame into stack lwipdev6");
-				}
-#endif
-#if defined(LIBZT_IPV4)
-				if(tap->lwipdev.input(p, &(tap->lwipdev)) != ERR_OK) {
-					DEBUG_ERROR("error while feeding frame into stack lwipdev");
-				}
-#endif
+			// The whole batch is queued under one lock acquisition
+			ProfiledMutex::Lock _l(lwip_core_m);
+			idle = tap->_lwip_frame_rxq.empty();
+			for(unsigned int i=0; i<n; i++)
+				lwip_queue_frame(tap, frames[i].from, frames[i].to, frames[i].etherType, frames[i].data, frames[i].len);
 		}
+		if(idle && !tap->_stack->spinning())
+			tap->_phy.whack();
 	}
 
 	int lwIP::lwip_Socket(void **pcb, int socket_family, int socket_type, int protocol)
 	{
-		// TODO: check lwIP timers, and max sockets
 		DEBUG_INFO();
+		ProfiledMutex::Lock _l(lwip_core_m);
 		if(socket_type == SOCK_STREAM) {
 			struct tcp_pcb *new_tcp_PCB = tcp_new();
+			if(new_tcp_PCB && ZT_SOCK_TCP_NODELAY_DEFAULT)
+				tcp_nagle_disable(new_tcp_PCB);
 			*pcb = new_tcp_PCB;
 			return ERR_OK;
 		}
@@ -243,153 +877,1239 @@ namespace ZeroTier
 		return -1;
 	}
 
-	int lwIP::lwip_Connect(Connection *conn, int fd, const struct sockaddr *addr, socklen_t addrlen)
+	int lwIP::SetLocalPort(Connection *conn, uint16_t port)
+	{
+		ProfiledMutex::Lock _l(lwip_core_m);
+		if(!conn->pcb || conn->socket_type != SOCK_STREAM)
+			return 0;
+		// tcp_connect() only looks for a free port (through every PCB) when there's none, it
+		// takes the PCB off tcp_bound_pcbs for one set here which it was never on
+		struct tcp_pcb *pcb = (struct tcp_pcb*)conn->pcb;
+		if(pcb->local_port || pcb->state != CLOSED)
+			return 0;
+		// Connected PCBs may share the port (with other destinations), bound or listening ones
+		// may not
+		for(struct tcp_pcb *p = tcp_bound_pcbs; p; p = p->next) {
+			if(p->local_port == port)
+				return -1;
+		}
+		for(struct tcp_pcb_listen *p = tcp_listen_pcbs.listen_pcbs; p; p = p->next) {
+			if(p->local_port == port)
+				return -1;
+		}
+		pcb->local_port = port;
+		return 1;
+	}
+
+	int lwIP::lwip_Connect(SocketTap *tap, Connection *conn, int fd, const struct sockaddr *addr, socklen_t addrlen)
 	{
 		DEBUG_INFO();
+		if(!conn || !conn->pcb) {
+			DEBUG_ERROR("invalid conn or conn->pcb");
+			handle_general_failure();
+			return ZT_ERR_GENERAL_FAILURE;
+		}
+		ip_addr_t ip;
+		u16_t port;
+		if(!lwip_from_sockaddr(addr, &ip, &port)) {
+			errno = EAFNOSUPPORT;
+			return -1;
+		}
+		err_t err;
+		ProfiledMutex::Lock _l(lwip_core_m);
+		if(conn->socket_type == SOCK_DGRAM) {
+			struct udp_pcb *pcb = (struct udp_pcb*)conn->pcb;
+			if((err = udp_connect(pcb, &ip, port)) == ERR_OK) {
+				conn->route_gen = 0;
+				if(!pcb->recv_arg)
+					udp_recv(pcb, nc_udp_recved, new ConnectionPair(tap, conn));
+				// Nothing to wait for
+				conn->state = ZT_SOCK_STATE_UNHANDLED_CONNECTED;
+				conn->connecting = false;
+			}
+		}
+		else {
+			struct tcp_pcb *pcb = (struct tcp_pcb*)conn->pcb;
+			ConnectionPair *pair = (ConnectionPair*)pcb->callback_arg;
+			lwip_attach_pcb(pcb, pair ? pair : new ConnectionPair(tap, conn));
+			// Completion is reported through nc_connected() or nc_err()
+#if LWIP_TCP_FASTOPEN
+			if(conn->syn_len) {
+				// What fits goes on the SYN if the peer's cookie is known, syn_len is left at that
+				u16_t len = (u16_t)std::min(conn->syn_len, (size_t)0xffff);
+				err = tcp_connect_fastopen(pcb, &ip, port, nc_connected, conn->syn_data, &len);
+				conn->syn_len = err == ERR_OK ? len : 0;
+			}
+			else
+#endif
+			err = tcp_connect(pcb, &ip, port, nc_connected);
+		}
+		if(err != ERR_OK) {
+			DEBUG_ERROR("unable to connect, err=%d", err);
+			errno = lwip_errno(err);
+			return -1;
+		}
+		return ZT_ERR_OK;
 	}
 
 	int lwIP::lwip_Bind(SocketTap *tap, Connection *conn, int fd, const struct sockaddr *addr, socklen_t addrlen)
 	{
 		DEBUG_INFO();
-		ip_addr_t ba;
-		char addrstr[INET6_ADDRSTRLEN];
-		int port = 0, err = 0;
+		if(!conn || !conn->pcb) {
+			DEBUG_ERROR("invalid conn or conn->pcb");
+			handle_general_failure();
+			return ZT_ERR_GENERAL_FAILURE;
+		}
+		ip_addr_t ip;
+		u16_t port;
+		if(!lwip_from_sockaddr(addr, &ip, &port)) {
+			errno = EAFNOSUPPORT;
+			return -1;
+		}
+		err_t err;
+		ProfiledMutex::Lock _l(lwip_core_m);
+		if(conn->socket_type == SOCK_DGRAM) {
+			struct udp_pcb *pcb = (struct udp_pcb*)conn->pcb;
+			if((err = udp_bind(pcb, &ip, port)) == ERR_OK && !pcb->recv_arg)
+				udp_recv(pcb, nc_udp_recved, new ConnectionPair(tap, conn));
+		}
+		else {
+			struct tcp_pcb *pcb = (struct tcp_pcb*)conn->pcb;
+			if((err = tcp_bind(pcb, &ip, port)) == ERR_OK && !pcb->callback_arg)
+				tcp_arg(pcb, new ConnectionPair(tap, conn));
+		}
+		if(err != ERR_OK) {
+			DEBUG_ERROR("unable to bind, err=%d", err);
+			errno = lwip_errno(err);
+			return -1;
+		}
+		return ZT_ERR_OK;
+	}
 
-#if defined(LIBZT_IPV4)
-		DEBUG_ERROR("A");
-			struct sockaddr_in *in4;
-			if(addr->sa_family == AF_INET) {
-				DEBUG_ERROR("A");
-				in4 = (struct sockaddr_in *)addr;
-				DEBUG_ERROR("A");
-				inet_ntop(AF_INET, &(in4->sin_addr), addrstr, INET_ADDRSTRLEN); 
-				DEBUG_ERROR("A");   
-				DEBUG_INFO("%s:%d", addrstr, lwip_ntohs(in4->sin_port));
+	int lwIP::lwip_Listen(Connection *conn, int fd, int backlog)
+	{
+		DEBUG_INFO();
+		if(!conn || !conn->pcb) {
+			DEBUG_ERROR("invalid conn or conn->pcb");
+			handle_general_failure();
+			return ZT_ERR_GENERAL_FAILURE;
+		}
+		if(conn->socket_type != SOCK_STREAM) {
+			errno = EOPNOTSUPP;
+			return -1;
+		}
+		// 0 (or less) gets the smallest useful queue, like the kernel. lwIP is built without
+		// TCP_LISTEN_BACKLOG, the queue is ours (see nc_accept())
+		conn->backlog = std::max(1, std::min(backlog, ZT_LISTEN_BACKLOG_MAX));
+		ProfiledMutex::Lock _l(lwip_core_m);
+		struct tcp_pcb *pcb = (struct tcp_pcb*)conn->pcb;
+		if(pcb->state != LISTEN) {
+			if(pcb->state != CLOSED) {
+				errno = EISCONN;
+				return -1;
 			}
-			ba = convert_ip(in4); 
-			port = lwip_ntohs(in4->sin_port);
-			DEBUG_INFO("port=%d", port);
-			DEBUG_INFO("port=%d", lwip_ntohs(port));
-#endif
-#if defined(LIBZT_IPV6)
-			struct sockaddr_in6 *in6 = (struct sockaddr_in6*)&addr;
-			in6_to_ip6((ip6_addr *)&ba, in6);
-			if(addr->sa_family == AF_INET6) {        
-				struct sockaddr_in6 *connaddr6 = (struct sockaddr_in6 *)addr;
-				inet_ntop(AF_INET6, &(connaddr6->sin6_addr), addrstr, INET6_ADDRSTRLEN);
-				DEBUG_INFO("%s:%d", addrstr, lwip_ntohs(connaddr6->sin6_port));
+			// pcb is freed in favour of a smaller listening one which keeps its callback_arg
+			struct tcp_pcb *lpcb = tcp_listen_with_backlog(pcb, (u8_t)std::min(conn->backlog, 0xff));
+			if(!lpcb) {
+				DEBUG_ERROR("unable to listen, out of listening pcbs");
+				errno = ENOMEM;
+				return -1;
 			}
+			conn->pcb = lpcb;
+			tcp_accept(lpcb, nc_accept);
+#if LWIP_TCP_FASTOPEN
+			tcp_fastopen(lpcb, (u16_t)std::min(conn->fastopen, 0xffff));
 #endif
-		if(conn->socket_type == SOCK_DGRAM) {
-			err = udp_bind((struct udp_pcb*)conn->pcb, (const ip_addr_t *)&ba, port);
-			if(err == ERR_USE) {
-				err = -1;
-				errno = EADDRINUSE; // port in use
+		}
+		conn->state = ZT_SOCK_STATE_LISTENING;
+		return ZT_ERR_OK;
+	}
+
+	/*
+	 * lwip_SetKeepalive() with lwip_core_m held
+	 */
+	static void lwip_apply_keepalive(struct tcp_pcb *pcb, Connection *conn)
+	{
+		if(conn->keepalive)
+			ip_set_option(pcb, SOF_KEEPALIVE);
+		else
+			ip_reset_option(pcb, SOF_KEEPALIVE);
+		pcb->keep_idle = (u32_t)PowerMode::keepalive(conn->keep_idle) * 1000;
+		pcb->keep_intvl = (u32_t)PowerMode::keepalive(conn->keep_intvl) * 1000;
+		pcb->keep_cnt = (u32_t)conn->keep_cnt;
+	}
+
+	/*
+	 * TCP_QUICKACK, TCP_USER_TIMEOUT and ZT_SO_TCP_RTO_MIN with lwip_core_m held
+	 */
+	static void lwip_apply_timers(struct tcp_pcb *pcb, Connection *conn)
+	{
+		if(conn->quickack)
+			tcp_quickack_enable(pcb);
+		else
+			tcp_quickack_disable(pcb);
+		tcp_set_user_timeout(pcb, conn->user_timeout);
+		tcp_set_rto_min(pcb, (u32_t)conn->rto_min);
+	}
+
+	Connection* lwIP::lwip_Accept(Connection *conn)
+	{
+		if(!conn) {
+			DEBUG_ERROR("invalid conn");
+			handle_general_failure();
+			return NULL;
+		}
+		// Caller holds _tcpconns_m. The first of the queued connections only now gets its
+		// Connection and socketpair
+		ProfiledMutex::Lock _l(lwip_core_m);
+		while(conn->_AcceptedPairs.size() && !conn->_AcceptedPairs.front()->pcb) {
+			// Reset or timed out before the app got to it (see nc_err())
+			conn->tap->_admission.connRelease(conn->_AcceptedPairs.front()->admit);
+			delete conn->_AcceptedPairs.front();
+			conn->_AcceptedPairs.pop_front();
+			conn->_AcceptedCount--;
+		}
+		if(!conn->_AcceptedPairs.size())
+			return NULL;
+		SocketTap *tap = conn->tap;
+		Connection *newConn = connpool.get(SOCK_STREAM);
+		if(newConn->app_fd < 0) {
+			connpool.recycle(newConn); // out of descriptors, leave it queued
+			return NULL;
+		}
+		ConnectionPair *pair = conn->_AcceptedPairs.front();
+		conn->_AcceptedPairs.pop_front();
+		conn->_AcceptedCount--;
+		struct tcp_pcb *pcb = (struct tcp_pcb*)pair->pcb;
+		pair->pcb = NULL;
+
+		newConn->socket_family = conn->socket_family;
+		newConn->socket_type = SOCK_STREAM;
+		newConn->pcb = pcb;
+		newConn->driver = this;
+		newConn->tap = tap;
+		newConn->admit = pair->admit;
+		newConn->state = ZT_SOCK_STATE_CONNECTED;
+
+		// Like the kernel, accepted sockets inherit the listener's TCP options
+		newConn->tx_nodelay = conn->tx_nodelay;
+		if(newConn->tx_nodelay)
+			tcp_nagle_disable(pcb);
+		else
+			tcp_nagle_enable(pcb);
+		newConn->tos = conn->tos;
+		pcb->tos = (u8_t)conn->tos;
+		newConn->keepalive = conn->keepalive;
+		newConn->keep_idle = conn->keep_idle;
+		newConn->keep_intvl = conn->keep_intvl;
+		newConn->keep_cnt = conn->keep_cnt;
+		lwip_apply_keepalive(pcb, newConn);
+		newConn->quickack = conn->quickack;
+		newConn->user_timeout = conn->user_timeout;
+		newConn->rto_min = conn->rto_min;
+		newConn->tx_shaper.configure(conn->tx_shaper.rate(), conn->tx_shaper.burst());
+		lwip_apply_timers(pcb, newConn);
+
+		tap->_Connections.add(newConn);
+		// For I/O loop participation and referencing the PhySocket's parent Connection in callbacks
+		newConn->sock = tap->_phy.wrapSocket(newConn->sdk_fd, newConn);
+		// From here on the stack's callbacks reach newConn, the stack thread replays whatever
+		// they reported before now
+		pair->conn = newConn;
+		tap->_lwip_accepted.push_back(newConn);
+		tap->_phy.whack();
+		return newConn;
+	}
+
+	void lwIP::lwip_Peername(Connection *conn, struct sockaddr_storage *addr)
+	{
+		memset(addr, 0, sizeof(*addr));
+		ProfiledMutex::Lock _l(lwip_core_m);
+		if(!conn->pcb || conn->socket_type != SOCK_STREAM)
+			return;
+		struct tcp_pcb *pcb = (struct tcp_pcb*)conn->pcb;
+		lwip_to_sockaddr(&pcb->remote_ip, pcb->remote_port, (struct sockaddr *)addr);
+	}
+
+	void lwIP::lwip_service_accepted(SocketTap *tap)
+	{
+		std::vector<Connection*> accepted;
+		{
+			ProfiledMutex::Lock _l(tap->_tcpconns_m);
+			if(tap->_lwip_accepted.empty())
+				return;
+			accepted.swap(tap->_lwip_accepted);
+		}
+		{
+			ProfiledMutex::Lock _l(lwip_core_m);
+			for(size_t i=0; i<accepted.size(); i++) {
+				Connection *conn = accepted[i];
+				// Closed by the app (or the peer) already
+				if(!conn->pcb || conn->closure_ts != -1)
+					continue;
+				struct tcp_pcb *pcb = (struct tcp_pcb*)conn->pcb;
+				ConnectionPair *pair = (ConnectionPair*)pcb->callback_arg;
+				// Data which arrived before the app accepted was refused (see nc_recved()), lwIP
+				// offers it again now. A bare FIN we had to remember ourselves
+				if(pcb->refused_data && tcp_process_refused_data(pcb) == ERR_ABRT)
+					continue;
+				if(conn->pcb && (pair->pending_ev & LWIP_EV_FIN))
+					nc_recved(pair, pcb, NULL, ERR_OK);
+				lwip_wake(conn);
 			}
-			else {
-				// set the recv callback
-				udp_recv((struct udp_pcb*)conn->pcb, nc_udp_recved, new ConnectionPair(tap, conn));
-				err = ERR_OK; 
-				errno = ERR_OK; // success
+		}
+		lwip_flush_wakeups();
+	}
+
+	/*
+	 * Flush as much of RXbuf to the app's end of the socketpair as it will take, both contiguous
+	 * regions in a single (non-blocking, like Phy::streamSend) sendmsg() call
+	 */
+	static int lwip_flush_rxbuf(SocketTap *tap, Connection *conn)
+	{
+		struct iovec iov[2];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = conn->RXbuf->readable_iov(iov);
+		int n = 0;
+		if(msg.msg_iovlen) {
+			n = sendmsg(conn->sdk_fd, &msg, MSG_DONTWAIT);
+			if(n > 0) {
+				conn->RXbuf->consume(n);
+				conn->rx_mark.consumed(conn->RXbuf->consumed(), ZTS_LATENCY_RX_BUF);
+			}
+		}
+		// Only our end stops sending, what the app writes still reaches the stack
+		if(conn->rx_fin && !conn->RXbuf->count()) {
+			conn->rx_fin = false;
+			shutdown(conn->sdk_fd, SHUT_WR);
+		}
+		if(conn->sock)
+			tap->_phy.setNotifyWritable(conn->sock, conn->RXbuf->count() > 0);
+		return n;
+	}
+
+	/*
+	 * The peer has closed its side, nothing more is coming. The app reads EOF once RXbuf has
+	 * gone out, while the pcb stays open (CLOSE_WAIT) for what it still sends until it closes
+	 * or shuts down too (see lwIP::Close()). Caller holds lwip_core_m
+	 */
+	static void lwip_remote_closed(Connection *conn)
+	{
+		ConnectionPair *pair = (ConnectionPair*)((struct tcp_pcb*)conn->pcb)->callback_arg;
+		pair->pending_ev &= ~LWIP_EV_FIN;
+		conn->rx_fin = true;
+		lwip_flush_rxbuf(conn->tap, conn);
+		lwip_wake(conn);
+	}
+
+	/*
+	 * Moves what lwIP has delivered (conn->rx_pbuf) into RXbuf as room allows, opens the window
+	 * by as much and hands RXbuf on to the app. Caller holds lwip_core_m
+	 */
+	static void lwip_deliver_rx(Connection *conn)
+	{
+		struct tcp_pcb *pcb = (struct tcp_pcb*)conn->pcb;
+		struct pbuf *p = conn->rx_pbuf;
+		size_t queued = conn->RXbuf->count(), cap = conn->RXbuf->getCapacity();
+		size_t limit = cap * ZT_TCP_RX_HIGH_WATER / 100;
+		size_t room = queued < limit ? limit - queued : 0;
+		u16_t n = 0;
+		for(struct pbuf *q = p; q && room; q = q->next) {
+			size_t w = conn->RXbuf->write((unsigned char*)q->payload, std::min((size_t)q->len, room));
+			n += (u16_t)w;
+			room -= w;
+			if(w < q->len)
+				break;
+		}
+		if(n) {
+			conn->rx_mark.produced(conn->RXbuf->produced());
+			stat_add(conn->stats.bytes_in, n);
+			stat_max(conn->stats.rxbuf_hwm, conn->RXbuf->count());
+			tcp_recved(pcb, n);
+			conn->rx_pbuf = lwip_pbuf_advance(p, n);
+		}
+		// Whatever is left waits until the app has caught up, see lwip_Read()
+		conn->rx_stalled = conn->rx_pbuf != NULL;
+		lwip_flush_rxbuf(conn->tap, conn);
+		lwip_wake(conn);
+		// A FIN which arrived behind the data can be passed on once all of it has been
+		ConnectionPair *pair = (ConnectionPair*)pcb->callback_arg;
+		if(!conn->rx_pbuf && (pair->pending_ev & LWIP_EV_FIN))
+			lwip_remote_closed(conn);
+	}
+
+	/*
+	 * Moves queued datagrams into the app's end of the socketpair until it's full, the rest
+	 * follow once it becomes writable again (see lwip_Read())
+	 */
+	static void lwip_flush_dgrams(SocketTap *tap, Connection *conn)
+	{
+		DatagramQueue *q = conn->rxq;
+		if(!q)
+			return;
+		while(q->count()) {
+			size_t sz;
+			const unsigned char *d = q->front(&sz);
+			if(send(conn->sdk_fd, d, sz, MSG_DONTWAIT) < 0) {
+				if(errno == EAGAIN || errno == EWOULDBLOCK)
+					break;
+				DEBUG_ERROR("unable to deliver datagram, app_fd=%d, errno=%d", conn->app_fd, errno);
+				q->drops++;
+			}
+			q->pop();
+		}
+		if(conn->sock)
+			tap->_phy.setNotifyWritable(conn->sock, q->count() > 0);
+	}
+
+	int lwIP::lwip_Read(SocketTap *tap, PhySocket *sock, Connection *conn, bool stack_invoked)
+	{
+		DEBUG_EXTRA();
+		if(!conn)
+			return 0;
+		// The app has made room in its socketpair, pass on whatever datagrams have queued up
+		if(conn->socket_type == SOCK_DGRAM) {
+			lwip_flush_dgrams(tap, conn);
+			return 0;
+		}
+		// ...or whatever is left in RXbuf, then take what lwIP has been holding on to for us
+		// (see lwip_deliver_rx()) once the app has caught up
+		lwip_flush_rxbuf(tap, conn);
+		if(conn->rx_stalled
+			&& conn->RXbuf->count() <= conn->RXbuf->getCapacity() * ZT_TCP_RX_LOW_WATER / 100) {
+			{
+				ProfiledMutex::Lock _l(lwip_core_m);
+				if(conn->pcb && conn->rx_pbuf)
+					lwip_deliver_rx(conn);
 			}
+			lwip_flush_wakeups();
 		}
-		else if (conn->socket_type == SOCK_STREAM) {
-			err = tcp_bind((struct tcp_pcb*)conn->pcb, (const ip_addr_t *)&ba, port);
+		return 0;
+	}
+
+	/*
+	 * Stops reading conn's socketpair once TXbuf passes its high-water mark (or anything had
+	 * to be spilled) and resumes once the stack has taken it down to the low-water mark
+	 */
+	static void lwip_tx_flow(Connection *conn)
+	{
+		if(!conn->sock)
+			return;
+		size_t queued = conn->TXbuf->count(), cap = conn->TXbuf->getCapacity();
+		if(!conn->tx_paused && (conn->tx_spill.size() || queued >= cap * ZT_TCP_TX_HIGH_WATER / 100)) {
+			conn->tx_paused = true;
+			conn->tap->_phy.setNotifyReadable(conn->sock, false);
+			ZT_PROBE2(txbuf_full, conn, queued);
+		}
+		else if(conn->tx_paused && !conn->tx_spill.size() && queued <= cap * ZT_TCP_TX_LOW_WATER / 100) {
+			conn->tx_paused = false;
+			conn->tap->_phy.setNotifyReadable(conn->sock, true);
+			ZT_PROBE2(txbuf_resume, conn, queued);
+		}
+	}
+
+	/*
+	 * Moves spilled bytes (see lwip_Write()) into TXbuf as room allows
+	 */
+	static size_t lwip_unspill(Connection *conn)
+	{
+		if(!conn->tx_spill.size())
+			return 0;
+		size_t w = conn->TXbuf->write(conn->tx_spill.data(), conn->tx_spill.size());
+		conn->tx_spill.erase(conn->tx_spill.begin(), conn->tx_spill.begin() + w);
+		return w;
+	}
+
+	/*
+	 * Hand TXbuf to lwIP until it's empty, lwIP won't take any more (its send buffer or queue
+	 * is full) or the egress shapers won't allow any more (unless shaped is false), returns the
+	 * number of bytes taken or -1 on error. Caller holds lwip_core_m
+	 */
+	static int lwip_drain_txbuf(Connection *conn, bool shaped = true)
+	{
+		struct tcp_pcb *pcb = (struct tcp_pcb*)conn->pcb;
+		int tot = 0;
+		ring_span<unsigned char> span[2];
+		size_t allow = shaped ? conn->tap->txAllowance(conn) : SIZE_MAX;
+		lwip_unspill(conn);
+		while(conn->TXbuf->readable_span(span)) {
+			// Over its rate the rest waits in TXbuf, lwip_service_held() picks it up again
+			if(!allow) {
+				conn->tap->_tx_held = true;
+				break;
+			}
+			size_t len = std::min(std::min(span[0].len, (size_t)tcp_sndbuf(pcb)), (size_t)ZT_STACK_SOCKET_WR_MAX);
+			len = std::min(len, allow);
+			if(!len)
+				break; // nc_sent() is called once the peer has acked some of it
+			// Copied since TXbuf's chunks are handed back as soon as they're consumed. MORE
+			// keeps PSH off all but the last segment of what's queued
+			u8_t flags = TCP_WRITE_FLAG_COPY;
+			if(len < conn->TXbuf->count())
+				flags |= TCP_WRITE_FLAG_MORE;
+			err_t err = tcp_write(pcb, span[0].ptr, (u16_t)len, flags);
+			if(err == ERR_MEM)
+				break; // out of segments, likewise
 			if(err != ERR_OK) {
-				DEBUG_ERROR("err=%d", err);
-				if(err == ERR_USE){
-					err = -1; 
-					errno = EADDRINUSE;
-				}
-				if(err == ERR_MEM){
-					err = -1; 
-					errno = ENOMEM;
-				}
-				if(err == ERR_BUF){
-					err = -1; 
-					errno = ENOMEM;
-				}
-			} 
-			else {
-				err = ERR_OK; 
-				errno = ERR_OK; // success
+				DEBUG_ERROR("unable to write to pcb=%p, err=%d", pcb, err);
+				return -1;
 			}
+			conn->TXbuf->consume(len);
+			conn->tx_mark.consumed(conn->TXbuf->consumed(), ZTS_LATENCY_TX_BUF);
+			stat_add(conn->stats.bytes_out, len);
+			allow -= len;
+			conn->tap->txCharge(conn, len);
+			tot += len;
+			lwip_unspill(conn);
+		}
+		if(tot)
+			tcp_output(pcb);
+		lwip_tx_flow(conn);
+		return tot;
+	}
+
+	/*
+	 * The netif a connected UDP pcb sends on, resolved once per TapIndex generation rather than
+	 * per datagram. NULL leaves it to udp_send(), as for multicast peers whose route it picks
+	 * differently
+	 */
+	static struct netif *lwip_connected_route(Connection *conn, struct udp_pcb *pcb)
+	{
+		if(!(pcb->flags & UDP_FLAGS_CONNECTED) || ip_addr_ismulticast(&pcb->remote_ip))
+			return NULL;
+		uint32_t gen = tapindex.generation();
+		struct netif *netif = (struct netif *)conn->route_netif;
+		if(conn->route_gen != gen || (netif && !netif_is_up(netif))) {
+			netif = ip_route(&pcb->local_ip, &pcb->remote_ip);
+			conn->route_netif = netif;
+			conn->route_gen = gen;
+		}
+		return netif;
+	}
+
+	/*
+	 * Sends one datagram which the app wrote to its end of the socketpair (DatagramHeader
+	 * followed by the payload), returns the payload length sent or -1. Caller holds lwip_core_m
+	 */
+	static int lwip_write_dgram(Connection *conn, const void *data, ssize_t len)
+	{
+		struct DatagramHeader hdr;
+		if(len < (ssize_t)sizeof(hdr) || len - sizeof(hdr) > 0xffff) {
+			DEBUG_ERROR("invalid datagram length (len=%d)", len);
+			return -1;
+		}
+		memcpy(&hdr, data, sizeof(hdr));
+		const unsigned char *payload = (const unsigned char *)data + sizeof(hdr);
+		u16_t plen = (u16_t)(len - sizeof(hdr));
+		struct udp_pcb *pcb = (struct udp_pcb*)conn->pcb;
+		struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, plen, PBUF_RAM);
+		if(!p) {
+			DEBUG_ERROR("unable to send datagram, no pbufs available");
+			return -1;
+		}
+		pbuf_take(p, payload, plen);
+		err_t err = ERR_VAL;
+		ip_addr_t dst;
+		u16_t port;
+		struct netif *netif;
+		if(!hdr.addrlen && (netif = lwip_connected_route(conn, pcb)))
+			err = udp_sendto_if(pcb, p, &pcb->remote_ip, pcb->remote_port, netif);
+		else if(!hdr.addrlen)
+			err = udp_send(pcb, p);
+		else if(lwip_from_sockaddr(&hdr.addr.sa, &dst, &port))
+			err = udp_sendto(pcb, p, &dst, port);
+		pbuf_free(p);
+		if(err != ERR_OK) {
+			DEBUG_ERROR("unable to send datagram, pcb=%p, err=%d", pcb, err);
+			return -1;
 		}
+		stat_add(conn->stats.bytes_out, plen);
+		conn->tap->txCharge(conn, plen);
+		// Over its rate the next datagram waits in the socketpair until lwip_service_held()
+		if(conn->sock && !conn->tx_paused && !conn->tap->txAllowance(conn)) {
+			conn->tx_paused = true;
+			conn->tap->_phy.setNotifyReadable(conn->sock, false);
+			conn->tap->_tx_held = true;
+		}
+		return plen;
+	}
+
+	int lwIP::lwip_Write(Connection *conn, void *data, ssize_t len)
+	{
+		// TXbuf is SPSC, lwip_core_m guards the pcb
+		if(!conn) {
+			DEBUG_ERROR("invalid connection (len=%d)", len);
+			handle_general_failure();
+			return -1;
+		}
+		if(len <= 0) {
+			DEBUG_ERROR("invalid write length (len=%d)", len);
+			handle_general_failure();
+			return -1;
+		}
+		ProfiledMutex::Lock _l(lwip_core_m);
+		if(!conn->pcb) {
+			DEBUG_ERROR("connection is closed, this write() will fail");
+			return -1;
+		}
+		// Datagrams go straight to the stack, one per socketpair message
+		if(conn->socket_type == SOCK_DGRAM)
+			return lwip_write_dgram(conn, data, len);
+
+		// Phy hands us whatever one read() of the socketpair returned, if that doesn't all fit
+		// the rest waits in tx_spill and we stop reading until the stack catches up
+		const unsigned char *p = (const unsigned char*)data;
+		size_t buf_w = conn->tx_spill.size() ? 0 : conn->TXbuf->write(p, len);
+		if(buf_w)
+			conn->tx_mark.produced(conn->TXbuf->produced());
+		stat_max(conn->stats.txbuf_hwm, conn->TXbuf->count());
+		if(buf_w < (size_t)len)
+			conn->tx_spill.insert(conn->tx_spill.end(), p + buf_w, p + len);
+		lwip_tx_flow(conn);
+		int err;
+		if((err = lwip_drain_txbuf(conn)) < 0)
+			DEBUG_ERROR("unable to write to pcb=%p", conn->pcb);
 		return err;
 	}
 
-	int lwIP::lwip_Listen(SocketTap *tap, PhySocket *sock, PhySocket *rpcSock, void **uptr, struct listen_st *listen_rpc)
+	unsigned long lwIP::lwip_service_held(SocketTap *tap)
 	{
-		DEBUG_INFO();
-		// to be implemented
+		if(!tap->_tx_held.exchange(false))
+			return 0;
+		unsigned long next = 0;
+		ProfiledMutex::Lock _l(tap->_tcpconns_m);
+		ProfiledMutex::Lock _lc(lwip_core_m);
+		for(size_t i=0; i<tap->_Connections.size(); i++) {
+			Connection *conn = tap->_Connections[i];
+			if(!conn->pcb || conn->closure_ts != -1)
+				continue;
+			if(conn->socket_type == SOCK_DGRAM ? !conn->tx_paused : !conn->TXbuf->count())
+				continue;
+			unsigned long shaped = tap->txShapedMs(conn);
+			if(shaped) {
+				if(!next || shaped < next)
+					next = shaped;
+				continue;
+			}
+			// Datagram sockets paused by the shaper just start being read again
+			if(conn->socket_type == SOCK_DGRAM) {
+				conn->tx_paused = false;
+				tap->_phy.setNotifyReadable(conn->sock, true);
+				continue;
+			}
+			if(((struct tcp_pcb*)conn->pcb)->state == LISTEN)
+				continue;
+			if(lwip_drain_txbuf(conn) > 0)
+				lwip_wake(conn);
+		}
+		if(next)
+			tap->_tx_held = true;
+		return next;
 	}
 
-	int lwIP::lwip_Read(SocketTap *tap, PhySocket *sock, void **uptr, bool lwip_invoked)
+	int lwIP::lwip_Close(Connection *conn)
 	{
-		DEBUG_EXTRA();
-		// to be implemented
+		DEBUG_INFO("conn = %p, pcb=%p, fd = %d", conn, conn->pcb, conn->app_fd);
+		if(!conn)
+			return ZT_ERR_GENERAL_FAILURE;
+		ProfiledMutex::Lock _l(lwip_core_m);
+		// Connections the app never accepted go with the listener
+		while(conn->_AcceptedPairs.size()) {
+			ConnectionPair *pair = conn->_AcceptedPairs.front();
+			conn->_AcceptedPairs.pop_front();
+			if(pair->pcb)
+				lwip_close_pcb((struct tcp_pcb*)pair->pcb);
+			conn->tap->_admission.connRelease(pair->admit);
+			delete pair;
+		}
+		conn->_AcceptedCount = 0;
+		if(conn->rx_pbuf) {
+			pbuf_free(conn->rx_pbuf);
+			conn->rx_pbuf = NULL;
+		}
+		// Closed by the peer (or reset) already
+		if(!conn->pcb)
+			return ZT_ERR_OK;
+		if(conn->socket_type == SOCK_DGRAM) {
+			struct udp_pcb *pcb = (struct udp_pcb*)conn->pcb;
+			delete (ConnectionPair*)pcb->recv_arg;
+			udp_recv(pcb, NULL, NULL);
+			udp_remove(pcb);
+		}
+		else {
+			struct tcp_pcb *pcb = (struct tcp_pcb*)conn->pcb;
+			ConnectionPair *pair = (ConnectionPair*)pcb->callback_arg;
+			// What lwIP will still take goes out ahead of the FIN
+			if(pcb->state != LISTEN && conn->TXbuf->count())
+				lwip_drain_txbuf(conn, false);
+			lwip_close_pcb(pcb);
+			delete pair;
+		}
+		conn->pcb = NULL;
+		return ZT_ERR_OK;
 	}
 
-	int lwIP::lwip_Write(SocketTap *tap, Connection *conn)
+	void lwIP::lwip_Limits(struct zts_socket_limits *limits)
 	{
-		DEBUG_EXTRA("conn=%p", (void*)&conn);
-		// to be implemented
+		limits->tcp = MEMP_NUM_TCP_PCB;
+		limits->tcp_listen = MEMP_NUM_TCP_PCB_LISTEN;
+		limits->udp = MEMP_NUM_UDP_PCB;
+		limits->timers = -1;
+		limits->timers_in_use = -1;
 	}
 
-	int lwIP::lwip_Close(SocketTap *tap, PhySocket *sock, Connection *conn)
+	void lwIP::lwip_SetTos(Connection *conn)
 	{
-		DEBUG_INFO();
-		// to be implemented
+		ProfiledMutex::Lock _l(lwip_core_m);
+		if(!conn->pcb)
+			return;
+		if(conn->socket_type == SOCK_STREAM)
+			((struct tcp_pcb*)conn->pcb)->tos = (u8_t)conn->tos;
+		else if(conn->socket_type == SOCK_DGRAM)
+			((struct udp_pcb*)conn->pcb)->tos = (u8_t)conn->tos;
+	}
+
+	void lwIP::lwip_SetKeepalive(Connection *conn)
+	{
+		ProfiledMutex::Lock _l(lwip_core_m);
+		if(conn->pcb && conn->socket_type == SOCK_STREAM)
+			lwip_apply_keepalive((struct tcp_pcb*)conn->pcb, conn);
+	}
+
+	void lwIP::lwip_ApplyOptions(Connection *conn, uint32_t opts)
+	{
+		ProfiledMutex::Lock _l(lwip_core_m);
+		if(!conn->pcb)
+			return;
+		if(conn->socket_type == SOCK_DGRAM) {
+			if(opts & ZT_CONN_OPT_TOS)
+				((struct udp_pcb*)conn->pcb)->tos = (u8_t)conn->tos;
+			return;
+		}
+		if(conn->socket_type != SOCK_STREAM)
+			return;
+		struct tcp_pcb *pcb = (struct tcp_pcb*)conn->pcb;
+		if(opts & ZT_CONN_OPT_TOS)
+			pcb->tos = (u8_t)conn->tos;
+		if(opts & ZT_CONN_OPT_KEEPALIVE)
+			lwip_apply_keepalive(pcb, conn);
+#if LWIP_TCP_FASTOPEN
+		// A listener's are only passed on to what it accepts, see lwip_Accept()
+		if((opts & ZT_CONN_OPT_TIMERS) && pcb->state != LISTEN)
+			lwip_apply_timers(pcb, conn);
+		// Before listen() this takes effect in lwip_Listen()
+		if(opts & ZT_CONN_OPT_FASTOPEN)
+			tcp_fastopen(pcb, (u16_t)std::min(conn->fastopen, 0xffff));
+#endif
+		if(opts & ZT_CONN_OPT_NODELAY) {
+			if(conn->tx_nodelay)
+				tcp_nagle_disable(pcb);
+			else
+				tcp_nagle_enable(pcb);
+		}
+	}
+
+	void lwIP::lwip_Stats(Connection *conn, struct zts_socket_stats *stats)
+	{
+		ProfiledMutex::Lock _l(lwip_core_m);
+		if(!conn->pcb || conn->socket_type != SOCK_STREAM)
+			return;
+		// lwIP keeps its estimates in slow timer ticks, sa is scaled by 8 and sv by 4. It has no
+		// running retransmit count per PCB, nrtx only covers the segment currently unacked
+		struct tcp_pcb *pcb = (struct tcp_pcb*)conn->pcb;
+		if(pcb->state == LISTEN)
+			return;
+		stats->retransmits = pcb->nrtx;
+		stats->rtt_ms = (uint32_t)((pcb->sa >> 3) * TCP_SLOW_INTERVAL);
+		stats->rttvar_ms = (uint32_t)((pcb->sv >> 2) * TCP_SLOW_INTERVAL);
+		stats->rto_ms = (uint32_t)(pcb->rto * TCP_SLOW_INTERVAL);
+		stats->cwnd = pcb->mss ? (uint32_t)(pcb->cwnd / pcb->mss) : 0;
+	}
+
+	void lwIP::lwip_Describe(Connection *conn, struct zts_connection_info *info)
+	{
+		ProfiledMutex::Lock _l(lwip_core_m);
+		if(!conn->pcb)
+			return;
+		if(conn->socket_type == SOCK_DGRAM) {
+			struct udp_pcb *pcb = (struct udp_pcb*)conn->pcb;
+			lwip_to_sockaddr(&pcb->local_ip, pcb->local_port, (struct sockaddr *)&info->local);
+			if(pcb->remote_port)
+				lwip_to_sockaddr(&pcb->remote_ip, pcb->remote_port, (struct sockaddr *)&info->peer);
+			return;
+		}
+		// A listening PCB is the smaller tcp_pcb_listen, which has no remote end or queues
+		struct tcp_pcb *pcb = (struct tcp_pcb*)conn->pcb;
+		lwip_to_sockaddr(&pcb->local_ip, pcb->local_port, (struct sockaddr *)&info->local);
+		if(pcb->state == LISTEN)
+			return;
+		lwip_to_sockaddr(&pcb->remote_ip, pcb->remote_port, (struct sockaddr *)&info->peer);
+		info->stack_sndq = (uint32_t)(pcb->snd_lbb - pcb->lastack);
+		info->stack_rcvq = conn->rx_pbuf ? conn->rx_pbuf->tot_len : 0;
+	}
+
+	int lwIP::Socket(Connection *conn)
+	{
+		void *pcb = NULL;
+		lwip_Socket(&pcb, conn->socket_family, conn->socket_type, conn->protocol);
+		if(!pcb)
+			return -1;
+		if(conn->socket_type == SOCK_STREAM) {
+			ProfiledMutex::Lock _l(lwip_core_m);
+			// zts_setsockopt() may have been called on the socket this one replaces
+			if(conn->tx_nodelay)
+				tcp_nagle_disable((struct tcp_pcb*)pcb);
+			else
+				tcp_nagle_enable((struct tcp_pcb*)pcb);
+			lwip_apply_timers((struct tcp_pcb*)pcb, conn);
+		}
+		conn->pcb = pcb;
+		conn->driver = this;
+		if(conn->tos)
+			lwip_SetTos(conn);
+		if(conn->keepalive)
+			lwip_SetKeepalive(conn);
+		return 0;
+	}
+
+	void lwIP::Assign(SocketTap *tap, Connection *conn)
+	{
+		ProfiledMutex::Lock _l(lwip_core_m);
+		if(!conn->pcb)
+			return;
+		if(conn->socket_type == SOCK_DGRAM) {
+			struct udp_pcb *pcb = (struct udp_pcb*)conn->pcb;
+			if(!pcb->recv_arg)
+				udp_recv(pcb, nc_udp_recved, new ConnectionPair(tap, conn));
+		}
+		else {
+			struct tcp_pcb *pcb = (struct tcp_pcb*)conn->pcb;
+			if(!pcb->callback_arg)
+				tcp_arg(pcb, new ConnectionPair(tap, conn));
+		}
+	}
+
+	int lwIP::Close(Connection *conn)
+	{
+		SocketTap *tap = conn->tap;
+		int err = lwip_Close(conn);
+		// A FIN to a socket of our own waits for the stack thread (see lwip_loopback_queued())
+		bool looped;
+		{
+			ProfiledMutex::Lock _l(lwip_core_m);
+			looped = lwip_loopback_queued(tap);
+		}
+		// Nothing reports on conn once its pcb is detached, it's recycled from here
+		tap->MarkClosed(conn);
+		if(looped)
+			tap->_phy.whack();
+		return err;
+	}
+
+	/*
+	 * ICMP probes go out through a raw PCB, which also sees every ICMP packet coming in and
+	 * takes those that answer them. UDP ones through a PCB of the session's own
+	 */
+	int lwIP::lwip_PingOpen(SocketTap *tap, PingSession *s)
+	{
+		ProfiledMutex::Lock _l(lwip_core_m);
+		if(s->proto == ZTS_PING_ICMP) {
+			if(s->dst.ss_family != AF_INET)
+				return -1;
+			struct raw_pcb *pcb = raw_new(IP_PROTO_ICMP);
+			if(!pcb)
+				return -1;
+			raw_recv(pcb, nc_ping_recved, s);
+			s->handle = pcb;
+			return 0;
+		}
+		struct udp_pcb *pcb = udp_new_ip_type(s->dst.ss_family == AF_INET6 ? IPADDR_TYPE_V6 : IPADDR_TYPE_V4);
+		if(!pcb)
+			return -1;
+		udp_recv(pcb, nc_ping_udp_recved, s);
+		s->handle = pcb;
+		return 0;
+	}
+
+	int lwIP::lwip_Ping(PingSession *s, uint32_t seq)
+	{
+		ip_addr_t dst;
+		u16_t port;
+		if(!lwip_from_sockaddr((struct sockaddr *)&s->dst, &dst, &port))
+			return -1;
+		ProfiledMutex::Lock _l(lwip_core_m);
+		err_t err;
+		if(s->proto == ZTS_PING_ICMP) {
+			struct pbuf *p = pbuf_alloc(PBUF_IP, sizeof(struct icmp_echo_hdr) + ZT_PING_SIZE, PBUF_RAM);
+			if(!p)
+				return -1;
+			struct icmp_echo_hdr *hdr = (struct icmp_echo_hdr *)p->payload;
+			ICMPH_TYPE_SET(hdr, ICMP_ECHO);
+			ICMPH_CODE_SET(hdr, 0);
+			hdr->id = lwip_htons(s->id);
+			hdr->seqno = lwip_htons((u16_t)seq);
+			hdr->chksum = 0;
+			s->payload(seq, hdr + 1);
+			hdr->chksum = inet_chksum(hdr, p->len);
+			s->sent(seq);
+			err = raw_sendto((struct raw_pcb *)s->handle, p, &dst);
+			pbuf_free(p);
+		}
+		else {
+			struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, ZT_PING_SIZE, PBUF_RAM);
+			if(!p)
+				return -1;
+			s->payload(seq, p->payload);
+			s->sent(seq);
+			err = udp_sendto((struct udp_pcb *)s->handle, p, &dst, port);
+			pbuf_free(p);
+		}
+		return err == ERR_OK ? 0 : -1;
+	}
+
+	void lwIP::lwip_PingClose(PingSession *s)
+	{
+		ProfiledMutex::Lock _l(lwip_core_m);
+		if(!s->handle)
+			return;
+		if(s->proto == ZTS_PING_ICMP)
+			raw_remove((struct raw_pcb *)s->handle);
+		else
+			udp_remove((struct udp_pcb *)s->handle);
+		s->handle = NULL;
 	}
 
 	/****************************************************************************/
 	/* Callbacks from lwIP stack                                                */
+	/* - These run on the stack thread with lwip_core_m held                   */
 	/****************************************************************************/
 
 	err_t lwIP::nc_recved(void *arg, struct tcp_pcb *PCB, struct pbuf *p, err_t err)
 	{
-		DEBUG_INFO();
-		// to be implemented
+		StackThread::Phase _p(ZTS_STACK_PHASE_CALLBACK);
+		ConnectionPair *pair = (ConnectionPair*)arg;
+		Connection *conn = pair ? pair->conn : NULL;
+		if(!pair)
+			return tcp_recv_null(NULL, PCB, p, err);
+		if(!conn) {
+			// Not accepted by the app yet, lwIP holds on to data we refuse and offers it again
+			// from lwip_service_accepted()
+			if(p)
+				return ERR_MEM;
+			pair->pending_ev |= LWIP_EV_FIN;
+			return ERR_OK;
+		}
+		if(!p) // FIN, passed on behind whatever is still waiting for room in RXbuf
+			pair->pending_ev |= LWIP_EV_FIN;
+		else if(!conn->rx_pbuf)
+			conn->rx_pbuf = p;
+		else if(conn->rx_pbuf->tot_len + p->tot_len <= 0xffff)
+			pbuf_cat(conn->rx_pbuf, p);
+		else
+			return ERR_MEM; // a chain can't hold any more, lwIP offers it again later
+		if(p && p->rx_stamp && conn->rx_timestamp)
+			conn->rx_stamp = p->rx_stamp;
+		lwip_deliver_rx(conn);
 		return ERR_OK;
 	}
 
+	// Admission::connAdmit() for a connection from addr
+	static int lwip_admit(SocketTap *tap, const ip_addr_t *addr)
+	{
+#if LWIP_IPV6
+		if(IP_IS_V6(addr))
+			return tap->_admission.connAdmit(ip_2_ip6(addr)->addr, sizeof(ip_2_ip6(addr)->addr));
+#endif
+#if LWIP_IPV4
+		return tap->_admission.connAdmit(&ip_2_ip4(addr)->addr, sizeof(ip_2_ip4(addr)->addr));
+#else
+		return 0;
+#endif
+	}
+
 	err_t lwIP::nc_accept(void *arg, struct tcp_pcb *newPCB, err_t err)
 	{
-		DEBUG_INFO();
-		// to be implemented
-		return -1;
+		StackThread::Phase _p(ZTS_STACK_PHASE_CALLBACK);
+		ConnectionPair *lpair = (ConnectionPair*)arg;
+		Connection *listener = lpair ? lpair->conn : NULL;
+		if(err != ERR_OK || !newPCB || !listener)
+			return ERR_VAL;
+		// The app is this far behind already, refuse rather than let a burst of inbound
+		// connections pile up. lwIP resets newPCB, which mustn't speak for the listener
+		if(listener->state != ZT_SOCK_STATE_LISTENING || listener->_AcceptedCount >= listener->backlog) {
+			tcp_arg(newPCB, NULL);
+			stat_add(listener->stats.accept_overflows, 1);
+			return ERR_MEM;
+		}
+		// Or one peer is having too much of the network (see zts_set_admission_limits())
+		int admit = lwip_admit(lpair->tap, &newPCB->remote_ip);
+		if(admit < 0) {
+			tcp_arg(newPCB, NULL);
+			stat_add(lpair->tap->_stats.conns_refused, 1);
+			return ERR_MEM;
+		}
+		// Only a placeholder until the app calls zts_accept(), see lwip_Accept()
+		ConnectionPair *pair = new ConnectionPair(lpair->tap, NULL);
+		pair->admit = admit;
+		pair->pcb = newPCB;
+		lwip_attach_pcb(newPCB, pair);
+		listener->_AcceptedPairs.push_back(pair);
+		listener->_AcceptedCount++;
+		// wake any blocking zts_accept()
+		lwip_wake(listener);
+		return ERR_OK;
 	}
-		
+
+	u8_t lwIP::nc_ping_recved(void *arg, struct raw_pcb *pcb, struct pbuf *p, const ip_addr_t *addr)
+	{
+		PingSession *s = (PingSession*)arg;
+		unsigned char buf[20 + 40 + sizeof(struct icmp_echo_hdr) + sizeof(struct PingPayload)];
+		u16_t len = pbuf_copy_partial(p, buf, sizeof(buf), 0);
+		// Raw IPv4 PCBs get the packet from its IP header on
+		unsigned int ihl = len ? (buf[0] & 0x0f) * 4 : 0;
+		if(ihl < 20 || len < ihl + sizeof(struct icmp_echo_hdr) + sizeof(struct PingPayload))
+			return 0;
+		struct icmp_echo_hdr hdr;
+		memcpy(&hdr, buf + ihl, sizeof(hdr));
+		uint32_t seq;
+		if(ICMPH_TYPE(&hdr) != ICMP_ER || lwip_ntohs(hdr.id) != s->id
+			|| !s->match(buf + ihl + sizeof(hdr), len - ihl - sizeof(hdr), &seq))
+			return 0;
+		s->replied(seq);
+		pbuf_free(p);
+		return 1;
+	}
+
+	void lwIP::nc_ping_udp_recved(void *arg, struct udp_pcb *upcb, struct pbuf *p, const ip_addr_t *addr, u16_t port)
+	{
+		PingSession *s = (PingSession*)arg;
+		unsigned char buf[sizeof(struct PingPayload)];
+		uint32_t seq;
+		u16_t len = pbuf_copy_partial(p, buf, sizeof(buf), 0);
+		if(s->match(buf, len, &seq))
+			s->replied(seq);
+		pbuf_free(p);
+	}
+
 	void lwIP::nc_udp_recved(void * arg, struct udp_pcb * upcb, struct pbuf * p, const ip_addr_t * addr, u16_t port)
 	{
-		DEBUG_INFO();
-		// to be implemented
+		StackThread::Phase _p(ZTS_STACK_PHASE_CALLBACK);
+		ConnectionPair *pair = (ConnectionPair*)arg;
+		Connection *conn = pair ? pair->conn : NULL;
+		if(!conn || !p) {
+			if(p)
+				pbuf_free(p);
+			return;
+		}
+		// (Re)size the queue while nothing is in it
+		size_t depth = conn->rxq_depth;
+		if(!conn->rxq || (conn->rxq->capacity() != depth && !conn->rxq->count())) {
+			delete conn->rxq;
+			conn->rxq = new DatagramQueue(depth, ZT_SDK_MTU, conn->rxq_drops);
+		}
+		DatagramQueue *q = conn->rxq;
+		// Datagrams are copied straight into the queue
+		struct DatagramHeader *hdr;
+		unsigned char *payload = p->tot_len <= ZT_SDK_MTU ? q->reserve(&hdr, conn->rxq_drop_oldest) : NULL;
+		if(!payload) {
+			q->drops++;
+			pbuf_free(p);
+			return;
+		}
+		u16_t r = pbuf_copy_partial(p, payload, p->tot_len, 0);
+		memset(hdr, 0, sizeof(*hdr));
+		if(conn->rx_timestamp)
+			hdr->rx_stamp = p->rx_stamp;
+		pbuf_free(p);
+		hdr->addrlen = lwip_to_sockaddr(addr, port, &hdr->addr.sa);
+		q->commit(r);
+		stat_add(conn->stats.bytes_in, r);
+		// Hand datagrams over as we go so the queue only fills when the app falls behind
+		lwip_flush_dgrams(pair->tap, conn);
+		lwip_wake(conn);
 	}
-	   
+
 	err_t lwIP::nc_sent(void* arg, struct tcp_pcb *PCB, u16_t len)
 	{
-		DEBUG_EXTRA("pcb=%p", (void*)&PCB);
-		// to be implemented
+		StackThread::Phase _p(ZTS_STACK_PHASE_CALLBACK);
+		ConnectionPair *pair = (ConnectionPair*)arg;
+		Connection *conn = pair ? pair->conn : NULL;
+		if(!conn)
+			return ERR_OK;
+		// There's room in lwIP's send buffer again
+		if(conn->TXbuf->count() || conn->tx_spill.size()) {
+			if(lwip_drain_txbuf(conn) < 0)
+				handle_general_failure();
+		}
+		lwip_wake(conn);
 		return ERR_OK;
 	}
-	   
+
 	err_t lwIP::nc_connected(void *arg, struct tcp_pcb *PCB, err_t err)
 	{
-		DEBUG_ATTN("pcb=%p", (void*)&PCB);
-		// to be implemented
+		ConnectionPair *pair = (ConnectionPair*)arg;
+		Connection *conn = pair ? pair->conn : NULL;
+		if(!conn)
+			return ERR_OK;
+		// set state so socket multiplexer logic will pick this up
+		conn->state = ZT_SOCK_STATE_UNHANDLED_CONNECTED;
+		conn->connecting = false;
+		// wake any blocking zts_connect()
+		lwip_wake(conn);
 		return ERR_OK;
 	}
 
 	err_t lwIP::nc_poll(void* arg, struct tcp_pcb *PCB)
 	{
-		DEBUG_INFO();
-		// to be implemented
+		ConnectionPair *pair = (ConnectionPair*)arg;
+		if(!pair) {
+			// Detached by lwip_close_pcb() before there was memory for the FIN
+			tcp_poll(PCB, NULL, 0);
+			if(tcp_close(PCB) != ERR_OK)
+				tcp_poll(PCB, nc_poll, LWIP_POLL_INTERVAL);
+			return ERR_OK;
+		}
+		// Picks up anything which was refused for want of memory since
+		Connection *conn = pair->conn;
+		if(conn && (conn->TXbuf->count() || conn->tx_spill.size()))
+			lwip_drain_txbuf(conn);
 		return ERR_OK;
 	}
 
 	void lwIP::nc_err(void *arg, err_t err)
 	{
-		DEBUG_INFO();
-		// to be implemented
+		// lwIP has freed the pcb by the time we're told
+		ConnectionPair *pair = (ConnectionPair*)arg;
+		if(!pair)
+			return;
+		Connection *conn = pair->conn;
+		if(!conn) {
+			pair->pcb = NULL; // dropped from the listener's queue by lwip_Accept()
+			return;
+		}
+		DEBUG_ERROR("err=%d, app_fd=%d, sdk_fd=%d", err, conn->app_fd, conn->sdk_fd);
+		conn->pcb = NULL;
+		delete pair;
+		if(conn->rx_pbuf) {
+			pbuf_free(conn->rx_pbuf);
+			conn->rx_pbuf = NULL;
+		}
+		// Reported through zts_connect() or SO_ERROR, a refused attempt is reset by the peer
+		if(conn->connecting) {
+			conn->so_error = err == ERR_RST ? ECONNREFUSED : lwip_errno(err);
+			conn->connecting = false;
+		}
+		else
+			conn->so_error = lwip_errno(err);
+		conn->tap->MarkClosed(conn);
+		lwip_wake(conn);
+	}
+}
+
+/*
+ * LWIP_HOOK_IP4_ROUTE/LWIP_HOOK_IP6_ROUTE (see lwipopts.h), every tap's netif is on the same
+ * list so the one to send on is that of the tap with the most specific route to dest. Called
+ * with lwip_core_m held, TapIndex lookups take no lock
+ */
+static struct netif *lwip_route_tap(const void *addr, unsigned int len)
+{
+	ZeroTier::SocketTap *tap = ZeroTier::tapindex.byAddr(ZeroTier::InetAddress(addr, len, 0));
+	if(!tap || !tap->lwipdev_initialized || !netif_is_up(&(tap->lwipdev)))
+		return NULL;
+	return &(tap->lwipdev);
+}
+
+#if LWIP_IPV4
+extern "C" struct netif *zt_lwip_route4(const struct ip4_addr *dest)
+{
+	return lwip_route_tap(&dest->addr, 4);
+}
+#endif
+
+#if LWIP_IPV6
+extern "C" struct netif *zt_lwip_route6(const struct ip6_addr *src, const struct ip6_addr *dest)
+{
+	(void)src;
+	return lwip_route_tap(dest->addr, 16);
+}
+#endif
+
+#if LWIP_TCP_FASTOPEN
+#define SIPROUND(v0,v1,v2,v3) do { \
+	v0 += v1; v1 = (v1 << 13) | (v1 >> 51); v1 ^= v0; v0 = (v0 << 32) | (v0 >> 32); \
+	v2 += v3; v3 = (v3 << 16) | (v3 >> 48); v3 ^= v2; \
+	v0 += v3; v3 = (v3 << 21) | (v3 >> 43); v3 ^= v0; \
+	v2 += v1; v1 = (v1 << 17) | (v1 >> 47); v1 ^= v2; v2 = (v2 << 32) | (v2 >> 32); } while(0)
+
+/*
+ * SipHash-2-4 of len bytes under key k
+ */
+static uint64_t lwip_siphash(const uint64_t k[2], const unsigned char *in, size_t len)
+{
+	uint64_t v0 = k[0] ^ 0x736f6d6570736575ULL, v1 = k[1] ^ 0x646f72616e646f6dULL;
+	uint64_t v2 = k[0] ^ 0x6c7967656e657261ULL, v3 = k[1] ^ 0x7465646279746573ULL;
+	uint64_t b = ((uint64_t)len) << 56;
+	size_t i;
+	for(i=0; i+8<=len; i+=8) {
+		uint64_t m = 0;
+		for(int j=0; j<8; j++)
+			m |= ((uint64_t)in[i+j]) << (8*j);
+		v3 ^= m; SIPROUND(v0,v1,v2,v3); SIPROUND(v0,v1,v2,v3); v0 ^= m;
+	}
+	for(int j=0; i<len; i++, j++)
+		b |= ((uint64_t)in[i]) << (8*j);
+	v3 ^= b; SIPROUND(v0,v1,v2,v3); SIPROUND(v0,v1,v2,v3); v0 ^= b;
+	v2 ^= 0xff;
+	SIPROUND(v0,v1,v2,v3); SIPROUND(v0,v1,v2,v3); SIPROUND(v0,v1,v2,v3); SIPROUND(v0,v1,v2,v3);
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+#undef SIPROUND
+
+/*
+ * LWIP_HOOK_TCP_PATH_MTU: the path MTU of the tap whose netif it is, the same for every member.
+ * Called with lwip_core_m held
+ */
+extern "C" unsigned short zt_lwip_path_mtu(struct netif *netif, const void *dest)
+{
+	ZeroTier::SocketTap *tap = (ZeroTier::SocketTap*)netif->state;
+	LWIP_UNUSED_ARG(dest);
+	return tap ? (unsigned short)tap->pathMtu() : 0;
+}
+
+/*
+ * IP_REASS_PBUF_LIMIT: half the frames a tap holds for the stack, as of the last tap added
+ */
+extern "C" unsigned int zt_lwip_reass_limit(void)
+{
+	return ZeroTier::lwip_reass_limit;
+}
+
+/*
+ * LWIP_HOOK_TCP_FASTOPEN_COOKIE: the cookie handed to a client (and expected back on its next
+ * SYN) is a SipHash of its address under a secret drawn once per process, so cookies need no
+ * state and stop being valid on restart. Called with lwip_core_m held
+ */
+extern "C" void zt_lwip_tfo_cookie(const void *remote_ip, unsigned char *cookie)
+{
+	static uint64_t key[2];
+	static bool keyed = false;
+	if(!keyed) {
+		ZeroTier::Utils::getSecureRandom(key, sizeof(key));
+		keyed = true;
 	}
+	const ip_addr_t *ip = (const ip_addr_t *)remote_ip;
+	uint64_t h = 0;
+#if LWIP_IPV6
+	if(IP_IS_V6(ip))
+		h = lwip_siphash(key, (const unsigned char *)ip_2_ip6(ip)->addr, 16);
+#endif
+#if LWIP_IPV4
+	if(!IP_IS_V6(ip))
+		h = lwip_siphash(key, (const unsigned char *)&ip_2_ip4(ip)->addr, 4);
+#endif
+	for(int i=0; i<LWIP_TCP_FASTOPEN_COOKIE_LEN; i++)
+		cookie[i] = (unsigned char)(h >> (8*(i%8)));
 }
+#endif
@@ -46,8 +46,10 @@
 
 #include "libzt.h"
 #include "SocketTap.hpp"
+#include "StackDriver.hpp"
 
 struct tcp_pcb;
+struct raw_pcb;
 struct netif;
 
 #if defined(LIBZT_IPV4)
@@ -56,10 +58,7 @@ struct netif;
 #endif
 #if defined(LIBZT_IPV6)
 #include "lwip/ip6_addr.h"
-	#define LWIP_NETIF_ADD_SIG struct netif *netif, void *state, netif_init_fn init, netif_input_fn input
 	#define LWIP_ETHIP6_OUTPUT_SIG struct netif *netif, struct pbuf *q, const ip6_addr_t *ip6addr
-	#define LWIP_ETHARP_OUTPUT_SIG struct netif *netif, struct pbuf *q, const ip6_addr_t *ipaddr
-	#define LWIP_NETIF_IP6_ADDR_SET_STATE_SIG struct netif* netif, s8_t addr_idx, u8_t state
 	#define LWIP_NETIF_CREATE_IP6_LINKLOCAL_ADDRESS_SIG struct netif *netif, u8_t from_mac_48bit
 #endif
 
@@ -109,7 +108,6 @@ struct netif;
 #endif            
 #if defined(LIBZT_IPV6)
 	extern "C" void nd6_tmr(void);
-	extern "C" void netif_ip6_addr_set_state(LWIP_NETIF_IP6_ADDR_SET_STATE_SIG);
 	extern "C" void netif_create_ip6_linklocal_address(LWIP_NETIF_CREATE_IP6_LINKLOCAL_ADDRESS_SIG);
 	extern "C" err_t _ethip6_output(LWIP_ETHIP6_OUTPUT_SIG);
 #endif
@@ -164,8 +162,9 @@ namespace ZeroTier {
 	
 	class SocketTap;
 	struct Connection;
+	struct TapFrame;
 
-	class lwIP
+	class lwIP final : public StackDriver
 	{
 	public:
 
@@ -175,30 +174,212 @@ namespace ZeroTier {
 		void lwip_init_interface(SocketTap *tap, const InetAddress &ip);
 
 		/*
-		 * Main stack loop
+		 * Removes an address from the tap's netif, aborting TCP connections bound to it
 		 */
-		void lwip_loop(SocketTap *tap);
+		void lwip_remove_interface_ip(SocketTap *tap, const InetAddress &ip);
 
 		/*
-		 * Packets from the ZeroTier virtual wire enter the stack here
+		 * Sets the MTU of the tap's netif
+		 */
+		void lwip_set_mtu(SocketTap *tap, unsigned int mtu);
+
+		/*
+		 * Removes the tap's netif, its IPv4 address is cleared beforehand so that netif_remove()
+		 * doesn't abort the TCP connections bound to it
+		 */
+		void lwip_remove_interface(SocketTap *tap);
+
+		/*
+		 * Points the callbacks of conn's pcb (and of those waiting to be accepted on it) at to
+		 */
+		void lwip_Rebind(Connection *conn, SocketTap *to);
+
+		/*
+		 * One pass of the stack's timers on behalf of the taps served by a StackThread, returns
+		 * how long (ms) the thread may sleep in Phy::poll() before the next pass is due
+		 */
+		unsigned long lwip_loop(std::vector<SocketTap*> &taps);
+
+		/*
+		 * Packets from the ZeroTier virtual wire enter the stack here, they're queued for the
+		 * stack thread which feeds them to lwIP on its next pass
 		 */
 		void lwip_rx(SocketTap *tap, const MAC &from,const MAC &to,unsigned int etherType,const void *data,unsigned int len);
+
+		/*
+		 * Zero-copy lwip_rx(), data is wrapped in a pbuf as-is and release(arg) is called once the
+		 * stack is done with it. Requires headroom writable bytes in front of data for the 
+		 * ethernet header, otherwise the frame is copied and released immediately
+		 */
+		void lwip_rx_ref(SocketTap *tap, const MAC &from,const MAC &to,unsigned int etherType,
+			void *data,unsigned int len,unsigned int headroom,void (*release)(void *),void *arg);
+
+		/*
+		 * Batched lwip_rx(), frames are queued under one lock acquisition
+		 */
+		void lwip_rx_batch(SocketTap *tap, const TapFrame *frames, unsigned int n);
 		
+		/*
+		 * Creates a stack-specific "socket" (a tcp_pcb or udp_pcb)
+		 */
 		int lwip_Socket(void **pcb, int socket_family, int socket_type, int protocol);
-		int lwip_Connect(Connection *conn, int fd, const struct sockaddr *addr, socklen_t addrlen);
+
+		/*
+		 * Connect to remote host via userspace network stack interface - Called from SocketTap
+		 */
+		int lwip_Connect(SocketTap *tap, Connection *conn, int fd, const struct sockaddr *addr, socklen_t addrlen);
+
+		/*
+		 * Bind to a userspace network stack interface - Called from SocketTap
+		 */
 		int lwip_Bind(SocketTap *tap, Connection *conn, int fd, const struct sockaddr *addr, socklen_t addrlen);
-		int lwip_Listen(SocketTap *tap, PhySocket *sock, PhySocket *rpcSock, void **uptr, struct listen_st *listen_rpc);
-		int lwip_Read(SocketTap *tap, PhySocket *sock, void **uptr, bool lwip_invoked);
-		int lwip_Write(SocketTap *tap, Connection *conn);
-		int lwip_Close(SocketTap *tap, PhySocket *sock, Connection *conn);
+
+		/*
+		 * Listen for incoming connections - Called from SocketTap
+		 */
+		int lwip_Listen(Connection *conn, int fd, int backlog);
+
+		/*
+		 * Accept an incoming connection - Called from SocketTap
+		 */
+		Connection* lwip_Accept(Connection *conn);
+
+		/*
+		 * Fills in the remote address of an accepted or connected Connection - Called from SocketTap
+		 */
+		void lwip_Peername(Connection *conn, struct sockaddr_storage *addr);
+
+		/*
+		 * Read from RX buffer to application - Called from SocketTap
+		 */
+		int lwip_Read(SocketTap *tap, PhySocket *sock, Connection *conn, bool stack_invoked);
+
+		/*
+		 * Write to userspace network stack - Called from SocketTap
+		 */
+		int lwip_Write(Connection *conn, void *data, ssize_t len);
+
+		/*
+		 * Close a Connection - Called from SocketTap
+		 */
+		int lwip_Close(Connection *conn);
+
+		/*
+		 * Fills in RTT, retransmits, etc. from conn's PCB
+		 */
+		void lwip_Stats(Connection *conn, struct zts_socket_stats *stats);
+
+		/*
+		 * Fills in the addresses and queue depths of conn's PCB
+		 */
+		void lwip_Describe(Connection *conn, struct zts_connection_info *info);
+
+		/*
+		 * lwIP's PCBs come from fixed pools (see lwipopts.h)
+		 */
+		void lwip_Limits(struct zts_socket_limits *limits);
+
+		/*
+		 * Sets the TOS of conn's PCB
+		 */
+		void lwip_SetTos(Connection *conn);
+
+		/*
+		 * Sets (or clears) keepalive on conn's PCB
+		 */
+		void lwip_SetKeepalive(Connection *conn);
+
+		/*
+		 * Applies TCP_NODELAY, TOS and keepalive as opts asks. Buffer sizes are ours alone, lwIP's
+		 * window is fixed at build time (TCP_WND)
+		 */
+		void lwip_ApplyOptions(Connection *conn, uint32_t opts);
+
+		/*
+		 * zts_ping() probes, ICMP (IPv4) through a raw PCB, UDP through a PCB of the session's own
+		 */
+		int lwip_PingOpen(SocketTap *tap, PingSession *s);
+		int lwip_Ping(PingSession *s, uint32_t seq);
+		void lwip_PingClose(PingSession *s);
 
 		static err_t nc_recved(void *arg, struct tcp_pcb *PCB, struct pbuf *p, err_t err);
 		static err_t nc_accept(void *arg, struct tcp_pcb *newPCB, err_t err);
 		static void nc_udp_recved(void * arg, struct udp_pcb * upcb, struct pbuf * p, const ip_addr_t * addr, u16_t port);
+		static u8_t nc_ping_recved(void *arg, struct raw_pcb *pcb, struct pbuf *p, const ip_addr_t *addr);
+		static void nc_ping_udp_recved(void *arg, struct udp_pcb *upcb, struct pbuf *p, const ip_addr_t *addr, u16_t port);
 		static void nc_err(void *arg, err_t err);
 		static err_t nc_poll(void* arg, struct tcp_pcb *PCB);
 		static err_t nc_sent(void *arg, struct tcp_pcb *PCB, u16_t len);
 		static err_t nc_connected(void *arg, struct tcp_pcb *PCB, err_t err);
+
+		/*
+		 * Delivers what the stack reported on Connections before the app accepted them (see
+		 * lwip_Accept())
+		 */
+		static void lwip_service_accepted(SocketTap *tap);
+
+		/*
+		 * Sends TX data which was held back by the egress shapers (see zts_set_network_rate(),
+		 * SO_MAX_PACING_RATE) once they allow it, returns how long (ms) until one next does,
+		 * 0 if nothing is held
+		 */
+		static unsigned long lwip_service_held(SocketTap *tap);
+
+		/****************************************************************************/
+		/* StackDriver                                                              */
+		/****************************************************************************/
+
+		int id() const { return ZTS_STACK_LWIP; }
+		bool init_interface(SocketTap *tap, const InetAddress &ip) {
+			lwip_init_interface(tap, ip);
+			return true;
+		}
+		void remove_interface_ip(SocketTap *tap, const InetAddress &ip) { lwip_remove_interface_ip(tap, ip); }
+		void set_mtu(SocketTap *tap, unsigned int mtu) { lwip_set_mtu(tap, mtu); }
+		void remove_interface(SocketTap *tap) { lwip_remove_interface(tap); }
+		// PCBs aren't tied to a netif, what they send is routed by address (see lwip_route_tap())
+		bool rebinds() const { return true; }
+		void Rebind(Connection *conn, SocketTap *to) { lwip_Rebind(conn, to); }
+		unsigned long loop(std::vector<SocketTap*> &taps) { return lwip_loop(taps); }
+		void rx(SocketTap *tap, const MAC &from,const MAC &to,unsigned int etherType,const void *data,unsigned int len) {
+			lwip_rx(tap, from, to, etherType, data, len);
+		}
+		void rx_ref(SocketTap *tap, const MAC &from,const MAC &to,unsigned int etherType,
+			void *data,unsigned int len,unsigned int headroom,void (*release)(void *),void *arg) {
+			lwip_rx_ref(tap, from, to, etherType, data, len, headroom, release, arg);
+		}
+		void rx_batch(SocketTap *tap, const TapFrame *frames, unsigned int n) { lwip_rx_batch(tap, frames, n); }
+		int Socket(Connection *conn);
+		void Discard(Connection *conn) { lwip_Close(conn); }
+		void Assign(SocketTap *tap, Connection *conn);
+		int Connect(SocketTap *tap, Connection *conn, int fd, const struct sockaddr *addr, socklen_t addrlen) {
+			return lwip_Connect(tap, conn, fd, addr, addrlen);
+		}
+		int SetLocalPort(Connection *conn, uint16_t port);
+		int Bind(SocketTap *tap, Connection *conn, int fd, const struct sockaddr *addr, socklen_t addrlen) {
+			return lwip_Bind(tap, conn, fd, addr, addrlen);
+		}
+		int Listen(Connection *conn, int fd, int backlog) { return lwip_Listen(conn, fd, backlog); }
+		Connection *Accept(Connection *conn) { return lwip_Accept(conn); }
+		void Peername(Connection *conn, struct sockaddr_storage *addr) { lwip_Peername(conn, addr); }
+		int Read(SocketTap *tap, PhySocket *sock, Connection *conn, bool stack_invoked) {
+			return lwip_Read(tap, sock, conn, stack_invoked);
+		}
+		int Write(Connection *conn, void *data, ssize_t len) { return lwip_Write(conn, data, len); }
+		int Close(Connection *conn);
+		void Stats(Connection *conn, struct zts_socket_stats *stats) { lwip_Stats(conn, stats); }
+		void Describe(Connection *conn, struct zts_connection_info *info) { lwip_Describe(conn, info); }
+		void Limits(struct zts_socket_limits *limits) { lwip_Limits(limits); }
+		void SetTos(Connection *conn) { lwip_SetTos(conn); }
+		void SetKeepalive(Connection *conn) { lwip_SetKeepalive(conn); }
+		void ApplyOptions(Connection *conn, uint32_t opts) { lwip_ApplyOptions(conn, opts); }
+		int PingOpen(SocketTap *tap, PingSession *s) { return lwip_PingOpen(tap, s); }
+		int Ping(PingSession *s, uint32_t seq) { return lwip_Ping(s, seq); }
+		void PingClose(PingSession *s) { lwip_PingClose(s); }
+
+	private:
+		// When lwIP's timers last ran, see lwip_loop()
+		uint64_t prev_tcp_time = 0, prev_discovery_time = 0, prev_reass_time = 0;
 	};
 } 
 
@@ -25,6 +25,10 @@
  */
 
 #include <ctime>
+#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <map>
 
 #include "pico_eth.h"
 #include "pico_stack.h"
@@ -35,12 +39,22 @@
 #include "pico_socket.h"
 #include "pico_device.h"
 #include "pico_ipv6.h"
+#include "pico_tcp.h"
+#include "pico_udp.h"
 
 #include "libzt.h"
 #include "Utilities.hpp"
 #include "SocketTap.hpp"
 #include "picoTCP.hpp"
 #include "RingBuffer.hpp"
+#include "ConnectionPool.hpp"
+#include "FdTable.hpp"
+#include "Epoll.hpp"
+#include "LatencyTrace.hpp"
+#include "Probes.hpp"
+#include "Ping.hpp"
+#include "PowerMode.hpp"
+#include "Clock.hpp"
 
 #include "Utils.hpp"
 #include "OSUtils.hpp"
@@ -81,6 +95,9 @@ struct pico_socket * pico_socket_accept(PICO_SOCKET_ACCEPT_SIG);
 
 namespace ZeroTier {
 
+	extern ConnectionPool connpool;
+	extern FdTable fdtable;
+
 	struct pico_device picodev;
 
 	bool picoTCP::pico_init_interface(SocketTap *tap, const InetAddress &ip)
@@ -131,182 +148,658 @@ namespace ZeroTier {
 		}
 		return false;
 	}
+
+	void picoTCP::pico_remove_interface_ip(SocketTap *tap, const InetAddress &ip)
+	{
+		if(!tap->picodev_initialized)
+			return;
+		char ipbuf[64];
+		if(ip.isV4()) {
+			struct pico_ip4 ipaddr;
+			ipaddr.addr = *((uint32_t *)ip.rawIpData());
+			if(pico_ipv4_link_del(&picodev, ipaddr) != 0)
+				DEBUG_ERROR("no such address %s", ip.toString(ipbuf));
+		}
+		if(ip.isV6()) {
+			struct pico_ip6 ipaddr;
+			memcpy(ipaddr.addr, ip.rawIpData(), 16);
+			if(pico_ipv6_link_del(&picodev, ipaddr) != 0)
+				DEBUG_ERROR("no such address %s", ip.toString(ipbuf));
+		}
+	}
+
+	void picoTCP::pico_set_mtu(SocketTap *tap, unsigned int mtu)
+	{
+		// Not yet set up, pico_init_interface() picks it up from tap->_mtu
+		if(tap->picodev_initialized)
+			picodev.mtu = mtu;
+	}
 	
-	void picoTCP::pico_loop(SocketTap *tap)
+	/*
+	 * Whether frames are waiting between the stack's layers, which only move on during a tick.
+	 * Those for one of our own addresses are turned around by the IP layer without ever
+	 * reaching pico_eth_send() (see pico_ipv4_frame_push()), onto an input queue which that
+	 * tick has already serviced
+	 */
+	static bool pico_frames_queued()
 	{
-		while(tap->_run)
-		{
-			tap->_phy.poll(ZT_PHY_POLL_INTERVAL);
-			pico_stack_tick();
-			//tap->Housekeeping();
+		static struct pico_protocol *protos[] = { 
+			&pico_proto_ipv4, &pico_proto_ipv6, &pico_proto_tcp, &pico_proto_udp };
+		for(size_t i=0; i<sizeof(protos) / sizeof(protos[0]); i++) {
+			if(protos[i]->q_in->frames || protos[i]->q_out->frames)
+				return true;
+		}
+		return false;
+	}
+
+	unsigned long picoTCP::pico_loop(std::vector<SocketTap*> &taps)
+	{
+		unsigned long held = 0;
+		for(size_t i=0; i<taps.size(); i++)
+			taps[i]->_pico_rx_defer = true;
+		for(size_t i=0; i<taps.size(); i++) {
+			pico_service_direct(taps[i]);
+			pico_service_accepted(taps[i]);
+			pico_service_rx(taps[i]);
+			unsigned long t = pico_service_held(taps[i]);
+			if(t && (!held || t < held))
+				held = t;
+			t = pico_service_impaired(taps[i]);
+			if(t && (!held || t < held))
+				held = t;
+		}
+		std::chrono::steady_clock::time_point tick_start = std::chrono::steady_clock::now();
+		pico_stack_tick();
+		for(size_t i=0; i<taps.size(); i++)
+			pico_flush_rx(taps[i]);
+		uint64_t tick_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - tick_start).count();
+		// One tick serves every tap on this thread, each of them is charged for all of it
+		for(size_t i=0; i<taps.size(); i++) {
+			stat_add(taps[i]->_stats.stack_ticks, 1);
+			stat_add(taps[i]->_stats.stack_tick_ns, tick_ns);
+			stat_max(taps[i]->_stats.stack_tick_max_ns, tick_ns);
+		}
+		// Sleep until the stack's next timer is due unless there's work queued up already, new
+		// frames or app activity wake the loop early (see pico_rx(), SocketTap::WakeDirect())
+		int timeout = pico_timers_next_ms();
+		if(timeout < 0 || timeout > (long)PowerMode::maxInterval())
+			timeout = PowerMode::maxInterval();
+		if(held && held < (unsigned long)timeout)
+			timeout = (int)held;
+		// Traffic between sockets of this process doesn't wait for a timer to be delivered
+		if(pico_frames_queued())
+			timeout = 0;
+		StackThread::Phase _p(ZTS_STACK_PHASE_HOUSEKEEPING);
+		for(size_t i=0; i<taps.size(); i++) {
+			taps[i]->ServiceOptions();
+			taps[i]->ServiceClosing();
+			taps[i]->Reap();
+			taps[i]->Housekeeping();
+			if(taps[i]->_pico_frame_rxq.count() || taps[i]->_direct_pending
+				|| !taps[i]->_pico_rx_backlog.empty())
+				timeout = 0;
+		}
+		return timeout;
+	}
+
+	/*
+	 * Flush as much of RXbuf to the app's end of the socketpair as it will take, both contiguous
+	 * regions in a single (non-blocking, like Phy::streamSend) sendmsg() call
+	 */
+	static int pico_flush_rxbuf(SocketTap *tap, Connection *conn)
+	{
+		struct iovec iov[2];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = conn->RXbuf->readable_iov(iov);
+		int n = 0;
+		if(msg.msg_iovlen) {
+			n = sendmsg(conn->sdk_fd, &msg, MSG_DONTWAIT);
+			if(n > 0) {
+				conn->RXbuf->consume(n);
+				conn->rx_mark.consumed(conn->RXbuf->consumed(), ZTS_LATENCY_RX_BUF);
+				if(!conn->RXbuf->count())
+					ZT_PROBE1(rxbuf_empty, conn);
+			}
+		}
+		tap->_phy.setNotifyWritable(conn->sock, conn->RXbuf->count() > 0);
+		return n;
+	}
+
+	size_t picoTCP::pico_deliver_rx(SocketTap *tap, Connection *conn)
+	{
+		size_t delivered = 0;
+		for(;;) {
+			int n = pico_flush_rxbuf(tap, conn);
+			if(n > 0)
+				delivered += n;
+			if(!conn->rx_stalled
+				|| conn->RXbuf->count() > conn->RXbuf->getCapacity() * ZT_TCP_RX_LOW_WATER / 100)
+				break;
+			ProfiledMutex::Lock _l(tap->_tcpconns_m); // see pico_Close()
+			if(!conn->picosock || !conn->rx_stalled.exchange(false))
+				break;
+			pico_cb_tcp_read(tap, conn->picosock);
+		}
+		return delivered;
+	}
+
+	void picoTCP::pico_flush_rx(SocketTap *tap)
+	{
+		tap->_pico_rx_defer = false;
+		if(tap->_pico_rx_flush.empty())
+			return;
+		std::vector<Connection*> flush;
+		flush.swap(tap->_pico_rx_flush);
+		for(size_t i=0; i<flush.size(); i++) {
+			Connection *conn = flush[i];
+			conn->rx_flush = false;
+			if(conn->sdk_fd < 0 || !conn->sock)
+				continue;
+			// Readiness was reported as the data came in, but only now is it in the socketpair
+			if(pico_deliver_rx(tap, conn))
+				epoll_notify(conn);
 		}
 	}
 
 	// from stack socket to app socket
 	void picoTCP::pico_cb_tcp_read(ZeroTier::SocketTap *tap, struct pico_socket *s)
 	{
-		Connection *conn = (Connection*)((ConnectionPair*)(s->priv))->conn;
-		Mutex::Lock _l(conn->_rx_m);
-		
+		// priv is gone once the socket has been detached (see pico_detach())
+		ConnectionPair *pair = (ConnectionPair*)(s->priv);
+		Connection *conn = pair ? (Connection*)pair->conn : NULL;
+		// RXbuf is SPSC, no need to take conn->_rx_m here
 		if(!conn || !tap) {
 			DEBUG_ERROR("invalid tap or conn");
 			handle_general_failure();
 			return;
 		}
 
-		int r, n;				
+		int r = 0;
 		uint16_t port = 0;
 		union {
 			struct pico_ip4 ip4;
 			struct pico_ip6 ip6;
 		} peer;
+		size_t budget = ZT_TCP_RX_QUANTUM;
+		if(conn->rx_timestamp && s->rx_stamp)
+			conn->rx_stamp = s->rx_stamp;
 
 		do {
-			n = 0;
-			//DEBUG_INFO("RXbuf->count() = %d", conn->RXbuf->count());
-			int avail = ZT_TCP_RX_BUF_SZ - conn->RXbuf->count();
-			if(avail) {
-
-				r = pico_socket_recvfrom(s, conn->RXbuf->get_buf(), ZT_STACK_SOCKET_RD_MAX, 
-					(void *)&peer.ip4.addr, &port);
-				
-				conn->tot += r;
-
-				if (r > 0)
-				{
+			ring_span<unsigned char> span[2];
+			// Direct I/O has no socketpair to drain into, so it may use all of RXbuf
+			size_t queued = conn->RXbuf->count(), cap = conn->RXbuf->getCapacity();
+			size_t limit = conn->direct ? cap : cap * ZT_TCP_RX_HIGH_WATER / 100;
+			if(queued >= limit || !conn->RXbuf->writable_span(span)) {
+				// The app hasn't caught up yet, whatever is left stays in the stack until
+				// directRead() or pico_Read() has us try again
+				if(!conn->rx_stalled)
+					ZT_PROBE2(rxbuf_full, conn, queued);
+				conn->rx_stalled = true;
+				break;
+			}
+			size_t room = std::min(limit - queued, budget);
+			// Fill the free space (up to limit) the stack has data for. If it wraps around the
+			// end of RXbuf, carry on into the second region so we never straddle the boundary
+			for(int i=0; i<2 && span[i].len && room; i++) {
+				int want = (int)std::min(span[i].len, room);
+				room -= want;
+				r = pico_socket_recvfrom(s, span[i].ptr, want, (void *)&peer.ip4.addr, &port);
+				if(r > 0) {
+					budget -= r;
+					stat_add(conn->stats.bytes_in, r);
 					conn->RXbuf->produce(r);
-					//DEBUG_INFO("RXbuf->count() = %d", conn->RXbuf->count());
-					n = tap->_phy.streamSend(conn->sock, conn->RXbuf->get_buf(), r);
-
-					if(n>0)
-						conn->RXbuf->consume(n);
-					//DEBUG_INFO("pico_recv = %d, streamSend = %d, rxsz = %d, tot = %d", r, n, conn->RXbuf->count(), conn->tot);
-
-					//DEBUG_TRANS("[ TCP RX <- STACK] :: conn = %p, len = %d", conn, n);
-				}
-
-				if(conn->RXbuf->count() == 0) {
-					tap->_phy.setNotifyWritable(conn->sock, false);
+					conn->rx_mark.produced(conn->RXbuf->produced());
 				}
-				else {
-					tap->_phy.setNotifyWritable(conn->sock, true);	
-				}				
-			}
-			else {
-				//tap->_phy.setNotifyWritable(conn->sock, false);
-				DEBUG_ERROR("not enough space left on I/O RX buffer for pico_socket(%p)", s);
-				handle_general_failure();
+				if(r < want)
+					break;
 			}
+			stat_max(conn->stats.rxbuf_hwm, conn->RXbuf->count());
+			// During a pass everything read is delivered in one go at the end of it, see pico_flush_rx()
+			if(!conn->direct && !tap->_pico_rx_defer)
+				pico_flush_rxbuf(tap, conn);
+			//DEBUG_TRANS("[ TCP RX <- STACK] :: conn = %p, len = %d", conn, n);
+		}
+		while(r > 0 && budget);
+		if(!conn->direct && tap->_pico_rx_defer && !conn->rx_flush) {
+			conn->rx_flush = true;
+			tap->_pico_rx_flush.push_back(conn);
+		}
+		// The stack may have more, the rest of the tap's connections go first
+		if(r > 0 && !budget && !conn->rx_backlog) {
+			conn->rx_backlog = true;
+			tap->_pico_rx_backlog.push_back(std::make_pair(conn, s));
 		}
-		while(r > 0);
 	}
 
 	// from stack socket to app socket
-	void picoTCP::pico_cb_udp_read(SocketTap *tap, struct pico_socket *s)
+	/*
+	 * Moves queued datagrams into the app's end of the socketpair until it's full, the rest
+	 * follow once it becomes writable again (see pico_Read())
+	 */
+	static void pico_flush_dgrams(SocketTap *tap, Connection *conn)
 	{
-		/*
-		DEBUG_INFO();
-		Connection *conn = (Connection*)((ConnectionPair*)(s->priv))->conn;
-		Mutex::Lock _l(conn->_rx_m);
-		if(conn) {
+		DatagramQueue *q = conn->rxq;
+		if(!q)
+			return;
+		while(q->count()) {
+			size_t sz;
+			const unsigned char *d = q->front(&sz);
+			if(send(conn->sdk_fd, d, sz, MSG_DONTWAIT) < 0) {
+				if(errno == EAGAIN || errno == EWOULDBLOCK)
+					break;
+				DEBUG_ERROR("unable to deliver datagram, app_fd=%d, errno=%d", conn->app_fd, errno);
+				q->drops++;
+			}
+			q->pop();
+		}
+		if(conn->sock)
+			tap->_phy.setNotifyWritable(conn->sock, q->count() > 0);
+	}
 
+	void picoTCP::pico_cb_udp_read(SocketTap *tap, struct pico_socket *s)
+	{
+		// priv is gone once the socket has been detached (see pico_detach())
+		ConnectionPair *pair = (ConnectionPair*)(s->priv);
+		Connection *conn = pair ? (Connection*)pair->conn : NULL;
+		if(!conn || !tap) {
+			DEBUG_ERROR("invalid tap or conn");
+			handle_general_failure();
+			return;
+		}
+		// (Re)size the queue while nothing is in it
+		size_t depth = conn->rxq_depth;
+		if(!conn->rxq || (conn->rxq->capacity() != depth && !conn->rxq->count())) {
+			delete conn->rxq;
+			conn->rxq = new DatagramQueue(depth, ZT_SDK_MTU, conn->rxq_drops);
+		}
+		DatagramQueue *q = conn->rxq;
+		bool drop_oldest = conn->rxq_drop_oldest;
+		for(;;) {
 			uint16_t port = 0;
 			union {
 				struct pico_ip4 ip4;
 				struct pico_ip6 ip6;
 			} peer;
-
-			char tmpbuf[ZT_SDK_MTU];
-			unsigned char *addr_pos, *sz_pos, *payload_pos;
-			struct sockaddr_in addr_in;
-			addr_in.sin_addr.s_addr = peer.ip4.addr;
-			addr_in.sin_port = port;
-			
-			// RX
-			int r = pico_socket_recvfrom(s, tmpbuf, ZT_SDK_MTU, (void *)&peer.ip4.addr, &port);
-			//DEBUG_FLOW(" [  RXBUF <- STACK] Receiving (%d) from stack, copying to receving buffer", r);
-
-			if(conn->rxsz == ZT_UDP_RX_BUF_SZ) { // if UDP buffer full
-				//DEBUG_FLOW(" [  RXBUF <- STACK] UDP RX buffer full. Discarding oldest payload segment");
-				memmove(conn->rxbuf, conn->rxbuf + ZT_SDK_MTU, ZT_UDP_RX_BUF_SZ - ZT_SDK_MTU);
-				addr_pos = conn->rxbuf + (ZT_UDP_RX_BUF_SZ - ZT_SDK_MTU); // TODO:
-				sz_pos = addr_pos + sizeof(struct sockaddr_storage);
-				conn->rxsz -= ZT_SDK_MTU;
+			// Datagrams are received straight into the queue
+			struct DatagramHeader *hdr;
+			unsigned char *payload = q->reserve(&hdr, drop_oldest);
+			unsigned char discard[ZT_SDK_MTU];
+			struct pico_msginfo info;
+			info.rx_stamp = 0;
+			int r = pico_socket_recvfrom_extended(s, payload ? payload : discard, ZT_SDK_MTU, &peer, &port, 
+				conn->rx_timestamp ? &info : NULL);
+			if(r < 0) {
+				DEBUG_ERROR("unable to read from picosock=%p, pico_err=%d", s, pico_err);
+				break;
+			}
+			if(r == 0)
+				break;
+			if(!payload) {
+				q->drops++;
+				continue;
+			}
+			// Both picoTCP and sockaddr keep addresses and ports in network byte order
+			memset(hdr, 0, sizeof(*hdr));
+			if(conn->socket_family == AF_INET6) {
+				hdr->addrlen = sizeof(struct sockaddr_in6);
+				hdr->addr.in6.sin6_family = AF_INET6;
+				hdr->addr.in6.sin6_port = port;
+				memcpy(&hdr->addr.in6.sin6_addr, peer.ip6.addr, sizeof(peer.ip6.addr));
 			}
 			else {
-				addr_pos = conn->rxbuf + conn->rxsz; // where we'll prepend the size of the address
-				sz_pos = addr_pos + sizeof(struct sockaddr_storage);
+				hdr->addrlen = sizeof(struct sockaddr_in);
+				hdr->addr.in4.sin_family = AF_INET;
+				hdr->addr.in4.sin_port = port;
+				hdr->addr.in4.sin_addr.s_addr = peer.ip4.addr;
 			}
-			payload_pos = addr_pos + sizeof(struct sockaddr_storage) + sizeof(r);
-			memcpy(addr_pos, &addr_in, sizeof(struct sockaddr_storage));
-			memcpy(payload_pos, tmpbuf, r); // write payload to app's socket
+			hdr->rx_stamp = info.rx_stamp;
+			q->commit(r);
+			stat_add(conn->stats.bytes_in, r);
+			// Hand datagrams over as we go so the queue only fills when the app falls behind
+			pico_flush_dgrams(tap, conn);
+		}
+	}
 
-			// Adjust buffer size
-			if(r) {
-				conn->rxsz += ZT_SDK_MTU;
-				memcpy(sz_pos, &r, sizeof(r));
-			}
-			if (r < 0) {
-				DEBUG_ERROR("unable to read from picosock=%p", s);
-				handle_general_failure();
-			} 
-			tap->_rx_buf_m.unlock(); 
+	/*
+	 * Sends one datagram which the app wrote to its end of the socketpair (DatagramHeader
+	 * followed by the payload), returns the payload length sent or -1
+	 */
+	static int pico_write_dgram(Connection *conn, const void *data, ssize_t len)
+	{
+		struct DatagramHeader hdr;
+		if(len < (ssize_t)sizeof(hdr)) {
+			DEBUG_ERROR("datagram too short (len=%d)", len);
+			return -1;
+		}
+		memcpy(&hdr, data, sizeof(hdr));
+		const unsigned char *payload = (const unsigned char *)data + sizeof(hdr);
+		int plen = (int)(len - sizeof(hdr));
+		int r = -1;
+		if(!hdr.addrlen) {
+			r = pico_socket_write(conn->picosock, payload, plen);
+		}
+		else if(hdr.addr.sa.sa_family == AF_INET) {
+			struct pico_ip4 dst;
+			dst.addr = hdr.addr.in4.sin_addr.s_addr;
+			r = pico_socket_sendto(conn->picosock, payload, plen, &dst, hdr.addr.in4.sin_port);
+		}
+		else if(hdr.addr.sa.sa_family == AF_INET6) {
+			struct pico_ip6 dst;
+			memcpy(dst.addr, &hdr.addr.in6.sin6_addr, sizeof(dst.addr));
+			r = pico_socket_sendto(conn->picosock, payload, plen, &dst, hdr.addr.in6.sin6_port);
+		}
+		if(r < 0) {
+			DEBUG_ERROR("unable to send datagram, picosock=%p, pico_err=%d", conn->picosock, pico_err);
+			return r;
+		}
+		stat_add(conn->stats.bytes_out, r);
+		conn->tap->txCharge(conn, r);
+		// Over its rate the next datagram waits in the socketpair until pico_service_held()
+		if(conn->sock && !conn->direct && !conn->tx_paused && !conn->tap->txAllowance(conn)) {
+			conn->tx_paused = true;
+			conn->tap->_phy.setNotifyReadable(conn->sock, false);
+			conn->tap->_tx_held = true;
+		}
+		return r;
+	}
 
-			if(r)
-				tap->phyOnUnixWritable(conn->sock, NULL, true);
-			//DEBUG_EXTRA(" Copied onto rxbuf (%d) from stack socket", r);
+	/*
+	 * How much longer (ms) the data queued in conn's TXbuf should be held back from the stack,
+	 * 0 if it should be sent now (see ZT_SO_TCP_COALESCE_BYTES, TCP_CORK)
+	 */
+	static unsigned long pico_tx_hold_ms(Connection *conn, uint64_t now)
+	{
+		size_t queued = conn->TXbuf->count();
+		// Nothing is held back from in front of a zero-copy send
+		if(!queued || conn->socket_type != SOCK_STREAM || conn->zc_pending)
+			return 0;
+		size_t limit;
+		uint64_t delay;
+		if(conn->tx_cork) {
+			limit = ZT_SDK_MTU;
+			delay = ZT_TCP_CORK_MAX_DELAY;
+		}
+		else if(conn->tx_coalesce_bytes > 0) {
+			limit = conn->tx_coalesce_bytes;
+			delay = conn->tx_coalesce_ms;
+		}
+		else
+			return 0;
+		// The hold starts the first time we see data queued (reset once TXbuf is drained)
+		if(!conn->tx_hold_ts)
+			conn->tx_hold_ts = now;
+		uint64_t waited = now - conn->tx_hold_ts;
+		if(queued >= limit || waited >= delay)
+			return 0;
+		return (unsigned long)(delay - waited);
+	}
+
+	/*
+	 * Stops reading conn's socketpair once TXbuf passes its high-water mark (or anything had
+	 * to be spilled) and resumes once the stack has taken it down to the low-water mark
+	 */
+	static void pico_tx_flow(Connection *conn)
+	{
+		if(!conn->sock || conn->direct) // direct I/O doesn't pass through the socketpair
 			return;
+		size_t queued = conn->TXbuf->count(), cap = conn->TXbuf->getCapacity();
+		if(!conn->tx_paused && (conn->tx_spill.size() || queued >= cap * ZT_TCP_TX_HIGH_WATER / 100)) {
+			conn->tx_paused = true;
+			conn->tap->_phy.setNotifyReadable(conn->sock, false);
+			ZT_PROBE2(txbuf_full, conn, queued);
 		}
-		*/
+		else if(conn->tx_paused && !conn->tx_spill.size() && queued <= cap * ZT_TCP_TX_LOW_WATER / 100) {
+			conn->tx_paused = false;
+			conn->tap->_phy.setNotifyReadable(conn->sock, true);
+			ZT_PROBE2(txbuf_resume, conn, queued);
+		}
+	}
+
+	/*
+	 * Moves spilled bytes (see pico_Write()) into TXbuf as room allows
+	 */
+	static size_t pico_unspill(Connection *conn)
+	{
+		if(!conn->tx_spill.size())
+			return 0;
+		size_t w = conn->TXbuf->write(conn->tx_spill.data(), conn->tx_spill.size());
+		conn->tx_spill.erase(conn->tx_spill.begin(), conn->tx_spill.begin() + w);
+		return w;
+	}
+
+	/*
+	 * Hand queued zero-copy sends (see zts_send_zc()) to the stack the same way as TXbuf, each
+	 * one's cb is called as soon as the stack has taken the last of it. TXbuf must be empty, no
+	 * more than allow bytes are taken (see SocketTap::txAllowance())
+	 */
+	static int pico_drain_zc(Connection *conn, size_t &allow)
+	{
+		int tot = 0;
+		while(conn->zc_pending) {
+			Connection::zc_send *zc;
+			{
+				// Only this thread takes sends off zc_q, the front one stays put until then
+				Mutex::Lock _l(conn->_zc_m);
+				zc = &conn->zc_q.front();
+			}
+			while(zc->off < zc->len) {
+				if(!allow) {
+					conn->tap->_tx_held = true;
+					return tot;
+				}
+				int r, max_write_len = (int)std::min(std::min(zc->len - zc->off, allow), (size_t)ZT_STACK_SOCKET_WR_MAX);
+				if((r = pico_socket_write(conn->picosock, (void*)(zc->buf + zc->off), max_write_len)) < 0) {
+					DEBUG_ERROR("unable to write to picosock=%p, r=%d", conn->picosock, r);
+					return -1;
+				}
+				zc->off += r;
+				allow -= r;
+				conn->tap->txCharge(conn, r);
+				stat_add(conn->stats.bytes_out, r);
+				tot += r;
+				if(r < max_write_len)
+					return tot;
+			}
+			Connection::zc_send done = *zc;
+			{
+				Mutex::Lock _l(conn->_zc_m);
+				conn->zc_q.pop_front();
+				conn->zc_pending--;
+			}
+			if(done.cb)
+				done.cb(conn->app_fd, done.tag, (ssize_t)done.len, done.arg);
+		}
+		return tot;
+	}
+
+	/*
+	 * Hand TXbuf to the stack until it's empty or the stack won't take any more (its send
+	 * buffer or window is full), then whatever zero-copy sends are queued behind it. Returns
+	 * the number of bytes taken or -1 on error
+	 */
+	static int pico_drain_txbuf(Connection *conn)
+	{
+		int tot = 0;
+		ring_span<unsigned char> span[2];
+		size_t allow = conn->tap->txAllowance(conn);
+		pico_unspill(conn);
+		while(conn->TXbuf->readable_span(span)) {
+			// Over its rate the rest waits in TXbuf, pico_service_held() picks it up again
+			if(!allow) {
+				conn->tap->_tx_held = true;
+				break;
+			}
+			int r, max_write_len = (int)std::min(std::min(span[0].len, allow), (size_t)ZT_STACK_SOCKET_WR_MAX);
+			if((r = pico_socket_write(conn->picosock, span[0].ptr, max_write_len)) < 0) {
+				DEBUG_ERROR("unable to write to picosock=%p, r=%d", conn->picosock, r);
+				return -1;
+			}
+			if(r > 0) {
+				conn->TXbuf->consume(r);
+				conn->tx_mark.consumed(conn->TXbuf->consumed(), ZTS_LATENCY_TX_BUF);
+				stat_add(conn->stats.bytes_out, r);
+				allow -= r;
+				conn->tap->txCharge(conn, r);
+				tot += r;
+			}
+			// A short (or zero length) write means picoTCP's send buffer is full, we'll get
+			// PICO_SOCK_EV_WR once there's room again
+			if(r < max_write_len)
+				break;
+			pico_unspill(conn);
+		}
+		if(!conn->TXbuf->count()) {
+			if(tot)
+				ZT_PROBE1(txbuf_empty, conn);
+			conn->tx_hold_ts = 0;
+			int zc = pico_drain_zc(conn, allow);
+			if(zc < 0)
+				return -1;
+			tot += zc;
+		}
+		pico_tx_flow(conn);
+		return tot;
 	}
 
 	void picoTCP::pico_cb_tcp_write(SocketTap *tap, struct pico_socket *s)
 	{
-		Connection *conn = (Connection*)((ConnectionPair*)(s->priv))->conn;
-		Mutex::Lock _l(conn->_tx_m);
+		// priv is gone once the socket has been detached (see pico_detach())
+		ConnectionPair *pair = (ConnectionPair*)(s->priv);
+		Connection *conn = pair ? (Connection*)pair->conn : NULL;
+		// TXbuf is SPSC, no need to take conn->_tx_m here
 		if(!conn) {
 			DEBUG_ERROR("invalid connection");
 			handle_general_failure();
 			return;
 		}
-		int txsz = conn->TXbuf->count();
-		if(txsz <= 0)
-			return;
-		//DEBUG_INFO("TXbuf->count() = %d", conn->TXbuf->count());
-
-		int r, max_write_len = std::min(std::min(txsz, ZT_SDK_MTU),ZT_STACK_SOCKET_WR_MAX);
-		if((r = pico_socket_write(conn->picosock, conn->TXbuf->get_buf(), max_write_len)) < 0) {
-			DEBUG_ERROR("unable to write to picosock=%p, r=%d", conn->picosock, r);
-			handle_general_failure();
+		if(pico_tx_hold_ms(conn, Clock::cached())) {
+			tap->_tx_held = true;
 			return;
 		}
-		if(conn->socket_type == SOCK_STREAM) {
-			//DEBUG_TRANS("[ TCP TX -> STACK] :: conn = %p, len = %d", conn, r);
+		if(pico_drain_txbuf(conn) < 0)
+			handle_general_failure();
+	}
+
+	unsigned long picoTCP::pico_service_held(SocketTap *tap)
+	{
+		if(!tap->_tx_held.exchange(false))
+			return 0;
+		uint64_t now = Clock::cached();
+		unsigned long next = 0;
+		std::vector<Connection*> serviced;
+		{
+			ProfiledMutex::Lock _l(tap->_tcpconns_m);
+			for(size_t i=0; i<tap->_Connections.size(); i++) {
+				Connection *conn = tap->_Connections[i];
+				if(!conn->picosock || conn->closure_ts != -1)
+					continue;
+				// Datagram sockets paused by the shaper just start being read again
+				if(conn->socket_type == SOCK_DGRAM) {
+					if(!conn->tx_paused)
+						continue;
+					unsigned long shaped = tap->txShapedMs(conn);
+					if(shaped) {
+						if(!next || shaped < next)
+							next = shaped;
+						continue;
+					}
+					conn->tx_paused = false;
+					tap->_phy.setNotifyReadable(conn->sock, true);
+					continue;
+				}
+				if(!conn->TXbuf->count() && !conn->zc_pending)
+					continue;
+				unsigned long hold = std::max(pico_tx_hold_ms(conn, now), tap->txShapedMs(conn));
+				if(hold) {
+					if(!next || hold < next)
+						next = hold;
+					continue;
+				}
+				if(pico_drain_txbuf(conn) > 0)
+					serviced.push_back(conn);
+			}
 		}
-		if(conn->socket_type == SOCK_DGRAM) {
-			//DEBUG_TRANS("[ UDP TX -> STACK] :: conn = %p, len = %d", conn, r);
+		if(next)
+			tap->_tx_held = true;
+		// Connections are only recycled from this thread so these are still valid
+		for(size_t i=0; i<serviced.size(); i++) {
+			if(serviced[i]->direct)
+				serviced[i]->notify_state();
+			epoll_notify(serviced[i]);
 		}
-		if(r == 0) {
-			// This is a peciliarity of the picoTCP network stack, if we receive no error code, and the size of 
-			// the byte stream written is 0, this is an indication that the buffer for this pico_socket is too small
-			// DEBUG_ERROR("pico_socket buffer is too small (adjust ZT_STACK_SOCKET_TX_SZ, ZT_STACK_SOCKET_RX_SZ)");
-			// handle_general_failure(); 
+		return next;
+	}
+
+	/*
+	 * Cuts conn (and any shards sharing s) loose from s, picoTCP doesn't report on them again
+	 * and frees s whenever it's done with it
+	 */
+	static void pico_detach(Connection *conn, struct pico_socket *s)
+	{
+		ConnectionPair *pair = (ConnectionPair*)(s->priv);
+		if(pair) {
+			for(size_t i=0; i<pair->shards.size(); i++) {
+				if(pair->shards[i]->picosock == s)
+					pair->shards[i]->picosock = NULL;
+			}
+			delete pair;
+			s->priv = NULL;
 		}
-		if(r>0)
-			conn->TXbuf->consume(r);
+		if(conn->picosock == s)
+			conn->picosock = NULL;
+		// Nothing more of them is going to be sent
+		conn->zc_fail(conn->state == PICO_ERR_ECONNRESET ? ECONNRESET : EPIPE);
+	}
+
+	/*
+	 * Picks the listening Connection which gets a new inbound connection, for a pico_socket
+	 * shared through SO_REUSEPORT that's one of its shards by hash of the remote address and
+	 * port (so each peer's connections spread evenly), NULL if none of them is listening
+	 */
+	static Connection *pico_pick_listener(ConnectionPair *pair, const void *peer, size_t peerlen, uint16_t port)
+	{
+		if(pair->shards.empty())
+			return pair->conn->state == ZT_SOCK_STATE_LISTENING ? pair->conn : NULL;
+		size_t n = 0;
+		for(size_t i=0; i<pair->shards.size(); i++)
+			n += pair->shards[i]->state == ZT_SOCK_STATE_LISTENING;
+		if(!n)
+			return NULL;
+		// FNV-1a
+		uint32_t h = 2166136261u;
+		const unsigned char *b = (const unsigned char *)peer;
+		for(size_t i=0; i<peerlen; i++)
+			h = (h ^ b[i]) * 16777619u;
+		h = ((h ^ (port & 0xff)) * 16777619u ^ (port >> 8)) * 16777619u;
+		size_t k = h % n;
+		for(size_t i=0; i<pair->shards.size(); i++) {
+			if(pair->shards[i]->state == ZT_SOCK_STATE_LISTENING && !k--)
+				return pair->shards[i];
+		}
+		return NULL;
 	}
 
 	void picoTCP::pico_cb_socket_activity(uint16_t ev, struct pico_socket *s)
 	{
+		StackThread::Phase _p(ZTS_STACK_PHASE_CALLBACK);
 		if(!(SocketTap*)((ConnectionPair*)(s->priv)))
 			return;
 		SocketTap *tap = (SocketTap*)((ConnectionPair*)(s->priv))->tap;
 		Connection *conn = (Connection*)((ConnectionPair*)(s->priv))->conn;
+		if(tap && !conn) {
+			// Not accepted by the app yet, this is replayed once it is (see pico_service_accepted())
+			((ConnectionPair*)(s->priv))->pending_ev |= ev;
+			return;
+		}
 		if(!tap || !conn) {
 			DEBUG_ERROR("invalid tap or conn");
 			handle_general_failure();
 			return;
 		}
+		ZT_PROBE2(socket_event, conn, ev);
 		int err = 0;
 		if(!conn) {
 			DEBUG_ERROR("invalid connection");
@@ -318,69 +811,83 @@ namespace ZeroTier {
 		// has been established, or on a listening socket, indicating that a call to pico socket accept
 		// may now be issued in order to accept the incoming connection from a remote host.
 		if (ev & PICO_SOCK_EV_CONN) {
-			if(conn->state == ZT_SOCK_STATE_LISTENING)
+			ConnectionPair *pair = (ConnectionPair*)(s->priv);
+			if(conn->state == ZT_SOCK_STATE_LISTENING || pair->shards.size())
 			{
-				Mutex::Lock _l(tap->_tcpconns_m);
-				uint32_t peer;
-				uint16_t port;
-				struct pico_socket *client_psock = pico_socket_accept(s, &peer, &port);
-				if(!client_psock) {
-					DEBUG_ERROR("pico_err=%s, picosock=%p", beautify_pico_error(pico_err), s);
-					return;
-				}			
-
-				// Create a new Connection and add it to the queue,
-				//   some time in the future a call to zts_multiplex_accept() will pick up 
-				//   this new connection, add it to the connection list and return its
-				//   Connection->sock to the application
-
-				Connection *newConn = new Connection();
-				newConn->socket_type = SOCK_STREAM;
-				newConn->picosock = client_psock;
-				newConn->tap = tap;
-				newConn->picosock->priv = new ConnectionPair(tap,newConn);
-				tap->_Connections.push_back(newConn);
-				conn->_AcceptedConnections.push(newConn);
-
-
-				int value = 1;
-				pico_socket_setoption(newConn->picosock, PICO_TCP_NODELAY, &value);
-				
-				if(ZT_SOCK_BEHAVIOR_LINGER) {
-					int linger_time_ms = ZT_SOCK_BEHAVIOR_LINGER_TIME;
-					int t_err = 0;
-					if((t_err = pico_socket_setoption(newConn->picosock, PICO_SOCKET_OPT_LINGER, &linger_time_ms)) < 0)
-						DEBUG_ERROR("unable to set LINGER size, err = %d, pico_err = %d, app_fd=%d, sdk_fd=%d", t_err, pico_err, conn->app_fd, conn->sdk_fd);
-				}
-/*
-				linger_time_ms = 0;
-				if((t_err = pico_socket_getoption(newConn->picosock, PICO_SOCKET_OPT_LINGER, &linger_time_ms)) < 0)
-				   DEBUG_ERROR("unable to set LINGER size, err = %d, pico_err = %d", t_err, pico_err);
-				DEBUG_TEST("getting linger = %d", linger_time_ms);
-*/
-				// For I/O loop participation and referencing the PhySocket's parent Connection in callbacks
-				newConn->sock = tap->_phy.wrapSocket(newConn->sdk_fd, newConn);
-				//DEBUG_ERROR("sock->fd = %d", tap->_phy.getDescriptor(newConn->sock));      
+				Connection *listener;
+				{
+					ProfiledMutex::Lock _l(tap->_tcpconns_m);
+					union {
+						struct pico_ip4 ip4;
+						struct pico_ip6 ip6;
+					} peer;
+					uint16_t port;
+					struct pico_socket *client_psock = pico_socket_accept(s, &peer, &port);
+					if(!client_psock) {
+						DEBUG_ERROR("pico_err=%s, picosock=%p", beautify_pico_error(pico_err), s);
+						return;
+					}			
+					listener = pico_pick_listener(pair, &peer, 
+						conn->socket_family == AF_INET6 ? sizeof(peer.ip6) : sizeof(peer.ip4), port);
 
+					// The app is this far behind already, refuse rather than let a burst of inbound
+					// connections pile up. The handshake has completed by now so the peer sees the
+					// connection closed rather than refused
+					if(!listener || listener->_AcceptedCount >= listener->backlog) {
+						client_psock->priv = NULL; // it's a clone of the listener, don't let it speak for it
+						pico_socket_close(client_psock);
+						stat_add((listener ? listener : conn)->stats.accept_overflows, 1);
+						return;
+					}
+					// Or one peer is having too much of the network (see zts_set_admission_limits())
+					int admit = tap->_admission.connAdmit(&peer, 
+						conn->socket_family == AF_INET6 ? sizeof(peer.ip6) : sizeof(peer.ip4));
+					if(admit < 0) {
+						client_psock->priv = NULL;
+						pico_socket_close(client_psock);
+						stat_add(tap->_stats.conns_refused, 1);
+						return;
+					}
+					// Only a placeholder until the app calls zts_accept(), see pico_Accept()
+					client_psock->priv = new ConnectionPair(tap, NULL);
+					((ConnectionPair*)client_psock->priv)->admit = admit;
+					listener->_AcceptedConnections.push_back(client_psock);
+					listener->_AcceptedCount++;
+				}
+				// wake any blocking zts_accept() (_tcpconns_m has been released by now)
+				listener->notify_state();
+				if(listener != conn)
+					epoll_notify(listener);
 			}
-			if(conn->state != ZT_SOCK_STATE_LISTENING) {
+			else {
 				// set state so socket multiplexer logic will pick this up
 				conn->state = ZT_SOCK_STATE_UNHANDLED_CONNECTED;
+				conn->connecting = false;
+				// wake any blocking zts_connect()
+				conn->notify_state();
 			}
 		}
 
 		// PICO_SOCK_EV_FIN - triggered when the socket is closed. No further communication is
-		// possible from this point on the socket.
+		// possible from this point on the socket, which picoTCP frees next (see pico_detach())
 		if (ev & PICO_SOCK_EV_FIN) {
 			//DEBUG_EXTRA("PICO_SOCK_EV_FIN (socket closed), picosock=%p, conn=%p, app_fd=%d, sdk_fd=%d", s, conn, conn->app_fd, conn->sdk_fd);
-			conn->closure_ts = std::time(nullptr);	
+			tap->MarkClosed(conn);
 		}
 
 		// PICO_SOCK_EV_ERR - triggered when an error occurs.
 		if (ev & PICO_SOCK_EV_ERR) {
+			if(conn->connecting) {
+				// picoTCP's error codes share their values with errno's
+				conn->so_error = pico_err ? pico_err : ECONNREFUSED;
+				conn->connecting = false;
+				conn->notify_state();
+			}
 			if(pico_err == PICO_ERR_ECONNRESET) {
 				DEBUG_ERROR("PICO_ERR_ECONNRESET");
 				conn->state = PICO_ERR_ECONNRESET;
+				conn->zc_fail(ECONNRESET);
+				conn->notify_state();
 			}
 			DEBUG_ERROR("PICO_SOCK_EV_ERR, err=%s, picosock=%p, app_fd=%d, sdk_fd=%d", beautify_pico_error(pico_err), s, conn->app_fd, conn->sdk_fd); 
 		}
@@ -392,7 +899,10 @@ namespace ZeroTier {
 		if (ev & PICO_SOCK_EV_CLOSE) {
 			err = pico_socket_close(s);
 			//DEBUG_INFO("PICO_SOCK_EV_CLOSE (socket closure) err = %d, picosock=%p, conn=%p, app_fd=%d, sdk_fd=%d", err, s, conn, conn->app_fd, conn->sdk_fd);            
-			conn->closure_ts = std::time(nullptr);	
+			tap->MarkClosed(conn);
+			epoll_notify(conn);
+			if(ev & PICO_SOCK_EV_FIN)
+				pico_detach(conn, s);
 			return;
 		}
 		// PICO_SOCK_EV_RD - triggered when new data arrives on the socket. A new receive action
@@ -408,8 +918,100 @@ namespace ZeroTier {
 		if (ev & PICO_SOCK_EV_WR) {
 			pico_cb_tcp_write(tap, s);
 		}
+		// Readiness may have changed for any zts_epoll instance watching this socket 
+		// (for a listening socket this covers a newly queued connection)
+		epoll_notify(conn);
+		// ...and for anyone blocked in directRead()/directWrite()
+		if(conn->direct)
+			conn->notify_state();
+		if(ev & PICO_SOCK_EV_FIN)
+			pico_detach(conn, s);
+	}
+
+	void picoTCP::pico_service_direct(SocketTap *tap)
+	{
+		if(!tap->_direct_pending.exchange(false))
+			return;
+		std::vector<Connection*> serviced;
+		{
+			ProfiledMutex::Lock _l(tap->_tcpconns_m);
+			for(size_t i=0; i<tap->_Connections.size(); i++) {
+				Connection *conn = tap->_Connections[i];
+				if(!conn->direct || !conn->picosock || conn->closure_ts != -1)
+					continue;
+				bool stalled = conn->rx_stalled.exchange(false);
+				bool tx = conn->TXbuf->count() || conn->zc_pending;
+				if(!stalled && !tx)
+					continue;
+				// Hands the stack as much as it will take (unless it's being held back)
+				if(tx)
+					pico_cb_tcp_write(tap, conn->picosock);
+				if(stalled)
+					pico_cb_tcp_read(tap, conn->picosock);
+				serviced.push_back(conn);
+			}
+		}
+		// Connections are only recycled from this thread so these are still valid
+		for(size_t i=0; i<serviced.size(); i++) {
+			serviced[i]->notify_state();
+			epoll_notify(serviced[i]);
+		}
 	}
    
+	void picoTCP::pico_service_rx(SocketTap *tap)
+	{
+		if(tap->_pico_rx_backlog.empty())
+			return;
+		std::vector<Connection*> serviced;
+		{
+			ProfiledMutex::Lock _l(tap->_tcpconns_m);
+			// One quantum each for those already waiting, any requeued go again on the next pass
+			for(size_t n=tap->_pico_rx_backlog.size(); n; n--) {
+				Connection *conn = tap->_pico_rx_backlog.front().first;
+				struct pico_socket *s = tap->_pico_rx_backlog.front().second;
+				tap->_pico_rx_backlog.pop_front();
+				// Closed (and maybe reused) since, or to be picked up again once the app has read
+				if(conn->picosock != s || conn->closure_ts != -1)
+					continue;
+				conn->rx_backlog = false;
+				if(conn->rx_stalled)
+					continue;
+				pico_cb_tcp_read(tap, s);
+				serviced.push_back(conn);
+			}
+		}
+		for(size_t i=0; i<serviced.size(); i++) {
+			epoll_notify(serviced[i]);
+			if(serviced[i]->direct)
+				serviced[i]->notify_state();
+		}
+	}
+
+	unsigned long picoTCP::pico_service_impaired(SocketTap *tap)
+	{
+		uint64_t now = Clock::cached();
+		while(!tap->_impair_q.empty()) {
+			std::pair<uint64_t, std::string> &f = tap->_impair_q.front();
+			if(f.first > now)
+				return (unsigned long)(f.first - now);
+			tap->sendFrame(f.second.data(), (unsigned int)f.second.size());
+			tap->_impair_q.pop_front();
+		}
+		return 0;
+	}
+
+	int pico_nd_resolve(struct pico_device *dev, struct pico_ip6 *addr, struct pico_eth *mac)
+	{
+		SocketTap *tap = dev ? (SocketTap*)(dev->tap) : NULL;
+		return tap && tap->neighborMac(addr->addr, mac->addr) ? 0 : -1;
+	}
+
+	uint32_t pico_path_mtu(struct pico_device *dev, union pico_address *remote, int ipv6)
+	{
+		SocketTap *tap = dev ? (SocketTap*)(dev->tap) : NULL;
+		return tap ? tap->pathMtu() : 0;
+	}
+
 	int pico_eth_send(struct pico_device *dev, void *buf, int len)
 	{
 		//DEBUG_INFO("len = %d", len);
@@ -419,18 +1021,29 @@ namespace ZeroTier {
 			handle_general_failure();
 			return ZT_ERR_GENERAL_FAILURE;
 		}
-		struct pico_eth_hdr *ethhdr;
-		ethhdr = (struct pico_eth_hdr *)buf;
-		MAC src_mac;
-		MAC dest_mac;
-		src_mac.setTo(ethhdr->saddr, 6);
-		dest_mac.setTo(ethhdr->daddr, 6);
-		tap->_handler(tap->_arg,NULL,tap->_nwid,src_mac,dest_mac,
-			Utils::ntoh((uint16_t)ethhdr->proto),0, ((char*)buf) + sizeof(struct pico_eth_hdr),len - sizeof(struct pico_eth_hdr));
+		ZT_PROBE2(frame_tx, tap->_nwid, len);
+		uint32_t loss = tap->_impair_loss_ppm.load(std::memory_order_relaxed);
+		uint32_t delay = tap->_impair_delay_ms.load(std::memory_order_relaxed);
+		if(loss || delay || !tap->_impair_q.empty()) {
+			if(loss) {
+				// xorshift64, this only has to look random to TCP
+				tap->_impair_rng ^= tap->_impair_rng << 13;
+				tap->_impair_rng ^= tap->_impair_rng >> 7;
+				tap->_impair_rng ^= tap->_impair_rng << 17;
+				if(tap->_impair_rng % 1000000 < loss)
+					return len;
+			}
+			// Behind frames still waiting even if the delay has since been lifted, keeping order
+			tap->_impair_q.push_back(std::make_pair(Clock::cached() + delay, std::string((char*)buf, len)));
+			if(!delay)
+				picoTCP::pico_service_impaired(tap);
+			return len;
+		}
+		tap->sendFrame(buf, len);
 		return len;
 	}
 
-	// receive frames from zerotier virtual wire and copy them to a guarded buffer awaiting placement into network stack
+	// receive frames from zerotier virtual wire and place them in a guarded queue awaiting placement into network stack
 	void picoTCP::pico_rx(SocketTap *tap, const MAC &from,const MAC &to,unsigned int etherType,
 		const void *data,unsigned int len)
 	{
@@ -440,33 +1053,283 @@ namespace ZeroTier {
 			handle_general_failure();
 			return;
 		}
+		stat_add(tap->_stats.frames_in, 1);
+		stat_add(tap->_stats.bytes_in, len);
+		if(len > ZT_SDK_MTU) {
+			DEBUG_ERROR("dropped frame: len = %d exceeds ZT_SDK_MTU", len);
+			stat_add(tap->_stats.frames_dropped, 1);
+			return;
+		}
+		// Shed before anything is copied if the stack is falling behind
+		size_t queued = tap->_pico_frame_rxq.count();
+		if(!tap->rxAdmit(queued)) {
+			ZT_PROBE2(frame_rx_drop, tap->_nwid, len);
+			stat_add(tap->_stats.frames_dropped, 1);
+			return;
+		}
 		// Since picoTCP only allows the reception of frames from within the polling function, we
-		// must enqueue each frame into a memory structure shared by both threads. This structure will
-		Mutex::Lock _l(tap->_pico_frame_rxbuf_m);
-
+		// must enqueue each frame into a memory structure shared by both threads. The frame is 
+		// assembled directly in a pooled buffer which is later given to the stack as-is
+		unsigned char *buf = tap->_pico_frame_pool->acquire();
+		if(!buf) {
+			DEBUG_ERROR("dropped frame: unable to allocate frame buffer");
+			stat_add(tap->_stats.frames_dropped, 1);
+			return;
+		}
+		if(latencyTrace.sample())
+			FramePool::stamp(buf) = LatencyTrace::now_ns();
 		// assemble new eth header
-		struct pico_eth_hdr ethhdr;
-		from.copyTo(ethhdr.saddr, 6);
-		to.copyTo(ethhdr.daddr, 6);
-		ethhdr.proto = Utils::hton((uint16_t)etherType);
-		int newlen = len + sizeof(int) + sizeof(struct pico_eth_hdr);
-
-		int mylen;
-		// FIXME
-		while(newlen > (MAX_PICO_FRAME_RX_BUF_SZ-tap->pico_frame_rxbuf_tot) && ethhdr.proto == 56710)
-		{
-			mylen = 0;
-			memset(tap->pico_frame_rxbuf,0,MAX_PICO_FRAME_RX_BUF_SZ);
-			tap->pico_frame_rxbuf_tot=0;
+		struct pico_eth_hdr *ethhdr = (struct pico_eth_hdr *)buf;
+		from.copyTo(ethhdr->saddr, 6);
+		to.copyTo(ethhdr->daddr, 6);
+		ethhdr->proto = Utils::hton((uint16_t)etherType);
+		memcpy(buf + sizeof(struct pico_eth_hdr), data, len); // frame data
+		// The stack thread only sleeps with an empty queue, so it needs waking for the first frame.
+		// Whether this is the first is known under the queue's lock, the thread may drain it meanwhile
+		bool idle;
+		if(!tap->_pico_frame_rxq.push(buf, len + sizeof(struct pico_eth_hdr), SocketTap::rxStamp(), &idle)) {
+			DEBUG_ERROR("dropped frame: RX frame queue is full (see ZT_FRAME_RX_QUEUE_LEN)");
+			ZT_PROBE2(frame_rx_drop, tap->_nwid, len);
+			stat_add(tap->_stats.rxq_overflows, 1);
+			stat_add(tap->_stats.frames_dropped, 1);
+			FramePool::release(buf);
+		}
+		else {
+			ZT_PROBE2(frame_rx, tap->_nwid, len);
+			stat_max(tap->_stats.rxq_hwm, tap->_pico_frame_rxq.count());
+			if(idle && !tap->_stack->spinning())
+				tap->_phy.whack();
+		}
+		//DEBUG_FLOW("[ ZWIRE -> FQUEUE ] Move FRAME(sz=%d) into FQUEUE(n=%d)", len, tap->_pico_frame_rxq.count());
+	}
+
+	void picoTCP::pico_rx_batch(SocketTap *tap, const TapFrame *frames, unsigned int n)
+	{
+		if(!tap) {
+			DEBUG_ERROR("invalid tap");
+			handle_general_failure();
+			return;
+		}
+		struct frame_desc descs[ZT_FRAME_RX_QUEUE_LEN];
+		unsigned char *bufs[ZT_FRAME_RX_QUEUE_LEN];
+		unsigned int done = 0;
+		size_t queued = tap->_pico_frame_rxq.count();
+		bool idle = false;
+		uint64_t rx_stamp = SocketTap::rxStamp();
+		while(done < n) {
+			unsigned int cnt = std::min(n - done, (unsigned int)ZT_FRAME_RX_QUEUE_LEN);
+			size_t nbufs = tap->_pico_frame_pool->acquire(bufs, cnt);
+			size_t ndescs = 0;
+			for(size_t i=0; i<cnt; i++)
+				stat_add(tap->_stats.bytes_in, frames[done + i].len);
+			stat_add(tap->_stats.frames_in, cnt);
+			for(size_t i=0; i<nbufs; i++) {
+				const TapFrame *f = &frames[done + i];
+				if(f->len > ZT_SDK_MTU) {
+					DEBUG_ERROR("dropped frame: len = %d exceeds ZT_SDK_MTU", f->len);
+					stat_add(tap->_stats.frames_dropped, 1);
+					FramePool::release(bufs[i]);
+					continue;
+				}
+				if(!tap->rxAdmit(queued + ndescs)) {
+					ZT_PROBE2(frame_rx_drop, tap->_nwid, f->len);
+					stat_add(tap->_stats.frames_dropped, 1);
+					FramePool::release(bufs[i]);
+					continue;
+				}
+				struct pico_eth_hdr *ethhdr = (struct pico_eth_hdr *)bufs[i];
+				f->from.copyTo(ethhdr->saddr, 6);
+				f->to.copyTo(ethhdr->daddr, 6);
+				ethhdr->proto = Utils::hton((uint16_t)f->etherType);
+				memcpy(bufs[i] + sizeof(struct pico_eth_hdr), f->data, f->len);
+				if(latencyTrace.sample())
+					FramePool::stamp(bufs[i]) = LatencyTrace::now_ns();
+				descs[ndescs].buf = bufs[i];
+				descs[ndescs].len = f->len + sizeof(struct pico_eth_hdr);
+				descs[ndescs].rx_stamp = rx_stamp;
+				ndescs++;
+			}
+			if(nbufs < cnt) {
+				DEBUG_ERROR("dropped %d frames: unable to allocate frame buffers", (int)(cnt - nbufs));
+				stat_add(tap->_stats.frames_dropped, cnt - nbufs);
+			}
+			bool was_empty;
+			size_t pushed = tap->_pico_frame_rxq.push(descs, ndescs, &was_empty);
+			idle |= was_empty && pushed;
+			if(pushed < ndescs) {
+				DEBUG_ERROR("dropped %d frames: RX frame queue is full (see ZT_FRAME_RX_QUEUE_LEN)", (int)(ndescs - pushed));
+				stat_add(tap->_stats.rxq_overflows, ndescs - pushed);
+				stat_add(tap->_stats.frames_dropped, ndescs - pushed);
+				for(size_t i=pushed; i<ndescs; i++) {
+					ZT_PROBE2(frame_rx_drop, tap->_nwid, descs[i].len - sizeof(struct pico_eth_hdr));
+					FramePool::release(descs[i].buf);
+				}
+			}
+			for(size_t i=0; i<pushed; i++)
+				ZT_PROBE2(frame_rx, tap->_nwid, descs[i].len - sizeof(struct pico_eth_hdr));
+			queued = tap->_pico_frame_rxq.count();
+			stat_max(tap->_stats.rxq_hwm, queued);
+			done += cnt;
+		}
+		// One wakeup for the whole batch (see pico_rx())
+		if(idle && !tap->_stack->spinning())
+			tap->_phy.whack();
+	}
+
+	// called by picoTCP once it is done with a frame we gave it in pico_eth_poll()
+	static void pico_frame_release(uint8_t *buf)
+	{
+		FramePool::release(buf);
+	}
+
+	static inline uint16_t rd16(const unsigned char *p) { return (uint16_t)((p[0] << 8) | p[1]); }
+	static inline uint32_t rd32(const unsigned char *p) { return ((uint32_t)rd16(p) << 16) | rd16(p + 2); }
+	static inline void wr16(unsigned char *p, uint16_t v) { p[0] = (unsigned char)(v >> 8); p[1] = (unsigned char)v; }
+
+	/*
+	 * Where a TCP segment sits in an ethernet frame, only filled in for segments which could
+	 * be merged with their neighbours (unfragmented, no IPv4 options or IPv6 extension headers,
+	 * carrying data and nothing but ACK or PSH set)
+	 */
+	struct tcp_seg
+	{
+		size_t l4;      // TCP header offset
+		size_t data;    // payload offset
+		size_t end;     // end of the IP packet (the frame may be padded beyond it)
+		uint32_t seq;
+		bool v6;
+	};
+
+	static bool pico_parse_seg(const struct frame_desc &f, struct tcp_seg *seg)
+	{
+		const size_t l3 = sizeof(struct pico_eth_hdr);
+		const unsigned char *b = f.buf;
+		if(f.len < l3 + 40)
+			return false;
+		uint16_t proto = rd16(b + 12);
+		if(proto == 0x0800 && b[l3] == 0x45 && !(rd16(b + l3 + 6) & 0x3fff) && b[l3 + 9] == 6) {
+			seg->v6 = false;
+			seg->l4 = l3 + 20;
+			seg->end = l3 + rd16(b + l3 + 2);
+		}
+		else if(proto == 0x86dd && (b[l3] >> 4) == 6 && b[l3 + 6] == 6) {
+			seg->v6 = true;
+			seg->l4 = l3 + 40;
+			seg->end = seg->l4 + rd16(b + l3 + 4);
+		}
+		else
+			return false;
+		if(seg->end > f.len || seg->l4 + 20 > seg->end)
+			return false;
+		const unsigned char *th = b + seg->l4;
+		seg->data = seg->l4 + (th[12] >> 4) * 4;
+		uint8_t flags = th[13];
+		if(seg->data < seg->l4 + 20 || seg->data >= seg->end || !(flags & PICO_TCP_ACK) 
+			|| (flags & ~(PICO_TCP_ACK | PICO_TCP_PSH)))
+			return false;
+		seg->seq = rd32(th + 4);
+		return true;
+	}
+
+	// Whether b continues a (same addresses, ports, ACK and options, next in sequence)
+	static bool pico_seg_follows(const unsigned char *a, const struct tcp_seg &sa, 
+		const unsigned char *b, const struct tcp_seg &sb)
+	{
+		const size_t l3 = sizeof(struct pico_eth_hdr);
+		if(sa.v6 != sb.v6 || sa.data - sa.l4 != sb.data - sb.l4)
+			return false;
+		if(sb.seq != sa.seq + (uint32_t)(sa.end - sa.data))
+			return false;
+		size_t addr = sa.v6 ? l3 + 8 : l3 + 12, addrlen = sa.v6 ? 32 : 8;
+		if(memcmp(a, b, l3) || memcmp(a + addr, b + addr, addrlen))
+			return false;
+		// ports, then ACK, then options
+		return !memcmp(a + sa.l4, b + sb.l4, 4) && !memcmp(a + sa.l4 + 8, b + sb.l4 + 8, 4)
+			&& !memcmp(a + sa.l4 + 20, b + sb.l4 + 20, sa.data - sa.l4 - 20);
+	}
+
+	/*
+	 * Merges frames[i] and the frames following it which continue it into seg, returns how many
+	 * frames were merged (1 if frames[i] stands alone, in which case seg is left untouched)
+	 */
+	static size_t pico_coalesce(const struct frame_desc *frames, size_t i, size_t n, 
+		unsigned char *seg, size_t *seglen)
+	{
+		struct tcp_seg first, prev, next;
+		if(!ZT_RX_COALESCE_MAX || i + 1 >= n || !pico_parse_seg(frames[i], &first))
+			return 1;
+		// Nothing follows a segment with PSH set
+		if(frames[i].buf[first.l4 + 13] & PICO_TCP_PSH)
+			return 1;
+		prev = first;
+		size_t len = first.end, j = i + 1;
+		for(; j<n; j++) {
+			if(!pico_parse_seg(frames[j], &next) || !pico_seg_follows(frames[j - 1].buf, prev, frames[j].buf, next))
+				break;
+			size_t add = next.end - next.data;
+			if(len + add > ZT_RX_COALESCE_MAX)
+				break;
+			if(j == i + 1)
+				memcpy(seg, frames[i].buf, first.end);
+			memcpy(seg + len, frames[j].buf + next.data, add);
+			len += add;
+			prev = next;
+			if(frames[j].buf[next.l4 + 13] & PICO_TCP_PSH) {
+				j++;
+				break;
+			}
 		}
-		memcpy(tap->pico_frame_rxbuf + tap->pico_frame_rxbuf_tot, &newlen, sizeof(newlen));                      // size of frame + meta		
-		memcpy(tap->pico_frame_rxbuf + tap->pico_frame_rxbuf_tot + sizeof(newlen), &ethhdr, sizeof(ethhdr));     // new eth header
-		memcpy(tap->pico_frame_rxbuf + tap->pico_frame_rxbuf_tot + sizeof(newlen) + sizeof(ethhdr), data, len);  // frame data
-		tap->pico_frame_rxbuf_tot += newlen;
-		//DEBUG_FLOW("[ ZWIRE -> FBUF ] Move FRAME(sz=%d) into FBUF(sz=%d), data_len=%d", newlen, tap->pico_frame_rxbuf_tot, len);
+		if(j == i + 1)
+			return 1;
+		// The last segment's PSH and window go for the whole, the TCP checksum isn't verified 
+		// (see ZT_RX_COALESCE_MAX)
+		const unsigned char *last = frames[j - 1].buf;
+		seg[first.l4 + 13] = last[prev.l4 + 13];
+		memcpy(seg + first.l4 + 14, last + prev.l4 + 14, 2);
+		const size_t l3 = sizeof(struct pico_eth_hdr);
+		if(first.v6)
+			wr16(seg + l3 + 4, (uint16_t)(len - first.l4));
+		else {
+			wr16(seg + l3 + 2, (uint16_t)(len - l3));
+			wr16(seg + l3 + 10, 0);
+			uint16_t crc = Utils::hton(pico_checksum(seg + l3, 20)); // as pico_ipv4_checksum() stores it
+			memcpy(seg + l3 + 10, &crc, sizeof(crc));
+		}
+		*seglen = len;
+		return j - i;
 	}
 
-	// feed frames on the guarded RX buffer (from zerotier virtual wire) into the network stack
+	// picoTCP's ping id to the zts_ping() run and probe it was sent for, ICMP probes in flight
+	static Mutex pico_pings_m;
+	static std::map<int, std::pair<PingSession*, uint32_t> > pico_pings;
+	static std::atomic<int> pico_pings_n(0);
+
+	/*
+	 * pico_icmp4_ping() reports replies without saying which ping they answer, so they are
+	 * picked out of the frames handed to the stack instead (by ICMP identifier, which is the
+	 * ping id)
+	 */
+	static void pico_ping_match(const unsigned char *frame, unsigned int len)
+	{
+		if(len < 14 + 20 + 8 || rd16(frame + 12) != 0x0800)
+			return;
+		const unsigned char *ip = frame + 14;
+		unsigned int ihl = (ip[0] & 0x0f) * 4;
+		if((ip[0] >> 4) != 4 || ihl < 20 || len < 14 + ihl + 8 || ip[9] != PICO_PROTO_ICMP4)
+			return;
+		const unsigned char *icmp = ip + ihl;
+		if(icmp[0] != PICO_ICMP_ECHOREPLY)
+			return;
+		Mutex::Lock _l(pico_pings_m);
+		std::map<int, std::pair<PingSession*, uint32_t> >::iterator it = pico_pings.find(rd16(icmp + 4));
+		if(it == pico_pings.end())
+			return;
+		it->second.first->replied(it->second.second);
+		pico_pings.erase(it);
+		pico_pings_n--;
+	}
+
+	// feed frames on the guarded RX queue (from zerotier virtual wire) into the network stack
 	int pico_eth_poll(struct pico_device *dev, int loop_score)
 	{
 		SocketTap *tap = (SocketTap*)(dev->tap);
@@ -475,30 +1338,43 @@ namespace ZeroTier {
 			handle_general_failure();
 			return ZT_ERR_GENERAL_FAILURE;
 		}
-		// FIXME: The copy logic and/or buffer structure should be reworked for better performance after the BETA
-		// SocketTap *tap = (SocketTap*)netif->state;
-		Mutex::Lock _l(tap->_pico_frame_rxbuf_m);
-		unsigned char frame[ZT_SDK_MTU];
-		int len;
-		int err = 0;
-		while (tap->pico_frame_rxbuf_tot > 0 && loop_score > 0) {
-			//DEBUG_FLOW(" [   FBUF -> STACK] Frame buffer SZ=%d", tap->pico_frame_rxbuf_tot);
-			memset(frame, 0, sizeof(frame));
-			len = 0;
-			memcpy(&len, tap->pico_frame_rxbuf, sizeof(len)); // get frame len
-			if(len >= 0) {
-				//DEBUG_FLOW(" [   FBUF -> STACK]   Moving FRAME of size (%d) from FBUF(sz=%d) into stack",len, tap->pico_frame_rxbuf_tot-len);
-				memcpy(frame, tap->pico_frame_rxbuf + sizeof(len), len-(sizeof(len)) ); // get frame data
-				memmove(tap->pico_frame_rxbuf, tap->pico_frame_rxbuf + len, MAX_PICO_FRAME_RX_BUF_SZ-len); // shift buffer
-				err = pico_stack_recv(dev, (uint8_t*)frame, (len-sizeof(len))); 
-				//DEBUG_INFO("recv = %d", err);
-				tap->pico_frame_rxbuf_tot-=len;
+		if(loop_score <= 0)
+			return loop_score;
+		StackThread::Phase _p(ZTS_STACK_PHASE_FRAME_RX);
+		struct frame_desc frames[ZT_FRAME_RX_QUEUE_LEN];
+		unsigned char seg[ZT_RX_COALESCE_MAX + 1];
+		size_t n = tap->_pico_frame_rxq.pop(frames, std::min(loop_score, ZT_FRAME_RX_QUEUE_LEN));
+		if(n) {
+			ZT_PROBE2(frame_poll, tap->_nwid, n);
+			tap->rxDrained(tap->_pico_frame_rxq.count());
+			tap->_stack->framesPolled(n);
+		}
+		for(size_t i=0; i<n; i++) {
+			if(FramePool::stamp(frames[i].buf))
+				latencyTrace.record(ZTS_LATENCY_RX_QUEUE, FramePool::stamp(frames[i].buf));
+		}
+		for(size_t i=0; i<n; ) {
+			//DEBUG_FLOW(" [ FQUEUE -> STACK] Moving FRAME of size (%d) into stack", frames[i].len);
+			size_t seglen, merged = pico_coalesce(frames, i, n, seg, &seglen);
+			// A coalesced segment arrived with its first frame
+			pico_stack_set_rx_stamp(frames[i].rx_stamp);
+			if(pico_pings_n.load(std::memory_order_relaxed))
+				pico_ping_match(frames[i].buf, frames[i].len);
+			if(merged > 1) {
+				// A bulk flow's segments go through the stack (and get ACKed) once per run
+				pico_stack_recv(dev, seg, seglen);
+				for(size_t j=i; j<i+merged; j++)
+					FramePool::release(frames[j].buf);
+				stat_add(tap->_stats.rx_coalesced, merged - 1);
 			}
 			else {
-				DEBUG_ERROR("Invalid frame size (%d). Exiting.",len);
-				handle_general_failure();
+				// Ownership of the buffer passes to picoTCP, it is returned via pico_frame_release(). If
+				// the stack can't take the frame (empty, out of memory or its queue is full) it's ours
+				if(pico_stack_recv_zerocopy_ext_buffer_notify(dev, frames[i].buf, frames[i].len, pico_frame_release) < 0)
+					FramePool::release(frames[i].buf);
 			}
-			loop_score--;
+			loop_score -= merged;
+			i += merged;
 		}
 		return loop_score;
 	}
@@ -506,55 +1382,76 @@ namespace ZeroTier {
 	int picoTCP::pico_Socket(struct pico_socket **p, int socket_family, int socket_type, int protocol)
 	{
 		int err = 0;
-		if(pico_ntimers() >= PICO_MAX_TIMERS) {
-			DEBUG_ERROR("cannot create additional socket, see PICO_MAX_TIMERS. current = %d", pico_ntimers());
-			errno = EMFILE;
-			err = -1;
-		}
-		else
-		{
-			int protocol_version = 0;
-			struct pico_socket *psock;
-			if(socket_family == AF_INET)
-				protocol_version = PICO_PROTO_IPV4;
-			if(socket_family == AF_INET6)
-				protocol_version = PICO_PROTO_IPV6;
-			
-			if(socket_type == SOCK_DGRAM) {
-				DEBUG_ERROR("SOCK_DGRAM");
-				psock = pico_socket_open(
-					protocol_version, PICO_PROTO_UDP, &ZeroTier::picoTCP::pico_cb_socket_activity);
-				if(psock) { // configure size of UDP SND/RCV buffers
-					// TODO
-				}
+		int protocol_version = 0;
+		struct pico_socket *psock = NULL;
+		if(socket_family == AF_INET)
+			protocol_version = PICO_PROTO_IPV4;
+		if(socket_family == AF_INET6)
+			protocol_version = PICO_PROTO_IPV6;
+		
+		if(socket_type == SOCK_DGRAM) {
+			DEBUG_ERROR("SOCK_DGRAM");
+			psock = pico_socket_open(
+				protocol_version, PICO_PROTO_UDP, &ZeroTier::picoTCP::pico_cb_socket_activity);
+			if(psock) { // configure size of UDP SND/RCV buffers
+				// TODO
 			}
-			if(socket_type == SOCK_STREAM) {		    	
-				psock = pico_socket_open(
-					protocol_version, PICO_PROTO_TCP, &ZeroTier::picoTCP::pico_cb_socket_activity);
-				if(psock) { // configure size of TCP SND/RCV buffers
-					int tx_buf_sz = ZT_STACK_TCP_SOCKET_TX_SZ;
-					int rx_buf_sz = ZT_STACK_TCP_SOCKET_RX_SZ;
-					int t_err = 0;
-					int value = 1;
-					pico_socket_setoption(psock, PICO_TCP_NODELAY, &value);
-
-					if((t_err = pico_socket_setoption(psock, PICO_SOCKET_OPT_SNDBUF, &tx_buf_sz)) < 0)
-						DEBUG_ERROR("unable to set SNDBUF size, err = %d, pico_err = %d", t_err, pico_err);
-					if((t_err = pico_socket_setoption(psock, PICO_SOCKET_OPT_RCVBUF, &rx_buf_sz)) < 0)
-						DEBUG_ERROR("unable to set RCVBUF size, err = %d, pico_err = %d", t_err, pico_err);
-				   
-					if(ZT_SOCK_BEHAVIOR_LINGER) {
-						int linger_time_ms = ZT_SOCK_BEHAVIOR_LINGER_TIME;
-						if((t_err = pico_socket_setoption(psock, PICO_SOCKET_OPT_LINGER, &linger_time_ms)) < 0)
-							DEBUG_ERROR("unable to set LINGER, err = %d, pico_err = %d", t_err, pico_err);
-					}
+		}
+		if(socket_type == SOCK_STREAM) {		    	
+			psock = pico_socket_open(
+				protocol_version, PICO_PROTO_TCP, &ZeroTier::picoTCP::pico_cb_socket_activity);
+			if(psock) { // configure size of TCP SND/RCV buffers
+				struct zts_stack_config config;
+				zts_get_stack_config(&config);
+				int tx_buf_sz = config.tcp_sndbuf;
+				int rx_buf_sz = config.tcp_rcvbuf;
+				int t_err = 0;
+				int value = ZT_SOCK_TCP_NODELAY_DEFAULT;
+				pico_socket_setoption(psock, PICO_TCP_NODELAY, &value);
+
+				if((t_err = pico_socket_setoption(psock, PICO_SOCKET_OPT_SNDBUF, &tx_buf_sz)) < 0)
+					DEBUG_ERROR("unable to set SNDBUF size, err = %d, pico_err = %d", t_err, pico_err);
+				if((t_err = pico_socket_setoption(psock, PICO_SOCKET_OPT_RCVBUF, &rx_buf_sz)) < 0)
+					DEBUG_ERROR("unable to set RCVBUF size, err = %d, pico_err = %d", t_err, pico_err);
+				if(pico_tcp_set_congestion(psock, config.tcp_congestion) < 0)
+					DEBUG_ERROR("unable to set congestion control %s, pico_err = %d", config.tcp_congestion, pico_err);
+			   
+				if(ZT_SOCK_BEHAVIOR_LINGER) {
+					int linger_time_ms = ZT_SOCK_BEHAVIOR_LINGER_TIME;
+					if((t_err = pico_socket_setoption(psock, PICO_SOCKET_OPT_LINGER, &linger_time_ms)) < 0)
+						DEBUG_ERROR("unable to set LINGER, err = %d, pico_err = %d", t_err, pico_err);
 				}
 			}
-			*p = psock;
 		}
+		if(!psock) {
+			DEBUG_ERROR("cannot create additional socket, pico_err = %d", pico_err);
+			errno = pico_err;
+			err = -1;
+		}
+		*p = psock;
 		return err;
 	}
 
+	int picoTCP::SetLocalPort(Connection *conn, uint16_t port)
+	{
+		// As if pico_socket_connect() had picked it, which only does so when there's none
+		if(!conn->picosock || conn->socket_type != SOCK_STREAM || conn->picosock->local_port)
+			return 0;
+		// Connected sockets may share the port (with other destinations), a listener or a
+		// socket bound to it and waiting for zts_connect()/zts_listen() may not
+		struct pico_sockport *sp = pico_get_sockport(PICO_PROTO_TCP, htons(port));
+		if(sp) {
+			struct pico_tree_node *index;
+			pico_tree_foreach(index, &sp->socks) {
+				struct pico_socket *s = (struct pico_socket *)index->keyValue;
+				if(!(s->state & PICO_SOCKET_STATE_CONNECTED) || (s->state & PICO_SOCKET_STATE_TCP) == PICO_SOCKET_STATE_TCP_LISTEN)
+					return -1;
+			}
+		}
+		conn->picosock->local_port = htons(port);
+		return 1;
+	}
+
 	int picoTCP::pico_Connect(Connection *conn, int fd, const struct sockaddr *addr, socklen_t addrlen)
 	{		
 		if(!conn || !conn->picosock) {
@@ -582,7 +1479,6 @@ namespace ZeroTier {
 			pico_string_to_ipv6(ipv6_str, zaddr.addr);
 			err = pico_socket_connect(conn->picosock, &zaddr, in6->sin6_port);
 		}
-		memcpy(&(conn->peer_addr), &addr, sizeof(struct sockaddr_storage));
 
 		if(err == PICO_ERR_EPROTONOSUPPORT)
 			DEBUG_ERROR("PICO_ERR_EPROTONOSUPPORT");
@@ -593,6 +1489,46 @@ namespace ZeroTier {
 		return err;
 	}
 
+	/*
+	 * Caller holds _tcpconns_m. Makes conn a shard of the pico_socket of an SO_REUSEPORT
+	 * Connection already bound to addr (see ConnectionPair::shards), returns false if there's
+	 * none to share with
+	 */
+	static bool pico_join_shards(Connection *conn, const struct sockaddr *addr)
+	{
+		if(!conn->reuseport || conn->socket_type != SOCK_STREAM)
+			return false;
+		ConnectionPair *own = (ConnectionPair*)(conn->picosock->priv);
+		uint16_t port = conn->socket_family == AF_INET6 
+			? ((struct sockaddr_in6*)addr)->sin6_port : ((struct sockaddr_in*)addr)->sin_port;
+		if(!own || !port)
+			return false;
+		SocketTap *tap = own->tap;
+		for(size_t i=0; i<tap->_Connections.size(); i++) {
+			Connection *other = tap->_Connections[i];
+			if(other == conn || !other->reuseport || !other->picosock || other->closure_ts != -1
+				|| other->socket_type != SOCK_STREAM || other->socket_family != conn->socket_family
+				|| other->picosock->local_port != port 
+				|| (other->state != ZT_SOCK_STATE_NONE && other->state != ZT_SOCK_STATE_LISTENING))
+				continue;
+			// IPv6 sockets are always bound to :: (see below)
+			if(conn->socket_family == AF_INET 
+				&& other->picosock->local_addr.ip4.addr != ((struct sockaddr_in*)addr)->sin_addr.s_addr)
+				continue;
+			ConnectionPair *pair = (ConnectionPair*)(other->picosock->priv);
+			if(pair->shards.empty())
+				pair->shards.push_back(pair->conn);
+			pair->shards.push_back(conn);
+			// The pico_socket conn was created with is never bound, the shared one stands in for it
+			conn->picosock->priv = NULL;
+			pico_socket_close(conn->picosock);
+			delete own;
+			conn->picosock = other->picosock;
+			return true;
+		}
+		return false;
+	}
+
 	int picoTCP::pico_Bind(Connection *conn, int fd, const struct sockaddr *addr, socklen_t addrlen)
 	{
 		//DEBUG_INFO();
@@ -602,6 +1538,8 @@ namespace ZeroTier {
 			return ZT_ERR_GENERAL_FAILURE;
 		}
 		int err = 0;
+		if(pico_join_shards(conn, addr))
+			return ZT_ERR_OK;
 		if(conn->socket_family == AF_INET) { 
 			struct pico_ip4 zaddr;
 			uint32_t tempaddr;
@@ -656,7 +1594,18 @@ namespace ZeroTier {
 			return ZT_ERR_GENERAL_FAILURE;
 		}
 		int err = 0;
-		if((err = pico_socket_listen(conn->picosock, backlog)) < 0)
+		// 0 (or less) gets the smallest useful queue, like the kernel
+		conn->backlog = std::max(1, std::min(backlog, ZT_LISTEN_BACKLOG_MAX));
+		ConnectionPair *pair = (ConnectionPair*)(conn->picosock->priv);
+		if(pair && pair->shards.size() && pair->conn != conn) {
+			// A shared pico_socket which is listening already only needs another accept queue
+			if(pair->conn->state == ZT_SOCK_STATE_LISTENING) {
+				conn->state = ZT_SOCK_STATE_LISTENING;
+				return ZT_ERR_OK;
+			}
+			pair->conn = conn;
+		}
+		if((err = pico_socket_listen(conn->picosock, conn->backlog)) < 0)
 		{
 			if(err == PICO_ERR_EINVAL) {
 				DEBUG_ERROR("PICO_ERR_EINVAL");
@@ -680,18 +1629,134 @@ namespace ZeroTier {
 			handle_general_failure();
 			return NULL;
 		}
-		// Retreive first of queued Connections from parent connection
-		Connection *new_conn = NULL;
-		if(conn->_AcceptedConnections.size()) {
-			new_conn = conn->_AcceptedConnections.front();
-			conn->_AcceptedConnections.pop();
+		// Stack thread only, with _tcpconns_m held (see SocketTap::Accept()). The first of the
+		// queued connections only now gets its Connection and socketpair
+		if(!conn->_AcceptedConnections.size())
+			return NULL;
+		SocketTap *tap = conn->tap;
+		// A listener with a userspace descriptor accepts sockets with one too
+		int ufd = -1;
+		if(FdTable::is_userspace(conn->app_fd) && (ufd = fdtable.alloc_userspace()) < 0)
+			return NULL;
+		Connection *newConn = connpool.get(SOCK_STREAM, ufd);
+		if(newConn->app_fd < 0) {
+			connpool.recycle(newConn); // out of descriptors, leave it queued
+			return NULL;
+		}
+		struct pico_socket *client_psock = conn->_AcceptedConnections.front();
+		conn->_AcceptedConnections.pop_front();
+		conn->_AcceptedCount--;
+
+		newConn->socket_type = SOCK_STREAM;
+		newConn->direct = conn->direct;
+		newConn->picosock = client_psock;
+		newConn->driver = this;
+		newConn->tap = tap;
+		newConn->admit = ((ConnectionPair*)(client_psock->priv))->admit;
+		newConn->state = ZT_SOCK_STATE_CONNECTED;
+
+		// Like the kernel, accepted sockets inherit the listener's TCP options
+		newConn->tx_nodelay = conn->tx_nodelay;
+		newConn->tx_cork = conn->tx_cork.load();
+		newConn->tx_coalesce_bytes = conn->tx_coalesce_bytes.load();
+		newConn->tx_coalesce_ms = conn->tx_coalesce_ms.load();
+		newConn->tx_shaper.configure(conn->tx_shaper.rate(), conn->tx_shaper.burst());
+		// The socket's own TOS and keepalive are copied by picoTCP
+		newConn->tos = conn->tos;
+		newConn->keepalive = conn->keepalive;
+		newConn->keep_idle = conn->keep_idle;
+		newConn->keep_intvl = conn->keep_intvl;
+		newConn->keep_cnt = conn->keep_cnt;
+		int value = newConn->tx_nodelay;
+		pico_socket_setoption(newConn->picosock, PICO_TCP_NODELAY, &value);
+
+		if(ZT_SOCK_BEHAVIOR_LINGER) {
+			int linger_time_ms = ZT_SOCK_BEHAVIOR_LINGER_TIME;
+			int t_err = 0;
+			if((t_err = pico_socket_setoption(newConn->picosock, PICO_SOCKET_OPT_LINGER, &linger_time_ms)) < 0)
+				DEBUG_ERROR("unable to set LINGER size, err = %d, pico_err = %d, app_fd=%d, sdk_fd=%d", t_err, pico_err, newConn->app_fd, newConn->sdk_fd);
+		}
+		tap->_Connections.add(newConn);
+		// For I/O loop participation and referencing the PhySocket's parent Connection in callbacks
+		if(newConn->sdk_fd >= 0)
+			newConn->sock = tap->_phy.wrapSocket(newConn->sdk_fd, newConn);
+		// From here on the stack's callbacks reach newConn, the stack thread replays whatever
+		// they reported before now
+		((ConnectionPair*)(client_psock->priv))->conn = newConn;
+		tap->_pico_accepted.push_back(std::make_pair(newConn, client_psock));
+		tap->_phy.whack();
+		return newConn;
+	}
+
+	union pico_any_addr {
+		struct pico_ip4 ip4;
+		struct pico_ip6 ip6;
+	};
+
+	static void pico_to_sockaddr(const union pico_any_addr *ip, uint16_t port, uint16_t proto, struct sockaddr_storage *addr)
+	{
+		// Both picoTCP and sockaddr keep addresses and ports in network byte order
+		if(proto == PICO_PROTO_IPV6) {
+			struct sockaddr_in6 *in6 = (struct sockaddr_in6*)addr;
+			in6->sin6_family = AF_INET6;
+			in6->sin6_port = port;
+			memcpy(&in6->sin6_addr, ip->ip6.addr, sizeof(ip->ip6.addr));
+		}
+		else {
+			struct sockaddr_in *in4 = (struct sockaddr_in*)addr;
+			in4->sin_family = AF_INET;
+			in4->sin_port = port;
+			in4->sin_addr.s_addr = ip->ip4.addr;
+		}
+	}
+
+	void picoTCP::pico_Peername(Connection *conn, struct sockaddr_storage *addr)
+	{
+		union pico_any_addr peer;
+		uint16_t port = 0, proto = 0;
+		memset(addr, 0, sizeof(*addr));
+		if(!conn->picosock || pico_socket_getpeername(conn->picosock, &peer, &port, &proto) < 0)
+			return;
+		pico_to_sockaddr(&peer, port, proto, addr);
+	}
+
+	void picoTCP::pico_service_accepted(SocketTap *tap)
+	{
+		std::vector<std::pair<Connection*, struct pico_socket*> > accepted;
+		{
+			ProfiledMutex::Lock _l(tap->_tcpconns_m);
+			if(tap->_pico_accepted.empty())
+				return;
+			accepted.swap(tap->_pico_accepted);
+		}
+		for(size_t i=0; i<accepted.size(); i++) {
+			Connection *conn = accepted[i].first;
+			struct pico_socket *s = accepted[i].second;
+			// Closed by the app already
+			if(conn->picosock != s || conn->closure_ts != -1)
+				continue;
+			ConnectionPair *pair = (ConnectionPair*)(s->priv);
+			// Data may have arrived before the app accepted, look for it regardless
+			uint16_t ev = (pair->pending_ev & ~PICO_SOCK_EV_CONN) | PICO_SOCK_EV_RD;
+			pair->pending_ev = 0;
+			pico_cb_socket_activity(ev, s);
 		}
-		return new_conn;
 	}
 
 	int picoTCP::pico_Read(SocketTap *tap, PhySocket *sock, Connection* conn, bool stack_invoked)
 	{
 		DEBUG_INFO();
+		// The app has made room in its socketpair, pass on whatever datagrams have queued up
+		if(conn && conn->socket_type == SOCK_DGRAM) {
+			pico_flush_dgrams(tap, conn);
+			return 0;
+		}
+		// ...or whatever is left in RXbuf, then take what the stack has been holding on to
+		// for us (see pico_cb_tcp_read()) once the app has caught up
+		if(conn && conn->socket_type == SOCK_STREAM && !conn->direct) {
+			pico_deliver_rx(tap, conn);
+			return 0;
+		}
 		//exit(0);
 		/*
 		if(!conn || !tap || !conn) {
@@ -775,9 +1840,8 @@ namespace ZeroTier {
 	int picoTCP::pico_Write(Connection *conn, void *data, ssize_t len)
 	{
 		int err = 0;
-		// TODO: Add RingBuffer overflow checks
 		//DEBUG_INFO("conn=%p, len = %d", conn, len);
-		Mutex::Lock _l(conn->_tx_m);
+		// TXbuf is SPSC, no need to take conn->_tx_m here
 		if(len <= 0) {
 			DEBUG_ERROR("invalid write length (len=%d)", len);
 			handle_general_failure();
@@ -792,46 +1856,28 @@ namespace ZeroTier {
 			handle_general_failure();
 			return -1;
 		}
+		// Datagrams go straight to the stack, one per socketpair message
+		if(conn->socket_type == SOCK_DGRAM)
+			return pico_write_dgram(conn, data, len);
 
-		int original_txsz = conn->TXbuf->count();
-
-		if(original_txsz + len >= ZT_TCP_TX_BUF_SZ) {
-			DEBUG_ERROR("txsz = %d, len = %d", original_txsz, len);
-			DEBUG_ERROR("TX buffer is too small, try increasing ZT_TCP_TX_BUF_SZ in libzt.h");
-			exit(0);
-		}
-
-		int buf_w = conn->TXbuf->write((const unsigned char*)data, len);
-			if (buf_w != len) {
-			// because we checked ZT_TCP_TX_BUF_SZ above, this should not happen
-			DEBUG_ERROR("TX wrote only %d but expected to write %d", buf_w, len);
-			exit(0);
-		}
-		//DEBUG_INFO("TXbuf->count() = %d", conn->TXbuf->count());
-		int txsz = conn->TXbuf->count();
+		// Phy hands us whatever one read() of the socketpair returned, if that doesn't all fit
+		// the rest waits in tx_spill and we stop reading until the stack catches up
+		const unsigned char *p = (const unsigned char*)data;
+		size_t buf_w = conn->tx_spill.size() ? 0 : conn->TXbuf->write(p, len);
+		if(buf_w)
+			conn->tx_mark.produced(conn->TXbuf->produced());
+		stat_max(conn->stats.txbuf_hwm, conn->TXbuf->count());
+		if(buf_w < (size_t)len)
+			conn->tx_spill.insert(conn->tx_spill.end(), p + buf_w, p + len);
+		pico_tx_flow(conn);
 
-		//if(original_txsz > 0)
-		//	return; // don't write here, we already have stuff in the queue, a callback will handle it
-		
-		int r, max_write_len = std::min(std::min(txsz, ZT_SDK_MTU),ZT_STACK_SOCKET_WR_MAX);
-		//int buf_r = conn->TXbuf->read(conn->tmptxbuf, max_write_len);
-		
-		if((r = pico_socket_write(conn->picosock, conn->TXbuf->get_buf(), max_write_len)) < 0) {
-			DEBUG_ERROR("unable to write to picosock=%p, r=%d", conn->picosock, r);
-			err = -1;
-		}
-		else {
-			err = r; // successful write
+		// Small writes may be held back to be sent along with whatever follows them
+		if(pico_tx_hold_ms(conn, Clock::cached())) {
+			conn->tap->_tx_held = true;
+			return 0;
 		}
-		if(conn->socket_type == SOCK_STREAM) {
-			//DEBUG_TRANS("[ TCP TX -> STACK] :: conn = %p, len = %d", conn, r);
-		}
-		if(conn->socket_type == SOCK_DGRAM) {
-			//DEBUG_TRANS("[ UDP TX -> STACK] :: conn = %p, len = %d", conn, r);
-		}
-		if(r>0)
-			conn->TXbuf->consume(r);
-
+		if((err = pico_drain_txbuf(conn)) < 0)
+			DEBUG_ERROR("unable to write to picosock=%p", conn->picosock);
 		return err;
 	}
 
@@ -841,16 +1887,285 @@ namespace ZeroTier {
 		if(!conn || !conn->picosock)
 			return ZT_ERR_GENERAL_FAILURE;
 		int err = 0;
-		Mutex::Lock _l(conn->tap->_tcpconns_m);
-		if(conn->closure_ts != -1) // it was closed at some point in the past, it'll work itself out 
+		ProfiledMutex::Lock _l(conn->tap->_tcpconns_m);
+		// Closed by the peer (or reset) already, picoTCP sees the rest through on its own
+		if(conn->closure_ts != -1) {
+			pico_detach(conn, conn->picosock);
 			return ZT_ERR_OK;
-		if((err = pico_socket_close(conn->picosock)) < 0) {
+		}
+		// Connections the app never accepted go with the listener
+		while(conn->_AcceptedConnections.size()) {
+			struct pico_socket *s = conn->_AcceptedConnections.front();
+			conn->_AcceptedConnections.pop_front();
+			conn->tap->_admission.connRelease(((ConnectionPair*)s->priv)->admit);
+			delete (ConnectionPair*)(s->priv);
+			s->priv = NULL;
+			pico_socket_close(s);
+		}
+		conn->_AcceptedCount = 0;
+		// A shared pico_socket stays open until its last shard goes
+		ConnectionPair *pair = (ConnectionPair*)(conn->picosock->priv);
+		if(pair && pair->shards.size()) {
+			pair->shards.erase(std::remove(pair->shards.begin(), pair->shards.end(), conn), pair->shards.end());
+			if(pair->shards.size()) {
+				if(pair->conn == conn) {
+					pair->conn = pair->shards[0];
+					for(size_t i=0; i<pair->shards.size(); i++) {
+						if(pair->shards[i]->state == ZT_SOCK_STATE_LISTENING) {
+							pair->conn = pair->shards[i];
+							break;
+						}
+					}
+				}
+				// picoTCP won't report on the shared socket to conn again, so it's done with
+				// conn right away
+				conn->picosock = NULL;
+				conn->tap->MarkClosed(conn);
+				return ZT_ERR_OK;
+			}
+			pair->conn = conn;
+		}
+		// Closing uncorks, give the stack anything still held back
+		if(conn->TXbuf->count() || conn->zc_pending)
+			pico_drain_txbuf(conn);
+		// What's queued in the stack still goes out, but nothing comes back to conn from here
+		struct pico_socket *s = conn->picosock;
+		pico_detach(conn, s);
+		if((err = pico_socket_close(s)) < 0) {
 			errno = pico_err;
-			DEBUG_ERROR("error closing pico_socket(%p)", (void*)(conn->picosock));
+			DEBUG_ERROR("error closing pico_socket(%p)", (void*)s);
 		}
+		conn->tap->MarkClosed(conn);
 		return err;
 	}
 
+	void picoTCP::pico_Limits(struct zts_socket_limits *limits)
+	{
+		limits->tcp = -1;
+		limits->tcp_listen = -1;
+		limits->udp = -1;
+		limits->timers = -1;
+		limits->timers_in_use = pico_ntimers();
+	}
+
+	void picoTCP::pico_SetTos(Connection *conn)
+	{
+		// Like PICO_TCP_NODELAY from zts_setsockopt(), the option is a plain field of the socket
+		if(!conn->picosock || conn->closure_ts != -1)
+			return;
+		int tos = conn->tos;
+		pico_socket_setoption(conn->picosock, PICO_SOCKET_OPT_TOS, &tos);
+	}
+
+	void picoTCP::pico_SetKeepalive(Connection *conn)
+	{
+		if(!conn->picosock || conn->closure_ts != -1 || conn->socket_type != SOCK_STREAM)
+			return;
+		// The idle time goes last, setting it is what (re)schedules the socket's probes
+		uint32_t cnt = (uint32_t)conn->keep_cnt;
+		uint32_t intvl = (uint32_t)PowerMode::keepalive(conn->keep_intvl) * 1000;
+		uint32_t idle = conn->keepalive ? (uint32_t)PowerMode::keepalive(conn->keep_idle) * 1000 : 0;
+		pico_socket_setoption(conn->picosock, PICO_SOCKET_OPT_KEEPCNT, &cnt);
+		pico_socket_setoption(conn->picosock, PICO_SOCKET_OPT_KEEPINTVL, &intvl);
+		pico_socket_setoption(conn->picosock, PICO_SOCKET_OPT_KEEPIDLE, &idle);
+	}
+
+	void picoTCP::pico_ApplyOptions(Connection *conn, uint32_t opts)
+	{
+		if(!conn->picosock || conn->closure_ts != -1)
+			return;
+		if(opts & ZT_CONN_OPT_TOS)
+			pico_SetTos(conn);
+		if(opts & ZT_CONN_OPT_KEEPALIVE)
+			pico_SetKeepalive(conn);
+		if(conn->socket_type != SOCK_STREAM)
+			return;
+		if(opts & ZT_CONN_OPT_NODELAY) {
+			int value = conn->tx_nodelay;
+			if(pico_socket_setoption(conn->picosock, PICO_TCP_NODELAY, &value) < 0)
+				DEBUG_ERROR("error while setting TCP_NODELAY, pico_err=%d", pico_err);
+		}
+		// The stack's own buffer decides the TCP window (and with it the scale announced
+		// in the SYN, so set this before connect()/listen() for windows above 64K)
+		if(opts & ZT_CONN_OPT_SNDBUF) {
+			int sz = (int)conn->TXbuf->getCapacity();
+			if(pico_socket_setoption(conn->picosock, PICO_SOCKET_OPT_SNDBUF, &sz) < 0)
+				DEBUG_ERROR("error while setting stack buffer size, pico_err=%d", pico_err);
+		}
+		if(opts & ZT_CONN_OPT_RCVBUF) {
+			int sz = (int)conn->RXbuf->getCapacity();
+			if(pico_socket_setoption(conn->picosock, PICO_SOCKET_OPT_RCVBUF, &sz) < 0)
+				DEBUG_ERROR("error while setting stack buffer size, pico_err=%d", pico_err);
+		}
+	}
+
+	void picoTCP::pico_Stats(Connection *conn, struct zts_socket_stats *stats)
+	{
+		struct pico_tcp_stats st;
+		if(!conn->picosock || conn->closure_ts != -1 || conn->socket_type != SOCK_STREAM)
+			return;
+		if(pico_tcp_get_stats(conn->picosock, &st) < 0)
+			return;
+		stats->retransmits = st.retrans;
+		stats->rtt_ms = st.rtt;
+		stats->rttvar_ms = st.rttvar;
+		stats->rto_ms = st.rto;
+		stats->cwnd = st.cwnd;
+	}
+
+	void picoTCP::pico_Describe(Connection *conn, struct zts_connection_info *info)
+	{
+		union pico_any_addr ip;
+		uint16_t port = 0, proto = 0;
+		struct pico_tcp_stats st;
+		if(!conn->picosock || conn->closure_ts != -1)
+			return;
+		if(pico_socket_getname(conn->picosock, &ip, &port, &proto) == 0)
+			pico_to_sockaddr(&ip, port, proto, &info->local);
+		if(pico_socket_getpeername(conn->picosock, &ip, &port, &proto) == 0)
+			pico_to_sockaddr(&ip, port, proto, &info->peer);
+		if(conn->socket_type == SOCK_STREAM) {
+			if(pico_tcp_get_stats(conn->picosock, &st) == 0) {
+				info->stack_sndq = st.sndq;
+				info->stack_rcvq = st.rcvq;
+			}
+		}
+		else {
+			info->stack_sndq = conn->picosock->q_out.size;
+			info->stack_rcvq = conn->picosock->q_in.size;
+		}
+	}
+
+	int picoTCP::Socket(Connection *conn)
+	{
+		struct pico_socket *p = NULL;
+		pico_Socket(&p, conn->socket_family, conn->socket_type, conn->protocol);
+		if(!p)
+			return -1;
+		conn->picosock = p;
+		conn->driver = this;
+		// zts_setsockopt() may have been called on the socket this one replaces
+		if(conn->tos)
+			pico_SetTos(conn);
+		if(conn->keepalive)
+			pico_SetKeepalive(conn);
+		return 0;
+	}
+
+	void picoTCP::Discard(Connection *conn)
+	{
+		if(!conn->picosock)
+			return;
+		delete (ConnectionPair*)(conn->picosock->priv);
+		conn->picosock->priv = NULL;
+		if(pico_socket_close(conn->picosock) < 0)
+			DEBUG_ERROR("error calling pico_socket_close()");
+		conn->picosock = NULL;
+	}
+
+	void picoTCP::Assign(SocketTap *tap, Connection *conn)
+	{
+		// pointer to tap we use in callbacks from the stack
+		conn->picosock->priv = new ConnectionPair(tap, conn);
+	}
+
+	// Replies are reported by pico_ping_match()
+	void picoTCP::pico_cb_ping(struct pico_icmp4_stats *stats) {}
+
+	void picoTCP::pico_cb_ping_udp(uint16_t ev, struct pico_socket *s)
+	{
+		PingSession *ps = (PingSession*)s->priv;
+		if(!ps || !(ev & PICO_SOCK_EV_RD))
+			return;
+		unsigned char buf[ZT_PING_SIZE];
+		union { struct pico_ip4 ip4; struct pico_ip6 ip6; } peer;
+		uint16_t port;
+		int n;
+		uint32_t seq;
+		while((n = pico_socket_recvfrom(s, buf, sizeof(buf), &peer, &port)) > 0) {
+			if(ps->match(buf, n, &seq))
+				ps->replied(seq);
+		}
+	}
+
+	int picoTCP::pico_PingOpen(SocketTap *tap, PingSession *s)
+	{
+		if(s->proto == ZTS_PING_ICMP)
+			return s->dst.ss_family == AF_INET ? 0 : -1;
+		struct pico_socket *psock = pico_socket_open(s->dst.ss_family == AF_INET6 ? PICO_PROTO_IPV6 : PICO_PROTO_IPV4,
+			PICO_PROTO_UDP, &ZeroTier::picoTCP::pico_cb_ping_udp);
+		if(!psock) {
+			DEBUG_ERROR("unable to open ping socket, pico_err=%d", pico_err);
+			return -1;
+		}
+		psock->priv = s;
+		s->handle = psock;
+		return 0;
+	}
+
+	int picoTCP::pico_Ping(PingSession *s, uint32_t seq)
+	{
+		if(s->proto == ZTS_PING_ICMP) {
+			char ipstr[INET_ADDRSTRLEN];
+			inet_ntop(AF_INET, &((struct sockaddr_in *)&s->dst)->sin_addr, ipstr, sizeof(ipstr));
+			s->sent(seq);
+			int id = pico_icmp4_ping(ipstr, 1, 1, ZTS_PING_TIMEOUT_MS, ZT_PING_SIZE, pico_cb_ping);
+			if(id < 0)
+				return -1;
+			s->ids[seq] = id;
+			Mutex::Lock _l(pico_pings_m);
+			// Ids wrap at 16 bits, a probe that old has long been given up on
+			std::pair<std::map<int, std::pair<PingSession*, uint32_t> >::iterator, bool> r =
+				pico_pings.insert(std::make_pair(id, std::make_pair(s, seq)));
+			if(r.second)
+				pico_pings_n++;
+			else
+				r.first->second = std::make_pair(s, seq);
+			return 0;
+		}
+		unsigned char buf[ZT_PING_SIZE];
+		s->payload(seq, buf);
+		s->sent(seq);
+		struct pico_socket *psock = (struct pico_socket *)s->handle;
+		int r;
+		if(s->dst.ss_family == AF_INET6) {
+			struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&s->dst;
+			struct pico_ip6 dst;
+			memcpy(dst.addr, &in6->sin6_addr, sizeof(dst.addr));
+			r = pico_socket_sendto(psock, buf, sizeof(buf), &dst, in6->sin6_port);
+		}
+		else {
+			struct sockaddr_in *in4 = (struct sockaddr_in *)&s->dst;
+			struct pico_ip4 dst;
+			dst.addr = in4->sin_addr.s_addr;
+			r = pico_socket_sendto(psock, buf, sizeof(buf), &dst, in4->sin_port);
+		}
+		return r < 0 ? -1 : 0;
+	}
+
+	void picoTCP::pico_PingClose(PingSession *s)
+	{
+		if(s->proto == ZTS_PING_ICMP) {
+			Mutex::Lock _l(pico_pings_m);
+			for(size_t i=0; i<s->ids.size(); i++) {
+				std::map<int, std::pair<PingSession*, uint32_t> >::iterator it = pico_pings.find(s->ids[i]);
+				if(s->ids[i] < 0 || it == pico_pings.end() || it->second.first != s)
+					continue;
+				// The cookie itself goes once its timeout fires
+				pico_icmp4_ping_abort(s->ids[i]);
+				pico_pings.erase(it);
+				pico_pings_n--;
+			}
+			return;
+		}
+		struct pico_socket *psock = (struct pico_socket *)s->handle;
+		if(psock) {
+			psock->priv = NULL;
+			pico_socket_close(psock);
+			s->handle = NULL;
+		}
+	}
+
 	char *picoTCP::beautify_pico_error(int err)
 	{
 		if(err==  0) return (char*)"PICO_ERR_NOERR";
@@ -38,6 +38,7 @@
 #include "pico_ipv6.h"
 
 #include "SocketTap.hpp"
+#include "StackDriver.hpp"
 
 /****************************************************************************/
 /* PicoTCP API Signatures (See libzt.h for the API an app should use)       */
@@ -80,10 +81,21 @@ namespace ZeroTier
 	 */
 	int pico_eth_poll(struct pico_device *dev, int loop_score);
 
+	/*
+	 * Neighbor discovery shortcut (see SocketTap::neighborMac()), 0 if mac was filled in
+	 */
+	int pico_nd_resolve(struct pico_device *dev, struct pico_ip6 *addr, struct pico_eth *mac);
+
+	/*
+	 * TCP MSS clamp, the path MTU of the device's tap (see SocketTap::pathMtu())
+	 */
+	uint32_t pico_path_mtu(struct pico_device *dev, union pico_address *remote, int ipv6);
+
 	class SocketTap;
 	struct Connection;
+	struct TapFrame;
 
-	class picoTCP
+	class picoTCP final : public StackDriver
 	{		
 	public:
 
@@ -93,9 +105,20 @@ namespace ZeroTier
 		bool pico_init_interface(ZeroTier::SocketTap *tap, const ZeroTier::InetAddress &ip);
 
 		/*
-		 * Main stack loop
+		 * Removes an address from the tap's device, and with it the routes through it
+		 */
+		void pico_remove_interface_ip(ZeroTier::SocketTap *tap, const ZeroTier::InetAddress &ip);
+
+		/*
+		 * Sets the MTU of the tap's device
+		 */
+		void pico_set_mtu(ZeroTier::SocketTap *tap, unsigned int mtu);
+
+		/*
+		 * One pass of the stack on behalf of the taps served by a StackThread, returns how long
+		 * (ms) the thread may sleep in Phy::poll() before the next pass is due
 		 */
-		void pico_loop(SocketTap *tap);
+		unsigned long pico_loop(std::vector<SocketTap*> &taps);
 
 		/*
 		 * Read bytes from the stack to the RX buffer (prepare to be read by app)
@@ -112,6 +135,50 @@ namespace ZeroTier
 		 */
 		static void pico_cb_tcp_write(SocketTap *tap, struct pico_socket *s);
 
+		/*
+		 * Moves data for direct I/O Connections which app threads have queued up since the 
+		 * last pass (see SocketTap::WakeDirect())
+		 */
+		static void pico_service_direct(SocketTap *tap);
+
+		/*
+		 * Gives each Connection in the tap's _pico_rx_backlog another ZT_TCP_RX_QUANTUM of what
+		 * the stack has for it, in the order they ran out
+		 */
+		static void pico_service_rx(SocketTap *tap);
+
+		/*
+		 * Flushes RXbuf to the app's end of the socketpair, then takes what the stack has been
+		 * holding on to for us (see pico_cb_tcp_read()) for as long as the app keeps up. Returns
+		 * the number of bytes delivered
+		 */
+		static size_t pico_deliver_rx(SocketTap *tap, Connection *conn);
+
+		/*
+		 * Delivers what the pass (services and stack tick) put in the RXbufs of the tap's
+		 * Connections, one flush each however many reads there were, see _pico_rx_flush
+		 */
+		static void pico_flush_rx(SocketTap *tap);
+
+		/*
+		 * Delivers what the stack reported on Connections before the app accepted them (see
+		 * pico_Accept())
+		 */
+		static void pico_service_accepted(SocketTap *tap);
+
+		/*
+		 * Sends TX data which was held back (see ZT_SO_TCP_COALESCE_BYTES, TCP_CORK, the egress
+		 * shapers) once its hold has expired, returns how long (ms) until the next hold
+		 * expires, 0 if none
+		 */
+		static unsigned long pico_service_held(SocketTap *tap);
+
+		/*
+		 * Sends frames held back by zts_set_impairment() once they are due, returns how long
+		 * (ms) until the next one is, 0 if none are waiting
+		 */
+		static unsigned long pico_service_impaired(SocketTap *tap);
+
 		/*
 		 * Write bytes from TX buffer to stack (prepare to be sent to ZT virtual wire)
 		 */
@@ -121,6 +188,11 @@ namespace ZeroTier
 		 * Packets from the ZeroTier virtual wire enter the stack here
 		 */
 		void pico_rx(SocketTap *tap, const ZeroTier::MAC &from,const ZeroTier::MAC &to,unsigned int etherType,const void *data,unsigned int len);
+
+		/*
+		 * Batched pico_rx(), frames are queued under one lock acquisition
+		 */
+		void pico_rx_batch(SocketTap *tap, const TapFrame *frames, unsigned int n);
 		
 		/*
 		 * Creates a stack-specific "socket" or "connection object"
@@ -147,6 +219,11 @@ namespace ZeroTier
 		 */
 		Connection* pico_Accept(Connection *conn);
 
+		/*
+		 * Fills in the remote address of an accepted or connected Connection - Called from SocketTap
+		 */
+		void pico_Peername(Connection *conn, struct sockaddr_storage *addr);
+
 		/*
 		 * Read from RX buffer to application - Called from SocketTap
 		 */
@@ -162,6 +239,88 @@ namespace ZeroTier
 		 */
 		int pico_Close(Connection *conn);
 
+		/*
+		 * Fills in RTT, retransmits, etc. from conn's picoTCP socket - Called from SocketTap
+		 */
+		void pico_Stats(Connection *conn, struct zts_socket_stats *stats);
+
+		/*
+		 * Fills in the addresses and queue depths of conn's picoTCP socket
+		 */
+		void pico_Describe(Connection *conn, struct zts_connection_info *info);
+
+		/*
+		 * picoTCP allocates sockets from the heap, only its timer heap is of fixed size
+		 */
+		void pico_Limits(struct zts_socket_limits *limits);
+
+		/*
+		 * Sets conn's picoTCP socket's TOS, which it copies to sockets accepted from it
+		 */
+		void pico_SetTos(Connection *conn);
+
+		/*
+		 * Sets (or clears) keepalive on conn's picoTCP socket, which copies it to sockets
+		 * accepted from it
+		 */
+		void pico_SetKeepalive(Connection *conn);
+
+		/*
+		 * Applies TCP_NODELAY, the buffer sizes, TOS and keepalive as opts asks
+		 */
+		void pico_ApplyOptions(Connection *conn, uint32_t opts);
+
+		/*
+		 * zts_ping() probes. ICMP goes through pico_icmp4_ping(), one ping (of its own id) per
+		 * probe, UDP through a socket of the session's own
+		 */
+		int pico_PingOpen(SocketTap *tap, PingSession *s);
+		int pico_Ping(PingSession *s, uint32_t seq);
+		void pico_PingClose(PingSession *s);
+		static void pico_cb_ping(struct pico_icmp4_stats *stats);
+		static void pico_cb_ping_udp(uint16_t ev, struct pico_socket *s);
+
+		/****************************************************************************/
+		/* StackDriver                                                              */
+		/****************************************************************************/
+
+		int id() const { return ZTS_STACK_PICO; }
+		bool init_interface(SocketTap *tap, const InetAddress &ip) { return pico_init_interface(tap, ip); }
+		void remove_interface_ip(SocketTap *tap, const InetAddress &ip) { pico_remove_interface_ip(tap, ip); }
+		void set_mtu(SocketTap *tap, unsigned int mtu) { pico_set_mtu(tap, mtu); }
+		unsigned long loop(std::vector<SocketTap*> &taps) { return pico_loop(taps); }
+		void rx(SocketTap *tap, const MAC &from,const MAC &to,unsigned int etherType,const void *data,unsigned int len) {
+			pico_rx(tap, from, to, etherType, data, len);
+		}
+		void rx_batch(SocketTap *tap, const TapFrame *frames, unsigned int n) { pico_rx_batch(tap, frames, n); }
+		int Socket(Connection *conn);
+		void Discard(Connection *conn);
+		void Assign(SocketTap *tap, Connection *conn);
+		int Connect(SocketTap *tap, Connection *conn, int fd, const struct sockaddr *addr, socklen_t addrlen) {
+			return pico_Connect(conn, fd, addr, addrlen);
+		}
+		int SetLocalPort(Connection *conn, uint16_t port);
+		int Bind(SocketTap *tap, Connection *conn, int fd, const struct sockaddr *addr, socklen_t addrlen) {
+			return pico_Bind(conn, fd, addr, addrlen);
+		}
+		int Listen(Connection *conn, int fd, int backlog) { return pico_Listen(conn, fd, backlog); }
+		Connection *Accept(Connection *conn) { return pico_Accept(conn); }
+		void Peername(Connection *conn, struct sockaddr_storage *addr) { pico_Peername(conn, addr); }
+		int Read(SocketTap *tap, PhySocket *sock, Connection *conn, bool stack_invoked) {
+			return pico_Read(tap, sock, conn, stack_invoked);
+		}
+		int Write(Connection *conn, void *data, ssize_t len) { return pico_Write(conn, data, len); }
+		int Close(Connection *conn) { return pico_Close(conn); } // conn is detached and MarkClosed() from here
+		void Stats(Connection *conn, struct zts_socket_stats *stats) { pico_Stats(conn, stats); }
+		void Describe(Connection *conn, struct zts_connection_info *info) { pico_Describe(conn, info); }
+		void Limits(struct zts_socket_limits *limits) { pico_Limits(limits); }
+		void SetTos(Connection *conn) { pico_SetTos(conn); }
+		void SetKeepalive(Connection *conn) { pico_SetKeepalive(conn); }
+		void ApplyOptions(Connection *conn, uint32_t opts) { pico_ApplyOptions(conn, opts); }
+		int PingOpen(SocketTap *tap, PingSession *s) { return pico_PingOpen(tap, s); }
+		int Ping(PingSession *s, uint32_t seq) { return pico_Ping(s, seq); }
+		void PingClose(PingSession *s) { pico_PingClose(s); }
+
 		/*
 		 * Converts picoTCP error codes to pretty string
 		 */
@@ -0,0 +1,1545 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+ // Throughput/latency benchmark between two library instances (see TESTING.md)
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <dirent.h>
+#if defined(__linux__)
+#include <malloc.h>
+#endif
+
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <map>
+
+#include "libzt.h"
+
+#define BENCH_MIN_MSG_SZ       64
+#define BENCH_MAX_MSG_SZ       1024*1024
+#define BENCH_CASE_BYTES       64*1024*1024 // payload sent per case (split across connections)
+#define BENCH_MAX_ROUNDS       10000        // round trips per connection, per case
+#define BENCH_POLL_TIMEOUT     10000        // ms without progress before a case is abandoned
+#define BENCH_IO_BUF_SZ        64*1024
+
+#if defined(STACK_PICO)
+	#define BENCH_STACK "picotcp"
+#elif defined(STACK_LWIP)
+	#define BENCH_STACK "lwip"
+#else
+	#define BENCH_STACK "none"
+#endif
+
+std::map<std::string, std::string> testConf;
+
+/****************************************************************************/
+/* Helper Functions                                                         */
+/****************************************************************************/
+
+void loadTestConfigFile(std::string filepath)
+{
+	std::string key, value, prefix;
+	std::ifstream testFile;
+	testFile.open(filepath.c_str());
+	while (testFile >> key >> value) {
+		if(key == "name") {
+			prefix = value;
+		}
+		if(key[0] != '#' && key[0] != ';') {
+			testConf[prefix + "." + key] = value;
+		}
+	}
+	testFile.close();
+}
+
+void create_addr(std::string ipstr, int port, int ipv, struct sockaddr *saddr)
+{
+	struct hostent *server;
+	if(ipv == 4) {
+		struct sockaddr_in *in4 = (struct sockaddr_in*)saddr;
+		memset(in4, 0, sizeof(struct sockaddr_in));
+		in4->sin_port = htons(port);
+		in4->sin_addr.s_addr = inet_addr(ipstr.c_str());
+		in4->sin_family = AF_INET;
+	}
+	if(ipv == 6) {
+		struct sockaddr_in6 *in6 = (struct sockaddr_in6*)saddr;
+		server = gethostbyname2(ipstr.c_str(),AF_INET6);
+		memset((char *) in6, 0, sizeof(struct sockaddr_in6));
+		in6->sin6_flowinfo = 0;
+		in6->sin6_family = AF_INET6;
+		if(server)
+			memmove((char *) in6->sin6_addr.s6_addr, (char *) server->h_addr, server->h_length);
+		in6->sin6_port = htons(port);
+	}
+}
+
+// With bench sim timescale=, time is that of the stacks (see zts_sim_get_time())
+bool bench_sim_time = false;
+
+// microseconds, monotonic
+uint64_t now_us()
+{
+	uint64_t us;
+	if(bench_sim_time && zts_sim_get_time(&us) == 0)
+		return us;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// user+system CPU time consumed by this process (app and stack threads), in microseconds
+uint64_t cpu_us()
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000
+		+ ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+// nearest-rank percentile of a sorted sample set
+uint64_t percentile(const std::vector<uint64_t> &v, double p)
+{
+	if(v.empty())
+		return 0;
+	size_t rank = (size_t)(p * v.size() + 0.999999);
+	if(rank < 1)
+		rank = 1;
+	return v[std::min(rank, v.size()) - 1];
+}
+
+std::vector<int> parse_list(const std::string &s)
+{
+	std::vector<int> out;
+	size_t pos = 0;
+	while(pos < s.size()) {
+		size_t end = s.find(',', pos);
+		if(end == std::string::npos)
+			end = s.size();
+		int v = atoi(s.substr(pos, end - pos).c_str());
+		if(v > 0)
+			out.push_back(v);
+		pos = end + 1;
+	}
+	return out;
+}
+
+// "<delay_ms>:<loss_ppm>,..." for netem=, 0:0 being an unimpaired path
+std::vector<std::pair<int, int> > parse_netem(const std::string &s)
+{
+	std::vector<std::pair<int, int> > out;
+	size_t pos = 0;
+	while(pos < s.size()) {
+		size_t end = s.find(',', pos);
+		if(end == std::string::npos)
+			end = s.size();
+		std::string item = s.substr(pos, end - pos);
+		size_t colon = item.find(':');
+		int delay = atoi(item.substr(0, colon).c_str());
+		int loss = colon == std::string::npos ? 0 : atoi(item.substr(colon + 1).c_str());
+		out.push_back(std::make_pair(std::max(delay, 0), std::max(loss, 0)));
+		pos = end + 1;
+	}
+	return out;
+}
+
+// "<latency_ms>:<jitter_ms>:<loss_ppm>:<reorder_ppm>:<mbps>,..." for wire=, trailing fields may be left out
+std::vector<struct zts_sim_config> parse_wire(const std::string &s)
+{
+	std::vector<struct zts_sim_config> out;
+	size_t pos = 0;
+	while(pos < s.size()) {
+		size_t end = s.find(',', pos);
+		if(end == std::string::npos)
+			end = s.size();
+		std::string item = s.substr(pos, end - pos);
+		int f[5] = { 0, 0, 0, 0, 0 };
+		size_t p = 0;
+		for(int i=0; i<5 && p <= item.size(); i++) {
+			size_t colon = item.find(':', p);
+			if(colon == std::string::npos)
+				colon = item.size();
+			f[i] = std::max(atoi(item.substr(p, colon - p).c_str()), 0);
+			p = colon + 1;
+		}
+		struct zts_sim_config c;
+		memset(&c, 0, sizeof(c));
+		c.latency_ms = f[0], c.jitter_ms = f[1], c.loss_ppm = f[2], c.reorder_ppm = f[3];
+		c.bandwidth_bps = (uint64_t)f[4] * 1000000;
+		out.push_back(c);
+		pos = end + 1;
+	}
+	return out;
+}
+
+std::vector<std::string> parse_names(const std::string &s)
+{
+	std::vector<std::string> out;
+	size_t pos = 0;
+	while(pos < s.size()) {
+		size_t end = s.find(',', pos);
+		if(end == std::string::npos)
+			end = s.size();
+		if(end > pos)
+			out.push_back(s.substr(pos, end - pos));
+		pos = end + 1;
+	}
+	return out;
+}
+
+/****************************************************************************/
+/* Echo server (one listener per address family, one poll loop for data)    */
+/****************************************************************************/
+
+struct bench_listener
+{
+	int fd;
+	pthread_mutex_t *m;
+	std::vector<int> *pending;
+};
+
+void *accept_loop(void *arg)
+{
+	struct bench_listener *l = (struct bench_listener *)arg;
+	int accfds[ZT_ACCEPT_MANY_MAX];
+	while(true) {
+		int n = zts_accept_many(l->fd, accfds, NULL, ZT_ACCEPT_MANY_MAX);
+		if(n < 0) {
+			DEBUG_ERROR("error accepting connection (errno=%d)", errno);
+			usleep(100000);
+			continue;
+		}
+		for(int i=0; i<n; i++)
+			zts_fcntl(accfds[i], F_SETFL, O_NONBLOCK);
+		pthread_mutex_lock(l->m);
+		l->pending->insert(l->pending->end(), accfds, accfds + n);
+		pthread_mutex_unlock(l->m);
+	}
+	return NULL;
+}
+
+int start_listener(std::string ipstr, int port, int ipv, struct bench_listener *l)
+{
+	struct sockaddr_storage addr;
+	int err;
+	create_addr(ipstr, port, ipv, (struct sockaddr *)&addr);
+	if((l->fd = zts_socket(ipv == 4 ? AF_INET : AF_INET6, SOCK_STREAM, 0)) < 0) {
+		DEBUG_ERROR("error creating ZeroTier socket");
+		return -1;
+	}
+	socklen_t len = ipv == 4 ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+	if((err = zts_bind(l->fd, (struct sockaddr *)&addr, len)) < 0) {
+		DEBUG_ERROR("error binding to interface (%d)", err);
+		return -1;
+	}
+	if((err = zts_listen(l->fd, 1024)) < 0) {
+		DEBUG_ERROR("error placing socket in LISTENING state (%d)", err);
+		return -1;
+	}
+	pthread_t t;
+	return pthread_create(&t, NULL, accept_loop, l);
+}
+
+// Echoes every byte the sockets accepted by l's listener(s) receive back to the sender, forever
+void *echo_loop(void *arg)
+{
+	pthread_mutex_t &m = *((struct bench_listener *)arg)->m;
+	std::vector<int> &pending = *((struct bench_listener *)arg)->pending;
+	std::vector<struct pollfd> fds;
+	std::vector<std::string> backlog; // bytes read but not yet written back, per fd
+	char *buf = (char *)malloc(BENCH_IO_BUF_SZ);
+	while(true) {
+		pthread_mutex_lock(&m);
+		for(size_t i=0; i<pending.size(); i++) {
+			struct pollfd p = { pending[i], POLLIN, 0 };
+			fds.push_back(p);
+			backlog.push_back(std::string());
+		}
+		pending.clear();
+		pthread_mutex_unlock(&m);
+
+		if(zts_poll(fds.data(), fds.size(), 10) <= 0)
+			continue;
+		for(size_t i=0; i<fds.size(); i++) {
+			bool dead = (fds[i].revents & (POLLERR | POLLNVAL)) != 0;
+			if(!dead && (fds[i].revents & (POLLIN | POLLHUP))) {
+				int r = zts_read(fds[i].fd, buf, BENCH_IO_BUF_SZ);
+				if(r > 0)
+					backlog[i].append(buf, r);
+				else if(r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+					dead = true;
+			}
+			if(!dead && backlog[i].size()) {
+				int w = zts_write(fds[i].fd, backlog[i].data(), backlog[i].size());
+				if(w > 0)
+					backlog[i].erase(0, w);
+				else if(w < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+					dead = true;
+			}
+			if(dead) {
+				zts_close(fds[i].fd);
+				fds.erase(fds.begin() + i);
+				backlog.erase(backlog.begin() + i);
+				i--;
+				continue;
+			}
+			fds[i].events = backlog[i].size() ? POLLIN | POLLOUT : POLLIN;
+		}
+	}
+	return NULL;
+}
+
+void echo_server(std::string ipstr, std::string ipstr6, int port)
+{
+	pthread_mutex_t m = PTHREAD_MUTEX_INITIALIZER;
+	std::vector<int> pending;
+	struct bench_listener l4 = { -1, &m, &pending }, l6 = { -1, &m, &pending };
+	if(start_listener(ipstr, port, 4, &l4) < 0)
+		DEBUG_ERROR("no ipv4 listener");
+	if(start_listener(ipstr6, port + 1, 6, &l6) < 0)
+		DEBUG_ERROR("no ipv6 listener");
+	DEBUG_TEST("echoing on port %d (ipv4) and %d (ipv6)", port, port + 1);
+	echo_loop(&l4);
+}
+
+/****************************************************************************/
+/* Client (drives every connection of a case from one poll loop)            */
+/****************************************************************************/
+
+struct bench_conn
+{
+	int fd;
+	int rounds_left;
+	size_t tx_left; // bytes of the current message still to be written
+	size_t rx_left; // bytes of the current echo still to be read
+	uint64_t t0;
+};
+
+struct bench_result
+{
+	std::string cc;   // congestion control, "" for the stack's default
+	int delay_ms;     // impairment on this side's frames, see zts_set_impairment()
+	int loss_ppm;
+	int ipv;
+	int conns;
+	int msg_sz;
+	uint64_t bytes;   // payload written (the same amount is read back)
+	uint64_t wall_us;
+	uint64_t cpu_us;
+	std::vector<uint64_t> lat; // per-message round trip, us
+	std::string wire; // simulated wire's impairments (wire= in sim mode), "" otherwise
+	bool ok;
+};
+
+bool run_case(struct sockaddr *addr, socklen_t addrlen, const std::string &cc, int ipv, int conns, int msg_sz, struct bench_result *res)
+{
+	res->cc = cc, res->ipv = ipv, res->conns = conns, res->msg_sz = msg_sz;
+	res->bytes = 0, res->wall_us = 0, res->cpu_us = 0, res->ok = false;
+	res->lat.clear();
+
+	uint64_t per_conn = (uint64_t)BENCH_CASE_BYTES / conns;
+	int rounds = (int)std::min((uint64_t)BENCH_MAX_ROUNDS, std::max((uint64_t)1, per_conn / msg_sz));
+
+	std::vector<struct bench_conn> cs(conns);
+	std::vector<struct pollfd> fds(conns);
+	int opened = 0;
+	for(; opened<conns; opened++) {
+		int fd;
+		if((fd = zts_socket(ipv == 4 ? AF_INET : AF_INET6, SOCK_STREAM, 0)) < 0) {
+			DEBUG_ERROR("error creating ZeroTier socket (%d of %d)", opened, conns);
+			break;
+		}
+#if defined(TCP_CONGESTION)
+		if(cc.size() && zts_setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, cc.c_str(), cc.size()) < 0) {
+			DEBUG_ERROR("error selecting congestion control %s (errno=%d)", cc.c_str(), errno);
+			zts_close(fd);
+			break;
+		}
+#endif
+		if(zts_connect(fd, addr, addrlen) < 0) {
+			DEBUG_ERROR("error connecting to remote host (%d of %d, errno=%d)", opened, conns, errno);
+			zts_close(fd);
+			break;
+		}
+		zts_fcntl(fd, F_SETFL, O_NONBLOCK);
+		cs[opened].fd = fd;
+		cs[opened].rounds_left = rounds;
+		cs[opened].tx_left = msg_sz;
+		cs[opened].rx_left = msg_sz;
+		cs[opened].t0 = 0;
+		fds[opened].fd = fd;
+		fds[opened].events = POLLIN | POLLOUT;
+	}
+	if(opened < conns) {
+		for(int i=0; i<opened; i++)
+			zts_close(cs[i].fd);
+		return false;
+	}
+
+	char *tbuf = (char *)malloc(msg_sz);
+	char *rbuf = (char *)malloc(BENCH_IO_BUF_SZ);
+	memset(tbuf, 0x5a, msg_sz);
+	res->lat.reserve((size_t)conns * rounds);
+
+	int active = conns;
+	bool stalled = false;
+	uint64_t cpu_start = cpu_us();
+	uint64_t start = now_us();
+	while(active) {
+		int n = zts_poll(fds.data(), fds.size(), BENCH_POLL_TIMEOUT);
+		if(n <= 0) {
+			DEBUG_ERROR("no progress for %d ms, abandoning case (active=%d)", BENCH_POLL_TIMEOUT, active);
+			stalled = true;
+			break;
+		}
+		for(int i=0; i<conns; i++) {
+			struct bench_conn *c = &cs[i];
+			if(fds[i].fd < 0 || !fds[i].revents)
+				continue;
+			if(fds[i].revents & (POLLERR | POLLNVAL)) {
+				stalled = true;
+				fds[i].fd = -1;
+				active--;
+				continue;
+			}
+			if(c->tx_left && (fds[i].revents & POLLOUT)) {
+				if(c->tx_left == (size_t)msg_sz)
+					c->t0 = now_us();
+				int w = zts_write(c->fd, tbuf + (msg_sz - c->tx_left), c->tx_left);
+				if(w > 0) {
+					c->tx_left -= w;
+					res->bytes += w;
+				}
+			}
+			if(fds[i].revents & (POLLIN | POLLHUP)) {
+				int r = zts_read(c->fd, rbuf, std::min(c->rx_left, (size_t)BENCH_IO_BUF_SZ));
+				if(r > 0)
+					c->rx_left -= r;
+				else if(r == 0) {
+					stalled = true;
+					fds[i].fd = -1;
+					active--;
+					continue;
+				}
+			}
+			if(!c->rx_left) {
+				res->lat.push_back(now_us() - c->t0);
+				if(--c->rounds_left == 0) {
+					fds[i].fd = -1;
+					active--;
+					continue;
+				}
+				c->tx_left = msg_sz;
+				c->rx_left = msg_sz;
+			}
+			fds[i].events = c->tx_left ? POLLIN | POLLOUT : POLLIN;
+		}
+	}
+	res->wall_us = now_us() - start;
+	res->cpu_us = cpu_us() - cpu_start;
+
+	for(int i=0; i<conns; i++)
+		zts_close(cs[i].fd);
+	free(tbuf);
+	free(rbuf);
+	std::sort(res->lat.begin(), res->lat.end());
+	res->ok = !stalled;
+	return res->ok;
+}
+
+void print_result(const struct bench_result *r, bool json)
+{
+	double secs = r->wall_us / 1000000.0;
+	double rate = secs > 0 ? (r->bytes / (1024.0 * 1024.0)) / secs : 0;
+	// CPU time per byte moved in either direction
+	double cpu_ns_per_byte = r->bytes ? (r->cpu_us * 1000.0) / (2.0 * r->bytes) : 0;
+	uint64_t p50 = percentile(r->lat, 0.50), p99 = percentile(r->lat, 0.99), p999 = percentile(r->lat, 0.999);
+	if(json) {
+		printf("{\"stack\":\"%s\",\"wire\":\"%s\",\"cc\":\"%s\",\"delay_ms\":%d,\"loss_ppm\":%d,\"ipv\":%d,\"conns\":%d,\"msg_sz\":%d,\"bytes\":%llu,\"secs\":%.3f,"
+			"\"rate_mbps\":%.2f,\"p50_us\":%llu,\"p99_us\":%llu,\"p999_us\":%llu,\"cpu_ns_per_byte\":%.3f,\"ok\":%s}\n",
+			BENCH_STACK, r->wire.c_str(), r->cc.c_str(), r->delay_ms, r->loss_ppm, r->ipv, r->conns, r->msg_sz, (unsigned long long)r->bytes, secs, rate,
+			(unsigned long long)p50, (unsigned long long)p99, (unsigned long long)p999, cpu_ns_per_byte,
+			r->ok ? "true" : "false");
+	}
+	else {
+		printf("%s,%s,%d,%d,%d,%d,%d,%llu,%.3f,%.2f,%llu,%llu,%llu,%.3f,%d%s%s\n",
+			BENCH_STACK, r->cc.c_str(), r->delay_ms, r->loss_ppm, r->ipv, r->conns, r->msg_sz, (unsigned long long)r->bytes, secs, rate,
+			(unsigned long long)p50, (unsigned long long)p99, (unsigned long long)p999, cpu_ns_per_byte,
+			r->ok, r->wire.size() ? "," : "", r->wire.c_str());
+	}
+	fflush(stdout);
+}
+
+/****************************************************************************/
+/* Cold start (service start to first connected socket)                     */
+/****************************************************************************/
+
+struct bench_ready
+{
+	pthread_mutex_t m;
+	pthread_cond_t c;
+	int status;
+	bool done;
+	uint64_t at;
+};
+
+void on_ready(const char *nwid, int status, void *arg)
+{
+	struct bench_ready *r = (struct bench_ready *)arg;
+	pthread_mutex_lock(&r->m);
+	r->status = status;
+	r->at = now_us();
+	r->done = true;
+	pthread_cond_signal(&r->c);
+	pthread_mutex_unlock(&r->m);
+}
+
+// Uses the identity saved in idfile (generating and saving one first if there is none)
+bool provision_identity(const std::string &zpath, const std::string &idfile)
+{
+	char secret[ZT_IDENTITY_SECRET_LEN];
+	memset(secret, 0, sizeof(secret));
+	FILE *f = fopen(idfile.c_str(), "r");
+	if(f) {
+		if(!fgets(secret, sizeof(secret), f))
+			secret[0] = 0;
+		fclose(f);
+	}
+	else {
+		if(zts_generate_identity(secret, sizeof(secret)) < 0)
+			return false;
+		if((f = fopen(idfile.c_str(), "w"))) {
+			fputs(secret, f);
+			fclose(f);
+		}
+	}
+	return zts_set_identity(zpath.c_str(), secret) == 0;
+}
+
+// Starts the service and connects once, reporting how long each step took
+int run_startup(const std::string &zpath, const std::string &nwid, struct sockaddr *addr, 
+	socklen_t addrlen, int ipv, bool provisioned, bool json)
+{
+	struct bench_ready r;
+	pthread_mutex_init(&r.m, NULL);
+	pthread_cond_init(&r.c, NULL);
+	r.done = false;
+	uint64_t start = now_us();
+	if(zts_start_async(zpath.c_str(), nwid.c_str(), BENCH_POLL_TIMEOUT * 6, on_ready, &r) < 0) {
+		DEBUG_ERROR("error starting service (errno=%d)", errno);
+		return 1;
+	}
+	pthread_mutex_lock(&r.m);
+	while(!r.done)
+		pthread_cond_wait(&r.c, &r.m);
+	pthread_mutex_unlock(&r.m);
+	if(r.status) {
+		DEBUG_ERROR("network never became ready (status=%d)", r.status);
+		return 1;
+	}
+	int fd = zts_socket(ipv == 4 ? AF_INET : AF_INET6, SOCK_STREAM, 0);
+	int err = fd < 0 ? -1 : zts_connect(fd, addr, addrlen);
+	uint64_t connected = now_us();
+	if(fd >= 0)
+		zts_close(fd);
+	if(err < 0) {
+		DEBUG_ERROR("error connecting to remote host (errno=%d)", errno);
+		return 1;
+	}
+	double ready_ms = (r.at - start) / 1000.0, connect_ms = (connected - start) / 1000.0;
+	if(json) {
+		printf("{\"stack\":\"%s\",\"ipv\":%d,\"provisioned\":%s,\"ready_ms\":%.3f,\"connect_ms\":%.3f}\n",
+			BENCH_STACK, ipv, provisioned ? "true" : "false", ready_ms, connect_ms);
+	}
+	else {
+		printf("stack,ipv,provisioned,ready_ms,connect_ms\n");
+		printf("%s,%d,%d,%.3f,%.3f\n", BENCH_STACK, ipv, provisioned, ready_ms, connect_ms);
+	}
+	fflush(stdout);
+	return 0;
+}
+
+#define BENCH_PING_COUNT       1000
+#define BENCH_PING_INTERVAL_US 1000
+
+// RTT of the overlay alone, ICMP echo sent and received by the stack (see zts_ping())
+int run_ping(struct sockaddr *addr, socklen_t addrlen, int count, bool json)
+{
+	struct zts_ping_stats stats;
+	if(zts_ping(addr, addrlen, count, BENCH_PING_INTERVAL_US, NULL, NULL, &stats) < 0) {
+		DEBUG_ERROR("error pinging remote host (errno=%d)", errno);
+		return 1;
+	}
+	if(json) {
+		printf("{\"stack\":\"%s\",\"sent\":%d,\"received\":%d,\"min_us\":%llu,\"avg_us\":%llu,"
+			"\"p50_us\":%llu,\"p90_us\":%llu,\"p99_us\":%llu,\"max_us\":%llu}\n", BENCH_STACK, stats.sent,
+			stats.received, (unsigned long long)stats.min_us, (unsigned long long)stats.avg_us,
+			(unsigned long long)stats.p50_us, (unsigned long long)stats.p90_us, (unsigned long long)stats.p99_us,
+			(unsigned long long)stats.max_us);
+	}
+	else {
+		printf("stack,sent,received,min_us,avg_us,p50_us,p90_us,p99_us,max_us\n");
+		printf("%s,%d,%d,%llu,%llu,%llu,%llu,%llu,%llu\n", BENCH_STACK, stats.sent, stats.received,
+			(unsigned long long)stats.min_us, (unsigned long long)stats.avg_us, (unsigned long long)stats.p50_us,
+			(unsigned long long)stats.p90_us, (unsigned long long)stats.p99_us, (unsigned long long)stats.max_us);
+	}
+	fflush(stdout);
+	return stats.received ? 0 : 1;
+}
+
+/****************************************************************************/
+/* Simulated wire (both ends in this process, see zts_sim_start())          */
+/****************************************************************************/
+
+#define BENCH_SIM_SERVER_NWID  "5a5a5a5a00000001"
+#define BENCH_SIM_CLIENT_NWID  "5a5a5a5a00000002"
+#define BENCH_SIM_SERVER_ADDR  "10.147.0.1"
+#define BENCH_SIM_CLIENT_ADDR  "10.147.0.2"
+#define BENCH_SIM_PORT         7000
+
+#define BENCH_SCALE_MAX_THREADS 64
+#define BENCH_SCALE_MSG_SZ     64
+
+struct bench_scaler
+{
+	struct sockaddr_in *addr;
+	volatile bool *stop;
+	uint64_t cycles;
+	uint64_t failures;
+};
+
+// socket(), connect(), write(), read() back the echo and close(), until told to stop
+void *scale_loop(void *arg)
+{
+	struct bench_scaler *s = (struct bench_scaler *)arg;
+	char tbuf[BENCH_SCALE_MSG_SZ], rbuf[BENCH_SCALE_MSG_SZ];
+	memset(tbuf, 0x5a, sizeof(tbuf));
+	while(!*s->stop) {
+		int fd = zts_socket(AF_INET, SOCK_STREAM, 0);
+		if(fd < 0) {
+			s->failures++;
+			usleep(1000);
+			continue;
+		}
+		bool ok = zts_connect(fd, (struct sockaddr *)s->addr, sizeof(struct sockaddr_in)) == 0
+			&& zts_write(fd, tbuf, sizeof(tbuf)) == (int)sizeof(tbuf);
+		for(size_t got=0; ok && got<sizeof(rbuf); ) {
+			int r = zts_read(fd, rbuf, sizeof(rbuf) - got);
+			ok = r > 0;
+			got += ok ? r : 0;
+		}
+		zts_close(fd);
+		ok ? s->cycles++ : s->failures++;
+	}
+	return NULL;
+}
+
+void print_scale(int threads, uint64_t cycles, uint64_t failures, double secs, const char *lock, const struct zts_lock_stats *l, bool json)
+{
+	double rate = secs > 0 ? cycles / secs : 0;
+	if(json) {
+		printf("{\"stack\":\"%s\",\"threads\":%d,\"cycles\":%llu,\"failures\":%llu,\"secs\":%.3f,\"cycles_per_sec\":%.1f,\"ops_per_sec\":%.1f,"
+			"\"lock\":\"%s\",\"acquisitions\":%llu,\"contended\":%llu,\"hold_p50_ns\":%llu,\"hold_p99_ns\":%llu,\"hold_p999_ns\":%llu,"
+			"\"hold_max_ns\":%llu,\"wait_p99_ns\":%llu,\"wait_max_ns\":%llu}\n",
+			BENCH_STACK, threads, (unsigned long long)cycles, (unsigned long long)failures, secs, rate, rate * 5, lock,
+			(unsigned long long)l->acquisitions, (unsigned long long)l->contended, (unsigned long long)l->hold_p50_ns,
+			(unsigned long long)l->hold_p99_ns, (unsigned long long)l->hold_p999_ns, (unsigned long long)l->hold_max_ns,
+			(unsigned long long)l->wait_p99_ns, (unsigned long long)l->wait_max_ns);
+	}
+	else {
+		printf("%s,%d,%llu,%llu,%.3f,%.1f,%.1f,%s,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu\n",
+			BENCH_STACK, threads, (unsigned long long)cycles, (unsigned long long)failures, secs, rate, rate * 5, lock,
+			(unsigned long long)l->acquisitions, (unsigned long long)l->contended, (unsigned long long)l->hold_p50_ns,
+			(unsigned long long)l->hold_p99_ns, (unsigned long long)l->hold_p999_ns, (unsigned long long)l->hold_max_ns,
+			(unsigned long long)l->wait_p99_ns, (unsigned long long)l->wait_max_ns);
+	}
+	fflush(stdout);
+}
+
+/*
+ * Runs scale_loop() on each thread count for secs and writes a row per lock (see
+ * zts_get_lock_stats(), a single row with lock "none" unless built with ZT_LOCK_STATS=1)
+ */
+int run_scale(struct sockaddr_in *addr, const std::vector<int> &thread_counts, int secs, bool json)
+{
+	if(!json)
+		printf("stack,threads,cycles,failures,secs,cycles_per_sec,ops_per_sec,lock,acquisitions,contended,hold_p50_ns,hold_p99_ns,hold_p999_ns,hold_max_ns,wait_p99_ns,wait_max_ns\n");
+	int failures = 0;
+	for(size_t i=0; i<thread_counts.size(); i++) {
+		int n = std::min(thread_counts[i], BENCH_SCALE_MAX_THREADS);
+		volatile bool stop = false;
+		std::vector<struct bench_scaler> ss(n);
+		std::vector<pthread_t> ts(n);
+		zts_reset_lock_stats();
+		uint64_t start = now_us();
+		for(int t=0; t<n; t++) {
+			ss[t].addr = addr, ss[t].stop = &stop, ss[t].cycles = 0, ss[t].failures = 0;
+			pthread_create(&ts[t], NULL, scale_loop, &ss[t]);
+		}
+		sleep(secs);
+		stop = true;
+		uint64_t cycles = 0, failed = 0;
+		for(int t=0; t<n; t++) {
+			pthread_join(ts[t], NULL);
+			cycles += ss[t].cycles;
+			failed += ss[t].failures;
+		}
+		double elapsed = (now_us() - start) / 1000000.0;
+		failures += failed > 0;
+		struct zts_lock_stats l;
+		if(zts_get_lock_stats(0, &l) < 0) {
+			memset(&l, 0, sizeof(l));
+			print_scale(n, cycles, failed, elapsed, "none", &l, json);
+			continue;
+		}
+		for(int k=0; k<ZTS_LOCK_COUNT; k++) {
+			zts_get_lock_stats(k, &l);
+			print_scale(n, cycles, failed, elapsed, l.name, &l, json);
+		}
+	}
+	return failures ? 1 : 0;
+}
+
+#define BENCH_CHURN_PORT       (BENCH_SIM_PORT + 2)
+#define BENCH_CHURN_SETTLE_MS  1000 // for closed connections to be reaped before growth is measured
+
+// Connections to the churn listener, each leads with when its connect() started
+struct bench_churn
+{
+	int fd;
+	pthread_mutex_t m;
+	std::vector<uint64_t> accept_lat; // connect() started until zts_accept() returned it
+};
+
+struct bench_churner
+{
+	struct sockaddr_in *addr;
+	volatile bool *stop;
+	uint64_t connects;
+	uint64_t failures;
+	std::vector<uint64_t> connect_lat;
+};
+
+void *churn_accept_loop(void *arg)
+{
+	struct bench_churn *c = (struct bench_churn *)arg;
+	int accfds[ZT_ACCEPT_MANY_MAX];
+	while(true) {
+		int n = zts_accept_many(c->fd, accfds, NULL, ZT_ACCEPT_MANY_MAX);
+		uint64_t at = now_us();
+		if(n < 0) {
+			DEBUG_ERROR("error accepting connection (errno=%d)", errno);
+			usleep(100000);
+			continue;
+		}
+		for(int i=0; i<n; i++) {
+			uint64_t started;
+			int r = zts_read(accfds[i], &started, sizeof(started));
+			zts_close(accfds[i]);
+			if(r != (int)sizeof(started))
+				continue;
+			pthread_mutex_lock(&c->m);
+			c->accept_lat.push_back(at > started ? at - started : 0);
+			pthread_mutex_unlock(&c->m);
+		}
+	}
+	return NULL;
+}
+
+// Its own listener, which accepts and closes without echoing
+int start_churn_listener(struct bench_churn *c)
+{
+	struct sockaddr_storage addr;
+	pthread_t t;
+	create_addr(BENCH_SIM_SERVER_ADDR, BENCH_CHURN_PORT, 4, (struct sockaddr *)&addr);
+	if((c->fd = zts_socket(AF_INET, SOCK_STREAM, 0)) < 0
+		|| zts_bind(c->fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) < 0
+		|| zts_listen(c->fd, 1024) < 0)
+		return -1;
+	return pthread_create(&t, NULL, churn_accept_loop, c);
+}
+
+// socket(), connect(), the 8 byte stamp and close(), until told to stop
+void *churn_loop(void *arg)
+{
+	struct bench_churner *s = (struct bench_churner *)arg;
+	while(!*s->stop) {
+		uint64_t started = now_us();
+		int fd = zts_socket(AF_INET, SOCK_STREAM, 0);
+		if(fd < 0) {
+			s->failures++;
+			usleep(1000);
+			continue;
+		}
+		bool ok = zts_connect(fd, (struct sockaddr *)s->addr, sizeof(struct sockaddr_in)) == 0;
+		if(ok)
+			s->connect_lat.push_back(now_us() - started);
+		ok = ok && zts_write(fd, &started, sizeof(started)) == (int)sizeof(started);
+		zts_close(fd);
+		ok ? s->connects++ : s->failures++;
+	}
+	return NULL;
+}
+
+// Descriptors open in this process, the host's and libzt's alike
+int count_fds()
+{
+	DIR *d = opendir("/proc/self/fd");
+	if(!d)
+		return -1;
+	int n = 0;
+	while(readdir(d))
+		n++;
+	closedir(d);
+	return n - 3; // ".", ".." and d's own
+}
+
+long rss_kb()
+{
+	long pages = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if(!f)
+		return -1;
+	if(fscanf(f, "%ld %ld", &pages, &resident) != 2)
+		resident = -1;
+	fclose(f);
+	return resident < 0 ? -1 : resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/*
+ * Opens and closes connections to a listener of the server's as fast as each thread count
+ * manages for secs, writing one row per count: connects_per_sec, connect() and accept latency
+ * percentiles, and how many descriptors and how much RSS the process has gained since the
+ * case began once the closed connections had time to go
+ */
+int run_churn(struct sockaddr_in *addr, struct bench_churn *c, const std::vector<int> &thread_counts, int secs, bool json)
+{
+	if(!json)
+		printf("stack,threads,connects,failures,secs,connects_per_sec,connect_p50_us,connect_p99_us,connect_p999_us,accept_p50_us,accept_p99_us,accept_p999_us,fd_growth,rss_growth_kb\n");
+	int failures = 0, fds0 = count_fds();
+	long rss0 = rss_kb();
+	for(size_t i=0; i<thread_counts.size(); i++) {
+		int n = std::min(thread_counts[i], BENCH_SCALE_MAX_THREADS);
+		volatile bool stop = false;
+		std::vector<struct bench_churner> ss(n);
+		std::vector<pthread_t> ts(n);
+		pthread_mutex_lock(&c->m);
+		c->accept_lat.clear();
+		pthread_mutex_unlock(&c->m);
+		uint64_t start = now_us();
+		for(int t=0; t<n; t++) {
+			ss[t].addr = addr, ss[t].stop = &stop, ss[t].connects = 0, ss[t].failures = 0;
+			pthread_create(&ts[t], NULL, churn_loop, &ss[t]);
+		}
+		sleep(secs);
+		stop = true;
+		uint64_t connects = 0, failed = 0;
+		std::vector<uint64_t> connect_lat;
+		for(int t=0; t<n; t++) {
+			pthread_join(ts[t], NULL);
+			connects += ss[t].connects;
+			failed += ss[t].failures;
+			connect_lat.insert(connect_lat.end(), ss[t].connect_lat.begin(), ss[t].connect_lat.end());
+		}
+		double elapsed = (now_us() - start) / 1000000.0;
+		usleep(BENCH_CHURN_SETTLE_MS * 1000);
+		int fds = count_fds();
+		long rss = rss_kb();
+		pthread_mutex_lock(&c->m);
+		std::vector<uint64_t> accept_lat(c->accept_lat);
+		pthread_mutex_unlock(&c->m);
+		std::sort(connect_lat.begin(), connect_lat.end());
+		std::sort(accept_lat.begin(), accept_lat.end());
+		failures += failed > 0;
+		double rate = elapsed > 0 ? connects / elapsed : 0;
+		unsigned long long cp50 = percentile(connect_lat, 0.50), cp99 = percentile(connect_lat, 0.99),
+			cp999 = percentile(connect_lat, 0.999), ap50 = percentile(accept_lat, 0.50),
+			ap99 = percentile(accept_lat, 0.99), ap999 = percentile(accept_lat, 0.999);
+		if(json) {
+			printf("{\"stack\":\"%s\",\"threads\":%d,\"connects\":%llu,\"failures\":%llu,\"secs\":%.3f,\"connects_per_sec\":%.1f,"
+				"\"connect_p50_us\":%llu,\"connect_p99_us\":%llu,\"connect_p999_us\":%llu,\"accept_p50_us\":%llu,"
+				"\"accept_p99_us\":%llu,\"accept_p999_us\":%llu,\"fd_growth\":%d,\"rss_growth_kb\":%ld}\n",
+				BENCH_STACK, n, (unsigned long long)connects, (unsigned long long)failed, elapsed, rate,
+				cp50, cp99, cp999, ap50, ap99, ap999, fds - fds0, rss - rss0);
+		}
+		else {
+			printf("%s,%d,%llu,%llu,%.3f,%.1f,%llu,%llu,%llu,%llu,%llu,%llu,%d,%ld\n",
+				BENCH_STACK, n, (unsigned long long)connects, (unsigned long long)failed, elapsed, rate,
+				cp50, cp99, cp999, ap50, ap99, ap999, fds - fds0, rss - rss0);
+		}
+		fflush(stdout);
+	}
+	return failures ? 1 : 0;
+}
+
+int run_sim(int argc, char *argv[])
+{
+#if defined(STACK_PICO) && defined(STACK_LWIP)
+	bool json = false, scale = false, churn = false;
+	uint32_t seed = 1, timescale = 0;
+	int secs = 2;
+	unsigned trace = 0;
+	std::string capture;
+	std::vector<int> conn_counts, sizes, thread_counts;
+	std::vector<std::string> ccs;
+	std::vector<struct zts_sim_config> wires;
+	for(int i=0; i<argc; i++) {
+		std::string arg = argv[i];
+		size_t eq = arg.find('=');
+		std::string key = arg.substr(0, eq), value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+		if(key == "fmt")
+			json = value == "json";
+		else if(key == "conns")
+			conn_counts = parse_list(value);
+		else if(key == "sizes")
+			sizes = parse_list(value);
+		else if(key == "cc")
+			ccs = parse_names(value);
+		else if(key == "wire")
+			wires = parse_wire(value);
+		else if(key == "seed")
+			seed = (uint32_t)strtoul(value.c_str(), NULL, 10);
+		else if(key == "timescale")
+			timescale = (uint32_t)strtoul(value.c_str(), NULL, 10);
+		else if(key == "case") {
+			scale = value == "scale";
+			churn = value == "churn";
+		}
+		else if(key == "threads")
+			thread_counts = parse_list(value);
+		else if(key == "secs")
+			secs = std::max(atoi(value.c_str()), 1);
+		else if(key == "trace")
+			trace = (unsigned)strtoul(value.c_str(), NULL, 10);
+		else if(key == "capture")
+			capture = value;
+		else
+			fprintf(stderr, "ignoring unknown option %s\n", arg.c_str());
+	}
+	if(thread_counts.empty()) {
+		for(int t=1; t<=BENCH_SCALE_MAX_THREADS; t*=2)
+			thread_counts.push_back(t);
+	}
+	if(conn_counts.empty()) {
+		conn_counts.push_back(1);
+		conn_counts.push_back(10);
+		conn_counts.push_back(100);
+	}
+	if(sizes.empty()) {
+		for(int sz=BENCH_MIN_MSG_SZ; sz<=BENCH_MAX_MSG_SZ; sz*=4)
+			sizes.push_back(sz);
+	}
+	if(ccs.empty())
+		ccs.push_back("");
+	if(wires.empty()) {
+		struct zts_sim_config c;
+		memset(&c, 0, sizeof(c));
+		wires.push_back(c);
+	}
+	for(size_t w=0; w<wires.size(); w++) {
+		wires[w].seed = seed;
+		wires[w].time_scale = timescale;
+	}
+	bench_sim_time = timescale > 1;
+
+	if(zts_sim_start(&wires[0]) < 0) {
+		DEBUG_ERROR("error starting the simulated wire (errno=%d)", errno);
+		return 1;
+	}
+	// Each stack is a single instance, so the echo server runs on picoTCP and the client on lwIP
+	// for the traffic to cross the wire. The client's node is added once the server is listening:
+	// it then owns the shared route, which only its outgoing connections look up
+	pthread_mutex_t m = PTHREAD_MUTEX_INITIALIZER;
+	std::vector<int> pending;
+	struct bench_listener l = { -1, &m, &pending };
+	pthread_t t;
+	struct bench_churn c;
+	c.fd = -1;
+	pthread_mutex_init(&c.m, NULL);
+	if(zts_sim_add_node(BENCH_SIM_SERVER_NWID, ZTS_STACK_PICO, BENCH_SIM_SERVER_ADDR "/24") < 0
+		|| start_listener(BENCH_SIM_SERVER_ADDR, BENCH_SIM_PORT, 4, &l) < 0
+		|| pthread_create(&t, NULL, echo_loop, &l) != 0
+		|| (churn && start_churn_listener(&c) < 0)
+		|| zts_sim_add_node(BENCH_SIM_CLIENT_NWID, ZTS_STACK_LWIP, BENCH_SIM_CLIENT_ADDR "/24") < 0) {
+		DEBUG_ERROR("error setting up the simulated nodes (errno=%d)", errno);
+		zts_sim_stop();
+		return 1;
+	}
+	zts_set_latency_sampling(trace);
+	// Headers only, enough for TCP sequence analysis
+	if(capture.size() && zts_capture_start(capture.c_str(), 128, NULL) < 0)
+		DEBUG_ERROR("error capturing to %s (errno=%d)", capture.c_str(), errno);
+	struct sockaddr_storage addr;
+	create_addr(BENCH_SIM_SERVER_ADDR, BENCH_SIM_PORT, 4, (struct sockaddr *)&addr);
+	if(scale) {
+		// Under the first wire= only, the sweep is over thread counts
+		int err = run_scale((struct sockaddr_in *)&addr, thread_counts, secs, json);
+		zts_sim_stop();
+		return err;
+	}
+	if(churn) {
+		create_addr(BENCH_SIM_SERVER_ADDR, BENCH_CHURN_PORT, 4, (struct sockaddr *)&addr);
+		int err = run_churn((struct sockaddr_in *)&addr, &c, thread_counts, secs, json);
+		zts_sim_stop();
+		return err;
+	}
+
+	if(!json)
+		printf("stack,cc,delay_ms,loss_ppm,ipv,conns,msg_sz,bytes,secs,rate_mbps,p50_us,p99_us,p999_us,cpu_ns_per_byte,ok,wire\n");
+	int failures = 0;
+	struct bench_result res;
+	for(size_t w=0; w<wires.size(); w++) {
+		char wire[128];
+		snprintf(wire, sizeof(wire), "%u:%u:%u:%u:%llu", wires[w].latency_ms, wires[w].jitter_ms, wires[w].loss_ppm,
+			wires[w].reorder_ppm, (unsigned long long)(wires[w].bandwidth_bps / 1000000));
+		if(zts_sim_set_config(&wires[w]) < 0) {
+			DEBUG_ERROR("skipping wire=%s (errno=%d)", wire, errno);
+			continue;
+		}
+		for(size_t k=0; k<ccs.size(); k++) {
+			for(size_t c=0; c<conn_counts.size(); c++) {
+				if(conn_counts[c] > zts_maxsockets() / 2) {
+					DEBUG_ERROR("skipping conns=%d, both ends need a socket", conn_counts[c]);
+					continue;
+				}
+				for(size_t s=0; s<sizes.size(); s++) {
+					if(!run_case((struct sockaddr *)&addr, sizeof(struct sockaddr_in), ccs[k], 4, conn_counts[c], sizes[s], &res))
+						failures++;
+					res.delay_ms = wires[w].latency_ms, res.loss_ppm = wires[w].loss_ppm, res.wire = wire;
+					print_result(&res, json);
+				}
+			}
+		}
+	}
+	struct zts_sim_stats stats;
+	if(zts_sim_get_stats(&stats) == 0) {
+		fprintf(stderr, "wire: %llu frames (%llu bytes), %llu lost, %llu overflowed, %llu reordered\n",
+			(unsigned long long)stats.frames, (unsigned long long)stats.bytes, (unsigned long long)stats.lost,
+			(unsigned long long)stats.overflowed, (unsigned long long)stats.reordered);
+	}
+	for(int i=0; trace && i<ZTS_LATENCY_COUNT; i++) {
+		struct zts_latency_stats l;
+		zts_get_latency_stats(i, &l);
+		fprintf(stderr, "%s: %llu samples, p50 %llu ns, p90 %llu ns, p99 %llu ns, p999 %llu ns, max %llu ns\n", l.name,
+			(unsigned long long)l.samples, (unsigned long long)l.p50_ns, (unsigned long long)l.p90_ns,
+			(unsigned long long)l.p99_ns, (unsigned long long)l.p999_ns, (unsigned long long)l.max_ns);
+	}
+	if(capture.size())
+		zts_capture_stop();
+	// The echo thread is left to exit with the process, its sockets go with the nodes
+	zts_sim_stop();
+	return failures ? 1 : 0;
+#else
+	fprintf(stderr, "sim needs a library with both stacks, rebuild with STACK_PICO=1 STACK_LWIP=1\n");
+	return 1;
+#endif
+}
+
+/****************************************************************************/
+/* Replay (a capture's inbound frames into one simulated node)              */
+/****************************************************************************/
+
+int run_replay(int argc, char *argv[])
+{
+	if(argc < 1) {
+		fprintf(stderr, "replay needs a pcap or pcapng file\n");
+		return 1;
+	}
+	std::string path = argv[0], addr;
+	bool json = false;
+#if defined(STACK_PICO)
+	int stack = ZTS_STACK_PICO;
+#else
+	int stack = ZTS_STACK_LWIP;
+#endif
+	std::vector<int> ports;
+	struct zts_replay_config cfg;
+	memset(&cfg, 0, sizeof(cfg));
+	for(int i=1; i<argc; i++) {
+		std::string arg = argv[i];
+		size_t eq = arg.find('=');
+		std::string key = arg.substr(0, eq), value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+		if(key == "fmt")
+			json = value == "json";
+		else if(key == "addr")
+			addr = value;
+		else if(key == "stack")
+			stack = value == "lwip" ? ZTS_STACK_LWIP : ZTS_STACK_PICO;
+		else if(key == "ports")
+			ports = parse_list(value);
+		else if(key == "speed")
+			cfg.speed_pct = (uint32_t)strtoul(value.c_str(), NULL, 10);
+		else if(key == "loops")
+			cfg.loops = (uint32_t)strtoul(value.c_str(), NULL, 10);
+		else
+			fprintf(stderr, "ignoring unknown option %s\n", arg.c_str());
+	}
+	if(addr.find('/') == std::string::npos) {
+		fprintf(stderr, "replay needs the capture's destination as addr=<ip>/<prefix>\n");
+		return 1;
+	}
+	struct zts_sim_config wire;
+	memset(&wire, 0, sizeof(wire));
+	if(zts_sim_start(&wire) < 0 || zts_sim_add_node(BENCH_SIM_SERVER_NWID, stack, addr.c_str()) < 0) {
+		DEBUG_ERROR("error setting up the simulated node (errno=%d)", errno);
+		zts_sim_stop();
+		return 1;
+	}
+	// Whatever the captured connections were to is served by one echo thread
+	pthread_mutex_t m = PTHREAD_MUTEX_INITIALIZER;
+	std::vector<int> pending;
+	std::vector<struct bench_listener> listeners(ports.size());
+	std::string ip = addr.substr(0, addr.find('/'));
+	int ipv = ip.find(':') == std::string::npos ? 4 : 6;
+	for(size_t i=0; i<ports.size(); i++) {
+		struct bench_listener l = { -1, &m, &pending };
+		listeners[i] = l;
+		if(start_listener(ip, ports[i], ipv, &listeners[i]) < 0) {
+			zts_sim_stop();
+			return 1;
+		}
+	}
+	pthread_t t;
+	if(ports.size())
+		pthread_create(&t, NULL, echo_loop, &listeners[0]);
+
+	struct zts_replay_stats stats;
+	if(zts_replay(BENCH_SIM_SERVER_NWID, path.c_str(), &cfg, &stats) < 0) {
+		DEBUG_ERROR("error replaying %s (errno=%d)", path.c_str(), errno);
+		zts_sim_stop();
+		return 1;
+	}
+	struct zts_stack_loop_stats loop;
+	memset(&loop, 0, sizeof(loop));
+	zts_get_stack_loop_stats(BENCH_SIM_SERVER_NWID, &loop);
+	const char *name = stack == ZTS_STACK_LWIP ? "lwip" : "picotcp";
+	double secs = stats.elapsed_us / 1e6;
+	double fps = secs > 0 ? stats.frames / secs : 0, mbps = secs > 0 ? stats.bytes * 8 / secs / 1e6 : 0;
+	if(json) {
+		printf("{\"stack\":\"%s\",\"frames\":%llu,\"bytes\":%llu,\"skipped\":%llu,\"truncated\":%llu,\"secs\":%.3f,"
+			"\"frames_per_sec\":%.0f,\"rate_mbps\":%.1f,\"dropped\":%llu,\"lag_max_us\":%llu,\"busy_pct\":%u,\"pass_p99_ns\":%llu}\n",
+			name, (unsigned long long)stats.frames, (unsigned long long)stats.bytes, (unsigned long long)stats.skipped,
+			(unsigned long long)stats.truncated, secs, fps, mbps, (unsigned long long)stats.dropped,
+			(unsigned long long)stats.lag_max_us, loop.busy_pct, (unsigned long long)loop.pass_p99_ns);
+	}
+	else {
+		printf("stack,frames,bytes,skipped,truncated,secs,frames_per_sec,rate_mbps,dropped,lag_max_us,busy_pct,pass_p99_ns\n");
+		printf("%s,%llu,%llu,%llu,%llu,%.3f,%.0f,%.1f,%llu,%llu,%u,%llu\n",
+			name, (unsigned long long)stats.frames, (unsigned long long)stats.bytes, (unsigned long long)stats.skipped,
+			(unsigned long long)stats.truncated, secs, fps, mbps, (unsigned long long)stats.dropped,
+			(unsigned long long)stats.lag_max_us, loop.busy_pct, (unsigned long long)loop.pass_p99_ns);
+	}
+	fflush(stdout);
+	zts_sim_stop();
+	return 0;
+}
+
+/****************************************************************************/
+/* Memory footprint (idle connections and networks on one stack)            */
+/****************************************************************************/
+
+#define BENCH_MEM_SETTLE_MS    500  // for the stack threads to finish with what was just set up
+#define BENCH_MEM_ACCEPT_MS    10000
+
+struct bench_mem
+{
+	long rss_kb;
+	long heap_kb;            // in use by malloc(), -1 where the C library can't say
+	uint64_t by_class[ZTS_MEM_CLASSES];
+	uint64_t stack_in_use;   // bytes of arena blocks held by the stack (PCBs, pools)
+	int fds;                 // the host's descriptors, libzt's socketpairs among them
+};
+
+void sample_mem(struct bench_mem *s)
+{
+	usleep(BENCH_MEM_SETTLE_MS * 1000);
+	s->rss_kb = rss_kb();
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+	struct mallinfo2 mi = mallinfo2();
+	s->heap_kb = (long)(mi.uordblks + mi.hblkhd) / 1024;
+#else
+	s->heap_kb = -1;
+#endif
+	struct zts_mem_stats m;
+	zts_get_mem_stats(&m);
+	memcpy(s->by_class, m.by_class, sizeof(s->by_class));
+	struct zts_arena_stats arena[64];
+	int n = std::min(zts_get_arena_stats(arena, 64), 64);
+	s->stack_in_use = 0;
+	for(int i=0; i<n; i++)
+		s->stack_in_use += (uint64_t)arena[i].in_use * arena[i].block_sz;
+	s->fds = count_fds();
+}
+
+// One row: the totals at s, and what each of count units added since base
+void print_mem(const char *stack, const char *unit, int count, const struct bench_mem *base, const struct bench_mem *s, bool json)
+{
+	double n = count ? count : 1;
+	double rss = count ? (s->rss_kb - base->rss_kb) * 1024 / n : 0;
+	double heap = count && s->heap_kb >= 0 ? (s->heap_kb - base->heap_kb) * 1024 / n : 0;
+	double bufs = count ? ((double)s->by_class[ZTS_MEM_BUFFERS] - base->by_class[ZTS_MEM_BUFFERS]) / n : 0;
+	double frames = count ? ((double)s->by_class[ZTS_MEM_FRAMES] - base->by_class[ZTS_MEM_FRAMES]) / n : 0;
+	double arena = count ? ((double)s->by_class[ZTS_MEM_STACK] - base->by_class[ZTS_MEM_STACK]) / n : 0;
+	double pcbs = count ? ((double)s->stack_in_use - base->stack_in_use) / n : 0;
+	double fds = count ? (s->fds - base->fds) / n : 0;
+	if(json) {
+		printf("{\"stack\":\"%s\",\"unit\":\"%s\",\"count\":%d,\"rss_kb\":%ld,\"heap_kb\":%ld,\"buffers_kb\":%llu,"
+			"\"frames_kb\":%llu,\"arena_kb\":%llu,\"stack_in_use_kb\":%llu,\"fds\":%d,\"rss_per_unit\":%.0f,"
+			"\"heap_per_unit\":%.0f,\"buffers_per_unit\":%.0f,\"frames_per_unit\":%.0f,\"arena_per_unit\":%.0f,"
+			"\"stack_in_use_per_unit\":%.0f,\"fds_per_unit\":%.2f}\n",
+			stack, unit, count, s->rss_kb, s->heap_kb, (unsigned long long)s->by_class[ZTS_MEM_BUFFERS] / 1024,
+			(unsigned long long)s->by_class[ZTS_MEM_FRAMES] / 1024, (unsigned long long)s->by_class[ZTS_MEM_STACK] / 1024,
+			(unsigned long long)s->stack_in_use / 1024, s->fds, rss, heap, bufs, frames, arena, pcbs, fds);
+	}
+	else {
+		printf("%s,%s,%d,%ld,%ld,%llu,%llu,%llu,%llu,%d,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f,%.2f\n",
+			stack, unit, count, s->rss_kb, s->heap_kb, (unsigned long long)s->by_class[ZTS_MEM_BUFFERS] / 1024,
+			(unsigned long long)s->by_class[ZTS_MEM_FRAMES] / 1024, (unsigned long long)s->by_class[ZTS_MEM_STACK] / 1024,
+			(unsigned long long)s->stack_in_use / 1024, s->fds, rss, heap, bufs, frames, arena, pcbs, fds);
+	}
+	fflush(stdout);
+}
+
+/*
+ * On one stack: adds networks (a node each) up to every count in nets, then opens idle
+ * connections between two more nodes up to every count in conns (each is two sockets),
+ * writing what each network or connection costs per row
+ */
+int run_mem_stack(int stack, const std::vector<int> &nets, const std::vector<int> &conns, bool json)
+{
+	const char *name = stack == ZTS_STACK_LWIP ? "lwip" : "picotcp";
+	struct bench_mem base, s;
+	sample_mem(&base);
+	int added = 0;
+	for(size_t i=0; i<nets.size(); i++) {
+		for(; added<nets[i]; added++) {
+			char nwid[17], addr[32];
+			snprintf(nwid, sizeof(nwid), "5a5a5a5b%08x", added);
+			snprintf(addr, sizeof(addr), "10.%d.%d.1/24", 148 + added / 256, added % 256);
+			if(zts_sim_add_node(nwid, stack, addr) < 0) {
+				DEBUG_ERROR("error adding network %d (errno=%d)", added, errno);
+				return 1;
+			}
+		}
+		sample_mem(&s);
+		print_mem(name, "network", added, &base, &s, json);
+	}
+
+	// Accepted from this thread between connects, so nothing outlives the nodes
+	std::vector<int> servers, clients;
+	struct sockaddr_storage addr;
+	create_addr(BENCH_SIM_SERVER_ADDR, BENCH_SIM_PORT, 4, (struct sockaddr *)&addr);
+	int lfd = -1;
+	if(zts_sim_add_node(BENCH_SIM_SERVER_NWID, stack, BENCH_SIM_SERVER_ADDR "/24") < 0
+		|| zts_sim_add_node(BENCH_SIM_CLIENT_NWID, stack, BENCH_SIM_CLIENT_ADDR "/24") < 0
+		|| (lfd = zts_socket(AF_INET, SOCK_STREAM, 0)) < 0
+		|| zts_bind(lfd, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) < 0
+		|| zts_listen(lfd, ZT_LISTEN_BACKLOG_MAX) < 0
+		|| zts_fcntl(lfd, F_SETFL, O_NONBLOCK) < 0) {
+		DEBUG_ERROR("error setting up the connections' nodes (errno=%d)", errno);
+		return 1;
+	}
+	sample_mem(&base);
+	int failures = 0, accfds[ZT_ACCEPT_MANY_MAX];
+	for(size_t i=0; i<conns.size(); i++) {
+		if(conns[i] > zts_maxsockets() / 2 - 1) {
+			DEBUG_ERROR("skipping conns=%d, both ends need a socket", conns[i]);
+			continue;
+		}
+		uint64_t t0 = now_us();
+		while(servers.size() < clients.size() || (int)clients.size() < conns[i]) {
+			if((int)clients.size() < conns[i]) {
+				int fd = zts_socket(AF_INET, SOCK_STREAM, 0);
+				if(fd < 0 || zts_connect(fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) < 0) {
+					DEBUG_ERROR("error connecting (errno=%d)", errno);
+					if(fd >= 0)
+						zts_close(fd);
+					failures++;
+					break;
+				}
+				clients.push_back(fd);
+			}
+			int n = zts_accept_many(lfd, accfds, NULL, ZT_ACCEPT_MANY_MAX);
+			if(n > 0)
+				servers.insert(servers.end(), accfds, accfds + n);
+			else if((int)clients.size() >= conns[i]) {
+				if(now_us() - t0 > BENCH_MEM_ACCEPT_MS * 1000) {
+					DEBUG_ERROR("%d connections never came out of accept()", (int)(clients.size() - servers.size()));
+					failures++;
+					break;
+				}
+				usleep(1000);
+			}
+		}
+		sample_mem(&s);
+		print_mem(name, "connection", (int)clients.size(), &base, &s, json);
+	}
+	for(size_t i=0; i<servers.size(); i++)
+		zts_close(servers[i]);
+	for(size_t i=0; i<clients.size(); i++)
+		zts_close(clients[i]);
+	zts_close(lfd);
+	return failures ? 1 : 0;
+}
+
+int run_mem(int argc, char *argv[])
+{
+	bool json = false;
+	std::vector<int> nets, conns, stacks;
+	for(int i=0; i<argc; i++) {
+		std::string arg = argv[i];
+		size_t eq = arg.find('=');
+		std::string key = arg.substr(0, eq), value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+		if(key == "fmt")
+			json = value == "json";
+		else if(key == "nets")
+			nets = parse_list(value);
+		else if(key == "conns")
+			conns = parse_list(value);
+		else if(key == "stack") {
+			std::vector<std::string> names = parse_names(value);
+			for(size_t k=0; k<names.size(); k++)
+				stacks.push_back(names[k] == "lwip" ? ZTS_STACK_LWIP : ZTS_STACK_PICO);
+		}
+		else
+			fprintf(stderr, "ignoring unknown option %s\n", arg.c_str());
+	}
+	if(nets.empty()) {
+		nets.push_back(1);
+		nets.push_back(10);
+		nets.push_back(100);
+	}
+	if(conns.empty()) {
+		conns.push_back(0);
+		conns.push_back(100);
+		conns.push_back(1000);
+		conns.push_back(10000);
+	}
+	std::sort(nets.begin(), nets.end());
+	std::sort(conns.begin(), conns.end());
+	if(stacks.empty()) {
+#if defined(STACK_PICO)
+		stacks.push_back(ZTS_STACK_PICO);
+#endif
+#if defined(STACK_LWIP)
+		stacks.push_back(ZTS_STACK_LWIP);
+#endif
+	}
+	if(!json)
+		printf("stack,unit,count,rss_kb,heap_kb,buffers_kb,frames_kb,arena_kb,stack_in_use_kb,fds,rss_per_unit,heap_per_unit,buffers_per_unit,frames_per_unit,arena_per_unit,stack_in_use_per_unit,fds_per_unit\n");
+	int failures = 0;
+	// A fresh wire per stack, what the previous one left behind is in the next one's baselines
+	for(size_t i=0; i<stacks.size(); i++) {
+		struct zts_sim_config wire;
+		memset(&wire, 0, sizeof(wire));
+		if(zts_sim_start(&wire) < 0) {
+			DEBUG_ERROR("error starting the simulated wire (errno=%d)", errno);
+			return 1;
+		}
+		failures += run_mem_stack(stacks[i], nets, conns, json);
+		zts_sim_stop();
+	}
+	return failures ? 1 : 0;
+}
+
+/****************************************************************************/
+/* main()                                                                   */
+/****************************************************************************/
+
+int main(int argc , char *argv[])
+{
+	if(argc > 1 && std::string(argv[1]) == "sim")
+		return run_sim(argc - 2, argv + 2);
+	if(argc > 1 && std::string(argv[1]) == "replay")
+		return run_replay(argc - 2, argv + 2);
+	if(argc > 1 && std::string(argv[1]) == "mem")
+		return run_mem(argc - 2, argv + 2);
+	if(argc < 5) {
+		fprintf(stderr, "usage: bench <selftest.conf> <alice|bob|ted|carol> to <bob|alice|ted|carol> [fmt=csv|json] [ipv=4,6] [conns=1,10,100,1000] [sizes=64,...] [cc=reno,cubic,bbr] [netem=<delay_ms>:<loss_ppm>,...] [case=startup|ping] [count=1000] [identity=<file>]\n");
+		fprintf(stderr, "       bench sim [fmt=csv|json] [conns=1,10,100] [sizes=64,...] [cc=reno,cubic,bbr] [wire=<latency_ms>:<jitter_ms>:<loss_ppm>:<reorder_ppm>:<mbps>,...] [seed=<n>] [timescale=<n>] [case=scale|churn] [threads=1,2,4,...,64] [secs=2]\n");
+		fprintf(stderr, "       bench replay <file.pcap|file.pcapng> addr=<ip>/<prefix> [stack=pico|lwip] [ports=80,...] [speed=<pct>] [loops=1] [fmt=csv|json]\n");
+		fprintf(stderr, "       bench mem [stack=pico,lwip] [nets=1,10,100] [conns=0,100,1000,10000] [fmt=csv|json]\n");
+		fprintf(stderr, "e.g. : bench test/selftest.conf alice to bob fmt=json\n");
+		return 1;
+	}
+
+	std::string me = argv[2];
+	std::string to = argv[4];
+	std::string path = argv[1];
+
+	bool json = false, startup = false, ping = false;
+	int ping_count = BENCH_PING_COUNT;
+	std::string idfile;
+	std::vector<int> ipvs, conn_counts, sizes;
+	std::vector<std::string> ccs;
+	std::vector<std::pair<int, int> > netems;
+	for(int i=5; i<argc; i++) {
+		std::string arg = argv[i];
+		size_t eq = arg.find('=');
+		std::string key = arg.substr(0, eq), value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+		if(key == "fmt")
+			json = value == "json";
+		else if(key == "ipv")
+			ipvs = parse_list(value);
+		else if(key == "conns")
+			conn_counts = parse_list(value);
+		else if(key == "sizes")
+			sizes = parse_list(value);
+		else if(key == "cc")
+			ccs = parse_names(value);
+		else if(key == "netem")
+			netems = parse_netem(value);
+		else if(key == "case") {
+			startup = value == "startup";
+			ping = value == "ping";
+		}
+		else if(key == "count")
+			ping_count = atoi(value.c_str());
+		else if(key == "identity")
+			idfile = value;
+		else
+			fprintf(stderr, "ignoring unknown option %s\n", arg.c_str());
+	}
+	if(ipvs.empty()) {
+		ipvs.push_back(4);
+		ipvs.push_back(6);
+	}
+	if(conn_counts.empty()) {
+		conn_counts.push_back(1);
+		conn_counts.push_back(10);
+		conn_counts.push_back(100);
+		conn_counts.push_back(1000);
+	}
+	if(sizes.empty()) {
+		for(int sz=BENCH_MIN_MSG_SZ; sz<=BENCH_MAX_MSG_SZ; sz*=4)
+			sizes.push_back(sz);
+	}
+	if(ccs.empty())
+		ccs.push_back("");
+	if(netems.empty())
+		netems.push_back(std::make_pair(0, 0));
+
+	if(path.find(".conf") == std::string::npos) {
+		fprintf(stderr, "Possibly invalid conf file. Exiting...\n");
+		exit(0);
+	}
+	loadTestConfigFile(path);
+
+	std::string nwid = testConf[me + ".nwid"];
+	std::string zpath = testConf[me + ".path"];
+	std::string smode = testConf[me + ".mode"];
+	int port = atoi(testConf[me + ".port"].c_str()) + 200; // stay clear of selftest's ports
+
+	if(idfile.size() && !provision_identity(zpath, idfile)) {
+		DEBUG_ERROR("error provisioning identity from %s (errno=%d)", idfile.c_str(), errno);
+		return 1;
+	}
+	if(startup && smode != "server") {
+		int ipv = ipvs[0];
+		port = atoi(testConf[to + ".port"].c_str()) + 200;
+		struct sockaddr_storage addr;
+		create_addr(testConf[to + (ipv == 4 ? ".ipv4" : ".ipv6")], ipv == 4 ? port : port + 1, ipv, (struct sockaddr *)&addr);
+		socklen_t addrlen = ipv == 4 ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+		return run_startup(zpath, nwid, (struct sockaddr *)&addr, addrlen, ipv, idfile.size() > 0, json);
+	}
+
+	// The server's accepted sockets use its default, which is the first cc= given to it
+	if(smode == "server" && ccs[0].size()) {
+		struct zts_stack_config config;
+		memset(&config, 0, sizeof(config));
+		strncpy(config.tcp_congestion, ccs[0].c_str(), sizeof(config.tcp_congestion) - 1);
+		if(zts_set_stack_config(&config) < 0)
+			DEBUG_ERROR("error selecting congestion control %s (errno=%d)", ccs[0].c_str(), errno);
+	}
+
+	DEBUG_TEST("Waiting for libzt to come online...\n");
+	zts_simple_start(zpath.c_str(), nwid.c_str());
+
+	// The server echoes until it is killed, results are only produced by the client
+	if(smode == "server") {
+		echo_server(testConf[me + ".ipv4"], testConf[me + ".ipv6"], port);
+		return 0;
+	}
+
+	port = atoi(testConf[to + ".port"].c_str()) + 200;
+	if(ping) {
+		struct sockaddr_storage addr;
+		create_addr(testConf[to + ".ipv4"], port, 4, (struct sockaddr *)&addr);
+		return run_ping((struct sockaddr *)&addr, sizeof(struct sockaddr_in), ping_count, json);
+	}
+	if(!json)
+		printf("stack,cc,delay_ms,loss_ppm,ipv,conns,msg_sz,bytes,secs,rate_mbps,p50_us,p99_us,p999_us,cpu_ns_per_byte,ok\n");
+
+	int failures = 0;
+	struct bench_result res;
+	for(size_t n=0; n<netems.size(); n++) {
+		// Impairs what this side sends, the data and the ACKs for what is echoed back
+		int delay = netems[n].first, loss = netems[n].second;
+		if(zts_set_impairment(nwid.c_str(), delay, loss) < 0) {
+			DEBUG_ERROR("skipping netem=%d:%d (errno=%d)", delay, loss, errno);
+			continue;
+		}
+		for(size_t k=0; k<ccs.size(); k++) {
+			for(size_t v=0; v<ipvs.size(); v++) {
+				int ipv = ipvs[v];
+				struct sockaddr_storage addr;
+				create_addr(testConf[to + (ipv == 4 ? ".ipv4" : ".ipv6")], ipv == 4 ? port : port + 1, ipv, (struct sockaddr *)&addr);
+				socklen_t addrlen = ipv == 4 ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+				for(size_t c=0; c<conn_counts.size(); c++) {
+					if(conn_counts[c] > zts_maxsockets()) {
+						DEBUG_ERROR("skipping conns=%d, exceeds zts_maxsockets()=%d", conn_counts[c], zts_maxsockets());
+						continue;
+					}
+					for(size_t s=0; s<sizes.size(); s++) {
+						if(!run_case((struct sockaddr *)&addr, addrlen, ccs[k], ipv, conn_counts[c], sizes[s], &res))
+							failures++;
+						res.delay_ms = delay, res.loss_ppm = loss;
+						print_result(&res, json);
+					}
+				}
+			}
+		}
+	}
+	zts_set_impairment(nwid.c_str(), 0, 0);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,64 @@
+#!/bin/bash
+
+# Runs the same zts_perf workloads through libzt and through zerotier-one's kernel TAP between
+# two hosts and prints their results side by side (see TESTING.md). Both hosts run a joined
+# zerotier-one as well as the libzt node of <path>, which must be on the same network:
+#
+#   test/compare.sh server <path> <nwid>
+#   test/compare.sh client <path> <nwid> <server's libzt address> <server's TAP address> [secs]
+
+BIN=${BIN:-build/linux}
+PORT=${PORT:-5201}
+KPORT=$((PORT + 10))
+RATE=${RATE:-100000000}
+
+if [[ $# -lt 3 ]] || [[ $1 == "client" && $# -lt 5 ]]
+then
+	echo "Usage: compare.sh server <path> <nwid> | client <path> <nwid> <libzt_addr> <tap_addr> [secs]"
+	exit 1
+fi
+
+# CPU zerotier-one spends moving the kernel path's frames counts as the kernel path's
+ZT_PID=$(pidof zerotier-one | cut -d' ' -f1)
+if [[ $ZT_PID == "" ]]
+then
+	echo "zerotier-one isn't running, the kernel path needs it"
+	exit 1
+fi
+
+if [[ $1 == "server" ]]
+then
+	$BIN/zts_perf_kernel - - server port=$KPORT zt_pid=$ZT_PID &
+	echo $! > "test/compare.kernel"
+	exec $BIN/zts_perf $2 $3 server port=$PORT
+fi
+
+SECS=${6:-10}
+WORKLOADS=(
+	"proto=tcp streams=1"
+	"proto=tcp streams=4"
+	"proto=udp rate=$RATE"
+	"proto=rr len=1"
+	"proto=rr len=1024"
+)
+
+OUT=$(mktemp)
+for w in "${WORKLOADS[@]}"
+do
+	row=$($BIN/zts_perf $2 $3 client $4 port=$PORT time=$SECS fmt=csv $w | tail -n1)
+	echo "libzt,$row" >> $OUT
+	row=$($BIN/zts_perf_kernel - - client $5 port=$KPORT time=$SECS fmt=csv zt_pid=$ZT_PID $w | tail -n1)
+	echo "kernel,$row" >> $OUT
+done
+
+echo "path,proto,streams,len,secs,sent_mbps,recv_mbps,lost_pct,rtt_p50_us,rtt_p99_us,rtt_p999_us,tps,client_cpu_s_per_gb,server_cpu_s_per_gb"
+cat $OUT
+echo
+# Pairs of rows: libzt's throughput and latency relative to the kernel path's
+awk -F, '
+	$1 == "libzt" { split($0, z, ",") }
+	$1 == "kernel" {
+		printf "%-4s streams=%-3s len=%-7s recv %9.1f vs %9.1f Mbit/s (%5.2fx)  p50 %6s vs %6s us  CPU %8.3f vs %8.3f s/GB\n",
+			$2, $3, $4, z[7], $7, ($7 > 0 ? z[7] / $7 : 0), z[9], $9, z[13] + z[14], $13 + $14
+	}' $OUT
+rm -f $OUT
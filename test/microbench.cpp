@@ -0,0 +1,480 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+
+ // Microbenchmarks of the data path's building blocks, no network needed (see TESTING.md)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <thread>
+#include <atomic>
+
+#include "libzt.h"
+#include "RingBuffer.hpp"
+#include "FramePool.hpp"
+#include "FdTable.hpp"
+#include "TapIndex.hpp"
+
+#define MB_MIN_TIME_NS         200000000ULL // each case runs at least this long
+#define MB_MAX_ITERS           ((uint64_t)1 << 32)
+#define MB_FRAME_SZ            1514
+#define MB_FRAME_BATCH         32          // descriptors moved per push()/pop() in the batched cases
+#define MB_FDS                 4096
+
+// Keeps results alive so the compiler can't drop the work that produced them
+volatile uint64_t sink;
+
+uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct mb_result
+{
+	std::string name;
+	uint64_t iters;
+	double ns_per_op;
+};
+
+/*
+ * A case runs its body iters times and returns the elapsed ns. The harness doubles iters until
+ * a run takes MB_MIN_TIME_NS, only the last run counts
+ */
+typedef uint64_t (*mb_body)(uint64_t iters, size_t arg);
+
+struct mb_case
+{
+	std::string name;
+	mb_body body;
+	size_t arg;
+};
+
+struct mb_result run(const struct mb_case &c)
+{
+	struct mb_result r;
+	r.name = c.name;
+	uint64_t iters = 1, ns = 0;
+	while(true) {
+		ns = c.body(iters, c.arg);
+		if(ns >= MB_MIN_TIME_NS || iters >= MB_MAX_ITERS)
+			break;
+		// Aim a little past the target so the final run usually is the next one
+		uint64_t next = ns ? (uint64_t)(iters * 1.2 * MB_MIN_TIME_NS / ns) : iters * 100;
+		iters = std::min(MB_MAX_ITERS, std::max(iters * 2, next));
+	}
+	r.iters = iters;
+	r.ns_per_op = (double)ns / iters;
+	return r;
+}
+
+/****************************************************************************/
+/* Socket buffers                                                           */
+/****************************************************************************/
+
+// A capacity of sz+1 makes nearly every sz-sized operation straddle the end of the ring,
+// 16*sz keeps every one of them contiguous
+size_t ring_cap(size_t sz, bool wrap)
+{
+	return wrap ? sz + 1 : sz * 16;
+}
+
+template<typename B> size_t span_write(B &b, const unsigned char *src, size_t n)
+{
+	ZeroTier::ring_span<unsigned char> span[2];
+	size_t tot = 0;
+	while(tot < n && b.writable_span(span)) {
+		for(int i=0; i<2 && tot < n; i++) {
+			size_t len = std::min(span[i].len, n - tot);
+			memcpy(span[i].ptr, src + tot, len);
+			b.produce(len);
+			tot += len;
+		}
+	}
+	return tot;
+}
+
+template<typename B> size_t span_read(B &b, unsigned char *dst, size_t n)
+{
+	ZeroTier::ring_span<unsigned char> span[2];
+	size_t tot = 0;
+	while(tot < n && b.readable_span(span)) {
+		for(int i=0; i<2 && tot < n; i++) {
+			size_t len = std::min(span[i].len, n - tot);
+			memcpy(dst + tot, span[i].ptr, len);
+			b.consume(len);
+			tot += len;
+		}
+	}
+	return tot;
+}
+
+// write()/read() an sz-byte message through a buffer holding cap bytes
+template<typename B> uint64_t buf_copy(B &b, uint64_t iters, size_t sz)
+{
+	std::vector<unsigned char> src(sz, 0x5a), dst(sz);
+	uint64_t tot = 0, start = now_ns();
+	for(uint64_t i=0; i<iters; i++) {
+		tot += b.write(src.data(), sz);
+		tot += b.read(dst.data(), sz);
+	}
+	uint64_t ns = now_ns() - start;
+	sink += tot + dst[sz / 2];
+	return ns;
+}
+
+// The same through writable_span()/produce() and readable_span()/consume(), as the stacks do
+template<typename B> uint64_t buf_span(B &b, uint64_t iters, size_t sz)
+{
+	std::vector<unsigned char> src(sz, 0x5a), dst(sz);
+	uint64_t tot = 0, start = now_ns();
+	for(uint64_t i=0; i<iters; i++) {
+		tot += span_write(b, src.data(), sz);
+		tot += span_read(b, dst.data(), sz);
+	}
+	uint64_t ns = now_ns() - start;
+	sink += tot + dst[sz / 2];
+	return ns;
+}
+
+uint64_t ring_copy(uint64_t iters, size_t sz)
+{
+	ZeroTier::RingBuffer<unsigned char> b(ring_cap(sz & ~1, sz & 1));
+	return buf_copy(b, iters, sz & ~1);
+}
+
+uint64_t ring_span(uint64_t iters, size_t sz)
+{
+	ZeroTier::RingBuffer<unsigned char> b(ring_cap(sz & ~1, sz & 1));
+	return buf_span(b, iters, sz & ~1);
+}
+
+// Compile-time power-of-two ring, the wrapping variant starts half an operation short of the
+// physical end so that operations straddle it whenever they reach it
+#define MB_POW2_RING_SZ (1 << 20)
+
+typedef ZeroTier::RingBuffer<unsigned char, MB_POW2_RING_SZ> Pow2Ring;
+
+Pow2Ring *pow2_ring(size_t sz)
+{
+	Pow2Ring *b = new Pow2Ring();
+	if(sz & 1) {
+		b->produce(MB_POW2_RING_SZ - sz / 2);
+		b->consume(MB_POW2_RING_SZ - sz / 2);
+	}
+	return b;
+}
+
+uint64_t pow2_copy(uint64_t iters, size_t sz)
+{
+	Pow2Ring *b = pow2_ring(sz);
+	uint64_t ns = buf_copy(*b, iters, sz & ~1);
+	delete b;
+	return ns;
+}
+
+uint64_t pow2_span(uint64_t iters, size_t sz)
+{
+	Pow2Ring *b = pow2_ring(sz);
+	uint64_t ns = buf_span(*b, iters, sz & ~1);
+	delete b;
+	return ns;
+}
+
+// Chunk boundaries rather than the end of the ring are what an operation straddles here, an odd
+// offset written up front shifts every operation off them
+uint64_t chunked_copy(uint64_t iters, size_t sz)
+{
+	ZeroTier::SPSCChunkedBuffer<unsigned char> b(ZT_TCP_TX_BUF_SZ);
+	unsigned char pad[ZT_SOCK_BUF_CHUNK_SZ / 2];
+	if(sz & 1)
+		b.write(pad, sizeof(pad));
+	return buf_copy(b, iters, sz & ~1);
+}
+
+uint64_t chunked_span(uint64_t iters, size_t sz)
+{
+	ZeroTier::SPSCChunkedBuffer<unsigned char> b(ZT_TCP_TX_BUF_SZ);
+	unsigned char pad[ZT_SOCK_BUF_CHUNK_SZ / 2];
+	if(sz & 1)
+		b.write(pad, sizeof(pad));
+	return buf_span(b, iters, sz & ~1);
+}
+
+/****************************************************************************/
+/* Frame queue (pico_rx() -> pico_eth_poll())                               */
+/****************************************************************************/
+
+// One thread acquiring, queueing, dequeuing and releasing a frame per op, arg frames at a time
+template<typename Q> uint64_t frames_local(uint64_t iters, size_t batch)
+{
+	ZeroTier::FramePool *pool = new ZeroTier::FramePool(ZT_FRAME_RX_QUEUE_LEN, MB_FRAME_SZ);
+	Q q;
+	std::vector<struct ZeroTier::frame_desc> descs(batch);
+	uint64_t start = now_ns();
+	for(uint64_t i=0; i<iters; i+=batch) {
+		size_t cnt = (size_t)std::min((uint64_t)batch, iters - i);
+		for(size_t j=0; j<cnt; j++) {
+			unsigned char *buf = pool->acquire();
+			buf[0] = (unsigned char)j;
+			q.push(buf, MB_FRAME_SZ);
+		}
+		size_t n = q.pop(descs.data(), cnt);
+		for(size_t j=0; j<n; j++) {
+			sink += descs[j].buf[0];
+			ZeroTier::FramePool::release(descs[j].buf);
+		}
+	}
+	uint64_t ns = now_ns() - start;
+	pool->dispose();
+	return ns;
+}
+
+// pico_rx() on one thread, pico_eth_poll() on another
+template<typename Q> uint64_t frames_threaded(uint64_t iters, size_t batch)
+{
+	ZeroTier::FramePool *pool = new ZeroTier::FramePool(ZT_FRAME_RX_QUEUE_LEN * 2, MB_FRAME_SZ);
+	Q q;
+	uint64_t start = now_ns();
+	std::thread consumer([&]() {
+		std::vector<struct ZeroTier::frame_desc> descs(batch);
+		uint64_t got = 0;
+		while(got < iters) {
+			size_t n = q.pop(descs.data(), batch);
+			if(!n)
+				std::this_thread::yield(); // empty, the producer may share this core
+			for(size_t j=0; j<n; j++)
+				ZeroTier::FramePool::release(descs[j].buf);
+			got += n;
+		}
+	});
+	for(uint64_t i=0; i<iters; i++) {
+		unsigned char *buf = pool->acquire();
+		while(!q.push(buf, MB_FRAME_SZ))
+			std::this_thread::yield(); // full, the consumer is behind
+	}
+	consumer.join();
+	uint64_t ns = now_ns() - start;
+	pool->dispose();
+	return ns;
+}
+
+// Both queues default-constructed at the rx queue's capacity
+typedef ZeroTier::FrameQueue<ZT_FRAME_RX_QUEUE_LEN> RxFrameQueue;
+struct RxFrameRing : ZeroTier::FrameRing { RxFrameRing() : FrameRing(ZT_FRAME_RX_QUEUE_LEN) {} };
+
+uint64_t frameq_local(uint64_t iters, size_t batch) { return frames_local<RxFrameQueue>(iters, batch); }
+uint64_t framering_local(uint64_t iters, size_t batch) { return frames_local<RxFrameRing>(iters, batch); }
+uint64_t frameq_threaded(uint64_t iters, size_t batch) { return frames_threaded<RxFrameQueue>(iters, batch); }
+uint64_t framering_threaded(uint64_t iters, size_t batch) { return frames_threaded<RxFrameRing>(iters, batch); }
+
+/****************************************************************************/
+/* Descriptor lookup (every zts_* call on a socket)                         */
+/****************************************************************************/
+
+// arg threads look descriptors up while one more keeps adding and erasing them, ns per lookup
+// of one reader. The table never dereferences what it holds, so fake pointers do
+uint64_t fd_lookup(uint64_t iters, size_t readers)
+{
+	ZeroTier::FdTable *t = new ZeroTier::FdTable();
+	ZeroTier::Connection *conn = (ZeroTier::Connection *)&sink;
+	ZeroTier::SocketTap *tap = (ZeroTier::SocketTap *)&sink;
+	for(int fd=0; fd<MB_FDS; fd++)
+		t->assign(fd, conn, tap);
+	std::atomic<bool> done(false);
+	std::thread writer([&]() {
+		for(int fd=0; !done.load(std::memory_order_relaxed); fd = (fd + 1) % MB_FDS) {
+			t->erase(fd);
+			t->assign(fd, conn, tap);
+		}
+	});
+	std::vector<std::thread> ts;
+	std::atomic<uint64_t> ns(0);
+	for(size_t r=0; r<readers; r++) {
+		ts.push_back(std::thread([&, r]() {
+			uint64_t hits = 0, start = now_ns();
+			for(uint64_t i=0; i<iters; i++) {
+				int fd = (int)((i * 2654435761U + r) % MB_FDS);
+				ZeroTier::FdTable::Pin _pin(*t, fd);
+				ZeroTier::SocketTap *tp;
+				hits += t->get_assigned(fd, &tp) != NULL;
+			}
+			ns.fetch_add(now_ns() - start);
+			sink += hits;
+		}));
+	}
+	for(size_t r=0; r<readers; r++)
+		ts[r].join();
+	done = true;
+	writer.join();
+	delete t;
+	return ns / readers;
+}
+
+/****************************************************************************/
+/* Tap lookup (getTapByAddr() on every bind()/connect()/sendto())           */
+/****************************************************************************/
+
+// A /24 per tap, as a network assigns, looked up with addresses spread over all of them
+uint64_t tap_lookup(uint64_t iters, size_t ntaps)
+{
+	ZeroTier::RouteTrie trie;
+	std::vector<uint32_t> addrs;
+	for(size_t i=0; i<ntaps; i++) {
+		uint32_t net = htonl(0x0a000000 | (uint32_t)(i << 8)); // 10.0.i.0/24
+		trie.insert((const uint8_t *)&net, 24, (ZeroTier::SocketTap *)(uintptr_t)(i + 1));
+		for(uint32_t h=1; h<=4; h++)
+			addrs.push_back(htonl(ntohl(net) | (h * 61)));
+	}
+	uint64_t tot = 0, start = now_ns();
+	for(uint64_t i=0; i<iters; i++)
+		tot += (uintptr_t)trie.match((const uint8_t *)&addrs[i % addrs.size()], 32);
+	uint64_t ns = now_ns() - start;
+	sink += tot;
+	return ns;
+}
+
+/****************************************************************************/
+/* main()                                                                   */
+/****************************************************************************/
+
+// name -> ns_per_op of an earlier run's CSV output
+std::map<std::string, double> load_baseline(const std::string &path)
+{
+	std::map<std::string, double> out;
+	std::ifstream f(path.c_str());
+	std::string line;
+	while(std::getline(f, line)) {
+		size_t c1 = line.find(','), c2 = line.find(',', c1 + 1);
+		if(c1 == std::string::npos || c2 == std::string::npos || line.compare(0, c1, "name") == 0)
+			continue;
+		out[line.substr(0, c1)] = atof(line.substr(c2 + 1).c_str());
+	}
+	return out;
+}
+
+int main(int argc, char *argv[])
+{
+	bool json = false;
+	std::string filter, baseline;
+	double tolerance = 10;
+	for(int i=1; i<argc; i++) {
+		std::string arg = argv[i];
+		size_t eq = arg.find('=');
+		std::string key = arg.substr(0, eq), value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+		if(key == "fmt")
+			json = value == "json";
+		else if(key == "filter")
+			filter = value;
+		else if(key == "baseline")
+			baseline = value;
+		else if(key == "tolerance")
+			tolerance = atof(value.c_str());
+		else {
+			fprintf(stderr, "usage: microbench [fmt=csv|json] [filter=<substring>] [baseline=<csv>] [tolerance=<percent>]\n");
+			return 1;
+		}
+	}
+
+	std::vector<struct mb_case> cases;
+	size_t sizes[] = { 64, 1500, 16384, 65536 };
+	for(size_t i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++) {
+		for(int wrap=0; wrap<2; wrap++) {
+			// The size's low bit (always clear otherwise) selects the wrapping variant
+			char suffix[32];
+			snprintf(suffix, sizeof(suffix), "/%d/%s", (int)sizes[i], wrap ? "wrap" : "flat");
+			struct mb_case c[] = {
+				{ std::string("ring_copy") + suffix, ring_copy, sizes[i] | wrap },
+				{ std::string("ring_span") + suffix, ring_span, sizes[i] | wrap },
+				{ std::string("pow2_copy") + suffix, pow2_copy, sizes[i] | wrap },
+				{ std::string("pow2_span") + suffix, pow2_span, sizes[i] | wrap },
+				{ std::string("chunked_copy") + suffix, chunked_copy, sizes[i] | wrap },
+				{ std::string("chunked_span") + suffix, chunked_span, sizes[i] | wrap },
+			};
+			cases.insert(cases.end(), c, c + 6);
+		}
+	}
+	size_t batches[] = { 1, MB_FRAME_BATCH };
+	for(size_t i=0; i<2; i++) {
+		char suffix[32];
+		snprintf(suffix, sizeof(suffix), "/%d", (int)batches[i]);
+		struct mb_case c[] = {
+			{ std::string("frameq_local") + suffix, frameq_local, batches[i] },
+			{ std::string("framering_local") + suffix, framering_local, batches[i] },
+			{ std::string("frameq_threaded") + suffix, frameq_threaded, batches[i] },
+			{ std::string("framering_threaded") + suffix, framering_threaded, batches[i] },
+		};
+		cases.insert(cases.end(), c, c + 4);
+	}
+	size_t readers[] = { 1, 2, 4, 8 };
+	for(size_t i=0; i<4; i++) {
+		struct mb_case c = { "fd_lookup/" + std::to_string(readers[i]), fd_lookup, readers[i] };
+		cases.push_back(c);
+	}
+	size_t taps[] = { 1, 10, 100 };
+	for(size_t i=0; i<3; i++) {
+		struct mb_case c = { "tap_lookup/" + std::to_string(taps[i]), tap_lookup, taps[i] };
+		cases.push_back(c);
+	}
+
+	std::map<std::string, double> base;
+	if(baseline.size() && (base = load_baseline(baseline)).empty()) {
+		fprintf(stderr, "no results in baseline %s\n", baseline.c_str());
+		return 1;
+	}
+	if(!json)
+		printf("name,iters,ns_per_op,mops\n");
+	int regressions = 0;
+	for(size_t i=0; i<cases.size(); i++) {
+		if(filter.size() && cases[i].name.find(filter) == std::string::npos)
+			continue;
+		struct mb_result r = run(cases[i]);
+		double mops = r.ns_per_op > 0 ? 1000.0 / r.ns_per_op : 0;
+		if(json) {
+			printf("{\"name\":\"%s\",\"iters\":%llu,\"ns_per_op\":%.3f,\"mops\":%.3f}\n",
+				r.name.c_str(), (unsigned long long)r.iters, r.ns_per_op, mops);
+		}
+		else
+			printf("%s,%llu,%.3f,%.3f\n", r.name.c_str(), (unsigned long long)r.iters, r.ns_per_op, mops);
+		fflush(stdout);
+		std::map<std::string, double>::iterator b = base.find(r.name);
+		if(b != base.end() && r.ns_per_op > b->second * (1 + tolerance / 100)) {
+			fprintf(stderr, "regression: %s takes %.3f ns/op, baseline %.3f ns/op (+%.1f%%)\n",
+				r.name.c_str(), r.ns_per_op, b->second, (r.ns_per_op / b->second - 1) * 100);
+			regressions++;
+		}
+	}
+	return regressions ? 1 : 0;
+}
@@ -38,6 +38,9 @@
 #include <string>
 #include <fcntl.h>
 #include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <netinet/tcp.h>
 
 #include <queue>
 #include <iostream>
@@ -53,276 +56,770 @@ namespace ZeroTier {
 
 	typedef void PhySocket;
 
-	ZTProxy::ZTProxy(int proxy_listen_port, std::string nwid, std::string path, std::string internal_addr, int internal_port) 
+	ZTProxy::ZTProxy(int proxy_listen_port, std::string nwid, std::string path, std::string internal_addr, int internal_port, int num_workers, bool udp) 
 		:
-			_enabled(true),
-			_run(true),
 			_proxy_listen_port(proxy_listen_port),
 			_internal_port(internal_port),
 			_nwid(nwid),
 			_internal_addr(internal_addr),
-			_phy(this,false,true)
+			_udp(udp)
 	{
+#if !defined(__linux__)
+		if(_udp) {
+			DEBUG_ERROR("UDP relaying needs recvmmsg()/sendmmsg(), only TCP is proxied");
+			_udp = false;
+		}
+#endif
 		// Start ZeroTier Node
 		// Join Network which contains resources we need to proxy
 		DEBUG_INFO("waiting for libzt to come online");
 		zts_simple_start(path.c_str(), nwid.c_str());
+		if(num_workers <= 0)
+			num_workers = std::max(1, (int)sysconf(_SC_NPROCESSORS_ONLN));
+		for(int i=0; i<num_workers; i++)
+			_workers.push_back(new ZTProxyWorker(this, i));
+		_last.resize(num_workers * 5, 0);
+	}
+
+	ZTProxy::~ZTProxy()
+	{
+		for(size_t i=0; i<_workers.size(); i++)
+			delete _workers[i];
+	}
+
+	void ZTProxy::report(double seconds)
+	{
+		uint64_t conns = 0, in = 0, out = 0, din = 0, dout = 0;
+		for(size_t i=0; i<_workers.size(); i++) {
+			ProxyStats &s = _workers[i]->stats;
+			uint64_t *last = &_last[i*5];
+			uint64_t a = s.accepted.load(std::memory_order_relaxed);
+			uint64_t z = s.bytes_to_zt.load(std::memory_order_relaxed);
+			uint64_t h = s.bytes_to_host.load(std::memory_order_relaxed);
+			uint64_t dz = s.datagrams_to_zt.load(std::memory_order_relaxed);
+			uint64_t dh = s.datagrams_to_host.load(std::memory_order_relaxed);
+			printf("worker %2d: %8.1f conn/s  %8.2f MB/s to zt  %8.2f MB/s to host  %6llu active\n",
+				(int)i, (a - last[0]) / seconds, (z - last[1]) / seconds / 1e6,
+				(h - last[2]) / seconds / 1e6,
+				(unsigned long long)s.active.load(std::memory_order_relaxed));
+			if(_udp)
+				printf("           %8.1f dgram/s to zt  %8.1f dgram/s to host  %6llu flows\n",
+					(dz - last[3]) / seconds, (dh - last[4]) / seconds,
+					(unsigned long long)s.flows.load(std::memory_order_relaxed));
+			conns += a - last[0];
+			in += z - last[1];
+			out += h - last[2];
+			din += dz - last[3];
+			dout += dh - last[4];
+			last[0] = a;
+			last[1] = z;
+			last[2] = h;
+			last[3] = dz;
+			last[4] = dh;
+		}
+		printf("total    : %8.1f conn/s  %8.2f MB/s to zt  %8.2f MB/s to host\n",
+			conns / seconds, in / seconds / 1e6, out / seconds / 1e6);
+		if(_udp)
+			printf("           %8.1f dgram/s to zt  %8.1f dgram/s to host\n", din / seconds, dout / seconds);
+		printf("\n");
+		fflush(stdout);
+	}
+
+	ZTProxyWorker::ZTProxyWorker(ZTProxy *proxy, int id)
+		:
+			_proxy(proxy),
+			_id(id),
+			_run(true),
+			_phy(this,false,true),
+			_listenFd(-1),
+			_listenFd6(-1),
+			_tcpListenSocket(NULL),
+			_tcpListenSocket6(NULL),
+			_udpFd(-1),
+			_udpFd6(-1),
+			_udpSocket(NULL),
+			_udpSocket6(NULL),
+			_epfd(-1),
+			_epollSocket(NULL),
+			_lastSweep(0)
+	{
+		// libzt sockets aren't handed to Phy, their readiness comes from one epoll instance
+		// whose descriptor Phy watches alongside the host sockets
+		if((_epfd = zts_epoll_create(0)) < 0)
+			DEBUG_ERROR("unable to create epoll instance (errno=%d)", errno);
+		else
+			_epollSocket = _phy.wrapSocket(_epfd, this);
 		// Set up TCP listen sockets
 		// IPv4
 		struct sockaddr_in in4;
 		memset(&in4,0,sizeof(in4));
 		in4.sin_family = AF_INET;
 		in4.sin_addr.s_addr = Utils::hton((uint32_t)(0x7f000001)); // right now we just listen for TCP @127.0.0.1
-		in4.sin_port = Utils::hton((uint16_t)proxy_listen_port);
-		_tcpListenSocket = _phy.tcpListen((const struct sockaddr *)&in4,this);
+		in4.sin_port = Utils::hton((uint16_t)_proxy->_proxy_listen_port);
+		_tcpListenSocket = listen((const struct sockaddr *)&in4, sizeof(in4), SOCK_STREAM);
 		// IPv6
 		struct sockaddr_in6 in6;
 		memset((void *)&in6,0,sizeof(in6));
 		in6.sin6_family = AF_INET6;
-		in6.sin6_port = in4.sin_port;
 		in6.sin6_addr.s6_addr[15] = 1; // IPv6 localhost == ::1
-		in6.sin6_port = Utils::hton((uint16_t)proxy_listen_port);
-		_tcpListenSocket6 = _phy.tcpListen((const struct sockaddr *)&in6,this);
+		in6.sin6_port = in4.sin_port;
+		_tcpListenSocket6 = listen((const struct sockaddr *)&in6, sizeof(in6), SOCK_STREAM);
 
 		if(!_tcpListenSocket)
-			DEBUG_ERROR("Error binding on port %d for IPv4 HTTP listen socket", proxy_listen_port);
+			DEBUG_ERROR("Error binding on port %d for IPv4 listen socket", _proxy->_proxy_listen_port);
+		else
+			_listenFd = (int)_phy.getDescriptor(_tcpListenSocket);
 		if(!_tcpListenSocket6)
-			DEBUG_ERROR("Error binding on port %d for IPv6 HTTP listen socket", proxy_listen_port);
+			DEBUG_ERROR("Error binding on port %d for IPv6 listen socket", _proxy->_proxy_listen_port);
+		else
+			_listenFd6 = (int)_phy.getDescriptor(_tcpListenSocket6);
+		// UDP on the same port, SO_REUSEPORT keeps each host peer on one worker
+		if(_proxy->_udp) {
+			_udpSocket = listen((const struct sockaddr *)&in4, sizeof(in4), SOCK_DGRAM);
+			_udpSocket6 = listen((const struct sockaddr *)&in6, sizeof(in6), SOCK_DGRAM);
+			if(_udpSocket)
+				_udpFd = (int)_phy.getDescriptor(_udpSocket);
+			else
+				DEBUG_ERROR("Error binding on port %d for IPv4 UDP socket", _proxy->_proxy_listen_port);
+			if(_udpSocket6)
+				_udpFd6 = (int)_phy.getDescriptor(_udpSocket6);
+			else
+				DEBUG_ERROR("Error binding on port %d for IPv6 UDP socket", _proxy->_proxy_listen_port);
+		}
 
 		_thread = Thread::start(this);
-	} 
+	}
 
-	ZTProxy::~ZTProxy()
+	ZTProxyWorker::~ZTProxyWorker()
 	{
 		_run = false;
 		_phy.whack();
 		Thread::join(_thread);
-		_phy.close(_tcpListenSocket,false);
-		_phy.close(_tcpListenSocket6,false);
+		// Phy leaves wrapped descriptors open
+		if(_tcpListenSocket) {
+			_phy.close(_tcpListenSocket,false);
+			::close(_listenFd);
+		}
+		if(_tcpListenSocket6) {
+			_phy.close(_tcpListenSocket6,false);
+			::close(_listenFd6);
+		}
+		while(_flows.size())
+			closeFlow(_flows.begin()->second);
+		if(_udpSocket) {
+			_phy.close(_udpSocket,false);
+			::close(_udpFd);
+		}
+		if(_udpSocket6) {
+			_phy.close(_udpSocket6,false);
+			::close(_udpFd6);
+		}
+		if(_epollSocket)
+			_phy.close(_epollSocket,false);
+		if(_epfd >= 0)
+			zts_close(_epfd);
+		while(cqueue.size()) {
+			delete cqueue.front();
+			cqueue.pop();
+		}
+		for(size_t i=0; i<_chunkPool.size(); i++)
+			delete _chunkPool[i];
 	}
 
-	void ZTProxy::threadMain()
+	void ZTProxyWorker::threadMain()
 		throw()
 	{
+#if defined(__linux__)
+		// Worker i stays on CPU i so that a connection's work doesn't migrate
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		if(ncpu > 0) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(_id % ncpu, &set);
+			pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		}
+#endif
 		while(_run) {
 			_phy.poll(10);
+			if(_flows.size()) {
+				uint64_t now = OSUtils::now();
+				if(now - _lastSweep >= ZT_PROXY_UDP_SWEEP_INTERVAL) {
+					sweepFlows(now);
+					_lastSweep = now;
+				}
+			}
+		}
+	}
+
+	// Phy can't set SO_REUSEPORT, so host sockets are made here and only watched by Phy
+	PhySocket *ZTProxyWorker::listen(const struct sockaddr *addr, socklen_t addrlen, int type)
+	{
+		int fd = ::socket(addr->sa_family, type, 0);
+		if(fd < 0)
+			return NULL;
+		int on = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+			DEBUG_ERROR("SO_REUSEPORT isn't supported (errno=%d)", errno);
+			::close(fd);
+			return NULL;
+		}
+		if(addr->sa_family == AF_INET6)
+			setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
+		if(::bind(fd, addr, addrlen) < 0 || (type == SOCK_STREAM && ::listen(fd, ZT_PROXY_LISTEN_BACKLOG) < 0)) {
+			::close(fd);
+			return NULL;
 		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+		return _phy.wrapSocket(fd, NULL);
 	}
 
-	void ZTProxy::phyOnTcpData(PhySocket *sock,void **uptr,void *data,unsigned long len)
+	ProxyChunk *ZTProxyWorker::getChunk()
 	{
-		DEBUG_INFO("phyOnTcpData(sock=%p, len=%lu)", sock, len);
-		unsigned char *buf = (unsigned char*)data;
-		std::string host = _internal_addr;
-
-		// Get the TcpConnection object 
-		TcpConnection *conn = cmap[sock];
-		if(conn == NULL) {
-			conn = cmap[dmap[sock]];
-			if(conn == NULL) {	
-				DEBUG_ERROR("no connection object");	
-				return; // Nothing
+		ProxyChunk *c;
+		if(_chunkPool.size()) {
+			c = _chunkPool.back();
+			_chunkPool.pop_back();
+		}
+		else {
+			c = new ProxyChunk();
+		}
+		c->off = c->len = 0;
+		c->next = NULL;
+		return c;
+	}
+
+	void ZTProxyWorker::putChunks(ProxyChunk **head)
+	{
+		while(*head) {
+			ProxyChunk *c = *head;
+			*head = c->next;
+			if(_chunkPool.size() < ZT_PROXY_CHUNK_POOL_SZ)
+				_chunkPool.push_back(c);
+			else
+				delete c;
+		}
+	}
+
+	// Queues what the receiving side couldn't take, filling the last chunk before taking another
+	void ZTProxyWorker::append(ProxyChunk **head, const char *data, size_t len)
+	{
+		ProxyChunk **tail = head;
+		while(*tail && (*tail)->next)
+			tail = &(*tail)->next;
+		while(len) {
+			if(!*tail || (*tail)->off + (*tail)->len == ZT_PROXY_CHUNK_SZ) {
+				ProxyChunk **next = *tail ? &(*tail)->next : tail;
+				*next = getChunk();
+				tail = next;
 			}
+			ProxyChunk *c = *tail;
+			size_t n = std::min(len, ZT_PROXY_CHUNK_SZ - (c->off + c->len));
+			memcpy(c->data + c->off + c->len, data, n);
+			c->len += n;
+			data += n;
+			len -= n;
 		}
+	}
 
-		if(!conn->destination_sock) { // no connection yet
-			if(host != "")
-			{
-				uint16_t dest_port, ipv;
-				dest_port = _internal_port;
-
-				// Save buffer to TcpConnection's write buffer, we'll forward 
-				// this data along only after the phyOnTcpConnect callback is called successfully
-				// Got data for connection but it hasn't been fully established, save to buffer for later writing
-				conn->tcp_client_m.lock();
-				memcpy(conn->client_buf, buf, len);
-				conn->client_buf_len = len;
-				conn->tcp_client_m.unlock();
-
-				host = _internal_addr;
-
-				// check for address type
-				if(host.find(":") != std::string::npos)
-					ipv = 6;
-				else
-					ipv = 4;
-
-				bool connected;
-				if(ipv == 4)
-				{
-					// Connect to proxied host via libzt
-					DEBUG_INFO("ipv4, %s -> %s:%d", host.c_str(), host.c_str(), dest_port);
-					struct sockaddr_in in4;
-					memset(&in4,0,sizeof(in4));
-					in4.sin_family = AF_INET;
-					in4.sin_addr.s_addr = inet_addr(host.c_str());
-					in4.sin_port = Utils::hton(dest_port);				
-					int sockfd = zts_socket(AF_INET, SOCK_STREAM, 0);
-					if(zts_connect(sockfd, (const struct sockaddr *)&in4, sizeof(in4)) < 0) {
-						DEBUG_ERROR("error while connecting to remote host");
-					}
-					else {
-						conn->destination_sock = _phy.wrapSocket(sockfd);
-						conn->origin_sock = sock;
-						cmap[conn->destination_sock] = conn;						
-						// Once connection through libzt is established, write data we received from the local host
-						conn->tcp_client_m.lock();
-						int n = 0, tot = conn->client_buf_len;
-						while(tot > 0) {
-							if((n = _phy.streamSend(conn->destination_sock, conn->client_buf, conn->client_buf_len)) > 0) {
-								tot -= n;
-								if(n < conn->client_buf_len) { // If we couldn't write the entire buffer
-									memmove(conn->client_buf, conn->client_buf+n, BUF_SZ-n);
-									conn->client_buf_len-=n;
-								}
-								else {
-									conn->client_buf_len = 0;
-								}
-							}
-							else
-								DEBUG_ERROR(" an error occured while writing to the destination_sock");
-						}
-						conn->tcp_client_m.unlock();
-					}
-				}
-				if(ipv == 6)
-				{
-					DEBUG_INFO("ipv6, %s -> [%s]:%d\n", host.c_str(), host.c_str(), dest_port);
-					struct sockaddr_in6 in6;
-					memset(&in6,0,sizeof(in6));
-					in6.sin6_family = AF_INET;
-					struct hostent *server;
-					server = gethostbyname2((char*)host.c_str(),AF_INET6);
-					memmove((char *) &in6.sin6_addr.s6_addr, (char *) server->h_addr, server->h_length);
-					in6.sin6_port = Utils::hton(dest_port);
-					conn->destination_sock = _phy.tcpConnect((const struct sockaddr *)&in6, connected, this);
-				}
-				dmap[conn->destination_sock] = conn->origin_sock; // for reverse lookup from callbacks
-				if(!conn->destination_sock) {
-					DEBUG_ERROR(" there was an error connecting to the remote host");
-					return;
-				}
+	// The proxied host on the ZeroTier network
+	bool ZTProxyWorker::targetAddr(struct sockaddr_storage *ss, socklen_t *sslen)
+	{
+		std::string host = _proxy->_internal_addr;
+		uint16_t dest_port = _proxy->_internal_port;
+		memset(ss,0,sizeof(*ss));
+		if(host.find(":") != std::string::npos) {
+			DEBUG_INFO("ipv6, -> [%s]:%d", host.c_str(), dest_port);
+			struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)ss;
+			in6->sin6_family = AF_INET6;
+			in6->sin6_port = Utils::hton(dest_port);
+			*sslen = sizeof(struct sockaddr_in6);
+			return inet_pton(AF_INET6, host.c_str(), &in6->sin6_addr) == 1;
+		}
+		DEBUG_INFO("ipv4, -> %s:%d", host.c_str(), dest_port);
+		struct sockaddr_in *in4 = (struct sockaddr_in *)ss;
+		in4->sin_family = AF_INET;
+		in4->sin_port = Utils::hton(dest_port);
+		*sslen = sizeof(struct sockaddr_in);
+		return inet_pton(AF_INET, host.c_str(), &in4->sin_addr) == 1;
+	}
+
+	bool ZTProxyWorker::connectZt(TcpConnection *conn)
+	{
+		struct sockaddr_storage ss;
+		socklen_t sslen;
+		if(!targetAddr(&ss, &sslen))
+			return false;
+		if((conn->zfd = zts_socket(ss.ss_family, SOCK_STREAM, 0)) < 0)
+			return false;
+		int on = 1;
+		zts_setsockopt(conn->zfd, ZT_SOL_LIBZT, ZT_SO_DIRECT_IO, &on, sizeof(on));
+		zts_fcntl(conn->zfd, F_SETFL, O_NONBLOCK);
+		if(zts_connect(conn->zfd, (const struct sockaddr *)&ss, sslen) < 0 && errno != EINPROGRESS) {
+			DEBUG_ERROR("error while connecting to remote host (errno=%d)", errno);
+			return false;
+		}
+		struct zts_epoll_event ev;
+		memset(&ev,0,sizeof(ev));
+		ev.events = conn->zt_events = ZTS_EPOLLIN | ZTS_EPOLLOUT;
+		ev.data.ptr = conn;
+		return zts_epoll_ctl(_epfd, ZTS_EPOLL_CTL_ADD, conn->zfd, &ev) == 0;
+	}
+
+	// Reading from a side stops while what it sent is still queued for the other one
+	void ZTProxyWorker::updateInterest(TcpConnection *conn)
+	{
+		if(conn->zfd >= 0) {
+			uint32_t want = 0;
+			if(!conn->to_host && !conn->zt_eof)
+				want |= ZTS_EPOLLIN;
+			if(!conn->connected || conn->to_zt)
+				want |= ZTS_EPOLLOUT;
+			if(want != conn->zt_events) {
+				struct zts_epoll_event ev;
+				memset(&ev,0,sizeof(ev));
+				ev.events = conn->zt_events = want;
+				ev.data.ptr = conn;
+				zts_epoll_ctl(_epfd, ZTS_EPOLL_CTL_MOD, conn->zfd, &ev);
 			}
 		}
-		else {
-			// Read data from localhost socket and send it into libzt
-			conn->tcp_client_m.lock();
-			int n = 0, tot = len;
-			while(tot > 0) {
-				if((n = _phy.streamSend(conn->destination_sock, buf, tot)) > 0) {
-					tot -= n;
-					printf("sent %d into libzt", n);
-				}		
+		if(conn->origin_sock) {
+			bool readable = conn->connected && !conn->to_zt;
+			if(readable != conn->origin_readable) {
+				conn->origin_readable = readable;
+				_phy.setNotifyReadable(conn->origin_sock, readable);
 			}
-			conn->tcp_client_m.unlock();
+			_phy.setNotifyWritable(conn->origin_sock, conn->to_host != NULL);
 		}
 	}
 
-	void ZTProxy::phyOnDatagram(PhySocket *sock,void **uptr,const struct sockaddr *localAddr,const struct sockaddr *from,void *data,unsigned long len)
+	void ZTProxyWorker::closeHost(TcpConnection *conn)
 	{
-		// Not used, connections are handled via user space network stack and SocketTap subsystem
-		DEBUG_INFO("phyOnDatagram");
-		exit(0);
+		if(conn->origin_sock) {
+			_phy.close(conn->origin_sock,false);
+			conn->origin_sock = NULL;
+		}
+		if(conn->host_fd >= 0) {
+			::close(conn->host_fd);
+			conn->host_fd = -1;
+		}
+		putChunks(&conn->to_host);
 	}
-	void ZTProxy::phyOnTcpWritable(PhySocket *sock,void **uptr)
+
+	// Drops both sides and anything still queued
+	void ZTProxyWorker::abort(TcpConnection *conn)
 	{
-		// Not used, connections are handled via user space network stack and SocketTap subsystem
-		DEBUG_INFO("phyOnTcpWritable");
-		exit(0);
+		putChunks(&conn->to_zt);
+		finish(conn);
 	}
-	void ZTProxy::phyOnFileDescriptorActivity(PhySocket *sock,void **uptr,bool readable,bool writable)
+
+	void ZTProxyWorker::finish(TcpConnection *conn)
 	{
-		// Not used, connections are handled via user space network stack and SocketTap subsystem
-		DEBUG_INFO("phyOnFileDescriptorActivity, sock=%p", sock);
-		exit(0);
+		closeHost(conn);
+		if(conn->zfd >= 0) {
+			zts_epoll_ctl(_epfd, ZTS_EPOLL_CTL_DEL, conn->zfd, NULL);
+			zts_close(conn->zfd); // whatever is in its TX buffer is still sent
+			conn->zfd = -1;
+		}
+		putChunks(&conn->to_zt);
+		stats.active.fetch_sub(1, std::memory_order_relaxed);
+		cqueue.push(conn);
+	}
+
+	void ZTProxyWorker::flushToZt(TcpConnection *conn)
+	{
+		while(conn->to_zt) {
+			ProxyChunk *c = conn->to_zt;
+			int n = zts_write(conn->zfd, c->data + c->off, c->len);
+			if(n < 0) {
+				if(errno == EAGAIN || errno == EWOULDBLOCK)
+					return;
+				abort(conn);
+				return;
+			}
+			stats.bytes_to_zt.fetch_add(n, std::memory_order_relaxed);
+			c->off += n;
+			c->len -= n;
+			if(c->len)
+				return;
+			conn->to_zt = c->next;
+			c->next = NULL;
+			putChunks(&c);
+		}
+		if(conn->host_fd < 0) // host went away before everything it sent was forwarded
+			finish(conn);
 	}
-	void ZTProxy::phyOnTcpConnect(PhySocket *sock,void **uptr,bool success)
+
+	void ZTProxyWorker::flushToHost(TcpConnection *conn)
 	{
-		// Not used, connections are handled via user space network stack and SocketTap subsystem
-		DEBUG_INFO("phyOnTcpConnect, sock=%p", sock);
-		exit(0);
+		while(conn->to_host) {
+			ProxyChunk *c = conn->to_host;
+			ssize_t n = ::send(conn->host_fd, c->data + c->off, c->len, 0);
+			if(n < 0) {
+				if(errno != EAGAIN && errno != EWOULDBLOCK)
+					abort(conn);
+				return;
+			}
+			stats.bytes_to_host.fetch_add(n, std::memory_order_relaxed);
+			c->off += n;
+			c->len -= n;
+			if(c->len)
+				return;
+			conn->to_host = c->next;
+			c->next = NULL;
+			putChunks(&c);
+		}
+		if(conn->zt_eof)
+			finish(conn);
 	}
-	void ZTProxy::phyOnUnixClose(PhySocket *sock,void **uptr) 
+
+	// Reads from the Connection's RX buffer and sends straight on to the host, a chunk is only
+	// taken for what the host socket doesn't accept
+	void ZTProxyWorker::pumpToHost(TcpConnection *conn)
 	{
-		// Not used, connections are handled via user space network stack and SocketTap subsystem
-		DEBUG_INFO("phyOnUnixClose, sock=%p", sock);
-		exit(0);
+		for(int i=0; i<ZT_PROXY_READS_PER_EVENT && !conn->to_host; i++) {
+			int n = zts_read(conn->zfd, _scratch, sizeof(_scratch));
+			if(n < 0) {
+				if(errno != EAGAIN && errno != EWOULDBLOCK)
+					abort(conn);
+				return;
+			}
+			if(n == 0) {
+				conn->zt_eof = true;
+				flushToHost(conn);
+				return;
+			}
+			ssize_t s = ::send(conn->host_fd, _scratch, n, 0);
+			if(s < 0) {
+				if(errno != EAGAIN && errno != EWOULDBLOCK) {
+					abort(conn);
+					return;
+				}
+				s = 0;
+			}
+			stats.bytes_to_host.fetch_add(s, std::memory_order_relaxed);
+			if(s < n)
+				append(&conn->to_host, _scratch + s, n - s);
+		}
 	}
 
-	void ZTProxy::phyOnTcpAccept(PhySocket *sockL,PhySocket *sockN,void **uptrL,void **uptrN,const struct sockaddr *from)
+	// Reads from the host and writes straight into the Connection's TX buffer, a chunk is only
+	// taken for what doesn't fit
+	void ZTProxyWorker::pumpToZt(TcpConnection *conn)
 	{
-		DEBUG_INFO("phyOnTcpAccept, sockL=%p, sockN=%p", sockL, sockN);
-		TcpConnection *conn;
-		// try to recycle TcpConnection objects instead of allocating new ones
-		if(cqueue.size()) {
-			conn = cqueue.front();
-			cqueue.pop();
+		for(int i=0; i<ZT_PROXY_READS_PER_EVENT && !conn->to_zt; i++) {
+			ssize_t n = ::recv(conn->host_fd, _scratch, sizeof(_scratch), 0);
+			if(n < 0) {
+				if(errno != EAGAIN && errno != EWOULDBLOCK)
+					abort(conn);
+				return;
+			}
+			if(n == 0) {
+				closeHost(conn);
+				if(!conn->to_zt)
+					finish(conn);
+				return;
+			}
+			int w = zts_write(conn->zfd, _scratch, n);
+			if(w < 0) {
+				if(errno != EAGAIN && errno != EWOULDBLOCK) {
+					abort(conn);
+					return;
+				}
+				w = 0;
+			}
+			stats.bytes_to_zt.fetch_add(w, std::memory_order_relaxed);
+			if(w < n)
+				append(&conn->to_zt, _scratch + w, n - w);
+		}
+	}
+
+	void ZTProxyWorker::onZtEvent(TcpConnection *conn, uint32_t events)
+	{
+		if(!conn->connected) {
+			int err = 0;
+			socklen_t errlen = sizeof(err);
+			zts_getsockopt(conn->zfd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+			if(err || (events & (ZTS_EPOLLERR | ZTS_EPOLLHUP))) {
+				DEBUG_ERROR("unable to connect to remote host (err=%d)", err);
+				abort(conn);
+				return;
+			}
+			if(!(events & ZTS_EPOLLOUT))
+				return;
+			conn->connected = true; // host data is read from now on
+		}
+		if(events & ZTS_EPOLLOUT) {
+			flushToZt(conn);
+			if(conn->zfd < 0)
+				return;
+		}
+		if(events & (ZTS_EPOLLIN | ZTS_EPOLLHUP | ZTS_EPOLLERR)) {
+			pumpToHost(conn);
+			if(conn->zfd < 0)
+				return;
+		}
+		updateInterest(conn);
+	}
+
+	UdpFlow *ZTProxyWorker::flowFor(int lfd, const struct sockaddr_storage *from, socklen_t fromlen, uint64_t now)
+	{
+		UdpFlowKey key;
+		memset(&key,0,sizeof(key));
+		key.family = (uint8_t)from->ss_family;
+		if(from->ss_family == AF_INET6) {
+			const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)from;
+			memcpy(key.addr, &in6->sin6_addr, 16);
+			key.port = in6->sin6_port;
 		}
 		else {
-			conn = new TcpConnection();
+			const struct sockaddr_in *in4 = (const struct sockaddr_in *)from;
+			memcpy(key.addr, &in4->sin_addr, 4);
+			key.port = in4->sin_port;
 		}
-		conn->origin_sock = sockN;
-		cmap[sockN]=conn; // add new connection
+		std::unordered_map<UdpFlowKey, UdpFlow*, UdpFlowKeyHash>::iterator it = _flows.find(key);
+		if(it != _flows.end()) {
+			it->second->last = now;
+			return it->second;
+		}
+		if(_flows.size() >= ZT_PROXY_UDP_MAX_FLOWS || _epfd < 0)
+			return NULL;
+		struct sockaddr_storage ss;
+		socklen_t sslen;
+		if(!targetAddr(&ss, &sslen))
+			return NULL;
+		UdpFlow *flow = new UdpFlow();
+		flow->proto = IPPROTO_UDP;
+		flow->host_fd = lfd;
+		memcpy(&flow->peer, from, fromlen);
+		flow->peerlen = fromlen;
+		flow->last = now;
+		flow->key = key;
+		if((flow->zfd = zts_socket(ss.ss_family, SOCK_DGRAM, 0)) < 0) {
+			delete flow;
+			return NULL;
+		}
+		zts_fcntl(flow->zfd, F_SETFL, O_NONBLOCK);
+		struct zts_epoll_event ev;
+		memset(&ev,0,sizeof(ev));
+		ev.events = ZTS_EPOLLIN;
+		ev.data.ptr = flow;
+		if(zts_connect(flow->zfd, (const struct sockaddr *)&ss, sslen) < 0
+			|| zts_epoll_ctl(_epfd, ZTS_EPOLL_CTL_ADD, flow->zfd, &ev) < 0) {
+			DEBUG_ERROR("unable to set up UDP flow (errno=%d)", errno);
+			zts_close(flow->zfd);
+			delete flow;
+			return NULL;
+		}
+		_flows[key] = flow;
+		stats.flows.fetch_add(1, std::memory_order_relaxed);
+		return flow;
 	}
 
-	void ZTProxy::phyOnUnixData(PhySocket *sock,void **uptr,void *data,ssize_t len)
+	void ZTProxyWorker::closeFlow(UdpFlow *flow)
 	{
-		DEBUG_INFO("phyOnUnixData(sock=%p, len=%lu)", sock, len);
-		unsigned char *buf = (unsigned char*)data;
-		// Get the TcpConnection object 
-		TcpConnection *conn = cmap[sock];
-		if(conn == NULL) {
-			conn = cmap[dmap[sock]];
-			if(conn == NULL) {	
-				DEBUG_ERROR("no connection object");	
-				return; // Nothing
-			}
+		zts_epoll_ctl(_epfd, ZTS_EPOLL_CTL_DEL, flow->zfd, NULL);
+		zts_close(flow->zfd);
+		_flows.erase(flow->key);
+		stats.flows.fetch_sub(1, std::memory_order_relaxed);
+		delete flow;
+	}
+
+	void ZTProxyWorker::sweepFlows(uint64_t now)
+	{
+		std::vector<UdpFlow*> idle;
+		for(std::unordered_map<UdpFlowKey, UdpFlow*, UdpFlowKeyHash>::iterator it = _flows.begin(); it != _flows.end(); ++it) {
+			if(now - it->second->last >= ZT_PROXY_UDP_IDLE_TIMEOUT)
+				idle.push_back(it->second);
 		}
-		else // If connection to host already established, just forward the data in the correct direction
-		{
-			int n = 0;
-			if(sock == conn->destination_sock) { // RX
-				conn->tcp_client_m.lock();
-				if(!conn->client_buf_len) // If nothing is buffered, attempt to write, otherwise copy to buffer to preserver order
-					n = _phy.streamSend(conn->origin_sock, buf, len);				
-				if(n < len) {
-					memcpy(conn->client_buf+conn->client_buf_len, buf+n, len-n);
-					conn->client_buf_len += len-n;
-					_phy.setNotifyWritable(conn->origin_sock, true);
+		for(size_t i=0; i<idle.size(); i++)
+			closeFlow(idle[i]);
+	}
+
+	/*
+	 * Takes up to ZT_PROXY_UDP_BATCH datagrams from a host UDP socket with one recvmmsg() and
+	 * hands each flow's share of them to its libzt socket with one zts_sendmmsg()
+	 */
+	void ZTProxyWorker::relayToZt(int lfd)
+	{
+#if defined(__linux__)
+		for(int i=0; i<ZT_PROXY_UDP_BATCH; i++) {
+			_iovs[i].iov_base = _dgrams[i];
+			_iovs[i].iov_len = ZT_PROXY_UDP_MTU;
+			memset(&_msgs[i].msg_hdr,0,sizeof(_msgs[i].msg_hdr));
+			_msgs[i].msg_hdr.msg_name = &_addrs[i];
+			_msgs[i].msg_hdr.msg_namelen = sizeof(_addrs[i]);
+			_msgs[i].msg_hdr.msg_iov = &_iovs[i];
+			_msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		int n = recvmmsg(lfd, _msgs, ZT_PROXY_UDP_BATCH, MSG_DONTWAIT, NULL);
+		if(n <= 0)
+			return;
+		uint64_t now = OSUtils::now();
+		UdpFlow *flows[ZT_PROXY_UDP_BATCH];
+		for(int i=0; i<n; i++) {
+			socklen_t namelen = _msgs[i].msg_hdr.msg_namelen;
+			_iovs[i].iov_len = _msgs[i].msg_len;
+			_msgs[i].msg_hdr.msg_name = NULL; // the flow's socket is connected
+			_msgs[i].msg_hdr.msg_namelen = 0;
+			flows[i] = (_msgs[i].msg_hdr.msg_flags & MSG_TRUNC) ? NULL
+				: flowFor(lfd, &_addrs[i], namelen, now);
+		}
+		struct mmsghdr out[ZT_PROXY_UDP_BATCH];
+		for(int i=0; i<n; i++) {
+			UdpFlow *flow = flows[i];
+			if(!flow)
+				continue;
+			// Gather the rest of this flow's datagrams, in order, so each flow costs one call
+			int k = 0;
+			for(int j=i; j<n; j++) {
+				if(flows[j] == flow) {
+					out[k++] = _msgs[j];
+					flows[j] = NULL;
 				}
-				conn->tcp_client_m.unlock();
 			}
+			int sent = zts_sendmmsg(flow->zfd, out, k, 0);
+			if(sent > 0)
+				stats.datagrams_to_zt.fetch_add(sent, std::memory_order_relaxed);
 		}
+#endif
 	}
-	void ZTProxy::phyOnUnixWritable(PhySocket *sock,void **uptr,bool lwip_invoked)
+
+	/*
+	 * Takes up to ZT_PROXY_UDP_BATCH datagrams from a flow's libzt socket with one zts_recvmmsg()
+	 * and sends them on to its host peer with one sendmmsg()
+	 */
+	void ZTProxyWorker::relayToHost(UdpFlow *flow)
 	{
-		DEBUG_INFO("phyOnUnixWritable, sock=%p", sock);
-		exit(0);
+#if defined(__linux__)
+		for(int i=0; i<ZT_PROXY_UDP_BATCH; i++) {
+			_iovs[i].iov_base = _dgrams[i];
+			_iovs[i].iov_len = ZT_PROXY_UDP_MTU;
+			memset(&_msgs[i].msg_hdr,0,sizeof(_msgs[i].msg_hdr));
+			_msgs[i].msg_hdr.msg_iov = &_iovs[i];
+			_msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		int n = zts_recvmmsg(flow->zfd, _msgs, ZT_PROXY_UDP_BATCH, MSG_DONTWAIT, NULL);
+		if(n < 0) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK)
+				closeFlow(flow);
+			return;
+		}
+		for(int i=0; i<n; i++) {
+			_iovs[i].iov_len = _msgs[i].msg_len;
+			_msgs[i].msg_hdr.msg_name = &flow->peer;
+			_msgs[i].msg_hdr.msg_namelen = flow->peerlen;
+		}
+		flow->last = OSUtils::now();
+		int sent = sendmmsg(flow->host_fd, _msgs, n, MSG_DONTWAIT); // drops when the host is behind, as UDP would
+		if(sent > 0)
+			stats.datagrams_to_host.fetch_add(sent, std::memory_order_relaxed);
+#endif
 	}
 
-	void ZTProxy::phyOnTcpClose(PhySocket *sock,void **uptr) 
-	{		
-		DEBUG_INFO("phyOnTcpClose, sock=%p", sock);
+	void ZTProxyWorker::acceptAll(int lfd)
+	{
+		for(int i=0; i<ZT_PROXY_ACCEPTS_PER_EVENT; i++) {
+			int fd = ::accept(lfd, NULL, NULL);
+			if(fd < 0)
+				return;
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+			int on = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+			TcpConnection *conn;
+			// try to recycle TcpConnection objects instead of allocating new ones
+			if(cqueue.size()) {
+				conn = cqueue.front();
+				cqueue.pop();
+			}
+			else {
+				conn = new TcpConnection();
+			}
+			conn->proto = IPPROTO_TCP;
+			conn->host_fd = fd;
+			conn->zfd = -1;
+			conn->connected = false;
+			conn->zt_eof = false;
+			conn->zt_events = 0;
+			conn->origin_readable = false;
+			conn->to_zt = conn->to_host = NULL;
+			conn->origin_sock = _phy.wrapSocket(fd, conn);
+			stats.accepted.fetch_add(1, std::memory_order_relaxed);
+			stats.active.fetch_add(1, std::memory_order_relaxed);
+			// Nothing is read from the host until the libzt side is connected
+			_phy.setNotifyReadable(conn->origin_sock, false);
+			if(_epfd < 0 || !connectZt(conn)) {
+				DEBUG_ERROR("there was an error connecting to the remote host");
+				abort(conn);
+			}
+		}
+	}
 
-		TcpConnection *conn = cmap[sock];
-		if(conn)
-		{
-			conn->origin_sock=NULL;
-			conn->destination_sock=NULL;
-			conn->client_buf_len=0;
-			cqueue.push(conn);
+	void ZTProxyWorker::phyOnFileDescriptorActivity(PhySocket *sock,void **uptr,bool readable,bool writable)
+	{
+		if(sock == _epollSocket) {
+			int n = zts_epoll_wait(_epfd, _events, ZT_PROXY_EPOLL_BATCH, 0);
+			for(int i=0; i<n; i++) {
+				if(*(int*)_events[i].data.ptr == IPPROTO_UDP) {
+					relayToHost((UdpFlow*)_events[i].data.ptr);
+					continue;
+				}
+				TcpConnection *conn = (TcpConnection*)_events[i].data.ptr;
+				if(conn->zfd >= 0) // not torn down earlier in this batch
+					onZtEvent(conn, _events[i].events);
+			}
+			return;
 		}
-		cmap.erase(sock);
-		dmap.erase(sock);
-		close(_phy.getDescriptor(sock));
+		if(sock == _udpSocket || sock == _udpSocket6) {
+			relayToZt(sock == _udpSocket ? _udpFd : _udpFd6);
+			return;
+		}
+		if(sock == _tcpListenSocket || sock == _tcpListenSocket6) {
+			acceptAll(sock == _tcpListenSocket ? _listenFd : _listenFd6);
+			return;
+		}
+		TcpConnection *conn = (TcpConnection*)*uptr;
+		if(!conn || conn->host_fd < 0)
+			return;
+		if(writable) {
+			flushToHost(conn);
+			if(conn->host_fd < 0)
+				return;
+		}
+		if(readable) {
+			pumpToZt(conn);
+			if(conn->host_fd < 0 || conn->zfd < 0)
+				return;
+		}
+		updateInterest(conn);
 	}
+
+	void ZTProxyWorker::phyOnTcpData(PhySocket *sock,void **uptr,void *data,unsigned long len) {}
+	void ZTProxyWorker::phyOnDatagram(PhySocket *sock,void **uptr,const struct sockaddr *localAddr,const struct sockaddr *from,void *data,unsigned long len) {}
+	void ZTProxyWorker::phyOnTcpWritable(PhySocket *sock,void **uptr) {}
+	void ZTProxyWorker::phyOnTcpConnect(PhySocket *sock,void **uptr,bool success) {}
+	void ZTProxyWorker::phyOnTcpAccept(PhySocket *sockL,PhySocket *sockN,void **uptrL,void **uptrN,const struct sockaddr *from) {}
+	void ZTProxyWorker::phyOnUnixClose(PhySocket *sock,void **uptr) {}
+	void ZTProxyWorker::phyOnUnixData(PhySocket *sock,void **uptr,void *data,ssize_t len) {}
+	void ZTProxyWorker::phyOnUnixWritable(PhySocket *sock,void **uptr,bool lwip_invoked) {}
+	void ZTProxyWorker::phyOnTcpClose(PhySocket *sock,void **uptr) {}
 }
 
 int main(int argc, char **argv)
 {
-	if(argc != 6) {
+	bool bench = false, udp = false;
+	while(argc > 1 && (!strcmp(argv[argc-1], "-b") || !strcmp(argv[argc-1], "-u"))) {
+		if(!strcmp(argv[argc-1], "-b"))
+			bench = true;
+		else
+			udp = true;
+		argc--;
+	}
+	if(argc != 6 && argc != 7) {
 		printf("\nZeroTier TCP Proxy Service\n");
-		printf("ztproxy [config_file_path] [local_listen_port] [nwid] [zt_host_addr] [zt_resource_port]\n");
+		printf("ztproxy [config_file_path] [local_listen_port] [nwid] [zt_host_addr] [zt_resource_port] [num_workers] [-b] [-u]\n");
+		printf("  num_workers defaults to one per CPU, -b prints connections/sec and throughput per worker every second\n");
+		printf("  -u also relays UDP on local_listen_port (Linux only)\n");
 		exit(0);
 	}
 	std::string path          = argv[1];
@@ -330,15 +827,24 @@ int main(int argc, char **argv)
 	std::string nwid          = argv[3];
 	std::string internal_addr = argv[4];
 	int internal_port         = atoi(argv[5]);
+	int num_workers           = argc == 7 ? atoi(argv[6]) : 0;
 
-	ZeroTier::ZTProxy *proxy = new ZeroTier::ZTProxy(proxy_listen_port, nwid, path, internal_addr, internal_port);
+	signal(SIGPIPE, SIG_IGN); // a host client going away shows up as EPIPE instead
+
+	ZeroTier::ZTProxy *proxy = new ZeroTier::ZTProxy(proxy_listen_port, nwid, path, internal_addr, internal_port, num_workers, udp);
 	
 	if(proxy) {
-		printf("\nZTProxy started. Listening on %d\n", proxy_listen_port);
+		printf("\nZTProxy started. Listening on %d with %d workers\n", proxy_listen_port, proxy->workers());
 		printf("Traffic will be proxied to and from %s:%d on network %s\n", internal_addr.c_str(), internal_port, nwid.c_str());
 		printf("Proxy Node config files and key stored in: %s/\n\n", path.c_str());
+		uint64_t last = ZeroTier::OSUtils::now();
 		while(1) {
 			sleep(1);
+			if(bench) {
+				uint64_t now = ZeroTier::OSUtils::now();
+				proxy->report((now - last) / 1000.0);
+				last = now;
+			}
 		}
 	}
 	else {
@@ -346,4 +852,4 @@ int main(int argc, char **argv)
 	}
 	return 0;
 }
-//#endif
\ No newline at end of file
+//#endif
@@ -34,76 +34,225 @@
 #include "Phy.hpp"
 #include "OSUtils.hpp"
 
+#include <vector>
 #include <queue>
+#include <atomic>
+#include <unordered_map>
+#include <string.h>
 
-#define BUF_SZ 1024*1024
+#include "libzt.h"
+
+#define ZT_PROXY_CHUNK_SZ         16384 // bytes, buffered per direction only while one side can't keep up
+#define ZT_PROXY_CHUNK_POOL_SZ    256   // free chunks kept for reuse (per worker)
+#define ZT_PROXY_EPOLL_BATCH      64    // libzt events handled per wakeup
+#define ZT_PROXY_READS_PER_EVENT  16    // bounds how long one connection can hold the loop
+#define ZT_PROXY_ACCEPTS_PER_EVENT 64
+#define ZT_PROXY_LISTEN_BACKLOG   1024
+#define ZT_PROXY_UDP_BATCH        64    // datagrams moved per recvmmsg()/zts_sendmmsg() and back
+#define ZT_PROXY_UDP_MTU          ZT_SDK_MTU // longer host datagrams are dropped
+#define ZT_PROXY_UDP_IDLE_TIMEOUT 60000 // ms without traffic either way before a flow is dropped
+#define ZT_PROXY_UDP_MAX_FLOWS    4096  // per worker, datagrams for new flows beyond this are dropped
+#define ZT_PROXY_UDP_SWEEP_INTERVAL 1000 // ms
 
 namespace ZeroTier {
 
 	typedef void PhySocket;
 	class ZTProxy;
 
+	// Bytes one side couldn't take yet, see ZTProxyWorker::append()
+	struct ProxyChunk
+	{
+		char data[ZT_PROXY_CHUNK_SZ];
+		size_t off;
+		size_t len;
+		ProxyChunk *next;
+	};
+
+	/*
+	 * One proxied connection, found through the host socket's uptr and the libzt socket's
+	 * epoll data. The libzt socket is in direct I/O mode so data goes straight between the
+	 * host socket and the Connection's buffers, chunks are only taken from the pool while
+	 * the receiving side is full (and reading from the other side is paused meanwhile)
+	 */
 	struct TcpConnection
 	{
-		PhySocket *origin_sock;
-		PhySocket *destination_sock;
-		char client_buf[BUF_SZ];
-		int client_buf_len;
+		int proto;              // IPPROTO_TCP, tells it apart from a UdpFlow in epoll data
+		int host_fd;            // host side, -1 once closed
+		PhySocket *origin_sock; // host_fd as wrapped by the worker's Phy
+		int zfd;                // libzt side, -1 once closed
+		bool connected;
+		bool zt_eof;            // libzt side is done, close the host side once to_host is flushed
+		uint32_t zt_events;     // current epoll interest
+		bool origin_readable;   // current Phy interest
+		ProxyChunk *to_zt;      // from the host, waiting for room in the Connection's TX buffer
+		ProxyChunk *to_host;    // from libzt, waiting for room in the host socket
+	};
 
-		char server_buf[BUF_SZ];
-		int server_buf_len;
+	// Host-side source address of a UDP flow
+	struct UdpFlowKey
+	{
+		uint8_t addr[16];
+		uint16_t port;
+		uint8_t family;
 
-		Mutex tcp_client_m;
-		Mutex tcp_server_m;
+		bool operator==(const UdpFlowKey &k) const { return !memcmp(this, &k, sizeof(k)); }
 	};
 
-	class ZTProxy
+	struct UdpFlowKeyHash
 	{
-		friend class Phy<ZTProxy *>;
+		size_t operator()(const UdpFlowKey &k) const
+		{
+			// FNV-1a, keys are zeroed before being filled in so padding hashes the same
+			const unsigned char *p = (const unsigned char *)&k;
+			size_t h = 2166136261u;
+			for(size_t i=0; i<sizeof(k); i++)
+				h = (h ^ p[i]) * 16777619u;
+			return h;
+		}
+	};
+
+	/*
+	 * One host-side UDP peer, relayed through its own libzt socket connected to the proxied
+	 * host. Dropped after ZT_PROXY_UDP_IDLE_TIMEOUT without traffic
+	 */
+	struct UdpFlow
+	{
+		int proto;              // IPPROTO_UDP
+		int zfd;
+		int host_fd;            // the worker's UDP socket the peer talks to
+		struct sockaddr_storage peer;
+		socklen_t peerlen;
+		uint64_t last;          // OSUtils::now() of the latest datagram either way
+		UdpFlowKey key;
+	};
+
+	// Counters for benchmark mode, only ever added to by the worker that owns them
+	struct ProxyStats
+	{
+		std::atomic<uint64_t> accepted;
+		std::atomic<uint64_t> active;
+		std::atomic<uint64_t> bytes_to_zt;
+		std::atomic<uint64_t> bytes_to_host;
+		std::atomic<uint64_t> datagrams_to_zt;
+		std::atomic<uint64_t> datagrams_to_host;
+		std::atomic<uint64_t> flows;
+
+		ProxyStats() : accepted(0), active(0), bytes_to_zt(0), bytes_to_host(0), 
+			datagrams_to_zt(0), datagrams_to_host(0), flows(0) {}
+	};
+
+	/*
+	 * One event loop (and thread) with its own listen sockets, sharing the port with the
+	 * other workers through SO_REUSEPORT so the host kernel spreads connections over them.
+	 * Everything a connection touches belongs to the worker that accepted it
+	 */
+	class ZTProxyWorker
+	{
+		friend class Phy<ZTProxyWorker *>;
 
 	public:
-		ZTProxy(int proxy_listen_port, std::string nwid, std::string path, std::string internal_addr, int internal_port);
-		~ZTProxy();
+		ZTProxyWorker(ZTProxy *proxy, int id);
+		~ZTProxyWorker();
 
-		// Send incoming data to intended host
+		// Listen and UDP sockets, the libzt epoll instance's descriptor and host connections
+		void phyOnFileDescriptorActivity(PhySocket *sock,void **uptr,bool readable,bool writable);
+		// Not used, Phy only watches raw descriptors here
 		void phyOnTcpData(PhySocket *sock,void **uptr,void *data,unsigned long len);
 		void phyOnDatagram(PhySocket *sock,void **uptr,const struct sockaddr *localAddr,const struct sockaddr *from,void *data,unsigned long len);
 		void phyOnTcpWritable(PhySocket *sock,void **uptr);
-		void phyOnFileDescriptorActivity(PhySocket *sock,void **uptr,bool readable,bool writable);
-		// Establish outgoing connection to intended host
 		void phyOnTcpConnect(PhySocket *sock,void **uptr,bool success);
-		// Accept connection 
 		void phyOnTcpAccept(PhySocket *sockL,PhySocket *sockN,void **uptrL,void **uptrN,const struct sockaddr *from);
-		// Handle the closure of a Unix Domain socket
 		void phyOnUnixClose(PhySocket *sock,void **uptr);
 		void phyOnUnixData(PhySocket *sock,void **uptr,void *data,ssize_t len);
 		void phyOnUnixWritable(PhySocket *sock,void **uptr,bool lwip_invoked);
-		// Handle the closure of a TCP connection
 		void phyOnTcpClose(PhySocket *sock,void **uptr);
 
 		void threadMain()
 			throw();
 
-	TcpConnection *getConnection(PhySocket *sock);
+		ProxyStats stats;
 
-	private:	
-		volatile bool _enabled;
-		volatile bool _run;	
+	private:
+		PhySocket *listen(const struct sockaddr *addr, socklen_t addrlen, int type);
+		void acceptAll(int lfd);
+		bool targetAddr(struct sockaddr_storage *ss, socklen_t *sslen);
+		bool connectZt(TcpConnection *conn);
+		void onZtEvent(TcpConnection *conn, uint32_t events);
+		void pumpToHost(TcpConnection *conn);
+		void pumpToZt(TcpConnection *conn);
+		void flushToZt(TcpConnection *conn);
+		void flushToHost(TcpConnection *conn);
+		void updateInterest(TcpConnection *conn);
+		void closeHost(TcpConnection *conn);
+		void abort(TcpConnection *conn);
+		void finish(TcpConnection *conn);
 
-		int _proxy_listen_port;
-		int _internal_port;
-		std::string _nwid;
-		std::string _internal_addr;
+		ProxyChunk *getChunk();
+		void putChunks(ProxyChunk **head);
+		void append(ProxyChunk **head, const char *data, size_t len);
+
+		UdpFlow *flowFor(int lfd, const struct sockaddr_storage *from, socklen_t fromlen, uint64_t now);
+		void relayToZt(int lfd);
+		void relayToHost(UdpFlow *flow);
+		void closeFlow(UdpFlow *flow);
+		void sweepFlows(uint64_t now);
+
+		ZTProxy *_proxy;
+		int _id;
+		volatile bool _run;
 
 		Thread _thread;
-		Phy<ZTProxy*> _phy;
+		Phy<ZTProxyWorker*> _phy;
+		int _listenFd;
+		int _listenFd6;
 		PhySocket *_tcpListenSocket;
 		PhySocket *_tcpListenSocket6;
+		int _udpFd;
+		int _udpFd6;
+		PhySocket *_udpSocket;
+		PhySocket *_udpSocket6;
 
-		std::map<PhySocket*, TcpConnection*> cmap;
-		std::map<PhySocket*, PhySocket*> dmap;
+		int _epfd;
+		PhySocket *_epollSocket;
+		struct zts_epoll_event _events[ZT_PROXY_EPOLL_BATCH];
+		char _scratch[ZT_PROXY_CHUNK_SZ]; // reads land here first, only leftovers are kept
 
+		std::vector<ProxyChunk*> _chunkPool;
 		std::queue<TcpConnection*> cqueue; // for recycling TcpConnection objects
+
+		std::unordered_map<UdpFlowKey, UdpFlow*, UdpFlowKeyHash> _flows;
+		uint64_t _lastSweep;
+#if defined(__linux__)
+		struct mmsghdr _msgs[ZT_PROXY_UDP_BATCH];
+		struct iovec _iovs[ZT_PROXY_UDP_BATCH];
+		struct sockaddr_storage _addrs[ZT_PROXY_UDP_BATCH];
+		char _dgrams[ZT_PROXY_UDP_BATCH][ZT_PROXY_UDP_MTU];
+#endif
+	};
+
+	class ZTProxy
+	{
+	public:
+		// num_workers of 0 starts one per online CPU, udp also relays UDP on the same port (Linux only)
+		ZTProxy(int proxy_listen_port, std::string nwid, std::string path, std::string internal_addr, int internal_port, int num_workers = 0, bool udp = false);
+		~ZTProxy();
+
+		// Prints connections/sec and throughput per worker since the previous call
+		void report(double seconds);
+
+		int workers() { return (int)_workers.size(); }
+
+	private:
+		friend class ZTProxyWorker;
+
+		int _proxy_listen_port;
+		int _internal_port;
+		std::string _nwid;
+		std::string _internal_addr;
+		bool _udp;
+
+		std::vector<ZTProxyWorker*> _workers;
+		std::vector<uint64_t> _last; // counters per worker at the last report()
 	};
 }
 
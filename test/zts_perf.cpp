@@ -0,0 +1,696 @@
+/*
+ * ZeroTier SDK - Network Virtualization Everywhere
+ * Copyright (C) 2011-2017  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --
+ *
+ * You can be released from the requirements of the license by purchasing
+ * a commercial license. Buying such a license is mandatory as soon as you
+ * develop commercial closed-source software that incorporates or links
+ * directly against ZeroTier software without disclosing the source code
+ * of your own application.
+ */
+
+// iperf-style throughput between two nodes (see TESTING.md):
+//   zts_perf <path> <nwid> server [port=5201]
+//   zts_perf <path> <nwid> client <host> [port=5201] [proto=tcp|udp|rr] [streams=1] [time=10]
+//     [len=131072] [interval=1] [rate=<bits/s per UDP stream>] [fmt=csv]
+// Control runs on TCP port, data on port+1. Both ends print one line per interval with the
+// CPU utilization of their own service, stack and TX threads (zts_get_thread_cpu()).
+// proto=rr bounces len bytes (1 unless given) back and forth on one connection for latency.
+// Built with PERF_KERNEL (zts_perf_kernel) the same workloads run over the host's sockets
+// instead, through zerotier-one's TAP when host is its address (see compare.sh), path and
+// nwid are then ignored. zt_pid=<pid> counts that process's CPU time (zerotier-one's) as
+// that end's own. fmt=csv makes the client print one row of results and nothing else
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(PERF_KERNEL)
+#define ZTS_THREAD_SERVICE     0
+#define ZTS_THREAD_STACK       1
+#define ZTS_THREAD_TX          2
+#define zts_socket             socket
+#define zts_bind               bind
+#define zts_listen             listen
+#define zts_accept             accept
+#define zts_connect            connect
+#define zts_send               send
+#define zts_recv               recv
+#define zts_sendto             sendto
+#define zts_recvfrom           recvfrom
+#define zts_poll               poll
+#define zts_close              close
+#define zts_simple_start(path, nwid)
+#define zts_stop()
+static int zts_get_thread_cpu(int thread, const char *nwid, uint64_t *cpu_us)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+#else
+#include "libzt.h"
+#endif
+
+#define PERF_MAGIC             0x7a747066 // "ztpf"
+#define PERF_PORT              5201
+#define PERF_PROTO_TCP         1
+#define PERF_PROTO_UDP         2
+#define PERF_PROTO_RR          3
+#define PERF_MAX_STREAMS       128
+#define PERF_MAX_LEN           (4*1024*1024)
+#define PERF_UDP_MAX_LEN       1400
+#define PERF_UDP_RATE          (10*1000*1000) // bits/s per stream
+#define PERF_DRAIN_MS          500            // UDP datagrams still arriving after the client is done
+
+// Client to server, in network byte order like everything on the control connection
+struct perf_hdr {
+	uint32_t magic;
+	uint32_t proto;
+	uint32_t streams;
+	uint32_t len;
+};
+
+struct perf_result {
+	uint64_t bytes;
+	uint64_t packets;
+	uint64_t lost;
+	uint64_t reordered;
+	uint64_t duration_us;
+	uint64_t cpu_us;       // the server's, see process_cpu_us()
+};
+
+// Leads every UDP datagram
+struct perf_udp_hdr {
+	uint32_t stream;
+	uint32_t _pad;
+	uint64_t seq;
+};
+
+static uint64_t now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// This process's CPU time (libzt's threads included), plus that of pid if it isn't 0
+static uint64_t process_cpu_us(int pid)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	uint64_t us = (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+	if(!pid)
+		return us;
+	char path[64], buf[1024];
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	FILE *f = fopen(path, "r");
+	if(!f)
+		return us;
+	size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[n] = 0;
+	// utime and stime are the 14th and 15th fields, the 2nd (comm) may hold spaces
+	char *p = strrchr(buf, ')');
+	unsigned long long utime = 0, stime = 0;
+	if(p && sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) == 2)
+		us += (utime + stime) * 1000000 / sysconf(_SC_CLK_TCK);
+	return us;
+}
+
+static uint64_t hton64(uint64_t v)
+{
+	return ((uint64_t)htonl((uint32_t)v) << 32) | htonl((uint32_t)(v >> 32));
+}
+
+static bool readFull(int fd, void *buf, size_t len)
+{
+	for(size_t got=0; got<len; ) {
+		ssize_t n = zts_recv(fd, (char *)buf + got, len - got, 0);
+		if(n <= 0)
+			return false;
+		got += n;
+	}
+	return true;
+}
+
+static bool writeFull(int fd, const void *buf, size_t len)
+{
+	for(size_t sent=0; sent<len; ) {
+		ssize_t n = zts_send(fd, (const char *)buf + sent, len - sent, 0);
+		if(n <= 0)
+			return false;
+		sent += n;
+	}
+	return true;
+}
+
+static bool parseAddr(const std::string &host, int port, struct sockaddr_storage *ss, socklen_t *len)
+{
+	memset(ss, 0, sizeof(*ss));
+	struct sockaddr_in *in = (struct sockaddr_in *)ss;
+	struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)ss;
+	if(inet_pton(AF_INET, host.c_str(), &in->sin_addr) == 1) {
+		in->sin_family = AF_INET;
+		in->sin_port = htons(port);
+		*len = sizeof(*in);
+		return true;
+	}
+	if(inet_pton(AF_INET6, host.c_str(), &in6->sin6_addr) == 1) {
+		in6->sin6_family = AF_INET6;
+		in6->sin6_port = htons(port);
+		*len = sizeof(*in6);
+		return true;
+	}
+	return false;
+}
+
+static void anyAddr(int family, int port, struct sockaddr_storage *ss, socklen_t *len)
+{
+	memset(ss, 0, sizeof(*ss));
+	if(family == AF_INET6) {
+		struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)ss;
+		in6->sin6_family = AF_INET6;
+		in6->sin6_addr = in6addr_any;
+		in6->sin6_port = htons(port);
+		*len = sizeof(*in6);
+	}
+	else {
+		struct sockaddr_in *in = (struct sockaddr_in *)ss;
+		in->sin_family = AF_INET;
+		in->sin_addr.s_addr = htonl(INADDR_ANY);
+		in->sin_port = htons(port);
+		*len = sizeof(*in);
+	}
+}
+
+static int listenOn(int family, int type, int port)
+{
+	struct sockaddr_storage ss;
+	socklen_t len;
+	anyAddr(family, port, &ss, &len);
+	int fd = zts_socket(family, type, 0);
+	if(fd < 0)
+		return -1;
+	if(zts_bind(fd, (struct sockaddr *)&ss, len) < 0 || (type == SOCK_STREAM && zts_listen(fd, PERF_MAX_STREAMS) < 0)) {
+		zts_close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/****************************************************************************/
+/* Interval reports                                                         */
+/****************************************************************************/
+
+// Utilization of libzt's threads (100% is one CPU) between samples
+struct cpu_sample {
+	uint64_t at;
+	uint64_t us[3];
+	bool ok;
+
+	void take()
+	{
+		static const int threads[3] = { ZTS_THREAD_SERVICE, ZTS_THREAD_STACK, ZTS_THREAD_TX };
+		at = now_us();
+		ok = true;
+		for(int i=0; i<3; i++)
+			ok = zts_get_thread_cpu(threads[i], NULL, &us[i]) == 0 && ok;
+	}
+};
+
+struct reporter {
+	uint64_t start;
+	uint64_t last_bytes;
+	cpu_sample last;
+	bool quiet;
+
+	void begin(bool q = false)
+	{
+		start = now_us();
+		last_bytes = 0;
+		quiet = q;
+		last.take();
+		if(!quiet)
+			printf("[ interval    ]     bytes       Mbit/s  service%%  stack%%  tx%%\n");
+	}
+
+	void line(uint64_t from, uint64_t to, uint64_t bytes, const cpu_sample &a, const cpu_sample &b)
+	{
+		double secs = (to - from) / 1e6;
+		printf("[%5.1f-%5.1f s] %10llu %10.2f", (from - start) / 1e6, (to - start) / 1e6,
+			(unsigned long long)bytes, secs > 0 ? bytes * 8 / secs / 1e6 : 0.0);
+		if(a.ok && b.ok && b.at > a.at) {
+			for(int i=0; i<3; i++)
+				printf(i ? " %6.1f" : "  %7.1f", (b.us[i] - a.us[i]) * 100.0 / (b.at - a.at));
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+
+	void tick(uint64_t bytes)
+	{
+		cpu_sample now;
+		now.take();
+		if(!quiet)
+			line(last.at, now.at, bytes - last_bytes, last, now);
+		last = now;
+		last_bytes = bytes;
+	}
+};
+
+/****************************************************************************/
+/* Server                                                                   */
+/****************************************************************************/
+
+struct udp_stream {
+	uint64_t expected;
+};
+
+static void serveTcp(int fd, std::atomic<uint64_t> *bytes, size_t len)
+{
+	std::vector<char> buf(len);
+	ssize_t n;
+	while((n = zts_recv(fd, &buf[0], buf.size(), 0)) > 0)
+		bytes->fetch_add(n, std::memory_order_relaxed);
+	zts_close(fd);
+}
+
+static void serveRr(int fd, std::atomic<uint64_t> *bytes, size_t len)
+{
+	std::vector<char> buf(len);
+	while(readFull(fd, &buf[0], len) && writeFull(fd, &buf[0], len))
+		bytes->fetch_add(len, std::memory_order_relaxed);
+	zts_close(fd);
+}
+
+static void serveUdp(int fd, std::atomic<bool> *run, std::atomic<uint64_t> *bytes, struct perf_result *res)
+{
+	std::vector<char> buf(PERF_MAX_LEN);
+	std::map<uint32_t, udp_stream> streams;
+	while(run->load()) {
+		struct pollfd p = { fd, POLLIN, 0 };
+		if(zts_poll(&p, 1, 100) <= 0)
+			continue;
+		ssize_t n = zts_recvfrom(fd, &buf[0], buf.size(), 0, NULL, NULL);
+		if(n < (ssize_t)sizeof(struct perf_udp_hdr))
+			continue;
+		struct perf_udp_hdr h;
+		memcpy(&h, &buf[0], sizeof(h));
+		uint64_t seq = hton64(h.seq);
+		udp_stream &s = streams[ntohl(h.stream)];
+		if(seq >= s.expected) {
+			res->lost += seq - s.expected;
+			s.expected = seq + 1;
+		}
+		else {
+			res->reordered++;
+			if(res->lost)
+				res->lost--;
+		}
+		res->packets++;
+		bytes->fetch_add(n, std::memory_order_relaxed);
+	}
+}
+
+static void runTest(int ctrl, int tcp_listen, int udp_fd, int interval_ms, int zt_pid)
+{
+	struct perf_hdr h;
+	if(!readFull(ctrl, &h, sizeof(h)) || ntohl(h.magic) != PERF_MAGIC) {
+		fprintf(stderr, "bad test request\n");
+		return;
+	}
+	uint32_t proto = ntohl(h.proto), streams = ntohl(h.streams), len = ntohl(h.len);
+	if((proto != PERF_PROTO_TCP && proto != PERF_PROTO_UDP && proto != PERF_PROTO_RR) || !streams || streams > PERF_MAX_STREAMS
+		|| !len || len > PERF_MAX_LEN) {
+		fprintf(stderr, "bad test request\n");
+		return;
+	}
+	printf("%s test, %u stream(s) of %u byte writes\n", proto == PERF_PROTO_TCP ? "TCP" : proto == PERF_PROTO_UDP ? "UDP" : "RR",
+		streams, len);
+	std::atomic<uint64_t> bytes(0);
+	std::atomic<bool> run(true);
+	struct perf_result res;
+	memset(&res, 0, sizeof(res));
+	std::vector<std::thread> readers;
+	char ack = 1;
+	if(!writeFull(ctrl, &ack, 1))
+		return;
+	uint64_t cpu0 = process_cpu_us(zt_pid);
+	if(proto != PERF_PROTO_UDP) {
+		for(uint32_t i=0; i<streams; i++) {
+			int fd = zts_accept(tcp_listen, NULL, NULL);
+			if(fd < 0) {
+				fprintf(stderr, "error accepting stream (errno=%d)\n", errno);
+				break;
+			}
+			if(proto == PERF_PROTO_RR)
+				readers.push_back(std::thread(serveRr, fd, &bytes, len));
+			else
+				readers.push_back(std::thread(serveTcp, fd, &bytes, len));
+		}
+	}
+	else
+		readers.push_back(std::thread(serveUdp, udp_fd, &run, &bytes, &res));
+	reporter r;
+	r.begin();
+	uint64_t next = r.start + interval_ms * 1000ULL, sent = 0;
+	// The client's byte count arrives once it's done sending
+	for(;;) {
+		struct pollfd p = { ctrl, POLLIN, 0 };
+		uint64_t now = now_us();
+		int wait = now >= next ? 0 : (int)((next - now) / 1000);
+		if(zts_poll(&p, 1, wait) > 0) {
+			readFull(ctrl, &sent, sizeof(sent));
+			break;
+		}
+		if(now_us() >= next) {
+			r.tick(bytes.load());
+			next += interval_ms * 1000ULL;
+		}
+	}
+	if(proto == PERF_PROTO_UDP)
+		usleep(PERF_DRAIN_MS * 1000);
+	run = false;
+	for(size_t i=0; i<readers.size(); i++)
+		readers[i].join();
+	uint64_t end = now_us();
+	r.tick(bytes.load());
+	res.bytes = bytes.load();
+	res.duration_us = end - r.start;
+	res.cpu_us = process_cpu_us(zt_pid) - cpu0;
+	printf("received %llu bytes in %.2f s, %.2f Mbit/s", (unsigned long long)res.bytes, res.duration_us / 1e6,
+		res.duration_us ? res.bytes * 8.0 / res.duration_us : 0.0);
+	if(proto == PERF_PROTO_UDP)
+		printf(", %llu datagrams, %llu lost, %llu reordered", (unsigned long long)res.packets,
+			(unsigned long long)res.lost, (unsigned long long)res.reordered);
+	printf("\n");
+	fflush(stdout);
+	struct perf_result out = { hton64(res.bytes), hton64(res.packets), hton64(res.lost), hton64(res.reordered),
+		hton64(res.duration_us), hton64(res.cpu_us) };
+	writeFull(ctrl, &out, sizeof(out));
+}
+
+static int server(std::map<std::string, std::string> &opts)
+{
+	int port = atoi(opts["port"].c_str());
+	int interval_ms = (int)(atof(opts["interval"].c_str()) * 1000);
+	int family = opts["ipv"] == "6" ? AF_INET6 : AF_INET;
+	int ctrl_listen = listenOn(family, SOCK_STREAM, port);
+	int tcp_listen = listenOn(family, SOCK_STREAM, port + 1);
+	int udp_fd = listenOn(family, SOCK_DGRAM, port + 1);
+	if(ctrl_listen < 0 || tcp_listen < 0 || udp_fd < 0) {
+		fprintf(stderr, "error listening on port %d/%d (errno=%d)\n", port, port + 1, errno);
+		return 1;
+	}
+	printf("listening on port %d\n", port);
+	fflush(stdout);
+	for(;;) {
+		int ctrl = zts_accept(ctrl_listen, NULL, NULL);
+		if(ctrl < 0) {
+			fprintf(stderr, "error accepting (errno=%d)\n", errno);
+			continue;
+		}
+		runTest(ctrl, tcp_listen, udp_fd, interval_ms > 0 ? interval_ms : 1000, atoi(opts["zt_pid"].c_str()));
+		zts_close(ctrl);
+	}
+	return 0;
+}
+
+/****************************************************************************/
+/* Client                                                                   */
+/****************************************************************************/
+
+static void sendTcp(struct sockaddr_storage addr, socklen_t alen, size_t len, uint64_t deadline,
+	std::atomic<uint64_t> *bytes)
+{
+	int fd = zts_socket(addr.ss_family, SOCK_STREAM, 0);
+	if(fd < 0 || zts_connect(fd, (struct sockaddr *)&addr, alen) < 0) {
+		fprintf(stderr, "error connecting stream (errno=%d)\n", errno);
+		if(fd >= 0)
+			zts_close(fd);
+		return;
+	}
+	std::vector<char> buf(len, 'z');
+	while(now_us() < deadline) {
+		ssize_t n = zts_send(fd, &buf[0], buf.size(), 0);
+		if(n <= 0)
+			break;
+		bytes->fetch_add(n, std::memory_order_relaxed);
+	}
+	zts_close(fd);
+}
+
+// Paced to rate bits/s by sleeping off any lead over it
+static void sendUdp(struct sockaddr_storage addr, socklen_t alen, uint32_t stream, size_t len,
+	uint64_t rate, uint64_t deadline, std::atomic<uint64_t> *bytes)
+{
+	int fd = zts_socket(addr.ss_family, SOCK_DGRAM, 0);
+	if(fd < 0) {
+		fprintf(stderr, "error creating stream (errno=%d)\n", errno);
+		return;
+	}
+	std::vector<char> buf(len, 'z');
+	uint64_t start = now_us(), sent = 0;
+	for(uint64_t seq=0; ; seq++) {
+		uint64_t now = now_us();
+		if(now >= deadline)
+			break;
+		uint64_t due = start + sent * 8 * 1000000 / rate;
+		if(due > now)
+			usleep(due - now);
+		struct perf_udp_hdr h = { htonl(stream), 0, hton64(seq) };
+		memcpy(&buf[0], &h, sizeof(h));
+		ssize_t n = zts_sendto(fd, &buf[0], buf.size(), 0, (struct sockaddr *)&addr, alen);
+		if(n > 0) {
+			sent += n;
+			bytes->fetch_add(n, std::memory_order_relaxed);
+		}
+	}
+	zts_close(fd);
+}
+
+// One request of len bytes and its echo at a time, RTTs in us
+static void sendRr(struct sockaddr_storage addr, socklen_t alen, size_t len, uint64_t deadline,
+	std::atomic<uint64_t> *bytes, std::vector<uint64_t> *rtts)
+{
+	int fd = zts_socket(addr.ss_family, SOCK_STREAM, 0);
+	if(fd < 0 || zts_connect(fd, (struct sockaddr *)&addr, alen) < 0) {
+		fprintf(stderr, "error connecting stream (errno=%d)\n", errno);
+		if(fd >= 0)
+			zts_close(fd);
+		return;
+	}
+	std::vector<char> buf(len, 'z');
+	for(uint64_t t = now_us(); t < deadline; ) {
+		if(!writeFull(fd, &buf[0], len) || !readFull(fd, &buf[0], len))
+			break;
+		uint64_t now = now_us();
+		rtts->push_back(now - t);
+		bytes->fetch_add(len, std::memory_order_relaxed);
+		t = now;
+	}
+	zts_close(fd);
+}
+
+static uint64_t percentile(const std::vector<uint64_t> &v, double p)
+{
+	if(v.empty())
+		return 0;
+	size_t rank = (size_t)(p * v.size() + 0.999999);
+	return v[rank ? rank - 1 : 0];
+}
+
+static int client(const std::string &host, std::map<std::string, std::string> &opts)
+{
+	int port = atoi(opts["port"].c_str());
+	bool udp = opts["proto"] == "udp", rr = opts["proto"] == "rr", csv = opts["fmt"] == "csv";
+	int streams = atoi(opts["streams"].c_str());
+	int secs = atoi(opts["time"].c_str());
+	int interval_ms = (int)(atof(opts["interval"].c_str()) * 1000);
+	int zt_pid = atoi(opts["zt_pid"].c_str());
+	size_t len = opts.count("len") ? strtoul(opts["len"].c_str(), NULL, 10) : udp ? PERF_UDP_MAX_LEN : 1;
+	uint64_t rate = opts.count("rate") ? strtoull(opts["rate"].c_str(), NULL, 10) : PERF_UDP_RATE;
+	if(streams <= 0 || streams > PERF_MAX_STREAMS || secs <= 0 || interval_ms <= 0 || !len
+		|| (udp && len < sizeof(struct perf_udp_hdr)) || len > PERF_MAX_LEN || !rate
+		|| (!udp && !rr && opts["proto"] != "tcp")) {
+		fprintf(stderr, "bad options\n");
+		return 1;
+	}
+	struct sockaddr_storage ctrl_addr, data_addr;
+	socklen_t alen;
+	if(!parseAddr(host, port, &ctrl_addr, &alen) || !parseAddr(host, port + 1, &data_addr, &alen)) {
+		fprintf(stderr, "not an IP address: %s\n", host.c_str());
+		return 1;
+	}
+	int ctrl = zts_socket(ctrl_addr.ss_family, SOCK_STREAM, 0);
+	if(ctrl < 0 || zts_connect(ctrl, (struct sockaddr *)&ctrl_addr, alen) < 0) {
+		fprintf(stderr, "error connecting to %s:%d (errno=%d)\n", host.c_str(), port, errno);
+		return 1;
+	}
+	uint32_t proto = udp ? PERF_PROTO_UDP : rr ? PERF_PROTO_RR : PERF_PROTO_TCP;
+	struct perf_hdr h = { htonl(PERF_MAGIC), htonl(proto), htonl(streams), htonl((uint32_t)len) };
+	char ack;
+	if(!writeFull(ctrl, &h, sizeof(h)) || !readFull(ctrl, &ack, 1)) {
+		fprintf(stderr, "server refused the test\n");
+		return 1;
+	}
+	if(!csv) {
+		printf("%s test to %s:%d, %d stream(s) of %zu byte writes for %d s\n", udp ? "UDP" : rr ? "RR" : "TCP",
+			host.c_str(), port, streams, len, secs);
+	}
+	std::atomic<uint64_t> bytes(0);
+	std::vector<std::thread> senders;
+	std::vector<std::vector<uint64_t> > rtts(streams);
+	reporter r;
+	r.begin(csv);
+	uint64_t cpu0 = process_cpu_us(zt_pid);
+	uint64_t deadline = r.start + secs * 1000000ULL;
+	for(int i=0; i<streams; i++) {
+		if(udp)
+			senders.push_back(std::thread(sendUdp, data_addr, alen, i, len, rate, deadline, &bytes));
+		else if(rr)
+			senders.push_back(std::thread(sendRr, data_addr, alen, len, deadline, &bytes, &rtts[i]));
+		else
+			senders.push_back(std::thread(sendTcp, data_addr, alen, len, deadline, &bytes));
+	}
+	for(uint64_t next = r.start + interval_ms * 1000ULL; next < deadline; next += interval_ms * 1000ULL) {
+		uint64_t now = now_us();
+		if(next > now)
+			usleep(next - now);
+		r.tick(bytes.load());
+	}
+	for(size_t i=0; i<senders.size(); i++)
+		senders[i].join();
+	uint64_t end = now_us();
+	uint64_t cpu = process_cpu_us(zt_pid) - cpu0;
+	r.tick(bytes.load());
+	uint64_t sent = hton64(bytes.load());
+	struct perf_result res;
+	if(!writeFull(ctrl, &sent, sizeof(sent)) || !readFull(ctrl, &res, sizeof(res))) {
+		fprintf(stderr, "no result from the server\n");
+		return 1;
+	}
+	zts_close(ctrl);
+	std::vector<uint64_t> all;
+	for(int i=0; i<streams; i++)
+		all.insert(all.end(), rtts[i].begin(), rtts[i].end());
+	std::sort(all.begin(), all.end());
+	uint64_t rbytes = hton64(res.bytes), rcpu = hton64(res.cpu_us);
+	uint64_t packets = hton64(res.packets), lost = hton64(res.lost);
+	double sbytes = (double)bytes.load(), gb = sbytes / 1e9;
+	// Over the client's time, the server's includes waiting for stragglers
+	double smbps = sbytes * 8.0 / (end - r.start), rmbps = rbytes * 8.0 / (end - r.start);
+	double lost_pct = packets + lost ? lost * 100.0 / (packets + lost) : 0.0;
+	if(csv) {
+		printf("proto,streams,len,secs,sent_mbps,recv_mbps,lost_pct,rtt_p50_us,rtt_p99_us,rtt_p999_us,tps,client_cpu_s_per_gb,server_cpu_s_per_gb\n");
+		printf("%s,%d,%zu,%d,%.2f,%.2f,%.3f,%llu,%llu,%llu,%.1f,%.3f,%.3f\n", opts["proto"].c_str(), streams, len, secs,
+			smbps, rmbps, lost_pct, (unsigned long long)percentile(all, 0.50), (unsigned long long)percentile(all, 0.99),
+			(unsigned long long)percentile(all, 0.999), all.size() * 1e6 / (end - r.start), gb > 0 ? cpu / 1e6 / gb : 0.0,
+			gb > 0 ? rcpu / 1e6 / gb : 0.0);
+		return 0;
+	}
+	printf("sent     %llu bytes in %.2f s, %.2f Mbit/s, %.3f CPU s/GB\n", (unsigned long long)bytes.load(),
+		(end - r.start) / 1e6, smbps, gb > 0 ? cpu / 1e6 / gb : 0.0);
+	printf("received %llu bytes, %.2f Mbit/s, %.3f CPU s/GB", (unsigned long long)rbytes, rmbps, gb > 0 ? rcpu / 1e6 / gb : 0.0);
+	if(udp) {
+		printf(", %llu datagrams, %llu lost (%.2f%%), %llu reordered", (unsigned long long)packets,
+			(unsigned long long)lost, lost_pct, (unsigned long long)hton64(res.reordered));
+	}
+	printf("\n");
+	if(rr) {
+		printf("%zu round trips, p50 %llu us, p99 %llu us, p999 %llu us\n", all.size(),
+			(unsigned long long)percentile(all, 0.50), (unsigned long long)percentile(all, 0.99),
+			(unsigned long long)percentile(all, 0.999));
+	}
+	return 0;
+}
+
+static void usage()
+{
+	fprintf(stderr, "usage: zts_perf <path> <nwid> server [port=%d] [interval=1] [ipv=4|6] [zt_pid=<pid>]\n"
+		"       zts_perf <path> <nwid> client <host> [port=%d] [proto=tcp|udp|rr] [streams=1] [time=10]\n"
+		"                [len=131072] [interval=1] [rate=%d] [zt_pid=<pid>] [fmt=csv]\n", PERF_PORT, PERF_PORT, PERF_UDP_RATE);
+}
+
+int main(int argc, char *argv[])
+{
+	if(argc < 4) {
+		usage();
+		return 1;
+	}
+	std::string mode = argv[3], host;
+	int first = 4;
+	if(mode == "client") {
+		if(argc < 5) {
+			usage();
+			return 1;
+		}
+		host = argv[4];
+		first = 5;
+	}
+	else if(mode != "server") {
+		usage();
+		return 1;
+	}
+	std::map<std::string, std::string> opts;
+	char buf[16];
+	snprintf(buf, sizeof(buf), "%d", PERF_PORT);
+	opts["port"] = buf;
+	opts["proto"] = "tcp";
+	opts["streams"] = "1";
+	opts["time"] = "10";
+	opts["len"] = "131072";
+	opts["interval"] = "1";
+	for(int i=first; i<argc; i++) {
+		std::string a = argv[i];
+		size_t eq = a.find('=');
+		if(eq == std::string::npos) {
+			usage();
+			return 1;
+		}
+		opts[a.substr(0, eq)] = a.substr(eq + 1);
+	}
+	// No explicit len for UDP means one that fits a ZeroTier frame, for RR a single byte
+	if(mode == "client" && opts["proto"] != "tcp") {
+		bool given = false;
+		for(int i=first; i<argc; i++)
+			given = given || strncmp(argv[i], "len=", 4) == 0;
+		if(!given)
+			opts.erase("len");
+	}
+	zts_simple_start(argv[1], argv[2]);
+	int ret = mode == "server" ? server(opts) : client(host, opts);
+	zts_stop();
+	return ret;
+}